@@ -4,63 +4,610 @@
 #include "rlist.h"
 
 #include <assert.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
-struct data_vector {
-	unsigned *data;
-	size_t size;
-	size_t capacity;
+#ifdef __linux__
+#include <sys/eventfd.h>
+#define CORO_BUS_HAVE_EVENTFD 1
+#else
+#define CORO_BUS_HAVE_EVENTFD 0
+#endif
+
+enum {
+	/** Capacity of a new ring, unless its limit is smaller. */
+	DATA_RING_MIN_CAPACITY = 16,
 };
 
-#if 0 /* Uncomment this if want to use */
+/**
+ * Message queue of a channel. A circular buffer with a power of 2
+ * capacity. It starts small and doubles when a push doesn't fit,
+ * up to the limit of the channel rounded up to a power of 2. So a
+ * channel with a big limit takes the memory only when it fills up.
+ * Stores numbers, message descriptors or fixed size records.
+ */
+struct data_ring {
+	char *data;
+	/** Size of one message in bytes. */
+	size_t elem_size;
+	/** Capacity - 1. */
+	size_t mask;
+	/** The biggest capacity the ring can grow to. */
+	size_t max_capacity;
+	/** Position of the first message. Only grows. */
+	size_t head;
+	/** Position after the last message. Only grows. */
+	size_t tail;
+};
 
-/** Append @a count messages in @a data to the end of the vector. */
 static void
-data_vector_append_many(struct data_vector *vector,
-	const unsigned *data, size_t count)
+data_ring_create(struct data_ring *ring, size_t size_limit, size_t elem_size)
+{
+	size_t capacity = 1;
+	while (capacity < size_limit)
+		capacity <<= 1;
+	ring->max_capacity = capacity;
+	if (capacity > DATA_RING_MIN_CAPACITY)
+		capacity = DATA_RING_MIN_CAPACITY;
+	ring->data = malloc(elem_size * capacity);
+	ring->elem_size = elem_size;
+	ring->mask = capacity - 1;
+	ring->head = 0;
+	ring->tail = 0;
+}
+
+static void
+data_ring_destroy(struct data_ring *ring)
+{
+	free(ring->data);
+}
+
+static size_t
+data_ring_size(const struct data_ring *ring)
+{
+	return ring->tail - ring->head;
+}
+
+/**
+ * Copy @a count messages of @a esize bytes. A single message of a
+ * common size is copied with a memcpy() of a constant size, which
+ * the compiler turns into a few moves instead of a call.
+ */
+static inline void
+data_ring_copy(void *dst, const void *src, size_t esize, size_t count)
 {
-	if (vector->size + count > vector->capacity) {
-		if (vector->capacity == 0)
-			vector->capacity = 4;
-		else
-			vector->capacity *= 2;
-		if (vector->capacity < vector->size + count)
-			vector->capacity = vector->size + count;
-		vector->data = realloc(vector->data,
-			sizeof(vector->data[0]) * vector->capacity);
+	if (count == 1) {
+		switch (esize) {
+		case 4:
+			memcpy(dst, src, 4);
+			return;
+		case 8:
+			memcpy(dst, src, 8);
+			return;
+		case 16:
+			memcpy(dst, src, 16);
+			return;
+		case 32:
+			memcpy(dst, src, 32);
+			return;
+		case 64:
+			memcpy(dst, src, 64);
+			return;
+		}
 	}
-	memcpy(&vector->data[vector->size], data, sizeof(data[0]) * count);
-	vector->size += count;
+	memcpy(dst, src, esize * count);
+}
+
+/** Bytes allocated for the messages. */
+static size_t
+data_ring_capacity_bytes(const struct data_ring *ring)
+{
+	return (ring->mask + 1) * ring->elem_size;
 }
 
-/** Append a single message to the vector. */
 static void
-data_vector_append(struct data_vector *vector, unsigned data)
+data_ring_pop_many(struct data_ring *ring, void *data, size_t count);
+
+/**
+ * Grow the ring to fit @a size messages. They are moved into the
+ * new buffer from its start, the positions begin anew.
+ */
+static void __attribute__((noinline))
+data_ring_grow(struct data_ring *ring, size_t size)
 {
-	data_vector_append_many(vector, &data, 1);
+	assert(size <= ring->max_capacity);
+	size_t capacity = ring->mask + 1;
+	while (capacity < size)
+		capacity <<= 1;
+	char *data = malloc(ring->elem_size * capacity);
+	size_t count = data_ring_size(ring);
+	data_ring_pop_many(ring, data, count);
+	free(ring->data);
+	ring->data = data;
+	ring->mask = capacity - 1;
+	ring->head = 0;
+	ring->tail = count;
 }
 
-/** Pop @a count of messages into @a data from the head of the vector. */
+/** Append @a count messages in @a data to the end of the ring. */
 static void
-data_vector_pop_first_many(struct data_vector *vector, unsigned *data, size_t count)
+data_ring_push_many(struct data_ring *ring, const void *data, size_t count)
 {
-	assert(count <= vector->size);
-	memcpy(data, vector->data, sizeof(data[0]) * count);
-	vector->size -= count;
-	memmove(vector->data, &vector->data[count], vector->size * sizeof(vector->data[0]));
+	if (data_ring_size(ring) + count > ring->mask + 1)
+		data_ring_grow(ring, data_ring_size(ring) + count);
+	size_t esize = ring->elem_size;
+	size_t pos = ring->tail & ring->mask;
+	size_t part = ring->mask + 1 - pos;
+	if (part > count)
+		part = count;
+	data_ring_copy(&ring->data[pos * esize], data, esize, part);
+	if (part < count) {
+		data_ring_copy(ring->data, (const char *)data + part * esize,
+			esize, count - part);
+	}
+	ring->tail += count;
 }
 
-/** Pop a single message from the head of the vector. */
-static unsigned
-data_vector_pop_first(struct data_vector *vector)
+/** Pop @a count of messages into @a data from the head of the ring. */
+static void
+data_ring_pop_many(struct data_ring *ring, void *data, size_t count)
 {
-	unsigned data = 0;
-	data_vector_pop_first_many(vector, &data, 1);
-	return data;
+	assert(count <= data_ring_size(ring));
+	size_t esize = ring->elem_size;
+	size_t pos = ring->head & ring->mask;
+	size_t part = ring->mask + 1 - pos;
+	if (part > count)
+		part = count;
+	data_ring_copy(data, &ring->data[pos * esize], esize, part);
+	if (part < count) {
+		data_ring_copy((char *)data + part * esize, ring->data,
+			esize, count - part);
+	}
+	ring->head += count;
 }
 
+enum {
+	/** Size of a cache line, to keep the ring ends apart. */
+	CORO_BUS_CACHE_LINE = 64,
+};
+
+/** A slot of the MPSC ring. */
+struct mpsc_cell {
+	/**
+	 * Position the cell is expected at. Equal to the position
+	 * when free, and to the position + 1 when published.
+	 */
+	atomic_size_t seq;
+	unsigned data;
+};
+
+struct coro_bus_channel;
+
+/**
+ * Bounded lock-free ring with many producers and one consumer, the
+ * channel owner. The producers reserve a cell with a CAS on the
+ * tail and publish it with its sequence number. The consumer wakes
+ * up due to an eventfd the producers signal only when it asks for
+ * that by arming.
+ */
+struct coro_bus_port {
+	/** Watch of the event descriptor in the consumer scheduler. */
+	struct coro_fd_watch watch;
+	struct coro_bus_channel *ch;
+	struct mpsc_cell *cells;
+	/** Capacity - 1. */
+	size_t mask;
+	/** Consumer position. Only the consumer touches it. */
+	size_t head;
+	/** Producer position. */
+	_Alignas(CORO_BUS_CACHE_LINE) atomic_size_t tail;
+	/** The consumer waits for a signal. */
+	atomic_bool is_armed;
+};
+
+static void
+mpsc_create(struct coro_bus_port *port, size_t size_limit)
+{
+	size_t capacity = 2;
+	while (capacity < size_limit)
+		capacity <<= 1;
+	port->cells = malloc(sizeof(port->cells[0]) * capacity);
+	for (size_t i = 0; i < capacity; ++i)
+		atomic_init(&port->cells[i].seq, i);
+	port->mask = capacity - 1;
+	port->head = 0;
+	atomic_init(&port->tail, 0);
+	atomic_init(&port->is_armed, false);
+}
+
+static void
+mpsc_destroy(struct coro_bus_port *port)
+{
+	free(port->cells);
+}
+
+/**
+ * Push a number into the cells from any thread, reserving the
+ * position with a CAS on @a tail. Fails when the ring is full.
+ */
+static bool
+mpsc_cells_try_push(struct mpsc_cell *cells, size_t mask, atomic_size_t *tail,
+	unsigned data)
+{
+	size_t pos = atomic_load_explicit(tail, memory_order_relaxed);
+	struct mpsc_cell *cell;
+	while (true) {
+		cell = &cells[pos & mask];
+		size_t seq = atomic_load_explicit(&cell->seq,
+			memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(tail, &pos,
+					pos + 1, memory_order_relaxed,
+					memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			return false;
+		} else {
+			pos = atomic_load_explicit(tail, memory_order_relaxed);
+		}
+	}
+	cell->data = data;
+	atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+	return true;
+}
+
+/** Push a number from any thread. Fails when the ring is full. */
+static bool
+mpsc_try_push(struct coro_bus_port *port, unsigned data)
+{
+	return mpsc_cells_try_push(port->cells, port->mask, &port->tail, data);
+}
+
+/** Pop a number in the consumer. Fails when nothing is published. */
+static bool
+mpsc_try_pop(struct coro_bus_port *port, unsigned *data)
+{
+	struct mpsc_cell *cell = &port->cells[port->head & port->mask];
+	size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+	if (seq != port->head + 1)
+		return false;
+	*data = cell->data;
+	atomic_store_explicit(&cell->seq, port->head + port->mask + 1,
+		memory_order_release);
+	++port->head;
+	return true;
+}
+
+/**
+ * Number of the messages in the ring. Includes the reserved, but
+ * not yet published ones.
+ */
+static size_t
+mpsc_size(struct coro_bus_port *port)
+{
+	return atomic_load_explicit(&port->tail, memory_order_relaxed) -
+		port->head;
+}
+
+/**
+ * Ask the producers to signal the next push. The caller must check
+ * the ring again afterwards, a push could happen right before.
+ */
+static void
+mpsc_arm(struct coro_bus_port *port)
+{
+	atomic_store_explicit(&port->is_armed, true, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+}
+
+/** Signal the consumer after a push, if it is waiting. */
+static void
+mpsc_notify(struct coro_bus_port *port)
+{
+	atomic_thread_fence(memory_order_seq_cst);
+	if (!atomic_load_explicit(&port->is_armed, memory_order_relaxed) ||
+	    !atomic_exchange(&port->is_armed, false))
+		return;
+#if CORO_BUS_HAVE_EVENTFD
+	eventfd_write(port->watch.fd, 1);
 #endif
+}
+
+/**
+ * Bounded lock-free ring with many producers and many consumers.
+ * The producers work as with the MPSC ring, and the consumers
+ * reserve a published cell with a CAS on the head the same way.
+ */
+struct mpmc_ring {
+	struct mpsc_cell *cells;
+	/** Capacity - 1. */
+	size_t mask;
+	/** Consumer position. */
+	_Alignas(CORO_BUS_CACHE_LINE) atomic_size_t head;
+	/** Producer position. */
+	_Alignas(CORO_BUS_CACHE_LINE) atomic_size_t tail;
+};
+
+static void
+mpmc_create(struct mpmc_ring *ring, size_t size_limit)
+{
+	size_t capacity = 2;
+	while (capacity < size_limit)
+		capacity <<= 1;
+	ring->cells = malloc(sizeof(ring->cells[0]) * capacity);
+	for (size_t i = 0; i < capacity; ++i)
+		atomic_init(&ring->cells[i].seq, i);
+	ring->mask = capacity - 1;
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+}
+
+static void
+mpmc_destroy(struct mpmc_ring *ring)
+{
+	free(ring->cells);
+}
+
+static bool
+mpmc_try_push(struct mpmc_ring *ring, unsigned data)
+{
+	return mpsc_cells_try_push(ring->cells, ring->mask, &ring->tail, data);
+}
+
+/** Pop a number in any thread. Fails when nothing is published. */
+static bool
+mpmc_try_pop(struct mpmc_ring *ring, unsigned *data)
+{
+	size_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	struct mpsc_cell *cell;
+	while (true) {
+		cell = &ring->cells[pos & ring->mask];
+		size_t seq = atomic_load_explicit(&cell->seq,
+			memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&ring->head,
+					&pos, pos + 1, memory_order_relaxed,
+					memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			return false;
+		} else {
+			pos = atomic_load_explicit(&ring->head,
+				memory_order_relaxed);
+		}
+	}
+	*data = cell->data;
+	atomic_store_explicit(&cell->seq, pos + ring->mask + 1,
+		memory_order_release);
+	return true;
+}
+
+/**
+ * Number of the messages in the ring, including the reserved ends
+ * not finished yet. The head is loaded first, so it is never above
+ * the tail.
+ */
+static size_t
+mpmc_size(struct mpmc_ring *ring)
+{
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	return atomic_load_explicit(&ring->tail, memory_order_relaxed) - head;
+}
+
+enum {
+	/** Payloads up to this size are allocated from the bus slab. */
+	CORO_BUS_SMALL_MSG_SIZE = 64,
+	/** Number of small payload blocks allocated at once. */
+	CORO_BUS_SLAB_BLOCK_COUNT = 64,
+};
+
+/**
+ * Header in front of each payload. A broadcast payload is shared
+ * by all the channels it was sent to, and each of them holds a
+ * reference.
+ */
+union msg_header {
+	long ref_count;
+	max_align_t align;
+};
+
+/** A free block of the small payload slab. */
+struct msg_block {
+	struct msg_block *next;
+};
+
+/**
+ * A chunk of small payload blocks. The blocks go first, so they are
+ * max aligned like the chunk from malloc(), and so are the headers
+ * and the payloads after them.
+ */
+struct msg_chunk {
+	union {
+		union msg_header header;
+		char data[sizeof(union msg_header) + CORO_BUS_SMALL_MSG_SIZE];
+	} blocks[CORO_BUS_SLAB_BLOCK_COUNT];
+	struct msg_chunk *next;
+};
+
+/**
+ * Allocator of the small payloads. Chunks are never freed until
+ * the bus is deleted, the freed blocks are reused.
+ */
+struct msg_slab {
+	struct msg_chunk *chunks;
+	struct msg_block *free_blocks;
+};
+
+static void *
+msg_slab_alloc(struct msg_slab *slab)
+{
+	if (slab->free_blocks == NULL) {
+		struct msg_chunk *chunk = malloc(sizeof(*chunk));
+		chunk->next = slab->chunks;
+		slab->chunks = chunk;
+		for (int i = CORO_BUS_SLAB_BLOCK_COUNT - 1; i >= 0; --i) {
+			struct msg_block *b = (void *)&chunk->blocks[i];
+			b->next = slab->free_blocks;
+			slab->free_blocks = b;
+		}
+	}
+	struct msg_block *b = slab->free_blocks;
+	slab->free_blocks = b->next;
+	return b;
+}
+
+static void
+msg_slab_free(struct msg_slab *slab, void *ptr)
+{
+	struct msg_block *b = ptr;
+	b->next = slab->free_blocks;
+	slab->free_blocks = b;
+}
+
+static void
+msg_slab_destroy(struct msg_slab *slab)
+{
+	while (slab->chunks != NULL) {
+		struct msg_chunk *next = slab->chunks->next;
+		free(slab->chunks);
+		slab->chunks = next;
+	}
+	slab->free_blocks = NULL;
+}
+
+enum {
+	FD_BITMAP_WORD_BITS = 64,
+	/** Enough for any int descriptor. */
+	FD_BITMAP_MAX_LEVELS = 6,
+};
+
+/**
+ * Set of free descriptors. Level 0 has a bit per descriptor. Each
+ * next level has a bit per word of the previous one, set when the
+ * word has any bits set. The last level is one word. The lowest
+ * free descriptor is found with one find-first-set per level.
+ */
+struct fd_bitmap {
+	uint64_t *levels[FD_BITMAP_MAX_LEVELS];
+	int level_count;
+	/** Number of descriptors covered, a multiple of the word bits. */
+	size_t capacity;
+};
+
+static void
+fd_bitmap_create(struct fd_bitmap *map)
+{
+	memset(map, 0, sizeof(*map));
+}
+
+static void
+fd_bitmap_destroy(struct fd_bitmap *map)
+{
+	for (int i = 0; i < map->level_count; ++i)
+		free(map->levels[i]);
+}
+
+static void
+fd_bitmap_set(struct fd_bitmap *map, size_t pos)
+{
+	assert(pos < map->capacity);
+	for (int i = 0; i < map->level_count; ++i) {
+		uint64_t *word = &map->levels[i][pos / FD_BITMAP_WORD_BITS];
+		uint64_t bit = (uint64_t)1 << (pos % FD_BITMAP_WORD_BITS);
+		bool was_empty = *word == 0;
+		*word |= bit;
+		if (!was_empty)
+			return;
+		pos /= FD_BITMAP_WORD_BITS;
+	}
+}
+
+static void
+fd_bitmap_clear(struct fd_bitmap *map, size_t pos)
+{
+	assert(pos < map->capacity);
+	for (int i = 0; i < map->level_count; ++i) {
+		uint64_t *word = &map->levels[i][pos / FD_BITMAP_WORD_BITS];
+		*word &= ~((uint64_t)1 << (pos % FD_BITMAP_WORD_BITS));
+		if (*word != 0)
+			return;
+		pos /= FD_BITMAP_WORD_BITS;
+	}
+}
+
+/** The lowest set position, or -1 if none. */
+static long
+fd_bitmap_first(const struct fd_bitmap *map)
+{
+	if (map->level_count == 0 || map->levels[map->level_count - 1][0] == 0)
+		return -1;
+	size_t pos = 0;
+	for (int i = map->level_count - 1; i >= 0; --i) {
+		uint64_t word = map->levels[i][pos];
+		assert(word != 0);
+		pos = pos * FD_BITMAP_WORD_BITS + __builtin_ctzll(word);
+	}
+	return pos;
+}
+
+/** Cover at least @a size descriptors. The new ones are not set. */
+static void
+fd_bitmap_reserve(struct fd_bitmap *map, size_t size)
+{
+	if (size <= map->capacity)
+		return;
+	size_t capacity = map->capacity == 0 ? FD_BITMAP_WORD_BITS :
+		map->capacity;
+	while (capacity < size)
+		capacity *= 2;
+	struct fd_bitmap new_map;
+	fd_bitmap_create(&new_map);
+	new_map.capacity = capacity;
+	size_t word_count = capacity;
+	do {
+		assert(new_map.level_count < FD_BITMAP_MAX_LEVELS);
+		word_count = (word_count + FD_BITMAP_WORD_BITS - 1) /
+			FD_BITMAP_WORD_BITS;
+		new_map.levels[new_map.level_count++] =
+			calloc(word_count, sizeof(uint64_t));
+	} while (word_count > 1);
+	for (size_t i = 0; i < map->capacity / FD_BITMAP_WORD_BITS; ++i) {
+		uint64_t word = map->levels[0][i];
+		while (word != 0) {
+			int bit = __builtin_ctzll(word);
+			word &= word - 1;
+			fd_bitmap_set(&new_map, i * FD_BITMAP_WORD_BITS + bit);
+		}
+	}
+	fd_bitmap_destroy(map);
+	*map = new_map;
+}
+
+static double
+coro_bus_clock(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static uint64_t
+coro_bus_clock_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
 /**
  * One coroutine waiting to be woken up in a list of other
@@ -69,56 +616,305 @@ data_vector_pop_first(struct data_vector *vector)
 struct wakeup_entry {
 	struct rlist base;
 	struct coro *coro;
+	/** Queue the entry is in. NULL when the queue is deleted. */
+	struct wakeup_queue *queue;
+	/** Woken up, but not yet left the queue. */
+	bool is_woken;
+	/** When the entry was added. */
+	uint64_t wait_start_ns;
+	/** Select the coroutine is waiting in, or NULL. */
+	struct wakeup_select *sel;
+	/** Index of the select operation this entry belongs to. */
+	int sel_index;
+	/** Engine of the coroutine, only in the shared channels. */
+	struct coro_engine *engine;
+};
+
+/**
+ * A coroutine waiting in coro_bus_select() has an entry in the
+ * queue of each operation. The first queue to wake it up tells
+ * which operation to try, so it doesn't need to check all of them.
+ */
+struct wakeup_select {
+	/** Index of the operation which might be ready, or -1. */
+	int ready_index;
+};
+
+enum {
+	/** Max coroutines passed to coro_wakeup_many() at once. */
+	WAKEUP_BATCH_SIZE = 64,
 };
 
-/** A queue of suspended coros waiting to be woken up. */
+/**
+ * A queue of suspended coros waiting to be woken up. The woken
+ * ones stay in the queue until they run, but are moved aside, so
+ * they are not woken again.
+ */
 struct wakeup_queue {
+	/** Entries waiting for a wakeup. */
 	struct rlist coros;
+	/** Entries woken up, but not yet run. */
+	struct rlist woken;
+	size_t woken_count;
+	/** Number of waits in the queue. */
+	uint64_t wait_count;
+	/** Total time of the finished waits. */
+	uint64_t wait_time_ns;
+	/**
+	 * The waiters can be of different engines, each is woken up
+	 * with coro_wakeup_remote().
+	 */
+	bool is_shared;
 };
 
-#if 0 /* Uncomment this if want to use */
+static void
+wakeup_queue_create(struct wakeup_queue *queue, bool is_shared)
+{
+	rlist_create(&queue->coros);
+	rlist_create(&queue->woken);
+	queue->woken_count = 0;
+	queue->wait_count = 0;
+	queue->wait_time_ns = 0;
+	queue->is_shared = is_shared;
+}
+
+static bool
+wakeup_queue_is_empty(const struct wakeup_queue *queue)
+{
+	return rlist_empty(&queue->coros) && rlist_empty(&queue->woken);
+}
 
-/** Suspend the current coroutine until it is woken up. */
 static void
+wakeup_queue_add(struct wakeup_queue *queue, struct wakeup_entry *entry)
+{
+	entry->queue = queue;
+	entry->is_woken = false;
+	entry->wait_start_ns = coro_bus_clock_ns();
+	++queue->wait_count;
+	rlist_add_tail_entry(&queue->coros, entry, base);
+}
+
+static void
+wakeup_entry_leave(struct wakeup_entry *entry)
+{
+	struct wakeup_queue *queue = entry->queue;
+	/* Orphaned, already unlinked. */
+	if (queue == NULL)
+		return;
+	if (entry->is_woken) {
+		assert(queue->woken_count > 0);
+		--queue->woken_count;
+	}
+	queue->wait_time_ns += coro_bus_clock_ns() - entry->wait_start_ns;
+	rlist_del_entry(entry, base);
+}
+
+/**
+ * Suspend the current coroutine until it is woken up.
+ *
+ * @retval true The queue was deleted meanwhile.
+ */
+static bool
 wakeup_queue_suspend_this(struct wakeup_queue *queue)
 {
 	struct wakeup_entry entry;
 	entry.coro = coro_this();
-	rlist_add_tail_entry(&queue->coros, &entry, base);
+	entry.sel = NULL;
+	wakeup_queue_add(queue, &entry);
 	coro_suspend();
-	rlist_del_entry(&entry, base);
+	bool is_orphaned = entry.queue == NULL;
+	wakeup_entry_leave(&entry);
+	return is_orphaned;
+}
+
+/**
+ * Make sure at least @a count coroutines of the queue are woken
+ * up. For example, one per message in the channel. The new ones
+ * are put into the run queue together.
+ */
+static void
+wakeup_queue_wakeup(struct wakeup_queue *queue, size_t count)
+{
+	struct coro *batch[WAKEUP_BATCH_SIZE];
+	struct rlist *head = &queue->coros;
+	while (queue->woken_count < count && !rlist_empty(head)) {
+		/* Mark a batch of entries, then move it in one go. */
+		struct rlist *first = rlist_first(head);
+		struct rlist *last = head;
+		int batch_size = 0;
+		while (batch_size < WAKEUP_BATCH_SIZE &&
+		       queue->woken_count < count && rlist_next(last) != head) {
+			last = rlist_next(last);
+			struct wakeup_entry *entry = rlist_entry(last,
+				struct wakeup_entry, base);
+			entry->is_woken = true;
+			++queue->woken_count;
+			if (entry->sel != NULL && entry->sel->ready_index < 0)
+				entry->sel->ready_index = entry->sel_index;
+			if (queue->is_shared)
+				coro_wakeup_remote(entry->engine, entry->coro);
+			else
+				batch[batch_size++] = entry->coro;
+		}
+		rlist_splice_range_tail(&queue->woken, first, last);
+		coro_wakeup_many(batch, batch_size);
+	}
+}
+
+/**
+ * Wakeup all the coroutines in the queue and detach their entries,
+ * so the queue can be freed right away. The coroutines find out
+ * when they run.
+ */
+static void
+wakeup_queue_orphan_all(struct wakeup_queue *queue)
+{
+	wakeup_queue_wakeup(queue, SIZE_MAX);
+	struct wakeup_entry *entry, *tmp;
+	rlist_foreach_entry_safe(entry, &queue->woken, base, tmp) {
+		entry->queue = NULL;
+		rlist_del_entry(entry, base);
+	}
+	queue->woken_count = 0;
+}
+
+/**
+ * Numbers and the lock of a channel shared by the coroutines of
+ * several engines and threads. The waiters of all of them are in
+ * the usual wakeup queues of the channel, which are protected by
+ * the lock. The ring is not, the waiters are looked at only when
+ * there are any. Each waiter holds a reference, so a close can
+ * leave the lock to the last woken of them.
+ */
+struct coro_bus_shared {
+	struct mpmc_ring ring;
+	_Alignas(CORO_BUS_CACHE_LINE) atomic_flag lock;
+	/** Number of the waiting senders and receivers. */
+	atomic_size_t wait_count[2];
+	/** Highest number of messages seen by the senders. */
+	atomic_size_t max_size;
+	/** The channel and each waiter hold one. */
+	atomic_int ref_count;
+};
+
+/** Index of a wait_count of the shared channels. */
+enum {
+	CORO_BUS_SHARED_SEND,
+	CORO_BUS_SHARED_RECV,
+};
+
+static struct coro_bus_shared *
+coro_bus_shared_new(size_t size_limit)
+{
+	struct coro_bus_shared *sh = aligned_alloc(CORO_BUS_CACHE_LINE,
+		(sizeof(*sh) + CORO_BUS_CACHE_LINE - 1) /
+		CORO_BUS_CACHE_LINE * CORO_BUS_CACHE_LINE);
+	mpmc_create(&sh->ring, size_limit);
+	atomic_flag_clear(&sh->lock);
+	atomic_init(&sh->wait_count[CORO_BUS_SHARED_SEND], 0);
+	atomic_init(&sh->wait_count[CORO_BUS_SHARED_RECV], 0);
+	atomic_init(&sh->max_size, 0);
+	atomic_init(&sh->ref_count, 1);
+	return sh;
 }
 
-/** Wakeup the first coroutine in the queue. */
 static void
-wakeup_queue_wakeup_first(struct wakeup_queue *queue)
+coro_bus_shared_unref(struct coro_bus_shared *sh)
 {
-	if (rlist_empty(&queue->coros))
+	if (atomic_fetch_sub_explicit(&sh->ref_count, 1,
+		memory_order_acq_rel) != 1)
 		return;
-	struct wakeup_entry *entry = rlist_first_entry(&queue->coros,
-		struct wakeup_entry, base);
-	coro_wakeup(entry->coro);
+	mpmc_destroy(&sh->ring);
+	free(sh);
 }
 
-#endif
+static inline void
+coro_bus_shared_lock(struct coro_bus_shared *sh)
+{
+	/* Held only for a few list operations, but it can be preempted. */
+	while (atomic_flag_test_and_set_explicit(&sh->lock,
+		memory_order_acquire))
+		sched_yield();
+}
+
+static inline void
+coro_bus_shared_unlock(struct coro_bus_shared *sh)
+{
+	atomic_flag_clear_explicit(&sh->lock, memory_order_release);
+}
 
 struct coro_bus_channel {
 	/** Channel max capacity. */
 	size_t size_limit;
+	/** The channel carries message descriptors, not numbers. */
+	bool is_msg;
+	/** Size of the records of a record channel, otherwise 0. */
+	size_t rec_size;
+	/** Destructor of the messages dropped with the channel. */
+	coro_bus_msg_delete_f on_drop;
+	/**
+	 * The lock-free ring for the other threads, if any. Then it
+	 * stores the messages instead of the data ring.
+	 */
+	struct coro_bus_port *port;
+	/**
+	 * The ring and the lock for the coroutines of several engines,
+	 * if the channel is shared. Then it stores the messages.
+	 */
+	struct coro_bus_shared *shared;
 	/** Coroutines waiting until the channel is not full. */
 	struct wakeup_queue send_queue;
 	/** Coroutines waiting until the channel is not empty. */
 	struct wakeup_queue recv_queue;
 	/** Message queue. */
-	struct data_vector data;
+	struct data_ring data;
+	/** Number of sent messages. */
+	uint64_t send_count;
+	/** Number of received messages. */
+	uint64_t recv_count;
+	/** Highest number of messages seen in the channel. */
+	size_t max_size;
+	/**
+	 * Bytes of the messages in the data ring, with their payloads.
+	 * Counted in the budget of the bus.
+	 */
+	size_t mem_size;
 };
 
 struct coro_bus {
 	struct coro_bus_channel **channels;
 	int channel_count;
+	/** Allocated size of the channels array. */
+	int channel_capacity;
+	/** Free descriptors below channel_count. */
+	struct fd_bitmap free_channels;
+	/** Number of open channels, of numbers and of messages. */
+	int open_count[2];
+	/**
+	 * Number of full channels, of numbers and of messages. Lets
+	 * a broadcast fail without looking at the channels. The
+	 * cross-thread channels are not counted in both, they are not
+	 * broadcast to.
+	 */
+	int full_count[2];
+	/** Allocator of the small message payloads. */
+	struct msg_slab slab;
+	/**
+	 * Bytes all the local channels can hold together, 0 means no
+	 * limit. See coro_bus_set_budget().
+	 */
+	size_t budget_limit;
+	/** Bytes held by the local channels now. */
+	size_t budget_used;
+	/** Highest number of bytes held at once. */
+	size_t budget_max_used;
+	/** Senders of any channels waiting for the budget. */
+	struct wakeup_queue budget_queue;
 };
 
-static enum coro_bus_error_code global_error = CORO_BUS_ERR_NONE;
+/** Per thread, the ports are used from the other threads. */
+static _Thread_local enum coro_bus_error_code global_error =
+	CORO_BUS_ERR_NONE;
 
 enum coro_bus_error_code
 coro_bus_errno(void)
@@ -132,152 +928,1088 @@ coro_bus_errno_set(enum coro_bus_error_code err)
 	global_error = err;
 }
 
+/**
+ * Find a channel by its descriptor and kind. The records must be of
+ * the same size, 0 for the other kinds. Sets the error if not
+ * found.
+ */
+static struct coro_bus_channel *
+coro_bus_channel_get(struct coro_bus *bus, int channel, bool is_msg,
+	size_t rec_size)
+{
+	if (channel < 0 || channel >= bus->channel_count ||
+	    bus->channels[channel] == NULL) {
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return NULL;
+	}
+	struct coro_bus_channel *ch = bus->channels[channel];
+	if (ch->is_msg != is_msg || ch->rec_size != rec_size) {
+		coro_bus_errno_set(CORO_BUS_ERR_WRONG_TYPE);
+		return NULL;
+	}
+	return ch;
+}
+
+/**
+ * The channel gets the broadcasts and is counted in the open and
+ * full counters of the bus. The cross-thread and record channels
+ * are not.
+ */
+static bool
+coro_bus_channel_is_broadcast(const struct coro_bus_channel *ch)
+{
+	return ch->port == NULL && ch->shared == NULL && ch->rec_size == 0;
+}
+
+static size_t
+coro_bus_channel_size(const struct coro_bus_channel *ch)
+{
+	if (ch->port != NULL)
+		return mpsc_size(ch->port);
+	if (ch->shared != NULL)
+		return mpmc_size(&ch->shared->ring);
+	return data_ring_size(&ch->data);
+}
+
+static bool
+coro_bus_channel_is_full(const struct coro_bus_channel *ch)
+{
+	return coro_bus_channel_size(ch) >= ch->size_limit;
+}
+
+/** Bytes of @a count messages of a local channel, with payloads. */
+static size_t
+coro_bus_channel_bytes(const struct coro_bus_channel *ch, const void *data,
+	size_t count)
+{
+	size_t bytes = count * ch->data.elem_size;
+	if (ch->is_msg) {
+		const struct coro_bus_msg *msgs = data;
+		for (size_t i = 0; i < count; ++i)
+			bytes += msgs[i].len;
+	}
+	return bytes;
+}
+
+/** Bytes the senders can add before the budget is exhausted. */
+static size_t
+coro_bus_budget_free(const struct coro_bus *bus)
+{
+	return bus->budget_limit > bus->budget_used ?
+		bus->budget_limit - bus->budget_used : 0;
+}
+
+/**
+ * How many of @a count > 0 messages fit into the budget of the bus.
+ * One always fits when the budget is not used at all, even if it
+ * is bigger, so it doesn't wait forever.
+ */
+static size_t
+coro_bus_budget_fit(const struct coro_bus *bus,
+	const struct coro_bus_channel *ch, const void *data, size_t count)
+{
+	size_t free = coro_bus_budget_free(bus);
+	size_t esize = ch->data.elem_size;
+	size_t i = 0;
+	if (!ch->is_msg) {
+		i = free / esize;
+		if (i > count)
+			i = count;
+	} else {
+		const struct coro_bus_msg *msgs = data;
+		for (; i < count; ++i) {
+			size_t cost = esize + msgs[i].len;
+			if (cost > free)
+				break;
+			free -= cost;
+		}
+	}
+	if (i == 0 && bus->budget_used == 0)
+		return 1;
+	return i;
+}
+
+/**
+ * Wakeup all the senders waiting for the budget. Each checks its own
+ * messages then, smaller ones can fit while bigger ones can't.
+ */
+static void
+coro_bus_budget_wakeup(struct coro_bus *bus)
+{
+	if (!rlist_empty(&bus->budget_queue.coros))
+		wakeup_queue_wakeup(&bus->budget_queue, SIZE_MAX);
+}
+
+/**
+ * Queue of the senders to a channel which is not sent to. A local
+ * one which is not full is out of the budget.
+ */
+static struct wakeup_queue *
+coro_bus_channel_send_queue(struct coro_bus *bus,
+	struct coro_bus_channel *ch)
+{
+	if (ch->port == NULL && ch->shared == NULL &&
+	    !coro_bus_channel_is_full(ch))
+		return &bus->budget_queue;
+	return &ch->send_queue;
+}
+
+/**
+ * Append @a count messages to a local channel, they must fit into
+ * its limit. The budget is not checked, only counted.
+ */
+static void
+coro_bus_channel_push_local(struct coro_bus *bus,
+	struct coro_bus_channel *ch, const void *data, size_t count)
+{
+	size_t size = data_ring_size(&ch->data);
+	assert(size + count <= ch->size_limit);
+	bool was_full = coro_bus_channel_is_full(ch);
+	data_ring_push_many(&ch->data, data, count);
+	if (!was_full && coro_bus_channel_is_full(ch) &&
+	    coro_bus_channel_is_broadcast(ch))
+		++bus->full_count[ch->is_msg];
+	ch->send_count += count;
+	if (size + count > ch->max_size)
+		ch->max_size = size + count;
+	size_t bytes = coro_bus_channel_bytes(ch, data, count);
+	ch->mem_size += bytes;
+	bus->budget_used += bytes;
+	if (bus->budget_used > bus->budget_max_used)
+		bus->budget_max_used = bus->budget_used;
+}
+
+/** Append as many of @a count messages as fit. */
+static size_t
+coro_bus_channel_push(struct coro_bus *bus, struct coro_bus_channel *ch,
+	const void *data, size_t count)
+{
+	struct coro_bus_shared *sh = ch->shared;
+	if (sh != NULL) {
+		const unsigned *numbers = data;
+		size_t i = 0;
+		while (i < count && mpmc_try_push(&sh->ring, numbers[i]))
+			++i;
+		size_t size = mpmc_size(&sh->ring);
+		size_t max = atomic_load_explicit(&sh->max_size,
+			memory_order_relaxed);
+		while (size > max && !atomic_compare_exchange_weak_explicit(
+			&sh->max_size, &max, size, memory_order_relaxed,
+			memory_order_relaxed)) {
+		}
+		return i;
+	}
+	if (ch->port != NULL) {
+		const unsigned *numbers = data;
+		size_t i = 0;
+		while (i < count && mpsc_try_push(ch->port, numbers[i]))
+			++i;
+		/* The send count is the ring tail, the others push too. */
+		size_t size = mpsc_size(ch->port);
+		if (size > ch->max_size)
+			ch->max_size = size;
+		return i;
+	}
+	size_t size = data_ring_size(&ch->data);
+	if (count > ch->size_limit - size)
+		count = ch->size_limit - size;
+	if (bus->budget_limit != 0 && count > 0)
+		count = coro_bus_budget_fit(bus, ch, data, count);
+	coro_bus_channel_push_local(bus, ch, data, count);
+	return count;
+}
+
+/** Take up to @a count messages. */
+static size_t
+coro_bus_channel_pop(struct coro_bus *bus, struct coro_bus_channel *ch,
+	void *data, size_t count)
+{
+	if (ch->shared != NULL) {
+		unsigned *numbers = data;
+		size_t i = 0;
+		while (i < count && mpmc_try_pop(&ch->shared->ring,
+						 &numbers[i]))
+			++i;
+		return i;
+	}
+	if (ch->port != NULL) {
+		unsigned *numbers = data;
+		size_t i = 0;
+		while (i < count && mpsc_try_pop(ch->port, &numbers[i]))
+			++i;
+		if (i == 0) {
+			/* Empty. Get a signal on the next push. */
+			mpsc_arm(ch->port);
+			while (i < count && mpsc_try_pop(ch->port, &numbers[i]))
+				++i;
+		}
+		/*
+		 * The remote pushes are not seen. The peak is sampled
+		 * when the consumer comes.
+		 */
+		size_t size = mpsc_size(ch->port) + i;
+		if (size > ch->max_size)
+			ch->max_size = size;
+		ch->recv_count += i;
+		return i;
+	}
+	size_t size = data_ring_size(&ch->data);
+	if (count > size)
+		count = size;
+	bool was_full = coro_bus_channel_is_full(ch);
+	data_ring_pop_many(&ch->data, data, count);
+	if (was_full && !coro_bus_channel_is_full(ch) &&
+	    coro_bus_channel_is_broadcast(ch))
+		--bus->full_count[ch->is_msg];
+	ch->recv_count += count;
+	size_t bytes = coro_bus_channel_bytes(ch, data, count);
+	ch->mem_size -= bytes;
+	bus->budget_used -= bytes;
+	coro_bus_budget_wakeup(bus);
+	return count;
+}
+
+/**
+ * Wakeup as many receivers as there are messages, and as many
+ * senders as there is free space. The ones woken earlier and not
+ * run yet are counted, so nobody is woken twice.
+ */
+static void
+coro_bus_channel_wakeup(struct coro_bus_channel *ch)
+{
+	struct coro_bus_shared *sh = ch->shared;
+	if (sh != NULL) {
+		/* Pairs with the fence of the waiters after being counted. */
+		atomic_thread_fence(memory_order_seq_cst);
+		if (atomic_load_explicit(&sh->wait_count[CORO_BUS_SHARED_SEND],
+			memory_order_relaxed) == 0 &&
+		    atomic_load_explicit(&sh->wait_count[CORO_BUS_SHARED_RECV],
+			memory_order_relaxed) == 0)
+			return;
+		coro_bus_shared_lock(sh);
+	}
+	size_t size = coro_bus_channel_size(ch);
+	wakeup_queue_wakeup(&ch->recv_queue, size);
+	wakeup_queue_wakeup(&ch->send_queue, ch->size_limit > size ?
+		ch->size_limit - size : 0);
+	if (sh != NULL)
+		coro_bus_shared_unlock(sh);
+}
+
+/**
+ * Suspend in a queue of a shared channel until woken up by any
+ * thread. The ring is checked again after the coroutine is counted
+ * as a waiter, so a push or a pop which hasn't seen the waiter is
+ * seen by it instead.
+ *
+ * @retval true The channel was closed meanwhile.
+ */
+static bool
+coro_bus_shared_suspend(struct coro_bus_channel *ch, int kind)
+{
+	struct coro_bus_shared *sh = ch->shared;
+	struct wakeup_queue *queue = kind == CORO_BUS_SHARED_SEND ?
+		&ch->send_queue : &ch->recv_queue;
+	struct wakeup_entry entry;
+	entry.coro = coro_this();
+	entry.sel = NULL;
+	entry.engine = coro_remote_wait_begin();
+	coro_bus_shared_lock(sh);
+	wakeup_queue_add(queue, &entry);
+	atomic_fetch_add_explicit(&sh->wait_count[kind], 1,
+		memory_order_relaxed);
+	atomic_fetch_add_explicit(&sh->ref_count, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	size_t size = mpmc_size(&sh->ring);
+	bool is_ready = kind == CORO_BUS_SHARED_SEND ?
+		size < ch->size_limit : size > 0;
+	coro_bus_shared_unlock(sh);
+	if (!is_ready)
+		coro_suspend();
+	/* The channel can be freed already, only the shared part is left. */
+	coro_bus_shared_lock(sh);
+	bool is_orphaned = entry.queue == NULL;
+	if (!is_orphaned) {
+		wakeup_entry_leave(&entry);
+		atomic_fetch_sub_explicit(&sh->wait_count[kind], 1,
+			memory_order_relaxed);
+	}
+	coro_bus_shared_unlock(sh);
+	coro_bus_shared_unref(sh);
+	coro_remote_wait_end(entry.engine);
+	return is_orphaned;
+}
+
+static void
+coro_bus_channel_delete(struct coro_bus *bus, struct coro_bus_channel *ch)
+{
+	assert(wakeup_queue_is_empty(&ch->send_queue));
+	assert(wakeup_queue_is_empty(&ch->recv_queue));
+	if (ch->is_msg) {
+		struct coro_bus_msg msg;
+		while (data_ring_size(&ch->data) > 0) {
+			data_ring_pop_many(&ch->data, &msg, 1);
+			if (ch->on_drop != NULL)
+				ch->on_drop(bus, msg.ptr, msg.len);
+			else
+				coro_bus_msg_free(bus, msg.ptr, msg.len);
+		}
+	}
+	if (ch->port != NULL) {
+		coro_watch_fd_stop(&ch->port->watch);
+		close(ch->port->watch.fd);
+		mpsc_destroy(ch->port);
+		free(ch->port);
+	} else if (ch->shared != NULL) {
+		coro_bus_shared_unref(ch->shared);
+	} else {
+		bus->budget_used -= ch->mem_size;
+		data_ring_destroy(&ch->data);
+	}
+	free(ch);
+}
+
 struct coro_bus *
 coro_bus_new(void)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return NULL;
+	struct coro_bus *bus = malloc(sizeof(*bus));
+	bus->channels = NULL;
+	bus->channel_count = 0;
+	bus->channel_capacity = 0;
+	fd_bitmap_create(&bus->free_channels);
+	bus->open_count[0] = bus->open_count[1] = 0;
+	bus->full_count[0] = bus->full_count[1] = 0;
+	bus->slab.chunks = NULL;
+	bus->slab.free_blocks = NULL;
+	bus->budget_limit = 0;
+	bus->budget_used = 0;
+	bus->budget_max_used = 0;
+	wakeup_queue_create(&bus->budget_queue, false);
+	return bus;
 }
 
 void
 coro_bus_delete(struct coro_bus *bus)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
+	for (int i = 0; i < bus->channel_count; ++i) {
+		if (bus->channels[i] != NULL)
+			coro_bus_channel_delete(bus, bus->channels[i]);
+	}
+	assert(wakeup_queue_is_empty(&bus->budget_queue));
+	free(bus->channels);
+	fd_bitmap_destroy(&bus->free_channels);
+	msg_slab_destroy(&bus->slab);
+	free(bus);
+}
+
+/**
+ * Pushes of the other threads are signaled through the eventfd
+ * when the consumer asked for that. Wakeup the receivers.
+ */
+static void
+coro_bus_port_watch_f(struct coro_fd_watch *watch, int events)
+{
+	(void)events;
+	struct coro_bus_port *port = watch->arg;
+#if CORO_BUS_HAVE_EVENTFD
+	eventfd_t value;
+	eventfd_read(watch->fd, &value);
+#endif
+	coro_bus_channel_wakeup(port->ch);
+}
+
+static struct coro_bus_port *
+coro_bus_port_new(struct coro_bus_channel *ch, size_t size_limit)
+{
+#if CORO_BUS_HAVE_EVENTFD
+	struct coro_bus_port *port = aligned_alloc(CORO_BUS_CACHE_LINE,
+		(sizeof(*port) + CORO_BUS_CACHE_LINE - 1) /
+		CORO_BUS_CACHE_LINE * CORO_BUS_CACHE_LINE);
+	port->ch = ch;
+	mpsc_create(port, size_limit);
+	port->watch.func = coro_bus_port_watch_f;
+	port->watch.arg = port;
+	port->watch.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	port->watch.events = CORO_EVENT_READ;
+	if (port->watch.fd < 0 || coro_watch_fd_start(&port->watch) != 0) {
+		printf("Error: can't watch the channel eventfd\n");
+		exit(-1);
+	}
+	return port;
+#else
+	(void)ch;
+	(void)size_limit;
+	printf("Error: cross-thread channels are not supported on this "
+		"platform\n");
+	exit(-1);
+#endif
+}
+
+/** Where a channel of numbers keeps them. */
+enum coro_bus_ring_type {
+	/** The data ring, for the coroutines of one engine. */
+	CORO_BUS_RING_LOCAL,
+	/** The MPSC ring of a port, see coro_bus_channel_open_mpsc(). */
+	CORO_BUS_RING_MPSC,
+	/** The MPMC ring, see coro_bus_channel_open_shared(). */
+	CORO_BUS_RING_SHARED,
+};
+
+static int
+coro_bus_channel_open_impl(struct coro_bus *bus, size_t size_limit,
+	bool is_msg, coro_bus_msg_delete_f on_drop,
+	enum coro_bus_ring_type ring_type, size_t rec_size)
+{
+	/* The lowest free descriptor is reused, if any. */
+	long channel = fd_bitmap_first(&bus->free_channels);
+	if (channel >= 0) {
+		fd_bitmap_clear(&bus->free_channels, channel);
+	} else {
+		channel = bus->channel_count++;
+		if (bus->channel_count > bus->channel_capacity) {
+			bus->channel_capacity = bus->channel_capacity == 0 ?
+				4 : bus->channel_capacity * 2;
+			bus->channels = realloc(bus->channels,
+				sizeof(bus->channels[0]) *
+				bus->channel_capacity);
+		}
+		fd_bitmap_reserve(&bus->free_channels, bus->channel_count);
+	}
+	struct coro_bus_channel *ch = malloc(sizeof(*ch));
+	ch->size_limit = size_limit;
+	ch->is_msg = is_msg;
+	ch->rec_size = rec_size;
+	ch->on_drop = on_drop;
+	ch->port = NULL;
+	ch->shared = NULL;
+	ch->send_count = 0;
+	ch->recv_count = 0;
+	ch->max_size = 0;
+	ch->mem_size = 0;
+	bool is_shared = ring_type == CORO_BUS_RING_SHARED;
+	wakeup_queue_create(&ch->send_queue, is_shared);
+	wakeup_queue_create(&ch->recv_queue, is_shared);
+	bus->channels[channel] = ch;
+	if (ring_type == CORO_BUS_RING_MPSC) {
+		assert(!is_msg);
+		ch->port = coro_bus_port_new(ch, size_limit);
+		ch->size_limit = ch->port->mask + 1;
+	} else if (is_shared) {
+		assert(!is_msg);
+		ch->shared = coro_bus_shared_new(size_limit);
+		ch->size_limit = ch->shared->ring.mask + 1;
+	} else if (rec_size != 0) {
+		assert(!is_msg);
+		data_ring_create(&ch->data, size_limit, rec_size);
+	} else {
+		data_ring_create(&ch->data, size_limit, is_msg ?
+			sizeof(struct coro_bus_msg) : sizeof(unsigned));
+		++bus->open_count[is_msg];
+		if (coro_bus_channel_is_full(ch))
+			++bus->full_count[is_msg];
+	}
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return channel;
 }
 
 int
 coro_bus_channel_open(struct coro_bus *bus, size_t size_limit)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)size_limit;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	/*
-	 * One of the tests will force you to reuse the channel
-	 * descriptors. It means, that if your maximal channel
-	 * descriptor is N, and you have any free descriptor in
-	 * the range 0-N, then you should open the new channel on
-	 * that old descriptor.
-	 *
-	 * A more precise instruction - check if any of the
-	 * bus->channels[i] with i = 0 -> bus->channel_count is
-	 * free (== NULL). If yes - reuse the slot. Don't grow the
-	 * bus->channels array, when have space in it.
-	 */
-	return -1;
+	return coro_bus_channel_open_impl(bus, size_limit, false, NULL,
+		CORO_BUS_RING_LOCAL, 0);
+}
+
+int
+coro_bus_channel_open_msg(struct coro_bus *bus, size_t size_limit,
+	coro_bus_msg_delete_f on_drop)
+{
+	return coro_bus_channel_open_impl(bus, size_limit, true, on_drop,
+		CORO_BUS_RING_LOCAL, 0);
+}
+
+int
+coro_bus_channel_open_mpsc(struct coro_bus *bus, size_t size_limit)
+{
+	return coro_bus_channel_open_impl(bus, size_limit, false, NULL,
+		CORO_BUS_RING_MPSC, 0);
+}
+
+int
+coro_bus_channel_open_shared(struct coro_bus *bus, size_t size_limit)
+{
+	return coro_bus_channel_open_impl(bus, size_limit, false, NULL,
+		CORO_BUS_RING_SHARED, 0);
+}
+
+int
+coro_bus_channel_open_rec(struct coro_bus *bus, size_t size_limit,
+	size_t rec_size)
+{
+	assert(rec_size > 0);
+	return coro_bus_channel_open_impl(bus, size_limit, false, NULL,
+		CORO_BUS_RING_LOCAL, rec_size);
+}
+
+int
+coro_bus_channel_stats(struct coro_bus *bus, int channel,
+	struct coro_bus_channel_stats *stats)
+{
+	if (channel < 0 || channel >= bus->channel_count ||
+	    bus->channels[channel] == NULL) {
+		coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+		return -1;
+	}
+	const struct coro_bus_channel *ch = bus->channels[channel];
+	stats->size_limit = ch->size_limit;
+	stats->size = coro_bus_channel_size(ch);
+	stats->max_size = ch->max_size;
+	stats->send_count = ch->send_count;
+	if (ch->port != NULL) {
+		stats->send_count = atomic_load_explicit(&ch->port->tail,
+			memory_order_relaxed);
+		stats->bytes = stats->size * sizeof(unsigned);
+		stats->alloc_bytes = (ch->port->mask + 1) *
+			sizeof(struct mpsc_cell);
+	} else if (ch->shared != NULL) {
+		stats->bytes = stats->size * sizeof(unsigned);
+		stats->alloc_bytes = (ch->shared->ring.mask + 1) *
+			sizeof(struct mpsc_cell);
+	} else {
+		stats->bytes = ch->mem_size;
+		stats->alloc_bytes = data_ring_capacity_bytes(&ch->data);
+	}
+	stats->recv_count = ch->recv_count;
+	struct coro_bus_shared *sh = ch->shared;
+	if (sh != NULL) {
+		/* The positions of the ring count the messages. */
+		stats->recv_count = atomic_load_explicit(&sh->ring.head,
+			memory_order_relaxed);
+		stats->send_count = atomic_load_explicit(&sh->ring.tail,
+			memory_order_relaxed);
+		stats->max_size = atomic_load_explicit(&sh->max_size,
+			memory_order_relaxed);
+		coro_bus_shared_lock(sh);
+	}
+	stats->send_wait_count = ch->send_queue.wait_count;
+	stats->recv_wait_count = ch->recv_queue.wait_count;
+	stats->wait_time_ns = ch->send_queue.wait_time_ns +
+		ch->recv_queue.wait_time_ns;
+	if (sh != NULL)
+		coro_bus_shared_unlock(sh);
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return 0;
+}
+
+void
+coro_bus_set_budget(struct coro_bus *bus, size_t limit)
+{
+	bus->budget_limit = limit;
+	coro_bus_budget_wakeup(bus);
+}
+
+void
+coro_bus_budget_stats(struct coro_bus *bus,
+	struct coro_bus_budget_stats *stats)
+{
+	stats->limit = bus->budget_limit;
+	stats->used = bus->budget_used;
+	stats->max_used = bus->budget_max_used;
+	stats->wait_count = bus->budget_queue.wait_count;
+	stats->wait_time_ns = bus->budget_queue.wait_time_ns;
+}
+
+void
+coro_bus_dump(struct coro_bus *bus, FILE *out)
+{
+	for (int i = 0; i < bus->channel_count; ++i) {
+		struct coro_bus_channel_stats stats;
+		if (bus->channels[i] == NULL ||
+		    coro_bus_channel_stats(bus, i, &stats) != 0)
+			continue;
+		fprintf(out, "channel %d: size %zu/%zu, max size %zu, "
+			"sent %llu, received %llu, send waits %llu, "
+			"recv waits %llu, wait %.3f ms, bytes %zu, "
+			"allocated %zu\n", i, stats.size,
+			stats.size_limit, stats.max_size,
+			(unsigned long long)stats.send_count,
+			(unsigned long long)stats.recv_count,
+			(unsigned long long)stats.send_wait_count,
+			(unsigned long long)stats.recv_wait_count,
+			stats.wait_time_ns / 1000000.0, stats.bytes,
+			stats.alloc_bytes);
+	}
+	struct coro_bus_budget_stats budget;
+	coro_bus_budget_stats(bus, &budget);
+	fprintf(out, "budget: used %zu/%zu, max used %zu, waits %llu, "
+		"wait %.3f ms\n", budget.used, budget.limit, budget.max_used,
+		(unsigned long long)budget.wait_count,
+		budget.wait_time_ns / 1000000.0);
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+}
+
+struct coro_bus_port *
+coro_bus_channel_port(struct coro_bus *bus, int channel)
+{
+	struct coro_bus_channel *ch = coro_bus_channel_get(bus, channel,
+		false, 0);
+	if (ch == NULL)
+		return NULL;
+	if (ch->port == NULL) {
+		coro_bus_errno_set(CORO_BUS_ERR_WRONG_TYPE);
+		return NULL;
+	}
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return ch->port;
+}
+
+int
+coro_bus_port_try_send_v(struct coro_bus_port *port, const unsigned *data,
+	unsigned count)
+{
+	unsigned i = 0;
+	while (i < count && mpsc_try_push(port, data[i]))
+		++i;
+	if (i == 0) {
+		coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+		return -1;
+	}
+	mpsc_notify(port);
+	coro_bus_errno_set(CORO_BUS_ERR_NONE);
+	return i;
+}
+
+int
+coro_bus_port_try_send(struct coro_bus_port *port, unsigned data)
+{
+	return coro_bus_port_try_send_v(port, &data, 1) < 0 ? -1 : 0;
 }
 
 void
 coro_bus_channel_close(struct coro_bus *bus, int channel)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
+	assert(channel >= 0 && channel < bus->channel_count);
+	struct coro_bus_channel *ch = bus->channels[channel];
+	assert(ch != NULL);
+	bus->channels[channel] = NULL;
+	fd_bitmap_set(&bus->free_channels, channel);
+	if (coro_bus_channel_is_broadcast(ch)) {
+		--bus->open_count[ch->is_msg];
+		if (coro_bus_channel_is_full(ch))
+			--bus->full_count[ch->is_msg];
+	}
 	/*
-	 * Be very attentive here. What happens, if the channel is
-	 * closed while there are coroutines waiting on it? For
-	 * example, the channel was empty, and some coros were
-	 * waiting on its recv_queue.
-	 *
-	 * If you wakeup those coroutines and just delete the
-	 * channel right away, then those waiting coroutines might
-	 * on wakeup try to reference invalid memory.
-	 *
-	 * Can happen, for example, if you use an intrusive list
-	 * (rlist), delete the list itself (by deleting the
-	 * channel), and then the coroutines on wakeup would try
-	 * to remove themselves from the already destroyed list.
-	 *
-	 * Think how you could address that. Remove all the
-	 * waiters from the list before freeing it? Yield this
-	 * coroutine after waking up the waiters but before
-	 * freeing the channel, so the waiters could safely leave?
+	 * The waiters don't touch the queues anymore, they see the
+	 * channel is gone by their orphaned entries.
 	 */
+	if (ch->shared != NULL)
+		coro_bus_shared_lock(ch->shared);
+	wakeup_queue_orphan_all(&ch->send_queue);
+	wakeup_queue_orphan_all(&ch->recv_queue);
+	if (ch->shared != NULL)
+		coro_bus_shared_unlock(ch->shared);
+	coro_bus_channel_delete(bus, ch);
+	/* Some budget is freed, or a waiter's channel is gone. */
+	coro_bus_budget_wakeup(bus);
+}
+
+/**
+ * Send as many of @a count messages as fit. Suspends while the
+ * channel is full, unless @a is_blocking is false.
+ */
+static int
+coro_bus_send_impl(struct coro_bus *bus, int channel, bool is_msg,
+	size_t rec_size, const void *data, unsigned count, bool is_blocking)
+{
+	while (true) {
+		struct coro_bus_channel *ch = coro_bus_channel_get(bus,
+			channel, is_msg, rec_size);
+		if (ch == NULL)
+			return -1;
+		size_t sent = coro_bus_channel_push(bus, ch, data, count);
+		if (sent == 0) {
+			if (!is_blocking) {
+				coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+				return -1;
+			}
+			bool is_orphaned = ch->shared != NULL ?
+				coro_bus_shared_suspend(ch,
+					CORO_BUS_SHARED_SEND) :
+				wakeup_queue_suspend_this(
+					coro_bus_channel_send_queue(bus, ch));
+			if (is_orphaned) {
+				coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+				return -1;
+			}
+			continue;
+		}
+		/*
+		 * A batch of messages wakes up a batch of receivers at
+		 * once, and the other senders if there is still space.
+		 */
+		coro_bus_channel_wakeup(ch);
+		coro_bus_errno_set(CORO_BUS_ERR_NONE);
+		return sent;
+	}
+}
+
+/**
+ * Receive up to @a capacity messages. Suspends while the channel
+ * is empty, unless @a is_blocking is false.
+ */
+static int
+coro_bus_recv_impl(struct coro_bus *bus, int channel, bool is_msg,
+	size_t rec_size, void *data, unsigned capacity, bool is_blocking)
+{
+	while (true) {
+		struct coro_bus_channel *ch = coro_bus_channel_get(bus,
+			channel, is_msg, rec_size);
+		if (ch == NULL)
+			return -1;
+		size_t count = coro_bus_channel_pop(bus, ch, data, capacity);
+		if (count == 0) {
+			if (!is_blocking) {
+				coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+				return -1;
+			}
+			bool is_orphaned = ch->shared != NULL ?
+				coro_bus_shared_suspend(ch,
+					CORO_BUS_SHARED_RECV) :
+				wakeup_queue_suspend_this(&ch->recv_queue);
+			if (is_orphaned) {
+				coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+				return -1;
+			}
+			continue;
+		}
+		/* Same as in send, for the rest of the messages. */
+		coro_bus_channel_wakeup(ch);
+		coro_bus_errno_set(CORO_BUS_ERR_NONE);
+		return count;
+	}
 }
 
 int
 coro_bus_send(struct coro_bus *bus, int channel, unsigned data)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
-	(void)data;
-	/*
-	 * Try sending in a loop, until success. If error, then
-	 * check which one is that. If 'wouldblock', then suspend
-	 * this coroutine and try again when woken up.
-	 *
-	 * If see the channel has space, then wakeup the first
-	 * coro in the send-queue. That is needed so when there is
-	 * enough space for many messages, and many coroutines are
-	 * waiting, they would then wake each other up one by one
-	 * as lone as there is still space.
-	 */
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	return coro_bus_send_impl(bus, channel, false, 0, &data, 1, true) < 0 ?
+		-1 : 0;
 }
 
 int
 coro_bus_try_send(struct coro_bus *bus, int channel, unsigned data)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
-	(void)data;
-	/*
-	 * Append data if has space. Otherwise 'wouldblock' error.
-	 * Wakeup the first coro in the recv-queue! To let it know
-	 * there is data.
-	 */
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	return coro_bus_send_impl(bus, channel, false, 0, &data, 1, false) < 0 ?
+		-1 : 0;
 }
 
 int
 coro_bus_recv(struct coro_bus *bus, int channel, unsigned *data)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
-	(void)data;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	return coro_bus_recv_impl(bus, channel, false, 0, data, 1, true) < 0 ?
+		-1 : 0;
 }
 
 int
 coro_bus_try_recv(struct coro_bus *bus, int channel, unsigned *data)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
-	(void)data;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	return coro_bus_recv_impl(bus, channel, false, 0, data, 1, false) < 0 ?
+		-1 : 0;
+}
+
+void *
+coro_bus_msg_alloc(struct coro_bus *bus, size_t len)
+{
+	union msg_header *h;
+	if (len <= CORO_BUS_SMALL_MSG_SIZE)
+		h = msg_slab_alloc(&bus->slab);
+	else
+		h = malloc(sizeof(*h) + len);
+	h->ref_count = 1;
+	return h + 1;
+}
+
+void
+coro_bus_msg_free(struct coro_bus *bus, void *ptr, size_t len)
+{
+	union msg_header *h = (union msg_header *)ptr - 1;
+	assert(h->ref_count > 0);
+	if (--h->ref_count > 0)
+		return;
+	if (len <= CORO_BUS_SMALL_MSG_SIZE)
+		msg_slab_free(&bus->slab, h);
+	else
+		free(h);
+}
+
+int
+coro_bus_send_msg(struct coro_bus *bus, int channel, void *ptr, size_t len)
+{
+	struct coro_bus_msg msg = {ptr, len};
+	return coro_bus_send_impl(bus, channel, true, 0, &msg, 1, true) < 0 ?
+		-1 : 0;
+}
+
+int
+coro_bus_try_send_msg(struct coro_bus *bus, int channel, void *ptr,
+	size_t len)
+{
+	struct coro_bus_msg msg = {ptr, len};
+	return coro_bus_send_impl(bus, channel, true, 0, &msg, 1, false) < 0 ?
+		-1 : 0;
+}
+
+int
+coro_bus_recv_msg(struct coro_bus *bus, int channel, struct coro_bus_msg *msg)
+{
+	return coro_bus_recv_impl(bus, channel, true, 0, msg, 1, true) < 0 ?
+		-1 : 0;
 }
 
+int
+coro_bus_try_recv_msg(struct coro_bus *bus, int channel,
+	struct coro_bus_msg *msg)
+{
+	return coro_bus_recv_impl(bus, channel, true, 0, msg, 1, false) < 0 ?
+		-1 : 0;
+}
+
+/** Try a select operation without suspending. */
+static int
+coro_bus_select_try(struct coro_bus *bus, const struct coro_bus_sel *op)
+{
+	if (op->type == CORO_BUS_SEL_SEND)
+		return coro_bus_try_send(bus, op->channel, op->data);
+	assert(op->type == CORO_BUS_SEL_RECV);
+	return coro_bus_try_recv(bus, op->channel, op->out);
+}
+
+/** Queue to wait in for a select operation. */
+static struct wakeup_queue *
+coro_bus_select_queue(struct coro_bus *bus, const struct coro_bus_sel *op)
+{
+	struct coro_bus_channel *ch = bus->channels[op->channel];
+	return op->type == CORO_BUS_SEL_SEND ?
+		coro_bus_channel_send_queue(bus, ch) : &ch->recv_queue;
+}
+
+/**
+ * Remove the select entries from the queues. The wakeups which
+ * were meant for this coroutine, but were not used, are passed
+ * on to the next waiters.
+ */
+static void
+coro_bus_select_leave(struct coro_bus *bus, const struct coro_bus_sel *ops,
+	struct wakeup_entry *entries, int count)
+{
+	for (int i = 0; i < count; ++i)
+		wakeup_entry_leave(&entries[i]);
+	for (int i = 0; i < count; ++i) {
+		struct coro_bus_channel *ch = bus->channels[ops[i].channel];
+		if (ch != NULL)
+			coro_bus_channel_wakeup(ch);
+	}
+}
+
+int
+coro_bus_select(struct coro_bus *bus, const struct coro_bus_sel *ops,
+	int count, double timeout)
+{
+	double deadline = timeout < 0 ? -1 : coro_bus_clock() + timeout;
+	struct wakeup_entry small_entries[8];
+	struct wakeup_entry *entries = small_entries;
+	if (count > (int)(sizeof(small_entries) / sizeof(small_entries[0])))
+		entries = malloc(sizeof(entries[0]) * count);
+	struct wakeup_select sel;
+	int rc;
+	for (int i = 0; i < count; ++i) {
+		int c = ops[i].channel;
+		if (c >= 0 && c < bus->channel_count &&
+		    bus->channels[c] != NULL &&
+		    bus->channels[c]->shared != NULL) {
+			coro_bus_errno_set(CORO_BUS_ERR_WRONG_TYPE);
+			rc = -1;
+			goto done;
+		}
+	}
+	while (true) {
+		for (rc = 0; rc < count; ++rc) {
+			if (coro_bus_select_try(bus, &ops[rc]) == 0)
+				goto done;
+			if (coro_bus_errno() != CORO_BUS_ERR_WOULD_BLOCK) {
+				rc = -1;
+				goto done;
+			}
+		}
+		if (deadline >= 0 && coro_bus_clock() >= deadline) {
+			coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+			rc = -1;
+			goto done;
+		}
+		/* Nothing is ready. Wait in all the queues at once. */
+		sel.ready_index = -1;
+		for (int i = 0; i < count; ++i) {
+			struct wakeup_entry *e = &entries[i];
+			e->coro = coro_this();
+			e->sel = &sel;
+			e->sel_index = i;
+			wakeup_queue_add(coro_bus_select_queue(bus, &ops[i]),
+				e);
+		}
+		bool is_woken;
+		if (deadline < 0) {
+			coro_suspend();
+			is_woken = true;
+		} else {
+			is_woken = coro_suspend_timeout(deadline -
+				coro_bus_clock());
+		}
+		int ready = sel.ready_index;
+		enum coro_bus_error_code err = CORO_BUS_ERR_WOULD_BLOCK;
+		for (int i = 0; i < count; ++i) {
+			/* The descriptor might be reused already. */
+			if (entries[i].queue == NULL) {
+				err = CORO_BUS_ERR_NO_CHANNEL;
+				ready = -1;
+				break;
+			}
+		}
+		if (ready >= 0) {
+			if (coro_bus_select_try(bus, &ops[ready]) == 0)
+				err = CORO_BUS_ERR_NONE;
+			else
+				err = coro_bus_errno();
+		}
+		coro_bus_select_leave(bus, ops, entries, count);
+		if (err != CORO_BUS_ERR_WOULD_BLOCK) {
+			coro_bus_errno_set(err);
+			rc = err == CORO_BUS_ERR_NONE ? ready : -1;
+			goto done;
+		}
+		if (!is_woken || (deadline >= 0 &&
+				  coro_bus_clock() >= deadline)) {
+			coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+			rc = -1;
+			goto done;
+		}
+	}
+done:
+	if (entries != small_entries)
+		free(entries);
+	return rc;
+}
 
 #if NEED_BROADCAST
 
+/**
+ * Send one message to all the channels of the given kind. Suspends
+ * while any of them is full, unless @a is_blocking is false. A
+ * payload is not copied, each channel only takes a reference.
+ */
+static int
+coro_bus_broadcast_impl(struct coro_bus *bus, bool is_msg, const void *data,
+	bool is_blocking)
+{
+	/* Descriptor of the channel waited for during the last try. */
+	int waited = -1;
+	while (true) {
+		if (bus->open_count[is_msg] == 0) {
+			coro_bus_errno_set(CORO_BUS_ERR_NO_CHANNEL);
+			return -1;
+		}
+		if (bus->full_count[is_msg] > 0) {
+			if (!is_blocking) {
+				coro_bus_errno_set(CORO_BUS_ERR_WOULD_BLOCK);
+				return -1;
+			}
+			/*
+			 * The wakeup from the previously waited channel is
+			 * not used. Pass it on, if there is still space.
+			 */
+			struct coro_bus_channel *ch = NULL;
+			if (waited >= 0)
+				ch = bus->channels[waited];
+			if (ch != NULL)
+				coro_bus_channel_wakeup(ch);
+			for (waited = 0;; ++waited) {
+				assert(waited < bus->channel_count);
+				ch = bus->channels[waited];
+				if (ch != NULL && ch->is_msg == is_msg &&
+				    coro_bus_channel_is_broadcast(ch) &&
+				    coro_bus_channel_is_full(ch))
+					break;
+			}
+			/* Closed or not, the other channels are checked. */
+			wakeup_queue_suspend_this(&ch->send_queue);
+			continue;
+		}
+		if (bus->budget_limit != 0 && bus->budget_used != 0) {
+			size_t cost = is_msg ? sizeof(struct coro_bus_msg) +
+				((const struct coro_bus_msg *)data)->len :
+				sizeof(unsigned);
+			/* Each channel holds the payload, it is in each. */
+			cost *= bus->open_count[is_msg];
+			if (cost > coro_bus_budget_free(bus)) {
+				if (!is_blocking) {
+					coro_bus_errno_set(
+						CORO_BUS_ERR_WOULD_BLOCK);
+					return -1;
+				}
+				struct coro_bus_channel *ch = NULL;
+				if (waited >= 0)
+					ch = bus->channels[waited];
+				if (ch != NULL)
+					coro_bus_channel_wakeup(ch);
+				waited = -1;
+				wakeup_queue_suspend_this(&bus->budget_queue);
+				continue;
+			}
+		}
+		int ref_count = 0;
+		for (int i = 0; i < bus->channel_count; ++i) {
+			struct coro_bus_channel *ch = bus->channels[i];
+			if (ch == NULL || ch->is_msg != is_msg ||
+			    !coro_bus_channel_is_broadcast(ch))
+				continue;
+			coro_bus_channel_push_local(bus, ch, data, 1);
+			coro_bus_channel_wakeup(ch);
+			++ref_count;
+		}
+		assert(ref_count == bus->open_count[is_msg]);
+		if (is_msg) {
+			const struct coro_bus_msg *msg = data;
+			union msg_header *h = (union msg_header *)msg->ptr - 1;
+			/* The sender's reference is passed to the channels. */
+			h->ref_count += ref_count - 1;
+		}
+		coro_bus_errno_set(CORO_BUS_ERR_NONE);
+		return 0;
+	}
+}
+
 int
 coro_bus_broadcast(struct coro_bus *bus, unsigned data)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)data;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	return coro_bus_broadcast_impl(bus, false, &data, true);
 }
 
 int
 coro_bus_try_broadcast(struct coro_bus *bus, unsigned data)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)data;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	return coro_bus_broadcast_impl(bus, false, &data, false);
+}
+
+int
+coro_bus_broadcast_msg(struct coro_bus *bus, void *ptr, size_t len)
+{
+	struct coro_bus_msg msg = {ptr, len};
+	return coro_bus_broadcast_impl(bus, true, &msg, true);
+}
+
+int
+coro_bus_try_broadcast_msg(struct coro_bus *bus, void *ptr, size_t len)
+{
+	struct coro_bus_msg msg = {ptr, len};
+	return coro_bus_broadcast_impl(bus, true, &msg, false);
 }
 
 #endif
@@ -287,49 +2019,58 @@ coro_bus_try_broadcast(struct coro_bus *bus, unsigned data)
 int
 coro_bus_send_v(struct coro_bus *bus, int channel, const unsigned *data, unsigned count)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
-	(void)data;
-	(void)count;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	return coro_bus_send_impl(bus, channel, false, 0, data, count, true);
 }
 
 int
 coro_bus_try_send_v(struct coro_bus *bus, int channel, const unsigned *data, unsigned count)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
-	(void)data;
-	(void)count;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	return coro_bus_send_impl(bus, channel, false, 0, data, count, false);
 }
 
 int
 coro_bus_recv_v(struct coro_bus *bus, int channel, unsigned *data, unsigned capacity)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
-	(void)data;
-	(void)capacity;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	return coro_bus_recv_impl(bus, channel, false, 0, data, capacity, true);
 }
 
 int
 coro_bus_try_recv_v(struct coro_bus *bus, int channel, unsigned *data, unsigned capacity)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)bus;
-	(void)channel;
-	(void)data;
-	(void)capacity;
-	coro_bus_errno_set(CORO_BUS_ERR_NOT_IMPLEMENTED);
-	return -1;
+	return coro_bus_recv_impl(bus, channel, false, 0, data, capacity,
+		false);
 }
 
 #endif
+
+int
+coro_bus_send_rec_v(struct coro_bus *bus, int channel, const void *data,
+	size_t rec_size, unsigned count)
+{
+	return coro_bus_send_impl(bus, channel, false, rec_size, data, count,
+		true);
+}
+
+int
+coro_bus_try_send_rec_v(struct coro_bus *bus, int channel, const void *data,
+	size_t rec_size, unsigned count)
+{
+	return coro_bus_send_impl(bus, channel, false, rec_size, data, count,
+		false);
+}
+
+int
+coro_bus_recv_rec_v(struct coro_bus *bus, int channel, void *data,
+	size_t rec_size, unsigned capacity)
+{
+	return coro_bus_recv_impl(bus, channel, false, rec_size, data,
+		capacity, true);
+}
+
+int
+coro_bus_try_recv_rec_v(struct coro_bus *bus, int channel, void *data,
+	size_t rec_size, unsigned capacity)
+{
+	return coro_bus_recv_impl(bus, channel, false, rec_size, data,
+		capacity, false);
+}
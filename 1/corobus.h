@@ -1,24 +1,38 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 
 /**
  * Here you should specify which bonuses do you want via the
  * macros. It is important to define these macros here, in the
  * header, because it is used by tests.
  */
-#define NEED_BROADCAST 0
-#define NEED_BATCH 0
+#define NEED_BROADCAST 1
+#define NEED_BATCH 1
 
 enum coro_bus_error_code {
 	CORO_BUS_ERR_NONE = 0,
 	CORO_BUS_ERR_NO_CHANNEL,
 	CORO_BUS_ERR_WOULD_BLOCK,
 	CORO_BUS_ERR_NOT_IMPLEMENTED,
+	/** Numbers sent to a message channel or vice versa. */
+	CORO_BUS_ERR_WRONG_TYPE,
 };
 
 struct coro_bus;
 
+/** Descriptor of a message payload passed through a channel. */
+struct coro_bus_msg {
+	void *ptr;
+	size_t len;
+};
+
+/** Destructor of a message payload. */
+typedef void (*coro_bus_msg_delete_f)(struct coro_bus *bus, void *ptr,
+				      size_t len);
+
 /** Get the latest error happened in coro_bus. */
 enum coro_bus_error_code
 coro_bus_errno(void);
@@ -126,6 +140,444 @@ coro_bus_recv(struct coro_bus *bus, int channel, unsigned *data);
 int
 coro_bus_try_recv(struct coro_bus *bus, int channel, unsigned *data);
 
+/**
+ * Create a channel carrying message payloads instead of numbers.
+ * The payloads are never copied, only their descriptors. The
+ * ownership passes from the sender to the receiver.
+ * @param bus The bus to create the channel in.
+ * @param size_limit Maximum messages a channel can hold at once.
+ * @param on_drop Destructor of the messages still in the channel
+ *     when it is closed or the bus is deleted. NULL means
+ *     coro_bus_msg_free().
+ *
+ * @retval >=0 Descriptor of the channel.
+ */
+int
+coro_bus_channel_open_msg(struct coro_bus *bus, size_t size_limit,
+	coro_bus_msg_delete_f on_drop);
+
+/**
+ * Allocate a payload of @a len bytes. Payloads up to 64 bytes are
+ * taken from a slab of the bus, without malloc. They must not
+ * outlive the bus. The payload is reference counted, see
+ * coro_bus_broadcast_msg().
+ */
+void *
+coro_bus_msg_alloc(struct coro_bus *bus, size_t len);
+
+/**
+ * Free a payload allocated with coro_bus_msg_alloc(). @a len must
+ * be the same as in the allocation. If the payload was broadcast,
+ * only one reference is dropped.
+ */
+void
+coro_bus_msg_free(struct coro_bus *bus, void *ptr, size_t len);
+
+/**
+ * Same as coro_bus_send(), but for a message channel. On success
+ * the channel owns the payload.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WRONG_TYPE - not a message channel.
+ */
+int
+coro_bus_send_msg(struct coro_bus *bus, int channel, void *ptr, size_t len);
+
+/**
+ * Same as coro_bus_send_msg(), but never suspends.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WRONG_TYPE - not a message channel.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is full.
+ */
+int
+coro_bus_try_send_msg(struct coro_bus *bus, int channel, void *ptr,
+	size_t len);
+
+/**
+ * Same as coro_bus_recv(), but for a message channel. On success
+ * the caller owns the payload.
+ *
+ * @retval 0 Success, @a msg is filled.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WRONG_TYPE - not a message channel.
+ */
+int
+coro_bus_recv_msg(struct coro_bus *bus, int channel, struct coro_bus_msg *msg);
+
+/**
+ * Same as coro_bus_recv_msg(), but never suspends.
+ *
+ * @retval 0 Success, @a msg is filled.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WRONG_TYPE - not a message channel.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is empty.
+ */
+int
+coro_bus_try_recv_msg(struct coro_bus *bus, int channel,
+	struct coro_bus_msg *msg);
+
+/**
+ * Create a channel of records of @a rec_size bytes. They are copied
+ * into the channel's ring and out of it, so they must be plain data.
+ * The records are sent and received only by the functions of the
+ * same record size, usually generated by CORO_BUS_CHANNEL_DEFINE().
+ * Broadcasts skip such channels, and select rejects them as it does
+ * the message ones.
+ *
+ * @retval >=0 Descriptor of the channel.
+ */
+int
+coro_bus_channel_open_rec(struct coro_bus *bus, size_t size_limit,
+	size_t rec_size);
+
+/**
+ * Same as coro_bus_send_v(), but for a record channel. The batch is
+ * copied into the ring with at most 2 memcpy() calls.
+ *
+ * @retval >0 Success, how many records were sent, from the start
+ *     of @a data.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WRONG_TYPE - not a channel of such records.
+ */
+int
+coro_bus_send_rec_v(struct coro_bus *bus, int channel, const void *data,
+	size_t rec_size, unsigned count);
+
+/**
+ * Same as coro_bus_send_rec_v(), but never suspends.
+ *
+ * @retval >0 Success, how many records were sent.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WRONG_TYPE - not a channel of such records.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is full.
+ */
+int
+coro_bus_try_send_rec_v(struct coro_bus *bus, int channel, const void *data,
+	size_t rec_size, unsigned count);
+
+/**
+ * Same as coro_bus_recv_v(), but for a record channel.
+ *
+ * @retval >0 Success, how many records were received into the
+ *     start of @a data.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WRONG_TYPE - not a channel of such records.
+ */
+int
+coro_bus_recv_rec_v(struct coro_bus *bus, int channel, void *data,
+	size_t rec_size, unsigned capacity);
+
+/**
+ * Same as coro_bus_recv_rec_v(), but never suspends.
+ *
+ * @retval >0 Success, how many records were received.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WRONG_TYPE - not a channel of such records.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is empty.
+ */
+int
+coro_bus_try_recv_rec_v(struct coro_bus *bus, int channel, void *data,
+	size_t rec_size, unsigned capacity);
+
+/**
+ * CORO_BUS_CHANNEL_DEFINE(name, type) defines the typed functions
+ * of a channel of records of the type, prefixed with name_:
+ * - open(bus, size_limit);
+ * - send, try_send, recv, try_recv of one record by a pointer;
+ * - send_v, try_send_v, recv_v, try_recv_v of an array of them.
+ *
+ * They return the same as the functions of the numbers. The record
+ * size is a compile-time constant in each of them, and a channel
+ * opened for one type rejects the functions of another size with
+ * CORO_BUS_ERR_WRONG_TYPE. The records are stored in the ring
+ * itself, without the payload pointers of the message channels.
+ */
+#define CORO_BUS_CHANNEL_DEFINE(name, type)				\
+									\
+static inline int							\
+name##_open(struct coro_bus *bus, size_t size_limit)			\
+{									\
+	return coro_bus_channel_open_rec(bus, size_limit,		\
+		sizeof(type));						\
+}									\
+									\
+static inline int							\
+name##_send_v(struct coro_bus *bus, int channel, const type *data,	\
+	unsigned count)							\
+{									\
+	return coro_bus_send_rec_v(bus, channel, data, sizeof(type),	\
+		count);							\
+}									\
+									\
+static inline int							\
+name##_try_send_v(struct coro_bus *bus, int channel, const type *data,	\
+	unsigned count)							\
+{									\
+	return coro_bus_try_send_rec_v(bus, channel, data,		\
+		sizeof(type), count);					\
+}									\
+									\
+static inline int							\
+name##_recv_v(struct coro_bus *bus, int channel, type *data,		\
+	unsigned capacity)						\
+{									\
+	return coro_bus_recv_rec_v(bus, channel, data, sizeof(type),	\
+		capacity);						\
+}									\
+									\
+static inline int							\
+name##_try_recv_v(struct coro_bus *bus, int channel, type *data,	\
+	unsigned capacity)						\
+{									\
+	return coro_bus_try_recv_rec_v(bus, channel, data,		\
+		sizeof(type), capacity);				\
+}									\
+									\
+static inline int							\
+name##_send(struct coro_bus *bus, int channel, const type *rec)		\
+{									\
+	return name##_send_v(bus, channel, rec, 1) < 0 ? -1 : 0;	\
+}									\
+									\
+static inline int							\
+name##_try_send(struct coro_bus *bus, int channel, const type *rec)	\
+{									\
+	return name##_try_send_v(bus, channel, rec, 1) < 0 ? -1 : 0;	\
+}									\
+									\
+static inline int							\
+name##_recv(struct coro_bus *bus, int channel, type *rec)		\
+{									\
+	return name##_recv_v(bus, channel, rec, 1) < 0 ? -1 : 0;	\
+}									\
+									\
+static inline int							\
+name##_try_recv(struct coro_bus *bus, int channel, type *rec)		\
+{									\
+	return name##_try_recv_v(bus, channel, rec, 1) < 0 ? -1 : 0;	\
+}
+
+/** Counters of a channel. */
+struct coro_bus_channel_stats {
+	size_t size_limit;
+	/** Number of messages in the channel now. */
+	size_t size;
+	/** Highest number of messages seen in the channel. */
+	size_t max_size;
+	/** Number of sent messages. */
+	uint64_t send_count;
+	/** Number of received messages. */
+	uint64_t recv_count;
+	/** How many times the senders waited, including in select. */
+	uint64_t send_wait_count;
+	/** How many times the receivers waited, including in select. */
+	uint64_t recv_wait_count;
+	/** Total time of the finished waits of all the coroutines. */
+	uint64_t wait_time_ns;
+	/**
+	 * Bytes of the messages in the channel now, with the payloads
+	 * of the message channels. The local channels count them in
+	 * the budget of the bus, see coro_bus_set_budget().
+	 */
+	size_t bytes;
+	/** Bytes allocated for the queue of the messages. */
+	size_t alloc_bytes;
+};
+
+/**
+ * Get the counters of a channel. They are always on, each is a
+ * plain increment, and the time is measured only when a coroutine
+ * waits. The peak size of a cross-thread channel is sampled by the
+ * consumer.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ */
+int
+coro_bus_channel_stats(struct coro_bus *bus, int channel,
+	struct coro_bus_channel_stats *stats);
+
+/**
+ * Limit the bytes all the local channels of the bus can hold
+ * together, on top of the limits of each channel. 0, the default,
+ * means no limit. A message costs its slot in the channel, and a
+ * payload of a message channel costs its length too. A broadcast
+ * payload is counted in each channel, as each holds it.
+ *
+ * When a message doesn't fit, the blocking senders, broadcasts and
+ * selects wait in one queue of the bus, and the non-blocking ones
+ * fail with CORO_BUS_ERR_WOULD_BLOCK. Each recv from any channel
+ * wakes the waiters up to try again. When nothing is held, one
+ * message is taken even if it is bigger than the limit. The
+ * messages held already when the limit is lowered stay.
+ *
+ * The queues of the local channels grow on demand, so the limit
+ * bounds their memory too, up to the doubling of each. The
+ * cross-thread channels allocate their rings at once and are not
+ * counted.
+ */
+void
+coro_bus_set_budget(struct coro_bus *bus, size_t limit);
+
+/** Counters of the budget of a bus. */
+struct coro_bus_budget_stats {
+	/** 0 means no limit. */
+	size_t limit;
+	/** Bytes held by the local channels now. */
+	size_t used;
+	/** Highest number of bytes held at once. */
+	size_t max_used;
+	/** How many times the senders waited for the budget. */
+	uint64_t wait_count;
+	/** Total time of the finished waits for the budget. */
+	uint64_t wait_time_ns;
+};
+
+void
+coro_bus_budget_stats(struct coro_bus *bus,
+	struct coro_bus_budget_stats *stats);
+
+/**
+ * Print the counters of each channel of the bus, with the bytes each
+ * holds, and of the budget.
+ */
+void
+coro_bus_dump(struct coro_bus *bus, FILE *out);
+
+/**
+ * Producer end of a cross-thread channel. Can be used from any
+ * thread, without locks.
+ */
+struct coro_bus_port;
+
+/**
+ * Create a channel of numbers which other threads can send to,
+ * for example the thread pool workers. It is backed by a lock-free
+ * ring with many producers and one consumer. The consumer is the
+ * thread running the bus scheduler, it uses the usual recv
+ * functions, and is woken up through an eventfd watched by the
+ * scheduler, so it never spins. The coroutines can send to it with
+ * the usual functions as well.
+ *
+ * Broadcasts skip such channels. The scheduler doesn't exit while
+ * the channel is open. Linux only.
+ * @param bus The bus to create the channel in.
+ * @param size_limit Maximum messages the channel can hold at once.
+ *     Rounded up to a power of 2.
+ *
+ * @retval >=0 Descriptor of the channel.
+ */
+int
+coro_bus_channel_open_mpsc(struct coro_bus *bus, size_t size_limit);
+
+/**
+ * Create a channel of numbers for the coroutines of different
+ * threads: of the per-thread engines of coro_sched_thread_init(),
+ * of the global one, and of the multi-threaded scheduler. It is
+ * backed by a lock-free ring with many producers and many
+ * consumers, and the usual send and recv functions work with it.
+ * A blocked coroutine is woken up through the remote wakeups of
+ * its engine, see coro_wakeup_remote(). The wait queues are under
+ * a spinlock, taken only when somebody waits.
+ *
+ * The channel is opened and closed in one thread while the others
+ * don't use it, except the coroutines waiting in it, which are
+ * woken up with CORO_BUS_ERR_NO_CHANNEL. Broadcasts skip such
+ * channels, selects fail on them with CORO_BUS_ERR_WRONG_TYPE.
+ * @param bus The bus to create the channel in.
+ * @param size_limit Maximum messages the channel can hold at once.
+ *     Rounded up to a power of 2.
+ *
+ * @retval >=0 Descriptor of the channel.
+ */
+int
+coro_bus_channel_open_shared(struct coro_bus *bus, size_t size_limit);
+
+/**
+ * Get the producer end of a cross-thread channel. It is valid
+ * until the channel is closed. The other threads must stop using
+ * it before that.
+ *
+ * @retval not NULL Success.
+ * @retval NULL Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - the channel doesn't exist.
+ *     - CORO_BUS_ERR_WRONG_TYPE - not a cross-thread channel.
+ */
+struct coro_bus_port *
+coro_bus_channel_port(struct coro_bus *bus, int channel);
+
+/**
+ * Send a number from any thread. Never blocks. The errors are per
+ * thread.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is full.
+ */
+int
+coro_bus_port_try_send(struct coro_bus_port *port, unsigned data);
+
+/**
+ * Same as coro_bus_port_try_send(), but sends as many of @a count
+ * numbers as fit, in their order in @a data.
+ *
+ * @retval >0 How many numbers were sent.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the channel is full.
+ */
+int
+coro_bus_port_try_send_v(struct coro_bus_port *port, const unsigned *data,
+	unsigned count);
+
+enum coro_bus_sel_type {
+	CORO_BUS_SEL_SEND,
+	CORO_BUS_SEL_RECV,
+};
+
+/** One operation of coro_bus_select(). */
+struct coro_bus_sel {
+	enum coro_bus_sel_type type;
+	/** Descriptor of the channel. */
+	int channel;
+	/** Data to send. */
+	unsigned data;
+	/** Output parameter to save the received data to. */
+	unsigned *out;
+};
+
+/**
+ * Perform exactly one of the @a count send and recv operations,
+ * whichever is possible first. If none is, the coroutine is
+ * suspended in all the channels at once until any of them is ready
+ * or @a timeout seconds pass. Negative timeout means infinity.
+ * @param bus Bus where the channels are located.
+ * @param ops Operations to choose from.
+ * @param count Size of @a ops.
+ * @param timeout Timeout in seconds.
+ *
+ * @retval >=0 Index of the performed operation.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - one of the channels doesn't
+ *       exist or was closed during the wait.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - the timeout has expired.
+ *     - CORO_BUS_ERR_WRONG_TYPE - one of the channels is shared
+ *       between threads, see coro_bus_channel_open_shared().
+ */
+int
+coro_bus_select(struct coro_bus *bus, const struct coro_bus_sel *ops,
+	int count, double timeout);
 
 #if NEED_BROADCAST /* Bonus 1 */
 
@@ -133,7 +585,8 @@ coro_bus_try_recv(struct coro_bus *bus, int channel, unsigned *data);
  * Send the given message to all the registered channels at once.
  * If any of the channels are full, then the message isn't sent
  * anywhere, and the coroutine is suspended until can submit the
- * data to all the channels.
+ * data to all the channels. Message channels are not touched, see
+ * coro_bus_broadcast_msg().
  * @param bus Bus where the channels are located.
  * @param data Data to send.
  *
@@ -158,6 +611,32 @@ coro_bus_broadcast(struct coro_bus *bus, unsigned data);
 int
 coro_bus_try_broadcast(struct coro_bus *bus, unsigned data);
 
+/**
+ * Same as coro_bus_broadcast(), but sends a payload to all the
+ * message channels. The payload must be allocated with
+ * coro_bus_msg_alloc(). It is not copied. Each channel gets a
+ * reference, and each receiver must free it with
+ * coro_bus_msg_free(). A custom on_drop of a channel is called
+ * for its reference too.
+ *
+ * @retval 0 Success. Sent to all the message channels.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - no message channels in the bus.
+ */
+int
+coro_bus_broadcast_msg(struct coro_bus *bus, void *ptr, size_t len);
+
+/**
+ * Same as coro_bus_broadcast_msg(), but never suspends.
+ *
+ * @retval 0 Success. Sent to all the message channels.
+ * @retval -1 Error. Check coro_bus_errno() for reason.
+ *     - CORO_BUS_ERR_NO_CHANNEL - no message channels in the bus.
+ *     - CORO_BUS_ERR_WOULD_BLOCK - at least one of them is full.
+ */
+int
+coro_bus_try_broadcast_msg(struct coro_bus *bus, void *ptr, size_t len);
+
 #endif /* Bonus 1 */
 
 #if NEED_BATCH /* Bonus 2 */
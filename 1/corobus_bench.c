@@ -0,0 +1,629 @@
+#include "corobus.h"
+#include "libcoro.h"
+#include "unit_bench.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * Benchmarks of the coroutine bus on ../utils/unit_bench.h.
+ *
+ * Microbenchmarks of the channel operations. The arg of a bench is
+ * the number of the open channels, if it matters.
+ *
+ * Topologies measure the throughput and latency of messages going
+ * through a set of channels and coroutines:
+ * - pipeline - a chain of channels with a relay coroutine between
+ *   each two;
+ * - fan_in - many producers, one channel, one consumer;
+ * - fan_out - one producer, one channel, many consumers;
+ * - broadcast - one producer broadcasting to many channels, each
+ *   with a consumer.
+ * One iteration of them is one delivery. The latency percentiles of
+ * the last run go to the info of the report. The parameters can be
+ * changed with the options, the others are of bench_main(), like
+ * --filter pipeline to run only one topology.
+ * Usage: bench_bus [--channels=N] [--size-limit=N] [--batch=N]
+ *     [--coros=N] [--messages=N] [bench_main() options]
+ */
+
+/** For the latencies, the harness measures the rest. */
+static uint64_t
+bench_clock_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @a channel_count channels are open. One iteration is a close of a
+ * pseudo-random one and an open, which takes the just freed
+ * descriptor back.
+ */
+static void
+bench_reopen(long iterations, long channel_count)
+{
+	bench_pause();
+	struct coro_bus *bus = coro_bus_new();
+	for (long i = 0; i < channel_count; ++i)
+		coro_bus_channel_open(bus, 1);
+	uint64_t seed = 1;
+	bench_resume();
+	for (long i = 0; i < iterations; ++i) {
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		int channel = (seed >> 33) % channel_count;
+		coro_bus_channel_close(bus, channel);
+		if (coro_bus_channel_open(bus, 1) != channel)
+			abort();
+	}
+	bench_pause();
+	coro_bus_delete(bus);
+	bench_resume();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+enum {
+	/** Elements per send and recv of the batch benchmarks. */
+	BENCH_BATCH_SIZE = 16,
+};
+
+struct bench_rec16 {
+	uint64_t words[2];
+};
+
+struct bench_rec64 {
+	uint64_t words[8];
+};
+
+CORO_BUS_CHANNEL_DEFINE(bench_rec16_channel, struct bench_rec16)
+CORO_BUS_CHANNEL_DEFINE(bench_rec64_channel, struct bench_rec64)
+
+/**
+ * One iteration is one element going through a channel, sent and received
+ * in batches of BENCH_BATCH_SIZE. The number channel is the baseline
+ * for the record ones.
+ */
+static void
+bench_batch_numbers(long iterations, long channel_count)
+{
+	(void)channel_count;
+	bench_pause();
+	struct coro_bus *bus = coro_bus_new();
+	int c = coro_bus_channel_open(bus, BENCH_BATCH_SIZE);
+	unsigned data[BENCH_BATCH_SIZE] = {0};
+	bench_resume();
+	for (long i = 0; i < iterations; i += BENCH_BATCH_SIZE) {
+		coro_bus_try_send_v(bus, c, data, BENCH_BATCH_SIZE);
+		coro_bus_try_recv_v(bus, c, data, BENCH_BATCH_SIZE);
+	}
+	bench_pause();
+	coro_bus_delete(bus);
+	bench_resume();
+}
+
+/** Same as bench_batch_numbers, on a channel shared by threads. */
+static void
+bench_batch_shared(long iterations, long channel_count)
+{
+	(void)channel_count;
+	bench_pause();
+	struct coro_bus *bus = coro_bus_new();
+	int c = coro_bus_channel_open_shared(bus, BENCH_BATCH_SIZE);
+	unsigned data[BENCH_BATCH_SIZE] = {0};
+	bench_resume();
+	for (long i = 0; i < iterations; i += BENCH_BATCH_SIZE) {
+		coro_bus_try_send_v(bus, c, data, BENCH_BATCH_SIZE);
+		coro_bus_try_recv_v(bus, c, data, BENCH_BATCH_SIZE);
+	}
+	bench_pause();
+	coro_bus_delete(bus);
+	bench_resume();
+}
+
+#define BENCH_BATCH_REC_DEFINE(name, type)				\
+static void								\
+name(long iterations, long channel_count)				\
+{									\
+	(void)channel_count;						\
+	bench_pause();							\
+	struct coro_bus *bus = coro_bus_new();				\
+	int c = type##_channel_open(bus, BENCH_BATCH_SIZE);		\
+	struct type data[BENCH_BATCH_SIZE];				\
+	memset(data, 0, sizeof(data));					\
+	bench_resume();							\
+	for (long i = 0; i < iterations; i += BENCH_BATCH_SIZE) {	\
+		type##_channel_try_send_v(bus, c, data,			\
+					  BENCH_BATCH_SIZE);		\
+		type##_channel_try_recv_v(bus, c, data,			\
+					  BENCH_BATCH_SIZE);		\
+	}								\
+	bench_pause();							\
+	coro_bus_delete(bus);						\
+	bench_resume();							\
+}
+
+BENCH_BATCH_REC_DEFINE(bench_batch_rec16, bench_rec16)
+BENCH_BATCH_REC_DEFINE(bench_batch_rec64, bench_rec64)
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct bench_echo {
+	struct coro_bus *bus;
+	int in;
+	int out;
+	long count;
+};
+
+/** Sends each number back, @a count times. */
+static void *
+bench_echo_f(void *arg)
+{
+	struct bench_echo *e = arg;
+	unsigned data;
+	for (long i = 0; i < e->count; ++i) {
+		if (coro_bus_recv(e->bus, e->in, &data) != 0 ||
+		    coro_bus_send(e->bus, e->out, data) != 0)
+			abort();
+	}
+	return NULL;
+}
+
+/** The echo coroutine in an engine of its own thread. */
+static void *
+bench_echo_thread_f(void *arg)
+{
+	coro_sched_thread_init();
+	struct coro *c = coro_new(bench_echo_f, arg);
+	coro_sched_run();
+	coro_join(c);
+	coro_sched_thread_destroy();
+	return NULL;
+}
+
+/**
+ * One iteration is a round trip of a number to an echo coroutine and back,
+ * through two channels of size 1. With @a is_shared the echo runs in
+ * another thread, each trip is two wakeups of one engine by another.
+ */
+static void
+bench_ping_pong(long iterations, bool is_shared)
+{
+	bench_pause();
+	struct coro_bus *bus = coro_bus_new();
+	struct bench_echo e;
+	e.bus = bus;
+	e.in = is_shared ? coro_bus_channel_open_shared(bus, 1) :
+		coro_bus_channel_open(bus, 1);
+	e.out = is_shared ? coro_bus_channel_open_shared(bus, 1) :
+		coro_bus_channel_open(bus, 1);
+	e.count = iterations;
+	pthread_t tid;
+	struct coro *echo = NULL;
+	bench_resume();
+	if (is_shared) {
+		if (pthread_create(&tid, NULL, bench_echo_thread_f, &e) != 0)
+			abort();
+	} else {
+		echo = coro_new(bench_echo_f, &e);
+	}
+	unsigned data;
+	for (long i = 0; i < iterations; ++i) {
+		if (coro_bus_send(bus, e.in, i) != 0 ||
+		    coro_bus_recv(bus, e.out, &data) != 0)
+			abort();
+	}
+	bench_pause();
+	if (is_shared)
+		pthread_join(tid, NULL);
+	else
+		coro_join(echo);
+	coro_bus_delete(bus);
+	bench_resume();
+}
+
+static void
+bench_ping_pong_local(long iterations, long channel_count)
+{
+	(void)channel_count;
+	bench_ping_pong(iterations, false);
+}
+
+static void
+bench_ping_pong_shared(long iterations, long channel_count)
+{
+	(void)channel_count;
+	bench_ping_pong(iterations, true);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+enum bench_topology {
+	BENCH_PIPELINE,
+	BENCH_FAN_IN,
+	BENCH_FAN_OUT,
+	BENCH_BROADCAST,
+	BENCH_TOPOLOGY_COUNT,
+};
+
+static const char *const bench_topology_names[BENCH_TOPOLOGY_COUNT] = {
+	"pipeline", "fan_in", "fan_out", "broadcast",
+};
+
+struct bench_topo_params {
+	enum bench_topology topology;
+	/** Pipeline length, or number of broadcast channels. */
+	int channel_count;
+	size_t size_limit;
+	/** Messages per send and recv call. */
+	unsigned batch;
+	/** Number of fan-in producers, or fan-out consumers. */
+	int coro_count;
+	/** Number of messages to produce. */
+	unsigned message_count;
+};
+
+/** Parameters of all the topologies, from the options. */
+static struct bench_topo_params topo_params = {
+	.topology = BENCH_PIPELINE,
+	.channel_count = 4,
+	.size_limit = 64,
+	.batch = 16,
+	.coro_count = 4,
+	.message_count = 200000,
+};
+
+/** State of one topology run. Messages are their sequence numbers. */
+struct bench_topo {
+	const struct bench_topo_params *params;
+	struct coro_bus *bus;
+	int *channels;
+	/** When each message was sent. */
+	uint64_t *send_times;
+	/** Latency of each delivery. */
+	uint64_t *latencies;
+	size_t delivery_count;
+	size_t expected_count;
+	/** Next message to produce, shared by the fan-in producers. */
+	unsigned next_message;
+	/** Suspended until all the messages are delivered. */
+	struct coro *main;
+};
+
+struct bench_topo_worker {
+	struct bench_topo *topo;
+	int in;
+	int out;
+};
+
+static void *
+bench_producer_f(void *arg)
+{
+	struct bench_topo_worker *w = arg;
+	struct bench_topo *t = w->topo;
+	const struct bench_topo_params *p = t->params;
+	unsigned *buf = malloc(sizeof(buf[0]) * p->batch);
+	while (t->next_message < p->message_count) {
+		unsigned count = p->message_count - t->next_message;
+		if (count > p->batch)
+			count = p->batch;
+		uint64_t now = bench_clock_ns();
+		for (unsigned i = 0; i < count; ++i) {
+			buf[i] = t->next_message++;
+			t->send_times[buf[i]] = now;
+		}
+		if (p->topology == BENCH_BROADCAST) {
+			for (unsigned i = 0; i < count; ++i)
+				coro_bus_broadcast(t->bus, buf[i]);
+			continue;
+		}
+		for (unsigned sent = 0; sent < count;) {
+			int rc = coro_bus_send_v(t->bus, w->out, buf + sent,
+				count - sent);
+			if (rc < 0)
+				abort();
+			sent += rc;
+		}
+	}
+	free(buf);
+	return NULL;
+}
+
+/**
+ * Receive until the channel is closed. Forward the messages if
+ * there is an output channel, otherwise they are delivered.
+ */
+static void *
+bench_consumer_f(void *arg)
+{
+	struct bench_topo_worker *w = arg;
+	struct bench_topo *t = w->topo;
+	unsigned batch = t->params->batch;
+	unsigned *buf = malloc(sizeof(buf[0]) * batch);
+	int count;
+	while ((count = coro_bus_recv_v(t->bus, w->in, buf, batch)) > 0) {
+		if (w->out >= 0) {
+			for (int sent = 0; sent < count;) {
+				int rc = coro_bus_send_v(t->bus, w->out,
+					buf + sent, count - sent);
+				if (rc < 0)
+					abort();
+				sent += rc;
+			}
+			continue;
+		}
+		uint64_t now = bench_clock_ns();
+		for (int i = 0; i < count; ++i)
+			t->latencies[t->delivery_count++] =
+				now - t->send_times[buf[i]];
+		if (t->delivery_count == t->expected_count)
+			coro_wakeup(t->main);
+	}
+	free(buf);
+	return NULL;
+}
+
+static int
+bench_cmp_u64(const void *a, const void *b)
+{
+	uint64_t l = *(const uint64_t *)a;
+	uint64_t r = *(const uint64_t *)b;
+	return l < r ? -1 : l > r;
+}
+
+/** Number of the deliveries of each message. */
+static int
+bench_topo_receiver_count(const struct bench_topo_params *p)
+{
+	return p->topology == BENCH_BROADCAST ? p->channel_count : 1;
+}
+
+/** One iteration is one delivery. */
+static void
+bench_topo_run(const struct bench_topo_params *p)
+{
+	bench_pause();
+	struct bench_topo t;
+	memset(&t, 0, sizeof(t));
+	t.params = p;
+	t.bus = coro_bus_new();
+	t.main = coro_this();
+	int channel_count = 1;
+	int producer_count = 1;
+	int consumer_count = 1;
+	int relay_count = 0;
+	switch (p->topology) {
+	case BENCH_PIPELINE:
+		channel_count = p->channel_count;
+		relay_count = channel_count - 1;
+		break;
+	case BENCH_FAN_IN:
+		producer_count = p->coro_count;
+		break;
+	case BENCH_FAN_OUT:
+		consumer_count = p->coro_count;
+		break;
+	case BENCH_BROADCAST:
+		channel_count = p->channel_count;
+		consumer_count = channel_count;
+		break;
+	default:
+		abort();
+	}
+	t.channels = malloc(sizeof(t.channels[0]) * channel_count);
+	for (int i = 0; i < channel_count; ++i)
+		t.channels[i] = coro_bus_channel_open(t.bus, p->size_limit);
+	t.expected_count = (size_t)p->message_count *
+		bench_topo_receiver_count(p);
+	t.send_times = malloc(sizeof(t.send_times[0]) * p->message_count);
+	t.latencies = malloc(sizeof(t.latencies[0]) * t.expected_count);
+
+	int worker_count = producer_count + relay_count + consumer_count;
+	struct bench_topo_worker *workers = malloc(sizeof(workers[0]) *
+		worker_count);
+	struct coro **coros = malloc(sizeof(coros[0]) * worker_count);
+	bench_resume();
+	int n = 0;
+	for (int i = 0; i < consumer_count; ++i, ++n) {
+		workers[n].topo = &t;
+		workers[n].in = t.channels[p->topology == BENCH_BROADCAST ? i :
+			channel_count - 1];
+		workers[n].out = -1;
+		coros[n] = coro_new(bench_consumer_f, &workers[n]);
+	}
+	for (int i = 0; i < relay_count; ++i, ++n) {
+		workers[n].topo = &t;
+		workers[n].in = t.channels[i];
+		workers[n].out = t.channels[i + 1];
+		coros[n] = coro_new(bench_consumer_f, &workers[n]);
+	}
+	for (int i = 0; i < producer_count; ++i, ++n) {
+		workers[n].topo = &t;
+		workers[n].in = -1;
+		workers[n].out = t.channels[0];
+		coros[n] = coro_new(bench_producer_f, &workers[n]);
+	}
+	while (t.delivery_count < t.expected_count)
+		coro_suspend();
+	bench_pause();
+	for (int i = 0; i < channel_count; ++i)
+		coro_bus_channel_close(t.bus, t.channels[i]);
+	for (int i = 0; i < worker_count; ++i)
+		coro_join(coros[i]);
+
+	qsort(t.latencies, t.expected_count, sizeof(t.latencies[0]),
+		bench_cmp_u64);
+	char key[64], value[128];
+	snprintf(key, sizeof(key), "%s_latency_ns",
+		 bench_topology_names[p->topology]);
+	snprintf(value, sizeof(value), "p50 %llu, p90 %llu, p99 %llu, max %llu",
+		 (unsigned long long)t.latencies[t.expected_count / 2],
+		 (unsigned long long)t.latencies[t.expected_count * 9 / 10],
+		 (unsigned long long)t.latencies[t.expected_count * 99 / 100],
+		 (unsigned long long)t.latencies[t.expected_count - 1]);
+	bench_info(key, value);
+
+	free(coros);
+	free(workers);
+	free(t.latencies);
+	free(t.send_times);
+	free(t.channels);
+	coro_bus_delete(t.bus);
+	bench_resume();
+}
+
+static void
+bench_topology(long iterations, enum bench_topology topology)
+{
+	struct bench_topo_params p = topo_params;
+	p.topology = topology;
+	p.message_count = iterations / bench_topo_receiver_count(&p);
+	bench_topo_run(&p);
+}
+
+static void
+bench_pipeline(long iterations, long arg)
+{
+	(void)arg;
+	bench_topology(iterations, BENCH_PIPELINE);
+}
+
+static void
+bench_fan_in(long iterations, long arg)
+{
+	(void)arg;
+	bench_topology(iterations, BENCH_FAN_IN);
+}
+
+static void
+bench_fan_out(long iterations, long arg)
+{
+	(void)arg;
+	bench_topology(iterations, BENCH_FAN_OUT);
+}
+
+static void
+bench_broadcast(long iterations, long arg)
+{
+	(void)arg;
+	bench_topology(iterations, BENCH_BROADCAST);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct bench_args {
+	int argc;
+	char **argv;
+	int rc;
+};
+
+static void *
+bench_main_f(void *arg)
+{
+	struct bench_args *args = arg;
+	const long channel_counts[] = {1000, 10000, 100000, 1000000};
+	for (size_t i = 0;
+	     i < sizeof(channel_counts) / sizeof(channel_counts[0]); ++i) {
+		bench_register_arg("reopen", bench_reopen, 100000,
+				   channel_counts[i]);
+	}
+	bench_register("batch_numbers", bench_batch_numbers, 1000000);
+	bench_register("batch_rec16", bench_batch_rec16, 1000000);
+	bench_register("batch_rec64", bench_batch_rec64, 1000000);
+	bench_register("batch_shared", bench_batch_shared, 1000000);
+	bench_register("ping_pong_local", bench_ping_pong_local, 100000);
+	bench_register("ping_pong_shared", bench_ping_pong_shared, 20000);
+	static const bench_f topologies[BENCH_TOPOLOGY_COUNT] = {
+		bench_pipeline, bench_fan_in, bench_fan_out, bench_broadcast,
+	};
+	for (int i = 0; i < BENCH_TOPOLOGY_COUNT; ++i) {
+		struct bench_topo_params p = topo_params;
+		p.topology = i;
+		bench_register(bench_topology_names[i], topologies[i],
+			       (long)p.message_count *
+			       bench_topo_receiver_count(&p));
+	}
+	args->rc = bench_main(args->argc, args->argv);
+	return NULL;
+}
+
+/**
+ * Take the topology parameters out of the options, the rest are left
+ * for bench_main(). A parameter is --name=N.
+ */
+static bool
+bench_parse_options(int *argc, char **argv)
+{
+	static const char *const names[] = {
+		"--channels=", "--size-limit=", "--batch=", "--coros=",
+		"--messages=",
+	};
+	enum { NAME_COUNT = sizeof(names) / sizeof(names[0]) };
+	struct bench_topo_params *p = &topo_params;
+	int count = 1;
+	for (int i = 1; i < *argc; ++i) {
+		int j = 0;
+		while (j < NAME_COUNT &&
+		       strncmp(argv[i], names[j], strlen(names[j])) != 0)
+			++j;
+		if (j == NAME_COUNT) {
+			argv[count++] = argv[i];
+			continue;
+		}
+		long value = atol(argv[i] + strlen(names[j]));
+		if (value <= 0)
+			return false;
+		switch (j) {
+		case 0:
+			p->channel_count = value;
+			break;
+		case 1:
+			p->size_limit = value;
+			break;
+		case 2:
+			p->batch = value;
+			break;
+		case 3:
+			p->coro_count = value;
+			break;
+		default:
+			p->message_count = value;
+			break;
+		}
+	}
+	*argc = count;
+	argv[count] = NULL;
+	return true;
+}
+
+int
+main(int argc, char **argv)
+{
+	if (!bench_parse_options(&argc, argv)) {
+		fprintf(stderr, "Usage: %s [--channels=N] [--size-limit=N] "
+			"[--batch=N] [--coros=N] [--messages=N] "
+			"[bench_main() options]\n", argv[0]);
+		return -1;
+	}
+	const struct bench_topo_params *p = &topo_params;
+	char value[128];
+	snprintf(value, sizeof(value), "channels %d, size_limit %zu, "
+		 "batch %u, coros %d, messages %u", p->channel_count,
+		 p->size_limit, p->batch, p->coro_count, p->message_count);
+	bench_info("topology_params", value);
+	struct bench_args args = {argc, argv, 0};
+	coro_sched_init();
+	struct coro *c = coro_new(bench_main_f, &args);
+	coro_sched_run();
+	coro_join(c);
+	coro_sched_destroy();
+	return args.rc;
+}
@@ -1,8 +1,14 @@
 #include "libcoro.h"
 
+#include "hugemem.h"
 #include "rlist.h"
+#include "trace.h"
 
 #include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -10,241 +16,342 @@
 #include <signal.h>
 #include <errno.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
 
 #define handle_error() do {														\
 	printf("Error %s\n", strerror(errno));										\
 	exit(-1);																	\
 } while(0)
 
-enum coro_state {
-	CORO_STATE_RUNNING,
-	CORO_STATE_SUSPENDED,
-	CORO_STATE_FINISHED,
-};
+/**
+ * Context switch backends. One of them can be selected at build
+ * time with -DCORO_CTX_BACKEND=CORO_CTX_BACKEND_<NAME>. By default
+ * the fastest one available on the platform is used.
+ *
+ * ASM - hand-written switch for x86-64 and aarch64. Neither spawn
+ *     nor switch make any syscalls.
+ * UCONTEXT - makecontext()/swapcontext(). Portable, but each
+ *     switch saves and restores the signal mask with a syscall.
+ * SIGNAL - sigaltstack() + SIGUSR2 for creation and
+ *     sigsetjmp()/siglongjmp() for switches. Works anywhere, but
+ *     the creation costs several syscalls.
+ */
+/**
+ * Build with -DCORO_PROFILE=1 to account the CPU time, switches
+ * and wakeups of each coroutine. Without it the accounting is
+ * compiled out completely.
+ */
+#ifndef CORO_PROFILE
+#define CORO_PROFILE 0
+#endif
 
-/** Main coroutine structure, its context. */
-struct coro {
-	/** Coroutine state. */
-	enum coro_state state;
-	/** A value, returned by func. */
-	void *ret;
-	/** Stack, used by the coroutine. */
-	void *stack;
-	/** An argument for the function func. */
-	void *func_arg;
-	/** A function to call as a coroutine. */
-	coro_f func;
-	/** Last remembered coroutine context. */
-	sigjmp_buf ctx;
-	/**
-	 * Coroutine which is trying to join this one right now.
-	 */
-	struct coro *joiner;
-	/** Links in a coroutine list, used by the scheduler. */
-	struct rlist link;
-};
+/**
+ * Build with -DCORO_STACK_PROFILE=1 to measure how deep the stack
+ * of each finished coroutine has gone, per coroutine function.
+ */
+#ifndef CORO_STACK_PROFILE
+#define CORO_STACK_PROFILE 0
+#endif
 
-struct coro_engine {
-	/**
-	 * Scheduler is the main coroutine - it represents the
-	 * context in which the scheduler itself runs.
-	 */
-	struct coro sched;
-	/** Which coroutine works at this moment. */
-	struct coro *this;
+/*
+ * Build with -DTRACE=1 and ../utils/trace.c to see on the timeline
+ * of trace.h which coroutine ran when, on which thread.
+ */
 
-	/**
-	 * Coroutines to run in this iteration of the loop. The
-	 * list gets populated once at the start of the iteration.
-	 */
-	struct rlist coros_running_now;
-	/**
-	 * Coroutines to run in the next iteration of the loop.
-	 * The list gets populated by wakeups and yields and new
-	 * coros.
-	 */
-	struct rlist coros_running_next;
-	/** Joined coroutines to be reused. */
-	struct rlist coros_pool;
-	/** Total number of coroutines, including the pool. */
-	size_t coro_count;
-	/**
-	 * Buffer, used by the coroutine constructor to escape
-	 * from the signal handler back into the constructor to
-	 * rollback sigaltstack etc.
-	 */
-	sigjmp_buf start_point;
+#define CORO_CTX_BACKEND_ASM 1
+#define CORO_CTX_BACKEND_UCONTEXT 2
+#define CORO_CTX_BACKEND_SIGNAL 3
+
+#ifndef CORO_CTX_BACKEND
+#  if defined(__x86_64__) || defined(__aarch64__)
+#    define CORO_CTX_BACKEND CORO_CTX_BACKEND_ASM
+#  else
+#    define CORO_CTX_BACKEND CORO_CTX_BACKEND_SIGNAL
+#  endif
+#endif
+
+#if CORO_CTX_BACKEND == CORO_CTX_BACKEND_UCONTEXT
+#include <ucontext.h>
+#endif
+
+/** Entry point of a new context. It must never return. */
+typedef void (*coro_ctx_f)(void *arg);
+
+///////////////////////////////////////////////////////////////////
+#if CORO_CTX_BACKEND == CORO_CTX_BACKEND_ASM
+
+#if !defined(__x86_64__) && !defined(__aarch64__)
+#error "CORO_CTX_BACKEND_ASM is only available on x86-64 and aarch64"
+#endif
+
+#if defined(__APPLE__)
+#  define CORO_ASM_SYM(name) "_" #name
+#else
+#  define CORO_ASM_SYM(name) #name
+#endif
+
+/**
+ * The whole context is saved right on the stack of the suspended
+ * coroutine. The only thing to remember is where the stack top
+ * is.
+ */
+struct coro_ctx {
+	void *sp;
 };
 
+/**
+ * Save the callee-saved registers on the current stack, store the
+ * stack pointer into @a from_sp, switch to @a to_sp and restore
+ * the registers saved there. All the caller-saved registers are
+ * already spilled by the compiler, because it is a normal function
+ * call for it.
+ */
+void
+libcoro_ctx_switch(void **from_sp, void *to_sp);
+
+/**
+ * First code executed in a new context. Moves the argument saved
+ * in a callee-saved register into the argument register and calls
+ * the entry function.
+ */
+void
+libcoro_ctx_trampoline(void);
+
+#if defined(__x86_64__)
+
+/*
+ * Stack layout of a suspended context, from the stack top:
+ * [0] mxcsr and x87 control word, [1] r15, [2] r14, [3] r13,
+ * [4] r12, [5] rbx, [6] rbp, [7] return address.
+ */
+__asm__(
+	".text\n"
+	".globl " CORO_ASM_SYM(libcoro_ctx_switch) "\n"
+	".p2align 4\n"
+	CORO_ASM_SYM(libcoro_ctx_switch) ":\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".globl " CORO_ASM_SYM(libcoro_ctx_trampoline) "\n"
+	".p2align 4\n"
+	CORO_ASM_SYM(libcoro_ctx_trampoline) ":\n"
+	"	movq %rbx, %rdi\n"
+	"	callq *%r12\n"
+	"	ud2\n"
+);
+
 static void
-coro_engine_create(struct coro_engine *engine)
+coro_ctx_create(struct coro_ctx *ctx, void *stack, size_t stack_size,
+	coro_ctx_f func, void *arg)
 {
-	memset(engine, 0, sizeof(*engine));
-	rlist_create(&engine->sched.link);
-	rlist_create(&engine->coros_running_now);
-	rlist_create(&engine->coros_running_next);
-	rlist_create(&engine->coros_pool);
+	uintptr_t top = ((uintptr_t)stack + stack_size) & ~(uintptr_t)15;
+	uint64_t *sp = (uint64_t *)(top - 8 * sizeof(uint64_t));
+	uint32_t mxcsr;
+	uint16_t fpucw;
+	__asm__ volatile("stmxcsr %0" : "=m"(mxcsr));
+	__asm__ volatile("fnstcw %0" : "=m"(fpucw));
+	sp[0] = (uint64_t)mxcsr | ((uint64_t)fpucw << 32);
+	sp[1] = 0;
+	sp[2] = 0;
+	sp[3] = 0;
+	sp[4] = (uint64_t)(uintptr_t)func;
+	sp[5] = (uint64_t)(uintptr_t)arg;
+	/* Zero frame pointer terminates backtraces in debuggers. */
+	sp[6] = 0;
+	sp[7] = (uint64_t)(uintptr_t)libcoro_ctx_trampoline;
+	ctx->sp = sp;
 }
 
-static void
-coro_engine_resume_next(struct coro_engine *engine)
-{
-	assert(!rlist_empty(&engine->coros_running_now));
-	struct coro *to = rlist_shift_entry(&engine->coros_running_now,
-		struct coro, link);
-	struct coro *from = engine->this;
-	assert(from != NULL);
+#else /* defined(__aarch64__) */
 
-	engine->this = NULL;
-	if (sigsetjmp(from->ctx, 0) == 0)
-		siglongjmp(to->ctx, 1);
-	assert(rlist_empty(&from->link));
-	assert(engine->this == NULL);
-	engine->this = from;
-}
+/*
+ * Stack layout of a suspended context, from the stack top:
+ * x19-x28, x29 (frame pointer), x30 (return address), d8-d15.
+ */
+__asm__(
+	".text\n"
+	".globl " CORO_ASM_SYM(libcoro_ctx_switch) "\n"
+	".p2align 4\n"
+	CORO_ASM_SYM(libcoro_ctx_switch) ":\n"
+	"	sub sp, sp, #160\n"
+	"	stp x19, x20, [sp, #0]\n"
+	"	stp x21, x22, [sp, #16]\n"
+	"	stp x23, x24, [sp, #32]\n"
+	"	stp x25, x26, [sp, #48]\n"
+	"	stp x27, x28, [sp, #64]\n"
+	"	stp x29, x30, [sp, #80]\n"
+	"	stp d8, d9, [sp, #96]\n"
+	"	stp d10, d11, [sp, #112]\n"
+	"	stp d12, d13, [sp, #128]\n"
+	"	stp d14, d15, [sp, #144]\n"
+	"	mov x2, sp\n"
+	"	str x2, [x0]\n"
+	"	mov sp, x1\n"
+	"	ldp x19, x20, [sp, #0]\n"
+	"	ldp x21, x22, [sp, #16]\n"
+	"	ldp x23, x24, [sp, #32]\n"
+	"	ldp x25, x26, [sp, #48]\n"
+	"	ldp x27, x28, [sp, #64]\n"
+	"	ldp x29, x30, [sp, #80]\n"
+	"	ldp d8, d9, [sp, #96]\n"
+	"	ldp d10, d11, [sp, #112]\n"
+	"	ldp d12, d13, [sp, #128]\n"
+	"	ldp d14, d15, [sp, #144]\n"
+	"	add sp, sp, #160\n"
+	"	ret\n"
+	".globl " CORO_ASM_SYM(libcoro_ctx_trampoline) "\n"
+	".p2align 4\n"
+	CORO_ASM_SYM(libcoro_ctx_trampoline) ":\n"
+	"	mov x0, x19\n"
+	"	blr x20\n"
+	"	brk #0\n"
+);
 
 static void
-coro_engine_suspend(struct coro_engine *engine)
+coro_ctx_create(struct coro_ctx *ctx, void *stack, size_t stack_size,
+	coro_ctx_f func, void *arg)
 {
-	struct coro *this = engine->this;
-	if (this == NULL) {
-		printf("Error: deadlock - suspension with no active "
-			"coroutines\n");
-		exit(-1);
-	}
-	assert(rlist_empty(&this->link));
-	assert(this->state == CORO_STATE_RUNNING);
-	this->state = CORO_STATE_SUSPENDED;
-	coro_engine_resume_next(engine);
+	uintptr_t top = ((uintptr_t)stack + stack_size) & ~(uintptr_t)15;
+	uint64_t *sp = (uint64_t *)(top - 20 * sizeof(uint64_t));
+	memset(sp, 0, 20 * sizeof(uint64_t));
+	sp[0] = (uint64_t)(uintptr_t)arg;
+	sp[1] = (uint64_t)(uintptr_t)func;
+	/* Zero frame pointer terminates backtraces in debuggers. */
+	sp[10] = 0;
+	sp[11] = (uint64_t)(uintptr_t)libcoro_ctx_trampoline;
+	ctx->sp = sp;
 }
 
-static void
-coro_engine_yield(struct coro_engine *engine)
+#endif /* defined(__aarch64__) */
+
+static inline void
+coro_ctx_switch(struct coro_ctx *from, struct coro_ctx *to)
 {
-	struct coro *this = engine->this;
-	assert(rlist_empty(&this->link));
-	assert(this->state == CORO_STATE_RUNNING);
-	rlist_add_tail_entry(&engine->coros_running_next, this, link);
-	coro_engine_resume_next(engine);
+	libcoro_ctx_switch(&from->sp, to->sp);
 }
 
+///////////////////////////////////////////////////////////////////
+#elif CORO_CTX_BACKEND == CORO_CTX_BACKEND_UCONTEXT
+
+struct coro_ctx {
+	ucontext_t uc;
+};
+
+/**
+ * makecontext() only passes int arguments. The pointers have to
+ * be split into halves.
+ */
 static void
-coro_engine_wakeup(struct coro_engine *engine, struct coro *coro)
+coro_ctx_ucontext_entry(unsigned f_hi, unsigned f_lo, unsigned a_hi,
+	unsigned a_lo)
 {
-	if (coro->state == CORO_STATE_RUNNING)
-		return;
-	if (coro->state == CORO_STATE_FINISHED)
-		return;
-	assert(coro->state == CORO_STATE_SUSPENDED);
-	assert(rlist_empty(&coro->link));
-	coro->state = CORO_STATE_RUNNING;
-	rlist_add_tail_entry(&engine->coros_running_next, coro, link);
+	coro_ctx_f func = (coro_ctx_f)(uintptr_t)
+		(((uint64_t)f_hi << 32) | f_lo);
+	void *arg = (void *)(uintptr_t)(((uint64_t)a_hi << 32) | a_lo);
+	func(arg);
+	abort();
 }
 
 static void
-coro_engine_run(struct coro_engine *engine)
+coro_ctx_create(struct coro_ctx *ctx, void *stack, size_t stack_size,
+	coro_ctx_f func, void *arg)
 {
-	while (true) {
-		assert(rlist_empty(&engine->coros_running_now));
-		rlist_splice_tail(&engine->coros_running_now,
-			&engine->coros_running_next);
-		if (rlist_empty(&engine->coros_running_now))
-			break;
-
-		assert(engine->this == NULL);
-		engine->this = &engine->sched;
-		assert(rlist_empty(&engine->sched.link));
-		/*
-		 * Add the scheduler to the tail so the control
-		 * comes back in the end of this iteration of the
-		 * loop.
-		 */
-		rlist_add_tail_entry(&engine->coros_running_now,
-			&engine->sched, link);
-		coro_engine_resume_next(engine);
-		assert(rlist_empty(&engine->coros_running_now));
-		assert(engine->this == &engine->sched);
-		engine->this = NULL;
-	}
+	if (getcontext(&ctx->uc) != 0)
+		handle_error();
+	ctx->uc.uc_stack.ss_sp = stack;
+	ctx->uc.uc_stack.ss_size = stack_size;
+	ctx->uc.uc_link = NULL;
+	uint64_t f = (uint64_t)(uintptr_t)func;
+	uint64_t a = (uint64_t)(uintptr_t)arg;
+	makecontext(&ctx->uc, (void (*)(void))coro_ctx_ucontext_entry, 4,
+		(unsigned)(f >> 32), (unsigned)f,
+		(unsigned)(a >> 32), (unsigned)a);
 }
 
-static void
-coro_engine_destroy(struct coro_engine *engine)
+static inline void
+coro_ctx_switch(struct coro_ctx *from, struct coro_ctx *to)
 {
-	assert(engine->this == NULL);
-	assert(rlist_empty(&engine->coros_running_now));
-	assert(rlist_empty(&engine->coros_running_next));
-	while (!rlist_empty(&engine->coros_pool)) {
-		struct coro *c = rlist_shift_entry(&engine->coros_pool,
-			struct coro, link);
-		free(c->stack);
-		free(c);
-		assert(engine->coro_count > 0);
-		--engine->coro_count;
-	}
-	assert(engine->coro_count == 0);
-	memset(engine, '#', sizeof(*engine));
+	if (swapcontext(&from->uc, &to->uc) != 0)
+		handle_error();
 }
 
-static __thread struct coro_engine *new_coro_engine = NULL;
+///////////////////////////////////////////////////////////////////
+#elif CORO_CTX_BACKEND == CORO_CTX_BACKEND_SIGNAL
+
+struct coro_ctx {
+	sigjmp_buf buf;
+};
+
+/** Context being created right now and its entry point. */
+static __thread struct coro_ctx *new_ctx = NULL;
+static __thread coro_ctx_f new_ctx_func = NULL;
+static __thread void *new_ctx_arg = NULL;
+/**
+ * Buffer, used by the context constructor to escape from the
+ * signal handler back into the constructor to rollback
+ * sigaltstack etc.
+ */
+static __thread sigjmp_buf new_ctx_start_point;
+/**
+ * Signal handlers are global for the process. The creation is
+ * serialized so the threads wouldn't restore the handler under
+ * each other's feet.
+ */
+static pthread_mutex_t new_ctx_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 /**
- * The core part of the coroutines creation - this signal handler
+ * The core part of the context creation - this signal handler
  * runs on a separate stack using sigaltstack. At invocation it
- * remembers its current context and jumps back to the coroutine
- * constructor. Later the coroutine continues from here.
+ * remembers its current context and jumps back to the context
+ * constructor. Later the context continues from here.
  */
 static void
-coro_body(int signum)
+coro_ctx_signal_entry(int signum)
 {
 	(void)signum;
-	struct coro_engine *my_engine = new_coro_engine;
-	new_coro_engine = NULL;
-
-	struct coro *c = my_engine->this;
-	my_engine->this = NULL;
+	struct coro_ctx *ctx = new_ctx;
+	coro_ctx_f func = new_ctx_func;
+	void *arg = new_ctx_arg;
+	new_ctx = NULL;
 	/*
 	 * On invocation jump back to the constructor right after
 	 * remembering the context.
 	 */
-	if (sigsetjmp(c->ctx, 0) == 0)
-		siglongjmp(my_engine->start_point, 1);
+	if (sigsetjmp(ctx->buf, 0) == 0)
+		siglongjmp(new_ctx_start_point, 1);
 	/*
-	 * If the execution is here, then the coroutine should
+	 * If the execution is here, then the context should
 	 * finally start work.
 	 */
-	my_engine->this = c;
-	while (true) {
-		c->ret = c->func(c->func_arg);
-		c->func = NULL;
-		assert(c->state == CORO_STATE_RUNNING);
-		c->state = CORO_STATE_FINISHED;
-		if (c->joiner != NULL)
-			coro_engine_wakeup(my_engine, c->joiner);
-		coro_engine_resume_next(my_engine);
-		/*
-		 * Here it is restarted already, must have its
-		 * state restored.
-		 */
-		assert(c->state == CORO_STATE_RUNNING);
-		assert(c->func != NULL);
-	}
+	func(arg);
+	abort();
 }
 
-static struct coro *
-coro_engine_spawn_new(struct coro_engine *engine, coro_f func, void *func_arg)
+static void
+coro_ctx_create(struct coro_ctx *ctx, void *stack, size_t stack_size,
+	coro_ctx_f func, void *arg)
 {
-	struct coro *c = malloc(sizeof(*c));
-	c->state = CORO_STATE_RUNNING;
-	c->ret = NULL;
-	int stack_size = 1024 * 1024;
-	if (stack_size < SIGSTKSZ)
-		stack_size = SIGSTKSZ;
-	c->stack = malloc(stack_size);
-	c->func = func;
-	c->func_arg = func_arg;
-	c->joiner = NULL;
-	rlist_create(&c->link);
+	pthread_mutex_lock(&new_ctx_mutex);
 	/*
 	 * SIGUSR2 is used. First of all, block new signals to be
 	 * able to set a new handler.
@@ -257,40 +364,39 @@ coro_engine_spawn_new(struct coro_engine *engine, coro_f func, void *func_arg)
 	/*
 	 * New handler should jump onto a new stack and remember
 	 * that position. Afterwards the stack is disabled and
-	 * becomes dedicated to that single coroutine.
+	 * becomes dedicated to that single context.
 	 */
 	struct sigaction newsa, oldsa;
-	newsa.sa_handler = coro_body;
+	newsa.sa_handler = coro_ctx_signal_entry;
 	newsa.sa_flags = SA_ONSTACK;
 	sigemptyset(&newsa.sa_mask);
 	if (sigaction(SIGUSR2, &newsa, &oldsa) != 0)
 		handle_error();
 	/* Create that new stack. */
 	stack_t oldst, newst;
-	newst.ss_sp = c->stack;
+	newst.ss_sp = stack;
 	newst.ss_size = stack_size;
 	newst.ss_flags = 0;
 	if (sigaltstack(&newst, &oldst) != 0)
 		handle_error();
 
 	/* Jump onto the stack and remember its position. */
-	assert(new_coro_engine == NULL);
-	new_coro_engine = engine;
-	struct coro *old_this = engine->this;
-	engine->this = c;
+	assert(new_ctx == NULL);
+	new_ctx = ctx;
+	new_ctx_func = func;
+	new_ctx_arg = arg;
 	sigemptyset(&suss);
-	if (sigsetjmp(engine->start_point, 1) == 0) {
+	if (sigsetjmp(new_ctx_start_point, 1) == 0) {
 		raise(SIGUSR2);
-		while (engine->this != NULL)
+		while (new_ctx != NULL)
 			sigsuspend(&suss);
 	}
-	assert(new_coro_engine == NULL);
-	engine->this = old_this;
+	assert(new_ctx == NULL);
 
 	/*
 	 * Return the old stack, unblock SIGUSR2. In other words,
 	 * rollback all global changes. The newly created stack
-	 * now is remembered only by the new coroutine, and can be
+	 * now is remembered only by the new context, and can be
 	 * used by it only.
 	 */
 	if (sigaltstack(NULL, &newst) != 0)
@@ -305,102 +411,3405 @@ coro_engine_spawn_new(struct coro_engine *engine, coro_f func, void *func_arg)
 		handle_error();
 	if (sigprocmask(SIG_SETMASK, &olds, NULL) != 0)
 		handle_error();
-
-	/* Now scheduler can work with that coroutine. */
-	++engine->coro_count;
-	assert(rlist_empty(&c->link));
-	rlist_add_tail_entry(&engine->coros_running_next, c, link);
-	return c;
+	pthread_mutex_unlock(&new_ctx_mutex);
 }
 
-static struct coro *
-coro_engine_spawn(struct coro_engine *engine, coro_f func, void *func_arg)
+static inline void
+coro_ctx_switch(struct coro_ctx *from, struct coro_ctx *to)
 {
-	if (rlist_empty(&engine->coros_pool))
-		return coro_engine_spawn_new(engine, func, func_arg);
-
-	struct coro *c = rlist_shift_entry(&engine->coros_pool,
-		struct coro, link);
-	c->func = func;
-	c->func_arg = func_arg;
-	c->state = CORO_STATE_RUNNING;
-	assert(rlist_empty(&c->link));
-	rlist_add_tail_entry(&engine->coros_running_next, c, link);
-	return c;
+	if (sigsetjmp(from->buf, 0) == 0)
+		siglongjmp(to->buf, 1);
 }
 
-static void *
-coro_engine_join(struct coro_engine *engine, struct coro *coro)
-{
-	assert(coro->joiner == NULL);
-	coro->joiner = engine->this;
-	while (coro->state == CORO_STATE_RUNNING ||
-		coro->state == CORO_STATE_SUSPENDED)
-		coro_engine_suspend(engine);
-	assert(coro->state == CORO_STATE_FINISHED);
-	assert(coro->joiner == engine->this);
-	coro->joiner = NULL;
-	void *ret = coro->ret;
-	coro->ret = NULL;
-	assert(rlist_empty(&coro->link));
-	rlist_add_entry(&engine->coros_pool, coro, link);
-	return ret;
-}
+///////////////////////////////////////////////////////////////////
+#else
+#error "Unknown CORO_CTX_BACKEND"
+#endif
 
-//////////////////////////////////////////////////////////////////
+/**
+ * Stack sizes are rounded up to a power of 2 so all the stacks of
+ * one size class are interchangeable and pooled coroutines can be
+ * reused by anyone asking for that class.
+ */
+enum {
+	CORO_STACK_CLASS_MIN_LOG2 = 14,
+	CORO_STACK_CLASS_MAX_LOG2 = 30,
+	CORO_STACK_CLASS_COUNT =
+		CORO_STACK_CLASS_MAX_LOG2 - CORO_STACK_CLASS_MIN_LOG2 + 1,
+	/** The huge page arenas of the stacks are mapped by this much. */
+	CORO_STACK_ARENA_SIZE = 16 * HUGEMEM_PAGE_SIZE,
+};
 
-static struct coro_engine glob_engine;
+/** Default stack size when nothing else is specified. */
+static const size_t CORO_STACK_SIZE_DEFAULT = 1024 * 1024;
 
-void
-coro_sched_init(void)
+/**
+ * Coroutine stack. It is mapped with a single inaccessible guard
+ * page in its lowest address, so an overflow crashes right away
+ * instead of silently corrupting other memory. The rest of the
+ * mapping is committed lazily by the kernel as the stack grows.
+ * The stacks on huge pages are cut from a bigger mapping without
+ * the guards, see CORO_STACK_HUGE_PAGES.
+ */
+struct coro_stack {
+	/** Start of the mapping, including the guard page if any. */
+	void *map;
+	/** Size of the whole mapping. */
+	size_t map_size;
+	/** Usable stack memory, right above the guard page if any. */
+	void *base;
+	/** Size of the usable stack memory. */
+	size_t size;
+	/** Index of the size class the stack belongs to. */
+	int size_class;
+	/**
+	 * The stack is pooled and its deep pages are given back to
+	 * the kernel.
+	 */
+	bool is_trimmed;
+	/**
+	 * How many bytes of the stack might be resident in physical
+	 * memory. Only the kept part, if the stack is trimmed.
+	 */
+	size_t resident_size;
+};
+
+static size_t
+coro_page_size(void)
 {
-	coro_engine_create(&glob_engine);
+	static size_t page_size = 0;
+	if (page_size == 0)
+		page_size = sysconf(_SC_PAGESIZE);
+	return page_size;
 }
 
-void
-coro_sched_run(void)
+/** Find the size class of a stack which can fit @a size bytes. */
+static int
+coro_stack_size_class(size_t size)
 {
-	coro_engine_run(&glob_engine);
+	if (size < SIGSTKSZ)
+		size = SIGSTKSZ;
+	int size_class = 0;
+	while (size_class < CORO_STACK_CLASS_COUNT - 1 &&
+	       ((size_t)1 << (CORO_STACK_CLASS_MIN_LOG2 + size_class)) < size)
+		++size_class;
+	return size_class;
 }
 
-void
-coro_sched_destroy(void)
+/** Size of the mapping of one stack of the class, with the guard. */
+static size_t
+coro_stack_map_size(int size_class)
 {
-	coro_engine_destroy(&glob_engine);
+	assert(size_class >= 0 && size_class < CORO_STACK_CLASS_COUNT);
+	return ((size_t)1 << (CORO_STACK_CLASS_MIN_LOG2 + size_class)) +
+		coro_page_size();
 }
 
-struct coro *
-coro_this(void)
+/**
+ * Map memory for stacks. The guard pages are set up separately.
+ * @a flags are of coro_sched_set_stack_memory().
+ */
+static void *
+coro_stack_map(size_t size, int flags)
 {
-	return glob_engine.this;
+	int map_flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_NORESERVE
+	map_flags |= MAP_NORESERVE;
+#endif
+#ifdef MAP_STACK
+	map_flags |= MAP_STACK;
+#endif
+	void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, map_flags, -1, 0);
+	if (map == MAP_FAILED)
+		handle_error();
+	if ((flags & CORO_STACK_NODE_LOCAL) != 0)
+		hugemem_bind_local(map, size);
+	return map;
 }
 
-struct coro *
-coro_new(coro_f func, void *func_arg)
+/**
+ * Make a stack out of @a map of coro_stack_map_size() bytes. The
+ * lowest page is the guard, or just a gap between the stacks if not
+ * @a is_guarded. The stack owns the memory then, even if it is a
+ * part of a bigger mapping.
+ */
+static void
+coro_stack_init(struct coro_stack *stack, void *map, int size_class,
+		bool is_guarded)
 {
-	return coro_engine_spawn(&glob_engine, func, func_arg);
+	size_t page_size = coro_page_size();
+	stack->map = map;
+	stack->map_size = coro_stack_map_size(size_class);
+	stack->size_class = size_class;
+	stack->size = stack->map_size - page_size;
+	if (is_guarded && mprotect(stack->map, page_size, PROT_NONE) != 0)
+		handle_error();
+	stack->base = (char *)stack->map + page_size;
+	stack->is_trimmed = false;
+	stack->resident_size = stack->size;
 }
 
-void *
-coro_join(struct coro *coro)
+static void
+coro_stack_create(struct coro_stack *stack, int size_class, int flags)
 {
-	return coro_engine_join(&glob_engine, coro);
+	size_t map_size = coro_stack_map_size(size_class);
+	coro_stack_init(stack, coro_stack_map(map_size, flags), size_class,
+			true);
 }
 
-void
-coro_suspend(void)
+/**
+ * Give the physical pages of the stack back to the kernel, except
+ * for the top @a keep_size bytes. These hold the frames of the
+ * suspended coroutine and are the hottest ones when it is reused.
+ * The trimmed pages read as zeros when touched again.
+ */
+static void
+coro_stack_trim(struct coro_stack *stack, size_t keep_size)
 {
-	coro_engine_suspend(&glob_engine);
+	size_t page_size = coro_page_size();
+	keep_size = (keep_size + page_size - 1) & ~(page_size - 1);
+	stack->is_trimmed = true;
+	if (keep_size >= stack->size)
+		return;
+	stack->resident_size = keep_size;
+	/* The base of a stack on huge pages is not page aligned. */
+	uintptr_t begin = (uintptr_t)stack->base & ~(page_size - 1);
+	uintptr_t end = ((uintptr_t)stack->base + stack->size - keep_size) &
+			~(page_size - 1);
+	if (madvise((void *)begin, end - begin, MADV_DONTNEED) != 0)
+		handle_error();
 }
 
-void
-coro_yield(void)
+static void
+coro_stack_destroy(struct coro_stack *stack)
 {
-	coro_engine_yield(&glob_engine);
+	if (munmap(stack->map, stack->map_size) != 0)
+		handle_error();
+	stack->map = NULL;
+	stack->base = NULL;
 }
 
-void
-coro_wakeup(struct coro *coro)
+//////////////////////////////////////////////////////////////////
+// Timers.
+//
+// Hierarchical timer wheel with 1ms ticks. Level L has 64 slots,
+// each covering 64^L ticks. A timer is put into the lowest level
+// which can fit its distance from now. When the level 0 wraps, the
+// next slot of the level 1 is cascaded down, and so on. Adding,
+// removal and expiration are O(1).
+//////////////////////////////////////////////////////////////////
+
+enum {
+	CORO_TIMER_LEVEL_BITS = 6,
+	CORO_TIMER_SLOT_COUNT = 1 << CORO_TIMER_LEVEL_BITS,
+	CORO_TIMER_SLOT_MASK = CORO_TIMER_SLOT_COUNT - 1,
+	CORO_TIMER_LEVEL_COUNT = 4,
+	CORO_TIMER_NS_PER_TICK = 1000000,
+};
+
+/**
+ * A timer. Lives in the frame of the coroutine waiting for it, so
+ * there are no allocations.
+ */
+struct coro_timer {
+	/** Link in a wheel slot. */
+	struct rlist link;
+	/** Tick when the timer expires. */
+	uint64_t expire_tick;
+	/** Coroutine to wakeup. */
+	struct coro *coro;
+	/** The timer has expired and woken the coroutine up. */
+	bool is_fired;
+};
+
+struct coro_timer_wheel {
+	struct rlist slots[CORO_TIMER_LEVEL_COUNT][CORO_TIMER_SLOT_COUNT];
+	/** Next tick to process. */
+	uint64_t tick;
+	/** Number of timers in the wheel. */
+	size_t count;
+};
+
+static uint64_t
+coro_clock_ns(void)
 {
-	coro_engine_wakeup(&glob_engine, coro);
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t
+coro_clock_tick(void)
+{
+	return coro_clock_ns() / CORO_TIMER_NS_PER_TICK;
+}
+
+static void
+coro_timer_wheel_create(struct coro_timer_wheel *wheel)
+{
+	for (int l = 0; l < CORO_TIMER_LEVEL_COUNT; ++l) {
+		for (int i = 0; i < CORO_TIMER_SLOT_COUNT; ++i)
+			rlist_create(&wheel->slots[l][i]);
+	}
+	wheel->tick = coro_clock_tick();
+	wheel->count = 0;
+}
+
+static void
+coro_timer_wheel_destroy(struct coro_timer_wheel *wheel)
+{
+	assert(wheel->count == 0);
+	(void)wheel;
+}
+
+/** Put the timer into the slot matching its distance from now. */
+static void
+coro_timer_wheel_link(struct coro_timer_wheel *wheel, struct coro_timer *t)
+{
+	uint64_t expire = t->expire_tick;
+	if (expire < wheel->tick)
+		expire = wheel->tick;
+	uint64_t delta = expire - wheel->tick;
+	int level = 0;
+	while (level < CORO_TIMER_LEVEL_COUNT - 1 &&
+	       delta >= (uint64_t)1 << ((level + 1) * CORO_TIMER_LEVEL_BITS))
+		++level;
+	if (level == CORO_TIMER_LEVEL_COUNT - 1) {
+		/*
+		 * Too far timers wait in the last level and are
+		 * re-linked on each of its cascades until close
+		 * enough.
+		 */
+		uint64_t max_delta = ((uint64_t)1 <<
+			(CORO_TIMER_LEVEL_COUNT * CORO_TIMER_LEVEL_BITS)) - 1;
+		if (delta > max_delta)
+			expire = wheel->tick + max_delta;
+	}
+	int idx = (expire >> (level * CORO_TIMER_LEVEL_BITS)) &
+		CORO_TIMER_SLOT_MASK;
+	rlist_add_tail_entry(&wheel->slots[level][idx], t, link);
+}
+
+static void
+coro_timer_wheel_add(struct coro_timer_wheel *wheel, struct coro_timer *t)
+{
+	if (wheel->count == 0)
+		wheel->tick = coro_clock_tick();
+	++wheel->count;
+	coro_timer_wheel_link(wheel, t);
+}
+
+static void
+coro_timer_wheel_del(struct coro_timer_wheel *wheel, struct coro_timer *t)
+{
+	assert(wheel->count > 0);
+	--wheel->count;
+	rlist_del_entry(t, link);
+}
+
+/**
+ * Re-link the timers of the given slot of the given level. They
+ * go to the lower levels as they get closer.
+ */
+static void
+coro_timer_wheel_cascade(struct coro_timer_wheel *wheel, int level, int idx)
+{
+	struct rlist list;
+	rlist_create(&list);
+	rlist_splice(&list, &wheel->slots[level][idx]);
+	while (!rlist_empty(&list)) {
+		struct coro_timer *t = rlist_shift_entry(&list,
+			struct coro_timer, link);
+		coro_timer_wheel_link(wheel, t);
+	}
+}
+
+/**
+ * Move the wheel up to the given tick and move the expired timers
+ * into @a out.
+ */
+static void
+coro_timer_wheel_advance(struct coro_timer_wheel *wheel, uint64_t now,
+	struct rlist *out)
+{
+	while (wheel->tick <= now) {
+		if (wheel->count == 0) {
+			wheel->tick = now + 1;
+			return;
+		}
+		uint64_t tick = wheel->tick;
+		int idx = tick & CORO_TIMER_SLOT_MASK;
+		for (int l = 1; l < CORO_TIMER_LEVEL_COUNT &&
+		     ((tick >> ((l - 1) * CORO_TIMER_LEVEL_BITS)) &
+		      CORO_TIMER_SLOT_MASK) == 0; ++l) {
+			coro_timer_wheel_cascade(wheel, l,
+				(tick >> (l * CORO_TIMER_LEVEL_BITS)) &
+				CORO_TIMER_SLOT_MASK);
+		}
+		struct rlist *slot = &wheel->slots[0][idx];
+		while (!rlist_empty(slot)) {
+			struct coro_timer *t = rlist_shift_entry(slot,
+				struct coro_timer, link);
+			--wheel->count;
+			rlist_add_tail_entry(out, t, link);
+		}
+		++wheel->tick;
+	}
+}
+
+/**
+ * The earliest tick when something can expire. It is exact for
+ * the close timers and a lower bound for the ones waiting for a
+ * cascade.
+ */
+static uint64_t
+coro_timer_wheel_next_tick(const struct coro_timer_wheel *wheel)
+{
+	assert(wheel->count > 0);
+	uint64_t res = UINT64_MAX;
+	for (int l = 0; l < CORO_TIMER_LEVEL_COUNT; ++l) {
+		int shift = l * CORO_TIMER_LEVEL_BITS;
+		/* First tick of this level's granularity to check. */
+		uint64_t unit = (uint64_t)1 << shift;
+		uint64_t first = (wheel->tick + unit - 1) & ~(unit - 1);
+		for (int i = 0; i < CORO_TIMER_SLOT_COUNT; ++i) {
+			uint64_t tick = first + i * unit;
+			if (tick >= res)
+				break;
+			int idx = (tick >> shift) & CORO_TIMER_SLOT_MASK;
+			if (!rlist_empty(&wheel->slots[l][idx])) {
+				res = tick;
+				break;
+			}
+		}
+	}
+	assert(res != UINT64_MAX);
+	return res;
+}
+
+//////////////////////////////////////////////////////////////////
+// Reactor.
+//
+// Each engine lazily creates an epoll instance. A coroutine waiting
+// for a descriptor registers it as one-shot with a pointer to the
+// wait object in its frame, and suspends. The scheduler polls the
+// instance once per iteration without blocking while there is
+// runnable work, and blocks otherwise.
+//////////////////////////////////////////////////////////////////
+
+#if defined(__linux__)
+#define CORO_HAVE_EPOLL 1
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#else
+#define CORO_HAVE_EPOLL 0
+#endif
+
+enum {
+	/** How many events are fetched by one poll. */
+	CORO_POLL_BATCH = 64,
+};
+
+/**
+ * A coroutine waiting for a descriptor. Lives in its frame. It is
+ * a one-shot watch which wakes the coroutine up.
+ */
+struct coro_fd_wait {
+	struct coro_fd_watch watch;
+	/** Coroutine to wakeup. */
+	struct coro *coro;
+	/** Happened CORO_EVENT_* flags. */
+	int revents;
+};
+
+enum coro_state {
+	CORO_STATE_RUNNING,
+	/**
+	 * Only in the multi-threaded mode. The coroutine is being
+	 * suspended, but is still on its stack. It can't be resumed
+	 * until its worker finishes the switch.
+	 */
+	CORO_STATE_SUSPENDING,
+	CORO_STATE_SUSPENDED,
+	CORO_STATE_FINISHED,
+};
+
+/** Main coroutine structure, its context. */
+struct coro {
+	/** Coroutine state. */
+	enum coro_state state;
+	/** Coroutine-local values, indexed by coro_key_t. */
+	void *specific[CORO_KEY_MAX];
+	/** Bit per key with a value set, to run the destructors. */
+	uint32_t specific_mask;
+	/** A value, returned by func. */
+	void *ret;
+	/** Stack, used by the coroutine. */
+	struct coro_stack stack;
+	/** An argument for the function func. */
+	void *func_arg;
+	/** A function to call as a coroutine. */
+	coro_f func;
+	/** Last remembered coroutine context. */
+	struct coro_ctx ctx;
+	/**
+	 * Coroutine which is trying to join this one right now.
+	 */
+	struct coro *joiner;
+	/** Links in a coroutine list, used by the scheduler. */
+	struct rlist link;
+	/**
+	 * Protects the state, the joiner and the wakeup flag in the
+	 * multi-threaded mode.
+	 */
+	atomic_flag lock;
+	/**
+	 * Only in the multi-threaded mode. The coroutine was woken
+	 * up while running, so its next suspension returns right
+	 * away. Otherwise a wakeup coming from another thread between
+	 * checking a condition and suspending would be lost.
+	 */
+	bool is_wakeup_pending;
+	/** Scheduling priority. */
+	enum coro_priority prio;
+	/** The coroutine is in one of the coros_running_next lists. */
+	bool is_in_next;
+	/** Slab the coroutine was allocated from, or NULL. */
+	struct coro_slab *slab;
+	/** Next in the remote wakeups of its engine. */
+	struct coro *remote_next;
+	/**
+	 * The coroutine is in the remote wakeups of its engine, or is
+	 * being pushed there, see coro_wakeup_remote().
+	 */
+	atomic_bool is_remote_woken;
+#if CORO_PROFILE
+	/** Profile counters. */
+	struct coro_prof prof;
+	/** Link in the list of all the coroutines. */
+	struct rlist in_all;
+#endif
+#if CORO_STACK_PROFILE
+	/** Function of the last finished run, not accounted yet. */
+	coro_f stack_prof_func;
+	/** Stack bytes used by that run. */
+	size_t stack_prof_used;
+#endif
+};
+
+enum {
+	/**
+	 * Base number of coroutines of one priority taken into an
+	 * iteration of the scheduler. Multiplied by the priority
+	 * weight.
+	 */
+	CORO_SCHED_BATCH = 64,
+};
+
+/**
+ * Weights of the priorities. A scheduler iteration takes up to
+ * weight * CORO_SCHED_BATCH runnable coroutines of each priority,
+ * the more important ones first. So the latency-critical
+ * coroutines don't wait behind a flood of others, and the others
+ * still make progress every iteration.
+ */
+static const int coro_prio_weights[CORO_PRIO_COUNT] = {4, 2, 1};
+
+/**
+ * Coroutine objects allocated together by coro_new_batch(). The
+ * slab is freed with the last of them.
+ */
+struct coro_slab {
+	atomic_size_t ref_count;
+	struct coro coros[];
+};
+
+struct coro_worker;
+
+struct coro_engine {
+	/**
+	 * Scheduler is the main coroutine - it represents the
+	 * context in which the scheduler itself runs.
+	 */
+	struct coro sched;
+	/** Which coroutine works at this moment. */
+	struct coro *this;
+
+	/**
+	 * Coroutines to run in this iteration of the loop. The
+	 * list gets populated once at the start of the iteration.
+	 */
+	struct rlist coros_running_now;
+	/**
+	 * Coroutines to run in the next iterations of the loop,
+	 * one list per priority. The lists get populated by
+	 * wakeups and yields and new coros.
+	 */
+	struct rlist coros_running_next[CORO_PRIO_COUNT];
+	/** Per-priority statistics. */
+	struct coro_prio_stats prio_stats[CORO_PRIO_COUNT];
+	/**
+	 * Joined coroutines to be reused. One list per stack size
+	 * class.
+	 */
+	struct rlist coros_pool[CORO_STACK_CLASS_COUNT];
+	/** Total number of coroutines, including the pool. */
+	size_t coro_count;
+	/** Stack size for coroutines created without attributes. */
+	size_t stack_size;
+	/** Flags of coro_sched_set_stack_memory(). */
+	int stack_flags;
+	/**
+	 * Not yet used part of the huge page arena of the stacks. The
+	 * used parts are owned by their stacks.
+	 */
+	char *stack_arena;
+	size_t stack_arena_size;
+	/** Number of the stacks cut from the arenas, for their colours. */
+	size_t stack_colour;
+	/** Limits of the pool of the joined coroutines. */
+	struct coro_pool_policy pool_policy;
+	/** Number of coroutines in the pool. */
+	size_t pool_count;
+	/**
+	 * Stack bytes of the pooled coroutines which might be
+	 * resident in physical memory. Trimmed stacks are
+	 * accounted only by their kept part.
+	 */
+	size_t pool_resident_size;
+	/** Pool usage statistics. */
+	struct coro_pool_stats pool_stats;
+	/**
+	 * Worker thread owning the engine in the multi-threaded
+	 * mode. NULL in the default single-threaded mode.
+	 */
+	struct coro_worker *worker;
+	/** Timers of the suspended coroutines. */
+	struct coro_timer_wheel timers;
+	/** Epoll instance of the reactor. -1 until first needed. */
+	int poll_fd;
+	/** Number of coroutines waiting for descriptors. */
+	size_t fd_wait_count;
+	/** Number of started descriptor watches. */
+	size_t fd_watch_count;
+	/**
+	 * Coroutines woken up by the other threads, a lock-free stack
+	 * linked by remote_next. Drained by the engine each iteration.
+	 */
+	_Atomic(struct coro *) remote_wakeups;
+	/**
+	 * Number of coroutines waiting for the remote wakeups, see
+	 * coro_remote_wait_begin(). Only the engine's thread touches
+	 * it.
+	 */
+	size_t remote_wait_count;
+	/**
+	 * Watch of the eventfd interrupting a sleep of the engine, its
+	 * fd is -1 until the first remote wait.
+	 */
+	struct coro_fd_watch remote_watch;
+	/** The engine sleeps, the remote wakeups must signal it. */
+	atomic_bool is_remote_armed;
+#if CORO_PROFILE
+	/** When the current coroutine got the CPU. */
+	uint64_t prof_slice_start;
+#endif
+};
+
+static struct coro_engine glob_engine;
+/** Thread which has initialized the global engine and runs it. */
+static pthread_t glob_engine_thread;
+/** Engine hosted by the current thread, see coro_sched_thread_init(). */
+static __thread struct coro_engine *this_engine = NULL;
+
+/**
+ * Engine of the current thread outside of the multi-threaded mode:
+ * its own one if it has it, or the global one.
+ */
+static inline struct coro_engine *
+coro_engine_local(void)
+{
+	struct coro_engine *e = this_engine;
+	return e != NULL ? e : &glob_engine;
+}
+
+static struct coro_engine *
+coro_engine_this(void);
+
+static void
+coro_on_resume(struct coro *c);
+
+//////////////////////////////////////////////////////////////////
+// Profiling.
+//////////////////////////////////////////////////////////////////
+
+#if CORO_PROFILE
+
+/**
+ * All the coroutines which are not pooled. A global list, because
+ * in the multi-threaded mode coroutines are created and freed by
+ * different workers.
+ */
+static struct rlist coro_prof_all = RLIST_HEAD_INITIALIZER(coro_prof_all);
+static pthread_mutex_t coro_prof_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+coro_prof_attach(struct coro *c)
+{
+	memset(&c->prof, 0, sizeof(c->prof));
+	pthread_mutex_lock(&coro_prof_mutex);
+	rlist_add_tail_entry(&coro_prof_all, c, in_all);
+	pthread_mutex_unlock(&coro_prof_mutex);
+}
+
+static void
+coro_prof_detach(struct coro *c)
+{
+	pthread_mutex_lock(&coro_prof_mutex);
+	rlist_del_entry(c, in_all);
+	pthread_mutex_unlock(&coro_prof_mutex);
+}
+
+/** Account the slice of @a c, which started at @a start. */
+static inline void
+coro_prof_account(struct coro *c, uint64_t start, uint64_t end)
+{
+	uint64_t slice = end - start;
+	c->prof.run_time_ns += slice;
+	if (slice > c->prof.max_slice_ns)
+		c->prof.max_slice_ns = slice;
+}
+
+/** The engine switches from @a from to @a to. */
+static inline void
+coro_prof_switch(struct coro_engine *engine, struct coro *from,
+	struct coro *to)
+{
+	uint64_t now = coro_clock_ns();
+	if (from != &engine->sched)
+		coro_prof_account(from, engine->prof_slice_start, now);
+	if (to != &engine->sched)
+		++to->prof.switch_count;
+	engine->prof_slice_start = now;
+}
+
+static inline void
+coro_prof_wakeup(struct coro *c)
+{
+	++c->prof.wakeup_count;
+}
+
+#else /* !CORO_PROFILE */
+
+static inline void
+coro_prof_attach(struct coro *c)
+{
+	(void)c;
+}
+
+static inline void
+coro_prof_detach(struct coro *c)
+{
+	(void)c;
+}
+
+static inline void
+coro_prof_switch(struct coro_engine *engine, struct coro *from,
+	struct coro *to)
+{
+	(void)engine;
+	(void)from;
+	(void)to;
+}
+
+static inline void
+coro_prof_wakeup(struct coro *c)
+{
+	(void)c;
+}
+
+#endif /* !CORO_PROFILE */
+
+//////////////////////////////////////////////////////////////////
+// Stack profiling.
+//
+// Zero is the paint of the stacks. A new mapping and the trimmed
+// pages read as zeros for free, without becoming resident. When a
+// coroutine function returns, the lowest non-zero word of the
+// stack is as deep as it has gone. Then the coroutine zeroes what
+// it has touched, on its own stack, so a pooled stack is painted
+// again for the next function. The measurement is accounted when
+// the coroutine is joined, on the joiner's stack.
+//////////////////////////////////////////////////////////////////
+
+#if CORO_STACK_PROFILE
+
+enum {
+	/** Pages checked by one mincore(). */
+	CORO_STACK_PROF_PAGE_BATCH = 64,
+	/**
+	 * Bytes right below the measuring frame, which are used by
+	 * the measurement itself and are not zeroed. The usage can be
+	 * over-estimated by that much.
+	 */
+	CORO_STACK_PROF_MARGIN = 1024,
+};
+
+/** Usage per function. They are few, so it is an array. */
+static struct coro_stack_prof *coro_stack_profs = NULL;
+static size_t coro_stack_prof_count = 0;
+static size_t coro_stack_prof_capacity = 0;
+static pthread_mutex_t coro_stack_prof_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Find the lowest non-zero word in [@a begin, @a end), or return
+ * @a end. @a begin is page aligned. The pages which are not
+ * resident were never touched, and are skipped without reading.
+ */
+static char *
+coro_stack_find_deepest(char *begin, char *end)
+{
+	size_t page_size = coro_page_size();
+	unsigned char vec[CORO_STACK_PROF_PAGE_BATCH];
+	char *page = begin;
+	while (page < end) {
+		size_t count = (end - page + page_size - 1) / page_size;
+		if (count > CORO_STACK_PROF_PAGE_BATCH)
+			count = CORO_STACK_PROF_PAGE_BATCH;
+		if (mincore(page, count * page_size, vec) != 0)
+			handle_error();
+		for (size_t i = 0; i < count; ++i, page += page_size) {
+			if ((vec[i] & 1) == 0)
+				continue;
+			uintptr_t *word = (uintptr_t *)page;
+			char *stop = page + page_size < end ?
+				page + page_size : end;
+			for (; (char *)word < stop; ++word) {
+				if (*word != 0)
+					return (char *)word;
+			}
+		}
+	}
+	return end;
+}
+
+/**
+ * Called by the coroutine right after its function has returned.
+ * Must not be inlined, so its frame and the ones of the functions
+ * it calls stay within the margin.
+ */
+static __attribute__((noinline)) void
+coro_stack_prof_measure(struct coro *c, coro_f func)
+{
+	char *begin = c->stack.base;
+	char *end = (char *)__builtin_frame_address(0) -
+		CORO_STACK_PROF_MARGIN;
+	char *deepest = coro_stack_find_deepest(begin, end);
+	c->stack_prof_func = func;
+	c->stack_prof_used = begin + c->stack.size - deepest;
+	if (deepest < end)
+		memset(deepest, 0, end - deepest);
+}
+
+/** Account the last run of a joined coroutine. */
+static void
+coro_stack_prof_account(struct coro *c)
+{
+	size_t used = c->stack_prof_used;
+	int bucket = 0;
+	while (bucket < CORO_STACK_PROF_BUCKET_COUNT - 1 &&
+	       ((size_t)1 << (CORO_STACK_PROF_MIN_LOG2 + bucket)) < used)
+		++bucket;
+	pthread_mutex_lock(&coro_stack_prof_mutex);
+	struct coro_stack_prof *prof = NULL;
+	for (size_t i = 0; i < coro_stack_prof_count && prof == NULL; ++i) {
+		if (coro_stack_profs[i].func == c->stack_prof_func)
+			prof = &coro_stack_profs[i];
+	}
+	if (prof == NULL) {
+		if (coro_stack_prof_count == coro_stack_prof_capacity) {
+			coro_stack_prof_capacity = coro_stack_prof_capacity == 0 ?
+				16 : coro_stack_prof_capacity * 2;
+			coro_stack_profs = realloc(coro_stack_profs,
+				coro_stack_prof_capacity * sizeof(*prof));
+			if (coro_stack_profs == NULL)
+				handle_error();
+		}
+		prof = &coro_stack_profs[coro_stack_prof_count++];
+		memset(prof, 0, sizeof(*prof));
+		prof->func = c->stack_prof_func;
+	}
+	++prof->run_count;
+	++prof->hist[bucket];
+	if (used > prof->max_used)
+		prof->max_used = used;
+	if (c->stack.size > prof->max_stack_size)
+		prof->max_stack_size = c->stack.size;
+	pthread_mutex_unlock(&coro_stack_prof_mutex);
+}
+
+#else /* !CORO_STACK_PROFILE */
+
+static inline void
+coro_stack_prof_measure(struct coro *c, coro_f func)
+{
+	(void)c;
+	(void)func;
+}
+
+static inline void
+coro_stack_prof_account(struct coro *c)
+{
+	(void)c;
+}
+
+#endif /* !CORO_STACK_PROFILE */
+
+//////////////////////////////////////////////////////////////////
+
+static void
+coro_engine_create(struct coro_engine *engine)
+{
+	memset(engine, 0, sizeof(*engine));
+	rlist_create(&engine->sched.link);
+	rlist_create(&engine->coros_running_now);
+	for (int i = 0; i < CORO_PRIO_COUNT; ++i)
+		rlist_create(&engine->coros_running_next[i]);
+	for (int i = 0; i < CORO_STACK_CLASS_COUNT; ++i)
+		rlist_create(&engine->coros_pool[i]);
+	engine->stack_size = CORO_STACK_SIZE_DEFAULT;
+	coro_pool_policy_create(&engine->pool_policy);
+	coro_timer_wheel_create(&engine->timers);
+	engine->poll_fd = -1;
+	atomic_init(&engine->remote_wakeups, NULL);
+	engine->remote_watch.fd = -1;
+	atomic_init(&engine->is_remote_armed, false);
+}
+
+/** Free a coroutine and its stack. It must not be in any list. */
+static void
+coro_engine_free_coro(struct coro_engine *engine, struct coro *c)
+{
+	assert(rlist_empty(&c->link));
+	coro_prof_detach(c);
+	coro_stack_destroy(&c->stack);
+	if (c->slab == NULL)
+		free(c);
+	else if (atomic_fetch_sub(&c->slab->ref_count, 1) == 1)
+		free(c->slab);
+	assert(engine->coro_count > 0);
+	--engine->coro_count;
+}
+
+/** Take a coroutine out of the pool to run it or free. */
+static void
+coro_engine_pool_take(struct coro_engine *engine, struct coro *c)
+{
+	size_t size = c->stack.resident_size;
+	assert(engine->pool_count > 0);
+	assert(engine->pool_resident_size >= size);
+	rlist_del_entry(c, link);
+	--engine->pool_count;
+	engine->pool_resident_size -= size;
+	c->stack.is_trimmed = false;
+	c->stack.resident_size = c->stack.size;
+}
+
+/** Trim the pooled stacks until they fit into the resident limit. */
+static void
+coro_engine_pool_trim(struct coro_engine *engine, struct coro *c)
+{
+	const struct coro_pool_policy *policy = &engine->pool_policy;
+	if (engine->pool_resident_size <= policy->max_resident_size)
+		return;
+	if (c->stack.is_trimmed)
+		return;
+	size_t old_size = c->stack.resident_size;
+	coro_stack_trim(&c->stack, policy->trim_keep_size);
+	engine->pool_resident_size -= old_size - c->stack.resident_size;
+	++engine->pool_stats.trim_count;
+}
+
+/**
+ * Put a joined coroutine into the pool or free it if the pool is
+ * full.
+ */
+static void
+coro_engine_pool_put(struct coro_engine *engine, struct coro *c)
+{
+	assert(rlist_empty(&c->link));
+	coro_prof_detach(c);
+	coro_stack_prof_account(c);
+	if (engine->pool_count >= engine->pool_policy.max_count) {
+		coro_engine_free_coro(engine, c);
+		++engine->pool_stats.free_count;
+		return;
+	}
+	/*
+	 * Most recently used coroutines go first, their stacks
+	 * are most likely still in the CPU caches.
+	 */
+	rlist_add_entry(&engine->coros_pool[c->stack.size_class], c, link);
+	++engine->pool_count;
+	engine->pool_resident_size += c->stack.resident_size;
+	coro_engine_pool_trim(engine, c);
+}
+
+/** Make the existing pool satisfy the current policy. */
+static void
+coro_engine_pool_apply_policy(struct coro_engine *engine)
+{
+	const struct coro_pool_policy *policy = &engine->pool_policy;
+	/*
+	 * Free the least recently used coroutines, starting with
+	 * the biggest stacks.
+	 */
+	for (int i = CORO_STACK_CLASS_COUNT - 1; i >= 0; --i) {
+		struct rlist *pool = &engine->coros_pool[i];
+		while (engine->pool_count > policy->max_count &&
+		       !rlist_empty(pool)) {
+			struct coro *c = rlist_last_entry(pool,
+				struct coro, link);
+			coro_engine_pool_take(engine, c);
+			coro_engine_free_coro(engine, c);
+			++engine->pool_stats.free_count;
+		}
+	}
+	for (int i = CORO_STACK_CLASS_COUNT - 1; i >= 0; --i) {
+		struct coro *c;
+		rlist_foreach_entry_reverse(c, &engine->coros_pool[i], link) {
+			if (engine->pool_resident_size <=
+			    policy->max_resident_size)
+				return;
+			coro_engine_pool_trim(engine, c);
+		}
+	}
+}
+
+/**
+ * Move all the pooled coroutines of @a src into @a dst, so @a src
+ * doesn't own any coroutines anymore.
+ */
+static void
+coro_engine_merge(struct coro_engine *dst, struct coro_engine *src)
+{
+	for (int i = 0; i < CORO_STACK_CLASS_COUNT; ++i)
+		rlist_splice_tail(&dst->coros_pool[i], &src->coros_pool[i]);
+	dst->pool_count += src->pool_count;
+	dst->pool_resident_size += src->pool_resident_size;
+	/*
+	 * Coroutines migrate between the engines, so in each one
+	 * alone the count can wrap around. But the sum is correct.
+	 */
+	dst->coro_count += src->coro_count;
+	dst->pool_stats.hit_count += src->pool_stats.hit_count;
+	dst->pool_stats.miss_count += src->pool_stats.miss_count;
+	dst->pool_stats.trim_count += src->pool_stats.trim_count;
+	dst->pool_stats.free_count += src->pool_stats.free_count;
+	src->pool_count = 0;
+	src->pool_resident_size = 0;
+	src->coro_count = 0;
+	coro_engine_pool_apply_policy(dst);
+}
+
+/** Check if any coroutines wait for the next iterations. */
+static bool
+coro_engine_has_next(const struct coro_engine *engine)
+{
+	for (int i = 0; i < CORO_PRIO_COUNT; ++i) {
+		if (!rlist_empty(&engine->coros_running_next[i]))
+			return true;
+	}
+	return false;
+}
+
+/** Queue a runnable coroutine for the next iterations. */
+static void
+coro_engine_push_next(struct coro_engine *engine, struct coro *c)
+{
+	assert(rlist_empty(&c->link));
+	struct coro_prio_stats *stats = &engine->prio_stats[c->prio];
+	rlist_add_tail_entry(&engine->coros_running_next[c->prio], c, link);
+	c->is_in_next = true;
+	if (++stats->runnable_count > stats->max_runnable_count)
+		stats->max_runnable_count = stats->runnable_count;
+}
+
+/** Take the next iteration's share of each priority into it. */
+static void
+coro_engine_fill_now(struct coro_engine *engine)
+{
+	assert(rlist_empty(&engine->coros_running_now));
+	for (int i = 0; i < CORO_PRIO_COUNT; ++i) {
+		struct rlist *next = &engine->coros_running_next[i];
+		int quota = coro_prio_weights[i] * CORO_SCHED_BATCH;
+		/* Unmark the share, then move it in one go. */
+		struct rlist *first = rlist_first(next);
+		struct rlist *last = next;
+		while (quota-- > 0 && rlist_next(last) != next) {
+			last = rlist_next(last);
+			rlist_entry(last, struct coro, link)->is_in_next = false;
+		}
+		if (last != next) {
+			rlist_splice_range_tail(&engine->coros_running_now,
+				first, last);
+		}
+	}
+}
+
+/** Name of the coroutine's slices in the trace. */
+static inline const char *
+coro_trace_name(const struct coro_engine *engine, const struct coro *c)
+{
+	return c == &engine->sched ? "coro_sched" : "coro";
+}
+
+static void
+coro_engine_resume_next(struct coro_engine *engine)
+{
+	assert(!rlist_empty(&engine->coros_running_now));
+	struct coro *to = rlist_shift_entry(&engine->coros_running_now,
+		struct coro, link);
+	struct coro *from = engine->this;
+	assert(from != NULL);
+	if (to != &engine->sched) {
+		struct coro_prio_stats *stats = &engine->prio_stats[to->prio];
+		assert(stats->runnable_count > 0);
+		--stats->runnable_count;
+		++stats->switch_count;
+	}
+	coro_prof_switch(engine, from, to);
+	trace_end(coro_trace_name(engine, from), (uintptr_t)from);
+	trace_begin(coro_trace_name(engine, to), (uintptr_t)to);
+
+	engine->this = NULL;
+	coro_ctx_switch(&from->ctx, &to->ctx);
+	coro_on_resume(from);
+}
+
+static void
+coro_engine_suspend(struct coro_engine *engine)
+{
+	struct coro *this = engine->this;
+	if (this == NULL) {
+		printf("Error: deadlock - suspension with no active "
+			"coroutines\n");
+		exit(-1);
+	}
+	assert(rlist_empty(&this->link));
+	assert(this->state == CORO_STATE_RUNNING);
+	this->state = CORO_STATE_SUSPENDED;
+	coro_engine_resume_next(engine);
+}
+
+static void
+coro_engine_yield(struct coro_engine *engine)
+{
+	struct coro *this = engine->this;
+	assert(rlist_empty(&this->link));
+	assert(this->state == CORO_STATE_RUNNING);
+	coro_engine_push_next(engine, this);
+	coro_engine_resume_next(engine);
+}
+
+static void
+coro_engine_wakeup(struct coro_engine *engine, struct coro *coro)
+{
+	if (coro->state == CORO_STATE_RUNNING)
+		return;
+	if (coro->state == CORO_STATE_FINISHED)
+		return;
+	assert(coro->state == CORO_STATE_SUSPENDED);
+	assert(rlist_empty(&coro->link));
+	coro->state = CORO_STATE_RUNNING;
+	coro_prof_wakeup(coro);
+	coro_engine_push_next(engine, coro);
+}
+
+/**
+ * Wakeup several coroutines at once. They are collected per
+ * priority and spliced into the run queues in one go.
+ */
+static void
+coro_engine_wakeup_many(struct coro_engine *engine, struct coro **coros,
+	size_t count)
+{
+	struct rlist batch[CORO_PRIO_COUNT];
+	size_t batch_count[CORO_PRIO_COUNT];
+	for (int i = 0; i < CORO_PRIO_COUNT; ++i) {
+		rlist_create(&batch[i]);
+		batch_count[i] = 0;
+	}
+	for (size_t i = 0; i < count; ++i) {
+		struct coro *c = coros[i];
+		/* Already runnable or gone. Duplicates are skipped too. */
+		if (c->state != CORO_STATE_SUSPENDED)
+			continue;
+		assert(rlist_empty(&c->link));
+		c->state = CORO_STATE_RUNNING;
+		c->is_in_next = true;
+		coro_prof_wakeup(c);
+		rlist_add_tail_entry(&batch[c->prio], c, link);
+		++batch_count[c->prio];
+	}
+	for (int i = 0; i < CORO_PRIO_COUNT; ++i) {
+		if (batch_count[i] == 0)
+			continue;
+		struct coro_prio_stats *stats = &engine->prio_stats[i];
+		rlist_splice_tail(&engine->coros_running_next[i], &batch[i]);
+		stats->runnable_count += batch_count[i];
+		if (stats->runnable_count > stats->max_runnable_count)
+			stats->max_runnable_count = stats->runnable_count;
+	}
+}
+
+static bool
+coro_engine_suspend_timeout(struct coro_engine *engine, double timeout)
+{
+	struct coro_timer t;
+	t.coro = engine->this;
+	t.is_fired = false;
+	if (timeout < 0)
+		timeout = 0;
+	uint64_t now = coro_clock_ns();
+	t.expire_tick = (now + (uint64_t)(timeout * 1000000000) +
+		CORO_TIMER_NS_PER_TICK - 1) / CORO_TIMER_NS_PER_TICK;
+	coro_timer_wheel_add(&engine->timers, &t);
+	coro_engine_suspend(engine);
+	if (t.is_fired)
+		return false;
+	coro_timer_wheel_del(&engine->timers, &t);
+	return true;
+}
+
+/** Wakeup the coroutines whose timers have expired. */
+static void
+coro_engine_process_timers(struct coro_engine *engine)
+{
+	if (engine->timers.count == 0)
+		return;
+	struct rlist expired;
+	rlist_create(&expired);
+	coro_timer_wheel_advance(&engine->timers, coro_clock_tick(), &expired);
+	while (!rlist_empty(&expired)) {
+		struct coro_timer *t = rlist_shift_entry(&expired,
+			struct coro_timer, link);
+		t->is_fired = true;
+		coro_engine_wakeup(engine, t->coro);
+	}
+}
+
+#if CORO_HAVE_EPOLL
+
+/** Register the watch in the reactor. */
+static int
+coro_engine_poll_add(struct coro_engine *engine, struct coro_fd_watch *watch,
+	bool is_oneshot)
+{
+	if (engine->poll_fd < 0) {
+		engine->poll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (engine->poll_fd < 0)
+			handle_error();
+	}
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	if (is_oneshot)
+		ev.events = EPOLLONESHOT;
+	if ((watch->events & CORO_EVENT_READ) != 0)
+		ev.events |= EPOLLIN | EPOLLRDHUP;
+	if ((watch->events & CORO_EVENT_WRITE) != 0)
+		ev.events |= EPOLLOUT;
+	ev.data.ptr = watch;
+	return epoll_ctl(engine->poll_fd, EPOLL_CTL_ADD, watch->fd, &ev);
+}
+
+static void
+coro_engine_poll_del(struct coro_engine *engine, struct coro_fd_watch *watch)
+{
+	if (epoll_ctl(engine->poll_fd, EPOLL_CTL_DEL, watch->fd, NULL) != 0)
+		handle_error();
+}
+
+static void
+coro_fd_wait_f(struct coro_fd_watch *watch, int events)
+{
+	struct coro_fd_wait *w = (struct coro_fd_wait *)watch;
+	w->revents |= events;
+	coro_engine_wakeup(coro_engine_local(), w->coro);
+}
+
+static int
+coro_engine_wait_fd(struct coro_engine *engine, int fd, int events,
+	double timeout)
+{
+	struct coro_fd_wait w;
+	w.watch.func = coro_fd_wait_f;
+	w.watch.arg = NULL;
+	w.watch.fd = fd;
+	w.watch.events = events;
+	w.coro = engine->this;
+	w.revents = 0;
+	if (coro_engine_poll_add(engine, &w.watch, true) != 0)
+		return -1;
+	++engine->fd_wait_count;
+	if (timeout < 0)
+		coro_engine_suspend(engine);
+	else
+		coro_engine_suspend_timeout(engine, timeout);
+	assert(engine->fd_wait_count > 0);
+	--engine->fd_wait_count;
+	/*
+	 * One-shot only disarms the descriptor. It must be removed
+	 * before the wait object goes out of scope.
+	 */
+	coro_engine_poll_del(engine, &w.watch);
+	return w.revents;
+}
+
+static int
+coro_engine_watch_fd_start(struct coro_engine *engine,
+	struct coro_fd_watch *watch)
+{
+	if (coro_engine_poll_add(engine, watch, false) != 0)
+		return -1;
+	++engine->fd_watch_count;
+	return 0;
+}
+
+static void
+coro_engine_watch_fd_stop(struct coro_engine *engine,
+	struct coro_fd_watch *watch)
+{
+	assert(engine->fd_watch_count > 0);
+	--engine->fd_watch_count;
+	coro_engine_poll_del(engine, watch);
+}
+
+/**
+ * Wakeup the coroutines whose descriptors are ready, and call the
+ * ready watches. Blocks for up to @a timeout_ms milliseconds, -1
+ * means infinitely.
+ */
+static void
+coro_engine_poll(struct coro_engine *engine, int timeout_ms)
+{
+	struct epoll_event events[CORO_POLL_BATCH];
+	int count = epoll_wait(engine->poll_fd, events, CORO_POLL_BATCH,
+		timeout_ms);
+	if (count < 0) {
+		/* Interruption is fine, will be polled again. */
+		if (errno == EINTR)
+			return;
+		handle_error();
+	}
+	for (int i = 0; i < count; ++i) {
+		struct coro_fd_watch *w = events[i].data.ptr;
+		uint32_t e = events[i].events;
+		int revents = 0;
+		if ((e & (EPOLLERR | EPOLLHUP)) != 0) {
+			/*
+			 * Let the waiter find the error in the next
+			 * read or write.
+			 */
+			revents |= w->events;
+		}
+		if ((e & (EPOLLIN | EPOLLRDHUP)) != 0)
+			revents |= CORO_EVENT_READ;
+		if ((e & EPOLLOUT) != 0)
+			revents |= CORO_EVENT_WRITE;
+		w->func(w, revents & w->events);
+	}
+}
+
+#else /* !CORO_HAVE_EPOLL */
+
+static int
+coro_engine_wait_fd(struct coro_engine *engine, int fd, int events,
+	double timeout)
+{
+	(void)engine;
+	(void)fd;
+	(void)events;
+	(void)timeout;
+	printf("Error: waiting for descriptors is not supported on this "
+		"platform\n");
+	exit(-1);
+}
+
+static int
+coro_engine_watch_fd_start(struct coro_engine *engine,
+	struct coro_fd_watch *watch)
+{
+	(void)engine;
+	(void)watch;
+	printf("Error: watching descriptors is not supported on this "
+		"platform\n");
+	exit(-1);
+}
+
+static void
+coro_engine_watch_fd_stop(struct coro_engine *engine,
+	struct coro_fd_watch *watch)
+{
+	(void)engine;
+	(void)watch;
+	abort();
+}
+
+static void
+coro_engine_poll(struct coro_engine *engine, int timeout_ms)
+{
+	(void)engine;
+	(void)timeout_ms;
+	/* Nobody can wait for a descriptor here. */
+	abort();
+}
+
+#endif /* !CORO_HAVE_EPOLL */
+
+//////////////////////////////////////////////////////////////////
+// Remote wakeups.
+//
+// The coroutines of an engine are woken up by the other threads
+// through its remote wakeups, a lock-free stack which the wakers
+// push to and the engine drains each iteration, so the coroutine
+// states are still changed only by the engine's thread. While
+// some coroutines wait for that, the engine doesn't finish a run
+// for the lack of work. When it sleeps, the wakers interrupt it
+// through an eventfd, but only when it has armed it.
+//////////////////////////////////////////////////////////////////
+
+/** Wakeup the coroutines which the other threads have woken up. */
+static void
+coro_engine_process_remote(struct coro_engine *engine)
+{
+	if (atomic_load_explicit(&engine->remote_wakeups,
+		memory_order_relaxed) == NULL)
+		return;
+	struct coro *c = atomic_exchange_explicit(&engine->remote_wakeups,
+		NULL, memory_order_acquire);
+	/* The stack has the last wakeup first. */
+	struct coro *first = NULL;
+	while (c != NULL) {
+		struct coro *next = c->remote_next;
+		c->remote_next = first;
+		first = c;
+		c = next;
+	}
+	for (c = first; c != NULL;) {
+		/* Once the flag is cleared, the link can be reused. */
+		struct coro *next = c->remote_next;
+		atomic_store_explicit(&c->is_remote_woken, false,
+			memory_order_release);
+		coro_engine_wakeup(engine, c);
+		c = next;
+	}
+}
+
+#if CORO_HAVE_EPOLL
+
+static void
+coro_engine_remote_watch_f(struct coro_fd_watch *watch, int events)
+{
+	(void)events;
+	eventfd_t value;
+	eventfd_read(watch->fd, &value);
+}
+
+/**
+ * Create the eventfd and put it into the reactor. It is not counted
+ * as a watch, so it keeps the engine alive only while there are
+ * remote waits.
+ */
+static void
+coro_engine_remote_init(struct coro_engine *engine)
+{
+	struct coro_fd_watch *w = &engine->remote_watch;
+	w->func = coro_engine_remote_watch_f;
+	w->arg = NULL;
+	w->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	w->events = CORO_EVENT_READ;
+	if (w->fd < 0 || coro_engine_poll_add(engine, w, false) != 0)
+		handle_error();
+}
+
+static void
+coro_engine_remote_signal(struct coro_engine *engine)
+{
+	eventfd_write(engine->remote_watch.fd, 1);
+}
+
+#else /* !CORO_HAVE_EPOLL */
+
+static void
+coro_engine_remote_init(struct coro_engine *engine)
+{
+	/* Nothing to interrupt, the engine naps instead, see below. */
+	(void)engine;
+}
+
+static void
+coro_engine_remote_signal(struct coro_engine *engine)
+{
+	(void)engine;
+}
+
+#endif /* !CORO_HAVE_EPOLL */
+
+/**
+ * Ask the remote wakers to signal the engine, before it sleeps.
+ *
+ * @retval true Armed, can sleep.
+ * @retval false There are remote wakeups already, must not sleep.
+ */
+static bool
+coro_engine_remote_arm(struct coro_engine *engine)
+{
+	atomic_store_explicit(&engine->is_remote_armed, true,
+		memory_order_relaxed);
+	/* Pairs with the fence of the wakers after their push. */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&engine->remote_wakeups,
+		memory_order_relaxed) == NULL)
+		return true;
+	atomic_store_explicit(&engine->is_remote_armed, false,
+		memory_order_relaxed);
+	return false;
+}
+
+/** Push a coroutine into the remote wakeups from any thread. */
+static void
+coro_engine_push_remote(struct coro_engine *engine, struct coro *c)
+{
+	if (atomic_exchange_explicit(&c->is_remote_woken, true,
+		memory_order_acq_rel))
+		return;
+	struct coro *head = atomic_load_explicit(&engine->remote_wakeups,
+		memory_order_relaxed);
+	do {
+		c->remote_next = head;
+	} while (!atomic_compare_exchange_weak_explicit(&engine->remote_wakeups,
+		&head, c, memory_order_release, memory_order_relaxed));
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&engine->is_remote_armed,
+		memory_order_relaxed) &&
+	    atomic_exchange(&engine->is_remote_armed, false))
+		coro_engine_remote_signal(engine);
+}
+
+/** There are descriptors to poll. */
+static inline bool
+coro_engine_has_fds(const struct coro_engine *engine)
+{
+	return engine->fd_wait_count > 0 || engine->fd_watch_count > 0;
+}
+
+/**
+ * Block the thread until the closest timer expiration or a
+ * descriptor event, but not longer than @a max_delta nanoseconds.
+ */
+static void
+coro_engine_wait_events(struct coro_engine *engine, uint64_t max_delta)
+{
+	uint64_t delta = max_delta;
+	if (engine->timers.count > 0) {
+		uint64_t deadline = coro_timer_wheel_next_tick(
+			&engine->timers) * CORO_TIMER_NS_PER_TICK;
+		uint64_t now = coro_clock_ns();
+		if (deadline <= now)
+			return;
+		if (deadline - now < delta)
+			delta = deadline - now;
+	}
+	bool is_remote = engine->remote_wait_count > 0;
+	if (is_remote && !coro_engine_remote_arm(engine))
+		return;
+	if (coro_engine_has_fds(engine) || (is_remote && CORO_HAVE_EPOLL)) {
+		int timeout_ms = -1;
+		if (delta != UINT64_MAX) {
+			uint64_t ms = (delta + 999999) / 1000000;
+			timeout_ms = ms > INT32_MAX ? INT32_MAX : (int)ms;
+		}
+		coro_engine_poll(engine, timeout_ms);
+	} else {
+		/* Without the eventfd the remote wakeups are napped for. */
+		if (is_remote && delta > CORO_TIMER_NS_PER_TICK)
+			delta = CORO_TIMER_NS_PER_TICK;
+		assert(delta != UINT64_MAX);
+		struct timespec ts;
+		ts.tv_sec = delta / 1000000000;
+		ts.tv_nsec = delta % 1000000000;
+		/* Interruption is fine, the timers will be checked again. */
+		nanosleep(&ts, NULL);
+	}
+	if (is_remote) {
+		atomic_store_explicit(&engine->is_remote_armed, false,
+			memory_order_relaxed);
+	}
+}
+
+static void
+coro_engine_finish(struct coro_engine *engine, struct coro *c)
+{
+	assert(c->state == CORO_STATE_RUNNING);
+	c->state = CORO_STATE_FINISHED;
+	if (c->joiner != NULL)
+		coro_engine_wakeup(engine, c->joiner);
+	coro_engine_resume_next(engine);
+}
+
+/** Run each of the runnable coroutines once. */
+static void
+coro_engine_run_once(struct coro_engine *engine)
+{
+	assert(coro_engine_has_next(engine));
+	if (coro_engine_has_fds(engine))
+		coro_engine_poll(engine, 0);
+	coro_engine_fill_now(engine);
+
+	assert(engine->this == NULL);
+	engine->this = &engine->sched;
+	assert(rlist_empty(&engine->sched.link));
+	/*
+	 * Add the scheduler to the tail so the control comes back in
+	 * the end of this iteration of the loop.
+	 */
+	rlist_add_tail_entry(&engine->coros_running_now, &engine->sched, link);
+	coro_engine_resume_next(engine);
+	assert(rlist_empty(&engine->coros_running_now));
+	assert(engine->this == &engine->sched);
+	engine->this = NULL;
+}
+
+static void
+coro_engine_run(struct coro_engine *engine)
+{
+	while (true) {
+		coro_engine_process_timers(engine);
+		coro_engine_process_remote(engine);
+		if (!coro_engine_has_next(engine)) {
+			if (engine->timers.count == 0 &&
+			    !coro_engine_has_fds(engine) &&
+			    engine->remote_wait_count == 0)
+				break;
+			/* Nothing to do until a timer or an event. */
+			coro_engine_wait_events(engine, UINT64_MAX);
+			continue;
+		}
+		coro_engine_run_once(engine);
+	}
+}
+
+static enum coro_sched_state
+coro_engine_state(const struct coro_engine *engine)
+{
+	if (coro_engine_has_next(engine) ||
+	    atomic_load_explicit(&engine->remote_wakeups,
+		memory_order_relaxed) != NULL)
+		return CORO_SCHED_RUNNABLE;
+	if (engine->timers.count > 0 || coro_engine_has_fds(engine) ||
+	    engine->remote_wait_count > 0)
+		return CORO_SCHED_WAITING;
+	if (engine->coro_count > engine->pool_count)
+		return CORO_SCHED_SUSPENDED;
+	return CORO_SCHED_IDLE;
+}
+
+static enum coro_sched_state
+coro_engine_step(struct coro_engine *engine, uint64_t timeout)
+{
+	coro_engine_process_timers(engine);
+	coro_engine_process_remote(engine);
+	if (!coro_engine_has_next(engine)) {
+		if (timeout > 0 && (engine->timers.count > 0 ||
+				    coro_engine_has_fds(engine) ||
+				    engine->remote_wait_count > 0)) {
+			coro_engine_wait_events(engine, timeout);
+			coro_engine_process_timers(engine);
+			coro_engine_process_remote(engine);
+		} else if (coro_engine_has_fds(engine)) {
+			coro_engine_poll(engine, 0);
+		}
+	}
+	if (coro_engine_has_next(engine))
+		coro_engine_run_once(engine);
+	return coro_engine_state(engine);
+}
+
+static void
+coro_engine_destroy(struct coro_engine *engine)
+{
+	assert(engine->this == NULL);
+	assert(rlist_empty(&engine->coros_running_now));
+	assert(!coro_engine_has_next(engine));
+	for (int i = 0; i < CORO_STACK_CLASS_COUNT; ++i) {
+		struct rlist *pool = &engine->coros_pool[i];
+		while (!rlist_empty(pool)) {
+			struct coro *c = rlist_first_entry(pool,
+				struct coro, link);
+			coro_engine_pool_take(engine, c);
+			coro_engine_free_coro(engine, c);
+		}
+	}
+	assert(engine->pool_count == 0);
+	assert(engine->coro_count == 0);
+	coro_timer_wheel_destroy(&engine->timers);
+	assert(engine->fd_wait_count == 0);
+	assert(engine->fd_watch_count == 0);
+	assert(engine->remote_wait_count == 0);
+	assert(atomic_load(&engine->remote_wakeups) == NULL);
+	if (engine->remote_watch.fd >= 0)
+		close(engine->remote_watch.fd);
+	if (engine->poll_fd >= 0)
+		close(engine->poll_fd);
+	if (engine->stack_arena_size > 0 &&
+	    munmap(engine->stack_arena, engine->stack_arena_size) != 0)
+		handle_error();
+	memset(engine, '#', sizeof(*engine));
+}
+
+//////////////////////////////////////////////////////////////////
+// Multi-threaded mode.
+//
+// Each worker thread has its own engine and a Chase-Lev deque of
+// runnable coroutines. The owner pushes and takes from the bottom,
+// the others steal from the top. A coroutine always switches back
+// to its worker's scheduler context, which then finishes the
+// suspension, yield or completion. Only after that the coroutine
+// can be resumed, maybe by another worker.
+//////////////////////////////////////////////////////////////////
+
+enum {
+	CORO_CACHE_LINE_SIZE = 64,
+	CORO_DEQUE_CAPACITY_MIN = 256,
+	/**
+	 * How often a worker looks into the global queue even when
+	 * its own deque has work. Otherwise the yielded coroutines
+	 * could starve.
+	 */
+	CORO_WORKER_GLOBAL_QUEUE_PERIOD = 61,
+};
+
+struct coro_deque_array {
+	/** Capacity, a power of 2. */
+	int64_t capacity;
+	/**
+	 * Previous arrays can't be freed until the deque is gone,
+	 * because thieves might still be reading them.
+	 */
+	struct coro_deque_array *prev;
+	_Atomic(struct coro *) data[];
+};
+
+struct coro_deque {
+	/** Index of the oldest element. Thieves take from here. */
+	_Atomic int64_t top;
+	char pad1[CORO_CACHE_LINE_SIZE - sizeof(int64_t)];
+	/** Index after the newest element. Owned by the worker. */
+	_Atomic int64_t bottom;
+	char pad2[CORO_CACHE_LINE_SIZE - sizeof(int64_t)];
+	_Atomic(struct coro_deque_array *) array;
+};
+
+static struct coro_deque_array *
+coro_deque_array_new(int64_t capacity)
+{
+	struct coro_deque_array *a = malloc(sizeof(*a) +
+		capacity * sizeof(a->data[0]));
+	a->capacity = capacity;
+	a->prev = NULL;
+	return a;
+}
+
+static void
+coro_deque_create(struct coro_deque *d)
+{
+	memset(d, 0, sizeof(*d));
+	atomic_init(&d->top, 0);
+	atomic_init(&d->bottom, 0);
+	atomic_init(&d->array, coro_deque_array_new(CORO_DEQUE_CAPACITY_MIN));
+}
+
+static void
+coro_deque_destroy(struct coro_deque *d)
+{
+	assert(atomic_load(&d->top) == atomic_load(&d->bottom));
+	struct coro_deque_array *a = atomic_load(&d->array);
+	while (a != NULL) {
+		struct coro_deque_array *prev = a->prev;
+		free(a);
+		a = prev;
+	}
+}
+
+/** Approximate number of elements. Can be called by anyone. */
+static int64_t
+coro_deque_size(struct coro_deque *d)
+{
+	int64_t b = atomic_load(&d->bottom);
+	int64_t t = atomic_load(&d->top);
+	return b > t ? b - t : 0;
+}
+
+/** Push to the bottom. Only the owner can do that. */
+static void
+coro_deque_push(struct coro_deque *d, struct coro *c)
+{
+	int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+	int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+	struct coro_deque_array *a = atomic_load_explicit(&d->array,
+		memory_order_relaxed);
+	if (b - t > a->capacity - 1) {
+		struct coro_deque_array *new_a =
+			coro_deque_array_new(a->capacity * 2);
+		for (int64_t i = t; i < b; ++i) {
+			atomic_store_explicit(&new_a->data[i & (new_a->capacity - 1)],
+				atomic_load_explicit(&a->data[i & (a->capacity - 1)],
+				memory_order_relaxed), memory_order_relaxed);
+		}
+		new_a->prev = a;
+		atomic_store_explicit(&d->array, new_a, memory_order_release);
+		a = new_a;
+	}
+	atomic_store_explicit(&a->data[b & (a->capacity - 1)], c,
+		memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+}
+
+/** Take from the bottom. Only the owner can do that. */
+static struct coro *
+coro_deque_take(struct coro_deque *d)
+{
+	int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+	struct coro_deque_array *a = atomic_load_explicit(&d->array,
+		memory_order_relaxed);
+	atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	int64_t t = atomic_load_explicit(&d->top, memory_order_relaxed);
+	if (t > b) {
+		atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+		return NULL;
+	}
+	struct coro *c = atomic_load_explicit(&a->data[b & (a->capacity - 1)],
+		memory_order_relaxed);
+	if (t < b)
+		return c;
+	/* The last element. Race with the thieves for it. */
+	if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+		memory_order_seq_cst, memory_order_relaxed))
+		c = NULL;
+	atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+	return c;
+}
+
+/** Steal from the top. Can be called by anyone. */
+static struct coro *
+coro_deque_steal(struct coro_deque *d)
+{
+	int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+	atomic_thread_fence(memory_order_seq_cst);
+	int64_t b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+	if (t >= b)
+		return NULL;
+	struct coro_deque_array *a = atomic_load_explicit(&d->array,
+		memory_order_acquire);
+	struct coro *c = atomic_load_explicit(&a->data[t & (a->capacity - 1)],
+		memory_order_relaxed);
+	if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+		memory_order_seq_cst, memory_order_relaxed))
+		return NULL;
+	return c;
+}
+
+/** Why a coroutine has switched back to its worker. */
+enum coro_switch_reason {
+	CORO_SWITCH_YIELD,
+	CORO_SWITCH_SUSPEND,
+	CORO_SWITCH_FINISH,
+};
+
+struct coro_mt;
+
+struct coro_worker {
+	/** Engine with the current coroutine and the pool. */
+	struct coro_engine engine;
+	/** Runnable coroutines of this worker. */
+	struct coro_deque deque;
+	struct coro_mt *mt;
+	int id;
+	pthread_t thread;
+	/** Why the current coroutine has switched back. */
+	enum coro_switch_reason switch_reason;
+	/** Number of scheduled coroutines. */
+	uint64_t tick;
+};
+
+struct coro_mt {
+	struct coro_worker *workers;
+	int worker_count;
+	/**
+	 * Number of coroutines which are either running or are in
+	 * any run queue. When it drops to 0, the run is over.
+	 */
+	atomic_size_t runnable_count;
+	/** Number of workers waiting for work on the condition. */
+	atomic_int idle_count;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	/**
+	 * FIFO queue for the yielded coroutines and for the ones
+	 * woken up by non-worker threads. Protected by the mutex.
+	 */
+	struct rlist queue;
+	atomic_size_t queue_size;
+	/** The run is over. Protected by the mutex. */
+	bool is_done;
+};
+
+/** Multi-threaded run in progress, if any. */
+static struct coro_mt *glob_mt = NULL;
+/** Worker of the current thread. */
+static __thread struct coro_worker *this_worker = NULL;
+
+/**
+ * Get the engine of the current thread. A coroutine can migrate
+ * to another thread at any switch. The function must not be
+ * inlined so the compiler never caches the address of the thread
+ * local variable across a switch.
+ */
+static __attribute__((noinline)) struct coro_engine *
+coro_engine_this(void)
+{
+	struct coro_worker *w = this_worker;
+	return w != NULL ? &w->engine : coro_engine_local();
+}
+
+/**
+ * Called by a coroutine right after it is resumed. It could have
+ * been suspended in another mode or thread, so the engine is
+ * looked up again.
+ */
+static void
+coro_on_resume(struct coro *c)
+{
+	struct coro_engine *engine = coro_engine_this();
+	if (engine->worker != NULL) {
+		/* Workers set the current coroutine themselves. */
+		assert(engine->this == c);
+		return;
+	}
+	assert(rlist_empty(&c->link));
+	assert(engine->this == NULL);
+	engine->this = c;
+}
+
+static inline void
+coro_lock(struct coro *c)
+{
+	while (atomic_flag_test_and_set_explicit(&c->lock,
+		memory_order_acquire)) {
+	}
+}
+
+static inline void
+coro_unlock(struct coro *c)
+{
+	atomic_flag_clear_explicit(&c->lock, memory_order_release);
+}
+
+/** Wakeup an idle worker, if any, because new work has appeared. */
+static void
+coro_mt_notify(struct coro_mt *mt)
+{
+	/*
+	 * Pairs with the workers announcing they are idle before
+	 * re-checking the queues one last time.
+	 */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load(&mt->idle_count) == 0)
+		return;
+	pthread_mutex_lock(&mt->mutex);
+	pthread_cond_signal(&mt->cond);
+	pthread_mutex_unlock(&mt->mutex);
+}
+
+static void
+coro_mt_push_global(struct coro_mt *mt, struct coro *c)
+{
+	assert(rlist_empty(&c->link));
+	pthread_mutex_lock(&mt->mutex);
+	rlist_add_tail_entry(&mt->queue, c, link);
+	atomic_fetch_add(&mt->queue_size, 1);
+	if (atomic_load(&mt->idle_count) > 0)
+		pthread_cond_signal(&mt->cond);
+	pthread_mutex_unlock(&mt->mutex);
+}
+
+static struct coro *
+coro_mt_pop_global(struct coro_mt *mt)
+{
+	if (atomic_load_explicit(&mt->queue_size, memory_order_relaxed) == 0)
+		return NULL;
+	struct coro *c = NULL;
+	pthread_mutex_lock(&mt->mutex);
+	if (!rlist_empty(&mt->queue)) {
+		c = rlist_shift_entry(&mt->queue, struct coro, link);
+		atomic_fetch_sub(&mt->queue_size, 1);
+	}
+	pthread_mutex_unlock(&mt->mutex);
+	return c;
+}
+
+/**
+ * Make a runnable coroutine visible for the workers. Goes to the
+ * current worker's deque when called by a worker, so it likely
+ * runs on the same CPU with warm caches.
+ */
+static void
+coro_mt_schedule(struct coro_mt *mt, struct coro *c)
+{
+	struct coro_worker *w = this_worker;
+	if (w == NULL) {
+		coro_mt_push_global(mt, c);
+		return;
+	}
+	coro_deque_push(&w->deque, c);
+	coro_mt_notify(mt);
+}
+
+static void
+coro_mt_wakeup(struct coro_mt *mt, struct coro *c)
+{
+	coro_lock(c);
+	switch (c->state) {
+	case CORO_STATE_SUSPENDED:
+		c->state = CORO_STATE_RUNNING;
+		coro_prof_wakeup(c);
+		coro_unlock(c);
+		atomic_fetch_add(&mt->runnable_count, 1);
+		coro_mt_schedule(mt, c);
+		return;
+	case CORO_STATE_SUSPENDING:
+		/* Its worker will put it back into a run queue. */
+		c->state = CORO_STATE_RUNNING;
+		coro_prof_wakeup(c);
+		break;
+	case CORO_STATE_RUNNING:
+		c->is_wakeup_pending = true;
+		break;
+	case CORO_STATE_FINISHED:
+		break;
+	}
+	coro_unlock(c);
+}
+
+/**
+ * Mark the current coroutine as being suspended. Must be done
+ * before its wakeup condition can be changed by other threads.
+ *
+ * @retval true Need to switch out.
+ * @retval false There was a wakeup pending, no need to suspend.
+ */
+static bool
+coro_worker_prepare_suspend(struct coro *c)
+{
+	coro_lock(c);
+	assert(c->state == CORO_STATE_RUNNING);
+	if (c->is_wakeup_pending) {
+		c->is_wakeup_pending = false;
+		coro_unlock(c);
+		return false;
+	}
+	c->state = CORO_STATE_SUSPENDING;
+	coro_unlock(c);
+	return true;
+}
+
+/**
+ * Switch from the current coroutine back to its worker's
+ * scheduler. When the coroutine is resumed, it might be already
+ * running in another thread.
+ */
+static void
+coro_worker_switch_out(enum coro_switch_reason reason)
+{
+	struct coro_worker *w = this_worker;
+	struct coro *c = w->engine.this;
+	assert(c != NULL);
+	w->switch_reason = reason;
+	coro_ctx_switch(&c->ctx, &w->engine.sched.ctx);
+	coro_on_resume(c);
+}
+
+static void
+coro_worker_suspend(void)
+{
+	if (coro_worker_prepare_suspend(coro_engine_this()->this))
+		coro_worker_switch_out(CORO_SWITCH_SUSPEND);
+}
+
+static void *
+coro_worker_join(struct coro *coro)
+{
+	struct coro *this = coro_engine_this()->this;
+	assert(this != NULL);
+	coro_lock(coro);
+	assert(coro->joiner == NULL);
+	coro->joiner = this;
+	while (coro->state != CORO_STATE_FINISHED) {
+		/*
+		 * Marked as being suspended while the joined coro
+		 * is locked, so its finish can't be missed.
+		 */
+		bool need_switch = coro_worker_prepare_suspend(this);
+		coro_unlock(coro);
+		if (need_switch)
+			coro_worker_switch_out(CORO_SWITCH_SUSPEND);
+		coro_lock(coro);
+	}
+	assert(coro->joiner == this);
+	coro->joiner = NULL;
+	void *ret = coro->ret;
+	coro->ret = NULL;
+	coro_unlock(coro);
+	coro_engine_pool_put(coro_engine_this(), coro);
+	return ret;
+}
+
+/** Finish what the coroutine has started before switching back. */
+static void
+coro_worker_complete_switch(struct coro_worker *w, struct coro *c)
+{
+	struct coro_mt *mt = w->mt;
+	switch (w->switch_reason) {
+	case CORO_SWITCH_YIELD:
+		coro_mt_push_global(mt, c);
+		return;
+	case CORO_SWITCH_SUSPEND:
+		coro_lock(c);
+		if (c->state == CORO_STATE_SUSPENDING) {
+			c->state = CORO_STATE_SUSPENDED;
+			coro_unlock(c);
+			atomic_fetch_sub(&mt->runnable_count, 1);
+			return;
+		}
+		/* Was woken up while switching out. */
+		assert(c->state == CORO_STATE_RUNNING);
+		coro_unlock(c);
+		coro_mt_schedule(mt, c);
+		return;
+	case CORO_SWITCH_FINISH:
+		coro_lock(c);
+		c->state = CORO_STATE_FINISHED;
+		/*
+		 * The joiner is woken up under the lock. Otherwise it
+		 * could see the finish, leave, get finished and reused
+		 * before this wakeup, which then would be spurious.
+		 */
+		if (c->joiner != NULL)
+			coro_mt_wakeup(mt, c->joiner);
+		coro_unlock(c);
+		atomic_fetch_sub(&mt->runnable_count, 1);
+		return;
+	}
+	assert(false);
+}
+
+static bool
+coro_mt_has_work(struct coro_mt *mt)
+{
+	if (atomic_load(&mt->queue_size) > 0)
+		return true;
+	for (int i = 0; i < mt->worker_count; ++i) {
+		if (coro_deque_size(&mt->workers[i].deque) > 0)
+			return true;
+	}
+	return false;
+}
+
+static struct coro *
+coro_worker_find_work(struct coro_worker *w)
+{
+	struct coro_mt *mt = w->mt;
+	struct coro *c;
+	if (++w->tick % CORO_WORKER_GLOBAL_QUEUE_PERIOD == 0 &&
+	    (c = coro_mt_pop_global(mt)) != NULL)
+		return c;
+	if ((c = coro_deque_take(&w->deque)) != NULL)
+		return c;
+	if ((c = coro_mt_pop_global(mt)) != NULL)
+		return c;
+	int count = mt->worker_count;
+	for (int i = 1; i < 2 * count; ++i) {
+		int victim = (w->id + w->tick + i) % count;
+		if (victim == w->id)
+			continue;
+		if ((c = coro_deque_steal(&mt->workers[victim].deque)) != NULL)
+			return c;
+	}
+	return NULL;
+}
+
+/**
+ * Wait until there is work.
+ *
+ * @retval true There is work.
+ * @retval false No runnable coroutines are left, the run is over.
+ */
+static bool
+coro_worker_park(struct coro_worker *w)
+{
+	struct coro_mt *mt = w->mt;
+	bool has_work = false;
+	pthread_mutex_lock(&mt->mutex);
+	atomic_fetch_add(&mt->idle_count, 1);
+	while (!mt->is_done) {
+		if (atomic_load(&mt->runnable_count) == 0) {
+			mt->is_done = true;
+			pthread_cond_broadcast(&mt->cond);
+			break;
+		}
+		if (coro_mt_has_work(mt)) {
+			has_work = true;
+			break;
+		}
+		pthread_cond_wait(&mt->cond, &mt->mutex);
+	}
+	atomic_fetch_sub(&mt->idle_count, 1);
+	pthread_mutex_unlock(&mt->mutex);
+	return has_work;
+}
+
+static void
+coro_worker_run(struct coro_worker *w)
+{
+	assert(this_worker == NULL);
+	this_worker = w;
+	while (true) {
+		struct coro *c = coro_worker_find_work(w);
+		if (c == NULL) {
+			if (!coro_worker_park(w))
+				break;
+			continue;
+		}
+		assert(w->engine.this == NULL);
+		w->engine.this = c;
+		coro_prof_switch(&w->engine, &w->engine.sched, c);
+		trace_begin("coro", (uintptr_t)c);
+		coro_ctx_switch(&w->engine.sched.ctx, &c->ctx);
+		trace_end("coro", (uintptr_t)c);
+		coro_prof_switch(&w->engine, c, &w->engine.sched);
+		assert(w->engine.this == c);
+		w->engine.this = NULL;
+		coro_worker_complete_switch(w, c);
+	}
+	this_worker = NULL;
+}
+
+static void *
+coro_worker_thread_f(void *arg)
+{
+	trace_set_thread_name("coro worker");
+	coro_worker_run(arg);
+	return NULL;
+}
+
+static void
+coro_mt_run(int thread_count)
+{
+	assert(glob_mt == NULL && this_engine == NULL);
+	assert(glob_engine.this == NULL);
+	struct coro_mt mt;
+	memset(&mt, 0, sizeof(mt));
+	mt.worker_count = thread_count;
+	mt.workers = calloc(thread_count, sizeof(mt.workers[0]));
+	atomic_init(&mt.runnable_count, 0);
+	atomic_init(&mt.idle_count, 0);
+	atomic_init(&mt.queue_size, 0);
+	pthread_mutex_init(&mt.mutex, NULL);
+	pthread_cond_init(&mt.cond, NULL);
+	rlist_create(&mt.queue);
+	for (int i = 0; i < thread_count; ++i) {
+		struct coro_worker *w = &mt.workers[i];
+		coro_engine_create(&w->engine);
+		w->engine.stack_size = glob_engine.stack_size;
+		w->engine.stack_flags = glob_engine.stack_flags;
+		w->engine.pool_policy = glob_engine.pool_policy;
+		w->engine.worker = w;
+		coro_deque_create(&w->deque);
+		w->mt = &mt;
+		w->id = i;
+	}
+	struct coro_worker *main_w = &mt.workers[0];
+	coro_engine_merge(&main_w->engine, &glob_engine);
+	/*
+	 * The already runnable coroutines are given to the first
+	 * worker. The others will steal them.
+	 */
+	for (int i = 0; i < CORO_PRIO_COUNT; ++i) {
+		struct rlist *next = &glob_engine.coros_running_next[i];
+		while (!rlist_empty(next)) {
+			struct coro *c = rlist_shift_entry(next,
+				struct coro, link);
+			c->is_in_next = false;
+			coro_deque_push(&main_w->deque, c);
+			atomic_fetch_add(&mt.runnable_count, 1);
+		}
+		glob_engine.prio_stats[i].runnable_count = 0;
+	}
+	glob_mt = &mt;
+	for (int i = 1; i < thread_count; ++i) {
+		struct coro_worker *w = &mt.workers[i];
+		if (pthread_create(&w->thread, NULL, coro_worker_thread_f,
+				   w) != 0)
+			handle_error();
+	}
+	coro_worker_run(main_w);
+	for (int i = 1; i < thread_count; ++i)
+		pthread_join(mt.workers[i].thread, NULL);
+	glob_mt = NULL;
+	assert(atomic_load(&mt.runnable_count) == 0);
+	assert(rlist_empty(&mt.queue));
+	for (int i = 0; i < thread_count; ++i) {
+		struct coro_worker *w = &mt.workers[i];
+		coro_engine_merge(&glob_engine, &w->engine);
+		coro_deque_destroy(&w->deque);
+		coro_engine_destroy(&w->engine);
+	}
+	pthread_cond_destroy(&mt.cond);
+	pthread_mutex_destroy(&mt.mutex);
+	free(mt.workers);
+}
+
+//////////////////////////////////////////////////////////////////
+
+//////////////////////////////////////////////////////////////////
+// Coroutine-local storage.
+//////////////////////////////////////////////////////////////////
+
+enum {
+	/**
+	 * How many times the destructors are called, if they set new
+	 * values themselves. The values left after that are dropped.
+	 */
+	CORO_KEY_DESTRUCTOR_ITERATIONS = 4,
+};
+
+static_assert(CORO_KEY_MAX <= 32, "the key mask is 32 bits");
+
+static coro_key_destructor_f coro_key_destructors[CORO_KEY_MAX];
+static int coro_key_count = 0;
+static pthread_mutex_t coro_key_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Call the destructors of the values of a finished coroutine. */
+static void
+coro_key_destroy_values(struct coro *c)
+{
+	for (int i = 0; i < CORO_KEY_DESTRUCTOR_ITERATIONS &&
+	     c->specific_mask != 0; ++i) {
+		uint32_t mask = c->specific_mask;
+		c->specific_mask = 0;
+		while (mask != 0) {
+			int key = __builtin_ctz(mask);
+			mask &= mask - 1;
+			void *value = c->specific[key];
+			c->specific[key] = NULL;
+			coro_key_destructor_f destructor =
+				coro_key_destructors[key];
+			if (value != NULL && destructor != NULL)
+				destructor(value);
+		}
+	}
+	if (c->specific_mask != 0) {
+		memset(c->specific, 0, sizeof(c->specific));
+		c->specific_mask = 0;
+	}
+}
+
+/**
+ * Entry point of each new coroutine. It starts on its own stack
+ * when the scheduler switches to the coroutine for the first
+ * time. After the function is finished, the coroutine can be
+ * reused from the pool, so the body never returns.
+ */
+static void
+coro_body(void *arg)
+{
+	struct coro *c = arg;
+	coro_on_resume(c);
+	while (true) {
+		c->ret = c->func(c->func_arg);
+		if (c->specific_mask != 0)
+			coro_key_destroy_values(c);
+		coro_stack_prof_measure(c, c->func);
+		c->func = NULL;
+		struct coro_engine *engine = coro_engine_this();
+		if (engine->worker != NULL)
+			coro_worker_switch_out(CORO_SWITCH_FINISH);
+		else
+			coro_engine_finish(engine, c);
+		/*
+		 * Here it is restarted already, must have its
+		 * state restored.
+		 */
+		assert(c->state == CORO_STATE_RUNNING);
+		assert(c->func != NULL);
+	}
+}
+
+/** Make a new coroutine runnable. */
+static void
+coro_engine_schedule_new(struct coro_engine *engine, struct coro *c)
+{
+	assert(rlist_empty(&c->link));
+	if (engine->worker == NULL) {
+		coro_engine_push_next(engine, c);
+		return;
+	}
+	struct coro_mt *mt = engine->worker->mt;
+	atomic_fetch_add(&mt->runnable_count, 1);
+	coro_mt_schedule(mt, c);
+}
+
+/** Initialize a new coroutine. Its stack must be created. */
+static void
+coro_create(struct coro *c, coro_f func, void *func_arg)
+{
+	c->state = CORO_STATE_RUNNING;
+	memset(c->specific, 0, sizeof(c->specific));
+	c->specific_mask = 0;
+	c->ret = NULL;
+	c->func = func;
+	c->func_arg = func_arg;
+	c->joiner = NULL;
+	rlist_create(&c->link);
+	atomic_flag_clear(&c->lock);
+	c->is_wakeup_pending = false;
+	c->prio = CORO_PRIO_NORMAL;
+	c->is_in_next = false;
+	c->slab = NULL;
+	c->remote_next = NULL;
+	atomic_init(&c->is_remote_woken, false);
+	coro_prof_attach(c);
+	coro_ctx_create(&c->ctx, c->stack.base, c->stack.size, coro_body, c);
+}
+
+/** Prepare a coroutine taken from the pool to run a new function. */
+static void
+coro_reuse(struct coro *c, coro_f func, void *func_arg)
+{
+	c->func = func;
+	c->func_arg = func_arg;
+	c->state = CORO_STATE_RUNNING;
+	c->is_wakeup_pending = false;
+	c->prio = CORO_PRIO_NORMAL;
+	coro_prof_attach(c);
+}
+
+/**
+ * Cut a stack from the huge page arena of the engine. When the rest
+ * of the arena is too small, it is unmapped, and a new arena is
+ * mapped.
+ *
+ * The stacks are laid out like the guarded ones, but the gap pages
+ * are not protected. Their tops are shifted down into the gaps by a
+ * different number of cache lines. On a huge page the physical
+ * addresses keep the stride of the virtual ones, and without the
+ * shift the tops of all the stacks, the hottest memory of the
+ * switches, would fall into the same few cache sets.
+ */
+static void
+coro_engine_stack_create_huge(struct coro_engine *engine,
+	struct coro_stack *stack, int size_class)
+{
+	size_t size = coro_stack_map_size(size_class);
+	if (engine->stack_arena_size < size) {
+		if (engine->stack_arena_size > 0 &&
+		    munmap(engine->stack_arena, engine->stack_arena_size) != 0)
+			handle_error();
+		size_t arena_size = hugemem_round(size);
+		if (arena_size < CORO_STACK_ARENA_SIZE)
+			arena_size = CORO_STACK_ARENA_SIZE;
+		int flags = HUGEMEM_THP;
+		if ((engine->stack_flags & CORO_STACK_NODE_LOCAL) != 0)
+			flags |= HUGEMEM_NODE_LOCAL;
+		engine->stack_arena = hugemem_map(arena_size, flags);
+		if (engine->stack_arena == NULL)
+			handle_error();
+		engine->stack_arena_size = arena_size;
+	}
+	coro_stack_init(stack, engine->stack_arena, size_class, false);
+	size_t colour = engine->stack_colour++ * CORO_CACHE_LINE_SIZE %
+			coro_page_size();
+	stack->base = (char *)stack->base - colour;
+	engine->stack_arena += size;
+	engine->stack_arena_size -= size;
+}
+
+/** A stack for a new coroutine, by the stack flags of the engine. */
+static void
+coro_engine_stack_create(struct coro_engine *engine,
+	struct coro_stack *stack, int size_class)
+{
+	if ((engine->stack_flags & CORO_STACK_HUGE_PAGES) != 0)
+		coro_engine_stack_create_huge(engine, stack, size_class);
+	else
+		coro_stack_create(stack, size_class, engine->stack_flags);
+}
+
+static struct coro *
+coro_engine_spawn_new(struct coro_engine *engine, coro_f func, void *func_arg,
+	int size_class)
+{
+	struct coro *c = malloc(sizeof(*c));
+	coro_engine_stack_create(engine, &c->stack, size_class);
+	coro_create(c, func, func_arg);
+
+	/* Now scheduler can work with that coroutine. */
+	++engine->coro_count;
+	coro_engine_schedule_new(engine, c);
+	return c;
+}
+
+static struct coro *
+coro_engine_spawn(struct coro_engine *engine, coro_f func, void *func_arg,
+	const struct coro_attr *attr)
+{
+	size_t stack_size = engine->stack_size;
+	if (attr != NULL && attr->stack_size != 0)
+		stack_size = attr->stack_size;
+	int size_class = coro_stack_size_class(stack_size);
+	struct rlist *pool = &engine->coros_pool[size_class];
+	if (rlist_empty(pool)) {
+		++engine->pool_stats.miss_count;
+		return coro_engine_spawn_new(engine, func, func_arg, size_class);
+	}
+	++engine->pool_stats.hit_count;
+	struct coro *c = rlist_first_entry(pool, struct coro, link);
+	coro_engine_pool_take(engine, c);
+	coro_reuse(c, func, func_arg);
+	coro_engine_schedule_new(engine, c);
+	return c;
+}
+
+/**
+ * Spawn @a count coroutines at once. The pooled ones are taken
+ * first. The rest are carved from a single slab with the stacks
+ * from a single mapping. The whole batch is scheduled in one go.
+ */
+static void
+coro_engine_spawn_batch(struct coro_engine *engine, coro_f func,
+	void **func_args, size_t count, struct coro **out)
+{
+	int size_class = coro_stack_size_class(engine->stack_size);
+	struct rlist *pool = &engine->coros_pool[size_class];
+	struct rlist batch;
+	rlist_create(&batch);
+	bool is_local = engine->worker == NULL;
+	size_t i = 0;
+	for (; i < count && !rlist_empty(pool); ++i) {
+		struct coro *c = rlist_first_entry(pool, struct coro, link);
+		coro_engine_pool_take(engine, c);
+		coro_reuse(c, func, func_args != NULL ? func_args[i] : NULL);
+		c->is_in_next = is_local;
+		rlist_add_tail_entry(&batch, c, link);
+		out[i] = c;
+	}
+	engine->pool_stats.hit_count += i;
+	size_t new_count = count - i;
+	if (new_count > 0) {
+		engine->pool_stats.miss_count += new_count;
+		struct coro_slab *slab = malloc(sizeof(*slab) +
+			new_count * sizeof(slab->coros[0]));
+		atomic_init(&slab->ref_count, new_count);
+		bool is_huge = (engine->stack_flags &
+				CORO_STACK_HUGE_PAGES) != 0;
+		size_t map_size = coro_stack_map_size(size_class);
+		char *map = NULL;
+		if (!is_huge) {
+			map = coro_stack_map(map_size * new_count,
+				engine->stack_flags);
+		}
+		for (size_t j = 0; j < new_count; ++j, ++i) {
+			struct coro *c = &slab->coros[j];
+			if (is_huge) {
+				coro_engine_stack_create_huge(engine,
+					&c->stack, size_class);
+			} else {
+				coro_stack_init(&c->stack, map + j * map_size,
+					size_class, true);
+			}
+			coro_create(c, func,
+				func_args != NULL ? func_args[i] : NULL);
+			c->slab = slab;
+			c->is_in_next = is_local;
+			rlist_add_tail_entry(&batch, c, link);
+			out[i] = c;
+		}
+		engine->coro_count += new_count;
+	}
+	if (is_local) {
+		struct coro_prio_stats *stats =
+			&engine->prio_stats[CORO_PRIO_NORMAL];
+		rlist_splice_tail(&engine->coros_running_next[CORO_PRIO_NORMAL],
+			&batch);
+		stats->runnable_count += count;
+		if (stats->runnable_count > stats->max_runnable_count)
+			stats->max_runnable_count = stats->runnable_count;
+		return;
+	}
+	struct coro_mt *mt = engine->worker->mt;
+	atomic_fetch_add(&mt->runnable_count, count);
+	while (!rlist_empty(&batch)) {
+		struct coro *c = rlist_shift_entry(&batch, struct coro, link);
+		coro_mt_schedule(mt, c);
+	}
+}
+
+static void *
+coro_engine_join(struct coro_engine *engine, struct coro *coro)
+{
+	assert(coro->joiner == NULL);
+	coro->joiner = engine->this;
+	while (coro->state == CORO_STATE_RUNNING ||
+		coro->state == CORO_STATE_SUSPENDED)
+		coro_engine_suspend(engine);
+	assert(coro->state == CORO_STATE_FINISHED);
+	assert(coro->joiner == engine->this);
+	coro->joiner = NULL;
+	void *ret = coro->ret;
+	coro->ret = NULL;
+	coro_engine_pool_put(engine, coro);
+	return ret;
+}
+
+//////////////////////////////////////////////////////////////////
+
+void
+coro_sched_init(void)
+{
+	coro_engine_create(&glob_engine);
+	glob_engine_thread = pthread_self();
+}
+
+void
+coro_sched_run(void)
+{
+	coro_engine_run(coro_engine_local());
+}
+
+void
+coro_sched_run_mt(int thread_count)
+{
+	if (thread_count <= 1)
+		coro_engine_run(&glob_engine);
+	else
+		coro_mt_run(thread_count);
+}
+
+void
+coro_sched_destroy(void)
+{
+	coro_engine_destroy(&glob_engine);
+}
+
+void
+coro_sched_thread_init(void)
+{
+	assert(this_engine == NULL && this_worker == NULL);
+	struct coro_engine *engine = malloc(sizeof(*engine));
+	coro_engine_create(engine);
+	this_engine = engine;
+}
+
+enum coro_sched_state
+coro_sched_step(double timeout)
+{
+	assert(this_worker == NULL);
+	uint64_t ns = timeout > 0 ? (uint64_t)(timeout * 1000000000) : 0;
+	return coro_engine_step(coro_engine_local(), ns);
+}
+
+void
+coro_sched_thread_destroy(void)
+{
+	struct coro_engine *engine = this_engine;
+	assert(engine != NULL);
+	coro_engine_destroy(engine);
+	free(engine);
+	this_engine = NULL;
+}
+
+void
+coro_sched_set_stack_size(size_t size)
+{
+	coro_engine_local()->stack_size = size != 0 ? size :
+					  CORO_STACK_SIZE_DEFAULT;
+}
+
+void
+coro_sched_set_stack_memory(int flags)
+{
+	coro_engine_local()->stack_flags = flags;
+}
+
+struct coro *
+coro_this(void)
+{
+	return coro_engine_this()->this;
+}
+
+int
+coro_key_create(coro_key_t *key, coro_key_destructor_f destructor)
+{
+	pthread_mutex_lock(&coro_key_mutex);
+	if (coro_key_count == CORO_KEY_MAX) {
+		pthread_mutex_unlock(&coro_key_mutex);
+		errno = EAGAIN;
+		return -1;
+	}
+	*key = coro_key_count;
+	coro_key_destructors[coro_key_count++] = destructor;
+	pthread_mutex_unlock(&coro_key_mutex);
+	return 0;
+}
+
+void *
+coro_getspecific(coro_key_t key)
+{
+	assert(key < CORO_KEY_MAX);
+	struct coro_engine *engine = coro_engine_this();
+	struct coro *c = engine->this != NULL ? engine->this : &engine->sched;
+	return c->specific[key];
+}
+
+void
+coro_setspecific(coro_key_t key, const void *value)
+{
+	assert(key < CORO_KEY_MAX);
+	struct coro_engine *engine = coro_engine_this();
+	struct coro *c = engine->this != NULL ? engine->this : &engine->sched;
+	c->specific[key] = (void *)value;
+	c->specific_mask |= (uint32_t)1 << key;
+}
+
+void
+coro_pool_policy_create(struct coro_pool_policy *policy)
+{
+	policy->max_count = SIZE_MAX;
+	policy->max_resident_size = SIZE_MAX;
+	policy->trim_keep_size = 64 * 1024;
+}
+
+void
+coro_sched_set_pool_policy(const struct coro_pool_policy *policy)
+{
+	struct coro_engine *engine = coro_engine_local();
+	engine->pool_policy = *policy;
+	coro_engine_pool_apply_policy(engine);
+}
+
+void
+coro_sched_pool_stats(struct coro_pool_stats *stats)
+{
+	const struct coro_engine *engine = coro_engine_local();
+	*stats = engine->pool_stats;
+	stats->count = engine->pool_count;
+	stats->resident_size = engine->pool_resident_size;
+}
+
+void
+coro_sched_prio_stats(enum coro_priority prio, struct coro_prio_stats *stats)
+{
+	assert(prio >= 0 && prio < CORO_PRIO_COUNT);
+	*stats = coro_engine_local()->prio_stats[prio];
+}
+
+bool
+coro_prof(const struct coro *coro, struct coro_prof *prof)
+{
+#if CORO_PROFILE
+	*prof = coro->prof;
+	return true;
+#else
+	(void)coro;
+	memset(prof, 0, sizeof(*prof));
+	return false;
+#endif
+}
+
+void
+coro_prof_foreach(coro_prof_f cb, void *arg)
+{
+#if CORO_PROFILE
+	pthread_mutex_lock(&coro_prof_mutex);
+	struct coro *c;
+	rlist_foreach_entry(c, &coro_prof_all, in_all)
+		cb(c, &c->prof, arg);
+	pthread_mutex_unlock(&coro_prof_mutex);
+#else
+	(void)cb;
+	(void)arg;
+#endif
+}
+
+static void
+coro_prof_dump_f(struct coro *coro, const struct coro_prof *prof, void *arg)
+{
+	fprintf((FILE *)arg, "coro %p: run %.3f ms, max slice %.3f ms, "
+		"switches %llu, wakeups %llu\n", (void *)coro,
+		prof->run_time_ns / 1000000.0, prof->max_slice_ns / 1000000.0,
+		(unsigned long long)prof->switch_count,
+		(unsigned long long)prof->wakeup_count);
+}
+
+void
+coro_prof_dump(FILE *out)
+{
+	if (!CORO_PROFILE) {
+		fprintf(out, "coro profiling is disabled, build with "
+			"-DCORO_PROFILE=1\n");
+		return;
+	}
+	coro_prof_foreach(coro_prof_dump_f, out);
+}
+
+bool
+coro_stack_prof_foreach(coro_stack_prof_f cb, void *arg)
+{
+#if CORO_STACK_PROFILE
+	pthread_mutex_lock(&coro_stack_prof_mutex);
+	for (size_t i = 0; i < coro_stack_prof_count; ++i)
+		cb(&coro_stack_profs[i], arg);
+	pthread_mutex_unlock(&coro_stack_prof_mutex);
+	return true;
+#else
+	(void)cb;
+	(void)arg;
+	return false;
+#endif
+}
+
+static void
+coro_stack_prof_dump_f(const struct coro_stack_prof *prof, void *arg)
+{
+	FILE *out = arg;
+	size_t fit = (size_t)1 << (CORO_STACK_CLASS_MIN_LOG2 +
+		coro_stack_size_class(prof->max_used * 2));
+	fprintf(out, "coro func %p: runs %llu, max used %zu of %zu KB, "
+		"fits into %zu KB\n", (void *)(uintptr_t)prof->func,
+		(unsigned long long)prof->run_count, prof->max_used / 1024,
+		prof->max_stack_size / 1024, fit / 1024);
+	for (int i = 0; i < CORO_STACK_PROF_BUCKET_COUNT; ++i) {
+		if (prof->hist[i] == 0)
+			continue;
+		fprintf(out, "\t<= %zu KB: %llu\n",
+			((size_t)1 << (CORO_STACK_PROF_MIN_LOG2 + i)) / 1024,
+			(unsigned long long)prof->hist[i]);
+	}
+}
+
+void
+coro_stack_prof_dump(FILE *out)
+{
+	if (!coro_stack_prof_foreach(coro_stack_prof_dump_f, out)) {
+		fprintf(out, "coro stack profiling is disabled, build with "
+			"-DCORO_STACK_PROFILE=1\n");
+	}
+}
+
+void
+coro_attr_create(struct coro_attr *attr)
+{
+	memset(attr, 0, sizeof(*attr));
+}
+
+struct coro *
+coro_new(coro_f func, void *func_arg)
+{
+	return coro_engine_spawn(coro_engine_this(), func, func_arg, NULL);
+}
+
+struct coro *
+coro_new_ex(coro_f func, void *func_arg, const struct coro_attr *attr)
+{
+	return coro_engine_spawn(coro_engine_this(), func, func_arg, attr);
+}
+
+void
+coro_new_batch(coro_f func, void **func_args, size_t count,
+	struct coro **out)
+{
+	if (count == 0)
+		return;
+	coro_engine_spawn_batch(coro_engine_this(), func, func_args, count,
+		out);
+}
+
+void *
+coro_join(struct coro *coro)
+{
+	struct coro_engine *engine = coro_engine_this();
+	if (engine->worker != NULL)
+		return coro_worker_join(coro);
+	return coro_engine_join(engine, coro);
+}
+
+/**
+ * Become the joiner of the coroutines, until one of them is found
+ * finished. Returns its index, or @a count if none is. In the
+ * multi-threaded mode the finish wakes the joiner up under the lock
+ * of the finished coroutine, so it is not missed after this.
+ */
+static size_t
+coro_join_any_register(struct coro **coros, size_t count, struct coro *this,
+	bool is_mt)
+{
+	for (size_t i = 0; i < count; ++i) {
+		struct coro *c = coros[i];
+		if (is_mt)
+			coro_lock(c);
+		bool is_finished = c->state == CORO_STATE_FINISHED;
+		if (!is_finished) {
+			assert(c->joiner == NULL || c->joiner == this);
+			c->joiner = this;
+		}
+		if (is_mt)
+			coro_unlock(c);
+		if (is_finished)
+			return i;
+	}
+	return count;
+}
+
+static void
+coro_join_any_unregister(struct coro **coros, size_t count, struct coro *this,
+	bool is_mt)
+{
+	for (size_t i = 0; i < count; ++i) {
+		struct coro *c = coros[i];
+		if (is_mt)
+			coro_lock(c);
+		if (c->joiner == this)
+			c->joiner = NULL;
+		if (is_mt)
+			coro_unlock(c);
+	}
+}
+
+size_t
+coro_join_any(struct coro **coros, size_t count, void **ret)
+{
+	assert(count > 0);
+	struct coro_engine *engine = coro_engine_this();
+	struct coro *this = engine->this;
+	bool is_mt = engine->worker != NULL;
+	size_t found;
+	while ((found = coro_join_any_register(coros, count, this,
+					       is_mt)) == count) {
+		if (!is_mt)
+			coro_engine_suspend(engine);
+		else if (coro_worker_prepare_suspend(this))
+			coro_worker_switch_out(CORO_SWITCH_SUSPEND);
+		engine = coro_engine_this();
+	}
+	coro_join_any_unregister(coros, count, this, is_mt);
+	void *res = coro_join(coros[found]);
+	if (ret != NULL)
+		*ret = res;
+	return found;
+}
+
+void
+coro_suspend(void)
+{
+	struct coro_engine *engine = coro_engine_this();
+	if (engine->worker != NULL)
+		coro_worker_suspend();
+	else
+		coro_engine_suspend(engine);
+}
+
+bool
+coro_suspend_timeout(double timeout)
+{
+	struct coro_engine *engine = coro_engine_this();
+	if (engine->worker != NULL) {
+		printf("Error: timers are not supported in the "
+			"multi-threaded mode\n");
+		exit(-1);
+	}
+	return coro_engine_suspend_timeout(engine, timeout);
+}
+
+int
+coro_wait_fd(int fd, int events, double timeout)
+{
+	struct coro_engine *engine = coro_engine_this();
+	if (engine->worker != NULL) {
+		printf("Error: waiting for descriptors is not supported in "
+			"the multi-threaded mode\n");
+		exit(-1);
+	}
+	return coro_engine_wait_fd(engine, fd, events, timeout);
+}
+
+int
+coro_watch_fd_start(struct coro_fd_watch *watch)
+{
+	struct coro_engine *engine = coro_engine_this();
+	if (engine->worker != NULL) {
+		printf("Error: watching descriptors is not supported in "
+			"the multi-threaded mode\n");
+		exit(-1);
+	}
+	return coro_engine_watch_fd_start(engine, watch);
+}
+
+void
+coro_watch_fd_stop(struct coro_fd_watch *watch)
+{
+	coro_engine_watch_fd_stop(coro_engine_this(), watch);
+}
+
+void
+coro_sleep(double timeout)
+{
+	coro_suspend_timeout(timeout);
+}
+
+void
+coro_yield(void)
+{
+	struct coro_engine *engine = coro_engine_this();
+	if (engine->worker != NULL)
+		coro_worker_switch_out(CORO_SWITCH_YIELD);
+	else
+		coro_engine_yield(engine);
+}
+
+void
+coro_set_priority(struct coro *coro, enum coro_priority prio)
+{
+	assert(prio >= 0 && prio < CORO_PRIO_COUNT);
+	struct coro_engine *engine = coro_engine_this();
+	if (engine->worker != NULL || coro->prio == prio ||
+	    coro->state != CORO_STATE_RUNNING || rlist_empty(&coro->link)) {
+		coro->prio = prio;
+		return;
+	}
+	/*
+	 * Queued to run. The counters follow the priority. If it
+	 * is not taken into this iteration yet, it is also moved to
+	 * the new priority's queue.
+	 */
+	--engine->prio_stats[coro->prio].runnable_count;
+	if (!coro->is_in_next) {
+		coro->prio = prio;
+		++engine->prio_stats[prio].runnable_count;
+		return;
+	}
+	rlist_del_entry(coro, link);
+	coro->prio = prio;
+	coro_engine_push_next(engine, coro);
+}
+
+void
+coro_wakeup(struct coro *coro)
+{
+	if (glob_mt != NULL)
+		coro_mt_wakeup(glob_mt, coro);
+	else
+		coro_engine_wakeup(coro_engine_local(), coro);
+}
+
+void
+coro_wakeup_many(struct coro **coros, size_t count)
+{
+	if (glob_mt == NULL) {
+		coro_engine_wakeup_many(coro_engine_local(), coros, count);
+		return;
+	}
+	for (size_t i = 0; i < count; ++i)
+		coro_mt_wakeup(glob_mt, coros[i]);
+}
+
+struct coro_engine *
+coro_remote_wait_begin(void)
+{
+	struct coro_engine *engine = coro_engine_this();
+	if (engine->worker != NULL)
+		return NULL;
+	if (engine->remote_watch.fd < 0)
+		coro_engine_remote_init(engine);
+	++engine->remote_wait_count;
+	return engine;
+}
+
+void
+coro_remote_wait_end(struct coro_engine *engine)
+{
+	if (engine == NULL)
+		return;
+	assert(engine == coro_engine_this());
+	assert(engine->remote_wait_count > 0);
+	--engine->remote_wait_count;
+	/*
+	 * A wakeup which has come too late, when the coroutine is running
+	 * already, is dropped. Otherwise it would wake up the next
+	 * suspension of the coroutine, which waits for something else.
+	 */
+	struct coro *this = engine->this;
+	while (atomic_load_explicit(&this->is_remote_woken,
+		memory_order_acquire)) {
+		coro_engine_process_remote(engine);
+		if (atomic_load_explicit(&this->is_remote_woken,
+			memory_order_acquire))
+			sched_yield();
+	}
+}
+
+void
+coro_wakeup_remote(struct coro_engine *engine, struct coro *coro)
+{
+	if (engine == NULL) {
+		coro_wakeup(coro);
+		return;
+	}
+	/* Same engine, nothing to synchronize with. */
+	if (engine == this_engine ||
+	    (engine == &glob_engine && this_engine == NULL &&
+	     this_worker == NULL && pthread_equal(pthread_self(),
+						  glob_engine_thread))) {
+		coro_engine_wakeup(engine, coro);
+		return;
+	}
+	coro_engine_push_remote(engine, coro);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/** A suspended coroutine in a wait list. Lives on its stack. */
+struct coro_waiter {
+	struct coro_waiter *next;
+	struct coro *coro;
+	/** The mutex or the unit is handed over to it. */
+	bool is_granted;
+};
+
+static inline void
+coro_wait_list_create(struct coro_wait_list *list)
+{
+	list->first = NULL;
+	list->last = NULL;
+}
+
+static inline bool
+coro_wait_list_empty(const struct coro_wait_list *list)
+{
+	return list->first == NULL;
+}
+
+static inline void
+coro_wait_list_push(struct coro_wait_list *list, struct coro_waiter *w)
+{
+	w->next = NULL;
+	if (list->last != NULL)
+		list->last->next = w;
+	else
+		list->first = w;
+	list->last = w;
+}
+
+static inline struct coro_waiter *
+coro_wait_list_pop(struct coro_wait_list *list)
+{
+	struct coro_waiter *w = list->first;
+	if (w == NULL)
+		return NULL;
+	list->first = w->next;
+	if (list->first == NULL)
+		list->last = NULL;
+	return w;
+}
+
+static inline void
+coro_sync_lock(atomic_flag *lock)
+{
+	while (atomic_flag_test_and_set_explicit(lock, memory_order_acquire)) {
+	}
+}
+
+static inline void
+coro_sync_unlock(atomic_flag *lock)
+{
+	atomic_flag_clear_explicit(lock, memory_order_release);
+}
+
+/**
+ * Hand the object over to the waiter. Called under the lock of the
+ * object, and the waiter checks the grant under the same lock. So
+ * it can't return and finish before the wakeup is done.
+ */
+static inline void
+coro_waiter_grant(struct coro_waiter *w)
+{
+	w->is_granted = true;
+	coro_wakeup(w->coro);
+}
+
+/**
+ * Suspend until the waiter is granted. Called with @a lock held,
+ * returns with it released. The other wakeups of the coroutine are
+ * ignored.
+ */
+static void
+coro_waiter_wait(struct coro_waiter *w, atomic_flag *lock)
+{
+	while (true) {
+		bool is_granted = w->is_granted;
+		coro_sync_unlock(lock);
+		if (is_granted)
+			return;
+		coro_suspend();
+		coro_sync_lock(lock);
+	}
+}
+
+void
+coro_mutex_create(struct coro_mutex *mutex)
+{
+	atomic_flag_clear(&mutex->lock);
+	mutex->owner = NULL;
+	coro_wait_list_create(&mutex->waiters);
+}
+
+void
+coro_mutex_destroy(struct coro_mutex *mutex)
+{
+	assert(mutex->owner == NULL);
+	assert(coro_wait_list_empty(&mutex->waiters));
+	(void)mutex;
+}
+
+void
+coro_mutex_lock(struct coro_mutex *mutex)
+{
+	struct coro *self = coro_this();
+	coro_sync_lock(&mutex->lock);
+	if (mutex->owner == NULL) {
+		mutex->owner = self;
+		coro_sync_unlock(&mutex->lock);
+		return;
+	}
+	assert(mutex->owner != self);
+	struct coro_waiter w;
+	w.coro = self;
+	w.is_granted = false;
+	coro_wait_list_push(&mutex->waiters, &w);
+	coro_waiter_wait(&w, &mutex->lock);
+}
+
+bool
+coro_mutex_trylock(struct coro_mutex *mutex)
+{
+	coro_sync_lock(&mutex->lock);
+	bool ok = mutex->owner == NULL;
+	if (ok)
+		mutex->owner = coro_this();
+	coro_sync_unlock(&mutex->lock);
+	return ok;
+}
+
+void
+coro_mutex_unlock(struct coro_mutex *mutex)
+{
+	coro_sync_lock(&mutex->lock);
+	assert(mutex->owner == coro_this());
+	struct coro_waiter *w = coro_wait_list_pop(&mutex->waiters);
+	if (w == NULL) {
+		mutex->owner = NULL;
+	} else {
+		mutex->owner = w->coro;
+		coro_waiter_grant(w);
+	}
+	coro_sync_unlock(&mutex->lock);
+}
+
+void
+coro_cond_create(struct coro_cond *cond)
+{
+	atomic_flag_clear(&cond->lock);
+	cond->mutex = NULL;
+	coro_wait_list_create(&cond->waiters);
+}
+
+void
+coro_cond_destroy(struct coro_cond *cond)
+{
+	assert(coro_wait_list_empty(&cond->waiters));
+	(void)cond;
+}
+
+void
+coro_cond_wait(struct coro_cond *cond, struct coro_mutex *mutex)
+{
+	struct coro_waiter w;
+	w.coro = coro_this();
+	w.is_granted = false;
+	coro_sync_lock(&cond->lock);
+	assert(coro_wait_list_empty(&cond->waiters) || cond->mutex == mutex);
+	cond->mutex = mutex;
+	coro_wait_list_push(&cond->waiters, &w);
+	coro_sync_unlock(&cond->lock);
+	coro_mutex_unlock(mutex);
+	/*
+	 * The signal only moves the waiter into the mutex, so the wait
+	 * is the same as of the mutex lock.
+	 */
+	coro_sync_lock(&mutex->lock);
+	coro_waiter_wait(&w, &mutex->lock);
+}
+
+/** Move up to @a count waiters of the condition into its mutex. */
+static void
+coro_cond_wakeup(struct coro_cond *cond, size_t count)
+{
+	coro_sync_lock(&cond->lock);
+	if (coro_wait_list_empty(&cond->waiters)) {
+		coro_sync_unlock(&cond->lock);
+		return;
+	}
+	struct coro_mutex *mutex = cond->mutex;
+	coro_sync_lock(&mutex->lock);
+	struct coro_waiter *w;
+	while (count-- > 0 &&
+	       (w = coro_wait_list_pop(&cond->waiters)) != NULL) {
+		if (mutex->owner == NULL) {
+			mutex->owner = w->coro;
+			coro_waiter_grant(w);
+		} else {
+			coro_wait_list_push(&mutex->waiters, w);
+		}
+	}
+	coro_sync_unlock(&mutex->lock);
+	coro_sync_unlock(&cond->lock);
+}
+
+void
+coro_cond_signal(struct coro_cond *cond)
+{
+	coro_cond_wakeup(cond, 1);
+}
+
+void
+coro_cond_broadcast(struct coro_cond *cond)
+{
+	coro_cond_wakeup(cond, SIZE_MAX);
+}
+
+void
+coro_sem_create(struct coro_sem *sem, size_t count)
+{
+	atomic_flag_clear(&sem->lock);
+	sem->count = count;
+	coro_wait_list_create(&sem->waiters);
+}
+
+void
+coro_sem_destroy(struct coro_sem *sem)
+{
+	assert(coro_wait_list_empty(&sem->waiters));
+	(void)sem;
+}
+
+void
+coro_sem_wait(struct coro_sem *sem)
+{
+	coro_sync_lock(&sem->lock);
+	if (sem->count > 0) {
+		--sem->count;
+		coro_sync_unlock(&sem->lock);
+		return;
+	}
+	struct coro_waiter w;
+	w.coro = coro_this();
+	w.is_granted = false;
+	coro_wait_list_push(&sem->waiters, &w);
+	coro_waiter_wait(&w, &sem->lock);
+}
+
+bool
+coro_sem_trywait(struct coro_sem *sem)
+{
+	coro_sync_lock(&sem->lock);
+	bool ok = sem->count > 0;
+	if (ok)
+		--sem->count;
+	coro_sync_unlock(&sem->lock);
+	return ok;
+}
+
+void
+coro_sem_post(struct coro_sem *sem)
+{
+	coro_sync_lock(&sem->lock);
+	struct coro_waiter *w = coro_wait_list_pop(&sem->waiters);
+	if (w == NULL)
+		++sem->count;
+	else
+		coro_waiter_grant(w);
+	coro_sync_unlock(&sem->lock);
+}
+
+void
+coro_wait_group_create(struct coro_wait_group *group)
+{
+	atomic_flag_clear(&group->lock);
+	group->count = 0;
+	coro_wait_list_create(&group->waiters);
+}
+
+void
+coro_wait_group_destroy(struct coro_wait_group *group)
+{
+	assert(coro_wait_list_empty(&group->waiters));
+	(void)group;
+}
+
+void
+coro_wait_group_add(struct coro_wait_group *group, size_t count)
+{
+	coro_sync_lock(&group->lock);
+	group->count += count;
+	coro_sync_unlock(&group->lock);
+}
+
+void
+coro_wait_group_done(struct coro_wait_group *group)
+{
+	coro_sync_lock(&group->lock);
+	assert(group->count > 0);
+	if (--group->count == 0) {
+		struct coro_waiter *w;
+		while ((w = coro_wait_list_pop(&group->waiters)) != NULL)
+			coro_waiter_grant(w);
+	}
+	coro_sync_unlock(&group->lock);
+}
+
+void
+coro_wait_group_wait(struct coro_wait_group *group)
+{
+	coro_sync_lock(&group->lock);
+	if (group->count == 0) {
+		coro_sync_unlock(&group->lock);
+		return;
+	}
+	struct coro_waiter w;
+	w.coro = coro_this();
+	w.is_granted = false;
+	coro_wait_list_push(&group->waiters, &w);
+	coro_waiter_wait(&w, &group->lock);
 }
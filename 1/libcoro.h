@@ -1,21 +1,181 @@
 #pragma once
 
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 
 struct coro;
+struct coro_engine;
 typedef void *(*coro_f)(void *);
 
+enum {
+	/** Maximal number of coroutine-local storage keys. */
+	CORO_KEY_MAX = 16,
+};
+
+/** Key of a coroutine-local value, see coro_key_create(). */
+typedef unsigned coro_key_t;
+
+/** Destructor of a coroutine-local value. */
+typedef void (*coro_key_destructor_f)(void *value);
+
+/** Descriptor events for coro_wait_fd(). */
+enum {
+	CORO_EVENT_READ = 1,
+	CORO_EVENT_WRITE = 2,
+};
+
+/** Coroutine creation attributes. */
+struct coro_attr {
+	/**
+	 * Stack size in bytes. It is rounded up to a power of 2.
+	 * Physical memory is only used by the pages the coroutine
+	 * actually touches. 0 means the scheduler default.
+	 */
+	size_t stack_size;
+};
+
+/**
+ * Limits of the pool of joined coroutines. They are kept to be
+ * reused by new coroutines without new allocations and page
+ * faults.
+ */
+struct coro_pool_policy {
+	/**
+	 * Maximal number of pooled coroutines. Surplus ones are
+	 * freed right when joined.
+	 */
+	size_t max_count;
+	/**
+	 * Maximal total size of the pooled stacks which can stay
+	 * resident in physical memory. Above that the stacks of
+	 * the newly pooled coroutines are trimmed.
+	 */
+	size_t max_resident_size;
+	/**
+	 * How many bytes at the top of a trimmed stack are kept
+	 * resident. The rest is given back to the kernel
+	 * via madvise(MADV_DONTNEED).
+	 */
+	size_t trim_keep_size;
+};
+
+/** Coroutine pool statistics. */
+struct coro_pool_stats {
+	/** Number of coroutines in the pool now. */
+	size_t count;
+	/** Stack bytes of the pooled coroutines accounted resident. */
+	size_t resident_size;
+	/** Number of new coroutines taken from the pool. */
+	size_t hit_count;
+	/** Number of new coroutines which had to be allocated. */
+	size_t miss_count;
+	/** Number of pooled stacks trimmed. */
+	size_t trim_count;
+	/** Number of coroutines freed because of the pool limits. */
+	size_t free_count;
+};
+
+/** Scheduling priorities, the most important first. */
+enum coro_priority {
+	CORO_PRIO_HIGH,
+	CORO_PRIO_NORMAL,
+	CORO_PRIO_LOW,
+	CORO_PRIO_COUNT,
+};
+
+/** Statistics of one scheduling priority. */
+struct coro_prio_stats {
+	/** Number of runnable coroutines waiting for their turn. */
+	size_t runnable_count;
+	/** Maximal runnable_count ever seen. */
+	size_t max_runnable_count;
+	/** Number of switches to the coroutines. */
+	size_t switch_count;
+};
+
+/**
+ * Profile counters of a coroutine. Collected only when libcoro is
+ * built with -DCORO_PROFILE=1. A pooled coroutine gets them reset
+ * when reused.
+ */
+struct coro_prof {
+	/** Total time the coroutine was running. */
+	uint64_t run_time_ns;
+	/** The longest time it was running without a switch. */
+	uint64_t max_slice_ns;
+	/** Number of switches to the coroutine. */
+	uint64_t switch_count;
+	/** Number of times it was woken up from a suspension. */
+	uint64_t wakeup_count;
+};
+
+typedef void (*coro_prof_f)(struct coro *coro, const struct coro_prof *prof,
+			    void *arg);
+
+enum {
+	/** Usage of the first histogram bucket is up to 2^10 bytes. */
+	CORO_STACK_PROF_MIN_LOG2 = 10,
+	/** The last one is up to 2^30 bytes, the biggest stack. */
+	CORO_STACK_PROF_BUCKET_COUNT = 21,
+};
+
+/**
+ * Stack usage of the coroutines running the same function.
+ * Collected only when libcoro is built with -DCORO_STACK_PROFILE=1.
+ */
+struct coro_stack_prof {
+	coro_f func;
+	/** Number of the finished runs of the function. */
+	uint64_t run_count;
+	/** The deepest usage seen, in bytes. */
+	size_t max_used;
+	/** The biggest stack the function ran on. */
+	size_t max_stack_size;
+	/**
+	 * Bucket i counts the runs which used up to
+	 * 2^(CORO_STACK_PROF_MIN_LOG2 + i) bytes, and more than the
+	 * previous bucket.
+	 */
+	uint64_t hist[CORO_STACK_PROF_BUCKET_COUNT];
+};
+
+typedef void (*coro_stack_prof_f)(const struct coro_stack_prof *prof,
+				  void *arg);
+
 /** Initialize the coroutines engine. */
 void
 coro_sched_init(void);
 
 /**
  * Run the coroutines processing while there are any runnable
- * ones.
+ * ones. Runs the engine of the calling thread, see
+ * coro_sched_thread_init().
  */
 void
 coro_sched_run(void);
 
+/**
+ * Same as coro_sched_run(), but the coroutines are run by
+ * @a thread_count threads, including the calling one. Idle
+ * threads steal runnable coroutines from the busy ones, so a
+ * coroutine can continue in another thread after any suspension
+ * point. coro_wakeup() can be called from any thread.
+ *
+ * In this mode a wakeup of a running coroutine is remembered and
+ * makes its next suspension return right away. Otherwise it would
+ * be impossible to check a condition and suspend without losing
+ * a concurrent wakeup. The coroutines must protect their shared
+ * data themselves.
+ *
+ * The function returns when there are no runnable coroutines
+ * left. Thread count <= 1 means the default single-threaded mode.
+ */
+void
+coro_sched_run_mt(int thread_count);
+
 /**
  * Destroy the coroutines engine. All coros must be finished by
  * now.
@@ -23,10 +183,184 @@ coro_sched_run(void);
 void
 coro_sched_destroy(void);
 
+/** What an engine has left after coro_sched_step(). */
+enum coro_sched_state {
+	/** No coroutines. */
+	CORO_SCHED_IDLE,
+	/**
+	 * Only the suspended ones which nothing but a coro_wakeup()
+	 * can resume.
+	 */
+	CORO_SCHED_SUSPENDED,
+	/**
+	 * Some wait for a timeout, for descriptors, or for the other
+	 * threads, see coro_remote_wait_begin().
+	 */
+	CORO_SCHED_WAITING,
+	/** Some are runnable. */
+	CORO_SCHED_RUNNABLE,
+};
+
+/**
+ * Give the calling thread an engine of its own. The coroutines
+ * created in this thread live in it and never leave the thread,
+ * and the scheduler functions work with it instead of the global
+ * one until coro_sched_thread_destroy(). Coroutines of different
+ * engines can wake each other up only with coro_wakeup_remote().
+ * Lets a thread which has its own loop, like a thread pool worker,
+ * run the coroutines between other work with coro_sched_step().
+ */
+void
+coro_sched_thread_init(void);
+
+/**
+ * Run one iteration of the scheduler of the calling thread: wake
+ * the coroutines up whose timeouts expired or descriptors are
+ * ready, and run each of the runnable ones once. When none is
+ * runnable, waits up to @a timeout seconds for the timers and the
+ * descriptors. Never blocks with @a timeout 0. Must be called
+ * outside of any coroutine.
+ *
+ * @return What is left to do, see enum coro_sched_state.
+ */
+enum coro_sched_state
+coro_sched_step(double timeout);
+
+/**
+ * Destroy the engine of the calling thread. All its coros must be
+ * finished and joined by now.
+ */
+void
+coro_sched_thread_destroy(void);
+
+/**
+ * Set the stack size used for the coroutines created without
+ * explicit attributes. 0 restores the default, which is 1MB.
+ */
+void
+coro_sched_set_stack_size(size_t size);
+
+/** Flags of coro_sched_set_stack_memory(). */
+enum {
+	/**
+	 * The stacks are cut from arenas of transparent huge pages,
+	 * so a 2MB page holds 128 stacks of 16KB in one TLB entry, and
+	 * the many coroutines switching in turn don't miss the TLB on
+	 * each switch. Such stacks have no guard pages, an overflow
+	 * corrupts the neighbour stack instead of a crash. They take
+	 * no VMAs of their own either, so there can be more of them
+	 * than /proc/sys/vm/max_map_count. But a huge page is resident
+	 * whole once any of its stacks touches it, and the trimming of
+	 * the pooled stacks splits it.
+	 */
+	CORO_STACK_HUGE_PAGES = 1 << 0,
+	/**
+	 * The stack memory is taken from the NUMA node of the thread
+	 * creating the coroutine, even if another thread touches it
+	 * first.
+	 */
+	CORO_STACK_NODE_LOCAL = 1 << 1,
+};
+
+/**
+ * Set the memory of the stacks of the new coroutines, a combination
+ * of the flags above. 0 is the default, a mapping per stack with a
+ * guard page. The pooled coroutines keep their stacks.
+ */
+void
+coro_sched_set_stack_memory(int flags);
+
+/**
+ * Initialize the pool policy with the default values - the pool
+ * is unlimited.
+ */
+void
+coro_pool_policy_create(struct coro_pool_policy *policy);
+
+/**
+ * Set the limits of the coroutine pool. The already pooled
+ * coroutines are freed and trimmed right away to fit them.
+ */
+void
+coro_sched_set_pool_policy(const struct coro_pool_policy *policy);
+
+/** Get the coroutine pool statistics. */
+void
+coro_sched_pool_stats(struct coro_pool_stats *stats);
+
+/** Get the statistics of the priority @a prio. */
+void
+coro_sched_prio_stats(enum coro_priority prio, struct coro_prio_stats *stats);
+
+/**
+ * Get the profile counters of a coroutine. The current slice of a
+ * running one isn't accounted yet.
+ *
+ * @retval true Success.
+ * @retval false The profiling is compiled out, all zeros.
+ */
+bool
+coro_prof(const struct coro *coro, struct coro_prof *prof);
+
+/**
+ * Call @a cb for each coroutine, which is not joined yet. The
+ * callback must not create or join coroutines.
+ */
+void
+coro_prof_foreach(coro_prof_f cb, void *arg);
+
+/** Print the profile counters of each not joined coroutine. */
+void
+coro_prof_dump(FILE *out);
+
+/**
+ * Call @a cb for the stack usage of each coroutine function which
+ * has finished at least once. The callback must not create or join
+ * coroutines.
+ *
+ * @retval true Success.
+ * @retval false The stack profiling is compiled out.
+ */
+bool
+coro_stack_prof_foreach(coro_stack_prof_f cb, void *arg);
+
+/**
+ * Print the stack usage histogram of each coroutine function, and
+ * the smallest stack size class fitting the deepest usage twice.
+ */
+void
+coro_stack_prof_dump(FILE *out);
+
 /** Get the currently working coroutine. */
 struct coro *
 coro_this(void);
 
+/**
+ * Create a key of coroutine-local values, like pthread_key_create()
+ * for threads. Each coroutine has its own value for the key, NULL
+ * until set. When the coroutine function returns, @a destructor is
+ * called for the non-NULL values, if it is not NULL. The keys are
+ * never deleted, so they are supposed to be created once at start,
+ * by the modules needing them.
+ *
+ * @retval 0 Success, the key is in @a key.
+ * @retval -1 All CORO_KEY_MAX keys are taken, errno is EAGAIN.
+ */
+int
+coro_key_create(coro_key_t *key, coro_key_destructor_f destructor);
+
+/**
+ * Get the value of the current coroutine for the key. Outside of
+ * coroutines the scheduler has its own values, without the
+ * destructors.
+ */
+void *
+coro_getspecific(coro_key_t key);
+
+/** Set the value of the current coroutine for the key. */
+void
+coro_setspecific(coro_key_t key, const void *value);
+
 /**
  * Create a new coroutine. The function won't yield. The coroutine
  * will start execution automatically on the next iteration of the
@@ -38,6 +372,28 @@ coro_this(void);
 struct coro *
 coro_new(coro_f func, void *func_arg);
 
+/** Initialize the attributes with the default values. */
+void
+coro_attr_create(struct coro_attr *attr);
+
+/**
+ * Same as coro_new(), but with creation attributes. NULL
+ * attributes mean the defaults.
+ */
+struct coro *
+coro_new_ex(coro_f func, void *func_arg, const struct coro_attr *attr);
+
+/**
+ * Create @a count coroutines running @a func, the i-th one with
+ * the argument @a func_args[i], and store them into @a out. NULL
+ * @a func_args means NULL arguments for all. Same as calling
+ * coro_new() for each, but the objects and stacks are allocated
+ * in bulk, so it is much cheaper for big fan-outs.
+ */
+void
+coro_new_batch(coro_f func, void **func_args, size_t count,
+	struct coro **out);
+
 /**
  * Join a coroutine. When joined, its resources are freed, and the
  * result of its callback function is returned. Each coroutine
@@ -46,6 +402,19 @@ coro_new(coro_f func, void *func_arg);
 void *
 coro_join(struct coro *coro);
 
+/**
+ * Join any of @a count coroutines, the first finished one. The
+ * current coroutine is suspended until one of them finishes, and is
+ * woken up once for that, not for each. None of them can be joined
+ * by another coroutine at the same time. The others stay not
+ * joined.
+ *
+ * @param ret If not NULL, the result of the joined coroutine.
+ * @return Index of the joined coroutine in @a coros.
+ */
+size_t
+coro_join_any(struct coro **coros, size_t count, void **ret);
+
 /**
  * Pause the current coroutine until its explicitly woken up with
  * coro_wakeup(). Can be used to wait for some event, which will
@@ -54,6 +423,86 @@ coro_join(struct coro *coro);
 void
 coro_suspend(void);
 
+/**
+ * Same as coro_suspend(), but the coroutine is also woken up
+ * automatically after @a timeout seconds. While there are only
+ * the timers to wait for, the scheduler sleeps instead of
+ * spinning. Only the single-threaded mode is supported.
+ *
+ * @retval true Woken up explicitly with coro_wakeup().
+ * @retval false The timeout has expired.
+ */
+bool
+coro_suspend_timeout(double timeout);
+
+/**
+ * Pause the current coroutine until the descriptor @a fd gets any
+ * of the @a events (CORO_EVENT_* flags), @a timeout seconds pass,
+ * or it is woken up with coro_wakeup(). Negative timeout means
+ * infinity. While the coroutines are waiting, the scheduler polls
+ * the descriptors once per iteration, and sleeps in the poll when
+ * nothing else is runnable. Errors and hangups are reported as all
+ * the awaited events, so the next read or write reveals them.
+ *
+ * Only one coroutine at a time can wait for the same descriptor.
+ * Only the single-threaded mode on Linux is supported.
+ *
+ * @retval >0 The happened events.
+ * @retval 0 Timeout or explicit wakeup.
+ * @retval -1 The descriptor can't be waited for, errno is set.
+ */
+int
+coro_wait_fd(int fd, int events, double timeout);
+
+struct coro_fd_watch;
+
+/**
+ * Callback of a descriptor watch. @a events are the happened
+ * CORO_EVENT_* flags.
+ */
+typedef void (*coro_fd_watch_f)(struct coro_fd_watch *watch, int events);
+
+/** A descriptor watched by the scheduler itself. */
+struct coro_fd_watch {
+	/** Called when the descriptor is ready. */
+	coro_fd_watch_f func;
+	/** Argument for the callback. */
+	void *arg;
+	int fd;
+	/** Awaited CORO_EVENT_* flags. */
+	int events;
+};
+
+/**
+ * Start watching the descriptor. The callback is called from the
+ * scheduler each time it polls and the descriptor is ready, while
+ * the watch is started. It can wakeup coroutines, but must not
+ * suspend or yield. For example, threads outside of the scheduler
+ * can wakeup its coroutines via an eventfd. The scheduler doesn't
+ * exit while there are started watches, it sleeps in the poll when
+ * nothing else is runnable.
+ *
+ * The watch must stay valid until stopped. Only the
+ * single-threaded mode on Linux is supported.
+ *
+ * @retval 0 Success.
+ * @retval -1 The descriptor can't be watched, errno is set.
+ */
+int
+coro_watch_fd_start(struct coro_fd_watch *watch);
+
+/** Stop a started watch. */
+void
+coro_watch_fd_stop(struct coro_fd_watch *watch);
+
+/**
+ * Pause the current coroutine for @a timeout seconds. Same as
+ * coro_suspend_timeout(), so it can be woken up earlier by
+ * coro_wakeup().
+ */
+void
+coro_sleep(double timeout);
+
 /**
  * Pause the current coroutine until the next iteration of the
  * scheduler. Can be used to let the other coroutines work for a
@@ -62,6 +511,17 @@ coro_suspend(void);
 void
 coro_yield(void);
 
+/**
+ * Set the scheduling priority of a coroutine. New coroutines have
+ * CORO_PRIO_NORMAL. Each iteration the scheduler runs up to
+ * 256 runnable coroutines of the high priority, then up to 128 of
+ * the normal one, and up to 64 of the low one. The rest wait for
+ * the next iteration, so no priority starves. Ignored in the
+ * multi-threaded mode.
+ */
+void
+coro_set_priority(struct coro *coro, enum coro_priority prio);
+
 /**
  * Wakeup a coroutine. If it was suspended, then it is going to be
  * continued on the next iteration of the scheduler. Otherwise
@@ -69,3 +529,204 @@ coro_yield(void);
  */
 void
 coro_wakeup(struct coro *coro);
+
+/**
+ * Same as calling coro_wakeup() for each of @a count coroutines,
+ * but they are put into the run queue together. The ones which are
+ * not suspended, including the repeated ones, are skipped.
+ */
+void
+coro_wakeup_many(struct coro **coros, size_t count);
+
+/**
+ * The current coroutine is going to wait for a wakeup from another
+ * thread, maybe running another engine. Until the matching
+ * coro_remote_wait_end() the engine doesn't finish coro_sched_run()
+ * for the lack of work, and when it has nothing to run, it sleeps
+ * in a poll which the remote wakeups interrupt.
+ *
+ * @return The engine of the coroutine for coro_wakeup_remote().
+ *     NULL in the multi-threaded mode, where any thread can wake
+ *     anybody up with coro_wakeup() anyway.
+ */
+struct coro_engine *
+coro_remote_wait_begin(void);
+
+/** Finish a wait started with coro_remote_wait_begin(). */
+void
+coro_remote_wait_end(struct coro_engine *engine);
+
+/**
+ * Wakeup a coroutine of @a engine from any thread. When it is the
+ * engine of the calling thread, it is the same as coro_wakeup().
+ * Otherwise the coroutine is pushed into the lock-free queue of
+ * remote wakeups of its engine, and the engine wakes it up on its
+ * next iteration. The coroutine must be in a wait started with
+ * coro_remote_wait_begin(), which returned @a engine.
+ */
+void
+coro_wakeup_remote(struct coro_engine *engine, struct coro *coro);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Synchronization of the coroutines. A coroutine which can't get
+// the mutex or the semaphore unit is suspended in a FIFO of
+// waiters, and the waiters are linked through their own stacks,
+// no allocation. A release hands the mutex or the unit directly
+// to the first waiter, so a coroutine which comes later can't
+// take it in between, and the woken one doesn't need to retry.
+// They work in the multi-threaded mode too.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+struct coro_waiter;
+
+/** FIFO of the suspended coroutines. */
+struct coro_wait_list {
+	struct coro_waiter *first;
+	struct coro_waiter *last;
+};
+
+struct coro_mutex {
+	/** Protects the fields in the multi-threaded mode. */
+	atomic_flag lock;
+	/** The coroutine holding the mutex, or NULL. */
+	struct coro *owner;
+	struct coro_wait_list waiters;
+};
+
+struct coro_cond {
+	atomic_flag lock;
+	/** The mutex of the current waiters. */
+	struct coro_mutex *mutex;
+	struct coro_wait_list waiters;
+};
+
+struct coro_sem {
+	atomic_flag lock;
+	/** Units not taken by anybody. While there are waiters it is 0. */
+	size_t count;
+	struct coro_wait_list waiters;
+};
+
+/** Initialize an unlocked mutex. */
+void
+coro_mutex_create(struct coro_mutex *mutex);
+
+/** Destroy the mutex. It must be unlocked and have no waiters. */
+void
+coro_mutex_destroy(struct coro_mutex *mutex);
+
+/**
+ * Lock the mutex. If it is locked, the current coroutine is
+ * suspended until the mutex is handed over to it. The mutex is
+ * not recursive.
+ */
+void
+coro_mutex_lock(struct coro_mutex *mutex);
+
+/** Lock the mutex if it is free. Returns whether it was locked. */
+bool
+coro_mutex_trylock(struct coro_mutex *mutex);
+
+/**
+ * Unlock the mutex held by the current coroutine. If there are
+ * waiters, the first one becomes the owner and is woken up.
+ */
+void
+coro_mutex_unlock(struct coro_mutex *mutex);
+
+void
+coro_cond_create(struct coro_cond *cond);
+
+/** Destroy the condition variable. It must have no waiters. */
+void
+coro_cond_destroy(struct coro_cond *cond);
+
+/**
+ * Unlock the @a mutex held by the current coroutine, suspend until
+ * the condition is signaled, and lock the mutex again. All the
+ * waiters at the same time must use the same mutex. Spurious
+ * wakeups don't happen, but the condition can change before the
+ * mutex is taken back, so it should be checked in a loop anyway.
+ */
+void
+coro_cond_wait(struct coro_cond *cond, struct coro_mutex *mutex);
+
+/**
+ * Wakeup the first waiter of the condition. If the mutex is
+ * locked, the waiter is moved into the mutex's waiters instead,
+ * and is woken up only when the mutex is handed over to it.
+ */
+void
+coro_cond_signal(struct coro_cond *cond);
+
+/**
+ * Same as coro_cond_signal() for all the waiters. Only the first
+ * one can get the mutex, the others are queued into the mutex,
+ * so they don't wake up to just suspend on it again.
+ */
+void
+coro_cond_broadcast(struct coro_cond *cond);
+
+/**
+ * Counter of unfinished jobs, like Go's sync.WaitGroup. The waiters
+ * are woken up once, when it drops to zero.
+ */
+struct coro_wait_group {
+	atomic_flag lock;
+	size_t count;
+	struct coro_wait_list waiters;
+};
+
+/** Initialize a wait group with no jobs. */
+void
+coro_wait_group_create(struct coro_wait_group *group);
+
+/** Destroy the wait group. It must have no waiters. */
+void
+coro_wait_group_destroy(struct coro_wait_group *group);
+
+/** Add @a count jobs. It is done before starting them. */
+void
+coro_wait_group_add(struct coro_wait_group *group, size_t count);
+
+/**
+ * Finish a job. The last one wakes up all the waiters. Doesn't
+ * suspend. A coroutine calling it at its end is not finished yet,
+ * so a join right after the wait can still suspend shortly in the
+ * multi-threaded mode.
+ */
+void
+coro_wait_group_done(struct coro_wait_group *group);
+
+/** Suspend until all the jobs are done. */
+void
+coro_wait_group_wait(struct coro_wait_group *group);
+
+/** Initialize a counting semaphore with @a count units. */
+void
+coro_sem_create(struct coro_sem *sem, size_t count);
+
+/** Destroy the semaphore. It must have no waiters. */
+void
+coro_sem_destroy(struct coro_sem *sem);
+
+/**
+ * Take a unit of the semaphore. If there are none, the current
+ * coroutine is suspended until a unit is handed over to it.
+ */
+void
+coro_sem_wait(struct coro_sem *sem);
+
+/** Take a unit if there is one. Returns whether it was taken. */
+bool
+coro_sem_trywait(struct coro_sem *sem);
+
+/**
+ * Return a unit to the semaphore. If there are waiters, the first
+ * one gets it and is woken up. Doesn't suspend, so it can be
+ * called from coro_fd_watch callbacks too.
+ */
+void
+coro_sem_post(struct coro_sem *sem);
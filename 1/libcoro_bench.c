@@ -0,0 +1,610 @@
+#include "libcoro.h"
+#include "unit_bench.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * Microbenchmarks of the coroutine engine on ../utils/unit_bench.h.
+ * The arg of a bench is the number of the live coroutines, if it
+ * matters. The benches run in a coroutine, so the setup of each one
+ * can spawn and join the others.
+ */
+
+enum {
+	/** Stack size of the coroutines in the many-coros scenarios. */
+	BENCH_SMALL_STACK_SIZE = 16 * 1024,
+};
+
+/** Number of coroutines which have started. */
+static long started_count = 0;
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+bench_nop_f(void *arg)
+{
+	return arg;
+}
+
+static void
+bench_spawn(long iterations, long live_count)
+{
+	(void)live_count;
+	for (long i = 0; i < iterations; ++i)
+		coro_join(coro_new(bench_nop_f, NULL));
+}
+
+/** Each spawn allocates and maps a new coroutine. */
+static void
+bench_cold_spawn(long iterations, long live_count)
+{
+	bench_pause();
+	struct coro_pool_policy policy;
+	coro_pool_policy_create(&policy);
+	policy.max_count = 0;
+	coro_sched_set_pool_policy(&policy);
+	bench_resume();
+	bench_spawn(iterations, live_count);
+	bench_pause();
+	coro_pool_policy_create(&policy);
+	coro_sched_set_pool_policy(&policy);
+	bench_resume();
+}
+
+static void
+bench_pooled_spawn(long iterations, long live_count)
+{
+	/* Warm the pool up. */
+	bench_pause();
+	coro_join(coro_new(bench_nop_f, NULL));
+	bench_resume();
+	bench_spawn(iterations, live_count);
+}
+
+/**
+ * Cold spawn of @a count coroutines at once and join of all of
+ * them, with or without coro_new_batch().
+ */
+static void
+bench_fan_out(long count, bool is_batch)
+{
+	bench_pause();
+	struct coro_pool_policy policy;
+	coro_pool_policy_create(&policy);
+	policy.max_count = 0;
+	coro_sched_set_pool_policy(&policy);
+	struct coro **coros = malloc(sizeof(coros[0]) * count);
+	bench_resume();
+	if (is_batch) {
+		coro_new_batch(bench_nop_f, NULL, count, coros);
+	} else {
+		for (long i = 0; i < count; ++i)
+			coros[i] = coro_new(bench_nop_f, NULL);
+	}
+	for (long i = 0; i < count; ++i)
+		coro_join(coros[i]);
+	bench_pause();
+	free(coros);
+	coro_pool_policy_create(&policy);
+	coro_sched_set_pool_policy(&policy);
+	bench_resume();
+}
+
+static void
+bench_fan_out_loop(long iterations, long live_count)
+{
+	(void)live_count;
+	bench_fan_out(iterations, false);
+}
+
+static void
+bench_fan_out_batch(long iterations, long live_count)
+{
+	(void)live_count;
+	bench_fan_out(iterations, true);
+}
+
+static void *
+bench_start_f(void *arg)
+{
+	++started_count;
+	return arg;
+}
+
+/**
+ * Yield until @a count coroutines have started. A scheduler
+ * iteration doesn't run all the runnable coroutines when there
+ * are many.
+ */
+static void
+bench_wait_started(long count)
+{
+	while (started_count < count)
+		coro_yield();
+	started_count = 0;
+}
+
+static void *
+bench_yield_f(void *arg)
+{
+	++started_count;
+	long count = *(long *)arg;
+	for (long i = 0; i < count; ++i)
+		coro_yield();
+	return NULL;
+}
+
+/** Two coroutines yielding to each other. One op is one switch. */
+static void
+bench_yield_ping_pong(long iterations, long live_count)
+{
+	(void)live_count;
+	bench_pause();
+	long count = iterations / 2;
+	struct coro *a = coro_new(bench_yield_f, &count);
+	struct coro *b = coro_new(bench_yield_f, &count);
+	bench_resume();
+	coro_join(a);
+	coro_join(b);
+	started_count = 0;
+}
+
+struct bench_wakeup_ctx {
+	struct coro *peer;
+	long count;
+};
+
+static void *
+bench_wakeup_f(void *arg)
+{
+	struct bench_wakeup_ctx *ctx = arg;
+	for (long i = 0; i < ctx->count; ++i) {
+		coro_wakeup(ctx->peer);
+		coro_suspend();
+	}
+	coro_wakeup(ctx->peer);
+	return NULL;
+}
+
+/**
+ * Two coroutines waking each other up and suspending. One op is
+ * one suspend + wakeup.
+ */
+static void
+bench_suspend_wakeup(long iterations, long live_count)
+{
+	(void)live_count;
+	bench_pause();
+	struct bench_wakeup_ctx ctx_a, ctx_b;
+	ctx_a.count = iterations / 2;
+	ctx_b.count = iterations / 2;
+	struct coro *a = coro_new(bench_wakeup_f, &ctx_a);
+	struct coro *b = coro_new(bench_wakeup_f, &ctx_b);
+	ctx_a.peer = b;
+	ctx_b.peer = a;
+	bench_resume();
+	coro_join(a);
+	coro_join(b);
+}
+
+/** Join of the already finished coroutines. */
+static void
+bench_join(long iterations, long live_count)
+{
+	(void)live_count;
+	bench_pause();
+	struct coro **coros = malloc(sizeof(coros[0]) * iterations);
+	struct coro_attr attr;
+	coro_attr_create(&attr);
+	attr.stack_size = BENCH_SMALL_STACK_SIZE;
+	for (long i = 0; i < iterations; ++i)
+		coros[i] = coro_new_ex(bench_start_f, NULL, &attr);
+	/* Let them all finish. */
+	bench_wait_started(iterations);
+	coro_yield();
+	bench_resume();
+	for (long i = 0; i < iterations; ++i)
+		coro_join(coros[i]);
+	bench_pause();
+	free(coros);
+	bench_resume();
+}
+
+/**
+ * @a live_count coroutines yielding in a loop. One iteration is
+ * one switch, so the cache and TLB misses of big run queues are seen.
+ * The iterations are a multiple of @a live_count.
+ */
+static void
+bench_switch_live(long iterations, long live_count)
+{
+	bench_pause();
+	struct coro **coros = malloc(sizeof(coros[0]) * live_count);
+	struct coro_attr attr;
+	coro_attr_create(&attr);
+	attr.stack_size = BENCH_SMALL_STACK_SIZE;
+	long count = iterations / live_count;
+	for (long i = 0; i < live_count; ++i)
+		coros[i] = coro_new_ex(bench_yield_f, &count, &attr);
+	/* Let them all start, not measuring the first touch. */
+	bench_wait_started(live_count);
+	bench_resume();
+	for (long i = 0; i < live_count; ++i)
+		coro_join(coros[i]);
+	bench_pause();
+	free(coros);
+	bench_resume();
+}
+
+/** One op is a get and a set of a coroutine-local value. */
+static void
+bench_key_get_set(long iterations, long live_count)
+{
+	(void)live_count;
+	static coro_key_t key;
+	static bool is_key_created = false;
+	bench_pause();
+	if (!is_key_created) {
+		if (coro_key_create(&key, NULL) != 0)
+			abort();
+		is_key_created = true;
+	}
+	bench_resume();
+	for (long i = 0; i < iterations; ++i) {
+		uintptr_t value = (uintptr_t)coro_getspecific(key);
+		coro_setspecific(key, (void *)(value + 1));
+	}
+	bench_pause();
+	if ((uintptr_t)coro_getspecific(key) == 0)
+		abort();
+	coro_setspecific(key, NULL);
+	bench_resume();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct bench_lock_ctx {
+	struct coro_mutex mutex;
+	struct coro_sem sem;
+	struct coro_cond cond;
+	/** The lock of the yield-and-retry scenario. */
+	bool is_locked;
+	long count;
+	/** Turn of the cond ping-pong. */
+	int turn;
+};
+
+/**
+ * The critical sections include a yield, so the others come while
+ * the lock is held, and it is contended all the time.
+ */
+static void *
+bench_mutex_f(void *arg)
+{
+	struct bench_lock_ctx *ctx = arg;
+	++started_count;
+	for (long i = 0; i < ctx->count; ++i) {
+		coro_mutex_lock(&ctx->mutex);
+		coro_yield();
+		coro_mutex_unlock(&ctx->mutex);
+	}
+	return NULL;
+}
+
+/** The same, but a waiter yields and checks again until it's free. */
+static void *
+bench_spin_yield_f(void *arg)
+{
+	struct bench_lock_ctx *ctx = arg;
+	++started_count;
+	for (long i = 0; i < ctx->count; ++i) {
+		while (ctx->is_locked)
+			coro_yield();
+		ctx->is_locked = true;
+		coro_yield();
+		ctx->is_locked = false;
+	}
+	return NULL;
+}
+
+static void *
+bench_sem_f(void *arg)
+{
+	struct bench_lock_ctx *ctx = arg;
+	++started_count;
+	for (long i = 0; i < ctx->count; ++i) {
+		coro_sem_wait(&ctx->sem);
+		coro_yield();
+		coro_sem_post(&ctx->sem);
+	}
+	return NULL;
+}
+
+/**
+ * @a live_count coroutines taking the same lock in a loop. One
+ * iteration is one pass through the critical section. The iterations
+ * are a multiple of @a live_count.
+ */
+static void
+bench_lock_contended(long iterations, long live_count, coro_f func,
+		     size_t sem_count)
+{
+	bench_pause();
+	struct bench_lock_ctx ctx;
+	coro_mutex_create(&ctx.mutex);
+	coro_sem_create(&ctx.sem, sem_count);
+	ctx.is_locked = false;
+	ctx.count = iterations / live_count;
+	struct coro **coros = malloc(sizeof(coros[0]) * live_count);
+	struct coro_attr attr;
+	coro_attr_create(&attr);
+	attr.stack_size = BENCH_SMALL_STACK_SIZE;
+	for (long i = 0; i < live_count; ++i)
+		coros[i] = coro_new_ex(func, &ctx, &attr);
+	bench_wait_started(live_count);
+	bench_resume();
+	for (long i = 0; i < live_count; ++i)
+		coro_join(coros[i]);
+	bench_pause();
+	free(coros);
+	coro_sem_destroy(&ctx.sem);
+	coro_mutex_destroy(&ctx.mutex);
+	bench_resume();
+}
+
+static void
+bench_mutex_contended(long iterations, long live_count)
+{
+	bench_lock_contended(iterations, live_count, bench_mutex_f, 0);
+}
+
+static void
+bench_spin_yield_contended(long iterations, long live_count)
+{
+	bench_lock_contended(iterations, live_count, bench_spin_yield_f,
+				    0);
+}
+
+/** A quarter of the coroutines can be inside at once. */
+static void
+bench_sem_contended(long iterations, long live_count)
+{
+	bench_lock_contended(iterations, live_count, bench_sem_f,
+				    (live_count + 3) / 4);
+}
+
+static void *
+bench_cond_f(void *arg)
+{
+	struct bench_lock_ctx *ctx = arg;
+	int id = started_count++;
+	coro_mutex_lock(&ctx->mutex);
+	for (long i = 0; i < ctx->count; ++i) {
+		while (ctx->turn != id)
+			coro_cond_wait(&ctx->cond, &ctx->mutex);
+		ctx->turn = 1 - id;
+		coro_cond_signal(&ctx->cond);
+	}
+	coro_mutex_unlock(&ctx->mutex);
+	return NULL;
+}
+
+/**
+ * Two coroutines passing the turn to each other via a condition
+ * variable. One op is one pass.
+ */
+static void
+bench_cond_ping_pong(long iterations, long live_count)
+{
+	(void)live_count;
+	bench_pause();
+	struct bench_lock_ctx ctx;
+	coro_mutex_create(&ctx.mutex);
+	coro_cond_create(&ctx.cond);
+	ctx.count = iterations / 2;
+	ctx.turn = 0;
+	struct coro *a = coro_new(bench_cond_f, &ctx);
+	struct coro *b = coro_new(bench_cond_f, &ctx);
+	bench_resume();
+	coro_join(a);
+	coro_join(b);
+	bench_pause();
+	started_count = 0;
+	coro_cond_destroy(&ctx.cond);
+	coro_mutex_destroy(&ctx.mutex);
+	bench_resume();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+enum bench_fan_in_mode {
+	BENCH_FAN_IN_JOIN,
+	BENCH_FAN_IN_WAIT_GROUP,
+	BENCH_FAN_IN_JOIN_ANY,
+};
+
+struct bench_fan_in_ctx {
+	struct coro_wait_group group;
+};
+
+/**
+ * Children finish one per scheduler iteration, in the order of
+ * their creation. So the sequential joins wait for each of them.
+ */
+static void *
+bench_fan_in_f(void *arg)
+{
+	struct bench_fan_in_ctx *ctx = arg;
+	long count = started_count++;
+	for (long i = 0; i < count; ++i)
+		coro_yield();
+	coro_wait_group_done(&ctx->group);
+	return NULL;
+}
+
+/**
+ * A parent waiting for @a live_count children. One iteration is one
+ * child, its spawn, run and join. The iterations are a multiple of
+ * @a live_count.
+ */
+static void
+bench_fan_in(long iterations, long live_count, enum bench_fan_in_mode mode)
+{
+	bench_pause();
+	struct coro **coros = malloc(sizeof(coros[0]) * live_count);
+	struct bench_fan_in_ctx ctx;
+	coro_wait_group_create(&ctx.group);
+	struct coro_attr attr;
+	coro_attr_create(&attr);
+	attr.stack_size = BENCH_SMALL_STACK_SIZE;
+	long rounds = iterations / live_count;
+	bench_resume();
+	for (long r = 0; r < rounds; ++r) {
+		started_count = 0;
+		coro_wait_group_add(&ctx.group, live_count);
+		for (long i = 0; i < live_count; ++i)
+			coros[i] = coro_new_ex(bench_fan_in_f, &ctx, &attr);
+		switch (mode) {
+		case BENCH_FAN_IN_JOIN:
+			for (long i = 0; i < live_count; ++i)
+				coro_join(coros[i]);
+			break;
+		case BENCH_FAN_IN_WAIT_GROUP:
+			coro_wait_group_wait(&ctx.group);
+			for (long i = 0; i < live_count; ++i)
+				coro_join(coros[i]);
+			break;
+		case BENCH_FAN_IN_JOIN_ANY:
+			for (long count = live_count; count > 0;) {
+				size_t i = coro_join_any(coros, count, NULL);
+				coros[i] = coros[--count];
+			}
+			break;
+		}
+	}
+	bench_pause();
+	started_count = 0;
+	coro_wait_group_destroy(&ctx.group);
+	free(coros);
+	bench_resume();
+}
+
+static void
+bench_fan_in_join(long iterations, long live_count)
+{
+	bench_fan_in(iterations, live_count, BENCH_FAN_IN_JOIN);
+}
+
+static void
+bench_fan_in_wait_group(long iterations, long live_count)
+{
+	bench_fan_in(iterations, live_count, BENCH_FAN_IN_WAIT_GROUP);
+}
+
+static void
+bench_fan_in_join_any(long iterations, long live_count)
+{
+	bench_fan_in(iterations, live_count, BENCH_FAN_IN_JOIN_ANY);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Each coroutine stack takes 2 memory mappings - the stack itself
+ * and the guard page. The total mapping count is limited in Linux.
+ */
+static long
+bench_max_live_count(long requested)
+{
+	FILE *f = fopen("/proc/sys/vm/max_map_count", "r");
+	if (f == NULL)
+		return requested;
+	long max_map_count;
+	if (fscanf(f, "%ld", &max_map_count) != 1)
+		max_map_count = 0;
+	fclose(f);
+	/* Leave some for the process itself. */
+	long limit = (max_map_count - 1024) / 2;
+	if (limit <= 0 || limit >= requested)
+		return requested;
+	return limit;
+}
+
+/** @a iterations rounded down to a multiple of @a live_count. */
+static long
+bench_round(long iterations, long live_count)
+{
+	if (iterations < live_count)
+		return live_count;
+	return iterations / live_count * live_count;
+}
+
+struct bench_args {
+	int argc;
+	char **argv;
+	int rc;
+};
+
+static void *
+bench_main_f(void *arg)
+{
+	struct bench_args *args = arg;
+	bench_register("cold_spawn", bench_cold_spawn, 10000);
+	bench_register("fan_out_loop", bench_fan_out_loop, 10000);
+	bench_register("fan_out_batch", bench_fan_out_batch, 10000);
+	bench_register("pooled_spawn", bench_pooled_spawn, 1000000);
+	bench_register("yield_ping_pong", bench_yield_ping_pong, 2000000);
+	bench_register("suspend_wakeup", bench_suspend_wakeup, 2000000);
+	bench_register("join", bench_join, 10000);
+	const long live_counts[] = {10, 1000, 100000};
+	for (size_t i = 0; i < sizeof(live_counts) / sizeof(live_counts[0]);
+	     ++i) {
+		long count = bench_max_live_count(live_counts[i]);
+		bench_register_arg("switch_live", bench_switch_live,
+				   bench_round(2000000, count), count);
+	}
+	const long lock_counts[] = {2, 10, 100};
+	for (size_t i = 0; i < sizeof(lock_counts) / sizeof(lock_counts[0]);
+	     ++i) {
+		long count = lock_counts[i];
+		long iterations = bench_round(200000, count);
+		bench_register_arg("mutex_contended", bench_mutex_contended,
+				   iterations, count);
+		bench_register_arg("spin_yield_contended",
+				   bench_spin_yield_contended, iterations,
+				   count);
+		bench_register_arg("sem_contended", bench_sem_contended,
+				   iterations, count);
+	}
+	bench_register("cond_ping_pong", bench_cond_ping_pong, 2000000);
+	bench_register("key_get_set", bench_key_get_set, 10000000);
+	const long fan_in_counts[] = {10, 100};
+	for (size_t i = 0;
+	     i < sizeof(fan_in_counts) / sizeof(fan_in_counts[0]); ++i) {
+		long count = fan_in_counts[i];
+		long iterations = bench_round(100000, count);
+		bench_register_arg("fan_in_join", bench_fan_in_join,
+				   iterations, count);
+		bench_register_arg("fan_in_wait_group",
+				   bench_fan_in_wait_group, iterations, count);
+		bench_register_arg("fan_in_join_any", bench_fan_in_join_any,
+				   iterations, count);
+	}
+	args->rc = bench_main(args->argc, args->argv);
+	return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bench_args args = {argc, argv, 0};
+	coro_sched_init();
+	struct coro *c = coro_new(bench_main_f, &args);
+	coro_sched_run();
+	coro_join(c);
+	coro_sched_destroy();
+	return args.rc;
+}
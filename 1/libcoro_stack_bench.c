@@ -0,0 +1,230 @@
+#include "libcoro.h"
+#include "unit_bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Coroutine stacks on the usual pages vs on the huge pages of
+ * CORO_STACK_HUGE_PAGES. The many live coroutines yield in turn, so
+ * each switch is to another stack, and with 4KB pages to another TLB
+ * entry. The spawn is of the cold coroutines, the page faults of the
+ * first touch of their stacks included.
+ *
+ * The arg of a bench is the number of the live coroutines. The usual
+ * stacks take 2 VMAs each, the mapping and the guard, so their count
+ * is limited by /proc/sys/vm/max_map_count. The huge ones have no
+ * such limit, and are also run with all of BENCH_LIVE_COUNT.
+ *
+ * The resident memory and the huge part of it, as seen in
+ * /proc/self/smaps_rollup, are added to the info of the report. Run
+ * with BENCH_ARGS="--perf" to see the dTLB misses and page faults, if
+ * perf_event has them.
+ */
+
+enum {
+	BENCH_LIVE_COUNT = 100000,
+	BENCH_STACK_SIZE = 16 * 1024,
+	/** Touched by each coroutine on each turn. */
+	BENCH_FRAME_SIZE = 512,
+};
+
+/** Stack memory flags of the coroutines in the pool. */
+static int pool_flags = 0;
+
+/** A field of /proc/self/smaps_rollup in KB, like "Rss:". */
+static long
+bench_smaps_kb(const char *key)
+{
+	FILE *f = fopen("/proc/self/smaps_rollup", "r");
+	if (f == NULL)
+		return -1;
+	char line[256];
+	long res = -1;
+	size_t len = strlen(key);
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (strncmp(line, key, len) == 0) {
+			res = strtol(line + len, NULL, 10);
+			break;
+		}
+	}
+	fclose(f);
+	return res;
+}
+
+/** Free the pooled coroutines, so the next ones get the new stacks. */
+static void
+bench_drop_pool(void)
+{
+	struct coro_pool_policy policy;
+	coro_pool_policy_create(&policy);
+	policy.max_count = 0;
+	coro_sched_set_pool_policy(&policy);
+	coro_pool_policy_create(&policy);
+	coro_sched_set_pool_policy(&policy);
+}
+
+static void
+bench_set_flags(int flags)
+{
+	if (flags != pool_flags)
+		bench_drop_pool();
+	pool_flags = flags;
+	coro_sched_set_stack_memory(flags);
+	coro_sched_set_stack_size(BENCH_STACK_SIZE);
+}
+
+static void
+bench_info_memory(const char *name, long live_count)
+{
+	char key[128], value[128];
+	snprintf(key, sizeof(key), "%s_%ld", name, live_count);
+	snprintf(value, sizeof(value), "rss %ld KB, huge %ld KB",
+		 bench_smaps_kb("Rss:"), bench_smaps_kb("AnonHugePages:"));
+	bench_info(key, value);
+}
+
+static void *
+bench_yield_f(void *arg)
+{
+	long count = *(long *)arg;
+	for (long i = 0; i < count; ++i) {
+		volatile char frame[BENCH_FRAME_SIZE];
+		memset((char *)frame, i, sizeof(frame));
+		coro_yield();
+	}
+	return NULL;
+}
+
+/** One iteration is one switch. */
+static void
+bench_switch(long iterations, long live_count, int flags, const char *name)
+{
+	bench_pause();
+	bench_set_flags(flags);
+	struct coro **coros = malloc(sizeof(coros[0]) * live_count);
+	long count = iterations / live_count;
+	if (count == 0)
+		count = 1;
+	void **args = malloc(sizeof(args[0]) * live_count);
+	for (long i = 0; i < live_count; ++i)
+		args[i] = &count;
+	coro_new_batch(bench_yield_f, args, live_count, coros);
+	/* The first turn, with the first touch, is not measured. */
+	coro_yield();
+	bench_info_memory(name, live_count);
+	bench_resume();
+	for (long i = 0; i < live_count; ++i)
+		coro_join(coros[i]);
+	bench_pause();
+	free(args);
+	free(coros);
+	bench_resume();
+}
+
+static void
+bench_switch_4k(long iterations, long live_count)
+{
+	bench_switch(iterations, live_count, 0, "switch_4k");
+}
+
+static void
+bench_switch_huge(long iterations, long live_count)
+{
+	bench_switch(iterations, live_count, CORO_STACK_HUGE_PAGES,
+		     "switch_huge");
+}
+
+static void *
+bench_touch_f(void *arg)
+{
+	volatile char frame[BENCH_FRAME_SIZE];
+	memset((char *)frame, 0, sizeof(frame));
+	return arg;
+}
+
+/** One iteration is a spawn and a join of a new coroutine. */
+static void
+bench_spawn(long iterations, int flags)
+{
+	bench_pause();
+	bench_set_flags(flags);
+	bench_drop_pool();
+	struct coro **coros = malloc(sizeof(coros[0]) * iterations);
+	bench_resume();
+	coro_new_batch(bench_touch_f, NULL, iterations, coros);
+	for (long i = 0; i < iterations; ++i)
+		coro_join(coros[i]);
+	bench_pause();
+	free(coros);
+	bench_resume();
+}
+
+static void
+bench_spawn_4k(long iterations, long arg)
+{
+	(void)arg;
+	bench_spawn(iterations, 0);
+}
+
+static void
+bench_spawn_huge(long iterations, long arg)
+{
+	(void)arg;
+	bench_spawn(iterations, CORO_STACK_HUGE_PAGES);
+}
+
+static long
+bench_max_live_count(long requested)
+{
+	FILE *f = fopen("/proc/sys/vm/max_map_count", "r");
+	if (f == NULL)
+		return requested;
+	long max_map_count;
+	if (fscanf(f, "%ld", &max_map_count) != 1)
+		max_map_count = 0;
+	fclose(f);
+	/* Leave some for the process itself. */
+	long limit = (max_map_count - 1024) / 2;
+	if (limit <= 0 || limit >= requested)
+		return requested;
+	return limit;
+}
+
+struct bench_args {
+	int argc;
+	char **argv;
+	int rc;
+};
+
+static void *
+bench_main_f(void *arg)
+{
+	struct bench_args *args = arg;
+	long live_count = bench_max_live_count(BENCH_LIVE_COUNT);
+	bench_register_arg("switch_4k", bench_switch_4k, 2000000, live_count);
+	bench_register_arg("switch_huge", bench_switch_huge, 2000000,
+			   live_count);
+	if (live_count != BENCH_LIVE_COUNT) {
+		bench_register_arg("switch_huge", bench_switch_huge, 2000000,
+				   BENCH_LIVE_COUNT);
+	}
+	bench_register_arg("spawn_4k", bench_spawn_4k, live_count, 0);
+	bench_register_arg("spawn_huge", bench_spawn_huge, live_count, 0);
+	args->rc = bench_main(args->argc, args->argv);
+	bench_drop_pool();
+	return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+	struct bench_args args = {argc, argv, 0};
+	coro_sched_init();
+	struct coro *c = coro_new(bench_main_f, &args);
+	coro_sched_run();
+	coro_join(c);
+	coro_sched_destroy();
+	return args.rc;
+}
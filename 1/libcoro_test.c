@@ -2,6 +2,13 @@
 
 #include "unit.h"
 
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
 ////////////////////////////////////////////////////////////////////////////////
 
 static void *
@@ -162,6 +169,977 @@ test_wakeup_of_finished(void)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+static void *
+test_big_stack_f(void *arg)
+{
+	size_t size = *(size_t *)arg;
+	char buf[size];
+	memset(buf, 0xab, size);
+	coro_yield();
+	for (size_t i = 0; i < size; i += 4096)
+		unit_assert((unsigned char)buf[i] == 0xab);
+	return arg;
+}
+
+static void
+test_stack_size(void)
+{
+	unit_test_start();
+
+	struct coro_attr attr;
+	coro_attr_create(&attr);
+	attr.stack_size = 4 * 1024 * 1024;
+	size_t size = 3 * 1024 * 1024;
+	struct coro *c = coro_new_ex(test_big_stack_f, &size, &attr);
+	unit_check(coro_join(c) == &size, "big stack");
+
+	struct coro *c2 = coro_new_ex(test_big_stack_f, &size, &attr);
+	unit_check(c2 == c, "pooled coro of the same stack size is reused");
+	unit_assert(coro_join(c2) == &size);
+
+	attr.stack_size = 32 * 1024;
+	size = 8 * 1024;
+	c2 = coro_new_ex(test_big_stack_f, &size, &attr);
+	unit_check(c2 != c, "other stack size uses another coro");
+	unit_check(coro_join(c2) == &size, "small stack");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+test_return_f(void *arg)
+{
+	return arg;
+}
+
+static void
+test_pool_policy(void)
+{
+	unit_test_start();
+
+	struct coro_pool_policy policy;
+	coro_pool_policy_create(&policy);
+	policy.max_count = 0;
+	coro_sched_set_pool_policy(&policy);
+	struct coro_pool_stats stats;
+	coro_sched_pool_stats(&stats);
+	unit_check(stats.count == 0, "pool is emptied by the new policy");
+	unit_check(stats.resident_size == 0, "no resident pooled stacks");
+	policy.max_count = 2;
+	coro_sched_set_pool_policy(&policy);
+
+	const int coro_count = 5;
+	struct coro *coros[coro_count];
+	struct coro_pool_stats old_stats;
+	coro_sched_pool_stats(&old_stats);
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(test_return_f, NULL);
+	for (int i = 0; i < coro_count; ++i)
+		unit_assert(coro_join(coros[i]) == NULL);
+	coro_sched_pool_stats(&stats);
+	unit_check(stats.count == 2, "pool is limited");
+	unit_check(stats.miss_count == old_stats.miss_count + coro_count,
+		"each spawn is a miss on an empty pool");
+	unit_check(stats.free_count == old_stats.free_count + coro_count - 2,
+		"surplus coros are freed");
+
+	coro_sched_pool_stats(&old_stats);
+	policy.max_resident_size = 0;
+	policy.trim_keep_size = 16 * 1024;
+	coro_sched_set_pool_policy(&policy);
+	coro_sched_pool_stats(&stats);
+	unit_check(stats.trim_count == old_stats.trim_count + 2,
+		"pooled stacks are trimmed by the new policy");
+	unit_check(stats.resident_size == 2 * policy.trim_keep_size,
+		"only the stack tops are resident");
+
+	size_t size = 512 * 1024;
+	struct coro *c = coro_new(test_big_stack_f, &size);
+	unit_assert(coro_join(c) == &size);
+	c = coro_new(test_big_stack_f, &size);
+	unit_check(coro_join(c) == &size, "trimmed stack is reusable");
+
+	coro_pool_policy_create(&policy);
+	coro_sched_set_pool_policy(&policy);
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static double
+test_clock(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+struct test_sleep_ctx {
+	double timeout;
+	int *order;
+	int *next_order;
+};
+
+static void *
+test_sleep_f(void *arg)
+{
+	struct test_sleep_ctx *ctx = arg;
+	coro_sleep(ctx->timeout);
+	*ctx->order = (*ctx->next_order)++;
+	return NULL;
+}
+
+static void *
+test_suspend_timeout_f(void *arg)
+{
+	return (void *)(long)coro_suspend_timeout(*(double *)arg);
+}
+
+static void
+test_timers(void)
+{
+	unit_test_start();
+
+	double start = test_clock();
+	coro_sleep(0.05);
+	unit_check(test_clock() - start >= 0.05, "sleep");
+
+	const int coro_count = 5;
+	const double timeouts[] = {0.07, 0.01, 0.2, 0.03, 0.1};
+	struct coro *coros[coro_count];
+	struct test_sleep_ctx ctx[coro_count];
+	int order[coro_count];
+	int next_order = 0;
+	for (int i = 0; i < coro_count; ++i) {
+		ctx[i].timeout = timeouts[i];
+		ctx[i].order = &order[i];
+		ctx[i].next_order = &next_order;
+		coros[i] = coro_new(test_sleep_f, &ctx[i]);
+	}
+	for (int i = 0; i < coro_count; ++i)
+		unit_assert(coro_join(coros[i]) == NULL);
+	unit_check(order[1] == 0 && order[3] == 1 && order[0] == 2 &&
+		order[4] == 3 && order[2] == 4, "timers expire in order");
+
+	double timeout = 10;
+	start = test_clock();
+	struct coro *c = coro_new(test_suspend_timeout_f, &timeout);
+	coro_yield();
+	coro_wakeup(c);
+	unit_check(coro_join(c) == (void *)1, "explicit wakeup");
+	unit_check(test_clock() - start < 1, "explicit wakeup is fast");
+
+	timeout = 0.02;
+	c = coro_new(test_suspend_timeout_f, &timeout);
+	unit_check(coro_join(c) == NULL, "timeout");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+test_wait_read_f(void *arg)
+{
+	int fd = *(int *)arg;
+	int rc = coro_wait_fd(fd, CORO_EVENT_READ, -1);
+	if (rc != CORO_EVENT_READ)
+		return (void *)-1;
+	char c;
+	if (read(fd, &c, 1) != 1)
+		return (void *)-1;
+	return (void *)(long)c;
+}
+
+static void
+test_wait_fd(void)
+{
+	unit_test_start();
+
+	int fds[2];
+	unit_fail_if(pipe(fds) != 0);
+	unit_check(coro_wait_fd(fds[1], CORO_EVENT_WRITE, -1) ==
+		CORO_EVENT_WRITE, "pipe is writable");
+	unit_check(coro_wait_fd(fds[0], CORO_EVENT_READ, 0.02) == 0,
+		"read timeout");
+
+	struct coro *c = coro_new(test_wait_read_f, &fds[0]);
+	coro_sleep(0.01);
+	unit_check(write(fds[1], "x", 1) == 1, "write");
+	unit_check(coro_join(c) == (void *)(long)'x', "woken up by data");
+
+	c = coro_new(test_wait_read_f, &fds[0]);
+	coro_yield();
+	unit_check(coro_wait_fd(fds[0], CORO_EVENT_READ, 0) == -1 &&
+		errno == EEXIST, "one waiter per descriptor");
+	close(fds[1]);
+	unit_check(coro_join(c) == (void *)-1, "woken up by hangup");
+	close(fds[0]);
+
+	unit_test_finish();
+}
+
+struct test_watch_ctx {
+	struct coro_fd_watch watch;
+	struct coro *coro;
+	int call_count;
+};
+
+static void
+test_watch_f(struct coro_fd_watch *watch, int events)
+{
+	struct test_watch_ctx *ctx = watch->arg;
+	unit_assert(events == CORO_EVENT_READ);
+	char buf[16];
+	unit_assert(read(watch->fd, buf, sizeof(buf)) > 0);
+	++ctx->call_count;
+	coro_wakeup(ctx->coro);
+}
+
+static void *
+test_watch_thread_f(void *arg)
+{
+	usleep(10000);
+	unit_assert(write(*(int *)arg, "x", 1) == 1);
+	return NULL;
+}
+
+static void
+test_watch_fd(void)
+{
+	unit_test_start();
+
+	int fds[2];
+	unit_fail_if(pipe(fds) != 0);
+	struct test_watch_ctx ctx;
+	ctx.watch.func = test_watch_f;
+	ctx.watch.arg = &ctx;
+	ctx.watch.fd = fds[0];
+	ctx.watch.events = CORO_EVENT_READ;
+	ctx.coro = coro_this();
+	ctx.call_count = 0;
+	unit_check(coro_watch_fd_start(&ctx.watch) == 0, "start");
+
+	pthread_t tid;
+	unit_fail_if(pthread_create(&tid, NULL, test_watch_thread_f,
+		&fds[1]) != 0);
+	coro_suspend();
+	unit_check(ctx.call_count == 1, "woken up from another thread");
+	pthread_join(tid, NULL);
+
+	unit_assert(write(fds[1], "xy", 2) == 2);
+	coro_suspend();
+	unit_check(ctx.call_count == 2, "called again");
+
+	coro_watch_fd_stop(&ctx.watch);
+	unit_assert(write(fds[1], "z", 1) == 1);
+	coro_yield();
+	unit_check(ctx.call_count == 2, "not called when stopped");
+	close(fds[0]);
+	close(fds[1]);
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct test_prio_ctx {
+	int id;
+	int *order;
+	int *order_size;
+	int yield_count;
+};
+
+static void *
+test_prio_f(void *arg)
+{
+	struct test_prio_ctx *ctx = arg;
+	for (int i = 0; i < ctx->yield_count; ++i)
+		coro_yield();
+	ctx->order[(*ctx->order_size)++] = ctx->id;
+	return NULL;
+}
+
+static void
+test_priority(void)
+{
+	unit_test_start();
+
+	int order[512];
+	int order_size = 0;
+	const enum coro_priority prios[] = {
+		CORO_PRIO_LOW, CORO_PRIO_NORMAL, CORO_PRIO_NORMAL,
+		CORO_PRIO_HIGH,
+	};
+	const int coro_count = sizeof(prios) / sizeof(prios[0]);
+	struct test_prio_ctx ctx[512];
+	struct coro *coros[512];
+	for (int i = 0; i < coro_count; ++i) {
+		ctx[i].id = i;
+		ctx[i].order = order;
+		ctx[i].order_size = &order_size;
+		ctx[i].yield_count = 0;
+		coros[i] = coro_new(test_prio_f, &ctx[i]);
+		coro_set_priority(coros[i], prios[i]);
+	}
+	for (int i = 0; i < coro_count; ++i)
+		unit_assert(coro_join(coros[i]) == NULL);
+	unit_check(order[0] == 3 && order[1] == 1 && order[2] == 2 &&
+		order[3] == 0, "more important go first");
+
+	struct coro_prio_stats old_high, high, low;
+	coro_sched_prio_stats(CORO_PRIO_HIGH, &old_high);
+	order_size = 0;
+	const int flood_count = 400;
+	for (int i = 0; i < flood_count; ++i) {
+		ctx[i].id = i;
+		ctx[i].order = order;
+		ctx[i].order_size = &order_size;
+		ctx[i].yield_count = 3;
+		coros[i] = coro_new(test_prio_f, &ctx[i]);
+		coro_set_priority(coros[i], CORO_PRIO_HIGH);
+	}
+	ctx[flood_count].id = flood_count;
+	ctx[flood_count].order = order;
+	ctx[flood_count].order_size = &order_size;
+	ctx[flood_count].yield_count = 0;
+	coros[flood_count] = coro_new(test_prio_f, &ctx[flood_count]);
+	coro_set_priority(coros[flood_count], CORO_PRIO_LOW);
+	for (int i = 0; i <= flood_count; ++i)
+		unit_assert(coro_join(coros[i]) == NULL);
+	unit_check(order[0] == flood_count, "low priority doesn't starve");
+
+	coro_sched_prio_stats(CORO_PRIO_HIGH, &high);
+	coro_sched_prio_stats(CORO_PRIO_LOW, &low);
+	unit_check(high.switch_count - old_high.switch_count ==
+		(size_t)flood_count * 4, "high switch count");
+	unit_check(high.max_runnable_count >= (size_t)flood_count,
+		"high max runnable count");
+	unit_check(high.runnable_count == 0 && low.runnable_count == 0,
+		"no runnable left");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+test_prof_f(void *arg)
+{
+	(void)arg;
+	double start = test_clock();
+	while (test_clock() - start < 0.005)
+		;
+	for (int i = 0; i < 3; ++i)
+		coro_yield();
+	coro_suspend();
+	return NULL;
+}
+
+static void
+test_prof_find_f(struct coro *coro, const struct coro_prof *prof, void *arg)
+{
+	(void)prof;
+	struct coro **target = arg;
+	if (*target == coro)
+		*target = NULL;
+}
+
+static void
+test_prof(void)
+{
+	unit_test_start();
+
+	struct coro_prof prof;
+	if (!coro_prof(coro_this(), &prof)) {
+		unit_msg("profiling is disabled");
+		unit_test_finish();
+		return;
+	}
+	struct coro *c = coro_new(test_prof_f, NULL);
+	for (int i = 0; i < 10; ++i)
+		coro_yield();
+	unit_assert(coro_prof(c, &prof));
+	unit_check(prof.switch_count == 4, "switch count");
+	unit_check(prof.wakeup_count == 0, "wakeup count");
+	unit_check(prof.run_time_ns >= 5000000, "run time");
+	unit_check(prof.max_slice_ns >= 5000000 &&
+		prof.max_slice_ns <= prof.run_time_ns, "max slice");
+	struct coro *target = c;
+	coro_prof_foreach(test_prof_find_f, &target);
+	unit_check(target == NULL, "foreach finds the coro");
+
+	coro_wakeup(c);
+	unit_assert(coro_join(c) == NULL);
+	target = c;
+	coro_prof_foreach(test_prof_find_f, &target);
+	unit_check(target == c, "joined coro is not listed");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+enum {
+	TEST_STACK_PROF_DEEP = 40 * 1024,
+};
+
+static void *
+test_stack_prof_deep_f(void *arg)
+{
+	volatile char buf[TEST_STACK_PROF_DEEP];
+	for (size_t i = 0; i < sizeof(buf); i += 512)
+		buf[i] = 1;
+	buf[0] = 1;
+	return arg;
+}
+
+static void *
+test_stack_prof_shallow_f(void *arg)
+{
+	return arg;
+}
+
+static void
+test_stack_prof_find_f(const struct coro_stack_prof *prof, void *arg)
+{
+	struct coro_stack_prof *res = arg;
+	if (prof->func == res->func)
+		*res = *prof;
+}
+
+static void
+test_stack_prof(void)
+{
+	unit_test_start();
+
+	struct coro_stack_prof deep, shallow;
+	deep.func = test_stack_prof_deep_f;
+	if (!coro_stack_prof_foreach(test_stack_prof_find_f, &deep)) {
+		unit_msg("stack profiling is disabled");
+		unit_test_finish();
+		return;
+	}
+	struct coro_attr attr;
+	coro_attr_create(&attr);
+	attr.stack_size = 256 * 1024;
+	/* The same pooled stack runs them all, one after another. */
+	for (int i = 0; i < 2; ++i) {
+		coro_join(coro_new_ex(test_stack_prof_deep_f, NULL, &attr));
+		coro_join(coro_new_ex(test_stack_prof_shallow_f, NULL, &attr));
+	}
+	deep.func = test_stack_prof_deep_f;
+	deep.run_count = 0;
+	coro_stack_prof_foreach(test_stack_prof_find_f, &deep);
+	shallow.func = test_stack_prof_shallow_f;
+	shallow.run_count = 0;
+	coro_stack_prof_foreach(test_stack_prof_find_f, &shallow);
+	unit_check(deep.run_count == 2 && shallow.run_count == 2,
+		"runs are counted per function");
+	unit_check(deep.max_used >= TEST_STACK_PROF_DEEP &&
+		deep.max_used < TEST_STACK_PROF_DEEP + 8 * 1024,
+		"deep usage");
+	unit_check(shallow.max_used < 4096, "the stack is repainted");
+	unit_check(deep.max_stack_size == attr.stack_size, "stack size");
+	unit_check(deep.hist[6] == 2, "deep is in the 64KB bucket");
+	unit_check(shallow.hist[0] + shallow.hist[1] + shallow.hist[2] == 2,
+		"shallow is in the small buckets");
+	coro_stack_prof_dump(stdout);
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+test_new_batch(void)
+{
+	unit_test_start();
+
+	struct coro_pool_policy policy;
+	coro_pool_policy_create(&policy);
+	policy.max_count = 0;
+	coro_sched_set_pool_policy(&policy);
+	coro_pool_policy_create(&policy);
+	coro_sched_set_pool_policy(&policy);
+
+	enum { coro_count = 300 };
+	struct coro *coros[coro_count * 2];
+	void *args[coro_count];
+	for (int i = 0; i < coro_count; ++i)
+		args[i] = (void *)(long)i;
+	struct coro_pool_stats old_stats, stats;
+	coro_sched_pool_stats(&old_stats);
+	coro_new_batch(test_return_f, args, coro_count, coros);
+	bool ok = true;
+	for (int i = 0; i < coro_count; ++i)
+		ok = ok && coro_join(coros[i]) == args[i];
+	unit_check(ok, "all the results are correct");
+	coro_sched_pool_stats(&stats);
+	unit_check(stats.miss_count - old_stats.miss_count == coro_count,
+		"all are new");
+	unit_check(stats.count == coro_count, "all are pooled");
+
+	/* Half from the pool, half new. */
+	coro_new_batch(test_return_f, NULL, coro_count * 2, coros);
+	coro_sched_pool_stats(&old_stats);
+	unit_check(old_stats.hit_count - stats.hit_count == coro_count &&
+		old_stats.miss_count - stats.miss_count == coro_count,
+		"pooled are reused");
+	ok = true;
+	for (int i = 0; i < coro_count * 2; ++i)
+		ok = ok && coro_join(coros[i]) == NULL;
+	unit_check(ok, "NULL arguments");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+test_stack_memory(void)
+{
+	unit_test_start();
+
+	struct coro_pool_policy policy;
+	coro_pool_policy_create(&policy);
+	policy.max_count = 0;
+	coro_sched_set_pool_policy(&policy);
+	coro_pool_policy_create(&policy);
+	coro_sched_set_pool_policy(&policy);
+	coro_sched_set_stack_memory(CORO_STACK_HUGE_PAGES |
+		CORO_STACK_NODE_LOCAL);
+
+	/* More than one arena of the stacks. */
+	enum { coro_count = 3000 };
+	struct coro **coros = malloc(sizeof(coros[0]) * coro_count);
+	struct coro_attr attr;
+	coro_attr_create(&attr);
+	attr.stack_size = 16 * 1024;
+	size_t size = 8 * 1024;
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new_ex(test_big_stack_f, &size, &attr);
+	bool ok = true;
+	for (int i = 0; i < coro_count; ++i)
+		ok = ok && coro_join(coros[i]) == &size;
+	unit_check(ok, "the neighbour stacks are intact");
+
+	coro_sched_set_stack_size(16 * 1024);
+	void *args[coro_count];
+	for (int i = 0; i < coro_count; ++i)
+		args[i] = &size;
+	/* The freed stacks are unmapped in the middle of the arenas. */
+	policy.max_count = coro_count / 3;
+	coro_sched_set_pool_policy(&policy);
+	coro_pool_policy_create(&policy);
+	coro_sched_set_pool_policy(&policy);
+	/* The pooled ones and the new ones. */
+	coro_new_batch(test_big_stack_f, args, coro_count, coros);
+	ok = true;
+	for (int i = 0; i < coro_count; ++i)
+		ok = ok && coro_join(coros[i]) == &size;
+	unit_check(ok, "batch");
+	coro_sched_set_stack_size(0);
+
+	attr.stack_size = 64 * 1024 * 1024;
+	size = 3 * 1024 * 1024;
+	struct coro *c = coro_new_ex(test_big_stack_f, &size, &attr);
+	unit_check(coro_join(c) == &size, "stack bigger than an arena");
+
+	coro_sched_set_stack_memory(0);
+	c = coro_new_ex(test_big_stack_f, &size, &attr);
+	unit_check(coro_join(c) == &size, "huge stack is pooled as usual");
+	struct coro_pool_stats stats;
+	coro_sched_pool_stats(&stats);
+	unit_check(stats.count == coro_count + 1, "all are pooled");
+	policy.max_resident_size = 0;
+	policy.trim_keep_size = 4096;
+	coro_sched_set_pool_policy(&policy);
+	c = coro_new_ex(test_big_stack_f, &size, &attr);
+	unit_check(coro_join(c) == &size, "trimmed huge stack is reusable");
+	policy.max_count = 0;
+	coro_sched_set_pool_policy(&policy);
+	coro_pool_policy_create(&policy);
+	coro_sched_set_pool_policy(&policy);
+	free(coros);
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+test_wakeup_many(void)
+{
+	unit_test_start();
+
+	int data[3];
+	struct coro *coros[3];
+	for (int i = 0; i < 3; ++i)
+		coros[i] = coro_new(test_suspend_and_return_f, &data[i]);
+	coro_yield();
+	struct coro *finished = coro_new(test_return_f, NULL);
+	coro_yield();
+	struct coro_prio_stats old_stats, stats;
+	coro_sched_prio_stats(CORO_PRIO_NORMAL, &old_stats);
+	struct coro *batch[] = {
+		coros[0], coros[1], coros[0], coro_this(), finished, coros[2],
+		coros[1],
+	};
+	coro_wakeup_many(batch, sizeof(batch) / sizeof(batch[0]));
+	coro_sched_prio_stats(CORO_PRIO_NORMAL, &stats);
+	unit_check(stats.runnable_count - old_stats.runnable_count == 3,
+		"only the suspended are queued, once");
+	bool ok = true;
+	for (int i = 0; i < 3; ++i)
+		ok = ok && coro_join(coros[i]) == &data[i];
+	unit_check(ok, "all are woken up");
+	unit_check(coro_join(finished) == NULL, "finished is not touched");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+test_join_any(void)
+{
+	unit_test_start();
+
+	int data[3];
+	struct coro *coros[3];
+	for (int i = 0; i < 3; ++i)
+		coros[i] = coro_new(test_suspend_and_return_f, &data[i]);
+	coro_yield();
+	struct coro *waker = coro_new(test_wakeup_f, coros[1]);
+	void *ret = NULL;
+	unit_check(coro_join_any(coros, 3, &ret) == 1 && ret == &data[1],
+		"the finished one is joined");
+	coro_join(waker);
+
+	coros[1] = coros[2];
+	coro_wakeup(coros[1]);
+	coro_yield();
+	coro_yield();
+	unit_check(coro_join_any(coros, 2, NULL) == 1,
+		"already finished is joined");
+
+	coro_wakeup(coros[0]);
+	unit_check(coro_join_any(coros, 1, &ret) == 0 && ret == &data[0],
+		"the last one");
+
+	unit_test_finish();
+}
+
+struct test_wait_group_ctx {
+	struct coro_wait_group *group;
+	int yield_count;
+	int *done_count;
+};
+
+static void *
+test_wait_group_f(void *arg)
+{
+	struct test_wait_group_ctx *ctx = arg;
+	for (int i = 0; i < ctx->yield_count; ++i)
+		coro_yield();
+	++*ctx->done_count;
+	coro_wait_group_done(ctx->group);
+	return NULL;
+}
+
+static void
+test_wait_group(void)
+{
+	unit_test_start();
+
+	struct coro_wait_group group;
+	coro_wait_group_create(&group);
+	coro_wait_group_wait(&group);
+	unit_msg("empty group doesn't wait");
+
+	enum { coro_count = 5 };
+	int done_count = 0;
+	struct test_wait_group_ctx ctx[coro_count];
+	struct coro *coros[coro_count];
+	coro_wait_group_add(&group, coro_count);
+	for (int i = 0; i < coro_count; ++i) {
+		ctx[i].group = &group;
+		ctx[i].yield_count = coro_count - i;
+		ctx[i].done_count = &done_count;
+		coros[i] = coro_new(test_wait_group_f, &ctx[i]);
+	}
+	coro_wait_group_wait(&group);
+	unit_check(done_count == coro_count, "woken when all are done");
+	for (int i = 0; i < coro_count; ++i)
+		coro_join(coros[i]);
+	coro_wait_group_destroy(&group);
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct test_sync_ctx {
+	struct coro_mutex *mutex;
+	struct coro_cond *cond;
+	struct coro_sem *sem;
+	int id;
+	int *order;
+	int *order_size;
+	int *counter;
+};
+
+static void *
+test_mutex_f(void *arg)
+{
+	struct test_sync_ctx *ctx = arg;
+	coro_mutex_lock(ctx->mutex);
+	ctx->order[(*ctx->order_size)++] = ctx->id;
+	/* Others must not get in while it is held across a yield. */
+	coro_yield();
+	++*ctx->counter;
+	coro_mutex_unlock(ctx->mutex);
+	return NULL;
+}
+
+static void
+test_mutex(void)
+{
+	unit_test_start();
+
+	struct coro_mutex mutex;
+	coro_mutex_create(&mutex);
+	unit_check(coro_mutex_trylock(&mutex), "trylock of a free one");
+	unit_check(!coro_mutex_trylock(&mutex), "trylock of a locked one");
+
+	enum { coro_count = 4 };
+	int order[coro_count];
+	int order_size = 0;
+	int counter = 0;
+	struct test_sync_ctx ctx[coro_count];
+	struct coro *coros[coro_count];
+	for (int i = 0; i < coro_count; ++i) {
+		ctx[i].mutex = &mutex;
+		ctx[i].id = i;
+		ctx[i].order = order;
+		ctx[i].order_size = &order_size;
+		ctx[i].counter = &counter;
+		coros[i] = coro_new(test_mutex_f, &ctx[i]);
+	}
+	coro_yield();
+	coro_yield();
+	unit_check(order_size == 0, "all are waiting");
+	coro_mutex_unlock(&mutex);
+	unit_check(!coro_mutex_trylock(&mutex), "handed over to a waiter");
+	for (int i = 0; i < coro_count; ++i)
+		coro_join(coros[i]);
+	unit_check(counter == coro_count, "all have been in");
+	bool ok = order_size == coro_count;
+	for (int i = 0; i < order_size; ++i)
+		ok = ok && order[i] == i;
+	unit_check(ok, "in the order of lock");
+	unit_check(coro_mutex_trylock(&mutex), "free in the end");
+	coro_mutex_unlock(&mutex);
+	coro_mutex_destroy(&mutex);
+
+	unit_test_finish();
+}
+
+static void *
+test_cond_f(void *arg)
+{
+	struct test_sync_ctx *ctx = arg;
+	coro_mutex_lock(ctx->mutex);
+	while (*ctx->counter == 0)
+		coro_cond_wait(ctx->cond, ctx->mutex);
+	--*ctx->counter;
+	ctx->order[(*ctx->order_size)++] = ctx->id;
+	coro_mutex_unlock(ctx->mutex);
+	return NULL;
+}
+
+static void
+test_cond(void)
+{
+	unit_test_start();
+
+	struct coro_mutex mutex;
+	coro_mutex_create(&mutex);
+	struct coro_cond cond;
+	coro_cond_create(&cond);
+	coro_cond_signal(&cond);
+	coro_cond_broadcast(&cond);
+
+	enum { coro_count = 4 };
+	int order[coro_count];
+	int order_size = 0;
+	int counter = 0;
+	struct test_sync_ctx ctx[coro_count];
+	struct coro *coros[coro_count];
+	for (int i = 0; i < coro_count; ++i) {
+		ctx[i].mutex = &mutex;
+		ctx[i].cond = &cond;
+		ctx[i].id = i;
+		ctx[i].order = order;
+		ctx[i].order_size = &order_size;
+		ctx[i].counter = &counter;
+		coros[i] = coro_new(test_cond_f, &ctx[i]);
+	}
+	coro_yield();
+
+	coro_mutex_lock(&mutex);
+	counter = 1;
+	coro_cond_signal(&cond);
+	coro_yield();
+	unit_check(order_size == 0, "signaled waits for the mutex");
+	coro_mutex_unlock(&mutex);
+	coro_yield();
+	unit_check(order_size == 1 && order[0] == 0, "signal wakes one");
+
+	coro_mutex_lock(&mutex);
+	counter = coro_count - 1;
+	coro_cond_broadcast(&cond);
+	coro_mutex_unlock(&mutex);
+	for (int i = 0; i < coro_count; ++i)
+		coro_join(coros[i]);
+	bool ok = order_size == coro_count;
+	for (int i = 0; i < order_size; ++i)
+		ok = ok && order[i] == i;
+	unit_check(ok, "broadcast wakes all, in the order of wait");
+	coro_cond_destroy(&cond);
+	coro_mutex_destroy(&mutex);
+
+	unit_test_finish();
+}
+
+static void *
+test_sem_f(void *arg)
+{
+	struct test_sync_ctx *ctx = arg;
+	coro_sem_wait(ctx->sem);
+	int in = ++*ctx->counter;
+	if (in > *ctx->order_size)
+		*ctx->order_size = in;
+	coro_yield();
+	--*ctx->counter;
+	coro_sem_post(ctx->sem);
+	return NULL;
+}
+
+static void
+test_sem(void)
+{
+	unit_test_start();
+
+	struct coro_sem sem;
+	coro_sem_create(&sem, 1);
+	unit_check(coro_sem_trywait(&sem), "trywait of a unit");
+	unit_check(!coro_sem_trywait(&sem), "trywait without units");
+	coro_sem_post(&sem);
+	coro_sem_post(&sem);
+
+	enum { coro_count = 6 };
+	int max_in = 0;
+	int counter = 0;
+	struct test_sync_ctx ctx[coro_count];
+	struct coro *coros[coro_count];
+	for (int i = 0; i < coro_count; ++i) {
+		ctx[i].sem = &sem;
+		ctx[i].order_size = &max_in;
+		ctx[i].counter = &counter;
+		coros[i] = coro_new(test_sem_f, &ctx[i]);
+	}
+	for (int i = 0; i < coro_count; ++i)
+		coro_join(coros[i]);
+	unit_check(max_in == 2, "no more than the units at once");
+	unit_check(coro_sem_trywait(&sem) && coro_sem_trywait(&sem) &&
+		!coro_sem_trywait(&sem), "all units are back");
+	coro_sem_destroy(&sem);
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static int test_key_destroy_count = 0;
+static coro_key_t test_key_main;
+static coro_key_t test_key_other;
+
+static void
+test_key_destructor(void *value)
+{
+	++test_key_destroy_count;
+	/* The values of the other keys are still there. */
+	if (value == (void *)&test_key_main) {
+		unit_assert(coro_getspecific(test_key_other) ==
+			&test_key_other);
+	}
+	if (value == (void *)&test_key_other)
+		coro_setspecific(test_key_main, &test_key_destroy_count);
+}
+
+static void *
+test_key_f(void *arg)
+{
+	unit_assert(coro_getspecific(test_key_main) == NULL);
+	coro_setspecific(test_key_main, arg);
+	coro_yield();
+	void *res = coro_getspecific(test_key_main);
+	coro_setspecific(test_key_main, NULL);
+	return res;
+}
+
+static void *
+test_key_destructor_f(void *arg)
+{
+	(void)arg;
+	coro_setspecific(test_key_main, &test_key_main);
+	coro_setspecific(test_key_other, &test_key_other);
+	return NULL;
+}
+
+static void
+test_key(void)
+{
+	unit_test_start();
+
+	unit_assert(coro_key_create(&test_key_main, test_key_destructor) == 0);
+	unit_assert(coro_key_create(&test_key_other, test_key_destructor) == 0);
+	unit_check(test_key_main != test_key_other, "keys are different");
+
+	int data[2];
+	struct coro *a = coro_new(test_key_f, &data[0]);
+	struct coro *b = coro_new(test_key_f, &data[1]);
+	coro_setspecific(test_key_main, &data);
+	unit_check(coro_join(a) == &data[0] && coro_join(b) == &data[1],
+		"interleaved coros see own values");
+	unit_check(coro_getspecific(test_key_main) == &data, "own value");
+	unit_check(test_key_destroy_count == 0, "no destructor for NULL");
+
+	/* The pooled ones must come clean. */
+	unit_assert(coro_join(coro_new(test_key_destructor_f, NULL)) == NULL);
+	unit_check(test_key_destroy_count == 3,
+		"destructors are called, and again for a new value");
+	a = coro_new(test_key_f, &data[0]);
+	unit_check(coro_join(a) == &data[0], "reused coro has no values");
+	coro_setspecific(test_key_main, NULL);
+
+	coro_key_t key;
+	int count = 2;
+	while (coro_key_create(&key, NULL) == 0)
+		++count;
+	unit_check(errno == EAGAIN && count == CORO_KEY_MAX,
+		"keys are limited");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 static void *
 coro_main_f(void *arg)
 {
@@ -171,9 +1149,295 @@ coro_main_f(void *arg)
 	test_wakup_self();
 	test_join_of_join();
 	test_wakeup_of_finished();
+	test_stack_size();
+	test_pool_policy();
+	test_timers();
+	test_wait_fd();
+	test_watch_fd();
+	test_priority();
+	test_prof();
+	test_stack_prof();
+	test_new_batch();
+	test_stack_memory();
+	test_wakeup_many();
+	test_mutex();
+	test_cond();
+	test_sem();
+	test_join_any();
+	test_wait_group();
+	/* The last, it takes all the keys. */
+	test_key();
+	return NULL;
+}
+
+struct test_mt_ctx {
+	struct coro *peer;
+	struct coro *self;
+	atomic_int *turn;
+	int id;
+	int rounds;
+	atomic_int *counter;
+};
+
+static void *
+test_mt_child_f(void *arg)
+{
+	atomic_fetch_add((atomic_int *)arg, 1);
+	coro_yield();
+	return arg;
+}
+
+static void *
+test_mt_f(void *arg)
+{
+	struct test_mt_ctx *ctx = arg;
+	for (int i = 0; i < ctx->rounds; ++i) {
+		while (atomic_load(ctx->turn) != ctx->id)
+			coro_suspend();
+		atomic_fetch_add(ctx->counter, 1);
+		atomic_store(ctx->turn, 1 - ctx->id);
+		coro_wakeup(ctx->peer);
+		struct coro *child = coro_new(test_mt_child_f, ctx->counter);
+		if (i % 2 == 0)
+			coro_yield();
+		unit_assert(coro_join(child) == ctx->counter);
+	}
+	return NULL;
+}
+
+static void
+test_mt(void)
+{
+	unit_test_start();
+
+	enum {
+		pair_count = 50,
+		rounds = 100,
+		thread_count = 4,
+	};
+	struct test_mt_ctx ctx[pair_count][2];
+	atomic_int turns[pair_count];
+	atomic_int counter;
+	atomic_init(&counter, 0);
+	for (int i = 0; i < pair_count; ++i) {
+		atomic_init(&turns[i], 0);
+		for (int j = 0; j < 2; ++j) {
+			ctx[i][j].turn = &turns[i];
+			ctx[i][j].id = j;
+			ctx[i][j].rounds = rounds;
+			ctx[i][j].counter = &counter;
+			ctx[i][j].self = coro_new(test_mt_f, &ctx[i][j]);
+		}
+		ctx[i][0].peer = ctx[i][1].self;
+		ctx[i][1].peer = ctx[i][0].self;
+	}
+	coro_sched_run_mt(thread_count);
+	unit_check(atomic_load(&counter) == pair_count * 2 * rounds * 2,
+		"all the coros have done all the rounds");
+	for (int i = 0; i < pair_count; ++i) {
+		for (int j = 0; j < 2; ++j)
+			unit_assert(coro_join(ctx[i][j].self) == NULL);
+	}
+
+	unit_test_finish();
+}
+
+struct test_mt_sync_ctx {
+	struct coro_mutex *mutex;
+	struct coro_sem *sem;
+	/** Not atomic, protected by the mutex. */
+	long *counter;
+	atomic_int *sem_in;
+	atomic_int *sem_max_in;
+	int rounds;
+};
+
+static void *
+test_mt_sync_f(void *arg)
+{
+	struct test_mt_sync_ctx *ctx = arg;
+	for (int i = 0; i < ctx->rounds; ++i) {
+		coro_mutex_lock(ctx->mutex);
+		long value = *ctx->counter;
+		if (i % 4 == 0)
+			coro_yield();
+		*ctx->counter = value + 1;
+		coro_mutex_unlock(ctx->mutex);
+
+		coro_sem_wait(ctx->sem);
+		int in = atomic_fetch_add(ctx->sem_in, 1) + 1;
+		int max = atomic_load(ctx->sem_max_in);
+		while (in > max &&
+		       !atomic_compare_exchange_weak(ctx->sem_max_in, &max, in)) {
+		}
+		atomic_fetch_sub(ctx->sem_in, 1);
+		coro_sem_post(ctx->sem);
+	}
+	return NULL;
+}
+
+static void
+test_mt_sync(void)
+{
+	unit_test_start();
+
+	enum {
+		coro_count = 50,
+		rounds = 200,
+		thread_count = 4,
+		sem_units = 3,
+	};
+	struct coro_mutex mutex;
+	coro_mutex_create(&mutex);
+	struct coro_sem sem;
+	coro_sem_create(&sem, sem_units);
+	long counter = 0;
+	atomic_int sem_in, sem_max_in;
+	atomic_init(&sem_in, 0);
+	atomic_init(&sem_max_in, 0);
+	struct test_mt_sync_ctx ctx;
+	ctx.mutex = &mutex;
+	ctx.sem = &sem;
+	ctx.counter = &counter;
+	ctx.sem_in = &sem_in;
+	ctx.sem_max_in = &sem_max_in;
+	ctx.rounds = rounds;
+	struct coro *coros[coro_count];
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(test_mt_sync_f, &ctx);
+	coro_sched_run_mt(thread_count);
+	for (int i = 0; i < coro_count; ++i)
+		unit_assert(coro_join(coros[i]) == NULL);
+	unit_check(counter == coro_count * rounds, "no lost updates");
+	unit_check(atomic_load(&sem_max_in) <= sem_units,
+		"no more than the units at once");
+	coro_sem_destroy(&sem);
+	coro_mutex_destroy(&mutex);
+
+	unit_test_finish();
+}
+
+static void *
+test_mt_fan_in_child_f(void *arg)
+{
+	for (int i = 0; i < 10; ++i)
+		coro_yield();
+	coro_wait_group_done(arg);
+	return arg;
+}
+
+static void *
+test_mt_fan_in_f(void *arg)
+{
+	(void)arg;
+	enum { coro_count = 20 };
+	struct coro_wait_group group;
+	coro_wait_group_create(&group);
+	struct coro *coros[coro_count];
+	coro_wait_group_add(&group, coro_count);
+	for (int i = 0; i < coro_count; ++i)
+		coros[i] = coro_new(test_mt_fan_in_child_f, &group);
+	coro_wait_group_wait(&group);
+	/* Join them in the order of finish. */
+	size_t count = coro_count;
+	while (count > 0) {
+		void *ret;
+		size_t i = coro_join_any(coros, count, &ret);
+		unit_assert(i < count && ret == &group);
+		coros[i] = coros[--count];
+	}
+	coro_wait_group_destroy(&group);
 	return NULL;
 }
 
+static void
+test_mt_fan_in(void)
+{
+	unit_test_start();
+
+	enum { parent_count = 10 };
+	struct coro *parents[parent_count];
+	for (int i = 0; i < parent_count; ++i)
+		parents[i] = coro_new(test_mt_fan_in_f, NULL);
+	coro_sched_run_mt(4);
+	bool ok = true;
+	for (int i = 0; i < parent_count; ++i)
+		ok = ok && coro_join(parents[i]) == NULL;
+	unit_check(ok, "wait groups and join_any of all parents");
+
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+test_thread_engine_sleep_f(void *arg)
+{
+	coro_sleep(0.005);
+	coro_wakeup(arg);
+	return arg;
+}
+
+static void *
+test_thread_engine_yield_f(void *arg)
+{
+	for (int i = 0; i < 3; ++i)
+		coro_yield();
+	return arg;
+}
+
+static void *
+test_thread_engine_f(void *arg)
+{
+	(void)arg;
+	coro_sched_thread_init();
+	unit_check(coro_sched_step(0) == CORO_SCHED_IDLE, "empty engine");
+
+	struct coro *c1 = coro_new(test_thread_engine_yield_f, NULL);
+	unit_check(coro_sched_step(0) == CORO_SCHED_RUNNABLE, "runnable");
+	int step_count = 1;
+	while (coro_sched_step(0) == CORO_SCHED_RUNNABLE)
+		++step_count;
+	unit_check(step_count == 3, "one yield per step");
+	unit_check(coro_join(c1) == NULL, "joined outside of coroutines");
+	unit_check(coro_sched_step(0) == CORO_SCHED_IDLE, "idle again");
+
+	struct coro *c2 = coro_new(test_suspend_and_return_f, NULL);
+	struct coro *c3 = coro_new(test_thread_engine_sleep_f, c2);
+	unit_check(coro_sched_step(0) == CORO_SCHED_WAITING, "timer");
+	step_count = 0;
+	enum coro_sched_state state;
+	while ((state = coro_sched_step(0.1)) != CORO_SCHED_SUSPENDED)
+		++step_count;
+	unit_check(step_count <= 5, "waited for the timer, not spun");
+	unit_check(coro_join(c3) == c2, "sleeper");
+	coro_join(c2);
+
+	struct coro_pool_stats stats;
+	coro_sched_pool_stats(&stats);
+	unit_check(stats.count == 2, "own pool");
+	coro_sched_thread_destroy();
+	return NULL;
+}
+
+static void
+test_thread_engine(void)
+{
+	unit_test_start();
+
+	struct coro_pool_stats before;
+	coro_sched_pool_stats(&before);
+	pthread_t tid;
+	unit_fail_if(pthread_create(&tid, NULL, test_thread_engine_f,
+		NULL) != 0);
+	pthread_join(tid, NULL);
+	struct coro_pool_stats after;
+	coro_sched_pool_stats(&after);
+	unit_check(after.count == before.count, "global pool is intact");
+
+	unit_test_finish();
+}
+
 int
 main(void)
 {
@@ -182,6 +1446,10 @@ main(void)
 	coro_sched_run();
 	void *rc = coro_join(main_coro);
 	unit_check(rc == NULL, "main coro rc");
+	test_mt();
+	test_mt_sync();
+	test_mt_fan_in();
+	test_thread_engine();
 	coro_sched_destroy();
 	return 0;
 }
@@ -3,6 +3,8 @@
 #include "unit.h"
 #include "corobus.h"
 
+#include <pthread.h>
+#include <sched.h>
 #include <string.h>
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -185,6 +187,17 @@ test_channel_reopen(void)
 	}
 	coro_bus_channel_close(bus, c1);
 
+	unit_msg("the lowest free descriptor is reused");
+	enum { MANY_COUNT = 10000, STEP = 97 };
+	for (int i = 0; i < MANY_COUNT; ++i)
+		unit_assert(coro_bus_channel_open(bus, 1) == i);
+	int first = (MANY_COUNT - 1) % STEP;
+	for (int i = MANY_COUNT - 1; i >= 0; i -= STEP)
+		coro_bus_channel_close(bus, i);
+	for (int i = first; i < MANY_COUNT; i += STEP)
+		unit_fail_if(coro_bus_channel_open(bus, 1) != i);
+	unit_assert(coro_bus_channel_open(bus, 1) == MANY_COUNT);
+
 	coro_bus_delete(bus);
 	unit_test_finish();
 }
@@ -737,6 +750,22 @@ test_wakeup_on_close(void)
 	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
 	unit_assert(data2 == 654);
 
+	unit_msg("close doesn't yield, the descriptor is reused right away");
+	c1 = coro_bus_channel_open(bus, 3);
+	recv_start(&recv_ctx1, bus, c1, &data1);
+	coro_yield();
+	unit_assert(recv_ctx1.is_started && !recv_ctx1.is_done);
+	recv_start(&recv_ctx2, bus, c1, &data2);
+	coro_bus_channel_close(bus, c1);
+	unit_assert(!recv_ctx2.is_started);
+	unit_assert(coro_bus_channel_open(bus, 3) == c1);
+	unit_assert(coro_bus_send(bus, c1, 123) == 0);
+	unit_assert(recv_join(&recv_ctx1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	unit_assert(data1 == 987);
+	unit_assert(recv_join(&recv_ctx2) == 0 && data2 == 123);
+	coro_bus_channel_close(bus, c1);
+
 	coro_bus_delete(bus);
 	unit_test_finish();
 }
@@ -1314,6 +1343,57 @@ test_send_vector_blocking_recv_many(void)
 #endif
 }
 
+static void
+test_send_vector_wakes_receivers(void)
+{
+#if NEED_BATCH
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open(bus, 100);
+	unit_assert(c1 >= 0);
+
+	unit_msg("start receivers");
+	enum { coro_count = 10 };
+	struct ctx_recv ctx[coro_count];
+	unsigned data[coro_count];
+	for (unsigned i = 0; i < coro_count; ++i)
+		recv_start(&ctx[i], bus, c1, &data[i]);
+	coro_yield();
+
+	unit_msg("one batch wakes all of them at once");
+	unsigned msgs[coro_count];
+	for (unsigned i = 0; i < coro_count; ++i)
+		msgs[i] = i;
+	unit_assert(coro_bus_send_v(bus, c1, msgs, coro_count) ==
+		coro_count);
+	coro_yield();
+	for (unsigned i = 0; i < coro_count; ++i)
+		unit_assert(ctx[i].is_done);
+	for (unsigned i = 0; i < coro_count; ++i) {
+		unit_assert(recv_join(&ctx[i]) == 0);
+		unit_assert(data[i] == i);
+	}
+
+	unit_msg("a half of them for a half of the batch");
+	for (unsigned i = 0; i < coro_count; ++i)
+		recv_start(&ctx[i], bus, c1, &data[i]);
+	coro_yield();
+	unit_assert(coro_bus_send_v(bus, c1, msgs, coro_count / 2) ==
+		coro_count / 2);
+	coro_yield();
+	for (unsigned i = 0; i < coro_count; ++i)
+		unit_assert(ctx[i].is_done == (i < coro_count / 2));
+	unit_assert(coro_bus_send_v(bus, c1, msgs, coro_count / 2) ==
+		coro_count / 2);
+	for (unsigned i = 0; i < coro_count; ++i)
+		unit_assert(recv_join(&ctx[i]) == 0);
+
+	coro_bus_channel_close(bus, c1);
+	coro_bus_delete(bus);
+	unit_test_finish();
+#endif
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 static void
@@ -1603,41 +1683,866 @@ test_recv_vector_blocking_recv_many(void)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+static int msg_drop_count = 0;
+
+static void
+msg_drop_f(struct coro_bus *bus, void *ptr, size_t len)
+{
+	++msg_drop_count;
+	coro_bus_msg_free(bus, ptr, len);
+}
+
+static void
+test_msg_basic(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open_msg(bus, 2, msg_drop_f);
+	unit_assert(c1 >= 0);
+	int c2 = coro_bus_channel_open(bus, 2);
+	unit_assert(c2 >= 0);
+
+	unit_msg("wrong channel types");
+	unsigned data;
+	struct coro_bus_msg msg;
+	unit_assert(coro_bus_try_send(bus, c1, 1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WRONG_TYPE);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WRONG_TYPE);
+	unit_assert(coro_bus_try_send_msg(bus, c2, NULL, 0) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WRONG_TYPE);
+	unit_assert(coro_bus_try_recv_msg(bus, c2, &msg) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WRONG_TYPE);
+
+	unit_msg("payloads are passed, not copied");
+	char *small = coro_bus_msg_alloc(bus, 10);
+	strcpy(small, "small");
+	char *big = coro_bus_msg_alloc(bus, 1000);
+	strcpy(big, "big");
+	unit_assert(coro_bus_send_msg(bus, c1, small, 10) == 0);
+	unit_assert(coro_bus_send_msg(bus, c1, big, 1000) == 0);
+	unit_assert(coro_bus_try_send_msg(bus, c1, NULL, 0) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_recv_msg(bus, c1, &msg) == 0);
+	unit_assert(msg.ptr == small && msg.len == 10);
+	unit_assert(strcmp(msg.ptr, "small") == 0);
+	coro_bus_msg_free(bus, msg.ptr, msg.len);
+	unit_assert(coro_bus_try_recv_msg(bus, c1, &msg) == 0);
+	unit_assert(msg.ptr == big && msg.len == 1000);
+	coro_bus_msg_free(bus, msg.ptr, msg.len);
+	unit_assert(coro_bus_try_recv_msg(bus, c1, &msg) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("small payloads are reused");
+	void *p1 = coro_bus_msg_alloc(bus, 64);
+	coro_bus_msg_free(bus, p1, 64);
+	unit_assert(coro_bus_msg_alloc(bus, 1) == p1);
+	coro_bus_msg_free(bus, p1, 1);
+
+	unit_msg("dropped on close");
+	unit_assert(coro_bus_send_msg(bus, c1, coro_bus_msg_alloc(bus, 8),
+		8) == 0);
+	unit_assert(coro_bus_send_msg(bus, c1, coro_bus_msg_alloc(bus, 100),
+		100) == 0);
+	coro_bus_channel_close(bus, c1);
+	unit_assert(msg_drop_count == 2);
+
+	unit_msg("dropped on bus delete");
+	c1 = coro_bus_channel_open_msg(bus, 2, msg_drop_f);
+	unit_assert(coro_bus_send_msg(bus, c1, coro_bus_msg_alloc(bus, 8),
+		8) == 0);
+	coro_bus_delete(bus);
+	unit_assert(msg_drop_count == 3);
+	unit_test_finish();
+}
+
+static void
+test_broadcast_msg(void)
+{
+#if NEED_BROADCAST
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	msg_drop_count = 0;
+
+	unit_msg("no message channels");
+	int c0 = coro_bus_channel_open(bus, 2);
+	unit_assert(c0 >= 0);
+	char *p = coro_bus_msg_alloc(bus, 16);
+	unit_assert(coro_bus_broadcast_msg(bus, p, 16) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	unit_assert(coro_bus_try_broadcast_msg(bus, p, 16) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("one payload is shared by all the channels");
+	int c1 = coro_bus_channel_open_msg(bus, 1, msg_drop_f);
+	int c2 = coro_bus_channel_open_msg(bus, 2, NULL);
+	int c3 = coro_bus_channel_open_msg(bus, 2, NULL);
+	strcpy(p, "shared");
+	unit_assert(coro_bus_broadcast_msg(bus, p, 16) == 0);
+	unsigned data;
+	unit_assert(coro_bus_try_recv(bus, c0, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	struct coro_bus_msg msg;
+	unit_assert(coro_bus_recv_msg(bus, c2, &msg) == 0);
+	unit_assert(msg.ptr == p && msg.len == 16);
+	coro_bus_msg_free(bus, msg.ptr, msg.len);
+	unit_assert(coro_bus_recv_msg(bus, c3, &msg) == 0);
+	unit_assert(msg.ptr == p && strcmp(msg.ptr, "shared") == 0);
+	coro_bus_msg_free(bus, msg.ptr, msg.len);
+
+	unit_msg("a full channel blocks the broadcast");
+	void *p2 = coro_bus_msg_alloc(bus, 16);
+	unit_assert(p2 != p);
+	unit_assert(coro_bus_try_broadcast_msg(bus, p2, 16) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_try_broadcast(bus, 123) == 0);
+	unit_assert(coro_bus_recv(bus, c0, &data) == 0 && data == 123);
+	coro_bus_msg_free(bus, p2, 16);
+
+	unit_msg("the last reference frees the payload");
+	coro_bus_channel_close(bus, c1);
+	unit_assert(msg_drop_count == 1);
+	unit_assert(coro_bus_msg_alloc(bus, 16) == p);
+	coro_bus_msg_free(bus, p, 16);
+
+	coro_bus_channel_close(bus, c0);
+	coro_bus_channel_close(bus, c2);
+	coro_bus_channel_close(bus, c3);
+	coro_bus_delete(bus);
+	unit_test_finish();
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct ctx_select {
+	struct coro_bus *bus;
+	const struct coro_bus_sel *ops;
+	int count;
+	double timeout;
+	int rc;
+	enum coro_bus_error_code err;
+	bool is_done;
+	struct coro *worker;
+};
+
 static void *
-coro_main_f(void *arg)
+select_f(void *arg)
+{
+	struct ctx_select *ctx = arg;
+	ctx->rc = coro_bus_select(ctx->bus, ctx->ops, ctx->count,
+		ctx->timeout);
+	ctx->err = coro_bus_errno();
+	ctx->is_done = true;
+	return NULL;
+}
+
+static void
+select_start(struct ctx_select *ctx, struct coro_bus *bus,
+	const struct coro_bus_sel *ops, int count, double timeout)
+{
+	ctx->bus = bus;
+	ctx->ops = ops;
+	ctx->count = count;
+	ctx->timeout = timeout;
+	ctx->rc = -1;
+	ctx->err = CORO_BUS_ERR_NONE;
+	ctx->is_done = false;
+	ctx->worker = coro_new(select_f, ctx);
+}
+
+static int
+select_join(struct ctx_select *ctx)
+{
+	unit_assert(coro_join(ctx->worker) == NULL);
+	unit_assert(ctx->is_done);
+	coro_bus_errno_set(ctx->err);
+	return ctx->rc;
+}
+
+static void
+test_select(void)
 {
-	(void)arg;
-	test_basic();
-	test_channel_reopen();
-	test_multiple_channels();
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c1 = coro_bus_channel_open(bus, 1);
+	int c2 = coro_bus_channel_open(bus, 1);
+	int c3 = coro_bus_channel_open(bus, 1);
+	unit_assert(c1 >= 0 && c2 >= 0 && c3 >= 0);
+	unsigned out[3] = {0, 0, 0};
+	struct coro_bus_sel ops[3];
+	int chans[3] = {c1, c2, c3};
+	for (int i = 0; i < 3; ++i) {
+		ops[i].type = CORO_BUS_SEL_RECV;
+		ops[i].channel = chans[i];
+		ops[i].data = 0;
+		ops[i].out = &out[i];
+	}
+
+	unit_msg("nothing is ready");
+	unit_assert(coro_bus_select(bus, ops, 3, 0) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_select(bus, ops, 3, 0.02) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
 
-	test_send_basic();
-	test_send_blocking();
-	test_send_blocking_recv_many();
+	unit_msg("one is ready");
+	unit_assert(coro_bus_send(bus, c2, 12) == 0);
+	unit_assert(coro_bus_select(bus, ops, 3, -1) == 1 && out[1] == 12);
 
-	test_recv_basic();
-	test_recv_blocking();
-	test_recv_blocking_send_many();
+	unit_msg("wait for any");
+	struct ctx_select ctx;
+	select_start(&ctx, bus, ops, 3, -1);
+	coro_yield();
+	unit_assert(!ctx.is_done);
+	unit_assert(coro_bus_send(bus, c3, 34) == 0);
+	unit_assert(select_join(&ctx) == 2 && out[2] == 34);
+
+	unit_msg("mixed send and recv");
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	struct coro_bus_sel mixed[2];
+	mixed[0].type = CORO_BUS_SEL_SEND;
+	mixed[0].channel = c1;
+	mixed[0].data = 56;
+	mixed[0].out = NULL;
+	mixed[1] = ops[1];
+	select_start(&ctx, bus, mixed, 2, -1);
+	coro_yield();
+	unit_assert(!ctx.is_done);
+	unsigned data = 0;
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 1);
+	unit_assert(select_join(&ctx) == 0);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) == 0 && data == 56);
+
+	unit_msg("close during the wait");
+	select_start(&ctx, bus, ops, 3, -1);
+	coro_yield();
+	unit_assert(!ctx.is_done);
+	coro_bus_channel_close(bus, c2);
+	unit_assert(select_join(&ctx) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
 
-	test_stress_send_recv_concurrent();
-	test_send_recv_very_many();
-	test_wakeup_on_close();
-	test_close_non_empty_bus();
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
 
-	test_broadcast_basic();
-	test_broadcast_blocking_basic();
-	test_broadcast_blocking_drop_channel_during_wait();
+////////////////////////////////////////////////////////////////////////////////
 
-	test_send_vector_basic();
-	test_send_vector_blocking();
-	test_send_vector_blocking_recv_many();
+struct ctx_producer {
+	struct coro_bus_port *port;
+	unsigned id;
+	unsigned count;
+	pthread_t tid;
+};
 
-	test_recv_vector_basic();
-	test_recv_vector_blocking();
-	test_recv_vector_blocking_recv_many();
+static void *
+producer_thread_f(void *arg)
+{
+	struct ctx_producer *ctx = arg;
+	for (unsigned i = 0; i < ctx->count;) {
+		unsigned data[4];
+		unsigned n = 0;
+		for (; n < 4 && i + n < ctx->count; ++n)
+			data[n] = ctx->id << 24 | (i + n);
+		int rc = coro_bus_port_try_send_v(ctx->port, data, n);
+		if (rc < 0) {
+			unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+			sched_yield();
+			continue;
+		}
+		i += rc;
+	}
 	return NULL;
 }
 
+static void
+test_mpsc(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+
+	unit_msg("only cross-thread channels have ports");
+	int c1 = coro_bus_channel_open(bus, 2);
+	unit_assert(coro_bus_channel_port(bus, c1) == NULL);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WRONG_TYPE);
+	unit_assert(coro_bus_channel_port(bus, 100) == NULL);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("local send and recv");
+	int c2 = coro_bus_channel_open_mpsc(bus, 3);
+	unit_assert(c2 >= 0);
+	struct coro_bus_port *port = coro_bus_channel_port(bus, c2);
+	unit_assert(port != NULL);
+	unsigned data = 0;
+	unit_assert(coro_bus_try_recv(bus, c2, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_send(bus, c2, 1) == 0);
+	unit_assert(coro_bus_port_try_send(port, 2) == 0);
+	unit_assert(coro_bus_recv(bus, c2, &data) == 0 && data == 1);
+	unit_assert(coro_bus_recv(bus, c2, &data) == 0 && data == 2);
+
+	unit_msg("limit is rounded up");
+	for (unsigned i = 0; i < 4; ++i)
+		unit_assert(coro_bus_port_try_send(port, i) == 0);
+	unit_assert(coro_bus_port_try_send(port, 4) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_try_send(bus, c2, 4) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unsigned batch[8];
+	unit_assert(coro_bus_recv_v(bus, c2, batch, 8) == 4);
+
+	unit_msg("the broadcast skips them");
+	unit_assert(coro_bus_broadcast(bus, 5) == 0);
+	unit_assert(coro_bus_try_recv(bus, c2, &data) != 0);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 5);
+
+	unit_msg("select is woken up by another thread");
+	struct ctx_producer producers[3];
+	producers[0].port = port;
+	producers[0].id = 0;
+	producers[0].count = 1;
+	struct coro_bus_sel ops[2] = {
+		{CORO_BUS_SEL_RECV, c1, 0, &data},
+		{CORO_BUS_SEL_RECV, c2, 0, &data},
+	};
+	unit_fail_if(pthread_create(&producers[0].tid, NULL,
+		producer_thread_f, &producers[0]) != 0);
+	unit_assert(coro_bus_select(bus, ops, 2, -1) == 1 && data == 0);
+	pthread_join(producers[0].tid, NULL);
+
+	unit_msg("many producer threads");
+	const unsigned count = 20000;
+	for (unsigned i = 0; i < 3; ++i) {
+		producers[i].port = port;
+		producers[i].id = i;
+		producers[i].count = count;
+		unit_fail_if(pthread_create(&producers[i].tid, NULL,
+			producer_thread_f, &producers[i]) != 0);
+	}
+	unsigned next[3] = {0, 0, 0};
+	bool is_ordered = true;
+	for (unsigned total = 0; total < 3 * count;) {
+		int rc = coro_bus_recv_v(bus, c2, batch, 8);
+		unit_assert(rc > 0);
+		for (int i = 0; i < rc; ++i) {
+			unsigned id = batch[i] >> 24;
+			unit_assert(id < 3);
+			is_ordered = is_ordered &&
+				(batch[i] & 0xffffff) == next[id];
+			++next[id];
+		}
+		total += rc;
+	}
+	for (unsigned i = 0; i < 3; ++i)
+		pthread_join(producers[i].tid, NULL);
+	unit_check(is_ordered, "order of each producer is kept");
+	unit_assert(coro_bus_try_recv(bus, c2, &data) != 0);
+
+	coro_bus_channel_close(bus, c1);
+	coro_bus_channel_close(bus, c2);
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+struct ctx_shared {
+	struct coro_bus *bus;
+	int in;
+	int out;
+	int closed;
+	unsigned count;
+	bool is_ok;
+	int close_rc;
+	enum coro_bus_error_code close_err;
+	pthread_t tid;
+};
+
+/** Sends back each number plus 1, then waits in a channel closed. */
+static void *
+shared_echo_f(void *arg)
+{
+	struct ctx_shared *ctx = arg;
+	ctx->is_ok = true;
+	for (unsigned i = 0; i < ctx->count && ctx->is_ok; ++i) {
+		unsigned data;
+		ctx->is_ok = coro_bus_recv(ctx->bus, ctx->in, &data) == 0 &&
+			coro_bus_send(ctx->bus, ctx->out, data + 1) == 0;
+	}
+	unsigned data;
+	ctx->close_rc = coro_bus_recv(ctx->bus, ctx->closed, &data);
+	ctx->close_err = coro_bus_errno();
+	return NULL;
+}
+
+/** A thread with its own engine, running one echo coroutine. */
+static void *
+shared_thread_f(void *arg)
+{
+	coro_sched_thread_init();
+	struct coro *echo = coro_new(shared_echo_f, arg);
+	coro_sched_run();
+	coro_join(echo);
+	coro_sched_thread_destroy();
+	return NULL;
+}
+
+struct ctx_shared_recv {
+	struct coro_bus *bus;
+	int channel;
+	unsigned count;
+	bool is_ordered;
+};
+
+static void *
+shared_recv_f(void *arg)
+{
+	struct ctx_shared_recv *ctx = arg;
+	ctx->is_ordered = true;
+	for (unsigned i = 0; i < ctx->count;) {
+		unsigned batch[8];
+		int rc = coro_bus_recv_v(ctx->bus, ctx->channel, batch, 8);
+		if (rc <= 0) {
+			ctx->is_ordered = false;
+			break;
+		}
+		for (int j = 0; j < rc; ++j, ++i)
+			ctx->is_ordered = ctx->is_ordered && batch[j] == i + 1;
+	}
+	return NULL;
+}
+
+static void
+test_shared(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+
+	unit_msg("same engine send and recv");
+	int c1 = coro_bus_channel_open_shared(bus, 3);
+	unit_assert(c1 >= 0);
+	unsigned data = 0;
+	unit_assert(coro_bus_try_recv(bus, c1, &data) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	for (unsigned i = 0; i < 4; ++i)
+		unit_assert(coro_bus_send(bus, c1, i) == 0);
+	unit_assert(coro_bus_try_send(bus, c1, 4) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unsigned batch[8];
+	unit_assert(coro_bus_recv_v(bus, c1, batch, 8) == 4);
+	unit_assert(batch[0] == 0 && batch[3] == 3);
+	unit_assert(coro_bus_channel_port(bus, c1) == NULL);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WRONG_TYPE);
+
+	unit_msg("the broadcast skips them, select rejects them");
+	int c2 = coro_bus_channel_open(bus, 2);
+	unit_assert(coro_bus_broadcast(bus, 5) == 0);
+	unit_assert(coro_bus_try_recv(bus, c1, &data) != 0);
+	unit_assert(coro_bus_recv(bus, c2, &data) == 0 && data == 5);
+	struct coro_bus_sel ops[2] = {
+		{CORO_BUS_SEL_RECV, c2, 0, &data},
+		{CORO_BUS_SEL_RECV, c1, 0, &data},
+	};
+	unit_assert(coro_bus_select(bus, ops, 2, 0) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WRONG_TYPE);
+	coro_bus_channel_close(bus, c2);
+
+	unit_msg("ping-pong with another engine");
+	struct ctx_shared ctx;
+	ctx.bus = bus;
+	ctx.in = c1;
+	ctx.out = coro_bus_channel_open_shared(bus, 2);
+	ctx.closed = coro_bus_channel_open_shared(bus, 2);
+	ctx.count = 1000 + 20000;
+	unit_fail_if(pthread_create(&ctx.tid, NULL, shared_thread_f,
+		&ctx) != 0);
+	bool is_ok = true;
+	for (unsigned i = 0; i < 1000 && is_ok; ++i) {
+		is_ok = coro_bus_send(bus, ctx.in, i) == 0 &&
+			coro_bus_recv(bus, ctx.out, &data) == 0 &&
+			data == i + 1;
+	}
+	unit_check(is_ok, "each number came back");
+
+	unit_msg("both sides block on full rings");
+	struct ctx_shared_recv ctx_recv;
+	ctx_recv.bus = bus;
+	ctx_recv.channel = ctx.out;
+	ctx_recv.count = 20000;
+	struct coro *receiver = coro_new(shared_recv_f, &ctx_recv);
+	for (unsigned i = 0; i < 20000;) {
+		unsigned n = 0;
+		for (; n < 8 && i + n < 20000; ++n)
+			batch[n] = i + n;
+		int rc = coro_bus_send_v(bus, ctx.in, batch, n);
+		unit_assert(rc > 0);
+		i += rc;
+	}
+	coro_join(receiver);
+	unit_check(ctx_recv.is_ordered, "order is kept");
+
+	unit_msg("close wakes up a waiter of another engine");
+	struct coro_bus_channel_stats stats;
+	do {
+		coro_yield();
+		unit_assert(coro_bus_channel_stats(bus, ctx.closed,
+			&stats) == 0);
+	} while (stats.recv_wait_count == 0);
+	coro_bus_channel_close(bus, ctx.closed);
+	pthread_join(ctx.tid, NULL);
+	unit_check(ctx.is_ok, "the echo didn't fail");
+	unit_check(ctx.close_rc == -1 &&
+		ctx.close_err == CORO_BUS_ERR_NO_CHANNEL, "closed recv");
+	unit_assert(coro_bus_channel_stats(bus, ctx.in, &stats) == 0);
+	unit_check(stats.send_count == stats.recv_count &&
+		stats.send_count == 4 + 1000 + 20000, "all were received");
+
+	coro_bus_channel_close(bus, c1);
+	coro_bus_channel_close(bus, ctx.out);
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+static void
+test_channel_stats(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	struct coro_bus_channel_stats stats;
+	unit_assert(coro_bus_channel_stats(bus, 0, &stats) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+
+	unit_msg("sends and receives are counted");
+	int c1 = coro_bus_channel_open(bus, 2);
+	unit_assert(coro_bus_send(bus, c1, 1) == 0);
+	unit_assert(coro_bus_send(bus, c1, 2) == 0);
+	unit_assert(coro_bus_try_send(bus, c1, 3) != 0);
+	unsigned data;
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0);
+	unit_assert(coro_bus_channel_stats(bus, c1, &stats) == 0);
+	unit_assert(stats.size_limit == 2 && stats.size == 1);
+	unit_assert(stats.max_size == 2);
+	unit_assert(stats.send_count == 2 && stats.recv_count == 1);
+	unit_assert(stats.send_wait_count == 0 && stats.recv_wait_count == 0);
+	unit_assert(stats.wait_time_ns == 0);
+
+	unit_msg("waits are counted");
+	unit_assert(coro_bus_send(bus, c1, 3) == 0);
+	struct ctx_send ctx_s;
+	send_start(&ctx_s, bus, c1, 4);
+	coro_sleep(0.01);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0);
+	unit_assert(send_join(&ctx_s) == 0);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0);
+	unit_assert(coro_bus_recv(bus, c1, &data) == 0 && data == 4);
+	struct ctx_recv ctx_r;
+	recv_start(&ctx_r, bus, c1, &data);
+	coro_yield();
+	unit_assert(coro_bus_send(bus, c1, 5) == 0);
+	unit_assert(recv_join(&ctx_r) == 0 && data == 5);
+	unit_assert(coro_bus_channel_stats(bus, c1, &stats) == 0);
+	unit_assert(stats.size == 0 && stats.max_size == 2);
+	unit_assert(stats.send_count == 5 && stats.recv_count == 5);
+	unit_assert(stats.send_wait_count == 1 && stats.recv_wait_count == 1);
+	unit_assert(stats.wait_time_ns >= 10000000);
+
+	unit_msg("dump");
+	char *buf = NULL;
+	size_t size = 0;
+	FILE *out = open_memstream(&buf, &size);
+	coro_bus_dump(bus, out);
+	fclose(out);
+	unit_assert(strstr(buf, "channel 0: size 0/2, max size 2, sent 5, "
+		"received 5, send waits 1, recv waits 1") == buf);
+	free(buf);
+
+	coro_bus_channel_close(bus, c1);
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+static void
+test_budget(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	struct coro_bus_budget_stats budget;
+	coro_bus_budget_stats(bus, &budget);
+	unit_assert(budget.limit == 0 && budget.used == 0);
+
+	unit_msg("the queues grow on demand");
+	int c1 = coro_bus_channel_open(bus, 1000);
+	struct coro_bus_channel_stats stats;
+	unit_assert(coro_bus_channel_stats(bus, c1, &stats) == 0);
+	unit_assert(stats.bytes == 0 && stats.alloc_bytes < 1000);
+	unsigned data[100];
+	for (unsigned i = 0; i < 100; ++i)
+		data[i] = i;
+	unit_assert(coro_bus_try_send_v(bus, c1, data, 100) == 100);
+	unit_assert(coro_bus_channel_stats(bus, c1, &stats) == 0);
+	unit_assert(stats.bytes == 100 * sizeof(unsigned));
+	unit_assert(stats.alloc_bytes == 128 * sizeof(unsigned));
+	unsigned out[100];
+	unit_assert(coro_bus_try_recv_v(bus, c1, out, 100) == 100);
+	unit_assert(memcmp(data, out, sizeof(data)) == 0);
+
+	unit_msg("the budget is shared by the channels");
+	coro_bus_set_budget(bus, 10 * sizeof(unsigned));
+	int c2 = coro_bus_channel_open(bus, 1000);
+	unit_assert(coro_bus_try_send_v(bus, c1, data, 8) == 8);
+	unit_assert(coro_bus_try_send_v(bus, c2, data, 8) == 2);
+	unit_assert(coro_bus_try_send(bus, c2, 0) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	coro_bus_budget_stats(bus, &budget);
+	unit_assert(budget.used == 10 * sizeof(unsigned));
+	unit_assert(coro_bus_channel_stats(bus, c2, &stats) == 0);
+	unit_assert(stats.bytes == 2 * sizeof(unsigned));
+
+	unit_msg("a recv from another channel wakes the sender");
+	struct ctx_send ctx;
+	send_start(&ctx, bus, c2, 5);
+	coro_yield();
+	unit_assert(ctx.is_started && !ctx.is_done);
+	unsigned value;
+	unit_assert(coro_bus_recv(bus, c1, &value) == 0 && value == 0);
+	unit_assert(send_join(&ctx) == 0);
+	coro_bus_budget_stats(bus, &budget);
+	unit_assert(budget.used == budget.limit && budget.wait_count == 1);
+
+	unit_msg("a bigger limit wakes the sender");
+	send_start(&ctx, bus, c2, 6);
+	coro_yield();
+	unit_assert(!ctx.is_done);
+	coro_bus_set_budget(bus, 11 * sizeof(unsigned));
+	unit_assert(send_join(&ctx) == 0);
+
+	unit_msg("a close wakes the sender of the closed channel");
+	send_start(&ctx, bus, c2, 7);
+	coro_yield();
+	unit_assert(!ctx.is_done);
+	coro_bus_channel_close(bus, c2);
+	unit_assert(send_join(&ctx) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+	coro_bus_budget_stats(bus, &budget);
+	unit_assert(budget.used == 7 * sizeof(unsigned));
+
+	unit_msg("payloads are counted, a big one goes alone");
+	coro_bus_channel_close(bus, c1);
+	coro_bus_budget_stats(bus, &budget);
+	unit_assert(budget.used == 0);
+	unit_assert(budget.max_used == 100 * sizeof(unsigned));
+	int c3 = coro_bus_channel_open_msg(bus, 10, NULL);
+	void *big = coro_bus_msg_alloc(bus, 100);
+	unit_assert(coro_bus_try_send_msg(bus, c3, big, 100) == 0);
+	void *small = coro_bus_msg_alloc(bus, 1);
+	unit_assert(coro_bus_try_send_msg(bus, c3, small, 1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_channel_stats(bus, c3, &stats) == 0);
+	unit_assert(stats.bytes == sizeof(struct coro_bus_msg) + 100);
+	struct coro_bus_msg msg;
+	unit_assert(coro_bus_recv_msg(bus, c3, &msg) == 0 && msg.len == 100);
+	coro_bus_msg_free(bus, msg.ptr, msg.len);
+	unit_assert(coro_bus_try_send_msg(bus, c3, small, 1) == 0);
+
+	unit_msg("select waits for the budget");
+	coro_bus_set_budget(bus, sizeof(struct coro_bus_msg) + 1);
+	int c4 = coro_bus_channel_open(bus, 10);
+	struct coro_bus_sel op = {CORO_BUS_SEL_SEND, c4, 8, NULL};
+	unit_assert(coro_bus_select(bus, &op, 1, 0.01) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	coro_bus_budget_stats(bus, &budget);
+	uint64_t wait_count = budget.wait_count;
+	unit_assert(coro_bus_channel_stats(bus, c4, &stats) == 0);
+	unit_assert(stats.send_wait_count == 0);
+	unit_assert(coro_bus_try_recv_msg(bus, c3, &msg) == 0);
+	coro_bus_msg_free(bus, msg.ptr, msg.len);
+	unit_assert(coro_bus_select(bus, &op, 1, 0) == 0);
+	coro_bus_budget_stats(bus, &budget);
+	unit_assert(budget.wait_count == wait_count);
+#if NEED_BROADCAST
+
+	unit_msg("broadcast waits for the budget of all the channels");
+	coro_bus_set_budget(bus, 2 * sizeof(unsigned));
+	int c5 = coro_bus_channel_open(bus, 10);
+	unit_assert(coro_bus_try_broadcast(bus, 9) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(coro_bus_try_recv(bus, c4, &value) == 0 && value == 8);
+	unit_assert(coro_bus_try_broadcast(bus, 9) == 0);
+	coro_bus_channel_close(bus, c5);
+#endif
+
+	unit_msg("dump");
+	char *buf = NULL;
+	size_t size = 0;
+	FILE *file = open_memstream(&buf, &size);
+	coro_bus_dump(bus, file);
+	fclose(file);
+	unit_assert(strstr(buf, "budget: used ") != NULL);
+	free(buf);
+
+	coro_bus_channel_close(bus, c3);
+	coro_bus_channel_close(bus, c4);
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct rec16 {
+	uint64_t id;
+	uint64_t value;
+};
+
+struct rec64 {
+	uint64_t words[8];
+};
+
+CORO_BUS_CHANNEL_DEFINE(rec16_channel, struct rec16)
+CORO_BUS_CHANNEL_DEFINE(rec64_channel, struct rec64)
+
+struct ctx_recv_rec {
+	struct coro_bus *bus;
+	int channel;
+	struct rec64 rec;
+	int rc;
+	enum coro_bus_error_code err;
+};
+
+static void *
+recv_rec64_f(void *arg)
+{
+	struct ctx_recv_rec *ctx = arg;
+	ctx->rc = rec64_channel_recv(ctx->bus, ctx->channel, &ctx->rec);
+	ctx->err = coro_bus_errno();
+	return NULL;
+}
+
+static void
+test_rec_channel(void)
+{
+	unit_test_start();
+	struct coro_bus *bus = coro_bus_new();
+	int c16 = rec16_channel_open(bus, 5);
+	unit_assert(c16 >= 0);
+	int c64 = rec64_channel_open(bus, 4);
+	unit_assert(c64 >= 0);
+	int c = coro_bus_channel_open(bus, 4);
+	unit_assert(c >= 0);
+
+	unit_msg("wrong channel types");
+	struct rec16 r16 = {1, 2};
+	struct rec64 r64;
+	unit_assert(rec16_channel_try_send(bus, c64, &r16) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WRONG_TYPE);
+	unit_assert(rec64_channel_try_recv(bus, c16, &r64) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WRONG_TYPE);
+	unit_assert(coro_bus_try_send(bus, c16, 1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WRONG_TYPE);
+	unit_assert(rec16_channel_try_send(bus, c, &r16) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WRONG_TYPE);
+
+	unit_msg("records are copied in order, across the ring end");
+	struct rec16 in[8], out[8];
+	for (int i = 0; i < 8; ++i) {
+		in[i].id = i;
+		in[i].value = i * 100;
+	}
+	/* The ring of 8, the limit of 5. */
+	unit_assert(rec16_channel_send_v(bus, c16, in, 8) == 5);
+	unit_assert(rec16_channel_try_send_v(bus, c16, in, 8) == -1);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+	unit_assert(rec16_channel_recv_v(bus, c16, out, 3) == 3);
+	unit_assert(rec16_channel_send_v(bus, c16, &in[5], 3) == 3);
+	unit_assert(rec16_channel_recv_v(bus, c16, &out[3], 8) == 5);
+	bool ok = true;
+	for (int i = 0; i < 8; ++i)
+		ok = ok && out[i].id == (uint64_t)i && out[i].value == i * 100u;
+	unit_assert(ok);
+	unit_assert(rec16_channel_try_recv(bus, c16, &r16) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_WOULD_BLOCK);
+
+	unit_msg("blocking recv is woken by a send");
+	struct ctx_recv_rec ctx;
+	ctx.bus = bus;
+	ctx.channel = c64;
+	struct coro *worker = coro_new(recv_rec64_f, &ctx);
+	coro_yield();
+	for (int i = 0; i < 8; ++i)
+		r64.words[i] = 7 + i;
+	unit_assert(rec64_channel_send(bus, c64, &r64) == 0);
+	coro_join(worker);
+	unit_assert(ctx.rc == 0 && ctx.err == CORO_BUS_ERR_NONE);
+	unit_assert(memcmp(&ctx.rec, &r64, sizeof(r64)) == 0);
+
+#if NEED_BROADCAST
+	unit_msg("broadcast skips the record channels");
+	unit_assert(rec64_channel_send(bus, c64, &r64) == 0);
+	unit_assert(coro_bus_broadcast(bus, 42) == 0);
+	unsigned data;
+	unit_assert(coro_bus_try_recv(bus, c, &data) == 0 && data == 42);
+	unit_assert(rec64_channel_try_recv(bus, c64, &r64) == 0);
+	unit_assert(r64.words[0] == 7);
+	coro_bus_channel_close(bus, c);
+	unit_assert(coro_bus_try_broadcast(bus, 1) != 0);
+	unit_assert(coro_bus_errno() == CORO_BUS_ERR_NO_CHANNEL);
+#endif
+
+	unit_msg("blocked recv gets an error on close");
+	worker = coro_new(recv_rec64_f, &ctx);
+	coro_yield();
+	coro_bus_channel_close(bus, c64);
+	coro_join(worker);
+	unit_assert(ctx.rc == -1 && ctx.err == CORO_BUS_ERR_NO_CHANNEL);
+	coro_bus_delete(bus);
+	unit_test_finish();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void *
+coro_main_f(void *arg)
+{
+	char **argv = arg;
+	unit_add(test_basic);
+	unit_add(test_channel_reopen);
+	unit_add(test_multiple_channels);
+
+	unit_add(test_send_basic);
+	unit_add(test_send_blocking);
+	unit_add(test_send_blocking_recv_many);
+
+	unit_add(test_recv_basic);
+	unit_add(test_recv_blocking);
+	unit_add(test_recv_blocking_send_many);
+
+	unit_add(test_stress_send_recv_concurrent);
+	unit_add(test_send_recv_very_many);
+	unit_add(test_wakeup_on_close);
+	unit_add(test_close_non_empty_bus);
+	unit_add(test_msg_basic);
+	unit_add(test_broadcast_msg);
+	unit_add(test_select);
+	unit_add(test_mpsc);
+	unit_add(test_shared);
+	unit_add(test_channel_stats);
+	unit_add(test_budget);
+	unit_add(test_rec_channel);
+
+	unit_add(test_broadcast_basic);
+	unit_add(test_broadcast_blocking_basic);
+	unit_add(test_broadcast_blocking_drop_channel_during_wait);
+
+	unit_add(test_send_vector_basic);
+	unit_add(test_send_vector_blocking);
+	unit_add(test_send_vector_blocking_recv_many);
+	unit_add(test_send_vector_wakes_receivers);
+
+	unit_add(test_recv_vector_basic);
+	unit_add(test_recv_vector_blocking);
+	unit_add(test_recv_vector_blocking_recv_many);
+	int argc = 0;
+	while (argv[argc] != NULL)
+		++argc;
+	return unit_run(argc, argv) == 0 ? NULL : (void *)-1;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -1653,7 +2558,8 @@ main(int argc, char **argv)
 		return 0;
 	}
 	coro_sched_init();
-	struct coro *main_coro = coro_new(coro_main_f, NULL);
+	/* The tests are run in a coroutine, the forked ones too. */
+	struct coro *main_coro = coro_new(coro_main_f, argv);
 	coro_sched_run();
 	void *rc = coro_join(main_coro);
 	unit_check(rc == NULL, "main coro rc");
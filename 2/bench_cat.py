@@ -0,0 +1,64 @@
+import argparse
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+# Benchmark of the built-in cat against /bin/cat. Each shell runs a
+# script of 'cat file | wc -c' lines, where the built-in copies the
+# file into the pipe with splice() or sendfile(), without a fork and
+# without copying the data through the user space.
+
+parser = argparse.ArgumentParser(description='Built-in cat benchmark')
+parser.add_argument('-e', type=str, default='./mybash',
+                    help='shell executable')
+parser.add_argument('--file_mb', type=int, default=256,
+                    help='Size of the file to cat')
+parser.add_argument('--lines', type=int, default=10,
+                    help='Number of the cat lines in the script')
+parser.add_argument('--runs', type=int, default=5,
+                    help='Number of runs of each script, the median is taken')
+args = parser.parse_args()
+
+data = tempfile.NamedTemporaryFile('wb', suffix='.txt', delete=False)
+chunk = b'a' * 1023 + b'\n'
+for _ in range(args.file_mb * 1024):
+    data.write(chunk)
+data.close()
+size = args.file_mb * 1024 * 1024
+
+def make_script(cat):
+    script = tempfile.NamedTemporaryFile('w', suffix='.sh', delete=False)
+    script.write('{} {} | wc -c\n'.format(cat, data.name) * args.lines)
+    script.close()
+    return script.name
+
+cases = [('builtin', make_script('cat')), ('/bin/cat', make_script('/bin/cat'))]
+expected = '{}\n'.format(size) * args.lines
+
+print('{')
+print('\t"file_mb": {}, "lines": {},'.format(args.file_mb, args.lines))
+print('\t"unit": "GB/s",')
+print('\t"benches": [')
+for i, (name, script) in enumerate(cases):
+    times = []
+    for _ in range(args.runs):
+        with open(script, 'rb') as f:
+            start = time.monotonic()
+            res = subprocess.run([os.path.abspath(args.e)], stdin=f,
+                                 stdout=subprocess.PIPE)
+            times.append(time.monotonic() - start)
+        if res.stdout.decode() != expected:
+            print('Bad output of {}'.format(name), file=sys.stderr)
+            sys.exit(-1)
+    times.sort()
+    gb = size * args.lines / 1e9
+    print('\t\t{{"cat": "{}", "med": {:.2f}, "max": {:.2f}}}{}'.format(
+          name, gb / times[len(times) // 2], gb / times[0],
+          ',' if i + 1 < len(cases) else ''))
+print('\t]')
+print('}')
+for _, script in cases:
+    os.unlink(script)
+os.unlink(data.name)
@@ -0,0 +1,60 @@
+import argparse
+import os
+import subprocess
+import sys
+import time
+
+# Benchmark of the pipe sizes on multi-GB pipelines. Each shell runs
+# the same pipelines of streaming commands with $SHELL_PIPE_SIZE off,
+# auto and a size for all the pipes. The data comes from /dev/zero, so
+# the pipes and the context switches are all what is measured.
+
+parser = argparse.ArgumentParser(description='Pipe size benchmark')
+parser.add_argument('-e', type=str, default='./mybash',
+                    help='shell executable')
+parser.add_argument('--gb', type=int, default=4,
+                    help='GB to push through each pipeline')
+parser.add_argument('--runs', type=int, default=3,
+                    help='Number of runs of each case, the median is taken')
+args = parser.parse_args()
+
+size = args.gb << 30
+source = 'dd if=/dev/zero bs=1M count={} status=none'.format(args.gb << 10)
+pipelines = [
+    ('dd|wc', '{} | wc -c'.format(source)),
+    ('dd|cat|cat|wc', '{} | /bin/cat | /bin/cat | wc -c'.format(source)),
+    ('dd|tr|wc', '{} | tr "\\0" a | wc -c'.format(source)),
+]
+policies = ['off', 'auto', '4M']
+
+print('{')
+print('\t"gb": {},'.format(args.gb))
+print('\t"unit": "GB/s",')
+print('\t"benches": [')
+for i, (name, line) in enumerate(pipelines):
+    for j, policy in enumerate(policies):
+        env = dict(os.environ, SHELL_PIPE_SIZE=policy, SHELL_RUSAGE='1')
+        times = []
+        for _ in range(args.runs):
+            start = time.monotonic()
+            res = subprocess.run([os.path.abspath(args.e)],
+                                 input=(line + '\n').encode(), env=env,
+                                 stdout=subprocess.PIPE,
+                                 stderr=subprocess.PIPE)
+            times.append(time.monotonic() - start)
+            if res.stdout.decode() != '{}\n'.format(size):
+                print('Bad output of {}'.format(line), file=sys.stderr)
+                sys.exit(-1)
+        # The context switches of all the commands of the last run.
+        vcsw = 0
+        for row in res.stderr.decode().splitlines()[1:-2]:
+            vcsw += int(row.split()[5])
+        times.sort()
+        gb = size / 1e9
+        last = i + 1 == len(pipelines) and j + 1 == len(policies)
+        print('\t\t{{"pipeline": "{}", "pipe_size": "{}", "med": {:.2f}, '
+              '"max": {:.2f}, "vcsw": {}}}{}'.format(
+                  name, policy, gb / times[len(times) // 2],
+                  gb / times[0], vcsw, '' if last else ','))
+print('\t]')
+print('}')
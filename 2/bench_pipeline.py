@@ -0,0 +1,63 @@
+import argparse
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+# Benchmark of pipeline launch. Each shell runs a script of long
+# 'yes | head | cat | ...' pipelines, optionally after growing its
+# heap with a huge argument, so the cost of copying the page tables
+# on fork() is visible.
+
+parser = argparse.ArgumentParser(description='Pipeline launch benchmark')
+parser.add_argument('-e', type=str, action='append', default=[],
+                    help='shell executable, can be given multiple times')
+parser.add_argument('--stages', type=int, default=50,
+                    help='Number of commands in each pipeline')
+parser.add_argument('--pipelines', type=int, default=20,
+                    help='Number of pipelines in the script')
+parser.add_argument('--heap_mb', type=int, default=128,
+                    help='Size of an argument to grow the shell heap with')
+parser.add_argument('--runs', type=int, default=5,
+                    help='Number of runs of each shell, the median is taken')
+args = parser.parse_args()
+if len(args.e) == 0:
+    args.e = ['./mybash']
+
+pipeline = 'yes | head -n 1000' + ' | cat' * (args.stages - 2) + \
+           ' | wc -l\n'
+script = tempfile.NamedTemporaryFile('w', suffix='.sh', delete=False)
+if args.heap_mb > 0:
+    script.write('true ' + 'a' * (args.heap_mb * 1024 * 1024) + '\n')
+script.write(pipeline * args.pipelines)
+script.close()
+expected = '1000\n' * args.pipelines
+
+print('{')
+print('\t"stages": {}, "pipelines": {}, "heap_mb": {},'.format(
+      args.stages, args.pipelines, args.heap_mb))
+print('\t"unit": "ms/pipeline",')
+print('\t"benches": [')
+for i, exe in enumerate(args.e):
+    times = []
+    for _ in range(args.runs):
+        with open(script.name, 'rb') as f:
+            start = time.monotonic()
+            # The heap growing command fails with E2BIG, ignore it.
+            res = subprocess.run([os.path.abspath(exe)], stdin=f,
+                                 stdout=subprocess.PIPE,
+                                 stderr=subprocess.DEVNULL)
+            times.append(time.monotonic() - start)
+        if res.stdout.decode() != expected:
+            print('Bad output of {}'.format(exe), file=sys.stderr)
+            os.unlink(script.name)
+            sys.exit(-1)
+    times.sort()
+    med = times[len(times) // 2] * 1000 / args.pipelines
+    print('\t\t{{"shell": "{}", "med": {:.2f}, "min": {:.2f}}}{}'.format(
+          exe, med, times[0] * 1000 / args.pipelines,
+          ',' if i + 1 < len(args.e) else ''))
+print('\t]')
+print('}')
+os.unlink(script.name)
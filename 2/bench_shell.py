@@ -0,0 +1,156 @@
+import argparse
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import test_parser
+
+# Throughput benchmark of whole shells. Each shell runs the test
+# corpus of checker.py and synthetic scripts: many one-liners, deep
+# pipes, huge quoted arguments. The outputs are compared with the
+# first shell's. Parse time is measured with 'shell -n', which only
+# parses the script, and the rest of the total time is exec time.
+# Peak RSS is sampled from /proc, rusage of a child of Python
+# includes the RSS of Python itself from before the exec.
+
+parser = argparse.ArgumentParser(description='Shell throughput benchmark')
+parser.add_argument('-e', type=str, action='append', default=[],
+                    help='shell executable, can be given multiple times')
+parser.add_argument('--tests', type=str, default='./tests.txt',
+                    help='File with the test corpus')
+parser.add_argument('--corpus_repeat', type=int, default=10,
+                    help='How many times the corpus is in its script')
+parser.add_argument('--one_liners', type=int, default=100 * 1000,
+                    help='Number of lines in the one-liners script')
+parser.add_argument('--pipe_depth', type=int, default=200,
+                    help='Number of commands in each deep pipe')
+parser.add_argument('--quoted_mb', type=int, default=16,
+                    help='Size of a huge quoted argument')
+parser.add_argument('--runs', type=int, default=5,
+                    help='Number of runs of each script, the median is taken')
+args = parser.parse_args()
+if len(args.e) == 0:
+    args.e = ['./mybash', '/bin/bash']
+
+
+def corpus_script():
+    body = ''
+    for section in test_parser.parse(args.tests):
+        for case in section.cases:
+            body += case.body
+    # The corpus leaves files behind, so each copy runs in its own dir.
+    res = ''
+    for i in range(args.corpus_repeat):
+        res += 'mkdir r{0}\ncd r{0}\n{1}\ncd ..\n'.format(i, body)
+    # Background jobs of the corpus must not print after the end.
+    return res + 'sleep 0.5\n'
+
+
+def one_liners_script():
+    lines = ['echo {}\n', 'true\n', 'echo a{} > f\n', 'false || echo {}\n']
+    return ''.join(lines[i % len(lines)].format(i)
+                   for i in range(args.one_liners))
+
+
+def deep_pipes_script():
+    line = 'echo x' + ' | cat' * (args.pipe_depth - 1) + '\n'
+    return line * 10
+
+
+def quoted_script():
+    arg = ('a' * 63 + '\n') * (args.quoted_mb * 1024 * 1024 // 64)
+    return 'echo "{}" | wc -c\n'.format(arg)
+
+
+def count_commands(script):
+    res = 0
+    for line in script.splitlines():
+        line = line.strip()
+        if line and not line.startswith('#'):
+            res += 1
+    return res
+
+
+def sample_rss(pid, peak, is_done):
+    while not is_done.is_set():
+        try:
+            with open('/proc/{}/status'.format(pid)) as f:
+                for line in f:
+                    if line.startswith('VmHWM:'):
+                        peak[0] = max(peak[0], int(line.split()[1]))
+        except (OSError, ValueError):
+            return
+        is_done.wait(0.002)
+
+
+def run(exe, script_path, flags):
+    # All the shells run in the same dir, it is in the output of pwd.
+    shutil.rmtree(run_dir, ignore_errors=True)
+    os.mkdir(run_dir)
+    with open(script_path, 'rb') as f:
+        start = time.monotonic()
+        p = subprocess.Popen([exe] + flags, stdin=f, stdout=subprocess.PIPE,
+                             stderr=subprocess.STDOUT, cwd=run_dir)
+        peak = [0]
+        is_done = threading.Event()
+        sampler = threading.Thread(target=sample_rss,
+                                   args=(p.pid, peak, is_done))
+        sampler.start()
+        out = p.stdout.read()
+        p.wait()
+        res = time.monotonic() - start
+        is_done.set()
+        sampler.join()
+        return res, out, peak[0]
+
+
+run_dir = os.path.join(tempfile.mkdtemp(), 'run')
+corpus = corpus_script()
+scripts = [
+    ('corpus', corpus, count_commands(corpus)),
+    ('one_liners', one_liners_script(), args.one_liners),
+    ('deep_pipes', deep_pipes_script(), 10),
+    ('huge_quoted', quoted_script(), 1),
+]
+print('{')
+print('\t"runs": {},'.format(args.runs))
+print('\t"benches": [')
+for si, (name, script, command_count) in enumerate(scripts):
+    f = tempfile.NamedTemporaryFile('w', suffix='.sh', delete=False)
+    f.write(script)
+    f.close()
+    expected = None
+    for ei, exe in enumerate(args.e):
+        exe = os.path.abspath(shutil.which(exe) or exe)
+        totals = []
+        parses = []
+        rss = 0
+        for _ in range(args.runs):
+            t, out, maxrss = run(exe, f.name, [])
+            totals.append(t)
+            rss = max(rss, maxrss)
+            if expected is None:
+                expected = out
+            elif out != expected:
+                print('Output of {} differs on {}'.format(exe, name),
+                      file=sys.stderr)
+            parses.append(run(exe, f.name, ['-n'])[0])
+        totals.sort()
+        parses.sort()
+        total = totals[len(totals) // 2]
+        parse = parses[len(parses) // 2]
+        last = si + 1 == len(scripts) and ei + 1 == len(args.e)
+        print('\t\t{{"script": "{}", "shell": "{}", "commands": {}, '
+              '"commands_per_sec": {:.0f}, "total_ms": {:.1f}, '
+              '"parse_ms": {:.1f}, "exec_ms": {:.1f}, '
+              '"peak_rss_kb": {}}}{}'.format(
+                  name, exe, command_count, command_count / total,
+                  total * 1000, parse * 1000, max(total - parse, 0) * 1000,
+                  rss, '' if last else ','))
+    os.unlink(f.name)
+print('\t]')
+print('}')
+shutil.rmtree(os.path.dirname(run_dir))
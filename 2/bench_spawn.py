@@ -0,0 +1,67 @@
+import argparse
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+# Benchmark of launching short commands one by one, as scripts calling
+# the same few binaries do. Each shell runs with posix_spawn() and
+# with the fork server of $SHELL_FORK_SERVER, see fork_server.h.
+
+parser = argparse.ArgumentParser(description='Command launch benchmark')
+parser.add_argument('-e', type=str, action='append', default=[],
+                    help='shell executable, can be given multiple times')
+parser.add_argument('--lines', type=int, default=2000,
+                    help='Number of lines in each script')
+parser.add_argument('--ready', type=int, default=4,
+                    help='Ready children of the fork server')
+parser.add_argument('--runs', type=int, default=5,
+                    help='Number of runs of each shell, the median is taken')
+args = parser.parse_args()
+if len(args.e) == 0:
+    args.e = ['./mybash']
+
+scripts = [
+    ('true', '/bin/true\n', ''),
+    ('echo', '/bin/echo x\n', 'x\n'),
+    ('pipe', '/bin/echo x | /usr/bin/wc -c\n', '2\n'),
+]
+modes = [('spawn', None), ('fork_server', str(args.ready))]
+
+print('{')
+print('\t"lines": {}, "unit": "us/line",'.format(args.lines))
+print('\t"benches": [')
+rows = []
+for exe in args.e:
+    for name, line, out in scripts:
+        script = tempfile.NamedTemporaryFile('w', suffix='.sh', delete=False)
+        script.write(line * args.lines)
+        script.close()
+        for mode, ready in modes:
+            env = dict(os.environ)
+            env.pop('SHELL_FORK_SERVER', None)
+            if ready is not None:
+                env['SHELL_FORK_SERVER'] = ready
+            times = []
+            for _ in range(args.runs):
+                with open(script.name, 'rb') as f:
+                    start = time.monotonic()
+                    res = subprocess.run([os.path.abspath(exe)], stdin=f,
+                                         stdout=subprocess.PIPE, env=env)
+                    times.append(time.monotonic() - start)
+                if res.stdout.decode() != out * args.lines:
+                    print('Bad output of {} {}'.format(exe, mode),
+                          file=sys.stderr)
+                    os.unlink(script.name)
+                    sys.exit(-1)
+            times.sort()
+            rows.append('\t\t{{"shell": "{}", "script": "{}", "mode": "{}", '
+                        '"med": {:.1f}, "min": {:.1f}}}'.format(
+                            exe, name, mode,
+                            times[len(times) // 2] * 1e6 / args.lines,
+                            times[0] * 1e6 / args.lines))
+        os.unlink(script.name)
+print(',\n'.join(rows))
+print('\t]')
+print('}')
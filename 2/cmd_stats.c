@@ -0,0 +1,168 @@
+#include "cmd_stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+	CMD_STATS_MIN_BUCKET_COUNT = 64,
+};
+
+/** FNV-1a. */
+static uint32_t
+cmd_stats_hash(const char *name)
+{
+	uint32_t h = 2166136261u;
+	for (; *name != 0; ++name) {
+		h ^= (unsigned char)*name;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static uint64_t
+timeval_us(const struct timeval *tv)
+{
+	return (uint64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+void
+cmd_stats_create(struct cmd_stats *stats)
+{
+	stats->buckets = NULL;
+	stats->bucket_count = 0;
+	stats->entry_count = 0;
+}
+
+void
+cmd_stats_destroy(struct cmd_stats *stats)
+{
+	for (uint32_t i = 0; i < stats->bucket_count; ++i) {
+		struct cmd_stats_entry *e = stats->buckets[i];
+		while (e != NULL) {
+			struct cmd_stats_entry *next = e->next;
+			free(e->name);
+			free(e);
+			e = next;
+		}
+	}
+	free(stats->buckets);
+}
+
+static void
+cmd_stats_grow(struct cmd_stats *stats)
+{
+	uint32_t new_count = stats->bucket_count * 2;
+	if (new_count < CMD_STATS_MIN_BUCKET_COUNT)
+		new_count = CMD_STATS_MIN_BUCKET_COUNT;
+	struct cmd_stats_entry **buckets = calloc(new_count,
+						  sizeof(buckets[0]));
+	for (uint32_t i = 0; i < stats->bucket_count; ++i) {
+		struct cmd_stats_entry *e = stats->buckets[i];
+		while (e != NULL) {
+			struct cmd_stats_entry *next = e->next;
+			struct cmd_stats_entry **b =
+				&buckets[e->hash & (new_count - 1)];
+			e->next = *b;
+			*b = e;
+			e = next;
+		}
+	}
+	free(stats->buckets);
+	stats->buckets = buckets;
+	stats->bucket_count = new_count;
+}
+
+static struct cmd_stats_entry *
+cmd_stats_get(struct cmd_stats *stats, const char *name)
+{
+	uint32_t hash = cmd_stats_hash(name);
+	if (stats->bucket_count > 0) {
+		struct cmd_stats_entry *e =
+			stats->buckets[hash & (stats->bucket_count - 1)];
+		for (; e != NULL; e = e->next) {
+			if (e->hash == hash && strcmp(e->name, name) == 0)
+				return e;
+		}
+	}
+	if (stats->entry_count >= stats->bucket_count)
+		cmd_stats_grow(stats);
+	struct cmd_stats_entry *e = calloc(1, sizeof(*e));
+	e->hash = hash;
+	e->name = strdup(name);
+	struct cmd_stats_entry **b =
+		&stats->buckets[hash & (stats->bucket_count - 1)];
+	e->next = *b;
+	*b = e;
+	++stats->entry_count;
+	return e;
+}
+
+void
+cmd_stats_add(struct cmd_stats *stats, const char *name,
+	      const struct rusage *usage, uint64_t launch_ns)
+{
+	struct cmd_stats_entry *e = cmd_stats_get(stats, name);
+	++e->count;
+	e->user_us += timeval_us(&usage->ru_utime);
+	e->sys_us += timeval_us(&usage->ru_stime);
+	if (usage->ru_maxrss > e->max_rss_kb)
+		e->max_rss_kb = usage->ru_maxrss;
+	e->vol_switch_count += usage->ru_nvcsw;
+	e->invol_switch_count += usage->ru_nivcsw;
+	e->launch_ns += launch_ns;
+}
+
+static int
+cmd_stats_cmp(const void *a, const void *b)
+{
+	const struct cmd_stats_entry *l = *(const struct cmd_stats_entry **)a;
+	const struct cmd_stats_entry *r = *(const struct cmd_stats_entry **)b;
+	uint64_t lt = l->user_us + l->sys_us;
+	uint64_t rt = r->user_us + r->sys_us;
+	if (lt != rt)
+		return lt > rt ? -1 : 1;
+	return strcmp(l->name, r->name);
+}
+
+static void
+cmd_stats_print_row(FILE *out, const char *name, uint64_t count,
+		    uint64_t user_us, uint64_t sys_us, long max_rss_kb,
+		    uint64_t vol, uint64_t invol, uint64_t launch_ns)
+{
+	fprintf(out, "%-16s %8llu %10.3f %10.3f %10ld %8llu %8llu "
+		"%10.3f\n", name, (unsigned long long)count,
+		user_us / 1e6, sys_us / 1e6, max_rss_kb,
+		(unsigned long long)vol, (unsigned long long)invol,
+		launch_ns / 1e9);
+}
+
+void
+cmd_stats_print(const struct cmd_stats *stats, FILE *out)
+{
+	struct cmd_stats_entry **entries =
+		malloc(sizeof(entries[0]) * (stats->entry_count + 1));
+	uint32_t count = 0;
+	for (uint32_t i = 0; i < stats->bucket_count; ++i) {
+		struct cmd_stats_entry *e = stats->buckets[i];
+		for (; e != NULL; e = e->next)
+			entries[count++] = e;
+	}
+	qsort(entries, count, sizeof(entries[0]), cmd_stats_cmp);
+	fprintf(out, "%-16s %8s %10s %10s %10s %8s %8s %10s\n", "command",
+		"count", "user_s", "sys_s", "maxrss_kb", "vcsw", "ivcsw",
+		"launch_s");
+	for (uint32_t i = 0; i < count; ++i) {
+		const struct cmd_stats_entry *e = entries[i];
+		cmd_stats_print_row(out, e->name, e->count, e->user_us,
+				    e->sys_us, e->max_rss_kb,
+				    e->vol_switch_count, e->invol_switch_count,
+				    e->launch_ns);
+	}
+	free(entries);
+	struct rusage self;
+	getrusage(RUSAGE_SELF, &self);
+	cmd_stats_print_row(out, "(shell)", 1, timeval_us(&self.ru_utime),
+			    timeval_us(&self.ru_stime), self.ru_maxrss,
+			    self.ru_nvcsw, self.ru_nivcsw, 0);
+	fflush(out);
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/resource.h>
+
+/**
+ * Resource usage of the finished commands, summed per command name.
+ * Each child's usage comes from wait4(), and the shell's own cost of
+ * launching it - the fork or posix_spawn() call - is measured on the
+ * shell side. The table is printed at exit to find the slow stages
+ * of a script.
+ */
+
+struct cmd_stats_entry {
+	/** Next entry in the same hash bucket. */
+	struct cmd_stats_entry *next;
+	uint32_t hash;
+	char *name;
+	/** How many processes of the command finished. */
+	uint64_t count;
+	uint64_t user_us;
+	uint64_t sys_us;
+	/** The biggest max RSS of them, in KB. */
+	long max_rss_kb;
+	uint64_t vol_switch_count;
+	uint64_t invol_switch_count;
+	/** Time the shell spent launching them. */
+	uint64_t launch_ns;
+};
+
+struct cmd_stats {
+	struct cmd_stats_entry **buckets;
+	uint32_t bucket_count;
+	uint32_t entry_count;
+};
+
+void
+cmd_stats_create(struct cmd_stats *stats);
+
+void
+cmd_stats_destroy(struct cmd_stats *stats);
+
+/** Add a finished process of the command. */
+void
+cmd_stats_add(struct cmd_stats *stats, const char *name,
+	      const struct rusage *usage, uint64_t launch_ns);
+
+/**
+ * Print a table of the commands, the most CPU consuming first, and
+ * a last row of the shell itself.
+ */
+void
+cmd_stats_print(const struct cmd_stats *stats, FILE *out);
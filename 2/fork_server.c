@@ -0,0 +1,320 @@
+#define _GNU_SOURCE
+#include "fork_server.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+enum {
+	/** Biggest launch message, other commands are spawned as usual. */
+	FORK_SERVER_MSG_MAX = 64 * 1024,
+	/** Stdin, stdout, stderr and the current directory. */
+	FORK_SERVER_FD_COUNT = 4,
+};
+
+/** Followed by the path and the argv, each ending with 0. */
+struct fork_server_msg {
+	uint32_t argc;
+	uint32_t is_cached;
+};
+
+struct fork_server {
+	/** The shell's end of the socket, -1 when the server is gone. */
+	int sock;
+	pid_t pid;
+	char *buf;
+};
+
+#ifdef __linux__
+
+/** Close all the descriptors from 3 except the ones in @a keep. */
+static void
+fork_server_close_others(const int *keep, int count)
+{
+	long max = sysconf(_SC_OPEN_MAX);
+	if (max < 0 || max > 65536)
+		max = 65536;
+	for (int fd = 3; fd < max; ++fd) {
+		bool is_kept = false;
+		for (int i = 0; i < count && !is_kept; ++i)
+			is_kept = keep[i] == fd;
+		if (is_kept)
+			continue;
+#ifdef SYS_close_range
+		/* Up to the next kept one at once. */
+		int next = (int)max;
+		for (int i = 0; i < count; ++i) {
+			if (keep[i] > fd && keep[i] < next)
+				next = keep[i];
+		}
+		if (syscall(SYS_close_range, fd, next - 1, 0) == 0) {
+			fd = next - 1;
+			continue;
+		}
+#endif
+		close(fd);
+	}
+}
+
+/**
+ * A ready child. Waits for a launch, and execs it. Exits when the
+ * shell is gone.
+ */
+static void __attribute__((noreturn))
+fork_server_child(int sock, int control, const sigset_t *child_sigmask)
+{
+	static char buf[FORK_SERVER_MSG_MAX + 1];
+	union {
+		struct cmsghdr hdr;
+		char data[CMSG_SPACE(sizeof(int) * FORK_SERVER_FD_COUNT)];
+	} cmsg;
+	struct iovec iov = {buf, FORK_SERVER_MSG_MAX};
+	struct msghdr msg = {0};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsg.data;
+	msg.msg_controllen = sizeof(cmsg.data);
+	ssize_t size;
+	while ((size = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0 &&
+	       errno == EINTR)
+		;
+	if (size <= 0)
+		_exit(0);
+	pid_t pid = getpid();
+	send(sock, &pid, sizeof(pid), MSG_NOSIGNAL);
+	/* Ask for a replacement. */
+	char c = 0;
+	write(control, &c, 1);
+
+	struct cmsghdr *h = CMSG_FIRSTHDR(&msg);
+	struct fork_server_msg hdr;
+	if (h == NULL || h->cmsg_type != SCM_RIGHTS ||
+	    h->cmsg_len != CMSG_LEN(sizeof(int) * FORK_SERVER_FD_COUNT) ||
+	    (size_t)size < sizeof(hdr))
+		_exit(127);
+	int fds[FORK_SERVER_FD_COUNT];
+	memcpy(fds, CMSG_DATA(h), sizeof(fds));
+	memcpy(&hdr, buf, sizeof(hdr));
+	buf[size] = 0;
+	char *pos = buf + sizeof(hdr);
+	char *end = buf + size;
+	const char *path = pos;
+	pos += strlen(pos) + 1;
+	char **argv = malloc((hdr.argc + 1) * sizeof(argv[0]));
+	for (uint32_t i = 0; i < hdr.argc; ++i) {
+		if (pos >= end)
+			_exit(127);
+		argv[i] = pos;
+		pos += strlen(pos) + 1;
+	}
+	argv[hdr.argc] = NULL;
+	if (hdr.argc == 0)
+		_exit(127);
+
+	fchdir(fds[3]);
+	for (int i = 0; i < 3; ++i) {
+		if (fds[i] != i)
+			dup2(fds[i], i);
+		else
+			fcntl(i, F_SETFD, 0);
+	}
+	signal(SIGPIPE, SIG_DFL);
+	sigprocmask(SIG_SETMASK, child_sigmask, NULL);
+	execv(path, argv);
+	/* The cached file can be gone, not known to the shell. */
+	if (errno == ENOENT && hdr.is_cached)
+		execvp(argv[0], argv);
+	if (errno == ENOENT)
+		fprintf(stderr, "%s: command not found\n", argv[0]);
+	else
+		fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+	_exit(errno == ENOENT ? 127 : 126);
+}
+
+/**
+ * Fork @a count ready children. With CLONE_PARENT they are the
+ * children of the shell, not of the server, so the shell waits for
+ * them like for its own. It is the raw syscall, without the fork
+ * handlers of libc, fine in the single thread of the server.
+ */
+static void
+fork_server_refill(int sock, int control, int count,
+		   const sigset_t *child_sigmask)
+{
+	for (int i = 0; i < count; ++i) {
+		if (syscall(SYS_clone, CLONE_PARENT | SIGCHLD, NULL, NULL, NULL,
+			    NULL) == 0)
+			fork_server_child(sock, control, child_sigmask);
+	}
+}
+
+static void __attribute__((noreturn))
+fork_server_main(int sock, int control[2], int ready_count,
+		 const sigset_t *child_sigmask, pid_t shell_pid)
+{
+	prctl(PR_SET_PDEATHSIG, SIGKILL);
+	if (getppid() != shell_pid)
+		_exit(0);
+	/*
+	 * The children get their descriptors in the messages. Nothing of
+	 * the shell is kept, like the write end of its stdout pipe, which
+	 * would hold the reader from EOF.
+	 */
+	int keep[3] = {sock, control[0], control[1]};
+	fork_server_close_others(keep, 3);
+	int null_fd = open("/dev/null", O_RDWR);
+	if (null_fd >= 0) {
+		for (int i = 0; i < 3; ++i)
+			dup2(null_fd, i);
+		if (null_fd > 2)
+			close(null_fd);
+	}
+	fork_server_refill(sock, control[1], ready_count, child_sigmask);
+	char buf[64];
+	while (true) {
+		ssize_t rc = read(control[0], buf, sizeof(buf));
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0)
+			_exit(0);
+		fork_server_refill(sock, control[1], (int)rc, child_sigmask);
+	}
+}
+
+#endif /* __linux__ */
+
+struct fork_server *
+fork_server_new(int ready_count, const sigset_t *child_sigmask)
+{
+#ifdef __linux__
+	if (ready_count <= 0)
+		return NULL;
+	int socks[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0,
+		       socks) != 0)
+		return NULL;
+	int control[2];
+	if (pipe2(control, O_CLOEXEC) != 0)
+		goto error_socks;
+	fflush(stdout);
+	pid_t shell_pid = getpid();
+	pid_t pid = fork();
+	if (pid == 0) {
+		close(socks[0]);
+		fork_server_main(socks[1], control, ready_count,
+				 child_sigmask, shell_pid);
+	}
+	close(control[0]);
+	close(control[1]);
+	if (pid < 0)
+		goto error_socks;
+	close(socks[1]);
+	struct fork_server *fs = malloc(sizeof(*fs));
+	fs->sock = socks[0];
+	fs->pid = pid;
+	fs->buf = malloc(FORK_SERVER_MSG_MAX);
+	return fs;
+
+error_socks:
+	close(socks[0]);
+	close(socks[1]);
+	return NULL;
+#else
+	(void)ready_count;
+	(void)child_sigmask;
+	return NULL;
+#endif
+}
+
+void
+fork_server_delete(struct fork_server *fs)
+{
+	if (fs->sock >= 0)
+		close(fs->sock);
+	kill(fs->pid, SIGKILL);
+	waitpid(fs->pid, NULL, 0);
+	free(fs->buf);
+	free(fs);
+}
+
+pid_t
+fork_server_spawn(struct fork_server *fs, const char *path, bool is_cached,
+		  char *const *argv, int in_fd, int out_fd)
+{
+	if (fs->sock < 0)
+		return -1;
+	struct fork_server_msg hdr = {0, is_cached};
+	size_t size = sizeof(hdr);
+	size_t len = strlen(path) + 1;
+	if (size + len > FORK_SERVER_MSG_MAX)
+		return -1;
+	memcpy(fs->buf + size, path, len);
+	size += len;
+	for (; argv[hdr.argc] != NULL; ++hdr.argc) {
+		len = strlen(argv[hdr.argc]) + 1;
+		if (size + len > FORK_SERVER_MSG_MAX)
+			return -1;
+		memcpy(fs->buf + size, argv[hdr.argc], len);
+		size += len;
+	}
+	memcpy(fs->buf, &hdr, sizeof(hdr));
+
+	int cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (cwd < 0)
+		return -1;
+	int fds[FORK_SERVER_FD_COUNT] = {
+		in_fd >= 0 ? in_fd : STDIN_FILENO,
+		out_fd >= 0 ? out_fd : STDOUT_FILENO,
+		STDERR_FILENO, cwd,
+	};
+	union {
+		struct cmsghdr hdr;
+		char data[CMSG_SPACE(sizeof(fds))];
+	} cmsg;
+	memset(&cmsg, 0, sizeof(cmsg));
+	struct iovec iov = {fs->buf, size};
+	struct msghdr msg = {0};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsg.data;
+	msg.msg_controllen = sizeof(cmsg.data);
+	struct cmsghdr *h = CMSG_FIRSTHDR(&msg);
+	h->cmsg_level = SOL_SOCKET;
+	h->cmsg_type = SCM_RIGHTS;
+	h->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(h), fds, sizeof(fds));
+	ssize_t rc;
+	while ((rc = sendmsg(fs->sock, &msg, MSG_NOSIGNAL)) < 0 &&
+	       errno == EINTR)
+		;
+	close(cwd);
+	if (rc < 0) {
+		if (errno == EMSGSIZE || errno == ENOBUFS)
+			return -1;
+		goto error_gone;
+	}
+	pid_t pid;
+	while ((rc = recv(fs->sock, &pid, sizeof(pid), 0)) < 0 &&
+	       errno == EINTR)
+		;
+	if (rc != sizeof(pid))
+		goto error_gone;
+	return pid;
+
+error_gone:
+	close(fs->sock);
+	fs->sock = -1;
+	return -1;
+}
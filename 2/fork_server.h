@@ -0,0 +1,53 @@
+#pragma once
+
+#include <signal.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/**
+ * Fork server, like a zygote: a small process forked from the shell
+ * at its start, while the heap is small, which keeps a few children
+ * forked ahead of time. The ready children wait on one SOCK_SEQPACKET
+ * socket. A launch is one message with the path and the argv, and
+ * with stdin, stdout, stderr and the current directory passed as
+ * SCM_RIGHTS, like in lecture_examples 13_socketpair.c. The child
+ * which gets it replies with its pid, asks the server for its
+ * replacement, takes the descriptors, and execs. So the fork is not
+ * on the way of a launch anymore, only the exec is.
+ *
+ * The children are cloned by the server with CLONE_PARENT, so they are
+ * the shell's children, and it waits for them and gets their resource
+ * usage like for its own.
+ *
+ * $SHELL_FORK_SERVER is the number of the ready children, unset or 0
+ * means no server. Linux only.
+ */
+
+struct fork_server;
+
+/**
+ * Start the server with @a ready_count children. They exec with the
+ * signal mask @a child_sigmask and SIGPIPE by default. NULL if it is
+ * not Linux or something failed.
+ */
+struct fork_server *
+fork_server_new(int ready_count, const sigset_t *child_sigmask);
+
+/** Stop the server. The ready children exit. */
+void
+fork_server_delete(struct fork_server *fs);
+
+/**
+ * Launch @a path with @a argv, and stdin and stdout @a in_fd and
+ * @a out_fd, -1 means the shell's ones. If the exec fails, the child
+ * prints the error and exits with 127 or 126, like a forked one.
+ * When @a is_cached and the path is gone, the child looks for
+ * argv[0] in PATH.
+ *
+ * Returns the pid, or -1 if the arguments don't fit into a message or
+ * the server is gone. Then the command is not launched, and the
+ * caller can launch it some other way.
+ */
+pid_t
+fork_server_spawn(struct fork_server *fs, const char *path, bool is_cached,
+		  char *const *argv, int in_fd, int out_fd);
@@ -0,0 +1,157 @@
+#include "job_table.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+enum {
+	JOB_TABLE_MIN_BUCKET_COUNT = 64,
+};
+
+/** Fibonacci hashing, the pids are sequential mostly. */
+static uint32_t
+job_table_hash(pid_t pid)
+{
+	return (uint32_t)pid * 2654435769u;
+}
+
+static struct job_proc **
+job_table_bucket(const struct job_table *t, pid_t pid)
+{
+	/* The high bits of the hash are the best mixed. */
+	uint32_t bits = __builtin_ctz(t->bucket_count);
+	return &t->buckets[job_table_hash(pid) >> (32 - bits)];
+}
+
+void
+job_table_create(struct job_table *t)
+{
+	t->buckets = NULL;
+	t->bucket_count = 0;
+	t->proc_count = 0;
+	t->first = NULL;
+	t->last = NULL;
+	t->job_count = 0;
+}
+
+void
+job_table_destroy(struct job_table *t)
+{
+	for (uint32_t i = 0; i < t->bucket_count; ++i) {
+		struct job_proc *p = t->buckets[i];
+		while (p != NULL) {
+			struct job_proc *next = p->next;
+			free(p);
+			p = next;
+		}
+	}
+	free(t->buckets);
+	struct job *j = t->first;
+	while (j != NULL) {
+		struct job *next = j->next;
+		free(j);
+		j = next;
+	}
+}
+
+static void
+job_table_grow(struct job_table *t)
+{
+	uint32_t old_count = t->bucket_count;
+	struct job_proc **old = t->buckets;
+	uint32_t new_count = old_count * 2;
+	if (new_count < JOB_TABLE_MIN_BUCKET_COUNT)
+		new_count = JOB_TABLE_MIN_BUCKET_COUNT;
+	t->buckets = calloc(new_count, sizeof(t->buckets[0]));
+	t->bucket_count = new_count;
+	for (uint32_t i = 0; i < old_count; ++i) {
+		struct job_proc *p = old[i];
+		while (p != NULL) {
+			struct job_proc *next = p->next;
+			struct job_proc **b = job_table_bucket(t, p->pid);
+			p->next = *b;
+			*b = p;
+			p = next;
+		}
+	}
+	free(old);
+}
+
+struct job *
+job_table_add(struct job_table *t, const pid_t *pids, uint32_t count)
+{
+	struct job *j = malloc(sizeof(*j));
+	j->proc_count = 0;
+	j->id = t->last != NULL ? t->last->id + 1 : 1;
+	for (uint32_t i = 0; i < count; ++i) {
+		if (pids[i] < 0)
+			continue;
+		if (t->proc_count >= t->bucket_count)
+			job_table_grow(t);
+		struct job_proc *p = malloc(sizeof(*p));
+		p->pid = pids[i];
+		p->job = j;
+		struct job_proc **b = job_table_bucket(t, p->pid);
+		p->next = *b;
+		*b = p;
+		++t->proc_count;
+		++j->proc_count;
+	}
+	if (j->proc_count == 0) {
+		free(j);
+		return NULL;
+	}
+	j->next = NULL;
+	j->prev = t->last;
+	if (t->last != NULL)
+		t->last->next = j;
+	else
+		t->first = j;
+	t->last = j;
+	++t->job_count;
+	return j;
+}
+
+struct job *
+job_table_find(const struct job_table *t, pid_t pid)
+{
+	if (t->bucket_count == 0)
+		return NULL;
+	struct job_proc *p = *job_table_bucket(t, pid);
+	for (; p != NULL; p = p->next) {
+		if (p->pid == pid)
+			return p->job;
+	}
+	return NULL;
+}
+
+bool
+job_table_reap(struct job_table *t, pid_t pid)
+{
+	if (t->bucket_count == 0)
+		return false;
+	struct job_proc **pp = job_table_bucket(t, pid);
+	for (; *pp != NULL; pp = &(*pp)->next) {
+		struct job_proc *p = *pp;
+		if (p->pid != pid)
+			continue;
+		*pp = p->next;
+		--t->proc_count;
+		struct job *j = p->job;
+		free(p);
+		assert(j->proc_count > 0);
+		if (--j->proc_count > 0)
+			return true;
+		if (j->prev != NULL)
+			j->prev->next = j->next;
+		else
+			t->first = j->next;
+		if (j->next != NULL)
+			j->next->prev = j->prev;
+		else
+			t->last = j->prev;
+		--t->job_count;
+		free(j);
+		return true;
+	}
+	return false;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * Table of the background jobs. A job is a pipeline or a subshell
+ * launched with '&', and is done when all its processes are reaped.
+ * The processes are found by pid in O(1), so reaping of each child
+ * costs the same regardless of how many jobs are running.
+ */
+
+struct job;
+
+struct job_proc {
+	/** Next process in the same hash bucket. */
+	struct job_proc *next;
+	pid_t pid;
+	struct job *job;
+};
+
+struct job {
+	struct job *prev;
+	struct job *next;
+	/** Number like %1 in Bash, one more than the last job's. */
+	uint32_t id;
+	/** How many processes of the job are not reaped yet. */
+	uint32_t proc_count;
+};
+
+struct job_table {
+	struct job_proc **buckets;
+	uint32_t bucket_count;
+	uint32_t proc_count;
+	/** List of all the jobs, in the order of launch. */
+	struct job *first;
+	struct job *last;
+	uint32_t job_count;
+};
+
+void
+job_table_create(struct job_table *t);
+
+void
+job_table_destroy(struct job_table *t);
+
+static inline bool
+job_table_is_empty(const struct job_table *t)
+{
+	return t->job_count == 0;
+}
+
+/**
+ * Add a job of the given processes. The pids < 0 are skipped, they
+ * are the commands which failed to launch. Returns NULL if no pids
+ * are left.
+ */
+struct job *
+job_table_add(struct job_table *t, const pid_t *pids, uint32_t count);
+
+/**
+ * Account the reaped process. When it was the last one of its job,
+ * the job is deleted. Returns false if the pid is not in the table.
+ */
+bool
+job_table_reap(struct job_table *t, pid_t pid);
+
+/** Find the job of a process, NULL if the pid is not in the table. */
+struct job *
+job_table_find(const struct job_table *t, pid_t pid);
@@ -0,0 +1,120 @@
+#include "launch_pool.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+struct launch_pool {
+	pthread_t *threads;
+	int thread_count;
+	pthread_mutex_t mutex;
+	/** Signaled on a new batch and on stop. */
+	pthread_cond_t cond_batch;
+	/** Signaled when the last helper leaves a batch. */
+	pthread_cond_t cond_idle;
+	/** Number of the current batch, the helpers wait for a new one. */
+	uint64_t batch_id;
+	launch_pool_f f;
+	void *arg;
+	uint32_t count;
+	/** Next index to take, atomic. */
+	uint32_t next;
+	/** How many helpers work on the current batch. */
+	int active_count;
+	bool is_stopped;
+};
+
+static void
+launch_pool_work(struct launch_pool *pool)
+{
+	while (true) {
+		uint32_t i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+		if (i >= pool->count)
+			return;
+		pool->f(pool->arg, i);
+	}
+}
+
+static void *
+launch_pool_worker(void *arg)
+{
+	struct launch_pool *pool = arg;
+	uint64_t batch_id = 0;
+	pthread_mutex_lock(&pool->mutex);
+	while (true) {
+		while (pool->batch_id == batch_id && !pool->is_stopped)
+			pthread_cond_wait(&pool->cond_batch, &pool->mutex);
+		if (pool->is_stopped)
+			break;
+		batch_id = pool->batch_id;
+		++pool->active_count;
+		pthread_mutex_unlock(&pool->mutex);
+		launch_pool_work(pool);
+		pthread_mutex_lock(&pool->mutex);
+		if (--pool->active_count == 0)
+			pthread_cond_signal(&pool->cond_idle);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	return NULL;
+}
+
+struct launch_pool *
+launch_pool_new(int thread_count)
+{
+	struct launch_pool *pool = calloc(1, sizeof(*pool));
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->cond_batch, NULL);
+	pthread_cond_init(&pool->cond_idle, NULL);
+	pool->threads = malloc(sizeof(pool->threads[0]) * (thread_count + 1));
+	for (int i = 0; i < thread_count; ++i) {
+		if (pthread_create(&pool->threads[pool->thread_count], NULL,
+				   launch_pool_worker, pool) == 0)
+			++pool->thread_count;
+	}
+	return pool;
+}
+
+void
+launch_pool_delete(struct launch_pool *pool)
+{
+	pthread_mutex_lock(&pool->mutex);
+	pool->is_stopped = true;
+	pthread_cond_broadcast(&pool->cond_batch);
+	pthread_mutex_unlock(&pool->mutex);
+	for (int i = 0; i < pool->thread_count; ++i)
+		pthread_join(pool->threads[i], NULL);
+	pthread_cond_destroy(&pool->cond_idle);
+	pthread_cond_destroy(&pool->cond_batch);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool->threads);
+	free(pool);
+}
+
+void
+launch_pool_run(struct launch_pool *pool, launch_pool_f f, void *arg,
+		uint32_t count)
+{
+	if (pool->thread_count == 0 || count < 2) {
+		for (uint32_t i = 0; i < count; ++i)
+			f(arg, i);
+		return;
+	}
+	pthread_mutex_lock(&pool->mutex);
+	/* A helper can be late to join the previous batch. */
+	while (pool->active_count > 0)
+		pthread_cond_wait(&pool->cond_idle, &pool->mutex);
+	pool->f = f;
+	pool->arg = arg;
+	pool->count = count;
+	pool->next = 0;
+	++pool->batch_id;
+	pthread_cond_broadcast(&pool->cond_batch);
+	pthread_mutex_unlock(&pool->mutex);
+
+	launch_pool_work(pool);
+
+	pthread_mutex_lock(&pool->mutex);
+	while (pool->active_count > 0)
+		pthread_cond_wait(&pool->cond_idle, &pool->mutex);
+	pthread_mutex_unlock(&pool->mutex);
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Pool of helper threads to run a batch of independent calls like
+ * posix_spawn() in parallel. A batch is fork-join: the caller works
+ * on it too, and gets back when all of it is done. So between the
+ * batches the helpers are idle, and the shell can fork safely.
+ */
+
+struct launch_pool;
+
+typedef void (*launch_pool_f)(void *arg, uint32_t i);
+
+/**
+ * Pool with @a thread_count helpers. With 0 the batches are run by
+ * the caller alone.
+ */
+struct launch_pool *
+launch_pool_new(int thread_count);
+
+void
+launch_pool_delete(struct launch_pool *pool);
+
+/** Call @a f(arg, i) for all i in [0, count), in parallel. */
+void
+launch_pool_run(struct launch_pool *pool, launch_pool_f f, void *arg,
+		uint32_t count);
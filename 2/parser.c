@@ -1,14 +1,105 @@
 #include "parser.h"
 
 #include <assert.h>
-#include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
 
-struct parser {
-	char *buffer;
+/*
+ * Plain chars of a token are found with SIMD when possible, and are
+ * copied in bulk. Define PARSER_NO_SIMD to use only the scalar
+ * search.
+ */
+#if defined(PARSER_NO_SIMD)
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#define PARSER_SIMD_AVX2 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define PARSER_SIMD_SSE2 1
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define PARSER_SIMD_NEON 1
+#endif
+
+enum {
+	/** Alignment of all the allocations in a line arena. */
+	ARENA_ALIGN = sizeof(void *),
+	/** Size of the first chunk, allocated together with the line. */
+	ARENA_FIRST_CHUNK_SIZE = 1024,
+	/**
+	 * A batch of lines isn't continued in an arena with a chunk
+	 * bigger than that, so huge lines don't pile up in memory.
+	 */
+	ARENA_BATCH_MAX_CHUNK_SIZE = 64 * 1024,
+	/** Longer lines are not cached, nor their bytes are copied. */
+	LINE_CACHE_MAX_LINE_SIZE = 4096,
+};
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	/** Size of the data following the header. */
 	uint32_t size;
+	uint32_t used;
+};
+
+/**
+ * All the memory of a command line - its exprs, argument arrays
+ * and strings - is bump-allocated from a list of chunks. The first
+ * chunk is allocated together with the line, so a short line costs
+ * one malloc and one free. On reset the chunks are kept for reuse.
+ */
+struct line_arena {
+	/** Must be first, the line pointer is the arena pointer. */
+	struct command_line line;
+	/** Chunk to allocate from. */
+	struct arena_chunk *chunk;
+	/** Must be last, its data follows the struct. */
+	struct arena_chunk first;
+};
+
+/**
+ * A cached line. It is allocated in the arena of its copy of the
+ * line, together with the line's bytes.
+ */
+struct line_cache_entry {
+	/** Next in the hash bucket. */
+	struct line_cache_entry *next;
+	/** Neighbours in the LRU list, the most recent is the first. */
+	struct line_cache_entry *lru_prev;
+	struct line_cache_entry *lru_next;
+	/** Holds one reference of the line. */
+	struct command_line *line;
+	uint64_t hash;
+	uint32_t size;
+	/** The line's bytes, the blanks before it are not included. */
+	char key[];
+};
+
+/** Parsed lines by their bytes, with LRU eviction. */
+struct line_cache {
+	struct line_cache_entry **buckets;
+	/** A power of 2, not less than the capacity. */
+	uint32_t bucket_count;
 	uint32_t capacity;
+	uint32_t count;
+	struct line_cache_entry *lru_first;
+	struct line_cache_entry *lru_last;
+	uint64_t hit_count;
+	uint64_t miss_count;
+};
+
+/** Bytes of a line looked up in the cache and not found. */
+struct line_key {
+	const char *data;
+	/** 0 if the line can't be cached. */
+	uint32_t size;
+	uint64_t hash;
+};
+
+/** Position in a line arena to free all the later allocations. */
+struct arena_mark {
+	struct arena_chunk *chunk;
+	uint32_t used;
 };
 
 enum token_type {
@@ -23,27 +114,193 @@ enum token_type {
 	TOKEN_TYPE_BACKGROUND,
 };
 
+enum token_state {
+	/** The next token is parsed from scratch. */
+	TOKEN_STATE_NONE,
+	/** A string token is not complete, more input is needed. */
+	TOKEN_STATE_STR,
+	/** A comment is not complete, more input is needed. */
+	TOKEN_STATE_COMMENT,
+};
+
 struct token {
 	enum token_type type;
+	enum token_state state;
+	/** Quote open in the incomplete token. */
+	char quote;
+	/**
+	 * While the token is a contiguous part of the input, it is
+	 * not copied, and is the slice's first size bytes. Otherwise
+	 * it is in data.
+	 */
+	const char *slice;
 	char *data;
 	uint32_t size;
 	uint32_t capacity;
 };
 
+enum parse_stage {
+	/** Commands and the operators between them. */
+	PARSE_STAGE_EXPRS,
+	/** File name after '>' or '>>'. */
+	PARSE_STAGE_OUT_FILE,
+	/** '&' or the line end after the file name. */
+	PARSE_STAGE_AFTER_OUT,
+	/** The line end after '&'. */
+	PARSE_STAGE_AFTER_BACKGROUND,
+	/** A bad line is skipped till its end. */
+	PARSE_STAGE_SKIP,
+};
+
+/**
+ * The input is kept in one buffer as [begin, size). Consumption
+ * only moves begin forward. The unused head is reclaimed when the
+ * feed needs space, and only if it's at least as big as the data
+ * left, so each byte is moved amortized O(1) times.
+ *
+ * The parsing is resumable. The input is consumed token by token,
+ * and an incomplete line is kept together with the state of its
+ * incomplete token till the next feed. So each byte is parsed
+ * once, even when a line spans many feeds.
+ */
+struct parser {
+	char *buffer;
+	/** The buffer is owned by the user, and is never fed. */
+	bool is_external;
+	/** Offset of the first unconsumed byte. */
+	uint32_t begin;
+	uint32_t size;
+	uint32_t capacity;
+	/** Token buffer, reused by all the lines. */
+	struct token token;
+	/** Incomplete line, its parsed input is already consumed. */
+	struct command_line *line;
+	/**
+	 * Arena of the incomplete line. The line is either the arena's
+	 * own, or the next one of a batch.
+	 */
+	struct line_arena *arena;
+	enum parse_stage stage;
+	/** Error in the incomplete line, returned at its end. */
+	enum parser_error error;
+	/** Arena of a released line, to be reused by the next one. */
+	struct line_arena *free_arena;
+	/** NULL if the cache is off. */
+	struct line_cache *cache;
+};
+
+static struct line_arena *
+line_arena_new(void)
+{
+	struct line_arena *a = malloc(sizeof(*a) + ARENA_FIRST_CHUNK_SIZE);
+	a->first.next = NULL;
+	a->first.size = ARENA_FIRST_CHUNK_SIZE;
+	return a;
+}
+
+static void
+line_arena_reset(struct line_arena *a)
+{
+	memset(&a->line, 0, sizeof(a->line));
+	for (struct arena_chunk *c = &a->first; c != NULL; c = c->next)
+		c->used = 0;
+	a->chunk = &a->first;
+}
+
+static void
+line_arena_delete(struct line_arena *a)
+{
+	struct arena_chunk *c = a->first.next;
+	while (c != NULL) {
+		struct arena_chunk *next = c->next;
+		free(c);
+		c = next;
+	}
+	free(a);
+}
+
+static struct arena_mark
+line_arena_mark(const struct line_arena *a)
+{
+	struct arena_mark res = {a->chunk, a->chunk->used};
+	return res;
+}
+
+static void
+line_arena_rollback(struct line_arena *a, struct arena_mark mark)
+{
+	for (struct arena_chunk *c = mark.chunk->next; c != NULL; c = c->next)
+		c->used = 0;
+	mark.chunk->used = mark.used;
+	a->chunk = mark.chunk;
+}
+
+static void *
+line_arena_alloc(struct line_arena *a, uint32_t size)
+{
+	size = (size + ARENA_ALIGN - 1) & ~(uint32_t)(ARENA_ALIGN - 1);
+	struct arena_chunk *c = a->chunk;
+	while (c->size - c->used < size) {
+		if (c->next == NULL) {
+			uint32_t new_size = c->size * 2;
+			if (new_size < size)
+				new_size = size;
+			struct arena_chunk *next = malloc(sizeof(*next) +
+				new_size);
+			next->next = NULL;
+			next->size = new_size;
+			next->used = 0;
+			c->next = next;
+		}
+		c = c->next;
+	}
+	a->chunk = c;
+	void *res = (char *)(c + 1) + c->used;
+	c->used += size;
+	return res;
+}
+
 static char *
-token_strdup(const struct token *t)
+token_strdup(struct line_arena *a, const struct token *t)
 {
 	assert(t->type == TOKEN_TYPE_STR);
 	assert(t->size > 0);
-	char *res = malloc(t->size + 1);
-	memcpy(res, t->data, t->size);
+	char *res = line_arena_alloc(a, t->size + 1);
+	memcpy(res, t->slice != NULL ? t->slice : t->data, t->size);
 	res[t->size] = 0;
 	return res;
 }
 
+static void
+token_copy_n(struct token *t, const char *data, uint32_t size)
+{
+	if (t->capacity - t->size < size) {
+		t->capacity = (t->capacity + 1) * 2;
+		if (t->capacity - t->size < size)
+			t->capacity = t->size + size;
+		t->data = realloc(t->data, sizeof(*t->data) * t->capacity);
+	}
+	memcpy(t->data + t->size, data, size);
+	t->size += size;
+}
+
+/** Copy the token out of the input, it isn't contiguous in it. */
+static void
+token_unslice(struct token *t)
+{
+	if (t->slice == NULL)
+		return;
+	const char *slice = t->slice;
+	uint32_t size = t->size;
+	t->slice = NULL;
+	t->size = 0;
+	token_copy_n(t, slice, size);
+}
+
 static void
 token_append(struct token *t, char c)
 {
+	token_unslice(t);
 	if (t->size == t->capacity) {
 		t->capacity = (t->capacity + 1) * 2;
 		t->data = realloc(t->data, sizeof(*t->data) * t->capacity);
@@ -53,42 +310,65 @@ token_append(struct token *t, char c)
 	t->data[t->size++] = c;
 }
 
+/** Append the input bytes. Contiguous ones aren't copied. */
+static void
+token_append_n(struct token *t, const char *data, uint32_t size)
+{
+	if (t->size == 0) {
+		t->slice = data;
+		t->size = size;
+		return;
+	}
+	if (t->slice != NULL) {
+		if (t->slice + t->size == data) {
+			t->size += size;
+			return;
+		}
+		token_unslice(t);
+	}
+	token_copy_n(t, data, size);
+}
+
 static void
 token_reset(struct token *t)
 {
+	t->slice = NULL;
 	t->size = 0;
 	t->type = TOKEN_TYPE_NONE;
 }
 
 static void
-command_append_arg(struct command *cmd, char *arg)
+command_append_arg(struct line_arena *a, struct command *cmd, char *arg)
 {
 	if (cmd->arg_count == cmd->arg_capacity) {
+		/* The old array stays in the arena till the line is freed. */
 		cmd->arg_capacity = (cmd->arg_capacity + 1) * 2;
-		cmd->args = realloc(cmd->args, sizeof(*cmd->args) * cmd->arg_capacity);
+		char **args = line_arena_alloc(a, sizeof(*cmd->args) *
+			cmd->arg_capacity);
+		if (cmd->arg_count > 0)
+			memcpy(args, cmd->args, sizeof(*args) * cmd->arg_count);
+		cmd->args = args;
 	} else {
 		assert(cmd->arg_count < cmd->arg_capacity);
 	}
 	cmd->args[cmd->arg_count++] = arg;
 }
 
+static struct expr *
+expr_new(struct line_arena *a, enum expr_type type)
+{
+	struct expr *e = line_arena_alloc(a, sizeof(*e));
+	memset(e, 0, sizeof(*e));
+	e->type = type;
+	return e;
+}
+
 void
 command_line_delete(struct command_line *line)
 {
-	while (line->head != NULL) {
-		struct expr *e = line->head;
-		if (e->type == EXPR_TYPE_COMMAND) {
-			struct command *cmd = &e->cmd;
-			free(cmd->exe);
-			for (uint32_t i = 0; i < cmd->arg_count; ++i)
-				free(cmd->args[i]);
-			free(cmd->args);
-		}
-		line->head = e->next;
-		free(e);
-	}
-	free(line->out_file);
-	free(line);
+	if (line->ref_count > 0 && --line->ref_count > 0)
+		return;
+	line_arena_delete((struct line_arena *)line);
 }
 
 static void
@@ -107,16 +387,47 @@ parser_new(void)
 	return calloc(1, sizeof(struct parser));
 }
 
+struct parser *
+parser_new_external(const char *data, uint32_t size)
+{
+	struct parser *p = parser_new();
+	p->buffer = (char *)data;
+	p->is_external = true;
+	p->size = size;
+	p->capacity = size;
+	return p;
+}
+
+void
+parser_release_line(struct parser *p, struct command_line *line)
+{
+	if (line->ref_count > 0 && --line->ref_count > 0)
+		return;
+	struct line_arena *a = (struct line_arena *)line;
+	if (p->free_arena != NULL)
+		line_arena_delete(p->free_arena);
+	p->free_arena = a;
+}
+
 void
 parser_feed(struct parser *p, const char *str, uint32_t len)
 {
+	assert(!p->is_external);
 	uint32_t cap = p->capacity - p->size;
 	if (cap < len) {
-		uint32_t new_capacity = (p->capacity + 1) * 2;
-		if (new_capacity - p->size < len)
-			new_capacity = p->size + len;
-		p->buffer = realloc(p->buffer, sizeof(*p->buffer) * new_capacity);
-		p->capacity = new_capacity;
+		uint32_t used = p->size - p->begin;
+		if (p->begin >= used && p->capacity - used >= len) {
+			memmove(p->buffer, p->buffer + p->begin, used);
+			p->begin = 0;
+			p->size = used;
+		} else {
+			uint32_t new_capacity = (p->capacity + 1) * 2;
+			if (new_capacity - p->size < len)
+				new_capacity = p->size + len;
+			p->buffer = realloc(p->buffer,
+				sizeof(*p->buffer) * new_capacity);
+			p->capacity = new_capacity;
+		}
 	}
 	memcpy(p->buffer + p->size, str, len);
 	p->size += len;
@@ -126,31 +437,209 @@ parser_feed(struct parser *p, const char *str, uint32_t len)
 static void
 parser_consume(struct parser *p, uint32_t size)
 {
-	assert(p->size >= size);
-	if (size == p->size) {
+	assert(p->size - p->begin >= size);
+	p->begin += size;
+	if (p->begin == p->size) {
+		p->begin = 0;
 		p->size = 0;
-		return;
 	}
-	memmove(p->buffer, p->buffer + size, p->size - size);
-	p->size -= size;
 }
 
+#if defined(PARSER_SIMD_AVX2) || defined(PARSER_SIMD_SSE2) || \
+	defined(PARSER_SIMD_NEON)
+#define PARSER_SIMD 1
+#endif
+
+/**
+ * Lexical classes of the grammar, the single source of truth for
+ * them. Each char which is not plain is listed once with all its
+ * classes. The class table for the scalar tokenizer and the compares
+ * of the SIMD one are both generated from this list at compile time.
+ */
+#define PARSE_CHAR_LIST(_)						\
+	_(' ', PARSE_CHAR_BLANK | PARSE_CHAR_SEPARATOR)			\
+	_('\t', PARSE_CHAR_BLANK | PARSE_CHAR_SEPARATOR)		\
+	_('\r', PARSE_CHAR_BLANK | PARSE_CHAR_SEPARATOR)		\
+	_('\n', PARSE_CHAR_BLANK | PARSE_CHAR_SEPARATOR |		\
+		PARSE_CHAR_NEW_LINE)					\
+	_('\v', PARSE_CHAR_BLANK)					\
+	_('\f', PARSE_CHAR_BLANK)					\
+	_('&', PARSE_CHAR_OPERATOR)					\
+	_('|', PARSE_CHAR_OPERATOR)					\
+	_('>', PARSE_CHAR_OPERATOR)					\
+	_('\'', PARSE_CHAR_SINGLE_QUOTE)				\
+	_('"', PARSE_CHAR_DOUBLE_QUOTE)					\
+	_('\\', PARSE_CHAR_ESCAPE)					\
+	_('#', PARSE_CHAR_COMMENT)
+
+enum parse_char_class {
+	/** Skipped before a token, same as isspace(). */
+	PARSE_CHAR_BLANK = 1 << 0,
+	/** Ends an unquoted token. */
+	PARSE_CHAR_SEPARATOR = 1 << 1,
+	PARSE_CHAR_NEW_LINE = 1 << 2,
+	/** First char of '&', '&&', '|', '||', '>', '>>'. */
+	PARSE_CHAR_OPERATOR = 1 << 3,
+	PARSE_CHAR_SINGLE_QUOTE = 1 << 4,
+	PARSE_CHAR_DOUBLE_QUOTE = 1 << 5,
+	PARSE_CHAR_ESCAPE = 1 << 6,
+	PARSE_CHAR_COMMENT = 1 << 7,
+};
+
+enum {
+	/** Classes which end a run of plain chars out of quotes. */
+	PARSE_SPECIAL_UNQUOTED = PARSE_CHAR_SEPARATOR | PARSE_CHAR_OPERATOR |
+		PARSE_CHAR_SINGLE_QUOTE | PARSE_CHAR_DOUBLE_QUOTE |
+		PARSE_CHAR_ESCAPE | PARSE_CHAR_COMMENT,
+	/** ... inside '...'. */
+	PARSE_SPECIAL_SINGLE_QUOTED = PARSE_CHAR_SINGLE_QUOTE,
+	/** ... inside "...". */
+	PARSE_SPECIAL_DOUBLE_QUOTED = PARSE_CHAR_DOUBLE_QUOTE |
+		PARSE_CHAR_ESCAPE,
+};
+
+#define PARSE_CHAR_TABLE_ENTRY(c, classes) [(unsigned char)(c)] = (classes),
+
+static const uint8_t parse_char_classes[256] = {
+	PARSE_CHAR_LIST(PARSE_CHAR_TABLE_ENTRY)
+};
+
+#undef PARSE_CHAR_TABLE_ENTRY
+
+static inline uint8_t
+parse_char_class(char c)
+{
+	return parse_char_classes[(unsigned char)c];
+}
+
+/**
+ * Find the first char in [pos, end) which has any of the
+ * @a special classes. The function is inlined with a constant
+ * mask, so the SIMD compares are generated only for the chars of
+ * these classes.
+ */
+static inline __attribute__((always_inline)) const char *
+parse_find_special_in(const char *pos, const char *end, uint8_t special)
+{
+#if PARSER_SIMD
+	/* Most of the tokens are short, cheaper to check them as is. */
+	const char *prefix_end = end - pos > 16 ? pos + 16 : end;
+	while (pos < prefix_end) {
+		if ((parse_char_class(*pos) & special) != 0)
+			return pos;
+		++pos;
+	}
+#endif
+#if defined(PARSER_SIMD_AVX2)
+#define PARSE_SIMD_CMP(c, classes)					\
+	if (((classes) & special) != 0) {				\
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v,		\
+			_mm256_set1_epi8(c)));				\
+	}
+	while (end - pos >= 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)pos);
+		__m256i m = _mm256_setzero_si256();
+		PARSE_CHAR_LIST(PARSE_SIMD_CMP)
+		uint32_t mask = _mm256_movemask_epi8(m);
+		if (mask != 0)
+			return pos + __builtin_ctz(mask);
+		pos += 32;
+	}
+#elif defined(PARSER_SIMD_SSE2)
+#define PARSE_SIMD_CMP(c, classes)					\
+	if (((classes) & special) != 0)					\
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(c)));
+	while (end - pos >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)pos);
+		__m128i m = _mm_setzero_si128();
+		PARSE_CHAR_LIST(PARSE_SIMD_CMP)
+		uint32_t mask = _mm_movemask_epi8(m);
+		if (mask != 0)
+			return pos + __builtin_ctz(mask);
+		pos += 16;
+	}
+#elif defined(PARSER_SIMD_NEON)
+#define PARSE_SIMD_CMP(c, classes)					\
+	if (((classes) & special) != 0)					\
+		m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8(c)));
+	while (end - pos >= 16) {
+		uint8x16_t v = vld1q_u8((const uint8_t *)pos);
+		uint8x16_t m = vdupq_n_u8(0);
+		PARSE_CHAR_LIST(PARSE_SIMD_CMP)
+		/* The position is found by the scalar loop below. */
+		if (vmaxvq_u8(m) != 0)
+			break;
+		pos += 16;
+	}
+#endif
+#undef PARSE_SIMD_CMP
+	while (pos < end && (parse_char_class(*pos) & special) == 0)
+		++pos;
+	return pos;
+}
+
+/**
+ * Find the first char in [pos, end) which is special inside the
+ * given quote. All the chars before it are appended to the token as
+ * is.
+ */
+static const char *
+parse_find_special(const char *pos, const char *end, char quote)
+{
+	switch (quote) {
+	case 0:
+		return parse_find_special_in(pos, end, PARSE_SPECIAL_UNQUOTED);
+	case '\'':
+		return parse_find_special_in(pos, end,
+			PARSE_SPECIAL_SINGLE_QUOTED);
+	default:
+		return parse_find_special_in(pos, end,
+			PARSE_SPECIAL_DOUBLE_QUOTED);
+	}
+}
+
+/**
+ * Parse a token from [pos, end). Returns the number of used bytes.
+ * If the token is not complete, its type is NONE, and its state is
+ * kept to continue with the next input. The bytes are used only
+ * once then, except for a trailing '\' or operator char, which
+ * meaning depends on the next char.
+ */
 static uint32_t
 parse_token(const char *pos, const char *end, struct token *out)
 {
-	token_reset(out);
 	const char *begin = pos;
-	while (pos < end) {
-		if (!isspace(*pos))
-			break;
-		if (*pos == '\n') {
-			out->type = TOKEN_TYPE_NEW_LINE;
-			return pos + 1 - begin;
+	char quote = 0;
+	switch (out->state) {
+	case TOKEN_STATE_STR:
+		quote = out->quote;
+		out->state = TOKEN_STATE_NONE;
+		break;
+	case TOKEN_STATE_COMMENT:
+		out->state = TOKEN_STATE_NONE;
+		goto comment;
+	default:
+		token_reset(out);
+		while (pos < end) {
+			uint8_t classes = parse_char_class(*pos);
+			if ((classes & PARSE_CHAR_BLANK) == 0)
+				break;
+			if ((classes & PARSE_CHAR_NEW_LINE) != 0) {
+				out->type = TOKEN_TYPE_NEW_LINE;
+				return pos + 1 - begin;
+			}
+			++pos;
 		}
-		++pos;
+		break;
 	}
-	char quote = 0;
 	while (pos < end) {
+		const char *plain_end = parse_find_special(pos, end, quote);
+		if (plain_end != pos) {
+			token_append_n(out, pos, plain_end - pos);
+			pos = plain_end;
+			if (pos == end)
+				break;
+		}
 		char c = *pos;
 		switch(c) {
 		case '\'':
@@ -158,8 +647,6 @@ parse_token(const char *pos, const char *end, struct token *out)
 			if (quote == 0) {
 				quote = c;
 				++pos;
-				if (pos == end)
-					return 0;
 				continue;
 			}
 			if (quote != c)
@@ -169,10 +656,10 @@ parse_token(const char *pos, const char *end, struct token *out)
 		case '\\':
 			if (quote == '\'')
 				goto append_and_next;
+			if (pos + 1 == end)
+				goto suspend;
 			if (quote == '"') {
 				++pos;
-				if (pos == end)
-					return 0;
 				c = *pos;
 				switch (c)
 				{
@@ -191,8 +678,6 @@ parse_token(const char *pos, const char *end, struct token *out)
 			}
 			assert(quote == 0);
 			++pos;
-			if (pos == end)
-				return 0;
 			c = *pos;
 			if (c == '\n') {
 				++pos;
@@ -208,9 +693,9 @@ parse_token(const char *pos, const char *end, struct token *out)
 				out->type = TOKEN_TYPE_STR;
 				return pos - begin;
 			}
+			if (pos + 1 == end)
+				goto suspend;
 			++pos;
-			if (pos == end)
-				return 0;
 			if (*pos == c) {
 				switch(c) {
 				case '&':
@@ -266,14 +751,7 @@ parse_token(const char *pos, const char *end, struct token *out)
 				return pos - begin;
 			}
 			++pos;
-			while (pos < end) {
-				if (*pos == '\n') {
-					out->type = TOKEN_TYPE_NEW_LINE;
-					return pos + 1 - begin;
-				}
-				++pos;
-			}
-			return 0;
+			goto comment;
 		default:
 			goto append_and_next;
 		}
@@ -281,162 +759,574 @@ parse_token(const char *pos, const char *end, struct token *out)
 		token_append(out, c);
 		++pos;
 	}
-	return 0;
-}
 
-enum parser_error
-parser_pop_next(struct parser *p, struct command_line **out)
-{
-	struct command_line *line = calloc(1, sizeof(*line));
-	char *pos = p->buffer;
-	const char *begin = pos;
-	char *end = pos + p->size;
-	struct token token = {0};
-	enum parser_error res = PARSER_ERR_NONE;
+suspend:
+	/* The input can be moved by the next feed. */
+	token_unslice(out);
+	if (quote != 0 || out->size > 0)
+		out->state = TOKEN_STATE_STR;
+	out->quote = quote;
+	return pos - begin;
 
+comment:
 	while (pos < end) {
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
-		struct expr *e;
-		switch(token.type) {
-		case TOKEN_TYPE_STR:
-			if (line->tail != NULL && line->tail->type == EXPR_TYPE_COMMAND) {
-				command_append_arg(&line->tail->cmd, token_strdup(&token));
-				continue;
-			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_COMMAND;
-			e->cmd.exe = token_strdup(&token);
-			command_line_append(line, e);
-			continue;
-		case TOKEN_TYPE_NEW_LINE:
-			/* Skip new lines. */
-			if (line->tail == NULL)
-				continue;
-			goto close_and_return;
-		case TOKEN_TYPE_PIPE:
-			if (line->tail == NULL) {
-				res = PARSER_ERR_PIPE_WITH_NO_LEFT_ARG;
-				goto return_error;
-			}
-			if (line->tail->type != EXPR_TYPE_COMMAND) {
-				res = PARSER_ERR_PIPE_WITH_LEFT_ARG_NOT_A_COMMAND;
-				goto return_error;
-			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_PIPE;
-			command_line_append(line, e);
-			continue;
-		case TOKEN_TYPE_AND:
-			if (line->tail == NULL) {
-				res = PARSER_ERR_AND_WITH_NO_LEFT_ARG;
-				goto return_error;
-			}
-			if (line->tail->type != EXPR_TYPE_COMMAND) {
-				res = PARSER_ERR_AND_WITH_LEFT_ARG_NOT_A_COMMAND;
-				goto return_error;
-			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_AND;
-			command_line_append(line, e);
-			continue;
-		case TOKEN_TYPE_OR:
-			if (line->tail == NULL) {
-				res = PARSER_ERR_OR_WITH_NO_LEFT_ARG;
-				goto return_error;
-			}
-			if (line->tail->type != EXPR_TYPE_COMMAND) {
-				res = PARSER_ERR_OR_WITH_LEFT_ARG_NOT_A_COMMAND;
-				goto return_error;
-			}
-			e = calloc(1, sizeof(*e));
-			e->type = EXPR_TYPE_OR;
-			command_line_append(line, e);
-			continue;
-		case TOKEN_TYPE_OUT_NEW:
-		case TOKEN_TYPE_OUT_APPEND:
-		case TOKEN_TYPE_BACKGROUND:
-			goto close_and_return;
-		default:
-			assert(false);
+		if (*pos == '\n') {
+			out->type = TOKEN_TYPE_NEW_LINE;
+			return pos + 1 - begin;
 		}
+		++pos;
 	}
-	goto return_no_line;
+	out->state = TOKEN_STATE_COMMENT;
+	return pos - begin;
+}
 
-close_and_return:
-	if (token.type == TOKEN_TYPE_OUT_NEW || token.type == TOKEN_TYPE_OUT_APPEND)
-	{
-		if (token.type == TOKEN_TYPE_OUT_NEW)
-			line->out_type = OUTPUT_TYPE_FILE_NEW;
-		else
-			line->out_type = OUTPUT_TYPE_FILE_APPEND;
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
-		if (token.type != TOKEN_TYPE_STR) {
-			res = PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG;
-			goto return_error;
+/**
+ * Add a complete token to the incomplete line. Returns true if the
+ * line is ended by it.
+ */
+static bool
+parser_add_token(struct parser *p, const struct token *token)
+{
+	struct line_arena *arena = p->arena;
+	struct command_line *line = p->line;
+	struct expr *e;
+	enum parser_error err;
+	switch (p->stage) {
+	case PARSE_STAGE_EXPRS:
+		break;
+	case PARSE_STAGE_OUT_FILE:
+		if (token->type != TOKEN_TYPE_STR) {
+			err = PARSER_ERR_OUTOUT_REDIRECT_BAD_ARG;
+			goto skip_line;
 		}
-		line->out_file = token_strdup(&token);
-		used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
-	}
-	if (token.type == TOKEN_TYPE_BACKGROUND) {
-		line->is_background = true;
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
-			goto return_no_line;
-		pos += used;
+		line->out_file = token_strdup(arena, token);
+		p->stage = PARSE_STAGE_AFTER_OUT;
+		return false;
+	case PARSE_STAGE_AFTER_OUT:
+		if (token->type == TOKEN_TYPE_BACKGROUND) {
+			line->is_background = true;
+			p->stage = PARSE_STAGE_AFTER_BACKGROUND;
+			return false;
+		}
+		if (token->type == TOKEN_TYPE_NEW_LINE)
+			return true;
+		err = PARSER_ERR_TOO_LATE_ARGUMENTS;
+		goto skip_line;
+	case PARSE_STAGE_AFTER_BACKGROUND:
+		if (token->type == TOKEN_TYPE_NEW_LINE)
+			return true;
+		err = PARSER_ERR_TOO_LATE_ARGUMENTS;
+		goto skip_line;
+	case PARSE_STAGE_SKIP:
+		return token->type == TOKEN_TYPE_NEW_LINE;
+	default:
+		assert(false);
 	}
-	if (token.type == TOKEN_TYPE_NEW_LINE) {
-		assert(line->tail != NULL);
-		parser_consume(p, pos - begin);
+	switch(token->type) {
+	case TOKEN_TYPE_STR:
+		if (line->tail != NULL && line->tail->type == EXPR_TYPE_COMMAND) {
+			command_append_arg(arena, &line->tail->cmd,
+				token_strdup(arena, token));
+			return false;
+		}
+		e = expr_new(arena, EXPR_TYPE_COMMAND);
+		e->cmd.exe = token_strdup(arena, token);
+		command_line_append(line, e);
+		return false;
+	case TOKEN_TYPE_NEW_LINE:
+		/* Skip new lines. */
+		return line->tail != NULL;
+	case TOKEN_TYPE_PIPE:
+		if (line->tail == NULL) {
+			err = PARSER_ERR_PIPE_WITH_NO_LEFT_ARG;
+			goto skip_line;
+		}
+		if (line->tail->type != EXPR_TYPE_COMMAND) {
+			err = PARSER_ERR_PIPE_WITH_LEFT_ARG_NOT_A_COMMAND;
+			goto skip_line;
+		}
+		e = expr_new(arena, EXPR_TYPE_PIPE);
+		command_line_append(line, e);
+		return false;
+	case TOKEN_TYPE_AND:
+		if (line->tail == NULL) {
+			err = PARSER_ERR_AND_WITH_NO_LEFT_ARG;
+			goto skip_line;
+		}
+		if (line->tail->type != EXPR_TYPE_COMMAND) {
+			err = PARSER_ERR_AND_WITH_LEFT_ARG_NOT_A_COMMAND;
+			goto skip_line;
+		}
+		e = expr_new(arena, EXPR_TYPE_AND);
+		command_line_append(line, e);
+		return false;
+	case TOKEN_TYPE_OR:
+		if (line->tail == NULL) {
+			err = PARSER_ERR_OR_WITH_NO_LEFT_ARG;
+			goto skip_line;
+		}
 		if (line->tail->type != EXPR_TYPE_COMMAND) {
-			res = PARSER_ERR_ENDS_NOT_WITH_A_COMMAND;
-			goto return_no_line;
+			err = PARSER_ERR_OR_WITH_LEFT_ARG_NOT_A_COMMAND;
+			goto skip_line;
 		}
-		res = PARSER_ERR_NONE;
-		*out = line;
-		goto return_final;
+		e = expr_new(arena, EXPR_TYPE_OR);
+		command_line_append(line, e);
+		return false;
+	case TOKEN_TYPE_OUT_NEW:
+		line->out_type = OUTPUT_TYPE_FILE_NEW;
+		p->stage = PARSE_STAGE_OUT_FILE;
+		return false;
+	case TOKEN_TYPE_OUT_APPEND:
+		line->out_type = OUTPUT_TYPE_FILE_APPEND;
+		p->stage = PARSE_STAGE_OUT_FILE;
+		return false;
+	case TOKEN_TYPE_BACKGROUND:
+		line->is_background = true;
+		p->stage = PARSE_STAGE_AFTER_BACKGROUND;
+		return false;
+	default:
+		assert(false);
+		return false;
 	}
-	res = PARSER_ERR_TOO_LATE_ARGUMENTS;
-	goto return_error;
 
-return_error:
+skip_line:
 	/*
-	 * Try to skip the whole current line. It can't be executed but can't
-	 * just crash here because of that.
+	 * The line can't be executed but can't just crash here because
+	 * of that. Skip the rest of it and report the error at its end.
 	 */
-	while (pos < end) {
-		uint32_t used = parse_token(pos, end, &token);
-		if (used == 0)
+	p->error = err;
+	p->stage = PARSE_STAGE_SKIP;
+	return false;
+}
+
+/** Begin a new line in the current arena. */
+static void
+parser_start_line(struct parser *p, struct command_line *line)
+{
+	memset(line, 0, sizeof(*line));
+	p->line = line;
+	p->stage = PARSE_STAGE_EXPRS;
+	p->error = PARSER_ERR_NONE;
+}
+
+static void
+parser_start_arena(struct parser *p)
+{
+	struct line_arena *arena = p->free_arena;
+	if (arena != NULL)
+		p->free_arena = NULL;
+	else
+		arena = line_arena_new();
+	line_arena_reset(arena);
+	p->arena = arena;
+	parser_start_line(p, &arena->line);
+}
+
+/**
+ * Continue parsing of the incomplete line from @a pos. Returns
+ * true if it is complete.
+ */
+static bool
+parser_parse_line(struct parser *p, const char **pos, const char *end)
+{
+	while (*pos < end) {
+		*pos += parse_token(*pos, end, &p->token);
+		if (p->token.type == TOKEN_TYPE_NONE)
+			return false;
+		if (parser_add_token(p, &p->token))
+			return true;
+	}
+	return false;
+}
+
+/** Error of the complete line if it can't be executed. */
+static enum parser_error
+parser_line_error(const struct parser *p)
+{
+	if (p->error != PARSER_ERR_NONE)
+		return p->error;
+	const struct command_line *line = p->line;
+	if (line->tail == NULL || line->tail->type != EXPR_TYPE_COMMAND)
+		return PARSER_ERR_ENDS_NOT_WITH_A_COMMAND;
+	return PARSER_ERR_NONE;
+}
+
+static char *
+line_arena_strdup(struct line_arena *a, const char *str)
+{
+	size_t size = strlen(str) + 1;
+	char *res = line_arena_alloc(a, size);
+	memcpy(res, str, size);
+	return res;
+}
+
+/** Copy of the line in its own arena, for the cache. */
+static struct line_arena *
+command_line_copy(const struct command_line *src)
+{
+	struct line_arena *a = line_arena_new();
+	line_arena_reset(a);
+	struct command_line *dst = &a->line;
+	dst->out_type = src->out_type;
+	if (src->out_file != NULL)
+		dst->out_file = line_arena_strdup(a, src->out_file);
+	dst->is_background = src->is_background;
+	for (const struct expr *e = src->head; e != NULL; e = e->next) {
+		struct expr *copy = expr_new(a, e->type);
+		if (e->type == EXPR_TYPE_COMMAND) {
+			const struct command *cmd = &e->cmd;
+			copy->cmd.exe = line_arena_strdup(a, cmd->exe);
+			copy->cmd.arg_count = cmd->arg_count;
+			copy->cmd.arg_capacity = cmd->arg_count;
+			if (cmd->arg_count > 0) {
+				copy->cmd.args = line_arena_alloc(a,
+					sizeof(char *) * cmd->arg_count);
+			}
+			for (uint32_t i = 0; i < cmd->arg_count; ++i) {
+				copy->cmd.args[i] =
+					line_arena_strdup(a, cmd->args[i]);
+			}
+		}
+		command_line_append(dst, copy);
+	}
+	return a;
+}
+
+/** Hash of 8 bytes at a time, the lines are mostly short. */
+static uint64_t
+line_cache_hash(const char *data, uint32_t size)
+{
+	const uint64_t mul = 0x9e3779b97f4a7c15ull;
+	uint64_t h = size * mul;
+	for (; size >= 8; data += 8, size -= 8) {
+		uint64_t w;
+		memcpy(&w, data, 8);
+		h = (h ^ w) * mul;
+		h ^= h >> 29;
+	}
+	if (size > 0) {
+		uint64_t w = 0;
+		memcpy(&w, data, size);
+		h = (h ^ w) * mul;
+	}
+	return h ^ (h >> 32);
+}
+
+static void
+line_cache_lru_unlink(struct line_cache *cache, struct line_cache_entry *e)
+{
+	if (e->lru_prev != NULL)
+		e->lru_prev->lru_next = e->lru_next;
+	else
+		cache->lru_first = e->lru_next;
+	if (e->lru_next != NULL)
+		e->lru_next->lru_prev = e->lru_prev;
+	else
+		cache->lru_last = e->lru_prev;
+}
+
+static void
+line_cache_lru_push(struct line_cache *cache, struct line_cache_entry *e)
+{
+	e->lru_prev = NULL;
+	e->lru_next = cache->lru_first;
+	if (cache->lru_first != NULL)
+		cache->lru_first->lru_prev = e;
+	else
+		cache->lru_last = e;
+	cache->lru_first = e;
+}
+
+static struct line_cache *
+line_cache_new(uint32_t capacity)
+{
+	struct line_cache *cache = calloc(1, sizeof(*cache));
+	cache->bucket_count = 1;
+	while (cache->bucket_count < capacity)
+		cache->bucket_count *= 2;
+	cache->buckets = calloc(cache->bucket_count,
+				sizeof(cache->buckets[0]));
+	cache->capacity = capacity;
+	return cache;
+}
+
+/** Drop the least recently used line. Its pops stay valid. */
+static void
+line_cache_evict(struct line_cache *cache)
+{
+	struct line_cache_entry *e = cache->lru_last;
+	struct line_cache_entry **pe =
+		&cache->buckets[e->hash & (cache->bucket_count - 1)];
+	while (*pe != e)
+		pe = &(*pe)->next;
+	*pe = e->next;
+	line_cache_lru_unlink(cache, e);
+	--cache->count;
+	/* The entry is in the line's arena, maybe freed with it. */
+	command_line_delete(e->line);
+}
+
+static void
+line_cache_delete(struct line_cache *cache)
+{
+	while (cache->count > 0)
+		line_cache_evict(cache);
+	free(cache->buckets);
+	free(cache);
+}
+
+static struct command_line *
+line_cache_find(struct line_cache *cache, const struct line_key *key)
+{
+	struct line_cache_entry *e =
+		cache->buckets[key->hash & (cache->bucket_count - 1)];
+	for (; e != NULL; e = e->next) {
+		if (e->hash == key->hash && e->size == key->size &&
+		    memcmp(e->key, key->data, key->size) == 0)
 			break;
-		pos += used;
-		if (token.type == TOKEN_TYPE_NEW_LINE) {
+	}
+	if (e == NULL) {
+		++cache->miss_count;
+		return NULL;
+	}
+	++cache->hit_count;
+	if (cache->lru_first != e) {
+		line_cache_lru_unlink(cache, e);
+		line_cache_lru_push(cache, e);
+	}
+	++e->line->ref_count;
+	return e->line;
+}
+
+/** Cache a copy of the parsed line under the key it was parsed from. */
+static void
+line_cache_insert(struct line_cache *cache, const struct command_line *line,
+		  const struct line_key *key)
+{
+	struct line_arena *a = command_line_copy(line);
+	struct line_cache_entry *e = line_arena_alloc(a, sizeof(*e) +
+		key->size);
+	e->line = &a->line;
+	e->line->ref_count = 1;
+	e->hash = key->hash;
+	e->size = key->size;
+	memcpy(e->key, key->data, key->size);
+	struct line_cache_entry **b =
+		&cache->buckets[key->hash & (cache->bucket_count - 1)];
+	e->next = *b;
+	*b = e;
+	line_cache_lru_push(cache, e);
+	if (++cache->count > cache->capacity)
+		line_cache_evict(cache);
+}
+
+/**
+ * No part of a new line is parsed yet. The parse from here depends
+ * only on the next bytes.
+ */
+static bool
+parser_is_line_start(const struct parser *p)
+{
+	if (p->token.state != TOKEN_STATE_NONE)
+		return false;
+	const struct command_line *line = p->line;
+	return line == NULL || (p->stage == PARSE_STAGE_EXPRS &&
+		line->head == NULL && line->out_type == OUTPUT_TYPE_STDOUT &&
+		!line->is_background);
+}
+
+/**
+ * Look up the next line from @a pos in the cache. The blanks before
+ * it are skipped, they don't change the parse of a new line. On a hit
+ * the shared line is returned and @a pos is moved after it. On a miss
+ * the key is filled, to cache the line if its parse ends at its first
+ * new line.
+ */
+static struct command_line *
+parser_cache_lookup(struct parser *p, const char **pos, const char *end,
+		    struct line_key *key)
+{
+	const char *begin = *pos;
+	while (begin < end && (*begin == ' ' || *begin == '\t' ||
+	       *begin == '\r' || *begin == '\n'))
+		++begin;
+	*pos = begin;
+	key->data = begin;
+	key->size = 0;
+	size_t size = end - begin;
+	if (size > LINE_CACHE_MAX_LINE_SIZE)
+		size = LINE_CACHE_MAX_LINE_SIZE;
+	const char *nl = memchr(begin, '\n', size);
+	if (nl == NULL)
+		return NULL;
+	key->size = nl + 1 - begin;
+	key->hash = line_cache_hash(begin, key->size);
+	struct command_line *line = line_cache_find(p->cache, key);
+	if (line != NULL)
+		*pos = nl + 1;
+	return line;
+}
+
+enum parser_error
+parser_pop_next(struct parser *p, struct command_line **out)
+{
+	*out = NULL;
+	const char *begin = p->buffer + p->begin;
+	const char *end = p->buffer + p->size;
+	const char *pos = begin;
+	struct line_key key = {NULL, 0, 0};
+	if (p->cache != NULL && parser_is_line_start(p)) {
+		struct command_line *line =
+			parser_cache_lookup(p, &pos, end, &key);
+		if (line != NULL) {
 			parser_consume(p, pos - begin);
-			goto return_no_line;
+			*out = line;
+			return PARSER_ERR_NONE;
 		}
 	}
-	res = PARSER_ERR_NONE;
-	goto return_no_line;
+	if (p->arena == NULL)
+		parser_start_arena(p);
+	bool is_line_end = parser_parse_line(p, &pos, end);
+	parser_consume(p, pos - begin);
+	if (!is_line_end)
+		return PARSER_ERR_NONE;
 
-return_no_line:
-	command_line_delete(line);
-	*out = NULL;
+	struct command_line *line = p->line;
+	enum parser_error res = parser_line_error(p);
+	p->arena = NULL;
+	p->line = NULL;
+	if (res != PARSER_ERR_NONE) {
+		parser_release_line(p, line);
+		return res;
+	}
+	if (key.size != 0 && pos == key.data + key.size)
+		line_cache_insert(p->cache, line, &key);
+	*out = line;
+	return PARSER_ERR_NONE;
+}
 
-return_final:
-	free(token.data);
-	return res;
+uint32_t
+parser_pop_many(struct parser *p, struct command_line **out, uint32_t cap,
+		enum parser_error *errs)
+{
+	if (p->arena == NULL)
+		parser_start_arena(p);
+	struct line_arena *arena = p->arena;
+	assert(p->line == &arena->line);
+	const char *begin = p->buffer + p->begin;
+	const char *end = p->buffer + p->size;
+	const char *pos = begin;
+	/* Where the incomplete line starts in the input and the arena. */
+	const char *line_begin = pos;
+	struct arena_mark mark = {&arena->first, 0};
+	uint32_t count = 0;
+	uint32_t line_count = 0;
+	while (count < cap) {
+		struct line_key key = {NULL, 0, 0};
+		if (p->cache != NULL && parser_is_line_start(p)) {
+			struct command_line *line =
+				parser_cache_lookup(p, &pos, end, &key);
+			if (line != NULL) {
+				errs[count] = PARSER_ERR_NONE;
+				out[count++] = line;
+				line_begin = pos;
+				continue;
+			}
+		}
+		if (!parser_parse_line(p, &pos, end))
+			break;
+		enum parser_error err = parser_line_error(p);
+		errs[count] = err;
+		if (err == PARSER_ERR_NONE) {
+			if (key.size != 0 && pos == key.data + key.size)
+				line_cache_insert(p->cache, p->line, &key);
+			out[count] = p->line;
+			++line_count;
+		} else {
+			out[count] = NULL;
+			line_arena_rollback(arena, mark);
+		}
+		++count;
+		line_begin = pos;
+		if (arena->chunk->size > ARENA_BATCH_MAX_CHUNK_SIZE &&
+		    line_count > 0)
+			break;
+		mark = line_arena_mark(arena);
+		if (line_count == 0)
+			parser_start_line(p, &arena->line);
+		else
+			parser_start_line(p, line_arena_alloc(arena,
+				sizeof(struct command_line)));
+	}
+	if (line_count == 0) {
+		/* The arena is not returned, keep the incomplete line in it. */
+		parser_consume(p, pos - begin);
+		return count;
+	}
+	/*
+	 * The arena belongs to the returned lines now. The rest of the
+	 * input is parsed again as a new line next time. Its bytes are
+	 * still parsed at most twice, because the first line of an arena
+	 * is resumable.
+	 */
+	token_reset(&p->token);
+	p->token.state = TOKEN_STATE_NONE;
+	p->arena = NULL;
+	p->line = NULL;
+	parser_consume(p, line_begin - begin);
+	return count;
+}
+
+void
+parser_release_many(struct parser *p, struct command_line **lines,
+		    uint32_t count)
+{
+	/* The first not shared line is the arena of all such. */
+	struct command_line *first = NULL;
+	for (uint32_t i = 0; i < count; ++i) {
+		struct command_line *line = lines[i];
+		if (line == NULL)
+			continue;
+		if (line->ref_count > 0)
+			parser_release_line(p, line);
+		else if (first == NULL)
+			first = line;
+	}
+	if (first != NULL)
+		parser_release_line(p, first);
+}
+
+void
+parser_set_cache(struct parser *p, uint32_t capacity)
+{
+	if (p->cache != NULL)
+		line_cache_delete(p->cache);
+	p->cache = capacity > 0 ? line_cache_new(capacity) : NULL;
+}
+
+void
+parser_get_cache_stats(const struct parser *p,
+		       struct parser_cache_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	if (p->cache == NULL)
+		return;
+	stats->hit_count = p->cache->hit_count;
+	stats->miss_count = p->cache->miss_count;
+	stats->line_count = p->cache->count;
 }
 
 void
 parser_delete(struct parser *p)
 {
-	free(p->buffer);
+	if (p->arena != NULL)
+		line_arena_delete(p->arena);
+	if (p->free_arena != NULL)
+		line_arena_delete(p->free_arena);
+	if (p->cache != NULL)
+		line_cache_delete(p->cache);
+	free(p->token.data);
+	if (!p->is_external)
+		free(p->buffer);
 	free(p);
 }
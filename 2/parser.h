@@ -52,19 +52,84 @@ struct command_line {
 	/** Valid if the out type is FILE. */
 	char *out_file;
 	bool is_background;
+	/**
+	 * 0 for a line owned by the user. A line from the parser's cache
+	 * is immutable and is shared by the cache and all its pops. Each
+	 * pop is released as usual, and the memory is freed with the
+	 * last reference.
+	 */
+	uint32_t ref_count;
 };
 
+/**
+ * All the memory of a line, including its exprs and strings, is
+ * freed at once.
+ */
 void
 command_line_delete(struct command_line *line);
 
 struct parser *
 parser_new(void);
 
+/**
+ * Parser of the given input, which must stay valid and unchanged
+ * till the parser is deleted. The input is not copied, and
+ * parser_feed() can't be used.
+ */
+struct parser *
+parser_new_external(const char *data, uint32_t size);
+
+/**
+ * Same as command_line_delete(), but the line's memory is kept by
+ * the parser and reused for the next parsed lines.
+ */
+void
+parser_release_line(struct parser *p, struct command_line *line);
+
 void
 parser_feed(struct parser *p, const char *str, uint32_t len);
 
 enum parser_error
 parser_pop_next(struct parser *p, struct command_line **out);
 
+/**
+ * Pop up to @a cap complete lines at once. Returns the number of
+ * results. Each result is either a line with PARSER_ERR_NONE in
+ * @a errs, or NULL and the error of a line which can't be executed.
+ * All the lines of one call share one memory block, and are freed
+ * together by parser_release_many().
+ */
+uint32_t
+parser_pop_many(struct parser *p, struct command_line **out, uint32_t cap,
+		enum parser_error *errs);
+
+/** Free all the lines returned by one parser_pop_many() call. */
+void
+parser_release_many(struct parser *p, struct command_line **lines,
+		    uint32_t count);
+
+/**
+ * Keep up to @a capacity of the recently parsed distinct lines by
+ * their bytes. A line found in the cache is not parsed again, its
+ * shared copy is popped instead. Only the lines which end with their
+ * first new line are cached, and not longer than a few KB. 0 turns
+ * the cache off, which is the default.
+ */
+void
+parser_set_cache(struct parser *p, uint32_t capacity);
+
+struct parser_cache_stats {
+	/** Lines popped from the cache. */
+	uint64_t hit_count;
+	/** Complete lines looked up and not found. */
+	uint64_t miss_count;
+	/** Lines in the cache now. */
+	uint32_t line_count;
+};
+
+void
+parser_get_cache_stats(const struct parser *p,
+		       struct parser_cache_stats *stats);
+
 void
 parser_delete(struct parser *p);
@@ -0,0 +1,284 @@
+#include "parser.h"
+#include "unit_bench.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Benchmarks of the command line parser on ../utils/unit_bench.h. A
+ * script is fed in pieces of the size of a read() in the shell, or is
+ * parsed right from its buffer, and all the lines are popped as they
+ * get complete. One iteration is one input byte.
+ *
+ * A bench is named by the scenario and the input, like
+ * "short_lines/feed". Its arg is the index of the scenario, the line
+ * and arg lengths of which are in the info of the report.
+ */
+
+enum {
+	BENCH_SCRIPT_SIZE = 64 * 1024 * 1024,
+	/** Same as the read buffer size in the shell. */
+	BENCH_FEED_SIZE = 1024,
+	/** Same as the line batch size in the shell. */
+	BENCH_BATCH_SIZE = 64,
+	/** Same as the parse cache size in the shell. */
+	BENCH_CACHE_SIZE = 1024,
+};
+
+enum bench_input {
+	/** Fed by pieces, popped one by one. */
+	BENCH_INPUT_FEED,
+	/** External, popped one by one. */
+	BENCH_INPUT_EXTERNAL,
+	/** External, popped in batches. */
+	BENCH_INPUT_BATCH,
+	/** Same, with the parse cache. */
+	BENCH_INPUT_BATCH_CACHED,
+};
+
+static const char *bench_input_names[] = {"feed", "external", "batch",
+	"batch_cached"};
+
+enum {
+	BENCH_INPUT_COUNT = sizeof(bench_input_names) /
+			    sizeof(bench_input_names[0]),
+};
+
+struct bench_scenario {
+	const char *name;
+	/** Length of each line in the script. */
+	long line_len;
+	/** Zero means all the line is one quoted argument. */
+	long arg_len;
+	/** Names of its benches, one per input. */
+	char bench_names[BENCH_INPUT_COUNT][64];
+};
+
+static struct bench_scenario scenarios[] = {
+	{.name = "short_lines", .line_len = 16, .arg_len = 3},
+	{.name = "short_lines", .line_len = 200, .arg_len = 3},
+	{.name = "long_lines", .line_len = 64 * 1024, .arg_len = 3},
+	{.name = "long_lines", .line_len = 4 * 1024 * 1024, .arg_len = 3},
+	{.name = "long_args", .line_len = 64 * 1024, .arg_len = 100},
+	{.name = "long_args", .line_len = 4 * 1024 * 1024, .arg_len = 4000},
+	{.name = "quoted_lines", .line_len = 64 * 1024, .arg_len = 0},
+	{.name = "quoted_lines", .line_len = 1024 * 1024, .arg_len = 0},
+};
+
+enum {
+	BENCH_SCENARIO_COUNT = sizeof(scenarios) / sizeof(scenarios[0]),
+};
+
+/** The script of the last scenario, reused by its other inputs. */
+static char *script = NULL;
+static long script_scenario = -1;
+
+/**
+ * Script of lines like "echo arg arg arg ...\n" of @a line_len
+ * bytes each, @a byte_count bytes in total. Each arg is
+ * @a arg_len bytes.
+ */
+static char *
+bench_script_new(long line_len, long arg_len, long byte_count)
+{
+	char *res = malloc(byte_count);
+	long pos = 0;
+	while (pos < byte_count) {
+		long end = pos + line_len;
+		if (end > byte_count)
+			end = byte_count;
+		memcpy(res + pos, "echo", 4 < end - pos ? 4 : end - pos);
+		for (long i = pos + 4; i < end; ++i)
+			res[i] = (i - pos) % (arg_len + 1) == 0 ? ' ' : 'a';
+		res[end - 1] = '\n';
+		pos = end;
+	}
+	return res;
+}
+
+/**
+ * Script of lines like 'echo "aaa\naaa\n...aaa"\n' of @a line_len
+ * bytes each, so the new lines inside the quotes don't end the
+ * command line, and it spans many feeds.
+ */
+static char *
+bench_quoted_script_new(long line_len, long byte_count)
+{
+	char *res = bench_script_new(line_len, line_len, byte_count);
+	for (long pos = 0; pos < byte_count; pos += line_len) {
+		long end = pos + line_len;
+		if (end > byte_count)
+			end = byte_count;
+		if (end - pos < 8)
+			continue;
+		res[pos + 5] = '"';
+		for (long i = pos + 6; i < end - 2; i += 64)
+			res[i] = '\n';
+		res[end - 2] = '"';
+	}
+	return res;
+}
+
+/** Parse the script right from its buffer, as if mapped. */
+static long
+bench_parse_external(const char *script, long byte_count)
+{
+	long line_count = 0;
+	struct parser *p = parser_new_external(script, byte_count);
+	struct command_line *line;
+	while (true) {
+		enum parser_error err = parser_pop_next(p, &line);
+		if (err == PARSER_ERR_NONE && line == NULL)
+			break;
+		if (err != PARSER_ERR_NONE)
+			abort();
+		++line_count;
+		parser_release_line(p, line);
+	}
+	parser_delete(p);
+	return line_count;
+}
+
+/** Same as the external parse, but the lines are popped in batches. */
+static long
+bench_parse_batch(const char *script, long byte_count, bool is_cached)
+{
+	long line_count = 0;
+	struct command_line *lines[BENCH_BATCH_SIZE];
+	enum parser_error errs[BENCH_BATCH_SIZE];
+	struct parser *p = parser_new_external(script, byte_count);
+	if (is_cached)
+		parser_set_cache(p, BENCH_CACHE_SIZE);
+	while (true) {
+		uint32_t count = parser_pop_many(p, lines, BENCH_BATCH_SIZE, errs);
+		if (count == 0)
+			break;
+		for (uint32_t i = 0; i < count; ++i) {
+			if (errs[i] != PARSER_ERR_NONE)
+				abort();
+		}
+		line_count += count;
+		parser_release_many(p, lines, count);
+	}
+	parser_delete(p);
+	return line_count;
+}
+
+static long
+bench_parse(const char *script, long byte_count)
+{
+	struct parser *p = parser_new();
+	long line_count = 0;
+	for (long pos = 0; pos < byte_count; pos += BENCH_FEED_SIZE) {
+		long size = byte_count - pos;
+		if (size > BENCH_FEED_SIZE)
+			size = BENCH_FEED_SIZE;
+		parser_feed(p, script + pos, size);
+		struct command_line *line;
+		while (true) {
+			enum parser_error err = parser_pop_next(p, &line);
+			if (err == PARSER_ERR_NONE && line == NULL)
+				break;
+			if (err != PARSER_ERR_NONE)
+				abort();
+			++line_count;
+			parser_release_line(p, line);
+		}
+	}
+	parser_delete(p);
+	return line_count;
+}
+
+/**
+ * Make the script of the scenario with @a byte_count bytes, if it
+ * isn't the last one made.
+ */
+static void
+bench_prepare_script(long index, long byte_count)
+{
+	if (script_scenario == index)
+		return;
+	const struct bench_scenario *sc = &scenarios[index];
+	free(script);
+	script = sc->arg_len > 0 ?
+		bench_script_new(sc->line_len, sc->arg_len, byte_count) :
+		bench_quoted_script_new(sc->line_len, byte_count);
+	script_scenario = index;
+}
+
+static void
+bench_input(long byte_count, long index, enum bench_input input)
+{
+	bench_pause();
+	bench_prepare_script(index, byte_count);
+	bench_resume();
+	long line_count;
+	switch (input) {
+	case BENCH_INPUT_FEED:
+		line_count = bench_parse(script, byte_count);
+		break;
+	case BENCH_INPUT_EXTERNAL:
+		line_count = bench_parse_external(script, byte_count);
+		break;
+	case BENCH_INPUT_BATCH:
+		line_count = bench_parse_batch(script, byte_count, false);
+		break;
+	default:
+		line_count = bench_parse_batch(script, byte_count, true);
+		break;
+	}
+	if (line_count == 0)
+		abort();
+}
+
+static void
+bench_feed(long iterations, long index)
+{
+	bench_input(iterations, index, BENCH_INPUT_FEED);
+}
+
+static void
+bench_external(long iterations, long index)
+{
+	bench_input(iterations, index, BENCH_INPUT_EXTERNAL);
+}
+
+static void
+bench_batch(long iterations, long index)
+{
+	bench_input(iterations, index, BENCH_INPUT_BATCH);
+}
+
+static void
+bench_batch_cached(long iterations, long index)
+{
+	bench_input(iterations, index, BENCH_INPUT_BATCH_CACHED);
+}
+
+int
+main(int argc, char **argv)
+{
+	static const bench_f inputs[BENCH_INPUT_COUNT] = {
+		bench_feed, bench_external, bench_batch, bench_batch_cached,
+	};
+	for (int i = 0; i < BENCH_SCENARIO_COUNT; ++i) {
+		struct bench_scenario *sc = &scenarios[i];
+		char key[32], value[64];
+		snprintf(key, sizeof(key), "scenario_%d", i);
+		snprintf(value, sizeof(value), "%s, line_len %ld, arg_len %ld",
+			 sc->name, sc->line_len, sc->arg_len);
+		bench_info(key, value);
+		for (int j = 0; j < BENCH_INPUT_COUNT; ++j) {
+			snprintf(sc->bench_names[j], sizeof(sc->bench_names[j]),
+				 "%s/%s", sc->name, bench_input_names[j]);
+			bench_register_arg(sc->bench_names[j], inputs[j],
+					   BENCH_SCRIPT_SIZE, i);
+		}
+	}
+	int rc = bench_main(argc, argv);
+	free(script);
+	return rc;
+}
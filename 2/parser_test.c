@@ -2,6 +2,8 @@
 
 #include "unit.h"
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 static void
@@ -819,6 +821,426 @@ test_errors(void)
 	unit_test_finish();
 }
 
+static void
+test_line_reuse(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+
+	unit_msg("Line bigger than the first arena chunk");
+	const int arg_count = 1000;
+	parser_feed(p, "echo", 4);
+	for (int i = 0; i < arg_count; ++i) {
+		char arg[32];
+		int len = snprintf(arg, sizeof(arg), " arg%d", i);
+		parser_feed(p, arg, len);
+	}
+	parser_feed(p, " > out.txt\n", 11);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(line->head->cmd.arg_count == (uint32_t)arg_count,
+		"arg count");
+	bool ok = true;
+	for (int i = 0; i < arg_count && ok; ++i) {
+		char arg[32];
+		snprintf(arg, sizeof(arg), "arg%d", i);
+		ok = strcmp(line->head->cmd.args[i], arg) == 0;
+	}
+	unit_check(ok, "args");
+	unit_check(strcmp(line->out_file, "out.txt") == 0, "out file");
+	struct command_line *old = line;
+	parser_release_line(p, line);
+
+	unit_msg("Released memory is reused");
+	parser_feed(p, "ls -l | wc\n", 11);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(line == old, "same line");
+	unit_check(line->out_type == OUTPUT_TYPE_STDOUT, "out type");
+	unit_check(line->out_file == NULL, "out file");
+	struct expr *e = line->head;
+	unit_check(strcmp(e->cmd.exe, "ls") == 0, "exe");
+	unit_check(e->cmd.arg_count == 1, "arg count");
+	unit_check(strcmp(e->cmd.args[0], "-l") == 0, "arg[0]");
+	e = e->next;
+	unit_check(e->type == EXPR_TYPE_PIPE, "expr type");
+	e = e->next;
+	unit_check(strcmp(e->cmd.exe, "wc") == 0, "exe");
+	unit_check(e->next == NULL, "no more exprs");
+	parser_release_line(p, line);
+
+	parser_delete(p);
+	unit_test_finish();
+}
+
+static void
+test_feed_in_pieces(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+
+	unit_msg("Lines crossing the piece borders");
+	const int line_count = 5000;
+	char *script = malloc(line_count * 32);
+	int size = 0;
+	for (int i = 0; i < line_count; ++i)
+		size += sprintf(script + size, "cmd%d arg%d\n", i, i);
+	int next = 0;
+	bool ok = true;
+	for (int pos = 0; pos < size && ok; pos += 7) {
+		int len = size - pos < 7 ? size - pos : 7;
+		parser_feed(p, script + pos, len);
+		while (ok) {
+			ok = parser_pop_next(p, &line) == PARSER_ERR_NONE;
+			if (!ok || line == NULL)
+				break;
+			char exe[32];
+			snprintf(exe, sizeof(exe), "cmd%d", next);
+			ok = strcmp(line->head->cmd.exe, exe) == 0 &&
+				line->head->cmd.arg_count == 1;
+			++next;
+			parser_release_line(p, line);
+		}
+	}
+	unit_check(ok, "all lines are correct");
+	unit_check(next == line_count, "all lines are parsed");
+	free(script);
+
+	unit_msg("New line in a string doesn't end the line");
+	const char *str = "echo \"a\nb\"";
+	for (uint32_t i = 0; i < strlen(str); ++i) {
+		parser_feed(p, &str[i], 1);
+		unit_fail_if(parser_pop_next(p, &line) != PARSER_ERR_NONE);
+		unit_fail_if(line != NULL);
+	}
+	parser_feed(p, "\n", 1);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(line->head->cmd.arg_count == 1, "arg count");
+	unit_check(strcmp(line->head->cmd.args[0], "a\nb") == 0, "arg[0]");
+	command_line_delete(line);
+
+	parser_delete(p);
+	unit_test_finish();
+}
+
+static void
+test_long_tokens_one(struct parser *p, const char *fmt, const char *expected)
+{
+	struct command_line *line = NULL;
+	char pad[128];
+	bool ok = true;
+	/* Special chars at all the positions of a SIMD block. */
+	for (int len = 0; len < 80 && ok; ++len) {
+		memset(pad, 'a', len);
+		pad[len] = 0;
+		char in[512], out[512];
+		int size = snprintf(in, sizeof(in), fmt, pad, pad);
+		snprintf(out, sizeof(out), expected, pad, pad);
+		parser_feed(p, in, size);
+		ok = parser_pop_next(p, &line) == PARSER_ERR_NONE &&
+			line != NULL && line->head->cmd.arg_count == 1 &&
+			strcmp(line->head->cmd.args[0], out) == 0;
+		if (line != NULL)
+			parser_release_line(p, line);
+	}
+	unit_check(ok, fmt);
+}
+
+static void
+test_long_tokens(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+
+	test_long_tokens_one(p, "echo %s\"x y%s\"\n", "%sx y%s");
+	test_long_tokens_one(p, "echo '%s\\\" |&>#%s'\n", "%s\\\" |&>#%s");
+	test_long_tokens_one(p, "echo \"%s\\\"' |&>#%s\"\n", "%s\"' |&>#%s");
+	test_long_tokens_one(p, "echo %s\\ %s\n", "%s %s");
+	test_long_tokens_one(p, "echo %sb%s# comment\n", "%sb%s");
+	test_long_tokens_one(p, "echo %sb%s\t\r\n", "%sb%s");
+
+	parser_delete(p);
+	unit_test_finish();
+}
+
+static void
+test_external_input(void)
+{
+	unit_test_start();
+	const char *str = "cat \"a b\" c\\ d x'e f' | grep x > out\n"
+		"echo 1 && echo 2\necho incomplete";
+	struct parser *p = parser_new_external(str, strlen(str));
+	struct command_line *line = NULL;
+
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	struct expr *e = line->head;
+	unit_check(strcmp(e->cmd.exe, "cat") == 0, "exe");
+	unit_check(e->cmd.arg_count == 3, "arg count");
+	unit_check(strcmp(e->cmd.args[0], "a b") == 0, "slice in quotes");
+	unit_check(strcmp(e->cmd.args[1], "c d") == 0, "escaped");
+	unit_check(strcmp(e->cmd.args[2], "xe f") == 0, "concatenated");
+	e = e->next;
+	unit_check(e->type == EXPR_TYPE_PIPE, "pipe");
+	e = e->next;
+	unit_check(strcmp(e->cmd.exe, "grep") == 0, "exe");
+	unit_check(strcmp(e->cmd.args[0], "x") == 0, "arg[0]");
+	unit_check(strcmp(line->out_file, "out") == 0, "out file");
+	parser_release_line(p, line);
+
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	e = line->head;
+	unit_check(strcmp(e->cmd.exe, "echo") == 0, "exe");
+	unit_check(e->next->type == EXPR_TYPE_AND, "and");
+	command_line_delete(line);
+
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(line == NULL, "no complete lines");
+	unit_check(strcmp(str + strlen(str) - 10, "incomplete") == 0,
+		"input is not changed");
+	parser_delete(p);
+	unit_test_finish();
+}
+
+static int
+line_dump(const struct command_line *line, char *buf, int size, int len)
+{
+	for (struct expr *e = line->head; e != NULL; e = e->next) {
+		if (e->type != EXPR_TYPE_COMMAND) {
+			len += snprintf(buf + len, size - len, "op %d ", e->type);
+			continue;
+		}
+		len += snprintf(buf + len, size - len, "[%s", e->cmd.exe);
+		for (uint32_t i = 0; i < e->cmd.arg_count; ++i) {
+			len += snprintf(buf + len, size - len, " [%s]",
+				e->cmd.args[i]);
+		}
+		len += snprintf(buf + len, size - len, "] ");
+	}
+	return len + snprintf(buf + len, size - len, "out %d %s bg %d\n",
+		line->out_type, line->out_file != NULL ? line->out_file : "-",
+		line->is_background);
+}
+
+/** Print all the lines and errors, as they are popped. */
+static int
+parse_dump_all(struct parser *p, char *buf, int size)
+{
+	int len = strlen(buf);
+	struct command_line *line;
+	while (true) {
+		enum parser_error err = parser_pop_next(p, &line);
+		if (err != PARSER_ERR_NONE) {
+			len += snprintf(buf + len, size - len, "error %d\n", err);
+			continue;
+		}
+		if (line == NULL)
+			return len;
+		len = line_dump(line, buf, size, len);
+		parser_release_line(p, line);
+	}
+}
+
+/** Same as parse_dump_all(), but in batches of @a cap results. */
+static int
+parse_dump_many(struct parser *p, uint32_t cap, char *buf, int size)
+{
+	int len = strlen(buf);
+	struct command_line *lines[8];
+	enum parser_error errs[8];
+	while (true) {
+		uint32_t count = parser_pop_many(p, lines, cap, errs);
+		if (count == 0)
+			return len;
+		for (uint32_t i = 0; i < count; ++i) {
+			if (lines[i] == NULL) {
+				len += snprintf(buf + len, size - len, "error %d\n",
+					errs[i]);
+				continue;
+			}
+			len = line_dump(lines[i], buf, size, len);
+		}
+		parser_release_many(p, lines, count);
+	}
+}
+
+static void
+test_resume(void)
+{
+	unit_test_start();
+	const char *str = "echo \"a\nb\\\"c\\\nd\" 'x\ny' e\\ f\\\ng\n"
+		"a && b || c | d >> out & # comment\n"
+		"\n   \t\n# only comment\n"
+		"ls > f\n"
+		"| ls\n"
+		"ls > f g\nls\n"
+		"ls &&\n"
+		"ls \"q\"x\n"
+		"cat 'q'\"w\"e > \"a b\" &\n";
+	uint32_t size = strlen(str);
+	char expected[4096] = {0};
+	char result[4096];
+
+	struct parser *p = parser_new_external(str, size);
+	parse_dump_all(p, expected, sizeof(expected));
+	parser_delete(p);
+
+	unit_msg("Each piece size gives the same lines as the whole input");
+	bool ok = true;
+	for (uint32_t step = 1; step <= 9 && ok; ++step) {
+		p = parser_new();
+		result[0] = 0;
+		for (uint32_t pos = 0; pos < size; pos += step) {
+			uint32_t len = size - pos < step ? size - pos : step;
+			parser_feed(p, str + pos, len);
+			parse_dump_all(p, result, sizeof(result));
+		}
+		ok = strcmp(expected, result) == 0;
+		if (!ok)
+			printf("step %u:\n%s\nexpected:\n%s\n", step, result,
+			       expected);
+		parser_delete(p);
+	}
+	unit_check(ok, "same lines");
+
+	unit_msg("Batches of lines are the same as one by one");
+	for (uint32_t cap = 1; cap <= 8 && ok; ++cap) {
+		for (uint32_t step = 1; step <= 9 && ok; ++step) {
+			p = parser_new();
+			result[0] = 0;
+			for (uint32_t pos = 0; pos < size; pos += step) {
+				uint32_t len = size - pos < step ? size - pos : step;
+				parser_feed(p, str + pos, len);
+				/* Both the APIs can be mixed. */
+				if (pos % 3 == 0)
+					parse_dump_all(p, result, sizeof(result));
+				parse_dump_many(p, cap, result, sizeof(result));
+			}
+			ok = strcmp(expected, result) == 0;
+			if (!ok)
+				printf("cap %u, step %u:\n%s\n", cap, step, result);
+			parser_delete(p);
+		}
+	}
+	unit_check(ok, "same lines");
+	p = parser_new_external(str, size);
+	result[0] = 0;
+	parse_dump_many(p, 8, result, sizeof(result));
+	parser_delete(p);
+	unit_check(strcmp(expected, result) == 0, "same lines in one pass");
+
+	unit_msg("Incomplete line is freed with the parser");
+	p = parser_new();
+	parser_feed(p, "echo \"long", 10);
+	struct command_line *line;
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(line == NULL, "no line");
+	parser_delete(p);
+	unit_test_finish();
+}
+
+static void
+test_cache(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	parser_set_cache(p, 2);
+	struct command_line *line;
+	struct command_line *first;
+	struct parser_cache_stats stats;
+
+	unit_msg("Same lines share one parse");
+	parser_feed(p, "ls -l > f\n  ls -l > f\n", 22);
+	unit_check(parser_pop_next(p, &first) == PARSER_ERR_NONE, "parse");
+	unit_check(first->ref_count == 0, "the parsed one is not shared");
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(line != NULL && line != first, "a cached copy");
+	unit_check(line->ref_count == 2, "held by the cache and the user");
+	unit_check(strcmp(line->head->cmd.exe, "ls") == 0 &&
+		   line->head->cmd.arg_count == 1 &&
+		   strcmp(line->head->cmd.args[0], "-l") == 0 &&
+		   strcmp(line->out_file, "f") == 0, "same line");
+	struct command_line *shared = line;
+	parser_feed(p, "ls -l > f\n", 10);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(line == shared && line->ref_count == 3, "same copy");
+	parser_release_line(p, line);
+	parser_release_line(p, first);
+	parser_get_cache_stats(p, &stats);
+	unit_check(stats.hit_count == 2 && stats.miss_count == 1 &&
+		   stats.line_count == 1, "stats");
+
+	unit_msg("Evicted line stays valid till released");
+	parser_feed(p, "a\nb\nc\n", 6);
+	for (int i = 0; i < 3; ++i) {
+		unit_fail_if(parser_pop_next(p, &line) != PARSER_ERR_NONE);
+		parser_release_line(p, line);
+	}
+	parser_get_cache_stats(p, &stats);
+	unit_check(stats.line_count == 2, "capacity");
+	unit_check(shared->ref_count == 1, "only the user has it");
+	unit_check(strcmp(shared->head->cmd.exe, "ls") == 0, "still valid");
+	parser_release_line(p, shared);
+	parser_feed(p, "ls -l > f\n", 10);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(line->ref_count == 0, "parsed again");
+	parser_release_line(p, line);
+
+	unit_msg("Lines not ending at their first new line are not cached");
+	uint64_t miss_count = stats.miss_count + 1;
+	parser_feed(p, "echo 'x\ny'\necho 'x\ny'\n", 22);
+	for (int i = 0; i < 2; ++i) {
+		unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE &&
+			   line->ref_count == 0, "parsed");
+		parser_release_line(p, line);
+	}
+	parser_get_cache_stats(p, &stats);
+	unit_check(stats.miss_count == miss_count + 2, "misses");
+	parser_delete(p);
+
+	unit_msg("Cached lines are the same as parsed");
+	const char *str = "echo \"a\nb\" c\n"
+		"a && b || c | d >> out & # comment\n"
+		"\n   \t\n# only comment\n"
+		"ls > f\n"
+		"| ls\n"
+		"ls\n";
+	char input[1024];
+	int size = snprintf(input, sizeof(input), "%s%s%s", str, str, str);
+	char expected[4096] = {0};
+	char result[4096];
+	p = parser_new_external(input, size);
+	parse_dump_all(p, expected, sizeof(expected));
+	parser_delete(p);
+	bool ok = true;
+	for (uint32_t cap = 0; cap <= 8 && ok; ++cap) {
+		/* Lines fed in small pieces get parsed before complete. */
+		for (int step = 1; step <= 10 && ok; ++step) {
+			if (step == 10)
+				step = size;
+			p = parser_new();
+			parser_set_cache(p, 4);
+			result[0] = 0;
+			for (int pos = 0; pos < size; pos += step) {
+				int len = size - pos < step ? size - pos : step;
+				parser_feed(p, input + pos, len);
+				if (cap == 0)
+					parse_dump_all(p, result, sizeof(result));
+				else
+					parse_dump_many(p, cap, result,
+							sizeof(result));
+			}
+			ok = strcmp(expected, result) == 0;
+			if (!ok)
+				printf("cap %u, step %d:\n%s\n", cap, step, result);
+			parser_get_cache_stats(p, &stats);
+			ok = ok && (step < size || stats.hit_count > 0);
+			parser_delete(p);
+		}
+	}
+	unit_check(ok, "same lines");
+	unit_test_finish();
+}
+
 int
 main(void)
 {
@@ -834,5 +1256,11 @@ main(void)
 	test_logical_operators();
 	test_background();
 	test_errors();
+	test_line_reuse();
+	test_feed_in_pieces();
+	test_long_tokens();
+	test_external_input();
+	test_resume();
+	test_cache();
 	return 0;
 }
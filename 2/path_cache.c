@@ -0,0 +1,172 @@
+#include "path_cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+enum {
+	PATH_CACHE_MIN_BUCKET_COUNT = 64,
+};
+
+/** FNV-1a. */
+static uint32_t
+path_cache_hash(const char *name)
+{
+	uint32_t h = 2166136261u;
+	for (; *name != 0; ++name) {
+		h ^= (unsigned char)*name;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+void
+path_cache_create(struct path_cache *cache)
+{
+	cache->buckets = NULL;
+	cache->bucket_count = 0;
+	cache->entry_count = 0;
+	cache->path_env = NULL;
+	cache->hit_count = 0;
+	cache->miss_count = 0;
+}
+
+void
+path_cache_clear(struct path_cache *cache)
+{
+	for (uint32_t i = 0; i < cache->bucket_count; ++i) {
+		struct path_entry *e = cache->buckets[i];
+		while (e != NULL) {
+			struct path_entry *next = e->next;
+			free(e->name);
+			free(e->path);
+			free(e);
+			e = next;
+		}
+		cache->buckets[i] = NULL;
+	}
+	cache->entry_count = 0;
+}
+
+void
+path_cache_destroy(struct path_cache *cache)
+{
+	path_cache_clear(cache);
+	free(cache->buckets);
+	free(cache->path_env);
+}
+
+static void
+path_cache_grow(struct path_cache *cache)
+{
+	uint32_t new_count = cache->bucket_count * 2;
+	if (new_count < PATH_CACHE_MIN_BUCKET_COUNT)
+		new_count = PATH_CACHE_MIN_BUCKET_COUNT;
+	struct path_entry **buckets = calloc(new_count, sizeof(buckets[0]));
+	for (uint32_t i = 0; i < cache->bucket_count; ++i) {
+		struct path_entry *e = cache->buckets[i];
+		while (e != NULL) {
+			struct path_entry *next = e->next;
+			struct path_entry **b = &buckets[e->hash & (new_count - 1)];
+			e->next = *b;
+			*b = e;
+			e = next;
+		}
+	}
+	free(cache->buckets);
+	cache->buckets = buckets;
+	cache->bucket_count = new_count;
+}
+
+/** Find an executable regular file with the name in $PATH. */
+static char *
+path_cache_resolve(const char *path_env, const char *name)
+{
+	size_t name_len = strlen(name);
+	const char *dir = path_env;
+	while (true) {
+		const char *dir_end = strchr(dir, ':');
+		if (dir_end == NULL)
+			dir_end = dir + strlen(dir);
+		size_t dir_len = dir_end - dir;
+		/* Empty entry means the current directory. */
+		if (dir_len == 0) {
+			dir = ".";
+			dir_len = 1;
+		}
+		char *path = malloc(dir_len + name_len + 2);
+		memcpy(path, dir, dir_len);
+		path[dir_len] = '/';
+		memcpy(path + dir_len + 1, name, name_len + 1);
+		struct stat st;
+		if (stat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+		    access(path, X_OK) == 0)
+			return path;
+		free(path);
+		if (*dir_end == 0)
+			return NULL;
+		dir = dir_end + 1;
+	}
+}
+
+const char *
+path_cache_find(struct path_cache *cache, const char *name)
+{
+	const char *path_env = getenv("PATH");
+	if (path_env == NULL)
+		path_env = "/usr/local/bin:/usr/bin:/bin";
+	if (cache->path_env == NULL || strcmp(cache->path_env, path_env) != 0) {
+		path_cache_clear(cache);
+		free(cache->path_env);
+		cache->path_env = strdup(path_env);
+	}
+	uint32_t hash = path_cache_hash(name);
+	if (cache->bucket_count > 0) {
+		struct path_entry *e =
+			cache->buckets[hash & (cache->bucket_count - 1)];
+		for (; e != NULL; e = e->next) {
+			if (e->hash == hash && strcmp(e->name, name) == 0) {
+				++e->hit_count;
+				++cache->hit_count;
+				return e->path;
+			}
+		}
+	}
+	++cache->miss_count;
+	char *path = path_cache_resolve(cache->path_env, name);
+	if (path == NULL)
+		return NULL;
+	if (cache->entry_count >= cache->bucket_count)
+		path_cache_grow(cache);
+	struct path_entry *e = malloc(sizeof(*e));
+	e->hash = hash;
+	e->hit_count = 1;
+	e->name = strdup(name);
+	e->path = path;
+	struct path_entry **b = &cache->buckets[hash & (cache->bucket_count - 1)];
+	e->next = *b;
+	*b = e;
+	++cache->entry_count;
+	return path;
+}
+
+void
+path_cache_forget(struct path_cache *cache, const char *name)
+{
+	if (cache->bucket_count == 0)
+		return;
+	uint32_t hash = path_cache_hash(name);
+	struct path_entry **pe = &cache->buckets[hash & (cache->bucket_count - 1)];
+	for (; *pe != NULL; pe = &(*pe)->next) {
+		struct path_entry *e = *pe;
+		if (e->hash != hash || strcmp(e->name, name) != 0)
+			continue;
+		*pe = e->next;
+		free(e->name);
+		free(e->path);
+		free(e);
+		--cache->entry_count;
+		return;
+	}
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Cache of command name -> absolute path resolved by $PATH, like
+ * the Bash 'hash' table. Without it each exec of a bare name walks
+ * all the $PATH directories with a failed syscall per each. The
+ * cache is dropped when $PATH changes.
+ */
+
+struct path_entry {
+	struct path_entry *next;
+	uint32_t hash;
+	/** How many times the entry was used. */
+	uint64_t hit_count;
+	char *name;
+	char *path;
+};
+
+struct path_cache {
+	struct path_entry **buckets;
+	uint32_t bucket_count;
+	uint32_t entry_count;
+	/** $PATH with which the entries were resolved. */
+	char *path_env;
+	uint64_t hit_count;
+	uint64_t miss_count;
+};
+
+void
+path_cache_create(struct path_cache *cache);
+
+void
+path_cache_destroy(struct path_cache *cache);
+
+/**
+ * Find the name in the cache or in $PATH. Returns NULL if it is not
+ * found. The result is valid till the next change of the cache.
+ */
+const char *
+path_cache_find(struct path_cache *cache, const char *name);
+
+/** Drop the name, for example when its file is gone. */
+void
+path_cache_forget(struct path_cache *cache, const char *name);
+
+/** Drop all the names, like 'hash -r'. */
+void
+path_cache_clear(struct path_cache *cache);
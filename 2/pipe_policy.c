@@ -0,0 +1,162 @@
+#define _GNU_SOURCE
+#include "pipe_policy.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+
+/**
+ * Commands which read or write their data as fast as they can, with
+ * no interaction. Compared by the base name.
+ */
+static const char *const pipe_policy_streamers[] = {
+	"base64", "bunzip2", "bzip2", "cat", "cksum", "cut", "dd", "gunzip",
+	"gzip", "head", "lz4", "md5sum", "openssl", "pigz", "pv",
+	"sha1sum", "sha256sum", "sort", "tail", "tar", "tee", "tr", "uniq",
+	"unxz", "unzstd", "wc", "xz", "xzcat", "zcat", "zstd", "zstdcat",
+};
+
+static bool
+pipe_policy_is_streamer(const char *name)
+{
+	const char *base = strrchr(name, '/');
+	base = base != NULL ? base + 1 : name;
+	size_t count = sizeof(pipe_policy_streamers) /
+		sizeof(pipe_policy_streamers[0]);
+	for (size_t i = 0; i < count; ++i) {
+		if (strcmp(pipe_policy_streamers[i], base) == 0)
+			return true;
+	}
+	return false;
+}
+
+/** Parse a size like 65536, 256K or 4M. Returns -1 if bad. */
+static long
+pipe_policy_parse_size(const char *value)
+{
+	char *end;
+	errno = 0;
+	long size = strtol(value, &end, 10);
+	if (errno != 0 || end == value || size < 0)
+		return -1;
+	if (*end == 'K' || *end == 'k') {
+		size <<= 10;
+		++end;
+	} else if (*end == 'M' || *end == 'm') {
+		size <<= 20;
+		++end;
+	}
+	if (*end != 0 || size > (1 << 30))
+		return -1;
+	return size;
+}
+
+void
+pipe_policy_create(struct pipe_policy *policy, const char *value)
+{
+	memset(policy, 0, sizeof(*policy));
+	policy->mode = PIPE_POLICY_AUTO;
+	policy->size = PIPE_POLICY_AUTO_SIZE;
+	if (value == NULL || strcmp(value, "auto") == 0)
+		return;
+	if (strcmp(value, "off") == 0) {
+		policy->mode = PIPE_POLICY_OFF;
+		return;
+	}
+	long size = pipe_policy_parse_size(value);
+	if (size < 0) {
+		fprintf(stderr, "SHELL_PIPE_SIZE: bad value '%s'\n", value);
+		return;
+	}
+	if (size == 0) {
+		policy->mode = PIPE_POLICY_OFF;
+		return;
+	}
+	policy->mode = PIPE_POLICY_ALL;
+	policy->size = size;
+}
+
+/** The limit of F_SETPIPE_SZ without CAP_SYS_RESOURCE. */
+static int
+pipe_policy_max_size(void)
+{
+	FILE *f = fopen("/proc/sys/fs/pipe-max-size", "r");
+	if (f == NULL)
+		return -1;
+	int size = -1;
+	if (fscanf(f, "%d", &size) != 1)
+		size = -1;
+	fclose(f);
+	return size;
+}
+
+void
+pipe_policy_apply(struct pipe_policy *policy, int fd, const char *writer,
+		  const char *reader)
+{
+	++policy->stats.pipe_count;
+	if (policy->mode == PIPE_POLICY_OFF)
+		return;
+	if (policy->mode == PIPE_POLICY_AUTO &&
+	    (!pipe_policy_is_streamer(writer) ||
+	     !pipe_policy_is_streamer(reader)))
+		return;
+#ifdef F_SETPIPE_SZ
+	if (fcntl(fd, F_SETPIPE_SZ, policy->size) >= 0) {
+		++policy->stats.resize_count;
+		return;
+	}
+	/* Cap the size once, and keep it for the next pipes. */
+	int max_size;
+	if (errno == EPERM && (max_size = pipe_policy_max_size()) > 0 &&
+	    max_size < policy->size) {
+		policy->size = max_size;
+		if (fcntl(fd, F_SETPIPE_SZ, policy->size) >= 0) {
+			++policy->stats.resize_count;
+			return;
+		}
+	}
+	++policy->stats.resize_fail_count;
+#else
+	(void)fd;
+	++policy->stats.resize_fail_count;
+#endif
+}
+
+void
+pipe_policy_account_write(struct pipe_policy *policy, int fd)
+{
+	if (!policy->is_stats)
+		return;
+#if defined(F_GETPIPE_SZ) && defined(FIONREAD)
+	int size = fcntl(fd, F_GETPIPE_SZ);
+	if (size < 0)
+		return;
+	int used;
+	if (ioctl(fd, FIONREAD, &used) != 0)
+		return;
+	++policy->stats.write_count;
+	if (used >= size)
+		++policy->stats.write_block_count;
+#else
+	(void)fd;
+#endif
+}
+
+void
+pipe_policy_print(const struct pipe_policy *policy, FILE *out)
+{
+	static const char *const mode_names[] = {"off", "auto", "all"};
+	const struct pipe_policy_stats *s = &policy->stats;
+	fprintf(out, "pipes: %s %d bytes, %llu created, %llu raised, "
+		"%llu failed, shell writes %llu, full %llu\n",
+		mode_names[policy->mode], policy->size,
+		(unsigned long long)s->pipe_count,
+		(unsigned long long)s->resize_count,
+		(unsigned long long)s->resize_fail_count,
+		(unsigned long long)s->write_count,
+		(unsigned long long)s->write_block_count);
+	fflush(out);
+}
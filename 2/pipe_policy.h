@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Sizes of the pipes of the pipelines. A pipe has 64KB by default, so
+ * a writer which streams faster than the reader off-CPU blocks each
+ * 64KB, and the stages context-switch constantly. A bigger pipe lets
+ * them run through the whole time slices.
+ *
+ * $SHELL_PIPE_SIZE sets the policy:
+ * - unset or "auto" raises the pipes between two stages which are
+ *   known to stream a lot of data, like cat, gzip or dd;
+ * - a size, with an optional K or M suffix, raises all the pipes;
+ * - "0" or "off" keeps the kernel default.
+ * The size is capped by /proc/sys/fs/pipe-max-size for the
+ * unprivileged users.
+ */
+
+enum pipe_policy_mode {
+	PIPE_POLICY_OFF,
+	PIPE_POLICY_AUTO,
+	PIPE_POLICY_ALL,
+};
+
+enum {
+	/** Size of the raised pipes in the auto mode. */
+	PIPE_POLICY_AUTO_SIZE = 1 << 20,
+};
+
+struct pipe_policy_stats {
+	/** Pipes between the commands of the pipelines. */
+	uint64_t pipe_count;
+	/** Of them raised to the bigger size. */
+	uint64_t resize_count;
+	/** F_SETPIPE_SZ fails even with the capped size. */
+	uint64_t resize_fail_count;
+	/**
+	 * Writes of the shell's own built-ins into the pipes, and how
+	 * many of them found the pipe full, and so blocked. The
+	 * children's blocks are seen only as their voluntary context
+	 * switches.
+	 */
+	uint64_t write_count;
+	uint64_t write_block_count;
+};
+
+struct pipe_policy {
+	enum pipe_policy_mode mode;
+	/** Size to set, in bytes. */
+	int size;
+	/** Count the shell's blocked writes, it costs 2 syscalls each. */
+	bool is_stats;
+	struct pipe_policy_stats stats;
+};
+
+/**
+ * Parse the policy from the value of $SHELL_PIPE_SIZE, NULL if it is
+ * not set. A bad value is reported and means the auto mode.
+ */
+void
+pipe_policy_create(struct pipe_policy *policy, const char *value);
+
+/**
+ * Apply the policy to a new pipe from @a writer to @a reader, the
+ * command names.
+ */
+void
+pipe_policy_apply(struct pipe_policy *policy, int fd, const char *writer,
+		  const char *reader);
+
+/**
+ * Check if the pipe of @a fd is full before a write into it. Counts
+ * the write and the block, if the stats are on.
+ */
+void
+pipe_policy_account_write(struct pipe_policy *policy, int fd);
+
+void
+pipe_policy_print(const struct pipe_policy *policy, FILE *out);
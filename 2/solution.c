@@ -1,71 +1,1542 @@
+#define _GNU_SOURCE
+#include "cmd_stats.h"
+#include "fork_server.h"
+#include "job_table.h"
+#include "launch_pool.h"
 #include "parser.h"
+#include "path_cache.h"
+#include "pipe_policy.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
+#endif
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+/**
+ * Commands are launched with posix_spawn(). Unlike fork() it doesn't
+ * copy the page tables of the shell, which gets slow when the heap
+ * is big. Fork is used only when something must be done in the child
+ * besides the exec: a built-in in a subshell, an open of an output
+ * which can block like a FIFO, or a background line with && and ||.
+ * Define SHELL_USE_FORK to always fork, for comparison. With
+ * $SHELL_FORK_SERVER the foreground commands are launched by the
+ * children pre-forked by a fork server, see fork_server.h.
+ */
+
+extern char **environ;
+
+struct shell {
+	/** Status of the last pipeline, like $? in Bash. */
+	int last_status;
+	/** 'exit' was called in the shell process itself. */
+	bool is_exit;
+	/** Only parse the commands, like 'sh -n'. */
+	bool is_noexec;
+	/** Resolved paths of the commands. */
+	struct path_cache paths;
+	/** Background jobs, not reaped yet. */
+	struct job_table jobs;
+	/**
+	 * Signalfd of SIGCHLD, or -1 if not supported. Then the jobs
+	 * are checked before each line.
+	 */
+	int child_fd;
+	/** Signal mask of the children, SIGCHLD is blocked in the shell. */
+	sigset_t child_sigmask;
+	/** Helpers to launch background lines, created on demand. */
+	struct launch_pool *launcher;
+	/** Number of the helpers, 0 if the shell has only one CPU. */
+	int launcher_thread_count;
+	/**
+	 * $SHELL_RUSAGE. With 1 the resource usage of the foreground
+	 * commands is printed per command name at exit, with 2 also
+	 * after each pipeline. 0 means no accounting.
+	 */
+	int rusage_level;
+	/** Usage of the finished commands by name. */
+	struct cmd_stats cmd_stats;
+	/** Sizes of the pipes, $SHELL_PIPE_SIZE. */
+	struct pipe_policy pipes;
+	/** Launcher of the foreground commands, or NULL. */
+	struct fork_server *forks;
+};
+
 static void
-execute_command_line(const struct command_line *line)
+shell_create(struct shell *sh)
 {
-	/* REPLACE THIS CODE WITH ACTUAL COMMAND EXECUTION */
+	sh->last_status = 0;
+	sh->is_exit = false;
+	sh->is_noexec = false;
+	path_cache_create(&sh->paths);
+	job_table_create(&sh->jobs);
+	sh->launcher = NULL;
+#ifdef SHELL_LAUNCH_THREAD_COUNT
+	sh->launcher_thread_count = SHELL_LAUNCH_THREAD_COUNT;
+#else
+	long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+	sh->launcher_thread_count = cpu_count > 8 ? 7 :
+		(cpu_count > 1 ? cpu_count - 1 : 0);
+#endif
+	const char *rusage = getenv("SHELL_RUSAGE");
+	sh->rusage_level = rusage != NULL ? atoi(rusage) : 0;
+	cmd_stats_create(&sh->cmd_stats);
+	pipe_policy_create(&sh->pipes, getenv("SHELL_PIPE_SIZE"));
+	sh->pipes.is_stats = sh->rusage_level > 0;
+	sh->child_fd = -1;
+	sigprocmask(SIG_SETMASK, NULL, &sh->child_sigmask);
+#ifdef __linux__
+	sigset_t sigs;
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &sigs, NULL);
+	sh->child_fd = signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (sh->child_fd < 0)
+		sigprocmask(SIG_SETMASK, &sh->child_sigmask, NULL);
+#endif
+	sh->forks = NULL;
+#ifndef SHELL_USE_FORK
+	/* Now, while the heap is small. */
+	const char *forks = getenv("SHELL_FORK_SERVER");
+	if (forks != NULL && atoi(forks) > 0)
+		sh->forks = fork_server_new(atoi(forks), &sh->child_sigmask);
+#endif
+}
 
-	assert(line != NULL);
-	printf("================================\n");
-	printf("Command line:\n");
-	printf("Is background: %d\n", (int)line->is_background);
-	printf("Output: ");
-	if (line->out_type == OUTPUT_TYPE_STDOUT) {
-		printf("stdout\n");
-	} else if (line->out_type == OUTPUT_TYPE_FILE_NEW) {
-		printf("new file - \"%s\"\n", line->out_file);
-	} else if (line->out_type == OUTPUT_TYPE_FILE_APPEND) {
-		printf("append file - \"%s\"\n", line->out_file);
-	} else {
-		assert(false);
+static void
+shell_destroy(struct shell *sh)
+{
+	if (sh->launcher != NULL)
+		launch_pool_delete(sh->launcher);
+	if (sh->forks != NULL)
+		fork_server_delete(sh->forks);
+	if (sh->child_fd >= 0)
+		close(sh->child_fd);
+	job_table_destroy(&sh->jobs);
+	path_cache_destroy(&sh->paths);
+	if (sh->rusage_level > 0) {
+		cmd_stats_print(&sh->cmd_stats, stderr);
+		pipe_policy_print(&sh->pipes, stderr);
+	}
+	cmd_stats_destroy(&sh->cmd_stats);
+}
+
+static uint64_t
+clock_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t
+timeval_us(const struct timeval *tv)
+{
+	return (uint64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+/** Like the 'time' of Bash, to stderr. */
+static void
+print_times(uint64_t real_us, uint64_t user_us, uint64_t sys_us)
+{
+	const char *names[] = {"real", "user", "sys"};
+	uint64_t times[] = {real_us, user_us, sys_us};
+	for (int i = 0; i < 3; ++i) {
+		uint64_t ms = (times[i] + 500) / 1000;
+		fprintf(stderr, "%s\t%llum%llu.%03llus\n", names[i],
+			(unsigned long long)(ms / 60000),
+			(unsigned long long)(ms / 1000 % 60),
+			(unsigned long long)(ms % 1000));
+	}
+}
+
+/** Write all the data, a pipe can take it in pieces. */
+static int
+write_all(int fd, const char *data, size_t size)
+{
+	while (size > 0) {
+		ssize_t rc = write(fd, data, size);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		data += rc;
+		size -= rc;
+	}
+	return 0;
+}
+
+/**
+ * Built-ins run without a fork and exec when possible. They read
+ * @a in_fd and write right into @a out_fd, not via stdio, so the
+ * output is never buffered in the shell. Return the exit status.
+ */
+typedef int (*builtin_f)(struct shell *sh, const struct command *cmd,
+			 int in_fd, int out_fd);
+
+struct builtin {
+	const char *name;
+	builtin_f func;
+	/**
+	 * Optional check if the built-in supports the arguments.
+	 * Otherwise the command is executed from $PATH.
+	 */
+	bool (*is_supported)(const struct command *cmd);
+	/**
+	 * Changes the shell itself. Then in a pipeline of several
+	 * commands it runs in a subshell, like in Bash, so as not to
+	 * touch the shell.
+	 */
+	bool is_shell_state;
+};
+
+static int
+builtin_true(struct shell *sh, const struct command *cmd, int in_fd,
+	     int out_fd)
+{
+	(void)in_fd;
+	(void)sh;
+	(void)cmd;
+	(void)out_fd;
+	return 0;
+}
+
+static int
+builtin_false(struct shell *sh, const struct command *cmd, int in_fd,
+	      int out_fd)
+{
+	(void)in_fd;
+	(void)sh;
+	(void)cmd;
+	(void)out_fd;
+	return 1;
+}
+
+/** Append the char with the escape at @a pos, like Bash 'echo -e'. */
+static const char *
+echo_unescape(const char *pos, char *out, size_t *size, bool *is_stop)
+{
+	assert(*pos == '\\');
+	char c = *++pos;
+	int base = 0;
+	int max_digits = 0;
+	switch (c) {
+	case 'a': c = '\a'; break;
+	case 'b': c = '\b'; break;
+	case 'e': case 'E': c = '\033'; break;
+	case 'f': c = '\f'; break;
+	case 'n': c = '\n'; break;
+	case 'r': c = '\r'; break;
+	case 't': c = '\t'; break;
+	case 'v': c = '\v'; break;
+	case '\\': break;
+	case 'c':
+		*is_stop = true;
+		return pos + 1;
+	case '0':
+		base = 8;
+		max_digits = 3;
+		break;
+	case 'x':
+		base = 16;
+		max_digits = 2;
+		break;
+	default:
+		/* Not an escape, printed as is. */
+		out[(*size)++] = '\\';
+		return pos;
+	}
+	if (base == 0) {
+		out[(*size)++] = c;
+		return pos + 1;
+	}
+	++pos;
+	int value = 0;
+	int digits = 0;
+	for (; digits < max_digits; ++digits, ++pos) {
+		int d;
+		if (*pos >= '0' && *pos <= '7')
+			d = *pos - '0';
+		else if (base == 16 && *pos >= '8' && *pos <= '9')
+			d = *pos - '0';
+		else if (base == 16 && *pos >= 'a' && *pos <= 'f')
+			d = *pos - 'a' + 10;
+		else if (base == 16 && *pos >= 'A' && *pos <= 'F')
+			d = *pos - 'A' + 10;
+		else
+			break;
+		value = value * base + d;
+	}
+	if (base == 16 && digits == 0) {
+		out[(*size)++] = '\\';
+		out[(*size)++] = 'x';
+		return pos;
+	}
+	out[(*size)++] = (char)value;
+	return pos;
+}
+
+/** Bash 'echo' with -n, -e and -E. */
+static int
+builtin_echo(struct shell *sh, const struct command *cmd, int in_fd,
+	     int out_fd)
+{
+	(void)in_fd;
+	(void)sh;
+	bool is_newline = true;
+	bool is_escape = false;
+	uint32_t i = 0;
+	for (; i < cmd->arg_count; ++i) {
+		const char *arg = cmd->args[i];
+		if (arg[0] != '-' || arg[1] == 0 ||
+		    arg[strspn(arg + 1, "neE") + 1] != 0)
+			break;
+		for (++arg; *arg != 0; ++arg) {
+			if (*arg == 'n')
+				is_newline = false;
+			else
+				is_escape = *arg == 'e';
+		}
+	}
+	size_t capacity = 1;
+	for (uint32_t j = i; j < cmd->arg_count; ++j)
+		capacity += strlen(cmd->args[j]) + 1;
+	char *buf = malloc(capacity);
+	size_t size = 0;
+	bool is_stop = false;
+	for (uint32_t j = i; j < cmd->arg_count && !is_stop; ++j) {
+		if (j > i)
+			buf[size++] = ' ';
+		const char *pos = cmd->args[j];
+		if (!is_escape) {
+			size_t len = strlen(pos);
+			memcpy(buf + size, pos, len);
+			size += len;
+			continue;
+		}
+		while (*pos != 0 && !is_stop) {
+			if (*pos == '\\')
+				pos = echo_unescape(pos, buf, &size, &is_stop);
+			else
+				buf[size++] = *pos++;
+		}
+	}
+	if (is_newline && !is_stop)
+		buf[size++] = '\n';
+	int rc = write_all(out_fd, buf, size);
+	free(buf);
+	if (rc != 0) {
+		/* The shell ignores SIGPIPE, a subshell would die of it. */
+		if (errno == EPIPE)
+			return 128 + SIGPIPE;
+		fprintf(stderr, "echo: write error: %s\n", strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+static int
+builtin_cd(struct shell *sh, const struct command *cmd, int in_fd,
+	   int out_fd)
+{
+	(void)in_fd;
+	(void)sh;
+	(void)out_fd;
+	const char *dir = cmd->arg_count > 0 ? cmd->args[0] : getenv("HOME");
+	if (dir == NULL) {
+		fprintf(stderr, "cd: HOME not set\n");
+		return 1;
+	}
+	if (chdir(dir) != 0) {
+		fprintf(stderr, "cd: %s: %s\n", dir, strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+static int
+builtin_exit(struct shell *sh, const struct command *cmd, int in_fd,
+	     int out_fd)
+{
+	(void)in_fd;
+	(void)out_fd;
+	sh->is_exit = true;
+	if (cmd->arg_count == 0)
+		return sh->last_status;
+	return (int)(strtol(cmd->args[0], NULL, 10) & 0xff);
+}
+
+/**
+ * Bash 'hash'. Without arguments prints the cached paths with their
+ * hit counts, with -r drops them, and looks up and caches the given
+ * names. -s is an extension, prints the cache hit and miss counters.
+ */
+static int
+builtin_hash(struct shell *sh, const struct command *cmd, int in_fd,
+	     int out_fd)
+{
+	(void)in_fd;
+	struct path_cache *cache = &sh->paths;
+	int rc = 0;
+	bool is_print = true;
+	for (uint32_t i = 0; i < cmd->arg_count; ++i) {
+		const char *arg = cmd->args[i];
+		is_print = false;
+		if (strcmp(arg, "-r") == 0) {
+			path_cache_clear(cache);
+		} else if (strcmp(arg, "-s") == 0) {
+			dprintf(out_fd, "hits %llu, misses %llu, entries %u\n",
+				(unsigned long long)cache->hit_count,
+				(unsigned long long)cache->miss_count,
+				cache->entry_count);
+		} else if (path_cache_find(cache, arg) == NULL) {
+			fprintf(stderr, "hash: %s: not found\n", arg);
+			rc = 1;
+		}
+	}
+	if (!is_print)
+		return rc;
+	if (cache->entry_count == 0) {
+		dprintf(out_fd, "hash: hash table empty\n");
+		return 0;
+	}
+	dprintf(out_fd, "hits\tcommand\n");
+	for (uint32_t i = 0; i < cache->bucket_count; ++i) {
+		const struct path_entry *e = cache->buckets[i];
+		for (; e != NULL; e = e->next) {
+			dprintf(out_fd, "%4llu\t%s\n",
+				(unsigned long long)e->hit_count, e->path);
+		}
+	}
+	return 0;
+}
+
+/** Only files, no options. */
+static bool
+builtin_cat_is_supported(const struct command *cmd)
+{
+	for (uint32_t i = 0; i < cmd->arg_count; ++i) {
+		const char *arg = cmd->args[i];
+		if (arg[0] == '-' && arg[1] != 0)
+			return false;
+	}
+	return true;
+}
+
+/**
+ * Copy all of @a in_fd into @a out_fd. The data goes through the
+ * kernel only, when can: splice() if one of the descriptors is a
+ * pipe, sendfile() from a regular file. Otherwise it is read and
+ * written. Returns 0 or -1 with errno and @a is_read_error set.
+ * The writes into a pipe are accounted in @a pipes.
+ */
+static int
+cat_copy(struct pipe_policy *pipes, int in_fd, int out_fd,
+	 bool *is_read_error)
+{
+	*is_read_error = false;
+#ifdef __linux__
+	const size_t chunk = 1 << 20;
+	bool is_splice = true;
+	bool is_sendfile = true;
+	while (is_splice) {
+		pipe_policy_account_write(pipes, out_fd);
+		ssize_t rc = splice(in_fd, NULL, out_fd, NULL, chunk,
+				    SPLICE_F_MOVE);
+		if (rc == 0)
+			return 0;
+		if (rc > 0) {
+			/* Sendfile is only needed if splice fails. */
+			is_sendfile = false;
+			continue;
+		}
+		if (errno == EINTR)
+			continue;
+		if (errno != EINVAL)
+			return -1;
+		is_splice = false;
+	}
+	while (is_sendfile) {
+		pipe_policy_account_write(pipes, out_fd);
+		ssize_t rc = sendfile(out_fd, in_fd, NULL, chunk);
+		if (rc == 0)
+			return 0;
+		if (rc > 0)
+			continue;
+		if (errno == EINTR)
+			continue;
+		if (errno != EINVAL && errno != ENOSYS)
+			return -1;
+		is_sendfile = false;
+	}
+#endif
+	char buf[64 * 1024];
+	while (true) {
+		ssize_t rc = read(in_fd, buf, sizeof(buf));
+		if (rc == 0)
+			return 0;
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			*is_read_error = true;
+			return -1;
+		}
+		pipe_policy_account_write(pipes, out_fd);
+		if (write_all(out_fd, buf, rc) != 0)
+			return -1;
+	}
+}
+
+/** 'cat' of files or stdin. */
+static int
+builtin_cat(struct shell *sh, const struct command *cmd, int in_fd,
+	    int out_fd)
+{
+	int rc = 0;
+	uint32_t count = cmd->arg_count > 0 ? cmd->arg_count : 1;
+	for (uint32_t i = 0; i < count; ++i) {
+		const char *name = cmd->arg_count > 0 ? cmd->args[i] : "-";
+		int fd = in_fd;
+		if (strcmp(name, "-") != 0) {
+			fd = open(name, O_RDONLY | O_CLOEXEC);
+			if (fd < 0) {
+				fprintf(stderr, "cat: %s: %s\n", name,
+					strerror(errno));
+				rc = 1;
+				continue;
+			}
+		}
+		bool is_read_error;
+		int copy_rc = cat_copy(&sh->pipes, fd, out_fd,
+					   &is_read_error);
+		int err = errno;
+		if (fd != in_fd)
+			close(fd);
+		if (copy_rc == 0)
+			continue;
+		if (!is_read_error && err == EPIPE)
+			return 128 + SIGPIPE;
+		if (is_read_error || err == EISDIR)
+			fprintf(stderr, "cat: %s: %s\n", name, strerror(err));
+		else
+			fprintf(stderr, "cat: write error: %s\n", strerror(err));
+		rc = 1;
+	}
+	return rc;
+}
+
+/**
+ * 'time' with a pipeline is done by the executor. Alone it times
+ * nothing, and with arguments outside of it, like in a background
+ * line, it is the one from $PATH.
+ */
+static bool
+builtin_time_is_supported(const struct command *cmd)
+{
+	return cmd->arg_count == 0;
+}
+
+static int
+builtin_time(struct shell *sh, const struct command *cmd, int in_fd,
+	     int out_fd)
+{
+	(void)sh;
+	(void)cmd;
+	(void)in_fd;
+	(void)out_fd;
+	print_times(0, 0, 0);
+	return 0;
+}
+
+/** Only 'wait' for all the jobs, there are no $! to wait for a pid. */
+static bool
+builtin_wait_is_supported(const struct command *cmd)
+{
+	return cmd->arg_count == 0;
+}
+
+static int
+builtin_wait(struct shell *sh, const struct command *cmd, int in_fd,
+	     int out_fd)
+{
+	(void)cmd;
+	(void)in_fd;
+	(void)out_fd;
+	/* Runs alone, so all the children are jobs. */
+	while (!job_table_is_empty(&sh->jobs)) {
+		pid_t pid = waitpid(-1, NULL, 0);
+		if (pid < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		job_table_reap(&sh->jobs, pid);
+	}
+	return 0;
+}
+
+static const struct builtin builtins[] = {
+	{":", builtin_true, NULL, false},
+	{"true", builtin_true, NULL, false},
+	{"false", builtin_false, NULL, false},
+	{"echo", builtin_echo, NULL, false},
+	{"cat", builtin_cat, builtin_cat_is_supported, false},
+	{"cd", builtin_cd, NULL, true},
+	{"exit", builtin_exit, NULL, true},
+	{"hash", builtin_hash, NULL, true},
+	{"wait", builtin_wait, builtin_wait_is_supported, true},
+	{"time", builtin_time, builtin_time_is_supported, false},
+};
+
+static const struct builtin *
+builtin_find(const struct command *cmd)
+{
+	for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); ++i) {
+		const struct builtin *b = &builtins[i];
+		if (strcmp(b->name, cmd->exe) != 0)
+			continue;
+		if (b->is_supported != NULL && !b->is_supported(cmd))
+			return NULL;
+		return b;
+	}
+	return NULL;
+}
+
+static char **
+command_argv_new(const struct command *cmd)
+{
+	char **argv = malloc(sizeof(argv[0]) * (cmd->arg_count + 2));
+	argv[0] = cmd->exe;
+	/* The args are NULL if none, and memcpy() must not get NULL. */
+	if (cmd->arg_count > 0)
+		memcpy(argv + 1, cmd->args, sizeof(argv[0]) * cmd->arg_count);
+	argv[cmd->arg_count + 1] = NULL;
+	return argv;
+}
+
+static void
+command_not_found(const struct command *cmd, int err)
+{
+	if (err == ENOENT)
+		fprintf(stderr, "%s: command not found\n", cmd->exe);
+	else
+		fprintf(stderr, "%s: %s\n", cmd->exe, strerror(err));
+}
+
+static int
+output_open(const struct command_line *line)
+{
+	int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+	if (line->out_type == OUTPUT_TYPE_FILE_APPEND)
+		flags |= O_APPEND;
+	else
+		flags |= O_TRUNC;
+	int fd = open(line->out_file, flags, 0644);
+	if (fd < 0)
+		fprintf(stderr, "%s: %s\n", line->out_file, strerror(errno));
+	return fd;
+}
+
+/**
+ * Opening a FIFO or a device for writing can block till the other
+ * side is opened. Can't do that in the shell.
+ */
+static bool
+output_is_blocking(const struct command_line *line)
+{
+	struct stat st;
+	return stat(line->out_file, &st) == 0 && !S_ISREG(st.st_mode);
+}
+
+/**
+ * All the shell's descriptors are closed on exec, so the children
+ * get only their stdin and stdout dup-ed.
+ */
+static int
+pipe_cloexec(int fds[2])
+{
+	if (pipe(fds) != 0)
+		return -1;
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	return 0;
+}
+
+/** Name of the command reading the pipe after @a e. */
+static const char *
+pipe_reader_name(const struct expr *e)
+{
+	for (e = e->next; e != NULL; e = e->next) {
+		if (e->type == EXPR_TYPE_COMMAND)
+			return e->cmd.exe;
+	}
+	return "";
+}
+
+/**
+ * Close all descriptors from @a first. A forked built-in doesn't
+ * exec, so the other pipes of the pipeline aren't closed by
+ * FD_CLOEXEC, and would keep the readers from getting EOF.
+ */
+static void
+close_from(int first)
+{
+#if defined(__linux__) && defined(SYS_close_range)
+	if (syscall(SYS_close_range, first, ~0U, 0) == 0)
+		return;
+#endif
+	long max = sysconf(_SC_OPEN_MAX);
+	if (max < 0 || max > 65536)
+		max = 65536;
+	for (int fd = first; fd < max; ++fd)
+		close(fd);
+}
+
+/**
+ * Wait for the child. Its resource usage is put into @a usage if it
+ * is not NULL, zeros if the wait failed.
+ */
+static int
+wait_status(pid_t pid, struct rusage *usage)
+{
+	int status;
+	while (wait4(pid, &status, 0, usage) < 0) {
+		if (errno == EINTR)
+			continue;
+		if (usage != NULL)
+			memset(usage, 0, sizeof(*usage));
+		return 1;
 	}
-	printf("Expressions:\n");
+	if (WIFSIGNALED(status))
+		return 128 + WTERMSIG(status);
+	return WEXITSTATUS(status);
+}
+
+/**
+ * Reap the finished background jobs, not to leave zombies. With a
+ * signalfd it is done only when some child has exited. The
+ * foreground commands are waited by their pids, so only the jobs
+ * can be found here.
+ */
+static void
+reap_background(struct shell *sh)
+{
+	if (job_table_is_empty(&sh->jobs))
+		return;
+#ifdef __linux__
+	if (sh->child_fd >= 0) {
+		/* The signals are merged, one can mean many children. */
+		struct signalfd_siginfo info[16];
+		if (read(sh->child_fd, info, sizeof(info)) <= 0)
+			return;
+		while (read(sh->child_fd, info, sizeof(info)) > 0)
+			;
+	}
+#endif
+	pid_t pid;
+	while ((pid = waitpid(-1, NULL, WNOHANG)) > 0)
+		job_table_reap(&sh->jobs, pid);
+}
+
+/**
+ * Wait for the input. Meanwhile the background jobs are reaped as
+ * they finish, not only when the next line comes.
+ */
+static void
+shell_wait_input(struct shell *sh)
+{
+	while (sh->child_fd >= 0 && !job_table_is_empty(&sh->jobs)) {
+		struct pollfd fds[2] = {
+			{STDIN_FILENO, POLLIN, 0},
+			{sh->child_fd, POLLIN, 0},
+		};
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		if (fds[1].revents != 0)
+			reap_background(sh);
+		if (fds[0].revents != 0)
+			return;
+	}
+}
+
+/** A command to launch with posix_spawn(). */
+struct spawn_cmd {
+	const struct command *cmd;
+	/** NULL if the command isn't launched. */
+	const char *path;
+	/** The path is resolved by the cache. */
+	bool is_cached;
+	char **argv;
+	/** Stdin and stdout of the command, -1 means keep. */
+	int in_fd;
+	int out_fd;
+	pid_t pid;
+	/** Result of posix_spawn(). */
+	int rc;
+};
+
+/**
+ * Spawn the command. Uses only the read-only state of the shell, so
+ * can be called in a helper thread.
+ */
+static void
+spawn_cmd_run(const struct shell *sh, struct spawn_cmd *sc)
+{
+	/* The shell ignores SIGPIPE, but the commands must not. */
+	posix_spawnattr_t attr;
+	posix_spawnattr_init(&attr);
+	sigset_t sigs;
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGPIPE);
+	posix_spawnattr_setsigdefault(&attr, &sigs);
+	posix_spawnattr_setsigmask(&attr, &sh->child_sigmask);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF |
+				 POSIX_SPAWN_SETSIGMASK);
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	if (sc->in_fd >= 0) {
+		posix_spawn_file_actions_adddup2(&actions, sc->in_fd,
+						 STDIN_FILENO);
+	}
+	if (sc->out_fd >= 0) {
+		posix_spawn_file_actions_adddup2(&actions, sc->out_fd,
+						 STDOUT_FILENO);
+	}
+	sc->rc = posix_spawn(&sc->pid, sc->path, &actions, &attr, sc->argv,
+			     environ);
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+}
+
+/**
+ * Retry the spawn if the cached file is gone, and report an error.
+ * Returns the pid or -1.
+ */
+static pid_t
+spawn_cmd_finish(struct shell *sh, struct spawn_cmd *sc)
+{
+	if (sc->rc == ENOENT && sc->is_cached) {
+		/* The file is gone, look for it again. */
+		path_cache_forget(&sh->paths, sc->cmd->exe);
+		sc->path = path_cache_find(&sh->paths, sc->cmd->exe);
+		if (sc->path != NULL)
+			spawn_cmd_run(sh, sc);
+	}
+	free(sc->argv);
+	sc->argv = NULL;
+	if (sc->rc == 0)
+		return sc->pid;
+	command_not_found(sc->cmd, sc->rc);
+	return -1;
+}
+
+/**
+ * Launch one command of a pipeline with the given descriptors as
+ * stdin and stdout, -1 means keep. If @a out_line is not NULL, its
+ * output file is opened in the child. Returns the pid or -1 and sets
+ * @a status if the command couldn't be launched.
+ */
+static pid_t
+launch_command(struct shell *sh, const struct command *cmd, int in_fd,
+	       int out_fd, const struct command_line *out_line, int *status)
+{
+	const struct builtin *builtin = builtin_find(cmd);
+	const char *path = NULL;
+	bool is_cached = false;
+	if (builtin == NULL) {
+		is_cached = strchr(cmd->exe, '/') == NULL;
+		path = is_cached ? path_cache_find(&sh->paths, cmd->exe) :
+			cmd->exe;
+		if (path == NULL) {
+			command_not_found(cmd, ENOENT);
+			*status = 127;
+			return -1;
+		}
+	}
+#ifndef SHELL_USE_FORK
+	if (builtin == NULL && out_line == NULL && sh->forks != NULL) {
+		char **argv = command_argv_new(cmd);
+		pid_t pid = fork_server_spawn(sh->forks, path, is_cached, argv,
+					      in_fd, out_fd);
+		free(argv);
+		if (pid >= 0)
+			return pid;
+	}
+	if (builtin == NULL && out_line == NULL) {
+		struct spawn_cmd sc = {cmd, path, is_cached,
+				       command_argv_new(cmd), in_fd, out_fd,
+				       -1, 0};
+		spawn_cmd_run(sh, &sc);
+		pid_t pid = spawn_cmd_finish(sh, &sc);
+		if (pid < 0)
+			*status = 127;
+		return pid;
+	}
+#endif
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid < 0) {
+		fprintf(stderr, "fork: %s\n", strerror(errno));
+		*status = 1;
+		return -1;
+	}
+	if (pid > 0)
+		return pid;
+	signal(SIGPIPE, SIG_DFL);
+	sigprocmask(SIG_SETMASK, &sh->child_sigmask, NULL);
+	if (out_line != NULL && (out_fd = output_open(out_line)) < 0)
+		_exit(1);
+	if (in_fd >= 0)
+		dup2(in_fd, STDIN_FILENO);
+	if (out_fd >= 0)
+		dup2(out_fd, STDOUT_FILENO);
+	if (builtin != NULL) {
+		close_from(STDERR_FILENO + 1);
+		_exit(builtin->func(sh, cmd, STDIN_FILENO, STDOUT_FILENO));
+	}
+	char **argv = command_argv_new(cmd);
+	execv(path, argv);
+	/* The cached file can be gone, not known to the parent. */
+	if (errno == ENOENT && is_cached)
+		execvp(cmd->exe, argv);
+	command_not_found(cmd, errno);
+	_exit(errno == ENOENT ? 127 : 126);
+}
+
+/**
+ * Run a built-in in the shell with the given stdin and stdout, -1
+ * means the shell's ones. If @a out_line is not NULL, the output
+ * goes to its file.
+ */
+static int
+execute_builtin(struct shell *sh, const struct builtin *builtin,
+		const struct command *cmd, int in_fd, int out_fd,
+		const struct command_line *out_line)
+{
+	if (in_fd < 0)
+		in_fd = STDIN_FILENO;
+	if (out_line == NULL) {
+		if (out_fd < 0)
+			out_fd = STDOUT_FILENO;
+		return builtin->func(sh, cmd, in_fd, out_fd);
+	}
+	int fd = output_open(out_line);
+	if (fd < 0)
+		return 1;
+	int rc = builtin->func(sh, cmd, in_fd, fd);
+	close(fd);
+	return rc;
+}
+
+/** A launched command of a pipeline, for $SHELL_RUSAGE. */
+struct pipeline_proc {
+	const struct command *cmd;
+	/** Time of the fork or spawn in the shell. */
+	uint64_t launch_ns;
+	struct rusage usage;
+};
+
+/**
+ * Account the reaped commands of a foreground pipeline, and print
+ * them in one line if asked.
+ */
+static void
+pipeline_account(struct shell *sh, const struct pipeline_proc *procs,
+		 const pid_t *pids, uint32_t count, uint64_t start_ns)
+{
+	bool is_print = sh->rusage_level >= 2;
+	if (is_print) {
+		fprintf(stderr, "rusage: real %.6fs",
+			(clock_ns() - start_ns) / 1e9);
+	}
+	for (uint32_t i = 0; i < count; ++i) {
+		if (pids[i] < 0)
+			continue;
+		const struct pipeline_proc *p = &procs[i];
+		cmd_stats_add(&sh->cmd_stats, p->cmd->exe, &p->usage,
+			      p->launch_ns);
+		if (!is_print)
+			continue;
+		fprintf(stderr, " | %s: user %.6fs sys %.6fs rss %ldK "
+			"csw %ld/%ld launch %.1fus", p->cmd->exe,
+			timeval_us(&p->usage.ru_utime) / 1e6,
+			timeval_us(&p->usage.ru_stime) / 1e6,
+			p->usage.ru_maxrss, p->usage.ru_nvcsw,
+			p->usage.ru_nivcsw, p->launch_ns / 1e3);
+	}
+	if (is_print)
+		fprintf(stderr, "\n");
+}
+
+/**
+ * Execute the commands in [begin, end) connected with pipes. The
+ * output of the last one goes to the file of @a out_line, if it is
+ * not NULL. Returns the status of the last command. If not
+ * @a is_wait, the commands are left running in background.
+ */
+static int
+execute_pipeline(struct shell *sh, const struct expr *begin,
+		 const struct expr *end, const struct command_line *out_line,
+		 bool is_wait)
+{
+	uint32_t count = 0;
+	const struct expr *last = NULL;
+	for (const struct expr *e = begin; e != end; e = e->next) {
+		if (e->type != EXPR_TYPE_COMMAND)
+			continue;
+		++count;
+		last = e;
+	}
+	assert(count > 0);
+	/*
+	 * One built-in of a foreground pipeline can run in the shell.
+	 * The last one is run after the other commands are launched.
+	 * Otherwise the first one is run after all the others are
+	 * launched, so its output pipe is read. The other built-ins are
+	 * forked.
+	 */
+	const struct builtin *builtin = NULL;
+	bool is_builtin_first = false;
+	if (is_wait) {
+		builtin = builtin_find(&last->cmd);
+		if (builtin != NULL && count > 1 && builtin->is_shell_state)
+			builtin = NULL;
+		if (builtin == NULL && count > 1) {
+			builtin = builtin_find(&begin->cmd);
+			if (builtin != NULL && builtin->is_shell_state)
+				builtin = NULL;
+			is_builtin_first = builtin != NULL;
+		}
+	}
+	if (builtin != NULL && count == 1) {
+		return execute_builtin(sh, builtin, &last->cmd, -1, -1,
+				       out_line);
+	}
+	pid_t *pids = malloc(sizeof(pids[0]) * count);
+	/* The background commands are reaped with no accounting. */
+	struct pipeline_proc *procs = NULL;
+	uint64_t start_ns = 0;
+	if (sh->rusage_level > 0 && is_wait) {
+		procs = malloc(sizeof(procs[0]) * count);
+		start_ns = clock_ns();
+	}
+	int status = 0;
+	int in_fd = -1;
+	/* Output of the first command, if it is run in the shell. */
+	int first_out_fd = -1;
+	uint32_t i = 0;
+	for (const struct expr *e = begin; e != end; e = e->next) {
+		if (e->type != EXPR_TYPE_COMMAND)
+			continue;
+		bool is_last = i + 1 == count;
+		if (is_last && builtin != NULL && !is_builtin_first) {
+			status = execute_builtin(sh, builtin, &e->cmd, in_fd, -1,
+						 out_line);
+			/* The writers get SIGPIPE if didn't finish. */
+			close(in_fd);
+			in_fd = -1;
+			pids[i++] = -1;
+			break;
+		}
+		int out_fd = -1;
+		int next_in_fd = -1;
+		const struct command_line *child_out_line = NULL;
+		if (!is_last) {
+			int fds[2];
+			if (pipe_cloexec(fds) != 0) {
+				fprintf(stderr, "pipe: %s\n", strerror(errno));
+				status = 1;
+				pids[i++] = -1;
+				break;
+			}
+			pipe_policy_apply(&sh->pipes, fds[1], e->cmd.exe,
+					  pipe_reader_name(e));
+			next_in_fd = fds[0];
+			out_fd = fds[1];
+		} else if (out_line != NULL) {
+			if (output_is_blocking(out_line))
+				child_out_line = out_line;
+			else if ((out_fd = output_open(out_line)) < 0)
+				status = 1;
+		}
+		if (i == 0 && is_builtin_first) {
+			first_out_fd = out_fd;
+			out_fd = -1;
+			pids[i] = -1;
+		} else if (is_last && out_line != NULL &&
+			   child_out_line == NULL && out_fd < 0) {
+			pids[i] = -1;
+		} else if (procs == NULL) {
+			pids[i] = launch_command(sh, &e->cmd, in_fd, out_fd,
+						 child_out_line, &status);
+		} else {
+			uint64_t launch_start_ns = clock_ns();
+			pids[i] = launch_command(sh, &e->cmd, in_fd, out_fd,
+						 child_out_line, &status);
+			procs[i].cmd = &e->cmd;
+			procs[i].launch_ns = clock_ns() - launch_start_ns;
+		}
+		if (in_fd >= 0)
+			close(in_fd);
+		if (out_fd >= 0)
+			close(out_fd);
+		in_fd = next_in_fd;
+		++i;
+	}
+	if (in_fd >= 0)
+		close(in_fd);
+	if (first_out_fd >= 0) {
+		execute_builtin(sh, builtin, &begin->cmd, -1, first_out_fd,
+				NULL);
+		close(first_out_fd);
+	}
+	if (!is_wait)
+		job_table_add(&sh->jobs, pids, i);
+	for (uint32_t j = 0; j < i && is_wait; ++j) {
+		if (pids[j] < 0)
+			continue;
+		int rc = wait_status(pids[j], procs != NULL ?
+				     &procs[j].usage : NULL);
+		if (j + 1 == count)
+			status = rc;
+	}
+	if (procs != NULL) {
+		pipeline_account(sh, procs, pids, i, start_ns);
+		free(procs);
+	}
+	free(pids);
+	return status;
+}
+
+/**
+ * Bash 'time' before a pipeline. When it ends, its real time and
+ * the CPU time of the shell and of the reaped children are printed.
+ */
+static int
+execute_timed_pipeline(struct shell *sh, const struct expr *begin,
+		       const struct expr *end,
+		       const struct command_line *out_line)
+{
+	const struct command *time_cmd = &begin->cmd;
+	assert(time_cmd->arg_count > 0);
+	/* The first command without the 'time' word. */
+	struct expr first = *begin;
+	first.cmd.exe = time_cmd->args[0];
+	first.cmd.args = time_cmd->args + 1;
+	first.cmd.arg_count = time_cmd->arg_count - 1;
+	first.cmd.arg_capacity = first.cmd.arg_count;
+	struct rusage self_start, children_start, self_end, children_end;
+	getrusage(RUSAGE_SELF, &self_start);
+	getrusage(RUSAGE_CHILDREN, &children_start);
+	uint64_t start_ns = clock_ns();
+	int status = execute_pipeline(sh, &first, end, out_line, true);
+	uint64_t real_us = (clock_ns() - start_ns) / 1000;
+	getrusage(RUSAGE_SELF, &self_end);
+	getrusage(RUSAGE_CHILDREN, &children_end);
+	uint64_t user_us = timeval_us(&self_end.ru_utime) -
+		timeval_us(&self_start.ru_utime) +
+		timeval_us(&children_end.ru_utime) -
+		timeval_us(&children_start.ru_utime);
+	uint64_t sys_us = timeval_us(&self_end.ru_stime) -
+		timeval_us(&self_start.ru_stime) +
+		timeval_us(&children_end.ru_stime) -
+		timeval_us(&children_start.ru_stime);
+	print_times(real_us, user_us, sys_us);
+	return status;
+}
+
+static bool
+expr_is_timed(const struct expr *e)
+{
+	return e->type == EXPR_TYPE_COMMAND && e->cmd.arg_count > 0 &&
+		strcmp(e->cmd.exe, "time") == 0;
+}
+
+/** Execute the pipelines of the line connected with && and ||. */
+static void
+execute_expr_list(struct shell *sh, const struct command_line *line)
+{
+	const struct command_line *out_line =
+		line->out_type == OUTPUT_TYPE_STDOUT ? NULL : line;
 	const struct expr *e = line->head;
+	enum expr_type op = EXPR_TYPE_COMMAND;
 	while (e != NULL) {
-		if (e->type == EXPR_TYPE_COMMAND) {
-			printf("\tCommand: %s", e->cmd.exe);
-			for (uint32_t i = 0; i < e->cmd.arg_count; ++i)
-				printf(" %s", e->cmd.args[i]);
-			printf("\n");
-		} else if (e->type == EXPR_TYPE_PIPE) {
-			printf("\tPIPE\n");
-		} else if (e->type == EXPR_TYPE_AND) {
-			printf("\tAND\n");
-		} else if (e->type == EXPR_TYPE_OR) {
-			printf("\tOR\n");
-		} else {
-			assert(false);
+		const struct expr *end = e;
+		while (end != NULL && end->type != EXPR_TYPE_AND &&
+		       end->type != EXPR_TYPE_OR)
+			end = end->next;
+		if (op == EXPR_TYPE_COMMAND ||
+		    (op == EXPR_TYPE_AND && sh->last_status == 0) ||
+		    (op == EXPR_TYPE_OR && sh->last_status != 0)) {
+			const struct command_line *pipe_out_line =
+				end == NULL ? out_line : NULL;
+			if (expr_is_timed(e)) {
+				sh->last_status = execute_timed_pipeline(sh, e,
+					end, pipe_out_line);
+			} else {
+				sh->last_status = execute_pipeline(sh, e, end,
+					pipe_out_line, true);
+			}
+			if (sh->is_exit)
+				return;
+		}
+		if (end == NULL)
+			break;
+		op = end->type;
+		e = end->next;
+	}
+}
+
+static bool
+command_line_has_logic(const struct command_line *line)
+{
+	for (const struct expr *e = line->head; e != NULL; e = e->next) {
+		if (e->type == EXPR_TYPE_AND || e->type == EXPR_TYPE_OR)
+			return true;
+	}
+	return false;
+}
+
+static void
+execute_command_line(struct shell *sh, const struct command_line *line)
+{
+	assert(line != NULL);
+	reap_background(sh);
+	if (!line->is_background) {
+		execute_expr_list(sh, line);
+		return;
+	}
+	if (!command_line_has_logic(line)) {
+		execute_pipeline(sh, line->head, NULL,
+			line->out_type == OUTPUT_TYPE_STDOUT ? NULL : line,
+			false);
+	} else {
+		fflush(stdout);
+		pid_t pid = fork();
+		if (pid == 0) {
+			/* The jobs are not children of the subshell. */
+			job_table_destroy(&sh->jobs);
+			job_table_create(&sh->jobs);
+			/*
+			 * Neither are the ones of the fork server, it
+			 * stays with the shell.
+			 */
+			sh->forks = NULL;
+			execute_expr_list(sh, line);
+			_exit(sh->last_status);
+		}
+		if (pid < 0)
+			fprintf(stderr, "fork: %s\n", strerror(errno));
+		else
+			job_table_add(&sh->jobs, &pid, 1);
+	}
+	sh->last_status = 0;
+}
+
+enum {
+	/**
+	 * Descriptors a batch of background lines can keep open till
+	 * all of them are launched.
+	 */
+	BACKGROUND_BATCH_MAX_FDS = 256,
+};
+
+/**
+ * A background line of only external commands, which can be
+ * launched with posix_spawn() from a helper thread.
+ */
+static bool
+command_line_is_spawnable(const struct command_line *line)
+{
+#ifdef SHELL_USE_FORK
+	(void)line;
+	return false;
+#else
+	if (!line->is_background || command_line_has_logic(line))
+		return false;
+	if (line->out_type != OUTPUT_TYPE_STDOUT && output_is_blocking(line))
+		return false;
+	for (const struct expr *e = line->head; e != NULL; e = e->next) {
+		if (e->type == EXPR_TYPE_COMMAND && builtin_find(&e->cmd) != NULL)
+			return false;
+	}
+	return true;
+#endif
+}
+
+/**
+ * How many of the first lines can be launched as one batch of
+ * background lines. 0 if it is not worth it.
+ */
+static uint32_t
+background_batch_size(const struct shell *sh, struct command_line **lines,
+		      uint32_t count)
+{
+	if (sh->launcher_thread_count == 0)
+		return 0;
+	uint32_t fd_count = 0;
+	uint32_t res = 0;
+	for (; res < count && lines[res] != NULL; ++res) {
+		if (!command_line_is_spawnable(lines[res]))
+			break;
+		/* A pipe per each command is an upper bound. */
+		for (const struct expr *e = lines[res]->head; e != NULL;
+		     e = e->next)
+			fd_count += 2;
+		if (fd_count > BACKGROUND_BATCH_MAX_FDS && res > 0)
+			break;
+	}
+	return res >= 2 ? res : 0;
+}
+
+struct spawn_batch {
+	const struct shell *sh;
+	struct spawn_cmd *cmds;
+};
+
+static void
+spawn_batch_run_one(void *arg, uint32_t i)
+{
+	struct spawn_batch *batch = arg;
+	struct spawn_cmd *sc = &batch->cmds[i];
+	if (sc->path != NULL)
+		spawn_cmd_run(batch->sh, sc);
+}
+
+/**
+ * Launch the spawnable background lines together. The shell prepares
+ * all of them - pipes, output files, paths, argv - and the spawns
+ * run in parallel on the launch pool. The jobs are added in the
+ * order of the lines, same as when launched one by one.
+ */
+static void
+execute_background_batch(struct shell *sh, struct command_line **lines,
+			 uint32_t count)
+{
+	reap_background(sh);
+	if (sh->launcher == NULL)
+		sh->launcher = launch_pool_new(sh->launcher_thread_count);
+	uint32_t cmd_count = 0;
+	for (uint32_t i = 0; i < count; ++i) {
+		for (const struct expr *e = lines[i]->head; e != NULL;
+		     e = e->next)
+			cmd_count += e->type == EXPR_TYPE_COMMAND;
+	}
+	struct spawn_cmd *cmds = calloc(cmd_count, sizeof(cmds[0]));
+	uint32_t k = 0;
+	for (uint32_t i = 0; i < count; ++i) {
+		const struct command_line *line = lines[i];
+		int in_fd = -1;
+		bool is_broken = false;
+		for (const struct expr *e = line->head; e != NULL; e = e->next) {
+			if (e->type != EXPR_TYPE_COMMAND)
+				continue;
+			struct spawn_cmd *sc = &cmds[k++];
+			const struct command *cmd = &e->cmd;
+			sc->cmd = cmd;
+			sc->in_fd = in_fd;
+			sc->out_fd = -1;
+			sc->pid = -1;
+			in_fd = -1;
+			if (e->next != NULL) {
+				int fds[2];
+				if (pipe_cloexec(fds) != 0) {
+					fprintf(stderr, "pipe: %s\n",
+						strerror(errno));
+					is_broken = true;
+				} else {
+					pipe_policy_apply(&sh->pipes, fds[1],
+							  cmd->exe,
+							  pipe_reader_name(e));
+					in_fd = fds[0];
+					sc->out_fd = fds[1];
+				}
+			} else if (line->out_type != OUTPUT_TYPE_STDOUT) {
+				sc->out_fd = output_open(line);
+				if (sc->out_fd < 0)
+					continue;
+			}
+			/* The rest of a line without a pipe isn't launched. */
+			if (is_broken)
+				continue;
+			sc->is_cached = strchr(cmd->exe, '/') == NULL;
+			sc->path = sc->is_cached ?
+				path_cache_find(&sh->paths, cmd->exe) : cmd->exe;
+			if (sc->path == NULL) {
+				command_not_found(cmd, ENOENT);
+				continue;
+			}
+			sc->argv = command_argv_new(cmd);
+		}
+		if (in_fd >= 0)
+			close(in_fd);
+	}
+	assert(k == cmd_count);
+	struct spawn_batch batch = {sh, cmds};
+	launch_pool_run(sh->launcher, spawn_batch_run_one, &batch, cmd_count);
+
+	pid_t *pids = malloc(sizeof(pids[0]) * cmd_count);
+	k = 0;
+	for (uint32_t i = 0; i < count; ++i) {
+		uint32_t first = k;
+		for (const struct expr *e = lines[i]->head; e != NULL;
+		     e = e->next) {
+			if (e->type != EXPR_TYPE_COMMAND)
+				continue;
+			struct spawn_cmd *sc = &cmds[k];
+			pids[k++] = sc->path != NULL ?
+				spawn_cmd_finish(sh, sc) : -1;
+			if (sc->in_fd >= 0)
+				close(sc->in_fd);
+			if (sc->out_fd >= 0)
+				close(sc->out_fd);
 		}
-		e = e->next;
+		job_table_add(&sh->jobs, pids + first, k - first);
 	}
+	free(pids);
+	free(cmds);
+	sh->last_status = 0;
+}
+
+enum {
+	/**
+	 * Distinct lines kept parsed. The generated scripts repeat a few
+	 * hundred of them, which then are not parsed again.
+	 */
+	PARSE_CACHE_SIZE = 1024,
+};
+
+/**
+ * The ready lines are parsed in batches, which are allocated at once
+ * and then executed one by one. Consecutive background lines are
+ * launched together.
+ */
+static void
+execute_ready_lines(struct shell *sh, struct parser *p)
+{
+	enum { LINE_BATCH_SIZE = 64 };
+	struct command_line *lines[LINE_BATCH_SIZE];
+	enum parser_error errs[LINE_BATCH_SIZE];
+	while (!sh->is_exit) {
+		uint32_t count = parser_pop_many(p, lines, LINE_BATCH_SIZE, errs);
+		if (count == 0)
+			break;
+		for (uint32_t i = 0; i < count && !sh->is_exit; ++i) {
+			if (errs[i] != PARSER_ERR_NONE) {
+				printf("Error: %d\n", (int)errs[i]);
+				continue;
+			}
+			if (sh->is_noexec)
+				continue;
+			uint32_t n = background_batch_size(sh, lines + i,
+							   count - i);
+			if (n > 0) {
+				execute_background_batch(sh, lines + i, n);
+				i += n - 1;
+				continue;
+			}
+			execute_command_line(sh, lines[i]);
+		}
+		parser_release_many(p, lines, count);
+	}
+}
+
+/**
+ * A script in a regular file is parsed right from its mapping, with
+ * no reads and copies of the input.
+ */
+static bool
+execute_mapped_stdin(struct shell *sh)
+{
+	struct stat st;
+	if (fstat(STDIN_FILENO, &st) != 0 || !S_ISREG(st.st_mode))
+		return false;
+	off_t offset = lseek(STDIN_FILENO, 0, SEEK_CUR);
+	if (offset < 0 || st.st_size <= offset ||
+	    st.st_size - offset > UINT32_MAX)
+		return false;
+	size_t size = st.st_size;
+	char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, STDIN_FILENO, 0);
+	if (data == MAP_FAILED)
+		return false;
+	madvise(data, size, MADV_SEQUENTIAL);
+	const char *begin = data + offset;
+	const char *end = data + size;
+	/*
+	 * The last line can end without a new line. It is parsed
+	 * separately with one added.
+	 */
+	const char *tail = end;
+	while (tail > begin && tail[-1] != '\n')
+		--tail;
+	struct parser *p = parser_new_external(begin, tail - begin);
+	parser_set_cache(p, PARSE_CACHE_SIZE);
+	execute_ready_lines(sh, p);
+	parser_delete(p);
+	if (tail < end && !sh->is_exit) {
+		p = parser_new();
+		parser_feed(p, tail, end - tail);
+		parser_feed(p, "\n", 1);
+		execute_ready_lines(sh, p);
+		parser_delete(p);
+	}
+	munmap(data, size);
+	return true;
 }
 
 int
-main(void)
+main(int argc, char **argv)
 {
+	/*
+	 * Built-ins write into pipes from the shell, it must survive
+	 * the readers exiting early.
+	 */
+	signal(SIGPIPE, SIG_IGN);
+	struct shell sh;
+	shell_create(&sh);
+	if (argc > 1 && strcmp(argv[1], "-n") == 0)
+		sh.is_noexec = true;
+	if (execute_mapped_stdin(&sh)) {
+		shell_destroy(&sh);
+		return sh.last_status;
+	}
 	const size_t buf_size = 1024;
 	char buf[buf_size];
 	int rc;
 	struct parser *p = parser_new();
-	while ((rc = read(STDIN_FILENO, buf, buf_size)) > 0) {
+	parser_set_cache(p, PARSE_CACHE_SIZE);
+	while (!sh.is_exit) {
+		shell_wait_input(&sh);
+		if ((rc = read(STDIN_FILENO, buf, buf_size)) <= 0)
+			break;
 		parser_feed(p, buf, rc);
-		struct command_line *line = NULL;
-		while (true) {
-			enum parser_error err = parser_pop_next(p, &line);
-			if (err == PARSER_ERR_NONE && line == NULL)
-				break;
-			if (err != PARSER_ERR_NONE) {
-				printf("Error: %d\n", (int)err);
-				continue;
-			}
-			execute_command_line(line);
-			command_line_delete(line);
-		}
+		execute_ready_lines(&sh, p);
+	}
+	/* The last line can end without a new line. */
+	if (!sh.is_exit) {
+		parser_feed(p, "\n", 1);
+		execute_ready_lines(&sh, p);
 	}
 	parser_delete(p);
-	return 0;
+	shell_destroy(&sh);
+	return sh.last_status;
 }
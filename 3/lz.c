@@ -0,0 +1,311 @@
+#include "lz.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+enum {
+	LZ_MIN_MATCH = 4,
+	/** The last match starts at least this far from the end ... */
+	LZ_MATCH_LIMIT = 12,
+	/** ... and the last bytes are literals. */
+	LZ_LAST_LITERALS = 5,
+	LZ_MAX_OFFSET = 65535,
+	LZ_HASH_LOG = 12,
+	/** Chunk of the fast copy of the literals and the matches. */
+	LZ_WILD_COPY = 16,
+};
+
+_Static_assert(1 << LZ_HASH_LOG == LZ_DICT_TABLE_SIZE,
+	       "the dictionary table is the same as of the compressor");
+
+static inline uint32_t
+lz_read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t
+lz_hash(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - LZ_HASH_LOG);
+}
+
+/** Write the 255-s of a length above 15. */
+static uint8_t *
+lz_write_length(uint8_t *op, int len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+	return op;
+}
+
+/**
+ * Write a sequence of literals and a match. @a match_len is without
+ * the min match, and -1 for the last literals. Returns NULL if it
+ * doesn't fit.
+ */
+static uint8_t *
+lz_write_sequence(uint8_t *op, const uint8_t *op_end, const uint8_t *lit,
+		  int lit_len, int offset, int match_len)
+{
+	if (op_end - op < 1 + lit_len + lit_len / 255 + 1 + 2 +
+	    (match_len < 0 ? 0 : match_len / 255 + 1))
+		return NULL;
+	uint8_t *token = op++;
+	*token = (lit_len < 15 ? lit_len : 15) << 4;
+	if (lit_len >= 15)
+		op = lz_write_length(op, lit_len - 15);
+	memcpy(op, lit, lit_len);
+	op += lit_len;
+	if (match_len < 0)
+		return op;
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+	*token |= match_len < 15 ? match_len : 15;
+	if (match_len >= 15)
+		op = lz_write_length(op, match_len - 15);
+	return op;
+}
+
+void
+lz_dict_create(struct lz_dict *dict, const char *data, int size)
+{
+	if (size > LZ_DICT_MAX_SIZE) {
+		data += size - LZ_DICT_MAX_SIZE;
+		size = LZ_DICT_MAX_SIZE;
+	}
+	/* Too short to refer to, and the empty slots point at 0. */
+	if (size < LZ_MIN_MATCH)
+		size = 0;
+	dict->data = data;
+	dict->size = size;
+	memset(dict->table, 0, sizeof(dict->table));
+	const uint8_t *p = (const uint8_t *)data;
+	for (int i = 0; i + LZ_MIN_MATCH <= size; ++i)
+		dict->table[lz_hash(lz_read32(p + i))] = i;
+}
+
+/**
+ * A match of @a ip in the dictionary, as far back as allowed. Returns
+ * the match position in it, or NULL.
+ */
+static inline const uint8_t *
+lz_dict_match(const struct lz_dict *dict, uint32_t h, uint32_t seq,
+	      int pos)
+{
+	if (dict == NULL || dict->size == 0)
+		return NULL;
+	uint32_t ref = dict->table[h];
+	if (pos + dict->size - ref > LZ_MAX_OFFSET)
+		return NULL;
+	const uint8_t *p = (const uint8_t *)dict->data + ref;
+	return lz_read32(p) == seq ? p : NULL;
+}
+
+static int
+lz_compress_impl(const struct lz_dict *dict, const char *src, int size,
+		 char *dst, int capacity)
+{
+	const uint8_t *base = (const uint8_t *)src;
+	const uint8_t *ip = base;
+	const uint8_t *anchor = base;
+	const uint8_t *end = base + size;
+	uint8_t *op = (uint8_t *)dst;
+	const uint8_t *op_end = op + capacity;
+	uint32_t table[1 << LZ_HASH_LOG];
+	memset(table, 0, sizeof(table));
+	if (size >= LZ_MATCH_LIMIT) {
+		const uint8_t *match_start_limit = end - LZ_MATCH_LIMIT;
+		const uint8_t *match_end_limit = end - LZ_LAST_LITERALS;
+		while (ip < match_start_limit) {
+			uint32_t seq = lz_read32(ip);
+			uint32_t h = lz_hash(seq);
+			const uint8_t *ref = base + table[h];
+			table[h] = ip - base;
+			/*
+			 * The match in the dictionary is at a virtual offset,
+			 * and ends with it, so the bounds are of that one.
+			 */
+			const uint8_t *ref_base = base;
+			const uint8_t *ref_limit = match_end_limit;
+			int offset;
+			if (ref < ip && ip - ref <= LZ_MAX_OFFSET &&
+			    lz_read32(ref) == seq) {
+				offset = ip - ref;
+			} else if ((ref = lz_dict_match(dict, h, seq,
+							ip - base)) != NULL) {
+				ref_base = (const uint8_t *)dict->data;
+				ref_limit = ref_base + dict->size;
+				offset = ip - base + ref_limit - ref;
+			} else {
+				++ip;
+				continue;
+			}
+			while (ip > anchor && ref > ref_base &&
+			       ip[-1] == ref[-1]) {
+				--ip;
+				--ref;
+			}
+			const uint8_t *match_end = ip + LZ_MIN_MATCH;
+			const uint8_t *ref_end = ref + LZ_MIN_MATCH;
+			while (match_end < match_end_limit &&
+			       ref_end < ref_limit && *match_end == *ref_end) {
+				++match_end;
+				++ref_end;
+			}
+			op = lz_write_sequence(op, op_end, anchor, ip - anchor,
+					       offset, match_end - ip -
+					       LZ_MIN_MATCH);
+			if (op == NULL)
+				return 0;
+			ip = match_end;
+			anchor = ip;
+		}
+	}
+	op = lz_write_sequence(op, op_end, anchor, end - anchor, 0, -1);
+	if (op == NULL)
+		return 0;
+	return op - (uint8_t *)dst;
+}
+
+int
+lz_compress(const char *src, int size, char *dst, int capacity)
+{
+	return lz_compress_impl(NULL, src, size, dst, capacity);
+}
+
+int
+lz_compress_dict(const struct lz_dict *dict, const char *src, int size,
+		 char *dst, int capacity)
+{
+	return lz_compress_impl(dict, src, size, dst, capacity);
+}
+
+/**
+ * Copy @a len bytes. If @a is_wild, the copy is done in chunks of
+ * LZ_WILD_COPY bytes, and can write and read up to a chunk beyond
+ * the end. It is much faster than memcpy() of the short random
+ * lengths the sequences have.
+ */
+static inline void
+lz_copy(uint8_t *dst, const uint8_t *src, int len, bool is_wild)
+{
+	if (!is_wild) {
+		memmove(dst, src, len);
+		return;
+	}
+	uint8_t *end = dst + len;
+	do {
+		memcpy(dst, src, LZ_WILD_COPY);
+		dst += LZ_WILD_COPY;
+		src += LZ_WILD_COPY;
+	} while (dst < end);
+}
+
+/** Read the 255-s of a length above 15. Returns -1 on the end. */
+static int
+lz_read_length(const uint8_t **ip, const uint8_t *end)
+{
+	int len = 0;
+	uint8_t b;
+	do {
+		if (*ip == end)
+			return -1;
+		b = *(*ip)++;
+		len += b;
+	} while (b == 255);
+	return len;
+}
+
+static int
+lz_decompress_impl(const uint8_t *dict, int dict_size, const char *src,
+		   int size, char *dst, int capacity)
+{
+	const uint8_t *ip = (const uint8_t *)src;
+	const uint8_t *end = ip + size;
+	uint8_t *op = (uint8_t *)dst;
+	uint8_t *op_end = op + capacity;
+	while (ip < end) {
+		uint8_t token = *ip++;
+		int len = token >> 4;
+		if (len == 15) {
+			int ext = lz_read_length(&ip, end);
+			if (ext < 0)
+				return -1;
+			len += ext;
+		}
+		if (end - ip < len || op_end - op < len)
+			return -1;
+		lz_copy(op, ip, len, end - ip >= len + LZ_WILD_COPY &&
+			op_end - op >= len + LZ_WILD_COPY);
+		ip += len;
+		op += len;
+		if (ip == end)
+			break;
+		if (end - ip < 2)
+			return -1;
+		int offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > op - (uint8_t *)dst + dict_size)
+			return -1;
+		len = token & 15;
+		if (len == 15) {
+			int ext = lz_read_length(&ip, end);
+			if (ext < 0)
+				return -1;
+			len += ext;
+		}
+		len += LZ_MIN_MATCH;
+		if (op_end - op < len)
+			return -1;
+		int back = offset - (op - (uint8_t *)dst);
+		if (back > 0) {
+			/* Starts in the dictionary, can go on in the output. */
+			const uint8_t *ref = dict + dict_size - back;
+			int n = back < len ? back : len;
+			memcpy(op, ref, n);
+			ref = (uint8_t *)dst;
+			for (int i = n; i < len; ++i)
+				op[i] = *ref++;
+			op += len;
+			continue;
+		}
+		const uint8_t *ref = op - offset;
+		bool is_wild = offset >= LZ_WILD_COPY &&
+			       op_end - op >= len + LZ_WILD_COPY;
+		if (is_wild || offset >= len) {
+			/* A wild copy reads only what is already written. */
+			lz_copy(op, ref, len, is_wild);
+			op += len;
+		} else {
+			/* Overlaps, repeats the last offset bytes. */
+			for (int i = 0; i < len; ++i)
+				*op++ = ref[i];
+		}
+	}
+	return op - (uint8_t *)dst;
+}
+
+int
+lz_decompress(const char *src, int size, char *dst, int capacity)
+{
+	return lz_decompress_impl(NULL, 0, src, size, dst, capacity);
+}
+
+int
+lz_decompress_dict(const char *dict, int dict_size, const char *src,
+		   int size, char *dst, int capacity)
+{
+	if (dict_size > LZ_DICT_MAX_SIZE) {
+		dict += dict_size - LZ_DICT_MAX_SIZE;
+		dict_size = LZ_DICT_MAX_SIZE;
+	}
+	if (dict_size < LZ_MIN_MATCH)
+		dict_size = 0;
+	return lz_decompress_impl((const uint8_t *)dict, dict_size, src,
+				  size, dst, capacity);
+}
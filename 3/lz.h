@@ -0,0 +1,64 @@
+#pragma once
+
+/**
+ * Compression in the LZ4 block format: a sequence of literal runs and
+ * back references of up to 64KB. It is fast rather than compact, to
+ * compress the cold data of the file system. A greedy compressor with
+ * one hash table of positions, and a decompressor checking all the
+ * bounds, so a corrupted input doesn't crash it.
+ */
+
+#include <stdint.h>
+
+enum {
+	LZ_DICT_MAX_SIZE = 65535,
+	LZ_DICT_TABLE_SIZE = 1 << 12,
+};
+
+/**
+ * Dictionary of the texts like the compressed ones, which the matches
+ * can refer to as if it was right before the data. It makes the
+ * short texts compress, they have nothing to refer to in themselves.
+ * The decompression needs the same bytes.
+ */
+struct lz_dict {
+	const char *data;
+	int size;
+	/** Positions in the data by the hash of their 4 bytes. */
+	uint32_t table[LZ_DICT_TABLE_SIZE];
+};
+
+/**
+ * Index the dictionary. The data is not copied, and only its last
+ * LZ_DICT_MAX_SIZE bytes are used.
+ */
+void
+lz_dict_create(struct lz_dict *dict, const char *data, int size);
+
+/**
+ * Compress @a size bytes of @a src into @a dst of @a capacity bytes.
+ * Returns the compressed size, or 0 if it doesn't fit.
+ */
+int
+lz_compress(const char *src, int size, char *dst, int capacity);
+
+/** Same as lz_compress(), with the matches in the dictionary too. */
+int
+lz_compress_dict(const struct lz_dict *dict, const char *src, int size,
+		 char *dst, int capacity);
+
+/**
+ * Decompress @a size bytes into @a dst of @a capacity bytes. Returns
+ * the decompressed size, or -1 if the input is corrupted or doesn't
+ * fit.
+ */
+int
+lz_decompress(const char *src, int size, char *dst, int capacity);
+
+/**
+ * Same as lz_decompress(), of the data compressed with the
+ * dictionary of these bytes.
+ */
+int
+lz_decompress_dict(const char *dict, int dict_size, const char *src,
+		   int size, char *dst, int capacity);
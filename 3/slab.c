@@ -0,0 +1,127 @@
+#include "slab.h"
+#include "hugemem.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+enum {
+	/** A slab is at least this big ... */
+	SLAB_MIN_SIZE = 64 * 1024,
+	/** ... and has at least this many objects. */
+	SLAB_MIN_OBJECT_COUNT = 8,
+	SLAB_ALIGNMENT = 16,
+};
+
+struct slab {
+	struct slab *next;
+	/**
+	 * Objects of a huge page slab, mapped separately, so they
+	 * take whole pages. NULL if the objects follow the header.
+	 */
+	void *map;
+	size_t map_size;
+	/** Keeps the objects after the header aligned. */
+	max_align_t align;
+};
+
+static size_t
+slab_object_size(const struct slab_cache *cache)
+{
+	size_t size = cache->object_size;
+	if (size < sizeof(void *))
+		size = sizeof(void *);
+	return (size + SLAB_ALIGNMENT - 1) & ~(size_t)(SLAB_ALIGNMENT - 1);
+}
+
+void *
+slab_alloc(struct slab_cache *cache)
+{
+	pthread_mutex_lock(&cache->lock);
+	++cache->used_count;
+	if (cache->free_list != NULL) {
+		void *res = cache->free_list;
+		cache->free_list = *(void **)res;
+		pthread_mutex_unlock(&cache->lock);
+		return res;
+	}
+	size_t size = slab_object_size(cache);
+	if (cache->tail == cache->tail_end) {
+		size_t count = SLAB_MIN_SIZE / size;
+		if (count < SLAB_MIN_OBJECT_COUNT)
+			count = SLAB_MIN_OBJECT_COUNT;
+		void *map = NULL;
+		size_t map_size = 0;
+		if (cache->huge_flags != 0) {
+			map_size = hugemem_round(count * size);
+			map = hugemem_map(map_size, cache->huge_flags);
+		}
+		struct slab *slab;
+		size_t slab_size;
+		if (map != NULL) {
+			slab = malloc(sizeof(*slab));
+			slab_size = sizeof(*slab) + map_size;
+			count = map_size / size;
+			cache->tail = map;
+		} else {
+			slab_size = sizeof(*slab) + count * size;
+			slab = malloc(slab_size);
+			map_size = 0;
+			cache->tail = (char *)(slab + 1);
+		}
+		slab->map = map;
+		slab->map_size = map_size;
+		slab->next = cache->slabs;
+		cache->slabs = slab;
+		cache->slab_size += slab_size;
+		cache->tail_end = cache->tail + count * size;
+	}
+	void *res = cache->tail;
+	cache->tail += size;
+	pthread_mutex_unlock(&cache->lock);
+	return res;
+}
+
+void
+slab_free(struct slab_cache *cache, void *object)
+{
+	pthread_mutex_lock(&cache->lock);
+	*(void **)object = cache->free_list;
+	cache->free_list = object;
+	--cache->used_count;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void
+slab_cache_stat(struct slab_cache *cache, size_t *slab_size,
+		size_t *used_size)
+{
+	pthread_mutex_lock(&cache->lock);
+	*slab_size += cache->slab_size;
+	*used_size += cache->used_count * cache->object_size;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void
+slab_cache_set_huge(struct slab_cache *cache, int flags)
+{
+	pthread_mutex_lock(&cache->lock);
+	cache->huge_flags = flags;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void
+slab_cache_destroy(struct slab_cache *cache)
+{
+	while (cache->slabs != NULL) {
+		struct slab *next = cache->slabs->next;
+		if (cache->slabs->map != NULL)
+			munmap(cache->slabs->map, cache->slabs->map_size);
+		free(cache->slabs);
+		cache->slabs = next;
+	}
+	cache->free_list = NULL;
+	cache->tail = NULL;
+	cache->tail_end = NULL;
+	cache->slab_size = 0;
+	cache->used_count = 0;
+}
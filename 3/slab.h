@@ -0,0 +1,66 @@
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+
+/**
+ * Cache of objects of one size. The objects are cut from big slabs
+ * taken from malloc(), and the freed ones are kept in a free list
+ * for reuse. So there is no malloc() header per object, and all the
+ * objects of a cache are released at once by freeing the slabs.
+ * A cache can be used by several threads.
+ *
+ * The slabs of a cache can be mapped on huge pages instead, see
+ * slab_cache_set_huge(). Then a slab is rounded up to a multiple of
+ * 2MB.
+ */
+
+struct slab;
+
+struct slab_cache {
+	/** Size of each object. */
+	size_t object_size;
+	/** All the slabs, the newest first. */
+	struct slab *slabs;
+	/** Freed objects, linked through their first bytes. */
+	void *free_list;
+	/** Not yet used part of the newest slab. */
+	char *tail;
+	char *tail_end;
+	/** Bytes taken from malloc(), with the slab headers. */
+	size_t slab_size;
+	/** Flags of hugemem_map() for the new slabs, 0 for malloc(). */
+	int huge_flags;
+	/** Number of the objects in use. */
+	size_t used_count;
+	pthread_mutex_t lock;
+};
+
+/** Cache of the objects of the given size, not allocating anything yet. */
+#define SLAB_CACHE_INITIALIZER(size) {					\
+	.object_size = (size),						\
+	.lock = PTHREAD_MUTEX_INITIALIZER,				\
+}
+
+void *
+slab_alloc(struct slab_cache *cache);
+
+void
+slab_free(struct slab_cache *cache, void *object);
+
+/** Add the slab bytes and the used object bytes to the counters. */
+void
+slab_cache_stat(struct slab_cache *cache, size_t *slab_size,
+		size_t *used_size);
+
+/**
+ * Take the new slabs from hugemem_map() with @a flags of
+ * hugemem_flags, or from malloc() with 0. The existing slabs stay
+ * as they are.
+ */
+void
+slab_cache_set_huge(struct slab_cache *cache, int flags);
+
+/** Free all the slabs. The objects of the cache become invalid. */
+void
+slab_cache_destroy(struct slab_cache *cache);
@@ -1,8 +1,17 @@
 #include "userfs.h"
+#include "userfs_aio.h"
 #include "unit.h"
 #include <assert.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 static void
 test_open(void)
@@ -469,6 +478,1073 @@ test_resize(void)
 #endif
 }
 
+static void
+test_sparse(void)
+{
+#if NEED_RESIZE
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(ufs_write(fd, "abc", 3) != 3);
+	size_t max_size = 1024 * 1024 * 100;
+	unit_check(ufs_resize(fd, max_size) == 0, "grow to the max size");
+	struct ufs_stat st;
+	ufs_stat(&st);
+	unit_check(st.data_size == max_size, "the size is max");
+	unit_check(st.block_size < 4096, "but it takes no memory");
+
+	char buf[4096];
+	unit_check(ufs_pread(fd, buf, sizeof(buf), 0) == sizeof(buf),
+		   "read the start");
+	bool is_zero = memcmp(buf, "abc", 3) == 0;
+	for (size_t i = 3; i < sizeof(buf); ++i)
+		is_zero = is_zero && buf[i] == 0;
+	unit_check(is_zero, "the data and then zeros");
+	unit_check(ufs_pread(fd, buf, sizeof(buf), max_size - 100) == 100,
+		   "read the end");
+	is_zero = true;
+	for (size_t i = 0; i < 100; ++i)
+		is_zero = is_zero && buf[i] == 0;
+	unit_check(is_zero, "the hole is zeros");
+
+	size_t middle = max_size / 2 + 17;
+	unit_fail_if(ufs_pwrite(fd, "xyz", 3, middle) != 3);
+	ufs_stat(&st);
+	unit_check(st.block_size <= 2 * 1024 * 1024,
+		   "a write allocates only its block");
+	unit_check(ufs_pread(fd, buf, 5, middle - 1) == 5 &&
+		   memcmp(buf, "\0xyz\0", 5) == 0, "the write is in the hole");
+	struct ufs_span spans[4];
+	int count = ufs_map_range(fd, middle - 10000, 30000, spans, 4);
+	size_t zero_count = 0;
+	for (int i = 0; i < count; ++i) {
+		for (size_t j = 0; j < spans[i].size; ++j)
+			zero_count += spans[i].data[j] == 0;
+	}
+	unit_check(zero_count == 30000 - 3, "the holes are mapped as zeros");
+	ufs_unmap(spans, count);
+
+	unit_check(ufs_resize(fd, 2) == 0, "shrink");
+	ufs_stat(&st);
+	unit_check(st.block_size == 512, "the blocks are released");
+	unit_check(ufs_resize(fd, 1000) == 0, "grow again");
+	unit_check(ufs_pread(fd, buf, 1000, 0) == 1000 && buf[0] == 'a' &&
+		   buf[1] == 'b' && buf[2] == 0 && buf[999] == 0,
+		   "the old garbage is zeroed");
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+#endif
+}
+
+static void
+test_vectored_and_positional_io(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	/* The blocks are 512, 1024, ... bytes, so it crosses two borders. */
+	char big[1000];
+	memset(big, 'b', sizeof(big));
+	struct iovec out[] = {
+		{"head", 4}, {big, sizeof(big)}, {NULL, 0}, {"tail", 4},
+	};
+	unit_check(ufs_writev(fd, out, 4) == 1008, "writev");
+	unit_check(ufs_pwrite(fd, "MID", 3, 600) == 3, "pwrite inside");
+	unit_check(ufs_write(fd, "!", 1) == 1,
+		   "pwrite didn't move the position");
+
+	char buf[2048];
+	unit_check(ufs_pread(fd, buf, 6, 1004) == 5, "pread of the tail");
+	unit_check(memcmp(buf, "tail!", 5) == 0, "data is correct");
+	unit_check(ufs_pread(fd, buf, 6, 2000) == 0, "pread behind the end");
+
+	int fd2 = ufs_open("file", 0);
+	unit_fail_if(fd2 == -1);
+	char head[2], rest[1500];
+	struct iovec in[] = {{head, 2}, {rest, sizeof(rest)}};
+	unit_check(ufs_readv(fd2, in, 2) == 1009, "readv");
+	bool ok = memcmp(head, "he", 2) == 0 && memcmp(rest, "ad", 2) == 0 &&
+		  rest[2] == 'b' && memcmp(rest + 598, "MID", 3) == 0 &&
+		  rest[601] == 'b' && memcmp(rest + 1002, "tail!", 5) == 0;
+	unit_check(ok, "data is correct");
+	unit_check(ufs_readv(fd2, in, 2) == 0, "readv at the end");
+
+	unit_check(ufs_pwrite(fd2, "z", 1, 3000) == 1,
+		   "pwrite behind the end");
+	unit_check(ufs_pread(fd2, buf, sizeof(buf), 1009) == 1992,
+		   "the gap is read");
+	ok = buf[1990] == 0 && buf[1991] == 'z';
+	for (int i = 0; i < 1990 && ok; ++i)
+		ok = buf[i] == 0;
+	unit_check(ok, "and is zeros");
+
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_clone(void)
+{
+	unit_test_start();
+
+	unit_check(ufs_clone("src", "dst") == -1, "clone of no file");
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE, "errno is set");
+
+	char buffer[2048];
+	for (size_t i = 0; i < sizeof(buffer); ++i)
+		buffer[i] = 'a' + i % 26;
+	int src = ufs_open("src", UFS_CREATE);
+	unit_fail_if(src == -1);
+	unit_fail_if(ufs_write(src, buffer, sizeof(buffer)) !=
+		     sizeof(buffer));
+	unit_check(ufs_clone("src", "dst") == 0, "clone");
+	int dst = ufs_open("dst", 0);
+	unit_check(dst != -1, "the clone is opened");
+
+	char buf[4096];
+	unit_check(ufs_read(dst, buf, sizeof(buf)) == sizeof(buffer),
+		   "the clone has the same size");
+	unit_check(memcmp(buf, buffer, sizeof(buffer)) == 0,
+		   "and the same data");
+	unit_fail_if(ufs_pwrite(dst, "XYZ", 3, 600) != 3);
+	unit_fail_if(ufs_pwrite(src, "123", 3, 601) != 3);
+	unit_check(ufs_pread(src, buf, 5, 599) == 5, "read the source");
+	unit_check(memcmp(buf, "bc123", 5) == 0,
+		   "it has only its own write");
+	unit_check(ufs_pread(dst, buf, 5, 599) == 5, "read the clone");
+	unit_check(memcmp(buf, "bXYZf", 5) == 0,
+		   "it has only its own write too");
+
+	unit_fail_if(ufs_close(src) != 0);
+	unit_fail_if(ufs_delete("src") != 0);
+	unit_check(ufs_pread(dst, buf, sizeof(buf), 0) == sizeof(buffer),
+		   "the clone lives after the source deletion");
+	unit_check(memcmp(buf + 1024, buffer + 1024, 1024) == 0,
+		   "with its data");
+	/*
+	 * Clone over an existing file, which has an opened descriptor
+	 * behind the new end.
+	 */
+	int small = ufs_open("small", UFS_CREATE);
+	unit_fail_if(small == -1);
+	unit_fail_if(ufs_write(small, "abc", 3) != 3);
+	unit_check(ufs_clone("small", "dst") == 0, "clone over a file");
+	unit_check(ufs_write(dst, "d", 1) == 1,
+		   "its descriptor continues from the new end");
+	unit_check(ufs_pread(dst, buf, sizeof(buf), 0) == 4, "new size");
+	unit_check(memcmp(buf, "abcd", 4) == 0, "new data");
+	unit_check(ufs_pread(small, buf, sizeof(buf), 0) == 3,
+		   "the source is not changed");
+	unit_check(ufs_pwrite(dst, "e", 1, 10) == 1,
+		   "the shared last block is extended with zeros");
+	unit_check(ufs_pread(small, buf, sizeof(buf), 0) == 3,
+		   "the source is still not changed");
+	unit_check(ufs_pread(dst, buf, sizeof(buf), 0) == 11, "read the clone");
+	unit_check(memcmp(buf, "abcd\0\0\0\0\0\0e", 11) == 0,
+		   "the gap is zeros");
+
+	unit_fail_if(ufs_close(small) != 0);
+	unit_fail_if(ufs_close(dst) != 0);
+	unit_fail_if(ufs_delete("small") != 0);
+	unit_fail_if(ufs_delete("dst") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_map_range(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	struct ufs_span spans[8];
+	unit_check(ufs_map_range(fd, 0, 100, spans, 8) == 0,
+		   "empty file has no spans");
+	unit_check(ufs_map_range(fd + 1, 0, 100, spans, 8) == -1,
+		   "invalid descriptor");
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE, "errno is set");
+
+	static char buffer[10000];
+	for (size_t i = 0; i < sizeof(buffer); ++i)
+		buffer[i] = 'a' + i % 26;
+	unit_fail_if(ufs_write(fd, buffer, sizeof(buffer)) !=
+		     sizeof(buffer));
+	int count = ufs_map_range(fd, 100, 100000, spans, 8);
+	unit_check(count > 1, "a few spans for a few blocks");
+	size_t pos = 100;
+	bool is_ok = true;
+	for (int i = 0; i < count; ++i) {
+		is_ok = is_ok && spans[i].size > 0 &&
+			memcmp(spans[i].data, buffer + pos, spans[i].size) == 0;
+		pos += spans[i].size;
+	}
+	unit_check(is_ok, "the spans have the file data");
+	unit_check(pos == sizeof(buffer), "and end at the file end");
+
+	unit_fail_if(ufs_pwrite(fd, "XYZ", 3, 100) != 3);
+	unit_check(memcmp(spans[0].data, buffer + 100, 3) == 0,
+		   "a write doesn't change the mapped data");
+	char buf[3];
+	unit_fail_if(ufs_pread(fd, buf, 3, 100) != 3);
+	unit_check(memcmp(buf, "XYZ", 3) == 0, "but changes the file");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	unit_check(memcmp(spans[count - 1].data,
+			  buffer + sizeof(buffer) - spans[count - 1].size,
+			  spans[count - 1].size) == 0,
+		   "the spans survive delete");
+	ufs_unmap(spans, count);
+
+	fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(ufs_write(fd, buffer, sizeof(buffer)) !=
+		     sizeof(buffer));
+	unit_check(ufs_map_range(fd, 0, sizeof(buffer), spans, 1) == 1,
+		   "only as many spans as given");
+	size_t size = spans[0].size;
+	ufs_unmap(spans, 1);
+	unit_check(ufs_map_range(fd, size, 10, spans, 8) == 1,
+		   "the rest is mapped by the next call");
+	unit_check(spans[0].size == 10 &&
+		   memcmp(spans[0].data, buffer + size, 10) == 0,
+		   "it has the next bytes");
+	ufs_unmap(spans, 1);
+	unit_check(ufs_map_range(fd, sizeof(buffer) + 1, 10, spans, 8) == 0,
+		   "nothing after the end");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_image(void)
+{
+	unit_test_start();
+
+	const char *path = "test_image.ufs";
+	unlink(path);
+	unit_check(ufs_sync() == -1, "sync without an image");
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE, "errno is set");
+	unit_check(ufs_mount(path) == 0, "mount a new image");
+
+	static char buffer[10000];
+	for (size_t i = 0; i < sizeof(buffer); ++i)
+		buffer[i] = 'a' + i % 26;
+	int fd = ufs_open("big", UFS_CREATE);
+	unit_fail_if(ufs_write(fd, buffer, sizeof(buffer)) != sizeof(buffer));
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("empty", UFS_CREATE);
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("small", UFS_CREATE);
+	unit_fail_if(ufs_write(fd, "hello", 5) != 5);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(ufs_sync() == 0, "sync");
+	ufs_destroy();
+
+	unit_check(ufs_mount(path) == 0, "mount the saved image");
+	struct ufs_stat st;
+	ufs_stat(&st);
+	unit_check(st.file_count == 3 && st.data_size == sizeof(buffer) + 5,
+		   "all the files are loaded");
+	unit_check(st.image_size > 0, "the image is mapped");
+	static char buf[20000];
+	fd = ufs_open("big", 0);
+	unit_check(ufs_read(fd, buf, sizeof(buf)) == sizeof(buffer) &&
+		   memcmp(buf, buffer, sizeof(buffer)) == 0, "the data is the same");
+	unit_fail_if(ufs_pwrite(fd, "XYZ", 3, 5000) != 3);
+	memcpy(buffer + 5000, "XYZ", 3);
+	unit_check(ufs_pread(fd, buf, sizeof(buf), 0) == sizeof(buffer) &&
+		   memcmp(buf, buffer, sizeof(buffer)) == 0,
+		   "a write into the mapped data");
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("empty", 0);
+	unit_check(fd != -1 && ufs_read(fd, buf, 10) == 0, "the empty file");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("small") != 0);
+	fd = ufs_open("new", UFS_CREATE);
+	unit_fail_if(ufs_write(fd, "abc", 3) != 3);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(ufs_sync() == 0, "sync the changes");
+	ufs_destroy();
+
+	unit_check(ufs_mount(path) == 0, "mount again");
+	fd = ufs_open("big", 0);
+	unit_check(ufs_read(fd, buf, sizeof(buf)) == sizeof(buffer) &&
+		   memcmp(buf, buffer, sizeof(buffer)) == 0, "the write is saved");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(ufs_open("small", 0) == -1, "the delete is saved");
+	fd = ufs_open("new", 0);
+	unit_check(ufs_read(fd, buf, 10) == 3 && memcmp(buf, "abc", 3) == 0,
+		   "the new file is saved");
+
+	for (int i = 0; i < 500; ++i) {
+		buf[0] = 'a' + i % 26;
+		unit_fail_if(ufs_pwrite(fd, buf, sizeof(buffer), 0) !=
+			     sizeof(buffer));
+		unit_fail_if(ufs_sync() != 0);
+	}
+	unit_fail_if(ufs_close(fd) != 0);
+	struct stat file_st;
+	unit_fail_if(stat(path, &file_st) != 0);
+	unit_check(file_st.st_size < 2 * 1024 * 1024,
+		   "the garbage of many syncs is dropped");
+	ufs_destroy();
+	unit_check(ufs_mount(path) == 0, "mount the compacted image");
+	fd = ufs_open("new", 0);
+	unit_check(ufs_read(fd, buf, sizeof(buf)) == sizeof(buffer) &&
+		   buf[0] == 'a' + 499 % 26, "it has the last data");
+	unit_fail_if(ufs_close(fd) != 0);
+	ufs_destroy();
+
+	FILE *f = fopen(path, "w");
+	fprintf(f, "not an image");
+	fclose(f);
+	unit_check(ufs_mount(path) == -1, "corrupted image");
+	unit_check(ufs_errno() == UFS_ERR_IO, "errno is set");
+	unlink(path);
+
+	unit_test_finish();
+}
+
+/** Names of the directory's entries, sorted, like "b/ f". */
+static void
+test_dirs_list(const char *path, char *out)
+{
+	char names[16][16];
+	int count = 0;
+	struct ufs_dir *dir = ufs_opendir(path);
+	struct ufs_dirent entry;
+	while (dir != NULL && ufs_readdir(dir, &entry) == 1 && count < 16) {
+		snprintf(names[count++], sizeof(names[0]), "%s%s", entry.name,
+			 entry.is_dir ? "/" : "");
+	}
+	if (dir != NULL)
+		ufs_closedir(dir);
+	qsort(names, count, sizeof(names[0]),
+	      (int (*)(const void *, const void *))strcmp);
+	*out = 0;
+	for (int i = 0; i < count; ++i) {
+		if (i > 0)
+			strcat(out, " ");
+		strcat(out, names[i]);
+	}
+}
+
+static void
+test_dirs(void)
+{
+	unit_test_start();
+
+	char list[256];
+	unit_check(ufs_mkdir("a") == 0, "mkdir");
+	unit_check(ufs_mkdir("a/b") == 0, "mkdir in it");
+	unit_check(ufs_mkdir("a") == -1, "mkdir of an existing one");
+	unit_check(ufs_errno() == UFS_ERR_EXISTS, "errno is set");
+	unit_check(ufs_mkdir("x/y") == -1, "mkdir with no parent");
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE, "errno is set");
+
+	int fd = ufs_open("a/b/f", UFS_CREATE);
+	unit_check(fd != -1, "create a file in a directory");
+	unit_fail_if(ufs_write(fd, "abc", 3) != 3);
+	int fd2 = ufs_open("/a//b/f", 0);
+	char buf[16];
+	unit_check(fd2 != -1 && ufs_read(fd2, buf, sizeof(buf)) == 3 &&
+		   memcmp(buf, "abc", 3) == 0, "the slashes don't matter");
+	unit_fail_if(ufs_close(fd2) != 0);
+	fd2 = ufs_open("f", UFS_CREATE);
+	unit_check(fd2 != -1 && ufs_read(fd2, buf, sizeof(buf)) == 0,
+		   "the same name in the root is another file");
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_delete("f") != 0);
+
+	unit_check(ufs_open("a/b/f/g", UFS_CREATE) == -1,
+		   "a file is not a directory");
+	unit_check(ufs_errno() == UFS_ERR_NOT_DIR, "errno is set");
+	unit_check(ufs_open("a/c/f", UFS_CREATE) == -1,
+		   "the directories are not created by open");
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE, "errno is set");
+	unit_check(ufs_open("a/b", UFS_CREATE) == -1,
+		   "a directory can't be opened");
+	unit_check(ufs_errno() == UFS_ERR_IS_DIR, "errno is set");
+	unit_check(ufs_delete("a/b") == -1, "a directory can't be deleted");
+	unit_check(ufs_errno() == UFS_ERR_IS_DIR, "errno is set");
+	unit_check(ufs_clone("a/b/f", "a/g") == 0, "clone into a directory");
+
+	test_dirs_list("a", list);
+	unit_check(strcmp(list, "b/ g") == 0, "list a directory");
+	test_dirs_list("/", list);
+	unit_check(strcmp(list, "a/") == 0, "list the root");
+	struct ufs_dir *dir = ufs_opendir("a/b");
+	unit_fail_if(dir == NULL);
+	unit_fail_if(ufs_mkdir("a/b/new") != 0);
+	struct ufs_dirent entry;
+	unit_check(ufs_readdir(dir, &entry) == 1 &&
+		   strcmp(entry.name, "f") == 0 && !entry.is_dir,
+		   "the entries are of the open moment");
+	unit_check(ufs_readdir(dir, &entry) == 0, "and there is no more");
+	ufs_closedir(dir);
+	unit_check(ufs_opendir("a/g") == NULL, "a file can't be listed");
+	unit_check(ufs_errno() == UFS_ERR_NOT_DIR, "errno is set");
+
+	struct ufs_stat st;
+	ufs_stat(&st);
+	unit_check(st.dir_count == 3 && st.file_count == 2, "stat counts");
+
+	unit_check(ufs_rmdir("a/b") == -1, "rmdir of a non-empty directory");
+	unit_check(ufs_errno() == UFS_ERR_NOT_EMPTY, "errno is set");
+	unit_check(ufs_rmdir("a/g") == -1, "rmdir of a file");
+	unit_check(ufs_errno() == UFS_ERR_NOT_DIR, "errno is set");
+	unit_check(ufs_rmdir("/") == -1, "rmdir of the root");
+	unit_fail_if(ufs_rmdir("a/b/new") != 0);
+	unit_fail_if(ufs_delete("a/b/f") != 0);
+	unit_check(ufs_rmdir("a/b") == 0,
+		   "rmdir when the deleted file is still opened");
+	unit_check(ufs_pread(fd, buf, sizeof(buf), 0) == 3,
+		   "the file still lives");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(ufs_open("a/b/f", UFS_CREATE) == -1,
+		   "the removed directory is not found");
+	unit_check(ufs_errno() == UFS_ERR_NO_FILE, "errno is set");
+	unit_fail_if(ufs_mkdir("a/b") != 0);
+	fd = ufs_open("a/b/f", UFS_CREATE);
+	unit_check(fd != -1, "the directory is created back");
+	unit_fail_if(ufs_close(fd) != 0);
+
+	/* A deep path, longer than the cached prefixes. */
+	char path[512] = "d";
+	unit_fail_if(ufs_mkdir(path) != 0);
+	for (int i = 1; i < 100; ++i) {
+		sprintf(path + strlen(path), "/d%d", i);
+		unit_fail_if(ufs_mkdir(path) != 0);
+	}
+	strcat(path, "/file");
+	fd = ufs_open(path, UFS_CREATE);
+	unit_check(fd != -1 && ufs_close(fd) == 0, "a deep file");
+
+	const char *image = "test_dirs.ufs";
+	unlink(image);
+	unit_fail_if(ufs_mount(image) != 0);
+	unit_fail_if(ufs_sync() != 0);
+	ufs_destroy();
+	unit_check(ufs_mount(image) == 0, "mount the saved directories");
+	fd = ufs_open(path, 0);
+	unit_check(fd != -1 && ufs_close(fd) == 0, "the deep file is loaded");
+	fd = ufs_open("a/g", 0);
+	unit_check(fd != -1 && ufs_read(fd, buf, sizeof(buf)) == 3,
+		   "the clone is loaded");
+	unit_fail_if(ufs_close(fd) != 0);
+	ufs_stat(&st);
+	unit_check(st.dir_count == 102 && st.file_count == 3,
+		   "the non-empty directories are loaded");
+	ufs_destroy();
+	unlink(image);
+
+	unit_test_finish();
+}
+
+static bool
+test_huge_check(const char *name, size_t size, char seed)
+{
+	int fd = ufs_open(name, 0);
+	char buf[4096];
+	bool is_ok = fd >= 0;
+	for (size_t pos = 0; pos < size && is_ok; pos += sizeof(buf)) {
+		is_ok = ufs_read(fd, buf, sizeof(buf)) == sizeof(buf);
+		for (size_t i = 0; i < sizeof(buf) && is_ok; ++i)
+			is_ok = buf[i] == (char)(seed + (pos + i) % 251);
+	}
+	ufs_close(fd);
+	return is_ok;
+}
+
+static void
+test_huge_write(const char *name, size_t size, char seed)
+{
+	int fd = ufs_open(name, UFS_CREATE);
+	char buf[4096];
+	for (size_t pos = 0; pos < size; pos += sizeof(buf)) {
+		for (size_t i = 0; i < sizeof(buf); ++i)
+			buf[i] = seed + (pos + i) % 251;
+		unit_fail_if(ufs_write(fd, buf, sizeof(buf)) != sizeof(buf));
+	}
+	ufs_close(fd);
+}
+
+static void
+test_huge_pages(void)
+{
+	unit_test_start();
+
+	/* No hugetlbfs pool is usually configured, then it is THP. */
+	ufs_set_huge_pages(UFS_HUGE_HUGETLB | UFS_HUGE_NODE_LOCAL);
+	size_t size = 8 * 1024 * 1024;
+	test_huge_write("huge", size, 1);
+	unit_check(test_huge_check("huge", size, 1), "data on huge pages");
+	struct ufs_stat st;
+	ufs_stat(&st);
+	unit_check(st.large_block_size > 0 &&
+		   st.huge_size >= st.large_block_size,
+		   "the big blocks are in the huge slabs");
+
+	unit_fail_if(ufs_clone("huge", "huge_clone") != 0);
+	test_huge_write("huge_clone", size / 2, 2);
+	unit_check(test_huge_check("huge", size, 1), "the origin is intact");
+	ufs_stat(&st);
+	size_t huge_size = st.huge_size;
+	unit_fail_if(ufs_delete("huge_clone") != 0);
+	unit_fail_if(ufs_delete("huge") != 0);
+	test_huge_write("huge", size, 3);
+	ufs_stat(&st);
+	unit_check(st.huge_size == huge_size, "the freed blocks are reused");
+
+	ufs_set_huge_pages(0);
+	test_huge_write("not_huge", size, 4);
+	ufs_stat(&st);
+	unit_check(st.huge_size == huge_size, "malloc() after switching off");
+	unit_check(test_huge_check("not_huge", size, 4) &&
+		   test_huge_check("huge", size, 3), "both are readable");
+	unit_fail_if(ufs_delete("not_huge") != 0);
+	unit_fail_if(ufs_delete("huge") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_compact(void)
+{
+	unit_test_start();
+
+	enum { SIZE = 300 * 1000 };
+	static char data[SIZE], buf[SIZE + 10];
+	for (int i = 0; i < SIZE; ++i)
+		data[i] = "cold data "[i % 10] + i / 10000;
+	int fd = ufs_open("cold", UFS_CREATE);
+	unit_fail_if(ufs_write(fd, data, SIZE) != SIZE);
+	int hot = ufs_open("hot", UFS_CREATE);
+	unit_fail_if(ufs_write(hot, data, SIZE) != SIZE);
+	uint64_t seed = 1;
+	for (int i = 0; i < SIZE; ++i) {
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		buf[i] = seed >> 56;
+	}
+	int noise = ufs_open("noise", UFS_CREATE);
+	unit_fail_if(ufs_write(noise, buf, SIZE) != SIZE);
+
+	struct ufs_stat st, st2;
+	ufs_stat(&st);
+	ufs_compact();
+	ufs_stat(&st2);
+	unit_check(st2.compressed_data_size == st.compressed_data_size,
+		   "the new data is not cold yet");
+	unit_fail_if(ufs_pread(hot, buf, SIZE, 0) != SIZE);
+	ufs_compact();
+	ufs_stat(&st2);
+	unit_check(st2.compressed_data_size - st.compressed_data_size == SIZE,
+		   "the unused data is compressed, not the random one");
+	unit_check(st2.compressed_size - st.compressed_size < SIZE / 10,
+		   "it is small");
+	unit_check(st.block_size - st2.block_size >= SIZE,
+		   "the blocks are freed");
+
+	unit_check(ufs_pread(fd, buf, sizeof(buf), 0) == SIZE &&
+		   memcmp(buf, data, SIZE) == 0, "read the compressed data");
+	ufs_stat(&st2);
+	unit_check(st2.cache_size > 0, "it is cached");
+	unit_check(ufs_pread(fd, buf, 5000, 100000) == 5000 &&
+		   memcmp(buf, data + 100000, 5000) == 0, "read in the middle");
+	/* The 128KB block from 130560 is in 2 frames. */
+	unit_check(ufs_pread(fd, buf, 1000, 195596) == 1000 &&
+		   memcmp(buf, data + 195596, 1000) == 0, "read across frames");
+	struct ufs_span spans[4];
+	int count = ufs_map_range(fd, 1000, 3000, spans, 4);
+	size_t done = 0;
+	for (int i = 0; i < count; ++i) {
+		unit_fail_if(memcmp(spans[i].data, data + 1000 + done,
+				    spans[i].size) != 0);
+		done += spans[i].size;
+	}
+	unit_check(done == 3000, "map the compressed data");
+	ufs_unmap(spans, count);
+
+	/* Repeats of a period longer than a fast copy of the decoder. */
+	static char period[SIZE];
+	for (int i = 0; i < SIZE; ++i)
+		period[i] = 'a' + i % 23;
+	int periodic = ufs_open("periodic", UFS_CREATE);
+	unit_fail_if(ufs_write(periodic, period, SIZE) != SIZE);
+	ufs_compact();
+	ufs_compact();
+	unit_check(ufs_pread(periodic, buf, sizeof(buf), 0) == SIZE &&
+		   memcmp(buf, period, SIZE) == 0, "read the repeated data");
+	unit_fail_if(ufs_close(periodic) != 0);
+	unit_fail_if(ufs_delete("periodic") != 0);
+
+	unit_fail_if(ufs_clone("cold", "clone") != 0);
+	unit_fail_if(ufs_pwrite(fd, "XYZ", 3, 150000) != 3);
+	memcpy(data + 150000, "XYZ", 3);
+	unit_check(ufs_pread(fd, buf, sizeof(buf), 0) == SIZE &&
+		   memcmp(buf, data, SIZE) == 0, "write into compressed data");
+	int clone = ufs_open("clone", 0);
+	unit_check(ufs_pread(clone, buf, 10, 150000) == 10 &&
+		   memcmp(buf, "XYZ", 3) != 0, "the clone is not changed");
+	unit_fail_if(ufs_close(clone) != 0);
+	unit_fail_if(ufs_delete("clone") != 0);
+
+	ufs_compact();
+	ufs_compact();
+	unit_fail_if(ufs_resize(fd, 200000) != 0);
+	unit_fail_if(ufs_resize(fd, SIZE) != 0);
+	memset(data + 200000, 0, SIZE - 200000);
+	unit_check(ufs_pread(fd, buf, sizeof(buf), 0) == SIZE &&
+		   memcmp(buf, data, SIZE) == 0, "resize of compressed data");
+
+	/* The compressed block has less data than the extended file. */
+	int far = ufs_open("far", UFS_CREATE);
+	unit_fail_if(ufs_pwrite(far, data, 1000, 3 << 20) != 1000);
+	ufs_compact();
+	ufs_compact();
+	struct ufs_span far_spans[16];
+	count = ufs_map_range_writable(far, 3 << 20, 5 << 20, far_spans, 16);
+	unit_fail_if(count <= 0);
+	unit_check(memcmp(far_spans[0].data, data, 1000) == 0,
+		   "map the compressed data past the end");
+	done = 0;
+	for (int i = 0; i < count; ++i) {
+		size_t skip = i == 0 ? 1000 : 0;
+		memset((char *)far_spans[i].data + skip, 'x',
+		       far_spans[i].size - skip);
+		done += far_spans[i].size;
+	}
+	ufs_unmap(far_spans, count);
+	unit_check(done == 5 << 20 && ufs_pread(far, buf, 2000, 3 << 20) ==
+		   2000 && memcmp(buf, data, 1000) == 0 && buf[1999] == 'x',
+		   "extend the compressed file");
+	unit_fail_if(ufs_close(far) != 0);
+	unit_fail_if(ufs_delete("far") != 0);
+
+	const char *image = "test_compact.ufs";
+	unlink(image);
+	ufs_compact();
+	ufs_compact();
+	unit_fail_if(ufs_mount(image) != 0);
+	unit_check(ufs_sync() == 0, "sync the compressed data");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_close(hot) != 0);
+	unit_fail_if(ufs_close(noise) != 0);
+	ufs_destroy();
+	unit_fail_if(ufs_mount(image) != 0);
+	fd = ufs_open("cold", 0);
+	unit_check(ufs_read(fd, buf, sizeof(buf)) == SIZE &&
+		   memcmp(buf, data, SIZE) == 0, "and load it");
+	unit_fail_if(ufs_close(fd) != 0);
+	ufs_destroy();
+	unlink(image);
+
+	unit_test_finish();
+}
+
+static void
+test_aio(void)
+{
+	unit_test_start();
+
+	struct thread_pool *pool;
+	unit_fail_if(thread_pool_new(4, &pool) != 0);
+	enum { SIZE = 10 * 1000 * 1000 + 123 };
+	char *data = malloc(SIZE);
+	char *buf = malloc(SIZE + 1000);
+	for (int i = 0; i < SIZE; ++i)
+		data[i] = 'a' + i % 23 + i / 1000000;
+
+	struct ufs_aio *aio;
+	unit_check(ufs_aio_write(pool, 100, data, SIZE, 0, &aio) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_FILE, "aio with a bad fd");
+	int fd = ufs_open("aio", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_aio_write(pool, fd, data, SIZE, 0, &aio) == 0,
+		   "start a write");
+	unit_check(ufs_aio_join(aio) == SIZE, "join it");
+	unit_check(ufs_pread(fd, buf, SIZE + 1000, 0) == SIZE &&
+		   memcmp(buf, data, SIZE) == 0, "the data is written");
+
+	memset(buf, 0, SIZE);
+	unit_fail_if(ufs_aio_read(pool, fd, buf, SIZE + 1000, 0, &aio) != 0);
+	unit_check(ufs_aio_join(aio) == SIZE && memcmp(buf, data, SIZE) == 0,
+		   "read it till the end");
+	unit_fail_if(ufs_aio_read(pool, fd, buf, 100, SIZE + 10, &aio) != 0);
+	unit_check(ufs_aio_join(aio) == 0, "read after the end");
+
+	/* A gap before the offset, and a write over a part of a block. */
+	unit_fail_if(ufs_aio_write(pool, fd, data, SIZE, SIZE + 5000,
+				   &aio) != 0);
+	unit_fail_if(ufs_aio_join(aio) != SIZE);
+	unit_fail_if(ufs_aio_write(pool, fd, "XYZ", 3, 777, &aio) != 0);
+	unit_check(ufs_aio_is_finished(aio), "a small one is done at once");
+	unit_fail_if(ufs_aio_join(aio) != 3);
+	bool is_ok = true;
+	for (size_t pos = 0; pos < 2 * SIZE + 5000; pos += SIZE / 10) {
+		size_t n = SIZE / 10;
+		unit_fail_if(ufs_pread(fd, buf, n, pos) < 0);
+		for (size_t i = 0; i < n && pos + i < 2 * SIZE + 5000; ++i) {
+			size_t j = pos + i;
+			char c = j < SIZE ? data[j] : j < SIZE + 5000 ? 0 :
+				 data[j - SIZE - 5000];
+			if (j >= 777 && j < 780)
+				c = "XYZ"[j - 777];
+			is_ok = is_ok && buf[i] == c;
+		}
+	}
+	unit_check(is_ok, "the gap is zeros, the rest is the data");
+
+	/* Compressed blocks of a clone are copied before the write. */
+	ufs_compact();
+	ufs_compact();
+	unit_fail_if(ufs_clone("aio", "aio_clone") != 0);
+	struct ufs_stat st;
+	ufs_stat(&st);
+	unit_fail_if(st.compressed_data_size == 0);
+	unit_fail_if(ufs_aio_write(pool, fd, buf, SIZE, 0, &aio) != 0);
+	unit_fail_if(ufs_aio_join(aio) != SIZE);
+	int clone = ufs_open("aio_clone", 0);
+	unit_fail_if(ufs_aio_read(pool, clone, buf, SIZE, 0, &aio) != 0);
+	unit_check(ufs_aio_join(aio) == SIZE && memcmp(buf, data, 777) == 0 &&
+		   memcmp(buf + 780, data + 780, SIZE - 780) == 0,
+		   "the clone is not changed");
+	unit_fail_if(ufs_close(clone) != 0);
+
+#if NEED_OPEN_FLAGS
+	int ro = ufs_open("aio", UFS_READ_ONLY);
+	unit_check(ufs_aio_write(pool, ro, data, SIZE, 0, &aio) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_PERMISSION,
+		   "no write into a read-only fd");
+	unit_fail_if(ufs_close(ro) != 0);
+#endif
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("aio") != 0);
+	unit_fail_if(ufs_delete("aio_clone") != 0);
+	unit_fail_if(thread_pool_delete(pool) != 0);
+	free(data);
+	free(buf);
+
+	unit_test_finish();
+}
+
+enum {
+	THREAD_TEST_WRITER_COUNT = 4,
+	THREAD_TEST_READER_COUNT = 4,
+	THREAD_TEST_OP_COUNT = 20000,
+	THREAD_TEST_FILE_SIZE = 64 * 1024,
+};
+
+struct thread_test_worker {
+	pthread_t thread;
+	int id;
+	bool is_ok;
+};
+
+static char
+thread_test_pattern(size_t pos)
+{
+	return 'a' + pos % 23;
+}
+
+/** Appends to its own file, shrinks it and checks the data. */
+static void *
+thread_test_writer_f(void *arg)
+{
+	struct thread_test_worker *w = arg;
+	char name[32];
+	sprintf(name, "writer%d", w->id);
+	int fd = ufs_open(name, UFS_CREATE);
+	char buf[100];
+	for (int i = 0; i < THREAD_TEST_OP_COUNT && w->is_ok; ++i) {
+		memset(buf, 'A' + w->id, sizeof(buf));
+		if (ufs_write(fd, buf, sizeof(buf)) != sizeof(buf) ||
+		    ufs_pread(fd, buf, sizeof(buf), i % 1000 * 10) != sizeof(buf) ||
+		    buf[0] != 'A' + w->id || buf[99] != 'A' + w->id)
+			w->is_ok = false;
+		if (i % 1000 == 999 && ufs_resize(fd, 0) != 0)
+			w->is_ok = false;
+	}
+	ufs_close(fd);
+	ufs_delete(name);
+	return NULL;
+}
+
+/** Reads the shared file at random positions and by its own cursor. */
+static void *
+thread_test_reader_f(void *arg)
+{
+	struct thread_test_worker *w = arg;
+	int fd = ufs_open("shared", UFS_READ_ONLY);
+	uint64_t seed = w->id + 1;
+	char buf[100];
+	for (int i = 0; i < THREAD_TEST_OP_COUNT && w->is_ok; ++i) {
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		size_t pos = (seed >> 33) %
+			(THREAD_TEST_FILE_SIZE - sizeof(buf));
+		if (ufs_pread(fd, buf, sizeof(buf), pos) != sizeof(buf) ||
+		    buf[0] != thread_test_pattern(pos) ||
+		    buf[99] != thread_test_pattern(pos + 99))
+			w->is_ok = false;
+	}
+	ufs_close(fd);
+	return NULL;
+}
+
+/**
+ * Opens, clones, deletes and compacts the files in parallel with the
+ * others.
+ */
+static void *
+thread_test_cloner_f(void *arg)
+{
+	struct thread_test_worker *w = arg;
+	char buf[100];
+	for (int i = 0; i < THREAD_TEST_OP_COUNT / 10 && w->is_ok; ++i) {
+		if (ufs_clone("shared", "clone") != 0) {
+			w->is_ok = false;
+			break;
+		}
+		int fd = ufs_open("clone", 0);
+		if (ufs_pwrite(fd, "X", 1, i) != 1 ||
+		    ufs_pread(fd, buf, 2, i) != 2 || buf[0] != 'X' ||
+		    buf[1] != thread_test_pattern(i + 1))
+			w->is_ok = false;
+		ufs_close(fd);
+		if (i % 2 == 0)
+			ufs_delete("clone");
+		/* The readers keep most of the shared file hot. */
+		if (i % 100 == 0)
+			ufs_compact();
+	}
+	ufs_delete("clone");
+	return NULL;
+}
+
+static void
+test_threads(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("shared", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	char buf[4096];
+	for (size_t pos = 0; pos < THREAD_TEST_FILE_SIZE; pos += sizeof(buf)) {
+		for (size_t i = 0; i < sizeof(buf); ++i)
+			buf[i] = thread_test_pattern(pos + i);
+		unit_fail_if(ufs_write(fd, buf, sizeof(buf)) != sizeof(buf));
+	}
+
+	struct thread_test_worker workers[THREAD_TEST_WRITER_COUNT +
+					  THREAD_TEST_READER_COUNT + 1];
+	int count = sizeof(workers) / sizeof(workers[0]);
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < count; ++i) {
+		struct thread_test_worker *w = &workers[i];
+		w->id = i;
+		w->is_ok = true;
+		void *(*f)(void *) = thread_test_cloner_f;
+		if (i < THREAD_TEST_WRITER_COUNT)
+			f = thread_test_writer_f;
+		else if (i < THREAD_TEST_WRITER_COUNT +
+			 THREAD_TEST_READER_COUNT)
+			f = thread_test_reader_f;
+		unit_fail_if(pthread_create(&w->thread, NULL, f, w) != 0);
+	}
+	bool is_ok = true;
+	for (int i = 0; i < count; ++i) {
+		pthread_join(workers[i].thread, NULL);
+		is_ok = is_ok && workers[i].is_ok;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	unit_check(is_ok, "all the threads saw the right data");
+
+	double sec = end.tv_sec - start.tv_sec +
+		(end.tv_nsec - start.tv_nsec) / 1e9;
+	long op_count = (THREAD_TEST_WRITER_COUNT * 2 +
+			 THREAD_TEST_READER_COUNT) * THREAD_TEST_OP_COUNT;
+	unit_msg("%d threads, %.0f ops/sec", count, op_count / sec);
+
+	struct ufs_stat st;
+	ufs_stat(&st);
+	unit_check(st.file_count == 1, "only the shared file is left");
+	unit_check(st.data_size == THREAD_TEST_FILE_SIZE,
+		   "and it is not changed");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("shared") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_append(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("log", UFS_CREATE | UFS_APPEND);
+	unit_fail_if(fd == -1);
+	int other = ufs_open("log", 0);
+	char buf[6000];
+	bool is_ok = true;
+	for (int i = 0; i < 1000; ++i)
+		is_ok = is_ok && ufs_write(fd, "0123456789", i % 10 + 1) ==
+			i % 10 + 1;
+	unit_check(is_ok, "append");
+	unit_check(ufs_read(other, buf, sizeof(buf)) == 5500 &&
+		   memcmp(buf, "001", 3) == 0, "the others see it");
+	unit_check(ufs_read(fd, buf, 10) == 10 && memcmp(buf, "0010120123",
+		   10) == 0, "the appends don't move the position");
+
+	unit_fail_if(ufs_write(other, "abc", 3) != 3);
+	unit_fail_if(ufs_write(fd, "XY", 2) != 2);
+	unit_check(ufs_pread(other, buf, 10, 5498) == 7 &&
+		   memcmp(buf, "89abcXY", 7) == 0,
+		   "append after a write by another descriptor");
+	unit_fail_if(ufs_pwrite(fd, "Z", 1, 0) != 1);
+	unit_check(ufs_pread(other, buf, 2, 0) == 2 &&
+		   memcmp(buf, "Z0", 2) == 0, "pwrite is at the offset");
+	unit_fail_if(ufs_resize(other, 5) != 0);
+	struct iovec iov[2] = {{(void *)"ab", 2}, {(void *)"cd", 2}};
+	unit_fail_if(ufs_writev(fd, iov, 2) != 4);
+	unit_check(ufs_pread(other, buf, 100, 0) == 9 &&
+		   memcmp(buf, "Z0101abcd", 9) == 0, "append after a shrink");
+
+	/* The tail is in a big block, then the next one is added. */
+	static char big[3000 * 1000];
+	memset(big, 'b', sizeof(big));
+	unit_fail_if(ufs_write(fd, big, sizeof(big)) != sizeof(big));
+	for (int i = 0; i < 100 * 1000; ++i)
+		unit_fail_if(ufs_write(fd, "0123456789", 10) != 10);
+	is_ok = ufs_pread(other, buf, 9, 0) == 9;
+	for (size_t pos = 9 + sizeof(big); pos < 9 + sizeof(big) + 1000000;
+	     pos += 1000) {
+		is_ok = is_ok && ufs_pread(other, buf, 1000, pos) == 1000 &&
+			memcmp(buf, "0123456789", 10) == 0 &&
+			memcmp(buf + 990, "0123456789", 10) == 0;
+	}
+	unit_check(is_ok, "many appends to the tail");
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_close(other) != 0);
+	unit_fail_if(ufs_delete("log") != 0);
+
+	unit_test_finish();
+}
+
+enum {
+	APPEND_TEST_THREAD_COUNT = 4,
+	APPEND_TEST_RECORD_COUNT = 50000,
+	APPEND_TEST_RECORD_SIZE = 16,
+};
+
+/** Appends the numbered records to its own file and the shared one. */
+static void *
+append_test_writer_f(void *arg)
+{
+	struct thread_test_worker *w = arg;
+	char name[32];
+	sprintf(name, "append%d", w->id);
+	int own = ufs_open(name, UFS_CREATE | UFS_APPEND);
+	int shared = ufs_open("append_shared", UFS_APPEND);
+	char rec[APPEND_TEST_RECORD_SIZE];
+	for (int i = 0; i < APPEND_TEST_RECORD_COUNT; ++i) {
+		snprintf(rec, sizeof(rec), "%d %013d", w->id, i);
+		if (ufs_write(own, rec, sizeof(rec)) != sizeof(rec) ||
+		    ufs_write(shared, rec, sizeof(rec)) != sizeof(rec))
+			w->is_ok = false;
+	}
+	ufs_close(own);
+	ufs_close(shared);
+	return NULL;
+}
+
+/** Reads the shared file, there are only whole records in it. */
+static void *
+append_test_reader_f(void *arg)
+{
+	struct thread_test_worker *w = arg;
+	int fd = ufs_open("append_shared", UFS_READ_ONLY);
+	char rec[APPEND_TEST_RECORD_SIZE];
+	size_t pos = 0;
+	size_t end = (size_t)APPEND_TEST_THREAD_COUNT *
+		     APPEND_TEST_RECORD_COUNT * sizeof(rec);
+	while (pos < end && w->is_ok) {
+		ssize_t rc = ufs_pread(fd, rec, sizeof(rec), pos);
+		if (rc == 0)
+			continue;
+		if (rc != sizeof(rec) || rec[1] != ' ' ||
+		    rec[sizeof(rec) - 1] != 0)
+			w->is_ok = false;
+		pos += rc;
+	}
+	ufs_close(fd);
+	return NULL;
+}
+
+static void
+test_append_threads(void)
+{
+	unit_test_start();
+
+	ufs_close(ufs_open("append_shared", UFS_CREATE));
+	struct thread_test_worker workers[APPEND_TEST_THREAD_COUNT + 1];
+	int count = sizeof(workers) / sizeof(workers[0]);
+	for (int i = 0; i < count; ++i) {
+		struct thread_test_worker *w = &workers[i];
+		w->id = i;
+		w->is_ok = true;
+		void *(*f)(void *) = i < APPEND_TEST_THREAD_COUNT ?
+				     append_test_writer_f :
+				     append_test_reader_f;
+		unit_fail_if(pthread_create(&w->thread, NULL, f, w) != 0);
+	}
+	bool is_ok = true;
+	for (int i = 0; i < count; ++i) {
+		pthread_join(workers[i].thread, NULL);
+		is_ok = is_ok && workers[i].is_ok;
+	}
+	unit_check(is_ok, "the appends are whole");
+
+	/* Each writer's records are in its order in both files. */
+	int next[APPEND_TEST_THREAD_COUNT] = {0};
+	char rec[APPEND_TEST_RECORD_SIZE];
+	int fd = ufs_open("append_shared", 0);
+	while (is_ok && ufs_read(fd, rec, sizeof(rec)) == sizeof(rec)) {
+		int id, i;
+		is_ok = sscanf(rec, "%d %d", &id, &i) == 2 && id >= 0 &&
+			id < APPEND_TEST_THREAD_COUNT && next[id]++ == i;
+	}
+	ufs_close(fd);
+	for (int id = 0; id < APPEND_TEST_THREAD_COUNT; ++id) {
+		is_ok = is_ok && next[id] == APPEND_TEST_RECORD_COUNT;
+		char name[32];
+		sprintf(name, "append%d", id);
+		fd = ufs_open(name, 0);
+		for (int i = 0; i < APPEND_TEST_RECORD_COUNT && is_ok; ++i) {
+			char expected[APPEND_TEST_RECORD_SIZE];
+			snprintf(expected, sizeof(expected), "%d %013d", id, i);
+			is_ok = ufs_read(fd, rec, sizeof(rec)) == sizeof(rec) &&
+				memcmp(rec, expected, sizeof(rec)) == 0;
+		}
+		ufs_close(fd);
+		ufs_delete(name);
+	}
+	unit_check(is_ok, "in the order of each writer");
+	ufs_delete("append_shared");
+
+	unit_test_finish();
+}
+
 int
 main(int argc, char **argv)
 {
@@ -493,6 +1569,18 @@ main(int argc, char **argv)
 	test_max_file_size();
 	test_rights();
 	test_resize();
+	test_sparse();
+	test_vectored_and_positional_io();
+	test_clone();
+	test_map_range();
+	test_image();
+	test_dirs();
+	test_compact();
+	test_huge_pages();
+	test_aio();
+	test_threads();
+	test_append();
+	test_append_threads();
 
 	/* Free the memory to make the memory leak detector happy. */
 	ufs_destroy();
@@ -1,53 +1,369 @@
 #include "userfs.h"
+#include "hugemem.h"
+#include "lz.h"
+#include "slab.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 enum {
 	BLOCK_SIZE = 512,
 	MAX_FILE_SIZE = 1024 * 1024 * 100,
+	/**
+	 * Each next block of a file is twice bigger than the previous
+	 * one, until it is BLOCK_SIZE << BLOCK_MAX_ORDER. Then all the
+	 * blocks are of this size. So a small file takes little
+	 * memory, and a 100MB file is only ~110 blocks instead of
+	 * 200k ones of BLOCK_SIZE.
+	 */
+	BLOCK_MAX_ORDER = 11,
+	/** Size of the first blocks, which grow. */
+	BLOCK_GROWING_SIZE = BLOCK_SIZE * ((1 << BLOCK_MAX_ORDER) - 1),
+	FILE_INDEX_MIN_SIZE = 64,
+	/**
+	 * Memory of the blocks up to BLOCK_SIZE << BLOCK_SLAB_MAX_ORDER
+	 * is taken from the slab caches, the bigger blocks are rare
+	 * and are allocated with malloc(). Or from the huge page slab
+	 * caches, see ufs_set_huge_pages().
+	 */
+	BLOCK_SLAB_MAX_ORDER = 6,
+	BLOCK_HUGE_CACHE_COUNT = BLOCK_MAX_ORDER - BLOCK_SLAB_MAX_ORDER,
+	/** The image is compacted when it has more garbage than this. */
+	IMAGE_GARBAGE_MIN = 1024 * 1024,
+	/** Buffers per write of the image, IOV_MAX of Linux. */
+	IMAGE_IOV_MAX = 1024,
+	/** Directory prefixes remembered by the path lookup. */
+	DCACHE_SIZE = 256,
+	/** Longer prefixes are always looked up name by name. */
+	DCACHE_KEY_MAX = 116,
+	/**
+	 * Extents are compressed in frames of up to this many bytes,
+	 * which are decompressed separately. The cold blocks smaller
+	 * than it are merged into one frame, a bigger block is an
+	 * extent of several frames.
+	 */
+	EXTENT_FRAME_SIZE = 64 * 1024,
+	EXTENT_MAX_FRAME_COUNT =
+		(BLOCK_SIZE << BLOCK_MAX_ORDER) / EXTENT_FRAME_SIZE,
 };
 
-/** Global error code. Set from any function on any error. */
-static enum ufs_error_code ufs_error_code = UFS_ERR_NO_ERR;
+/**
+ * All the functions except ufs_destroy() can be called from any
+ * threads. The file list, the directories and the descriptor table
+ * are protected by one lock, which is taken only for lookups and
+ * changes of them. The data of each file is protected by its own
+ * reader-writer lock, so readers of one file don't block each
+ * other and writers of different files don't block each other.
+ * Lock order: the table lock, then a descriptor lock, then file
+ * locks by their addresses.
+ */
+
+/** Error code of the thread. Set from any function on any error. */
+static __thread enum ufs_error_code ufs_error_code = UFS_ERR_NO_ERR;
+
+/**
+ * Consecutive cold blocks of a file, compressed together by
+ * ufs_compact().
+ */
+struct extent {
+	/**
+	 * Number of the blocks in it and of the file caches having it
+	 * decompressed. Atomic, as the blocks' one.
+	 */
+	int refs;
+	/** Size of the data when decompressed. */
+	int size;
+	/** Size of the frame offsets and the frames. */
+	int compressed_size;
+	int frame_count;
+	/**
+	 * Offsets of the frames in the data following the array, and
+	 * the data end.
+	 */
+	int frame_offsets[];
+};
 
+/**
+ * A block can be shared by several files after ufs_clone(). Then it
+ * is copied when one of them writes into it.
+ */
 struct block {
-	/** Block memory. */
+	/** Block memory, NULL if the block is compressed. */
 	char *memory;
-	/** How many bytes are occupied. */
-	int occupied;
-	/** Next block in the file. */
-	struct block *next;
-	/** Previous block in the file. */
-	struct block *prev;
+	/** Size of the memory. Depends on the block number in the file. */
+	int capacity;
+	/**
+	 * Number of the files having the block. Atomic, because the
+	 * files can be locked by different threads.
+	 */
+	int refs;
+	/**
+	 * The memory is in a mounted image. It is read-only, and is
+	 * copied on the first write like a shared block.
+	 */
+	bool is_mapped;
+	/** The compression didn't save enough, not to retry it. */
+	bool is_incompressible;
+	/** The memory is from block_huge_caches. */
+	bool is_huge;
+	/** ufs_compact() epoch of the last read or write. */
+	uint32_t access_epoch;
+	/** Extent of the data when compressed, and the offset in it. */
+	struct extent *extent;
+	int extent_offset;
+};
+
+/** A file or a directory in its parent directory. */
+struct dentry {
+	/** Name in the parent, the last part of the owner's path. */
+	const char *name;
+	/** Hash of the name. */
+	uint32_t hash;
+	bool is_dir;
+};
 
-	/* PUT HERE OTHER MEMBERS */
+/**
+ * Names of a directory. Open addressing with linear probing, the
+ * size is a power of 2 and is kept at least twice bigger than the
+ * count.
+ */
+struct dentry_index {
+	struct dentry **slots;
+	uint32_t size;
+	uint32_t count;
+};
+
+/**
+ * Each directory has its own index, so a lookup costs a probe per
+ * name of the path, whatever is the total count of the files.
+ */
+struct dir {
+	/** Full path without the leading slash, "" for the root. */
+	char *path;
+	struct dentry dentry;
+	struct dir *parent;
+	/** The files and the subdirectories. */
+	struct dentry_index index;
+	/** Directories are stored in a double-linked list. */
+	struct dir *next;
+	struct dir *prev;
 };
 
 struct file {
-	/** Double-linked list of file blocks. */
-	struct block *block_list;
-	/**
-	 * Last block in the list above for fast access to the end
-	 * of file.
-	 */
-	struct block *last_block;
 	/** How many file descriptors are opened on the file. */
 	int refs;
-	/** File name. */
+	/**
+	 * Full path of the file without the leading slash, with one
+	 * slash between the names.
+	 */
 	char *name;
+	struct dentry dentry;
+	/** Directory of the file, NULL if it is deleted. */
+	struct dir *parent;
 	/** Files are stored in a double-linked list. */
 	struct file *next;
 	struct file *prev;
 
-	/* PUT HERE OTHER MEMBERS */
+	/**
+	 * The file blocks by their numbers. Since the block sizes
+	 * depend only on the numbers, the block of any file position
+	 * is found in O(1). NULL is a hole, which is read as zeros and
+	 * is allocated on the first write.
+	 */
+	struct block **blocks;
+	/** Number of the blocks in the array. */
+	int block_count;
+	/** Size of the blocks array. */
+	int block_array_size;
+	/** Size of all the blocks, with the holes. */
+	size_t capacity;
+	/** Size of the allocated blocks. */
+	size_t block_size;
+	/**
+	 * Size of the data. Atomic while the append tail is armed,
+	 * otherwise protected by the lock.
+	 */
+	size_t size;
+	/**
+	 * The free space of the last block, where the UFS_APPEND writes
+	 * copy without the file lock. They reserve their bytes by moving
+	 * the reserved end, and then publish them by moving the size in
+	 * the order of the reservations. The tail is armed by an append
+	 * under the lock, and is disarmed by whatever takes the lock
+	 * next: see file_lock_read() and file_lock_write().
+	 */
+	struct block *tail_block;
+	size_t tail_start;
+	/** Atomic, is read before the reservation. */
+	size_t tail_end;
+	/**
+	 * The reserved end of the data with FILE_TAIL_ARMED, when the
+	 * tail is armed. It stays without the flag till the appends in
+	 * flight are published, then it is 0. Atomic.
+	 */
+	uint64_t tail_reserved;
+	/**
+	 * The file is deleted, but still has opened descriptors. It is
+	 * not in the file list anymore.
+	 */
+	bool is_deleted;
+	/** Opened descriptors of the file. */
+	struct filedesc *desc_list;
+	/**
+	 * Protects the data of the file and its descriptor list. Taken
+	 * via file_lock_read() and file_lock_write().
+	 */
+	pthread_rwlock_t lock;
+	/**
+	 * Offset of the file data in the image, when the image has the
+	 * same data. 0 when the file was changed or was never synced.
+	 */
+	size_t image_offset;
+	/** Is incremented on each change of the data. */
+	uint64_t change_count;
+	/**
+	 * The extent frame of the last read of the compressed data and
+	 * its decompressed copy, so the reads of it in a row decompress
+	 * it once. Dropped by ufs_compact() if unused since the previous
+	 * one. Protected by its mutex, since the readers share the file
+	 * lock.
+	 */
+	struct extent *cache_extent;
+	int cache_frame;
+	/** EXTENT_FRAME_SIZE bytes, allocated on the first read. */
+	char *cache_data;
+	uint32_t cache_epoch;
+	pthread_mutex_t cache_lock;
 };
 
 /** List of all files. */
 static struct file *file_list = NULL;
 
+static const uint64_t FILE_TAIL_ARMED = (uint64_t)1 << 63;
+
+static char root_path[] = "";
+/**
+ * The names without slashes are in the root, so the flat file
+ * system of before stays the same. Deleted files are not in the
+ * directories, even if are still opened.
+ */
+static struct dir root_dir = {
+	.path = root_path,
+	.dentry = {.name = root_path, .is_dir = true},
+};
+/** List of all directories except the root. */
+static struct dir *dir_list = NULL;
+static size_t dir_count = 0;
+
+/**
+ * Directories of the recently looked up path prefixes, so a lookup
+ * in a hot directory is one probe whatever is its depth. Direct
+ * mapped by the hash of the prefix as given, with all its slashes.
+ * An entry is valid only in the generation it was made in, which
+ * changes when a directory is removed. Protected by the table lock
+ * taken for writing.
+ */
+struct dcache_entry {
+	uint64_t gen;
+	struct dir *dir;
+	uint32_t hash;
+	uint32_t len;
+	char key[DCACHE_KEY_MAX];
+};
+
+static struct dcache_entry dcache[DCACHE_SIZE];
+/** Starts from 1 so the zeroed entries are invalid. */
+static uint64_t dcache_gen = 1;
+
+static struct slab_cache block_cache =
+	SLAB_CACHE_INITIALIZER(sizeof(struct block));
+static struct slab_cache file_cache =
+	SLAB_CACHE_INITIALIZER(sizeof(struct file));
+static struct slab_cache dir_cache =
+	SLAB_CACHE_INITIALIZER(sizeof(struct dir));
+/** Memory of the blocks by their orders. */
+static struct slab_cache block_memory_caches[BLOCK_SLAB_MAX_ORDER + 1] = {
+	SLAB_CACHE_INITIALIZER(BLOCK_SIZE << 0),
+	SLAB_CACHE_INITIALIZER(BLOCK_SIZE << 1),
+	SLAB_CACHE_INITIALIZER(BLOCK_SIZE << 2),
+	SLAB_CACHE_INITIALIZER(BLOCK_SIZE << 3),
+	SLAB_CACHE_INITIALIZER(BLOCK_SIZE << 4),
+	SLAB_CACHE_INITIALIZER(BLOCK_SIZE << 5),
+	SLAB_CACHE_INITIALIZER(BLOCK_SIZE << 6),
+};
+/**
+ * Memory of the blocks bigger than the slab ones when they are
+ * mapped by hugemem_map(), by their orders above
+ * BLOCK_SLAB_MAX_ORDER.
+ */
+static struct slab_cache block_huge_caches[BLOCK_HUGE_CACHE_COUNT] = {
+	SLAB_CACHE_INITIALIZER(BLOCK_SIZE << 7),
+	SLAB_CACHE_INITIALIZER(BLOCK_SIZE << 8),
+	SLAB_CACHE_INITIALIZER(BLOCK_SIZE << 9),
+	SLAB_CACHE_INITIALIZER(BLOCK_SIZE << 10),
+	SLAB_CACHE_INITIALIZER(BLOCK_SIZE << 11),
+};
+/** Flags of ufs_set_huge_pages(). Atomic. */
+static int block_huge_flags = 0;
+/** Memory of the blocks bigger than the slab ones. */
+static size_t block_large_size = 0;
+/** Memory of the extents, and the sizes of their data uncompressed. */
+static size_t extent_size = 0;
+static size_t extent_data_size = 0;
+/** Memory of the decompressed extents in the file caches. */
+static size_t extent_cache_size = 0;
+/**
+ * Is incremented by each ufs_compact(). The blocks not used since
+ * the previous epoch are cold.
+ */
+static uint32_t compact_epoch = 0;
+
+/** Data of the holes for ufs_map_range() and the image. */
+static char block_zeros[BLOCK_SIZE << BLOCK_MAX_ORDER];
+
+/** Protects the files and the descriptors tables. */
+static pthread_rwlock_t table_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/** Position in a file. */
+struct file_cursor {
+	size_t pos;
+	/**
+	 * Number of the block which had the position last time, and
+	 * offset of the block in the file. A number stays valid while
+	 * the file has such a block, even if it was dropped and
+	 * allocated again.
+	 */
+	int block_index;
+	size_t block_start;
+};
+
 struct filedesc {
 	struct file *file;
 
-	/* PUT HERE OTHER MEMBERS */
+	/** Bitwise combination of open_flags. */
+	int flags;
+	/**
+	 * Never behind the file size. Protected by the file lock for
+	 * writing, or by both the file lock for reading and the
+	 * descriptor lock, when the descriptor is used by several
+	 * threads.
+	 */
+	struct file_cursor cursor;
+	pthread_mutex_t lock;
+	/** Descriptors of one file are stored in a double-linked list. */
+	struct filedesc *next;
+	struct filedesc *prev;
 };
 
 /**
@@ -60,64 +376,1530 @@ static struct filedesc **file_descriptors = NULL;
 static int file_descriptor_count = 0;
 static int file_descriptor_capacity = 0;
 
+static struct slab_cache filedesc_cache =
+	SLAB_CACHE_INITIALIZER(sizeof(struct filedesc));
+
 enum ufs_error_code
 ufs_errno()
 {
 	return ufs_error_code;
 }
 
+static int
+block_order(int index)
+{
+	return index < BLOCK_MAX_ORDER ? index : BLOCK_MAX_ORDER;
+}
+
+/** Size of the block with the given number in a file. */
+static int
+block_capacity(int index)
+{
+	return BLOCK_SIZE << block_order(index);
+}
+
+/** Offset of the block with the given number in a file. */
+static size_t
+block_start(int index)
+{
+	if (index < BLOCK_MAX_ORDER)
+		return (size_t)BLOCK_SIZE * ((1 << index) - 1);
+	return BLOCK_GROWING_SIZE +
+		(size_t)(index - BLOCK_MAX_ORDER) * (BLOCK_SIZE << BLOCK_MAX_ORDER);
+}
+
+/** Number of the block with the given file position. */
+static int
+block_index(size_t pos)
+{
+	if (pos < BLOCK_GROWING_SIZE)
+		return 31 - __builtin_clz(pos / BLOCK_SIZE + 1);
+	return BLOCK_MAX_ORDER +
+		(pos - BLOCK_GROWING_SIZE) / (BLOCK_SIZE << BLOCK_MAX_ORDER);
+}
+
+/** A new block to be the block with the given number in a file. */
+static struct block *
+block_new(int index)
+{
+	struct block *b = slab_alloc(&block_cache);
+	int order = block_order(index);
+	b->capacity = block_capacity(index);
+	b->refs = 1;
+	b->is_mapped = false;
+	b->is_incompressible = false;
+	b->is_huge = false;
+	b->access_epoch = __atomic_load_n(&compact_epoch, __ATOMIC_RELAXED);
+	b->extent = NULL;
+	b->extent_offset = 0;
+	if (order <= BLOCK_SLAB_MAX_ORDER) {
+		b->memory = slab_alloc(&block_memory_caches[order]);
+		return b;
+	}
+	if (__atomic_load_n(&block_huge_flags, __ATOMIC_RELAXED) != 0) {
+		int i = order - BLOCK_SLAB_MAX_ORDER - 1;
+		b->memory = slab_alloc(&block_huge_caches[i]);
+		b->is_huge = true;
+	} else {
+		b->memory = malloc(b->capacity);
+	}
+	__atomic_add_fetch(&block_large_size, b->capacity, __ATOMIC_RELAXED);
+	return b;
+}
+
+static const char *
+extent_data(const struct extent *e)
+{
+	return (const char *)&e->frame_offsets[e->frame_count + 1];
+}
+
+static void
+extent_unref(struct extent *e)
+{
+	if (__atomic_sub_fetch(&e->refs, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+	__atomic_sub_fetch(&extent_size, sizeof(*e) + e->compressed_size,
+			   __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&extent_data_size, e->size, __ATOMIC_RELAXED);
+	free(e);
+}
+
+/** Free the memory of the block with the given number in a file. */
+static void
+block_free_memory(struct block *b, int index)
+{
+	int order = block_order(index);
+	if (order <= BLOCK_SLAB_MAX_ORDER) {
+		slab_free(&block_memory_caches[order], b->memory);
+	} else {
+		int i = order - BLOCK_SLAB_MAX_ORDER - 1;
+		if (b->is_huge)
+			slab_free(&block_huge_caches[i], b->memory);
+		else
+			free(b->memory);
+		__atomic_sub_fetch(&block_large_size, b->capacity,
+				   __ATOMIC_RELAXED);
+	}
+	b->memory = NULL;
+	b->is_huge = false;
+}
+
+/** Drop a reference to the block with the given number in a file. */
+static void
+block_unref(struct block *b, int index)
+{
+	if (__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+	if (b->extent != NULL) {
+		extent_unref(b->extent);
+	} else if (b->is_mapped) {
+		/* The image is unmapped only by ufs_destroy(). */
+	} else {
+		block_free_memory(b, index);
+	}
+	slab_free(&block_cache, b);
+}
+
+/** Mark the block used now, so it is not cold. */
+static inline void
+block_touch(struct block *b)
+{
+	uint32_t epoch = __atomic_load_n(&compact_epoch, __ATOMIC_RELAXED);
+	/* The readers of the file can touch it concurrently. */
+	if (__atomic_load_n(&b->access_epoch, __ATOMIC_RELAXED) != epoch)
+		__atomic_store_n(&b->access_epoch, epoch, __ATOMIC_RELAXED);
+}
+
+static void
+file_reserve_blocks(struct file *f, int count)
+{
+	if (count <= f->block_array_size)
+		return;
+	while (f->block_array_size < count)
+		f->block_array_size = f->block_array_size * 2 + 8;
+	f->blocks = realloc(f->blocks, f->block_array_size *
+			    sizeof(f->blocks[0]));
+}
+
+/** Append a new block to the file end. */
+static struct block *
+file_append_block(struct file *f)
+{
+	struct block *b = block_new(f->block_count);
+	file_reserve_blocks(f, f->block_count + 1);
+	f->blocks[f->block_count++] = b;
+	f->capacity += b->capacity;
+	f->block_size += b->capacity;
+	return b;
+}
+
+/** Drop the last block of the file. */
+static void
+file_pop_block(struct file *f)
+{
+	struct block *b = f->blocks[--f->block_count];
+	f->capacity -= block_capacity(f->block_count);
+	if (b != NULL) {
+		if (b->extent == NULL)
+			f->block_size -= b->capacity;
+		block_unref(b, f->block_count);
+	}
+}
+
+/** Decompress the extent frame into the file's cache. */
+static void
+file_cache_frame(struct file *f, struct extent *e, int frame)
+{
+	if (f->cache_data == NULL) {
+		f->cache_data = malloc(EXTENT_FRAME_SIZE);
+		__atomic_add_fetch(&extent_cache_size, EXTENT_FRAME_SIZE,
+				   __ATOMIC_RELAXED);
+	}
+	int begin = e->frame_offsets[frame];
+	int size = e->size - frame * EXTENT_FRAME_SIZE;
+	if (size > EXTENT_FRAME_SIZE)
+		size = EXTENT_FRAME_SIZE;
+	int rc = lz_decompress(extent_data(e) + begin,
+			       e->frame_offsets[frame + 1] - begin,
+			       f->cache_data, size);
+	assert(rc == size);
+	(void)rc;
+	if (f->cache_extent != e) {
+		__atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+		if (f->cache_extent != NULL)
+			extent_unref(f->cache_extent);
+		f->cache_extent = e;
+	}
+	f->cache_frame = frame;
+}
+
+/**
+ * Copy the data of a compressed block. Its extent frames are
+ * decompressed into the file's cache, unless they are there already.
+ */
+static void
+file_read_compressed(struct file *f, const struct block *b, int offset,
+		     char *buf, size_t size)
+{
+	struct extent *e = b->extent;
+	size_t pos = b->extent_offset + offset;
+	pthread_mutex_lock(&f->cache_lock);
+	while (size > 0) {
+		int frame = pos / EXTENT_FRAME_SIZE;
+		if (f->cache_extent != e || f->cache_frame != frame)
+			file_cache_frame(f, e, frame);
+		size_t frame_offset = pos % EXTENT_FRAME_SIZE;
+		size_t n = EXTENT_FRAME_SIZE - frame_offset;
+		if (n > size)
+			n = size;
+		memcpy(buf, f->cache_data + frame_offset, n);
+		buf += n;
+		pos += n;
+		size -= n;
+	}
+	f->cache_epoch = __atomic_load_n(&compact_epoch, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&f->cache_lock);
+}
+
+/** Free the decompressed extent of the file. */
+static void
+file_drop_cache(struct file *f)
+{
+	if (f->cache_extent != NULL)
+		extent_unref(f->cache_extent);
+	if (f->cache_data != NULL) {
+		free(f->cache_data);
+		__atomic_sub_fetch(&extent_cache_size, EXTENT_FRAME_SIZE,
+				   __ATOMIC_RELAXED);
+	}
+	f->cache_extent = NULL;
+	f->cache_data = NULL;
+}
+
+/** An unshared uncompressed copy of the compressed block. */
+static struct block *
+file_inflate_block(struct file *f, int index)
+{
+	struct block *b = f->blocks[index];
+	struct block *copy = block_new(index);
+	/*
+	 * The blocks are packed in the extent with their data sizes at
+	 * the compaction. The file size can be bigger by now, when it is
+	 * being extended, and the rest of the copy is written then.
+	 */
+	size_t size = b->extent->size - b->extent_offset;
+	if (size > (size_t)copy->capacity)
+		size = copy->capacity;
+	file_read_compressed(f, b, 0, copy->memory, size);
+	return copy;
+}
+
+/**
+ * Get the block with the given number to write into it. If it is
+ * shared with other files, the file gets its own copy. A hole gets
+ * a zeroed block.
+ */
+static struct block *
+file_block_writable(struct file *f, int index)
+{
+	struct block *b = f->blocks[index];
+	if (b == NULL) {
+		b = block_new(index);
+		memset(b->memory, 0, b->capacity);
+		f->blocks[index] = b;
+		f->block_size += b->capacity;
+		return b;
+	}
+	if (b->extent != NULL) {
+		struct block *copy = file_inflate_block(f, index);
+		block_unref(b, index);
+		f->blocks[index] = copy;
+		f->block_size += copy->capacity;
+		return copy;
+	}
+	/*
+	 * The other owners only read the block, and drop it after
+	 * copying. When it is the last one, it is not shared anymore.
+	 */
+	if (__atomic_load_n(&b->refs, __ATOMIC_ACQUIRE) == 1 &&
+	    !b->is_mapped) {
+		block_touch(b);
+		b->is_incompressible = false;
+		return b;
+	}
+	struct block *copy = block_new(index);
+	size_t start = block_start(index);
+	size_t size = f->size - start;
+	if (size > (size_t)b->capacity)
+		size = b->capacity;
+	memcpy(copy->memory, b->memory, size);
+	block_unref(b, index);
+	f->blocks[index] = copy;
+	return copy;
+}
+
+static void
+file_delete(struct file *f)
+{
+	while (f->block_count > 0)
+		file_pop_block(f);
+	file_drop_cache(f);
+	free(f->blocks);
+	free(f->name);
+	pthread_rwlock_destroy(&f->lock);
+	pthread_mutex_destroy(&f->cache_lock);
+	slab_free(&file_cache, f);
+}
+
+/**
+ * Free the file memory which is not from the slab caches, when all
+ * the caches are going to be destroyed anyway.
+ */
+static void
+file_release_heap(struct file *f)
+{
+	pthread_rwlock_destroy(&f->lock);
+	pthread_mutex_destroy(&f->cache_lock);
+	for (int i = 0; i < f->block_count; ++i) {
+		struct block *b = f->blocks[i];
+		if (b == NULL || --b->refs > 0)
+			continue;
+		if (b->extent != NULL) {
+			if (--b->extent->refs == 0)
+				free(b->extent);
+		} else if (i > BLOCK_SLAB_MAX_ORDER && !b->is_mapped &&
+			   !b->is_huge) {
+			free(b->memory);
+		}
+	}
+	if (f->cache_extent != NULL && --f->cache_extent->refs == 0)
+		free(f->cache_extent);
+	free(f->cache_data);
+	free(f->blocks);
+	free(f->name);
+}
+
+/** FNV-1a. */
+static uint32_t
+name_hash(const char *name, size_t len)
+{
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < len; ++i) {
+		h ^= (unsigned char)name[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static struct file *
+dentry_file(struct dentry *e)
+{
+	assert(!e->is_dir);
+	return (struct file *)((char *)e - offsetof(struct file, dentry));
+}
+
+static struct dir *
+dentry_dir(struct dentry *e)
+{
+	assert(e->is_dir);
+	return (struct dir *)((char *)e - offsetof(struct dir, dentry));
+}
+
+/**
+ * Slot of the entry with the name in the index, or the empty slot
+ * where it would be. The name is not 0-terminated.
+ */
+static uint32_t
+dentry_index_slot(const struct dentry_index *index, const char *name,
+		  size_t len, uint32_t hash)
+{
+	uint32_t mask = index->size - 1;
+	uint32_t i = hash & mask;
+	for (; index->slots[i] != NULL; i = (i + 1) & mask) {
+		const struct dentry *e = index->slots[i];
+		if (e->hash == hash && strncmp(e->name, name, len) == 0 &&
+		    e->name[len] == 0)
+			break;
+	}
+	return i;
+}
+
+static void
+dentry_index_grow(struct dentry_index *index)
+{
+	struct dentry **old = index->slots;
+	uint32_t old_size = index->size;
+	index->size = old_size == 0 ? FILE_INDEX_MIN_SIZE : old_size * 2;
+	index->slots = calloc(index->size, sizeof(index->slots[0]));
+	uint32_t mask = index->size - 1;
+	for (uint32_t i = 0; i < old_size; ++i) {
+		if (old[i] == NULL)
+			continue;
+		uint32_t j = old[i]->hash & mask;
+		while (index->slots[j] != NULL)
+			j = (j + 1) & mask;
+		index->slots[j] = old[i];
+	}
+	free(old);
+}
+
+/**
+ * Drop the slot from the index. The next entries of its probe
+ * sequence are shifted back, so no tombstones are needed.
+ */
+static void
+dentry_index_remove(struct dentry_index *index, uint32_t i)
+{
+	struct dentry **slots = index->slots;
+	uint32_t mask = index->size - 1;
+	uint32_t j = i;
+	while (true) {
+		j = (j + 1) & mask;
+		if (slots[j] == NULL)
+			break;
+		uint32_t k = slots[j]->hash & mask;
+		/* Can move back only if its home is not in (i, j]. */
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		slots[i] = slots[j];
+		i = j;
+	}
+	slots[i] = NULL;
+	--index->count;
+}
+
+static struct dentry *
+dentry_index_find(const struct dentry_index *index, const char *name,
+		  size_t len, uint32_t hash)
+{
+	if (index->count == 0)
+		return NULL;
+	return index->slots[dentry_index_slot(index, name, len, hash)];
+}
+
+static void
+dentry_index_add(struct dentry_index *index, struct dentry *e)
+{
+	if ((index->count + 1) * 2 > index->size)
+		dentry_index_grow(index);
+	index->slots[dentry_index_slot(index, e->name, strlen(e->name),
+				       e->hash)] = e;
+	++index->count;
+}
+
+/**
+ * Path of the name in the directory. @a name_offset is set to where
+ * the name is in it.
+ */
+static char *
+path_join(const struct dir *parent, const char *name, size_t len,
+	  size_t *name_offset)
+{
+	size_t parent_len = strlen(parent->path);
+	size_t offset = parent_len == 0 ? 0 : parent_len + 1;
+	char *path = malloc(offset + len + 1);
+	if (parent_len > 0) {
+		memcpy(path, parent->path, parent_len);
+		path[parent_len] = '/';
+	}
+	memcpy(path + offset, name, len);
+	path[offset + len] = 0;
+	*name_offset = offset;
+	return path;
+}
+
+static struct dir *
+dir_new(struct dir *parent, const char *name, size_t len, uint32_t hash)
+{
+	struct dir *d = slab_alloc(&dir_cache);
+	memset(d, 0, sizeof(*d));
+	size_t name_offset;
+	d->path = path_join(parent, name, len, &name_offset);
+	d->dentry.name = d->path + name_offset;
+	d->dentry.hash = hash;
+	d->dentry.is_dir = true;
+	d->parent = parent;
+	d->next = dir_list;
+	if (dir_list != NULL)
+		dir_list->prev = d;
+	dir_list = d;
+	++dir_count;
+	dentry_index_add(&parent->index, &d->dentry);
+	return d;
+}
+
+/** Drop the empty directory. */
+static void
+dir_delete(struct dir *d)
+{
+	assert(d->index.count == 0 && d != &root_dir);
+	struct dentry_index *index = &d->parent->index;
+	dentry_index_remove(index, dentry_index_slot(index, d->dentry.name,
+		strlen(d->dentry.name), d->dentry.hash));
+	if (d->prev != NULL)
+		d->prev->next = d->next;
+	else
+		dir_list = d->next;
+	if (d->next != NULL)
+		d->next->prev = d->prev;
+	--dir_count;
+	/* The cached prefixes could lead into it. */
+	++dcache_gen;
+	free(d->index.slots);
+	free(d->path);
+	slab_free(&dir_cache, d);
+}
+
+/**
+ * Go through the directories of the path, of @a len bytes, from the
+ * root. Missing ones are created if @a is_create is set. Returns
+ * NULL with the error code set if one is not found or is a file.
+ */
+static struct dir *
+dir_walk(const char *path, size_t len, bool is_create)
+{
+	struct dir *d = &root_dir;
+	size_t i = 0;
+	while (i < len) {
+		if (path[i] == '/') {
+			++i;
+			continue;
+		}
+		size_t end = i;
+		while (end < len && path[end] != '/')
+			++end;
+		const char *name = path + i;
+		uint32_t hash = name_hash(name, end - i);
+		struct dentry *e = dentry_index_find(&d->index, name, end - i,
+						     hash);
+		if (e == NULL) {
+			if (!is_create) {
+				ufs_error_code = UFS_ERR_NO_FILE;
+				return NULL;
+			}
+			d = dir_new(d, name, end - i, hash);
+		} else if (!e->is_dir) {
+			ufs_error_code = UFS_ERR_NOT_DIR;
+			return NULL;
+		} else {
+			d = dentry_dir(e);
+		}
+		i = end;
+	}
+	return d;
+}
+
+/** Same as dir_walk() with no creation, via the prefix cache. */
+static struct dir *
+dir_lookup(const char *path, size_t len)
+{
+	if (len == 0)
+		return &root_dir;
+	if (len > DCACHE_KEY_MAX)
+		return dir_walk(path, len, false);
+	uint32_t hash = name_hash(path, len);
+	struct dcache_entry *c = &dcache[hash & (DCACHE_SIZE - 1)];
+	if (c->gen == dcache_gen && c->hash == hash && c->len == len &&
+	    memcmp(c->key, path, len) == 0)
+		return c->dir;
+	struct dir *d = dir_walk(path, len, false);
+	if (d != NULL) {
+		c->gen = dcache_gen;
+		c->dir = d;
+		c->hash = hash;
+		c->len = len;
+		memcpy(c->key, path, len);
+	}
+	return d;
+}
+
+/**
+ * A path split into its directory and the last name. The leading,
+ * the trailing and the repeated slashes don't matter.
+ */
+struct path_parts {
+	const char *dir;
+	size_t dir_len;
+	const char *name;
+	size_t name_len;
+	uint32_t name_hash;
+};
+
+static void
+path_split(const char *path, struct path_parts *parts)
+{
+	while (*path == '/')
+		++path;
+	size_t len = strlen(path);
+	while (len > 0 && path[len - 1] == '/')
+		--len;
+	size_t i = len;
+	while (i > 0 && path[i - 1] != '/')
+		--i;
+	parts->name = path + i;
+	parts->name_len = len - i;
+	parts->name_hash = name_hash(parts->name, parts->name_len);
+	while (i > 0 && path[i - 1] == '/')
+		--i;
+	parts->dir = path;
+	parts->dir_len = i;
+}
+
+/**
+ * Find the directory of the path and the entry of the last name in
+ * it. The entry is NULL when there is no such name, and is the root
+ * itself for an empty path. Returns -1 with the error code set when
+ * the directory is not found. The table lock has to be held for
+ * writing.
+ */
+static int
+path_lookup(const char *path, struct path_parts *parts, struct dir **dir,
+	    struct dentry **entry)
+{
+	path_split(path, parts);
+	*dir = dir_lookup(parts->dir, parts->dir_len);
+	if (*dir == NULL)
+		return -1;
+	if (parts->name_len == 0) {
+		*entry = &root_dir.dentry;
+		return 0;
+	}
+	*entry = dentry_index_find(&(*dir)->index, parts->name,
+				   parts->name_len, parts->name_hash);
+	return 0;
+}
+
+static struct file *
+file_new(struct dir *parent, const char *name, size_t len, uint32_t hash)
+{
+	struct file *f = slab_alloc(&file_cache);
+	memset(f, 0, sizeof(*f));
+	size_t name_offset;
+	f->name = path_join(parent, name, len, &name_offset);
+	f->dentry.name = f->name + name_offset;
+	f->dentry.hash = hash;
+	f->parent = parent;
+	pthread_rwlock_init(&f->lock, NULL);
+	pthread_mutex_init(&f->cache_lock, NULL);
+	f->next = file_list;
+	if (file_list != NULL)
+		file_list->prev = f;
+	file_list = f;
+	dentry_index_add(&parent->index, &f->dentry);
+	return f;
+}
+
+/**
+ * Find the file of the path. Returns NULL with the error code set if
+ * there is none. Then @a dir is its directory, if that exists, and
+ * the code is UFS_ERR_NO_FILE.
+ */
+static struct file *
+file_lookup(const char *path, struct path_parts *parts, struct dir **dir)
+{
+	struct dentry *e;
+	if (path_lookup(path, parts, dir, &e) != 0) {
+		*dir = NULL;
+		return NULL;
+	}
+	if (e == NULL) {
+		ufs_error_code = UFS_ERR_NO_FILE;
+		return NULL;
+	}
+	if (e->is_dir) {
+		*dir = NULL;
+		ufs_error_code = UFS_ERR_IS_DIR;
+		return NULL;
+	}
+	return dentry_file(e);
+}
+
+/** Take the file out of the file list. */
+static void
+file_unlink(struct file *f)
+{
+	if (f->prev != NULL)
+		f->prev->next = f->next;
+	else
+		file_list = f->next;
+	if (f->next != NULL)
+		f->next->prev = f->prev;
+	f->next = NULL;
+	f->prev = NULL;
+	f->is_deleted = true;
+	struct dentry_index *index = &f->parent->index;
+	dentry_index_remove(index, dentry_index_slot(index, f->dentry.name,
+		strlen(f->dentry.name), f->dentry.hash));
+	f->parent = NULL;
+}
+
+/** Drop a reference taken by a descriptor or a clone. */
+static void
+file_unref(struct file *f)
+{
+	if (--f->refs == 0 && f->is_deleted)
+		file_delete(f);
+}
+
+/** Get the descriptor. The table lock has to be held. */
+static struct filedesc *
+filedesc_get(int fd)
+{
+	if (fd < 0 || fd >= file_descriptor_capacity ||
+	    file_descriptors[fd] == NULL) {
+		ufs_error_code = UFS_ERR_NO_FILE;
+		return NULL;
+	}
+	return file_descriptors[fd];
+}
+
+static void
+file_cursor_create(struct file_cursor *cur, size_t pos)
+{
+	cur->pos = pos;
+	cur->block_index = 0;
+	cur->block_start = 0;
+}
+
+/**
+ * Find the block with the cursor position. Returns false if the
+ * position is right after the last block.
+ */
+static bool
+file_cursor_seek(struct file_cursor *cur, struct file *f, int *offset)
+{
+	if (cur->pos >= f->capacity)
+		return false;
+	int index = cur->block_index;
+	if (index >= f->block_count || cur->pos < cur->block_start ||
+	    cur->pos - cur->block_start >= (size_t)block_capacity(index)) {
+		index = block_index(cur->pos);
+		cur->block_index = index;
+		cur->block_start = block_start(index);
+	}
+	*offset = cur->pos - cur->block_start;
+	return true;
+}
+
+/** Move the cursor to the next block from the current one. */
+static void
+file_cursor_next_block(struct file_cursor *cur)
+{
+	cur->block_start += block_capacity(cur->block_index);
+	++cur->block_index;
+}
+
+static size_t
+iov_size(const struct iovec *iov, int iovcnt)
+{
+	size_t res = 0;
+	for (int i = 0; i < iovcnt; ++i) {
+		/* Too big is too big, whatever it is exactly. */
+		if (iov[i].iov_len > SIZE_MAX - res)
+			return SIZE_MAX;
+		res += iov[i].iov_len;
+	}
+	return res;
+}
+
+/** The data is going to change, and is not the same as in the image. */
+static void
+file_touch(struct file *f)
+{
+	f->image_offset = 0;
+	++f->change_count;
+}
+
+/**
+ * Write the buffers at the cursor, which is moved to the end of
+ * the written data. The file is extended if needed. The blocks are
+ * walked once, the buffers are copied across their borders.
+ */
+static void
+file_writev(struct file *f, struct file_cursor *cur, const struct iovec *iov,
+	    int iovcnt)
+{
+	file_touch(f);
+	int offset;
+	struct block *b = NULL;
+	if (file_cursor_seek(cur, f, &offset))
+		b = file_block_writable(f, cur->block_index);
+	for (int i = 0; i < iovcnt; ++i) {
+		const char *buf = iov[i].iov_base;
+		size_t size = iov[i].iov_len;
+		size_t done = 0;
+		while (done < size) {
+			if (b == NULL) {
+				cur->block_index = f->block_count;
+				cur->block_start = f->capacity;
+				b = file_append_block(f);
+				offset = 0;
+			} else if (offset == b->capacity) {
+				file_cursor_next_block(cur);
+				b = cur->block_index < f->block_count ?
+				    file_block_writable(f, cur->block_index) :
+				    NULL;
+				offset = 0;
+				continue;
+			}
+			size_t n = b->capacity - offset;
+			if (n > size - done)
+				n = size - done;
+			memcpy(b->memory + offset, buf + done, n);
+			offset += n;
+			done += n;
+		}
+		cur->pos += size;
+	}
+	if (cur->pos > f->size)
+		f->size = cur->pos;
+}
+
+/**
+ * Let the next appends copy into the free space of the last block
+ * without the lock. The lock is held for writing.
+ */
+static void
+file_tail_arm(struct file *f)
+{
+	if (f->block_count == 0)
+		return;
+	int index = f->block_count - 1;
+	size_t start = block_start(index);
+	size_t end = start + block_capacity(index);
+	if (end > MAX_FILE_SIZE)
+		end = MAX_FILE_SIZE;
+	if (f->size < start || f->size >= end)
+		return;
+	f->tail_block = file_block_writable(f, index);
+	f->tail_start = start;
+	__atomic_store_n(&f->tail_end, end, __ATOMIC_RELAXED);
+	__atomic_store_n(&f->tail_reserved, f->size | FILE_TAIL_ARMED,
+			 __ATOMIC_RELEASE);
+}
+
+/**
+ * Stop the appends without the lock, and wait for the ones in
+ * flight. The lock is held, for reading is enough: the others
+ * holding it wait for the same appends.
+ */
+static void
+file_tail_disarm(struct file *f)
+{
+	uint64_t reserved = __atomic_fetch_and(&f->tail_reserved,
+					       ~FILE_TAIL_ARMED,
+					       __ATOMIC_ACQUIRE);
+	if (reserved == 0)
+		return;
+	reserved &= ~FILE_TAIL_ARMED;
+	while (__atomic_load_n(&f->size, __ATOMIC_ACQUIRE) != reserved)
+		sched_yield();
+	__atomic_compare_exchange_n(&f->tail_reserved, &reserved, 0, false,
+				    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+/**
+ * Append the data into the armed tail, if it fits. The order of the
+ * appends is the order of their reservations.
+ */
+static bool
+file_tail_append(struct file *f, const struct iovec *iov, int iovcnt,
+		 size_t size)
+{
+	uint64_t reserved = __atomic_load_n(&f->tail_reserved,
+					    __ATOMIC_ACQUIRE);
+	size_t pos;
+	do {
+		if ((reserved & FILE_TAIL_ARMED) == 0)
+			return false;
+		pos = reserved & ~FILE_TAIL_ARMED;
+		/*
+		 * Can be of the next arming if the reservation is
+		 * stale. Then the CAS fails, unless the tail is armed
+		 * again at the same size, having the same end.
+		 */
+		size_t end = __atomic_load_n(&f->tail_end, __ATOMIC_RELAXED);
+		if (size > end - pos)
+			return false;
+	} while (!__atomic_compare_exchange_n(&f->tail_reserved, &reserved,
+					      (pos + size) | FILE_TAIL_ARMED,
+					      true, __ATOMIC_ACQUIRE,
+					      __ATOMIC_ACQUIRE));
+	char *dst = f->tail_block->memory + (pos - f->tail_start);
+	for (int i = 0; i < iovcnt; ++i) {
+		memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+		dst += iov[i].iov_len;
+	}
+	block_touch(f->tail_block);
+	/* The previous appends are published first. */
+	while (__atomic_load_n(&f->size, __ATOMIC_ACQUIRE) != pos)
+		sched_yield();
+	__atomic_store_n(&f->size, pos + size, __ATOMIC_RELEASE);
+	return true;
+}
+
+static void
+file_lock_read(struct file *f)
+{
+	pthread_rwlock_rdlock(&f->lock);
+	file_tail_disarm(f);
+}
+
+static void
+file_lock_write(struct file *f)
+{
+	pthread_rwlock_wrlock(&f->lock);
+	file_tail_disarm(f);
+}
+
+static void
+file_unlock(struct file *f)
+{
+	pthread_rwlock_unlock(&f->lock);
+}
+
+/**
+ * Read into the buffers from the cursor, not further than the file
+ * end. Returns how many bytes were read.
+ */
+static size_t
+file_readv(struct file *f, struct file_cursor *cur, const struct iovec *iov,
+	   int iovcnt)
+{
+	size_t total = iov_size(iov, iovcnt);
+	if (total > f->size - cur->pos)
+		total = f->size - cur->pos;
+	if (total == 0)
+		return 0;
+	int offset;
+	file_cursor_seek(cur, f, &offset);
+	struct block *b = f->blocks[cur->block_index];
+	if (b != NULL)
+		block_touch(b);
+	int capacity = block_capacity(cur->block_index);
+	size_t done = 0;
+	for (int i = 0; done < total; ++i) {
+		char *buf = iov[i].iov_base;
+		size_t size = iov[i].iov_len;
+		if (size > total - done)
+			size = total - done;
+		size_t buf_done = 0;
+		while (buf_done < size) {
+			if (offset == capacity) {
+				file_cursor_next_block(cur);
+				b = f->blocks[cur->block_index];
+				if (b != NULL)
+					block_touch(b);
+				capacity = block_capacity(cur->block_index);
+				offset = 0;
+			}
+			size_t n = capacity - offset;
+			if (n > size - buf_done)
+				n = size - buf_done;
+			if (b == NULL) {
+				memset(buf + buf_done, 0, n);
+			} else if (b->extent != NULL) {
+				file_read_compressed(f, b, offset,
+						     buf + buf_done, n);
+			} else {
+				memcpy(buf + buf_done, b->memory + offset, n);
+			}
+			offset += n;
+			buf_done += n;
+		}
+		done += size;
+	}
+	cur->pos += total;
+	return total;
+}
+
+/**
+ * Extend the file with zeros. Only the garbage after the old size
+ * in its block is zeroed, the new blocks are holes.
+ */
+static void
+file_grow(struct file *f, size_t new_size)
+{
+	file_touch(f);
+	if (f->size < f->capacity && f->blocks[block_index(f->size)] != NULL) {
+		int index = block_index(f->size);
+		size_t start = block_start(index);
+		struct block *b = file_block_writable(f, index);
+		size_t end = start + b->capacity;
+		if (end > new_size)
+			end = new_size;
+		memset(b->memory + (f->size - start), 0, end - f->size);
+	}
+	int count = block_index(new_size - 1) + 1;
+	file_reserve_blocks(f, count);
+	for (; f->block_count < count; ++f->block_count) {
+		f->blocks[f->block_count] = NULL;
+		f->capacity += block_capacity(f->block_count);
+	}
+	f->size = new_size;
+}
+
+/** Drop the data after the new size. */
+static void
+file_shrink(struct file *f, size_t new_size)
+{
+	file_touch(f);
+	while (f->block_count > 0 &&
+	       block_start(f->block_count - 1) >= new_size)
+		file_pop_block(f);
+	f->size = new_size;
+}
+
+/**
+ * The descriptors behind the file end continue from the end. Their
+ * block numbers are checked on each access anyway.
+ */
+static void
+file_clamp_descriptors(struct file *f)
+{
+	for (struct filedesc *d = f->desc_list; d != NULL; d = d->next) {
+		if (d->cursor.pos > f->size)
+			d->cursor.pos = f->size;
+	}
+}
+
+/**
+ * Find the descriptor with one of the access flags. Closing of a
+ * descriptor used by another thread is not allowed, same as with
+ * the system descriptors, so the descriptor and its file stay valid
+ * after the table lock is released.
+ */
+static struct filedesc *
+filedesc_find(int fd, int access)
+{
+	pthread_rwlock_rdlock(&table_lock);
+	struct filedesc *desc = filedesc_get(fd);
+	if (desc != NULL && (desc->flags & access) == 0) {
+		ufs_error_code = UFS_ERR_NO_PERMISSION;
+		desc = NULL;
+	}
+	pthread_rwlock_unlock(&table_lock);
+	return desc;
+}
+
+/**
+ * Find the descriptor and lock its file, for writing if the access
+ * flags allow writing.
+ */
+static struct filedesc *
+filedesc_lock(int fd, int access)
+{
+	struct filedesc *desc = filedesc_find(fd, access);
+	if (desc == NULL)
+		return NULL;
+	if ((access & UFS_WRITE_ONLY) != 0)
+		file_lock_write(desc->file);
+	else
+		file_lock_read(desc->file);
+	return desc;
+}
+
+static struct filedesc *
+filedesc_lock_writable(int fd)
+{
+	return filedesc_lock(fd, UFS_WRITE_ONLY | UFS_READ_WRITE);
+}
+
+static struct filedesc *
+filedesc_lock_readable(int fd)
+{
+	return filedesc_lock(fd, UFS_READ_ONLY | UFS_READ_WRITE);
+}
+
+static void
+filedesc_unlock(struct filedesc *desc)
+{
+	file_unlock(desc->file);
+}
+
 int
 ufs_open(const char *filename, int flags)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)filename;
-	(void)flags;
-	(void)file_list;
-	(void)file_descriptors;
-	(void)file_descriptor_count;
-	(void)file_descriptor_capacity;
-	ufs_error_code = UFS_ERR_NOT_IMPLEMENTED;
-	return -1;
+	pthread_rwlock_wrlock(&table_lock);
+	struct path_parts parts;
+	struct dir *dir;
+	struct file *f = file_lookup(filename, &parts, &dir);
+	if (f == NULL) {
+		if (dir == NULL || (flags & UFS_CREATE) == 0) {
+			pthread_rwlock_unlock(&table_lock);
+			return -1;
+		}
+		f = file_new(dir, parts.name, parts.name_len,
+			     parts.name_hash);
+	}
+	int fd = 0;
+	if (file_descriptor_count == file_descriptor_capacity) {
+		int new_capacity = file_descriptor_capacity * 2;
+		if (new_capacity == 0)
+			new_capacity = 16;
+		file_descriptors = realloc(file_descriptors, new_capacity *
+					   sizeof(file_descriptors[0]));
+		memset(file_descriptors + file_descriptor_capacity, 0,
+		       (new_capacity - file_descriptor_capacity) *
+		       sizeof(file_descriptors[0]));
+		fd = file_descriptor_capacity;
+		file_descriptor_capacity = new_capacity;
+	} else {
+		while (file_descriptors[fd] != NULL)
+			++fd;
+	}
+	struct filedesc *desc = slab_alloc(&filedesc_cache);
+	desc->file = f;
+	/* No access flags means both read and write. */
+	desc->flags = flags;
+	if ((flags & (UFS_READ_ONLY | UFS_WRITE_ONLY | UFS_READ_WRITE)) == 0)
+		desc->flags |= UFS_READ_WRITE;
+	file_cursor_create(&desc->cursor, 0);
+	pthread_mutex_init(&desc->lock, NULL);
+	desc->prev = NULL;
+	file_lock_write(f);
+	desc->next = f->desc_list;
+	if (f->desc_list != NULL)
+		f->desc_list->prev = desc;
+	f->desc_list = desc;
+	file_unlock(f);
+	file_descriptors[fd] = desc;
+	++file_descriptor_count;
+	++f->refs;
+	pthread_rwlock_unlock(&table_lock);
+	return fd;
 }
 
 ssize_t
 ufs_write(int fd, const char *buf, size_t size)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)fd;
-	(void)buf;
-	(void)size;
-	ufs_error_code = UFS_ERR_NOT_IMPLEMENTED;
-	return -1;
+	struct iovec iov = {(void *)buf, size};
+	return ufs_writev(fd, &iov, 1);
+}
+
+/**
+ * Write to the end of the file. Without the lock if it fits into the
+ * armed tail, otherwise under the lock, arming the tail for the next
+ * appends.
+ */
+static ssize_t
+file_append(struct file *f, const struct iovec *iov, int iovcnt, size_t size)
+{
+	if (file_tail_append(f, iov, iovcnt, size))
+		return size;
+	file_lock_write(f);
+	if (size > MAX_FILE_SIZE - f->size) {
+		file_unlock(f);
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	struct file_cursor cur;
+	file_cursor_create(&cur, f->size);
+	file_writev(f, &cur, iov, iovcnt);
+	file_tail_arm(f);
+	file_unlock(f);
+	return size;
+}
+
+ssize_t
+ufs_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	struct filedesc *desc = filedesc_find(fd, UFS_WRITE_ONLY |
+					      UFS_READ_WRITE);
+	if (desc == NULL)
+		return -1;
+	size_t size = iov_size(iov, iovcnt);
+	if ((desc->flags & UFS_APPEND) != 0)
+		return file_append(desc->file, iov, iovcnt, size);
+	file_lock_write(desc->file);
+	if (size > MAX_FILE_SIZE - desc->cursor.pos) {
+		filedesc_unlock(desc);
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	file_writev(desc->file, &desc->cursor, iov, iovcnt);
+	filedesc_unlock(desc);
+	return size;
+}
+
+ssize_t
+ufs_pwrite(int fd, const char *buf, size_t size, size_t offset)
+{
+	if (offset > MAX_FILE_SIZE || size > MAX_FILE_SIZE - offset) {
+		/* Invalid descriptor is reported first. */
+		pthread_rwlock_rdlock(&table_lock);
+		bool is_valid = filedesc_get(fd) != NULL;
+		pthread_rwlock_unlock(&table_lock);
+		if (is_valid)
+			ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	struct filedesc *desc = filedesc_lock_writable(fd);
+	if (desc == NULL)
+		return -1;
+	struct file *f = desc->file;
+	/* A gap between the file end and the offset is zeros. */
+	if (offset > f->size)
+		file_grow(f, offset);
+	struct file_cursor cur;
+	file_cursor_create(&cur, offset);
+	struct iovec iov = {(void *)buf, size};
+	file_writev(f, &cur, &iov, 1);
+	filedesc_unlock(desc);
+	return size;
 }
 
 ssize_t
 ufs_read(int fd, char *buf, size_t size)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)fd;
-	(void)buf;
-	(void)size;
-	ufs_error_code = UFS_ERR_NOT_IMPLEMENTED;
-	return -1;
+	struct iovec iov = {buf, size};
+	return ufs_readv(fd, &iov, 1);
+}
+
+ssize_t
+ufs_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	struct filedesc *desc = filedesc_lock_readable(fd);
+	if (desc == NULL)
+		return -1;
+	/* The cursor is changed under the file read lock. */
+	pthread_mutex_lock(&desc->lock);
+	size_t res = file_readv(desc->file, &desc->cursor, iov, iovcnt);
+	pthread_mutex_unlock(&desc->lock);
+	filedesc_unlock(desc);
+	return res;
+}
+
+ssize_t
+ufs_pread(int fd, char *buf, size_t size, size_t offset)
+{
+	struct filedesc *desc = filedesc_lock_readable(fd);
+	if (desc == NULL)
+		return -1;
+	struct file *f = desc->file;
+	size_t res = 0;
+	if (offset < f->size) {
+		struct file_cursor cur;
+		file_cursor_create(&cur, offset);
+		struct iovec iov = {buf, size};
+		res = file_readv(f, &cur, &iov, 1);
+	}
+	filedesc_unlock(desc);
+	return res;
+}
+
+int
+ufs_map_range(int fd, size_t offset, size_t size, struct ufs_span *spans,
+	      int span_count)
+{
+	struct filedesc *desc = filedesc_lock_readable(fd);
+	if (desc == NULL)
+		return -1;
+	struct file *f = desc->file;
+	if (offset > f->size)
+		offset = f->size;
+	if (size > f->size - offset)
+		size = f->size - offset;
+	struct file_cursor cur;
+	file_cursor_create(&cur, offset);
+	int count = 0;
+	int block_offset = 0;
+	if (size > 0)
+		file_cursor_seek(&cur, f, &block_offset);
+	for (; size > 0 && count < span_count; ++count) {
+		struct ufs_span *s = &spans[count];
+		struct block *b = f->blocks[cur.block_index];
+		const char *memory = block_zeros;
+		if (b != NULL && b->extent != NULL) {
+			/* The span owns a decompressed copy. */
+			b = file_inflate_block(f, cur.block_index);
+			memory = b->memory;
+		} else if (b != NULL) {
+			memory = b->memory;
+			block_touch(b);
+			/* The file holds a reference, so the block is alive. */
+			__atomic_add_fetch(&b->refs, 1, __ATOMIC_RELAXED);
+		}
+		s->data = memory + block_offset;
+		s->size = block_capacity(cur.block_index) - block_offset;
+		if (s->size > size)
+			s->size = size;
+		s->block = b;
+		s->block_index = cur.block_index;
+		size -= s->size;
+		file_cursor_next_block(&cur);
+		block_offset = 0;
+	}
+	filedesc_unlock(desc);
+	return count;
+}
+
+int
+ufs_map_range_writable(int fd, size_t offset, size_t size,
+		       struct ufs_span *spans, int span_count)
+{
+	if (offset > MAX_FILE_SIZE || size > MAX_FILE_SIZE - offset) {
+		/* Invalid descriptor is reported first. */
+		pthread_rwlock_rdlock(&table_lock);
+		bool is_valid = filedesc_get(fd) != NULL;
+		pthread_rwlock_unlock(&table_lock);
+		if (is_valid)
+			ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	struct filedesc *desc = filedesc_lock_writable(fd);
+	if (desc == NULL)
+		return -1;
+	if (size == 0 || span_count == 0) {
+		filedesc_unlock(desc);
+		return 0;
+	}
+	struct file *f = desc->file;
+	int first = block_index(offset);
+	int last = block_index(offset + size - 1);
+	if (last - first >= span_count) {
+		last = first + span_count - 1;
+		size = block_start(last) + block_capacity(last) - offset;
+	}
+	file_touch(f);
+	/* A gap between the file end and the offset is zeros. */
+	if (offset > f->size)
+		file_grow(f, offset);
+	if (offset + size > f->size)
+		f->size = offset + size;
+	int block_offset = offset - block_start(first);
+	for (int i = first; i <= last; ++i) {
+		struct ufs_span *s = &spans[i - first];
+		/* The new blocks are not zeroed, they are written anyway. */
+		struct block *b = i < f->block_count ?
+				  file_block_writable(f, i) :
+				  file_append_block(f);
+		__atomic_add_fetch(&b->refs, 1, __ATOMIC_RELAXED);
+		s->data = b->memory + block_offset;
+		s->size = b->capacity - block_offset;
+		if (s->size > size)
+			s->size = size;
+		s->block = b;
+		s->block_index = i;
+		size -= s->size;
+		block_offset = 0;
+	}
+	filedesc_unlock(desc);
+	return last - first + 1;
+}
+
+void
+ufs_unmap(struct ufs_span *spans, int span_count)
+{
+	for (int i = 0; i < span_count; ++i) {
+		if (spans[i].block != NULL)
+			block_unref(spans[i].block, spans[i].block_index);
+	}
 }
 
 int
 ufs_close(int fd)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)fd;
-	ufs_error_code = UFS_ERR_NOT_IMPLEMENTED;
-	return -1;
+	pthread_rwlock_wrlock(&table_lock);
+	struct filedesc *desc = filedesc_get(fd);
+	if (desc == NULL) {
+		pthread_rwlock_unlock(&table_lock);
+		return -1;
+	}
+	struct file *f = desc->file;
+	file_lock_write(f);
+	if (desc->prev != NULL)
+		desc->prev->next = desc->next;
+	else
+		f->desc_list = desc->next;
+	if (desc->next != NULL)
+		desc->next->prev = desc->prev;
+	file_unlock(f);
+	file_unref(f);
+	pthread_mutex_destroy(&desc->lock);
+	slab_free(&filedesc_cache, desc);
+	file_descriptors[fd] = NULL;
+	--file_descriptor_count;
+	pthread_rwlock_unlock(&table_lock);
+	return 0;
 }
 
 int
 ufs_delete(const char *filename)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)filename;
-	ufs_error_code = UFS_ERR_NOT_IMPLEMENTED;
-	return -1;
+	pthread_rwlock_wrlock(&table_lock);
+	struct path_parts parts;
+	struct dir *dir;
+	struct file *f = file_lookup(filename, &parts, &dir);
+	if (f == NULL) {
+		pthread_rwlock_unlock(&table_lock);
+		return -1;
+	}
+	file_unlink(f);
+	if (f->refs == 0)
+		file_delete(f);
+	pthread_rwlock_unlock(&table_lock);
+	return 0;
+}
+
+int
+ufs_mkdir(const char *path)
+{
+	pthread_rwlock_wrlock(&table_lock);
+	struct path_parts parts;
+	struct dir *dir;
+	struct dentry *e;
+	if (path_lookup(path, &parts, &dir, &e) != 0) {
+		pthread_rwlock_unlock(&table_lock);
+		return -1;
+	}
+	if (e != NULL) {
+		pthread_rwlock_unlock(&table_lock);
+		ufs_error_code = UFS_ERR_EXISTS;
+		return -1;
+	}
+	dir_new(dir, parts.name, parts.name_len, parts.name_hash);
+	pthread_rwlock_unlock(&table_lock);
+	return 0;
+}
+
+int
+ufs_rmdir(const char *path)
+{
+	pthread_rwlock_wrlock(&table_lock);
+	struct path_parts parts;
+	struct dir *dir;
+	struct dentry *e;
+	if (path_lookup(path, &parts, &dir, &e) != 0) {
+		pthread_rwlock_unlock(&table_lock);
+		return -1;
+	}
+	enum ufs_error_code err = UFS_ERR_NO_ERR;
+	/* The root can't be removed. */
+	if (e == NULL || e == &root_dir.dentry)
+		err = UFS_ERR_NO_FILE;
+	else if (!e->is_dir)
+		err = UFS_ERR_NOT_DIR;
+	else if (dentry_dir(e)->index.count > 0)
+		err = UFS_ERR_NOT_EMPTY;
+	else
+		dir_delete(dentry_dir(e));
+	pthread_rwlock_unlock(&table_lock);
+	if (err != UFS_ERR_NO_ERR) {
+		ufs_error_code = err;
+		return -1;
+	}
+	return 0;
+}
+
+/** The names of a directory at the moment of ufs_opendir(). */
+struct ufs_dir {
+	struct ufs_dirent *entries;
+	size_t count;
+	size_t pos;
+	/** The names of the entries, one after another. */
+	char *names;
+};
+
+struct ufs_dir *
+ufs_opendir(const char *path)
+{
+	pthread_rwlock_wrlock(&table_lock);
+	struct path_parts parts;
+	struct dir *dir;
+	struct dentry *e;
+	if (path_lookup(path, &parts, &dir, &e) != 0) {
+		pthread_rwlock_unlock(&table_lock);
+		return NULL;
+	}
+	if (e == NULL || !e->is_dir) {
+		pthread_rwlock_unlock(&table_lock);
+		ufs_error_code = e == NULL ? UFS_ERR_NO_FILE : UFS_ERR_NOT_DIR;
+		return NULL;
+	}
+	dir = dentry_dir(e);
+	const struct dentry_index *index = &dir->index;
+	size_t names_size = 0;
+	for (uint32_t i = 0; i < index->size; ++i) {
+		if (index->slots[i] != NULL)
+			names_size += strlen(index->slots[i]->name) + 1;
+	}
+	struct ufs_dir *d = malloc(sizeof(*d));
+	d->entries = malloc(index->count * sizeof(d->entries[0]) + 1);
+	d->names = malloc(names_size + 1);
+	d->count = 0;
+	d->pos = 0;
+	char *name = d->names;
+	for (uint32_t i = 0; i < index->size; ++i) {
+		const struct dentry *child = index->slots[i];
+		if (child == NULL)
+			continue;
+		size_t len = strlen(child->name) + 1;
+		memcpy(name, child->name, len);
+		d->entries[d->count].name = name;
+		d->entries[d->count].is_dir = child->is_dir;
+		++d->count;
+		name += len;
+	}
+	pthread_rwlock_unlock(&table_lock);
+	return d;
+}
+
+int
+ufs_readdir(struct ufs_dir *dir, struct ufs_dirent *entry)
+{
+	if (dir->pos == dir->count)
+		return 0;
+	*entry = dir->entries[dir->pos++];
+	return 1;
+}
+
+void
+ufs_closedir(struct ufs_dir *dir)
+{
+	free(dir->entries);
+	free(dir->names);
+	free(dir);
 }
 
 #if NEED_RESIZE
@@ -125,16 +1907,761 @@ ufs_delete(const char *filename)
 int
 ufs_resize(int fd, size_t new_size)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)fd;
-	(void)new_size;
-	ufs_error_code = UFS_ERR_NOT_IMPLEMENTED;
-	return -1;
+	struct filedesc *desc = filedesc_lock_writable(fd);
+	if (desc == NULL)
+		return -1;
+	if (new_size > MAX_FILE_SIZE) {
+		filedesc_unlock(desc);
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	struct file *f = desc->file;
+	if (new_size > f->size) {
+		file_grow(f, new_size);
+	} else {
+		file_shrink(f, new_size);
+		file_clamp_descriptors(f);
+	}
+	filedesc_unlock(desc);
+	return 0;
 }
 
 #endif
 
+int
+ufs_clone(const char *src_name, const char *dst_name)
+{
+	pthread_rwlock_wrlock(&table_lock);
+	struct path_parts parts;
+	struct dir *dir;
+	struct file *src = file_lookup(src_name, &parts, &dir);
+	if (src == NULL) {
+		pthread_rwlock_unlock(&table_lock);
+		return -1;
+	}
+	struct file *dst = file_lookup(dst_name, &parts, &dir);
+	if (dst == NULL && dir == NULL) {
+		pthread_rwlock_unlock(&table_lock);
+		return -1;
+	}
+	if (dst == src) {
+		pthread_rwlock_unlock(&table_lock);
+		return 0;
+	}
+	if (dst == NULL)
+		dst = file_new(dir, parts.name, parts.name_len, parts.name_hash);
+	/* The files are kept alive while the table is unlocked. */
+	++src->refs;
+	++dst->refs;
+	pthread_rwlock_unlock(&table_lock);
+	if (src < dst) {
+		file_lock_read(src);
+		file_lock_write(dst);
+	} else {
+		file_lock_write(dst);
+		file_lock_read(src);
+	}
+	file_shrink(dst, 0);
+	file_reserve_blocks(dst, src->block_count);
+	for (int i = 0; i < src->block_count; ++i) {
+		dst->blocks[i] = src->blocks[i];
+		if (dst->blocks[i] != NULL) {
+			__atomic_add_fetch(&dst->blocks[i]->refs, 1,
+					   __ATOMIC_RELAXED);
+		}
+	}
+	dst->block_count = src->block_count;
+	dst->capacity = src->capacity;
+	dst->block_size = src->block_size;
+	dst->size = src->size;
+	dst->image_offset = src->image_offset;
+	file_clamp_descriptors(dst);
+	file_unlock(src);
+	file_unlock(dst);
+	pthread_rwlock_wrlock(&table_lock);
+	file_unref(src);
+	file_unref(dst);
+	pthread_rwlock_unlock(&table_lock);
+	return 0;
+}
+
+/**
+ * Image of the file system in a file:
+ *
+ *     header | file data | ... | file data | table | names
+ *
+ * The files of a mounted image point right into its mapping, and
+ * their blocks are copied on the first write, like the shared ones.
+ * A sync appends the data of the changed files and a new table to
+ * the image end, and only then rewrites the header. So a crash in
+ * the middle leaves the previous image. When there is more garbage
+ * than live data, a sync writes a compact image into a new file,
+ * which then replaces the old one.
+ */
+
+static const char image_magic[8] = "UFSIMG1";
+
+struct image_header {
+	char magic[8];
+	/** End of the image, the next sync appends from here. */
+	uint64_t size;
+	uint64_t table_offset;
+	uint64_t file_count;
+};
+
+/** Entry of the table. The names follow the table, 0-terminated. */
+struct image_file {
+	uint64_t data_offset;
+	uint64_t size;
+	/** Offset of the name from the end of the table. */
+	uint64_t name_offset;
+};
+
+struct image_mapping {
+	char *data;
+	size_t size;
+};
+
+/** Serializes mounts and syncs. */
+static pthread_mutex_t image_lock = PTHREAD_MUTEX_INITIALIZER;
+/** Descriptor of the mounted image, or -1. */
+static int image_fd = -1;
+static char *image_path = NULL;
+/** Where the next sync appends. */
+static size_t image_size = 0;
+/**
+ * All the mappings, including of the replaced images, since their
+ * blocks can be still used by the files.
+ */
+static struct image_mapping *image_mappings = NULL;
+static int image_mapping_count = 0;
+
+static bool
+image_is_valid(const char *data, size_t size)
+{
+	const struct image_header *h = (const struct image_header *)data;
+	if (size < sizeof(*h) || memcmp(h->magic, image_magic,
+					sizeof(image_magic)) != 0)
+		return false;
+	if (h->size > size || h->table_offset < sizeof(*h) ||
+	    h->table_offset > h->size || h->table_offset % 8 != 0 ||
+	    h->file_count > (h->size - h->table_offset) /
+	    sizeof(struct image_file))
+		return false;
+	const struct image_file *files =
+		(const struct image_file *)(data + h->table_offset);
+	const char *names = (const char *)(files + h->file_count);
+	size_t names_size = data + h->size - names;
+	for (uint64_t i = 0; i < h->file_count; ++i) {
+		const struct image_file *e = &files[i];
+		if (e->data_offset < sizeof(*h) ||
+		    e->data_offset > h->table_offset ||
+		    e->size > h->table_offset - e->data_offset ||
+		    e->size > MAX_FILE_SIZE || e->name_offset >= names_size ||
+		    memchr(names + e->name_offset, 0,
+			   names_size - e->name_offset) == NULL)
+			return false;
+	}
+	return true;
+}
+
+/**
+ * Create a file with the data in the mapping, and its directories.
+ * A file with the same name is deleted. The file is skipped if the
+ * path is taken by a directory, or has a file in place of one.
+ */
+static void
+image_load_file(char *data, const struct image_file *e, const char *name)
+{
+	struct path_parts parts;
+	path_split(name, &parts);
+	struct dir *dir = dir_walk(parts.dir, parts.dir_len, true);
+	if (dir == NULL || parts.name_len == 0)
+		return;
+	struct dentry *old = dentry_index_find(&dir->index, parts.name,
+					       parts.name_len,
+					       parts.name_hash);
+	if (old != NULL && old->is_dir)
+		return;
+	if (old != NULL) {
+		struct file *f = dentry_file(old);
+		file_unlink(f);
+		if (f->refs == 0)
+			file_delete(f);
+	}
+	struct file *f = file_new(dir, parts.name, parts.name_len,
+				  parts.name_hash);
+	int count = e->size > 0 ? block_index(e->size - 1) + 1 : 0;
+	file_reserve_blocks(f, count);
+	for (int i = 0; i < count; ++i) {
+		struct block *b = slab_alloc(&block_cache);
+		memset(b, 0, sizeof(*b));
+		b->memory = data + e->data_offset + block_start(i);
+		b->capacity = block_capacity(i);
+		b->refs = 1;
+		b->is_mapped = true;
+		f->blocks[i] = b;
+		f->capacity += b->capacity;
+		f->block_size += b->capacity;
+	}
+	f->block_count = count;
+	f->size = e->size;
+	f->image_offset = e->data_offset;
+}
+
+int
+ufs_mount(const char *path)
+{
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		ufs_error_code = UFS_ERR_IO;
+		return -1;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		ufs_error_code = UFS_ERR_IO;
+		return -1;
+	}
+	size_t size = st.st_size;
+	char *data = NULL;
+	if (size > 0) {
+		data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			close(fd);
+			ufs_error_code = UFS_ERR_IO;
+			return -1;
+		}
+		if (!image_is_valid(data, size)) {
+			munmap(data, size);
+			close(fd);
+			errno = EINVAL;
+			ufs_error_code = UFS_ERR_IO;
+			return -1;
+		}
+	}
+	pthread_mutex_lock(&image_lock);
+	pthread_rwlock_wrlock(&table_lock);
+	size_t new_image_size = sizeof(struct image_header);
+	if (data != NULL) {
+		image_mappings = realloc(image_mappings,
+					 (image_mapping_count + 1) *
+					 sizeof(image_mappings[0]));
+		image_mappings[image_mapping_count].data = data;
+		image_mappings[image_mapping_count].size = size;
+		++image_mapping_count;
+		const struct image_header *h =
+			(const struct image_header *)data;
+		const struct image_file *files =
+			(const struct image_file *)(data + h->table_offset);
+		const char *names = (const char *)(files + h->file_count);
+		for (uint64_t i = 0; i < h->file_count; ++i)
+			image_load_file(data, &files[i],
+					names + files[i].name_offset);
+		new_image_size = h->size;
+	}
+	if (image_fd >= 0)
+		close(image_fd);
+	free(image_path);
+	image_fd = fd;
+	image_path = strdup(path);
+	image_size = new_image_size;
+	pthread_rwlock_unlock(&table_lock);
+	pthread_mutex_unlock(&image_lock);
+	return 0;
+}
+
+/**
+ * Sequential writer of the image. The buffers are collected and
+ * are written by one syscall per IMAGE_IOV_MAX of them.
+ */
+struct image_writer {
+	int fd;
+	size_t offset;
+	struct iovec iov[IMAGE_IOV_MAX];
+	int iov_count;
+	bool is_failed;
+};
+
+static void
+image_writer_flush(struct image_writer *w)
+{
+	struct iovec *iov = w->iov;
+	int count = w->iov_count;
+	w->iov_count = 0;
+	while (count > 0 && !w->is_failed) {
+		ssize_t rc = pwritev(w->fd, iov, count, w->offset);
+		if (rc < 0) {
+			w->is_failed = errno != EINTR;
+			continue;
+		}
+		w->offset += rc;
+		for (; count > 0 && (size_t)rc >= iov->iov_len; ++iov, --count)
+			rc -= iov->iov_len;
+		if (count > 0) {
+			iov->iov_base = (char *)iov->iov_base + rc;
+			iov->iov_len -= rc;
+		}
+	}
+}
+
+static void
+image_writer_add(struct image_writer *w, const void *data, size_t size)
+{
+	if (size == 0)
+		return;
+	if (w->iov_count == IMAGE_IOV_MAX)
+		image_writer_flush(w);
+	w->iov[w->iov_count].iov_base = (void *)data;
+	w->iov[w->iov_count].iov_len = size;
+	++w->iov_count;
+}
+
+/** A file being synced, and how it was at the moment of the sync. */
+struct image_entry {
+	struct file *file;
+	size_t size;
+	uint64_t change_count;
+	/** Offset of the data in the new image, 0 to write it. */
+	size_t data_offset;
+	/** Pinned blocks of the data to write. */
+	struct block **blocks;
+	int block_count;
+};
+
+/**
+ * Write the table and the data of the entries having no offset, and
+ * then the header. Returns the new image size or 0 on an error.
+ */
+static size_t
+image_write(int fd, size_t offset, struct image_entry *entries, int count)
+{
+	struct image_writer *w = malloc(sizeof(*w));
+	w->fd = fd;
+	w->offset = offset;
+	w->iov_count = 0;
+	w->is_failed = false;
+	for (int i = 0; i < count; ++i) {
+		struct image_entry *e = &entries[i];
+		if (e->data_offset != 0)
+			continue;
+		e->data_offset = w->offset;
+		for (int j = 0; j < w->iov_count; ++j)
+			e->data_offset += w->iov[j].iov_len;
+		size_t left = e->size;
+		for (int j = 0; j < e->block_count; ++j) {
+			size_t n = block_capacity(j);
+			if (n > left)
+				n = left;
+			struct block *b = e->blocks[j];
+			image_writer_add(w, b != NULL ? b->memory : block_zeros, n);
+			left -= n;
+		}
+	}
+	image_writer_flush(w);
+	static const char padding[8];
+	size_t table_offset = (w->offset + 7) & ~(size_t)7;
+	image_writer_add(w, padding, table_offset - w->offset);
+	struct image_file *files = malloc(count * sizeof(files[0]) + 1);
+	size_t names_size = 0;
+	for (int i = 0; i < count; ++i) {
+		files[i].data_offset = entries[i].data_offset;
+		files[i].size = entries[i].size;
+		files[i].name_offset = names_size;
+		names_size += strlen(entries[i].file->name) + 1;
+	}
+	image_writer_add(w, files, count * sizeof(files[0]));
+	for (int i = 0; i < count; ++i) {
+		const char *name = entries[i].file->name;
+		image_writer_add(w, name, strlen(name) + 1);
+	}
+	image_writer_flush(w);
+	struct image_header h;
+	memcpy(h.magic, image_magic, sizeof(h.magic));
+	h.size = w->offset;
+	h.table_offset = table_offset;
+	h.file_count = count;
+	bool is_ok = !w->is_failed && fsync(fd) == 0 &&
+		     pwrite(fd, &h, sizeof(h), 0) == sizeof(h) && fsync(fd) == 0;
+	free(files);
+	free(w);
+	return is_ok ? h.size : 0;
+}
+
+int
+ufs_sync(void)
+{
+	pthread_mutex_lock(&image_lock);
+	if (image_fd < 0) {
+		pthread_mutex_unlock(&image_lock);
+		ufs_error_code = UFS_ERR_NO_FILE;
+		return -1;
+	}
+	/* The files are kept alive while the table is unlocked. */
+	pthread_rwlock_wrlock(&table_lock);
+	int count = 0;
+	for (struct file *f = file_list; f != NULL; f = f->next)
+		++count;
+	struct image_entry *entries = calloc(count + 1, sizeof(entries[0]));
+	size_t live_size = 0;
+	size_t dirty_size = 0;
+	struct image_entry *e = entries;
+	for (struct file *f = file_list; f != NULL; f = f->next, ++e) {
+		++f->refs;
+		e->file = f;
+		file_lock_read(f);
+		e->size = f->size;
+		e->change_count = f->change_count;
+		e->data_offset = f->image_offset;
+		file_unlock(f);
+		live_size += e->size;
+		if (e->data_offset == 0)
+			dirty_size += e->size;
+	}
+	pthread_rwlock_unlock(&table_lock);
+
+	bool is_compact = image_size + dirty_size >
+			  2 * live_size + IMAGE_GARBAGE_MIN;
+	for (int i = 0; i < count; ++i) {
+		e = &entries[i];
+		if (is_compact)
+			e->data_offset = 0;
+		else if (e->data_offset != 0)
+			continue;
+		struct file *f = e->file;
+		file_lock_read(f);
+		e->size = f->size;
+		e->change_count = f->change_count;
+		e->block_count = f->size > 0 ? block_index(f->size - 1) + 1 : 0;
+		e->blocks = malloc(e->block_count * sizeof(e->blocks[0]) + 1);
+		for (int j = 0; j < e->block_count; ++j) {
+			struct block *b = f->blocks[j];
+			if (b != NULL && b->extent != NULL) {
+				b = file_inflate_block(f, j);
+			} else if (b != NULL) {
+				__atomic_add_fetch(&b->refs, 1,
+						   __ATOMIC_RELAXED);
+			}
+			e->blocks[j] = b;
+		}
+		file_unlock(f);
+	}
+
+	size_t new_size;
+	int new_fd = image_fd;
+	char *tmp_path = NULL;
+	if (!is_compact) {
+		new_size = image_write(image_fd, image_size, entries, count);
+	} else {
+		tmp_path = malloc(strlen(image_path) + 5);
+		strcpy(tmp_path, image_path);
+		strcat(tmp_path, ".tmp");
+		new_fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		new_size = 0;
+		if (new_fd >= 0) {
+			new_size = image_write(new_fd, sizeof(struct image_header),
+					       entries, count);
+		}
+		if (new_size != 0 && rename(tmp_path, image_path) != 0)
+			new_size = 0;
+		if (new_size != 0) {
+			close(image_fd);
+			image_fd = new_fd;
+		} else if (new_fd >= 0) {
+			close(new_fd);
+			unlink(tmp_path);
+		}
+		free(tmp_path);
+	}
+	if (new_size != 0)
+		image_size = new_size;
+
+	pthread_rwlock_wrlock(&table_lock);
+	for (int i = 0; i < count; ++i) {
+		e = &entries[i];
+		for (int j = 0; j < e->block_count; ++j) {
+			if (e->blocks[j] != NULL)
+				block_unref(e->blocks[j], j);
+		}
+		free(e->blocks);
+		struct file *f = e->file;
+		if (new_size != 0) {
+			file_lock_write(f);
+			/* The files changed during the sync stay dirty. */
+			if (f->change_count == e->change_count)
+				f->image_offset = e->data_offset;
+			file_unlock(f);
+		}
+		file_unref(f);
+	}
+	pthread_rwlock_unlock(&table_lock);
+	pthread_mutex_unlock(&image_lock);
+	free(entries);
+	if (new_size == 0) {
+		ufs_error_code = UFS_ERR_IO;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * A block is cold if it was not used since the previous compaction,
+ * and can be compressed in place if the file is its only user. The
+ * pinned and the shared blocks, and the mapped ones of the image,
+ * which the kernel can drop anyway, are left as is.
+ */
+static bool
+block_is_cold(const struct block *b, uint32_t epoch)
+{
+	return b != NULL && b->extent == NULL && !b->is_mapped &&
+	       !b->is_incompressible && b->access_epoch + 1 < epoch &&
+	       __atomic_load_n(&b->refs, __ATOMIC_ACQUIRE) == 1;
+}
+
+/** Bytes of the file data in the block with the given number. */
+static size_t
+file_block_data_size(const struct file *f, int index)
+{
+	size_t size = f->size - block_start(index);
+	size_t capacity = block_capacity(index);
+	return size < capacity ? size : capacity;
+}
+
+/**
+ * Compress @a size bytes of the blocks [begin, end) copied into
+ * @a raw, and make the blocks point into the extent. Nothing is
+ * done if it saves less than 1/8 of a frame.
+ */
+static void
+file_compress_blocks(struct file *f, int begin, int end, const char *raw,
+		     size_t size, char *compressed)
+{
+	int offsets[EXTENT_MAX_FRAME_COUNT + 1];
+	int frame_count = 0;
+	int data_size = 0;
+	for (size_t pos = 0; pos < size; pos += EXTENT_FRAME_SIZE) {
+		int n = size - pos < EXTENT_FRAME_SIZE ? size - pos :
+			EXTENT_FRAME_SIZE;
+		int rc = lz_compress(raw + pos, n, compressed + data_size,
+				     n - n / 8);
+		if (rc == 0) {
+			for (int i = begin; i < end; ++i)
+				f->blocks[i]->is_incompressible = true;
+			return;
+		}
+		offsets[frame_count++] = data_size;
+		data_size += rc;
+	}
+	offsets[frame_count] = data_size;
+	int compressed_size = (frame_count + 1) * sizeof(offsets[0]) +
+			      data_size;
+	struct extent *e = malloc(sizeof(*e) + compressed_size);
+	e->refs = end - begin;
+	e->size = size;
+	e->compressed_size = compressed_size;
+	e->frame_count = frame_count;
+	memcpy(e->frame_offsets, offsets,
+	       (frame_count + 1) * sizeof(offsets[0]));
+	memcpy((char *)extent_data(e), compressed, data_size);
+	__atomic_add_fetch(&extent_size, sizeof(*e) + compressed_size,
+			   __ATOMIC_RELAXED);
+	__atomic_add_fetch(&extent_data_size, size, __ATOMIC_RELAXED);
+	int offset = 0;
+	for (int i = begin; i < end; ++i) {
+		struct block *b = f->blocks[i];
+		block_free_memory(b, i);
+		f->block_size -= b->capacity;
+		b->extent = e;
+		b->extent_offset = offset;
+		offset += file_block_data_size(f, i);
+	}
+}
+
+/**
+ * Compress the runs of the cold blocks of the file, and drop its
+ * cache if it is cold too. The file has to be locked for writing.
+ * The scratch buffers fit the biggest block.
+ */
+static void
+file_compact(struct file *f, uint32_t epoch, char *raw, char *compressed)
+{
+	if (f->cache_extent != NULL && f->cache_epoch + 1 < epoch)
+		file_drop_cache(f);
+	int i = 0;
+	while (i < f->block_count) {
+		if (!block_is_cold(f->blocks[i], epoch)) {
+			++i;
+			continue;
+		}
+		size_t size = 0;
+		int end = i;
+		do {
+			size_t n = file_block_data_size(f, end);
+			memcpy(raw + size, f->blocks[end]->memory, n);
+			size += n;
+			++end;
+		} while (end < f->block_count &&
+			 block_is_cold(f->blocks[end], epoch) &&
+			 size + file_block_data_size(f, end) <= EXTENT_FRAME_SIZE);
+		file_compress_blocks(f, i, end, raw, size, compressed);
+		i = end;
+	}
+}
+
+void
+ufs_compact(void)
+{
+	uint32_t epoch = __atomic_add_fetch(&compact_epoch, 1,
+					    __ATOMIC_RELAXED);
+	/* The files are kept alive while the table is unlocked. */
+	pthread_rwlock_wrlock(&table_lock);
+	int count = 0;
+	for (struct file *f = file_list; f != NULL; f = f->next)
+		++count;
+	struct file **files = malloc(count * sizeof(files[0]) + 1);
+	count = 0;
+	for (struct file *f = file_list; f != NULL; f = f->next) {
+		++f->refs;
+		files[count++] = f;
+	}
+	pthread_rwlock_unlock(&table_lock);
+	char *raw = malloc(BLOCK_SIZE << BLOCK_MAX_ORDER);
+	char *compressed = malloc(BLOCK_SIZE << BLOCK_MAX_ORDER);
+	for (int i = 0; i < count; ++i) {
+		file_lock_write(files[i]);
+		file_compact(files[i], epoch, raw, compressed);
+		file_unlock(files[i]);
+	}
+	free(raw);
+	free(compressed);
+	pthread_rwlock_wrlock(&table_lock);
+	for (int i = 0; i < count; ++i)
+		file_unref(files[i]);
+	pthread_rwlock_unlock(&table_lock);
+	free(files);
+}
+
+void
+ufs_set_huge_pages(int flags)
+{
+	int huge_flags = 0;
+	if ((flags & UFS_HUGE_HUGETLB) != 0)
+		huge_flags |= HUGEMEM_HUGETLB;
+	if ((flags & UFS_HUGE_THP) != 0)
+		huge_flags |= HUGEMEM_THP;
+	if ((flags & UFS_HUGE_NODE_LOCAL) != 0)
+		huge_flags |= HUGEMEM_NODE_LOCAL;
+	for (int i = 0; i < BLOCK_HUGE_CACHE_COUNT; ++i)
+		slab_cache_set_huge(&block_huge_caches[i], huge_flags);
+	__atomic_store_n(&block_huge_flags, huge_flags, __ATOMIC_RELAXED);
+}
+
+void
+ufs_stat(struct ufs_stat *stat)
+{
+	memset(stat, 0, sizeof(*stat));
+	pthread_rwlock_rdlock(&table_lock);
+	stat->dir_count = dir_count;
+	for (struct file *f = file_list; f != NULL; f = f->next) {
+		++stat->file_count;
+		file_lock_read(f);
+		stat->data_size += f->size;
+		stat->block_size += f->block_size;
+		file_unlock(f);
+	}
+	/* The deleted files are found by their first descriptors. */
+	for (int i = 0; i < file_descriptor_capacity; ++i) {
+		struct filedesc *d = file_descriptors[i];
+		if (d == NULL || !d->file->is_deleted || d->prev != NULL)
+			continue;
+		++stat->file_count;
+		file_lock_read(d->file);
+		stat->data_size += d->file->size;
+		stat->block_size += d->file->block_size;
+		file_unlock(d->file);
+	}
+	pthread_rwlock_unlock(&table_lock);
+	struct slab_cache *caches[] = {&block_cache, &file_cache,
+				       &dir_cache, &filedesc_cache};
+	for (size_t i = 0; i < sizeof(caches) / sizeof(caches[0]); ++i)
+		slab_cache_stat(caches[i], &stat->slab_size,
+				&stat->slab_used_size);
+	for (int i = 0; i <= BLOCK_SLAB_MAX_ORDER; ++i)
+		slab_cache_stat(&block_memory_caches[i], &stat->slab_size,
+				&stat->slab_used_size);
+	stat->large_block_size =
+		__atomic_load_n(&block_large_size, __ATOMIC_RELAXED);
+	size_t huge_used_size = 0;
+	for (int i = 0; i < BLOCK_HUGE_CACHE_COUNT; ++i)
+		slab_cache_stat(&block_huge_caches[i], &stat->huge_size,
+				&huge_used_size);
+	stat->compressed_size =
+		__atomic_load_n(&extent_size, __ATOMIC_RELAXED);
+	stat->compressed_data_size =
+		__atomic_load_n(&extent_data_size, __ATOMIC_RELAXED);
+	stat->cache_size =
+		__atomic_load_n(&extent_cache_size, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&image_lock);
+	for (int i = 0; i < image_mapping_count; ++i)
+		stat->image_size += image_mappings[i].size;
+	pthread_mutex_unlock(&image_lock);
+}
+
 void
 ufs_destroy(void)
 {
+	/*
+	 * The slab memory is released at once. Only strings, arrays
+	 * and the big blocks are freed one by one.
+	 */
+	for (int i = 0; i < file_descriptor_capacity; ++i) {
+		struct filedesc *d = file_descriptors[i];
+		if (d == NULL)
+			continue;
+		pthread_mutex_destroy(&d->lock);
+		if (d->file->is_deleted && d->prev == NULL)
+			file_release_heap(d->file);
+	}
+	free(file_descriptors);
+	file_descriptors = NULL;
+	file_descriptor_count = 0;
+	file_descriptor_capacity = 0;
+	for (struct file *f = file_list; f != NULL; f = f->next)
+		file_release_heap(f);
+	file_list = NULL;
+	for (struct dir *d = dir_list; d != NULL; d = d->next) {
+		free(d->index.slots);
+		free(d->path);
+	}
+	dir_list = NULL;
+	dir_count = 0;
+	free(root_dir.index.slots);
+	memset(&root_dir.index, 0, sizeof(root_dir.index));
+	++dcache_gen;
+	slab_cache_destroy(&block_cache);
+	slab_cache_destroy(&file_cache);
+	slab_cache_destroy(&dir_cache);
+	slab_cache_destroy(&filedesc_cache);
+	for (int i = 0; i <= BLOCK_SLAB_MAX_ORDER; ++i)
+		slab_cache_destroy(&block_memory_caches[i]);
+	for (int i = 0; i < BLOCK_HUGE_CACHE_COUNT; ++i) {
+		slab_cache_destroy(&block_huge_caches[i]);
+		slab_cache_set_huge(&block_huge_caches[i], 0);
+	}
+	block_huge_flags = 0;
+	block_large_size = 0;
+	extent_size = 0;
+	extent_data_size = 0;
+	extent_cache_size = 0;
+	for (int i = 0; i < image_mapping_count; ++i)
+		munmap(image_mappings[i].data, image_mappings[i].size);
+	free(image_mappings);
+	image_mappings = NULL;
+	image_mapping_count = 0;
+	if (image_fd >= 0)
+		close(image_fd);
+	image_fd = -1;
+	free(image_path);
+	image_path = NULL;
+	image_size = 0;
 }
@@ -1,12 +1,17 @@
 #pragma once
 
+#include <stdbool.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 /**
  * User-defined in-memory filesystem. It is as simple as possible.
  * Each file lies in the memory as an array of blocks. A file
- * has an unique file name, and there are no directories, so the
- * FS is a monolithic flat contiguous folder.
+ * has an unique path. The names are separated by slashes, and all
+ * but the last one are directories, which are created with
+ * ufs_mkdir(). A name without slashes is in the root directory. The
+ * leading, the trailing and the repeated slashes are ignored, and
+ * "." and ".." are just names.
  */
 
 /**
@@ -23,8 +28,8 @@
  * It is important to define these macros here, in the header,
  * because it is used by tests.
  */
-#define NEED_OPEN_FLAGS 0
-#define NEED_RESIZE 0
+#define NEED_OPEN_FLAGS 1
+#define NEED_RESIZE 1
 
 /**
  * Flags for ufs_open call.
@@ -54,6 +59,13 @@ enum open_flags {
 	UFS_READ_WRITE = 8,
 
 #endif
+
+	/**
+	 * The writes go to the end of the file, and don't move the
+	 * descriptor position. The small appends of one or several
+	 * threads are done without the file lock, see ufs_write().
+	 */
+	UFS_APPEND = 16,
 };
 
 /** Possible errors from all functions. */
@@ -62,6 +74,16 @@ enum ufs_error_code {
 	UFS_ERR_NO_FILE,
 	UFS_ERR_NO_MEM,
 	UFS_ERR_NOT_IMPLEMENTED,
+	/** The image can't be read or written. See errno for why. */
+	UFS_ERR_IO,
+	/** The path is taken. */
+	UFS_ERR_EXISTS,
+	/** The path is a directory, and a file is needed. */
+	UFS_ERR_IS_DIR,
+	/** A directory of the path is a file. */
+	UFS_ERR_NOT_DIR,
+	/** The directory to remove has entries. */
+	UFS_ERR_NOT_EMPTY,
 
 #if NEED_OPEN_FLAGS
 
@@ -81,13 +103,24 @@ ufs_errno();
  * @retval > 0 File descriptor.
  * @retval -1 Error occurred. Check ufs_errno() for a code.
  *     - UFS_ERR_NO_FILE - no such file, and UFS_CREATE flag is
- *       not specified.
+ *       not specified. Or no directory of the path.
+ *     - UFS_ERR_IS_DIR - the path is a directory.
+ *     - UFS_ERR_NOT_DIR - a directory of the path is a file.
  */
 int
 ufs_open(const char *filename, int flags);
 
 /**
  * Write data to the file.
+ *
+ * With UFS_APPEND the data goes to the file end, and the writes of
+ * the other threads are never mixed with it. The last block is kept
+ * as an append tail. An append fitting into its free space reserves
+ * the bytes by one atomic update, copies them without the file lock,
+ * and is visible to the others when the appends before it are. The
+ * appends not fitting, and the first one after any other operation
+ * on the file, take the file lock and prepare the tail again.
+ *
  * @param fd File descriptor from ufs_open().
  * @param buf Buffer to write.
  * @param size Size of @a buf.
@@ -114,6 +147,63 @@ ufs_write(int fd, const char *buf, size_t size);
 ssize_t
 ufs_read(int fd, char *buf, size_t size);
 
+/**
+ * Write the buffers one after another, like writev(). Same as a
+ * ufs_write() of all of them concatenated.
+ * @param fd File descriptor from ufs_open().
+ * @param iov Buffers to write.
+ * @param iovcnt Number of the buffers.
+ *
+ * @retval >= 0 How many bytes were written.
+ * @retval -1 Error occurred. Same codes as of ufs_write().
+ */
+ssize_t
+ufs_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * Read into the buffers one after another, like readv(). Same as
+ * a ufs_read() of their total size.
+ * @param fd File descriptor from ufs_open().
+ * @param iov Buffers to fill.
+ * @param iovcnt Number of the buffers.
+ *
+ * @retval > 0 How many bytes were read.
+ * @retval 0 EOF.
+ * @retval -1 Error occurred. Same codes as of ufs_read().
+ */
+ssize_t
+ufs_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * Write data at the given offset, like pwrite(). The descriptor
+ * position is not changed. If the offset is behind the file end,
+ * the gap is filled with zeros.
+ * @param fd File descriptor from ufs_open().
+ * @param buf Buffer to write.
+ * @param size Size of @a buf.
+ * @param offset Offset in the file.
+ *
+ * @retval >= 0 How many bytes were written.
+ * @retval -1 Error occurred. Same codes as of ufs_write().
+ */
+ssize_t
+ufs_pwrite(int fd, const char *buf, size_t size, size_t offset);
+
+/**
+ * Read data from the given offset, like pread(). The descriptor
+ * position is not changed.
+ * @param fd File descriptor from ufs_open().
+ * @param buf Buffer to read into.
+ * @param size Maximum bytes to read.
+ * @param offset Offset in the file.
+ *
+ * @retval > 0 How many bytes were read.
+ * @retval 0 EOF.
+ * @retval -1 Error occurred. Same codes as of ufs_read().
+ */
+ssize_t
+ufs_pread(int fd, char *buf, size_t size, size_t offset);
+
 /**
  * Close a file.
  * @param fd File descriptor from ufs_open().
@@ -135,16 +225,198 @@ ufs_close(int fd);
  * @param filename Name of a file to delete.
  * @retval -1 Error occurred. Check ufs_errno() for a code.
  *     - UFS_ERR_NO_FILE - no such file.
+ *     - UFS_ERR_IS_DIR - the path is a directory, see ufs_rmdir().
+ *     - UFS_ERR_NOT_DIR - a directory of the path is a file.
  */
 int
 ufs_delete(const char *filename);
 
+/**
+ * Create a directory. Its parent has to exist.
+ *
+ * @param path Path of the directory.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_EXISTS - the path is taken by a file or a directory.
+ *     - UFS_ERR_NO_FILE - no parent directory.
+ *     - UFS_ERR_NOT_DIR - a directory of the path is a file.
+ */
+int
+ufs_mkdir(const char *path);
+
+/**
+ * Delete an empty directory.
+ *
+ * @param path Path of the directory.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such directory, or it is the root.
+ *     - UFS_ERR_NOT_DIR - the path or its directory is a file.
+ *     - UFS_ERR_NOT_EMPTY - the directory has entries. The deleted
+ *       files still opened don't count.
+ */
+int
+ufs_rmdir(const char *path);
+
+/** An entry of a directory, from ufs_readdir(). */
+struct ufs_dirent {
+	/** Name in the directory, valid until ufs_closedir(). */
+	const char *name;
+	bool is_dir;
+};
+
+struct ufs_dir;
+
+/**
+ * Open a directory to iterate its entries. The entries are the ones
+ * of the moment of the call, the later changes are not seen. Their
+ * order is undefined.
+ *
+ * @param path Path of the directory, "" or "/" for the root.
+ * @retval Not NULL Directory stream for ufs_readdir().
+ * @retval NULL Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such directory.
+ *     - UFS_ERR_NOT_DIR - the path or its directory is a file.
+ */
+struct ufs_dir *
+ufs_opendir(const char *path);
+
+/**
+ * Get the next entry of the directory.
+ * @retval 1 @a entry is filled.
+ * @retval 0 No more entries.
+ */
+int
+ufs_readdir(struct ufs_dir *dir, struct ufs_dirent *entry);
+
+/** Free the directory stream and its entries. */
+void
+ufs_closedir(struct ufs_dir *dir);
+
+/**
+ * Make a file @a dst_name with the same content as @a src_name.
+ * If @a dst_name exists, its content is replaced, and its opened
+ * descriptors continue from the new end if they are behind it. The
+ * blocks are not copied, but shared by the files until one of them
+ * writes into a block. Then the writer copies the block.
+ *
+ * @param src_name Name of a file to clone.
+ * @param dst_name Name of the clone. Its directory has to exist.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no file @a src_name, or no directory of
+ *       @a dst_name.
+ *     - UFS_ERR_IS_DIR - one of the paths is a directory.
+ *     - UFS_ERR_NOT_DIR - a directory of a path is a file.
+ */
+int
+ufs_clone(const char *src_name, const char *dst_name);
+
+/**
+ * Load the files from the image file, and use it as the backing of
+ * ufs_sync(). The image is mapped into memory, and the data is not
+ * read until it is used. A file from the image replaces an existing
+ * one with the same name, the same as after ufs_delete(). The
+ * missing directories of the files are created. A file whose path
+ * is taken by a directory is not loaded. If there is no such image
+ * file, it is created, empty.
+ *
+ * @param path Path of the image file.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_IO - the image can't be opened or is corrupted.
+ */
+int
+ufs_mount(const char *path);
+
+/**
+ * Save the files into the mounted image. Only the data changed since
+ * the mount or the previous sync is written, in big sequential
+ * writes. Then the image is switched to the new state at once, so
+ * after a crash the image has either the old state or the new one.
+ * The deleted files and the descriptors are not saved. The
+ * directories are saved as the paths of their files, so the empty
+ * ones are not. The files changed during the sync are saved by the
+ * next one.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no image is mounted.
+ *     - UFS_ERR_IO - the image can't be written.
+ */
+int
+ufs_sync(void);
+
+/** Part of a file in one block, which can be read in place. */
+struct ufs_span {
+	/**
+	 * Bytes of the file, valid until ufs_unmap(). Can be written
+	 * if mapped by ufs_map_range_writable().
+	 */
+	const char *data;
+	size_t size;
+	/** Private, used by ufs_unmap(). */
+	void *block;
+	int block_index;
+};
+
+/**
+ * Get pointers to the file bytes from @a offset, without copying
+ * them. One span is filled per block. The blocks are pinned until
+ * ufs_unmap(), so the spans stay valid whatever happens with the
+ * file, and keep the bytes it had at the moment of mapping. A write
+ * into a pinned block copies it, same as a write into a cloned one.
+ * All the spans have to be unmapped before ufs_destroy().
+ *
+ * @param fd File descriptor from ufs_open().
+ * @param offset Offset in the file.
+ * @param size Maximum bytes to map. The file end stops earlier.
+ * @param spans Spans to fill.
+ * @param span_count Size of @a spans. When they end, the rest of
+ *     the range is not mapped and can be mapped by another call.
+ *
+ * @retval >= 0 How many spans were filled. 0 means EOF.
+ * @retval -1 Error occurred. Same codes as of ufs_read().
+ */
+int
+ufs_map_range(int fd, size_t offset, size_t size, struct ufs_span *spans,
+	      int span_count);
+
+/**
+ * Same as ufs_map_range(), but the spans are to write the file in
+ * place. The file is extended to the end of the mapped part first,
+ * and the blocks are made its own, so the writes into the spans are
+ * seen by the reads of the file at once, with no locks. The new
+ * bytes are undefined until written via the spans. The blocks stay
+ * pinned till ufs_unmap(), so if the file is written meanwhile by
+ * the other calls, the blocks they touch are copied, and the later
+ * writes of the spans into them are lost.
+ *
+ * @param fd File descriptor from ufs_open().
+ * @param offset Offset in the file.
+ * @param size Bytes to map.
+ * @param spans Spans to fill.
+ * @param span_count Size of @a spans. When they end, the rest of
+ *     the range is not mapped and can be mapped by another call.
+ *
+ * @retval >= 0 How many spans were filled. 0 means @a size is 0.
+ * @retval -1 Error occurred. Same codes as of ufs_pwrite().
+ */
+int
+ufs_map_range_writable(int fd, size_t offset, size_t size,
+		       struct ufs_span *spans, int span_count);
+
+/** Unpin the blocks of the spans from ufs_map_range*(). */
+void
+ufs_unmap(struct ufs_span *spans, int span_count);
+
 #if NEED_RESIZE
 
 /**
  * Resize a file opened by the file descriptor @a fd. If current
- * file size is less than @a new_size, then new empty blocks are
- * created and positions of opened file descriptors are not
+ * file size is less than @a new_size, then the file is extended
+ * with a hole, which is read as zeros and takes no memory until
+ * written, and positions of opened file descriptors are not
  * changed. If the current size is bigger than @a new_size, then
  * the blocks are truncated. Opened file descriptors behind the
  * new file size should proceed from the new file end.
@@ -164,9 +436,92 @@ ufs_resize(int fd, size_t new_size);
 
 #endif
 
+/** Memory usage of the file system. */
+struct ufs_stat {
+	/** Number of the files, including deleted but opened ones. */
+	size_t file_count;
+	/** Number of the directories, without the root. */
+	size_t dir_count;
+	/** Bytes of data in all the files. */
+	size_t data_size;
+	/**
+	 * Bytes of memory of all the file blocks, except the compressed
+	 * ones. A block shared by cloned files is counted in each of
+	 * them.
+	 */
+	size_t block_size;
+	/** Bytes taken from malloc() by the slab caches. */
+	size_t slab_size;
+	/** Bytes of the slab objects in use. */
+	size_t slab_used_size;
+	/** Bytes of the blocks too big for the slabs, not in the above. */
+	size_t large_block_size;
+	/**
+	 * Bytes mapped for such blocks by ufs_set_huge_pages(). The
+	 * used part is in the above.
+	 */
+	size_t huge_size;
+	/** Bytes of the compressed extents, and of their data. */
+	size_t compressed_size;
+	size_t compressed_data_size;
+	/** Bytes of the decompressed frames cached for the reads. */
+	size_t cache_size;
+	/**
+	 * Bytes of the images mapped by ufs_mount(). They are loaded
+	 * by the kernel on demand, and are not in the above.
+	 */
+	size_t image_size;
+};
+
+/**
+ * Compress the cold data. The blocks not read nor written since the
+ * previous call are compressed in the LZ4 format, in frames of 64KB,
+ * if it saves at least 1/8. The small ones are merged into a frame.
+ * A read decompresses the frame into a cache of the file, kept until
+ * the next call if it is not used. A write decompresses the block
+ * back.
+ * The shared, the mapped and the pinned blocks are not compressed.
+ * The freed block memory stays in the slab caches, for the new
+ * blocks. Can be called from any thread, for example periodically
+ * from a background one.
+ */
+void
+ufs_compact(void);
+
+/** Flags of ufs_set_huge_pages(). */
+enum ufs_huge_flags {
+	/** Transparent huge pages, madvise(MADV_HUGEPAGE). */
+	UFS_HUGE_THP = 1 << 0,
+	/**
+	 * The hugetlbfs pool of /proc/sys/vm/nr_hugepages, and THP when
+	 * it is empty.
+	 */
+	UFS_HUGE_HUGETLB = 1 << 1,
+	/** From the NUMA node of the thread which needs the memory. */
+	UFS_HUGE_NODE_LOCAL = 1 << 2,
+};
+
+/**
+ * Take the memory of the new blocks of 64KB and bigger, which make
+ * up the big files, from the slabs mapped with @a flags of
+ * ufs_huge_flags. 0 is the default, malloc() for each block. A 2MB
+ * page takes one TLB entry instead of 512, so the reads and writes
+ * all over a big file miss the TLB less. The slabs are of 2MB and
+ * bigger, their freed blocks are kept for the new ones until
+ * ufs_destroy(). The existing blocks stay where they are. It is
+ * Linux only, elsewhere it is a usual mapping.
+ */
+void
+ufs_set_huge_pages(int flags);
+
+/** Get the memory usage, real memory vs logical file bytes. */
+void
+ufs_stat(struct ufs_stat *stat);
+
 /**
  * Destroy all the global variables, free all the memory, close and delete all
- * the files. After the destruction neither of the ufs functions are supposed to
+ * the files. Unlike the other functions, can't be called concurrently with
+ * anything. After the destruction neither of the ufs functions are supposed to
  * be used. Purpose of the destruction is to reclaim all the dynamic memory.
  */
 void
@@ -0,0 +1,198 @@
+#include "userfs_aio.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/** A part of the request copied by one task. */
+struct ufs_aio_chunk {
+	struct thread_task_storage task;
+	struct ufs_aio *aio;
+	/** The span it starts in, and where in it. */
+	int span_index;
+	size_t span_offset;
+	/** Where it is in the buffer. */
+	size_t buf_offset;
+	size_t size;
+};
+
+struct ufs_aio {
+	bool is_write;
+	char *buf;
+	/** Bytes mapped, the result of the request. */
+	size_t size;
+	struct ufs_span *spans;
+	int span_count;
+	struct ufs_aio_chunk *chunks;
+	struct thread_task **tasks;
+	int chunk_count;
+	/** The tasks of the chunks are in the pool. */
+	bool is_pushed;
+	/** Chunks copied. Atomic. */
+	int done_count;
+};
+
+/** Map the file range, in as many calls as needed. */
+static int
+ufs_aio_map(struct ufs_aio *aio, int fd, size_t offset, size_t size)
+{
+	int capacity = 16;
+	aio->spans = malloc(capacity * sizeof(aio->spans[0]));
+	while (size > 0) {
+		if (aio->span_count == capacity) {
+			capacity *= 2;
+			aio->spans = realloc(aio->spans,
+					     capacity * sizeof(aio->spans[0]));
+		}
+		struct ufs_span *spans = aio->spans + aio->span_count;
+		int free_count = capacity - aio->span_count;
+		int rc = aio->is_write ?
+			 ufs_map_range_writable(fd, offset, size, spans,
+						free_count) :
+			 ufs_map_range(fd, offset, size, spans, free_count);
+		if (rc < 0) {
+			ufs_unmap(aio->spans, aio->span_count);
+			free(aio->spans);
+			return -1;
+		}
+		if (rc == 0)
+			break;
+		for (int i = 0; i < rc; ++i) {
+			offset += spans[i].size;
+			size -= spans[i].size;
+			aio->size += spans[i].size;
+		}
+		aio->span_count += rc;
+	}
+	return 0;
+}
+
+/** Cut the mapped spans into the chunks. */
+static void
+ufs_aio_split(struct ufs_aio *aio)
+{
+	int count = (aio->size + UFS_AIO_CHUNK_SIZE - 1) / UFS_AIO_CHUNK_SIZE;
+	aio->chunks = malloc(count * sizeof(aio->chunks[0]) + 1);
+	aio->tasks = malloc(count * sizeof(aio->tasks[0]) + 1);
+	aio->chunk_count = count;
+	int span_index = 0;
+	size_t span_offset = 0;
+	for (int i = 0; i < count; ++i) {
+		struct ufs_aio_chunk *c = &aio->chunks[i];
+		c->aio = aio;
+		c->span_index = span_index;
+		c->span_offset = span_offset;
+		c->buf_offset = (size_t)i * UFS_AIO_CHUNK_SIZE;
+		c->size = aio->size - c->buf_offset;
+		if (c->size > UFS_AIO_CHUNK_SIZE)
+			c->size = UFS_AIO_CHUNK_SIZE;
+		size_t left = c->size;
+		while (left > 0) {
+			size_t n = aio->spans[span_index].size - span_offset;
+			if (n > left) {
+				span_offset += left;
+				break;
+			}
+			left -= n;
+			++span_index;
+			span_offset = 0;
+		}
+	}
+}
+
+static void
+ufs_aio_copy(const struct ufs_aio_chunk *c)
+{
+	const struct ufs_aio *aio = c->aio;
+	char *buf = aio->buf + c->buf_offset;
+	int i = c->span_index;
+	size_t offset = c->span_offset;
+	size_t done = 0;
+	while (done < c->size) {
+		const struct ufs_span *s = &aio->spans[i++];
+		size_t n = s->size - offset;
+		if (n > c->size - done)
+			n = c->size - done;
+		if (aio->is_write)
+			memcpy((char *)s->data + offset, buf + done, n);
+		else
+			memcpy(buf + done, s->data + offset, n);
+		done += n;
+		offset = 0;
+	}
+}
+
+static void *
+ufs_aio_chunk_f(void *arg)
+{
+	struct ufs_aio_chunk *c = arg;
+	ufs_aio_copy(c);
+	__atomic_add_fetch(&c->aio->done_count, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static int
+ufs_aio_start(struct thread_pool *pool, int fd, bool is_write, char *buf,
+	      size_t size, size_t offset, struct ufs_aio **result)
+{
+	struct ufs_aio *aio = calloc(1, sizeof(*aio));
+	aio->is_write = is_write;
+	aio->buf = buf;
+	if (ufs_aio_map(aio, fd, offset, size) != 0) {
+		free(aio);
+		return -1;
+	}
+	ufs_aio_split(aio);
+	for (int i = 0; i < aio->chunk_count; ++i) {
+		struct ufs_aio_chunk *c = &aio->chunks[i];
+		aio->tasks[i] = thread_task_init(&c->task, ufs_aio_chunk_f, c);
+	}
+	/* A single chunk is not worth a task switch. */
+	if (aio->chunk_count > 1 &&
+	    thread_pool_push_tasks(pool, aio->tasks, aio->chunk_count) == 0) {
+		aio->is_pushed = true;
+	} else {
+		for (int i = 0; i < aio->chunk_count; ++i)
+			ufs_aio_copy(&aio->chunks[i]);
+		aio->done_count = aio->chunk_count;
+	}
+	*result = aio;
+	return 0;
+}
+
+int
+ufs_aio_read(struct thread_pool *pool, int fd, char *buf, size_t size,
+	     size_t offset, struct ufs_aio **aio)
+{
+	return ufs_aio_start(pool, fd, false, buf, size, offset, aio);
+}
+
+int
+ufs_aio_write(struct thread_pool *pool, int fd, const char *buf, size_t size,
+	      size_t offset, struct ufs_aio **aio)
+{
+	/* Only read from, the copy direction is in the request. */
+	return ufs_aio_start(pool, fd, true, (char *)buf, size, offset, aio);
+}
+
+bool
+ufs_aio_is_finished(const struct ufs_aio *aio)
+{
+	return __atomic_load_n(&aio->done_count, __ATOMIC_ACQUIRE) ==
+	       aio->chunk_count;
+}
+
+ssize_t
+ufs_aio_join(struct ufs_aio *aio)
+{
+	if (aio->is_pushed)
+		thread_task_join_all(aio->tasks, aio->chunk_count, NULL);
+	for (int i = 0; i < aio->chunk_count; ++i)
+		thread_task_destroy(aio->tasks[i]);
+	ufs_unmap(aio->spans, aio->span_count);
+	ssize_t size = aio->size;
+	free(aio->spans);
+	free(aio->chunks);
+	free(aio->tasks);
+	free(aio);
+	return size;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "thread_pool.h"
+#include "userfs.h"
+
+/**
+ * Asynchronous I/O of big ranges of the files. A request is split
+ * into chunks of UFS_AIO_CHUNK_SIZE bytes, copied in parallel by the
+ * tasks of a thread pool. The file blocks are mapped by the caller,
+ * see ufs_map_range() and ufs_map_range_writable(), so the copies
+ * don't take the file lock and don't block each other. A request
+ * not bigger than a chunk, or not fitting into the pool's queue, is
+ * done right in the calling thread.
+ *
+ *     struct ufs_aio *aio;
+ *     if (ufs_aio_write(pool, fd, buf, size, 0, &aio) != 0)
+ *         return -1;
+ *     ...
+ *     ssize_t rc = ufs_aio_join(aio);
+ */
+
+enum {
+	UFS_AIO_CHUNK_SIZE = 256 * 1024,
+};
+
+struct ufs_aio;
+
+/**
+ * Start reading the file range into @a buf.
+ * @param pool Pool to run the copies in.
+ * @param fd File descriptor from ufs_open().
+ * @param buf Buffer to read into. Valid until the request is joined.
+ * @param size Size of @a buf.
+ * @param offset Offset in the file.
+ * @param[out] aio The request handle.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Same codes as of ufs_pread().
+ */
+int
+ufs_aio_read(struct thread_pool *pool, int fd, char *buf, size_t size,
+	     size_t offset, struct ufs_aio **aio);
+
+/**
+ * Start writing @a buf into the file range. The file is extended
+ * right away, and its blocks of the range are pinned till the join.
+ * The range has to be not written by anything else in the meantime,
+ * otherwise the data of a block written by both can be lost, see
+ * ufs_map_range_writable().
+ * @param pool Pool to run the copies in.
+ * @param fd File descriptor from ufs_open().
+ * @param buf Buffer to write. Valid until the request is joined.
+ * @param size Size of @a buf.
+ * @param offset Offset in the file.
+ * @param[out] aio The request handle.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Same codes as of ufs_pwrite().
+ */
+int
+ufs_aio_write(struct thread_pool *pool, int fd, const char *buf, size_t size,
+	      size_t offset, struct ufs_aio **aio);
+
+/** Check if all the chunks of the request are copied. */
+bool
+ufs_aio_is_finished(const struct ufs_aio *aio);
+
+/**
+ * Wait for the request to finish, and delete it.
+ * @param aio The request handle.
+ *
+ * @retval >= 0 How many bytes were read or written. A read of a
+ *     range after the file end returns less.
+ */
+ssize_t
+ufs_aio_join(struct ufs_aio *aio);
@@ -0,0 +1,770 @@
+#include "userfs.h"
+#include "userfs_aio.h"
+#include "unit_bench.h"
+
+#include <malloc.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Benchmarks of the file system on ../utils/unit_bench.h. The arg of
+ * a bench is its parameter: the chunk size of the I/O ones, the
+ * thread count of the bulk and append ones, the file count or the
+ * directory depth of the lookup ones. So MB/s of the I/O ones is the
+ * chunk size, or BENCH_FILE_SIZE of the bulk and
+ * BENCH_APPEND_RECORD_SIZE of the append ones, * 1e9 / 2^20 / ns.
+ *
+ * The memory benches build a file set, one iteration is one set. Its
+ * memory usage, real memory vs logical file bytes, with the peak RSS
+ * of the building, goes to the info of the report.
+ */
+
+enum {
+	BENCH_FILE_SIZE = 64 * 1024 * 1024,
+	/** Limit of the ops of one run at the small chunks. */
+	BENCH_MAX_OP_COUNT = 1000 * 1000,
+	/** The directory trees have this many leaves of files. */
+	BENCH_TREE_LEAF_COUNT = 10000,
+	BENCH_TREE_LEAF_SIZE = 100,
+	BENCH_APPEND_RECORD_SIZE = 100,
+};
+
+/**
+ * The files kept between the runs of a lookup bench, they take long
+ * to create. The other benches start and end with no files.
+ */
+enum bench_set {
+	BENCH_SET_NONE,
+	BENCH_SET_FILES,
+	BENCH_SET_TREE,
+};
+
+static enum bench_set set_kind = BENCH_SET_NONE;
+/** File count or tree depth of the set. */
+static long set_param = 0;
+
+/** A field of /proc/self/status, in KB. */
+static long
+bench_proc_status_kb(const char *field)
+{
+	FILE *f = fopen("/proc/self/status", "r");
+	if (f == NULL)
+		return 0;
+	char line[256];
+	long res = 0;
+	size_t len = strlen(field);
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (strncmp(line, field, len) == 0) {
+			res = atol(line + len);
+			break;
+		}
+	}
+	fclose(f);
+	return res;
+}
+
+/** Make the peak RSS equal to the current one. */
+static void
+bench_rss_reset_peak(void)
+{
+	FILE *f = fopen("/proc/self/clear_refs", "w");
+	if (f == NULL)
+		return;
+	fputs("5", f);
+	fclose(f);
+}
+
+static void
+bench_create_files(long file_count)
+{
+	char name[32];
+	for (long i = 0; i < file_count; ++i) {
+		sprintf(name, "file%ld", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		if (fd < 0 || ufs_close(fd) != 0)
+			abort();
+	}
+}
+
+/**
+ * Path of a leaf directory of a tree of the given depth. Each leaf
+ * is at the end of its own chain of directories.
+ */
+static int
+bench_tree_path(char *path, long leaf, long depth)
+{
+	int len = sprintf(path, "n%ld", leaf);
+	for (long i = 1; i < depth; ++i)
+		len += sprintf(path + len, "/d%ld", i);
+	return len;
+}
+
+static void
+bench_create_tree(long depth)
+{
+	char path[256];
+	for (long i = 0; i < BENCH_TREE_LEAF_COUNT; ++i) {
+		int len = sprintf(path, "n%ld", i);
+		if (ufs_mkdir(path) != 0)
+			abort();
+		for (long j = 1; j < depth; ++j) {
+			len += sprintf(path + len, "/d%ld", j);
+			if (ufs_mkdir(path) != 0)
+				abort();
+		}
+		for (long j = 0; j < BENCH_TREE_LEAF_SIZE; ++j) {
+			sprintf(path + len, "/file%ld", j);
+			int fd = ufs_open(path, UFS_CREATE);
+			if (fd < 0 || ufs_close(fd) != 0)
+				abort();
+		}
+	}
+}
+
+/**
+ * Make the set of the lookup benches, if it isn't there already. With
+ * BENCH_SET_NONE just drop the previous one. Not measured.
+ */
+static void
+bench_set_prepare(enum bench_set kind, long param)
+{
+	if (set_kind == kind && set_param == param)
+		return;
+	bench_pause();
+	if (set_kind != BENCH_SET_NONE)
+		ufs_destroy();
+	set_kind = kind;
+	set_param = param;
+	if (kind == BENCH_SET_FILES)
+		bench_create_files(param);
+	else if (kind == BENCH_SET_TREE)
+		bench_create_tree(param);
+	bench_resume();
+}
+
+/**
+ * @a file_count files exist. One op is an open of a pseudo-random
+ * one and its close.
+ */
+static void
+bench_open_close(long op_count, long file_count)
+{
+	bench_set_prepare(BENCH_SET_FILES, file_count);
+	char name[32];
+	uint64_t seed = 1;
+	for (long i = 0; i < op_count; ++i) {
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		sprintf(name, "file%ld", (long)((seed >> 33) % file_count));
+		int fd = ufs_open(name, 0);
+		if (fd < 0 || ufs_close(fd) != 0)
+			abort();
+	}
+}
+
+/**
+ * A tree of @a depth is created. One op is an open and a close of a
+ * pseudo-random file of it, in a pseudo-random leaf directory when
+ * @a is_hot is false, so the prefix cache mostly misses. Otherwise
+ * of one leaf.
+ */
+static void
+bench_open_close_tree(long op_count, long depth, bool is_hot)
+{
+	bench_set_prepare(BENCH_SET_TREE, depth);
+	char path[256];
+	uint64_t seed = 1;
+	int hot_len = bench_tree_path(path, 0, depth);
+	for (long i = 0; i < op_count; ++i) {
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		long file = (seed >> 33) % (BENCH_TREE_LEAF_COUNT *
+					    BENCH_TREE_LEAF_SIZE);
+		int len = is_hot ? hot_len : bench_tree_path(
+			path, file / BENCH_TREE_LEAF_SIZE, depth);
+		sprintf(path + len, "/file%ld", file % BENCH_TREE_LEAF_SIZE);
+		int fd = ufs_open(path, 0);
+		if (fd < 0 || ufs_close(fd) != 0)
+			abort();
+	}
+}
+
+static void
+bench_open_close_tree_random(long op_count, long depth)
+{
+	bench_open_close_tree(op_count, depth, false);
+}
+
+static void
+bench_open_close_tree_hot(long op_count, long depth)
+{
+	bench_open_close_tree(op_count, depth, true);
+}
+
+/** A file of @a size bytes of a pattern, and a descriptor of it. */
+static int
+bench_create_file(const char *name, long size)
+{
+	enum { CHUNK_SIZE = 1024 * 1024 };
+	char *chunk = malloc(CHUNK_SIZE);
+	for (int i = 0; i < CHUNK_SIZE; ++i)
+		chunk[i] = 'a' + i % 26;
+	int fd = ufs_open(name, UFS_CREATE);
+	for (long done = 0; done < size; done += CHUNK_SIZE) {
+		long n = size - done < CHUNK_SIZE ? size - done : CHUNK_SIZE;
+		if (ufs_write(fd, chunk, n) != n)
+			abort();
+	}
+	free(chunk);
+	return fd;
+}
+
+/**
+ * Fill the buffer with words of a small dictionary, which compress
+ * about as well as a text or a log.
+ */
+static void
+bench_fill_text(char *buf, long size, uint64_t *seed)
+{
+	static const char *const words[] = {
+		"the ", "request ", "of ", "user ", "id=", "42 ", "took ",
+		"ms ", "and ", "returned ", "status ", "200\n", "file ",
+		"error ", "timeout ", "retry ", "connection ", "closed\n",
+	};
+	long pos = 0;
+	while (pos < size) {
+		*seed = *seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		const char *w = words[(*seed >> 33) % (sizeof(words) /
+						      sizeof(words[0]))];
+		for (; *w != 0 && pos < size; ++w)
+			buf[pos++] = *w;
+		/* Some noise, like the numbers and the times. */
+		if (pos < size && (*seed >> 20) % 4 == 0)
+			buf[pos++] = '0' + (*seed >> 40) % 10;
+	}
+}
+
+/**
+ * A text file of @a size bytes compressed by ufs_compact(), and a
+ * descriptor of it.
+ */
+static int
+bench_create_compressed_file(const char *name, long size)
+{
+	enum { CHUNK_SIZE = 1024 * 1024 };
+	char *chunk = malloc(CHUNK_SIZE);
+	uint64_t seed = 1;
+	int fd = ufs_open(name, UFS_CREATE);
+	for (long done = 0; done < size; done += CHUNK_SIZE) {
+		long n = size - done < CHUNK_SIZE ? size - done : CHUNK_SIZE;
+		bench_fill_text(chunk, n, &seed);
+		if (ufs_write(fd, chunk, n) != n)
+			abort();
+	}
+	free(chunk);
+	/* The first one only ages the new blocks. */
+	ufs_compact();
+	ufs_compact();
+	return fd;
+}
+
+/**
+ * One op is a read of @a chunk_size bytes of compressed data, the
+ * next ones or at a random offset.
+ */
+static void
+bench_read_compressed(long op_count, long chunk_size, bool is_random)
+{
+	bench_set_prepare(BENCH_SET_NONE, 0);
+	bench_pause();
+	char *chunk = malloc(chunk_size);
+	long size = is_random ? BENCH_FILE_SIZE : op_count * chunk_size;
+	int fd = bench_create_compressed_file("file", size);
+	uint64_t seed = 1;
+	bench_resume();
+	for (long i = 0; i < op_count; ++i) {
+		size_t offset = i * chunk_size;
+		if (is_random) {
+			seed = seed * 6364136223846793005ULL +
+			       1442695040888963407ULL;
+			offset = (seed >> 33) % (size - chunk_size);
+		}
+		if (ufs_pread(fd, chunk, chunk_size, offset) != chunk_size)
+			abort();
+	}
+	bench_pause();
+	ufs_close(fd);
+	ufs_destroy();
+	free(chunk);
+	bench_resume();
+}
+
+static void
+bench_seq_read_compressed(long op_count, long chunk_size)
+{
+	bench_read_compressed(op_count, chunk_size, false);
+}
+
+static void
+bench_random_read_compressed(long op_count, long chunk_size)
+{
+	bench_read_compressed(op_count, chunk_size, true);
+}
+
+/** One op is a write of @a chunk_size bytes to the end of a file. */
+static void
+bench_seq_write(long op_count, long chunk_size)
+{
+	bench_set_prepare(BENCH_SET_NONE, 0);
+	bench_pause();
+	char *chunk = calloc(1, chunk_size);
+	int fd = ufs_open("file", UFS_CREATE);
+	bench_resume();
+	for (long i = 0; i < op_count; ++i) {
+		if (ufs_write(fd, chunk, chunk_size) != chunk_size)
+			abort();
+	}
+	bench_pause();
+	ufs_close(fd);
+	ufs_destroy();
+	free(chunk);
+	bench_resume();
+}
+
+/** One op is a read of next @a chunk_size bytes of a file. */
+static void
+bench_seq_read(long op_count, long chunk_size)
+{
+	bench_set_prepare(BENCH_SET_NONE, 0);
+	bench_pause();
+	char *chunk = malloc(chunk_size);
+	int fd = bench_create_file("file", op_count * chunk_size);
+	ufs_close(fd);
+	fd = ufs_open("file", 0);
+	bench_resume();
+	for (long i = 0; i < op_count; ++i) {
+		if (ufs_read(fd, chunk, chunk_size) != chunk_size)
+			abort();
+	}
+	bench_pause();
+	ufs_close(fd);
+	ufs_destroy();
+	free(chunk);
+	bench_resume();
+}
+
+/** One op is a read of @a chunk_size bytes at a random offset. */
+static void
+bench_random_read(long op_count, long chunk_size)
+{
+	bench_set_prepare(BENCH_SET_NONE, 0);
+	bench_pause();
+	char *chunk = malloc(chunk_size);
+	int fd = bench_create_file("file", BENCH_FILE_SIZE);
+	uint64_t seed = 1;
+	bench_resume();
+	for (long i = 0; i < op_count; ++i) {
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		size_t offset = (seed >> 33) % (BENCH_FILE_SIZE - chunk_size);
+		if (ufs_pread(fd, chunk, chunk_size, offset) != chunk_size)
+			abort();
+	}
+	bench_pause();
+	ufs_close(fd);
+	ufs_destroy();
+	free(chunk);
+	bench_resume();
+}
+
+/** A file of the max size, and a writable descriptor of it. */
+static int
+bench_create_max_file(const char *name)
+{
+	enum { CHUNK_SIZE = 1024 * 1024 };
+	char *chunk = calloc(1, CHUNK_SIZE);
+	int fd = ufs_open(name, UFS_CREATE);
+	for (int i = 0; i < 100; ++i) {
+		if (ufs_write(fd, chunk, CHUNK_SIZE) != CHUNK_SIZE)
+			abort();
+	}
+	free(chunk);
+	return fd;
+}
+
+/**
+ * One op is a write of a new file of BENCH_FILE_SIZE bytes in one
+ * call. With 0 threads it is ufs_pwrite(), otherwise an aio on a
+ * pool of that many threads.
+ */
+static void
+bench_bulk_write(long op_count, long thread_count)
+{
+	bench_set_prepare(BENCH_SET_NONE, 0);
+	bench_pause();
+	char *buf = malloc(BENCH_FILE_SIZE);
+	memset(buf, 'x', BENCH_FILE_SIZE);
+	struct thread_pool *pool = NULL;
+	if (thread_count > 0 && thread_pool_new(thread_count, &pool) != 0)
+		abort();
+	bench_resume();
+	for (long i = 0; i < op_count; ++i) {
+		int fd = ufs_open("file", UFS_CREATE);
+		ssize_t rc;
+		if (pool == NULL) {
+			rc = ufs_pwrite(fd, buf, BENCH_FILE_SIZE, 0);
+		} else {
+			struct ufs_aio *aio;
+			if (ufs_aio_write(pool, fd, buf, BENCH_FILE_SIZE, 0,
+					  &aio) != 0)
+				abort();
+			rc = ufs_aio_join(aio);
+		}
+		if (rc != BENCH_FILE_SIZE)
+			abort();
+		ufs_close(fd);
+		ufs_delete("file");
+	}
+	bench_pause();
+	if (pool != NULL)
+		thread_pool_delete(pool);
+	ufs_destroy();
+	free(buf);
+	bench_resume();
+}
+
+struct bench_append_worker {
+	pthread_t thread;
+	long op_count;
+	int flags;
+};
+
+static void *
+bench_append_worker_f(void *arg)
+{
+	struct bench_append_worker *w = arg;
+	char rec[BENCH_APPEND_RECORD_SIZE];
+	memset(rec, 'r', sizeof(rec));
+	int fd = ufs_open("log", w->flags);
+	for (long i = 0; i < w->op_count; ++i) {
+		if (ufs_write(fd, rec, sizeof(rec)) != sizeof(rec))
+			abort();
+	}
+	ufs_close(fd);
+	return NULL;
+}
+
+/**
+ * One op is an append of a small record to a log file, by each of
+ * the threads via UFS_APPEND. With 0 threads it is a plain write in
+ * the calling thread, under the file lock.
+ */
+static void
+bench_append(long op_count, long thread_count)
+{
+	bench_set_prepare(BENCH_SET_NONE, 0);
+	bench_pause();
+	ufs_close(ufs_open("log", UFS_CREATE));
+	struct bench_append_worker workers[8];
+	bench_resume();
+	if (thread_count == 0) {
+		workers[0].op_count = op_count;
+		workers[0].flags = 0;
+		bench_append_worker_f(&workers[0]);
+	}
+	for (long i = 0; i < thread_count; ++i) {
+		struct bench_append_worker *w = &workers[i];
+		w->op_count = op_count / thread_count;
+		w->flags = UFS_APPEND;
+		if (pthread_create(&w->thread, NULL, bench_append_worker_f,
+				   w) != 0)
+			abort();
+	}
+	for (long i = 0; i < thread_count; ++i)
+		pthread_join(workers[i].thread, NULL);
+	bench_pause();
+	ufs_destroy();
+	bench_resume();
+}
+
+/** Same as bench_bulk_write(), a read of the whole file. */
+static void
+bench_bulk_read(long op_count, long thread_count)
+{
+	bench_set_prepare(BENCH_SET_NONE, 0);
+	bench_pause();
+	char *buf = malloc(BENCH_FILE_SIZE);
+	int fd = bench_create_file("file", BENCH_FILE_SIZE);
+	struct thread_pool *pool = NULL;
+	if (thread_count > 0 && thread_pool_new(thread_count, &pool) != 0)
+		abort();
+	bench_resume();
+	for (long i = 0; i < op_count; ++i) {
+		ssize_t rc;
+		if (pool == NULL) {
+			rc = ufs_pread(fd, buf, BENCH_FILE_SIZE, 0);
+		} else {
+			struct ufs_aio *aio;
+			if (ufs_aio_read(pool, fd, buf, BENCH_FILE_SIZE, 0,
+					 &aio) != 0)
+				abort();
+			rc = ufs_aio_join(aio);
+		}
+		if (rc != BENCH_FILE_SIZE)
+			abort();
+	}
+	bench_pause();
+	if (pool != NULL)
+		thread_pool_delete(pool);
+	ufs_close(fd);
+	ufs_destroy();
+	free(buf);
+	bench_resume();
+}
+
+/**
+ * One op is a clone of a 100MB file over its previous clone, and a
+ * write of a byte into the clone, which copies one block.
+ */
+static void
+bench_clone(long op_count, long arg)
+{
+	(void)arg;
+	bench_set_prepare(BENCH_SET_NONE, 0);
+	bench_pause();
+	int src = bench_create_max_file("src");
+	uint64_t seed = 1;
+	bench_resume();
+	for (long i = 0; i < op_count; ++i) {
+		if (ufs_clone("src", "dst") != 0)
+			abort();
+		int fd = ufs_open("dst", 0);
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		size_t offset = (seed >> 33) % (100 * 1024 * 1024);
+		if (ufs_pwrite(fd, "x", 1, offset) != 1)
+			abort();
+		ufs_close(fd);
+	}
+	bench_pause();
+	ufs_close(src);
+	ufs_destroy();
+	bench_resume();
+}
+
+/**
+ * Start measuring the memory of a file set, not measured. Returns the
+ * RSS before.
+ */
+static long
+bench_memory_start(void)
+{
+	bench_set_prepare(BENCH_SET_NONE, 0);
+	bench_pause();
+	/* Not to count the memory freed, but kept by malloc. */
+	malloc_trim(0);
+	bench_rss_reset_peak();
+	long res = bench_proc_status_kb("VmRSS:");
+	bench_resume();
+	return res;
+}
+
+/** Report the usage of the current file set and destroy it. */
+static void
+bench_memory_finish(const char *name, long rss_before_kb)
+{
+	bench_pause();
+	struct ufs_stat st;
+	ufs_stat(&st);
+	long peak_rss_kb = bench_proc_status_kb("VmHWM:") - rss_before_kb;
+	double rss_per_byte = st.data_size == 0 ? 0 :
+			      peak_rss_kb * 1024.0 / st.data_size;
+	char compressed[96] = "";
+	if (st.compressed_data_size > 0) {
+		snprintf(compressed, sizeof(compressed),
+			 ", compressed %zu of %zu", st.compressed_size,
+			 st.compressed_data_size);
+	}
+	char value[512];
+	snprintf(value, sizeof(value), "files %zu, data %zu, blocks %zu, "
+		 "slab %zu, slab used %zu, large blocks %zu%s, "
+		 "peak rss %ld KB, %.3f per byte", st.file_count,
+		 st.data_size, st.block_size, st.slab_size, st.slab_used_size,
+		 st.large_block_size, compressed, peak_rss_kb, rss_per_byte);
+	bench_info(name, value);
+	ufs_destroy();
+	bench_resume();
+}
+
+/** Create @a file_count files of @a file_size bytes and get the usage. */
+static void
+bench_memory(const char *name, long file_count, long file_size)
+{
+	long rss = bench_memory_start();
+	char name_buf[32];
+	char chunk[4096] = {0};
+	for (long i = 0; i < file_count; ++i) {
+		sprintf(name_buf, "file%ld", i);
+		int fd = ufs_open(name_buf, UFS_CREATE);
+		for (long done = 0; done < file_size;) {
+			long size = file_size - done;
+			if (size > (long)sizeof(chunk))
+				size = sizeof(chunk);
+			if (ufs_write(fd, chunk, size) != size)
+				abort();
+			done += size;
+		}
+		ufs_close(fd);
+	}
+	bench_memory_finish(name, rss);
+}
+
+static void
+bench_memory_empty_files(long iterations, long arg)
+{
+	(void)arg;
+	for (long i = 0; i < iterations; ++i)
+		bench_memory("memory_empty_files", 100 * 1000, 0);
+}
+
+static void
+bench_memory_small_files(long iterations, long arg)
+{
+	(void)arg;
+	for (long i = 0; i < iterations; ++i)
+		bench_memory("memory_small_files", 100 * 1000, 100);
+}
+
+static void
+bench_memory_medium_files(long iterations, long arg)
+{
+	(void)arg;
+	for (long i = 0; i < iterations; ++i)
+		bench_memory("memory_medium_files", 1000, 100 * 1000);
+}
+
+static void
+bench_memory_max_file(long iterations, long arg)
+{
+	(void)arg;
+	for (long i = 0; i < iterations; ++i)
+		bench_memory("memory_max_file", 1, 100 * 1024 * 1024);
+}
+
+/** The clones share the blocks, but each has its own copy of one. */
+static void
+bench_memory_clones(long iterations, long arg)
+{
+	(void)arg;
+	for (long i = 0; i < iterations; ++i) {
+		long rss = bench_memory_start();
+		int src = bench_create_max_file("src");
+		ufs_close(src);
+		for (int j = 0; j < 10; ++j) {
+			char name[32];
+			sprintf(name, "clone%d", j);
+			ufs_clone("src", name);
+			int fd = ufs_open(name, 0);
+			ufs_pwrite(fd, "x", 1, 0);
+			ufs_close(fd);
+		}
+		bench_memory_finish("memory_max_file_10_clones", rss);
+	}
+}
+
+/** A hole of the max size with one written byte in the middle. */
+static void
+bench_memory_sparse(long iterations, long arg)
+{
+	(void)arg;
+	for (long i = 0; i < iterations; ++i) {
+		long rss = bench_memory_start();
+		int fd = ufs_open("sparse", UFS_CREATE);
+		ufs_resize(fd, 100 * 1024 * 1024);
+		ufs_pwrite(fd, "x", 1, 50 * 1024 * 1024);
+		ufs_close(fd);
+		bench_memory_finish("memory_sparse_max_file", rss);
+	}
+}
+
+/** Cold text files, compressed. */
+static void
+bench_memory_compressed(long iterations, long arg)
+{
+	(void)arg;
+	for (long i = 0; i < iterations; ++i) {
+		long rss = bench_memory_start();
+		for (int j = 0; j < 1000; ++j) {
+			char name[32];
+			sprintf(name, "text%d", j);
+			ufs_close(bench_create_compressed_file(name,
+							       100 * 1000));
+		}
+		bench_memory_finish("memory_compressed_text_files", rss);
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	const long chunk_sizes[] = {1, 512, 4096, 64 * 1024, 1024 * 1024};
+	for (size_t i = 0; i < sizeof(chunk_sizes) / sizeof(chunk_sizes[0]);
+	     ++i) {
+		long size = chunk_sizes[i];
+		long op_count = BENCH_FILE_SIZE / size;
+		if (op_count > BENCH_MAX_OP_COUNT)
+			op_count = BENCH_MAX_OP_COUNT;
+		bench_register_arg("seq_write", bench_seq_write, op_count,
+				   size);
+		bench_register_arg("seq_read", bench_seq_read, op_count, size);
+	}
+	bench_register_arg("random_read", bench_random_read,
+			   BENCH_MAX_OP_COUNT, 4096);
+	bench_register_arg("seq_read_compressed", bench_seq_read_compressed,
+			   BENCH_FILE_SIZE / 4096, 4096);
+	bench_register_arg("seq_read_compressed", bench_seq_read_compressed,
+			   BENCH_FILE_SIZE / (64 * 1024), 64 * 1024);
+	bench_register_arg("random_read_compressed",
+			   bench_random_read_compressed, 100 * 1000, 4096);
+	const long thread_counts[] = {0, 1, 2, 4};
+	for (size_t i = 0; i < sizeof(thread_counts) / sizeof(thread_counts[0]);
+	     ++i) {
+		bench_register_arg("bulk_write", bench_bulk_write, 8,
+				   thread_counts[i]);
+		bench_register_arg("bulk_read", bench_bulk_read, 8,
+				   thread_counts[i]);
+	}
+	for (size_t i = 0; i < sizeof(thread_counts) / sizeof(thread_counts[0]);
+	     ++i) {
+		bench_register_arg("append", bench_append, BENCH_MAX_OP_COUNT,
+				   thread_counts[i]);
+	}
+	const long file_counts[] = {1000, 100 * 1000, 1000 * 1000};
+	for (size_t i = 0; i < sizeof(file_counts) / sizeof(file_counts[0]);
+	     ++i) {
+		bench_register_arg("open_close", bench_open_close, 1000 * 1000,
+				   file_counts[i]);
+	}
+	/* 1M files in directory trees, the lookup cost by the depth. */
+	const long depths[] = {1, 4, 16};
+	for (size_t i = 0; i < sizeof(depths) / sizeof(depths[0]); ++i) {
+		bench_register_arg("open_close_tree",
+				   bench_open_close_tree_random, 1000 * 1000,
+				   depths[i]);
+		bench_register_arg("open_close_hot_dir",
+				   bench_open_close_tree_hot, 1000 * 1000,
+				   depths[i]);
+	}
+	bench_register("clone_100mb", bench_clone, 1000);
+	bench_register("memory_empty_files", bench_memory_empty_files, 1);
+	bench_register("memory_small_files", bench_memory_small_files, 1);
+	bench_register("memory_medium_files", bench_memory_medium_files, 1);
+	bench_register("memory_max_file", bench_memory_max_file, 1);
+	bench_register("memory_max_file_10_clones", bench_memory_clones, 1);
+	bench_register("memory_sparse_max_file", bench_memory_sparse, 1);
+	bench_register("memory_compressed_text_files",
+		       bench_memory_compressed, 1);
+	int rc = bench_main(argc, argv);
+	bench_set_prepare(BENCH_SET_NONE, 0);
+	return rc;
+}
@@ -0,0 +1,156 @@
+#include "userfs.h"
+#include "unit_bench.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * A 100MB file with its big blocks from malloc() vs on the huge pages
+ * of ufs_set_huge_pages(). The arg of a bench is the flags, 0 or
+ * UFS_HUGE_THP. The small random reads all over the file miss the TLB
+ * on nearly each read with 4KB pages, the sequential I/O shows the
+ * page faults and the copies.
+ *
+ * The resident memory and the huge part of it, as seen in
+ * /proc/self/smaps_rollup, are added to the info of the report. Run
+ * with BENCH_ARGS="--perf" to see the dTLB misses and page faults, if
+ * perf_event has them.
+ */
+
+enum {
+	BENCH_FILE_SIZE = 100 * 1024 * 1024,
+	BENCH_WRITE_SIZE = 4096,
+	BENCH_READ_SIZE = 64 * 1024,
+	BENCH_RANDOM_READ_SIZE = 8,
+};
+
+static const char *BENCH_FILE_NAME = "huge_bench";
+/** Flags the file was written with, -1 if there is no file. */
+static long file_flags = -1;
+
+/** A field of /proc/self/smaps_rollup in KB, like "Rss:". */
+static long
+bench_smaps_kb(const char *key)
+{
+	FILE *f = fopen("/proc/self/smaps_rollup", "r");
+	if (f == NULL)
+		return -1;
+	char line[256];
+	long res = -1;
+	size_t len = strlen(key);
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (strncmp(line, key, len) == 0) {
+			res = strtol(line + len, NULL, 10);
+			break;
+		}
+	}
+	fclose(f);
+	return res;
+}
+
+static void
+bench_info_memory(long flags)
+{
+	char key[64], value[128];
+	snprintf(key, sizeof(key), "file_%s", flags != 0 ? "huge" : "malloc");
+	snprintf(value, sizeof(value), "rss %ld KB, huge %ld KB",
+		 bench_smaps_kb("Rss:"), bench_smaps_kb("AnonHugePages:"));
+	bench_info(key, value);
+}
+
+/**
+ * Write the file anew with @a iterations writes. Only the writes are
+ * measured, not the deletion of the old file.
+ */
+static void
+bench_write_file(long iterations, long flags)
+{
+	static char buf[BENCH_WRITE_SIZE];
+	bench_pause();
+	ufs_delete(BENCH_FILE_NAME);
+	ufs_set_huge_pages((int)flags);
+	int fd = ufs_open(BENCH_FILE_NAME, UFS_CREATE);
+	bench_resume();
+	for (long i = 0; i < iterations; ++i) {
+		memset(buf, i, 64);
+		if (ufs_write(fd, buf, sizeof(buf)) != sizeof(buf))
+			abort();
+	}
+	bench_pause();
+	ufs_close(fd);
+	file_flags = flags;
+	bench_info_memory(flags);
+	bench_resume();
+}
+
+/**
+ * Make sure the file is there, written with @a flags. It is by the
+ * write bench before, unless it is filtered out. Then the first run
+ * is slower.
+ */
+static void
+bench_prepare_file(long flags)
+{
+	if (file_flags != flags)
+		bench_write_file(BENCH_FILE_SIZE / BENCH_WRITE_SIZE, flags);
+}
+
+/** One iteration is a write of BENCH_WRITE_SIZE. */
+static void
+bench_write(long iterations, long flags)
+{
+	bench_write_file(iterations, flags);
+}
+
+/** One iteration is a read of BENCH_READ_SIZE. */
+static void
+bench_read_seq(long iterations, long flags)
+{
+	static char buf[BENCH_READ_SIZE];
+	bench_prepare_file(flags);
+	int fd = ufs_open(BENCH_FILE_NAME, 0);
+	for (long i = 0; i < iterations; ++i) {
+		if (ufs_read(fd, buf, sizeof(buf)) != sizeof(buf))
+			abort();
+	}
+	ufs_close(fd);
+}
+
+/** One iteration is a read of a few bytes at a random place. */
+static void
+bench_read_random(long iterations, long flags)
+{
+	char buf[BENCH_RANDOM_READ_SIZE];
+	bench_prepare_file(flags);
+	int fd = ufs_open(BENCH_FILE_NAME, 0);
+	uint64_t x = 88172645463325252ULL;
+	for (long i = 0; i < iterations; ++i) {
+		/* xorshift, cheaper than rand(). */
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		size_t pos = x % (BENCH_FILE_SIZE - sizeof(buf));
+		if (ufs_pread(fd, buf, sizeof(buf), pos) != sizeof(buf))
+			abort();
+	}
+	ufs_close(fd);
+}
+
+int
+main(int argc, char **argv)
+{
+	const long flags[] = {0, UFS_HUGE_THP};
+	for (int i = 0; i < 2; ++i) {
+		bench_register_arg("write_4k", bench_write, BENCH_FILE_SIZE /
+				   BENCH_WRITE_SIZE, flags[i]);
+		bench_register_arg("read_64k_seq", bench_read_seq,
+				   BENCH_FILE_SIZE / BENCH_READ_SIZE, flags[i]);
+		bench_register_arg("read_8b_random", bench_read_random, 2000000,
+				   flags[i]);
+	}
+	int rc = bench_main(argc, argv);
+	ufs_destroy();
+	return rc;
+}
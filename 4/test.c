@@ -1,8 +1,14 @@
+#define _GNU_SOURCE
 #include "thread_pool.h"
 #include "unit.h"
+#if TPOOL_CORO
+#include "libcoro.h"
+#endif
 #include <pthread.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
 static void
 test_new(void)
@@ -299,6 +305,1029 @@ test_timed_join(void)
 #endif
 }
 
+static void
+test_push_tasks(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	enum { COUNT = 100 };
+	struct thread_task *tasks[COUNT];
+	void *results[COUNT];
+	int arg = 0;
+	for (int i = 0; i < COUNT; ++i)
+		unit_fail_if(thread_task_new(&tasks[i], task_incr_f,
+					     &arg) != 0);
+	unit_check(thread_task_join_all(tasks, COUNT, results) ==
+		   TPOOL_ERR_TASK_NOT_PUSHED, "join_all of not pushed tasks");
+	unit_check(thread_pool_push_tasks(p, tasks, COUNT) == 0,
+		   "push a batch");
+	unit_check(thread_pool_push_tasks(p, tasks, 1) ==
+		   TPOOL_ERR_TASK_IN_POOL, "push a batch with a pushed task");
+	unit_check(thread_task_join_all(tasks, COUNT, results) == 0,
+		   "join_all");
+	unit_check(arg == COUNT, "all the tasks are done");
+	bool ok = true;
+	for (int i = 0; i < COUNT; ++i)
+		ok = ok && results[i] == &arg;
+	unit_check(ok, "all the results are returned");
+	unit_check(thread_pool_push_tasks(p, tasks, COUNT) == 0,
+		   "push the batch again");
+	unit_check(thread_task_join_all(tasks, COUNT, NULL) == 0,
+		   "join_all without results");
+	unit_check(arg == 2 * COUNT, "all the tasks are done again");
+	for (int i = 0; i < COUNT; ++i)
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+
+	struct thread_task **many = malloc((TPOOL_MAX_TASKS + 1) *
+					   sizeof(many[0]));
+	for (int i = 0; i <= TPOOL_MAX_TASKS; ++i)
+		unit_fail_if(thread_task_new(&many[i], task_incr_f, &arg) != 0);
+	unit_check(thread_pool_push_tasks(p, many, TPOOL_MAX_TASKS + 1) ==
+		   TPOOL_ERR_TOO_MANY_TASKS, "too big batch");
+	unit_check(thread_pool_push_tasks(p, many, TPOOL_MAX_TASKS) == 0,
+		   "max tasks batch");
+	unit_check(thread_task_join_all(many, TPOOL_MAX_TASKS, NULL) == 0,
+		   "join_all max tasks");
+	for (int i = 0; i <= TPOOL_MAX_TASKS; ++i)
+		unit_fail_if(thread_task_delete(many[i]) != 0);
+	free(many);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_embedded(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(2, &p) != 0);
+	int arg = 0;
+	void *result;
+	struct thread_task_storage storage;
+	struct thread_task *t = thread_task_init(&storage, task_incr_f, &arg);
+	unit_check(thread_pool_push_task(p, t) == 0, "push an embedded task");
+	unit_check(thread_task_join(t, &result) == 0, "join it");
+	unit_check(result == &arg && arg == 1, "it is done");
+	unit_check(thread_pool_push_task(p, t) == 0, "push it again");
+#if NEED_DETACH
+	unit_check(thread_task_detach(t) == TPOOL_ERR_INVALID_ARGUMENT,
+		   "can not detach an embedded task");
+#endif
+	unit_check(thread_task_join(t, &result) == 0, "join it again");
+	unit_check(thread_task_destroy(t) == 0, "destroy it");
+
+	/* The deleted tasks are reused. */
+	struct thread_task *t1, *t2;
+	unit_fail_if(thread_task_new(&t1, task_incr_f, &arg) != 0);
+	unit_fail_if(thread_task_delete(t1) != 0);
+	unit_fail_if(thread_task_new(&t2, task_incr_f, &arg) != 0);
+	unit_check(thread_pool_push_task(p, t2) == 0 &&
+		   thread_task_join(t2, &result) == 0 && arg == 3,
+		   "a reused task works");
+	unit_fail_if(thread_task_delete(t2) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_idle_timeout(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	struct thread_pool_options options = {
+		.max_thread_count = 4,
+		.min_thread_count = 5,
+		.idle_timeout = 0.01,
+		.is_timing_enabled = true,
+	};
+	unit_check(thread_pool_new_ex(&options, &p) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "min > max is forbidden");
+	options.min_thread_count = 1;
+	unit_fail_if(thread_pool_new_ex(&options, &p) != 0);
+
+	enum { COUNT = 4 };
+	struct thread_task *tasks[COUNT];
+	int arg = 0;
+	for (int i = 0; i < COUNT; ++i)
+		unit_fail_if(thread_task_new(&tasks[i], task_wait_for_f,
+					     &arg) != 0);
+	for (int round = 0; round < 2; ++round) {
+		__atomic_store_n(&arg, 0, __ATOMIC_RELAXED);
+		unit_fail_if(thread_pool_push_tasks(p, tasks, COUNT) != 0);
+		unit_check(thread_pool_thread_count(p) == COUNT,
+			   "a thread per blocked task");
+		__atomic_store_n(&arg, 1, __ATOMIC_RELAXED);
+		unit_fail_if(thread_task_join_all(tasks, COUNT, NULL) != 0);
+		for (int i = 0; i < 1000; ++i) {
+			if (thread_pool_thread_count(p) == 1)
+				break;
+			usleep(1000);
+		}
+		unit_check(thread_pool_thread_count(p) == 1,
+			   "idle threads exit down to the min");
+	}
+	struct thread_pool_stats stats;
+	thread_pool_stats(p, &stats);
+	unit_check(stats.threads_created == 7 && stats.threads_retired == 6,
+		   "threads created and retired");
+	unit_check(stats.tasks_done == 2 * COUNT && stats.task_count == 0 &&
+		   stats.queued_task_count == 0, "task counts");
+	unit_check(stats.task_run_ns > 0, "run time is measured");
+	for (int i = 0; i < COUNT; ++i)
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void *
+task_get_cpu_f(void *arg)
+{
+	(void)arg;
+	return (void *)(intptr_t)sched_getcpu();
+}
+
+static void
+test_affinity(void)
+{
+	unit_test_start();
+
+	enum { COUNT = 3 };
+	cpu_set_t cpus[COUNT];
+	for (int i = 0; i < COUNT; ++i) {
+		CPU_ZERO(&cpus[i]);
+		CPU_SET(0, &cpus[i]);
+	}
+	struct thread_pool_options options = {
+		.max_thread_count = COUNT,
+		.worker_cpus = cpus,
+		.is_numa_aware = true,
+	};
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new_ex(&options, &p) != 0);
+	struct thread_task *tasks[COUNT * 10];
+	for (int i = 0; i < COUNT * 10; ++i)
+		unit_fail_if(thread_task_new(&tasks[i], task_get_cpu_f,
+					     NULL) != 0);
+	void *results[COUNT * 10];
+	unit_fail_if(thread_pool_push_tasks(p, tasks, COUNT * 10) != 0);
+	unit_fail_if(thread_task_join_all(tasks, COUNT * 10, results) != 0);
+	bool ok = true;
+	for (int i = 0; i < COUNT * 10; ++i) {
+		ok = ok && results[i] == NULL;
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	}
+	unit_check(ok, "the workers run on their CPUs");
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	/* NUMA aware and not pinned. */
+	options.worker_cpus = NULL;
+	unit_fail_if(thread_pool_new_ex(&options, &p) != 0);
+	int arg = 0;
+	struct thread_task *t;
+	void *result;
+	unit_fail_if(thread_task_new(&t, task_incr_f, &arg) != 0);
+	unit_check(thread_pool_push_task(p, t) == 0 &&
+		   thread_task_join(t, &result) == 0 && arg == 1,
+		   "a NUMA aware pool runs the tasks");
+	unit_fail_if(thread_task_delete(t) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void *
+task_get_stack_size_f(void *arg)
+{
+	(void)arg;
+	/* Use some of the stack, it must be there. */
+	volatile char buf[16 * 1024];
+	for (size_t i = 0; i < sizeof(buf); i += 1024)
+		buf[i] = 1;
+	pthread_attr_t attr;
+	size_t size = 0;
+	if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+		pthread_attr_getstacksize(&attr, &size);
+		pthread_attr_destroy(&attr);
+	}
+	return (void *)(uintptr_t)size;
+}
+
+static void
+test_stack_size(void)
+{
+	unit_test_start();
+
+	struct thread_pool_options options = {
+		.max_thread_count = 4,
+		.stack_size = 1,
+	};
+	struct thread_pool *p;
+	unit_check(thread_pool_new_ex(&options, &p) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "too small stack is forbidden");
+	options.stack_size = 64 * 1024;
+	unit_fail_if(thread_pool_new_ex(&options, &p) != 0);
+	enum { COUNT = 8 };
+	struct thread_task *tasks[COUNT];
+	for (int i = 0; i < COUNT; ++i)
+		unit_fail_if(thread_task_new(&tasks[i], task_get_stack_size_f,
+					     NULL) != 0);
+	void *results[COUNT];
+	unit_fail_if(thread_pool_push_tasks(p, tasks, COUNT) != 0);
+	unit_fail_if(thread_task_join_all(tasks, COUNT, results) != 0);
+	bool ok = true;
+	for (int i = 0; i < COUNT; ++i) {
+		size_t size = (uintptr_t)results[i];
+		ok = ok && size >= options.stack_size && size < 1024 * 1024;
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	}
+	unit_check(ok, "the workers have the small stacks");
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+struct task_sum_arg {
+	struct thread_pool *pool;
+	int begin;
+	int end;
+	long sum;
+};
+
+/** Sum the range, splitting it into two subtasks until it is small. */
+static void *
+task_sum_f(void *arg)
+{
+	struct task_sum_arg *a = arg;
+	if (a->end - a->begin <= 10) {
+		a->sum = 0;
+		for (int i = a->begin; i < a->end; ++i)
+			a->sum += i;
+		return a;
+	}
+	int mid = (a->begin + a->end) / 2;
+	struct task_sum_arg left = {a->pool, a->begin, mid, 0};
+	struct task_sum_arg right = {a->pool, mid, a->end, 0};
+	struct thread_task *tl, *tr;
+	void *result;
+	thread_task_new(&tl, task_sum_f, &left);
+	thread_task_new(&tr, task_sum_f, &right);
+	unit_fail_if(thread_pool_push_task(a->pool, tl) != 0);
+	unit_fail_if(thread_pool_push_task(a->pool, tr) != 0);
+	unit_fail_if(thread_task_join(tr, &result) != 0);
+	unit_fail_if(thread_task_join(tl, &result) != 0);
+	thread_task_delete(tl);
+	thread_task_delete(tr);
+	a->sum = left.sum + right.sum;
+	return a;
+}
+
+static void
+test_recursive(void)
+{
+	unit_test_start();
+
+	/*
+	 * The tasks push and join their subtasks. Even with one
+	 * worker it can't deadlock, the joins run the subtasks.
+	 */
+	int thread_counts[] = {1, 4};
+	for (int i = 0; i < 2; ++i) {
+		struct thread_pool *p;
+		unit_fail_if(thread_pool_new(thread_counts[i], &p) != 0);
+		struct task_sum_arg arg = {p, 0, 10000, 0};
+		struct thread_task *t;
+		void *result;
+		unit_fail_if(thread_task_new(&t, task_sum_f, &arg) != 0);
+		unit_fail_if(thread_pool_push_task(p, t) != 0);
+		unit_fail_if(thread_task_join(t, &result) != 0);
+		unit_check(arg.sum == 10000L * 9999 / 2,
+			   "recursive tasks are joined");
+		unit_fail_if(thread_task_delete(t) != 0);
+		unit_fail_if(thread_pool_delete(p) != 0);
+	}
+
+	unit_test_finish();
+}
+
+struct task_log {
+	int ids[16];
+	int count;
+};
+
+struct task_log_arg {
+	struct task_log *log;
+	int id;
+};
+
+static void *
+task_log_f(void *arg)
+{
+	struct task_log_arg *a = arg;
+	int i = __atomic_fetch_add(&a->log->count, 1, __ATOMIC_RELAXED);
+	a->log->ids[i] = a->id;
+	return NULL;
+}
+
+/** Position of the task in the log of the finished tasks. */
+static int
+task_log_pos(const struct task_log *log, int id)
+{
+	for (int i = 0; i < log->count; ++i) {
+		if (log->ids[i] == id)
+			return i;
+	}
+	return -1;
+}
+
+struct task_check_before_arg {
+	struct thread_task *before;
+	bool is_before_finished;
+};
+
+static void *
+task_check_before_f(void *arg)
+{
+	struct task_check_before_arg *a = arg;
+	a->is_before_finished = thread_task_is_finished(a->before);
+	return NULL;
+}
+
+static void
+test_then(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	struct task_log log = {.count = 0};
+	struct task_log_arg args[3];
+	struct thread_task *t[3];
+	for (int i = 0; i < 3; ++i) {
+		args[i] = (struct task_log_arg){&log, i};
+		unit_fail_if(thread_task_new(&t[i], task_log_f, &args[i]) != 0);
+	}
+	unit_fail_if(thread_task_then(t[0], t[1]) != 0);
+	unit_fail_if(thread_task_then(t[1], t[2]) != 0);
+	/* Pushed in the reverse order, but run in the chain order. */
+	for (int i = 2; i >= 0; --i)
+		unit_fail_if(thread_pool_push_task(p, t[i]) != 0);
+	void *result;
+	unit_fail_if(thread_task_join(t[2], &result) != 0);
+	unit_check(log.count == 3 && log.ids[0] == 0 && log.ids[1] == 1 &&
+		   log.ids[2] == 2, "chain runs in order");
+	unit_fail_if(thread_task_join(t[0], &result) != 0);
+	unit_fail_if(thread_task_join(t[1], &result) != 0);
+
+	unit_check(thread_task_then(t[0], t[0]) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "task can't follow itself");
+	/* The joined task is finished, nothing to wait for. */
+	log.count = 0;
+	unit_fail_if(thread_task_then(t[0], t[1]) != 0);
+	unit_fail_if(thread_pool_push_task(p, t[1]) != 0);
+	unit_fail_if(thread_task_join(t[1], &result) != 0);
+	unit_check(log.count == 1, "then() on a finished task");
+
+	/* A deleted task does not block its dependents. */
+	struct thread_task *never;
+	unit_fail_if(thread_task_new(&never, task_log_f, &args[0]) != 0);
+	unit_fail_if(thread_task_then(never, t[2]) != 0);
+	unit_fail_if(thread_pool_push_task(p, t[2]) != 0);
+	unit_check(thread_task_then(t[0], t[2]) == TPOOL_ERR_TASK_IN_POOL,
+		   "then() on a pushed task");
+	unit_fail_if(thread_task_delete(never) != 0);
+	unit_fail_if(thread_task_join(t[2], &result) != 0);
+	unit_check(log.count == 2, "deleted dependency is released");
+
+	/*
+	 * The continuation starts only when its dependency is finished
+	 * and is out of the pool. Many times to catch the race.
+	 */
+	bool is_finished = true;
+	bool is_pool_empty = true;
+	for (int i = 0; i < 200; ++i) {
+		struct thread_pool *q;
+		unit_fail_if(thread_pool_new(4, &q) != 0);
+		int counter = 0;
+		struct task_check_before_arg check = {NULL, false};
+		struct thread_task *before, *after;
+		unit_fail_if(thread_task_new(&before, task_incr_f,
+					     &counter) != 0);
+		check.before = before;
+		unit_fail_if(thread_task_new(&after, task_check_before_f,
+					     &check) != 0);
+		unit_fail_if(thread_task_then(before, after) != 0);
+		unit_fail_if(thread_pool_push_task(q, after) != 0);
+		unit_fail_if(thread_pool_push_task(q, before) != 0);
+		unit_fail_if(thread_task_join(after, &result) != 0);
+		is_finished = is_finished && check.is_before_finished;
+		if (thread_pool_delete(q) != 0) {
+			is_pool_empty = false;
+			unit_fail_if(thread_task_join(before, &result) != 0);
+			unit_fail_if(thread_pool_delete(q) != 0);
+		} else {
+			unit_fail_if(thread_task_join(before, &result) != 0);
+		}
+		unit_fail_if(thread_task_delete(before) != 0);
+		unit_fail_if(thread_task_delete(after) != 0);
+	}
+	unit_check(is_finished, "continuation sees its dependency finished");
+	unit_check(is_pool_empty, "pool is empty after the continuation");
+
+	for (int i = 0; i < 3; ++i)
+		unit_fail_if(thread_task_delete(t[i]) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_push_graph(void)
+{
+	unit_test_start();
+
+	/*
+	 * A diamond: 0 -> {1, 2} -> 3. And 4 is independent. Pushed
+	 * many times to catch the races of the last dependencies.
+	 */
+	const struct thread_task_edge edges[] = {
+		{0, 1}, {0, 2}, {1, 3}, {2, 3},
+	};
+	int thread_counts[] = {1, 4};
+	for (int i = 0; i < 2; ++i) {
+		struct thread_pool *p;
+		unit_fail_if(thread_pool_new(thread_counts[i], &p) != 0);
+		struct task_log log;
+		struct task_log_arg args[5];
+		struct thread_task *t[5];
+		for (int j = 0; j < 5; ++j) {
+			args[j] = (struct task_log_arg){&log, j};
+			unit_fail_if(thread_task_new(&t[j], task_log_f,
+						     &args[j]) != 0);
+		}
+		bool is_ordered = true;
+		for (int k = 0; k < 1000; ++k) {
+			log.count = 0;
+			unit_fail_if(thread_pool_push_graph(p, t, 5, edges,
+							    4) != 0);
+			void *result;
+			for (int j = 0; j < 5; ++j)
+				unit_fail_if(thread_task_join(t[j],
+							      &result) != 0);
+			for (int j = 0; j < 4; ++j) {
+				is_ordered = is_ordered &&
+					task_log_pos(&log, edges[j].before) <
+					task_log_pos(&log, edges[j].after);
+			}
+			is_ordered = is_ordered && log.count == 5;
+		}
+		unit_check(is_ordered, "graph runs in the dependency order");
+
+		const struct thread_task_edge cycle[] = {
+			{0, 1}, {1, 2}, {2, 0},
+		};
+		unit_check(thread_pool_push_graph(p, t, 5, cycle, 3) ==
+			   TPOOL_ERR_INVALID_ARGUMENT, "cycle is rejected");
+		const struct thread_task_edge out[] = {{0, 5}};
+		unit_check(thread_pool_push_graph(p, t, 5, out, 1) ==
+			   TPOOL_ERR_INVALID_ARGUMENT, "bad edge is rejected");
+		for (int j = 0; j < 5; ++j)
+			unit_fail_if(thread_task_delete(t[j]) != 0);
+		unit_fail_if(thread_pool_delete(p) != 0);
+	}
+
+	unit_test_finish();
+}
+
+static void
+task_visit_f(long begin, long end, void *ctx)
+{
+	int *visits = ctx;
+	for (long i = begin; i < end; ++i)
+		__atomic_add_fetch(&visits[i], 1, __ATOMIC_RELAXED);
+}
+
+struct visit_nested_arg {
+	struct thread_pool *pool;
+	int *visits;
+};
+
+/** Each index runs an inner loop, nested in the outer one. */
+static void
+task_visit_nested_f(long begin, long end, void *ctx)
+{
+	struct visit_nested_arg *a = ctx;
+	for (long i = begin; i < end; ++i) {
+		thread_pool_parallel_for(a->pool, i * 100, (i + 1) * 100, 7,
+					 task_visit_f, a->visits);
+	}
+}
+
+static void
+test_parallel_for(void)
+{
+	unit_test_start();
+
+	enum { COUNT = 10000 };
+	static int visits[COUNT];
+	int thread_counts[] = {1, 4};
+	for (int i = 0; i < 2; ++i) {
+		struct thread_pool *p;
+		unit_fail_if(thread_pool_new(thread_counts[i], &p) != 0);
+		memset(visits, 0, sizeof(visits));
+		unit_fail_if(thread_pool_parallel_for(p, 0, COUNT, 1,
+						      task_visit_f,
+						      visits) != 0);
+		bool is_once = true;
+		for (int j = 0; j < COUNT; ++j)
+			is_once = is_once && visits[j] == 1;
+		unit_check(is_once, "each index is visited once");
+
+		memset(visits, 0, sizeof(visits));
+		struct visit_nested_arg arg = {p, visits};
+		unit_fail_if(thread_pool_parallel_for(p, 0, COUNT / 100, 1,
+						      task_visit_nested_f,
+						      &arg) != 0);
+		is_once = true;
+		for (int j = 0; j < COUNT; ++j)
+			is_once = is_once && visits[j] == 1;
+		unit_check(is_once, "nested loops visit each index once");
+
+		unit_check(thread_pool_parallel_for(p, 0, COUNT, 0,
+						    task_visit_f, visits) ==
+			   TPOOL_ERR_INVALID_ARGUMENT, "grain 0 is invalid");
+		unit_check(thread_pool_parallel_for(p, 1, 0, 1, task_visit_f,
+						    visits) ==
+			   TPOOL_ERR_INVALID_ARGUMENT, "bad range");
+		unit_fail_if(thread_pool_delete(p) != 0);
+	}
+
+	unit_test_finish();
+}
+
+/** The partial result is the sum of the chunk. */
+static void *
+task_sum_map_f(long begin, long end, void *ctx)
+{
+	(void)ctx;
+	long sum = 0;
+	for (long i = begin; i < end; ++i)
+		sum += i;
+	return (void *)sum;
+}
+
+static void *
+task_sum_combine_f(void *left, void *right, void *ctx)
+{
+	(void)ctx;
+	return (void *)((long)left + (long)right);
+}
+
+struct range_result {
+	long begin;
+	long end;
+	bool is_ordered;
+};
+
+static void *
+task_range_map_f(long begin, long end, void *ctx)
+{
+	(void)ctx;
+	struct range_result *r = malloc(sizeof(*r));
+	*r = (struct range_result){begin, end, true};
+	return r;
+}
+
+/** Adjacent ranges, left first, keep the order. */
+static void *
+task_range_combine_f(void *left, void *right, void *ctx)
+{
+	(void)ctx;
+	struct range_result *l = left;
+	struct range_result *r = right;
+	l->is_ordered = l->is_ordered && r->is_ordered && l->end == r->begin;
+	l->end = r->end;
+	free(r);
+	return l;
+}
+
+static void
+test_parallel_reduce(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	void *result;
+	unit_fail_if(thread_pool_parallel_reduce(p, 0, 100000, 10,
+						 task_sum_map_f,
+						 task_sum_combine_f, NULL,
+						 &result) != 0);
+	unit_check((long)result == 100000L * 99999 / 2, "reduce sum");
+	unit_fail_if(thread_pool_parallel_reduce(p, 5, 5, 1, task_sum_map_f,
+						 task_sum_combine_f, NULL,
+						 &result) != 0);
+	unit_check((long)result == 0, "reduce empty range");
+
+	unit_fail_if(thread_pool_parallel_reduce(p, 3, 50003, 1,
+						 task_range_map_f,
+						 task_range_combine_f, NULL,
+						 &result) != 0);
+	struct range_result *r = result;
+	unit_check(r->is_ordered && r->begin == 3 && r->end == 50003,
+		   "reduce combines in order");
+	free(r);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+/** Wait until the task is taken by a worker. */
+static void
+task_wait_running(const struct thread_task *t)
+{
+	while (!thread_task_is_running(t))
+		usleep(100);
+}
+
+static void
+test_priority(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(1, &p) != 0);
+	struct thread_task *t;
+	int arg = 0;
+	unit_fail_if(thread_task_new(&t, task_wait_for_f, &arg) != 0);
+	unit_check(thread_task_set_priority(t, TPOOL_PRIORITY_COUNT) ==
+		   TPOOL_ERR_INVALID_ARGUMENT, "no such priority");
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	unit_check(thread_task_set_priority(t, TPOOL_PRIORITY_HIGH) ==
+		   TPOOL_ERR_TASK_IN_POOL, "can't change it in the pool");
+	/* The only worker is busy while they are queued. */
+	task_wait_running(t);
+	enum { COUNT = 15 };
+	struct task_log log = {.count = 0};
+	struct task_log_arg args[COUNT];
+	struct thread_task *tasks[COUNT];
+	for (int i = 0; i < COUNT; ++i) {
+		args[i] = (struct task_log_arg){&log, i};
+		unit_fail_if(thread_task_new(&tasks[i], task_log_f,
+					     &args[i]) != 0);
+		/* Low, normal, high, low, ... */
+		unit_fail_if(thread_task_set_priority(tasks[i], i % 3) != 0);
+	}
+	unit_fail_if(thread_pool_push_tasks(p, tasks, COUNT) != 0);
+	__atomic_store_n(&arg, 1, __ATOMIC_RELAXED);
+	unit_fail_if(thread_task_join_all(tasks, COUNT, NULL) != 0);
+	bool is_ok = log.count == COUNT;
+	for (int i = 1; i < log.count; ++i)
+		is_ok = is_ok && log.ids[i - 1] % 3 >= log.ids[i] % 3;
+	unit_check(is_ok, "high ones first, low ones last");
+	for (int i = 0; i < COUNT; ++i)
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	unit_fail_if(thread_task_join(t, NULL) != 0);
+	unit_fail_if(thread_task_delete(t) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+struct task_cancel_arg {
+	int count;
+	struct thread_pool *pool;
+};
+
+/** Pushes the subtasks into its deque and cancels the odd ones. */
+static void *
+task_cancel_subtasks_f(void *arg)
+{
+	struct task_cancel_arg *a = arg;
+	enum { COUNT = 100 };
+	struct thread_task_storage storages[COUNT];
+	struct thread_task *tasks[COUNT];
+	for (int i = 0; i < COUNT; ++i) {
+		tasks[i] = thread_task_init(&storages[i], task_incr_f,
+					    &a->count);
+	}
+	bool is_ok = thread_pool_push_tasks(a->pool, tasks, COUNT) == 0;
+	for (int i = 1; i < COUNT; i += 2)
+		is_ok = is_ok && thread_task_cancel(tasks[i]) == 0;
+	is_ok = thread_task_join_all(tasks, COUNT, NULL) == 0 && is_ok;
+	for (int i = 0; i < COUNT; ++i)
+		thread_task_destroy(tasks[i]);
+	return is_ok ? arg : NULL;
+}
+
+static void
+test_cancel(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(1, &p) != 0);
+	int arg = 0;
+	struct thread_task *t;
+	unit_fail_if(thread_task_new(&t, task_wait_for_f, &arg) != 0);
+	unit_check(thread_task_cancel(t) == TPOOL_ERR_TASK_NOT_PUSHED,
+		   "can't cancel a not pushed task");
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	task_wait_running(t);
+	unit_check(thread_task_cancel(t) == TPOOL_ERR_TASK_STARTED,
+		   "can't cancel a running task");
+
+	enum { COUNT = 10 };
+	int count = 0;
+	struct thread_task *tasks[COUNT];
+	for (int i = 0; i < COUNT; ++i)
+		unit_fail_if(thread_task_new(&tasks[i], task_incr_f,
+					     &count) != 0);
+	unit_fail_if(thread_pool_push_tasks(p, tasks, COUNT) != 0);
+	bool is_ok = true;
+	for (int i = 0; i < COUNT; i += 2) {
+		is_ok = is_ok && thread_task_cancel(tasks[i]) == 0 &&
+			thread_task_is_finished(tasks[i]);
+	}
+	unit_check(is_ok, "a queued task is finished by the cancel");
+	unit_check(thread_task_cancel(tasks[0]) == TPOOL_ERR_TASK_STARTED,
+		   "can't cancel it twice");
+	struct thread_pool_stats stats;
+	thread_pool_stats(p, &stats);
+	unit_check(stats.tasks_cancelled == COUNT / 2 &&
+		   stats.task_count == 1 + COUNT / 2, "stats");
+
+	/* The dependent is released by the cancel, the dependency not. */
+	struct thread_task *before, *after;
+	unit_fail_if(thread_task_new(&before, task_incr_f, &count) != 0);
+	unit_fail_if(thread_task_new(&after, task_incr_f, &count) != 0);
+	unit_fail_if(thread_task_then(t, before) != 0);
+	unit_fail_if(thread_task_then(before, after) != 0);
+	unit_fail_if(thread_pool_push_task(p, after) != 0);
+	unit_fail_if(thread_pool_push_task(p, before) != 0);
+	unit_check(thread_task_cancel(before) == 0,
+		   "cancel a task waiting for a dependency");
+
+	__atomic_store_n(&arg, 1, __ATOMIC_RELAXED);
+	void *results[COUNT];
+	unit_fail_if(thread_task_join_all(tasks, COUNT, results) != 0);
+	is_ok = true;
+	for (int i = 0; i < COUNT; ++i)
+		is_ok = is_ok && results[i] == (i % 2 == 0 ? NULL : &count);
+	unit_check(is_ok, "the cancelled ones have no results");
+	void *result;
+	unit_fail_if(thread_task_join(before, &result) != 0);
+	unit_fail_if(thread_task_join(after, NULL) != 0);
+	unit_check(result == NULL && count == COUNT / 2 + 1,
+		   "the cancelled ones are not run");
+	unit_check(thread_pool_push_task(p, tasks[0]) == 0 &&
+		   thread_task_join(tasks[0], &result) == 0 &&
+		   result == &count, "a cancelled task can be pushed again");
+	for (int i = 0; i < COUNT; ++i)
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	unit_fail_if(thread_task_delete(before) != 0);
+	unit_fail_if(thread_task_delete(after) != 0);
+	unit_fail_if(thread_task_join(t, NULL) != 0);
+	unit_fail_if(thread_task_delete(t) != 0);
+
+	/* Cancel in a deque, the worker skips them. */
+	struct task_cancel_arg sub = {0, p};
+	unit_fail_if(thread_task_new(&t, task_cancel_subtasks_f, &sub) != 0);
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	unit_fail_if(thread_task_join(t, &result) != 0);
+	unit_check(result == &sub.count && sub.count == 50,
+		   "cancel the subtasks in the worker deque");
+	unit_fail_if(thread_task_delete(t) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+/** Cancels the tasks while the workers run them. */
+static void
+test_cancel_stress(void)
+{
+	unit_test_start();
+
+	struct thread_pool *p;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	enum { COUNT = 20000 };
+	struct thread_task **tasks = malloc(COUNT * sizeof(tasks[0]));
+	int count = 0;
+	for (int i = 0; i < COUNT; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i], task_incr_f,
+					     &count) != 0);
+		thread_task_set_priority(tasks[i], i % TPOOL_PRIORITY_COUNT);
+	}
+	unit_fail_if(thread_pool_push_tasks(p, tasks, COUNT) != 0);
+	int cancelled = 0;
+	for (int i = COUNT - 1; i >= 0; --i)
+		cancelled += thread_task_cancel(tasks[i]) == 0;
+	unit_fail_if(thread_task_join_all(tasks, COUNT, NULL) != 0);
+	struct thread_pool_stats stats;
+	thread_pool_stats(p, &stats);
+	unit_check(count + cancelled == COUNT &&
+		   stats.tasks_cancelled == (uint64_t)cancelled &&
+		   stats.tasks_done == (uint64_t)count,
+		   "each one is run or cancelled");
+	for (int i = 0; i < COUNT; ++i)
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	free(tasks);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
+#if TPOOL_CORO
+
+static void *
+task_coro_sleep_f(void *arg)
+{
+	coro_sleep(0.02);
+	return arg;
+}
+
+/** Reads a byte from the pipe, waiting for it as a coroutine. */
+static void *
+task_coro_read_f(void *arg)
+{
+	int fd = *(int *)arg;
+	char c;
+	if (coro_wait_fd(fd, CORO_EVENT_READ, -1) != CORO_EVENT_READ ||
+	    read(fd, &c, 1) != 1)
+		return NULL;
+	return arg;
+}
+
+static void *
+task_write_f(void *arg)
+{
+	return write(*(int *)arg, "x", 1) == 1 ? arg : NULL;
+}
+
+static void *
+coro_yield_f(void *arg)
+{
+	for (int i = 0; i < 3; ++i)
+		coro_yield();
+	return arg;
+}
+
+static void *
+task_coro_spawn_f(void *arg)
+{
+	struct coro *c = coro_new(coro_yield_f, arg);
+	return coro_join(c);
+}
+
+struct task_coro_join_arg {
+	struct thread_pool *pool;
+	bool is_coro;
+};
+
+/** Pushes a sleeping coroutine task and joins it. */
+static void *
+task_coro_join_f(void *arg)
+{
+	struct task_coro_join_arg *a = arg;
+	struct thread_task_storage storage;
+	struct thread_task *t = thread_task_init(&storage, task_coro_sleep_f,
+						 arg);
+	void *result = NULL;
+	if (thread_task_set_coro(t, true) != 0 ||
+	    thread_pool_push_task(a->pool, t) != 0 ||
+	    thread_task_join(t, &result) != 0)
+		return NULL;
+	return result;
+}
+
+#endif
+
+static void
+test_coro(void)
+{
+	unit_test_start();
+
+	struct thread_pool_options options = {
+		.max_thread_count = 1,
+		.is_coro_enabled = true,
+	};
+	struct thread_pool *p;
+	struct thread_task *t;
+#if !TPOOL_CORO
+	unit_check(thread_pool_new_ex(&options, &p) ==
+		   TPOOL_ERR_NOT_IMPLEMENTED, "no coroutines without libcoro");
+#else
+	unit_fail_if(thread_pool_new_ex(&options, &p) != 0);
+
+	enum { COUNT = 10 };
+	struct thread_task *tasks[COUNT];
+	for (int i = 0; i < COUNT; ++i) {
+		unit_fail_if(thread_task_new(&tasks[i], task_coro_sleep_f,
+					     &tasks[i]) != 0);
+		unit_fail_if(thread_task_set_coro(tasks[i], true) != 0);
+	}
+	struct timespec ts1, ts2;
+	clock_gettime(CLOCK_MONOTONIC, &ts1);
+	unit_fail_if(thread_pool_push_tasks(p, tasks, COUNT) != 0);
+	void *results[COUNT];
+	unit_fail_if(thread_task_join_all(tasks, COUNT, results) != 0);
+	clock_gettime(CLOCK_MONOTONIC, &ts2);
+	uint64_t ns1 = ts1.tv_sec * 1000000000 + ts1.tv_nsec;
+	uint64_t ns2 = ts2.tv_sec * 1000000000 + ts2.tv_nsec;
+	unit_check(ns2 - ns1 < COUNT * 20000000 / 2,
+		   "sleeping tasks don't block the only worker");
+	bool is_ok = true;
+	for (int i = 0; i < COUNT; ++i) {
+		is_ok = is_ok && results[i] == &tasks[i];
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	}
+	unit_check(is_ok, "results");
+
+	int fds[2];
+	unit_fail_if(pipe(fds) != 0);
+	struct thread_task *w;
+	unit_fail_if(thread_task_new(&t, task_coro_read_f, &fds[0]) != 0);
+	unit_fail_if(thread_task_set_coro(t, true) != 0);
+	unit_fail_if(thread_task_new(&w, task_write_f, &fds[1]) != 0);
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	task_wait_running(t);
+	unit_fail_if(thread_pool_push_task(p, w) != 0);
+	void *result;
+	unit_fail_if(thread_task_join(t, &result) != 0);
+	unit_check(result == &fds[0], "a task runs while a coroutine waits "
+		   "for a descriptor");
+	unit_fail_if(thread_task_join(w, NULL) != 0);
+	close(fds[0]);
+	close(fds[1]);
+	unit_check(thread_task_set_coro(t, false) == 0, "can be unset");
+	unit_fail_if(thread_task_delete(w) != 0);
+
+	unit_fail_if(thread_task_delete(t) != 0);
+	int arg;
+	unit_fail_if(thread_task_new(&t, task_coro_spawn_f, &arg) != 0);
+	unit_fail_if(thread_task_set_coro(t, true) != 0);
+	unit_fail_if(thread_pool_push_task(p, t) != 0);
+	unit_fail_if(thread_task_join(t, &result) != 0);
+	unit_check(result == &arg, "a task creates and joins a coroutine");
+	unit_fail_if(thread_task_delete(t) != 0);
+
+	struct task_coro_join_arg join_arg = {.pool = p};
+	for (int i = 0; i < 2; ++i) {
+		join_arg.is_coro = i == 0;
+		unit_fail_if(thread_task_new(&t, task_coro_join_f,
+					     &join_arg) != 0);
+		unit_fail_if(thread_task_set_coro(t, join_arg.is_coro) != 0);
+		unit_fail_if(thread_pool_push_task(p, t) != 0);
+		unit_fail_if(thread_task_join(t, &result) != 0);
+		unit_check(result == &join_arg, join_arg.is_coro ?
+			   "a coroutine task joins a coroutine task" :
+			   "a plain task joins a coroutine task");
+		unit_fail_if(thread_task_delete(t) != 0);
+	}
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	options.max_thread_count = 4;
+	unit_fail_if(thread_pool_new_ex(&options, &p) != 0);
+	enum { STRESS_COUNT = 1000 };
+	struct thread_task *stress[STRESS_COUNT];
+	for (int i = 0; i < STRESS_COUNT; ++i) {
+		unit_fail_if(thread_task_new(&stress[i], i % 2 == 0 ?
+					     coro_yield_f : task_incr_f,
+					     &arg) != 0);
+		unit_fail_if(thread_task_set_coro(stress[i], true) != 0);
+	}
+	is_ok = true;
+	for (int k = 0; k < 3; ++k) {
+		arg = 0;
+		unit_fail_if(thread_pool_push_tasks(p, stress,
+						    STRESS_COUNT) != 0);
+		unit_fail_if(thread_task_join_all(stress, STRESS_COUNT,
+						  NULL) != 0);
+		is_ok = is_ok && arg == STRESS_COUNT / 2;
+	}
+	unit_check(is_ok, "coroutine tasks on many workers, pushed again");
+	for (int i = 0; i < STRESS_COUNT; ++i)
+		unit_fail_if(thread_task_delete(stress[i]) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+#endif
+	unit_fail_if(thread_pool_new(1, &p) != 0);
+	unit_fail_if(thread_task_new(&t, task_incr_f, NULL) != 0);
+	unit_fail_if(thread_task_set_coro(t, true) != 0);
+	unit_check(thread_pool_push_task(p, t) == TPOOL_ERR_INVALID_ARGUMENT,
+		   "no coroutine tasks in a pool without coroutines");
+	unit_fail_if(thread_task_delete(t) != 0);
+	unit_fail_if(thread_pool_delete(p) != 0);
+
+	unit_test_finish();
+}
+
 static void
 test_detach_stress(void)
 {
@@ -379,14 +1408,29 @@ main(int argc, char **argv)
 	}
 	unit_test_start();
 
-	test_new();
-	test_push();
-	test_thread_pool_delete();
-	test_thread_pool_max_tasks();
-	test_timed_join();
-	test_detach_stress();
-	test_detach_long();
+	unit_add(test_new);
+	unit_add(test_push);
+	unit_add(test_thread_pool_delete);
+	unit_add(test_thread_pool_max_tasks);
+	unit_add(test_timed_join);
+	unit_add(test_push_tasks);
+	unit_add(test_embedded);
+	unit_add(test_recursive);
+	unit_add(test_then);
+	unit_add(test_push_graph);
+	unit_add(test_parallel_for);
+	unit_add(test_parallel_reduce);
+	unit_add(test_idle_timeout);
+	unit_add(test_affinity);
+	unit_add(test_stack_size);
+	unit_add(test_priority);
+	unit_add(test_cancel);
+	unit_add(test_cancel_stress);
+	unit_add(test_coro);
+	unit_add(test_detach_stress);
+	unit_add(test_detach_long);
+	int rc = unit_run(argc, argv);
 
 	unit_test_finish();
-	return 0;
+	return rc;
 }
@@ -1,86 +1,1949 @@
+#define _GNU_SOURCE
 #include "thread_pool.h"
+#include "../utils/trace.h"
+#if TPOOL_CORO
+#include "libcoro.h"
+#endif
+
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
 #include <pthread.h>
+#include <stdalign.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Each worker has its own deque of tasks. The owner pushes and
+ * takes the tasks at the bottom without locks, and the other
+ * workers steal them from the top with a CAS (Chase-Lev). The
+ * tasks pushed from outside of the pool go to a lock-free bounded
+ * queue, from which the workers take them in batches into their
+ * deques. So a push and a pick-up of a task don't touch any mutex.
+ * A task pushed from a worker of the same pool goes right to the
+ * worker deque, and is taken back LIFO while its data is still in
+ * the cache. A worker joining a task runs the other tasks while
+ * waiting, so the recursive tasks don't block the pool.
+ * A worker without tasks spins for a while, and then parks on its
+ * own futex. A push wakes one parked worker, and only if none is
+ * spinning, since a spinning one picks the task up anyway. The spin
+ * gets longer when it finds the tasks and shorter when it does not.
+ * The spinners leave at least one CPU to the others, so on one CPU
+ * nobody spins.
+ *
+ * A task can depend on other tasks. It is counted in the pool when
+ * pushed, but gets to a queue only when its last dependency is
+ * finished, from the worker which finished it. So nobody blocks on
+ * a join to order the tasks.
+ *
+ * With NUMA awareness each node has its own queue, and the workers
+ * of a node prefer its queue and its deques when look for tasks.
+ *
+ * Each queue is in fact a lane per priority. A worker looks at the
+ * high lane before its own deque, and at the low one only when there
+ * is nothing to run or to steal. The tasks of the normal priority
+ * pushed from a worker go to its deque as usual, the others go to
+ * their lanes.
+ *
+ * A queued task is cancelled by a CAS of its state, so no worker
+ * starts it anymore. If it is still in a lane, the cell remembered
+ * by the task is emptied with one more CAS, and the cancel finishes
+ * the task right away. Otherwise the worker which gets the task from
+ * a deque, or a dependent task when it is released, just finishes it
+ * without running.
+ *
+ * With coroutines each worker has a libcoro engine of its own, and
+ * steps it after each task and when out of tasks. A coroutine task
+ * is spawned there when started, and finished by its coroutine. The
+ * worker joins the finished ones after the step, since a coroutine
+ * can't join itself. A worker with coroutines asleep on the timers
+ * or the descriptors polls for them in short slices instead of
+ * parking, and never retires while it has any coroutines.
+ *
+ * The threads start on demand, and with an idle timeout the parked
+ * ones exit after it, down to the minimal count. A thread started
+ * later reuses a free slot with its deque.
+ *
+ * The deleted tasks are cached per thread, and the surplus goes to
+ * a global depot, from where the threads refill their caches. So a
+ * task created in one thread and deleted in another one rarely gets
+ * to malloc().
+ */
+
+enum {
+	/** The hot fields written by different threads are this apart. */
+	CACHE_LINE_SIZE = 64,
+	/** Must be a power of 2 not less than TPOOL_MAX_TASKS. */
+	TASK_QUEUE_SIZE = 1 << 17,
+	TASK_DEQUE_MIN_SIZE = 256,
+	/** A worker takes up to this many tasks from the queue at once. */
+	TASK_QUEUE_BATCH_MAX = 32,
+	/** Pauses of an idle worker before it parks ... */
+	WORKER_SPIN_MIN = 64,
+	WORKER_SPIN_MAX = 16 * 1024,
+	/** ... checking for the tasks once per this many. */
+	WORKER_SPIN_CHECK_STEP = 64,
+	/** Free tasks cached by a thread. */
+	TASK_CACHE_MAX = 256,
+	/** Moved between a cache and the depot at once. */
+	TASK_CACHE_BATCH = TASK_CACHE_MAX / 2,
+	/** Free tasks in the depot, the rest are freed. */
+	TASK_DEPOT_MAX = 16 * 1024,
+	/** Longest poll of the coroutines by a worker out of tasks. */
+	WORKER_CORO_POLL_NS = 1000 * 1000,
+};
+
+_Static_assert((int)TASK_QUEUE_SIZE >= (int)TPOOL_MAX_TASKS,
+	       "the queue never fills");
+
+/**
+ * The task state is one atomic word, with the stage in the low bits
+ * and the flags above it. A finish exchanges the word, so exactly one
+ * of the finisher and the thread setting a flag sees the other.
+ */
+enum thread_task_state {
+	TASK_STATE_NEW = 0,
+	TASK_STATE_QUEUED,
+	TASK_STATE_RUNNING,
+	TASK_STATE_FINISHED,
+	TASK_STATE_JOINED,
+	TASK_STATE_MASK = 0x7,
+	/** A join sleeps on the state, the finish wakes it up. */
+	TASK_FLAG_WAITED = 0x8,
+	/** A join_all counts the task, the finish decrements the counter. */
+	TASK_FLAG_GROUPED = 0x10,
+	/** Delete the task when it is finished. */
+	TASK_FLAG_DETACHED = 0x20,
+	/** Finish the queued task without running it. */
+	TASK_FLAG_CANCELLED = 0x40,
+};
 
 struct thread_task {
 	thread_task_f function;
 	void *arg;
+	void *result;
+	/** enum thread_task_state with the flags. Atomic, a futex. */
+	int state;
+	/** Created by thread_task_init(). */
+	bool is_embedded;
+	/** Run as a coroutine, see thread_task_set_coro(). */
+	bool is_coro;
+	/** enum thread_task_priority. */
+	int priority;
+	/** The pool of the last push. */
+	struct thread_pool *pool;
+	/** When it was pushed, if the pool measures the time. */
+	uint64_t push_ns;
+	/** Counter of a thread_task_join_all() to decrement. */
+	int *group_pending;
+	/** Next one in a list of free tasks. */
+	struct thread_task *next_free;
+	/**
+	 * Tasks to start after this one, or TASK_DEPS_CLOSED since it
+	 * is finished until it is pushed again. Atomic.
+	 */
+	struct task_dep *dependents;
+	/** Unfinished dependencies, and 1 until it is pushed. Atomic. */
+	int dep_count;
+	/**
+	 * Cell of the last lane the task was put into. The task is
+	 * still there if the cell points at it. Atomic.
+	 */
+	struct thread_task **queue_slot;
+};
+
+/** Dependency of a task on another one. */
+struct task_dep {
+	struct thread_task *task;
+	struct task_dep *next;
+};
 
-	/* PUT HERE OTHER MEMBERS */
+#define TASK_DEPS_CLOSED ((struct task_dep *)1)
+
+/**
+ * Cell of the queue. Its sequence number says whose turn it is:
+ * a producer of the position, or a consumer of the position.
+ */
+struct task_queue_cell {
+	uint64_t seq;
+	/** NULL when the task is cancelled in the queue. Atomic. */
+	struct thread_task *task;
+};
+
+/**
+ * Bounded multi-producer multi-consumer queue (Vyukov). The pushers
+ * and the poppers don't share a cache line.
+ */
+struct task_queue {
+	struct task_queue_cell *cells;
+	/** Next position to push. */
+	alignas(CACHE_LINE_SIZE) uint64_t tail;
+	/** Next position to pop. */
+	alignas(CACHE_LINE_SIZE) uint64_t head;
+};
+
+struct task_deque_array {
+	/** Power of 2. */
+	int64_t size;
+	/** Arrays replaced by bigger ones, still read by the thieves. */
+	struct task_deque_array *prev;
+	struct thread_task *tasks[];
+};
+
+/** Chase-Lev work-stealing deque. */
+struct task_deque {
+	/** Where the thieves steal. */
+	alignas(CACHE_LINE_SIZE) int64_t top;
+	/** Where the owner pushes and takes. Read by the thieves. */
+	alignas(CACHE_LINE_SIZE) int64_t bottom;
+	struct task_deque_array *array;
+};
+
+/**
+ * The workers are in one array, so each one is cache line aligned,
+ * and the fields written by the other threads are apart from the
+ * ones written by the owner.
+ */
+struct thread_worker {
+	/** Read-mostly. */
+	struct thread_pool *pool;
+	pthread_t thread;
+	/** NUMA node index in the pool. */
+	int node;
+	/** The thread has exited and is not joined yet. */
+	bool is_retired;
+	/** The slot has a running thread. Atomic. */
+	bool is_active;
+	/** Written by the wakers: 1 when parked, they set it to 0. */
+	alignas(CACHE_LINE_SIZE) int futex;
+	/** Written by the owner only. */
+	alignas(CACHE_LINE_SIZE) uint64_t random;
+	/** Pauses of the next spin. */
+	int spin_count;
+	/** Stats, read by thread_pool_stats(). Atomic. */
+	uint64_t tasks_done;
+	uint64_t steal_count;
+	uint64_t wait_ns;
+	uint64_t run_ns;
+#if TPOOL_CORO
+	/** enum coro_sched_state after the last step. */
+	int coro_state;
+	/** Finished coroutines of the tasks, to join. */
+	struct coro **coro_done;
+	int coro_done_count;
+	int coro_done_size;
+#endif
+	/** Top and bottom have own lines. */
+	struct task_deque deque;
 };
 
+/**
+ * The configuration is read by every push and every worker loop, so
+ * it is apart from the counters written often.
+ */
 struct thread_pool {
-	pthread_t *threads;
+	/** Read-mostly. */
+	struct thread_worker *workers;
+	int max_thread_count;
+	int min_thread_count;
+	/** 0 means no idle threads exit. */
+	uint64_t idle_timeout_ns;
+	bool is_timing_enabled;
+	/** The lanes of each NUMA node, or of one. */
+	struct task_queue *queues;
+	int node_count;
+	/** Node index of each CPU, if NUMA aware. */
+	int *cpu_nodes;
+	/** CPUs of each node, if NUMA aware. */
+	cpu_set_t *node_cpus;
+	/** CPUs of each worker slot, or NULL. */
+	cpu_set_t *worker_cpus;
+	/** Most spinners at once. */
+	int spinner_max;
+	/** The workers host coroutines. */
+	bool is_coro_enabled;
+	/** 0 is the default of pthread. */
+	size_t stack_size;
+	/** Atomic. */
+	bool is_stopping;
+	/** Changed by each push and each finished task. Atomic. */
+	alignas(CACHE_LINE_SIZE) int task_count;
+	/** Changed by each worker going to spin or park. Atomic. */
+	alignas(CACHE_LINE_SIZE) int spinner_count;
+	/** Number of the workers parked or going to park. Atomic. */
+	int sleeper_count;
+	/** Changed when the workers start and exit. */
+	alignas(CACHE_LINE_SIZE) pthread_mutex_t mutex;
+	/** Number of the used worker slots, not all are active. Atomic. */
+	int thread_count;
+	/** Number of the running workers. Atomic. */
+	int active_count;
+	/** Under the mutex, read without it. */
+	uint64_t threads_created;
+	uint64_t threads_retired;
+	/** Atomic. */
+	alignas(CACHE_LINE_SIZE) uint64_t tasks_cancelled;
+};
+
+/** Lane of the priority in the queue of the node. */
+static inline struct task_queue *
+thread_pool_lane(struct thread_pool *pool, int node, int priority)
+{
+	return &pool->queues[node * TPOOL_PRIORITY_COUNT + priority];
+}
 
-	/* PUT HERE OTHER MEMBERS */
+/**
+ * Zeroed array of @a count objects of a cache line aligned type.
+ * Only calloc() is used, so the heap checkers see it. The calloc()
+ * pointer is stored right before the array.
+ */
+static void *
+cache_aligned_calloc(size_t count, size_t size)
+{
+	char *mem = calloc(1, count * size + CACHE_LINE_SIZE);
+	uintptr_t res = ((uintptr_t)mem + CACHE_LINE_SIZE) &
+			~(uintptr_t)(CACHE_LINE_SIZE - 1);
+	((void **)res)[-1] = mem;
+	return (void *)res;
+}
+
+static void
+cache_aligned_free(void *ptr)
+{
+	free(((void **)ptr)[-1]);
+}
+
+/**
+ * Wait while the value is @a val, until the CLOCK_MONOTONIC deadline
+ * or forever if it is NULL. Returns false on the timeout.
+ */
+static bool
+futex_wait(int *futex, int val, const struct timespec *deadline)
+{
+	return syscall(SYS_futex, futex, FUTEX_WAIT_BITSET_PRIVATE, val,
+		       deadline, NULL, FUTEX_BITSET_MATCH_ANY) == 0 ||
+	       errno != ETIMEDOUT;
+}
+
+/**
+ * Wake up to @a count waiters. The futex memory can be freed already
+ * by a waiter which has seen the new value without sleeping, then the
+ * call at most makes a spurious wakeup, and all the waits loop.
+ */
+static void
+futex_wake(int *futex, int count)
+{
+	syscall(SYS_futex, futex, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+static uint64_t
+clock_monotonic_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** Add to a counter which only the current thread changes. */
+static inline void
+stat_add(uint64_t *counter, uint64_t value)
+{
+	__atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+/** Deadline @a ns nanoseconds from now. */
+static void
+deadline_after(struct timespec *deadline, uint64_t ns)
+{
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	ns += deadline->tv_nsec;
+	deadline->tv_sec += ns / 1000000000;
+	deadline->tv_nsec = ns % 1000000000;
+}
+
+/** Tell the CPU it is a spin loop. */
+static inline void
+cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ volatile("yield");
+#endif
+}
+
+_Static_assert(sizeof(struct thread_task) <= THREAD_TASK_SIZE,
+	       "a task fits into its storage");
+
+/** List of free tasks. */
+struct task_cache {
+	struct thread_task *first;
+	int count;
 };
 
+static __thread struct task_cache task_cache;
+static __thread bool task_cache_is_registered = false;
+/** Flushes the cache of an exiting thread into the depot. */
+static pthread_key_t task_cache_key;
+static pthread_once_t task_cache_once = PTHREAD_ONCE_INIT;
+static struct task_cache task_depot;
+static pthread_mutex_t task_depot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** The worker of the current thread, or NULL for other threads. */
+static __thread struct thread_worker *current_worker = NULL;
+
+static void
+task_queue_create(struct task_queue *q)
+{
+	q->cells = malloc(TASK_QUEUE_SIZE * sizeof(q->cells[0]));
+	for (uint64_t i = 0; i < TASK_QUEUE_SIZE; ++i)
+		q->cells[i].seq = i;
+	q->tail = 0;
+	q->head = 0;
+}
+
+static void
+task_queue_destroy(struct task_queue *q)
+{
+	free(q->cells);
+}
+
+/** Never fails, since the pool has not more tasks than the cells. */
+static void
+task_queue_push(struct task_queue *q, struct thread_task *task)
+{
+	uint64_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	struct task_queue_cell *cell;
+	for (;;) {
+		cell = &q->cells[pos & (TASK_QUEUE_SIZE - 1)];
+		uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		int64_t diff = (int64_t)(seq - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1,
+							true, __ATOMIC_SEQ_CST,
+							__ATOMIC_RELAXED))
+				break;
+		} else {
+			pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+		}
+	}
+	__atomic_store_n(&task->queue_slot, &cell->task, __ATOMIC_RELAXED);
+	__atomic_store_n(&cell->task, task, __ATOMIC_RELAXED);
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Push several tasks. The positions are taken at once, and each
+ * cell is free already or is being freed by a pop right now, since
+ * the queue has space for all the tasks of the pool.
+ */
+static void
+task_queue_push_many(struct task_queue *q, struct thread_task **tasks,
+		     int count)
+{
+	uint64_t pos = __atomic_fetch_add(&q->tail, count, __ATOMIC_SEQ_CST);
+	for (int i = 0; i < count; ++i, ++pos) {
+		struct task_queue_cell *cell =
+			&q->cells[pos & (TASK_QUEUE_SIZE - 1)];
+		while (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != pos)
+			cpu_relax();
+		__atomic_store_n(&tasks[i]->queue_slot, &cell->task,
+				 __ATOMIC_RELAXED);
+		__atomic_store_n(&cell->task, tasks[i], __ATOMIC_RELAXED);
+		__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+	}
+}
+
+/** Pop a task, the cells emptied by the cancels are skipped. */
+static struct thread_task *
+task_queue_pop(struct task_queue *q)
+{
+	uint64_t pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	struct task_queue_cell *cell;
+	for (;;) {
+		cell = &q->cells[pos & (TASK_QUEUE_SIZE - 1)];
+		uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		int64_t diff = (int64_t)(seq - (pos + 1));
+		if (diff == 0) {
+			if (!__atomic_compare_exchange_n(&q->head, &pos,
+							 pos + 1, true,
+							 __ATOMIC_RELAXED,
+							 __ATOMIC_RELAXED))
+				continue;
+			/* Either this or the cancel gets the task. */
+			struct thread_task *task =
+				__atomic_exchange_n(&cell->task, NULL,
+						    __ATOMIC_ACQUIRE);
+			__atomic_store_n(&cell->seq, pos + TASK_QUEUE_SIZE,
+					 __ATOMIC_RELEASE);
+			if (task != NULL)
+				return task;
+			pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+		} else if (diff < 0) {
+			return NULL;
+		} else {
+			pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+static bool
+task_queue_is_empty(struct task_queue *q)
+{
+	return __atomic_load_n(&q->head, __ATOMIC_SEQ_CST) ==
+	       __atomic_load_n(&q->tail, __ATOMIC_SEQ_CST);
+}
+
+static struct task_deque_array *
+task_deque_array_new(int64_t size, struct task_deque_array *prev)
+{
+	struct task_deque_array *a =
+		malloc(sizeof(*a) + size * sizeof(a->tasks[0]));
+	a->size = size;
+	a->prev = prev;
+	return a;
+}
+
+static void
+task_deque_create(struct task_deque *d)
+{
+	d->top = 0;
+	d->bottom = 0;
+	d->array = task_deque_array_new(TASK_DEQUE_MIN_SIZE, NULL);
+}
+
+static void
+task_deque_destroy(struct task_deque *d)
+{
+	struct task_deque_array *a = d->array;
+	while (a != NULL) {
+		struct task_deque_array *prev = a->prev;
+		free(a);
+		a = prev;
+	}
+}
+
+/** Push to the bottom. Only for the owner. */
+static void
+task_deque_push(struct task_deque *d, struct thread_task *task)
+{
+	int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+	int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+	struct task_deque_array *a = __atomic_load_n(&d->array,
+						     __ATOMIC_RELAXED);
+	if (b - t > a->size - 1) {
+		/*
+		 * The old array is kept, a thief can be reading it. The
+		 * arrays only grow, so there are a few of them.
+		 */
+		struct task_deque_array *new_a =
+			task_deque_array_new(a->size * 2, a);
+		for (int64_t i = t; i < b; ++i) {
+			new_a->tasks[i & (new_a->size - 1)] =
+				__atomic_load_n(&a->tasks[i & (a->size - 1)],
+						__ATOMIC_RELAXED);
+		}
+		__atomic_store_n(&d->array, new_a, __ATOMIC_RELEASE);
+		a = new_a;
+	}
+	__atomic_store_n(&a->tasks[b & (a->size - 1)], task, __ATOMIC_RELAXED);
+	__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELEASE);
+}
+
+/** Take from the bottom. Only for the owner. */
+static struct thread_task *
+task_deque_take(struct task_deque *d)
+{
+	int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+	struct task_deque_array *a = __atomic_load_n(&d->array,
+						     __ATOMIC_RELAXED);
+	__atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	int64_t t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+	if (t > b) {
+		__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	struct thread_task *task =
+		__atomic_load_n(&a->tasks[b & (a->size - 1)], __ATOMIC_RELAXED);
+	if (t == b) {
+		/* The last one, a thief can be taking it too. */
+		if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, false,
+						 __ATOMIC_SEQ_CST,
+						 __ATOMIC_RELAXED))
+			task = NULL;
+		__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+	}
+	return task;
+}
+
+/** Steal from the top. For any thread. */
+static struct thread_task *
+task_deque_steal(struct task_deque *d)
+{
+	int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+	if (t >= b)
+		return NULL;
+	struct task_deque_array *a = __atomic_load_n(&d->array,
+						     __ATOMIC_ACQUIRE);
+	struct thread_task *task =
+		__atomic_load_n(&a->tasks[t & (a->size - 1)], __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, false,
+					 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		return NULL;
+	return task;
+}
+
+static bool
+task_deque_is_empty(struct task_deque *d)
+{
+	return __atomic_load_n(&d->top, __ATOMIC_SEQ_CST) >=
+	       __atomic_load_n(&d->bottom, __ATOMIC_SEQ_CST);
+}
+
+/** Free the tasks of the list. */
+static void
+task_cache_free(struct task_cache *c)
+{
+	while (c->first != NULL) {
+		struct thread_task *next = c->first->next_free;
+		free(c->first);
+		c->first = next;
+	}
+	c->count = 0;
+}
+
+/** Move up to @a count tasks from one list to another. */
+static void
+task_cache_move(struct task_cache *from, struct task_cache *to, int count)
+{
+	while (count-- > 0 && from->first != NULL) {
+		struct thread_task *t = from->first;
+		from->first = t->next_free;
+		--from->count;
+		t->next_free = to->first;
+		to->first = t;
+		++to->count;
+	}
+}
+
+static void
+task_cache_on_thread_exit(void *arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&task_depot_lock);
+	task_cache_move(&task_cache, &task_depot, TASK_DEPOT_MAX -
+			task_depot.count);
+	pthread_mutex_unlock(&task_depot_lock);
+	task_cache_free(&task_cache);
+}
+
+/**
+ * The main thread has no exit destructor, and the other threads are
+ * gone already.
+ */
+static void
+task_cache_on_exit(void)
+{
+	task_cache_free(&task_cache);
+	task_cache_free(&task_depot);
+}
+
+static void
+task_cache_init_once(void)
+{
+	pthread_key_create(&task_cache_key, task_cache_on_thread_exit);
+	atexit(task_cache_on_exit);
+}
+
+static struct thread_task *
+task_cache_get(void)
+{
+	struct task_cache *c = &task_cache;
+	if (c->first == NULL) {
+		pthread_mutex_lock(&task_depot_lock);
+		task_cache_move(&task_depot, c, TASK_CACHE_BATCH);
+		pthread_mutex_unlock(&task_depot_lock);
+		if (c->first == NULL)
+			return NULL;
+	}
+	struct thread_task *t = c->first;
+	c->first = t->next_free;
+	--c->count;
+	return t;
+}
+
+static void
+task_cache_put(struct thread_task *task)
+{
+	struct task_cache *c = &task_cache;
+	if (!task_cache_is_registered) {
+		pthread_once(&task_cache_once, task_cache_init_once);
+		/* Any non-NULL value, so the destructor is called. */
+		pthread_setspecific(task_cache_key, c);
+		task_cache_is_registered = true;
+	}
+	task->next_free = c->first;
+	c->first = task;
+	if (++c->count <= TASK_CACHE_MAX)
+		return;
+	struct task_cache surplus = {NULL, 0};
+	task_cache_move(c, &surplus, TASK_CACHE_BATCH);
+	pthread_mutex_lock(&task_depot_lock);
+	task_cache_move(&surplus, &task_depot, TASK_DEPOT_MAX -
+			task_depot.count);
+	pthread_mutex_unlock(&task_depot_lock);
+	task_cache_free(&surplus);
+}
+
+/** Free the task memory. An embedded one has nothing to free. */
+static void
+thread_task_free(struct thread_task *task)
+{
+	if (!task->is_embedded)
+		task_cache_put(task);
+}
+
+static void
+thread_pool_enqueue(struct thread_pool *pool, struct thread_task **tasks,
+		    int count);
+
+/** Take the dependents of the task, no new ones can be added then. */
+static struct task_dep *
+thread_task_close_dependents(struct thread_task *task)
+{
+	return __atomic_exchange_n(&task->dependents, TASK_DEPS_CLOSED,
+				   __ATOMIC_ACQ_REL);
+}
+
+/**
+ * Make the dependents not wait for their closed dependency, and queue
+ * the ones which wait for nothing else.
+ */
+static void
+thread_task_queue_dependents(struct task_dep *dep)
+{
+	while (dep != NULL && dep != TASK_DEPS_CLOSED) {
+		struct task_dep *next = dep->next;
+		struct thread_task *t = dep->task;
+		free(dep);
+		if (__atomic_sub_fetch(&t->dep_count, 1, __ATOMIC_ACQ_REL) == 0)
+			thread_pool_enqueue(t->pool, &t, 1);
+		dep = next;
+	}
+}
+
+static void
+thread_task_release_dependents(struct thread_task *task)
+{
+	thread_task_queue_dependents(thread_task_close_dependents(task));
+}
+
+/** Finish the task taken out of the queues, run or cancelled. */
+static void
+thread_task_finish(struct thread_pool *pool, struct thread_task *task)
+{
+	/* Nobody adds dependencies to a pushed task. */
+	__atomic_store_n(&task->dep_count, 1, __ATOMIC_RELAXED);
+	/*
+	 * The dependents are queued only when the task is seen finished
+	 * and is out of the pool, so they find it so.
+	 */
+	struct task_dep *deps = thread_task_close_dependents(task);
+	/*
+	 * The task leaves the pool before it is seen finished. So a
+	 * push after a join sees the worker free.
+	 */
+	__atomic_sub_fetch(&pool->task_count, 1, __ATOMIC_RELEASE);
+	/*
+	 * After this the task can be joined and deleted, so only the
+	 * addresses are used. Nobody waiting means no syscalls. A group
+	 * keeps the task until the counter is decremented.
+	 */
+	int old = __atomic_exchange_n(&task->state, TASK_STATE_FINISHED,
+				      __ATOMIC_ACQ_REL);
+	if ((old & TASK_FLAG_GROUPED) != 0) {
+		int *pending = task->group_pending;
+		if (__atomic_sub_fetch(pending, 1, __ATOMIC_SEQ_CST) == 0)
+			futex_wake(pending, 1);
+	}
+	if ((old & TASK_FLAG_WAITED) != 0)
+		futex_wake(&task->state, INT_MAX);
+	if ((old & TASK_FLAG_DETACHED) != 0)
+		thread_task_free(task);
+	thread_task_queue_dependents(deps);
+}
+
+/** Call the function of the started task, and finish it. */
+static void
+thread_task_exec(struct thread_pool *pool, struct thread_task *task)
+{
+	/* Only the workers run the tasks. */
+	struct thread_worker *w = current_worker;
+	uint64_t start_ns = 0;
+	if (pool->is_timing_enabled) {
+		start_ns = clock_monotonic_ns();
+		stat_add(&w->wait_ns, start_ns - task->push_ns);
+	}
+	trace_begin("task", (uintptr_t)task);
+	task->result = task->function(task->arg);
+	trace_end("task", (uintptr_t)task);
+	if (pool->is_timing_enabled)
+		stat_add(&w->run_ns, clock_monotonic_ns() - start_ns);
+	stat_add(&w->tasks_done, 1);
+	thread_task_finish(pool, task);
+}
+
+#if TPOOL_CORO
+
+static void *
+thread_task_coro_f(void *arg)
+{
+	/* The coroutine never leaves the worker. */
+	struct thread_worker *w = current_worker;
+	thread_task_exec(w->pool, arg);
+	if (w->coro_done_count == w->coro_done_size) {
+		w->coro_done_size = w->coro_done_size == 0 ? 16 :
+				    w->coro_done_size * 2;
+		w->coro_done = realloc(w->coro_done, w->coro_done_size *
+				       sizeof(w->coro_done[0]));
+	}
+	w->coro_done[w->coro_done_count++] = coro_this();
+	return NULL;
+}
+
+#endif
+
+static void
+thread_task_run(struct thread_pool *pool, struct thread_task *task)
+{
+	/* Keep the flags. A cancel sees it running then. */
+	int old = __atomic_fetch_add(&task->state, TASK_STATE_RUNNING -
+				     TASK_STATE_QUEUED, __ATOMIC_ACQUIRE);
+	if ((old & TASK_FLAG_CANCELLED) != 0) {
+		task->result = NULL;
+		thread_task_finish(pool, task);
+		return;
+	}
+#if TPOOL_CORO
+	if (task->is_coro) {
+		/* Starts in the next step of the worker engine. */
+		coro_new(thread_task_coro_f, task);
+		return;
+	}
+#endif
+	thread_task_exec(pool, task);
+}
+
+/** Unpark the worker. Returns false if it was not parked. */
+static bool
+thread_worker_unpark(struct thread_worker *w)
+{
+	int parked = 1;
+	if (!__atomic_compare_exchange_n(&w->futex, &parked, 0, false,
+					 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		return false;
+	futex_wake(&w->futex, 1);
+	return true;
+}
+
+/**
+ * Wake up to @a count parked workers, less the spinning ones, which
+ * would take the tasks anyway. The workers of the node go first.
+ */
+static void
+thread_pool_wakeup_many(struct thread_pool *pool, int node, int count)
+{
+	/*
+	 * The tasks are already visible, and a worker stops spinning
+	 * or parks only after it counts itself in the next state and
+	 * then checks the queues. So either this sees the worker, or
+	 * the worker sees the tasks.
+	 */
+	count -= __atomic_load_n(&pool->spinner_count, __ATOMIC_SEQ_CST);
+	if (count <= 0 ||
+	    __atomic_load_n(&pool->sleeper_count, __ATOMIC_SEQ_CST) == 0)
+		return;
+	int thread_count = __atomic_load_n(&pool->thread_count,
+					   __ATOMIC_ACQUIRE);
+	for (int is_local = 1; is_local >= 0; --is_local) {
+		for (int i = 0; i < thread_count && count > 0; ++i) {
+			struct thread_worker *w = &pool->workers[i];
+			if ((w->node == node) == is_local &&
+			    thread_worker_unpark(w))
+				--count;
+		}
+		if (pool->node_count == 1)
+			break;
+	}
+}
+
+/** Wake one parked worker, unless some worker is spinning. */
+static void
+thread_pool_wakeup(struct thread_pool *pool, int node)
+{
+	thread_pool_wakeup_many(pool, node, 1);
+}
+
+/**
+ * Take a task from a lane of the priority, of the own node first.
+ * From the normal lane a batch is taken: one is returned, the rest
+ * go to the worker deque, where the others can steal them. The high
+ * and the low ones stay in their lanes to keep the order.
+ */
+static struct thread_task *
+thread_worker_grab(struct thread_worker *w, int priority)
+{
+	struct thread_pool *pool = w->pool;
+	struct task_queue *queue = NULL;
+	struct thread_task *task = NULL;
+	for (int i = 0; i < pool->node_count && task == NULL; ++i) {
+		queue = thread_pool_lane(pool, (w->node + i) % pool->node_count,
+					 priority);
+		task = task_queue_pop(queue);
+	}
+	if (task == NULL || priority != TPOOL_PRIORITY_NORMAL)
+		return task;
+	int thread_count = __atomic_load_n(&pool->thread_count,
+					   __ATOMIC_RELAXED);
+	int pending = __atomic_load_n(&pool->task_count, __ATOMIC_RELAXED);
+	int count = pending / thread_count;
+	if (count > TASK_QUEUE_BATCH_MAX)
+		count = TASK_QUEUE_BATCH_MAX;
+	int moved = 0;
+	for (; moved < count; ++moved) {
+		struct thread_task *next = task_queue_pop(queue);
+		if (next == NULL)
+			break;
+		task_deque_push(&w->deque, next);
+	}
+	if (moved > 0)
+		thread_pool_wakeup(pool, w->node);
+	return task;
+}
+
+static struct thread_task *
+thread_worker_steal(struct thread_worker *w)
+{
+	struct thread_pool *pool = w->pool;
+	int count = __atomic_load_n(&pool->thread_count, __ATOMIC_ACQUIRE);
+	/* Xorshift. */
+	w->random ^= w->random << 13;
+	w->random ^= w->random >> 7;
+	w->random ^= w->random << 17;
+	int start = w->random % count;
+	/* The same node first. */
+	for (int is_local = 1; is_local >= 0; --is_local) {
+		for (int i = 0; i < count; ++i) {
+			struct thread_worker *victim =
+				&pool->workers[(start + i) % count];
+			bool is_victim_local = victim->node == w->node;
+			if (victim == w || is_victim_local != is_local)
+				continue;
+			struct thread_task *task =
+				task_deque_steal(&victim->deque);
+			if (task != NULL) {
+				stat_add(&w->steal_count, 1);
+				return task;
+			}
+		}
+		if (pool->node_count == 1)
+			break;
+	}
+	return NULL;
+}
+
+static bool
+thread_pool_has_work(struct thread_pool *pool)
+{
+	for (int i = 0; i < pool->node_count * TPOOL_PRIORITY_COUNT; ++i) {
+		if (!task_queue_is_empty(&pool->queues[i]))
+			return true;
+	}
+	int count = __atomic_load_n(&pool->thread_count, __ATOMIC_ACQUIRE);
+	for (int i = 0; i < count; ++i) {
+		if (!task_deque_is_empty(&pool->workers[i].deque))
+			return true;
+	}
+	return false;
+}
+
+/**
+ * Find a task for the worker: a high priority one, its own, from the
+ * queue, stolen, or a low priority one.
+ */
+static struct thread_task *
+thread_worker_next(struct thread_worker *w)
+{
+	struct thread_task *task = thread_worker_grab(w, TPOOL_PRIORITY_HIGH);
+	if (task == NULL)
+		task = task_deque_take(&w->deque);
+	if (task == NULL)
+		task = thread_worker_grab(w, TPOOL_PRIORITY_NORMAL);
+	if (task == NULL)
+		task = thread_worker_steal(w);
+	if (task == NULL)
+		task = thread_worker_grab(w, TPOOL_PRIORITY_LOW);
+	return task;
+}
+
+static bool
+thread_pool_is_stopping(struct thread_pool *pool)
+{
+	return __atomic_load_n(&pool->is_stopping, __ATOMIC_SEQ_CST);
+}
+
+#if TPOOL_CORO
+
+/**
+ * Run the coroutines of the worker once, waiting for their timers and
+ * descriptors up to @a timeout_ns if none is runnable. The finished
+ * coroutines of the tasks are joined.
+ */
+static enum coro_sched_state
+thread_worker_coro_step(struct thread_worker *w, uint64_t timeout_ns)
+{
+	enum coro_sched_state state = coro_sched_step(timeout_ns / 1e9);
+	if (w->coro_done_count > 0) {
+		for (int i = 0; i < w->coro_done_count; ++i)
+			coro_join(w->coro_done[i]);
+		w->coro_done_count = 0;
+		/* Could be the last ones. */
+		if (state == CORO_SCHED_SUSPENDED)
+			state = coro_sched_step(0);
+	}
+	w->coro_state = state;
+	return state;
+}
+
+/**
+ * Give the time of the worker out of tasks to its coroutines. Returns
+ * false if they have nothing to do, and the worker can park.
+ */
+static bool
+thread_worker_coro_wait(struct thread_worker *w)
+{
+	enum coro_sched_state state = thread_worker_coro_step(w, 0);
+	if (state == CORO_SCHED_RUNNABLE)
+		return true;
+	if (state != CORO_SCHED_WAITING)
+		return false;
+	/*
+	 * A parked worker would miss the timers and the descriptors,
+	 * and a polling one misses the pushes. So the poll is short.
+	 */
+	thread_worker_coro_step(w, WORKER_CORO_POLL_NS);
+	return true;
+}
+
+/** Let the coroutines created by the tasks finish, and drop the engine. */
+static void
+thread_worker_coro_exit(struct thread_worker *w)
+{
+	enum coro_sched_state state = w->coro_state;
+	while (state == CORO_SCHED_RUNNABLE || state == CORO_SCHED_WAITING)
+		state = thread_worker_coro_step(w, WORKER_CORO_POLL_NS);
+	coro_sched_thread_destroy();
+	free(w->coro_done);
+	w->coro_done = NULL;
+	w->coro_done_size = 0;
+}
+
+#endif
+
+/**
+ * Exit the worker thread after an idle timeout, unless it is needed.
+ * Returns true if the thread should exit.
+ */
+static bool
+thread_worker_retire(struct thread_worker *w)
+{
+	struct thread_pool *pool = w->pool;
+	bool is_retired = false;
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->is_stopping ||
+	    __atomic_load_n(&pool->active_count, __ATOMIC_RELAXED) <=
+	    pool->min_thread_count)
+		goto unlock;
+#if TPOOL_CORO
+	/* The coroutines can't leave the thread. */
+	if (pool->is_coro_enabled && w->coro_state != CORO_SCHED_IDLE)
+		goto unlock;
+#endif
+	/*
+	 * A push counts the task and then checks the workers, this
+	 * does it the other way round. So either the push sees less
+	 * workers and starts one, or this sees the task.
+	 */
+	int active_count = __atomic_sub_fetch(&pool->active_count, 1,
+					      __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&pool->task_count, __ATOMIC_SEQ_CST) >
+	    active_count || thread_pool_has_work(pool)) {
+		__atomic_add_fetch(&pool->active_count, 1, __ATOMIC_SEQ_CST);
+		goto unlock;
+	}
+	__atomic_store_n(&w->is_active, false, __ATOMIC_RELEASE);
+	w->is_retired = true;
+	__atomic_store_n(&pool->threads_retired, pool->threads_retired + 1,
+			 __ATOMIC_RELAXED);
+	is_retired = true;
+unlock:
+	pthread_mutex_unlock(&pool->mutex);
+	return is_retired;
+}
+
+/**
+ * Spin, then park until there is work. Returns false when the pool
+ * stops or the thread exits by the idle timeout.
+ */
+static bool
+thread_worker_wait(struct thread_worker *w)
+{
+	struct thread_pool *pool = w->pool;
+#if TPOOL_CORO
+	if (pool->is_coro_enabled && thread_worker_coro_wait(w))
+		return !thread_pool_is_stopping(pool);
+#endif
+	int spinner_count = __atomic_load_n(&pool->spinner_count,
+					    __ATOMIC_RELAXED);
+	bool is_spinning = false;
+	while (spinner_count < pool->spinner_max && !is_spinning) {
+		is_spinning = __atomic_compare_exchange_n(
+			&pool->spinner_count, &spinner_count, spinner_count + 1,
+			true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+	}
+	for (int i = 1; is_spinning && i <= w->spin_count; ++i) {
+		cpu_relax();
+		if (i % WORKER_SPIN_CHECK_STEP != 0)
+			continue;
+		if (thread_pool_has_work(pool) ||
+		    thread_pool_is_stopping(pool)) {
+			__atomic_sub_fetch(&pool->spinner_count, 1,
+					   __ATOMIC_SEQ_CST);
+			if (w->spin_count < WORKER_SPIN_MAX)
+				w->spin_count *= 2;
+			return !thread_pool_is_stopping(pool);
+		}
+	}
+	/* Become a sleeper before stopping being a spinner. */
+	__atomic_store_n(&w->futex, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&pool->sleeper_count, 1, __ATOMIC_SEQ_CST);
+	if (is_spinning) {
+		__atomic_sub_fetch(&pool->spinner_count, 1, __ATOMIC_SEQ_CST);
+		if (w->spin_count > WORKER_SPIN_MIN)
+			w->spin_count /= 2;
+	}
+	struct timespec deadline;
+	const struct timespec *timeout = NULL;
+	if (pool->idle_timeout_ns > 0 &&
+	    __atomic_load_n(&pool->active_count, __ATOMIC_RELAXED) >
+	    pool->min_thread_count) {
+		deadline_after(&deadline, pool->idle_timeout_ns);
+		timeout = &deadline;
+	}
+	bool is_retired = false;
+	while (__atomic_load_n(&w->futex, __ATOMIC_SEQ_CST) == 1) {
+		if (thread_pool_has_work(pool) ||
+		    thread_pool_is_stopping(pool)) {
+			__atomic_store_n(&w->futex, 0, __ATOMIC_SEQ_CST);
+			break;
+		}
+		if (futex_wait(&w->futex, 1, timeout))
+			continue;
+		/* Not woken up by anybody meanwhile. */
+		int parked = 1;
+		if (__atomic_compare_exchange_n(&w->futex, &parked, 0, false,
+						__ATOMIC_SEQ_CST,
+						__ATOMIC_RELAXED))
+			is_retired = thread_worker_retire(w);
+		break;
+	}
+	__atomic_sub_fetch(&pool->sleeper_count, 1, __ATOMIC_SEQ_CST);
+	return !is_retired && !thread_pool_is_stopping(pool);
+}
+
+static void *
+thread_worker_f(void *arg)
+{
+	struct thread_worker *w = arg;
+	current_worker = w;
+	trace_set_thread_name("pool worker");
+#if TPOOL_CORO
+	bool is_coro_enabled = w->pool->is_coro_enabled;
+	if (is_coro_enabled) {
+		coro_sched_thread_init();
+		w->coro_state = CORO_SCHED_IDLE;
+	}
+#endif
+	do {
+		struct thread_task *task;
+		while ((task = thread_worker_next(w)) != NULL) {
+			thread_task_run(w->pool, task);
+#if TPOOL_CORO
+			/* The tasks and the coroutines take turns. */
+			if (is_coro_enabled)
+				thread_worker_coro_step(w, 0);
+#endif
+		}
+	} while (thread_worker_wait(w));
+#if TPOOL_CORO
+	if (is_coro_enabled)
+		thread_worker_coro_exit(w);
+#endif
+	return NULL;
+}
+
+/** Parse a CPU list like "0-3,8,10-11". */
+static void
+cpulist_parse(const char *list, cpu_set_t *cpus)
+{
+	CPU_ZERO(cpus);
+	while (*list != 0 && *list != '\n') {
+		char *end;
+		long first = strtol(list, &end, 10);
+		long last = first;
+		if (end == list)
+			return;
+		if (*end == '-')
+			last = strtol(end + 1, &end, 10);
+		for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu)
+			CPU_SET(cpu, cpus);
+		list = *end == ',' ? end + 1 : end;
+	}
+}
+
+/**
+ * Find the NUMA nodes of the CPUs in sysfs. The nodes without CPUs
+ * are skipped. Without sysfs there is one node.
+ */
+static void
+thread_pool_init_numa(struct thread_pool *pool)
+{
+	enum { NODE_MAX = 64 };
+	cpu_set_t *node_cpus = malloc(NODE_MAX * sizeof(node_cpus[0]));
+	int node_count = 0;
+	for (int i = 0; i < NODE_MAX * 4 && node_count < NODE_MAX; ++i) {
+		char path[64];
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/node/node%d/cpulist", i);
+		FILE *f = fopen(path, "r");
+		if (f == NULL)
+			continue;
+		char list[4096];
+		if (fgets(list, sizeof(list), f) != NULL) {
+			cpulist_parse(list, &node_cpus[node_count]);
+			if (CPU_COUNT(&node_cpus[node_count]) > 0)
+				++node_count;
+		}
+		fclose(f);
+	}
+	if (node_count == 0) {
+		free(node_cpus);
+		return;
+	}
+	pool->node_count = node_count;
+	pool->node_cpus = node_cpus;
+	pool->cpu_nodes = calloc(CPU_SETSIZE, sizeof(pool->cpu_nodes[0]));
+	for (int node = 0; node < node_count; ++node) {
+		for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+			if (CPU_ISSET(cpu, &node_cpus[node]))
+				pool->cpu_nodes[cpu] = node;
+		}
+	}
+}
+
+/** Node of the calling thread CPU. */
+static int
+thread_pool_current_node(struct thread_pool *pool)
+{
+	if (pool->node_count == 1)
+		return 0;
+	int cpu = sched_getcpu();
+	return cpu >= 0 && cpu < CPU_SETSIZE ? pool->cpu_nodes[cpu] : 0;
+}
+
+/**
+ * Node and CPUs of a new worker slot: its own CPUs and their node,
+ * or the next node in turn with all its CPUs. NULL means no pinning.
+ */
+static const cpu_set_t *
+thread_pool_place_worker(struct thread_pool *pool, int slot, int *node)
+{
+	*node = 0;
+	const cpu_set_t *cpus = NULL;
+	if (pool->worker_cpus != NULL)
+		cpus = &pool->worker_cpus[slot];
+	if (pool->cpu_nodes == NULL)
+		return cpus;
+	if (cpus == NULL) {
+		*node = slot % pool->node_count;
+		return &pool->node_cpus[*node];
+	}
+	for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		if (CPU_ISSET(cpu, cpus)) {
+			*node = pool->cpu_nodes[cpu];
+			break;
+		}
+	}
+	return cpus;
+}
+
 int
 thread_pool_new(int max_thread_count, struct thread_pool **pool)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)max_thread_count;
-	(void)pool;
-	return TPOOL_ERR_NOT_IMPLEMENTED;
+	struct thread_pool_options options = {
+		.max_thread_count = max_thread_count,
+	};
+	return thread_pool_new_ex(&options, pool);
+}
+
+int
+thread_pool_new_ex(const struct thread_pool_options *options,
+		   struct thread_pool **pool)
+{
+	int max_thread_count = options->max_thread_count;
+	if (max_thread_count <= 0 || max_thread_count > TPOOL_MAX_THREADS ||
+	    options->min_thread_count < 0 ||
+	    options->min_thread_count > max_thread_count ||
+	    options->idle_timeout < 0 ||
+	    (options->stack_size != 0 &&
+	     options->stack_size < (size_t)PTHREAD_STACK_MIN))
+		return TPOOL_ERR_INVALID_ARGUMENT;
+#if !TPOOL_CORO
+	if (options->is_coro_enabled)
+		return TPOOL_ERR_NOT_IMPLEMENTED;
+#endif
+	struct thread_pool *p = cache_aligned_calloc(1, sizeof(*p));
+	p->workers = cache_aligned_calloc(max_thread_count,
+					  sizeof(p->workers[0]));
+	p->max_thread_count = max_thread_count;
+	p->min_thread_count = options->min_thread_count;
+	double timeout = options->idle_timeout;
+	/* Something huge is just never. */
+	p->idle_timeout_ns = timeout > 0 && timeout < 1e9 ?
+			     (uint64_t)(timeout * 1e9) + 1 : 0;
+	p->is_timing_enabled = options->is_timing_enabled;
+	p->is_coro_enabled = options->is_coro_enabled;
+	p->stack_size = options->stack_size;
+	p->node_count = 1;
+	if (options->is_numa_aware)
+		thread_pool_init_numa(p);
+	if (options->worker_cpus != NULL) {
+		p->worker_cpus = malloc(max_thread_count *
+					sizeof(p->worker_cpus[0]));
+		memcpy(p->worker_cpus, options->worker_cpus,
+		       max_thread_count * sizeof(p->worker_cpus[0]));
+	}
+	int queue_count = p->node_count * TPOOL_PRIORITY_COUNT;
+	p->queues = cache_aligned_calloc(queue_count, sizeof(p->queues[0]));
+	for (int i = 0; i < queue_count; ++i)
+		task_queue_create(&p->queues[i]);
+	long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+	p->spinner_max = cpu_count > 1 ? cpu_count - 1 : 0;
+	pthread_mutex_init(&p->mutex, NULL);
+	*pool = p;
+	return 0;
 }
 
 int
 thread_pool_thread_count(const struct thread_pool *pool)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)pool;
-	return TPOOL_ERR_NOT_IMPLEMENTED;
+	return __atomic_load_n(&pool->active_count, __ATOMIC_RELAXED);
+}
+
+void
+thread_pool_stats(const struct thread_pool *pool,
+		  struct thread_pool_stats *stats)
+{
+	struct thread_pool *p = (struct thread_pool *)pool;
+	stats->thread_count = __atomic_load_n(&p->active_count,
+					      __ATOMIC_RELAXED);
+	stats->threads_created = __atomic_load_n(&p->threads_created,
+						 __ATOMIC_RELAXED);
+	stats->threads_retired = __atomic_load_n(&p->threads_retired,
+						 __ATOMIC_RELAXED);
+	stats->task_count = __atomic_load_n(&p->task_count, __ATOMIC_RELAXED);
+	int64_t queued = 0;
+	for (int i = 0; i < p->node_count * TPOOL_PRIORITY_COUNT; ++i) {
+		struct task_queue *q = &p->queues[i];
+		queued += __atomic_load_n(&q->tail, __ATOMIC_RELAXED) -
+			  __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	}
+	stats->tasks_done = 0;
+	stats->steal_count = 0;
+	stats->task_wait_ns = 0;
+	stats->task_run_ns = 0;
+	stats->tasks_cancelled = __atomic_load_n(&p->tasks_cancelled,
+						 __ATOMIC_RELAXED);
+	int count = __atomic_load_n(&p->thread_count, __ATOMIC_ACQUIRE);
+	for (int i = 0; i < count; ++i) {
+		struct thread_worker *w = &p->workers[i];
+		queued += __atomic_load_n(&w->deque.bottom, __ATOMIC_RELAXED) -
+			  __atomic_load_n(&w->deque.top, __ATOMIC_RELAXED);
+		stats->tasks_done += __atomic_load_n(&w->tasks_done,
+						     __ATOMIC_RELAXED);
+		stats->steal_count += __atomic_load_n(&w->steal_count,
+						      __ATOMIC_RELAXED);
+		stats->task_wait_ns += __atomic_load_n(&w->wait_ns,
+						       __ATOMIC_RELAXED);
+		stats->task_run_ns += __atomic_load_n(&w->run_ns,
+						      __ATOMIC_RELAXED);
+	}
+	/* The counters are read at different moments. */
+	if (queued < 0)
+		queued = 0;
+	if (queued > stats->task_count)
+		queued = stats->task_count;
+	stats->queued_task_count = queued;
 }
 
 int
 thread_pool_delete(struct thread_pool *pool)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)pool;
-	return TPOOL_ERR_NOT_IMPLEMENTED;
+	pthread_mutex_lock(&pool->mutex);
+	if (__atomic_load_n(&pool->task_count, __ATOMIC_ACQUIRE) > 0) {
+		pthread_mutex_unlock(&pool->mutex);
+		return TPOOL_ERR_HAS_TASKS;
+	}
+	__atomic_store_n(&pool->is_stopping, true, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&pool->mutex);
+	for (int i = 0; i < pool->thread_count; ++i)
+		thread_worker_unpark(&pool->workers[i]);
+	for (int i = 0; i < pool->thread_count; ++i) {
+		struct thread_worker *w = &pool->workers[i];
+		if (__atomic_load_n(&w->is_active, __ATOMIC_ACQUIRE) ||
+		    w->is_retired)
+			pthread_join(w->thread, NULL);
+		task_deque_destroy(&w->deque);
+	}
+	for (int i = 0; i < pool->node_count * TPOOL_PRIORITY_COUNT; ++i)
+		task_queue_destroy(&pool->queues[i]);
+	cache_aligned_free(pool->queues);
+	free(pool->cpu_nodes);
+	free(pool->node_cpus);
+	free(pool->worker_cpus);
+	pthread_mutex_destroy(&pool->mutex);
+	cache_aligned_free(pool->workers);
+	cache_aligned_free(pool);
+	return 0;
+}
+
+/** Start one more worker, if the pool has more tasks than workers. */
+static void
+thread_pool_grow(struct thread_pool *pool, int task_count)
+{
+	pthread_mutex_lock(&pool->mutex);
+	int active_count = pool->active_count;
+	if (active_count >= pool->max_thread_count ||
+	    task_count <= active_count) {
+		pthread_mutex_unlock(&pool->mutex);
+		return;
+	}
+	/* A slot of an exited thread, or a new one. */
+	int count = pool->thread_count;
+	struct thread_worker *w = NULL;
+	for (int i = 0; i < count && w == NULL; ++i) {
+		if (!pool->workers[i].is_active)
+			w = &pool->workers[i];
+	}
+	if (w != NULL) {
+		pthread_join(w->thread, NULL);
+		w->is_retired = false;
+	} else {
+		w = &pool->workers[count];
+		w->pool = pool;
+		w->random = count + 1;
+		thread_pool_place_worker(pool, count, &w->node);
+		task_deque_create(&w->deque);
+		/*
+		 * The deque is ready before the thieves see the worker,
+		 * and the worker sees itself in the count.
+		 */
+		__atomic_store_n(&pool->thread_count, count + 1,
+				 __ATOMIC_RELEASE);
+	}
+	w->spin_count = WORKER_SPIN_MIN;
+	__atomic_store_n(&w->is_active, true, __ATOMIC_RELEASE);
+	__atomic_store_n(&pool->active_count, active_count + 1,
+			 __ATOMIC_SEQ_CST);
+	__atomic_store_n(&pool->threads_created, pool->threads_created + 1,
+			 __ATOMIC_RELAXED);
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	int node;
+	const cpu_set_t *cpus =
+		thread_pool_place_worker(pool, w - pool->workers, &node);
+	if (cpus != NULL)
+		pthread_attr_setaffinity_np(&attr, sizeof(*cpus), cpus);
+	/*
+	 * glibc maps the stack of this size, with a guard page, and keeps
+	 * the stacks of the exited threads for the new ones.
+	 *
+	 * It is instead of the workers started by a raw clone() on their
+	 * own stacks, which is not done on purpose. Without CLONE_SETTLS
+	 * such a thread shares the TLS of its creator: errno, the malloc()
+	 * tcache, current_worker and task_cache. Only glibc can build a
+	 * TLS block, so a task calling malloc() would corrupt the heap.
+	 * The start and the memory saved by clone() are measured against
+	 * this in thread_pool_start_bench.c.
+	 */
+	if (pool->stack_size != 0)
+		pthread_attr_setstacksize(&attr, pool->stack_size);
+	pthread_create(&w->thread, &attr, thread_worker_f, w);
+	pthread_attr_destroy(&attr);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+/**
+ * Put the ready tasks into a queue: of the current worker if it is
+ * in the pool, or the lane of their priority of the current node.
+ * And wake the workers up.
+ */
+static void
+thread_pool_enqueue(struct thread_pool *pool, struct thread_task **tasks,
+		    int count)
+{
+	if (pool->is_timing_enabled) {
+		uint64_t push_ns = clock_monotonic_ns();
+		for (int i = 0; i < count; ++i)
+			tasks[i]->push_ns = push_ns;
+	}
+	struct thread_worker *w = current_worker;
+	bool is_local = w != NULL && w->pool == pool;
+	int node = is_local ? w->node : thread_pool_current_node(pool);
+	/* The tasks of the same priority in a row go together. */
+	int end;
+	for (int begin = 0; begin < count; begin = end) {
+		int priority = tasks[begin]->priority;
+		end = begin + 1;
+		while (end < count && tasks[end]->priority == priority)
+			++end;
+		if (is_local && priority == TPOOL_PRIORITY_NORMAL) {
+			for (int i = begin; i < end; ++i) {
+				__atomic_store_n(&tasks[i]->queue_slot, NULL,
+						 __ATOMIC_RELAXED);
+				task_deque_push(&w->deque, tasks[i]);
+			}
+			continue;
+		}
+		struct task_queue *lane = thread_pool_lane(pool, node, priority);
+		if (end - begin == 1)
+			task_queue_push(lane, tasks[begin]);
+		else
+			task_queue_push_many(lane, tasks + begin, end - begin);
+	}
+	thread_pool_wakeup_many(pool, node, count);
+}
+
+enum {
+	/** Ready tasks of a batch push are queued by this many. */
+	TASK_PUSH_CHUNK = 256,
+};
+
+/** Let a task, not pushed yet, get dependents again after its run. */
+static inline void
+thread_task_open_dependents(struct thread_task *task)
+{
+	struct task_dep *closed = TASK_DEPS_CLOSED;
+	__atomic_compare_exchange_n(&task->dependents, &closed, NULL, false,
+				    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+static void
+thread_task_add_dependent(struct thread_task *task, struct thread_task *next);
+
+/**
+ * Push the tasks, already counted in the pool. The tasks with
+ * unfinished dependencies are queued later.
+ */
+static void
+thread_pool_push_counted(struct thread_pool *pool, struct thread_task **tasks,
+			 int count, int task_count)
+{
+	for (int i = 0; i < count; ++i) {
+		struct thread_task *t = tasks[i];
+		__atomic_store_n(&t->state, TASK_STATE_QUEUED,
+				 __ATOMIC_RELAXED);
+		t->pool = pool;
+		thread_task_open_dependents(t);
+	}
+	int active_count;
+	while (task_count > (active_count = __atomic_load_n(
+		&pool->active_count, __ATOMIC_SEQ_CST)) &&
+	       active_count < pool->max_thread_count)
+		thread_pool_grow(pool, task_count);
+	struct thread_task *ready[TASK_PUSH_CHUNK];
+	int ready_count = 0;
+	for (int i = 0; i < count; ++i) {
+		/* The last finished dependency queues it otherwise. */
+		if (__atomic_sub_fetch(&tasks[i]->dep_count, 1,
+				       __ATOMIC_ACQ_REL) != 0)
+			continue;
+		ready[ready_count++] = tasks[i];
+		if (ready_count == TASK_PUSH_CHUNK) {
+			thread_pool_enqueue(pool, ready, ready_count);
+			ready_count = 0;
+		}
+	}
+	if (ready_count > 0)
+		thread_pool_enqueue(pool, ready, ready_count);
+}
+
+/** Count the tasks in the pool. Returns the new count, or -1. */
+static int
+thread_pool_count_tasks(struct thread_pool *pool, int count)
+{
+	int task_count = __atomic_add_fetch(&pool->task_count, count,
+					    __ATOMIC_SEQ_CST);
+	if (task_count > TPOOL_MAX_TASKS) {
+		__atomic_sub_fetch(&pool->task_count, count, __ATOMIC_RELAXED);
+		return -1;
+	}
+	return task_count;
 }
 
 int
 thread_pool_push_task(struct thread_pool *pool, struct thread_task *task)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)pool;
-	(void)task;
-	return TPOOL_ERR_NOT_IMPLEMENTED;
+	return thread_pool_push_tasks(pool, &task, 1);
+}
+
+int
+thread_pool_push_tasks(struct thread_pool *pool, struct thread_task **tasks,
+		       int count)
+{
+	for (int i = 0; i < count; ++i) {
+		int state = __atomic_load_n(&tasks[i]->state, __ATOMIC_ACQUIRE);
+		if (state != TASK_STATE_NEW && state != TASK_STATE_JOINED)
+			return TPOOL_ERR_TASK_IN_POOL;
+		if (tasks[i]->is_coro && !pool->is_coro_enabled)
+			return TPOOL_ERR_INVALID_ARGUMENT;
+	}
+	if (count <= 0)
+		return 0;
+	int task_count = thread_pool_count_tasks(pool, count);
+	if (task_count < 0)
+		return TPOOL_ERR_TOO_MANY_TASKS;
+	thread_pool_push_counted(pool, tasks, count, task_count);
+	return 0;
+}
+
+/** Check that the edges are valid and make no cycles (Kahn). */
+static bool
+thread_task_graph_is_valid(int task_count, const struct thread_task_edge *edges,
+			   int edge_count)
+{
+	for (int i = 0; i < edge_count; ++i) {
+		if (edges[i].before < 0 || edges[i].before >= task_count ||
+		    edges[i].after < 0 || edges[i].after >= task_count)
+			return false;
+	}
+	/* The edges grouped by their first task. */
+	int *first = calloc(task_count + 1, sizeof(first[0]));
+	int *after = malloc((edge_count + 1) * sizeof(after[0]));
+	int *in_count = calloc(task_count, sizeof(in_count[0]));
+	int *ready = malloc(task_count * sizeof(ready[0]));
+	for (int i = 0; i < edge_count; ++i) {
+		++first[edges[i].before + 1];
+		++in_count[edges[i].after];
+	}
+	for (int i = 0; i < task_count; ++i)
+		first[i + 1] += first[i];
+	int *pos = ready;
+	memcpy(pos, first, task_count * sizeof(pos[0]));
+	for (int i = 0; i < edge_count; ++i)
+		after[pos[edges[i].before]++] = edges[i].after;
+	int ready_count = 0;
+	for (int i = 0; i < task_count; ++i) {
+		if (in_count[i] == 0)
+			ready[ready_count++] = i;
+	}
+	int done_count = 0;
+	while (ready_count > 0) {
+		int t = ready[--ready_count];
+		++done_count;
+		for (int i = first[t]; i < first[t + 1]; ++i) {
+			if (--in_count[after[i]] == 0)
+				ready[ready_count++] = after[i];
+		}
+	}
+	free(first);
+	free(after);
+	free(in_count);
+	free(ready);
+	return done_count == task_count;
+}
+
+int
+thread_pool_push_graph(struct thread_pool *pool, struct thread_task **tasks,
+		       int task_count, const struct thread_task_edge *edges,
+		       int edge_count)
+{
+	for (int i = 0; i < task_count; ++i) {
+		int state = __atomic_load_n(&tasks[i]->state, __ATOMIC_ACQUIRE);
+		if (state != TASK_STATE_NEW && state != TASK_STATE_JOINED)
+			return TPOOL_ERR_TASK_IN_POOL;
+		if (tasks[i]->is_coro && !pool->is_coro_enabled)
+			return TPOOL_ERR_INVALID_ARGUMENT;
+	}
+	if (!thread_task_graph_is_valid(task_count, edges, edge_count))
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	if (task_count <= 0)
+		return 0;
+	int count = thread_pool_count_tasks(pool, task_count);
+	if (count < 0)
+		return TPOOL_ERR_TOO_MANY_TASKS;
+	/* Even the finished tasks are going to run again. */
+	for (int i = 0; i < task_count; ++i)
+		thread_task_open_dependents(tasks[i]);
+	for (int i = 0; i < edge_count; ++i) {
+		thread_task_add_dependent(tasks[edges[i].before],
+					  tasks[edges[i].after]);
+	}
+	thread_pool_push_counted(pool, tasks, task_count, count);
+	return 0;
+}
+
+static void
+thread_task_reset(struct thread_task *task, thread_task_f function, void *arg,
+		  bool is_embedded)
+{
+	task->function = function;
+	task->arg = arg;
+	task->result = NULL;
+	task->state = TASK_STATE_NEW;
+	task->is_embedded = is_embedded;
+	task->is_coro = false;
+	task->priority = TPOOL_PRIORITY_NORMAL;
+	task->pool = NULL;
+	task->group_pending = NULL;
+	task->next_free = NULL;
+	task->dependents = NULL;
+	task->dep_count = 1;
+	task->queue_slot = NULL;
 }
 
 int
 thread_task_new(struct thread_task **task, thread_task_f function, void *arg)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)task;
-	(void)function;
-	(void)arg;
-	return TPOOL_ERR_NOT_IMPLEMENTED;
+	struct thread_task *t = task_cache_get();
+	if (t == NULL)
+		t = malloc(sizeof(*t));
+	thread_task_reset(t, function, arg, false);
+	*task = t;
+	return 0;
+}
+
+struct thread_task *
+thread_task_init(struct thread_task_storage *storage, thread_task_f function,
+		 void *arg)
+{
+	struct thread_task *t = (struct thread_task *)storage;
+	thread_task_reset(t, function, arg, true);
+	return t;
+}
+
+static int
+thread_task_stage(const struct thread_task *task)
+{
+	return __atomic_load_n(&task->state, __ATOMIC_ACQUIRE) &
+	       TASK_STATE_MASK;
+}
+
+static bool
+thread_task_is_pushed(const struct thread_task *task)
+{
+	int stage = thread_task_stage(task);
+	return stage != TASK_STATE_NEW && stage != TASK_STATE_JOINED;
 }
 
 bool
 thread_task_is_finished(const struct thread_task *task)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)task;
-	return false;
+	int stage = thread_task_stage(task);
+	return stage == TASK_STATE_FINISHED || stage == TASK_STATE_JOINED;
 }
 
 bool
 thread_task_is_running(const struct thread_task *task)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)task;
-	return false;
+	return thread_task_stage(task) == TASK_STATE_RUNNING;
+}
+
+/**
+ * Set the flag unless the task is finished. Returns false if it is
+ * finished.
+ */
+static bool
+thread_task_set_flag(struct thread_task *task, int flag)
+{
+	int state = __atomic_load_n(&task->state, __ATOMIC_ACQUIRE);
+	do {
+		if ((state & TASK_STATE_MASK) == TASK_STATE_FINISHED)
+			return false;
+	} while (!__atomic_compare_exchange_n(&task->state, &state,
+					      state | flag, true,
+					      __ATOMIC_ACQ_REL,
+					      __ATOMIC_ACQUIRE));
+	return true;
+}
+
+/**
+ * Sleep on the task state until it is finished or the deadline
+ * comes, if it is not NULL. Returns false on the timeout.
+ */
+static bool
+thread_task_sleep(struct thread_task *task, const struct timespec *deadline)
+{
+	if (!thread_task_set_flag(task, TASK_FLAG_WAITED))
+		return true;
+	int state;
+	while (((state = __atomic_load_n(&task->state, __ATOMIC_ACQUIRE)) &
+		TASK_STATE_MASK) != TASK_STATE_FINISHED) {
+		if (!futex_wait(&task->state, state, deadline))
+			return thread_task_stage(task) == TASK_STATE_FINISHED;
+	}
+	return true;
+}
+
+/** Take the result of a finished task. */
+static void
+thread_task_take_result(struct thread_task *task, void **result)
+{
+	if (result != NULL)
+		*result = task->result;
+	__atomic_store_n(&task->state, TASK_STATE_JOINED, __ATOMIC_RELAXED);
+}
+
+/**
+ * Wait for the task to finish until the deadline, or forever if it
+ * is NULL.
+ */
+static int
+thread_task_wait(struct thread_task *task, const struct timespec *deadline,
+		 void **result)
+{
+	if (!thread_task_is_pushed(task))
+		return TPOOL_ERR_TASK_NOT_PUSHED;
+	if (!thread_task_sleep(task, deadline))
+		return TPOOL_ERR_TIMEOUT;
+	thread_task_take_result(task, result);
+	return 0;
 }
 
+enum {
+	/** How long a helping join sleeps when there is nothing to run. */
+	TASK_JOIN_HELP_WAIT_NS = 100 * 1000,
+};
+
+#if TPOOL_CORO
+
+/**
+ * Let the coroutines run while a join of the worker has nothing else
+ * to do. Returns false if the join has to sleep itself.
+ */
+static bool
+thread_worker_coro_help(struct thread_worker *w)
+{
+	if (!w->pool->is_coro_enabled)
+		return false;
+	if (coro_this() != NULL) {
+		/* The worker runs the others meanwhile. */
+		coro_sleep(TASK_JOIN_HELP_WAIT_NS / 1e9);
+		return true;
+	}
+	enum coro_sched_state state = thread_worker_coro_step(
+		w, TASK_JOIN_HELP_WAIT_NS);
+	return state == CORO_SCHED_RUNNABLE || state == CORO_SCHED_WAITING;
+}
+
+#endif
+
 int
 thread_task_join(struct thread_task *task, void **result)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)task;
-	(void)result;
-	return TPOOL_ERR_NOT_IMPLEMENTED;
+	struct thread_worker *w = current_worker;
+	if (w == NULL || w->pool != task->pool || !thread_task_is_pushed(task))
+		return thread_task_wait(task, NULL, result);
+	/*
+	 * Blocking a worker on a task which might be in its own deque
+	 * could stall the pool forever. So run the tasks until this one
+	 * is done. Having nothing to run means the task is running in
+	 * another worker, which might push more tasks soon, so the wait
+	 * is short.
+	 */
+	while (thread_task_stage(task) != TASK_STATE_FINISHED) {
+		struct thread_task *next = thread_worker_next(w);
+		if (next != NULL) {
+			thread_task_run(w->pool, next);
+			continue;
+		}
+#if TPOOL_CORO
+		if (thread_worker_coro_help(w))
+			continue;
+#endif
+		struct timespec deadline;
+		deadline_after(&deadline, TASK_JOIN_HELP_WAIT_NS);
+		thread_task_sleep(task, &deadline);
+	}
+	thread_task_take_result(task, result);
+	return 0;
+}
+
+int
+thread_task_join_all(struct thread_task **tasks, int count, void **results)
+{
+	struct thread_worker *w = current_worker;
+	bool is_helping = false;
+	for (int i = 0; i < count; ++i) {
+		if (!thread_task_is_pushed(tasks[i]))
+			return TPOOL_ERR_TASK_NOT_PUSHED;
+		if (w != NULL && w->pool == tasks[i]->pool)
+			is_helping = true;
+	}
+	/*
+	 * Each task either is finished already, or decrements the
+	 * counter when it is. The ones not seen yet keep it above 0.
+	 */
+	int pending = count;
+	for (int i = 0; i < count; ++i) {
+		tasks[i]->group_pending = &pending;
+		if (!thread_task_set_flag(tasks[i], TASK_FLAG_GROUPED))
+			__atomic_sub_fetch(&pending, 1, __ATOMIC_SEQ_CST);
+	}
+	int left;
+	while ((left = __atomic_load_n(&pending, __ATOMIC_SEQ_CST)) != 0) {
+		if (!is_helping) {
+			futex_wait(&pending, left, NULL);
+			continue;
+		}
+		struct thread_task *next = thread_worker_next(w);
+		if (next != NULL) {
+			thread_task_run(w->pool, next);
+			continue;
+		}
+#if TPOOL_CORO
+		if (thread_worker_coro_help(w))
+			continue;
+#endif
+		struct timespec deadline;
+		deadline_after(&deadline, TASK_JOIN_HELP_WAIT_NS);
+		futex_wait(&pending, left, &deadline);
+	}
+	for (int i = 0; i < count; ++i) {
+		/* Pairs with the release of the finish. */
+		thread_task_stage(tasks[i]);
+		thread_task_take_result(tasks[i],
+					results != NULL ? &results[i] : NULL);
+	}
+	return 0;
 }
 
 #if NEED_TIMED_JOIN
@@ -88,21 +1951,125 @@ thread_task_join(struct thread_task *task, void **result)
 int
 thread_task_timed_join(struct thread_task *task, double timeout, void **result)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)task;
-	(void)timeout;
-	(void)result;
-	return TPOOL_ERR_NOT_IMPLEMENTED;
+	/* Something huge is just a very long wait. */
+	if (timeout > 1e9)
+		timeout = 1e9;
+	struct timespec deadline;
+	deadline_after(&deadline, timeout > 0 ? (uint64_t)(timeout * 1e9) : 0);
+	return thread_task_wait(task, &deadline, result);
 }
 
 #endif
 
+/** Make @a next wait for @a task, unless it is finished already. */
+static void
+thread_task_add_dependent(struct thread_task *task, struct thread_task *next)
+{
+	struct task_dep *dep = malloc(sizeof(*dep));
+	dep->task = next;
+	__atomic_add_fetch(&next->dep_count, 1, __ATOMIC_RELAXED);
+	struct task_dep *head = __atomic_load_n(&task->dependents,
+						__ATOMIC_ACQUIRE);
+	do {
+		/* Finished meanwhile. */
+		if (head == TASK_DEPS_CLOSED) {
+			free(dep);
+			__atomic_sub_fetch(&next->dep_count, 1,
+					   __ATOMIC_RELAXED);
+			return;
+		}
+		dep->next = head;
+	} while (!__atomic_compare_exchange_n(&task->dependents, &head, dep,
+					      true, __ATOMIC_RELEASE,
+					      __ATOMIC_ACQUIRE));
+}
+
+int
+thread_task_then(struct thread_task *task, struct thread_task *next)
+{
+	if (thread_task_is_pushed(next))
+		return TPOOL_ERR_TASK_IN_POOL;
+	if (task == next)
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	if (!thread_task_is_finished(task))
+		thread_task_add_dependent(task, next);
+	return 0;
+}
+
 int
 thread_task_delete(struct thread_task *task)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)task;
-	return TPOOL_ERR_NOT_IMPLEMENTED;
+	if (thread_task_is_pushed(task))
+		return TPOOL_ERR_TASK_IN_POOL;
+	/* It will never finish, so don't make anybody wait for it. */
+	thread_task_release_dependents(task);
+	thread_task_free(task);
+	return 0;
+}
+
+int
+thread_task_destroy(struct thread_task *task)
+{
+	return thread_task_delete(task);
+}
+
+int
+thread_task_set_priority(struct thread_task *task, int priority)
+{
+	if (thread_task_is_pushed(task))
+		return TPOOL_ERR_TASK_IN_POOL;
+	if (priority < 0 || priority >= TPOOL_PRIORITY_COUNT)
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	task->priority = priority;
+	return 0;
+}
+
+int
+thread_task_set_coro(struct thread_task *task, bool is_coro)
+{
+	if (thread_task_is_pushed(task))
+		return TPOOL_ERR_TASK_IN_POOL;
+	task->is_coro = is_coro;
+	return 0;
+}
+
+int
+thread_task_cancel(struct thread_task *task)
+{
+	/*
+	 * Read before the cancel, since after it the task can finish
+	 * any moment. A slot of a lane is valid while the pool is, and
+	 * is checked to have the task.
+	 */
+	struct thread_pool *pool = task->pool;
+	struct thread_task **slot = __atomic_load_n(&task->queue_slot,
+						    __ATOMIC_RELAXED);
+	int state = __atomic_load_n(&task->state, __ATOMIC_ACQUIRE);
+	do {
+		int stage = state & TASK_STATE_MASK;
+		if (stage == TASK_STATE_NEW || stage == TASK_STATE_JOINED)
+			return TPOOL_ERR_TASK_NOT_PUSHED;
+		if (stage != TASK_STATE_QUEUED ||
+		    (state & TASK_FLAG_CANCELLED) != 0)
+			return TPOOL_ERR_TASK_STARTED;
+	} while (!__atomic_compare_exchange_n(&task->state, &state,
+					      state | TASK_FLAG_CANCELLED, true,
+					      __ATOMIC_ACQ_REL,
+					      __ATOMIC_ACQUIRE));
+	__atomic_add_fetch(&pool->tasks_cancelled, 1, __ATOMIC_RELAXED);
+	/*
+	 * Not in the lane means it is in a deque, or waits for the
+	 * dependencies, or is popped right now. Then the one who gets
+	 * it finishes it.
+	 */
+	struct thread_task *expected = task;
+	if (slot != NULL &&
+	    __atomic_compare_exchange_n(slot, &expected, NULL, false,
+					__ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+		task->result = NULL;
+		thread_task_finish(pool, task);
+	}
+	return 0;
 }
 
 #if NEED_DETACH
@@ -110,9 +2077,161 @@ thread_task_delete(struct thread_task *task)
 int
 thread_task_detach(struct thread_task *task)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)task;
-	return TPOOL_ERR_NOT_IMPLEMENTED;
+	/* Nobody would know when its memory is free. */
+	if (task->is_embedded)
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	if (!thread_task_is_pushed(task))
+		return TPOOL_ERR_TASK_NOT_PUSHED;
+	/* Either the worker sees the flag and deletes it, or this. */
+	if (!thread_task_set_flag(task, TASK_FLAG_DETACHED))
+		thread_task_free(task);
+	return 0;
 }
 
 #endif
+
+/** What a parallel loop or reduction runs. */
+struct parallel_job {
+	struct thread_pool *pool;
+	long grain;
+	/** The loop function, or NULL for a reduction. */
+	thread_pool_for_f for_f;
+	thread_pool_map_f map;
+	thread_pool_combine_f combine;
+	void *ctx;
+};
+
+/** A part of the range, run as an embedded task on the stack. */
+struct parallel_range {
+	const struct parallel_job *job;
+	long begin;
+	long end;
+	/** How many more times the range can be halved. */
+	int depth;
+	/** The worker which pushed it. Anyone else has stolen it. */
+	struct thread_worker *owner;
+	struct thread_task_storage storage;
+};
+
+enum {
+	/** Splits added to a range taken by another worker. */
+	PARALLEL_STEAL_DEPTH = 1,
+};
+
+static void *
+parallel_range_run(const struct parallel_job *job, long begin, long end,
+		   int depth);
+
+static void *
+parallel_range_f(void *arg)
+{
+	struct parallel_range *r = arg;
+	/*
+	 * A stolen half means the thief was idle, so there is demand
+	 * for more chunks. An own half is just run.
+	 */
+	if (r->owner != current_worker)
+		r->depth += PARALLEL_STEAL_DEPTH;
+	return parallel_range_run(r->job, r->begin, r->end, r->depth);
+}
+
+/**
+ * Halve the range while it is allowed: push the right half, run the
+ * left one, and join the right one, running it right here unless it
+ * is stolen meanwhile.
+ */
+static void *
+parallel_range_run(const struct parallel_job *job, long begin, long end,
+		   int depth)
+{
+	if (end - begin <= job->grain || depth == 0) {
+		if (job->for_f == NULL)
+			return job->map(begin, end, job->ctx);
+		job->for_f(begin, end, job->ctx);
+		return NULL;
+	}
+	long mid = begin + (end - begin) / 2;
+	struct parallel_range right = {
+		.job = job,
+		.begin = mid,
+		.end = end,
+		.depth = depth - 1,
+		.owner = current_worker,
+	};
+	struct thread_task *task = thread_task_init(&right.storage,
+						    parallel_range_f, &right);
+	void *right_result;
+	bool is_pushed = thread_pool_push_task(job->pool, task) == 0;
+	void *left_result = parallel_range_run(job, begin, mid, depth - 1);
+	if (is_pushed)
+		thread_task_join(task, &right_result);
+	else
+		right_result = parallel_range_f(&right);
+	thread_task_destroy(task);
+	if (job->for_f != NULL)
+		return NULL;
+	return job->combine(left_result, right_result, job->ctx);
+}
+
+/** Run the job in a task of the pool, or right here if in a worker. */
+static void *
+parallel_job_run(const struct parallel_job *job, long begin, long end)
+{
+	/* About 2 chunks per thread when nothing is stolen. */
+	int depth = 1;
+	while ((1 << (depth - 1)) < job->pool->max_thread_count)
+		++depth;
+	struct thread_worker *w = current_worker;
+	if (w != NULL && w->pool == job->pool)
+		return parallel_range_run(job, begin, end, depth);
+	struct parallel_range root = {
+		.job = job,
+		.begin = begin,
+		.end = end,
+		.depth = depth - PARALLEL_STEAL_DEPTH,
+		.owner = NULL,
+	};
+	struct thread_task *task = thread_task_init(&root.storage,
+						    parallel_range_f, &root);
+	void *result;
+	while (thread_pool_push_task(job->pool, task) != 0)
+		sched_yield();
+	thread_task_join(task, &result);
+	thread_task_destroy(task);
+	return result;
+}
+
+int
+thread_pool_parallel_for(struct thread_pool *pool, long begin, long end,
+			 long grain, thread_pool_for_f function, void *ctx)
+{
+	if (grain < 1 || end < begin)
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	struct parallel_job job = {
+		.pool = pool,
+		.grain = grain,
+		.for_f = function,
+		.ctx = ctx,
+	};
+	parallel_job_run(&job, begin, end);
+	return 0;
+}
+
+int
+thread_pool_parallel_reduce(struct thread_pool *pool, long begin, long end,
+			    long grain, thread_pool_map_f map,
+			    thread_pool_combine_f combine, void *ctx,
+			    void **result)
+{
+	if (grain < 1 || end < begin)
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	struct parallel_job job = {
+		.pool = pool,
+		.grain = grain,
+		.map = map,
+		.combine = combine,
+		.ctx = ctx,
+	};
+	*result = parallel_job_run(&job, begin, end);
+	return 0;
+}
@@ -1,6 +1,9 @@
 #pragma once
 
+#include <sched.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 /**
  * Here you should specify which features do you want to implement via macros:
@@ -15,8 +18,8 @@
  * It is important to define these macros here, in the header, because it is
  * used by tests.
  */
-#define NEED_DETACH 0
-#define NEED_TIMED_JOIN 0
+#define NEED_DETACH 1
+#define NEED_TIMED_JOIN 1
 
 struct thread_pool;
 struct thread_task;
@@ -26,6 +29,19 @@ typedef void *(*thread_task_f)(void *);
 enum {
 	TPOOL_MAX_THREADS = 20,
 	TPOOL_MAX_TASKS = 100000,
+	/** Not less than the size of struct thread_task. */
+	THREAD_TASK_SIZE = 128,
+};
+
+/**
+ * Memory for a task inside of another object or on the stack. See
+ * thread_task_init().
+ */
+struct thread_task_storage {
+	union {
+		char data[THREAD_TASK_SIZE];
+		max_align_t align;
+	};
 };
 
 enum thread_poool_errcode {
@@ -36,6 +52,15 @@ enum thread_poool_errcode {
 	TPOOL_ERR_TASK_IN_POOL,
 	TPOOL_ERR_NOT_IMPLEMENTED,
 	TPOOL_ERR_TIMEOUT,
+	TPOOL_ERR_TASK_STARTED,
+};
+
+/** Priorities of the tasks, see thread_task_set_priority(). */
+enum thread_task_priority {
+	TPOOL_PRIORITY_LOW = 0,
+	TPOOL_PRIORITY_NORMAL,
+	TPOOL_PRIORITY_HIGH,
+	TPOOL_PRIORITY_COUNT,
 };
 
 /** Thread pool API. */
@@ -54,6 +79,75 @@ enum thread_poool_errcode {
 int
 thread_pool_new(int max_thread_count, struct thread_pool **pool);
 
+struct thread_pool_options {
+	/** Maximum pool size. */
+	int max_thread_count;
+	/** Idle threads exit, but not below this count. */
+	int min_thread_count;
+	/**
+	 * Seconds a thread is idle before it exits. 0 means the
+	 * threads never exit, like in thread_pool_new().
+	 */
+	double idle_timeout;
+	/** Measure the wait and run time of the tasks. */
+	bool is_timing_enabled;
+	/**
+	 * CPUs of each worker, max_thread_count sets. NULL means the
+	 * workers are not pinned.
+	 */
+	const cpu_set_t *worker_cpus;
+	/**
+	 * Group the workers by the NUMA nodes of their CPUs, with a
+	 * task queue per node. A push from outside goes to the queue
+	 * of the node it runs on. The workers take the tasks from
+	 * their node first, and steal within it first. Unpinned
+	 * workers are spread over the nodes and pinned to all the
+	 * CPUs of their node.
+	 */
+	bool is_numa_aware;
+	/**
+	 * Each worker hosts a libcoro engine, see
+	 * coro_sched_thread_init(). The tasks of the pool can create
+	 * coroutines, and the ones marked by thread_task_set_coro()
+	 * run as coroutines themselves, so they can suspend on
+	 * coro_sleep(), coro_wait_fd() and the like without blocking
+	 * the worker. The worker runs its runnable coroutines once
+	 * after each task, and when it has no tasks. A coroutine never
+	 * leaves its worker, and must not be woken up from the other
+	 * ones. A worker with the coroutines waiting for timers or
+	 * descriptors doesn't park, but polls for them up to 1ms at a
+	 * time, so a push can wait that long for it. Needs the pool
+	 * built with -DTPOOL_CORO=1 and libcoro.
+	 */
+	bool is_coro_enabled;
+	/**
+	 * Stack size of each worker, at least PTHREAD_STACK_MIN. 0 is
+	 * the default of pthread, usually 8MB. The tasks with deep
+	 * recursion or big arrays on the stack need the default, but
+	 * a big elastic pool of the small tasks is created faster and
+	 * takes less memory with stacks like 64KB.
+	 */
+	size_t stack_size;
+};
+
+/**
+ * Create a new thread pool with the given options.
+ * @param options Pool options.
+ * @param[out] Pointer to store result pool object.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - max_thread_count is too big,
+ *       or 0, or min_thread_count is not in [0, max_thread_count],
+ *       or idle_timeout is negative, or stack_size is less than
+ *       PTHREAD_STACK_MIN.
+ *     - TPOOL_ERR_NOT_IMPLEMENTED - is_coro_enabled is set, but
+ *       the pool is built without libcoro.
+ */
+int
+thread_pool_new_ex(const struct thread_pool_options *options,
+		   struct thread_pool **pool);
+
 /**
  * How many threads are created by this pool. Can be less than
  * max.
@@ -63,6 +157,44 @@ thread_pool_new(int max_thread_count, struct thread_pool **pool);
 int
 thread_pool_thread_count(const struct thread_pool *pool);
 
+struct thread_pool_stats {
+	/** Threads running now. */
+	int thread_count;
+	/** Threads started and exited by the idle timeout. */
+	uint64_t threads_created;
+	uint64_t threads_retired;
+	/** Tasks pushed and not finished. */
+	int task_count;
+	/** Tasks pushed and not started yet. Approximate. */
+	int queued_task_count;
+	/** Tasks finished. */
+	uint64_t tasks_done;
+	/** Tasks taken from the other threads queues. */
+	uint64_t steal_count;
+	/**
+	 * Total nanoseconds of the tasks between push and start, and
+	 * between start and finish. Only with is_timing_enabled.
+	 */
+	uint64_t task_wait_ns;
+	uint64_t task_run_ns;
+	/**
+	 * Tasks cancelled before they started. They are not in
+	 * tasks_done. The time saved is about this many times the mean
+	 * run time of the done ones.
+	 */
+	uint64_t tasks_cancelled;
+};
+
+/**
+ * Get the statistics of the pool. The counters are collected
+ * without a lock, so they can be a bit out of sync with each other.
+ * @param pool Thread pool to get the stats of.
+ * @param[out] stats Pointer to store the stats.
+ */
+void
+thread_pool_stats(const struct thread_pool *pool,
+		  struct thread_pool_stats *stats);
+
 /**
  * Delete @a pool, free its memory.
  * @param pool Pool to delete.
@@ -74,7 +206,9 @@ int
 thread_pool_delete(struct thread_pool *pool);
 
 /**
- * Push @a task into thread pool queue.
+ * Push @a task into thread pool queue. A task pushed from a task of
+ * the same pool goes to the queue of the current worker, and is
+ * likely to run next there, while its data is hot in the cache.
  * @param pool Pool to push into.
  * @param task Task to push.
  *
@@ -82,10 +216,117 @@ thread_pool_delete(struct thread_pool *pool);
  * @retval != Error code.
  *     - TPOOL_ERR_TOO_MANY_TASKS - pool has too many tasks
  *       already.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - a coroutine task, and the
+ *       pool is without coroutines.
  */
 int
 thread_pool_push_task(struct thread_pool *pool, struct thread_task *task);
 
+/**
+ * Push @a count tasks at once. It is cheaper than pushing them one
+ * by one: the queue space is taken once, and the needed workers are
+ * woken up together. Either all the tasks are pushed, or none.
+ * @param pool Pool to push into.
+ * @param tasks Tasks to push.
+ * @param count Number of the tasks.
+ *
+ * @retval 0 Success.
+ * @retval != Error code.
+ *     - TPOOL_ERR_TOO_MANY_TASKS - pool would have too many tasks.
+ *     - TPOOL_ERR_TASK_IN_POOL - some task is in a pool already.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - same as for one task.
+ */
+int
+thread_pool_push_tasks(struct thread_pool *pool, struct thread_task **tasks,
+		       int count);
+
+/** Dependency between two tasks of a graph, by their indexes. */
+struct thread_task_edge {
+	/** The task to finish first. */
+	int before;
+	/** The task to start after it. */
+	int after;
+};
+
+/**
+ * Push a graph of tasks. A task is started only when all the tasks
+ * it depends on are finished. It is queued by the worker finishing
+ * the last of them, so nobody has to join the tasks to order them.
+ * The tasks are joined as usual. Either all the tasks are pushed,
+ * or none.
+ * @param pool Pool to push into.
+ * @param tasks Tasks to push.
+ * @param task_count Number of the tasks.
+ * @param edges Dependencies between the tasks.
+ * @param edge_count Number of the dependencies.
+ *
+ * @retval 0 Success.
+ * @retval != Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - an edge is out of the tasks, or
+ *       the edges make a cycle, or same as for one task.
+ *     - TPOOL_ERR_TOO_MANY_TASKS - pool would have too many tasks.
+ *     - TPOOL_ERR_TASK_IN_POOL - some task is in a pool already.
+ */
+int
+thread_pool_push_graph(struct thread_pool *pool, struct thread_task **tasks,
+		       int task_count, const struct thread_task_edge *edges,
+		       int edge_count);
+
+/** Process the indexes [begin, end) of a parallel loop. */
+typedef void (*thread_pool_for_f)(long begin, long end, void *ctx);
+
+/**
+ * Run @a function over [begin, end) split into the chunks in the
+ * pool, and wait until all are done. The range is split in halves,
+ * down to about 2 chunks per thread, and deeper only for the halves
+ * stolen by the other workers, so the chunks are as big as the load
+ * balance allows. A chunk is never split below @a grain. Called from
+ * a task of the pool, the task runs the chunks as well.
+ * @param pool Pool to run in.
+ * @param begin First index.
+ * @param end Index after the last one.
+ * @param grain Least chunk size.
+ * @param function Function to run on each chunk.
+ * @param ctx Argument for @a function.
+ *
+ * @retval 0 Success.
+ * @retval != Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - @a grain < 1 or @a end < @a begin.
+ */
+int
+thread_pool_parallel_for(struct thread_pool *pool, long begin, long end,
+			 long grain, thread_pool_for_f function, void *ctx);
+
+/** Compute the partial result of the indexes [begin, end). */
+typedef void *(*thread_pool_map_f)(long begin, long end, void *ctx);
+
+/** Combine the partial results of two adjacent ranges, left first. */
+typedef void *(*thread_pool_combine_f)(void *left, void *right, void *ctx);
+
+/**
+ * Reduce [begin, end) in parallel. The range is split like in
+ * thread_pool_parallel_for(), each chunk is mapped to a partial
+ * result, and the results of the adjacent chunks are combined, in
+ * the index order, until one is left.
+ * @param pool Pool to run in.
+ * @param begin First index.
+ * @param end Index after the last one.
+ * @param grain Least chunk size.
+ * @param map Function computing the result of a chunk.
+ * @param combine Function combining two results.
+ * @param ctx Argument for @a map and @a combine.
+ * @param[out] result The result of the whole range.
+ *
+ * @retval 0 Success.
+ * @retval != Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - @a grain < 1 or @a end < @a begin.
+ */
+int
+thread_pool_parallel_reduce(struct thread_pool *pool, long begin, long end,
+			    long grain, thread_pool_map_f map,
+			    thread_pool_combine_f combine, void *ctx,
+			    void **result);
+
 /** Thread pool task API. */
 
 /**
@@ -99,6 +340,19 @@ thread_pool_push_task(struct thread_pool *pool, struct thread_task *task);
 int
 thread_task_new(struct thread_task **task, thread_task_f function, void *arg);
 
+/**
+ * Create a task in the given memory, without any allocation. It
+ * can not be detached, and is destroyed via thread_task_destroy().
+ * @param storage Memory for the task, valid until it is destroyed.
+ * @param function Function to run in the task.
+ * @param arg Argument for @a function.
+ *
+ * @return The task.
+ */
+struct thread_task *
+thread_task_init(struct thread_task_storage *storage, thread_task_f function,
+		 void *arg);
+
 /**
  * Check if @a task is finished and its result can be obtained.
  * @param task Task to check.
@@ -115,6 +369,9 @@ thread_task_is_running(const struct thread_task *task);
 
 /**
  * Join the task. If it is not finished, then wait until it is.
+ * Called from a task in the same pool, it runs the other tasks of
+ * the pool meanwhile, so the workers don't idle and the pool does
+ * not deadlock on the tasks joining their subtasks.
  * Note, this function does not delete task object. It can be
  * reused for a next task or deleted via thread_task_delete.
  * @param task Task to join.
@@ -127,6 +384,21 @@ thread_task_is_running(const struct thread_task *task);
 int
 thread_task_join(struct thread_task *task, void **result);
 
+/**
+ * Join all the tasks. The wait is on a single counter of the group,
+ * woken up once when the last task is finished.
+ * @param tasks Tasks to join.
+ * @param count Number of the tasks.
+ * @param[out] results Results of the tasks, can be NULL.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_TASK_NOT_PUSHED - some task is not pushed to a
+ *       pool, nothing is joined.
+ */
+int
+thread_task_join_all(struct thread_task **tasks, int count, void **results);
+
 #if NEED_TIMED_JOIN
 
 /**
@@ -147,7 +419,79 @@ thread_task_timed_join(struct thread_task *task, double timeout, void **result);
 #endif
 
 /**
- * Delete a task, free its memory.
+ * Make a task start only after another one is finished. When pushed,
+ * @a next waits for all the tasks it was chained to, and then is
+ * queued by the worker finishing the last of them. If @a task is
+ * finished already, there is nothing to wait for. Deleting a never
+ * pushed @a task releases @a next as if @a task was finished.
+ * @param task Task to finish first.
+ * @param next Task to start after it. Not pushed yet.
+ *
+ * @retval 0 Success.
+ * @retval != Error code.
+ *     - TPOOL_ERR_TASK_IN_POOL - @a next is in a pool already.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - @a task is @a next.
+ */
+int
+thread_task_then(struct thread_task *task, struct thread_task *next);
+
+/**
+ * Set the priority of a task, TPOOL_PRIORITY_NORMAL by default. The
+ * workers take a queued high priority task before anything else, and
+ * a low priority one only when there is nothing else to run. So the
+ * high ones overtake the tasks queued earlier, and the low ones can
+ * wait until the pool is idle. The tasks of one priority are not
+ * ordered strictly either, as usual.
+ * @param task Task to set the priority of. Not pushed.
+ * @param priority enum thread_task_priority.
+ *
+ * @retval 0 Success.
+ * @retval != Error code.
+ *     - TPOOL_ERR_TASK_IN_POOL - the task is in a pool already.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - no such priority.
+ */
+int
+thread_task_set_priority(struct thread_task *task, int priority);
+
+/**
+ * Make the task run as a coroutine of the worker which starts it, so
+ * it can suspend. See thread_pool_options.is_coro_enabled. A join of
+ * another task of the pool in such a task suspends the coroutine
+ * instead of the worker, checking the task once per the libcoro
+ * timer tick. The run time in the stats includes the suspensions.
+ * The other blocking calls still block the whole worker.
+ * @param task Task to set it for. Not pushed.
+ * @param is_coro Run it as a coroutine or as a plain function.
+ *
+ * @retval 0 Success.
+ * @retval != Error code.
+ *     - TPOOL_ERR_TASK_IN_POOL - the task is in a pool already.
+ */
+int
+thread_task_set_coro(struct thread_task *task, bool is_coro);
+
+/**
+ * Cancel a pushed task, not started yet. It never runs then, and is
+ * finished with a NULL result, to be joined as usual. A task still in
+ * a queue of the pool is finished right here. One already taken by a
+ * worker, or waiting for its dependencies, is finished without
+ * running by who gets to it. The tasks depending on a cancelled one
+ * don't wait for it, like for a deleted one. Can be called while the
+ * others join the task, but the task can't be deleted until the
+ * cancel returns.
+ * @param task Task to cancel.
+ *
+ * @retval 0 Success.
+ * @retval != Error code.
+ *     - TPOOL_ERR_TASK_NOT_PUSHED - task is not pushed to a pool.
+ *     - TPOOL_ERR_TASK_STARTED - task is running or finished
+ *       already, or is cancelled already.
+ */
+int
+thread_task_cancel(struct thread_task *task);
+
+/**
+ * Delete a task created by thread_task_new(), free its memory.
  * @param task Task to delete.
  *
  * @retval 0 Success.
@@ -158,6 +502,19 @@ thread_task_timed_join(struct thread_task *task, double timeout, void **result);
 int
 thread_task_delete(struct thread_task *task);
 
+/**
+ * Destroy a task created by thread_task_init(). Its memory can be
+ * reused then.
+ * @param task Task to destroy.
+ *
+ * @retval 0 Success.
+ * @retval != Error code.
+ *     - TPOOL_ERR_TASK_IN_POOL - can not drop the task. It still
+ *       is in a pool. Need to join it firstly.
+ */
+int
+thread_task_destroy(struct thread_task *task);
+
 #if NEED_DETACH
 
 /**
@@ -169,6 +526,8 @@ thread_task_delete(struct thread_task *task);
  * @retval != Error code.
  *     - TPOOL_ERR_TASK_NOT_PUSHED - task is not pushed to a
  *       pool.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - task is not created by
+ *       thread_task_new().
 */
 int
 thread_task_detach(struct thread_task *task);
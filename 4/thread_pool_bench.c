@@ -0,0 +1,509 @@
+#include "thread_pool.h"
+#include "unit_bench.h"
+
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/**
+ * Benchmarks of the thread pool on ../utils/unit_bench.h. One
+ * iteration is one task, so the tasks per second are 1e9 / ns. The
+ * arg of a bench is the thread count, if it varies.
+ *
+ * The bandwidth benches sum memory-bound chunks, one iteration is one
+ * byte, so GB/s is 1 / ns. The scaling ones show the throughput of
+ * the compute tasks by the workers: with no false sharing in the pool
+ * the speedup, the med of 1 thread divided by the med of N, grows
+ * linearly up to the CPU count, which is in the info of the report.
+ */
+
+enum {
+	/** Most tasks in the pool at once. */
+	BENCH_BATCH_MAX = TPOOL_MAX_TASKS,
+	/** Threads of the benches with a fixed thread count. */
+	BENCH_THREAD_COUNT = 4,
+};
+
+static void *
+bench_noop_f(void *arg)
+{
+	return arg;
+}
+
+/**
+ * Push @a task_count no-op tasks with a pool of @a thread_count
+ * threads, by batches of @a batch_size, and join them. The batches
+ * of 1 task show the latency of waking a worker up. With
+ * @a is_batch_api the batches are pushed and joined at once.
+ */
+static void
+bench_noop(int thread_count, long task_count, int batch_size,
+	   bool is_batch_api)
+{
+	bench_pause();
+	struct thread_pool *pool;
+	if (thread_pool_new(thread_count, &pool) != 0)
+		abort();
+	struct thread_task **tasks = malloc(batch_size * sizeof(tasks[0]));
+	for (int i = 0; i < batch_size; ++i)
+		thread_task_new(&tasks[i], bench_noop_f, NULL);
+	bench_resume();
+	for (long done = 0; done < task_count; done += batch_size) {
+		long count = task_count - done;
+		if (count > batch_size)
+			count = batch_size;
+		if (is_batch_api) {
+			if (thread_pool_push_tasks(pool, tasks, count) != 0 ||
+			    thread_task_join_all(tasks, count, NULL) != 0)
+				abort();
+			continue;
+		}
+		for (long i = 0; i < count; ++i) {
+			if (thread_pool_push_task(pool, tasks[i]) != 0)
+				abort();
+		}
+		void *result;
+		for (long i = 0; i < count; ++i)
+			thread_task_join(tasks[i], &result);
+	}
+	bench_pause();
+	for (int i = 0; i < batch_size; ++i)
+		thread_task_delete(tasks[i]);
+	free(tasks);
+	thread_pool_delete(pool);
+	bench_resume();
+}
+
+static void *
+bench_count_f(void *arg)
+{
+	__atomic_add_fetch((long *)arg, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+/**
+ * Create, push and detach @a task_count tasks, so they are allocated
+ * in one thread and freed in the others.
+ */
+static void
+bench_detached(int thread_count, long task_count)
+{
+	bench_pause();
+	struct thread_pool *pool;
+	if (thread_pool_new(thread_count, &pool) != 0)
+		abort();
+	long done = 0;
+	bench_resume();
+	for (long i = 0; i < task_count; ++i) {
+		struct thread_task *task;
+		thread_task_new(&task, bench_count_f, &done);
+		while (thread_pool_push_task(pool, task) != 0)
+			sched_yield();
+		thread_task_detach(task);
+	}
+	while (__atomic_load_n(&done, __ATOMIC_RELAXED) != task_count)
+		sched_yield();
+	bench_pause();
+	while (thread_pool_delete(pool) != 0)
+		sched_yield();
+	bench_resume();
+}
+
+/**
+ * Push @a task_count no-op tasks as graphs of independent chains of
+ * @a chain_length, as many chains as fit into the pool at once. Each
+ * next task of a chain is queued by the worker finishing the
+ * previous one.
+ */
+static void
+bench_chains(int thread_count, long task_count, int chain_length)
+{
+	bench_pause();
+	struct thread_pool *pool;
+	if (thread_pool_new(thread_count, &pool) != 0)
+		abort();
+	int batch_size = BENCH_BATCH_MAX / chain_length * chain_length;
+	struct thread_task **tasks = malloc(batch_size * sizeof(tasks[0]));
+	struct thread_task_edge *edges = malloc(batch_size * sizeof(edges[0]));
+	int edge_count = 0;
+	for (int i = 0; i < batch_size; ++i) {
+		thread_task_new(&tasks[i], bench_noop_f, NULL);
+		if (i % chain_length != 0) {
+			edges[edge_count++] =
+				(struct thread_task_edge){i - 1, i};
+		}
+	}
+	bench_resume();
+	for (long done = 0; done < task_count; done += batch_size) {
+		if (thread_pool_push_graph(pool, tasks, batch_size, edges,
+					   edge_count) != 0 ||
+		    thread_task_join_all(tasks, batch_size, NULL) != 0)
+			abort();
+	}
+	bench_pause();
+	for (int i = 0; i < batch_size; ++i)
+		thread_task_delete(tasks[i]);
+	free(tasks);
+	free(edges);
+	thread_pool_delete(pool);
+	bench_resume();
+}
+
+enum {
+	/** Iterations of a compute task, a few microseconds. */
+	BENCH_SPIN_WORK = 2000,
+};
+
+static void *
+bench_spin_f(void *arg)
+{
+	uint64_t x = (uintptr_t)arg;
+	for (int i = 0; i < BENCH_SPIN_WORK; ++i)
+		x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+	return (void *)(uintptr_t)x;
+}
+
+/**
+ * Push @a task_count compute tasks by the biggest batches, cancel
+ * all but each @a keep_step-th of each batch, and join them. The
+ * time is of all the pushed tasks, so it shows what is saved by the
+ * cancels, and what they cost.
+ */
+static void
+bench_cancel(int thread_count, long task_count, int keep_step)
+{
+	bench_pause();
+	struct thread_pool *pool;
+	if (thread_pool_new(thread_count, &pool) != 0)
+		abort();
+	int batch_size = BENCH_BATCH_MAX;
+	struct thread_task **tasks = malloc(batch_size * sizeof(tasks[0]));
+	for (int i = 0; i < batch_size; ++i)
+		thread_task_new(&tasks[i], bench_spin_f, (void *)(uintptr_t)i);
+	bench_resume();
+	for (long done = 0; done < task_count; done += batch_size) {
+		if (thread_pool_push_tasks(pool, tasks, batch_size) != 0)
+			abort();
+		for (int i = 0; i < batch_size; ++i) {
+			if (i % keep_step != 0)
+				thread_task_cancel(tasks[i]);
+		}
+		if (thread_task_join_all(tasks, batch_size, NULL) != 0)
+			abort();
+	}
+	bench_pause();
+	for (int i = 0; i < batch_size; ++i)
+		thread_task_delete(tasks[i]);
+	free(tasks);
+	thread_pool_delete(pool);
+	bench_resume();
+}
+
+/**
+ * Fill the pool with 10000 compute tasks, push one more of the given
+ * priority, and measure until it is finished.
+ */
+static void
+bench_priority(int thread_count, int priority)
+{
+	bench_pause();
+	struct thread_pool *pool;
+	if (thread_pool_new(thread_count, &pool) != 0)
+		abort();
+	enum { COUNT = 10000 };
+	struct thread_task **tasks = malloc(COUNT * sizeof(tasks[0]));
+	for (int i = 0; i < COUNT; ++i)
+		thread_task_new(&tasks[i], bench_spin_f, (void *)(uintptr_t)i);
+	struct thread_task *task;
+	thread_task_new(&task, bench_noop_f, NULL);
+	thread_task_set_priority(task, priority);
+	if (thread_pool_push_tasks(pool, tasks, COUNT) != 0)
+		abort();
+	bench_resume();
+	if (thread_pool_push_task(pool, task) != 0 ||
+	    thread_task_join(task, NULL) != 0)
+		abort();
+	bench_pause();
+	thread_task_join_all(tasks, COUNT, NULL);
+	for (int i = 0; i < COUNT; ++i)
+		thread_task_delete(tasks[i]);
+	thread_task_delete(task);
+	free(tasks);
+	thread_pool_delete(pool);
+	bench_resume();
+}
+
+static void
+bench_noop_push(long iterations, long thread_count)
+{
+	bench_noop(thread_count, iterations, BENCH_BATCH_MAX, false);
+}
+
+static void
+bench_noop_push_tasks(long iterations, long thread_count)
+{
+	bench_noop(thread_count, iterations, BENCH_BATCH_MAX, true);
+}
+
+static void
+bench_sporadic(long iterations, long arg)
+{
+	(void)arg;
+	bench_noop(BENCH_THREAD_COUNT, iterations, 1, false);
+}
+
+static void
+bench_burst(long iterations, long arg)
+{
+	(void)arg;
+	bench_noop(BENCH_THREAD_COUNT, iterations, 16, false);
+}
+
+static void
+bench_burst_push_tasks(long iterations, long arg)
+{
+	(void)arg;
+	bench_noop(BENCH_THREAD_COUNT, iterations, 16, true);
+}
+
+static void
+bench_detached_tasks(long iterations, long arg)
+{
+	(void)arg;
+	bench_detached(BENCH_THREAD_COUNT, iterations);
+}
+
+/** 1000 chains of 100 tasks per graph. */
+static void
+bench_chains_100(long iterations, long arg)
+{
+	(void)arg;
+	bench_chains(BENCH_THREAD_COUNT, iterations, 100);
+}
+
+/** All kept, a half kept, and none kept but the first of a batch. */
+static void
+bench_spin(long iterations, long arg)
+{
+	(void)arg;
+	bench_cancel(BENCH_THREAD_COUNT, iterations, 1);
+}
+
+static void
+bench_spin_cancel_half(long iterations, long arg)
+{
+	(void)arg;
+	bench_cancel(BENCH_THREAD_COUNT, iterations, 2);
+}
+
+static void
+bench_spin_cancel_all(long iterations, long arg)
+{
+	(void)arg;
+	bench_cancel(BENCH_THREAD_COUNT, iterations, BENCH_BATCH_MAX);
+}
+
+/** One iteration is one task pushed behind the full pool. */
+static void
+bench_behind_normal(long iterations, long arg)
+{
+	(void)arg;
+	for (long i = 0; i < iterations; ++i)
+		bench_priority(BENCH_THREAD_COUNT, TPOOL_PRIORITY_NORMAL);
+}
+
+static void
+bench_behind_high(long iterations, long arg)
+{
+	(void)arg;
+	for (long i = 0; i < iterations; ++i)
+		bench_priority(BENCH_THREAD_COUNT, TPOOL_PRIORITY_HIGH);
+}
+
+enum {
+	/** Bytes summed by a bandwidth task ... */
+	BENCH_BW_CHUNK_SIZE = 256 * 1024,
+	/** ... of this many, so the data is far bigger than the caches. */
+	BENCH_BW_CHUNK_COUNT = 256,
+	/** The tasks sum all the chunks this many times per run. */
+	BENCH_BW_PASS_COUNT = 16,
+};
+
+struct bench_chunk {
+	uint64_t *data;
+	uint64_t sum;
+};
+
+static void *
+bench_fill_f(void *arg)
+{
+	struct bench_chunk *c = arg;
+	c->data = malloc(BENCH_BW_CHUNK_SIZE);
+	size_t count = BENCH_BW_CHUNK_SIZE / sizeof(c->data[0]);
+	for (size_t i = 0; i < count; ++i)
+		c->data[i] = i;
+	return NULL;
+}
+
+static void *
+bench_sum_f(void *arg)
+{
+	struct bench_chunk *c = arg;
+	size_t count = BENCH_BW_CHUNK_SIZE / sizeof(c->data[0]);
+	uint64_t sum = 0;
+	for (size_t i = 0; i < count; ++i)
+		sum += c->data[i];
+	c->sum = sum;
+	return NULL;
+}
+
+/**
+ * The chunks are allocated and filled by the workers, so the pages
+ * are on the nodes of the workers, and then summed again and again.
+ * With NUMA awareness the workers stay on their nodes, and steal
+ * within the node first. One iteration is one byte summed, there are
+ * BENCH_BW_CHUNK_SIZE * BENCH_BW_CHUNK_COUNT * BENCH_BW_PASS_COUNT.
+ */
+static void
+bench_bandwidth(const struct thread_pool_options *options)
+{
+	bench_pause();
+	struct thread_pool *pool;
+	if (thread_pool_new_ex(options, &pool) != 0)
+		abort();
+	static struct bench_chunk chunks[BENCH_BW_CHUNK_COUNT];
+	struct thread_task *tasks[BENCH_BW_CHUNK_COUNT];
+	for (int i = 0; i < BENCH_BW_CHUNK_COUNT; ++i)
+		thread_task_new(&tasks[i], bench_fill_f, &chunks[i]);
+	if (thread_pool_push_tasks(pool, tasks, BENCH_BW_CHUNK_COUNT) != 0 ||
+	    thread_task_join_all(tasks, BENCH_BW_CHUNK_COUNT, NULL) != 0)
+		abort();
+	for (int i = 0; i < BENCH_BW_CHUNK_COUNT; ++i) {
+		thread_task_delete(tasks[i]);
+		thread_task_new(&tasks[i], bench_sum_f, &chunks[i]);
+	}
+	bench_resume();
+	for (int pass = 0; pass < BENCH_BW_PASS_COUNT; ++pass) {
+		if (thread_pool_push_tasks(pool, tasks,
+					   BENCH_BW_CHUNK_COUNT) != 0 ||
+		    thread_task_join_all(tasks, BENCH_BW_CHUNK_COUNT,
+					 NULL) != 0)
+			abort();
+	}
+	bench_pause();
+	for (int i = 0; i < BENCH_BW_CHUNK_COUNT; ++i) {
+		thread_task_delete(tasks[i]);
+		free(chunks[i].data);
+	}
+	thread_pool_delete(pool);
+	bench_resume();
+}
+
+static void
+bench_sum(long iterations, long arg)
+{
+	(void)iterations;
+	(void)arg;
+	struct thread_pool_options options = {
+		.max_thread_count = TPOOL_MAX_THREADS,
+	};
+	bench_bandwidth(&options);
+}
+
+static void
+bench_sum_numa(long iterations, long arg)
+{
+	(void)iterations;
+	(void)arg;
+	struct thread_pool_options options = {
+		.max_thread_count = TPOOL_MAX_THREADS,
+		.is_numa_aware = true,
+	};
+	bench_bandwidth(&options);
+}
+
+enum {
+	/** Loop iterations of a trivial compute task. */
+	BENCH_SCALE_TASK_WORK = 1000,
+	BENCH_SCALE_TASK_COUNT = 1000 * 1000,
+};
+
+static void *
+bench_work_f(void *arg)
+{
+	uint64_t x = (uintptr_t)arg;
+	for (int i = 0; i < BENCH_SCALE_TASK_WORK; ++i)
+		x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+	return (void *)(uintptr_t)x;
+}
+
+/**
+ * Push the independent compute tasks, touching no shared memory, by
+ * the biggest batches.
+ */
+static void
+bench_scaling(long iterations, long thread_count)
+{
+	bench_pause();
+	struct thread_pool *pool;
+	if (thread_pool_new(thread_count, &pool) != 0)
+		abort();
+	int batch_size = BENCH_BATCH_MAX;
+	struct thread_task **tasks = malloc(batch_size * sizeof(tasks[0]));
+	for (int i = 0; i < batch_size; ++i)
+		thread_task_new(&tasks[i], bench_work_f, (void *)(uintptr_t)i);
+	bench_resume();
+	for (long done = 0; done < iterations; done += batch_size) {
+		if (thread_pool_push_tasks(pool, tasks, batch_size) != 0 ||
+		    thread_task_join_all(tasks, batch_size, NULL) != 0)
+			abort();
+	}
+	bench_pause();
+	for (int i = 0; i < batch_size; ++i)
+		thread_task_delete(tasks[i]);
+	free(tasks);
+	thread_pool_delete(pool);
+	bench_resume();
+}
+
+int
+main(int argc, char **argv)
+{
+	const long thread_counts[] = {1, 2, 4, 8, 20};
+	for (size_t i = 0; i < sizeof(thread_counts) / sizeof(thread_counts[0]);
+	     ++i) {
+		bench_register_arg("noop", bench_noop_push, 10 * 1000 * 1000,
+				   thread_counts[i]);
+	}
+	bench_register_arg("noop_push_tasks", bench_noop_push_tasks,
+			   10 * 1000 * 1000, 20);
+	bench_register("sporadic", bench_sporadic, 100 * 1000);
+	bench_register("burst", bench_burst, 1000 * 1000);
+	bench_register("burst_push_tasks", bench_burst_push_tasks,
+		       1000 * 1000);
+	bench_register("detached", bench_detached_tasks, 1000 * 1000);
+	bench_register("chains", bench_chains_100, 10 * 1000 * 1000);
+	bench_register("spin", bench_spin, 1000 * 1000);
+	bench_register("spin_cancel_half", bench_spin_cancel_half,
+		       1000 * 1000);
+	bench_register("spin_cancel_all", bench_spin_cancel_all, 1000 * 1000);
+	bench_register("behind_10k_normal", bench_behind_normal, 1);
+	bench_register("behind_10k_high", bench_behind_high, 1);
+	long byte_count = (long)BENCH_BW_CHUNK_SIZE * BENCH_BW_CHUNK_COUNT *
+			  BENCH_BW_PASS_COUNT;
+	bench_register("sum", bench_sum, byte_count);
+	bench_register("sum_numa", bench_sum_numa, byte_count);
+	const long scale_counts[] = {1, 2, 4, 8, 12, 16, 20};
+	for (size_t i = 0; i < sizeof(scale_counts) / sizeof(scale_counts[0]);
+	     ++i) {
+		bench_register_arg("scaling", bench_scaling,
+				   BENCH_SCALE_TASK_COUNT, scale_counts[i]);
+	}
+	char cpu_count[32];
+	snprintf(cpu_count, sizeof(cpu_count), "%ld",
+		 sysconf(_SC_NPROCESSORS_ONLN));
+	bench_info("cpu_count", cpu_count);
+	return bench_main(argc, argv);
+}
@@ -0,0 +1,254 @@
+#include "thread_pool.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/**
+ * Parallel merge sort on the thread pool, the threaded version of
+ * lecture_examples/7_ipc/2_parallel_sort.c. There the processes sort
+ * a file each and the parent only collects the parts. Here the array
+ * is cut into runs sorted by qsort() in a parallel loop, and then
+ * the runs are merged pairwise, round by round. Each merge is split
+ * into output blocks too, so even the last merge of two halves runs
+ * on all the workers. The result is checked with a parallel
+ * reduction. Times are printed as JSON, with plain qsort() for a
+ * reference.
+ */
+
+enum {
+	SORT_RUN_COUNT = 5,
+	SORT_SIZE = 4 * 1000 * 1000,
+	/** Ints in a run sorted by qsort(), fits into L2 cache. */
+	SORT_RUN_SIZE = 16 * 1024,
+	/** Least output block of a parallel merge. */
+	SORT_MERGE_GRAIN = 64 * 1024,
+	SORT_CHECK_GRAIN = 256 * 1024,
+};
+
+struct sort_result {
+	const char *name;
+	int thread_count;
+	double min;
+	double med;
+	double max;
+};
+
+static struct sort_result results[8];
+static int result_count = 0;
+
+static uint64_t
+sort_clock_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+sort_cmp_int(const void *a, const void *b)
+{
+	int l = *(const int *)a;
+	int r = *(const int *)b;
+	return l < r ? -1 : l > r;
+}
+
+static int
+sort_cmp_double(const void *a, const void *b)
+{
+	double l = *(const double *)a;
+	double r = *(const double *)b;
+	return l < r ? -1 : l > r;
+}
+
+struct sort_ctx {
+	int *src;
+	int *dst;
+	long size;
+	/** Size of the sorted runs in @a src. */
+	long width;
+};
+
+static void
+sort_runs_f(long begin, long end, void *arg)
+{
+	struct sort_ctx *ctx = arg;
+	for (long i = begin; i < end; ++i) {
+		long from = i * SORT_RUN_SIZE;
+		long count = ctx->size - from;
+		if (count > SORT_RUN_SIZE)
+			count = SORT_RUN_SIZE;
+		qsort(ctx->src + from, count, sizeof(int), sort_cmp_int);
+	}
+}
+
+/**
+ * How many of the first @a k merged elements come from @a a. The
+ * elements of @a a go first on ties.
+ */
+static long
+sort_co_rank(long k, const int *a, long m, const int *b, long n)
+{
+	long lo = k > n ? k - n : 0;
+	long hi = k < m ? k : m;
+	while (lo < hi) {
+		long i = lo + (hi - lo) / 2;
+		if (a[i] <= b[k - i - 1])
+			lo = i + 1;
+		else
+			hi = i;
+	}
+	return lo;
+}
+
+/** Merge the output positions [begin, end) of the pair of runs. */
+static void
+sort_merge_block(const int *a, long m, const int *b, long n, int *dst,
+		 long begin, long end)
+{
+	long i = sort_co_rank(begin, a, m, b, n);
+	long j = begin - i;
+	long i_end = sort_co_rank(end, a, m, b, n);
+	long j_end = end - i_end;
+	int *out = dst + begin;
+	while (i < i_end && j < j_end)
+		*out++ = a[i] <= b[j] ? a[i++] : b[j++];
+	while (i < i_end)
+		*out++ = a[i++];
+	while (j < j_end)
+		*out++ = b[j++];
+}
+
+/** Merge the output [begin, end), which can cover several pairs. */
+static void
+sort_merge_f(long begin, long end, void *arg)
+{
+	struct sort_ctx *ctx = arg;
+	long pair_size = 2 * ctx->width;
+	for (long k = begin; k < end;) {
+		long start = k / pair_size * pair_size;
+		long pair_end = start + pair_size;
+		if (pair_end > ctx->size)
+			pair_end = ctx->size;
+		long m = ctx->size - start;
+		if (m > ctx->width)
+			m = ctx->width;
+		long block_end = end < pair_end ? end : pair_end;
+		const int *a = ctx->src + start;
+		sort_merge_block(a, m, a + m, pair_end - start - m,
+				 ctx->dst + start, k - start,
+				 block_end - start);
+		k = block_end;
+	}
+}
+
+/** Count of the unordered neighbours, summed by the reduction. */
+static void *
+sort_check_map_f(long begin, long end, void *arg)
+{
+	const int *data = arg;
+	long count = 0;
+	for (long i = begin > 0 ? begin : 1; i < end; ++i)
+		count += data[i - 1] > data[i];
+	return (void *)count;
+}
+
+static void *
+sort_check_combine_f(void *left, void *right, void *arg)
+{
+	(void)arg;
+	return (void *)((long)left + (long)right);
+}
+
+/** Sort @a data of @a size in the pool. Returns the sorted array. */
+static int *
+sort_parallel(struct thread_pool *pool, int *data, int *buf, long size)
+{
+	struct sort_ctx ctx = {data, buf, size, SORT_RUN_SIZE};
+	long run_count = (size + SORT_RUN_SIZE - 1) / SORT_RUN_SIZE;
+	thread_pool_parallel_for(pool, 0, run_count, 1, sort_runs_f, &ctx);
+	for (; ctx.width < size; ctx.width *= 2) {
+		thread_pool_parallel_for(pool, 0, size, SORT_MERGE_GRAIN,
+					 sort_merge_f, &ctx);
+		int *tmp = ctx.src;
+		ctx.src = ctx.dst;
+		ctx.dst = tmp;
+	}
+	return ctx.src;
+}
+
+static void
+sort_fill(int *data, long size)
+{
+	srand(42);
+	for (long i = 0; i < size; ++i)
+		data[i] = rand();
+}
+
+static void
+sort_add_result(const char *name, int thread_count, double *ms)
+{
+	qsort(ms, SORT_RUN_COUNT, sizeof(ms[0]), sort_cmp_double);
+	struct sort_result *r = &results[result_count++];
+	r->name = name;
+	r->thread_count = thread_count;
+	r->min = ms[0];
+	r->med = ms[SORT_RUN_COUNT / 2];
+	r->max = ms[SORT_RUN_COUNT - 1];
+}
+
+int
+main(void)
+{
+	int *data = malloc(SORT_SIZE * sizeof(data[0]));
+	int *buf = malloc(SORT_SIZE * sizeof(buf[0]));
+	double ms[SORT_RUN_COUNT];
+	for (int i = 0; i < SORT_RUN_COUNT; ++i) {
+		sort_fill(data, SORT_SIZE);
+		uint64_t start = sort_clock_ns();
+		qsort(data, SORT_SIZE, sizeof(data[0]), sort_cmp_int);
+		ms[i] = (sort_clock_ns() - start) / 1e6;
+	}
+	sort_add_result("qsort", 1, ms);
+
+	const int thread_counts[] = {1, 2, 4, 8, 20};
+	for (size_t t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]);
+	     ++t) {
+		struct thread_pool *pool;
+		if (thread_pool_new(thread_counts[t], &pool) != 0)
+			abort();
+		for (int i = 0; i < SORT_RUN_COUNT; ++i) {
+			sort_fill(data, SORT_SIZE);
+			uint64_t start = sort_clock_ns();
+			int *res = sort_parallel(pool, data, buf, SORT_SIZE);
+			ms[i] = (sort_clock_ns() - start) / 1e6;
+			void *unordered;
+			thread_pool_parallel_reduce(pool, 0, SORT_SIZE,
+						    SORT_CHECK_GRAIN,
+						    sort_check_map_f,
+						    sort_check_combine_f, res,
+						    &unordered);
+			if (unordered != NULL) {
+				fprintf(stderr, "not sorted\n");
+				abort();
+			}
+		}
+		sort_add_result("merge_sort", thread_counts[t], ms);
+		thread_pool_delete(pool);
+	}
+	free(data);
+	free(buf);
+
+	printf("{\n\t\"unit\": \"ms\",\n\t\"size\": %d,\n\t\"run_count\": %d,\n"
+	       "\t\"benches\": [\n", SORT_SIZE, SORT_RUN_COUNT);
+	for (int i = 0; i < result_count; ++i) {
+		const struct sort_result *r = &results[i];
+		printf("\t\t{\"name\": \"%s\", \"thread_count\": %d, "
+		       "\"min\": %.1f, \"med\": %.1f, \"max\": %.1f}%s\n",
+		       r->name, r->thread_count, r->min, r->med, r->max,
+		       i + 1 < result_count ? "," : "");
+	}
+	printf("\t]\n}\n");
+	return 0;
+}
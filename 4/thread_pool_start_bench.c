@@ -0,0 +1,291 @@
+#define _GNU_SOURCE
+#include "thread_pool.h"
+#include "unit_bench.h"
+
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/**
+ * Start of the threads: how long it takes until all of them run, and
+ * how much memory they take while alive. Of the pool workers and of
+ * many bare threads: pthreads, and clone() threads on mmap()-ed
+ * stacks joined by a futex, like in
+ * lecture_examples/6_threads/9_clone_vs_pthread.c, for a reference.
+ * One iteration is the start of one thread, the arg of a bench is the
+ * stack size, the default one of pthreads or 64KB.
+ *
+ * The memory is the growth of VmSize and VmRSS of the process per
+ * thread, added to the info of the report. The stacks of the exited
+ * pthreads are cached by glibc and reused by the next ones, so it is
+ * taken from the first run only, the warmup one.
+ */
+
+enum {
+	BENCH_SMALL_STACK_SIZE = 64 * 1024,
+	BENCH_THREAD_COUNT = 1000,
+};
+
+enum bench_kind {
+	BENCH_KIND_POOL,
+	BENCH_KIND_PTHREAD,
+	BENCH_KIND_CLONE,
+	BENCH_KIND_COUNT,
+};
+
+static const char *bench_kind_names[BENCH_KIND_COUNT] = {
+	"pool", "pthread", "clone",
+};
+
+/** Threads which have started. Atomic. */
+static int started_count = 0;
+/** Set when the threads can exit. Atomic. */
+static bool is_released = false;
+/** The memory is seen, per kind, for the small and the default stacks. */
+static bool is_memory_seen[BENCH_KIND_COUNT][2];
+
+/** A field of /proc/self/status in KB, like "VmRSS:". */
+static long
+bench_status_kb(const char *key)
+{
+	FILE *f = fopen("/proc/self/status", "r");
+	if (f == NULL)
+		return 0;
+	char line[256];
+	long res = 0;
+	size_t len = strlen(key);
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (strncmp(line, key, len) == 0) {
+			res = strtol(line + len, NULL, 10);
+			break;
+		}
+	}
+	fclose(f);
+	return res;
+}
+
+/**
+ * Body of all the threads. Only the atomics and a syscall, nothing of
+ * libc which would need its thread-local storage. A clone() thread
+ * has none of its own.
+ */
+static void
+bench_thread_body(void)
+{
+	__atomic_add_fetch(&started_count, 1, __ATOMIC_RELAXED);
+	while (!__atomic_load_n(&is_released, __ATOMIC_ACQUIRE))
+		syscall(SYS_sched_yield);
+}
+
+static void *
+bench_thread_f(void *arg)
+{
+	bench_thread_body();
+	return arg;
+}
+
+static int
+bench_clone_f(void *arg)
+{
+	(void)arg;
+	bench_thread_body();
+	return 0;
+}
+
+/** A clone() thread with its stack and the tid cleared at its exit. */
+struct bench_clone {
+	void *stack;
+	size_t stack_size;
+	pid_t tid;
+};
+
+static void
+bench_clone_start(struct bench_clone *c, size_t stack_size)
+{
+	c->stack_size = stack_size;
+	c->stack = mmap(NULL, stack_size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+	if (c->stack == MAP_FAILED)
+		abort();
+	int flags = CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_SIGHAND |
+		    CLONE_THREAD | CLONE_SYSVSEM | CLONE_PARENT_SETTID |
+		    CLONE_CHILD_CLEARTID;
+	if (clone(bench_clone_f, (char *)c->stack + stack_size, flags, NULL,
+		  &c->tid, NULL, &c->tid) < 0)
+		abort();
+}
+
+/** The kernel zeroes the tid and wakes its futex when the thread is gone. */
+static void
+bench_clone_join(struct bench_clone *c)
+{
+	pid_t tid;
+	while ((tid = __atomic_load_n(&c->tid, __ATOMIC_ACQUIRE)) != 0)
+		syscall(SYS_futex, &c->tid, FUTEX_WAIT, tid, NULL, NULL, 0);
+	munmap(c->stack, c->stack_size);
+}
+
+static void
+bench_wait_started(long count)
+{
+	while (__atomic_load_n(&started_count, __ATOMIC_RELAXED) < count)
+		sched_yield();
+}
+
+static void
+bench_info_memory(enum bench_kind kind, long count, size_t stack_size,
+		  long vm_kb, long rss_kb)
+{
+	bool *is_seen = &is_memory_seen[kind][stack_size ==
+					      BENCH_SMALL_STACK_SIZE];
+	if (*is_seen)
+		return;
+	*is_seen = true;
+	char key[64], value[128];
+	snprintf(key, sizeof(key), "%s_%zu", bench_kind_names[kind],
+		 stack_size);
+	snprintf(value, sizeof(value),
+		 "%ld threads, vm %.1f KB, rss %.1f KB per thread", count,
+		 (double)vm_kb / count, (double)rss_kb / count);
+	bench_info(key, value);
+}
+
+/**
+ * Start @a count threads, wait for all of them to run, and see the
+ * memory. Only the start is measured.
+ */
+static void
+bench_start(enum bench_kind kind, long count, size_t stack_size)
+{
+	bench_pause();
+	__atomic_store_n(&started_count, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&is_released, false, __ATOMIC_RELAXED);
+	long vm_start = bench_status_kb("VmSize:");
+	long rss_start = bench_status_kb("VmRSS:");
+	struct thread_pool *pool = NULL;
+	struct thread_task **tasks = NULL;
+	pthread_t *threads = NULL;
+	struct bench_clone *clones = NULL;
+	switch (kind) {
+	case BENCH_KIND_POOL: {
+		struct thread_pool_options options = {
+			.max_thread_count = count,
+			.stack_size = stack_size,
+		};
+		if (thread_pool_new_ex(&options, &pool) != 0)
+			abort();
+		tasks = malloc(count * sizeof(tasks[0]));
+		for (long i = 0; i < count; ++i)
+			thread_task_new(&tasks[i], bench_thread_f, NULL);
+		/* Each push of a blocked task starts one more worker. */
+		bench_resume();
+		for (long i = 0; i < count; ++i) {
+			if (thread_pool_push_task(pool, tasks[i]) != 0)
+				abort();
+		}
+		break;
+	}
+	case BENCH_KIND_PTHREAD: {
+		threads = malloc(count * sizeof(threads[0]));
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setstacksize(&attr, stack_size);
+		bench_resume();
+		for (long i = 0; i < count; ++i) {
+			if (pthread_create(&threads[i], &attr, bench_thread_f,
+					   NULL) != 0)
+				abort();
+		}
+		pthread_attr_destroy(&attr);
+		break;
+	}
+	default:
+		clones = malloc(count * sizeof(clones[0]));
+		bench_resume();
+		for (long i = 0; i < count; ++i)
+			bench_clone_start(&clones[i], stack_size);
+		break;
+	}
+	bench_wait_started(count);
+	bench_pause();
+	bench_info_memory(kind, count, stack_size,
+			  bench_status_kb("VmSize:") - vm_start,
+			  bench_status_kb("VmRSS:") - rss_start);
+	__atomic_store_n(&is_released, true, __ATOMIC_RELEASE);
+	switch (kind) {
+	case BENCH_KIND_POOL:
+		thread_task_join_all(tasks, count, NULL);
+		for (long i = 0; i < count; ++i)
+			thread_task_delete(tasks[i]);
+		free(tasks);
+		thread_pool_delete(pool);
+		break;
+	case BENCH_KIND_PTHREAD:
+		for (long i = 0; i < count; ++i)
+			pthread_join(threads[i], NULL);
+		free(threads);
+		break;
+	default:
+		for (long i = 0; i < count; ++i)
+			bench_clone_join(&clones[i]);
+		free(clones);
+		break;
+	}
+	bench_resume();
+}
+
+static void
+bench_pool(long iterations, long stack_size)
+{
+	bench_start(BENCH_KIND_POOL, iterations, stack_size);
+}
+
+static void
+bench_pthread(long iterations, long stack_size)
+{
+	bench_start(BENCH_KIND_PTHREAD, iterations, stack_size);
+}
+
+static void
+bench_clone(long iterations, long stack_size)
+{
+	bench_start(BENCH_KIND_CLONE, iterations, stack_size);
+}
+
+static size_t
+bench_default_stack_size(void)
+{
+	pthread_attr_t attr;
+	size_t size = 0;
+	pthread_attr_init(&attr);
+	pthread_attr_getstacksize(&attr, &size);
+	pthread_attr_destroy(&attr);
+	return size;
+}
+
+int
+main(int argc, char **argv)
+{
+	long default_size = bench_default_stack_size();
+	/*
+	 * The clone() threads go first, before any pthread stack is in the
+	 * cache of glibc, then the small stacks, then the default ones.
+	 */
+	bench_register_arg("clone", bench_clone, BENCH_THREAD_COUNT,
+			   BENCH_SMALL_STACK_SIZE);
+	bench_register_arg("pthread", bench_pthread, BENCH_THREAD_COUNT,
+			   BENCH_SMALL_STACK_SIZE);
+	bench_register_arg("pool", bench_pool, TPOOL_MAX_THREADS,
+			   BENCH_SMALL_STACK_SIZE);
+	bench_register_arg("pthread", bench_pthread, BENCH_THREAD_COUNT,
+			   default_size);
+	bench_register_arg("pool", bench_pool, TPOOL_MAX_THREADS,
+			   default_size);
+	return bench_main(argc, argv);
+}
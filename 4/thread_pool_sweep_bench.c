@@ -0,0 +1,301 @@
+#include "thread_pool.h"
+#include "unit_bench.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/**
+ * Sweep of the thread pool over the thread counts, the task durations
+ * and the number of the pushing threads, on ../utils/unit_bench.h.
+ * Each point is a bench named like "pool/t4/d1000ns/p1", of 4 threads,
+ * tasks of 1000ns and 1 producer, its arg is the number of the point.
+ * One iteration is one task, so the tasks per second are 1e9 / ns.
+ * The same tasks run as a pthread per task for a reference.
+ *
+ * The percentiles of the submit and join latencies of the last run of
+ * a point go to the info of the report. Submit latency is the
+ * duration of a push. Join latency is from the moment when the task
+ * is both finished and joined, whichever is later, until the join
+ * returns.
+ */
+
+enum {
+	/** Tasks a producer pushes before joining them. */
+	SWEEP_WINDOW = 1000,
+	SWEEP_PRODUCER_MAX = 4,
+	/** The task count of a point is chosen to take about this long. */
+	SWEEP_POINT_NS = 200 * 1000 * 1000,
+	SWEEP_TASK_COUNT_MIN = 200,
+	SWEEP_TASK_COUNT_MAX = 100 * 1000,
+	/** Creating a thread is slow, so fewer tasks for them. */
+	SWEEP_PTHREAD_TASK_COUNT_MAX = 2000,
+	/** Threads started at once, as many as the pool can have. */
+	SWEEP_PTHREAD_WINDOW = TPOOL_MAX_THREADS,
+};
+
+struct sweep_point {
+	char name[64];
+	/** 0 for a pthread per task. */
+	int thread_count;
+	int producer_count;
+	uint64_t duration_ns;
+};
+
+static struct sweep_point points[128];
+static int point_count = 0;
+
+static uint64_t
+sweep_clock_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+sweep_cmp_u64(const void *a, const void *b)
+{
+	uint64_t l = *(const uint64_t *)a;
+	uint64_t r = *(const uint64_t *)b;
+	return l < r ? -1 : l > r;
+}
+
+/** Sort the latencies and take p50, p90, p99 and max of them. */
+static void
+sweep_percentiles(uint64_t *ns, long count, uint64_t *out)
+{
+	qsort(ns, count, sizeof(ns[0]), sweep_cmp_u64);
+	const double qs[] = {0.5, 0.9, 0.99, 1};
+	for (int i = 0; i < 4; ++i)
+		out[i] = ns[(long)(qs[i] * (count - 1))];
+}
+
+/** The latency percentiles of the point into the info. */
+static void
+sweep_info(const struct sweep_point *point, uint64_t *submit_ns,
+	   uint64_t *join_ns, long count)
+{
+	uint64_t s[4], j[4];
+	sweep_percentiles(submit_ns, count, s);
+	sweep_percentiles(join_ns, count, j);
+	char value[256];
+	snprintf(value, sizeof(value), "submit_ns p50 %llu, p90 %llu, "
+		 "p99 %llu, max %llu; join_ns p50 %llu, p90 %llu, p99 %llu, "
+		 "max %llu", (unsigned long long)s[0], (unsigned long long)s[1],
+		 (unsigned long long)s[2], (unsigned long long)s[3],
+		 (unsigned long long)j[0], (unsigned long long)j[1],
+		 (unsigned long long)j[2], (unsigned long long)j[3]);
+	bench_info(point->name, value);
+}
+
+struct sweep_task {
+	struct thread_task *task;
+	pthread_t thread;
+	uint64_t duration_ns;
+	/** When the task function has returned. */
+	uint64_t end_ns;
+};
+
+/** Busy for the task duration, so it holds the CPU like real work. */
+static void *
+sweep_task_f(void *arg)
+{
+	struct sweep_task *t = arg;
+	if (t->duration_ns > 0) {
+		uint64_t deadline = sweep_clock_ns() + t->duration_ns;
+		while (sweep_clock_ns() < deadline)
+			;
+	}
+	t->end_ns = sweep_clock_ns();
+	return NULL;
+}
+
+static uint64_t
+sweep_join_latency(const struct sweep_task *t, uint64_t join_ns,
+		   uint64_t done_ns)
+{
+	uint64_t from = t->end_ns > join_ns ? t->end_ns : join_ns;
+	return done_ns > from ? done_ns - from : 0;
+}
+
+struct sweep_producer {
+	struct thread_pool *pool;
+	pthread_t thread;
+	long task_count;
+	uint64_t duration_ns;
+	/** Latencies of each task. */
+	uint64_t *submit_ns;
+	uint64_t *join_ns;
+};
+
+static void *
+sweep_producer_f(void *arg)
+{
+	struct sweep_producer *p = arg;
+	struct sweep_task *tasks = malloc(SWEEP_WINDOW * sizeof(tasks[0]));
+	for (int i = 0; i < SWEEP_WINDOW; ++i) {
+		tasks[i].duration_ns = p->duration_ns;
+		thread_task_new(&tasks[i].task, sweep_task_f, &tasks[i]);
+	}
+	for (long done = 0; done < p->task_count; done += SWEEP_WINDOW) {
+		long count = p->task_count - done;
+		if (count > SWEEP_WINDOW)
+			count = SWEEP_WINDOW;
+		for (long i = 0; i < count; ++i) {
+			uint64_t start = sweep_clock_ns();
+			if (thread_pool_push_task(p->pool, tasks[i].task) != 0)
+				abort();
+			p->submit_ns[done + i] = sweep_clock_ns() - start;
+		}
+		for (long i = 0; i < count; ++i) {
+			void *result;
+			uint64_t start = sweep_clock_ns();
+			if (thread_task_join(tasks[i].task, &result) != 0)
+				abort();
+			p->join_ns[done + i] = sweep_join_latency(
+				&tasks[i], start, sweep_clock_ns());
+		}
+	}
+	for (int i = 0; i < SWEEP_WINDOW; ++i)
+		thread_task_delete(tasks[i].task);
+	free(tasks);
+	return NULL;
+}
+
+static long
+sweep_task_count(uint64_t duration_ns, long max)
+{
+	long count = duration_ns == 0 ? max :
+		     (long)(SWEEP_POINT_NS / duration_ns);
+	if (count < SWEEP_TASK_COUNT_MIN)
+		count = SWEEP_TASK_COUNT_MIN;
+	return count < max ? count : max;
+}
+
+/** One point of the pool, @a task_count is a multiple of the producers. */
+static void
+sweep_run(long task_count, long index)
+{
+	bench_pause();
+	const struct sweep_point *point = &points[index];
+	int producer_count = point->producer_count;
+	uint64_t *submit_ns = malloc(task_count * sizeof(submit_ns[0]));
+	uint64_t *join_ns = malloc(task_count * sizeof(join_ns[0]));
+	struct thread_pool *pool;
+	if (thread_pool_new(point->thread_count, &pool) != 0)
+		abort();
+	struct sweep_producer producers[SWEEP_PRODUCER_MAX];
+	long share = task_count / producer_count;
+	bench_resume();
+	for (int i = 0; i < producer_count; ++i) {
+		struct sweep_producer *p = &producers[i];
+		p->pool = pool;
+		p->task_count = share;
+		p->duration_ns = point->duration_ns;
+		p->submit_ns = submit_ns + i * share;
+		p->join_ns = join_ns + i * share;
+		pthread_create(&p->thread, NULL, sweep_producer_f, p);
+	}
+	for (int i = 0; i < producer_count; ++i)
+		pthread_join(producers[i].thread, NULL);
+	bench_pause();
+	thread_pool_delete(pool);
+	sweep_info(point, submit_ns, join_ns, task_count);
+	free(submit_ns);
+	free(join_ns);
+	bench_resume();
+}
+
+/**
+ * The same tasks with a new thread each, started by the windows of
+ * the pool's max thread count and then joined.
+ */
+static void
+sweep_pthread_run(long task_count, long index)
+{
+	bench_pause();
+	const struct sweep_point *point = &points[index];
+	uint64_t duration_ns = point->duration_ns;
+	uint64_t *submit_ns = malloc(task_count * sizeof(submit_ns[0]));
+	uint64_t *join_ns = malloc(task_count * sizeof(join_ns[0]));
+	struct sweep_task tasks[SWEEP_PTHREAD_WINDOW];
+	bench_resume();
+	for (long done = 0; done < task_count; done += SWEEP_PTHREAD_WINDOW) {
+		long count = task_count - done;
+		if (count > SWEEP_PTHREAD_WINDOW)
+			count = SWEEP_PTHREAD_WINDOW;
+		for (long i = 0; i < count; ++i) {
+			uint64_t t = sweep_clock_ns();
+			tasks[i].duration_ns = duration_ns;
+			if (pthread_create(&tasks[i].thread, NULL,
+					   sweep_task_f, &tasks[i]) != 0)
+				abort();
+			submit_ns[done + i] = sweep_clock_ns() - t;
+		}
+		for (long i = 0; i < count; ++i) {
+			uint64_t t = sweep_clock_ns();
+			pthread_join(tasks[i].thread, NULL);
+			join_ns[done + i] = sweep_join_latency(
+				&tasks[i], t, sweep_clock_ns());
+		}
+	}
+	bench_pause();
+	sweep_info(point, submit_ns, join_ns, task_count);
+	free(submit_ns);
+	free(join_ns);
+	bench_resume();
+}
+
+/** Add a point, a pool one with a non-zero @a thread_count. */
+static void
+sweep_register(int thread_count, uint64_t duration_ns, int producer_count)
+{
+	struct sweep_point *point = &points[point_count];
+	point->thread_count = thread_count;
+	point->duration_ns = duration_ns;
+	point->producer_count = producer_count;
+	long task_count;
+	if (thread_count == 0) {
+		snprintf(point->name, sizeof(point->name), "pthread/d%lluns",
+			 (unsigned long long)duration_ns);
+		task_count = sweep_task_count(duration_ns,
+					      SWEEP_PTHREAD_TASK_COUNT_MAX);
+		bench_register_arg(point->name, sweep_pthread_run, task_count,
+				   point_count);
+	} else {
+		snprintf(point->name, sizeof(point->name),
+			 "pool/t%d/d%lluns/p%d", thread_count,
+			 (unsigned long long)duration_ns, producer_count);
+		task_count = sweep_task_count(duration_ns,
+					      SWEEP_TASK_COUNT_MAX);
+		task_count -= task_count % producer_count;
+		bench_register_arg(point->name, sweep_run, task_count,
+				   point_count);
+	}
+	++point_count;
+}
+
+int
+main(int argc, char **argv)
+{
+	const int thread_counts[] = {1, 2, 4, 8, 12, 16, 20};
+	const uint64_t durations_ns[] = {0, 1000, 10000, 100000, 1000000};
+	const int producer_counts[] = {1, SWEEP_PRODUCER_MAX};
+	const int duration_count = sizeof(durations_ns) /
+				   sizeof(durations_ns[0]);
+	for (int d = 0; d < duration_count; ++d) {
+		for (int p = 0; p < 2; ++p) {
+			for (size_t t = 0; t < sizeof(thread_counts) /
+			     sizeof(thread_counts[0]); ++t) {
+				sweep_register(thread_counts[t],
+					       durations_ns[d],
+					       producer_counts[p]);
+			}
+		}
+		sweep_register(0, durations_ns[d], 1);
+	}
+	return bench_main(argc, argv);
+}
@@ -1,12 +1,28 @@
 #include "chat.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <poll.h>
+#include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+enum {
+	/** Free space made for the first recv() into a buffer. */
+	CHAT_RECV_SIZE = CHAT_CHUNK_SIZE,
+	/** Least free space worth a recv(). */
+	CHAT_RECV_MIN = 1024,
+};
 
 void
 chat_message_delete(struct chat_message *msg)
 {
-	free(msg->data);
+#if NEED_AUTHOR
+	if (msg->author_ref != NULL)
+		chat_author_unref(msg->author_ref);
+#endif
+	/* The text is in the same allocation. */
 	free(msg);
 }
 
@@ -20,3 +36,495 @@ chat_events_to_poll_events(int mask)
 		res |= POLLOUT;
 	return res;
 }
+
+/** isspace() of the C locale, without a call per byte. */
+static const bool chat_is_space[256] = {
+	[' '] = true, ['\t'] = true, ['\n'] = true,
+	['\v'] = true, ['\f'] = true, ['\r'] = true,
+};
+
+/** Trim the spaces at both sides. Returns the new size. */
+static inline size_t
+chat_trim(const char **data, size_t size)
+{
+	const char *begin = *data;
+	const char *end = begin + size;
+	while (begin < end && chat_is_space[(unsigned char)*begin])
+		++begin;
+	while (end > begin && chat_is_space[(unsigned char)end[-1]])
+		--end;
+	*data = begin;
+	return end - begin;
+}
+
+struct chat_author *
+chat_author_new(uint32_t id, const char *name, size_t name_len)
+{
+	struct chat_author *author = malloc(sizeof(*author) + name_len + 1);
+	author->ref_count = 1;
+	author->id = id;
+	author->name_len = name_len;
+	memcpy(author->name, name, name_len);
+	author->name[name_len] = 0;
+	return author;
+}
+
+void
+chat_author_unref(struct chat_author *author)
+{
+	if (__atomic_sub_fetch(&author->ref_count, 1, __ATOMIC_ACQ_REL) == 0)
+		free(author);
+}
+
+static inline uint32_t
+chat_author_table_slot(const struct chat_author_table *table, uint32_t id)
+{
+	return (id * 2654435761u) & (table->capacity - 1);
+}
+
+struct chat_author *
+chat_author_table_get(const struct chat_author_table *table, uint32_t id)
+{
+	if (table->count == 0)
+		return NULL;
+	uint32_t mask = table->capacity - 1;
+	for (uint32_t i = chat_author_table_slot(table, id);;
+	     i = (i + 1) & mask) {
+		struct chat_author *author = table->slots[i];
+		if (author == NULL || author->id == id)
+			return author;
+	}
+}
+
+/** Put into the first free slot from the id's one. Never full. */
+static void
+chat_author_table_insert(struct chat_author_table *table,
+			 struct chat_author *author)
+{
+	uint32_t mask = table->capacity - 1;
+	uint32_t i = chat_author_table_slot(table, author->id);
+	while (table->slots[i] != NULL)
+		i = (i + 1) & mask;
+	table->slots[i] = author;
+}
+
+void
+chat_author_table_put(struct chat_author_table *table,
+		      struct chat_author *author)
+{
+	chat_author_ref(author);
+	struct chat_author *old = chat_author_table_get(table, author->id);
+	if (old != NULL) {
+		uint32_t mask = table->capacity - 1;
+		uint32_t i = chat_author_table_slot(table, author->id);
+		while (table->slots[i] != old)
+			i = (i + 1) & mask;
+		table->slots[i] = author;
+		chat_author_unref(old);
+		return;
+	}
+	/* At most 3/4 full, so the probes are short. */
+	if ((table->count + 1) * 4 > table->capacity * 3) {
+		struct chat_author **slots = table->slots;
+		uint32_t capacity = table->capacity;
+		table->capacity = capacity > 0 ? capacity * 2 : 16;
+		table->slots = calloc(table->capacity, sizeof(slots[0]));
+		for (uint32_t i = 0; i < capacity; ++i) {
+			if (slots[i] != NULL)
+				chat_author_table_insert(table, slots[i]);
+		}
+		free(slots);
+	}
+	chat_author_table_insert(table, author);
+	++table->count;
+}
+
+void
+chat_author_table_del(struct chat_author_table *table, uint32_t id)
+{
+	struct chat_author *author = chat_author_table_get(table, id);
+	if (author == NULL)
+		return;
+	uint32_t mask = table->capacity - 1;
+	uint32_t i = chat_author_table_slot(table, id);
+	while (table->slots[i] != author)
+		i = (i + 1) & mask;
+	table->slots[i] = NULL;
+	--table->count;
+	chat_author_unref(author);
+	/*
+	 * Move up the next entries of the probe chain which can not be
+	 * found past the new hole otherwise.
+	 */
+	uint32_t hole = i;
+	for (i = (i + 1) & mask; table->slots[i] != NULL; i = (i + 1) & mask) {
+		uint32_t home = chat_author_table_slot(table,
+						       table->slots[i]->id);
+		if (((i - home) & mask) < ((i - hole) & mask))
+			continue;
+		table->slots[hole] = table->slots[i];
+		table->slots[i] = NULL;
+		hole = i;
+	}
+}
+
+void
+chat_author_table_destroy(struct chat_author_table *table)
+{
+	for (uint32_t i = 0; i < table->capacity; ++i) {
+		if (table->slots[i] != NULL)
+			chat_author_unref(table->slots[i]);
+	}
+	free(table->slots);
+	table->slots = NULL;
+	table->capacity = 0;
+	table->count = 0;
+}
+
+struct chat_message *
+chat_message_new(const char *data, size_t size, struct chat_author *author)
+{
+	struct chat_message *msg = malloc(sizeof(*msg) + size + 1);
+	msg->data = (char *)(msg + 1);
+	memcpy(msg->data, data, size);
+	msg->data[size] = 0;
+	msg->next = NULL;
+#if NEED_AUTHOR
+	msg->author = author != NULL ? author->name : "";
+	msg->author_ref = author != NULL ? chat_author_ref(author) : NULL;
+#else
+	(void)author;
+#endif
+	return msg;
+}
+
+void
+chat_message_queue_push(struct chat_message_queue *queue,
+			struct chat_message *msg)
+{
+	msg->next = NULL;
+	if (queue->last == NULL)
+		queue->first = msg;
+	else
+		queue->last->next = msg;
+	queue->last = msg;
+}
+
+struct chat_message *
+chat_message_queue_pop(struct chat_message_queue *queue)
+{
+	struct chat_message *msg = queue->first;
+	if (msg == NULL)
+		return NULL;
+	queue->first = msg->next;
+	if (queue->first == NULL)
+		queue->last = NULL;
+	msg->next = NULL;
+	return msg;
+}
+
+void
+chat_message_queue_destroy(struct chat_message_queue *queue)
+{
+	struct chat_message *msg;
+	while ((msg = chat_message_queue_pop(queue)) != NULL)
+		chat_message_delete(msg);
+}
+
+void
+chat_chunk_pool_destroy(struct chat_chunk_pool *pool)
+{
+	while (pool->free_list != NULL) {
+		void *chunk = pool->free_list;
+		pool->free_list = *(void **)chunk;
+		free(chunk);
+	}
+	pool->free_count = 0;
+}
+
+static void *
+chat_chunk_pool_take(struct chat_chunk_pool *pool)
+{
+	void *chunk = pool->free_list;
+	if (chunk != NULL) {
+		pool->free_list = *(void **)chunk;
+		--pool->free_count;
+	} else {
+		chunk = malloc(CHAT_CHUNK_SIZE);
+	}
+	if (++pool->used_count > pool->used_peak)
+		pool->used_peak = pool->used_count;
+	return chunk;
+}
+
+static void
+chat_chunk_pool_put(struct chat_chunk_pool *pool, void *chunk)
+{
+	--pool->used_count;
+	if (pool->free_count == CHAT_CHUNK_FREE_MAX) {
+		free(chunk);
+		return;
+	}
+	*(void **)chunk = pool->free_list;
+	pool->free_list = chunk;
+	++pool->free_count;
+}
+
+void
+chat_buffer_reserve(struct chat_buffer *buf, size_t size)
+{
+	if (buf->capacity - buf->size >= size)
+		return;
+	size_t len = chat_buffer_len(buf);
+	if (buf->pos > 0) {
+		memmove(buf->data, buf->data + buf->pos, len);
+		buf->pos = 0;
+		buf->size = len;
+		if (buf->capacity - buf->size >= size)
+			return;
+	}
+	if (buf->capacity == 0 && buf->pool != NULL &&
+	    size <= CHAT_CHUNK_SIZE) {
+		buf->data = chat_chunk_pool_take(buf->pool);
+		buf->capacity = CHAT_CHUNK_SIZE;
+		buf->is_chunk = true;
+		return;
+	}
+	size_t capacity = buf->capacity > 0 ? buf->capacity : 1024;
+	while (capacity - len < size)
+		capacity *= 2;
+	if (buf->is_chunk) {
+		/* A big message, it does not fit into a chunk. */
+		char *data = malloc(capacity);
+		memcpy(data, buf->data, len);
+		chat_chunk_pool_put(buf->pool, buf->data);
+		++buf->pool->big_count;
+		buf->data = data;
+		buf->is_chunk = false;
+	} else {
+		buf->data = realloc(buf->data, capacity);
+	}
+	buf->capacity = capacity;
+}
+
+void
+chat_buffer_append(struct chat_buffer *buf, const char *data, size_t size)
+{
+	chat_buffer_reserve(buf, size);
+	memcpy(buf->data + buf->size, data, size);
+	buf->size += size;
+}
+
+void
+chat_buffer_consume(struct chat_buffer *buf, size_t size)
+{
+	buf->pos += size;
+	if (buf->pos == buf->size) {
+		buf->pos = 0;
+		buf->size = 0;
+	}
+}
+
+void
+chat_buffer_destroy(struct chat_buffer *buf)
+{
+	if (buf->is_chunk)
+		chat_chunk_pool_put(buf->pool, buf->data);
+	else
+		free(buf->data);
+	buf->data = NULL;
+	buf->pos = 0;
+	buf->size = 0;
+	buf->capacity = 0;
+	buf->is_chunk = false;
+}
+
+ssize_t
+chat_buffer_recv(struct chat_buffer *buf, int socket)
+{
+	ssize_t total = 0;
+	while (true) {
+		if (buf->capacity - buf->size < CHAT_RECV_MIN) {
+			chat_buffer_reserve(buf, buf->capacity == 0 ?
+					    CHAT_RECV_SIZE : CHAT_RECV_MIN);
+		}
+		ssize_t rc = recv(socket, buf->data + buf->size,
+				  buf->capacity - buf->size, 0);
+		if (rc > 0) {
+			buf->size += rc;
+			total += rc;
+			continue;
+		}
+		if (rc == 0)
+			return -1;
+		if (errno == EINTR)
+			continue;
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return total;
+		return -1;
+	}
+}
+
+int
+chat_buffer_send(struct chat_buffer *buf, int socket)
+{
+	while (chat_buffer_len(buf) > 0) {
+		ssize_t rc = send(socket, buf->data + buf->pos,
+				  chat_buffer_len(buf), MSG_NOSIGNAL);
+		if (rc >= 0) {
+			chat_buffer_consume(buf, rc);
+			continue;
+		}
+		if (errno == EINTR)
+			continue;
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		return -1;
+	}
+	return 0;
+}
+
+bool
+chat_buffer_next_message(struct chat_buffer *buf, size_t *scan,
+			 struct chat_slice *slice)
+{
+	while (true) {
+		size_t len = chat_buffer_len(buf);
+		if (len == 0) {
+			*scan = 0;
+			return false;
+		}
+		const char *begin = buf->data + buf->pos;
+		const char *line_end = memchr(begin + *scan, '\n',
+					      len - *scan);
+		if (line_end == NULL) {
+			*scan = len;
+			return false;
+		}
+		/*
+		 * The consumed bytes stay in place until the next reserve,
+		 * so the slice is still valid.
+		 */
+		chat_buffer_consume(buf, line_end + 1 - begin);
+		*scan = 0;
+		slice->data = begin;
+		slice->size = chat_trim(&slice->data, line_end - begin);
+		if (slice->size > 0)
+			return true;
+	}
+}
+
+uint32_t
+chat_lz_dict_id(const char *dict, size_t size)
+{
+	/* FNV-1a. */
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < size; ++i) {
+		h ^= (unsigned char)dict[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+void
+chat_frame_encode_header(char *out, int type, uint32_t author_id,
+			 size_t size)
+{
+	chat_encode_u32(out, (uint32_t)size);
+	out[4] = (char)type;
+	chat_encode_u32(out + 5, author_id);
+}
+
+void
+chat_buffer_append_frame(struct chat_buffer *buf, int type,
+			 uint32_t author_id, const char *data, size_t size)
+{
+	chat_buffer_reserve(buf, CHAT_FRAME_HEADER_SIZE + size);
+	chat_frame_encode_header(buf->data + buf->size, type, author_id, size);
+	if (size > 0) {
+		memcpy(buf->data + buf->size + CHAT_FRAME_HEADER_SIZE, data,
+		       size);
+	}
+	buf->size += CHAT_FRAME_HEADER_SIZE + size;
+}
+
+bool
+chat_buffer_next_frame(struct chat_buffer *buf, struct chat_frame *frame)
+{
+	size_t len = chat_buffer_len(buf);
+	if (len < CHAT_FRAME_HEADER_SIZE)
+		return false;
+	const char *begin = buf->data + buf->pos;
+	size_t size = chat_decode_u32(begin);
+	if (len - CHAT_FRAME_HEADER_SIZE < size)
+		return false;
+	frame->type = (unsigned char)begin[4];
+	frame->author_id = chat_decode_u32(begin + 5);
+	frame->payload.data = begin + CHAT_FRAME_HEADER_SIZE;
+	frame->payload.size = size;
+	/* The data stays in place until the next reserve. */
+	chat_buffer_consume(buf, CHAT_FRAME_HEADER_SIZE + size);
+	return true;
+}
+
+ssize_t
+chat_buffer_recv_datagrams(struct chat_buffer *buf, int socket)
+{
+	ssize_t total = 0;
+	while (true) {
+		/* A datagram not fitting is truncated, so room for any. */
+		chat_buffer_reserve(buf, CHAT_DATAGRAM_MAX);
+		ssize_t rc = recv(socket, buf->data + buf->size,
+				  buf->capacity - buf->size, 0);
+		if (rc >= 0) {
+			buf->size += rc;
+			total += rc;
+			continue;
+		}
+		if (errno == EINTR)
+			continue;
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return total;
+		return -1;
+	}
+}
+
+int
+chat_buffer_send_datagrams(struct chat_buffer *buf, int socket)
+{
+	while (chat_buffer_len(buf) > 0) {
+		const char *begin = buf->data + buf->pos;
+		size_t len = chat_buffer_len(buf);
+		size_t size = 0;
+		while (len - size >= CHAT_FRAME_HEADER_SIZE) {
+			size_t frame = CHAT_FRAME_HEADER_SIZE +
+				       chat_decode_u32(begin + size);
+			if (size > 0 && size + frame > CHAT_DATAGRAM_MAX)
+				break;
+			size += frame;
+		}
+		/* A broken frame goes as it is, not to hang here. */
+		if (size == 0 || size > len)
+			size = len;
+		ssize_t rc = send(socket, begin, size, MSG_NOSIGNAL);
+		if (rc >= 0 || errno == EMSGSIZE) {
+			chat_buffer_consume(buf, size);
+			continue;
+		}
+		if (errno == EINTR)
+			continue;
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		return -1;
+	}
+	return 0;
+}
+
+int
+chat_socket_set_nonblock(int socket)
+{
+	int flags = fcntl(socket, F_GETFL);
+	if (flags < 0)
+		return -1;
+	return fcntl(socket, F_SETFL, flags | O_NONBLOCK);
+}
@@ -1,5 +1,10 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
 /**
  * Here you should specify which features do you want to implement via macros:
  * If you want to enable author name support, do:
@@ -13,8 +18,8 @@
  * It is important to define these macros here, in the header, because it is
  * used by tests.
  */
-#define NEED_AUTHOR 0
-#define NEED_SERVER_FEED 0
+#define NEED_AUTHOR 1
+#define NEED_SERVER_FEED 1
 
 enum chat_errcode {
 	CHAT_ERR_INVALID_ARGUMENT = 1,
@@ -36,11 +41,14 @@ struct chat_message {
 #if NEED_AUTHOR
 	/** Author's name. */
 	const char *author;
+	/** The interned author holding the name. */
+	struct chat_author *author_ref;
 #endif
 	/** 0-terminate text. */
 	char *data;
 
-	/* PUT HERE OTHER MEMBERS */
+	/** Next message in a queue. */
+	struct chat_message *next;
 };
 
 /** Free message's memory. */
@@ -50,3 +58,337 @@ chat_message_delete(struct chat_message *msg);
 /** Convert chat_events mask to events suitable for poll(). */
 int
 chat_events_to_poll_events(int mask);
+
+/**
+ * Below are the helpers shared by the client and the server, not a
+ * part of the public API.
+ */
+
+/**
+ * An author's name, interned by its id. The messages share it instead
+ * of a copy of the name each.
+ */
+struct chat_author {
+	/** Atomic, the messages move between the threads. */
+	int ref_count;
+	uint32_t id;
+	size_t name_len;
+	/** 0-terminated. */
+	char name[];
+};
+
+/** Create an author with one reference. */
+struct chat_author *
+chat_author_new(uint32_t id, const char *name, size_t name_len);
+
+static inline struct chat_author *
+chat_author_ref(struct chat_author *author)
+{
+	__atomic_add_fetch(&author->ref_count, 1, __ATOMIC_RELAXED);
+	return author;
+}
+
+void
+chat_author_unref(struct chat_author *author);
+
+/** Open addressing hash table of the authors by their ids. */
+struct chat_author_table {
+	/** Power of 2 of them, NULL is a free one. */
+	struct chat_author **slots;
+	uint32_t capacity;
+	uint32_t count;
+};
+
+struct chat_author *
+chat_author_table_get(const struct chat_author_table *table, uint32_t id);
+
+/** Add a reference of the author, replacing one with the same id. */
+void
+chat_author_table_put(struct chat_author_table *table,
+		      struct chat_author *author);
+
+/** Remove the author with the id and drop its reference. */
+void
+chat_author_table_del(struct chat_author_table *table, uint32_t id);
+
+void
+chat_author_table_destroy(struct chat_author_table *table);
+
+/**
+ * Create a message of the text copied into the same allocation. It
+ * refers to the author, which can be NULL for no name.
+ */
+struct chat_message *
+chat_message_new(const char *data, size_t size, struct chat_author *author);
+
+/** FIFO of messages. */
+struct chat_message_queue {
+	struct chat_message *first;
+	struct chat_message *last;
+};
+
+void
+chat_message_queue_push(struct chat_message_queue *queue,
+			struct chat_message *msg);
+
+struct chat_message *
+chat_message_queue_pop(struct chat_message_queue *queue);
+
+void
+chat_message_queue_destroy(struct chat_message_queue *queue);
+
+enum {
+	/** Size of a pooled buffer chunk. */
+	CHAT_CHUNK_SIZE = 16 * 1024,
+	/** Most free chunks kept by a pool, the rest is freed. */
+	CHAT_CHUNK_FREE_MAX = 64,
+};
+
+/**
+ * Shared free list of the fixed size chunks, which the buffers take
+ * while they have data and give back when drained.
+ */
+struct chat_chunk_pool {
+	/** Free chunks, linked through their first bytes. */
+	void *free_list;
+	int free_count;
+	/** Chunks held by the buffers now, and at most. */
+	int used_count;
+	int used_peak;
+	/** How many times a buffer outgrew a chunk and moved to malloc. */
+	uint64_t big_count;
+};
+
+void
+chat_chunk_pool_destroy(struct chat_chunk_pool *pool);
+
+/**
+ * Growable byte buffer. The data not consumed yet is [pos, size),
+ * the free space is [size, capacity).
+ */
+struct chat_buffer {
+	char *data;
+	size_t pos;
+	size_t size;
+	size_t capacity;
+	/** Pool to take the memory from, or NULL for plain malloc. */
+	struct chat_chunk_pool *pool;
+	/** The data is a chunk of the pool. */
+	bool is_chunk;
+};
+
+static inline size_t
+chat_buffer_len(const struct chat_buffer *buf)
+{
+	return buf->size - buf->pos;
+}
+
+/**
+ * Make at least @a size bytes of the free space. The consumed prefix
+ * is dropped first, so a buffer does not grow while it is drained.
+ */
+void
+chat_buffer_reserve(struct chat_buffer *buf, size_t size);
+
+void
+chat_buffer_append(struct chat_buffer *buf, const char *data, size_t size);
+
+/** Mark @a size bytes as consumed. */
+void
+chat_buffer_consume(struct chat_buffer *buf, size_t size);
+
+/** Free the memory. The buffer can be used again. */
+void
+chat_buffer_destroy(struct chat_buffer *buf);
+
+/**
+ * Give the memory back if the buffer is drained, so an idle pooled
+ * buffer holds nothing.
+ */
+static inline void
+chat_buffer_release_empty(struct chat_buffer *buf)
+{
+	if (buf->data != NULL && chat_buffer_len(buf) == 0)
+		chat_buffer_destroy(buf);
+}
+
+/**
+ * Receive everything available from the non-blocking socket into
+ * the buffer.
+ *
+ * @retval >0 Bytes received, and the socket has no more data now.
+ * @retval 0 Nothing, and the socket is still fine.
+ * @retval -1 The peer has closed the connection or it is broken. What
+ *     was received before that is in the buffer still.
+ */
+ssize_t
+chat_buffer_recv(struct chat_buffer *buf, int socket);
+
+/**
+ * Send the buffer data to the non-blocking socket, as much as it
+ * takes.
+ *
+ * @retval 0 All is sent, or the socket is full.
+ * @retval -1 The connection is broken.
+ */
+int
+chat_buffer_send(struct chat_buffer *buf, int socket);
+
+enum {
+	/** Biggest UDP payload over IPv4. */
+	CHAT_DATAGRAM_MAX = 65507,
+};
+
+/**
+ * Receive all the datagrams available on the non-blocking socket
+ * into the buffer. A datagram of the UDP transport carries whole
+ * frames, so they are framed like a stream, and a lost datagram
+ * loses only its own frames.
+ *
+ * @retval >=0 Bytes received, and the socket has no more data now.
+ * @retval -1 The socket is broken, like a connected one refused by
+ *     the other side.
+ */
+ssize_t
+chat_buffer_recv_datagrams(struct chat_buffer *buf, int socket);
+
+/**
+ * Send the frames of the buffer to the connected non-blocking UDP
+ * socket, as many whole ones per datagram as fit.
+ *
+ * @retval 0 All is sent, or the socket is full. A frame too big for
+ *     a datagram is dropped.
+ * @retval -1 The socket is broken.
+ */
+int
+chat_buffer_send_datagrams(struct chat_buffer *buf, int socket);
+
+/** A message text borrowed from a buffer. */
+struct chat_slice {
+	const char *data;
+	size_t size;
+};
+
+/**
+ * Cut the next complete line from the buffer, trimmed from the
+ * spaces. The empty lines are skipped. @a scan is where the search
+ * for '\n' continues, so each byte is checked once even when a line
+ * arrives by many parts. The slice points into the buffer and is
+ * valid until the next receive or append into it.
+ *
+ * @retval true A message is in @a slice.
+ * @retval false No complete lines left.
+ */
+bool
+chat_buffer_next_message(struct chat_buffer *buf, size_t *scan,
+			 struct chat_slice *slice);
+
+/**
+ * The binary protocol of chat_client. A client starts with
+ * CHAT_PROTO_MAGIC, which is never the first byte of a text line as
+ * it is not UTF-8, and a hello frame with its name. The frames are
+ *
+ *     [payload size: u32][type: u8][author id: u32][payload]
+ *
+ * with the numbers in the network byte order. The server gives each
+ * author an id and announces its name once, before its first
+ * message, then its messages carry only the id. The peers not
+ * starting with the magic are served by the text protocol of the
+ * '\n'-terminated lines.
+ */
+enum {
+	CHAT_PROTO_MAGIC = 0xff,
+	CHAT_FRAME_HEADER_SIZE = 9,
+};
+
+enum chat_frame_type {
+	/** Client to server, the payload is the client's name. */
+	CHAT_FRAME_HELLO = 1,
+	/** A message. The author id is 0 in the ones from a client. */
+	CHAT_FRAME_MESSAGE,
+	/** Server to client, the name of the author id. */
+	CHAT_FRAME_NAME,
+	/** Server to client, the author id is not used anymore. */
+	CHAT_FRAME_LEAVE,
+	/** Server to a silent client, which answers with a pong. */
+	CHAT_FRAME_PING,
+	CHAT_FRAME_PONG,
+	/**
+	 * Client to server, before the hello. The payload is what the
+	 * client can, u32 of chat_feature flags, and the id of its LZ
+	 * dictionary, u32. The servers not knowing it skip it.
+	 */
+	CHAT_FRAME_FEATURES,
+	/**
+	 * Server to a client with CHAT_FEATURE_LZ, a message compressed
+	 * by the shared dictionary. The payload is the text size, u32,
+	 * and the text in the LZ4 block format, see ../3/lz.h.
+	 */
+	CHAT_FRAME_MESSAGE_LZ,
+};
+
+enum chat_feature {
+	CHAT_FEATURE_LZ = 1,
+};
+
+enum {
+	/** Payload size of a features frame. */
+	CHAT_FEATURES_SIZE = 8,
+	/** Shorter messages are not worth compressing. */
+	CHAT_LZ_MIN_SIZE = 8,
+};
+
+/**
+ * Id of the LZ dictionary, the same on both sides when the bytes
+ * are. The empty one is a dictionary too.
+ */
+uint32_t
+chat_lz_dict_id(const char *dict, size_t size);
+
+struct chat_frame {
+	/** One of chat_frame_type, or anything from a broken peer. */
+	int type;
+	uint32_t author_id;
+	struct chat_slice payload;
+};
+
+static inline void
+chat_encode_u32(char *out, uint32_t value)
+{
+	out[0] = (char)(value >> 24);
+	out[1] = (char)(value >> 16);
+	out[2] = (char)(value >> 8);
+	out[3] = (char)value;
+}
+
+static inline uint32_t
+chat_decode_u32(const char *in)
+{
+	const unsigned char *p = (const unsigned char *)in;
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+	       (uint32_t)p[2] << 8 | p[3];
+}
+
+/** Write the header of a frame with a payload of @a size bytes. */
+void
+chat_frame_encode_header(char *out, int type, uint32_t author_id,
+			 size_t size);
+
+void
+chat_buffer_append_frame(struct chat_buffer *buf, int type,
+			 uint32_t author_id, const char *data, size_t size);
+
+/**
+ * Cut the next complete frame from the buffer. The size is in the
+ * header, so the payload is not scanned. The payload slice is valid
+ * like the one of chat_buffer_next_message().
+ *
+ * @retval true A frame is in @a frame.
+ * @retval false No complete frames left.
+ */
+bool
+chat_buffer_next_frame(struct chat_buffer *buf, struct chat_frame *frame);
+
+/** Make the socket non-blocking. Returns -1 on error. */
+int
+chat_socket_set_nonblock(int socket);
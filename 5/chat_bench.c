@@ -0,0 +1,583 @@
+#include "chat.h"
+#include "chat_client.h"
+#include "chat_server.h"
+#include "unit_bench.h"
+
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Load generator of the chat server on ../utils/unit_bench.h. Each run
+ * starts the server in a child process in the chosen mode, and the
+ * clients, many per thread, send messages at a fixed rate each, for
+ * the given duration. One iteration is one sent message, so with a
+ * steady rate ns/op is mostly 1e9 / (clients * rate), plus the tail
+ * of the last deliveries.
+ *
+ * A message carries its send time, so each receiver measures the
+ * broadcast latency. The latency percentiles, delivered messages per
+ * second, and the CPU time and memory of the server process of the
+ * last run go to the info of the report.
+ *
+ * The load is changed with the options, the others are of
+ * bench_main(), like --runs 3.
+ * Usage: bench [--clients=N] [--rate=MSG_PER_SEC] [--size=BYTES]
+ *     [--duration=SEC] [--backend=poll|uring] [--threads=N]
+ *     [--workers=N] [--flush-us=N] [--udp] [bench_main() options]
+ */
+
+enum {
+	/** Sub-buckets per power of 2 of the latency histogram. */
+	BENCH_HIST_SUB_BITS = 5,
+	BENCH_HIST_SUB = 1 << BENCH_HIST_SUB_BITS,
+	BENCH_HIST_SIZE = (64 - BENCH_HIST_SUB_BITS + 1) * BENCH_HIST_SUB,
+	/** Room for the timestamp and the client id of a message. */
+	BENCH_MSG_SIZE_MIN = 48,
+	/** The clients are done when nothing comes for this long. */
+	BENCH_IDLE_NS = 200 * 1000 * 1000,
+	BENCH_DRAIN_NS = 5ull * 1000 * 1000 * 1000,
+};
+
+struct bench_options {
+	int client_count;
+	/** Messages per second of each client. */
+	double rate;
+	int msg_size;
+	double duration;
+	enum chat_server_backend backend;
+	/** Event loop threads of the server. */
+	int server_thread_count;
+	/** Threads running the clients. */
+	int worker_count;
+	/** Flush window of the clients, 0 to send each message at once. */
+	int flush_us;
+	/** The clients talk to the UDP transport of the server. */
+	bool use_udp;
+};
+
+static struct bench_options opts = {
+	.client_count = 100,
+	.rate = 10,
+	.msg_size = 64,
+	.duration = 1,
+	.backend = CHAT_SERVER_BACKEND_POLL,
+	.worker_count = 1,
+};
+
+/** Clients of one thread and what they measured. */
+struct bench_worker {
+	pthread_t thread;
+	struct chat_client **clients;
+	/** Time of the next message of each client. */
+	uint64_t *next_send_ns;
+	int first_id;
+	int count;
+	/** Messages to send by each client. */
+	long send_count;
+	uint64_t start_ns;
+	uint64_t sent_count;
+	uint64_t received_count;
+	uint64_t last_receive_ns;
+	/** Latencies, log-linear buckets of nanoseconds. */
+	uint64_t hist[BENCH_HIST_SIZE];
+};
+
+/** The server child process of a run. */
+struct bench_server {
+	pid_t pid;
+	/** Its port first, then its stats at the exit. */
+	int fd;
+	uint16_t port;
+};
+
+static uint64_t
+bench_clock_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** Histogram bucket of the value, with 1/32 precision. */
+static int
+bench_hist_index(uint64_t v)
+{
+	if (v < BENCH_HIST_SUB)
+		return (int)v;
+	int p = 63 - __builtin_clzll(v);
+	int sub = (int)(v >> (p - BENCH_HIST_SUB_BITS)) - BENCH_HIST_SUB;
+	return (p - BENCH_HIST_SUB_BITS + 1) * BENCH_HIST_SUB + sub;
+}
+
+/** The smallest value of the bucket. */
+static uint64_t
+bench_hist_value(int index)
+{
+	if (index < BENCH_HIST_SUB)
+		return index;
+	int p = index / BENCH_HIST_SUB + BENCH_HIST_SUB_BITS - 1;
+	uint64_t sub = BENCH_HIST_SUB + index % BENCH_HIST_SUB;
+	return sub << (p - BENCH_HIST_SUB_BITS);
+}
+
+/** Take p50, p90, p99, p99.9 and max of the histogram. */
+static void
+bench_hist_percentiles(const uint64_t *hist, uint64_t *out)
+{
+	const double qs[] = {0.5, 0.9, 0.99, 0.999, 1};
+	uint64_t total = 0;
+	for (int i = 0; i < BENCH_HIST_SIZE; ++i)
+		total += hist[i];
+	memset(out, 0, 5 * sizeof(out[0]));
+	if (total == 0)
+		return;
+	uint64_t seen = 0;
+	int q = 0;
+	for (int i = 0; i < BENCH_HIST_SIZE && q < 5; ++i) {
+		seen += hist[i];
+		while (q < 5) {
+			uint64_t need = (uint64_t)(qs[q] * total);
+			if (seen < need || seen == 0)
+				break;
+			out[q++] = bench_hist_value(i);
+		}
+	}
+}
+
+static void
+bench_worker_send(struct bench_worker *w, int i, uint64_t now)
+{
+	char *text = malloc(opts.msg_size);
+	int len = sprintf(text, "%llu %d ", (unsigned long long)now,
+			  w->first_id + i);
+	memset(text + len, 'x', opts.msg_size - len - 1);
+	text[opts.msg_size - 1] = '\n';
+	chat_client_feed(w->clients[i], text, opts.msg_size);
+	free(text);
+	++w->sent_count;
+}
+
+static void
+bench_worker_receive(struct bench_worker *w, struct chat_client *client)
+{
+	chat_client_update(client, 0);
+	struct chat_message *msg;
+	uint64_t now = bench_clock_ns();
+	while ((msg = chat_client_pop_next(client)) != NULL) {
+		unsigned long long sent_ns = 0;
+		if (sscanf(msg->data, "%llu", &sent_ns) == 1 && now >= sent_ns)
+			++w->hist[bench_hist_index(now - sent_ns)];
+		chat_message_delete(msg);
+		++w->received_count;
+		w->last_receive_ns = now;
+	}
+}
+
+static void *
+bench_worker_f(void *arg)
+{
+	struct bench_worker *w = arg;
+	uint64_t interval_ns = (uint64_t)(1e9 / opts.rate);
+	/*
+	 * Each client sends exactly send_count messages, the late ones
+	 * are caught up, so the iteration count of the run is exact.
+	 */
+	uint64_t end_ns = w->start_ns + interval_ns * w->send_count;
+	/* Spread the clients evenly over the interval. */
+	for (int i = 0; i < w->count; ++i) {
+		w->next_send_ns[i] = w->start_ns + interval_ns *
+				     (w->first_id + i) / opts.client_count;
+	}
+	struct pollfd *pfds = malloc(w->count * sizeof(pfds[0]));
+	while (true) {
+		uint64_t now = bench_clock_ns();
+		uint64_t next_ns = UINT64_MAX;
+		for (int i = 0; i < w->count; ++i) {
+			while (w->next_send_ns[i] <= now &&
+			       w->next_send_ns[i] < end_ns) {
+				bench_worker_send(w, i, now);
+				w->next_send_ns[i] += interval_ns;
+			}
+			if (w->next_send_ns[i] < end_ns &&
+			    w->next_send_ns[i] < next_ns)
+				next_ns = w->next_send_ns[i];
+		}
+		if (next_ns == UINT64_MAX) {
+			uint64_t last = w->last_receive_ns > end_ns ?
+					w->last_receive_ns : end_ns;
+			if (now > last && (now - last > BENCH_IDLE_NS ||
+					   now - end_ns > BENCH_DRAIN_NS))
+				break;
+			next_ns = now + BENCH_IDLE_NS / 4;
+		}
+		for (int i = 0; i < w->count; ++i) {
+			/* Wake up when a held batch is due. */
+			double hold = chat_client_get_timeout(w->clients[i]);
+			if (hold >= 0 && now + (uint64_t)(hold * 1e9) < next_ns)
+				next_ns = now + (uint64_t)(hold * 1e9);
+			int events = chat_client_get_events(w->clients[i]);
+			pfds[i].fd = events != 0 ?
+				     chat_client_get_descriptor(w->clients[i]) :
+				     -1;
+			pfds[i].events = chat_events_to_poll_events(events);
+			pfds[i].revents = 0;
+		}
+		int timeout_ms = next_ns > now ?
+				 (int)((next_ns - now + 999999) / 1000000) : 0;
+		int rc = poll(pfds, w->count, timeout_ms);
+		for (int i = 0; i < w->count && rc > 0; ++i) {
+			if (pfds[i].revents == 0)
+				continue;
+			--rc;
+			bench_worker_receive(w, w->clients[i]);
+		}
+	}
+	free(pfds);
+	return NULL;
+}
+
+static volatile sig_atomic_t bench_is_stopped = 0;
+
+static void
+bench_on_term(int sig)
+{
+	(void)sig;
+	bench_is_stopped = 1;
+}
+
+/**
+ * The child process. Serves until SIGTERM, reports its port, and its
+ * stats at the exit.
+ */
+static void
+bench_server_run(int port_fd)
+{
+	signal(SIGTERM, bench_on_term);
+	struct chat_server_options so;
+	memset(&so, 0, sizeof(so));
+	so.thread_count = opts.server_thread_count;
+	so.backend = opts.backend;
+	so.use_udp = opts.use_udp;
+	struct chat_server *s = chat_server_new_with_options(&so);
+	uint16_t port = 0;
+	if (chat_server_listen(s, 0) == 0) {
+		struct sockaddr_in addr;
+		socklen_t len = sizeof(addr);
+		if (getsockname(chat_server_get_socket(s),
+				(struct sockaddr *)&addr, &len) == 0)
+			port = ntohs(addr.sin_port);
+	}
+	if (write(port_fd, &port, sizeof(port)) != sizeof(port) ||
+	    port == 0)
+		_exit(1);
+	while (!bench_is_stopped) {
+		chat_server_update(s, 0.1);
+		struct chat_message *msg;
+		while ((msg = chat_server_pop_next(s)) != NULL)
+			chat_message_delete(msg);
+	}
+	struct chat_server_stats stats;
+	chat_server_get_stats(s, &stats);
+	if (write(port_fd, &stats, sizeof(stats)) != sizeof(stats))
+		_exit(1);
+	close(port_fd);
+	chat_server_delete(s);
+	_exit(0);
+}
+
+/** Resident memory of the process in KB, or 0 if not known. */
+static long
+bench_rss_kb(pid_t pid)
+{
+	char path[64];
+	sprintf(path, "/proc/%d/statm", (int)pid);
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return 0;
+	long size = 0;
+	long rss = 0;
+	if (fscanf(f, "%ld %ld", &size, &rss) != 2)
+		rss = 0;
+	fclose(f);
+	return rss * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static double
+bench_cpu_sec(const struct rusage *ru)
+{
+	return ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6 +
+	       ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+}
+
+/** Fork the server and wait for its port. Aborts if it can't start. */
+static void
+bench_server_start(struct bench_server *server)
+{
+	int fds[2];
+	if (pipe(fds) != 0) {
+		perror("pipe");
+		abort();
+	}
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		abort();
+	}
+	if (pid == 0) {
+		close(fds[0]);
+		bench_server_run(fds[1]);
+	}
+	close(fds[1]);
+	server->pid = pid;
+	server->fd = fds[0];
+	server->port = 0;
+	if (read(fds[0], &server->port, sizeof(server->port)) !=
+	    sizeof(server->port) || server->port == 0) {
+		fprintf(stderr, "The server could not start\n");
+		waitpid(pid, NULL, 0);
+		abort();
+	}
+}
+
+/** Stop the server and put its CPU time, memory and stats to the info. */
+static void
+bench_server_stop(struct bench_server *server)
+{
+	long rss_kb = bench_rss_kb(server->pid);
+	kill(server->pid, SIGTERM);
+	struct chat_server_stats stats;
+	if (read(server->fd, &stats, sizeof(stats)) != sizeof(stats))
+		memset(&stats, 0, sizeof(stats));
+	close(server->fd);
+	struct rusage ru;
+	int status;
+	if (wait4(server->pid, &status, 0, &ru) < 0)
+		memset(&ru, 0, sizeof(ru));
+	char value[256];
+	snprintf(value, sizeof(value), "cpu_sec %.3f, rss %ld KB, "
+		 "max_rss %ld KB", bench_cpu_sec(&ru), rss_kb, ru.ru_maxrss);
+	bench_info("server", value);
+	if (opts.use_udp) {
+		snprintf(value, sizeof(value), "sends %llu, datagrams %llu",
+			 (unsigned long long)stats.udp_send_count,
+			 (unsigned long long)stats.udp_datagram_count);
+		bench_info("server_udp", value);
+	}
+}
+
+/** The messages of the whole run, all the clients sending. */
+static long
+bench_message_count(void)
+{
+	long send_count = (long)(opts.rate * opts.duration + 0.5);
+	if (send_count < 1)
+		send_count = 1;
+	return send_count * opts.client_count;
+}
+
+/** One run of the load. @a iterations are the messages to send. */
+static void
+bench_chat(long iterations, long arg)
+{
+	(void)arg;
+	bench_pause();
+	struct bench_server server;
+	bench_server_start(&server);
+	char addr[64];
+	sprintf(addr, "localhost:%u", server.port);
+	struct chat_client_options client_opts;
+	memset(&client_opts, 0, sizeof(client_opts));
+	client_opts.flush_window_us = opts.flush_us;
+	client_opts.use_udp = opts.use_udp;
+	struct chat_client **clients = malloc(opts.client_count *
+					      sizeof(clients[0]));
+	for (int i = 0; i < opts.client_count; ++i) {
+		clients[i] = chat_client_new_with_options("bench",
+							  &client_opts);
+		if (chat_client_connect(clients[i], addr) != 0) {
+			fprintf(stderr, "Could not connect client %d\n", i);
+			kill(server.pid, SIGTERM);
+			waitpid(server.pid, NULL, 0);
+			abort();
+		}
+	}
+	struct bench_worker *workers = calloc(opts.worker_count,
+					      sizeof(workers[0]));
+	uint64_t *next_send_ns = malloc(opts.client_count *
+					sizeof(next_send_ns[0]));
+	long share = opts.client_count / opts.worker_count;
+	struct rusage self_ru_start;
+	getrusage(RUSAGE_SELF, &self_ru_start);
+	bench_resume();
+	uint64_t start_ns = bench_clock_ns();
+	for (int i = 0; i < opts.worker_count; ++i) {
+		struct bench_worker *w = &workers[i];
+		w->first_id = i * share;
+		w->count = i + 1 < opts.worker_count ? share :
+			   opts.client_count - w->first_id;
+		w->clients = clients + w->first_id;
+		w->next_send_ns = next_send_ns + w->first_id;
+		w->send_count = iterations / opts.client_count;
+		w->start_ns = start_ns;
+		pthread_create(&w->thread, NULL, bench_worker_f, w);
+	}
+	for (int i = 0; i < opts.worker_count; ++i)
+		pthread_join(workers[i].thread, NULL);
+	bench_pause();
+	struct rusage self_ru;
+	getrusage(RUSAGE_SELF, &self_ru);
+	uint64_t sent = 0;
+	uint64_t received = 0;
+	uint64_t last_ns = start_ns;
+	uint64_t *hist = calloc(BENCH_HIST_SIZE, sizeof(hist[0]));
+	for (int i = 0; i < opts.worker_count; ++i) {
+		struct bench_worker *w = &workers[i];
+		sent += w->sent_count;
+		received += w->received_count;
+		if (w->last_receive_ns > last_ns)
+			last_ns = w->last_receive_ns;
+		for (int j = 0; j < BENCH_HIST_SIZE; ++j)
+			hist[j] += w->hist[j];
+	}
+	bench_server_stop(&server);
+	for (int i = 0; i < opts.client_count; ++i)
+		chat_client_delete(clients[i]);
+	free(clients);
+	free(next_send_ns);
+	free(workers);
+
+	uint64_t lat[5];
+	bench_hist_percentiles(hist, lat);
+	free(hist);
+	double sec = (last_ns - start_ns) / 1e9;
+	uint64_t expected = sent * (opts.client_count - 1);
+	char value[256];
+	snprintf(value, sizeof(value), "sent %llu, delivered %llu, "
+		 "ratio %.4f, per_sec %.0f, duration_sec %.3f",
+		 (unsigned long long)sent, (unsigned long long)received,
+		 expected > 0 ? (double)received / expected : 0,
+		 sec > 0 ? received / sec : 0, sec);
+	bench_info("delivered", value);
+	snprintf(value, sizeof(value), "p50 %llu, p90 %llu, p99 %llu, "
+		 "p999 %llu, max %llu", (unsigned long long)lat[0],
+		 (unsigned long long)lat[1], (unsigned long long)lat[2],
+		 (unsigned long long)lat[3], (unsigned long long)lat[4]);
+	bench_info("latency_ns", value);
+	snprintf(value, sizeof(value), "%.3f",
+		 bench_cpu_sec(&self_ru) - bench_cpu_sec(&self_ru_start));
+	bench_info("clients_cpu_sec", value);
+	bench_resume();
+}
+
+/**
+ * Take the load options out of argv, the rest are left for
+ * bench_main(). An option is --name=VALUE, or --udp.
+ */
+static bool
+bench_parse_options(int *argc, char **argv)
+{
+	static const char *const names[] = {
+		"--clients=", "--rate=", "--size=", "--duration=",
+		"--backend=", "--threads=", "--workers=", "--flush-us=",
+	};
+	enum { NAME_COUNT = sizeof(names) / sizeof(names[0]) };
+	int count = 1;
+	for (int i = 1; i < *argc; ++i) {
+		if (strcmp(argv[i], "--udp") == 0) {
+			opts.use_udp = true;
+			continue;
+		}
+		int j = 0;
+		while (j < NAME_COUNT &&
+		       strncmp(argv[i], names[j], strlen(names[j])) != 0)
+			++j;
+		if (j == NAME_COUNT) {
+			argv[count++] = argv[i];
+			continue;
+		}
+		const char *value = argv[i] + strlen(names[j]);
+		switch (j) {
+		case 0:
+			opts.client_count = atoi(value);
+			break;
+		case 1:
+			opts.rate = atof(value);
+			break;
+		case 2:
+			opts.msg_size = atoi(value);
+			break;
+		case 3:
+			opts.duration = atof(value);
+			break;
+		case 4:
+			if (strcmp(value, "poll") == 0)
+				opts.backend = CHAT_SERVER_BACKEND_POLL;
+			else if (strcmp(value, "uring") == 0)
+				opts.backend = CHAT_SERVER_BACKEND_URING;
+			else
+				return false;
+			break;
+		case 5:
+			opts.server_thread_count = atoi(value);
+			break;
+		case 6:
+			opts.worker_count = atoi(value);
+			break;
+		default:
+			opts.flush_us = atoi(value);
+			break;
+		}
+	}
+	*argc = count;
+	argv[count] = NULL;
+	return opts.client_count > 1 && opts.rate > 0 &&
+	       opts.msg_size >= BENCH_MSG_SIZE_MIN && opts.duration > 0 &&
+	       opts.server_thread_count >= 0 && opts.worker_count > 0 &&
+	       opts.worker_count <= opts.client_count && opts.flush_us >= 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	if (!bench_parse_options(&argc, argv)) {
+		fprintf(stderr, "Usage: %s [--clients=N] [--rate=MSG_PER_SEC] "
+			"[--size=BYTES] [--duration=SEC] "
+			"[--backend=poll|uring] [--threads=N] [--workers=N] "
+			"[--flush-us=N] [--udp] [bench_main() options]\n",
+			argv[0]);
+		return -1;
+	}
+	/* Thousands of clients, and the server has a socket for each. */
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+	const char *backend = opts.backend == CHAT_SERVER_BACKEND_URING ?
+			      "uring" : "poll";
+	const char *transport = opts.use_udp ? "udp" : "tcp";
+	char value[256];
+	snprintf(value, sizeof(value), "backend %s, server_threads %d, "
+		 "clients %d, workers %d, rate %.1f, size %d, flush_us %d, "
+		 "transport %s, duration_sec %.3f", backend,
+		 opts.server_thread_count, opts.client_count, opts.worker_count,
+		 opts.rate, opts.msg_size, opts.flush_us, transport,
+		 opts.duration);
+	bench_info("load_params", value);
+	static char name[64];
+	snprintf(name, sizeof(name), "broadcast_%s_%s", backend, transport);
+	bench_register(name, bench_chat, bench_message_count());
+	return bench_main(argc, argv);
+}
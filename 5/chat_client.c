@@ -1,81 +1,421 @@
 #include "chat.h"
 #include "chat_client.h"
+#include "chat_tls.h"
+#include "../3/lz.h"
 
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
 struct chat_client {
 	/** Socket connected to the server. */
 	int socket;
+	/** Name sent to the server in the hello frame. */
+	char *name;
 	/** Array of received messages. */
-	/* ... */
-	/** Output buffer. */
-	/* ... */
-	/* PUT HERE OTHER MEMBERS */
+	struct chat_message_queue messages;
+	/** Input buffer of the frames. */
+	struct chat_buffer in;
+	/** Output buffer of the frames. */
+	struct chat_buffer out;
+	/**
+	 * The fed text not ending with '\n' yet, and how much of it is
+	 * checked for '\n'.
+	 */
+	struct chat_buffer line;
+	size_t line_scan;
+	/** Names of the authors by the ids given by the server. */
+	struct chat_author_table authors;
+	/** The flush window in seconds, and its size limit. */
+	double flush_window;
+	size_t flush_size;
+	/**
+	 * When the held output has to be sent. 0 when nothing is held,
+	 * or the window is over and the output is being sent.
+	 */
+	double flush_deadline;
+	/** The socket is UDP, the frames go in datagrams. */
+	bool use_udp;
+	bool use_tls;
+	char *tls_ca_file;
+	/** The LZ dictionary, NULL when the messages are not compressed. */
+	char *lz_dict;
+	size_t lz_dict_size;
+#if CHAT_TLS
+	struct chat_tls_ctx *tls_ctx;
+	/** The handshake, until it is done. The output waits for it. */
+	struct chat_tls *tls;
+#endif
 };
 
+/** Monotonic time in seconds. */
+static double
+chat_client_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 struct chat_client *
 chat_client_new(const char *name)
 {
-	/* Ignore 'name' param if don't want to support it for +5 points. */
-	(void)name;
-
 	struct chat_client *client = calloc(1, sizeof(*client));
 	client->socket = -1;
+	client->name = strdup(name != NULL ? name : "");
+	return client;
+}
 
-	/* IMPLEMENT THIS FUNCTION */
-
+struct chat_client *
+chat_client_new_with_options(const char *name,
+			     const struct chat_client_options *opts)
+{
+	struct chat_client *client = chat_client_new(name);
+	client->flush_window = opts->flush_window_us / 1e6;
+	client->flush_size = opts->flush_size;
+	client->use_udp = opts->use_udp;
+	client->use_tls = opts->use_tls;
+	if (opts->tls_ca_file != NULL)
+		client->tls_ca_file = strdup(opts->tls_ca_file);
+	if (opts->use_lz) {
+		/* The same end of it as the server takes. */
+		const char *dict = opts->lz_dict;
+		size_t size = opts->lz_dict_size;
+		if (size > LZ_DICT_MAX_SIZE) {
+			dict += size - LZ_DICT_MAX_SIZE;
+			size = LZ_DICT_MAX_SIZE;
+		}
+		client->lz_dict = malloc(size + 1);
+		client->lz_dict_size = size;
+		if (size > 0)
+			memcpy(client->lz_dict, dict, size);
+	}
 	return client;
 }
 
-void
-chat_client_delete(struct chat_client *client)
+static void
+chat_client_close(struct chat_client *client)
 {
+	if (client->socket >= 0 && client->use_udp) {
+		/* No disconnect to see, so the server is told. */
+		char leave[CHAT_FRAME_HEADER_SIZE];
+		chat_frame_encode_header(leave, CHAT_FRAME_LEAVE, 0, 0);
+		ssize_t rc = send(client->socket, leave, sizeof(leave),
+				  MSG_NOSIGNAL);
+		(void)rc;
+	}
+#if CHAT_TLS
+	if (client->tls != NULL)
+		chat_tls_delete(client->tls);
+	client->tls = NULL;
+#endif
 	if (client->socket >= 0)
 		close(client->socket);
+	client->socket = -1;
+	chat_buffer_destroy(&client->out);
+}
 
-	/* IMPLEMENT THIS FUNCTION */
-
+void
+chat_client_delete(struct chat_client *client)
+{
+	chat_client_close(client);
+	chat_buffer_destroy(&client->in);
+	chat_buffer_destroy(&client->line);
+	chat_message_queue_destroy(&client->messages);
+	chat_author_table_destroy(&client->authors);
+#if CHAT_TLS
+	if (client->tls_ctx != NULL)
+		chat_tls_ctx_delete(client->tls_ctx);
+#endif
+	free(client->tls_ca_file);
+	free(client->lz_dict);
+	free(client->name);
 	free(client);
 }
 
+/** Send what the socket takes. */
+static int
+chat_client_send(struct chat_client *client)
+{
+#if CHAT_TLS
+	if (client->tls != NULL)
+		return 0;
+#endif
+	client->flush_deadline = 0;
+	int rc = client->use_udp ?
+		 chat_buffer_send_datagrams(&client->out, client->socket) :
+		 chat_buffer_send(&client->out, client->socket);
+	if (rc != 0) {
+		chat_client_close(client);
+		return -1;
+	}
+	return 0;
+}
+
+#if CHAT_TLS
+/**
+ * Go on with the handshake. -1 when it has failed, and the client is
+ * closed.
+ */
+static int
+chat_client_handshake(struct chat_client *client)
+{
+	int rc = chat_tls_handshake(client->tls);
+	if (rc == CHAT_ERR_TIMEOUT)
+		return 0;
+	chat_tls_delete(client->tls);
+	client->tls = NULL;
+	if (rc != 0) {
+		chat_client_close(client);
+		return -1;
+	}
+	return 0;
+}
+#endif
+
+/** Check the TLS options, and load the CAs on the first connect. */
+static int
+chat_client_prepare_tls(struct chat_client *client)
+{
+	if (!client->use_tls)
+		return 0;
+	if (client->use_udp)
+		return CHAT_ERR_INVALID_ARGUMENT;
+#if CHAT_TLS
+	if (client->tls_ctx == NULL)
+		client->tls_ctx = chat_tls_ctx_new_client(client->tls_ca_file);
+	return client->tls_ctx != NULL ? 0 : CHAT_ERR_INVALID_ARGUMENT;
+#else
+	return CHAT_ERR_NOT_IMPLEMENTED;
+#endif
+}
+
 int
 chat_client_connect(struct chat_client *client, const char *addr)
 {
+	if (client->socket >= 0)
+		return CHAT_ERR_ALREADY_STARTED;
+	int rc = chat_client_prepare_tls(client);
+	if (rc != 0)
+		return rc;
+	const char *sep = strrchr(addr, ':');
+	if (sep == NULL)
+		return CHAT_ERR_NO_ADDR;
+	size_t host_len = sep - addr;
+	char *host = malloc(host_len + 1);
+	memcpy(host, addr, host_len);
+	host[host_len] = 0;
+
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = client->use_udp ? SOCK_DGRAM : SOCK_STREAM;
+	struct addrinfo *info;
+	rc = getaddrinfo(host, sep + 1, &hints, &info);
+	if (rc != 0) {
+		free(host);
+		return CHAT_ERR_NO_ADDR;
+	}
+
+	int res = CHAT_ERR_SYS;
+	for (struct addrinfo *i = info; i != NULL; i = i->ai_next) {
+		int sock = socket(i->ai_family, i->ai_socktype, i->ai_protocol);
+		if (sock < 0)
+			continue;
+		/*
+		 * Connect blocking, so the errors are seen right here. The
+		 * rest of the work is non-blocking.
+		 */
+		if (connect(sock, i->ai_addr, i->ai_addrlen) != 0 ||
+		    chat_socket_set_nonblock(sock) != 0) {
+			close(sock);
+			continue;
+		}
+		if (client->flush_window > 0 && !client->use_udp) {
+			int on = 1;
+			setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on,
+				   sizeof(on));
+		}
+		client->socket = sock;
+		res = 0;
+		break;
+	}
+	freeaddrinfo(info);
+#if CHAT_TLS
+	if (res == 0 && client->use_tls) {
+		client->tls = chat_tls_new(client->tls_ctx, client->socket,
+					   host);
+		if (client->tls == NULL) {
+			chat_client_close(client);
+			res = CHAT_ERR_SYS;
+		}
+	}
+#endif
+	free(host);
+	if (res != 0)
+		return res;
 	/*
-	 * 1) Use getaddrinfo() to resolve addr to struct sockaddr_in.
-	 * 2) Create a client socket (function socket()).
-	 * 3) Connect it by the found address (function connect()).
+	 * The name goes once, then the messages only have the id. The
+	 * datagrams are always binary, with no magic.
 	 */
-	/* IMPLEMENT THIS FUNCTION */
-	(void)client;
-	(void)addr;
+	if (!client->use_udp) {
+		char magic = (char)CHAT_PROTO_MAGIC;
+		chat_buffer_append(&client->out, &magic, 1);
+	}
+	if (client->lz_dict != NULL && !client->use_udp) {
+		char features[CHAT_FEATURES_SIZE];
+		chat_encode_u32(features, CHAT_FEATURE_LZ);
+		chat_encode_u32(features + 4, chat_lz_dict_id(
+			client->lz_dict, client->lz_dict_size));
+		chat_buffer_append_frame(&client->out, CHAT_FRAME_FEATURES, 0,
+					 features, sizeof(features));
+	}
+	chat_buffer_append_frame(&client->out, CHAT_FRAME_HELLO, 0,
+				 client->name, strlen(client->name));
+#if CHAT_TLS
+	/* The hello waits for it. */
+	if (client->tls != NULL) {
+		if (chat_client_handshake(client) != 0)
+			return CHAT_ERR_SYS;
+		if (client->tls != NULL)
+			return 0;
+	}
+#endif
+	/* The server holds the output to the client until the name. */
+	if (chat_client_send(client) != 0) {
+		chat_client_close(client);
+		return CHAT_ERR_SYS;
+	}
+	return 0;
+}
 
-	return CHAT_ERR_NOT_IMPLEMENTED;
+/** Decompress the message. A broken one is skipped. */
+static void
+chat_client_push_lz(struct chat_client *client, const struct chat_frame *frame)
+{
+	const struct chat_slice *p = &frame->payload;
+	if (client->lz_dict == NULL || p->size < 4)
+		return;
+	size_t size = chat_decode_u32(p->data);
+	/* LZ4 can't squeeze more than 255 times. */
+	if (size > (p->size - 4) * 255)
+		return;
+	char *text = malloc(size + 1);
+	int rc = lz_decompress_dict(client->lz_dict, client->lz_dict_size,
+				    p->data + 4, p->size - 4, text, size);
+	if (rc < 0 || (size_t)rc != size) {
+		free(text);
+		return;
+	}
+	struct chat_author *author = chat_author_table_get(
+		&client->authors, frame->author_id);
+	chat_message_queue_push(&client->messages,
+				chat_message_new(text, size, author));
+	free(text);
+}
+
+/** Take the complete frames of the input. */
+static void
+chat_client_read_frames(struct chat_client *client)
+{
+	struct chat_frame frame;
+	while (chat_buffer_next_frame(&client->in, &frame)) {
+		const struct chat_slice *p = &frame.payload;
+		switch (frame.type) {
+		case CHAT_FRAME_NAME: {
+			struct chat_author *author = chat_author_new(
+				frame.author_id, p->data, p->size);
+			chat_author_table_put(&client->authors, author);
+			chat_author_unref(author);
+			break;
+		}
+		case CHAT_FRAME_LEAVE:
+			chat_author_table_del(&client->authors,
+					      frame.author_id);
+			break;
+		case CHAT_FRAME_PING:
+			/* Any input tells the server the client is alive. */
+			chat_buffer_append_frame(&client->out, CHAT_FRAME_PONG,
+						 0, NULL, 0);
+			break;
+		case CHAT_FRAME_MESSAGE: {
+			struct chat_author *author = chat_author_table_get(
+				&client->authors, frame.author_id);
+			chat_message_queue_push(&client->messages,
+						chat_message_new(p->data,
+								 p->size,
+								 author));
+			break;
+		}
+		case CHAT_FRAME_MESSAGE_LZ:
+			chat_client_push_lz(client, &frame);
+			break;
+		default:
+			break;
+		}
+	}
 }
 
 struct chat_message *
 chat_client_pop_next(struct chat_client *client)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)client;
-	return NULL;
+	return chat_message_queue_pop(&client->messages);
 }
 
 int
 chat_client_update(struct chat_client *client, double timeout)
 {
-	/*
-	 * The easiest way to wait for updates on a single socket with a timeout
-	 * is to use poll(). Epoll is good for many sockets, poll is good for a
-	 * few.
-	 *
-	 * You create one struct pollfd, fill it, call poll() on it, handle the
-	 * events (do read/write).
-	 */
-	(void)client;
-	(void)timeout;
-	return CHAT_ERR_NOT_IMPLEMENTED;
+	if (client->socket < 0)
+		return CHAT_ERR_NOT_STARTED;
+	struct pollfd pfd;
+	pfd.fd = client->socket;
+	pfd.events = chat_events_to_poll_events(
+		chat_client_get_events(client));
+	pfd.revents = 0;
+	int timeout_ms = timeout < 0 ? -1 : (int)(timeout * 1000);
+	double hold = chat_client_get_timeout(client);
+	bool is_held = hold >= 0 && (timeout < 0 || hold < timeout);
+	if (is_held) {
+		/* Rounded up, not to wake up before the window is over. */
+		timeout_ms = (int)(hold * 1000) + 1;
+	}
+	int rc = poll(&pfd, 1, timeout_ms);
+	if (rc < 0)
+		return errno == EINTR ? CHAT_ERR_TIMEOUT : CHAT_ERR_SYS;
+	if (rc == 0) {
+		if (!is_held)
+			return CHAT_ERR_TIMEOUT;
+		/* The window is over, the batch goes in one send. */
+		chat_client_send(client);
+		return 0;
+	}
+#if CHAT_TLS
+	if (client->tls != NULL) {
+		if (chat_client_handshake(client) != 0 || client->tls != NULL)
+			return 0;
+		/* Done. The held output goes, and the input can be there. */
+		pfd.revents = POLLIN | POLLOUT;
+	}
+#endif
+	if ((pfd.revents & POLLOUT) != 0 && chat_client_send(client) != 0)
+		return 0;
+	if ((pfd.revents & ~POLLOUT) != 0) {
+		ssize_t res = client->use_udp ?
+			      chat_buffer_recv_datagrams(&client->in,
+							 client->socket) :
+			      chat_buffer_recv(&client->in, client->socket);
+		chat_client_read_frames(client);
+		if (res < 0)
+			chat_client_close(client);
+	}
+	return 0;
 }
 
 int
@@ -87,20 +427,55 @@ chat_client_get_descriptor(const struct chat_client *client)
 int
 chat_client_get_events(const struct chat_client *client)
 {
-	/*
-	 * IMPLEMENT THIS FUNCTION - add OUTPUT event if has non-empty output
-	 * buffer.
-	 */
-	(void)client;
-	return CHAT_EVENT_INPUT;
+	if (client->socket < 0)
+		return 0;
+#if CHAT_TLS
+	if (client->tls != NULL)
+		return chat_tls_get_events(client->tls);
+#endif
+	int res = CHAT_EVENT_INPUT;
+	if (chat_buffer_len(&client->out) > 0 &&
+	    chat_client_get_timeout(client) < 0)
+		res |= CHAT_EVENT_OUTPUT;
+	return res;
+}
+
+double
+chat_client_get_timeout(const struct chat_client *client)
+{
+	if (client->flush_deadline == 0)
+		return -1;
+	double now = chat_client_now();
+	if (now >= client->flush_deadline)
+		return -1;
+	return client->flush_deadline - now;
 }
 
 int
 chat_client_feed(struct chat_client *client, const char *msg, uint32_t msg_size)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)client;
-	(void)msg;
-	(void)msg_size;
-	return CHAT_ERR_NOT_IMPLEMENTED;
+	if (client->socket < 0)
+		return CHAT_ERR_NOT_STARTED;
+	/* Each complete line is a frame, the rest waits for its end. */
+	chat_buffer_append(&client->line, msg, msg_size);
+	size_t old_len = chat_buffer_len(&client->out);
+	struct chat_slice slice;
+	while (chat_buffer_next_message(&client->line, &client->line_scan,
+					&slice)) {
+		chat_buffer_append_frame(&client->out, CHAT_FRAME_MESSAGE, 0,
+					 slice.data, slice.size);
+	}
+	chat_buffer_release_empty(&client->line);
+	if (client->flush_window == 0)
+		return 0;
+	size_t len = chat_buffer_len(&client->out);
+	if (client->flush_size > 0 && len >= client->flush_size) {
+		/* Big enough to go on the next update. */
+		client->flush_deadline = 0;
+	} else if (old_len == 0 && len > 0) {
+		/* The first message opens the window. */
+		client->flush_deadline = chat_client_now() +
+					 client->flush_window;
+	}
+	return 0;
 }
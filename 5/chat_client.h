@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 struct chat_client;
@@ -11,6 +13,51 @@ struct chat_client;
 struct chat_client *
 chat_client_new(const char *name);
 
+struct chat_client_options {
+	/**
+	 * How long the fed messages may wait to be sent together, in
+	 * microseconds. 0 sends them on the next update. The client
+	 * batches its output itself then, so the socket goes with
+	 * TCP_NODELAY.
+	 */
+	uint32_t flush_window_us;
+	/** Send right away when this many bytes wait. 0 is no limit. */
+	size_t flush_size;
+	/**
+	 * Talk to the UDP transport of the server instead of TCP. The
+	 * frames go in datagrams, which can be lost or reordered, and
+	 * the client leaves with a frame, not by a disconnect.
+	 */
+	bool use_udp;
+	/**
+	 * Talk TLS to the server. The handshake goes in the updates,
+	 * and the fed messages wait for it. Then the session is in the
+	 * kernel (kTLS), and the socket is used as a plain one. The
+	 * client is closed if the handshake fails, or the kernel has no
+	 * kTLS. Needs the client built with CHAT_TLS=1, and no UDP.
+	 */
+	bool use_tls;
+	/**
+	 * PEM file of the CAs to check the server's certificate by,
+	 * NULL is the system ones. The certificate has to be for the
+	 * host of the address connected to.
+	 */
+	const char *tls_ca_file;
+	/**
+	 * Ask the server for the compressed messages, by this
+	 * dictionary. A server with another one or with none sends them
+	 * plain. See chat_server_options.
+	 */
+	bool use_lz;
+	const char *lz_dict;
+	size_t lz_dict_size;
+};
+
+/** Create a new chat client with the given options. */
+struct chat_client *
+chat_client_new_with_options(const char *name,
+			     const struct chat_client_options *opts);
+
 /** Free all client's resources. */
 void
 chat_client_delete(struct chat_client *client);
@@ -26,6 +73,10 @@ chat_client_delete(struct chat_client *client);
  * @retval !=0 Error code.
  *     - CHAT_ERR_ALREADY_STARTED - the client is already connected.
  *     - CHAT_ERR_NO_ADDR - the addr couldn't be resolved to any IP.
+ *     - CHAT_ERR_INVALID_ARGUMENT - the CA file can't be used, or TLS
+ *       is asked together with UDP.
+ *     - CHAT_ERR_NOT_IMPLEMENTED - TLS is asked, and the client is
+ *       built with no CHAT_TLS.
  *     - CHAT_ERR_SYS - a system error, check errno.
  */
 int
@@ -79,6 +130,17 @@ chat_client_get_descriptor(const struct chat_client *client);
 int
 chat_client_get_events(const struct chat_client *client);
 
+/**
+ * Get the time in seconds till the output held by the flush window
+ * has to be sent. An external event loop should wait no longer and
+ * call chat_client_update() then.
+ *
+ * @retval >=0 Timeout.
+ * @retval <0 No output is held.
+ */
+double
+chat_client_get_timeout(const struct chat_client *client);
+
 /**
  * Feed a message to the client.
  *
@@ -18,7 +18,18 @@ main(int argc, char **argv)
 	}
 	const char *addr = argv[1];
 	const char *name = argc >= 3 ? argv[2] : "anon";
-	struct chat_client *cli = chat_client_new(name);
+	/*
+	 * An optional third argument turns TLS on, with the CA file to
+	 * check the server by, or '-' for the system CAs.
+	 */
+	struct chat_client_options opts;
+	memset(&opts, 0, sizeof(opts));
+	if (argc >= 4) {
+		opts.use_tls = true;
+		if (strcmp(argv[3], "-") != 0)
+			opts.tls_ca_file = argv[3];
+	}
+	struct chat_client *cli = chat_client_new_with_options(name, &opts);
 	int rc = chat_client_connect(cli, addr);
 	if (rc != 0) {
 		printf("Couldn't connect: %d\n", rc);
@@ -49,7 +60,10 @@ main(int argc, char **argv)
 		poll_client->events =
 			chat_events_to_poll_events(chat_client_get_events(cli));
 
-		int rc = poll(poll_fds, 2, -1);
+		/* The held output is due after this timeout. */
+		double timeout = chat_client_get_timeout(cli);
+		int rc = poll(poll_fds, 2, timeout < 0 ? -1 :
+			      (int)(timeout * 1000) + 1);
 		if (rc < 0) {
 			printf("Poll error: %d\n", errno);
 			break;
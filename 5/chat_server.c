@@ -1,143 +1,3373 @@
+/* For sendmmsg() and recvmmsg(). */
+#define _GNU_SOURCE
 #include "chat.h"
 #include "chat_server.h"
+#include "chat_tls.h"
+#include "chat_uring.h"
+#include "../3/lz.h"
+#include "../utils/trace.h"
 
+#include <errno.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#define CHAT_USE_EPOLL 1
+#else
+#include <sys/event.h>
+#define CHAT_USE_EPOLL 0
+#endif
+
+#if defined(__linux__) || defined(__FreeBSD__)
+#define CHAT_USE_MMSG 1
+#else
+#define CHAT_USE_MMSG 0
+/** The same as the others have, done by a loop of single calls. */
+struct mmsghdr {
+	struct msghdr msg_hdr;
+	unsigned int msg_len;
+};
+#endif
+
+enum {
+	/** Peer slots are allocated by blocks of this many. */
+	CHAT_PEER_BLOCK_SIZE = 1024,
+	/** Most events taken by one wait. */
+	CHAT_EVENT_BATCH = 128,
+	/**
+	 * Most blocks given to one sendmsg(). IOV_MAX is 1024 on Linux
+	 * and the BSDs, and the iovecs are on the stack.
+	 */
+	CHAT_SEND_IOV_COUNT = 256,
+	/** Slots of the timer wheel, a power of 2. */
+	CHAT_WHEEL_SIZE = 64,
+	/** Ticks of the wheel in the shortest timeout. */
+	CHAT_WHEEL_TICKS_PER_TIMEOUT = 16,
+	/** Datagrams taken by one recvmmsg(). */
+	CHAT_UDP_RECV_BATCH = 32,
+	/**
+	 * Most datagram messages and their iovecs given to one
+	 * sendmmsg(). UIO_MAXIOV is 1024.
+	 */
+	CHAT_UDP_SEND_BATCH = 1024,
+	/** Most segments of one UDP_SEGMENT send, the kernel's limit. */
+	CHAT_UDP_GSO_SEGMENTS = 64,
+};
+
+/**
+ * Immutable frame of a broadcast, shared by the output queues of all
+ * its receivers. A message to N peers costs one allocation, not N
+ * copies. The text peers get the payload and '\n' after it.
+ */
+struct chat_block {
+	/**
+	 * Number of the output queues holding the block. Atomic, the
+	 * shards of a server share the blocks.
+	 */
+	int ref_count;
+	/** Of the frame, for the shards learning the names. */
+	enum chat_frame_type type;
+	uint32_t author_id;
+	/** Size of the frame with the header. */
+	size_t size;
+	/**
+	 * The message frame compressed for the peers of the LZ feature,
+	 * once for all of them. NULL if it is not smaller.
+	 */
+	char *lz;
+	size_t lz_size;
+	char data[];
+};
+
+/** Make a frame block of the payload. */
+static struct chat_block *
+chat_block_new(enum chat_frame_type type, uint32_t author_id,
+	       const char *text, size_t len, int ref_count)
+{
+	size_t size = CHAT_FRAME_HEADER_SIZE + len;
+	struct chat_block *block = malloc(sizeof(*block) + size + 1);
+	block->ref_count = ref_count;
+	block->type = type;
+	block->author_id = author_id;
+	block->size = size;
+	block->lz = NULL;
+	chat_frame_encode_header(block->data, type, author_id, len);
+	if (len > 0)
+		memcpy(block->data + CHAT_FRAME_HEADER_SIZE, text, len);
+	block->data[size] = '\n';
+	return block;
+}
+
+/** The bytes of the block to send to a text or a binary peer. */
+static inline const char *
+chat_block_view(const struct chat_block *block, bool is_text, bool use_lz,
+		size_t *size)
+{
+	if (use_lz && block->lz != NULL) {
+		*size = block->lz_size;
+		return block->lz;
+	}
+	if (!is_text) {
+		*size = block->size;
+		return block->data;
+	}
+	*size = block->size - CHAT_FRAME_HEADER_SIZE + 1;
+	return block->data + CHAT_FRAME_HEADER_SIZE;
+}
+
+static inline void
+chat_block_unref(struct chat_block *block)
+{
+	if (__atomic_sub_fetch(&block->ref_count, 1, __ATOMIC_ACQ_REL) == 0) {
+		free(block->lz);
+		free(block);
+	}
+}
+
+/** Ring of the blocks to send, and how much of the first is sent. */
+struct chat_out_queue {
+	struct chat_block **blocks;
+	/** Power of 2. */
+	int capacity;
+	int first;
+	int count;
+	size_t offset;
+	/**
+	 * Total size of the blocks, the sent part of the first too. By
+	 * the frame sizes, close enough for the text peers.
+	 */
+	size_t size;
+	/** The blocks are sent as text lines. */
+	bool is_text;
+	/** The blocks are sent compressed, where they are. */
+	bool use_lz;
+};
+
+static void
+chat_out_queue_push(struct chat_out_queue *queue, struct chat_block *block)
+{
+	if (queue->count == queue->capacity) {
+		int capacity = queue->capacity > 0 ? queue->capacity * 2 : 8;
+		struct chat_block **blocks = malloc(capacity *
+						    sizeof(blocks[0]));
+		for (int i = 0; i < queue->count; ++i) {
+			blocks[i] = queue->blocks[(queue->first + i) &
+						  (queue->capacity - 1)];
+		}
+		free(queue->blocks);
+		queue->blocks = blocks;
+		queue->capacity = capacity;
+		queue->first = 0;
+	}
+	int pos = (queue->first + queue->count) & (queue->capacity - 1);
+	queue->blocks[pos] = block;
+	++queue->count;
+	queue->size += block->size;
+}
+
+/** Put the block first, when nothing is sent yet. */
+static void
+chat_out_queue_push_front(struct chat_out_queue *queue,
+			  struct chat_block *block)
+{
+	chat_out_queue_push(queue, block);
+	int mask = queue->capacity - 1;
+	for (int i = queue->count - 1; i > 0; --i) {
+		queue->blocks[(queue->first + i) & mask] =
+			queue->blocks[(queue->first + i - 1) & mask];
+	}
+	queue->blocks[queue->first] = block;
+}
+
+static void
+chat_out_queue_pop(struct chat_out_queue *queue)
+{
+	struct chat_block *block = queue->blocks[queue->first];
+	queue->size -= block->size;
+	chat_block_unref(block);
+	queue->first = (queue->first + 1) & (queue->capacity - 1);
+	--queue->count;
+	queue->offset = 0;
+	if (queue->count == 0) {
+		/* An idle peer holds no memory besides itself. */
+		free(queue->blocks);
+		queue->blocks = NULL;
+		queue->capacity = 0;
+		queue->first = 0;
+	}
+}
+
+/**
+ * Drop the block at @a index. The ones before it move one slot up,
+ * the first with its offset.
+ */
+static void
+chat_out_queue_drop(struct chat_out_queue *queue, int index)
+{
+	if (index == 0) {
+		chat_out_queue_pop(queue);
+		return;
+	}
+	int mask = queue->capacity - 1;
+	struct chat_block *block = queue->blocks[(queue->first + index) &
+						 mask];
+	for (int i = index; i > 0; --i) {
+		queue->blocks[(queue->first + i) & mask] =
+			queue->blocks[(queue->first + i - 1) & mask];
+	}
+	queue->first = (queue->first + 1) & mask;
+	--queue->count;
+	queue->size -= block->size;
+	chat_block_unref(block);
+}
+
+static void
+chat_out_queue_destroy(struct chat_out_queue *queue)
+{
+	while (queue->count > 0)
+		chat_out_queue_pop(queue);
+}
+
+/**
+ * Switch a queue, nothing sent from yet, to the text. The blocks not
+ * of the messages are dropped.
+ */
+static void
+chat_out_queue_set_text(struct chat_out_queue *queue)
+{
+	queue->is_text = true;
+	int mask = queue->capacity - 1;
+	int count = 0;
+	for (int i = 0; i < queue->count; ++i) {
+		struct chat_block *block =
+			queue->blocks[(queue->first + i) & mask];
+		if (block->type == CHAT_FRAME_MESSAGE) {
+			queue->blocks[(queue->first + count++) & mask] = block;
+			continue;
+		}
+		queue->size -= block->size;
+		chat_block_unref(block);
+	}
+	queue->count = count;
+	if (count == 0) {
+		free(queue->blocks);
+		queue->blocks = NULL;
+		queue->capacity = 0;
+		queue->first = 0;
+	}
+}
+
+/**
+ * Fill the iovecs with the first blocks of the queue, starting from
+ * the not sent part of the first one. Returns the iovec count.
+ */
+static int
+chat_out_queue_fill_iov(const struct chat_out_queue *queue,
+			struct iovec *iov)
+{
+	int count = queue->count < CHAT_SEND_IOV_COUNT ?
+		    queue->count : CHAT_SEND_IOV_COUNT;
+	for (int i = 0; i < count; ++i) {
+		struct chat_block *block = queue->blocks[
+			(queue->first + i) & (queue->capacity - 1)];
+		iov[i].iov_base = (char *)chat_block_view(block, queue->is_text,
+							  queue->use_lz,
+							  &iov[i].iov_len);
+	}
+	iov[0].iov_base = (char *)iov[0].iov_base + queue->offset;
+	iov[0].iov_len -= queue->offset;
+	return count;
+}
+
+/** Drop the sent blocks, keep the offset in a partial one. */
+static void
+chat_out_queue_advance(struct chat_out_queue *queue, size_t sent)
+{
+	while (sent > 0) {
+		struct chat_block *block = queue->blocks[queue->first];
+		size_t size;
+		chat_block_view(block, queue->is_text, queue->use_lz, &size);
+		size_t left = size - queue->offset;
+		if (sent < left) {
+			queue->offset += sent;
+			return;
+		}
+		sent -= left;
+		chat_out_queue_pop(queue);
+	}
+}
+
+/**
+ * Send as much as possible, many blocks per sendmsg(). Returns 0, or
+ * -1 if the socket is broken.
+ */
+static int
+chat_out_queue_send(struct chat_out_queue *queue, int socket)
+{
+	struct iovec iov[CHAT_SEND_IOV_COUNT];
+	while (queue->count > 0) {
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = chat_out_queue_fill_iov(queue, iov);
+		ssize_t rc = sendmsg(socket, &msg, MSG_NOSIGNAL);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -1;
+		}
+		chat_out_queue_advance(queue, rc);
+	}
+	return 0;
+}
+
+/** A ready descriptor, the same for epoll and kqueue. */
+struct chat_ready {
+	/** Peer, the shard's wakeup, or NULL for the listening socket. */
+	void *ptr;
+	/** Mask of chat_events. */
+	int events;
+};
+
+static int
+chat_poll_create(void)
+{
+#if CHAT_USE_EPOLL
+	return epoll_create1(EPOLL_CLOEXEC);
+#else
+	return kqueue();
+#endif
+}
+
+/**
+ * Add the socket to the poll once, edge-triggered, for input and
+ * optionally output.
+ */
+static int
+chat_poll_add(int poll_fd, int socket, void *ptr, bool need_output)
+{
+#if CHAT_USE_EPOLL
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLET;
+	if (need_output)
+		ev.events |= EPOLLOUT;
+	ev.data.ptr = ptr;
+	return epoll_ctl(poll_fd, EPOLL_CTL_ADD, socket, &ev);
+#else
+	struct kevent evs[2];
+	int count = 0;
+	EV_SET(&evs[count++], socket, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0,
+	       ptr);
+	if (need_output) {
+		EV_SET(&evs[count++], socket, EVFILT_WRITE, EV_ADD | EV_CLEAR,
+		       0, 0, ptr);
+	}
+	return kevent(poll_fd, evs, count, NULL, 0, NULL);
+#endif
+}
+
+static void
+chat_poll_del(int poll_fd, int socket, bool has_output)
+{
+#if CHAT_USE_EPOLL
+	(void)has_output;
+	epoll_ctl(poll_fd, EPOLL_CTL_DEL, socket, NULL);
+#else
+	struct kevent evs[2];
+	int count = 0;
+	EV_SET(&evs[count++], socket, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+	if (has_output) {
+		EV_SET(&evs[count++], socket, EVFILT_WRITE, EV_DELETE, 0, 0,
+		       NULL);
+	}
+	kevent(poll_fd, evs, count, NULL, 0, NULL);
+#endif
+}
+
+/** Wait for the ready descriptors. Returns their count or -1. */
+static int
+chat_poll_wait(int poll_fd, struct chat_ready *ready, int count,
+	       double timeout)
+{
+#if CHAT_USE_EPOLL
+	struct epoll_event evs[CHAT_EVENT_BATCH];
+	int timeout_ms = timeout < 0 ? -1 : (int)(timeout * 1000);
+	int rc = epoll_wait(poll_fd, evs, count, timeout_ms);
+	for (int i = 0; i < rc; ++i) {
+		ready[i].ptr = evs[i].data.ptr;
+		ready[i].events = 0;
+		/* Errors and hangups are found by recv(). */
+		if ((evs[i].events & ~EPOLLOUT) != 0)
+			ready[i].events |= CHAT_EVENT_INPUT;
+		if ((evs[i].events & EPOLLOUT) != 0)
+			ready[i].events |= CHAT_EVENT_OUTPUT;
+	}
+	return rc;
+#else
+	struct kevent evs[CHAT_EVENT_BATCH];
+	struct timespec ts;
+	struct timespec *tsp = NULL;
+	if (timeout >= 0) {
+		ts.tv_sec = (time_t)timeout;
+		ts.tv_nsec = (long)((timeout - ts.tv_sec) * 1e9);
+		tsp = &ts;
+	}
+	int rc = kevent(poll_fd, NULL, 0, evs, count, tsp);
+	for (int i = 0; i < rc; ++i) {
+		ready[i].ptr = evs[i].udata;
+		ready[i].events = evs[i].filter == EVFILT_WRITE ?
+				  CHAT_EVENT_OUTPUT : CHAT_EVENT_INPUT;
+	}
+	return rc;
+#endif
+}
+
+/** Blocks broadcast by one shard for another during an update. */
+struct chat_block_batch {
+	struct chat_block_batch *next;
+	int count;
+	int capacity;
+	struct chat_block *blocks[];
+};
+
+static struct chat_block_batch *
+chat_block_batch_push(struct chat_block_batch *batch, struct chat_block *block)
+{
+	if (batch == NULL) {
+		batch = malloc(sizeof(*batch) + 16 * sizeof(batch->blocks[0]));
+		batch->next = NULL;
+		batch->count = 0;
+		batch->capacity = 16;
+	} else if (batch->count == batch->capacity) {
+		batch->capacity *= 2;
+		batch = realloc(batch, sizeof(*batch) +
+				batch->capacity * sizeof(batch->blocks[0]));
+	}
+	batch->blocks[batch->count++] = block;
+	return batch;
+}
+
+static void
+chat_block_batch_delete(struct chat_block_batch *batch)
+{
+	for (int i = 0; i < batch->count; ++i)
+		chat_block_unref(batch->blocks[i]);
+	free(batch);
+}
+
+/**
+ * A descriptor to wake up a thread waiting in poll. Eventfd on Linux,
+ * a pipe elsewhere. It is written only when not signaled yet, so many
+ * pushes by other threads cost one syscall.
+ */
+struct chat_wakeup {
+	int read_fd;
+	int write_fd;
+	bool is_signaled;
+};
+
+static int
+chat_wakeup_open(struct chat_wakeup *w)
+{
+	w->is_signaled = false;
+#if CHAT_USE_EPOLL
+	w->read_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	w->write_fd = w->read_fd;
+	return w->read_fd >= 0 ? 0 : -1;
+#else
+	int fds[2];
+	if (pipe(fds) != 0)
+		return -1;
+	w->read_fd = fds[0];
+	w->write_fd = fds[1];
+	if (chat_socket_set_nonblock(fds[0]) != 0 ||
+	    chat_socket_set_nonblock(fds[1]) != 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+	return 0;
+#endif
+}
+
+static void
+chat_wakeup_close(struct chat_wakeup *w)
+{
+	if (w->read_fd < 0)
+		return;
+	close(w->read_fd);
+	if (w->write_fd != w->read_fd)
+		close(w->write_fd);
+	w->read_fd = -1;
+	w->write_fd = -1;
+}
+
+static void
+chat_wakeup_signal(struct chat_wakeup *w)
+{
+	if (__atomic_exchange_n(&w->is_signaled, true, __ATOMIC_SEQ_CST))
+		return;
+	uint64_t one = 1;
+	/* A full pipe is signaled anyway. */
+	ssize_t rc = write(w->write_fd, &one, CHAT_USE_EPOLL ? sizeof(one) : 1);
+	(void)rc;
+}
+
+/**
+ * Reset the wakeup. Has to be done before taking the pushed data, so
+ * a push after that signals again.
+ */
+static void
+chat_wakeup_drain(struct chat_wakeup *w)
+{
+	__atomic_store_n(&w->is_signaled, false, __ATOMIC_SEQ_CST);
+	uint64_t buf[16];
+	while (read(w->read_fd, buf, sizeof(buf)) > 0)
+		;
+}
+
+#if CHAT_USE_URING
+struct chat_uring_send {
+	struct msghdr msg;
+	struct iovec iov[CHAT_SEND_IOV_COUNT];
+};
+#endif
+
+enum chat_peer_proto {
+	/** Nothing is received yet. */
+	CHAT_PEER_PROTO_UNKNOWN,
+	CHAT_PEER_PROTO_TEXT,
+	CHAT_PEER_PROTO_BINARY,
+};
+
 struct chat_peer {
 	/** Client's socket. To read/write messages. */
 	int socket;
-	/** Output buffer. */
-	/* ... */
-	/* PUT HERE OTHER MEMBERS */
+	enum chat_peer_proto proto;
+	/**
+	 * A peer of the UDP transport has no socket, it is its address
+	 * on the shard's UDP socket.
+	 */
+	bool is_udp;
+	struct sockaddr_in addr;
+	/**
+	 * Name and id. NULL until the hello frame, or the first line of
+	 * a text peer. The output waits till then, so the names are
+	 * sent before the messages.
+	 */
+	struct chat_author *author;
+	/**
+	 * The name is sent to the others with the first message, so
+	 * the silent peers cost nothing to the rest.
+	 */
+	bool is_announced;
+	/** Index in the array of the connected peers. */
+	int index;
+	/** Input buffer, and how much of it is checked for '\n'. */
+	struct chat_buffer in;
+	size_t in_scan;
+	/** Output queue of the shared blocks. */
+	struct chat_out_queue out;
+	/** Got EAGAIN on send, so waits for a writable event. */
+	bool is_blocked;
+	/** Is in the list of the peers to flush. */
+	bool is_dirty;
+	/** Is closed, the slot is freed at the end of the update. */
+	bool is_closed;
+	/** The pause policy. Its output is over the limit. */
+	bool is_over;
+	/** Has input not read or not framed while the shard is paused. */
+	bool has_input;
+	/** Last input and last ping, for the idle timeouts. */
+	double active_time;
+	double ping_time;
+	/**
+	 * Tick of the peer's timer, and its links in the slot of the
+	 * wheel. The timer is not moved by the input, only checked
+	 * when it expires, so the input costs nothing.
+	 */
+	uint64_t timer_tick;
+	struct chat_peer *timer_next;
+	struct chat_peer **timer_prev;
+	/** Next peer to flush. */
+	struct chat_peer *next_dirty;
+	/** Next free slot, or next peer to free. */
+	struct chat_peer *next_free;
+#if CHAT_TLS
+	/**
+	 * The TLS handshake, until it is done. The input and output
+	 * wait for it, the socket has kTLS after it.
+	 */
+	struct chat_tls *tls;
+#endif
+#if CHAT_USE_URING
+	/**
+	 * io_uring requests in flight. A closed peer is freed when all
+	 * of them are done.
+	 */
+	int op_count;
+	/** Has a multishot receive armed. */
+	bool is_receiving;
+	/** Message of the send in flight. */
+	struct chat_uring_send *send;
+#endif
 };
 
-struct chat_server {
+/** The UDP peers by their addresses, open addressing. */
+struct chat_udp_table {
+	/** Power of 2 of them, NULL is a free one. */
+	struct chat_peer **slots;
+	uint32_t capacity;
+	uint32_t count;
+};
+
+static inline bool
+chat_addr_is_equal(const struct sockaddr_in *a, const struct sockaddr_in *b)
+{
+	return a->sin_addr.s_addr == b->sin_addr.s_addr &&
+	       a->sin_port == b->sin_port;
+}
+
+static inline uint32_t
+chat_udp_table_slot(const struct chat_udp_table *table,
+		    const struct sockaddr_in *addr)
+{
+	uint64_t key = (uint64_t)addr->sin_addr.s_addr << 16 | addr->sin_port;
+	return (uint32_t)((key * 0x9e3779b97f4a7c15ull) >> 32) &
+	       (table->capacity - 1);
+}
+
+static struct chat_peer *
+chat_udp_table_get(const struct chat_udp_table *table,
+		   const struct sockaddr_in *addr)
+{
+	if (table->count == 0)
+		return NULL;
+	uint32_t mask = table->capacity - 1;
+	for (uint32_t i = chat_udp_table_slot(table, addr);;
+	     i = (i + 1) & mask) {
+		struct chat_peer *peer = table->slots[i];
+		if (peer == NULL || chat_addr_is_equal(&peer->addr, addr))
+			return peer;
+	}
+}
+
+/** Put into the first free slot from the address's one. Never full. */
+static void
+chat_udp_table_insert(struct chat_udp_table *table, struct chat_peer *peer)
+{
+	uint32_t mask = table->capacity - 1;
+	uint32_t i = chat_udp_table_slot(table, &peer->addr);
+	while (table->slots[i] != NULL)
+		i = (i + 1) & mask;
+	table->slots[i] = peer;
+}
+
+/** Add a peer, its address is not in the table. */
+static void
+chat_udp_table_put(struct chat_udp_table *table, struct chat_peer *peer)
+{
+	/* At most 3/4 full, so the probes are short. */
+	if ((table->count + 1) * 4 > table->capacity * 3) {
+		struct chat_peer **slots = table->slots;
+		uint32_t capacity = table->capacity;
+		table->capacity = capacity > 0 ? capacity * 2 : 64;
+		table->slots = calloc(table->capacity, sizeof(slots[0]));
+		for (uint32_t i = 0; i < capacity; ++i) {
+			if (slots[i] != NULL)
+				chat_udp_table_insert(table, slots[i]);
+		}
+		free(slots);
+	}
+	chat_udp_table_insert(table, peer);
+	++table->count;
+}
+
+static void
+chat_udp_table_del(struct chat_udp_table *table, struct chat_peer *peer)
+{
+	uint32_t mask = table->capacity - 1;
+	uint32_t i = chat_udp_table_slot(table, &peer->addr);
+	while (table->slots[i] != peer)
+		i = (i + 1) & mask;
+	table->slots[i] = NULL;
+	--table->count;
+	/* Move up the rest of the probe chain, like the authors do. */
+	uint32_t hole = i;
+	for (i = (i + 1) & mask; table->slots[i] != NULL; i = (i + 1) & mask) {
+		uint32_t home = chat_udp_table_slot(table,
+						    &table->slots[i]->addr);
+		if (((i - home) & mask) < ((i - hole) & mask))
+			continue;
+		table->slots[hole] = table->slots[i];
+		table->slots[i] = NULL;
+		hole = i;
+	}
+}
+
+/**
+ * One sendmmsg() to the UDP peers. Message i has counts[i] blocks of
+ * the output of peers[i], which is pending[positions[i]].
+ */
+struct chat_udp_batch {
+	struct mmsghdr msgs[CHAT_UDP_SEND_BATCH];
+	struct iovec iov[CHAT_UDP_SEND_BATCH];
+	struct chat_peer *peers[CHAT_UDP_SEND_BATCH];
+	int counts[CHAT_UDP_SEND_BATCH];
+	int positions[CHAT_UDP_SEND_BATCH];
+	/** The UDP_SEGMENT size of a message of many blocks. */
+	union {
+		char buf[CMSG_SPACE(sizeof(uint16_t))];
+		struct cmsghdr align;
+	} controls[CHAT_UDP_SEND_BATCH];
+};
+
+/** The UDP transport of a shard. */
+struct chat_udp {
+	/** Bound to the port of the listening socket, or -1. */
+	int socket;
+	/** The kernel takes UDP_SEGMENT, a few datagrams per message. */
+	bool use_gso;
+	/** Got EAGAIN, the peers with output wait for a writable event. */
+	bool is_blocked;
+	/** Has datagrams not read while the shard is paused. */
+	bool has_input;
+	struct chat_udp_table peers;
+	/** The peers flushed in this update, to send all at once. */
+	struct chat_peer **pending;
+	int pending_count;
+	int pending_capacity;
+	struct chat_udp_batch *batch;
+	/** CHAT_UDP_RECV_BATCH buffers of the biggest datagram. */
+	char *recv_buf;
+	uint64_t send_count;
+	uint64_t datagram_count;
+};
+
+/**
+ * An event loop with its own listening socket and peers. A server
+ * has one shard run by chat_server_update(), or in the sharded mode
+ * many, each in its own thread.
+ */
+struct chat_shard {
+	struct chat_server *server;
 	/** Listening socket. To accept new clients. */
 	int socket;
-	/** Array of peers. */
-	/* ... */
-	/* PUT HERE OTHER MEMBERS */
+	/** Epoll or kqueue descriptor. */
+	int poll_fd;
+	struct chat_udp udp;
+#if CHAT_USE_URING
+	/** Is served by io_uring instead of the poll. */
+	bool use_uring;
+	struct chat_uring ring;
+#endif
+	/**
+	 * Blocks of the peer slots. A slot never moves, so the event
+	 * data can point at it.
+	 */
+	struct chat_peer **blocks;
+	int block_count;
+	struct chat_peer *free_peers;
+	/** The connected peers, densely, for the broadcasts. */
+	struct chat_peer **peers;
+	int peer_count;
+	int peer_capacity;
+	/** The peers with new output, flushed at the end of the update. */
+	struct chat_peer *dirty_peers;
+	/** The peers closed during the update. */
+	struct chat_peer *closed_peers;
+	/** Number of the peers with the not sent output. */
+	int out_peer_count;
+	/**
+	 * The pause policy. Number of the peers over the limit, the
+	 * reading is paused while there are any. And whether it is to
+	 * be resumed at the end of the update.
+	 */
+	int over_count;
+	bool need_resume;
+	/** Backpressure counters, see chat_server_stats. */
+	uint64_t drop_count;
+	uint64_t eviction_count;
+	uint64_t pause_count;
+	/**
+	 * Timer wheel of the idle timeouts, a list of the peers in each
+	 * slot, and the last tick done.
+	 */
+	struct chat_peer **wheel;
+	uint64_t wheel_tick;
+	/** Sent to the silent peers, shared by all of them. */
+	struct chat_block *ping_block;
+	uint64_t idle_count;
+	uint64_t ping_count;
+	/** Chunks for the input buffers of the peers. */
+	struct chat_chunk_pool chunks;
+	/** The authors of all the shards, for the new peers. */
+	struct chat_author_table authors;
+	/** The last messages of all the shards, for the new peers. */
+	struct chat_out_queue history;
+	/**
+	 * Sharded mode. Messages received in this update, the newest
+	 * first, and the oldest one to link the list to the server's
+	 * inbox.
+	 */
+	struct chat_message *received;
+	struct chat_message *received_last;
+	/** Broadcasts of this update for each other shard. */
+	struct chat_block_batch **outgoing;
+	/**
+	 * Batches pushed by the other shards, the newest first. Many
+	 * producers, one consumer, lock-free.
+	 */
+	struct chat_block_batch *incoming;
+	struct chat_wakeup wakeup;
+	pthread_t thread;
+	/** The numbers published for chat_server_get_stats(). */
+	struct chat_server_stats stats;
 };
 
+struct chat_server {
+	/** Number of the shard threads, 0 when not sharded. */
+	int thread_count;
+	enum chat_server_backend backend;
+	/** Limits of a peer's output, and what to do over them. */
+	size_t out_limit_size;
+	int out_limit_count;
+	enum chat_server_overflow overflow;
+	bool use_udp;
+	/** Limits of the history, see chat_server_options. */
+	int history_count;
+	size_t history_size;
+	/**
+	 * The LZ dictionary, its copy and its id. NULL when it is not
+	 * used.
+	 */
+	struct lz_dict *lz_dict;
+	char *lz_dict_data;
+	uint32_t lz_dict_id;
+	/** TLS files, see chat_server_options. */
+	char *tls_cert_file;
+	char *tls_key_file;
+#if CHAT_TLS
+	/** Shared by the shards. */
+	struct chat_tls_ctx *tls_ctx;
+#endif
+	/** Idle timeouts, and the tick of the timer wheels. 0 is none. */
+	double idle_timeout;
+	double keepalive_interval;
+	double timer_tick;
+	struct chat_shard *shards;
+	int shard_count;
+	bool is_started;
+	bool is_stopped;
+	/** Received messages. */
+	struct chat_message_queue messages;
+	/** The last author id given, atomic. */
+	uint32_t last_author_id;
+	/**
+	 * The messages fed to the server. Their author, announced with
+	 * the first of them, and the fed text not ending with '\n' yet.
+	 */
+	struct chat_author *author;
+	bool is_announced;
+	struct chat_buffer feed;
+	size_t feed_scan;
+	/** Not sharded mode. The fed blocks for the next update. */
+	struct chat_block_batch *feed_batch;
+	/**
+	 * Sharded mode. Messages pushed by the shards, the newest
+	 * first, and the wakeup when there are new ones.
+	 */
+	struct chat_message *inbox;
+	struct chat_wakeup wakeup;
+};
+
+/**
+ * Push the list [first, last] to a lock-free stack. The list must go
+ * from the newest to the oldest, then all the stack reversed is in
+ * the push order.
+ */
+#define CHAT_STACK_PUSH(head, first, last) do {				\
+	(last)->next = __atomic_load_n(head, __ATOMIC_RELAXED);		\
+	while (!__atomic_compare_exchange_n(head, &(last)->next, first,	\
+					    true, __ATOMIC_RELEASE,	\
+					    __ATOMIC_RELAXED))		\
+		;							\
+} while (0)
+
+/** Take all the stack in the push order. */
+#define CHAT_STACK_TAKE(head, type, res) do {				\
+	type *chat_node_ = __atomic_exchange_n(head, NULL,		\
+					       __ATOMIC_ACQUIRE);	\
+	(res) = NULL;							\
+	while (chat_node_ != NULL) {					\
+		type *chat_next_ = chat_node_->next;			\
+		chat_node_->next = (res);				\
+		(res) = chat_node_;					\
+		chat_node_ = chat_next_;				\
+	}								\
+} while (0)
+
+/** Monotonic time in seconds. */
+static double
+chat_server_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 struct chat_server *
 chat_server_new(void)
 {
-	struct chat_server *server = calloc(1, sizeof(*server));
-	server->socket = -1;
+	return chat_server_new_sharded(0);
+}
 
-	/* IMPLEMENT THIS FUNCTION */
+struct chat_server *
+chat_server_new_sharded(int thread_count)
+{
+	struct chat_server_options opts;
+	memset(&opts, 0, sizeof(opts));
+	opts.thread_count = thread_count;
+	opts.backend = CHAT_SERVER_BACKEND_POLL;
+	return chat_server_new_with_options(&opts);
+}
 
+struct chat_server *
+chat_server_new_with_options(const struct chat_server_options *opts)
+{
+	int thread_count = opts->thread_count;
+	struct chat_server *server = calloc(1, sizeof(*server));
+	server->backend = opts->backend;
+	server->out_limit_size = opts->out_limit_size;
+	server->out_limit_count = opts->out_limit_count > 0 ?
+				  opts->out_limit_count : 0;
+	server->overflow = opts->overflow;
+	server->use_udp = opts->use_udp;
+	server->history_count = opts->history_count > 0 ?
+				opts->history_count : 0;
+	server->history_size = opts->history_size;
+	if (opts->use_lz) {
+		/* Only the end of a big one can be referred to. */
+		const char *dict = opts->lz_dict;
+		size_t size = opts->lz_dict_size;
+		if (size > LZ_DICT_MAX_SIZE) {
+			dict += size - LZ_DICT_MAX_SIZE;
+			size = LZ_DICT_MAX_SIZE;
+		}
+		server->lz_dict_data = malloc(size + 1);
+		if (size > 0)
+			memcpy(server->lz_dict_data, dict, size);
+		server->lz_dict = malloc(sizeof(*server->lz_dict));
+		lz_dict_create(server->lz_dict, server->lz_dict_data, size);
+		server->lz_dict_id = chat_lz_dict_id(server->lz_dict_data,
+						     size);
+	}
+	if (opts->tls_cert_file != NULL) {
+		server->tls_cert_file = strdup(opts->tls_cert_file);
+		server->tls_key_file = strdup(opts->tls_key_file != NULL ?
+					      opts->tls_key_file :
+					      opts->tls_cert_file);
+	}
+	server->idle_timeout = opts->idle_timeout > 0 ? opts->idle_timeout : 0;
+	server->keepalive_interval = opts->keepalive_interval > 0 ?
+				     opts->keepalive_interval : 0;
+	double timeout = server->idle_timeout;
+	if (timeout == 0 || (server->keepalive_interval > 0 &&
+			     server->keepalive_interval < timeout))
+		timeout = server->keepalive_interval;
+	server->timer_tick = timeout / CHAT_WHEEL_TICKS_PER_TIMEOUT;
+	server->thread_count = thread_count > 0 ? thread_count : 0;
+	server->shard_count = thread_count > 0 ? thread_count : 1;
+	server->shards = calloc(server->shard_count,
+				sizeof(server->shards[0]));
+	for (int i = 0; i < server->shard_count; ++i) {
+		struct chat_shard *shard = &server->shards[i];
+		shard->server = server;
+		shard->socket = -1;
+		shard->poll_fd = -1;
+		shard->udp.socket = -1;
+		shard->wakeup.read_fd = -1;
+		shard->wakeup.write_fd = -1;
+#if CHAT_USE_URING
+		shard->ring.fd = -1;
+#endif
+		if (server->thread_count > 0) {
+			shard->outgoing = calloc(server->shard_count,
+						 sizeof(shard->outgoing[0]));
+		}
+		if (server->timer_tick > 0) {
+			shard->wheel = calloc(CHAT_WHEEL_SIZE,
+					      sizeof(shard->wheel[0]));
+			shard->wheel_tick = chat_server_now() /
+					    server->timer_tick;
+		}
+	}
+	server->wakeup.read_fd = -1;
+	server->wakeup.write_fd = -1;
 	return server;
 }
 
+/** Free the peer's resources and put the slot to the free list. */
+static void
+chat_shard_release_peer(struct chat_shard *shard, struct chat_peer *peer)
+{
+	if (peer->socket >= 0)
+		close(peer->socket);
+	peer->socket = -1;
+	chat_buffer_destroy(&peer->in);
+	chat_out_queue_destroy(&peer->out);
+	if (peer->author != NULL)
+		chat_author_unref(peer->author);
+	peer->author = NULL;
+#if CHAT_USE_URING
+	free(peer->send);
+	peer->send = NULL;
+#endif
+#if CHAT_TLS
+	if (peer->tls != NULL)
+		chat_tls_delete(peer->tls);
+	peer->tls = NULL;
+#endif
+	peer->next_free = shard->free_peers;
+	shard->free_peers = peer;
+}
+
+static inline bool
+chat_shard_uses_uring(const struct chat_shard *shard)
+{
+#if CHAT_USE_URING
+	return shard->use_uring;
+#else
+	(void)shard;
+	return false;
+#endif
+}
+
+static void
+chat_shard_destroy(struct chat_shard *shard)
+{
+#if CHAT_USE_URING
+	/* No more writes into the peers' memory. */
+	chat_uring_close(&shard->ring);
+#endif
+	bool use_poll = !chat_shard_uses_uring(shard);
+	for (int i = 0; i < shard->peer_count; ++i) {
+		struct chat_peer *peer = shard->peers[i];
+		if (use_poll && !peer->is_udp)
+			chat_poll_del(shard->poll_fd, peer->socket, true);
+		chat_shard_release_peer(shard, peer);
+	}
+	/* Closed peers are out of the array already. */
+	while (shard->closed_peers != NULL) {
+		struct chat_peer *peer = shard->closed_peers;
+		shard->closed_peers = peer->next_free;
+		chat_shard_release_peer(shard, peer);
+	}
+	if (shard->socket >= 0) {
+		if (use_poll)
+			chat_poll_del(shard->poll_fd, shard->socket, false);
+		close(shard->socket);
+	}
+	if (shard->udp.socket >= 0) {
+		chat_poll_del(shard->poll_fd, shard->udp.socket, true);
+		close(shard->udp.socket);
+	}
+	free(shard->udp.peers.slots);
+	free(shard->udp.pending);
+	free(shard->udp.batch);
+	free(shard->udp.recv_buf);
+	if (shard->wakeup.read_fd >= 0) {
+		if (use_poll) {
+			chat_poll_del(shard->poll_fd, shard->wakeup.read_fd,
+				      false);
+		}
+		chat_wakeup_close(&shard->wakeup);
+	}
+	if (shard->poll_fd >= 0)
+		close(shard->poll_fd);
+	for (int i = 0; i < shard->block_count; ++i)
+		free(shard->blocks[i]);
+	free(shard->blocks);
+	free(shard->peers);
+	/* The threads are stopped, nothing is pushed anymore. */
+	struct chat_block_batch *batch = shard->incoming;
+	while (batch != NULL) {
+		struct chat_block_batch *next = batch->next;
+		chat_block_batch_delete(batch);
+		batch = next;
+	}
+	free(shard->outgoing);
+	free(shard->wheel);
+	if (shard->ping_block != NULL)
+		chat_block_unref(shard->ping_block);
+	chat_chunk_pool_destroy(&shard->chunks);
+	chat_author_table_destroy(&shard->authors);
+	chat_out_queue_destroy(&shard->history);
+}
+
+/** Stop and join the first @a count shard threads. */
+static void
+chat_server_stop_threads(struct chat_server *server, int count)
+{
+	__atomic_store_n(&server->is_stopped, true, __ATOMIC_RELEASE);
+	for (int i = 0; i < count; ++i)
+		chat_wakeup_signal(&server->shards[i].wakeup);
+	for (int i = 0; i < count; ++i)
+		pthread_join(server->shards[i].thread, NULL);
+}
+
 void
 chat_server_delete(struct chat_server *server)
 {
-	if (server->socket >= 0)
-		close(server->socket);
+	if (server->thread_count > 0 && server->is_started)
+		chat_server_stop_threads(server, server->shard_count);
+	for (int i = 0; i < server->shard_count; ++i)
+		chat_shard_destroy(&server->shards[i]);
+	free(server->shards);
+	struct chat_message *msg = server->inbox;
+	while (msg != NULL) {
+		struct chat_message *next = msg->next;
+		chat_message_delete(msg);
+		msg = next;
+	}
+	chat_wakeup_close(&server->wakeup);
+	chat_message_queue_destroy(&server->messages);
+	if (server->feed_batch != NULL)
+		chat_block_batch_delete(server->feed_batch);
+	chat_buffer_destroy(&server->feed);
+	if (server->author != NULL)
+		chat_author_unref(server->author);
+#if CHAT_TLS
+	if (server->tls_ctx != NULL)
+		chat_tls_ctx_delete(server->tls_ctx);
+#endif
+	free(server->tls_cert_file);
+	free(server->tls_key_file);
+	free(server->lz_dict);
+	free(server->lz_dict_data);
+	free(server);
+}
 
-	/* IMPLEMENT THIS FUNCTION */
+#if CHAT_USE_URING
+static int
+chat_shard_open_uring(struct chat_shard *shard);
 
-	free(server);
+static void
+chat_shard_uring_wakeup(struct chat_shard *shard);
+#endif
+
+/**
+ * Open the shard's UDP socket on the port of its listening one. In
+ * the sharded mode it is SO_REUSEPORT too, and the kernel hashes
+ * each address to the same shard.
+ */
+static int
+chat_shard_listen_udp(struct chat_shard *shard)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	if (getsockname(shard->socket, (struct sockaddr *)&addr, &len) != 0)
+		return CHAT_ERR_SYS;
+	int sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sock < 0)
+		return CHAT_ERR_SYS;
+	int on = 1;
+	if (chat_socket_set_nonblock(sock) != 0)
+		goto error_sys;
+	if (shard->server->thread_count > 0 &&
+	    setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0)
+		goto error_sys;
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		if (errno == EADDRINUSE) {
+			close(sock);
+			return CHAT_ERR_PORT_BUSY;
+		}
+		goto error_sys;
+	}
+	/* A broadcast is many datagrams at once. Capped by the kernel. */
+	int size = 4 * 1024 * 1024;
+	setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	struct chat_udp *udp = &shard->udp;
+	udp->use_gso = false;
+#ifdef UDP_SEGMENT
+	int gso_size;
+	len = sizeof(gso_size);
+	udp->use_gso = getsockopt(sock, IPPROTO_UDP, UDP_SEGMENT, &gso_size,
+				  &len) == 0;
+#endif
+	udp->batch = malloc(sizeof(*udp->batch));
+	udp->recv_buf = malloc(CHAT_UDP_RECV_BATCH * CHAT_DATAGRAM_MAX);
+	udp->socket = sock;
+	return 0;
+
+error_sys:;
+	int err = errno;
+	close(sock);
+	errno = err;
+	return CHAT_ERR_SYS;
 }
 
-int
-chat_server_listen(struct chat_server *server, uint16_t port)
+/**
+ * Serve the listening socket in the shard, with the UDP one if needed,
+ * and open the poll. The socket is closed on error.
+ */
+static int
+chat_shard_listen_socket(struct chat_shard *shard, int sock)
+{
+	int rc;
+	if (chat_socket_set_nonblock(sock) != 0)
+		goto error_sys;
+	shard->socket = sock;
+	if (shard->server->use_udp && (rc = chat_shard_listen_udp(shard)) != 0)
+		goto error;
+#if CHAT_USE_URING
+	/* Fall back to the poll when io_uring is not available. */
+	if (shard->server->backend == CHAT_SERVER_BACKEND_URING &&
+	    !shard->server->use_udp && shard->server->tls_cert_file == NULL &&
+	    chat_shard_open_uring(shard) == 0)
+		return 0;
+#endif
+	int poll_fd = chat_poll_create();
+	if (poll_fd < 0)
+		goto error_sys;
+	if (chat_poll_add(poll_fd, sock, NULL, false) != 0 ||
+	    (shard->udp.socket >= 0 &&
+	     chat_poll_add(poll_fd, shard->udp.socket, &shard->udp,
+			   true) != 0)) {
+		close(poll_fd);
+		goto error_sys;
+	}
+	shard->poll_fd = poll_fd;
+	return 0;
+
+error_sys:
+	rc = CHAT_ERR_SYS;
+error:;
+	int err = errno;
+	close(sock);
+	shard->socket = -1;
+	if (shard->udp.socket >= 0) {
+		close(shard->udp.socket);
+		shard->udp.socket = -1;
+	}
+	errno = err;
+	return rc;
+}
+
+/**
+ * Open the shard's listening socket and poll. In the sharded mode all
+ * the shards listen on the same port with SO_REUSEPORT, and the
+ * kernel spreads the new connections among them.
+ */
+static int
+chat_shard_listen(struct chat_shard *shard, uint16_t port)
 {
 	struct sockaddr_in addr;
 	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
 	addr.sin_port = htons(port);
 	/* Listen on all IPs of this machine. */
 	addr.sin_addr.s_addr = htonl(INADDR_ANY);
 
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0)
+		return CHAT_ERR_SYS;
+	int on = 1;
+	if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0)
+		goto error_sys;
+	if (shard->server->thread_count > 0 &&
+	    setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0)
+		goto error_sys;
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		if (errno == EADDRINUSE) {
+			close(sock);
+			return CHAT_ERR_PORT_BUSY;
+		}
+		goto error_sys;
+	}
+	if (listen(sock, SOMAXCONN) != 0)
+		goto error_sys;
+	return chat_shard_listen_socket(shard, sock);
+
+error_sys:;
+	int err = errno;
+	close(sock);
+	errno = err;
+	return CHAT_ERR_SYS;
+}
+
+static void *
+chat_shard_thread_f(void *arg);
+
+/** Check what is needed before the listening, and make the TLS one. */
+static int
+chat_server_prepare_listen(struct chat_server *server)
+{
+	if (server->is_started)
+		return CHAT_ERR_ALREADY_STARTED;
+	if (server->tls_cert_file == NULL)
+		return 0;
+	if (server->use_udp)
+		return CHAT_ERR_INVALID_ARGUMENT;
+#if CHAT_TLS
+	if (server->tls_ctx == NULL) {
+		server->tls_ctx = chat_tls_ctx_new_server(
+			server->tls_cert_file, server->tls_key_file);
+	}
+	if (server->tls_ctx == NULL)
+		return CHAT_ERR_INVALID_ARGUMENT;
+	return 0;
+#else
+	return CHAT_ERR_NOT_IMPLEMENTED;
+#endif
+}
+
+/**
+ * Listen on the port, or on the given listening socket when it is not
+ * -1. Then all the shards accept from that one socket, each from its
+ * own dup() of it. The socket is closed on error.
+ */
+static int
+chat_server_listen_impl(struct chat_server *server, uint16_t port,
+			int sock)
+{
+	int rc = chat_server_prepare_listen(server);
+	if (rc != 0) {
+		if (sock >= 0)
+			close(sock);
+		return rc;
+	}
+	for (int i = 0; i < server->shard_count && rc == 0; ++i) {
+		struct chat_shard *shard = &server->shards[i];
+		if (sock >= 0) {
+			int fd = i == 0 ? sock : dup(sock);
+			rc = fd < 0 ? CHAT_ERR_SYS :
+			     chat_shard_listen_socket(shard, fd);
+			continue;
+		}
+		rc = chat_shard_listen(shard, port);
+		if (rc != 0 || port != 0)
+			continue;
+		/* The next shards join the port chosen by the kernel. */
+		struct sockaddr_in addr;
+		socklen_t len = sizeof(addr);
+		if (getsockname(shard->socket, (struct sockaddr *)&addr,
+				&len) != 0)
+			rc = CHAT_ERR_SYS;
+		port = ntohs(addr.sin_port);
+	}
+	if (rc != 0)
+		goto error;
+	if (server->thread_count == 0) {
+		server->is_started = true;
+		return 0;
+	}
+	if (chat_wakeup_open(&server->wakeup) != 0)
+		goto error_sys;
+	for (int i = 0; i < server->shard_count; ++i) {
+		struct chat_shard *shard = &server->shards[i];
+		if (chat_wakeup_open(&shard->wakeup) != 0)
+			goto error_sys;
+#if CHAT_USE_URING
+		if (shard->use_uring) {
+			chat_shard_uring_wakeup(shard);
+			continue;
+		}
+#endif
+		if (chat_poll_add(shard->poll_fd, shard->wakeup.read_fd,
+				  &shard->wakeup, false) != 0) {
+			chat_wakeup_close(&shard->wakeup);
+			goto error_sys;
+		}
+	}
+	for (int i = 0; i < server->shard_count; ++i) {
+		struct chat_shard *shard = &server->shards[i];
+		if (pthread_create(&shard->thread, NULL, chat_shard_thread_f,
+				   shard) != 0) {
+			int err = errno;
+			chat_server_stop_threads(server, i);
+			server->is_stopped = false;
+			errno = err;
+			goto error_sys;
+		}
+	}
+	server->is_started = true;
+	return 0;
+
+error_sys:
+	rc = CHAT_ERR_SYS;
+error:;
+	int saved = errno;
+	for (int i = 0; i < server->shard_count; ++i) {
+		struct chat_shard *shard = &server->shards[i];
+#if CHAT_USE_URING
+		chat_uring_close(&shard->ring);
+		shard->use_uring = false;
+#endif
+		if (shard->wakeup.read_fd >= 0) {
+			if (shard->poll_fd >= 0) {
+				chat_poll_del(shard->poll_fd,
+					      shard->wakeup.read_fd, false);
+			}
+			chat_wakeup_close(&shard->wakeup);
+		}
+		if (shard->socket >= 0) {
+			close(shard->socket);
+			shard->socket = -1;
+		}
+		if (shard->udp.socket >= 0) {
+			close(shard->udp.socket);
+			shard->udp.socket = -1;
+		}
+		if (shard->poll_fd >= 0) {
+			close(shard->poll_fd);
+			shard->poll_fd = -1;
+		}
+	}
+	chat_wakeup_close(&server->wakeup);
+	errno = saved;
+	return rc;
+}
+
+int
+chat_server_listen(struct chat_server *server, uint16_t port)
+{
+	return chat_server_listen_impl(server, port, -1);
+}
+
+int
+chat_server_listen_socket(struct chat_server *server, int sock)
+{
+	/* UDP would need an own port for each worker. */
+	if (server->use_udp) {
+		close(sock);
+		return CHAT_ERR_INVALID_ARGUMENT;
+	}
+	return chat_server_listen_impl(server, 0, sock);
+}
+
+/** Take a free slot, adding a block of them if there are none. */
+static struct chat_peer *
+chat_shard_alloc_peer(struct chat_shard *shard)
+{
+	if (shard->free_peers == NULL) {
+		struct chat_peer *block = calloc(CHAT_PEER_BLOCK_SIZE,
+						 sizeof(*block));
+		shard->blocks = realloc(shard->blocks,
+					(shard->block_count + 1) *
+					sizeof(shard->blocks[0]));
+		shard->blocks[shard->block_count++] = block;
+		for (int i = CHAT_PEER_BLOCK_SIZE - 1; i >= 0; --i) {
+			block[i].next_free = shard->free_peers;
+			shard->free_peers = &block[i];
+		}
+	}
+	struct chat_peer *peer = shard->free_peers;
+	shard->free_peers = peer->next_free;
+	memset(peer, 0, sizeof(*peer));
+	peer->in.pool = &shard->chunks;
+	return peer;
+}
+
+/**
+ * Let the kernel drop a dead peer too. Keepalive probes the silent
+ * ones, and the user timeout ends the ones not acking the sent data,
+ * both in about the idle timeout.
+ */
+static void
+chat_socket_set_timeouts(int sock, double timeout)
+{
+	int on = 1;
+	setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+#if defined(TCP_KEEPIDLE) && defined(TCP_KEEPINTVL) && defined(TCP_KEEPCNT)
+	int idle = timeout / 2 >= 1 ? (int)(timeout / 2) : 1;
+	int interval = timeout / 6 >= 1 ? (int)(timeout / 6) : 1;
+	int count = 3;
+	setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+	setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &interval,
+		   sizeof(interval));
+	setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+#endif
+#ifdef TCP_USER_TIMEOUT
+	unsigned ms = (unsigned)(timeout * 1000);
+	setsockopt(sock, IPPROTO_TCP, TCP_USER_TIMEOUT, &ms, sizeof(ms));
+#endif
+}
+
+/** Put the peer's timer to the wheel, by its next deadline. */
+static void
+chat_shard_timer_set(struct chat_shard *shard, struct chat_peer *peer);
+
+static inline bool
+chat_server_has_history(const struct chat_server *server)
+{
+	return server->history_count > 0 || server->history_size > 0;
+}
+
+/** Keep the message for the new peers, forget the oldest over limits. */
+static void
+chat_shard_history_push(struct chat_shard *shard, struct chat_block *block)
+{
+	const struct chat_server *server = shard->server;
+	struct chat_out_queue *history = &shard->history;
+	__atomic_add_fetch(&block->ref_count, 1, __ATOMIC_RELAXED);
+	chat_out_queue_push(history, block);
+	while (history->count > 0 &&
+	       ((server->history_count > 0 &&
+		 history->count > server->history_count) ||
+		(server->history_size > 0 &&
+		 history->size > server->history_size)))
+		chat_out_queue_pop(history);
+}
+
+/**
+ * Queue the history for the new peer, before anything else. It goes
+ * out after the join, like the rest.
+ */
+static void
+chat_shard_send_history(struct chat_shard *shard, struct chat_peer *peer)
+{
+	const struct chat_out_queue *history = &shard->history;
+	if (history->count == 0)
+		return;
+	int mask = history->capacity - 1;
+	for (int i = 0; i < history->count; ++i) {
+		struct chat_block *block =
+			history->blocks[(history->first + i) & mask];
+		__atomic_add_fetch(&block->ref_count, 1, __ATOMIC_RELAXED);
+		chat_out_queue_push(&peer->out, block);
+	}
+	++shard->out_peer_count;
+}
+
+/** Add the peer to the array of the connected ones. */
+static void
+chat_shard_add_peer(struct chat_shard *shard, struct chat_peer *peer)
+{
+	if (shard->peer_count == shard->peer_capacity) {
+		shard->peer_capacity = shard->peer_capacity > 0 ?
+				       shard->peer_capacity * 2 : 16;
+		shard->peers = realloc(shard->peers, shard->peer_capacity *
+				       sizeof(shard->peers[0]));
+	}
+	peer->index = shard->peer_count;
+	shard->peers[shard->peer_count++] = peer;
+	const struct chat_server *server = shard->server;
+	if (server->idle_timeout > 0 && !peer->is_udp)
+		chat_socket_set_timeouts(peer->socket, server->idle_timeout);
+	if (shard->wheel != NULL) {
+		peer->active_time = chat_server_now();
+		chat_shard_timer_set(shard, peer);
+	}
+	chat_shard_send_history(shard, peer);
+}
+
+static void
+chat_shard_accept(struct chat_shard *shard)
+{
+	while (true) {
+		int sock = accept(shard->socket, NULL, NULL);
+		if (sock < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			/* EAGAIN, or out of descriptors - retry later. */
+			return;
+		}
+		if (chat_socket_set_nonblock(sock) != 0) {
+			close(sock);
+			continue;
+		}
+		struct chat_peer *peer = chat_shard_alloc_peer(shard);
+		peer->socket = sock;
+#if CHAT_TLS
+		const struct chat_server *server = shard->server;
+		if (server->tls_ctx != NULL) {
+			peer->tls = chat_tls_new(server->tls_ctx, sock, NULL);
+			if (peer->tls == NULL)
+				goto error;
+		}
+#endif
+		if (chat_poll_add(shard->poll_fd, sock, peer, true) != 0)
+			goto error;
+		chat_shard_add_peer(shard, peer);
+		continue;
+	error:
+		chat_shard_release_peer(shard, peer);
+	}
+}
+
+/**
+ * Whether the peer's not sent output is over the limits scaled by
+ * @a halves / 2.
+ */
+static bool
+chat_shard_is_over(const struct chat_shard *shard,
+		   const struct chat_peer *peer, int halves)
+{
+	const struct chat_server *server = shard->server;
+	size_t size = peer->out.size - peer->out.offset;
+	if (server->out_limit_size > 0 &&
+	    size * 2 > server->out_limit_size * halves)
+		return true;
+	return server->out_limit_count > 0 &&
+	       peer->out.count * 2 > server->out_limit_count * halves;
+}
+
+/** The peer is not over the limit anymore, maybe resume the reading. */
+static void
+chat_shard_unmark_over(struct chat_shard *shard, struct chat_peer *peer)
+{
+	if (!peer->is_over)
+		return;
+	peer->is_over = false;
+	if (--shard->over_count == 0)
+		shard->need_resume = true;
+}
+
+static void
+chat_shard_timer_del(struct chat_peer *peer)
+{
+	if (peer->timer_prev == NULL)
+		return;
+	*peer->timer_prev = peer->timer_next;
+	if (peer->timer_next != NULL)
+		peer->timer_next->timer_prev = peer->timer_prev;
+	peer->timer_prev = NULL;
+	peer->timer_next = NULL;
+}
+
+/**
+ * Close the peer. The slot stays valid until the end of the update,
+ * because more events of this batch can point at it.
+ */
+static void
+chat_shard_close_peer(struct chat_shard *shard, struct chat_peer *peer)
+{
+	if (peer->is_closed)
+		return;
+	peer->is_closed = true;
+#if CHAT_USE_URING
+	if (shard->use_uring) {
+		/*
+		 * Cancel the requests on the socket. It is closed when the
+		 * slot is freed, after all of them are done.
+		 */
+		struct io_uring_sqe *sqe = chat_uring_get_sqe(&shard->ring);
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = peer->socket;
+		sqe->cancel_flags = IORING_ASYNC_CANCEL_FD |
+				    IORING_ASYNC_CANCEL_ALL;
+	} else
+#endif
+	if (peer->is_udp) {
+		chat_udp_table_del(&shard->udp.peers, peer);
+	} else {
+		chat_poll_del(shard->poll_fd, peer->socket, true);
+		close(peer->socket);
+		peer->socket = -1;
+	}
+	if (peer->out.count > 0)
+		--shard->out_peer_count;
+	chat_shard_unmark_over(shard, peer);
+	chat_shard_timer_del(peer);
+	struct chat_peer *last = shard->peers[--shard->peer_count];
+	last->index = peer->index;
+	shard->peers[peer->index] = last;
+	peer->next_free = shard->closed_peers;
+	shard->closed_peers = peer;
+}
+
+static void
+chat_shard_mark_dirty(struct chat_shard *shard, struct chat_peer *peer)
+{
+	if (peer->is_dirty || peer->is_blocked)
+		return;
+	peer->is_dirty = true;
+	peer->next_dirty = shard->dirty_peers;
+	shard->dirty_peers = peer;
+}
+
+/** Number of the first output blocks being sent, not to be dropped. */
+static int
+chat_peer_pinned_count(const struct chat_peer *peer)
+{
+#if CHAT_USE_URING
+	if (peer->send != NULL)
+		return (int)peer->send->msg.msg_iovlen;
+#endif
+	return peer->out.offset > 0 ? 1 : 0;
+}
+
+#if CHAT_USE_URING
+static void
+chat_shard_uring_pause(struct chat_shard *shard);
+#endif
+
+/** Apply the overflow policy to the peer after a push to its output. */
+static void
+chat_shard_check_limit(struct chat_shard *shard, struct chat_peer *peer)
+{
+	if (!chat_shard_is_over(shard, peer, 2))
+		return;
+	switch (shard->server->overflow) {
+	case CHAT_SERVER_OVERFLOW_DROP_OLDEST: {
+		/* The names stay, the messages would refer to them. */
+		struct chat_out_queue *out = &peer->out;
+		int index = chat_peer_pinned_count(peer);
+		while (chat_shard_is_over(shard, peer, 2)) {
+			while (index < out->count &&
+			       out->blocks[(out->first + index) &
+					   (out->capacity - 1)]->type !=
+			       CHAT_FRAME_MESSAGE)
+				++index;
+			if (index == out->count)
+				break;
+			chat_out_queue_drop(out, index);
+			++shard->drop_count;
+		}
+		if (peer->out.count == 0)
+			--shard->out_peer_count;
+		return;
+	}
+	case CHAT_SERVER_OVERFLOW_PAUSE:
+		if (chat_shard_is_over(shard, peer, 4))
+			break;
+		if (peer->is_over)
+			return;
+		peer->is_over = true;
+		if (shard->over_count++ > 0)
+			return;
+		++shard->pause_count;
+		shard->need_resume = false;
+#if CHAT_USE_URING
+		if (shard->use_uring)
+			chat_shard_uring_pause(shard);
+#endif
+		return;
+	case CHAT_SERVER_OVERFLOW_DISCONNECT:
+		break;
+	}
+	++shard->eviction_count;
+	chat_shard_close_peer(shard, peer);
+}
+
+/** The peer has sent some output, maybe it is under the limit now. */
+static inline void
+chat_shard_check_drained(struct chat_shard *shard, struct chat_peer *peer)
+{
+	if (peer->is_over && !chat_shard_is_over(shard, peer, 1))
+		chat_shard_unmark_over(shard, peer);
+}
+
+/** Queue the block for all the shard's peers except the author. */
+static void
+chat_shard_send_block(struct chat_shard *shard, struct chat_block *block,
+		      const struct chat_peer *author)
+{
+	bool is_message = block->type == CHAT_FRAME_MESSAGE;
+	if (is_message && chat_server_has_history(shard->server))
+		chat_shard_history_push(shard, block);
+	int receiver_count = shard->peer_count;
+	if (author != NULL)
+		--receiver_count;
+	if (receiver_count == 0)
+		return;
+	__atomic_add_fetch(&block->ref_count, receiver_count,
+			   __ATOMIC_RELAXED);
+	int skip_count = 0;
+	/* Backwards, an evicted peer is replaced by a visited one. */
+	for (int i = shard->peer_count - 1; i >= 0; --i) {
+		struct chat_peer *peer = shard->peers[i];
+		if (peer == author)
+			continue;
+		/* The text peers only get the messages. */
+		if (!is_message && peer->out.is_text) {
+			++skip_count;
+			continue;
+		}
+		if (peer->out.count == 0)
+			++shard->out_peer_count;
+		chat_out_queue_push(&peer->out, block);
+		chat_shard_mark_dirty(shard, peer);
+		chat_shard_check_limit(shard, peer);
+	}
+	/* The caller holds a reference too, so it is not freed here. */
+	if (skip_count > 0) {
+		__atomic_sub_fetch(&block->ref_count, skip_count,
+				   __ATOMIC_RELAXED);
+	}
+}
+
+static void
+chat_shard_timer_add(struct chat_shard *shard, struct chat_peer *peer,
+		     uint64_t tick)
+{
+	if (tick <= shard->wheel_tick)
+		tick = shard->wheel_tick + 1;
+	peer->timer_tick = tick;
+	struct chat_peer **slot = &shard->wheel[tick & (CHAT_WHEEL_SIZE - 1)];
+	peer->timer_next = *slot;
+	if (*slot != NULL)
+		(*slot)->timer_prev = &peer->timer_next;
+	peer->timer_prev = slot;
+	*slot = peer;
+}
+
+static void
+chat_shard_timer_set(struct chat_shard *shard, struct chat_peer *peer)
+{
+	const struct chat_server *server = shard->server;
+	double deadline = -1;
+	if (server->keepalive_interval > 0) {
+		double last = peer->active_time > peer->ping_time ?
+			      peer->active_time : peer->ping_time;
+		deadline = last + server->keepalive_interval;
+	}
+	if (server->idle_timeout > 0) {
+		double idle = peer->active_time + server->idle_timeout;
+		if (deadline < 0 || idle < deadline)
+			deadline = idle;
+	}
+	/* Rounded up, a tick is done when it is over. */
+	chat_shard_timer_add(shard, peer,
+			     (uint64_t)(deadline / server->timer_tick) + 1);
+}
+
+/** Ping the peer, or close it when it has been silent for too long. */
+static void
+chat_shard_timer_fire(struct chat_shard *shard, struct chat_peer *peer,
+		      double now)
+{
+	const struct chat_server *server = shard->server;
+	/* A paused shard does not read, the silence is not the peers'. */
+	if (shard->over_count > 0)
+		peer->active_time = now;
+	if (server->idle_timeout > 0 &&
+	    now >= peer->active_time + server->idle_timeout) {
+		++shard->idle_count;
+		chat_shard_close_peer(shard, peer);
+		return;
+	}
+	double last = peer->active_time > peer->ping_time ?
+		      peer->active_time : peer->ping_time;
+	if (server->keepalive_interval > 0 &&
+	    now >= last + server->keepalive_interval) {
+		peer->ping_time = now;
+		/* The text peers would print it, they only get the timeout. */
+		if (peer->proto == CHAT_PEER_PROTO_BINARY &&
+		    peer->author != NULL) {
+			if (shard->ping_block == NULL) {
+				shard->ping_block = chat_block_new(
+					CHAT_FRAME_PING, 0, NULL, 0, 1);
+			}
+			__atomic_add_fetch(&shard->ping_block->ref_count, 1,
+					   __ATOMIC_RELAXED);
+			if (peer->out.count == 0)
+				++shard->out_peer_count;
+			chat_out_queue_push(&peer->out, shard->ping_block);
+			chat_shard_mark_dirty(shard, peer);
+			++shard->ping_count;
+		}
+	}
+	chat_shard_timer_set(shard, peer);
+}
+
+/**
+ * Do the expired ticks of the wheel. Only the slots of these ticks
+ * are visited, so the cost is by the expired timers, not by all the
+ * peers. A timer of a later round of the wheel is put back.
+ *
+ * @retval true Some timers fired.
+ */
+static bool
+chat_shard_timer_run(struct chat_shard *shard)
+{
+	if (shard->wheel == NULL)
+		return false;
+	double now = chat_server_now();
+	uint64_t tick = now / shard->server->timer_tick;
+	if (tick <= shard->wheel_tick)
+		return false;
+	uint64_t count = tick - shard->wheel_tick;
+	if (count > CHAT_WHEEL_SIZE)
+		count = CHAT_WHEEL_SIZE;
+	uint64_t first = shard->wheel_tick + 1;
+	shard->wheel_tick = tick;
+	bool is_fired = false;
+	for (uint64_t i = 0; i < count; ++i) {
+		struct chat_peer **slot =
+			&shard->wheel[(first + i) & (CHAT_WHEEL_SIZE - 1)];
+		struct chat_peer *peer = *slot;
+		*slot = NULL;
+		while (peer != NULL) {
+			struct chat_peer *next = peer->timer_next;
+			peer->timer_prev = NULL;
+			peer->timer_next = NULL;
+			if (peer->timer_tick > tick) {
+				chat_shard_timer_add(shard, peer,
+						     peer->timer_tick);
+			} else {
+				chat_shard_timer_fire(shard, peer, now);
+				is_fired = true;
+			}
+			peer = next;
+		}
+	}
+	return is_fired;
+}
+
+/** Time till the next tick of the wheel, or the given timeout. */
+static double
+chat_shard_timer_timeout(const struct chat_shard *shard, double timeout)
+{
+	if (shard->wheel == NULL || shard->peer_count == 0)
+		return timeout;
+	double next = (shard->wheel_tick + 1) * shard->server->timer_tick -
+		      chat_server_now();
+	if (next < 0)
+		next = 0;
+	return timeout < 0 || next < timeout ? next : timeout;
+}
+
+/**
+ * Compress the message block for the peers of the LZ feature, if the
+ * server has it. Done once per message, before the block is shared.
+ */
+static void
+chat_server_compress(const struct chat_server *server,
+		     struct chat_block *block)
+{
+	size_t len = block->size - CHAT_FRAME_HEADER_SIZE;
+	if (server->lz_dict == NULL || block->type != CHAT_FRAME_MESSAGE ||
+	    len < CHAT_LZ_MIN_SIZE || len > INT32_MAX)
+		return;
+	enum { HEADER_SIZE = CHAT_FRAME_HEADER_SIZE + 4 };
+	char *lz = malloc(HEADER_SIZE + len);
+	/* Only if it is smaller with its size field too. */
+	int rc = lz_compress_dict(server->lz_dict,
+				  block->data + CHAT_FRAME_HEADER_SIZE, len,
+				  lz + HEADER_SIZE, len - 4 - 1);
+	if (rc == 0) {
+		free(lz);
+		return;
+	}
+	chat_frame_encode_header(lz, CHAT_FRAME_MESSAGE_LZ, block->author_id,
+				 4 + rc);
+	chat_encode_u32(lz + CHAT_FRAME_HEADER_SIZE, len);
+	block->lz_size = HEADER_SIZE + rc;
+	block->lz = realloc(lz, block->lz_size);
+}
+
+/**
+ * Send the frame to all the peers except its author, on this shard
+ * right away and on the others at the end of the update.
+ */
+static void
+chat_shard_broadcast(struct chat_shard *shard, enum chat_frame_type type,
+		     uint32_t author_id, const char *data, size_t size,
+		     const struct chat_peer *author)
+{
+	struct chat_server *server = shard->server;
+	if (server->thread_count == 0 && shard->peer_count <= 1 &&
+	    (type != CHAT_FRAME_MESSAGE || !chat_server_has_history(server)))
+		return;
+	/* The reference of this function. */
+	struct chat_block *block = chat_block_new(type, author_id, data, size,
+						  1);
+	chat_server_compress(server, block);
+	chat_shard_send_block(shard, block, author);
+	for (int i = 0; i < server->thread_count; ++i) {
+		if (&server->shards[i] == shard)
+			continue;
+		__atomic_add_fetch(&block->ref_count, 1, __ATOMIC_RELAXED);
+		shard->outgoing[i] = chat_block_batch_push(shard->outgoing[i],
+							   block);
+	}
+	chat_block_unref(block);
+}
+
+/** Give the received message to the server. */
+static void
+chat_shard_deliver(struct chat_shard *shard, struct chat_message *msg)
+{
+	if (shard->server->thread_count == 0) {
+		chat_message_queue_push(&shard->server->messages, msg);
+		return;
+	}
+	msg->next = shard->received;
+	shard->received = msg;
+	if (shard->received_last == NULL)
+		shard->received_last = msg;
+}
+
+#if CHAT_USE_URING
+static void
+chat_shard_uring_send(struct chat_shard *shard, struct chat_peer *peer);
+#endif
+
+/**
+ * Fill the message with the blocks of the peer's output from
+ * @a index, at most @a max_iov of them. Each block is a datagram.
+ * With GSO the next ones of the same size go in the same message,
+ * and the kernel splits it. Returns the number of the blocks taken.
+ */
+static int
+chat_udp_fill_msg(const struct chat_udp *udp, struct chat_peer *peer,
+		  int index, int max_iov, struct mmsghdr *msg,
+		  struct iovec *iov, void *control)
+{
+	const struct chat_out_queue *out = &peer->out;
+	int mask = out->capacity - 1;
+	const struct chat_block *block = out->blocks[(out->first + index) &
+						     mask];
+	size_t segment = block->size;
+	size_t total = segment;
+	iov[0].iov_base = (char *)block->data;
+	iov[0].iov_len = segment;
+	int count = 1;
+	int max = udp->use_gso ? CHAT_UDP_GSO_SEGMENTS : 1;
+	if (max > max_iov)
+		max = max_iov;
+	while (count < max && index + count < out->count) {
+		block = out->blocks[(out->first + index + count) & mask];
+		if (block->size > segment ||
+		    total + block->size > CHAT_DATAGRAM_MAX)
+			break;
+		iov[count].iov_base = (char *)block->data;
+		iov[count].iov_len = block->size;
+		total += block->size;
+		++count;
+		/* Only the last segment can be shorter. */
+		if (block->size < segment)
+			break;
+	}
+	memset(msg, 0, sizeof(*msg));
+	msg->msg_hdr.msg_name = &peer->addr;
+	msg->msg_hdr.msg_namelen = sizeof(peer->addr);
+	msg->msg_hdr.msg_iov = iov;
+	msg->msg_hdr.msg_iovlen = count;
+#ifdef UDP_SEGMENT
+	if (count > 1) {
+		msg->msg_hdr.msg_control = control;
+		msg->msg_hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg->msg_hdr);
+		cmsg->cmsg_level = IPPROTO_UDP;
+		cmsg->cmsg_type = UDP_SEGMENT;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+		uint16_t size = (uint16_t)segment;
+		memcpy(CMSG_DATA(cmsg), &size, sizeof(size));
+	}
+#else
+	(void)control;
+#endif
+	return count;
+}
+
+static int
+chat_udp_sendmmsg(int socket, struct mmsghdr *msgs, int count)
+{
+#if CHAT_USE_MMSG
+	return sendmmsg(socket, msgs, count, MSG_NOSIGNAL);
+#else
+	for (int i = 0; i < count; ++i) {
+		ssize_t rc = sendmsg(socket, &msgs[i].msg_hdr, MSG_NOSIGNAL);
+		if (rc < 0)
+			return i > 0 ? i : -1;
+		msgs[i].msg_len = rc;
+	}
+	return count;
+#endif
+}
+
+/** Drop the blocks of the first @a count messages, sent or failed. */
+static void
+chat_shard_udp_advance(struct chat_shard *shard, int count)
+{
+	struct chat_udp_batch *batch = shard->udp.batch;
+	for (int i = 0; i < count; ++i) {
+		struct chat_peer *peer = batch->peers[i];
+		for (int j = 0; j < batch->counts[i]; ++j)
+			chat_out_queue_pop(&peer->out);
+		shard->udp.datagram_count += batch->counts[i];
+		if (peer->out.count == 0)
+			--shard->out_peer_count;
+		chat_shard_check_drained(shard, peer);
+	}
+}
+
+/**
+ * Send the output of all the UDP peers flushed in this update, many
+ * peers per sendmmsg(). A broadcast to N peers costs N / 1024 calls.
+ * A datagram the kernel refuses is dropped, like a lost one.
+ */
+static void
+chat_shard_udp_flush(struct chat_shard *shard)
+{
+	struct chat_udp *udp = &shard->udp;
+	struct chat_udp_batch *batch = udp->batch;
+	int pos = 0;
+	int index = 0;
+	while (pos < udp->pending_count && !udp->is_blocked) {
+		int count = 0;
+		int iov_count = 0;
+		while (pos < udp->pending_count &&
+		       count < CHAT_UDP_SEND_BATCH &&
+		       iov_count < CHAT_UDP_SEND_BATCH) {
+			struct chat_peer *peer = udp->pending[pos];
+			if (peer->is_closed || index == peer->out.count) {
+				++pos;
+				index = 0;
+				continue;
+			}
+			int n = chat_udp_fill_msg(udp, peer, index,
+						  CHAT_UDP_SEND_BATCH -
+						  iov_count,
+						  &batch->msgs[count],
+						  &batch->iov[iov_count],
+						  batch->controls[count].buf);
+			batch->peers[count] = peer;
+			batch->counts[count] = n;
+			batch->positions[count] = pos;
+			index += n;
+			iov_count += n;
+			++count;
+		}
+		int sent = 0;
+		while (sent < count) {
+			int rc = chat_udp_sendmmsg(udp->socket,
+						   batch->msgs + sent,
+						   count - sent);
+			++udp->send_count;
+			if (rc >= 0) {
+				sent += rc;
+				continue;
+			}
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				udp->is_blocked = true;
+				break;
+			}
+			if (batch->counts[sent] > 1) {
+				/*
+				 * No GSO on the route, like a segment over
+				 * the MTU. Resend the rest without it.
+				 */
+				udp->use_gso = false;
+				break;
+			}
+			shard->drop_count += batch->counts[sent];
+			++sent;
+		}
+		chat_shard_udp_advance(shard, sent);
+		if (sent < count) {
+			/* The rest is at the front of the queues now. */
+			pos = batch->positions[sent];
+			index = 0;
+			continue;
+		}
+		/* The blocks taken so far are gone from the queues. */
+		index = 0;
+	}
+	if (udp->is_blocked) {
+		for (int i = 0; i < udp->pending_count; ++i) {
+			struct chat_peer *peer = udp->pending[i];
+			if (!peer->is_closed && peer->out.count > 0)
+				peer->is_blocked = true;
+		}
+	}
+	udp->pending_count = 0;
+}
+
+/** The UDP socket is writable, send the output of the blocked peers. */
+static void
+chat_shard_udp_unblock(struct chat_shard *shard)
+{
+	shard->udp.is_blocked = false;
+	for (int i = 0; i < shard->peer_count; ++i) {
+		struct chat_peer *peer = shard->peers[i];
+		if (peer->is_udp && peer->is_blocked) {
+			peer->is_blocked = false;
+			chat_shard_mark_dirty(shard, peer);
+		}
+	}
+}
+
+static void
+chat_shard_flush_peer(struct chat_shard *shard, struct chat_peer *peer)
+{
+	if (peer->is_closed || peer->out.count == 0 || peer->author == NULL)
+		return;
+	if (peer->is_udp) {
+		struct chat_udp *udp = &shard->udp;
+		if (udp->pending_count == udp->pending_capacity) {
+			udp->pending_capacity = udp->pending_capacity > 0 ?
+						udp->pending_capacity * 2 : 64;
+			udp->pending = realloc(udp->pending,
+					       udp->pending_capacity *
+					       sizeof(udp->pending[0]));
+		}
+		udp->pending[udp->pending_count++] = peer;
+		return;
+	}
+#if CHAT_USE_URING
+	if (shard->use_uring) {
+		chat_shard_uring_send(shard, peer);
+		return;
+	}
+#endif
+	if (chat_out_queue_send(&peer->out, peer->socket) != 0) {
+		chat_shard_close_peer(shard, peer);
+		return;
+	}
+	chat_shard_check_drained(shard, peer);
+	if (peer->out.count > 0) {
+		/* The edge-triggered poll reports when it is writable. */
+		peer->is_blocked = true;
+		return;
+	}
+	--shard->out_peer_count;
+}
+
+/** Give the peer a name and an id, and tell it the names of the others. */
+static void
+chat_shard_join(struct chat_shard *shard, struct chat_peer *peer,
+		const char *name, size_t name_len)
+{
+	uint32_t id = __atomic_add_fetch(&shard->server->last_author_id, 1,
+					 __ATOMIC_RELAXED);
+	peer->author = chat_author_new(id, name, name_len);
+	struct chat_author_table *authors = &shard->authors;
+	if (peer->proto == CHAT_PEER_PROTO_BINARY && authors->count > 0) {
+		/*
+		 * All the names in one block, ahead of the messages queued
+		 * while the peer was silent. A UDP peer gets as many as a
+		 * datagram takes per block.
+		 */
+		size_t limit = peer->is_udp ? CHAT_DATAGRAM_MAX : SIZE_MAX;
+		struct chat_block_batch *names = NULL;
+		uint32_t begin = 0;
+		while (begin < authors->capacity) {
+			size_t size = 0;
+			uint32_t end = begin;
+			for (; end < authors->capacity; ++end) {
+				const struct chat_author *a =
+					authors->slots[end];
+				if (a == NULL)
+					continue;
+				size_t frame = CHAT_FRAME_HEADER_SIZE +
+					       a->name_len;
+				if (size > 0 && size + frame > limit)
+					break;
+				size += frame;
+			}
+			if (size == 0)
+				break;
+			struct chat_block *block = malloc(sizeof(*block) +
+							  size);
+			block->ref_count = 1;
+			block->type = CHAT_FRAME_NAME;
+			block->author_id = 0;
+			block->size = size;
+			block->lz = NULL;
+			char *pos = block->data;
+			for (uint32_t i = begin; i < end; ++i) {
+				const struct chat_author *a = authors->slots[i];
+				if (a == NULL)
+					continue;
+				chat_frame_encode_header(pos, CHAT_FRAME_NAME,
+							 a->id, a->name_len);
+				memcpy(pos + CHAT_FRAME_HEADER_SIZE, a->name,
+				       a->name_len);
+				pos += CHAT_FRAME_HEADER_SIZE + a->name_len;
+			}
+			names = chat_block_batch_push(names, block);
+			begin = end;
+		}
+		if (peer->out.count == 0)
+			++shard->out_peer_count;
+		for (int i = names->count - 1; i >= 0; --i)
+			chat_out_queue_push_front(&peer->out, names->blocks[i]);
+		/* The queue has the references now. */
+		free(names);
+	}
+	/* The output held till now can go. */
+	chat_shard_mark_dirty(shard, peer);
+}
+
+/** Tell the others the peer's name, before its first message. */
+static void
+chat_shard_announce(struct chat_shard *shard, struct chat_peer *peer)
+{
+	struct chat_author *a = peer->author;
+	chat_author_table_put(&shard->authors, a);
+	chat_shard_broadcast(shard, CHAT_FRAME_NAME, a->id, a->name,
+			     a->name_len, peer);
+	peer->is_announced = true;
+}
+
+/** Tell the others the peer's id is free, if they know it. */
+static void
+chat_shard_leave(struct chat_shard *shard, struct chat_peer *peer)
+{
+	uint32_t id = peer->author->id;
+	chat_author_unref(peer->author);
+	peer->author = NULL;
+	if (!peer->is_announced)
+		return;
+	peer->is_announced = false;
+	chat_author_table_del(&shard->authors, id);
+	chat_shard_broadcast(shard, CHAT_FRAME_LEAVE, id, NULL, 0, NULL);
+}
+
+/** Broadcast and deliver a message of the peer. */
+static void
+chat_shard_on_message(struct chat_shard *shard, struct chat_peer *peer,
+		      const struct chat_slice *slice)
+{
+	if (!peer->is_announced)
+		chat_shard_announce(shard, peer);
+	/* The broadcast takes the text right from the input. */
+	chat_shard_broadcast(shard, CHAT_FRAME_MESSAGE, peer->author->id,
+			     slice->data, slice->size, peer);
+	chat_shard_deliver(shard, chat_message_new(slice->data, slice->size,
+						   peer->author));
+}
+
+/** The first byte of a peer tells its protocol. */
+static bool
+chat_shard_detect_proto(struct chat_shard *shard, struct chat_peer *peer)
+{
+	if (chat_buffer_len(&peer->in) == 0)
+		return false;
+	if ((unsigned char)peer->in.data[peer->in.pos] == CHAT_PROTO_MAGIC) {
+		chat_buffer_consume(&peer->in, 1);
+		peer->proto = CHAT_PEER_PROTO_BINARY;
+		return true;
+	}
+	/* A text peer has no name. */
+	peer->proto = CHAT_PEER_PROTO_TEXT;
+	bool had_out = peer->out.count > 0;
+	chat_out_queue_set_text(&peer->out);
+	if (had_out && peer->out.count == 0)
+		--shard->out_peer_count;
+	chat_shard_join(shard, peer, "", 0);
+	return true;
+}
+
+/**
+ * Take the features of the peer the server has too. Before its hello,
+ * when nothing is sent to it yet.
+ */
+static void
+chat_shard_set_features(struct chat_shard *shard, struct chat_peer *peer,
+			const struct chat_slice *payload)
+{
+	const struct chat_server *server = shard->server;
+	if (payload->size < CHAT_FEATURES_SIZE)
+		return;
+	uint32_t flags = chat_decode_u32(payload->data);
+	uint32_t dict_id = chat_decode_u32(payload->data + 4);
+	peer->out.use_lz = (flags & CHAT_FEATURE_LZ) != 0 &&
+			   server->lz_dict != NULL &&
+			   dict_id == server->lz_dict_id;
+}
+
+/** Handle the complete frames or lines of the peer's input. */
+static void
+chat_shard_frame_peer(struct chat_shard *shard, struct chat_peer *peer)
+{
+	if (peer->proto == CHAT_PEER_PROTO_UNKNOWN &&
+	    !chat_shard_detect_proto(shard, peer))
+		return;
+	struct chat_slice slice;
+	struct chat_frame frame;
+	if (peer->proto == CHAT_PEER_PROTO_TEXT) {
+		while (chat_buffer_next_message(&peer->in, &peer->in_scan,
+						&slice))
+			chat_shard_on_message(shard, peer, &slice);
+	}
+	while (peer->proto == CHAT_PEER_PROTO_BINARY &&
+	       chat_buffer_next_frame(&peer->in, &frame)) {
+		if (frame.type == CHAT_FRAME_HELLO && peer->author == NULL) {
+			chat_shard_join(shard, peer, frame.payload.data,
+					frame.payload.size);
+		} else if (frame.type == CHAT_FRAME_MESSAGE &&
+			   peer->author != NULL && frame.payload.size > 0) {
+			chat_shard_on_message(shard, peer, &frame.payload);
+		} else if (frame.type == CHAT_FRAME_FEATURES &&
+			   peer->author == NULL) {
+			chat_shard_set_features(shard, peer, &frame.payload);
+		}
+	}
+	chat_buffer_release_empty(&peer->in);
+}
+
+static void
+chat_shard_read_peer(struct chat_shard *shard, struct chat_peer *peer)
+{
 	/*
-	 * 1) Create a server socket (function socket()).
-	 * 2) Bind the server socket to addr (function bind()).
-	 * 3) Listen the server socket (function listen()).
-	 * 4) Create epoll/kqueue if needed.
+	 * The peers not named yet are read anyway, their output waits
+	 * for the hello.
 	 */
-	/* IMPLEMENT THIS FUNCTION */
-	(void)server;
+	if (shard->over_count > 0 && peer->author != NULL) {
+		/* Left in the kernel, so TCP slows the sender down. */
+		peer->has_input = true;
+		return;
+	}
+	peer->has_input = false;
+	ssize_t rc = chat_buffer_recv(&peer->in, peer->socket);
+	chat_shard_frame_peer(shard, peer);
+	if (rc < 0)
+		chat_shard_close_peer(shard, peer);
+}
 
-	return CHAT_ERR_NOT_IMPLEMENTED;
+/** A new UDP peer, by the address of its hello. */
+static struct chat_peer *
+chat_shard_udp_add_peer(struct chat_shard *shard,
+			const struct sockaddr_in *addr)
+{
+	struct chat_peer *peer = chat_shard_alloc_peer(shard);
+	peer->socket = -1;
+	peer->is_udp = true;
+	peer->addr = *addr;
+	peer->proto = CHAT_PEER_PROTO_BINARY;
+	chat_udp_table_put(&shard->udp.peers, peer);
+	chat_shard_add_peer(shard, peer);
+	return peer;
+}
+
+/**
+ * Handle the frames of a datagram. The ones from an unknown address
+ * are dropped until a hello, there is no connection to tell them.
+ */
+static void
+chat_shard_udp_on_datagram(struct chat_shard *shard,
+			   const struct sockaddr_in *addr, char *data,
+			   size_t size, double now)
+{
+	struct chat_peer *peer = chat_udp_table_get(&shard->udp.peers, addr);
+	if (peer != NULL)
+		peer->active_time = now;
+	/* Framed right in the receive buffer, it is not kept. */
+	struct chat_buffer in;
+	memset(&in, 0, sizeof(in));
+	in.data = data;
+	in.size = size;
+	in.capacity = size;
+	struct chat_frame frame;
+	while (chat_buffer_next_frame(&in, &frame)) {
+		if (peer == NULL) {
+			if (frame.type != CHAT_FRAME_HELLO)
+				continue;
+			peer = chat_shard_udp_add_peer(shard, addr);
+			chat_shard_join(shard, peer, frame.payload.data,
+					frame.payload.size);
+		} else if (frame.type == CHAT_FRAME_MESSAGE &&
+			   frame.payload.size > 0) {
+			chat_shard_on_message(shard, peer, &frame.payload);
+		} else if (frame.type == CHAT_FRAME_LEAVE) {
+			chat_shard_close_peer(shard, peer);
+			return;
+		}
+	}
+}
+
+static int
+chat_udp_recvmmsg(int socket, struct mmsghdr *msgs, int count)
+{
+#if CHAT_USE_MMSG
+	return recvmmsg(socket, msgs, count, 0, NULL);
+#else
+	for (int i = 0; i < count; ++i) {
+		ssize_t rc = recvmsg(socket, &msgs[i].msg_hdr, 0);
+		if (rc < 0)
+			return i > 0 ? i : -1;
+		msgs[i].msg_len = rc;
+	}
+	return count;
+#endif
+}
+
+/** Read the datagrams, many per recvmmsg(), until there are none. */
+static void
+chat_shard_udp_read(struct chat_shard *shard)
+{
+	struct chat_udp *udp = &shard->udp;
+	struct mmsghdr msgs[CHAT_UDP_RECV_BATCH];
+	struct iovec iov[CHAT_UDP_RECV_BATCH];
+	struct sockaddr_in addrs[CHAT_UDP_RECV_BATCH];
+	while (true) {
+		/* Left in the kernel, over its buffer they are lost. */
+		udp->has_input = shard->over_count > 0;
+		if (udp->has_input)
+			return;
+		for (int i = 0; i < CHAT_UDP_RECV_BATCH; ++i) {
+			iov[i].iov_base = udp->recv_buf + i * CHAT_DATAGRAM_MAX;
+			iov[i].iov_len = CHAT_DATAGRAM_MAX;
+			memset(&msgs[i], 0, sizeof(msgs[i]));
+			msgs[i].msg_hdr.msg_name = &addrs[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		int count = chat_udp_recvmmsg(udp->socket, msgs,
+					      CHAT_UDP_RECV_BATCH);
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		double now = shard->wheel != NULL ? chat_server_now() : 0;
+		for (int i = 0; i < count; ++i) {
+			if (msgs[i].msg_hdr.msg_namelen != sizeof(addrs[i]))
+				continue;
+			chat_shard_udp_on_datagram(shard, &addrs[i],
+						   iov[i].iov_base,
+						   msgs[i].msg_len, now);
+		}
+		/* Fewer than asked, so none are left till the next event. */
+		if (count < CHAT_UDP_RECV_BATCH)
+			return;
+	}
+}
+
+/**
+ * Send the broadcasts made elsewhere, by the other shards or fed to
+ * the server, to all the own peers. Frees the batch.
+ */
+static void
+chat_shard_take_batch(struct chat_shard *shard,
+		      struct chat_block_batch *batch)
+{
+	for (int i = 0; i < batch->count; ++i) {
+		struct chat_block *block = batch->blocks[i];
+		/* Learn the names of the authors of the others. */
+		if (block->type == CHAT_FRAME_NAME) {
+			size_t len = block->size - CHAT_FRAME_HEADER_SIZE;
+			struct chat_author *a = chat_author_new(
+				block->author_id,
+				block->data + CHAT_FRAME_HEADER_SIZE, len);
+			chat_author_table_put(&shard->authors, a);
+			chat_author_unref(a);
+		} else if (block->type == CHAT_FRAME_LEAVE) {
+			chat_author_table_del(&shard->authors,
+					      block->author_id);
+		}
+		chat_shard_send_block(shard, block, NULL);
+	}
+	chat_block_batch_delete(batch);
+}
+
+/** Send the broadcasts pushed by the other shards to the own peers. */
+static void
+chat_shard_read_incoming(struct chat_shard *shard)
+{
+	chat_wakeup_drain(&shard->wakeup);
+	struct chat_block_batch *batch;
+	CHAT_STACK_TAKE(&shard->incoming, struct chat_block_batch, batch);
+	while (batch != NULL) {
+		struct chat_block_batch *next = batch->next;
+		chat_shard_take_batch(shard, batch);
+		batch = next;
+	}
+}
+
+/** Hand over what this update produced for the other threads. */
+static void
+chat_shard_publish(struct chat_shard *shard)
+{
+	struct chat_server *server = shard->server;
+	for (int i = 0; i < server->thread_count; ++i) {
+		struct chat_block_batch *batch = shard->outgoing[i];
+		if (batch == NULL)
+			continue;
+		shard->outgoing[i] = NULL;
+		struct chat_shard *dst = &server->shards[i];
+		CHAT_STACK_PUSH(&dst->incoming, batch, batch);
+		chat_wakeup_signal(&dst->wakeup);
+	}
+	if (shard->received != NULL) {
+		CHAT_STACK_PUSH(&server->inbox, shard->received,
+				shard->received_last);
+		shard->received = NULL;
+		shard->received_last = NULL;
+		chat_wakeup_signal(&server->wakeup);
+	}
+	struct chat_server_stats *stats = &shard->stats;
+	__atomic_store_n(&stats->peer_count, shard->peer_count,
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&stats->peer_slot_count,
+			 shard->block_count * CHAT_PEER_BLOCK_SIZE,
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&stats->chunk_used_count, shard->chunks.used_count,
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&stats->chunk_used_peak, shard->chunks.used_peak,
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&stats->chunk_free_count, shard->chunks.free_count,
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&stats->chunk_big_count, shard->chunks.big_count,
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&stats->drop_count, shard->drop_count,
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&stats->eviction_count, shard->eviction_count,
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&stats->pause_count, shard->pause_count,
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&stats->idle_count, shard->idle_count,
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&stats->ping_count, shard->ping_count,
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&stats->udp_send_count, shard->udp.send_count,
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&stats->udp_datagram_count, shard->udp.datagram_count,
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&stats->history_count, shard->history.count,
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&stats->history_size, shard->history.size,
+			 __ATOMIC_RELAXED);
+}
+
+#if CHAT_USE_URING
+static void
+chat_shard_uring_resume(struct chat_shard *shard, struct chat_peer *peer);
+#endif
+
+/** Read the input left while the shard was paused. */
+static void
+chat_shard_resume(struct chat_shard *shard)
+{
+	if (shard->udp.has_input)
+		chat_shard_udp_read(shard);
+	/* Backwards, a closed peer is replaced by a visited one. */
+	for (int i = shard->peer_count - 1; i >= 0; --i) {
+		if (shard->over_count > 0)
+			return;
+		struct chat_peer *peer = shard->peers[i];
+#if CHAT_USE_URING
+		if (shard->use_uring) {
+			chat_shard_uring_resume(shard, peer);
+			continue;
+		}
+#endif
+		if (peer->has_input)
+			chat_shard_read_peer(shard, peer);
+	}
+}
+
+/** Flush the output and free the closed peers after the events. */
+static void
+chat_shard_end_update(struct chat_shard *shard)
+{
+	do {
+		while (shard->dirty_peers != NULL) {
+			struct chat_peer *peer = shard->dirty_peers;
+			shard->dirty_peers = peer->next_dirty;
+			peer->is_dirty = false;
+			chat_shard_flush_peer(shard, peer);
+		}
+		if (shard->udp.pending_count > 0)
+			chat_shard_udp_flush(shard);
+		if (shard->need_resume) {
+			/* The resumed input makes new output. */
+			shard->need_resume = false;
+			chat_shard_resume(shard);
+		}
+		/* The leaves can evict more peers, so in the loop. */
+		for (struct chat_peer *peer = shard->closed_peers;
+		     peer != NULL; peer = peer->next_free) {
+			if (peer->author != NULL)
+				chat_shard_leave(shard, peer);
+		}
+	} while (shard->dirty_peers != NULL);
+	struct chat_peer **next = &shard->closed_peers;
+	while (*next != NULL) {
+		struct chat_peer *peer = *next;
+#if CHAT_USE_URING
+		if (peer->op_count > 0) {
+			next = &peer->next_free;
+			continue;
+		}
+#endif
+		*next = peer->next_free;
+		chat_shard_release_peer(shard, peer);
+	}
+#if CHAT_USE_URING
+	if (shard->use_uring)
+		chat_uring_submit(&shard->ring);
+#endif
+	chat_shard_publish(shard);
+}
+
+#if CHAT_TLS
+/**
+ * Go on with the peer's TLS handshake. True when it is done, and the
+ * peer is like any other one from now on.
+ */
+static bool
+chat_shard_tls_step(struct chat_shard *shard, struct chat_peer *peer)
+{
+	int rc = chat_tls_handshake(peer->tls);
+	if (rc == CHAT_ERR_TIMEOUT)
+		return false;
+	chat_tls_delete(peer->tls);
+	peer->tls = NULL;
+	if (rc != 0) {
+		chat_shard_close_peer(shard, peer);
+		return false;
+	}
+	return true;
+}
+#endif
+
+static int
+chat_shard_update_poll(struct chat_shard *shard, double timeout)
+{
+	struct chat_ready ready[CHAT_EVENT_BATCH];
+	int count = chat_poll_wait(shard->poll_fd, ready, CHAT_EVENT_BATCH,
+				   timeout);
+	if (count < 0)
+		return errno == EINTR ? CHAT_ERR_TIMEOUT : CHAT_ERR_SYS;
+	if (count == 0)
+		return CHAT_ERR_TIMEOUT;
+	for (int i = 0; i < count; ++i) {
+		if (ready[i].ptr == NULL) {
+			chat_shard_accept(shard);
+			continue;
+		}
+		if (ready[i].ptr == &shard->wakeup) {
+			chat_shard_read_incoming(shard);
+			continue;
+		}
+		if (ready[i].ptr == &shard->udp) {
+			if ((ready[i].events & CHAT_EVENT_OUTPUT) != 0 &&
+			    shard->udp.is_blocked)
+				chat_shard_udp_unblock(shard);
+			if ((ready[i].events & CHAT_EVENT_INPUT) != 0)
+				chat_shard_udp_read(shard);
+			continue;
+		}
+		struct chat_peer *peer = ready[i].ptr;
+		if (peer->is_closed)
+			continue;
+#if CHAT_TLS
+		if (peer->tls != NULL) {
+			/* The edge is taken, so what is there is read. */
+			if (chat_shard_tls_step(shard, peer))
+				chat_shard_read_peer(shard, peer);
+			continue;
+		}
+#endif
+		if ((ready[i].events & CHAT_EVENT_OUTPUT) != 0 &&
+		    peer->is_blocked) {
+			peer->is_blocked = false;
+			chat_shard_mark_dirty(shard, peer);
+		}
+		if ((ready[i].events & CHAT_EVENT_INPUT) != 0) {
+			if (shard->wheel != NULL)
+				peer->active_time = chat_server_now();
+			chat_shard_read_peer(shard, peer);
+		}
+	}
+	chat_shard_end_update(shard);
+	return 0;
+}
+
+#if CHAT_USE_URING
+
+/**
+ * The io_uring backend. Accepts and receives are multishot requests,
+ * armed once and re-armed only when the kernel ends them. The data
+ * is received into the buffers provided to the kernel, a ring of
+ * them per shard, and copied into the peer's input. A peer has at
+ * most one send in flight, a sendmsg() of many blocks.
+ */
+
+/** Kind of a request, in the low bits of its user data. */
+enum chat_uring_op {
+	CHAT_OP_ACCEPT,
+	CHAT_OP_RECV,
+	CHAT_OP_SEND,
+	CHAT_OP_WAKEUP,
+	CHAT_OP_MASK = 3,
+};
+
+enum {
+	CHAT_URING_ENTRIES = 256,
+	CHAT_URING_BUF_COUNT = 64,
+};
+
+static inline uint64_t
+chat_uring_data(void *ptr, enum chat_uring_op op)
+{
+	return (uint64_t)(uintptr_t)ptr | op;
+}
+
+static void
+chat_shard_uring_accept(struct chat_shard *shard)
+{
+	struct io_uring_sqe *sqe = chat_uring_get_sqe(&shard->ring);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = shard->socket;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = chat_uring_data(shard, CHAT_OP_ACCEPT);
+}
+
+static void
+chat_shard_uring_recv(struct chat_shard *shard, struct chat_peer *peer)
+{
+	struct io_uring_sqe *sqe = chat_uring_get_sqe(&shard->ring);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = peer->socket;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = CHAT_URING_BUF_GROUP;
+	sqe->user_data = chat_uring_data(peer, CHAT_OP_RECV);
+	++peer->op_count;
+	peer->is_receiving = true;
+}
+
+/**
+ * Cancel the receives of all the peers. Multishot ones can not be
+ * just left alone, they would fill the input without a bound.
+ */
+static void
+chat_shard_uring_pause(struct chat_shard *shard)
+{
+	for (int i = 0; i < shard->peer_count; ++i) {
+		struct chat_peer *peer = shard->peers[i];
+		if (!peer->is_receiving || peer->author == NULL)
+			continue;
+		struct io_uring_sqe *sqe = chat_uring_get_sqe(&shard->ring);
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = chat_uring_data(peer, CHAT_OP_RECV);
+	}
+}
+
+/** Frame the input received while paused and receive again. */
+static void
+chat_shard_uring_resume(struct chat_shard *shard, struct chat_peer *peer)
+{
+	if (peer->has_input) {
+		peer->has_input = false;
+		chat_shard_frame_peer(shard, peer);
+	}
+	if (!peer->is_receiving && !peer->is_closed)
+		chat_shard_uring_recv(shard, peer);
+}
+
+static void
+chat_shard_uring_wakeup(struct chat_shard *shard)
+{
+	struct io_uring_sqe *sqe = chat_uring_get_sqe(&shard->ring);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = shard->wakeup.read_fd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = chat_uring_data(shard, CHAT_OP_WAKEUP);
+	chat_uring_submit(&shard->ring);
+}
+
+static int
+chat_shard_open_uring(struct chat_shard *shard)
+{
+	if (chat_uring_open(&shard->ring, CHAT_URING_ENTRIES,
+			    CHAT_URING_BUF_COUNT, CHAT_CHUNK_SIZE) != 0)
+		return -1;
+	shard->use_uring = true;
+	chat_shard_uring_accept(shard);
+	if (chat_uring_submit(&shard->ring) != 0) {
+		chat_uring_close(&shard->ring);
+		shard->use_uring = false;
+		return -1;
+	}
+	return 0;
+}
+
+static void
+chat_shard_uring_send(struct chat_shard *shard, struct chat_peer *peer)
+{
+	if (peer->send != NULL)
+		return;
+	struct chat_uring_send *send = malloc(sizeof(*send));
+	memset(&send->msg, 0, sizeof(send->msg));
+	send->msg.msg_iov = send->iov;
+	send->msg.msg_iovlen = chat_out_queue_fill_iov(&peer->out, send->iov);
+	peer->send = send;
+	struct io_uring_sqe *sqe = chat_uring_get_sqe(&shard->ring);
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = peer->socket;
+	sqe->addr = (uint64_t)(uintptr_t)&send->msg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = chat_uring_data(peer, CHAT_OP_SEND);
+	++peer->op_count;
+}
+
+static void
+chat_shard_uring_on_accept(struct chat_shard *shard, int res, unsigned flags)
+{
+	if ((flags & IORING_CQE_F_MORE) == 0)
+		chat_shard_uring_accept(shard);
+	if (res < 0)
+		return;
+	struct chat_peer *peer = chat_shard_alloc_peer(shard);
+	peer->socket = res;
+	chat_shard_add_peer(shard, peer);
+	/* When paused, the resume starts the receiving. */
+	if (shard->over_count == 0)
+		chat_shard_uring_recv(shard, peer);
+}
+
+static void
+chat_shard_uring_on_recv(struct chat_shard *shard, struct chat_peer *peer,
+			 int res, unsigned flags)
+{
+	bool is_done = (flags & IORING_CQE_F_MORE) == 0;
+	if (is_done) {
+		--peer->op_count;
+		peer->is_receiving = false;
+	}
+	if ((flags & IORING_CQE_F_BUFFER) != 0) {
+		unsigned id = flags >> IORING_CQE_BUFFER_SHIFT;
+		if (!peer->is_closed && res > 0) {
+			const char *data = chat_uring_buf(&shard->ring, id);
+			chat_buffer_append(&peer->in, data, res);
+		}
+		chat_uring_buf_recycle(&shard->ring, id);
+	}
+	if (peer->is_closed)
+		return;
+	bool is_paused = shard->over_count > 0 && peer->author != NULL;
+	if (res > 0 && shard->wheel != NULL)
+		peer->active_time = chat_server_now();
+	if (res > 0) {
+		if (is_paused)
+			peer->has_input = true;
+		else
+			chat_shard_frame_peer(shard, peer);
+	}
+	/*
+	 * Out of the provided buffers, they are back already. Or
+	 * cancelled by a pause, and the resume re-arms it.
+	 */
+	if (res == -ENOBUFS || res == -ECANCELED || (res > 0 && is_done)) {
+		if (is_done && !is_paused)
+			chat_shard_uring_recv(shard, peer);
+	} else if (res <= 0) {
+		chat_shard_close_peer(shard, peer);
+	}
+}
+
+static void
+chat_shard_uring_on_send(struct chat_shard *shard, struct chat_peer *peer,
+			 int res)
+{
+	--peer->op_count;
+	free(peer->send);
+	peer->send = NULL;
+	if (peer->is_closed)
+		return;
+	if (res < 0) {
+		chat_shard_close_peer(shard, peer);
+		return;
+	}
+	chat_out_queue_advance(&peer->out, res);
+	chat_shard_check_drained(shard, peer);
+	if (peer->out.count > 0)
+		chat_shard_uring_send(shard, peer);
+	else
+		--shard->out_peer_count;
+}
+
+static int
+chat_shard_update_uring(struct chat_shard *shard, double timeout)
+{
+	struct chat_uring *ring = &shard->ring;
+	if (chat_uring_wait(ring, timeout) != 0)
+		return CHAT_ERR_SYS;
+	int count = 0;
+	struct io_uring_cqe *cqe;
+	while ((cqe = chat_uring_peek(ring)) != NULL) {
+		uint64_t data = cqe->user_data;
+		int res = cqe->res;
+		unsigned flags = cqe->flags;
+		chat_uring_seen(ring);
+		++count;
+		void *ptr = (void *)(uintptr_t)(data & ~(uint64_t)CHAT_OP_MASK);
+		switch (data & CHAT_OP_MASK) {
+		case CHAT_OP_ACCEPT:
+			/* The cancels have no user data. */
+			if (ptr != NULL)
+				chat_shard_uring_on_accept(shard, res, flags);
+			break;
+		case CHAT_OP_RECV:
+			chat_shard_uring_on_recv(shard, ptr, res, flags);
+			break;
+		case CHAT_OP_SEND:
+			chat_shard_uring_on_send(shard, ptr, res);
+			break;
+		case CHAT_OP_WAKEUP:
+			if ((flags & IORING_CQE_F_MORE) == 0)
+				chat_shard_uring_wakeup(shard);
+			chat_shard_read_incoming(shard);
+			break;
+		}
+	}
+	if (count == 0)
+		return CHAT_ERR_TIMEOUT;
+	chat_shard_end_update(shard);
+	return 0;
+}
+
+#endif /* CHAT_USE_URING */
+
+static int
+chat_shard_update(struct chat_shard *shard, double timeout)
+{
+	int rc;
+	double wait = chat_shard_timer_timeout(shard, timeout);
+	/* The slice includes the wait for the events. */
+	trace_begin("chat_shard_update", 0);
+#if CHAT_USE_URING
+	if (shard->use_uring)
+		rc = chat_shard_update_uring(shard, wait);
+	else
+#endif
+	rc = chat_shard_update_poll(shard, wait);
+	if ((rc == 0 || rc == CHAT_ERR_TIMEOUT) && chat_shard_timer_run(shard)) {
+		/* The pings and the closed peers are like the events. */
+		chat_shard_end_update(shard);
+		rc = 0;
+	}
+	trace_end("chat_shard_update", rc);
+	return rc;
+}
+
+static void *
+chat_shard_thread_f(void *arg)
+{
+	struct chat_shard *shard = arg;
+	struct chat_server *server = shard->server;
+	trace_set_thread_name("chat shard");
+	while (!__atomic_load_n(&server->is_stopped, __ATOMIC_ACQUIRE))
+		chat_shard_update(shard, -1);
+	return NULL;
+}
+
+/** Move the messages pushed by the shards to the server's queue. */
+static bool
+chat_server_take_inbox(struct chat_server *server)
+{
+	struct chat_message *msg;
+	CHAT_STACK_TAKE(&server->inbox, struct chat_message, msg);
+	if (msg == NULL)
+		return false;
+	while (msg != NULL) {
+		struct chat_message *next = msg->next;
+		chat_message_queue_push(&server->messages, msg);
+		msg = next;
+	}
+	return true;
 }
 
 struct chat_message *
 chat_server_pop_next(struct chat_server *server)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)server;
-	return NULL;
+	struct chat_message *msg = chat_message_queue_pop(&server->messages);
+	if (msg == NULL && server->thread_count > 0 &&
+	    chat_server_take_inbox(server))
+		msg = chat_message_queue_pop(&server->messages);
+	return msg;
+}
+
+static int
+chat_server_update_impl(struct chat_server *server, double timeout)
+{
+	if (!server->is_started)
+		return CHAT_ERR_NOT_STARTED;
+	if (server->thread_count == 0) {
+		struct chat_shard *shard = &server->shards[0];
+		struct chat_block_batch *batch = server->feed_batch;
+		if (batch == NULL)
+			return chat_shard_update(shard, timeout);
+		/* The peers connected by now get the fed messages too. */
+		int rc = chat_shard_update(shard, 0);
+		if (rc != 0 && rc != CHAT_ERR_TIMEOUT)
+			return rc;
+		server->feed_batch = NULL;
+		chat_shard_take_batch(shard, batch);
+		chat_shard_end_update(shard);
+		return 0;
+	}
+	/* The shards do all the work, only wait for their messages. */
+	chat_wakeup_drain(&server->wakeup);
+	if (chat_server_take_inbox(server))
+		return 0;
+	struct pollfd pfd;
+	pfd.fd = server->wakeup.read_fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	int timeout_ms = timeout < 0 ? -1 : (int)(timeout * 1000);
+	int rc = poll(&pfd, 1, timeout_ms);
+	if (rc < 0)
+		return errno == EINTR ? CHAT_ERR_TIMEOUT : CHAT_ERR_SYS;
+	chat_wakeup_drain(&server->wakeup);
+	return chat_server_take_inbox(server) ? 0 : CHAT_ERR_TIMEOUT;
 }
 
 int
 chat_server_update(struct chat_server *server, double timeout)
 {
-	/*
-	 * 1) Wait on epoll/kqueue/poll for update on any socket.
-	 * 2) Handle the update.
-	 * 2.1) If the update was on listen-socket, then you probably need to
-	 *     call accept() on it - a new client wants to join.
-	 * 2.2) If the update was on a client-socket, then you might want to
-	 *     read/write on it.
-	 */
-	(void)server;
-	(void)timeout;
-	return CHAT_ERR_NOT_IMPLEMENTED;
+	trace_begin("chat_server_update", 0);
+	int rc = chat_server_update_impl(server, timeout);
+	trace_end("chat_server_update", rc);
+	return rc;
 }
 
 int
 chat_server_get_descriptor(const struct chat_server *server)
 {
-#if NEED_SERVER_FEED
-	/* IMPLEMENT THIS FUNCTION if want +5 points. */
-
 	/*
-	 * Server has multiple sockets - own and from connected clients. Hence
-	 * you can't return a socket here. But if you are using epoll/kqueue,
-	 * then you can return their descriptor. These descriptors can be polled
-	 * just like sockets and will return an event when any of their owned
-	 * descriptors has any events.
-	 *
-	 * For example, assume you created an epoll descriptor and added to
-	 * there a listen-socket and a few client-sockets. Now if you will call
-	 * poll() on the epoll's descriptor, then on return from poll() you can
-	 * be sure epoll_wait() can return something useful for some of those
-	 * sockets.
+	 * The epoll or kqueue descriptor is readable when any of its
+	 * sockets has events. The shards wake the server's descriptor
+	 * when they have new messages.
 	 */
+	if (server->thread_count > 0)
+		return server->wakeup.read_fd;
+#if CHAT_USE_URING
+	/* The ring signals its eventfd on each completion. */
+	if (server->shards[0].use_uring)
+		return server->shards[0].ring.event_fd;
 #endif
-	(void)server;
-	return -1;
+	return server->shards[0].poll_fd;
 }
 
 int
 chat_server_get_socket(const struct chat_server *server)
 {
-	return server->socket;
+	return server->shards[0].socket;
 }
 
 int
 chat_server_get_events(const struct chat_server *server)
 {
-	/*
-	 * IMPLEMENT THIS FUNCTION - add OUTPUT event if has non-empty output
-	 * buffer in any of the client-sockets.
-	 */
-	(void)server;
-	return CHAT_EVENT_INPUT;
+	if (!server->is_started)
+		return 0;
+	int res = CHAT_EVENT_INPUT;
+	/* io_uring sends by itself and reports that as input. */
+	if (server->thread_count == 0 && server->shards[0].out_peer_count > 0 &&
+	    !chat_shard_uses_uring(&server->shards[0]))
+		res |= CHAT_EVENT_OUTPUT;
+	return res;
+}
+
+double
+chat_server_get_timeout(const struct chat_server *server)
+{
+	if (!server->is_started || server->thread_count > 0)
+		return -1;
+	const struct chat_shard *shard = &server->shards[0];
+	if (shard->wheel == NULL || shard->peer_count == 0)
+		return -1;
+	return chat_shard_timer_timeout(shard, -1);
+}
+
+void
+chat_server_get_stats(const struct chat_server *server,
+		      struct chat_server_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	stats->chunk_size = CHAT_CHUNK_SIZE;
+	for (int i = 0; i < server->shard_count; ++i) {
+		const struct chat_server_stats *s = &server->shards[i].stats;
+		stats->peer_count += __atomic_load_n(&s->peer_count,
+						     __ATOMIC_RELAXED);
+		stats->peer_slot_count += __atomic_load_n(&s->peer_slot_count,
+							  __ATOMIC_RELAXED);
+		stats->chunk_used_count += __atomic_load_n(
+			&s->chunk_used_count, __ATOMIC_RELAXED);
+		stats->chunk_used_peak += __atomic_load_n(
+			&s->chunk_used_peak, __ATOMIC_RELAXED);
+		stats->chunk_free_count += __atomic_load_n(
+			&s->chunk_free_count, __ATOMIC_RELAXED);
+		stats->chunk_big_count += __atomic_load_n(
+			&s->chunk_big_count, __ATOMIC_RELAXED);
+		stats->drop_count += __atomic_load_n(&s->drop_count,
+						     __ATOMIC_RELAXED);
+		stats->eviction_count += __atomic_load_n(&s->eviction_count,
+							 __ATOMIC_RELAXED);
+		stats->pause_count += __atomic_load_n(&s->pause_count,
+						      __ATOMIC_RELAXED);
+		stats->idle_count += __atomic_load_n(&s->idle_count,
+						     __ATOMIC_RELAXED);
+		stats->ping_count += __atomic_load_n(&s->ping_count,
+						     __ATOMIC_RELAXED);
+		stats->udp_send_count += __atomic_load_n(&s->udp_send_count,
+							 __ATOMIC_RELAXED);
+		stats->udp_datagram_count += __atomic_load_n(
+			&s->udp_datagram_count, __ATOMIC_RELAXED);
+		if (chat_shard_uses_uring(&server->shards[i]))
+			++stats->uring_shard_count;
+		/* Each shard has the same history, roughly. */
+		int history_count = __atomic_load_n(&s->history_count,
+						    __ATOMIC_RELAXED);
+		if (history_count > stats->history_count) {
+			stats->history_count = history_count;
+			stats->history_size = __atomic_load_n(
+				&s->history_size, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/** Add the block to the fed ones, after the server's name once. */
+static struct chat_block_batch *
+chat_server_feed_push(struct chat_server *server,
+		      struct chat_block_batch *batch, struct chat_block *block)
+{
+	if (!server->is_announced) {
+		struct chat_author *a = server->author;
+		batch = chat_block_batch_push(batch, chat_block_new(
+			CHAT_FRAME_NAME, a->id, a->name, a->name_len, 1));
+		server->is_announced = true;
+	}
+	chat_server_compress(server, block);
+	return chat_block_batch_push(batch, block);
+}
+
+/**
+ * Give the fed blocks to the shards. The threads get them right away,
+ * the only shard of the not sharded mode on the next update.
+ */
+static void
+chat_server_feed_send(struct chat_server *server,
+		      struct chat_block_batch *batch)
+{
+	if (server->thread_count == 0) {
+		if (server->feed_batch == NULL) {
+			server->feed_batch = batch;
+			return;
+		}
+		for (int i = 0; i < batch->count; ++i) {
+			server->feed_batch = chat_block_batch_push(
+				server->feed_batch, batch->blocks[i]);
+		}
+		free(batch);
+		return;
+	}
+	size_t size = sizeof(*batch) + batch->count * sizeof(batch->blocks[0]);
+	for (int i = 0; i < batch->count; ++i) {
+		__atomic_add_fetch(&batch->blocks[i]->ref_count,
+				   server->thread_count - 1, __ATOMIC_RELAXED);
+	}
+	for (int i = 0; i < server->thread_count; ++i) {
+		/* Each shard frees its own copy of the pointers. */
+		struct chat_block_batch *copy = batch;
+		if (i + 1 < server->thread_count) {
+			copy = malloc(size);
+			memcpy(copy, batch, size);
+			copy->capacity = copy->count;
+		}
+		struct chat_shard *dst = &server->shards[i];
+		CHAT_STACK_PUSH(&dst->incoming, copy, copy);
+		chat_wakeup_signal(&dst->wakeup);
+	}
+}
+
+/** Make the server's author on the first feed. */
+static void
+chat_server_feed_prepare(struct chat_server *server)
+{
+	if (server->author != NULL)
+		return;
+	uint32_t id = __atomic_add_fetch(&server->last_author_id, 1,
+					 __ATOMIC_RELAXED);
+	server->author = chat_author_new(id, "server", strlen("server"));
 }
 
 int
 chat_server_feed(struct chat_server *server, const char *msg, uint32_t msg_size)
 {
-#if NEED_SERVER_FEED
-	/* IMPLEMENT THIS FUNCTION if want +5 points. */
-#endif
-	(void)server;
-	(void)msg;
-	(void)msg_size;
-	return CHAT_ERR_NOT_IMPLEMENTED;
+	if (!server->is_started)
+		return CHAT_ERR_NOT_STARTED;
+	chat_server_feed_prepare(server);
+	/* Each complete line is one block for all, the rest waits. */
+	chat_buffer_append(&server->feed, msg, msg_size);
+	struct chat_block_batch *batch = NULL;
+	struct chat_slice slice;
+	while (chat_buffer_next_message(&server->feed, &server->feed_scan,
+					&slice)) {
+		batch = chat_server_feed_push(server, batch, chat_block_new(
+			CHAT_FRAME_MESSAGE, server->author->id, slice.data,
+			slice.size, 1));
+	}
+	chat_buffer_release_empty(&server->feed);
+	if (batch != NULL)
+		chat_server_feed_send(server, batch);
+	return 0;
+}
+
+/** The block of a buffer of chat_server_feed_buffer_new(). */
+static inline struct chat_block *
+chat_block_of_feed_buffer(char *buf)
+{
+	return (struct chat_block *)(buf - CHAT_FRAME_HEADER_SIZE -
+				     offsetof(struct chat_block, data));
+}
+
+char *
+chat_server_feed_buffer_new(uint32_t size)
+{
+	/* The block is made around the text, to be sent right from it. */
+	struct chat_block *block = malloc(sizeof(*block) +
+					  CHAT_FRAME_HEADER_SIZE + size + 1);
+	block->ref_count = 1;
+	block->type = CHAT_FRAME_MESSAGE;
+	block->author_id = 0;
+	block->size = CHAT_FRAME_HEADER_SIZE + size;
+	block->lz = NULL;
+	return block->data + CHAT_FRAME_HEADER_SIZE;
+}
+
+int
+chat_server_feed_buffer(struct chat_server *server, char *buf, uint32_t size)
+{
+	struct chat_block *block = chat_block_of_feed_buffer(buf);
+	if (!server->is_started) {
+		free(block);
+		return CHAT_ERR_NOT_STARTED;
+	}
+	if (size > block->size - CHAT_FRAME_HEADER_SIZE) {
+		free(block);
+		return CHAT_ERR_INVALID_ARGUMENT;
+	}
+	if (size == 0) {
+		free(block);
+		return 0;
+	}
+	chat_server_feed_prepare(server);
+	block->author_id = server->author->id;
+	block->size = CHAT_FRAME_HEADER_SIZE + size;
+	chat_frame_encode_header(block->data, CHAT_FRAME_MESSAGE,
+				 block->author_id, size);
+	block->data[block->size] = '\n';
+	chat_server_feed_send(server, chat_server_feed_push(server, NULL,
+							    block));
+	return 0;
 }
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 struct chat_server;
@@ -11,6 +13,114 @@ struct chat_server;
 struct chat_server *
 chat_server_new(void);
 
+enum chat_server_backend {
+	/** Epoll on Linux, kqueue on the others. */
+	CHAT_SERVER_BACKEND_POLL,
+	/**
+	 * io_uring on Linux. Falls back to the poll when it is not
+	 * available.
+	 */
+	CHAT_SERVER_BACKEND_URING,
+};
+
+/** What to do with a peer whose output is over the limit. */
+enum chat_server_overflow {
+	/** Drop its oldest messages not started to be sent yet. */
+	CHAT_SERVER_OVERFLOW_DROP_OLDEST,
+	/** Disconnect it. */
+	CHAT_SERVER_OVERFLOW_DISCONNECT,
+	/**
+	 * Stop reading from the peers of its event loop until its output
+	 * drains to a half of the limit, so the senders are slowed down
+	 * by TCP. The messages from the other event loops do not stop,
+	 * so at twice the limit it is disconnected anyway.
+	 */
+	CHAT_SERVER_OVERFLOW_PAUSE,
+};
+
+struct chat_server_options {
+	/** Event loop threads, 0 to run the loop in chat_server_update(). */
+	int thread_count;
+	enum chat_server_backend backend;
+	/**
+	 * Limits of a peer's not sent output, in bytes and in messages.
+	 * 0 is no limit.
+	 */
+	size_t out_limit_size;
+	int out_limit_count;
+	enum chat_server_overflow overflow;
+	/**
+	 * Seconds a peer may be silent before it is closed. The kernel
+	 * gets about the same keepalive and TCP_USER_TIMEOUT. 0 is no
+	 * limit.
+	 */
+	double idle_timeout;
+	/**
+	 * Seconds of silence before a peer of chat_client is pinged. It
+	 * answers, so a live one is not idle. 0 is no pings.
+	 */
+	double keepalive_interval;
+	/**
+	 * Serve the binary protocol over UDP too, on the same port
+	 * number. A peer is its address, it joins with a hello datagram
+	 * and leaves with a leave one or by the idle timeout. It is
+	 * read by recvmmsg(), and the output of all the UDP peers of an
+	 * update goes by a few sendmmsg(), with the equal datagrams of
+	 * a peer in one UDP_SEGMENT send where the kernel has it. The
+	 * UDP shards run on the poll backend.
+	 */
+	bool use_udp;
+	/**
+	 * Last messages a new peer gets when it connects, at most this
+	 * many and this many bytes by the frame sizes, 0 is no limit.
+	 * They are the references to the broadcast blocks, so the
+	 * history costs no copies, and goes out with the rest of the
+	 * peer's output, many messages per write. The messages of the
+	 * authors gone since then have no names. Both 0 is no history.
+	 */
+	int history_count;
+	size_t history_size;
+	/**
+	 * TLS of the TCP peers, by the certificate chain and its key in
+	 * the PEM files. NULL is no TLS. The handshake is done by
+	 * OpenSSL in the event loop, and then the session goes into the
+	 * kernel (kTLS), so the output is still sent many messages per
+	 * sendmsg() of the shared blocks, and encrypted by the kernel or
+	 * the NIC. The peers of a kernel with no kTLS are closed after
+	 * the handshake. Needs the server built with CHAT_TLS=1, runs on
+	 * the poll backend, and no UDP.
+	 */
+	const char *tls_cert_file;
+	const char *tls_key_file;
+	/**
+	 * Compress the messages for the clients asking for it with the
+	 * same dictionary, see CHAT_FRAME_FEATURES. A message is
+	 * compressed once, when it is received, and the compressed frame
+	 * is shared by all such peers, like the plain one by the rest.
+	 * The dictionary is of the texts like the expected messages,
+	 * the usual phrases of the chat, so the short ones compress
+	 * too. Its last LZ_DICT_MAX_SIZE bytes are used, it is copied.
+	 */
+	bool use_lz;
+	const char *lz_dict;
+	size_t lz_dict_size;
+};
+
+/** Create a new chat server with the given options. */
+struct chat_server *
+chat_server_new_with_options(const struct chat_server_options *opts);
+
+/**
+ * Create a new chat server with @a thread_count event loop threads.
+ * Each thread accepts its own share of the clients on the same port,
+ * via SO_REUSEPORT, and serves them. The messages are broadcast to
+ * the clients of all the threads. chat_server_update() then only
+ * waits for the received messages. 0 threads is the same as
+ * chat_server_new().
+ */
+struct chat_server *
+chat_server_new_sharded(int thread_count);
+
 /** Free all server's resources. */
 void
 chat_server_delete(struct chat_server *server);
@@ -25,11 +135,27 @@ chat_server_delete(struct chat_server *server);
  * @retval !=0 Error code.
  *     - CHAT_ERR_PORT_BUSY - the port is already busy.
  *     - CHAT_ERR_ALREADY_STARTED - the server is already listening.
+ *     - CHAT_ERR_INVALID_ARGUMENT - the TLS files can't be used, or
+ *       TLS is asked together with UDP.
+ *     - CHAT_ERR_NOT_IMPLEMENTED - TLS is asked, and the server is
+ *       built with no CHAT_TLS.
  *     - CHAT_ERR_SYS - a system error, check errno.
  */
 int
 chat_server_listen(struct chat_server *server, uint16_t port);
 
+/**
+ * Serve the clients of an already listening TCP socket, like the one
+ * inherited from a supervisor process. Several processes can serve
+ * the same socket, each accepts its own share of the clients. The
+ * server owns the socket, it is closed by chat_server_delete() and on
+ * error. In the sharded mode each shard accepts from its own dup() of
+ * it. The errors are the ones of chat_server_listen(), and
+ * CHAT_ERR_INVALID_ARGUMENT with UDP.
+ */
+int
+chat_server_listen_socket(struct chat_server *server, int sock);
+
 /**
  * Pop a next pending chat message. The returned message has to be
  * freed using chat_message_delete().
@@ -90,7 +216,60 @@ int
 chat_server_get_events(const struct chat_server *server);
 
 /**
- * Feed a message to the server to broadcast to all clients.
+ * Get the time in seconds till the next check of the idle timeouts.
+ * An external event loop should wait no longer and call
+ * chat_server_update() then. The sharded threads check them by
+ * themselves.
+ *
+ * @retval >=0 Timeout.
+ * @retval <0 No timers.
+ */
+double
+chat_server_get_timeout(const struct chat_server *server);
+
+struct chat_server_stats {
+	/** Connected peers, and the slots allocated for them. */
+	int peer_count;
+	int peer_slot_count;
+	/** Input buffers of the peers are the chunks of this size. */
+	int chunk_size;
+	/** Chunks held by the peers now, and at most. */
+	int chunk_used_count;
+	int chunk_used_peak;
+	/** Free chunks cached by the pool. */
+	int chunk_free_count;
+	/** How many times a big message did not fit into a chunk. */
+	uint64_t chunk_big_count;
+	/** Event loops running on io_uring. */
+	int uring_shard_count;
+	/** Messages dropped from the output over the limit. */
+	uint64_t drop_count;
+	/** Peers disconnected for the output over the limit. */
+	uint64_t eviction_count;
+	/** How many times the reading was paused for a slow peer. */
+	uint64_t pause_count;
+	/** Peers closed for the idle timeout, and the pings sent. */
+	uint64_t idle_count;
+	uint64_t ping_count;
+	/** The sendmmsg() calls to the UDP peers and their datagrams. */
+	uint64_t udp_send_count;
+	uint64_t udp_datagram_count;
+	/** Messages kept for the new peers, and their size. */
+	int history_count;
+	size_t history_size;
+};
+
+/** Get the memory usage and the backpressure numbers of the server. */
+void
+chat_server_get_stats(const struct chat_server *server,
+		      struct chat_server_stats *stats);
+
+/**
+ * Feed a message to the server to broadcast to all clients. Each
+ * complete line is sent with the author "server", the rest waits for
+ * its '\n'. A line is copied once, to a block shared by all the
+ * peers. In the not sharded mode the lines are sent by the next
+ * chat_server_update(), in the sharded mode right away.
  *
  * @param server Chat server.
  * @param msg Message.
@@ -98,9 +277,31 @@ chat_server_get_events(const struct chat_server *server);
  *
  * @retval 0 Success.
  * @retval !=0 Error code.
- *     - CHAT_ERR_NOT_IMPLEMENTED - not implemented.
  *     - CHAT_ERR_NOT_STARTED - the server is not listening yet.
  */
 int
 chat_server_feed(struct chat_server *server, const char *msg,
 		 uint32_t msg_size);
+
+/**
+ * Allocate a buffer for a message of up to @a size bytes to feed with
+ * chat_server_feed_buffer(). There is room around it for the framing,
+ * so the message is sent to all the peers right from this buffer.
+ */
+char *
+chat_server_feed_buffer_new(uint32_t size);
+
+/**
+ * Feed the first @a size bytes of a buffer of
+ * chat_server_feed_buffer_new() as one message, not split into lines
+ * and not trimmed. The server takes the buffer, on an error too, and
+ * never copies it. Good for the big announcements.
+ *
+ * @retval 0 Success.
+ * @retval !=0 Error code.
+ *     - CHAT_ERR_NOT_STARTED - the server is not listening yet.
+ *     - CHAT_ERR_INVALID_ARGUMENT - the size is over the buffer's.
+ */
+int
+chat_server_feed_buffer(struct chat_server *server, char *buf,
+			uint32_t size);
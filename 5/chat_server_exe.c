@@ -1,10 +1,32 @@
 #include "chat.h"
 #include "chat_server.h"
 
+#include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * The environment of a new binary started by a hot upgrade: the
+ * listening socket to serve, and the pipe to say when its workers are
+ * up.
+ */
+#define CHAT_ENV_LISTEN_FD "CHAT_LISTEN_FD"
+#define CHAT_ENV_READY_FD "CHAT_READY_FD"
+
+/** A worker dead sooner after its start is restarted after that. */
+static const double chat_worker_min_life = 1;
+/** How long the old binary waits for the new one in an upgrade. */
+static const int chat_upgrade_timeout_ms = 10000;
 
 static int
 port_from_str(const char *str, uint16_t *port)
@@ -22,37 +44,74 @@ port_from_str(const char *str, uint16_t *port)
 	return 0;
 }
 
-int
-main(int argc, char **argv)
+/** Serve the clients until an error. */
+static void
+serve(struct chat_server *serv, bool use_input)
 {
-	if (argc < 2) {
-		printf("Expected a port to listen on\n");
-		return -1;
-	}
-	uint16_t port = 0;
-	int rc = port_from_str(argv[1], &port);
-	if (rc != 0) {
-		printf("Invalid port\n");
-		return -1;
-	}
-	struct chat_server *serv = chat_server_new();
-	rc = chat_server_listen(serv, port);
-	if (rc != 0) {
-		printf("Couldn't listen: %d\n", rc);
-		chat_server_delete(serv);
-		return -1;
-	}
 #if NEED_SERVER_FEED
 	/*
-	 * If want +5 points, then do similarly to the client_exe - create 2
-	 * pollfd objects, wait on STDIN_FILENO and on
-	 * chat_server_get_descriptor(), process events, etc.
+	 * Like the client_exe - wait on the standard input and on the
+	 * server's descriptor, and feed the input to the clients.
 	 */
+	struct pollfd poll_fds[2];
+	memset(poll_fds, 0, sizeof(poll_fds));
+	struct pollfd *poll_input = &poll_fds[0];
+	poll_input->fd = use_input ? STDIN_FILENO : -1;
+	poll_input->events = POLLIN;
+	struct pollfd *poll_server = &poll_fds[1];
+	poll_server->fd = chat_server_get_descriptor(serv);
+
+	const int buf_size = 1024;
+	char buf[buf_size];
+	while (true) {
+		poll_server->events = chat_events_to_poll_events(
+			chat_server_get_events(serv));
+		/* The timers of the server are due after this timeout. */
+		double timeout = chat_server_get_timeout(serv);
+		int rc = poll(poll_fds, 2, timeout < 0 ? -1 :
+			      (int)(timeout * 1000) + 1);
+		if (rc < 0) {
+			printf("Poll error: %d\n", errno);
+			break;
+		}
+		if (poll_input->revents != 0) {
+			poll_input->revents = 0;
+			rc = read(STDIN_FILENO, buf, buf_size);
+			if (rc <= 0) {
+				/* No more input, only serve the clients. */
+				poll_input->fd = -1;
+				continue;
+			}
+			rc = chat_server_feed(serv, buf, rc);
+			if (rc != 0) {
+				printf("Feed error: %d\n", rc);
+				break;
+			}
+		}
+		/* Not only on the events, the fed lines go by an update. */
+		poll_server->revents = 0;
+		rc = chat_server_update(serv, 0);
+		if (rc != 0 && rc != CHAT_ERR_TIMEOUT) {
+			printf("Update error: %d\n", rc);
+			break;
+		}
+		/* Flush all the pending messages to the standard output. */
+		struct chat_message *msg;
+		while ((msg = chat_server_pop_next(serv)) != NULL) {
+#if NEED_AUTHOR
+			printf("%s: %s\n", msg->author, msg->data);
+#else
+			printf("%s\n", msg->data);
+#endif
+			chat_message_delete(msg);
+		}
+	}
 #else
 	/*
 	 * The basic implementation without server messages. Just serving
 	 * clients.
 	 */
+	(void)use_input;
 	while (true) {
 		int rc = chat_server_update(serv, -1);
 		if (rc != 0) {
@@ -71,6 +130,360 @@ main(int argc, char **argv)
 		}
 	}
 #endif
+}
+
+static double
+now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Go to the background like in lecture_examples/10_users/9_daemon.c:
+ * the parent exits, the output goes to the log file, and the process
+ * leaves the terminal's session.
+ */
+static int
+daemonize(const char *log_file)
+{
+	pid_t pid = fork();
+	if (pid < 0)
+		return -1;
+	if (pid > 0)
+		exit(0);
+	int fd = open(log_file, O_CREAT | O_WRONLY | O_APPEND, 0600);
+	if (fd < 0)
+		return -1;
+	int null_fd = open("/dev/null", O_RDONLY);
+	if (null_fd < 0 || dup2(null_fd, STDIN_FILENO) < 0 ||
+	    dup2(fd, STDOUT_FILENO) < 0 || dup2(fd, STDERR_FILENO) < 0)
+		return -1;
+	close(null_fd);
+	close(fd);
+	/* The output is not a terminal now, and would wait in the buffers. */
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	return setsid() < 0 ? -1 : 0;
+}
+
+/**
+ * The listening socket of the workers. SO_REUSEPORT lets a new binary
+ * bind the port too, when it is started not by an upgrade.
+ */
+static int
+supervisor_listen(uint16_t port)
+{
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0)
+		return -1;
+	int on = 1;
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+	    setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0 ||
+	    bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+	    listen(sock, SOMAXCONN) != 0) {
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+/**
+ * Prefork supervisor. The workers are the processes with their own
+ * chat servers on the one listening socket of the supervisor. Each
+ * accepts its own share of the clients and shares nothing with the
+ * others, so the messages go only to the clients of the same worker.
+ * A dead worker is restarted right away, and it takes only its own
+ * clients with it.
+ */
+struct supervisor {
+	const struct chat_server_options *opts;
+	char **argv;
+	int listen_fd;
+	int worker_count;
+	/** Of each worker, 0 when it is not running. */
+	pid_t *pids;
+	/** When a worker has started, or has to be started. */
+	double *start_times;
+	/** The signals of the supervisor, blocked and waited for. */
+	sigset_t signals;
+	sigset_t old_signals;
+};
+
+static void
+supervisor_start_worker(struct supervisor *sv, int i)
+{
+	/* Otherwise the child would print the buffered output again. */
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid < 0) {
+		printf("Couldn't fork a worker: %s\n", strerror(errno));
+		/* Try again a bit later. */
+		sv->start_times[i] = now_sec() + chat_worker_min_life;
+		return;
+	}
+	if (pid > 0) {
+		sv->pids[i] = pid;
+		sv->start_times[i] = now_sec();
+		return;
+	}
+	sigprocmask(SIG_SETMASK, &sv->old_signals, NULL);
+	/* The workers share the output, a line is one write. */
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	struct chat_server *serv = chat_server_new_with_options(sv->opts);
+	int rc = chat_server_listen_socket(serv, sv->listen_fd);
+	if (rc != 0) {
+		printf("Worker couldn't listen: %d\n", rc);
+		chat_server_delete(serv);
+		_exit(1);
+	}
+	serve(serv, false);
+	chat_server_delete(serv);
+	_exit(1);
+}
+
+static void
+supervisor_reap(struct supervisor *sv, bool is_stopping)
+{
+	int status;
+	pid_t pid;
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		int i = 0;
+		while (i < sv->worker_count && sv->pids[i] != pid)
+			++i;
+		if (i == sv->worker_count)
+			continue;
+		sv->pids[i] = 0;
+		if (is_stopping)
+			continue;
+		if (WIFSIGNALED(status)) {
+			printf("Worker %d is killed by signal %d\n", (int)pid,
+			       WTERMSIG(status));
+		} else {
+			printf("Worker %d exited with %d\n", (int)pid,
+			       WEXITSTATUS(status));
+		}
+		/* A crash loop is not restarted in a busy loop. */
+		double now = now_sec();
+		if (now - sv->start_times[i] < chat_worker_min_life)
+			sv->start_times[i] = now + chat_worker_min_life;
+		else
+			sv->start_times[i] = now;
+	}
+}
+
+/** Terminate the workers and wait for them all. */
+static void
+supervisor_stop_workers(struct supervisor *sv)
+{
+	for (int i = 0; i < sv->worker_count; ++i) {
+		if (sv->pids[i] > 0)
+			kill(sv->pids[i], SIGTERM);
+	}
+	for (int i = 0; i < sv->worker_count; ++i) {
+		if (sv->pids[i] > 0)
+			waitpid(sv->pids[i], NULL, 0);
+		sv->pids[i] = 0;
+	}
+}
+
+/**
+ * Hot upgrade. The binary is started again with the same arguments,
+ * and inherits the listening socket. When its workers are up, the old
+ * ones are stopped. The socket is never closed, so no connection is
+ * refused meanwhile. The peers of the old workers have to reconnect.
+ * True when the new binary has taken over.
+ */
+static bool
+supervisor_upgrade(struct supervisor *sv)
+{
+	int ready[2];
+	if (pipe(ready) != 0) {
+		printf("Upgrade error: %s\n", strerror(errno));
+		return false;
+	}
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid < 0) {
+		printf("Upgrade error: %s\n", strerror(errno));
+		close(ready[0]);
+		close(ready[1]);
+		return false;
+	}
+	if (pid == 0) {
+		close(ready[0]);
+		char str[16];
+		snprintf(str, sizeof(str), "%d", sv->listen_fd);
+		setenv(CHAT_ENV_LISTEN_FD, str, 1);
+		snprintf(str, sizeof(str), "%d", ready[1]);
+		setenv(CHAT_ENV_READY_FD, str, 1);
+		sigprocmask(SIG_SETMASK, &sv->old_signals, NULL);
+		execv(sv->argv[0], sv->argv);
+		printf("Upgrade exec error: %s\n", strerror(errno));
+		_exit(127);
+	}
+	close(ready[1]);
+	struct pollfd pfd = {.fd = ready[0], .events = POLLIN};
+	char c;
+	bool ok = poll(&pfd, 1, chat_upgrade_timeout_ms) == 1 &&
+		  read(ready[0], &c, 1) == 1;
+	close(ready[0]);
+	if (!ok) {
+		printf("The new binary didn't start, staying\n");
+		kill(pid, SIGKILL);
+		return false;
+	}
+	printf("The new binary %d has taken over\n", (int)pid);
+	return true;
+}
+
+static int
+supervisor_run(struct supervisor *sv)
+{
+	for (int i = 0; i < sv->worker_count; ++i)
+		supervisor_start_worker(sv, i);
+	const char *ready_str = getenv(CHAT_ENV_READY_FD);
+	if (ready_str != NULL) {
+		/* Started by an upgrade, the old binary can go. */
+		int fd = atoi(ready_str);
+		if (write(fd, "1", 1) != 1)
+			printf("Couldn't tell the old binary: %d\n", errno);
+		close(fd);
+		unsetenv(CHAT_ENV_READY_FD);
+	}
+	printf("Supervisor %d serves with %d workers\n", (int)getpid(),
+	       sv->worker_count);
+	while (true) {
+		double now = now_sec();
+		double next = -1;
+		for (int i = 0; i < sv->worker_count; ++i) {
+			if (sv->pids[i] != 0)
+				continue;
+			if (sv->start_times[i] <= now)
+				supervisor_start_worker(sv, i);
+			else if (next < 0 || sv->start_times[i] < next)
+				next = sv->start_times[i];
+		}
+		struct timespec ts;
+		if (next >= 0) {
+			double left = next - now;
+			ts.tv_sec = (time_t)left;
+			ts.tv_nsec = (long)((left - ts.tv_sec) * 1e9);
+		}
+		int sig = sigtimedwait(&sv->signals, NULL,
+				       next >= 0 ? &ts : NULL);
+		if (sig == SIGCHLD) {
+			supervisor_reap(sv, false);
+		} else if (sig == SIGHUP) {
+			if (supervisor_upgrade(sv))
+				break;
+		} else if (sig == SIGINT || sig == SIGTERM) {
+			break;
+		}
+	}
+	supervisor_stop_workers(sv);
+	return 0;
+}
+
+static void
+usage(void)
+{
+	printf("Usage: server [--workers=N] [--daemon=LOG_FILE] PORT "
+	       "[THREADS [CERT_FILE KEY_FILE]]\n"
+	       "--workers=N runs N worker processes on one socket, "
+	       "restarts the dead ones, and\n"
+	       "does a hot upgrade to the binary by the same path on "
+	       "SIGHUP.\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	int worker_count = 0;
+	const char *log_file = NULL;
+	int argi = 1;
+	for (; argi < argc && strncmp(argv[argi], "--", 2) == 0; ++argi) {
+		const char *arg = argv[argi];
+		if (strncmp(arg, "--workers=", 10) == 0) {
+			worker_count = atoi(arg + 10);
+		} else if (strncmp(arg, "--daemon=", 9) == 0) {
+			log_file = arg + 9;
+		} else {
+			usage();
+			return -1;
+		}
+	}
+	if (argi >= argc) {
+		printf("Expected a port to listen on\n");
+		return -1;
+	}
+	uint16_t port = 0;
+	int rc = port_from_str(argv[argi], &port);
+	if (rc != 0) {
+		printf("Invalid port\n");
+		return -1;
+	}
+	/*
+	 * An optional next argument is the number of threads, and the
+	 * next two are the TLS certificate and key files.
+	 */
+	struct chat_server_options opts;
+	memset(&opts, 0, sizeof(opts));
+	opts.thread_count = argc > argi + 1 ? atoi(argv[argi + 1]) : 0;
+	opts.backend = CHAT_SERVER_BACKEND_POLL;
+	opts.tls_cert_file = argc > argi + 2 ? argv[argi + 2] : NULL;
+	opts.tls_key_file = argc > argi + 3 ? argv[argi + 3] : NULL;
+	/* An upgraded binary is a child of the daemon already. */
+	const char *listen_str = getenv(CHAT_ENV_LISTEN_FD);
+	if (log_file != NULL && listen_str == NULL &&
+	    daemonize(log_file) != 0) {
+		printf("Couldn't daemonize: %s\n", strerror(errno));
+		return -1;
+	}
+	if (worker_count > 0) {
+		struct supervisor sv;
+		memset(&sv, 0, sizeof(sv));
+		sv.opts = &opts;
+		sv.argv = argv;
+		sv.worker_count = worker_count;
+		if (listen_str != NULL) {
+			sv.listen_fd = atoi(listen_str);
+			unsetenv(CHAT_ENV_LISTEN_FD);
+		} else {
+			sv.listen_fd = supervisor_listen(port);
+		}
+		if (sv.listen_fd < 0) {
+			printf("Couldn't listen: %s\n", strerror(errno));
+			return -1;
+		}
+		sigemptyset(&sv.signals);
+		sigaddset(&sv.signals, SIGCHLD);
+		sigaddset(&sv.signals, SIGHUP);
+		sigaddset(&sv.signals, SIGINT);
+		sigaddset(&sv.signals, SIGTERM);
+		sigprocmask(SIG_BLOCK, &sv.signals, &sv.old_signals);
+		sv.pids = calloc(worker_count, sizeof(sv.pids[0]));
+		sv.start_times = calloc(worker_count,
+					sizeof(sv.start_times[0]));
+		rc = supervisor_run(&sv);
+		free(sv.pids);
+		free(sv.start_times);
+		close(sv.listen_fd);
+		return rc;
+	}
+	struct chat_server *serv = chat_server_new_with_options(&opts);
+	rc = chat_server_listen(serv, port);
+	if (rc != 0) {
+		printf("Couldn't listen: %d\n", rc);
+		chat_server_delete(serv);
+		return -1;
+	}
+	serve(serv, true);
 	chat_server_delete(serv);
 	return 0;
 }
@@ -0,0 +1,190 @@
+#include "chat_tls.h"
+
+#if CHAT_TLS
+
+#include "chat.h"
+
+#include <arpa/inet.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <time.h>
+
+/**
+ * The ciphers the kernel does in the records. TLS 1.2 only, the
+ * Linux kTLS of OpenSSL 3.0 receives only these. And in TLS 1.3 the
+ * session tickets and the key updates come as the records the
+ * kernel gives to no recv().
+ */
+static const char *const chat_tls_ciphers =
+	"ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:"
+	"ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384:"
+	"ECDHE-ECDSA-CHACHA20-POLY1305:ECDHE-RSA-CHACHA20-POLY1305";
+
+struct chat_tls_ctx {
+	SSL_CTX *ssl_ctx;
+};
+
+struct chat_tls {
+	SSL *ssl;
+	int events;
+};
+
+static struct chat_tls_ctx *
+chat_tls_ctx_new(const SSL_METHOD *method)
+{
+	SSL_CTX *ssl_ctx = SSL_CTX_new(method);
+	if (ssl_ctx == NULL)
+		return NULL;
+	if (SSL_CTX_set_min_proto_version(ssl_ctx, TLS1_2_VERSION) != 1 ||
+	    SSL_CTX_set_max_proto_version(ssl_ctx, TLS1_2_VERSION) != 1 ||
+	    SSL_CTX_set_cipher_list(ssl_ctx, chat_tls_ciphers) != 1) {
+		SSL_CTX_free(ssl_ctx);
+		return NULL;
+	}
+	/* The kernel can't renegotiate. */
+	SSL_CTX_set_options(ssl_ctx, SSL_OP_ENABLE_KTLS |
+			    SSL_OP_NO_RENEGOTIATION);
+	struct chat_tls_ctx *ctx = malloc(sizeof(*ctx));
+	ctx->ssl_ctx = ssl_ctx;
+	return ctx;
+}
+
+struct chat_tls_ctx *
+chat_tls_ctx_new_server(const char *cert_file, const char *key_file)
+{
+	struct chat_tls_ctx *ctx = chat_tls_ctx_new(TLS_server_method());
+	if (ctx == NULL)
+		return NULL;
+	if (SSL_CTX_use_certificate_chain_file(ctx->ssl_ctx,
+					       cert_file) != 1 ||
+	    SSL_CTX_use_PrivateKey_file(ctx->ssl_ctx, key_file,
+					SSL_FILETYPE_PEM) != 1 ||
+	    SSL_CTX_check_private_key(ctx->ssl_ctx) != 1) {
+		chat_tls_ctx_delete(ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+struct chat_tls_ctx *
+chat_tls_ctx_new_client(const char *ca_file)
+{
+	struct chat_tls_ctx *ctx = chat_tls_ctx_new(TLS_client_method());
+	if (ctx == NULL)
+		return NULL;
+	int rc = ca_file != NULL ?
+		 SSL_CTX_load_verify_locations(ctx->ssl_ctx, ca_file, NULL) :
+		 SSL_CTX_set_default_verify_paths(ctx->ssl_ctx);
+	if (rc != 1) {
+		chat_tls_ctx_delete(ctx);
+		return NULL;
+	}
+	SSL_CTX_set_verify(ctx->ssl_ctx, SSL_VERIFY_PEER, NULL);
+	return ctx;
+}
+
+void
+chat_tls_ctx_delete(struct chat_tls_ctx *ctx)
+{
+	SSL_CTX_free(ctx->ssl_ctx);
+	free(ctx);
+}
+
+struct chat_tls *
+chat_tls_new(struct chat_tls_ctx *ctx, int socket, const char *host)
+{
+	SSL *ssl = SSL_new(ctx->ssl_ctx);
+	if (ssl == NULL)
+		return NULL;
+	if (SSL_set_fd(ssl, socket) != 1)
+		goto error;
+	if (host == NULL) {
+		SSL_set_accept_state(ssl);
+	} else {
+		struct in_addr ip;
+		if (inet_pton(AF_INET, host, &ip) == 1) {
+			X509_VERIFY_PARAM *param = SSL_get0_param(ssl);
+			if (X509_VERIFY_PARAM_set1_ip_asc(param, host) != 1)
+				goto error;
+		} else if (SSL_set1_host(ssl, host) != 1 ||
+			   SSL_set_tlsext_host_name(ssl, host) != 1) {
+			goto error;
+		}
+		SSL_set_connect_state(ssl);
+	}
+	struct chat_tls *tls = malloc(sizeof(*tls));
+	tls->ssl = ssl;
+	tls->events = host == NULL ? CHAT_EVENT_INPUT : CHAT_EVENT_OUTPUT;
+	return tls;
+error:
+	SSL_free(ssl);
+	return NULL;
+}
+
+int
+chat_tls_handshake(struct chat_tls *tls)
+{
+	/*
+	 * OpenSSL writes with write(), so a peer gone in the middle of
+	 * the handshake would kill the process with SIGPIPE. It is
+	 * blocked in this thread meanwhile, and a new one is dropped.
+	 */
+	sigset_t pipe_set, old_set, pending;
+	sigemptyset(&pipe_set);
+	sigaddset(&pipe_set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &pipe_set, &old_set);
+	sigpending(&pending);
+	bool had_pipe = sigismember(&pending, SIGPIPE);
+	ERR_clear_error();
+	int rc = SSL_do_handshake(tls->ssl);
+	int err = rc == 1 ? SSL_ERROR_NONE : SSL_get_error(tls->ssl, rc);
+	if (!had_pipe) {
+		sigpending(&pending);
+		if (sigismember(&pending, SIGPIPE)) {
+			struct timespec zero = {0, 0};
+			sigtimedwait(&pipe_set, NULL, &zero);
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+
+	switch (err) {
+	case SSL_ERROR_NONE:
+		tls->events = 0;
+		if (BIO_get_ktls_send(SSL_get_wbio(tls->ssl)) &&
+		    BIO_get_ktls_recv(SSL_get_rbio(tls->ssl)))
+			return 0;
+		return CHAT_ERR_NOT_IMPLEMENTED;
+	case SSL_ERROR_WANT_READ:
+		tls->events = CHAT_EVENT_INPUT;
+		return CHAT_ERR_TIMEOUT;
+	case SSL_ERROR_WANT_WRITE:
+		tls->events = CHAT_EVENT_OUTPUT;
+		return CHAT_ERR_TIMEOUT;
+	default:
+		tls->events = 0;
+		return CHAT_ERR_SYS;
+	}
+}
+
+int
+chat_tls_get_events(const struct chat_tls *tls)
+{
+	return tls->events;
+}
+
+void
+chat_tls_delete(struct chat_tls *tls)
+{
+	/*
+	 * No close_notify, the session lives on in the kernel. The
+	 * socket is not owned by the BIO.
+	 */
+	SSL_free(tls->ssl);
+	free(tls);
+}
+
+#endif /* CHAT_TLS */
@@ -0,0 +1,70 @@
+#pragma once
+
+/**
+ * TLS of the TCP connections, with the handshake in OpenSSL and the
+ * records in the kernel (kTLS). When the handshake is done, the
+ * session keys are installed into the socket, and it is a plain
+ * socket again: send(), sendmsg() and recv() of the rest of the code
+ * work as before, with the encryption in the kernel or the NIC. Not
+ * a part of the public API. Built with -DCHAT_TLS=1 and -lssl
+ * -lcrypto, otherwise CHAT_TLS is 0 and nothing of that.
+ */
+
+#ifndef CHAT_TLS
+#define CHAT_TLS 0
+#endif
+
+#if CHAT_TLS
+
+struct chat_tls_ctx;
+struct chat_tls;
+
+/**
+ * Context of the server side, with its certificate chain and key in
+ * PEM files. NULL on error.
+ */
+struct chat_tls_ctx *
+chat_tls_ctx_new_server(const char *cert_file, const char *key_file);
+
+/**
+ * Context of the client side. The server's certificate is verified
+ * by the CAs of the PEM file, or by the system ones when it is NULL.
+ * NULL on error.
+ */
+struct chat_tls_ctx *
+chat_tls_ctx_new_client(const char *ca_file);
+
+void
+chat_tls_ctx_delete(struct chat_tls_ctx *ctx);
+
+/**
+ * Start a handshake on the connected non-blocking socket. @a host is
+ * the name or IP the client checks the certificate for, NULL on the
+ * server side.
+ */
+struct chat_tls *
+chat_tls_new(struct chat_tls_ctx *ctx, int socket, const char *host);
+
+/**
+ * Continue the handshake with what the socket has.
+ *
+ * @retval 0 Done, the socket has kTLS in both directions, and the
+ *     handshake object can be deleted.
+ * @retval CHAT_ERR_TIMEOUT Not done yet. Call again when the socket
+ *     has chat_tls_get_events().
+ * @retval CHAT_ERR_NOT_IMPLEMENTED Done, but the kernel has no kTLS
+ *     for the session.
+ * @retval CHAT_ERR_SYS The handshake failed.
+ */
+int
+chat_tls_handshake(struct chat_tls *tls);
+
+/** Events the handshake waits for, a mask of chat_events. */
+int
+chat_tls_get_events(const struct chat_tls *tls);
+
+/** Free the handshake. The socket is not closed. */
+void
+chat_tls_delete(struct chat_tls *tls);
+
+#endif /* CHAT_TLS */
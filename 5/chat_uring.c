@@ -0,0 +1,248 @@
+#include "chat_uring.h"
+
+#if CHAT_USE_URING
+
+#include <errno.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+static int
+chat_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+chat_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+		 unsigned flags, const void *arg, size_t arg_size)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+			    flags, arg, arg_size);
+}
+
+static int
+chat_uring_register(int fd, unsigned opcode, const void *arg,
+		    unsigned count)
+{
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+static void
+chat_uring_unmap(struct chat_uring *ring)
+{
+	if (ring->buf_ring != NULL)
+		munmap(ring->buf_ring, ring->buf_ring_map_size);
+	if (ring->bufs != NULL)
+		munmap(ring->bufs, (size_t)ring->buf_count * ring->buf_size);
+	if (ring->sqes != NULL)
+		munmap(ring->sqes, ring->sqes_map_size);
+	if (ring->cq_ptr != NULL && ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_map_size);
+	if (ring->sq_ptr != NULL)
+		munmap(ring->sq_ptr, ring->sq_map_size);
+}
+
+static void *
+chat_uring_map(int fd, size_t size, off_t offset)
+{
+	void *res = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, fd, offset);
+	return res == MAP_FAILED ? NULL : res;
+}
+
+/** Map the queues shared with the kernel. */
+static int
+chat_uring_map_queues(struct chat_uring *ring, const struct io_uring_params *p)
+{
+	ring->sq_map_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+	ring->cq_map_size = p->cq_off.cqes +
+			    p->cq_entries * sizeof(struct io_uring_cqe);
+	if ((p->features & IORING_FEAT_SINGLE_MMAP) != 0) {
+		if (ring->cq_map_size > ring->sq_map_size)
+			ring->sq_map_size = ring->cq_map_size;
+		ring->cq_map_size = ring->sq_map_size;
+	}
+	ring->sq_ptr = chat_uring_map(ring->fd, ring->sq_map_size,
+				      IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == NULL)
+		return -1;
+	if ((p->features & IORING_FEAT_SINGLE_MMAP) != 0) {
+		ring->cq_ptr = ring->sq_ptr;
+	} else {
+		ring->cq_ptr = chat_uring_map(ring->fd, ring->cq_map_size,
+					      IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == NULL)
+			return -1;
+	}
+	ring->sqes_map_size = p->sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = chat_uring_map(ring->fd, ring->sqes_map_size,
+				    IORING_OFF_SQES);
+	if (ring->sqes == NULL)
+		return -1;
+	char *sq = ring->sq_ptr;
+	ring->sq_head = (unsigned *)(sq + p->sq_off.head);
+	ring->sq_tail = (unsigned *)(sq + p->sq_off.tail);
+	ring->sq_mask = *(unsigned *)(sq + p->sq_off.ring_mask);
+	ring->sq_entries = *(unsigned *)(sq + p->sq_off.ring_entries);
+	ring->sq_array = (unsigned *)(sq + p->sq_off.array);
+	ring->sq_local_tail = *ring->sq_tail;
+	char *cq = ring->cq_ptr;
+	ring->cq_head = (unsigned *)(cq + p->cq_off.head);
+	ring->cq_tail = (unsigned *)(cq + p->cq_off.tail);
+	ring->cq_mask = *(unsigned *)(cq + p->cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+	return 0;
+}
+
+/** Register the ring of the provided buffers and fill it. */
+static int
+chat_uring_map_bufs(struct chat_uring *ring, unsigned buf_count,
+		    unsigned buf_size)
+{
+	ring->buf_count = buf_count;
+	ring->buf_size = buf_size;
+	ring->buf_ring_map_size = buf_count * sizeof(struct io_uring_buf);
+	void *ptr = mmap(NULL, ring->buf_ring_map_size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED)
+		return -1;
+	ring->buf_ring = ptr;
+	ptr = mmap(NULL, (size_t)buf_count * buf_size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED)
+		return -1;
+	ring->bufs = ptr;
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+	reg.ring_entries = buf_count;
+	reg.bgid = CHAT_URING_BUF_GROUP;
+	if (chat_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg,
+				1) != 0)
+		return -1;
+	ring->buf_tail = 0;
+	for (unsigned i = 0; i < buf_count; ++i)
+		chat_uring_buf_recycle(ring, i);
+	return 0;
+}
+
+int
+chat_uring_open(struct chat_uring *ring, unsigned entries,
+		unsigned buf_count, unsigned buf_size)
+{
+	memset(ring, 0, sizeof(*ring));
+	ring->event_fd = -1;
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	ring->fd = chat_uring_setup(entries, &p);
+	if (ring->fd < 0)
+		return -1;
+	if (chat_uring_map_queues(ring, &p) != 0 ||
+	    chat_uring_map_bufs(ring, buf_count, buf_size) != 0)
+		goto error;
+	ring->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ring->event_fd < 0 ||
+	    chat_uring_register(ring->fd, IORING_REGISTER_EVENTFD,
+				&ring->event_fd, 1) != 0)
+		goto error;
+	return 0;
+
+error:;
+	int err = errno;
+	chat_uring_close(ring);
+	errno = err;
+	return -1;
+}
+
+void
+chat_uring_close(struct chat_uring *ring)
+{
+	if (ring->fd < 0)
+		return;
+	/* Closing the ring cancels all the requests in flight. */
+	close(ring->fd);
+	ring->fd = -1;
+	chat_uring_unmap(ring);
+	if (ring->event_fd >= 0)
+		close(ring->event_fd);
+	ring->event_fd = -1;
+}
+
+struct io_uring_sqe *
+chat_uring_get_sqe(struct chat_uring *ring)
+{
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (ring->sq_local_tail - head == ring->sq_entries)
+		chat_uring_submit(ring);
+	/* The kernel takes all the submitted entries right away. */
+	unsigned index = ring->sq_local_tail++ & ring->sq_mask;
+	ring->sq_array[index] = index;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+int
+chat_uring_submit(struct chat_uring *ring)
+{
+	unsigned count = ring->sq_local_tail - *ring->sq_tail;
+	if (count == 0)
+		return 0;
+	__atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+	while (chat_uring_enter(ring->fd, count, 0, 0, NULL, 0) < 0) {
+		if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			return -1;
+	}
+	return 0;
+}
+
+int
+chat_uring_wait(struct chat_uring *ring, double timeout)
+{
+	unsigned count = ring->sq_local_tail - *ring->sq_tail;
+	__atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+	unsigned flags = IORING_ENTER_GETEVENTS;
+	unsigned min_complete = timeout == 0 ? 0 : 1;
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg;
+	const void *argp = NULL;
+	size_t arg_size = 0;
+	if (timeout > 0) {
+		ts.tv_sec = (long long)timeout;
+		ts.tv_nsec = (long long)((timeout - ts.tv_sec) * 1e9);
+		memset(&arg, 0, sizeof(arg));
+		arg.ts = (uint64_t)(uintptr_t)&ts;
+		flags |= IORING_ENTER_EXT_ARG;
+		argp = &arg;
+		arg_size = sizeof(arg);
+	}
+	if (chat_uring_peek(ring) != NULL)
+		min_complete = 0;
+	if (chat_uring_enter(ring->fd, count, min_complete, flags, argp,
+			     arg_size) < 0 && errno != ETIME && errno != EINTR)
+		return -1;
+	/* Reset the eventfd, all the completions are handled next. */
+	uint64_t value;
+	ssize_t rc = read(ring->event_fd, &value, sizeof(value));
+	(void)rc;
+	return 0;
+}
+
+void
+chat_uring_buf_recycle(struct chat_uring *ring, unsigned id)
+{
+	struct io_uring_buf *buf =
+		&ring->buf_ring->bufs[ring->buf_tail & (ring->buf_count - 1)];
+	buf->addr = (uint64_t)(uintptr_t)chat_uring_buf(ring, id);
+	buf->len = ring->buf_size;
+	buf->bid = id;
+	++ring->buf_tail;
+	__atomic_store_n(&ring->buf_ring->tail, ring->buf_tail,
+			 __ATOMIC_RELEASE);
+}
+
+#endif /* CHAT_USE_URING */
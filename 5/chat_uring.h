@@ -0,0 +1,124 @@
+#pragma once
+
+/**
+ * A minimal io_uring ring over the raw syscalls, for the server's
+ * io_uring backend. Not a part of the public API. Only on Linux, the
+ * rest of the systems have CHAT_USE_URING 0 and nothing of that.
+ */
+
+#if defined(__linux__)
+#define CHAT_USE_URING 1
+#else
+#define CHAT_USE_URING 0
+#endif
+
+#if CHAT_USE_URING
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum {
+	/** Buffer group of the provided buffers of a ring. */
+	CHAT_URING_BUF_GROUP = 0,
+};
+
+struct chat_uring {
+	int fd;
+	/** Submission queue, shared with the kernel. */
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	/** Tail with the not submitted entries yet. */
+	unsigned sq_local_tail;
+	/** Completion queue, shared with the kernel. */
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+	/** Eventfd signaled on each completion. */
+	int event_fd;
+	/** Ring of the buffers provided to the kernel for receiving. */
+	struct io_uring_buf_ring *buf_ring;
+	unsigned buf_count;
+	unsigned buf_size;
+	unsigned short buf_tail;
+	char *bufs;
+	/** The mappings, to unmap them. */
+	void *sq_ptr;
+	size_t sq_map_size;
+	void *cq_ptr;
+	size_t cq_map_size;
+	size_t sqes_map_size;
+	size_t buf_ring_map_size;
+};
+
+/**
+ * Create a ring with @a entries submission entries, an eventfd and
+ * @a buf_count provided buffers of @a buf_size each. @a buf_count is
+ * a power of 2.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error, check errno. ENOSYS, EPERM or EINVAL mean
+ *     io_uring or some of its features are not available.
+ */
+int
+chat_uring_open(struct chat_uring *ring, unsigned entries,
+		unsigned buf_count, unsigned buf_size);
+
+void
+chat_uring_close(struct chat_uring *ring);
+
+/**
+ * Get a cleared submission entry. When the queue is full, it is
+ * submitted first.
+ */
+struct io_uring_sqe *
+chat_uring_get_sqe(struct chat_uring *ring);
+
+/** Submit the new entries. Returns 0 or -1. */
+int
+chat_uring_submit(struct chat_uring *ring);
+
+/**
+ * Submit the new entries and wait for a completion. @a timeout is in
+ * seconds, < 0 means infinity. With 0 it does not wait, only runs the
+ * completions pending in the kernel.
+ *
+ * @retval 0 There are completions or the timeout has passed.
+ * @retval -1 Error, check errno.
+ */
+int
+chat_uring_wait(struct chat_uring *ring, double timeout);
+
+/** Next completion, or NULL. It is consumed by chat_uring_seen(). */
+static inline struct io_uring_cqe *
+chat_uring_peek(struct chat_uring *ring)
+{
+	unsigned head = *ring->cq_head;
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &ring->cqes[head & ring->cq_mask];
+}
+
+static inline void
+chat_uring_seen(struct chat_uring *ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/** Data of the provided buffer the kernel has filled. */
+static inline const char *
+chat_uring_buf(const struct chat_uring *ring, unsigned id)
+{
+	return ring->bufs + (size_t)id * ring->buf_size;
+}
+
+/** Give the buffer back to the kernel. */
+void
+chat_uring_buf_recycle(struct chat_uring *ring, unsigned id);
+
+#endif /* CHAT_USE_URING */
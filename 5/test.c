@@ -2,11 +2,21 @@
 #include "chat.h"
 #include "chat_client.h"
 #include "chat_server.h"
+#include "chat_tls.h"
 
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <unistd.h>
+
+#if CHAT_TLS
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+#endif
 
 enum {
 	TEST_MSG_ID_LEN = 64,
@@ -545,6 +555,582 @@ test_stress(void)
 	unit_test_finish();
 }
 
+static void
+test_many_peers(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	uint16_t port = server_get_port(s);
+	/* More than one block of the peer slots on the server. */
+	int client_count = 1100;
+	struct chat_message *msg;
+
+	unit_msg("Connect clients");
+	struct chat_client **clis = malloc(client_count * sizeof(clis[0]));
+	for (int i = 0; i < client_count; ++i) {
+		clis[i] = chat_client_new("cli");
+		unit_fail_if(chat_client_connect(
+			clis[i], make_addr_str(port)) != 0);
+		server_consume_events(s);
+	}
+	unit_msg("Reconnect a half of them, to reuse the slots");
+	for (int i = 0; i < client_count; i += 2) {
+		chat_client_delete(clis[i]);
+		server_consume_events(s);
+		clis[i] = chat_client_new("cli");
+		unit_fail_if(chat_client_connect(
+			clis[i], make_addr_str(port)) != 0);
+		server_consume_events(s);
+	}
+	unit_msg("Broadcast");
+	struct chat_client *cli = clis[0];
+	unit_fail_if(chat_client_feed(cli, "hello\n", 6) != 0);
+	msg = server_pop_next_blocking_from(s, cli);
+	unit_fail_if(strcmp(msg->data, "hello") != 0);
+	chat_message_delete(msg);
+	bool ok = true;
+	for (int i = 1; i < client_count && ok; ++i) {
+		msg = client_pop_next_blocking(clis[i], s);
+		ok = strcmp(msg->data, "hello") == 0;
+		chat_message_delete(msg);
+	}
+	unit_check(ok, "all the peers got the message");
+	struct chat_server_stats stats;
+	chat_server_get_stats(s, &stats);
+	unit_check(stats.peer_count == client_count, "peer count");
+	unit_check(stats.peer_slot_count == 2048, "slots are reused");
+	unit_check(stats.chunk_used_count == 0 && stats.chunk_used_peak > 0,
+		   "idle peers hold no input chunks");
+	for (int i = 0; i < client_count; ++i)
+		chat_client_delete(clis[i]);
+	free(clis);
+	chat_server_delete(s);
+
+	unit_test_finish();
+}
+
+static void
+test_sharded_with(enum chat_server_backend backend)
+{
+	unit_msg("Backend %d", (int)backend);
+	struct chat_server_options opts;
+	memset(&opts, 0, sizeof(opts));
+	opts.thread_count = 4;
+	opts.backend = backend;
+	struct chat_server *s = chat_server_new_with_options(&opts);
+	unit_check(chat_server_update(s, 0) == CHAT_ERR_NOT_STARTED,
+		   "not started");
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	uint16_t port = server_get_port(s);
+	int client_count = 20;
+	struct chat_message *msg;
+
+	unit_msg("Connect clients");
+	struct chat_client **clis = malloc(client_count * sizeof(clis[0]));
+	for (int i = 0; i < client_count; ++i) {
+		clis[i] = chat_client_new("cli");
+		unit_fail_if(chat_client_connect(
+			clis[i], make_addr_str(port)) != 0);
+	}
+	/* The shards accept on their own, wait for them. */
+	struct chat_server_stats stats;
+	do {
+		chat_server_update(s, 0.01);
+		chat_server_get_stats(s, &stats);
+	} while (stats.peer_count != client_count);
+
+	unit_msg("Each client says hello");
+	for (int i = 0; i < client_count; ++i) {
+		char text[64];
+		int len = sprintf(text, "hello %d\n", i);
+		unit_fail_if(chat_client_feed(clis[i], text, len) != 0);
+		while (chat_client_get_events(clis[i]) & CHAT_EVENT_OUTPUT)
+			chat_client_update(clis[i], 1);
+	}
+	unit_msg("Check all is delivered");
+	bool ok = true;
+	for (int i = 0; i < client_count; ++i) {
+		/* Ordered per author, not among authors. */
+		int count = 0;
+		while (count < client_count - 1) {
+			msg = chat_client_pop_next(clis[i]);
+			if (msg == NULL) {
+				if (chat_client_update(clis[i], 5) != 0)
+					break;
+				continue;
+			}
+			int id = -1;
+			sscanf(msg->data, "hello %d", &id);
+			ok = ok && id >= 0 && id < client_count && id != i;
+			chat_message_delete(msg);
+			++count;
+		}
+		ok = ok && count == client_count - 1;
+	}
+	unit_check(ok, "the clients got the messages of all the shards");
+	int count = 0;
+	while (count < client_count) {
+		msg = chat_server_pop_next(s);
+		if (msg == NULL) {
+			if (chat_server_update(s, 5) != 0)
+				break;
+			continue;
+		}
+		chat_message_delete(msg);
+		++count;
+	}
+	unit_check(count == client_count, "the server got all the messages");
+	for (int i = 0; i < client_count; ++i)
+		chat_client_delete(clis[i]);
+	free(clis);
+	chat_server_delete(s);
+}
+
+static void
+test_sharded(void)
+{
+	unit_test_start();
+
+	test_sharded_with(CHAT_SERVER_BACKEND_POLL);
+	test_sharded_with(CHAT_SERVER_BACKEND_URING);
+
+	unit_test_finish();
+}
+
+static void
+test_uring(void)
+{
+	unit_test_start();
+
+	struct chat_server_options opts;
+	memset(&opts, 0, sizeof(opts));
+	opts.thread_count = 0;
+	opts.backend = CHAT_SERVER_BACKEND_URING;
+	struct chat_server *s = chat_server_new_with_options(&opts);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	uint16_t port = server_get_port(s);
+	struct chat_server_stats stats;
+	chat_server_get_stats(s, &stats);
+	if (stats.uring_shard_count == 0)
+		unit_msg("io_uring is not available, testing the fallback");
+	int client_count = 3;
+	struct chat_client *clis[3];
+	for (int i = 0; i < client_count; ++i) {
+		clis[i] = chat_client_new("cli");
+		unit_fail_if(chat_client_connect(
+			clis[i], make_addr_str(port)) != 0);
+	}
+	/* The accepts complete asynchronously. */
+	do {
+		chat_server_update(s, 0.01);
+		chat_server_get_stats(s, &stats);
+	} while (stats.peer_count != client_count);
+
+	unit_msg("Broadcast a small message");
+	unit_fail_if(chat_client_feed(clis[0], "hello\n", 6) != 0);
+	struct chat_message *msg = server_pop_next_blocking_from(s, clis[0]);
+	unit_check(strcmp(msg->data, "hello") == 0, "server got it");
+	chat_message_delete(msg);
+	for (int i = 1; i < client_count; ++i) {
+		msg = client_pop_next_blocking(clis[i], s);
+		unit_check(strcmp(msg->data, "hello") == 0, "client got it");
+		chat_message_delete(msg);
+	}
+
+	unit_msg("Broadcast a big message, sent by many parts");
+	uint32_t len = 1024 * 1024;
+	struct test_msg *big = test_msg_new(len);
+	unit_fail_if(chat_client_feed(clis[1], big->data, big->size) != 0);
+	msg = server_pop_next_blocking_from(s, clis[1]);
+	test_msg_check_data(big, msg->data);
+	chat_message_delete(msg);
+	msg = client_pop_next_blocking(clis[0], s);
+	test_msg_check_data(big, msg->data);
+	chat_message_delete(msg);
+	msg = client_pop_next_blocking(clis[2], s);
+	test_msg_check_data(big, msg->data);
+	chat_message_delete(msg);
+	test_msg_delete(big);
+
+	unit_msg("Disconnect a client");
+	chat_client_delete(clis[2]);
+	do {
+		chat_server_update(s, 0.01);
+		chat_server_get_stats(s, &stats);
+	} while (stats.peer_count != client_count - 1);
+	unit_fail_if(chat_client_feed(clis[0], "bye\n", 4) != 0);
+	msg = server_pop_next_blocking_from(s, clis[0]);
+	chat_message_delete(msg);
+	msg = client_pop_next_blocking(clis[1], s);
+	unit_check(strcmp(msg->data, "bye") == 0, "got the last message");
+	chat_message_delete(msg);
+
+	chat_client_delete(clis[0]);
+	chat_client_delete(clis[1]);
+	chat_server_delete(s);
+
+	unit_test_finish();
+}
+
+static void
+test_overflow_with(enum chat_server_overflow overflow,
+		   enum chat_server_backend backend)
+{
+	unit_msg("Overflow policy %d, backend %d", (int)overflow,
+		 (int)backend);
+	struct chat_server_options opts;
+	memset(&opts, 0, sizeof(opts));
+	opts.backend = backend;
+	opts.out_limit_size = 64 * 1024;
+	opts.overflow = overflow;
+	struct chat_server *s = chat_server_new_with_options(&opts);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	uint16_t port = server_get_port(s);
+	struct chat_client *fast = chat_client_new("fast");
+	struct chat_client *slow = chat_client_new("slow");
+	unit_fail_if(chat_client_connect(fast, make_addr_str(port)) != 0);
+	unit_fail_if(chat_client_connect(slow, make_addr_str(port)) != 0);
+	struct chat_server_stats stats;
+	do {
+		chat_server_update(s, 0.01);
+		chat_server_get_stats(s, &stats);
+	} while (stats.peer_count != 2);
+
+	unit_msg("Send to a client not reading until the limit works");
+	char text[1024];
+	memset(text, 'x', sizeof(text));
+	text[sizeof(text) - 1] = '\n';
+	int sent = 0;
+	int server_count = 0;
+	struct chat_message *msg;
+	do {
+		sprintf(text, "%d ", sent++);
+		text[strlen(text)] = 'x';
+		unit_fail_if(chat_client_feed(fast, text, sizeof(text)) != 0);
+		chat_client_update(fast, 0);
+		chat_server_update(s, 0);
+		while ((msg = chat_server_pop_next(s)) != NULL) {
+			chat_message_delete(msg);
+			++server_count;
+		}
+		chat_server_get_stats(s, &stats);
+	} while (stats.drop_count + stats.eviction_count +
+		 stats.pause_count == 0 && sent < 100000);
+
+	unit_msg("Let it read");
+	unit_fail_if(chat_client_feed(fast, "end\n", 4) != 0);
+	int count = 0;
+	int last = -1;
+	bool is_end = false;
+	while (!is_end && chat_client_get_events(slow) != 0) {
+		chat_client_update(slow, 0);
+		chat_client_update(fast, 0);
+		chat_server_update(s, 0);
+		while ((msg = chat_server_pop_next(s)) != NULL) {
+			chat_message_delete(msg);
+			++server_count;
+		}
+		while ((msg = chat_client_pop_next(slow)) != NULL) {
+			if (strcmp(msg->data, "end") == 0) {
+				is_end = true;
+			} else {
+				sscanf(msg->data, "%d", &last);
+				++count;
+			}
+			chat_message_delete(msg);
+		}
+	}
+	chat_server_get_stats(s, &stats);
+	switch (overflow) {
+	case CHAT_SERVER_OVERFLOW_DROP_OLDEST:
+		unit_check(stats.drop_count > 0 && stats.eviction_count == 0,
+			   "dropped");
+		unit_check(is_end && count + (int)stats.drop_count == sent &&
+			   last == sent - 1, "kept the newest messages");
+		break;
+	case CHAT_SERVER_OVERFLOW_DISCONNECT:
+		unit_check(stats.eviction_count == 1 && stats.drop_count == 0,
+			   "evicted");
+		unit_check(!is_end && count < sent, "disconnected");
+		break;
+	case CHAT_SERVER_OVERFLOW_PAUSE:
+		unit_check(stats.pause_count > 0 && stats.eviction_count == 0 &&
+			   stats.drop_count == 0, "paused");
+		unit_check(is_end && count == sent, "nothing is lost");
+		break;
+	}
+	while (server_count < sent + 1) {
+		msg = server_pop_next_blocking_from(s, fast);
+		chat_message_delete(msg);
+		++server_count;
+	}
+	unit_check(server_count == sent + 1, "the server got all");
+	chat_client_delete(fast);
+	chat_client_delete(slow);
+	chat_server_delete(s);
+}
+
+static void
+test_overflow(void)
+{
+	unit_test_start();
+
+	enum chat_server_backend poll = CHAT_SERVER_BACKEND_POLL;
+	enum chat_server_backend uring = CHAT_SERVER_BACKEND_URING;
+	test_overflow_with(CHAT_SERVER_OVERFLOW_DROP_OLDEST, poll);
+	test_overflow_with(CHAT_SERVER_OVERFLOW_DISCONNECT, poll);
+	test_overflow_with(CHAT_SERVER_OVERFLOW_PAUSE, poll);
+	test_overflow_with(CHAT_SERVER_OVERFLOW_DROP_OLDEST, uring);
+	test_overflow_with(CHAT_SERVER_OVERFLOW_PAUSE, uring);
+
+	unit_test_finish();
+}
+
+/** A peer of the text protocol, like nc. */
+static int
+text_peer_connect(uint16_t port)
+{
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	unit_fail_if(sock < 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	unit_fail_if(connect(sock, (struct sockaddr *)&addr,
+			     sizeof(addr)) != 0);
+	return sock;
+}
+
+/** Read from the text peer until the buffer ends with @a tail. */
+static bool
+text_peer_read_until(int sock, struct chat_server *s, char *buf, size_t size,
+		     const char *tail)
+{
+	size_t len = 0;
+	size_t tail_len = strlen(tail);
+	while (len < size - 1) {
+		chat_server_update(s, 0.01);
+		ssize_t rc = recv(sock, buf + len, size - 1 - len,
+				  MSG_DONTWAIT);
+		if (rc == 0)
+			return false;
+		if (rc > 0)
+			len += rc;
+		buf[len] = 0;
+		if (len >= tail_len && strcmp(buf + len - tail_len, tail) == 0)
+			return true;
+	}
+	return false;
+}
+
+static void
+test_authors(void)
+{
+#if NEED_AUTHOR
+	unit_test_start();
+
+	struct chat_server_options opts;
+	memset(&opts, 0, sizeof(opts));
+	opts.thread_count = 2;
+	struct chat_server *s = chat_server_new_with_options(&opts);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	uint16_t port = server_get_port(s);
+	struct chat_client *c1 = chat_client_new("alice");
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	struct chat_client *c2 = chat_client_new("bob");
+	unit_fail_if(chat_client_connect(c2, make_addr_str(port)) != 0);
+	int text = text_peer_connect(port);
+
+	unit_msg("The text peer gets the lines, the clients the names");
+	unit_fail_if(send(text, "  hi all \n", 10, 0) != 10);
+	struct chat_message *msg = server_pop_next_blocking_from(s, c1);
+	unit_check(strcmp(msg->data, "hi all") == 0 &&
+		   author_is_eq(msg, ""), "server got the text line");
+	chat_message_delete(msg);
+	msg = client_pop_next_blocking(c1, s);
+	unit_check(strcmp(msg->data, "hi all") == 0 &&
+		   author_is_eq(msg, ""), "a client got it with no name");
+	chat_message_delete(msg);
+	msg = client_pop_next_blocking(c2, s);
+	unit_check(strcmp(msg->data, "hi all") == 0, "the other one too");
+	chat_message_delete(msg);
+	unit_fail_if(chat_client_feed(c1, "hello\nfrom ", 11) != 0);
+	unit_fail_if(chat_client_feed(c1, "alice\n", 6) != 0);
+	client_consume_events(c1);
+	msg = client_pop_next_blocking(c2, s);
+	unit_check(strcmp(msg->data, "hello") == 0 &&
+		   author_is_eq(msg, "alice"), "first message with the name");
+	chat_message_delete(msg);
+	msg = client_pop_next_blocking(c2, s);
+	unit_check(strcmp(msg->data, "from alice") == 0 &&
+		   author_is_eq(msg, "alice"), "second message with the name");
+	chat_message_delete(msg);
+	char buf[256];
+	unit_check(text_peer_read_until(text, s, buf, sizeof(buf),
+					"hello\nfrom alice\n"),
+		   "the text peer got the lines");
+
+	unit_msg("A late client learns the names of the others");
+	struct chat_client *c3 = chat_client_new("carol");
+	unit_fail_if(chat_client_connect(c3, make_addr_str(port)) != 0);
+	struct chat_server_stats stats;
+	do {
+		chat_server_update(s, 0.01);
+		chat_client_update(c3, 0);
+		chat_server_get_stats(s, &stats);
+	} while (stats.peer_count != 4);
+	unit_fail_if(chat_client_feed(c2, "hey carol\n", 10) != 0);
+	client_consume_events(c2);
+	msg = client_pop_next_blocking(c3, s);
+	unit_check(strcmp(msg->data, "hey carol") == 0 &&
+		   author_is_eq(msg, "bob"), "the late one knows bob");
+	chat_message_delete(msg);
+	msg = client_pop_next_blocking(c1, s);
+	chat_message_delete(msg);
+	unit_fail_if(chat_client_feed(c3, "hi\n", 3) != 0);
+	client_consume_events(c3);
+	msg = client_pop_next_blocking(c1, s);
+	unit_check(strcmp(msg->data, "hi") == 0 &&
+		   author_is_eq(msg, "carol"), "the others know carol");
+	chat_message_delete(msg);
+
+	close(text);
+	chat_client_delete(c1);
+	chat_client_delete(c2);
+	chat_client_delete(c3);
+	while ((msg = chat_server_pop_next(s)) != NULL)
+		chat_message_delete(msg);
+	chat_server_delete(s);
+
+	unit_test_finish();
+#endif
+}
+
+static void
+test_idle_with(enum chat_server_backend backend)
+{
+	unit_msg("Backend %d", (int)backend);
+	struct chat_server_options opts;
+	memset(&opts, 0, sizeof(opts));
+	opts.backend = backend;
+	opts.idle_timeout = 0.3;
+	opts.keepalive_interval = 0.1;
+	struct chat_server *s = chat_server_new_with_options(&opts);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	uint16_t port = server_get_port(s);
+	unit_check(chat_server_get_timeout(s) < 0, "no timers without peers");
+	struct chat_client *alive = chat_client_new("alive");
+	unit_fail_if(chat_client_connect(alive, make_addr_str(port)) != 0);
+	/* Connected, never answers. */
+	struct chat_client *dead = chat_client_new("dead");
+	unit_fail_if(chat_client_connect(dead, make_addr_str(port)) != 0);
+	int text = text_peer_connect(port);
+	struct chat_server_stats stats;
+	do {
+		chat_server_update(s, 0.01);
+		chat_client_update(alive, 0);
+		chat_server_get_stats(s, &stats);
+	} while (stats.peer_count != 3);
+	double timeout = chat_server_get_timeout(s);
+	unit_check(timeout >= 0 && timeout <= 0.1, "timer timeout");
+
+	/* A few idle timeouts, the live one answers the pings. */
+	for (int i = 0; i < 100; ++i) {
+		chat_server_update(s, 0.01);
+		chat_client_update(alive, 0.001);
+	}
+	chat_server_get_stats(s, &stats);
+	unit_check(stats.peer_count == 1, "the silent ones are closed");
+	unit_check(stats.idle_count == 2, "idle count");
+	unit_check(stats.ping_count > 2, "pings are sent");
+	char buf[16];
+	unit_check(recv(text, buf, sizeof(buf), 0) == 0,
+		   "the text peer got EOF");
+	unit_fail_if(chat_client_feed(alive, "still here\n", 11) != 0);
+	struct chat_message *msg = server_pop_next_blocking_from(s, alive);
+	unit_check(strcmp(msg->data, "still here") == 0, "the live one works");
+	chat_message_delete(msg);
+
+	close(text);
+	chat_client_delete(alive);
+	chat_client_delete(dead);
+	chat_server_delete(s);
+}
+
+static void
+test_idle(void)
+{
+	unit_test_start();
+
+	test_idle_with(CHAT_SERVER_BACKEND_POLL);
+	test_idle_with(CHAT_SERVER_BACKEND_URING);
+
+	unit_test_finish();
+}
+
+static void
+test_flush_window(void)
+{
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new();
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	uint16_t port = server_get_port(s);
+	struct chat_client_options opts;
+	memset(&opts, 0, sizeof(opts));
+	opts.flush_window_us = 100 * 1000;
+	opts.flush_size = 1024;
+	struct chat_client *c1 = chat_client_new_with_options("c1", &opts);
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	client_consume_events(c1);
+
+	unit_msg("Small messages are held for the window");
+	char buf[16];
+	for (int i = 0; i < 10; ++i) {
+		int len = sprintf(buf, "%d\n", i);
+		unit_fail_if(chat_client_feed(c1, buf, len) != 0);
+	}
+	unit_check((chat_client_get_events(c1) & CHAT_EVENT_OUTPUT) == 0,
+		   "no output wanted");
+	double timeout = chat_client_get_timeout(c1);
+	unit_check(timeout > 0 && timeout <= 0.1, "the window timeout");
+	unit_check(chat_client_update(c1, 0) == CHAT_ERR_TIMEOUT,
+		   "nothing to do yet");
+	server_consume_events(s);
+	unit_check(chat_server_pop_next(s) == NULL, "nothing is sent");
+	unit_check(chat_client_update(c1, -1) == 0, "sent after the window");
+	unit_check(chat_client_get_timeout(c1) < 0, "nothing is held");
+	bool ok = true;
+	for (int i = 0; i < 10 && ok; ++i) {
+		struct chat_message *msg = server_pop_next_blocking_from(s, c1);
+		sprintf(buf, "%d", i);
+		ok = strcmp(msg->data, buf) == 0;
+		chat_message_delete(msg);
+	}
+	unit_check(ok, "the batch came in order");
+
+	unit_msg("A big batch goes without waiting");
+	char *big = malloc(opts.flush_size + 1);
+	memset(big, 'a', opts.flush_size);
+	big[opts.flush_size] = '\n';
+	unit_fail_if(chat_client_feed(c1, big, opts.flush_size + 1) != 0);
+	free(big);
+	unit_check((chat_client_get_events(c1) & CHAT_EVENT_OUTPUT) != 0,
+		   "output wanted");
+	unit_check(chat_client_get_timeout(c1) < 0, "nothing is held");
+	struct chat_message *msg = server_pop_next_blocking_from(s, c1);
+	unit_check(strlen(msg->data) == opts.flush_size, "got the big one");
+	chat_message_delete(msg);
+
+	chat_client_delete(c1);
+	chat_server_delete(s);
+
+	unit_test_finish();
+}
+
 static void
 test_big_author(void)
 {
@@ -677,6 +1263,628 @@ test_server_feed(void)
 #endif
 }
 
+static void
+test_server_feed_buffer(void)
+{
+#if NEED_SERVER_FEED
+	unit_test_start();
+
+	struct chat_server *s = chat_server_new_sharded(2);
+	char *buf = chat_server_feed_buffer_new(10);
+	unit_check(chat_server_feed_buffer(s, buf, 5) == CHAT_ERR_NOT_STARTED,
+		   "feed before listen");
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	uint16_t port = server_get_port(s);
+	buf = chat_server_feed_buffer_new(10);
+	unit_check(chat_server_feed_buffer(s, buf, 11) ==
+		   CHAT_ERR_INVALID_ARGUMENT, "feed over the buffer");
+	struct chat_client *c1 = chat_client_new("c1");
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	struct chat_client *c2 = chat_client_new("c2");
+	unit_fail_if(chat_client_connect(c2, make_addr_str(port)) != 0);
+	struct chat_server_stats stats;
+	do {
+		chat_server_update(s, 0.01);
+		chat_client_update(c1, 0);
+		chat_client_update(c2, 0);
+		chat_server_get_stats(s, &stats);
+	} while (stats.peer_count != 2);
+
+	unit_msg("A big message right from the buffer");
+	uint32_t size = 100 * 1000;
+	buf = chat_server_feed_buffer_new(size);
+	memset(buf, 'a', size);
+	unit_check(chat_server_feed_buffer(s, buf, size) == 0, "feed buffer");
+	struct chat_client *clis[] = {c1, c2};
+	for (int i = 0; i < 2; ++i) {
+		struct chat_message *msg = client_pop_next_blocking(clis[i], s);
+		unit_check(strlen(msg->data) == size && msg->data[0] == 'a' &&
+			   author_is_eq(msg, "server"), "got the big one");
+		chat_message_delete(msg);
+	}
+
+	unit_msg("A late client knows the server's name");
+	struct chat_client *c3 = chat_client_new("c3");
+	unit_fail_if(chat_client_connect(c3, make_addr_str(port)) != 0);
+	do {
+		chat_server_update(s, 0.01);
+		chat_client_update(c3, 0);
+		chat_server_get_stats(s, &stats);
+	} while (stats.peer_count != 3);
+	unit_check(chat_server_feed(s, "hello\n", 6) == 0, "feed server");
+	struct chat_message *msg = client_pop_next_blocking(c3, s);
+	unit_check(strcmp(msg->data, "hello") == 0 &&
+		   author_is_eq(msg, "server"), "got the line");
+	chat_message_delete(msg);
+	unit_check(chat_server_pop_next(s) == NULL,
+		   "the server does not get its own messages");
+
+	chat_client_delete(c1);
+	chat_client_delete(c2);
+	chat_client_delete(c3);
+	chat_server_delete(s);
+
+	unit_test_finish();
+#endif
+}
+
+static void
+test_udp(void)
+{
+	unit_test_start();
+
+	struct chat_server_options opts;
+	memset(&opts, 0, sizeof(opts));
+	opts.use_udp = true;
+	struct chat_server *s = chat_server_new_with_options(&opts);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	uint16_t port = server_get_port(s);
+	struct chat_client_options copts;
+	memset(&copts, 0, sizeof(copts));
+	copts.use_udp = true;
+	struct chat_client *c1 = chat_client_new_with_options("alice", &copts);
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	struct chat_client *c2 = chat_client_new_with_options("bob", &copts);
+	unit_fail_if(chat_client_connect(c2, make_addr_str(port)) != 0);
+	struct chat_client *c3 = chat_client_new("carol");
+	unit_fail_if(chat_client_connect(c3, make_addr_str(port)) != 0);
+	struct chat_server_stats stats;
+	do {
+		chat_server_update(s, 0.01);
+		chat_server_get_stats(s, &stats);
+	} while (stats.peer_count != 3);
+
+	unit_msg("UDP and TCP peers talk to each other");
+	unit_fail_if(chat_client_feed(c1, "over udp\n", 9) != 0);
+	client_consume_events(c1);
+	struct chat_message *msg = server_pop_next_blocking_from(s, c1);
+	unit_check(strcmp(msg->data, "over udp") == 0 &&
+		   author_is_eq(msg, "alice"), "server got the datagram");
+	chat_message_delete(msg);
+	msg = client_pop_next_blocking(c2, s);
+	unit_check(strcmp(msg->data, "over udp") == 0 &&
+		   author_is_eq(msg, "alice"), "a UDP peer got it");
+	chat_message_delete(msg);
+	msg = client_pop_next_blocking(c3, s);
+	unit_check(strcmp(msg->data, "over udp") == 0 &&
+		   author_is_eq(msg, "alice"), "a TCP peer got it");
+	chat_message_delete(msg);
+	unit_fail_if(chat_client_feed(c3, "over tcp\n", 9) != 0);
+	client_consume_events(c3);
+	msg = client_pop_next_blocking(c1, s);
+	unit_check(strcmp(msg->data, "over tcp") == 0 &&
+		   author_is_eq(msg, "carol"), "a UDP peer got TCP's");
+	chat_message_delete(msg);
+	msg = client_pop_next_blocking(c2, s);
+	chat_message_delete(msg);
+	server_consume_events(s);
+	while ((msg = chat_server_pop_next(s)) != NULL)
+		chat_message_delete(msg);
+
+	unit_msg("A broadcast to the UDP peers is batched");
+	struct chat_server_stats before;
+	chat_server_get_stats(s, &before);
+	const int count = 100;
+	for (int i = 0; i < count; ++i) {
+		char line[32];
+		int len = sprintf(line, "feed %03d\n", i);
+		unit_fail_if(chat_server_feed(s, line, len) != 0);
+	}
+	server_consume_events(s);
+	chat_server_get_stats(s, &stats);
+	uint64_t datagrams = stats.udp_datagram_count -
+			     before.udp_datagram_count;
+	uint64_t sends = stats.udp_send_count - before.udp_send_count;
+	unit_check(datagrams >= 2 * (uint64_t)count, "all datagrams are sent");
+	unit_check(sends <= 2, "in a couple of calls");
+	for (int i = 0; i < count; ++i) {
+		char line[32];
+		sprintf(line, "feed %03d", i);
+		msg = client_pop_next_blocking(c2, s);
+		unit_fail_if(strcmp(msg->data, line) != 0 ||
+			     !author_is_eq(msg, "server"));
+		chat_message_delete(msg);
+		msg = client_pop_next_blocking(c1, s);
+		unit_fail_if(strcmp(msg->data, line) != 0);
+		chat_message_delete(msg);
+		msg = client_pop_next_blocking(c3, s);
+		chat_message_delete(msg);
+	}
+	unit_check(true, "the UDP peers got all in order");
+
+	unit_msg("A UDP peer leaves with a frame");
+	chat_client_delete(c2);
+	do {
+		chat_server_update(s, 0.01);
+		chat_server_get_stats(s, &stats);
+	} while (stats.peer_count != 2);
+	unit_check(true, "the peer is gone");
+
+	chat_client_delete(c1);
+	chat_client_delete(c3);
+	chat_server_delete(s);
+
+	unit_test_finish();
+}
+
+static void
+test_history_with(int thread_count)
+{
+	unit_msg("History with %d threads", thread_count);
+	struct chat_server_options opts;
+	memset(&opts, 0, sizeof(opts));
+	opts.thread_count = thread_count;
+	opts.history_count = 3;
+	opts.history_size = 3 * (CHAT_FRAME_HEADER_SIZE + 2);
+	struct chat_server *s = chat_server_new_with_options(&opts);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	uint16_t port = server_get_port(s);
+	struct chat_client *c1 = chat_client_new("alice");
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	unit_fail_if(chat_client_feed(c1, "m0\nm1\nm2\nm3\nm4\n", 15) != 0);
+	for (int i = 0; i < 5; ++i)
+		chat_message_delete(server_pop_next_blocking_from(s, c1));
+	/* The other shards get them a bit later. */
+	if (thread_count > 0)
+		usleep(100000);
+
+	struct chat_client *c2 = chat_client_new("bob");
+	unit_fail_if(chat_client_connect(c2, make_addr_str(port)) != 0);
+	bool is_ok = true;
+	for (int i = 2; i < 5; ++i) {
+		char line[8];
+		sprintf(line, "m%d", i);
+		struct chat_message *msg = client_pop_next_blocking(c2, s);
+		is_ok = is_ok && strcmp(msg->data, line) == 0 &&
+			author_is_eq(msg, "alice");
+		chat_message_delete(msg);
+	}
+	unit_check(is_ok, "a late client gets the last messages");
+	unit_fail_if(chat_client_feed(c1, "m5\n", 3) != 0);
+	client_consume_events(c1);
+	struct chat_message *msg = client_pop_next_blocking(c2, s);
+	unit_check(strcmp(msg->data, "m5") == 0, "and then the new ones, "
+		   "no repeats");
+	chat_message_delete(msg);
+	chat_message_delete(server_pop_next_blocking_from(s, c1));
+	if (thread_count > 0)
+		usleep(100000);
+
+	int text = text_peer_connect(port);
+	unit_fail_if(send(text, "t\n", 2, 0) != 2);
+	char buf[256];
+	unit_check(text_peer_read_until(text, s, buf, sizeof(buf),
+					"m5\n") &&
+		   strcmp(buf, "m3\nm4\nm5\n") == 0,
+		   "a late text peer gets them as lines");
+
+	unit_fail_if(chat_client_feed(c1, "a message over the size limit\n",
+				      30) != 0);
+	client_consume_events(c1);
+	struct chat_server_stats stats;
+	do {
+		chat_server_update(s, 0.01);
+		chat_server_get_stats(s, &stats);
+	} while (stats.history_count != 0);
+	unit_check(stats.history_size == 0, "the size is a strict bound");
+
+	close(text);
+	chat_client_delete(c1);
+	chat_client_delete(c2);
+	while ((msg = chat_server_pop_next(s)) != NULL)
+		chat_message_delete(msg);
+	chat_server_delete(s);
+}
+
+static void
+test_history(void)
+{
+	unit_test_start();
+
+	test_history_with(0);
+	test_history_with(2);
+
+	unit_test_finish();
+}
+
+#if CHAT_TLS
+
+/** A self-signed certificate of localhost and its key, in a file. */
+static void
+tls_make_cert(const char *path)
+{
+	EVP_PKEY *key = EVP_EC_gen("P-256");
+	X509 *x = X509_new();
+	X509_set_version(x, 2);
+	ASN1_INTEGER_set(X509_get_serialNumber(x), 1);
+	X509_gmtime_adj(X509_getm_notBefore(x), 0);
+	X509_gmtime_adj(X509_getm_notAfter(x), 3600);
+	X509_set_pubkey(x, key);
+	X509_NAME *name = X509_get_subject_name(x);
+	X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+				   (const unsigned char *)"localhost", -1, -1,
+				   0);
+	X509_set_issuer_name(x, name);
+	X509V3_CTX ctx;
+	X509V3_set_ctx_nodb(&ctx);
+	X509V3_set_ctx(&ctx, x, x, NULL, NULL, 0);
+	X509_EXTENSION *ext = X509V3_EXT_conf_nid(NULL, &ctx,
+		NID_subject_alt_name, "DNS:localhost,IP:127.0.0.1");
+	X509_add_ext(x, ext, -1);
+	X509_EXTENSION_free(ext);
+	X509_sign(x, key, EVP_sha256());
+	FILE *f = fopen(path, "w");
+	unit_fail_if(f == NULL);
+	PEM_write_X509(f, x);
+	PEM_write_PrivateKey(f, key, NULL, NULL, 0, NULL, NULL);
+	fclose(f);
+	X509_free(x);
+	EVP_PKEY_free(key);
+}
+
+/** Whether the kernel takes TLS sessions, tried on a connection. */
+static bool
+tls_has_ktls(void)
+{
+	struct chat_server *s = chat_server_new();
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(server_get_port(s));
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	unit_fail_if(connect(sock, (struct sockaddr *)&addr,
+			     sizeof(addr)) != 0);
+	bool ok = setsockopt(sock, SOL_TCP, TCP_ULP, "tls", 3) == 0;
+	close(sock);
+	chat_server_delete(s);
+	return ok;
+}
+
+/** Update both till the client is closed, or a message comes. */
+static struct chat_message *
+tls_client_pop_next(struct chat_client *c, struct chat_server *s)
+{
+	struct chat_message *msg;
+	while ((msg = chat_client_pop_next(c)) == NULL) {
+		if (chat_client_update(c, 0) == CHAT_ERR_NOT_STARTED)
+			return NULL;
+		chat_server_update(s, 0);
+	}
+	return msg;
+}
+
+static void
+test_tls_with(int thread_count, const char *cert, const char *other_cert,
+	      bool has_ktls)
+{
+	unit_msg("TLS with %d threads", thread_count);
+	struct chat_server_options opts;
+	memset(&opts, 0, sizeof(opts));
+	opts.thread_count = thread_count;
+	opts.tls_cert_file = cert;
+	struct chat_server *s = chat_server_new_with_options(&opts);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	uint16_t port = server_get_port(s);
+
+	struct chat_client_options copts;
+	memset(&copts, 0, sizeof(copts));
+	copts.use_tls = true;
+	copts.tls_ca_file = other_cert;
+	struct chat_client *c = chat_client_new_with_options("eve", &copts);
+	unit_fail_if(chat_client_connect(c, make_addr_str(port)) != 0);
+	unit_check(tls_client_pop_next(c, s) == NULL, "a certificate of "
+		   "another CA is not taken");
+	chat_client_delete(c);
+
+	copts.tls_ca_file = cert;
+	struct chat_client *c1 = chat_client_new_with_options("alice",
+							      &copts);
+	struct chat_client *c2 = chat_client_new_with_options("bob", &copts);
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	unit_fail_if(chat_client_connect(c2, make_addr_str(port)) != 0);
+	/* Held till the handshake. */
+	unit_fail_if(chat_client_feed(c1, "secret\n", 7) != 0);
+	struct chat_message *msg = tls_client_pop_next(c2, s);
+	if (!has_ktls) {
+		unit_msg("no kTLS in the kernel");
+		unit_check(msg == NULL, "the client is closed");
+	} else {
+		unit_check(msg != NULL && strcmp(msg->data, "secret") == 0 &&
+			   author_is_eq(msg, "alice"), "a message goes "
+			   "through kTLS");
+		if (msg != NULL)
+			chat_message_delete(msg);
+		unit_fail_if(chat_client_feed(c2, "reply\n", 6) != 0);
+		msg = tls_client_pop_next(c1, s);
+		unit_check(msg != NULL && strcmp(msg->data, "reply") == 0,
+			   "and back");
+		if (msg != NULL)
+			chat_message_delete(msg);
+	}
+	chat_client_delete(c1);
+	chat_client_delete(c2);
+	while ((msg = chat_server_pop_next(s)) != NULL)
+		chat_message_delete(msg);
+	chat_server_delete(s);
+}
+
+#endif /* CHAT_TLS */
+
+static void
+test_tls(void)
+{
+	unit_test_start();
+
+	struct chat_server_options opts;
+	memset(&opts, 0, sizeof(opts));
+	opts.tls_cert_file = "no_such_file.pem";
+	opts.use_udp = true;
+	struct chat_server *s = chat_server_new_with_options(&opts);
+	unit_check(chat_server_listen(s, 0) == CHAT_ERR_INVALID_ARGUMENT,
+		   "no TLS over UDP");
+	chat_server_delete(s);
+	opts.use_udp = false;
+	s = chat_server_new_with_options(&opts);
+	int rc = chat_server_listen(s, 0);
+	struct chat_client_options copts;
+	memset(&copts, 0, sizeof(copts));
+	copts.use_tls = true;
+	copts.tls_ca_file = "no_such_file.pem";
+	struct chat_client *c = chat_client_new_with_options("c", &copts);
+	int crc = chat_client_connect(c, "localhost:1");
+	chat_client_delete(c);
+	chat_server_delete(s);
+#if CHAT_TLS
+	unit_check(rc == CHAT_ERR_INVALID_ARGUMENT, "server, no certificate");
+	unit_check(crc == CHAT_ERR_INVALID_ARGUMENT, "client, no CA file");
+
+	char cert[] = "/tmp/chat_test_cert_XXXXXX";
+	char other_cert[] = "/tmp/chat_test_cert_XXXXXX";
+	close(mkstemp(cert));
+	close(mkstemp(other_cert));
+	tls_make_cert(cert);
+	tls_make_cert(other_cert);
+	bool has_ktls = tls_has_ktls();
+	test_tls_with(0, cert, other_cert, has_ktls);
+	test_tls_with(2, cert, other_cert, has_ktls);
+	unlink(cert);
+	unlink(other_cert);
+#else
+	unit_check(rc == CHAT_ERR_NOT_IMPLEMENTED, "server, no TLS built");
+	unit_check(crc == CHAT_ERR_NOT_IMPLEMENTED, "client, no TLS built");
+#endif
+
+	unit_test_finish();
+}
+
+/** Next frame of a raw binary peer, not a name one. */
+static bool
+raw_peer_next_frame(int sock, struct chat_server *s, char *buf, size_t size,
+		    struct chat_frame *frame)
+{
+	size_t len = 0;
+	while (len < size) {
+		chat_server_update(s, 0.01);
+		ssize_t rc = recv(sock, buf + len, size - len, MSG_DONTWAIT);
+		if (rc == 0)
+			return false;
+		if (rc > 0)
+			len += rc;
+		while (len >= CHAT_FRAME_HEADER_SIZE) {
+			size_t frame_size = CHAT_FRAME_HEADER_SIZE +
+					    chat_decode_u32(buf);
+			if (len < frame_size)
+				break;
+			frame->type = (unsigned char)buf[4];
+			frame->payload.size = frame_size -
+					      CHAT_FRAME_HEADER_SIZE;
+			if (frame->type != CHAT_FRAME_NAME)
+				return true;
+			memmove(buf, buf + frame_size, len - frame_size);
+			len -= frame_size;
+		}
+	}
+	return false;
+}
+
+static void
+test_lz_with(int thread_count)
+{
+	unit_msg("LZ with %d threads", thread_count);
+	const char *dict = "anyone want to trade? selling a sword, cheap! "
+			   "looking for group, need a healer. lol gg wp ";
+	struct chat_server_options opts;
+	memset(&opts, 0, sizeof(opts));
+	opts.thread_count = thread_count;
+	opts.use_lz = true;
+	opts.lz_dict = dict;
+	opts.lz_dict_size = strlen(dict);
+	struct chat_server *s = chat_server_new_with_options(&opts);
+	unit_fail_if(chat_server_listen(s, 0) != 0);
+	uint16_t port = server_get_port(s);
+
+	struct chat_client_options copts;
+	memset(&copts, 0, sizeof(copts));
+	copts.use_lz = true;
+	copts.lz_dict = dict;
+	copts.lz_dict_size = strlen(dict);
+	struct chat_client *c1 = chat_client_new("spammer");
+	struct chat_client *c2 = chat_client_new_with_options("lz", &copts);
+	copts.lz_dict = "another dictionary";
+	copts.lz_dict_size = strlen(copts.lz_dict);
+	struct chat_client *c3 = chat_client_new_with_options("other",
+							      &copts);
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	unit_fail_if(chat_client_connect(c2, make_addr_str(port)) != 0);
+	unit_fail_if(chat_client_connect(c3, make_addr_str(port)) != 0);
+	/* A peer of the same dictionary, to see what is on the wire. */
+	int raw = text_peer_connect(port);
+	char out[64];
+	out[0] = (char)CHAT_PROTO_MAGIC;
+	chat_frame_encode_header(out + 1, CHAT_FRAME_FEATURES, 0,
+				 CHAT_FEATURES_SIZE);
+	chat_encode_u32(out + 1 + CHAT_FRAME_HEADER_SIZE, CHAT_FEATURE_LZ);
+	chat_encode_u32(out + 5 + CHAT_FRAME_HEADER_SIZE,
+			chat_lz_dict_id(dict, strlen(dict)));
+	size_t len = 1 + CHAT_FRAME_HEADER_SIZE + CHAT_FEATURES_SIZE;
+	chat_frame_encode_header(out + len, CHAT_FRAME_HELLO, 0, 3);
+	memcpy(out + len + CHAT_FRAME_HEADER_SIZE, "raw", 3);
+	len += CHAT_FRAME_HEADER_SIZE + 3;
+	unit_fail_if(send(raw, out, len, 0) != (ssize_t)len);
+	/* All have joined, so all get the messages. */
+	chat_client_update(c2, 0);
+	chat_client_update(c3, 0);
+	for (int i = 0; i < 10; ++i)
+		chat_server_update(s, 0.01);
+
+	const char *spam = "anyone want to trade? selling a sword, cheap!";
+	size_t spam_len = strlen(spam);
+	unit_fail_if(chat_client_feed(c1, spam, spam_len) != 0);
+	unit_fail_if(chat_client_feed(c1, "\ngg\n", 4) != 0);
+	client_consume_events(c1);
+	struct chat_message *msg = client_pop_next_blocking(c2, s);
+	unit_check(strcmp(msg->data, spam) == 0 &&
+		   author_is_eq(msg, "spammer"), "a compressed message");
+	chat_message_delete(msg);
+	msg = client_pop_next_blocking(c2, s);
+	unit_check(strcmp(msg->data, "gg") == 0, "a short one, plain");
+	chat_message_delete(msg);
+	msg = client_pop_next_blocking(c3, s);
+	unit_check(strcmp(msg->data, spam) == 0, "another dictionary gets "
+		   "them plain");
+	chat_message_delete(msg);
+	msg = client_pop_next_blocking(c3, s);
+	chat_message_delete(msg);
+
+	char buf[256];
+	struct chat_frame frame;
+	unit_fail_if(!raw_peer_next_frame(raw, s, buf, sizeof(buf), &frame));
+	unit_check(frame.type == CHAT_FRAME_MESSAGE_LZ, "the frame is "
+		   "compressed");
+	unit_msg("%zu bytes in %zu", spam_len, frame.payload.size);
+	unit_check(frame.payload.size < spam_len / 2, "a lot smaller");
+
+	close(raw);
+	chat_client_delete(c1);
+	chat_client_delete(c2);
+	chat_client_delete(c3);
+	while ((msg = chat_server_pop_next(s)) != NULL)
+		chat_message_delete(msg);
+	chat_server_delete(s);
+}
+
+static void
+test_lz(void)
+{
+	unit_test_start();
+
+	test_lz_with(0);
+	test_lz_with(2);
+
+	unit_test_finish();
+}
+
+/** A listening socket on a port chosen by the kernel. */
+static int
+listen_socket_new(uint16_t *port)
+{
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	unit_fail_if(sock < 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t len = sizeof(addr);
+	unit_fail_if(bind(sock, (struct sockaddr *)&addr, len) != 0);
+	unit_fail_if(listen(sock, SOMAXCONN) != 0);
+	unit_fail_if(getsockname(sock, (struct sockaddr *)&addr, &len) != 0);
+	*port = ntohs(addr.sin_port);
+	return sock;
+}
+
+static void
+test_listen_socket(void)
+{
+	unit_test_start();
+
+	uint16_t port;
+	int sock = listen_socket_new(&port);
+	struct chat_server_options opts;
+	memset(&opts, 0, sizeof(opts));
+	opts.use_udp = true;
+	struct chat_server *s1 = chat_server_new_with_options(&opts);
+	unit_check(chat_server_listen_socket(s1, sock) ==
+		   CHAT_ERR_INVALID_ARGUMENT, "no UDP");
+	unit_check(fcntl(sock, F_GETFD) < 0 && errno == EBADF,
+		   "the socket is closed on error");
+	chat_server_delete(s1);
+
+	/* Like two workers of a supervisor, on one socket. */
+	sock = listen_socket_new(&port);
+	s1 = chat_server_new();
+	struct chat_server *s2 = chat_server_new();
+	unit_fail_if(chat_server_listen_socket(s1, sock) != 0);
+	int sock2 = dup(sock);
+	unit_fail_if(chat_server_listen_socket(s2, sock2) != 0);
+	unit_check(chat_server_get_socket(s1) == sock &&
+		   chat_server_get_socket(s2) == sock2, "both listen");
+	unit_check(chat_server_listen_socket(s1, dup(sock)) ==
+		   CHAT_ERR_ALREADY_STARTED, "only once");
+
+	struct chat_client *c1 = chat_client_new("alice");
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	unit_fail_if(chat_client_feed(c1, "m1\n", 3) != 0);
+	struct chat_message *msg = server_pop_next_blocking_from(s1, c1);
+	unit_check(strcmp(msg->data, "m1") == 0, "the first one serves");
+	chat_message_delete(msg);
+	struct chat_client *c2 = chat_client_new("bob");
+	unit_fail_if(chat_client_connect(c2, make_addr_str(port)) != 0);
+	unit_fail_if(chat_client_feed(c2, "m2\n", 3) != 0);
+	msg = server_pop_next_blocking_from(s2, c2);
+	unit_check(strcmp(msg->data, "m2") == 0, "and the second one");
+	chat_message_delete(msg);
+	chat_client_delete(c1);
+	chat_client_delete(c2);
+	chat_server_delete(s1);
+	chat_server_delete(s2);
+
+	sock = listen_socket_new(&port);
+	s1 = chat_server_new_sharded(2);
+	unit_fail_if(chat_server_listen_socket(s1, sock) != 0);
+	c1 = chat_client_new("alice");
+	unit_fail_if(chat_client_connect(c1, make_addr_str(port)) != 0);
+	unit_fail_if(chat_client_feed(c1, "m3\n", 3) != 0);
+	msg = server_pop_next_blocking_from(s1, c1);
+	unit_check(strcmp(msg->data, "m3") == 0, "the shards serve it too");
+	chat_message_delete(msg);
+	chat_client_delete(c1);
+	chat_server_delete(s1);
+
+	unit_test_finish();
+}
+
 int
 main(int argc, char **argv)
 {
@@ -698,8 +1906,21 @@ main(int argc, char **argv)
 	test_multi_feed();
 	test_multi_client();
 	test_stress();
+	test_many_peers();
+	test_sharded();
+	test_uring();
+	test_overflow();
+	test_authors();
+	test_flush_window();
+	test_idle();
 	test_big_author();
 	test_server_feed();
+	test_server_feed_buffer();
+	test_udp();
+	test_history();
+	test_tls();
+	test_lz();
+	test_listen_socket();
 
 	unit_test_finish();
 	return 0;
@@ -1,5 +1,143 @@
 #include "chat.h"
 
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+chat_recv_buf::chat_recv_buf()
+	: m_pos(0)
+	, m_scan(0)
+	, m_size(0)
+	, m_read_size(CHAT_RECV_BUF_SIZE)
+	, m_last_prepared(0)
+{
+}
+
+size_t
+chat_recv_buf::prepare()
+{
+	if (m_pos == m_size) {
+		m_pos = 0;
+		m_scan = 0;
+		m_size = 0;
+		// Don't keep a huge buffer of a big message for the idle times. The usual
+		// size is a max read plus a partial line.
+		if (m_data.size() > 2 * CHAT_RECV_BUF_MAX_SIZE)
+			std::string().swap(m_data);
+	}
+	if (m_data.size() - m_size < m_read_size && m_pos > 0) {
+		m_size -= m_pos;
+		m_scan -= m_pos;
+		memmove(m_data.data(), m_data.data() + m_pos, m_size);
+		m_pos = 0;
+	}
+	if (m_data.size() - m_size < m_read_size)
+		m_data.resize(m_size + m_read_size);
+	m_last_prepared = m_data.size() - m_size;
+	return m_last_prepared;
+}
+
+void
+chat_recv_buf::commit(
+	size_t size)
+{
+	assert(size <= m_last_prepared);
+	m_size += size;
+	if (size == m_last_prepared)
+		m_read_size = std::min<size_t>(m_read_size * 2, CHAT_RECV_BUF_MAX_SIZE);
+}
+
+bool
+chat_recv_buf::next_line(
+	std::string_view& line)
+{
+	const char *begin = m_data.data();
+	const char *end = (const char *)memchr(begin + m_scan, '\n', m_size - m_scan);
+	if (end == nullptr) {
+		m_scan = m_size;
+		return false;
+	}
+	line = std::string_view(begin + m_pos, end - begin - m_pos);
+	m_pos = end - begin + 1;
+	m_scan = m_pos;
+	return true;
+}
+
+chat_msg_queue::chat_msg_queue()
+	: m_items(CHAT_MSG_QUEUE_SIZE)
+	, m_head(0)
+	, m_is_sleeping(false)
+	, m_tail(0)
+	, m_is_overflow(false)
+	, m_wakeup_seq(0)
+{
+	static_assert((CHAT_MSG_QUEUE_SIZE & (CHAT_MSG_QUEUE_SIZE - 1)) == 0,
+		"the queue size is a power of 2");
+}
+
+bool
+chat_msg_queue::push(
+	chat_msg_ring& msgs)
+{
+	size_t tail = m_tail.load(std::memory_order_relaxed);
+	size_t head = m_head.load(std::memory_order_acquire);
+	while (not msgs.empty() and tail - head < CHAT_MSG_QUEUE_SIZE) {
+		m_items[tail & (CHAT_MSG_QUEUE_SIZE - 1)] = msgs.pop_front();
+		++tail;
+	}
+	m_tail.store(tail, std::memory_order_release);
+	bool is_all = msgs.empty();
+	if (not is_all)
+		m_is_overflow.store(true, std::memory_order_relaxed);
+	priv_wakeup();
+	return is_all;
+}
+
+size_t
+chat_msg_queue::pop_all(
+	std::vector<std::unique_ptr<chat_message>>& msgs)
+{
+	size_t head = m_head.load(std::memory_order_relaxed);
+	size_t tail = m_tail.load(std::memory_order_acquire);
+	for (size_t i = head; i != tail; ++i)
+		msgs.emplace_back(std::move(m_items[i & (CHAT_MSG_QUEUE_SIZE - 1)]));
+	m_head.store(tail, std::memory_order_release);
+	return tail - head;
+}
+
+bool
+chat_msg_queue::take_overflow()
+{
+	return m_is_overflow.load(std::memory_order_relaxed) and
+		m_is_overflow.exchange(false, std::memory_order_relaxed);
+}
+
+void
+chat_msg_queue::wait()
+{
+	uint32_t seq = m_wakeup_seq.load(std::memory_order_acquire);
+	m_is_sleeping.store(true, std::memory_order_relaxed);
+	// Pairs with the fence in priv_wakeup(). Either the producer sees the sleeping
+	// flag, or the consumer sees the new messages.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (m_tail.load(std::memory_order_relaxed) == m_head.load(std::memory_order_relaxed)
+		and not m_is_overflow.load(std::memory_order_relaxed)) {
+		m_wakeup_seq.wait(seq, std::memory_order_acquire);
+	}
+	m_is_sleeping.store(false, std::memory_order_relaxed);
+}
+
+void
+chat_msg_queue::priv_wakeup()
+{
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (not m_is_sleeping.load(std::memory_order_relaxed) or
+		not m_is_sleeping.exchange(false, std::memory_order_relaxed))
+		return;
+	m_wakeup_seq.fetch_add(1, std::memory_order_release);
+	m_wakeup_seq.notify_one();
+}
+
 event::event() : m_is_set(false) {}
 
 void
@@ -7,6 +145,7 @@ event::send()
 {
 	std::unique_lock lock(m_mutex);
 	m_is_set = true;
+	m_cond.notify_all();
 }
 
 void
@@ -1,12 +1,26 @@
 #pragma once
 
+#include <atomic>
 #include <condition_variable>
+#include <cstddef>
+#include <memory>
 #include <mutex>
+#include <new>
 #include <string>
+#include <utility>
+#include <vector>
 
 enum
 {
 	CHAT_RECV_BUF_SIZE = 128,
+	// Reads grow from CHAT_RECV_BUF_SIZE up to this while they fill the buffer.
+	CHAT_RECV_BUF_MAX_SIZE = 64 * 1024,
+	// Fits the operations of the recv and send loops with their handlers.
+	CHAT_HANDLER_MEMORY_SIZE = 1024,
+	// Messages in chat_msg_queue. The rest waits on the producer's side.
+	CHAT_MSG_QUEUE_SIZE = 1024,
+	// First capacity of chat_ring.
+	CHAT_RING_MIN_SIZE = 16,
 };
 
 enum chat_errcode
@@ -32,6 +46,294 @@ struct chat_message
 	// <YOUR CODE IF NEEDED>
 };
 
+// Input buffer of a connection. Each read gets at least the current read size, which
+// doubles every time a read fills all the space given to it. The lines are framed in
+// place and consumed by offset. The rest of the data is moved to the front only when
+// the space at the end is short.
+class chat_recv_buf final
+{
+public:
+	chat_recv_buf();
+
+	// Make room for a next read and return its size. The data goes to tail().
+	size_t
+	prepare();
+
+	char *
+	tail() { return m_data.data() + m_size; }
+
+	// The read after prepare() got that many bytes.
+	void
+	commit(
+		size_t size);
+
+	// Pop a next complete line without its '\n'. It stays valid until prepare(). False
+	// when there is no complete line yet.
+	bool
+	next_line(
+		std::string_view& line);
+
+private:
+	std::string m_data;
+	// Consumed bytes are before the pos. There is no '\n' between it and the scan.
+	size_t m_pos;
+	size_t m_scan;
+	size_t m_size;
+	size_t m_read_size;
+	size_t m_last_prepared;
+};
+
+// Memory for the handler of one async operation at a time. A loop like recv-recv-recv
+// gets the same block every time and does not touch the heap. When the block is busy
+// or too small, the heap is used.
+//
+// The block is freed before the handler is called, and the next operation is started
+// from the handler. So the recv loop and the send loop need one each.
+class chat_handler_memory final
+{
+public:
+	chat_handler_memory() : m_is_used(false) {}
+	chat_handler_memory(const chat_handler_memory&) = delete;
+	chat_handler_memory& operator=(const chat_handler_memory&) = delete;
+
+	void*
+	allocate(
+		size_t size)
+	{
+		if (not m_is_used && size <= sizeof(m_storage)) {
+			m_is_used = true;
+			return m_storage;
+		}
+		return ::operator new(size);
+	}
+
+	void
+	deallocate(
+		void* ptr)
+	{
+		if (ptr == m_storage) {
+			m_is_used = false;
+			return;
+		}
+		::operator delete(ptr);
+	}
+
+private:
+	alignas(std::max_align_t) unsigned char m_storage[CHAT_HANDLER_MEMORY_SIZE];
+	bool m_is_used;
+};
+
+template<typename T>
+class chat_handler_allocator final
+{
+public:
+	using value_type = T;
+
+	explicit chat_handler_allocator(
+		chat_handler_memory& mem) : m_mem(&mem) {}
+
+	template<typename U>
+	chat_handler_allocator(
+		const chat_handler_allocator<U>& other) noexcept : m_mem(other.m_mem) {}
+
+	bool
+	operator==(
+		const chat_handler_allocator& other) const noexcept
+	{ return m_mem == other.m_mem; }
+
+	bool
+	operator!=(
+		const chat_handler_allocator& other) const noexcept
+	{ return m_mem != other.m_mem; }
+
+	T*
+	allocate(
+		size_t n) const
+	{ return static_cast<T*>(m_mem->allocate(sizeof(T) * n)); }
+
+	void
+	deallocate(
+		T* ptr,
+		size_t /* n */) const
+	{ m_mem->deallocate(ptr); }
+
+private:
+	template<typename> friend class chat_handler_allocator;
+
+	chat_handler_memory* m_mem;
+};
+
+// A handler with the associated allocator taking the memory from the given block. The
+// asio operations find it via get_allocator().
+template<typename Handler>
+class chat_alloc_handler final
+{
+public:
+	using allocator_type = chat_handler_allocator<Handler>;
+
+	chat_alloc_handler(
+		chat_handler_memory& mem,
+		Handler handler) : m_mem(mem), m_handler(std::move(handler)) {}
+
+	allocator_type
+	get_allocator() const noexcept { return allocator_type(m_mem); }
+
+	template<typename... Args>
+	void
+	operator()(
+		Args&&... args)
+	{ m_handler(std::forward<Args>(args)...); }
+
+private:
+	chat_handler_memory& m_mem;
+	Handler m_handler;
+};
+
+template<typename Handler>
+inline chat_alloc_handler<Handler>
+chat_make_alloc_handler(
+	chat_handler_memory& mem,
+	Handler handler)
+{
+	return chat_alloc_handler<Handler>(mem, std::move(handler));
+}
+
+// FIFO queue on one contiguous array used as a ring. The capacity is a power of 2 and
+// only grows, twice at a time. So once warmed up, a push or a pop does not touch the
+// heap, and the popped slots are reused by the next pushes.
+template<typename T>
+class chat_ring final
+{
+public:
+	chat_ring() : m_head(0), m_size(0) {}
+
+	bool
+	empty() const { return m_size == 0; }
+
+	size_t
+	size() const { return m_size; }
+
+	T&
+	front() { return m_items[m_head]; }
+
+	T&
+	operator[](
+		size_t i) { return m_items[(m_head + i) & (m_items.size() - 1)]; }
+
+	const T&
+	operator[](
+		size_t i) const { return m_items[(m_head + i) & (m_items.size() - 1)]; }
+
+	void
+	push_back(
+		T&& item)
+	{
+		if (m_size == m_items.size())
+			priv_grow();
+		m_items[(m_head + m_size) & (m_items.size() - 1)] = std::move(item);
+		++m_size;
+	}
+
+	T
+	pop_front()
+	{
+		T item = std::move(m_items[m_head]);
+		priv_drop_front(1);
+		return item;
+	}
+
+	// Drop the first count items.
+	void
+	pop_front(
+		size_t count) { priv_drop_front(count); }
+
+	void
+	clear() { priv_drop_front(m_size); }
+
+	void
+	swap(
+		chat_ring& other)
+	{
+		m_items.swap(other.m_items);
+		std::swap(m_head, other.m_head);
+		std::swap(m_size, other.m_size);
+	}
+
+private:
+	void
+	priv_drop_front(
+		size_t count)
+	{
+		for (size_t i = 0; i < count; ++i) {
+			m_items[m_head] = T();
+			m_head = (m_head + 1) & (m_items.size() - 1);
+		}
+		m_size -= count;
+	}
+
+	void
+	priv_grow()
+	{
+		std::vector<T> items(
+			m_items.empty() ? (size_t)CHAT_RING_MIN_SIZE : m_items.size() * 2);
+		for (size_t i = 0; i < m_size; ++i)
+			items[i] = std::move((*this)[i]);
+		m_items.swap(items);
+		m_head = 0;
+	}
+
+	std::vector<T> m_items;
+	size_t m_head;
+	size_t m_size;
+};
+
+using chat_msg_ring = chat_ring<std::unique_ptr<chat_message>>;
+
+// Bounded lock-free queue of messages from one producer to one consumer thread. The
+// consumer takes all the messages at once, and sleeps only when there are none. The
+// producer wakes it up only when it really sleeps. While the consumer keeps up, the
+// messages pass with no locks and no syscalls.
+class chat_msg_queue final
+{
+public:
+	chat_msg_queue();
+	chat_msg_queue(const chat_msg_queue&) = delete;
+	chat_msg_queue& operator=(const chat_msg_queue&) = delete;
+
+	// Producer. Move the messages from the front of the ring while there is room. False
+	// when some did not fit. The consumer sees that in take_overflow().
+	bool
+	push(
+		chat_msg_ring& msgs);
+
+	// Consumer. Move all the messages to the vector and return their count.
+	size_t
+	pop_all(
+		std::vector<std::unique_ptr<chat_message>>& msgs);
+
+	// Consumer. True when the producer got out of room since the last call.
+	bool
+	take_overflow();
+
+	// Consumer. Sleep until there are messages or an overflow.
+	void
+	wait();
+
+private:
+	void
+	priv_wakeup();
+
+	std::vector<std::unique_ptr<chat_message>> m_items;
+	// Written by the consumer.
+	alignas(64) std::atomic_size_t m_head;
+	std::atomic_bool m_is_sleeping;
+	// Written by the producer.
+	alignas(64) std::atomic_size_t m_tail;
+	std::atomic_bool m_is_overflow;
+	// Bumped to wake the consumer up. It sleeps in wait() on the value.
+	std::atomic_uint32_t m_wakeup_seq;
+};
+
 struct event
 {
 public:
@@ -2,10 +2,15 @@
 #include "chat_client.h"
 
 #include <boost/asio/bind_executor.hpp>
+#include <boost/asio/connect.hpp>
+#include <boost/asio/dispatch.hpp>
 #include <boost/asio/io_context.hpp>
 #include <boost/asio/io_context_strand.hpp>
 #include <boost/asio/ip/tcp.hpp>
-#include <list>
+#include <boost/asio/redirect_error.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <boost/asio/write.hpp>
 
 struct chat_client_request final
 {
@@ -17,6 +22,16 @@ struct chat_client_request final
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
+enum chat_client_peer_state
+{
+	CHAT_CLIENT_PEER_STATE_NEW,
+	CHAT_CLIENT_PEER_STATE_CONNECTING,
+	CHAT_CLIENT_PEER_STATE_CONNECTED,
+	CHAT_CLIENT_PEER_STATE_STOPPED,
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
 class chat_client_peer final : public std::enable_shared_from_this<chat_client_peer>
 {
 public:
@@ -34,11 +49,21 @@ public:
 	recv_async(
 		chat_client_on_msg_f&& cb);
 
+	boost::asio::awaitable<chat_errcode>
+	recv(
+		std::unique_ptr<chat_message>& msg);
+
 	void
 	feed_async(
 		std::string_view text);
 
+	void
+	stop();
+
 private:
+	bool
+	priv_in_strand_is_waited() const;
+
 	void
 	priv_in_strand_on_resolve(
 		const boost::system::error_code& err,
@@ -54,6 +79,9 @@ private:
 	priv_in_strand_on_new_request(
 		std::unique_ptr<chat_client_request> req);
 
+	void
+	priv_in_strand_serve();
+
 	void
 	priv_in_strand_recv();
 
@@ -74,6 +102,15 @@ private:
 		const boost::system::error_code& err,
 		std::size_t size);
 
+	void
+	priv_in_strand_close(
+		chat_errcode err);
+
+	void
+	priv_in_strand_stop();
+
+	chat_client_peer_state m_state;
+
 	// Strand "serializes" all callbacks associated with it. It means the strand will
 	// invoke them one by one, never in more than one thread at a time. That in turn
 	// means, that inside strand callbacks you don't need to protect its data with any
@@ -82,18 +119,31 @@ private:
 	boost::asio::ip::tcp::socket m_sock;
 
 	// Requests which are waiting for data.
-	std::list<std::unique_ptr<chat_client_request>> m_reqs;
+	chat_ring<std::unique_ptr<chat_client_request>> m_reqs;
+	// Coroutines waiting for data. They sleep on the timer which never expires, and
+	// are woken up by its cancellation.
+	boost::asio::steady_timer m_co_signal;
+	uint32_t m_co_wait_count;
+	// Returned to the coroutines after the stop.
+	chat_errcode m_close_err;
 	// Full messages waiting to be delivered to requests.
-	std::list<std::unique_ptr<chat_message>> m_in_msgs;
+	chat_msg_ring m_in_msgs;
 	// Input buffer for reading the next incoming messages.
-	std::string m_in_buf;
+	chat_recv_buf m_in_buf;
+	bool m_is_receiving;
+	// Each message comes as two lines. The author is kept here until its data line.
+	std::string m_in_author;
+	bool m_has_in_author;
 	// Output buffer for prearing the next outgoing messages.
 	std::string m_out_buf;
+	// Output being sent. Is not touched until the sending ends.
+	std::string m_out_sending;
+
+	chat_handler_memory m_recv_mem;
+	chat_handler_memory m_send_mem;
 
 	boost::asio::ip::tcp::resolver m_resolver;
 	const std::string m_name;
-
-	// <YOUR CODE IF NEEDED>
 };
 
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -103,12 +153,11 @@ chat_client::chat_client(
 	std::string_view name)
 	: m_conn(std::make_shared<chat_client_peer>(ioCtx, name))
 {
-	// <YOUR CODE IF NEEDED>
 }
 
 chat_client::~chat_client()
 {
-	// <YOUR CODE IF NEEDED>
+	m_conn->stop();
 }
 
 void
@@ -126,6 +175,13 @@ chat_client::recv_async(
 	m_conn->recv_async(std::move(cb));
 }
 
+boost::asio::awaitable<chat_errcode>
+chat_client::recv(
+	std::unique_ptr<chat_message>& msg)
+{
+	return m_conn->recv(msg);
+}
+
 void
 chat_client::feed_async(
 	std::string_view text)
@@ -138,40 +194,51 @@ chat_client::feed_async(
 chat_client_peer::chat_client_peer(
 	boost::asio::io_context& ioCtx,
 	std::string_view name)
-	: m_strand(ioCtx)
+	: m_state(CHAT_CLIENT_PEER_STATE_NEW)
+	, m_strand(ioCtx)
 	, m_sock(ioCtx)
+	, m_co_signal(ioCtx, boost::asio::steady_timer::time_point::max())
+	, m_co_wait_count(0)
+	, m_close_err(CHAT_ERR_NONE)
+	, m_is_receiving(false)
+	, m_has_in_author(false)
 	, m_resolver(ioCtx)
 	, m_name(name)
 {
-	// <YOUR CODE IF NEEDED>
+	// The name goes first, before anything fed.
+	m_out_buf.append(m_name);
+	m_out_buf.push_back('\n');
 }
 
 chat_client_peer::~chat_client_peer()
 {
-	for (std::unique_ptr<chat_client_request>& r : m_reqs)
-		r->m_cb(CHAT_ERR_CANCELED, {});
+	// The peer is deleted together with its io_context, after the client itself.
+	// Nobody waits for the pending requests anymore, and their owners might be gone.
+	// So they are dropped without calling. A stop still cancels them with a call.
 	m_reqs.clear();
-
-	// <YOUR CODE IF NEEDED>
 }
 
 void
 chat_client_peer::connect_async(
-	std::string_view /* endpoint */,
-	chat_client_on_connect_f&& /* cb */)
+	std::string_view endpoint,
+	chat_client_on_connect_f&& cb)
 {
-	// <YOUR CODE IF NEEDED>
-	abort();
-
-	// 1) Extract host and port from the endpoint string.
-	//
-	// 2) Start resolving them to an IP:
-	// m_resolver.async_resolve(host, port, boost::asio::bind_executor(m_strand,
-	//	[ref = shared_from_this(), this, cb = std::move(cb)](
-	//		const boost::system::error_code& err,
-	//		boost::asio::ip::tcp::resolver::results_type results) {
-	//	priv_in_strand_on_resolve(err, std::move(cb), results);
-	// }));
+	size_t pos = endpoint.rfind(':');
+	if (pos == std::string_view::npos) {
+		boost::asio::post(m_strand, [cb = std::move(cb)]() {
+			cb(CHAT_ERR_NO_ADDR);
+		});
+		return;
+	}
+	std::string host(endpoint.substr(0, pos));
+	std::string port(endpoint.substr(pos + 1));
+	m_resolver.async_resolve(boost::asio::ip::tcp::v4(), host, port,
+		boost::asio::bind_executor(m_strand,
+			[ref = shared_from_this(), this, cb = std::move(cb)](
+			const boost::system::error_code& err,
+			boost::asio::ip::tcp::resolver::results_type results) mutable {
+		priv_in_strand_on_resolve(err, std::move(cb), results);
+	}));
 }
 
 void
@@ -186,6 +253,29 @@ chat_client_peer::recv_async(
 	});
 }
 
+boost::asio::awaitable<chat_errcode>
+chat_client_peer::recv(
+	std::unique_ptr<chat_message>& msg)
+{
+	// The coroutine frame holds the peer alive until the end.
+	std::shared_ptr<chat_client_peer> ref = shared_from_this();
+	co_await boost::asio::dispatch(m_strand, boost::asio::use_awaitable);
+	while (not m_reqs.empty() or m_in_msgs.empty()) {
+		if (m_state == CHAT_CLIENT_PEER_STATE_STOPPED)
+			co_return m_close_err;
+		++m_co_wait_count;
+		priv_in_strand_recv();
+		// The wait is started before the strand is left. Hence no wakeup is lost.
+		boost::system::error_code err;
+		co_await m_co_signal.async_wait(
+			boost::asio::redirect_error(boost::asio::use_awaitable, err));
+		co_await boost::asio::dispatch(m_strand, boost::asio::use_awaitable);
+		--m_co_wait_count;
+	}
+	msg = m_in_msgs.pop_front();
+	co_return CHAT_ERR_NONE;
+}
+
 void
 chat_client_peer::feed_async(
 	std::string_view text)
@@ -196,34 +286,64 @@ chat_client_peer::feed_async(
 }
 
 void
-chat_client_peer::priv_in_strand_on_resolve(
-	const boost::system::error_code& /* err */,
-	chat_client_on_connect_f&& /* cb */,
-	boost::asio::ip::tcp::resolver::results_type /* results */)
+chat_client_peer::stop()
 {
-	assert(m_strand.running_in_this_thread());
+	boost::asio::post(m_strand, std::bind(&chat_client_peer::priv_in_strand_stop,
+		shared_from_this()));
+}
 
-	// <YOUR CODE IF NEEDED>
-	abort();
+bool
+chat_client_peer::priv_in_strand_is_waited() const
+{
+	assert(m_strand.running_in_this_thread());
+	return not m_reqs.empty() or m_co_wait_count > 0;
+}
 
-	// 1) Choose one of the results (it is an array).
-	// 2) Do
-	// m_sock.async_connect(endpoint, boost::asio::bind_executor(m_strand,
-	//	[ref = shared_from_this(), this, cb = std::move(cb)](
-	//		const boost::system::error_code& err) {
-	//	priv_in_strand_on_connect(err, std::move(cb));
-	// }));
+void
+chat_client_peer::priv_in_strand_on_resolve(
+	const boost::system::error_code& err,
+	chat_client_on_connect_f&& cb,
+	boost::asio::ip::tcp::resolver::results_type results)
+{
+	assert(m_strand.running_in_this_thread());
+	if (m_state == CHAT_CLIENT_PEER_STATE_STOPPED) {
+		cb(CHAT_ERR_CANCELED);
+		return;
+	}
+	if (err) {
+		cb(CHAT_ERR_NO_ADDR);
+		return;
+	}
+	m_state = CHAT_CLIENT_PEER_STATE_CONNECTING;
+	// Tries the addresses one by one until any of them works.
+	boost::asio::async_connect(m_sock, results, boost::asio::bind_executor(m_strand,
+		[ref = shared_from_this(), this, cb = std::move(cb)](
+		const boost::system::error_code& err,
+		const boost::asio::ip::tcp::endpoint&) mutable {
+		priv_in_strand_on_connect(err, std::move(cb));
+	}));
 }
 
 void
 chat_client_peer::priv_in_strand_on_connect(
-	const boost::system::error_code& /* err */,
-	chat_client_on_connect_f&& /* cb */)
+	const boost::system::error_code& err,
+	chat_client_on_connect_f&& cb)
 {
 	assert(m_strand.running_in_this_thread());
-
-	// <YOUR CODE IF NEEDED>
-	abort();
+	if (m_state == CHAT_CLIENT_PEER_STATE_STOPPED) {
+		cb(CHAT_ERR_CANCELED);
+		return;
+	}
+	if (err) {
+		m_state = CHAT_CLIENT_PEER_STATE_NEW;
+		cb(CHAT_ERR_NO_ADDR);
+		return;
+	}
+	m_state = CHAT_CLIENT_PEER_STATE_CONNECTED;
+	priv_in_strand_send();
+	if (priv_in_strand_is_waited())
+		priv_in_strand_recv();
+	cb(CHAT_ERR_NONE);
 }
 
 void
@@ -234,118 +354,154 @@ chat_client_peer::priv_in_strand_on_new_request(
 	if (not m_reqs.empty()) {
 		// Older requests are not served yet. Means we need to wait for them to be served
 		// to preserve the FIFO order.
-		m_reqs.emplace_back(std::move(req));
+		m_reqs.push_back(std::move(req));
 		return;
 	}
 	if (not m_in_msgs.empty()) {
 		// Already have data to return. Then just return it.
-		req->m_cb(CHAT_ERR_NONE, std::move(m_in_msgs.front()));
-		m_in_msgs.pop_front();
+		std::unique_ptr<chat_message> msg = m_in_msgs.pop_front();
+		req->m_cb(CHAT_ERR_NONE, std::move(msg));
 		return;
 	}
+	if (m_state == CHAT_CLIENT_PEER_STATE_STOPPED) {
+		req->m_cb(CHAT_ERR_CANCELED, {});
+		return;
+	}
+	// No ready messages. It means need to receive some new ones.
+	m_reqs.push_back(std::move(req));
+	priv_in_strand_recv();
+}
 
-	// <YOUR CODE IF NEEDED>
-	abort();
-
-	// No ready messages. It means you need to receive some new ones.
-	//
-	// 1) Save the request for serving it later.
-	// m_reqs.emplace_back(std::move(req));
-	//
-	// 2) priv_in_strand_recv();
+void
+chat_client_peer::priv_in_strand_serve()
+{
+	assert(m_strand.running_in_this_thread());
+	while (not m_reqs.empty() and not m_in_msgs.empty()) {
+		std::unique_ptr<chat_client_request> req = m_reqs.pop_front();
+		std::unique_ptr<chat_message> msg = m_in_msgs.pop_front();
+		req->m_cb(CHAT_ERR_NONE, std::move(msg));
+	}
 }
 
 void
 chat_client_peer::priv_in_strand_recv()
 {
 	assert(m_strand.running_in_this_thread());
-
-	// <YOUR CODE IF NEEDED>
-	abort();
-
-	// 1) Ensure you have enough space in m_in_buf. Reserve at least CHAT_RECV_BUF_SIZE.
-	// Grow it x2 when need more.
-	//
-	// 2) Receive more data.
-	// uint8_t* buf = m_in_buf.data() + m_in_buf.length();
-	// size_t size = m_in_buf.capacity() - m_in_buf.length();
-	// m_sock.async_receive(boost::asio::buffer(buf, size),
-	//	boost::asio::bind_executor(strand_,
-	//		std::bind(&chat_client_peer::priv_in_strand_on_recv, shared_from_this(),
-	//		std::placeholder::_1, std::placeholders::_2)));
+	if (m_state != CHAT_CLIENT_PEER_STATE_CONNECTED or m_is_receiving)
+		return;
+	size_t size = m_in_buf.prepare();
+	m_is_receiving = true;
+	m_sock.async_receive(boost::asio::buffer(m_in_buf.tail(), size),
+		boost::asio::bind_executor(m_strand, chat_make_alloc_handler(m_recv_mem,
+			std::bind(&chat_client_peer::priv_in_strand_on_recv, shared_from_this(),
+				std::placeholders::_1, std::placeholders::_2))));
 }
 
 void
 chat_client_peer::priv_in_strand_on_recv(
-	const boost::system::error_code& /* err */,
-	std::size_t /* size */)
+	const boost::system::error_code& err,
+	std::size_t size)
 {
 	assert(m_strand.running_in_this_thread());
-
-	// <YOUR CODE IF NEEDED>
-	abort();
-
-	// 1) Start considering the newly received bytes.
-	// m_in_buf.resize(m_in_buf.length() + size);
-	//
-	// 2) Parse the buffer trying to extract complete messages. Put each extracted one
-	// into m_in_msgs.
-	//
-	// 3) Hand the received messages from m_in_msgs to pending requests in m_reqs.
-	//
-	// 4) Keep receiving until you get at least one full message.
-	//
-	// In your code you might make m_in_buf more efficient.
+	m_is_receiving = false;
+	if (m_state == CHAT_CLIENT_PEER_STATE_STOPPED)
+		return;
+	if (err) {
+		priv_in_strand_close(CHAT_ERR_SYS);
+		return;
+	}
+	m_in_buf.commit(size);
+	std::string_view line;
+	while (m_in_buf.next_line(line)) {
+		if (not m_has_in_author) {
+			m_in_author = line;
+			m_has_in_author = true;
+			continue;
+		}
+		std::unique_ptr<chat_message> msg = std::make_unique<chat_message>();
+		msg->m_author = std::move(m_in_author);
+		msg->m_data = line;
+		m_has_in_author = false;
+		m_in_msgs.push_back(std::move(msg));
+	}
+	priv_in_strand_serve();
+	if (m_co_wait_count > 0 and not m_in_msgs.empty())
+		m_co_signal.cancel();
+	// Keep receiving only while somebody waits. The rest stays in the socket.
+	if (priv_in_strand_is_waited())
+		priv_in_strand_recv();
 }
 
 void
 chat_client_peer::priv_in_strand_on_new_feed(
-	std::string_view /* text */)
+	std::string_view text)
 {
 	assert(m_strand.running_in_this_thread());
-
-	// <YOUR CODE IF NEEDED>
-	abort();
-
-	// 1) Append the data to the pending output buffer m_out_buf.
-	// 2) priv_in_strand_send();
+	if (m_state == CHAT_CLIENT_PEER_STATE_STOPPED)
+		return;
+	// The server splits the lines and trims them. The text is sent as is.
+	m_out_buf.append(text);
+	priv_in_strand_send();
 }
 
 void
 chat_client_peer::priv_in_strand_send()
 {
 	assert(m_strand.running_in_this_thread());
-
-	// <YOUR CODE IF NEEDED>
-	abort();
-
-	// If the buffer m_out_buf contains a complete message, then send it using
-	// m_sock.async_send(boost::asio::buffer(m_out_buf.data(), m_out_buf.length()),
-	//	boost::asio::bind_executor(m_strand,
-	//		std::bind(&chat_client_peer::priv_in_strand_on_send, shared_from_this(),
-	//			std::placeholders::_1, std::placeholders::_2)));
-	//
-	// You don't have to send whole messages. Could send the parts right away if your
-	// protocol is fine with that. But you might need to send full ones if you encode them
-	// anyhow. For example, prefix each message with its total size to make receipt on the
-	// other end more optimal.
-	//
-	// When m_out_buf is needed (only if you are sending full messages), you should keep
-	// it valid and unchanged until the sending is complete. Which means you might need a
-	// second buffer where you would store newer messages while the older ones are being
-	// sent.
+	if (m_state != CHAT_CLIENT_PEER_STATE_CONNECTED)
+		return;
+	if (not m_out_sending.empty() or m_out_buf.empty())
+		return;
+	m_out_sending.swap(m_out_buf);
+	boost::asio::async_write(m_sock, boost::asio::buffer(m_out_sending),
+		boost::asio::bind_executor(m_strand, chat_make_alloc_handler(m_send_mem,
+			std::bind(&chat_client_peer::priv_in_strand_on_send, shared_from_this(),
+				std::placeholders::_1, std::placeholders::_2))));
 }
 
 void
 chat_client_peer::priv_in_strand_on_send(
-	const boost::system::error_code& /* err */,
+	const boost::system::error_code& err,
 	std::size_t /* size */)
 {
 	assert(m_strand.running_in_this_thread());
+	if (m_state == CHAT_CLIENT_PEER_STATE_STOPPED)
+		return;
+	if (err) {
+		priv_in_strand_close(CHAT_ERR_SYS);
+		return;
+	}
+	// async_write() sends everything or fails. No partial writes here.
+	m_out_sending.clear();
+	// The buffers swap their roles. Keep them of the same capacity, so they stop
+	// growing once both fit the biggest burst.
+	if (m_out_buf.capacity() < m_out_sending.capacity())
+		m_out_buf.reserve(m_out_sending.capacity());
+	priv_in_strand_send();
+}
 
-	// <YOUR CODE IF NEEDED>
-	abort();
+void
+chat_client_peer::priv_in_strand_close(
+	chat_errcode err)
+{
+	assert(m_strand.running_in_this_thread());
+	m_state = CHAT_CLIENT_PEER_STATE_STOPPED;
+	m_close_err = err;
+	boost::system::error_code close_err;
+	m_sock.close(close_err);
+	m_co_signal.cancel();
+	chat_ring<std::unique_ptr<chat_client_request>> reqs;
+	reqs.swap(m_reqs);
+	while (not reqs.empty())
+		reqs.pop_front()->m_cb(err, {});
+}
 
-	// Be careful about partial writes. The sent size might be < m_out_buf.length(). Then
-	// you must send the rest again. Keep sending as long as you have something to send.
+void
+chat_client_peer::priv_in_strand_stop()
+{
+	assert(m_strand.running_in_this_thread());
+	if (m_state == CHAT_CLIENT_PEER_STATE_STOPPED)
+		return;
+	m_resolver.cancel();
+	priv_in_strand_close(CHAT_ERR_CANCELED);
 }
@@ -4,6 +4,10 @@
 
 #include <functional>
 #include <memory>
+// Boost 1.74 awaitable.hpp uses std::exchange() without including <utility>.
+#include <utility>
+
+#include <boost/asio/awaitable.hpp>
 
 namespace boost { namespace asio { class io_context; } }
 
@@ -27,6 +31,13 @@ public:
 	recv_async(
 		chat_client_on_msg_f&& c);
 
+	// Coroutine version of recv_async(). The caller is resumed in the client's strand,
+	// with the message already in @a msg. Not meant to be mixed with recv_async() on
+	// the same client - the callbacks are always served first.
+	boost::asio::awaitable<chat_errcode>
+	recv(
+		std::unique_ptr<chat_message>& msg);
+
 	void
 	feed_async(
 		std::string_view text);
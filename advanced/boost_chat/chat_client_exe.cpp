@@ -1,12 +1,18 @@
 #include "chat_client.h"
 
 #include <boost/asio/bind_executor.hpp>
+#include <boost/asio/dispatch.hpp>
 #include <boost/asio/io_context.hpp>
 #include <boost/asio/io_context_strand.hpp>
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/posix/stream_descriptor.hpp>
-#include <boost/asio/read.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <cstring>
+#include <getopt.h>
 #include <iostream>
+#include <sys/resource.h>
+#include <thread>
+#include <vector>
 
 class chat_client_app final
 {
@@ -57,8 +63,10 @@ chat_client_app::chat_client_app(
 	, m_input(m_ioctx, dup(STDIN_FILENO))
 	, m_res(0)
 {
-	m_cli.connect_async(endpoint, boost::asio::bind_executor(m_strand,
-		std::bind(&chat_client_app::priv_on_connect, this, std::placeholders::_1)));
+	m_cli.connect_async(endpoint, [this](chat_errcode err) {
+		boost::asio::dispatch(m_strand,
+			std::bind(&chat_client_app::priv_on_connect, this, err));
+	});
 }
 
 int
@@ -73,16 +81,21 @@ void
 chat_client_app::priv_recv_next()
 {
 	assert(m_strand.running_in_this_thread());
-	m_cli.recv_async(boost::asio::bind_executor(m_strand,
-		std::bind(&chat_client_app::priv_on_recv, this, std::placeholders::_1,
-			std::placeholders::_2)));
+	// The callback is type-erased and loses the bound executor. So it is dispatched
+	// to the strand explicitly.
+	m_cli.recv_async([this](chat_errcode err, std::unique_ptr<chat_message> msg) {
+		boost::asio::dispatch(m_strand, [this, err, msg = std::move(msg)]() mutable {
+			priv_on_recv(err, std::move(msg));
+		});
+	});
 }
 
 void
 chat_client_app::priv_read_next()
 {
 	assert(m_strand.running_in_this_thread());
-	boost::asio::async_read(m_input, boost::asio::buffer(m_in_buf, CHAT_RECV_BUF_SIZE),
+	// Whatever is typed goes right away. Not waiting for the buffer to fill up.
+	m_input.async_read_some(boost::asio::buffer(m_in_buf, CHAT_RECV_BUF_SIZE),
 		boost::asio::bind_executor(m_strand,
 			std::bind(&chat_client_app::priv_on_input, this, std::placeholders::_1,
 				std::placeholders::_2)));
@@ -115,7 +128,7 @@ chat_client_app::priv_on_recv(
 		m_ioctx.stop();
 		return;
 	}
-	std::cout << msg->m_author << ": " << msg->m_data;
+	std::cout << msg->m_author << ": " << msg->m_data << '\n';
 	priv_recv_next();
 }
 
@@ -140,9 +153,491 @@ chat_client_app::priv_on_input(
 	priv_read_next();
 }
 
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Load generator for "server --bench". Many virtual clients in one process send
+// messages at a fixed rate each. A message carries its send time, so each receiver
+// measures the broadcast latency. Prints JSON with the same fields as the bench of the
+// C chat in 5/, except for the server's own numbers which the server prints itself.
+
+enum
+{
+	// Sub-buckets per power of 2 of the latency histogram.
+	CHAT_BENCH_HIST_SUB_BITS = 5,
+	CHAT_BENCH_HIST_SUB = 1 << CHAT_BENCH_HIST_SUB_BITS,
+	CHAT_BENCH_HIST_SIZE = (64 - CHAT_BENCH_HIST_SUB_BITS + 1) * CHAT_BENCH_HIST_SUB,
+	// Room for the timestamp and the client id of a message.
+	CHAT_BENCH_MSG_SIZE_MIN = 48,
+	// The clients are done when nothing comes for this long after the end.
+	CHAT_BENCH_IDLE_MS = 200,
+	CHAT_BENCH_DRAIN_MS = 5000,
+};
+
+struct chat_bench_options
+{
+	int m_client_count = 100;
+	// Messages per second of each client.
+	double m_rate = 10;
+	int m_msg_size = 64;
+	double m_duration = 5;
+	// Threads running the clients, an io_context each.
+	int m_thread_count = 1;
+};
+
+static uint64_t
+chat_bench_clock_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Histogram bucket of the value, with 1/32 precision.
+static int
+chat_bench_hist_index(
+	uint64_t v)
+{
+	if (v < CHAT_BENCH_HIST_SUB)
+		return (int)v;
+	int p = 63 - __builtin_clzll(v);
+	int sub = (int)(v >> (p - CHAT_BENCH_HIST_SUB_BITS)) - CHAT_BENCH_HIST_SUB;
+	return (p - CHAT_BENCH_HIST_SUB_BITS + 1) * CHAT_BENCH_HIST_SUB + sub;
+}
+
+// The smallest value of the bucket.
+static uint64_t
+chat_bench_hist_value(
+	int index)
+{
+	if (index < CHAT_BENCH_HIST_SUB)
+		return index;
+	int p = index / CHAT_BENCH_HIST_SUB + CHAT_BENCH_HIST_SUB_BITS - 1;
+	uint64_t sub = CHAT_BENCH_HIST_SUB + index % CHAT_BENCH_HIST_SUB;
+	return sub << (p - CHAT_BENCH_HIST_SUB_BITS);
+}
+
+static std::vector<std::unique_ptr<boost::asio::io_context>>
+chat_bench_make_ioctxs(
+	int count)
+{
+	std::vector<std::unique_ptr<boost::asio::io_context>> res;
+	for (int i = 0; i < count; ++i)
+		res.emplace_back(std::make_unique<boost::asio::io_context>(1));
+	return res;
+}
+
+static double
+chat_bench_cpu_sec()
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+		ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+class chat_bench_app;
+
+// One virtual client. Everything of it runs in its strand.
+class chat_bench_client final
+{
+public:
+	chat_bench_client(
+		chat_bench_app& app,
+		boost::asio::io_context& ioCtx,
+		int id);
+
+	void
+	connect_async(
+		std::string_view endpoint);
+
+	void
+	start_async(
+		uint64_t start_ns);
+
+	uint64_t m_sent_count;
+	uint64_t m_recv_count;
+	// Latencies, log-linear buckets of nanoseconds.
+	std::vector<uint64_t> m_hist;
+
+private:
+	void
+	priv_on_connect(
+		chat_errcode err);
+
+	void
+	priv_recv_next();
+
+	void
+	priv_on_recv(
+		chat_errcode err,
+		std::unique_ptr<chat_message> msg);
+
+	void
+	priv_on_timer(
+		const boost::system::error_code& err);
+
+	chat_bench_app& m_app;
+	const int m_id;
+	boost::asio::io_context::strand m_strand;
+	chat_client m_cli;
+	boost::asio::steady_timer m_timer;
+	uint64_t m_next_send_ns;
+	uint64_t m_end_ns;
+	std::string m_out_buf;
+};
+
+class chat_bench_app final
+{
+public:
+	chat_bench_app(
+		const chat_bench_options& opts);
+
+	int
+	run(
+		std::string_view endpoint);
+
+private:
+	void
+	priv_on_connect(
+		chat_errcode err);
+
+	void
+	priv_on_recv(
+		uint64_t now_ns);
+
+	void
+	priv_check_next();
+
+	void
+	priv_on_check(
+		const boost::system::error_code& err);
+
+	const chat_bench_options m_opts;
+	std::vector<std::unique_ptr<boost::asio::io_context>> m_ioctxs;
+	std::vector<std::unique_ptr<chat_bench_client>> m_clis;
+
+	// Updated by the clients from any thread.
+	std::atomic_int m_connect_count;
+	std::atomic_int m_connect_err_count;
+	std::atomic_uint64_t m_last_recv_ns;
+	event m_connected;
+
+	// The end is checked by the timer in the first context.
+	boost::asio::steady_timer m_check_timer;
+	uint64_t m_end_ns;
+	event m_done;
+
+	friend chat_bench_client;
+};
+
+chat_bench_client::chat_bench_client(
+	chat_bench_app& app,
+	boost::asio::io_context& ioCtx,
+	int id)
+	: m_sent_count(0)
+	, m_recv_count(0)
+	, m_hist(CHAT_BENCH_HIST_SIZE, 0)
+	, m_app(app)
+	, m_id(id)
+	, m_strand(ioCtx)
+	, m_cli(ioCtx, "bench" + std::to_string(id))
+	, m_timer(ioCtx)
+	, m_next_send_ns(0)
+	, m_end_ns(0)
+{
+}
+
+void
+chat_bench_client::connect_async(
+	std::string_view endpoint)
+{
+	// The callbacks are type-erased and lose the bound executor. So they are
+	// dispatched to the strand explicitly.
+	m_cli.connect_async(endpoint, [this](chat_errcode err) {
+		boost::asio::dispatch(m_strand,
+			std::bind(&chat_bench_client::priv_on_connect, this, err));
+	});
+}
+
+void
+chat_bench_client::start_async(
+	uint64_t start_ns)
+{
+	boost::asio::post(m_strand, [this, start_ns]() {
+		const chat_bench_options& opts = m_app.m_opts;
+		uint64_t interval_ns = (uint64_t)(1e9 / opts.m_rate);
+		// Spread the clients evenly over the interval.
+		m_next_send_ns = start_ns + interval_ns * m_id / opts.m_client_count;
+		m_end_ns = start_ns + (uint64_t)(opts.m_duration * 1e9);
+		priv_on_timer({});
+	});
+}
+
+void
+chat_bench_client::priv_on_connect(
+	chat_errcode err)
+{
+	assert(m_strand.running_in_this_thread());
+	if (err == CHAT_ERR_NONE)
+		priv_recv_next();
+	m_app.priv_on_connect(err);
+}
+
+void
+chat_bench_client::priv_recv_next()
+{
+	assert(m_strand.running_in_this_thread());
+	m_cli.recv_async([this](chat_errcode err, std::unique_ptr<chat_message> msg) {
+		boost::asio::dispatch(m_strand, [this, err, msg = std::move(msg)]() mutable {
+			priv_on_recv(err, std::move(msg));
+		});
+	});
+}
+
+void
+chat_bench_client::priv_on_recv(
+	chat_errcode err,
+	std::unique_ptr<chat_message> msg)
+{
+	assert(m_strand.running_in_this_thread());
+	if (err != CHAT_ERR_NONE)
+		return;
+	uint64_t now_ns = chat_bench_clock_ns();
+	uint64_t sent_ns = strtoull(msg->m_data.c_str(), NULL, 10);
+	if (sent_ns != 0 && now_ns >= sent_ns)
+		++m_hist[chat_bench_hist_index(now_ns - sent_ns)];
+	++m_recv_count;
+	m_app.priv_on_recv(now_ns);
+	priv_recv_next();
+}
+
+void
+chat_bench_client::priv_on_timer(
+	const boost::system::error_code& err)
+{
+	assert(m_strand.running_in_this_thread());
+	if (err)
+		return;
+	const chat_bench_options& opts = m_app.m_opts;
+	uint64_t interval_ns = (uint64_t)(1e9 / opts.m_rate);
+	uint64_t now_ns = chat_bench_clock_ns();
+	while (m_next_send_ns <= now_ns && m_next_send_ns < m_end_ns) {
+		m_out_buf.resize(opts.m_msg_size);
+		int len = snprintf(m_out_buf.data(), opts.m_msg_size, "%llu %d ",
+			(unsigned long long)now_ns, m_id);
+		memset(m_out_buf.data() + len, 'x', opts.m_msg_size - len - 1);
+		m_out_buf[opts.m_msg_size - 1] = '\n';
+		m_cli.feed_async(m_out_buf);
+		++m_sent_count;
+		m_next_send_ns += interval_ns;
+	}
+	if (m_next_send_ns >= m_end_ns)
+		return;
+	m_timer.expires_after(std::chrono::nanoseconds(m_next_send_ns - now_ns));
+	m_timer.async_wait(boost::asio::bind_executor(m_strand,
+		std::bind(&chat_bench_client::priv_on_timer, this, std::placeholders::_1)));
+}
+
+chat_bench_app::chat_bench_app(
+	const chat_bench_options& opts)
+	: m_opts(opts)
+	, m_ioctxs(chat_bench_make_ioctxs(opts.m_thread_count))
+	, m_connect_count(0)
+	, m_connect_err_count(0)
+	, m_last_recv_ns(0)
+	, m_check_timer(*m_ioctxs[0])
+	, m_end_ns(0)
+{
+}
+
+int
+chat_bench_app::run(
+	std::string_view endpoint)
+{
+	using work_guard = boost::asio::executor_work_guard<
+		boost::asio::io_context::executor_type>;
+	std::vector<work_guard> works;
+	std::vector<std::thread> threads;
+	for (std::unique_ptr<boost::asio::io_context>& ioCtx : m_ioctxs) {
+		works.emplace_back(ioCtx->get_executor());
+		threads.emplace_back([ioCtx = ioCtx.get()]() { ioCtx->run(); });
+	}
+	for (int i = 0; i < m_opts.m_client_count; ++i) {
+		m_clis.emplace_back(std::make_unique<chat_bench_client>(*this,
+			*m_ioctxs[i % m_ioctxs.size()], i));
+	}
+	for (std::unique_ptr<chat_bench_client>& c : m_clis)
+		c->connect_async(endpoint);
+	m_connected.recv();
+
+	int res = 0;
+	uint64_t start_ns = chat_bench_clock_ns();
+	double cpu_start_sec = chat_bench_cpu_sec();
+	if (m_connect_err_count.load() != 0) {
+		std::cout << "Could not connect " << m_connect_err_count.load() <<
+			" clients\n";
+		res = -1;
+	} else {
+		m_end_ns = start_ns + (uint64_t)(m_opts.m_duration * 1e9);
+		for (std::unique_ptr<chat_bench_client>& c : m_clis)
+			c->start_async(start_ns);
+		boost::asio::post(*m_ioctxs[0],
+			std::bind(&chat_bench_app::priv_check_next, this));
+		m_done.recv();
+	}
+	for (std::unique_ptr<boost::asio::io_context>& ioCtx : m_ioctxs)
+		ioCtx->stop();
+	for (std::thread& t : threads)
+		t.join();
+	if (res != 0)
+		return res;
+
+	// All the threads are stopped. The clients' numbers are safe to read.
+	uint64_t sent = 0;
+	uint64_t received = 0;
+	std::vector<uint64_t> hist(CHAT_BENCH_HIST_SIZE, 0);
+	for (std::unique_ptr<chat_bench_client>& c : m_clis) {
+		sent += c->m_sent_count;
+		received += c->m_recv_count;
+		for (int i = 0; i < CHAT_BENCH_HIST_SIZE; ++i)
+			hist[i] += c->m_hist[i];
+	}
+	// p50, p90, p99, p99.9 and max.
+	const double qs[] = {0.5, 0.9, 0.99, 0.999, 1};
+	uint64_t lat[5] = {0, 0, 0, 0, 0};
+	uint64_t total = 0;
+	for (int i = 0; i < CHAT_BENCH_HIST_SIZE; ++i)
+		total += hist[i];
+	uint64_t seen = 0;
+	int q = 0;
+	for (int i = 0; i < CHAT_BENCH_HIST_SIZE && q < 5; ++i) {
+		seen += hist[i];
+		while (q < 5 && seen > 0 && seen >= (uint64_t)(qs[q] * total))
+			lat[q++] = chat_bench_hist_value(i);
+	}
+	uint64_t last_ns = std::max(m_last_recv_ns.load(), start_ns);
+	double sec = (last_ns - start_ns) / 1e9;
+	uint64_t expected = sent * (m_opts.m_client_count - 1);
+	printf("{\n\t\"impl\": \"boost\",\n\t\"clients\": %d,\n\t\"threads\": %d,\n"
+		"\t\"rate\": %.1f,\n\t\"size\": %d,\n\t\"duration_sec\": %.3f,\n",
+		m_opts.m_client_count, m_opts.m_thread_count, m_opts.m_rate,
+		m_opts.m_msg_size, sec);
+	printf("\t\"sent\": %llu,\n\t\"delivered\": %llu,\n"
+		"\t\"delivered_ratio\": %.4f,\n\t\"delivered_per_sec\": %.0f,\n",
+		(unsigned long long)sent, (unsigned long long)received,
+		expected > 0 ? (double)received / expected : 0,
+		sec > 0 ? received / sec : 0);
+	printf("\t\"latency_ns\": {\"p50\": %llu, \"p90\": %llu, "
+		"\"p99\": %llu, \"p999\": %llu, \"max\": %llu},\n",
+		(unsigned long long)lat[0], (unsigned long long)lat[1],
+		(unsigned long long)lat[2], (unsigned long long)lat[3],
+		(unsigned long long)lat[4]);
+	printf("\t\"clients_cpu_sec\": %.3f\n}\n", chat_bench_cpu_sec() - cpu_start_sec);
+	return 0;
+}
+
+void
+chat_bench_app::priv_on_connect(
+	chat_errcode err)
+{
+	if (err != CHAT_ERR_NONE)
+		m_connect_err_count.fetch_add(1);
+	if (m_connect_count.fetch_add(1) + 1 == m_opts.m_client_count)
+		m_connected.send();
+}
+
+void
+chat_bench_app::priv_on_recv(
+	uint64_t now_ns)
+{
+	// Only for the end detection, so a rare lost update is fine.
+	if (m_last_recv_ns.load(std::memory_order_relaxed) < now_ns)
+		m_last_recv_ns.store(now_ns, std::memory_order_relaxed);
+}
+
+void
+chat_bench_app::priv_check_next()
+{
+	m_check_timer.expires_after(std::chrono::milliseconds(CHAT_BENCH_IDLE_MS / 4));
+	m_check_timer.async_wait(std::bind(&chat_bench_app::priv_on_check, this,
+		std::placeholders::_1));
+}
+
+void
+chat_bench_app::priv_on_check(
+	const boost::system::error_code& err)
+{
+	if (err)
+		return;
+	uint64_t now_ns = chat_bench_clock_ns();
+	if (now_ns >= m_end_ns) {
+		uint64_t last_ns = std::max(m_last_recv_ns.load(std::memory_order_relaxed),
+			m_end_ns);
+		if (now_ns - last_ns > CHAT_BENCH_IDLE_MS * 1000000ull ||
+			now_ns - m_end_ns > CHAT_BENCH_DRAIN_MS * 1000000ull) {
+			m_done.send();
+			return;
+		}
+	}
+	priv_check_next();
+}
+
+static int
+chat_client_bench_main(
+	int argc,
+	char **argv)
+{
+	chat_bench_options opts;
+	const struct option long_opts[] = {
+		{"clients", required_argument, NULL, 'c'},
+		{"rate", required_argument, NULL, 'r'},
+		{"size", required_argument, NULL, 's'},
+		{"duration", required_argument, NULL, 'd'},
+		{"threads", required_argument, NULL, 't'},
+		{NULL, 0, NULL, 0},
+	};
+	bool ok = true;
+	int opt;
+	while ((opt = getopt_long(argc, argv, "", long_opts, NULL)) != -1) {
+		switch (opt) {
+		case 'c':
+			opts.m_client_count = atoi(optarg);
+			break;
+		case 'r':
+			opts.m_rate = atof(optarg);
+			break;
+		case 's':
+			opts.m_msg_size = atoi(optarg);
+			break;
+		case 'd':
+			opts.m_duration = atof(optarg);
+			break;
+		case 't':
+			opts.m_thread_count = atoi(optarg);
+			break;
+		default:
+			ok = false;
+			break;
+		}
+	}
+	ok = ok && optind + 1 == argc && opts.m_client_count > 1 && opts.m_rate > 0 &&
+		opts.m_msg_size >= CHAT_BENCH_MSG_SIZE_MIN && opts.m_duration > 0 &&
+		opts.m_thread_count > 0;
+	if (not ok) {
+		std::cout << "Usage: client --bench [--clients=N] [--rate=MSG_PER_SEC] "
+			"[--size=BYTES] [--duration=SEC] [--threads=N] ADDRESS\n";
+		return -1;
+	}
+	chat_bench_app app(opts);
+	return app.run(argv[optind]);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
 int
 main(int argc, char **argv)
 {
+	if (argc >= 2 && strcmp(argv[1], "--bench") == 0)
+		return chat_client_bench_main(argc - 1, argv + 1);
 	if (argc < 2) {
 		std::cout << "Expected an address to connect to\n";
 		return -1;
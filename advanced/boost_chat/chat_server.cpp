@@ -2,47 +2,215 @@
 #include "chat_server.h"
 
 #include <boost/asio/bind_executor.hpp>
+#include <boost/asio/dispatch.hpp>
 #include <boost/asio/io_context.hpp>
 #include <boost/asio/io_context_strand.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/redirect_error.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <boost/asio/write.hpp>
+#include <cstring>
 #include <iostream>
 #include <list>
 
+// Asio runs on io_uring with BOOST_ASIO_HAS_IO_URING and BOOST_ASIO_DISABLE_EPOLL, see
+// the Makefile. The registered buffers came in Boost 1.80, and the build needs them.
+#if defined(BOOST_ASIO_HAS_IO_URING)
+#include <boost/version.hpp>
+#if BOOST_VERSION < 108000
+#error "The io_uring build needs Boost 1.80 or newer"
+#endif
+#include <boost/asio/registered_buffer.hpp>
+#define CHAT_USE_REGISTERED_BUFFERS 1
+#else
+#define CHAT_USE_REGISTERED_BUFFERS 0
+#endif
+
 enum chat_server_state
 {
 	CHAT_SERVER_STATE_NEW,
 	CHAT_SERVER_STATE_LISTEN,
+	CHAT_SERVER_STATE_DRAINING,
 	CHAT_SERVER_STATE_STOPPED,
 };
 
 enum chat_server_peer_state
 {
 	CHAT_SERVER_PEER_STATE_CONNECTED,
+	// Not reading anymore, only sending out what is queued.
+	CHAT_SERVER_PEER_STATE_DRAINING,
 	CHAT_SERVER_PEER_STATE_STOPPED,
 };
 
-class chat_server_peer final : public std::enable_shared_from_this<chat_server_peer>
+// The peer sockets are bound to their io_context directly. Not to a type-erased executor.
+using chat_server_socket = boost::asio::basic_stream_socket<boost::asio::ip::tcp,
+	boost::asio::io_context::executor_type>;
+
+class chat_server_shard;
+
+// Accepted sockets with their peer ids.
+using chat_server_new_peers = std::vector<std::pair<uint64_t, chat_server_socket>>;
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// The protocol is text. A client sends its name as the first line, and then its
+// messages, one per line. The server sends each message as two lines - the author and
+// the data.
+
+static std::string_view
+chat_trim(
+	std::string_view text)
 {
-public:
-	chat_server_peer(
-		boost::asio::ip::tcp::socket&& sock,
-		std::shared_ptr<chat_server_ctx> server);
-	~chat_server_peer();
+	size_t begin = 0;
+	size_t end = text.size();
+	while (begin < end && isspace((unsigned char)text[begin]))
+		++begin;
+	while (end > begin && isspace((unsigned char)text[end - 1]))
+		--end;
+	return text.substr(begin, end - begin);
+}
 
-	void
-	start();
+// Author line of a peer, "name\n". Made once per connection and shared by all its
+// batches, so the name is never copied per message.
+using chat_server_author_ptr = std::shared_ptr<const std::string>;
 
+// Messages received together from one author. Only the data lines are in the batch,
+// and the author buffer is sent in front of each of them. One allocation for all the
+// peers, except the sender. Immutable after that, so the peers of all the shards share
+// it.
+struct chat_server_batch final
+{
 	void
-	stop();
+	append(
+		std::string_view data)
+	{
+		m_data.append(data);
+		m_data.push_back('\n');
+	}
+
+	// Id of the sending peer. 0 is the server itself.
+	uint64_t m_sender_id = 0;
+	chat_server_author_ptr m_author;
+	// The data lines, each with its '\n'. The lines are trimmed, there is no other '\n'.
+	std::string m_data;
+};
+
+using chat_server_batch_ptr = std::shared_ptr<const chat_server_batch>;
+
+// Buffers of a vector, not owning them. async_write() keeps a copy of its buffer
+// sequence, and a copy of the vector itself would be a heap allocation per write. Not
+// final, asio derives from it to check for the methods.
+struct chat_server_buf_view
+{
+	const boost::asio::const_buffer*
+	begin() const { return m_begin; }
+
+	const boost::asio::const_buffer*
+	end() const { return m_end; }
+
+	const boost::asio::const_buffer* m_begin;
+	const boost::asio::const_buffer* m_end;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+#if CHAT_USE_REGISTERED_BUFFERS
+
+// Receive buffers of a shard, registered with the kernel once. A read into one of them
+// is IORING_OP_READ_FIXED, and the kernel doesn't pin and map the pages on every call.
+// A peer first waits for its socket to be readable, and takes a buffer only for the
+// read then, so the idle peers hold none. The data is copied into the peer's own
+// buffer right after, where it is framed anyway. Used in the shard's strand only.
+class chat_server_recv_pool final
+{
+public:
+	chat_server_recv_pool(
+		boost::asio::io_context& ioCtx,
+		uint32_t count,
+		uint32_t size);
+
+	// -1 when all are busy.
+	int
+	take();
 
 	void
-	feed_async(
-		std::string_view text);
+	put(
+		int index) { m_free.push_back(index); }
+
+	boost::asio::mutable_registered_buffer
+	buffer(
+		int index) { return m_reg[index]; }
+
+	const char*
+	data(
+		int index) const { return m_data.data() + (size_t)index * m_size; }
+
+private:
+	static std::vector<boost::asio::mutable_buffer>
+	priv_split(
+		std::vector<char>& data,
+		uint32_t size);
+
+	const uint32_t m_size;
+	std::vector<char> m_data;
+	std::vector<boost::asio::mutable_buffer> m_bufs;
+	boost::asio::buffer_registration<std::vector<boost::asio::mutable_buffer>> m_reg;
+	std::vector<int> m_free;
+};
+
+chat_server_recv_pool::chat_server_recv_pool(
+	boost::asio::io_context& ioCtx,
+	uint32_t count,
+	uint32_t size)
+	: m_size(size)
+	, m_data((size_t)count * size)
+	, m_bufs(priv_split(m_data, size))
+	, m_reg(boost::asio::register_buffers(ioCtx, m_bufs))
+{
+	m_free.reserve(count);
+	for (uint32_t i = count; i > 0; --i)
+		m_free.push_back(i - 1);
+}
+
+int
+chat_server_recv_pool::take()
+{
+	if (m_free.empty())
+		return -1;
+	int index = m_free.back();
+	m_free.pop_back();
+	return index;
+}
+
+std::vector<boost::asio::mutable_buffer>
+chat_server_recv_pool::priv_split(
+	std::vector<char>& data,
+	uint32_t size)
+{
+	std::vector<boost::asio::mutable_buffer> res;
+	for (size_t pos = 0; pos < data.size(); pos += size)
+		res.push_back(boost::asio::buffer(data.data() + pos, size));
+	return res;
+}
+
+#endif
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+class chat_server_peer final : public std::enable_shared_from_this<chat_server_peer>
+{
+public:
+	chat_server_peer(
+		chat_server_socket&& sock,
+		uint64_t id,
+		const std::shared_ptr<chat_server_shard>& shard,
+		const std::shared_ptr<chat_server_ctx>& server);
 
 private:
 	void
 	priv_in_strand_on_new_feed(
-		std::string&& text);
+		const chat_server_batch_ptr& batch);
 
 	void
 	priv_in_strand_recv();
@@ -52,6 +220,22 @@ private:
 		const boost::system::error_code& err,
 		std::size_t size);
 
+	// Frame the received lines and read on.
+	void
+	priv_in_strand_on_data();
+
+#if CHAT_USE_REGISTERED_BUFFERS
+	void
+	priv_in_strand_on_readable(
+		const boost::system::error_code& err);
+
+	void
+	priv_in_strand_on_recv_registered(
+		int index,
+		const boost::system::error_code& err,
+		std::size_t size);
+#endif
+
 	void
 	priv_in_strand_send();
 
@@ -60,21 +244,123 @@ private:
 		const boost::system::error_code& err,
 		std::size_t size);
 
+	void
+	priv_in_strand_drain();
+
 	void
 	priv_in_strand_stop();
 
 	chat_server_peer_state m_state;
+	const uint64_t m_id;
+	// Position in the shard's list, for removal without a search.
+	std::list<std::shared_ptr<chat_server_peer>>::iterator m_shard_pos;
+
+	// The strand of the shard. All its peers share it, so the broadcasts inside one
+	// shard are just function calls.
+	boost::asio::io_context::strand m_strand;
+	chat_server_socket m_sock;
+	// Weak, they own the peer. When they are gone without a stop, the peer stops by
+	// itself.
+	std::weak_ptr<chat_server_shard> m_shard;
+	std::weak_ptr<chat_server_ctx> m_server;
+
+	// The first line of the client is its name.
+	std::string m_name;
+	chat_server_author_ptr m_author;
+	bool m_is_named;
+
+	chat_recv_buf m_in_buf;
+#if CHAT_USE_REGISTERED_BUFFERS
+	// The shard's one, shared so it outlives the reads into it. Can be null.
+	std::shared_ptr<chat_server_recv_pool> m_recv_pool;
+#endif
+	// Output batches, shared with the other peers. The first m_out_sending_count ones
+	// are being sent. New ones are only appended meanwhile.
+	chat_ring<chat_server_batch_ptr> m_out_queue;
+	size_t m_out_sending_count;
+	// Buffers of the batches being sent. Kept between the writes to reuse the memory.
+	std::vector<boost::asio::const_buffer> m_out_bufs;
+
+	chat_handler_memory m_recv_mem;
+	chat_handler_memory m_send_mem;
+
+	friend chat_server_shard;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Peers served by one io_context, under one strand.
+class chat_server_shard final : public std::enable_shared_from_this<chat_server_shard>
+{
+public:
+	chat_server_shard(
+		boost::asio::io_context& ioCtx,
+		const chat_server_options& opts);
+
+	void
+	add_peers_async(
+		chat_server_new_peers&& socks,
+		std::shared_ptr<chat_server_ctx> server);
+
+	void
+	broadcast_async(
+		chat_server_batch_ptr batch);
+
+	void
+	drain_async(
+		std::chrono::steady_clock::time_point deadline,
+		std::shared_ptr<chat_server_ctx> server);
+
+	void
+	stop();
+
+private:
+	void
+	priv_in_strand_add_peers(
+		chat_server_new_peers&& socks,
+		const std::shared_ptr<chat_server_ctx>& server);
+
+	void
+	priv_in_strand_broadcast(
+		const chat_server_batch_ptr& batch);
+
+	void
+	priv_in_strand_peer_on_close(
+		const chat_server_peer* peer);
 
+	void
+	priv_in_strand_drain(
+		std::chrono::steady_clock::time_point deadline,
+		std::shared_ptr<chat_server_ctx> server);
+
+	void
+	priv_in_strand_on_drain_timeout(
+		const boost::system::error_code& err);
+
+	void
+	priv_in_strand_check_drained();
+
+	void
+	priv_in_strand_stop();
+
+	boost::asio::io_context& m_ioctx;
 	boost::asio::io_context::strand m_strand;
-	boost::asio::ip::tcp::socket m_sock;
-	std::shared_ptr<chat_server_ctx> m_server;
+	const chat_server_options m_opts;
+	bool m_is_stopped;
 
-	std::string m_in_buf;
-	std::string m_out_buf;
+	// Set while draining. The server is told once the last peer is closed.
+	std::shared_ptr<chat_server_ctx> m_drain_server;
+	boost::asio::steady_timer m_drain_timer;
+	bool m_is_drain_timed_out;
 
-	// <YOUR CODE IF NEEDED>
+	std::list<std::shared_ptr<chat_server_peer>> m_peers;
+#if CHAT_USE_REGISTERED_BUFFERS
+	// Null when there are none, or the io_context already has a registration.
+	std::shared_ptr<chat_server_recv_pool> m_recv_pool;
+#endif
 
 	friend chat_server_ctx;
+	friend chat_server_peer;
 };
 
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -93,7 +379,8 @@ class chat_server_ctx final : public std::enable_shared_from_this<chat_server_ct
 {
 public:
 	chat_server_ctx(
-		boost::asio::io_context& ioCtx);
+		const std::vector<boost::asio::io_context*>& ioCtxs,
+		const chat_server_options& opts);
 	~chat_server_ctx();
 
 	chat_errcode
@@ -103,6 +390,9 @@ public:
 	uint16_t
 	port() const;
 
+	chat_server_stats
+	stats() const;
+
 	void
 	stop();
 
@@ -110,41 +400,69 @@ public:
 	recv_async(
 		chat_server_on_msg_f&& cb);
 
+	boost::asio::awaitable<chat_errcode>
+	recv(
+		std::unique_ptr<chat_message>& msg);
+
+	size_t
+	recv_batch(
+		std::vector<std::unique_ptr<chat_message>>& msgs);
+
 	void
 	feed_async(
 		std::string_view text);
 
+	void
+	drain_async(
+		std::chrono::milliseconds timeout,
+		chat_server_on_drain_f&& cb);
+
 private:
 	void
 	priv_in_strand_accept();
 
 	void
 	priv_in_strand_on_accept(
-		const boost::system::error_code& err,
-		boost::asio::ip::tcp::socket sock);
+		const boost::system::error_code& err);
 
 	void
 	priv_in_strand_stop();
 
+	void
+	priv_in_strand_drain(
+		std::chrono::milliseconds timeout,
+		chat_server_on_drain_f&& cb);
+
+	void
+	priv_shard_on_drained(
+		bool is_timed_out);
+
+	void
+	priv_in_strand_on_shard_drained(
+		bool is_timed_out);
+
 	void
 	priv_in_strand_on_new_request(
 		std::unique_ptr<chat_server_request> req);
 
 	void
 	priv_peer_on_recv(
-		std::unique_ptr<chat_message> msg);
+		chat_msg_ring&& msgs);
 
 	void
 	priv_in_strand_peer_on_recv(
-		std::unique_ptr<chat_message> msg);
+		chat_msg_ring&& msgs);
 
 	void
-	priv_peer_on_close(
-		std::shared_ptr<chat_server_peer> peer);
+	priv_in_strand_serve();
 
 	void
-	priv_in_strand_peer_on_close(
-		std::shared_ptr<chat_server_peer> peer);
+	priv_in_strand_batch_push();
+
+	void
+	priv_broadcast(
+		chat_server_batch_ptr&& batch,
+		chat_server_shard* own);
 
 	void
 	priv_in_strand_on_new_feed(
@@ -156,30 +474,63 @@ private:
 	boost::asio::ip::tcp::acceptor m_sock;
 	uint16_t m_port;
 
-	std::list<std::shared_ptr<chat_server_peer>> m_peers;
-
-	std::list<std::unique_ptr<chat_server_request>> m_reqs;
-	std::list<std::unique_ptr<chat_message>> m_in_msgs;
-
-	// <YOUR CODE IF NEEDED>
+	// One shard per io_context. The vector never changes after the creation, so it
+	// is read from any strand.
+	std::vector<std::shared_ptr<chat_server_shard>> m_shards;
+	size_t m_next_shard;
+	uint64_t m_last_peer_id;
+	const chat_server_options m_opts;
+	// Written by the strand, read by stats() from any thread.
+	std::atomic_uint64_t m_accept_count;
+	std::atomic_uint64_t m_accept_wakeup_count;
+
+	chat_ring<std::unique_ptr<chat_server_request>> m_reqs;
+	chat_msg_ring m_in_msgs;
+	// Coroutines waiting for messages. They sleep on the timer which never expires,
+	// and are woken up by its cancellation.
+	boost::asio::steady_timer m_co_signal;
+	uint32_t m_co_wait_count;
+	// Messages for recv_batch(). Taken from m_in_msgs once the consumer appears.
+	chat_msg_queue m_batch_queue;
+	std::atomic_bool m_is_batch_used;
+
+	// Fed text waiting for its '\n'.
+	std::string m_feed_buf;
+	const chat_server_author_ptr m_feed_author;
+
+	// Shards still draining, and the callback for when none is left.
+	chat_server_on_drain_f m_drain_cb;
+	size_t m_drain_shard_count;
+	bool m_is_drain_timed_out;
 
 	friend chat_server_peer;
+	friend chat_server_shard;
 };
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
 chat_server::chat_server(
 	boost::asio::io_context& ioCtx)
-	: m_ctx(std::make_shared<chat_server_ctx>(ioCtx))
+	: chat_server(std::vector<boost::asio::io_context*>{&ioCtx})
+{
+}
+
+chat_server::chat_server(
+	const std::vector<boost::asio::io_context*>& ioCtxs)
+	: chat_server(ioCtxs, chat_server_options())
+{
+}
+
+chat_server::chat_server(
+	const std::vector<boost::asio::io_context*>& ioCtxs,
+	const chat_server_options& opts)
+	: m_ctx(std::make_shared<chat_server_ctx>(ioCtxs, opts))
 {
-	// <YOUR CODE IF NEEDED>
 }
 
 chat_server::~chat_server()
 {
 	m_ctx->stop();
-
-	// <YOUR CODE IF NEEDED>
 }
 
 chat_errcode
@@ -195,6 +546,12 @@ chat_server::port() const
 	return m_ctx->port();
 }
 
+chat_server_stats
+chat_server::stats() const
+{
+	return m_ctx->stats();
+}
+
 void
 chat_server::recv_async(
 	chat_server_on_msg_f&& cb)
@@ -202,6 +559,20 @@ chat_server::recv_async(
 	m_ctx->recv_async(std::move(cb));
 }
 
+boost::asio::awaitable<chat_errcode>
+chat_server::recv(
+	std::unique_ptr<chat_message>& msg)
+{
+	return m_ctx->recv(msg);
+}
+
+size_t
+chat_server::recv_batch(
+	std::vector<std::unique_ptr<chat_message>>& msgs)
+{
+	return m_ctx->recv_batch(msgs);
+}
+
 void
 chat_server::feed_async(
 	std::string_view text)
@@ -209,187 +580,508 @@ chat_server::feed_async(
 	m_ctx->feed_async(text);
 }
 
+void
+chat_server::drain_async(
+	std::chrono::milliseconds timeout,
+	chat_server_on_drain_f&& cb)
+{
+	m_ctx->drain_async(timeout, std::move(cb));
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////
 
 chat_server_peer::chat_server_peer(
-	boost::asio::ip::tcp::socket&& sock,
-	std::shared_ptr<chat_server_ctx> server)
+	chat_server_socket&& sock,
+	uint64_t id,
+	const std::shared_ptr<chat_server_shard>& shard,
+	const std::shared_ptr<chat_server_ctx>& server)
 	: m_state(CHAT_SERVER_PEER_STATE_CONNECTED)
-	, m_strand(sock.get_executor().context())
+	, m_id(id)
+	, m_strand(shard->m_strand)
 	, m_sock(std::move(sock))
-	, m_server(std::move(server))
+	, m_shard(shard)
+	, m_server(server)
+	, m_is_named(false)
+#if CHAT_USE_REGISTERED_BUFFERS
+	, m_recv_pool(shard->m_recv_pool)
+#endif
+	, m_out_sending_count(0)
 {
 }
 
-chat_server_peer::~chat_server_peer()
+void
+chat_server_peer::priv_in_strand_on_new_feed(
+	const chat_server_batch_ptr& batch)
 {
-	// <YOUR CODE IF NEEDED>
+	assert(m_strand.running_in_this_thread());
+	if (m_state == CHAT_SERVER_PEER_STATE_STOPPED)
+		return;
+	m_out_queue.push_back(chat_server_batch_ptr(batch));
+	priv_in_strand_send();
 }
 
 void
-chat_server_peer::start()
+chat_server_peer::priv_in_strand_recv()
 {
-	boost::asio::post(m_strand, std::bind(&chat_server_peer::priv_in_strand_recv,
-		shared_from_this()));
+	assert(m_strand.running_in_this_thread());
+	if (m_state == CHAT_SERVER_PEER_STATE_STOPPED)
+		return;
+#if CHAT_USE_REGISTERED_BUFFERS
+	if (m_recv_pool) {
+		m_sock.async_wait(chat_server_socket::wait_read,
+			boost::asio::bind_executor(m_strand, chat_make_alloc_handler(m_recv_mem,
+				std::bind(&chat_server_peer::priv_in_strand_on_readable,
+					shared_from_this(), std::placeholders::_1))));
+		return;
+	}
+#endif
+	size_t size = m_in_buf.prepare();
+	m_sock.async_receive(boost::asio::buffer(m_in_buf.tail(), size),
+		boost::asio::bind_executor(m_strand, chat_make_alloc_handler(m_recv_mem,
+			std::bind(&chat_server_peer::priv_in_strand_on_recv, shared_from_this(),
+				std::placeholders::_1, std::placeholders::_2))));
 }
 
 void
-chat_server_peer::stop()
+chat_server_peer::priv_in_strand_on_recv(
+	const boost::system::error_code& err,
+	std::size_t size)
 {
-	boost::asio::post(m_strand, std::bind(&chat_server_peer::priv_in_strand_stop,
-		shared_from_this()));
+	assert(m_strand.running_in_this_thread());
+	// Draining takes no new messages. The socket is not read anymore.
+	if (m_state != CHAT_SERVER_PEER_STATE_CONNECTED)
+		return;
+	if (err) {
+		priv_in_strand_stop();
+		return;
+	}
+	m_in_buf.commit(size);
+	priv_in_strand_on_data();
 }
 
+#if CHAT_USE_REGISTERED_BUFFERS
+
 void
-chat_server_peer::feed_async(
-	std::string_view text)
+chat_server_peer::priv_in_strand_on_readable(
+	const boost::system::error_code& err)
 {
-	boost::asio::post(m_strand, [ref = shared_from_this(), this,
-		text = std::string(text)]() mutable {
-		priv_in_strand_on_new_feed(std::move(text));
-	});
+	assert(m_strand.running_in_this_thread());
+	if (m_state != CHAT_SERVER_PEER_STATE_CONNECTED)
+		return;
+	if (err) {
+		priv_in_strand_stop();
+		return;
+	}
+	int index = m_recv_pool->take();
+	if (index < 0) {
+		// All are busy, this one goes the usual way.
+		size_t size = m_in_buf.prepare();
+		m_sock.async_receive(boost::asio::buffer(m_in_buf.tail(), size),
+			boost::asio::bind_executor(m_strand, chat_make_alloc_handler(m_recv_mem,
+				std::bind(&chat_server_peer::priv_in_strand_on_recv,
+					shared_from_this(), std::placeholders::_1,
+					std::placeholders::_2))));
+		return;
+	}
+	m_sock.async_read_some(m_recv_pool->buffer(index),
+		boost::asio::bind_executor(m_strand, chat_make_alloc_handler(m_recv_mem,
+			std::bind(&chat_server_peer::priv_in_strand_on_recv_registered,
+				shared_from_this(), index, std::placeholders::_1,
+				std::placeholders::_2))));
 }
 
 void
-chat_server_peer::priv_in_strand_on_new_feed(
-	std::string&& /* text */)
+chat_server_peer::priv_in_strand_on_recv_registered(
+	int index,
+	const boost::system::error_code& err,
+	std::size_t size)
 {
 	assert(m_strand.running_in_this_thread());
+	const char* data = m_recv_pool->data(index);
+	for (size_t done = 0; done < size;) {
+		size_t n = std::min(m_in_buf.prepare(), size - done);
+		memcpy(m_in_buf.tail(), data + done, n);
+		m_in_buf.commit(n);
+		done += n;
+	}
+	m_recv_pool->put(index);
+	if (m_state != CHAT_SERVER_PEER_STATE_CONNECTED)
+		return;
+	if (err) {
+		priv_in_strand_stop();
+		return;
+	}
+	priv_in_strand_on_data();
+}
 
-	// <YOUR CODE IF NEEDED>
-	abort();
+#endif
 
-	// 1) Append the data to the pending output buffer m_out_buf.
-	// 2) priv_in_strand_send();
+void
+chat_server_peer::priv_in_strand_on_data()
+{
+	std::string_view line;
+	std::shared_ptr<chat_server_batch> batch;
+	chat_msg_ring msgs;
+	while (m_in_buf.next_line(line)) {
+		if (not m_is_named) {
+			m_name = line;
+			m_author = std::make_shared<const std::string>(m_name + '\n');
+			m_is_named = true;
+			continue;
+		}
+		line = chat_trim(line);
+		if (line.empty())
+			continue;
+		if (not batch) {
+			batch = std::make_shared<chat_server_batch>();
+			batch->m_sender_id = m_id;
+			batch->m_author = m_author;
+		}
+		batch->append(line);
+		std::unique_ptr<chat_message> msg = std::make_unique<chat_message>();
+		msg->m_author = m_name;
+		msg->m_data = line;
+		msgs.push_back(std::move(msg));
+	}
+	if (batch) {
+		std::shared_ptr<chat_server_ctx> server = m_server.lock();
+		std::shared_ptr<chat_server_shard> shard = m_shard.lock();
+		if (not server or not shard) {
+			priv_in_strand_stop();
+			return;
+		}
+		server->priv_peer_on_recv(std::move(msgs));
+		server->priv_broadcast(std::move(batch), shard.get());
+	}
+	priv_in_strand_recv();
 }
 
 void
-chat_server_peer::priv_in_strand_recv()
+chat_server_peer::priv_in_strand_send()
 {
 	assert(m_strand.running_in_this_thread());
 	if (m_state == CHAT_SERVER_PEER_STATE_STOPPED)
 		return;
+	if (m_out_sending_count != 0 or m_out_queue.empty())
+		return;
+	// Everything queued by now goes in one write, and one completion. Each message is
+	// the shared author buffer and its data line.
+	m_out_bufs.clear();
+	for (size_t i = 0; i < m_out_queue.size(); ++i) {
+		const chat_server_batch_ptr& b = m_out_queue[i];
+		boost::asio::const_buffer author = boost::asio::buffer(*b->m_author);
+		const char* pos = b->m_data.data();
+		const char* end = pos + b->m_data.size();
+		while (pos < end) {
+			const char* line_end = (const char*)memchr(pos, '\n', end - pos) + 1;
+			m_out_bufs.emplace_back(author);
+			m_out_bufs.emplace_back(pos, line_end - pos);
+			pos = line_end;
+		}
+	}
+	m_out_sending_count = m_out_queue.size();
+	chat_server_buf_view bufs = {m_out_bufs.data(), m_out_bufs.data() + m_out_bufs.size()};
+	boost::asio::async_write(m_sock, bufs,
+		boost::asio::bind_executor(m_strand, chat_make_alloc_handler(m_send_mem,
+			std::bind(&chat_server_peer::priv_in_strand_on_send, shared_from_this(),
+				std::placeholders::_1, std::placeholders::_2))));
+}
 
-	// <YOUR CODE IF NEEDED>
-	abort();
+void
+chat_server_peer::priv_in_strand_on_send(
+	const boost::system::error_code& err,
+	std::size_t /* size */)
+{
+	assert(m_strand.running_in_this_thread());
+	if (m_state == CHAT_SERVER_PEER_STATE_STOPPED)
+		return;
+	if (err) {
+		priv_in_strand_stop();
+		return;
+	}
+	// async_write() sends everything or fails. No partial writes here.
+	m_out_queue.pop_front(m_out_sending_count);
+	m_out_sending_count = 0;
+	if (m_state == CHAT_SERVER_PEER_STATE_DRAINING and m_out_queue.empty()) {
+		priv_in_strand_stop();
+		return;
+	}
+	priv_in_strand_send();
+}
 
-	// 1) Ensure you have enough space in m_in_buf. Reserve at least CHAT_RECV_BUF_SIZE.
-	// Grow it x2 when need more.
-	//
-	// 2) Receive more data.
-	// uint8_t* buf = m_in_buf.data() + m_in_buf.length();
-	// size_t size = m_in_buf.capacity() - m_in_buf.length();
-	// m_sock.async_receive(boost::asio::buffer(buf, size),
-	//	boost::asio::bind_executor(strand_,
-	//		std::bind(&chat_server_peer::priv_in_strand_on_recv, shared_from_this(),
-	//		std::placeholder::_1, std::placeholders::_2)));
+void
+chat_server_peer::priv_in_strand_drain()
+{
+	assert(m_strand.running_in_this_thread());
+	if (m_state != CHAT_SERVER_PEER_STATE_CONNECTED)
+		return;
+	m_state = CHAT_SERVER_PEER_STATE_DRAINING;
+	if (m_out_queue.empty())
+		priv_in_strand_stop();
 }
 
 void
-chat_server_peer::priv_in_strand_on_recv(
-	const boost::system::error_code& /* err */,
-	std::size_t /* size */)
+chat_server_peer::priv_in_strand_stop()
 {
 	assert(m_strand.running_in_this_thread());
+	if (m_state == CHAT_SERVER_PEER_STATE_STOPPED)
+		return;
+	m_state = CHAT_SERVER_PEER_STATE_STOPPED;
+	boost::system::error_code err;
+	m_sock.close(err);
+	std::shared_ptr<chat_server_shard> shard = m_shard.lock();
+	if (shard)
+		shard->priv_in_strand_peer_on_close(this);
+}
 
-	// <YOUR CODE IF NEEDED>
-	abort();
+//////////////////////////////////////////////////////////////////////////////////////////
 
-	// 1) Start considering the newly received bytes.
-	// m_in_buf.resize(m_in_buf.length() + size);
-	//
-	// 2) Parse the buffer trying to extract complete messages. Send each extracted one
-	// to the server: m_server->priv_peer_on_recv(msg).
-	//
-	// 3) Keep receiving infinitely.
-	//
-	// In your code you might make m_in_buf more efficient.
+chat_server_shard::chat_server_shard(
+	boost::asio::io_context& ioCtx,
+	const chat_server_options& opts)
+	: m_ioctx(ioCtx)
+	, m_strand(ioCtx)
+	, m_opts(opts)
+	, m_is_stopped(false)
+	, m_drain_timer(ioCtx)
+	, m_is_drain_timed_out(false)
+{
+#if CHAT_USE_REGISTERED_BUFFERS
+	if (opts.m_registered_buf_count == 0 || opts.m_registered_buf_size == 0)
+		return;
+	try {
+		m_recv_pool = std::make_shared<chat_server_recv_pool>(ioCtx,
+			opts.m_registered_buf_count, opts.m_registered_buf_size);
+	} catch (const boost::system::system_error& e) {
+		// One registration per io_context. Another server or shard on it has one.
+		std::cerr << "No registered buffers: " << e.what() << '\n';
+	}
+#endif
 }
 
 void
-chat_server_peer::priv_in_strand_send()
+chat_server_shard::add_peers_async(
+	chat_server_new_peers&& socks,
+	std::shared_ptr<chat_server_ctx> server)
+{
+	boost::asio::post(m_strand, [ref = shared_from_this(), this,
+		socks = std::move(socks), server = std::move(server)]() mutable {
+		priv_in_strand_add_peers(std::move(socks), server);
+	});
+}
+
+void
+chat_server_shard::broadcast_async(
+	chat_server_batch_ptr batch)
+{
+	boost::asio::post(m_strand, [ref = shared_from_this(), this,
+		batch = std::move(batch)]() {
+		priv_in_strand_broadcast(batch);
+	});
+}
+
+void
+chat_server_shard::drain_async(
+	std::chrono::steady_clock::time_point deadline,
+	std::shared_ptr<chat_server_ctx> server)
+{
+	boost::asio::post(m_strand, [ref = shared_from_this(), this, deadline,
+		server = std::move(server)]() mutable {
+		priv_in_strand_drain(deadline, std::move(server));
+	});
+}
+
+void
+chat_server_shard::stop()
+{
+	boost::asio::post(m_strand, std::bind(&chat_server_shard::priv_in_strand_stop,
+		shared_from_this()));
+}
+
+void
+chat_server_shard::priv_in_strand_add_peers(
+	chat_server_new_peers&& socks,
+	const std::shared_ptr<chat_server_ctx>& server)
 {
 	assert(m_strand.running_in_this_thread());
-	if (m_state == CHAT_SERVER_PEER_STATE_STOPPED)
+	// Accepted right before the drain. The sockets are just closed.
+	if (m_is_stopped or m_drain_server)
 		return;
+	for (std::pair<uint64_t, chat_server_socket>& s : socks) {
+		chat_server_socket& sock = s.second;
+		// The options are not critical. A failure keeps the defaults.
+		boost::system::error_code err;
+		sock.set_option(boost::asio::ip::tcp::no_delay(m_opts.m_tcp_nodelay), err);
+		if (m_opts.m_send_buf_size > 0) {
+			sock.set_option(boost::asio::socket_base::send_buffer_size(
+				m_opts.m_send_buf_size), err);
+		}
+		if (m_opts.m_recv_buf_size > 0) {
+			sock.set_option(boost::asio::socket_base::receive_buffer_size(
+				m_opts.m_recv_buf_size), err);
+		}
+		std::shared_ptr<chat_server_peer> peer = std::make_shared<chat_server_peer>(
+			std::move(sock), s.first, shared_from_this(), server);
+		peer->priv_in_strand_recv();
+		m_peers.emplace_back(peer);
+		peer->m_shard_pos = std::prev(m_peers.end());
+	}
+}
 
-	// <YOUR CODE IF NEEDED>
-	abort();
+void
+chat_server_shard::priv_in_strand_broadcast(
+	const chat_server_batch_ptr& batch)
+{
+	assert(m_strand.running_in_this_thread());
+	for (std::shared_ptr<chat_server_peer>& p : m_peers) {
+		if (p->m_id != batch->m_sender_id)
+			p->priv_in_strand_on_new_feed(batch);
+	}
+}
 
-	// If the buffer m_out_buf contains a complete message, then send it using
-	// m_sock.async_send(boost::asio::buffer(m_out_buf.data(), m_out_buf.length()),
-	//	boost::asio::bind_executor(m_strand,
-	//		std::bind(&chat_server_peer::priv_in_strand_on_send, shared_from_this(),
-	//			std::placeholders::_1, std::placeholders::_2)));
-	//
-	// You don't have to send whole messages. Could send the parts right away if your
-	// protocol is fine with that. But you might need to send full ones if you encode them
-	// anyhow. For example, prefix each message with its total size to make receipt on the
-	// other end more optimal.
-	//
-	// When m_out_buf is needed (only if you are sending full messages), you should keep
-	// it valid and unchanged until the sending is complete. Which means you might need a
-	// second buffer where you would store newer messages while the older ones are being
-	// sent.
+void
+chat_server_shard::priv_in_strand_peer_on_close(
+	const chat_server_peer* peer)
+{
+	assert(m_strand.running_in_this_thread());
+	// The stopped shard has already taken the peers out of the list.
+	if (m_is_stopped)
+		return;
+	assert(peer->m_shard_pos->get() == peer);
+	m_peers.erase(peer->m_shard_pos);
+	priv_in_strand_check_drained();
 }
 
 void
-chat_server_peer::priv_in_strand_on_send(
-	const boost::system::error_code& /* err */,
-	std::size_t /* size */)
+chat_server_shard::priv_in_strand_drain(
+	std::chrono::steady_clock::time_point deadline,
+	std::shared_ptr<chat_server_ctx> server)
 {
 	assert(m_strand.running_in_this_thread());
+	if (m_is_stopped or m_drain_server)
+		return;
+	m_drain_server = std::move(server);
+	// The idle peers are closed right away and leave the list meanwhile.
+	for (auto it = m_peers.begin(); it != m_peers.end();) {
+		std::shared_ptr<chat_server_peer> peer = *it++;
+		peer->priv_in_strand_drain();
+	}
+	if (not m_peers.empty()) {
+		m_drain_timer.expires_at(deadline);
+		m_drain_timer.async_wait(boost::asio::bind_executor(m_strand, std::bind(
+			&chat_server_shard::priv_in_strand_on_drain_timeout, shared_from_this(),
+			std::placeholders::_1)));
+	}
+	priv_in_strand_check_drained();
+}
 
-	// <YOUR CODE IF NEEDED>
-	abort();
+void
+chat_server_shard::priv_in_strand_on_drain_timeout(
+	const boost::system::error_code& err)
+{
+	assert(m_strand.running_in_this_thread());
+	if (err or m_is_stopped or not m_drain_server)
+		return;
+	m_is_drain_timed_out = true;
+	for (auto it = m_peers.begin(); it != m_peers.end();) {
+		std::shared_ptr<chat_server_peer> peer = *it++;
+		peer->priv_in_strand_stop();
+	}
+}
 
-	// Be careful about partial writes. The sent size might be < m_out_buf.length(). Then
-	// you must send the rest again. Keep sending as long as you have something to send.
+void
+chat_server_shard::priv_in_strand_check_drained()
+{
+	assert(m_strand.running_in_this_thread());
+	if (not m_drain_server or not m_peers.empty())
+		return;
+	m_is_stopped = true;
+	m_drain_timer.cancel();
+	std::shared_ptr<chat_server_ctx> server = std::move(m_drain_server);
+	server->priv_shard_on_drained(m_is_drain_timed_out);
 }
 
 void
-chat_server_peer::priv_in_strand_stop()
+chat_server_shard::priv_in_strand_stop()
 {
 	assert(m_strand.running_in_this_thread());
-	if (m_state != CHAT_SERVER_PEER_STATE_CONNECTED)
+	if (m_is_stopped)
 		return;
-	m_state = CHAT_SERVER_PEER_STATE_CONNECTED;
-	m_sock.close();
-	m_server->priv_peer_on_close(shared_from_this());
-	m_server.reset();
+	m_is_stopped = true;
+	// The server does not wait for the drain anymore.
+	m_drain_server.reset();
+	m_drain_timer.cancel();
+	std::list<std::shared_ptr<chat_server_peer>> peers;
+	peers.swap(m_peers);
+	for (std::shared_ptr<chat_server_peer>& p : peers)
+		p->priv_in_strand_stop();
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
 chat_server_ctx::chat_server_ctx(
-	boost::asio::io_context& ioCtx)
+	const std::vector<boost::asio::io_context*>& ioCtxs,
+	const chat_server_options& opts)
 	: m_state(CHAT_SERVER_STATE_NEW)
-	, m_strand(ioCtx)
-	, m_sock(ioCtx)
+	, m_strand(*ioCtxs.at(0))
+	, m_sock(*ioCtxs.at(0))
+	, m_port(0)
+	, m_next_shard(0)
+	, m_last_peer_id(0)
+	, m_opts(opts)
+	, m_accept_count(0)
+	, m_accept_wakeup_count(0)
+	, m_co_signal(*ioCtxs.at(0), boost::asio::steady_timer::time_point::max())
+	, m_co_wait_count(0)
+	, m_is_batch_used(false)
+	, m_feed_author(std::make_shared<const std::string>("server\n"))
+	, m_drain_shard_count(0)
+	, m_is_drain_timed_out(false)
 {
-	// <YOUR CODE IF NEEDED>
+	m_shards.reserve(ioCtxs.size());
+	for (boost::asio::io_context* ioCtx : ioCtxs)
+		m_shards.emplace_back(std::make_shared<chat_server_shard>(*ioCtx, m_opts));
 }
 
 chat_server_ctx::~chat_server_ctx()
 {
-	// <YOUR CODE IF NEEDED>
+	// The server is deleted. Nobody waits for the pending requests anymore, so they
+	// are dropped without calling.
+	m_reqs.clear();
 }
 
 chat_errcode
 chat_server_ctx::start(
 	uint16_t port)
 {
-	assert(m_state == CHAT_SERVER_STATE_NEW);
-	// <YOUR CODE IF NEEDED>
-	//
-	// You need to handle errors without throwing exceptions and return them
-	// gracefully.
-	//
-	boost::asio::ip::tcp::endpoint endpoint;
-	endpoint.port(port);
-	m_sock.bind(endpoint);
-	m_port = m_sock.local_endpoint().port();
-	m_sock.listen();
+	if (m_state != CHAT_SERVER_STATE_NEW)
+		return CHAT_ERR_ALREADY_STARTED;
+	boost::system::error_code err;
+	boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::tcp::v4(), port);
+	m_sock.open(endpoint.protocol(), err);
+	if (err)
+		return CHAT_ERR_SYS;
+	m_sock.set_option(boost::asio::socket_base::reuse_address(true), err);
+	if (not err)
+		m_sock.bind(endpoint, err);
+	if (err) {
+		boost::system::error_code close_err;
+		m_sock.close(close_err);
+		if (err == boost::asio::error::address_in_use)
+			return CHAT_ERR_PORT_BUSY;
+		return CHAT_ERR_SYS;
+	}
+	m_sock.listen(boost::asio::socket_base::max_listen_connections, err);
+	// The clients are taken in a loop until there are no more.
+	if (not err)
+		m_sock.non_blocking(true, err);
+	if (not err)
+		m_port = m_sock.local_endpoint(err).port();
+	if (err) {
+		boost::system::error_code close_err;
+		m_sock.close(close_err);
+		return CHAT_ERR_SYS;
+	}
 	m_state = CHAT_SERVER_STATE_LISTEN;
 	boost::asio::post(m_strand, std::bind(
 		&chat_server_ctx::priv_in_strand_accept, shared_from_this()));
@@ -403,6 +1095,15 @@ chat_server_ctx::port() const
 	return m_port;
 }
 
+chat_server_stats
+chat_server_ctx::stats() const
+{
+	chat_server_stats res;
+	res.m_accept_count = m_accept_count.load(std::memory_order_relaxed);
+	res.m_accept_wakeup_count = m_accept_wakeup_count.load(std::memory_order_relaxed);
+	return res;
+}
+
 void
 chat_server_ctx::stop()
 {
@@ -422,6 +1123,50 @@ chat_server_ctx::recv_async(
 	});
 }
 
+boost::asio::awaitable<chat_errcode>
+chat_server_ctx::recv(
+	std::unique_ptr<chat_message>& msg)
+{
+	// The coroutine frame holds the server alive until the end.
+	std::shared_ptr<chat_server_ctx> ref = shared_from_this();
+	co_await boost::asio::dispatch(m_strand, boost::asio::use_awaitable);
+	while (not m_reqs.empty() or m_in_msgs.empty()) {
+		if (m_state == CHAT_SERVER_STATE_STOPPED)
+			co_return CHAT_ERR_CANCELED;
+		++m_co_wait_count;
+		// The wait is started before the strand is left. Hence no wakeup is lost.
+		boost::system::error_code err;
+		co_await m_co_signal.async_wait(
+			boost::asio::redirect_error(boost::asio::use_awaitable, err));
+		co_await boost::asio::dispatch(m_strand, boost::asio::use_awaitable);
+		--m_co_wait_count;
+	}
+	msg = m_in_msgs.pop_front();
+	co_return CHAT_ERR_NONE;
+}
+
+size_t
+chat_server_ctx::recv_batch(
+	std::vector<std::unique_ptr<chat_message>>& msgs)
+{
+	// The messages received before the first call are still in the strand.
+	if (not m_is_batch_used.exchange(true)) {
+		boost::asio::post(m_strand, std::bind(
+			&chat_server_ctx::priv_in_strand_batch_push, shared_from_this()));
+	}
+	while (true) {
+		size_t count = m_batch_queue.pop_all(msgs);
+		// The queue was full and the rest waits in the strand. Now there is room.
+		if (m_batch_queue.take_overflow()) {
+			boost::asio::post(m_strand, std::bind(
+				&chat_server_ctx::priv_in_strand_batch_push, shared_from_this()));
+		}
+		if (count > 0)
+			return count;
+		m_batch_queue.wait();
+	}
+}
+
 void
 chat_server_ctx::feed_async(
 	std::string_view text)
@@ -430,23 +1175,36 @@ chat_server_ctx::feed_async(
 		shared_from_this(), std::string(text)));
 }
 
+void
+chat_server_ctx::drain_async(
+	std::chrono::milliseconds timeout,
+	chat_server_on_drain_f&& cb)
+{
+	boost::asio::post(m_strand, [ref = shared_from_this(), this, timeout,
+		cb = std::move(cb)]() mutable {
+		priv_in_strand_drain(timeout, std::move(cb));
+	});
+}
+
 void
 chat_server_ctx::priv_in_strand_accept()
 {
 	assert(m_strand.running_in_this_thread());
-	assert(m_state == CHAT_SERVER_STATE_LISTEN);
-	m_sock.async_accept(boost::asio::bind_executor(m_strand, std::bind(
-		&chat_server_ctx::priv_in_strand_on_accept, shared_from_this(),
-		std::placeholders::_1, std::placeholders::_2)));
+	if (m_state != CHAT_SERVER_STATE_LISTEN)
+		return;
+	// Only wait for the clients. They are taken all at once then.
+	m_sock.async_wait(boost::asio::socket_base::wait_read,
+		boost::asio::bind_executor(m_strand, std::bind(
+			&chat_server_ctx::priv_in_strand_on_accept, shared_from_this(),
+			std::placeholders::_1)));
 }
 
 void
 chat_server_ctx::priv_in_strand_on_accept(
-	const boost::system::error_code& err,
-	boost::asio::ip::tcp::socket sock)
+	const boost::system::error_code& err)
 {
 	assert(m_strand.running_in_this_thread());
-	if (m_state == CHAT_SERVER_STATE_STOPPED)
+	if (m_state != CHAT_SERVER_STATE_LISTEN)
 		return;
 	if (err) {
 		std::cout << "Chat server accept error: boost " << err << '\n';
@@ -455,10 +1213,36 @@ chat_server_ctx::priv_in_strand_on_accept(
 		abort();
 		return;
 	}
-	std::shared_ptr<chat_server_peer> peer = std::make_shared<chat_server_peer>(
-		std::move(sock), shared_from_this());
-	peer->start();
-	m_peers.emplace_back(std::move(peer));
+	m_accept_wakeup_count.fetch_add(1, std::memory_order_relaxed);
+	// The sockets of a shard go to it in one post.
+	std::vector<chat_server_new_peers> socks(m_shards.size());
+	uint32_t count = 0;
+	while (count < m_opts.m_accept_batch_size) {
+		boost::system::error_code accept_err;
+		// The socket is created right in the context of the shard which is going to
+		// serve it.
+		chat_server_socket sock = m_sock.accept(m_shards[m_next_shard]->m_ioctx,
+			accept_err);
+		if (accept_err == boost::asio::error::would_block or
+			accept_err == boost::asio::error::try_again)
+			break;
+		// The client has gone before it was taken.
+		if (accept_err == boost::asio::error::connection_aborted)
+			continue;
+		if (accept_err) {
+			std::cout << "Chat server accept error: boost " << accept_err << '\n';
+			abort();
+			return;
+		}
+		socks[m_next_shard].emplace_back(++m_last_peer_id, std::move(sock));
+		m_next_shard = (m_next_shard + 1) % m_shards.size();
+		++count;
+	}
+	m_accept_count.fetch_add(count, std::memory_order_relaxed);
+	for (size_t i = 0; i < m_shards.size(); ++i) {
+		if (not socks[i].empty())
+			m_shards[i]->add_peers_async(std::move(socks[i]), shared_from_this());
+	}
 	priv_in_strand_accept();
 }
 
@@ -466,13 +1250,73 @@ void
 chat_server_ctx::priv_in_strand_stop()
 {
 	assert(m_strand.running_in_this_thread());
-	if (m_state != CHAT_SERVER_STATE_LISTEN)
+	if (m_state == CHAT_SERVER_STATE_STOPPED)
+		return;
+	m_state = CHAT_SERVER_STATE_STOPPED;
+	boost::system::error_code err;
+	m_sock.close(err);
+	m_co_signal.cancel();
+	for (std::shared_ptr<chat_server_shard>& s : m_shards)
+		s->stop();
+	if (m_drain_cb) {
+		chat_server_on_drain_f cb = std::move(m_drain_cb);
+		m_drain_cb = nullptr;
+		cb(CHAT_ERR_CANCELED);
+	}
+}
+
+void
+chat_server_ctx::priv_in_strand_drain(
+	std::chrono::milliseconds timeout,
+	chat_server_on_drain_f&& cb)
+{
+	assert(m_strand.running_in_this_thread());
+	if (m_state == CHAT_SERVER_STATE_NEW) {
+		cb(CHAT_ERR_NOT_STARTED);
+		return;
+	}
+	if (m_state != CHAT_SERVER_STATE_LISTEN) {
+		cb(CHAT_ERR_CANCELED);
+		return;
+	}
+	m_state = CHAT_SERVER_STATE_DRAINING;
+	boost::system::error_code err;
+	m_sock.close(err);
+	m_drain_cb = std::move(cb);
+	m_drain_shard_count = m_shards.size();
+	m_is_drain_timed_out = false;
+	// One post per io_context. The shard drains all its peers in one go.
+	std::chrono::steady_clock::time_point deadline =
+		std::chrono::steady_clock::now() + timeout;
+	for (std::shared_ptr<chat_server_shard>& s : m_shards)
+		s->drain_async(deadline, shared_from_this());
+}
+
+void
+chat_server_ctx::priv_shard_on_drained(
+	bool is_timed_out)
+{
+	boost::asio::post(m_strand, std::bind(
+		&chat_server_ctx::priv_in_strand_on_shard_drained, shared_from_this(),
+		is_timed_out));
+}
+
+void
+chat_server_ctx::priv_in_strand_on_shard_drained(
+	bool is_timed_out)
+{
+	assert(m_strand.running_in_this_thread());
+	if (m_state != CHAT_SERVER_STATE_DRAINING)
+		return;
+	m_is_drain_timed_out = m_is_drain_timed_out or is_timed_out;
+	assert(m_drain_shard_count > 0);
+	if (--m_drain_shard_count > 0)
 		return;
 	m_state = CHAT_SERVER_STATE_STOPPED;
-	m_sock.close();
-	for (std::shared_ptr<chat_server_peer>& p : m_peers)
-		p->stop();
-	m_peers.clear();
+	m_co_signal.cancel();
+	chat_server_on_drain_f cb = std::move(m_drain_cb);
+	m_drain_cb = nullptr;
+	cb(m_is_drain_timed_out ? CHAT_ERR_TIMEOUT : CHAT_ERR_NONE);
 }
 
 void
@@ -481,61 +1325,75 @@ chat_server_ctx::priv_in_strand_on_new_request(
 {
 	assert(m_strand.running_in_this_thread());
 	if (not m_reqs.empty() or m_in_msgs.empty()) {
-		m_reqs.emplace_back(std::move(req));
+		m_reqs.push_back(std::move(req));
 		return;
 	}
 	// Already have data to return. Then just return it.
-	req->m_cb(CHAT_ERR_NONE, std::move(m_in_msgs.front()));
-	m_in_msgs.pop_front();
+	std::unique_ptr<chat_message> msg = m_in_msgs.pop_front();
+	req->m_cb(CHAT_ERR_NONE, std::move(msg));
 }
 
 void
 chat_server_ctx::priv_peer_on_recv(
-	std::unique_ptr<chat_message> msg)
+	chat_msg_ring&& msgs)
 {
 	boost::asio::post(m_strand, [ref = shared_from_this(), this,
-		msg = std::move(msg)]() mutable {
-		priv_in_strand_peer_on_recv(std::move(msg));
+		msgs = std::move(msgs)]() mutable {
+		priv_in_strand_peer_on_recv(std::move(msgs));
 	});
 }
 
 void
 chat_server_ctx::priv_in_strand_peer_on_recv(
-	std::unique_ptr<chat_message> msg)
+	chat_msg_ring&& msgs)
 {
 	assert(m_strand.running_in_this_thread());
-	m_in_msgs.emplace_back(std::move(msg));
-
-	// <YOUR CODE IF NEEDED>
-	//
-	// Serve the pending receive-requests if there are any.
+	if (m_in_msgs.empty()) {
+		m_in_msgs.swap(msgs);
+	} else {
+		while (not msgs.empty())
+			m_in_msgs.push_back(msgs.pop_front());
+	}
+	priv_in_strand_serve();
+	if (m_co_wait_count > 0 and not m_in_msgs.empty())
+		m_co_signal.cancel();
+	else
+		priv_in_strand_batch_push();
 }
 
 void
-chat_server_ctx::priv_peer_on_close(
-	std::shared_ptr<chat_server_peer> peer)
+chat_server_ctx::priv_in_strand_batch_push()
 {
-	boost::asio::post(m_strand, [ref = shared_from_this(), this,
-		peer = std::move(peer)]() mutable {
-		priv_in_strand_peer_on_close(std::move(peer));
-	});
+	assert(m_strand.running_in_this_thread());
+	if (m_in_msgs.empty() or not m_is_batch_used.load(std::memory_order_relaxed))
+		return;
+	m_batch_queue.push(m_in_msgs);
 }
 
 void
-chat_server_ctx::priv_in_strand_peer_on_close(
-	std::shared_ptr<chat_server_peer> peer)
+chat_server_ctx::priv_in_strand_serve()
 {
 	assert(m_strand.running_in_this_thread());
-	for (auto it = m_peers.begin(); it != m_peers.end(); ++it) {
-		if (*it == peer) {
-			m_peers.erase(it);
-			return;
-		}
+	while (not m_reqs.empty() and not m_in_msgs.empty()) {
+		std::unique_ptr<chat_server_request> req = m_reqs.pop_front();
+		std::unique_ptr<chat_message> msg = m_in_msgs.pop_front();
+		req->m_cb(CHAT_ERR_NONE, std::move(msg));
+	}
+}
+
+void
+chat_server_ctx::priv_broadcast(
+	chat_server_batch_ptr&& batch,
+	chat_server_shard* own)
+{
+	// One post per shard for the whole batch. The own shard is already in its strand
+	// and is served right away.
+	for (std::shared_ptr<chat_server_shard>& s : m_shards) {
+		if (s.get() == own)
+			s->priv_in_strand_broadcast(batch);
+		else
+			s->broadcast_async(batch);
 	}
-	if (m_state == CHAT_SERVER_STATE_STOPPED)
-		return;
-	// Unreachable. If it is reachable, then you have a bug.
-	abort();
 }
 
 void
@@ -543,10 +1401,22 @@ chat_server_ctx::priv_in_strand_on_new_feed(
 	std::string_view text)
 {
 	assert(m_strand.running_in_this_thread());
-	for (std::shared_ptr<chat_server_peer>& p : m_peers)
-		p->feed_async(text);
+	m_feed_buf.append(text);
+	std::shared_ptr<chat_server_batch> batch;
+	size_t pos = 0;
+	for (size_t end = m_feed_buf.find('\n'); end != std::string::npos;
+		pos = end + 1, end = m_feed_buf.find('\n', pos)) {
+		std::string_view line = chat_trim(std::string_view(m_feed_buf).substr(
+			pos, end - pos));
+		if (line.empty())
+			continue;
+		if (not batch) {
+			batch = std::make_shared<chat_server_batch>();
+			batch->m_author = m_feed_author;
+		}
+		batch->append(line);
+	}
+	m_feed_buf.erase(0, pos);
+	if (batch)
+		priv_broadcast(std::move(batch), nullptr);
 }
-
-//////////////////////////////////////////////////////////////////////////////////////////
-
-//////////////////////////////////////////////////////////////////////////////////////////
@@ -2,19 +2,58 @@
 
 #include "chat.h"
 
+#include <chrono>
 #include <functional>
+// Boost 1.74 awaitable.hpp uses std::exchange() without including <utility>.
+#include <utility>
+#include <vector>
+
+#include <boost/asio/awaitable.hpp>
 
 namespace boost { namespace asio { class io_context; } }
 
 class chat_server_ctx;
 
+struct chat_server_options
+{
+	// Set on each accepted socket. The buffer sizes of 0 keep the system defaults.
+	bool m_tcp_nodelay = true;
+	int m_send_buf_size = 0;
+	int m_recv_buf_size = 0;
+	// Most clients accepted per wakeup of the listening socket. The rest are taken on
+	// the next one, so the other work of the strand is not starved.
+	uint32_t m_accept_batch_size = 256;
+	// Only in the io_uring build, URING=1 in the Makefile. Each shard registers that
+	// many receive buffers of that size with the kernel, and a readable peer reads
+	// into a free one of them. 0 is the peers' own buffers only.
+	uint32_t m_registered_buf_count = 64;
+	uint32_t m_registered_buf_size = 16 * 1024;
+};
+
+struct chat_server_stats
+{
+	// Accepted clients, and the wakeups of the listening socket they took. The accept
+	// rate is the difference of two samples over the time between them.
+	uint64_t m_accept_count = 0;
+	uint64_t m_accept_wakeup_count = 0;
+};
+
 using chat_server_on_msg_f = std::function<void(chat_errcode err, std::unique_ptr<chat_message> msg)>;
+using chat_server_on_drain_f = std::function<void(chat_errcode err)>;
 
 class chat_server final
 {
 public:
 	chat_server(
 		boost::asio::io_context& ioCtx);
+	// The peers are spread over the contexts round-robin, and each one is served only
+	// by its own context. The contexts are supposed to be run by a thread each. The
+	// first one also accepts the clients and serves recv_async() and feed_async().
+	chat_server(
+		const std::vector<boost::asio::io_context*>& ioCtxs);
+	chat_server(
+		const std::vector<boost::asio::io_context*>& ioCtxs,
+		const chat_server_options& opts);
 	~chat_server();
 
 	chat_errcode
@@ -24,14 +63,44 @@ public:
 	uint16_t
 	port() const;
 
+	// Can be called from any thread.
+	chat_server_stats
+	stats() const;
+
 	void
 	recv_async(
 		chat_server_on_msg_f&& cb);
 
+	// Coroutine version of recv_async(). The caller is resumed in the server's strand,
+	// with the message already in @a msg. Not meant to be mixed with recv_async() on
+	// the same server - the callbacks are always served first.
+	boost::asio::awaitable<chat_errcode>
+	recv(
+		std::unique_ptr<chat_message>& msg);
+
+	// Lock-free alternative to recv_async() for one consumer thread. Appends all the
+	// received messages to @a msgs and returns their count. Waits when there are none
+	// yet. Since the first call the messages not taken by recv_async() and recv() go
+	// to a lock-free queue, and the consumer is woken up only when it sleeps.
+	size_t
+	recv_batch(
+		std::vector<std::unique_ptr<chat_message>>& msgs);
+
 	void
 	feed_async(
 		std::string_view text);
 
+	// Graceful stop. No new clients and no new messages are taken, while the output
+	// already queued is sent out. Each peer is closed once its output is flushed, and
+	// whatever is left at the timeout is closed anyway. The callback gets
+	// CHAT_ERR_NONE, or CHAT_ERR_TIMEOUT when some output was dropped, or
+	// CHAT_ERR_CANCELED when the server is deleted meanwhile. Each io_context gets one
+	// post for all its peers.
+	void
+	drain_async(
+		std::chrono::milliseconds timeout,
+		chat_server_on_drain_f&& cb);
+
 private:
 	const std::shared_ptr<chat_server_ctx> m_ctx;
 };
@@ -1,12 +1,18 @@
 #include "chat_server.h"
 
 #include <boost/asio/bind_executor.hpp>
+#include <boost/asio/dispatch.hpp>
 #include <boost/asio/io_context.hpp>
 #include <boost/asio/io_context_strand.hpp>
 #include <boost/asio/ip/tcp.hpp>
 #include <boost/asio/posix/stream_descriptor.hpp>
-#include <boost/asio/read.hpp>
+#include <boost/asio/signal_set.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <cstring>
+#include <getopt.h>
 #include <iostream>
+#include <sys/resource.h>
+#include <thread>
 
 class chat_server_app final
 {
@@ -84,16 +90,21 @@ void
 chat_server_app::priv_recv_next()
 {
 	assert(m_strand.running_in_this_thread());
-	m_server.recv_async(boost::asio::bind_executor(m_strand,
-		std::bind(&chat_server_app::priv_on_recv, this, std::placeholders::_1,
-			std::placeholders::_2)));
+	// The callback is type-erased and loses the bound executor. So it is dispatched
+	// to the strand explicitly.
+	m_server.recv_async([this](chat_errcode err, std::unique_ptr<chat_message> msg) {
+		boost::asio::dispatch(m_strand, [this, err, msg = std::move(msg)]() mutable {
+			priv_on_recv(err, std::move(msg));
+		});
+	});
 }
 
 void
 chat_server_app::priv_read_next()
 {
 	assert(m_strand.running_in_this_thread());
-	boost::asio::async_read(m_input, boost::asio::buffer(m_in_buf, CHAT_RECV_BUF_SIZE),
+	// Whatever is typed goes right away. Not waiting for the buffer to fill up.
+	m_input.async_read_some(boost::asio::buffer(m_in_buf, CHAT_RECV_BUF_SIZE),
 		boost::asio::bind_executor(m_strand,
 			std::bind(&chat_server_app::priv_on_input, this, std::placeholders::_1,
 				std::placeholders::_2)));
@@ -111,7 +122,7 @@ chat_server_app::priv_on_recv(
 		m_ioctx.stop();
 		return;
 	}
-	std::cout << msg->m_author << ": " << msg->m_data;
+	std::cout << msg->m_author << ": " << msg->m_data << '\n';
 	priv_recv_next();
 }
 
@@ -136,9 +147,239 @@ chat_server_app::priv_on_input(
 	priv_read_next();
 }
 
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Server of the benchmark. Serves until SIGINT or SIGTERM and prints every second how
+// many messages came in and how much CPU it took. Then drains and tells how long it
+// took. The load comes from
+// "client --bench".
+class chat_server_bench_app final
+{
+public:
+	chat_server_bench_app(
+		int thread_count);
+
+	int
+	run(
+		uint16_t port);
+
+private:
+	void
+	priv_recv_next();
+
+	void
+	priv_on_recv(
+		chat_errcode err,
+		std::unique_ptr<chat_message> msg);
+
+	void
+	priv_tick_next();
+
+	void
+	priv_on_tick(
+		const boost::system::error_code& err);
+
+	void
+	priv_stop();
+
+	// The first context is run by the main thread, the others by a thread each.
+	std::vector<std::unique_ptr<boost::asio::io_context>> m_ioctxs;
+	boost::asio::io_context::strand m_strand;
+	chat_server m_server;
+	boost::asio::steady_timer m_timer;
+	boost::asio::signal_set m_signals;
+
+	uint64_t m_recv_count;
+	uint64_t m_last_recv_count;
+	double m_last_cpu_sec;
+	chat_server_stats m_last_stats;
+	std::chrono::steady_clock::time_point m_last_tick;
+};
+
+static std::vector<std::unique_ptr<boost::asio::io_context>>
+chat_bench_make_ioctxs(
+	int count)
+{
+	std::vector<std::unique_ptr<boost::asio::io_context>> res;
+	for (int i = 0; i < count; ++i)
+		res.emplace_back(std::make_unique<boost::asio::io_context>(1));
+	return res;
+}
+
+static std::vector<boost::asio::io_context*>
+chat_bench_ioctx_ptrs(
+	const std::vector<std::unique_ptr<boost::asio::io_context>>& ioCtxs)
+{
+	std::vector<boost::asio::io_context*> res;
+	for (const std::unique_ptr<boost::asio::io_context>& ioCtx : ioCtxs)
+		res.push_back(ioCtx.get());
+	return res;
+}
+
+static double
+chat_bench_cpu_sec()
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+		ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+chat_server_bench_app::chat_server_bench_app(
+	int thread_count)
+	: m_ioctxs(chat_bench_make_ioctxs(thread_count))
+	, m_strand(*m_ioctxs[0])
+	, m_server(chat_bench_ioctx_ptrs(m_ioctxs))
+	, m_timer(*m_ioctxs[0])
+	, m_signals(*m_ioctxs[0], SIGINT, SIGTERM)
+	, m_recv_count(0)
+	, m_last_recv_count(0)
+	, m_last_cpu_sec(0)
+{
+}
+
+int
+chat_server_bench_app::run(
+	uint16_t port)
+{
+	chat_errcode err = m_server.start(port);
+	if (err != CHAT_ERR_NONE) {
+		std::cout << "Start error: chat " << err << '\n';
+		return -1;
+	}
+	std::cout << "Bench server on port " << m_server.port() << " with "
+		<< m_ioctxs.size() << " threads" << std::endl;
+	m_signals.async_wait(boost::asio::bind_executor(m_strand,
+		std::bind(&chat_server_bench_app::priv_stop, this)));
+	m_last_cpu_sec = chat_bench_cpu_sec();
+	m_last_tick = std::chrono::steady_clock::now();
+	boost::asio::post(m_strand, std::bind(&chat_server_bench_app::priv_recv_next, this));
+	boost::asio::post(m_strand, std::bind(&chat_server_bench_app::priv_tick_next, this));
+
+	using work_guard = boost::asio::executor_work_guard<
+		boost::asio::io_context::executor_type>;
+	std::vector<work_guard> works;
+	std::vector<std::thread> threads;
+	for (std::unique_ptr<boost::asio::io_context>& ioCtx : m_ioctxs)
+		works.emplace_back(ioCtx->get_executor());
+	for (size_t i = 1; i < m_ioctxs.size(); ++i)
+		threads.emplace_back([ioCtx = m_ioctxs[i].get()]() { ioCtx->run(); });
+	m_ioctxs[0]->run();
+	for (size_t i = 1; i < m_ioctxs.size(); ++i)
+		m_ioctxs[i]->stop();
+	for (std::thread& t : threads)
+		t.join();
+	return 0;
+}
+
+void
+chat_server_bench_app::priv_recv_next()
+{
+	assert(m_strand.running_in_this_thread());
+	// The callback is type-erased and loses the bound executor. So it is dispatched
+	// to the strand explicitly.
+	m_server.recv_async([this](chat_errcode err, std::unique_ptr<chat_message> msg) {
+		boost::asio::dispatch(m_strand, [this, err, msg = std::move(msg)]() mutable {
+			priv_on_recv(err, std::move(msg));
+		});
+	});
+}
+
+void
+chat_server_bench_app::priv_on_recv(
+	chat_errcode err,
+	std::unique_ptr<chat_message> /* msg */)
+{
+	assert(m_strand.running_in_this_thread());
+	if (err != CHAT_ERR_NONE)
+		return;
+	++m_recv_count;
+	priv_recv_next();
+}
+
+void
+chat_server_bench_app::priv_tick_next()
+{
+	assert(m_strand.running_in_this_thread());
+	m_timer.expires_after(std::chrono::seconds(1));
+	m_timer.async_wait(boost::asio::bind_executor(m_strand,
+		std::bind(&chat_server_bench_app::priv_on_tick, this, std::placeholders::_1)));
+}
+
+void
+chat_server_bench_app::priv_on_tick(
+	const boost::system::error_code& err)
+{
+	assert(m_strand.running_in_this_thread());
+	if (err)
+		return;
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	double sec = std::chrono::duration<double>(now - m_last_tick).count();
+	double cpu_sec = chat_bench_cpu_sec();
+	chat_server_stats stats = m_server.stats();
+	char line[192];
+	snprintf(line, sizeof(line), "in: %.0f msg/sec, total: %llu, cpu: %.0f%%, "
+		"accept: %.0f/sec in %.0f wakeups/sec",
+		(m_recv_count - m_last_recv_count) / sec, (unsigned long long)m_recv_count,
+		(cpu_sec - m_last_cpu_sec) / sec * 100,
+		(stats.m_accept_count - m_last_stats.m_accept_count) / sec,
+		(stats.m_accept_wakeup_count - m_last_stats.m_accept_wakeup_count) / sec);
+	std::cout << line << std::endl;
+	m_last_tick = now;
+	m_last_recv_count = m_recv_count;
+	m_last_cpu_sec = cpu_sec;
+	m_last_stats = stats;
+	priv_tick_next();
+}
+
+void
+chat_server_bench_app::priv_stop()
+{
+	assert(m_strand.running_in_this_thread());
+	m_timer.cancel();
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	m_server.drain_async(std::chrono::seconds(1), [this, start](chat_errcode err) {
+		double ms = std::chrono::duration<double, std::milli>(
+			std::chrono::steady_clock::now() - start).count();
+		std::cout << "Drained in " << ms << " ms, chat " << err << std::endl;
+		m_ioctxs[0]->stop();
+	});
+}
+
+static int
+chat_server_bench_main(
+	int argc,
+	char **argv)
+{
+	int thread_count = 1;
+	const struct option long_opts[] = {
+		{"threads", required_argument, NULL, 't'},
+		{NULL, 0, NULL, 0},
+	};
+	int opt;
+	while ((opt = getopt_long(argc, argv, "", long_opts, NULL)) != -1) {
+		if (opt != 't')
+			thread_count = 0;
+		else
+			thread_count = atoi(optarg);
+	}
+	uint16_t port = 0;
+	if (thread_count <= 0 || optind + 1 != argc ||
+		port_from_str(argv[optind], &port) != 0) {
+		std::cout << "Usage: server --bench [--threads=N] PORT\n";
+		return -1;
+	}
+	chat_server_bench_app app(thread_count);
+	return app.run(port);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
 int
 main(int argc, char **argv)
 {
+	if (argc >= 2 && strcmp(argv[1], "--bench") == 0)
+		return chat_server_bench_main(argc - 1, argv + 1);
 	if (argc < 2) {
 		std::cout << "Expected a port to listen on\n";
 		return -1;
@@ -3,6 +3,8 @@
 #include "chat_server.h"
 #include "unitpp.h"
 
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
 #include <boost/asio/executor_work_guard.hpp>
 #include <boost/asio/io_context.hpp>
 #include <thread>
@@ -12,6 +14,38 @@ enum
 	TEST_MSG_ID_LEN = 64,
 };
 
+// Heap allocations made by the io threads. The ones of the test threads are not
+// counted, they are the test's own business.
+static std::atomic_uint64_t test_io_alloc_count(0);
+static thread_local bool test_is_io_thread = false;
+
+void *
+operator new(
+	size_t size)
+{
+	if (test_is_io_thread)
+		test_io_alloc_count.fetch_add(1, std::memory_order_relaxed);
+	void *res = malloc(size);
+	if (res == nullptr)
+		throw std::bad_alloc();
+	return res;
+}
+
+void
+operator delete(
+	void *ptr) noexcept
+{
+	free(ptr);
+}
+
+void
+operator delete(
+	void *ptr,
+	size_t /* size */) noexcept
+{
+	free(ptr);
+}
+
 class io_core final
 {
 public:
@@ -45,6 +79,7 @@ private:
 	void
 	priv_worker_f()
 	{
+		test_is_io_thread = true;
 		boost::asio::executor_work_guard<boost::asio::io_context::executor_type> work(
 			m_backend.get_executor());
 		m_backend.run();
@@ -67,7 +102,7 @@ struct test_msg final
 		memset(m_data.data(), '0', TEST_MSG_ID_LEN);
 		for (size_t i = TEST_MSG_ID_LEN; i < len; ++i)
 			m_data[i] = 'a' + i % ('z' - 'a' + 1);
-		m_data[len] = '\n';
+		m_data[len - 1] = '\n';
 	}
 
 	void
@@ -373,7 +408,7 @@ test_multi_client(void)
 
 	unit_msg("Connect clients");
 	std::vector<std::unique_ptr<chat_client>> clis;
-	clis.resize(client_count);
+	clis.reserve(client_count);
 	for (uint32_t i = 0; i < client_count; ++i) {
 		clis.emplace_back(std::make_unique<chat_client>(
 			core.backend(), "cli_" + std::to_string(i)));
@@ -438,6 +473,139 @@ test_multi_client(void)
 	}
 }
 
+static void
+test_pool()
+{
+	unit_test_start();
+
+	// Each server context has its own thread, like in a real pool.
+	const uint32_t pool_size = 3;
+	std::vector<std::unique_ptr<io_core>> pool;
+	std::vector<boost::asio::io_context*> ctxs;
+	for (uint32_t i = 0; i < pool_size; ++i) {
+		pool.emplace_back(std::make_unique<io_core>());
+		pool.back()->start(1);
+		ctxs.push_back(&pool.back()->backend());
+	}
+	io_core core;
+	core.start(2);
+
+	chat_server server(ctxs);
+	unit_assert(server.start(0) == CHAT_ERR_NONE);
+	std::string endpoint = make_addr_str(server.port());
+	//
+	// Not a multiple of the pool size, so the contexts get different peer counts.
+	//
+	uint32_t client_count = 7;
+	unit_msg("Connect clients");
+	std::vector<std::unique_ptr<chat_client>> clis;
+	clis.reserve(client_count);
+	for (uint32_t i = 0; i < client_count; ++i) {
+		clis.emplace_back(std::make_unique<chat_client>(
+			core.backend(), "cli_" + std::to_string(i)));
+		unit_assert(client_connect_blocking(*clis.back(), endpoint) == CHAT_ERR_NONE);
+		// When the server got a message, the client is surely served by its context.
+		// The ones before it see the message too.
+		clis.back()->feed_async("join\n");
+		std::unique_ptr<chat_message> rsp = server_recv_blocking(server);
+		unit_assert(rsp->m_author == "cli_" + std::to_string(i));
+		for (uint32_t j = 0; j < i; ++j) {
+			rsp = client_recv_blocking(*clis[j]);
+			unit_assert(rsp->m_data == "join");
+			unit_assert(rsp->m_author == "cli_" + std::to_string(i));
+		}
+	}
+
+	unit_msg("Send messages across the contexts");
+	uint32_t msg_count = 50;
+	for (uint32_t mi = 0; mi < msg_count; ++mi) {
+		for (uint32_t ci = 0; ci < client_count; ++ci)
+			clis[ci]->feed_async("msg " + std::to_string(mi) + "\n");
+	}
+	std::vector<uint32_t> msg_counts;
+	msg_counts.resize(client_count, 0);
+	for (uint32_t i = 0, end = msg_count * client_count; i < end; ++i) {
+		std::unique_ptr<chat_message> rsp = server_recv_blocking(server);
+		uint32_t cli_id = std::stoul(rsp->m_author.substr(4));
+		unit_assert(cli_id < client_count);
+		unit_assert(rsp->m_data == "msg " + std::to_string(msg_counts[cli_id]));
+		++msg_counts[cli_id];
+	}
+	bool ok = true;
+	for (uint32_t ci = 0; ci < client_count; ++ci) {
+		msg_counts.clear();
+		msg_counts.resize(client_count, 0);
+		for (uint32_t i = 0, end = msg_count * (client_count - 1); i < end; ++i) {
+			std::unique_ptr<chat_message> rsp = client_recv_blocking(*clis[ci]);
+			uint32_t cli_id = std::stoul(rsp->m_author.substr(4));
+			ok = ok && cli_id < client_count && cli_id != ci && rsp->m_data ==
+				"msg " + std::to_string(msg_counts[cli_id]);
+			++msg_counts[cli_id % client_count];
+		}
+	}
+	unit_check(ok, "each client got all the others' messages in order");
+
+	unit_msg("Feed from the server");
+	server.feed_async("  bye  \n");
+	ok = true;
+	for (uint32_t ci = 0; ci < client_count; ++ci) {
+		std::unique_ptr<chat_message> rsp = client_recv_blocking(*clis[ci]);
+		ok = ok && rsp->m_author == "server" && rsp->m_data == "bye";
+	}
+	unit_check(ok, "each client got the feed");
+}
+
+static void
+test_alloc_round(
+	chat_client& cli,
+	chat_server& server,
+	uint32_t feed_count,
+	uint64_t* alloc_count)
+{
+	uint64_t start = test_io_alloc_count.load(std::memory_order_relaxed);
+	// Empty lines go through all the reading and sending, but never become messages.
+	for (uint32_t i = 0; i < feed_count; ++i)
+		cli.feed_async(" \n");
+	cli.feed_async("done\n");
+	std::unique_ptr<chat_message> msg = server_recv_blocking(server);
+	unit_assert(msg->m_data == "done");
+	*alloc_count = test_io_alloc_count.load(std::memory_order_relaxed) - start;
+}
+
+static void
+test_alloc()
+{
+	unit_test_start();
+
+	io_core server_core;
+	server_core.start(1);
+	io_core client_core;
+	client_core.start(1);
+
+	chat_server server(server_core.backend());
+	unit_assert(server.start(0) == CHAT_ERR_NONE);
+	chat_client cli(client_core.backend(), "c1");
+	unit_assert(client_connect_blocking(
+		cli, make_addr_str(server.port())) == CHAT_ERR_NONE);
+
+	uint32_t feed_count = 10000;
+	uint64_t count = 0;
+	// The buffers grow to the burst size first. Both of the two output buffers of the
+	// client, so two rounds.
+	test_alloc_round(cli, server, feed_count, &count);
+	test_alloc_round(cli, server, feed_count, &count);
+	unit_msg("warm up: " << count << " allocations");
+	uint64_t base = 0;
+	test_alloc_round(cli, server, 0, &base);
+	unit_msg("one message: " << base << " allocations");
+	test_alloc_round(cli, server, feed_count, &count);
+	unit_msg(feed_count << " empty feeds and the message: " << count << " allocations");
+	// The message itself may take one more when the request waits in the queue. And a
+	// burst bigger than all the warm up ones may double a buffer once or twice. But
+	// nothing per feed - that would be thousands.
+	unit_check(count <= base + 8, "no allocations in the recv and send loops");
+}
+
 struct test_stress_ctx final
 {
 	uint32_t msg_count;
@@ -561,7 +729,7 @@ test_big_author()
 
 	cli1.feed_async(body);
 	std::unique_ptr<chat_message> rsp = server_recv_blocking(server);
-	body[body_len] = 0;
+	body.resize(body_len);
 	unit_check(rsp->m_data == body, "msg data");
 	unit_check(rsp->m_author == author1, "msg author");
 
@@ -570,6 +738,338 @@ test_big_author()
 	unit_check(rsp->m_author == author1, "msg author");
 }
 
+static boost::asio::awaitable<void>
+test_coro_echo_f(
+	chat_server& server,
+	chat_client& cli,
+	std::vector<std::string>& res,
+	event& ev)
+{
+	// Two messages from the client to the server. Then they are fed back to everybody,
+	// and come to the other client after their originals.
+	std::string echo;
+	for (int i = 0; i < 2; ++i) {
+		std::unique_ptr<chat_message> msg;
+		chat_errcode err = co_await server.recv(msg);
+		if (err != CHAT_ERR_NONE)
+			break;
+		res.push_back(msg->m_author + ": " + msg->m_data);
+		echo += "echo " + msg->m_data + "\n";
+	}
+	server.feed_async(echo);
+	for (int i = 0; i < 4; ++i) {
+		std::unique_ptr<chat_message> msg;
+		chat_errcode err = co_await cli.recv(msg);
+		if (err != CHAT_ERR_NONE)
+			break;
+		res.push_back(msg->m_author + ": " + msg->m_data);
+	}
+	ev.send();
+}
+
+static boost::asio::awaitable<void>
+test_coro_recv_f(
+	chat_client& cli,
+	chat_errcode& res,
+	event& ev)
+{
+	std::unique_ptr<chat_message> msg;
+	res = co_await cli.recv(msg);
+	ev.send();
+}
+
+static void
+test_coro()
+{
+	unit_test_start();
+
+	io_core core;
+	core.start(2);
+
+	std::unique_ptr<chat_server> server =
+		std::make_unique<chat_server>(core.backend());
+	unit_assert(server->start(0) == CHAT_ERR_NONE);
+	std::string endpoint = make_addr_str(server->port());
+
+	chat_client cli1(core.backend(), "c1");
+	unit_assert(client_connect_blocking(cli1, endpoint) == CHAT_ERR_NONE);
+	chat_client cli2(core.backend(), "c2");
+	unit_assert(client_connect_blocking(cli2, endpoint) == CHAT_ERR_NONE);
+	//
+	// The messages are awaited by a coroutine with no threads blocked.
+	//
+	{
+		std::vector<std::string> res;
+		event ev;
+		boost::asio::co_spawn(core.backend(),
+			test_coro_echo_f(*server, cli2, res, ev), boost::asio::detached);
+		cli1.feed_async("hello\n");
+		unit_msg("the first one is sent");
+		cli1.feed_async("world\n");
+		ev.recv();
+		std::vector<std::string> expected = {
+			"c1: hello", "c1: world",
+			"c1: hello", "c1: world", "server: echo hello", "server: echo world",
+		};
+		unit_check(res == expected, "received in order");
+	}
+	//
+	// The waiting coroutine is woken up when the connection is lost. A new client,
+	// so it has no old messages to get instead.
+	//
+	{
+		chat_client cli3(core.backend(), "c3");
+		unit_assert(client_connect_blocking(cli3, endpoint) == CHAT_ERR_NONE);
+		chat_errcode res = CHAT_ERR_NONE;
+		event ev;
+		boost::asio::co_spawn(core.backend(),
+			test_coro_recv_f(cli3, res, ev), boost::asio::detached);
+		server.reset();
+		ev.recv();
+		unit_check(res == CHAT_ERR_SYS, "woken up by the close");
+	}
+}
+
+static void
+test_batch()
+{
+	unit_test_start();
+
+	io_core core;
+	core.start(2);
+
+	chat_server server(core.backend());
+	unit_assert(server.start(0) == CHAT_ERR_NONE);
+	std::string endpoint = make_addr_str(server.port());
+
+	// More messages than the queue fits, so the producer has to keep some of them
+	// until the consumer makes room.
+	const uint32_t cli_count = 3;
+	const uint32_t msg_count = CHAT_MSG_QUEUE_SIZE;
+	std::vector<std::unique_ptr<chat_client>> clis;
+	for (uint32_t i = 0; i < cli_count; ++i) {
+		clis.emplace_back(std::make_unique<chat_client>(core.backend(),
+			"c" + std::to_string(i)));
+		unit_assert(client_connect_blocking(*clis.back(), endpoint) == CHAT_ERR_NONE);
+	}
+	//
+	// Messages sent before the first recv_batch() are not lost.
+	//
+	clis[0]->feed_async("first\n");
+	std::unique_ptr<chat_message> msg = server_recv_blocking(server);
+	unit_check(msg->m_data == "first", "got a message via the callback");
+	clis[0]->feed_async("second\n");
+	std::vector<std::unique_ptr<chat_message>> msgs;
+	unit_check(server.recv_batch(msgs) == 1, "got 1 message in a batch");
+	unit_check(msgs[0]->m_data == "second", "data");
+	msgs.clear();
+	//
+	// All the messages in order of each client.
+	//
+	for (uint32_t i = 0; i < cli_count; ++i) {
+		std::string text;
+		for (uint32_t j = 0; j < msg_count; ++j)
+			text += std::to_string(j) + '\n';
+		clis[i]->feed_async(text);
+	}
+	std::vector<uint32_t> next(cli_count, 0);
+	uint32_t total = 0;
+	uint32_t batch_count = 0;
+	bool ok = true;
+	while (total < cli_count * msg_count) {
+		total += server.recv_batch(msgs);
+		++batch_count;
+		for (std::unique_ptr<chat_message>& m : msgs) {
+			uint32_t cli_id = std::stoul(m->m_author.substr(1));
+			unit_assert(cli_id < cli_count);
+			ok = ok and m->m_data == std::to_string(next[cli_id]++);
+		}
+		msgs.clear();
+	}
+	unit_msg(total << " messages in " << batch_count << " batches");
+	unit_check(ok, "the order of each client is kept");
+	unit_check(total == cli_count * msg_count, "got all");
+}
+
+static chat_errcode
+server_drain_blocking(
+	chat_server& server,
+	std::chrono::milliseconds timeout)
+{
+	event ev;
+	chat_errcode err;
+	server.drain_async(timeout, [&](chat_errcode err_res) {
+		err = err_res;
+		ev.send();
+	});
+	ev.recv();
+	return err;
+}
+
+static void
+test_drain()
+{
+	unit_test_start();
+
+	io_core core;
+	core.start(2);
+	{
+		chat_server server(core.backend());
+		unit_check(server_drain_blocking(server, std::chrono::seconds(1)) ==
+			CHAT_ERR_NOT_STARTED, "drain before start");
+	}
+	//
+	// Everything queued before the drain is delivered. Then the peers are closed.
+	//
+	{
+		chat_server server(core.backend());
+		unit_assert(server.start(0) == CHAT_ERR_NONE);
+		std::string endpoint = make_addr_str(server.port());
+		chat_client cli1(core.backend(), "c1");
+		unit_assert(client_connect_blocking(cli1, endpoint) == CHAT_ERR_NONE);
+		chat_client cli2(core.backend(), "c2");
+		unit_assert(client_connect_blocking(cli2, endpoint) == CHAT_ERR_NONE);
+
+		const uint32_t msg_count = 1000;
+		std::string text;
+		for (uint32_t i = 0; i < msg_count; ++i)
+			text += std::to_string(i) + '\n';
+		cli1.feed_async(text);
+		for (uint32_t i = 0; i < msg_count; ++i)
+			unit_assert(server_recv_blocking(server)->m_data == std::to_string(i));
+		unit_msg("drain with the messages in the output");
+		event ev;
+		chat_errcode drain_err;
+		server.drain_async(std::chrono::seconds(10), [&](chat_errcode err) {
+			drain_err = err;
+			ev.send();
+		});
+		bool ok = true;
+		for (uint32_t i = 0; i < msg_count; ++i)
+			ok = ok and client_recv_blocking(cli2)->m_data == std::to_string(i);
+		unit_check(ok, "all the messages are delivered");
+		ev.recv();
+		unit_check(drain_err == CHAT_ERR_NONE, "drained");
+
+		event ev_recv;
+		chat_errcode recv_err = CHAT_ERR_NONE;
+		cli2.recv_async([&](chat_errcode err, std::unique_ptr<chat_message>) {
+			recv_err = err;
+			ev_recv.send();
+		});
+		ev_recv.recv();
+		unit_check(recv_err == CHAT_ERR_SYS, "the peer is closed");
+		chat_client cli3(core.backend(), "c3");
+		unit_check(client_connect_blocking(cli3, endpoint) != CHAT_ERR_NONE,
+			"no new clients");
+	}
+	//
+	// A client which does not read is closed at the timeout.
+	//
+	{
+		chat_server server(core.backend());
+		unit_assert(server.start(0) == CHAT_ERR_NONE);
+		std::string endpoint = make_addr_str(server.port());
+		chat_client cli1(core.backend(), "c1");
+		unit_assert(client_connect_blocking(cli1, endpoint) == CHAT_ERR_NONE);
+		chat_client cli2(core.backend(), "c2");
+		unit_assert(client_connect_blocking(cli2, endpoint) == CHAT_ERR_NONE);
+
+		// Much more than the socket buffers take.
+		const uint32_t msg_count = 32;
+		std::string text(1024 * 1024, 'a');
+		text.back() = '\n';
+		for (uint32_t i = 0; i < msg_count; ++i)
+			cli1.feed_async(text);
+		for (uint32_t i = 0; i < msg_count; ++i)
+			server_recv_blocking(server);
+		unit_check(server_drain_blocking(server, std::chrono::milliseconds(100)) ==
+			CHAT_ERR_TIMEOUT, "timed out");
+	}
+}
+
+static void
+test_accept()
+{
+	unit_test_start();
+
+	io_core core;
+	core.start(2);
+
+	chat_server_options opts;
+	opts.m_accept_batch_size = 4;
+	opts.m_send_buf_size = 64 * 1024;
+	chat_server server({&core.backend()}, opts);
+	unit_assert(server.start(0) == CHAT_ERR_NONE);
+	std::string endpoint = make_addr_str(server.port());
+	//
+	// Many clients at once are taken a batch per wakeup.
+	//
+	const uint32_t cli_count = 30;
+	std::vector<std::unique_ptr<chat_client>> clis;
+	std::atomic_uint32_t connect_count(0);
+	std::atomic_uint32_t connect_err_count(0);
+	event ev;
+	for (uint32_t i = 0; i < cli_count; ++i) {
+		clis.emplace_back(std::make_unique<chat_client>(core.backend(),
+			"c" + std::to_string(i)));
+	}
+	for (std::unique_ptr<chat_client>& c : clis) {
+		c->connect_async(endpoint, [&](chat_errcode err) {
+			if (err != CHAT_ERR_NONE)
+				connect_err_count.fetch_add(1);
+			if (connect_count.fetch_add(1) + 1 == cli_count)
+				ev.send();
+		});
+	}
+	ev.recv();
+	unit_check(connect_err_count.load() == 0, "all connected");
+	// Connected on the client side does not mean accepted yet. A message from each
+	// proves it.
+	for (std::unique_ptr<chat_client>& c : clis)
+		c->feed_async("hello\n");
+	for (uint32_t i = 0; i < cli_count; ++i)
+		unit_assert(server_recv_blocking(server)->m_data == "hello");
+	chat_server_stats stats = server.stats();
+	unit_msg(stats.m_accept_count << " accepted in " << stats.m_accept_wakeup_count <<
+		" wakeups");
+	unit_check(stats.m_accept_count == cli_count, "accept count");
+	unit_check(stats.m_accept_wakeup_count >= cli_count / opts.m_accept_batch_size,
+		"batch size limit");
+}
+
+static void
+test_ring()
+{
+	unit_test_start();
+
+	chat_ring<std::unique_ptr<int>> ring;
+	unit_check(ring.empty(), "new is empty");
+	// Wrap around the first capacity a few times, then grow in the middle of a wrap.
+	int next_push = 0;
+	int next_pop = 0;
+	bool ok = true;
+	for (int round = 0; round < 100; ++round) {
+		for (int i = 0; i < 10; ++i)
+			ring.push_back(std::make_unique<int>(next_push++));
+		for (int i = 0; i < 9; ++i)
+			ok = ok and *ring.pop_front() == next_pop++;
+	}
+	unit_check(ok, "order on wrap and growth");
+	unit_check(ring.size() == 100, "size");
+	ok = true;
+	for (size_t i = 0; i < ring.size(); ++i)
+		ok = ok and *ring[i] == next_pop + (int)i;
+	unit_check(ok, "indexing");
+	ring.pop_front(50);
+	unit_check(*ring.front() == next_pop + 50, "pop many");
+	chat_ring<std::unique_ptr<int>> other;
+	other.swap(ring);
+	unit_check(ring.empty() and other.size() == 50, "swap");
+	other.clear();
+	unit_check(other.empty(), "clear");
+}
+
 int
 main(void)
 {
@@ -580,7 +1080,14 @@ main(void)
 	test_big_messages();
 	test_multi_feed();
 	test_multi_client();
+	test_pool();
+	test_alloc();
 	test_stress();
 	test_big_author();
+	test_coro();
+	test_batch();
+	test_drain();
+	test_accept();
+	test_ring();
 	return 0;
 }
@@ -0,0 +1,942 @@
+#define _GNU_SOURCE
+#include "../utils/unit_bench.h"
+#include "../utils/uring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/utsname.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * All the bonus benchmarks of task_eng.txt in one binary, on the
+ * unit_bench harness. Each scenario is swept over its parameters, the
+ * argument in the report is the thread count or the pack size. The
+ * report starts with the host info, so the reports of different
+ * hosts and kernels can be compared side by side.
+ *
+ * The iteration counts are smaller than in the task, so the whole
+ * suite takes tens of seconds. --scale N multiplies them. The other
+ * options are the ones of unit_bench.h.
+ *
+ * The time is always ns per iteration. An iteration is:
+ * clock_* - one clock_gettime();
+ * socket_* - one pack sent and received, MB/s = pack / ns * 1000;
+ * mutex - one lock/unlock by any of the threads;
+ * thread_create_join - one pthread_create() + pthread_join();
+ * atomic_store_* - one increment + store by any of the threads;
+ * cond_* - one signal or broadcast;
+ * false_sharing_* - one increment by each of the threads.
+ */
+
+enum {
+	BENCH_MAX_THREADS = 8,
+	/** Numbers per cache line, for the distant false sharing. */
+	BENCH_LINE_STRIDE = 8,
+};
+
+static long bench_scale = 1;
+
+static volatile uint64_t bench_sink;
+
+/** Threads created untimed, started all at once. */
+struct bench_threads {
+	pthread_t tids[BENCH_MAX_THREADS];
+	int count;
+	bool is_started;
+};
+
+static void
+bench_threads_start(struct bench_threads *t, int count,
+		    void *(*f)(void *), void *args, size_t arg_size)
+{
+	t->count = count;
+	t->is_started = false;
+	for (int i = 0; i < count; ++i) {
+		pthread_create(&t->tids[i], NULL, f,
+			       (char *)args + arg_size * i);
+	}
+	bench_resume();
+	__atomic_store_n(&t->is_started, true, __ATOMIC_RELEASE);
+}
+
+static void
+bench_threads_wait_start(struct bench_threads *t)
+{
+	while (!__atomic_load_n(&t->is_started, __ATOMIC_ACQUIRE))
+		sched_yield();
+}
+
+static void
+bench_threads_join(struct bench_threads *t)
+{
+	for (int i = 0; i < t->count; ++i)
+		pthread_join(t->tids[i], NULL);
+	bench_pause();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/** (1) clock_gettime() with the clock id as the argument. */
+static void
+bench_clock(long iterations, long clock_id)
+{
+	struct timespec ts;
+	uint64_t sum = 0;
+	for (long i = 0; i < iterations; ++i) {
+		clock_gettime(clock_id, &ts);
+		sum += ts.tv_nsec;
+	}
+	bench_sink = sum;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * (2) Socket throughput. The server side is a thread. The sender
+ * modes:
+ * plain - send() of each pack;
+ * mmsg - sendmmsg() of BENCH_MMSG_BATCH packs, recvmmsg() to read;
+ * zerocopy - send() with MSG_ZEROCOPY from a pool of buffers, a
+ *     buffer is reused when the error queue tells it is released.
+ *     TCP only. Over loopback the kernel copies anyway, this is
+ *     reported in the info as tcp_zerocopy;
+ * splice - vmsplice() of the pack into a pipe and splice() of the
+ *     pipe into the socket;
+ * uring - io_uring sends and receives, BENCH_URING_DEPTH in flight.
+ *     The sockets are blocking here, otherwise io_uring returns
+ *     EAGAIN instead of waiting.
+ */
+
+enum {
+	BENCH_MMSG_BATCH = 16,
+	BENCH_ZEROCOPY_BUFS = 64,
+	BENCH_URING_DEPTH = 8,
+};
+
+enum bench_socket_mode {
+	BENCH_SOCKET_PLAIN,
+	BENCH_SOCKET_MMSG,
+	BENCH_SOCKET_ZEROCOPY,
+	BENCH_SOCKET_SPLICE,
+	BENCH_SOCKET_URING,
+};
+
+struct bench_socket_ctx {
+	enum bench_socket_mode mode;
+	int fd;
+	long pack_size;
+	long total_size;
+};
+
+static void
+bench_socket_wait(int fd, short events)
+{
+	struct pollfd pfd = {.fd = fd, .events = events};
+	poll(&pfd, 1, -1);
+}
+
+/** For the errors of the non-blocking calls. */
+static void
+bench_socket_check(int fd, short events)
+{
+	if (errno == EAGAIN || errno == EWOULDBLOCK)
+		bench_socket_wait(fd, events);
+	else if (errno != EINTR)
+		abort();
+}
+
+static void
+bench_socket_recv_plain(struct bench_socket_ctx *ctx, char *buf)
+{
+	long left = ctx->total_size;
+	while (left > 0) {
+		ssize_t rc = recv(ctx->fd, buf, ctx->pack_size, 0);
+		if (rc > 0)
+			left -= rc;
+		else if (rc == 0)
+			break;
+		else
+			bench_socket_check(ctx->fd, POLLIN);
+	}
+}
+
+static void
+bench_socket_recv_mmsg(struct bench_socket_ctx *ctx, char *buf)
+{
+	struct mmsghdr msgs[BENCH_MMSG_BATCH];
+	struct iovec iovs[BENCH_MMSG_BATCH];
+	memset(msgs, 0, sizeof(msgs));
+	for (int i = 0; i < BENCH_MMSG_BATCH; ++i) {
+		/* The content is not checked, one buffer is enough. */
+		iovs[i].iov_base = buf;
+		iovs[i].iov_len = ctx->pack_size;
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	long left = ctx->total_size;
+	while (left > 0) {
+		int rc = recvmmsg(ctx->fd, msgs, BENCH_MMSG_BATCH, 0, NULL);
+		if (rc < 0) {
+			bench_socket_check(ctx->fd, POLLIN);
+			continue;
+		}
+		for (int i = 0; i < rc; ++i)
+			left -= msgs[i].msg_len;
+		if (rc == 0 || msgs[0].msg_len == 0)
+			break;
+	}
+}
+
+static void
+bench_socket_recv_uring(struct bench_socket_ctx *ctx, char *buf)
+{
+	struct uring r;
+	if (uring_create(&r, BENCH_URING_DEPTH) != 0)
+		abort();
+	long left = ctx->total_size;
+	int in_flight = 0;
+	while (left > 0) {
+		for (; in_flight < BENCH_URING_DEPTH; ++in_flight) {
+			struct io_uring_sqe *sqe = uring_get_sqe(&r);
+			uring_prep_rw(sqe, IORING_OP_RECV, ctx->fd, buf,
+				      ctx->pack_size, 0);
+		}
+		if (uring_submit_and_wait(&r, 1) < 0)
+			abort();
+		struct io_uring_cqe *cqe;
+		while ((cqe = uring_peek_cqe(&r)) != NULL) {
+			if (cqe->res > 0)
+				left -= cqe->res;
+			else if (cqe->res == 0)
+				left = 0;
+			else if (cqe->res != -EINTR && cqe->res != -EAGAIN)
+				abort();
+			--in_flight;
+			uring_cqe_seen(&r);
+		}
+	}
+	/* The rest are completed by the shutdown of the sender. */
+	uring_destroy(&r);
+}
+
+static void *
+bench_socket_recv_f(void *arg)
+{
+	struct bench_socket_ctx *ctx = arg;
+	char *buf = malloc(ctx->pack_size);
+	switch (ctx->mode) {
+	case BENCH_SOCKET_MMSG:
+		bench_socket_recv_mmsg(ctx, buf);
+		break;
+	case BENCH_SOCKET_URING:
+		bench_socket_recv_uring(ctx, buf);
+		break;
+	default:
+		bench_socket_recv_plain(ctx, buf);
+		break;
+	}
+	free(buf);
+	return NULL;
+}
+
+static void
+bench_socket_send_all(int fd, const char *buf, long size)
+{
+	while (size > 0) {
+		ssize_t rc = send(fd, buf, size, MSG_NOSIGNAL);
+		if (rc > 0) {
+			buf += rc;
+			size -= rc;
+		} else {
+			bench_socket_check(fd, POLLOUT);
+		}
+	}
+}
+
+static void
+bench_socket_send_plain(int fd, long iterations, long pack_size)
+{
+	char *buf = malloc(pack_size);
+	memset(buf, 'x', pack_size);
+	for (long i = 0; i < iterations; ++i)
+		bench_socket_send_all(fd, buf, pack_size);
+	free(buf);
+}
+
+static void
+bench_socket_send_mmsg(int fd, long iterations, long pack_size)
+{
+	char *buf = malloc(pack_size);
+	memset(buf, 'x', pack_size);
+	struct mmsghdr msgs[BENCH_MMSG_BATCH];
+	struct iovec iovs[BENCH_MMSG_BATCH];
+	memset(msgs, 0, sizeof(msgs));
+	for (int i = 0; i < BENCH_MMSG_BATCH; ++i) {
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	/*
+	 * A stream socket can take a message partially. The bytes are
+	 * all the same, so the rest is just sent as a shorter message.
+	 */
+	long left = iterations * pack_size;
+	while (left > 0) {
+		int count = 0;
+		for (long rest = left; count < BENCH_MMSG_BATCH && rest > 0;
+		     ++count) {
+			long size = rest < pack_size ? rest : pack_size;
+			iovs[count].iov_base = buf;
+			iovs[count].iov_len = size;
+			rest -= size;
+		}
+		int rc = sendmmsg(fd, msgs, count, MSG_NOSIGNAL);
+		if (rc < 0) {
+			bench_socket_check(fd, POLLOUT);
+			continue;
+		}
+		for (int i = 0; i < rc; ++i)
+			left -= msgs[i].msg_len;
+	}
+	free(buf);
+}
+
+/**
+ * Read the zerocopy notifications. Returns the number of the first
+ * send not known to be released yet.
+ */
+static uint32_t
+bench_zerocopy_reap(int fd, uint32_t done)
+{
+	while (true) {
+		char control[128];
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			return done;
+		for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL;
+		     cm = CMSG_NXTHDR(&msg, cm)) {
+			struct sock_extended_err *err =
+				(struct sock_extended_err *)CMSG_DATA(cm);
+			if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+			if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				bench_info("tcp_zerocopy", "copied");
+			/* [ee_info, ee_data] are released, in order. */
+			if (err->ee_data + 1 > done)
+				done = err->ee_data + 1;
+		}
+	}
+}
+
+static void
+bench_socket_send_zerocopy(int fd, long iterations, long pack_size)
+{
+	char *bufs = malloc(pack_size * BENCH_ZEROCOPY_BUFS);
+	memset(bufs, 'x', pack_size * BENCH_ZEROCOPY_BUFS);
+	/* Number of the last send of each buffer, plus 1. */
+	uint32_t buf_sends[BENCH_ZEROCOPY_BUFS];
+	memset(buf_sends, 0, sizeof(buf_sends));
+	uint32_t sends = 0;
+	uint32_t done = 0;
+	for (long i = 0; i < iterations; ++i) {
+		int idx = i % BENCH_ZEROCOPY_BUFS;
+		/* The kernel might still read the buffer. */
+		while ((int32_t)(buf_sends[idx] - done) > 0) {
+			done = bench_zerocopy_reap(fd, done);
+			if ((int32_t)(buf_sends[idx] - done) > 0)
+				bench_socket_wait(fd, 0);
+		}
+		const char *pos = bufs + idx * pack_size;
+		long left = pack_size;
+		while (left > 0) {
+			ssize_t rc = send(fd, pos, left,
+					  MSG_NOSIGNAL | MSG_ZEROCOPY);
+			if (rc > 0) {
+				buf_sends[idx] = ++sends;
+				pos += rc;
+				left -= rc;
+				continue;
+			}
+			if (errno == ENOBUFS) {
+				/* Too much pinned memory, wait for some. */
+				done = bench_zerocopy_reap(fd, done);
+				bench_socket_wait(fd, 0);
+				continue;
+			}
+			bench_socket_check(fd, POLLOUT);
+			done = bench_zerocopy_reap(fd, done);
+		}
+	}
+	while ((int32_t)(sends - done) > 0) {
+		done = bench_zerocopy_reap(fd, done);
+		if ((int32_t)(sends - done) > 0)
+			bench_socket_wait(fd, 0);
+	}
+	free(bufs);
+}
+
+static void
+bench_socket_send_splice(int fd, long iterations, long pack_size)
+{
+	char *buf = malloc(pack_size);
+	memset(buf, 'x', pack_size);
+	int pipe_fds[2];
+	if (pipe(pipe_fds) != 0)
+		abort();
+	if (pack_size > 64 * 1024)
+		fcntl(pipe_fds[1], F_SETPIPE_SZ, (int)pack_size);
+	for (long i = 0; i < iterations; ++i) {
+		/* The pipe is empty here, so the whole pack fits. */
+		struct iovec iov = {.iov_base = buf, .iov_len = pack_size};
+		long in_pipe = 0;
+		while (iov.iov_len > 0) {
+			ssize_t rc = vmsplice(pipe_fds[1], &iov, 1, 0);
+			if (rc < 0)
+				abort();
+			iov.iov_base = (char *)iov.iov_base + rc;
+			iov.iov_len -= rc;
+			in_pipe += rc;
+		}
+		while (in_pipe > 0) {
+			ssize_t rc = splice(pipe_fds[0], NULL, fd, NULL,
+					    in_pipe, SPLICE_F_MOVE |
+					    SPLICE_F_NONBLOCK);
+			if (rc > 0)
+				in_pipe -= rc;
+			else
+				bench_socket_check(fd, POLLOUT);
+		}
+	}
+	close(pipe_fds[0]);
+	close(pipe_fds[1]);
+	free(buf);
+}
+
+static void
+bench_socket_send_uring(int fd, long iterations, long pack_size)
+{
+	char *buf = malloc(pack_size);
+	memset(buf, 'x', pack_size);
+	struct uring r;
+	if (uring_create(&r, BENCH_URING_DEPTH) != 0)
+		abort();
+	/* Bytes not yet given to a send. */
+	long to_queue = iterations * pack_size;
+	long in_flight = 0;
+	while (to_queue > 0 || in_flight > 0) {
+		for (; to_queue > 0 && in_flight < BENCH_URING_DEPTH;
+		     ++in_flight) {
+			long size = to_queue < pack_size ? to_queue : pack_size;
+			struct io_uring_sqe *sqe = uring_get_sqe(&r);
+			uring_prep_rw(sqe, IORING_OP_SEND, fd, buf, size, 0);
+			sqe->msg_flags = MSG_NOSIGNAL;
+			sqe->user_data = size;
+			to_queue -= size;
+		}
+		if (uring_submit_and_wait(&r, 1) < 0)
+			abort();
+		struct io_uring_cqe *cqe;
+		while ((cqe = uring_peek_cqe(&r)) != NULL) {
+			long size = cqe->user_data;
+			if (cqe->res >= 0)
+				to_queue += size - cqe->res;
+			else if (cqe->res == -EINTR || cqe->res == -EAGAIN)
+				to_queue += size;
+			else
+				abort();
+			--in_flight;
+			uring_cqe_seen(&r);
+		}
+	}
+	uring_destroy(&r);
+	free(buf);
+}
+
+/**
+ * A listening socket, a connected client and an accepted server end.
+ * Non-blocking, as the task says, unless it is for io_uring.
+ */
+static void
+bench_socket_pair(int domain, bool is_blocking, int *client, int *server)
+{
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	memset(&addr, 0, sizeof(addr));
+	if (domain == AF_UNIX) {
+		struct sockaddr_un *un = (struct sockaddr_un *)&addr;
+		un->sun_family = AF_UNIX;
+		/* Abstract, so nothing is left in the file system. */
+		snprintf(un->sun_path + 1, sizeof(un->sun_path) - 1,
+			 "bench_all.%d", (int)getpid());
+		addr_len = sizeof(*un);
+	} else {
+		struct sockaddr_in *in = (struct sockaddr_in *)&addr;
+		in->sin_family = AF_INET;
+		in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		addr_len = sizeof(*in);
+	}
+	int listen_fd = socket(domain, SOCK_STREAM, 0);
+	if (listen_fd < 0 ||
+	    bind(listen_fd, (struct sockaddr *)&addr, addr_len) != 0 ||
+	    listen(listen_fd, 1) != 0)
+		abort();
+	/* The TCP port is chosen by the kernel. */
+	getsockname(listen_fd, (struct sockaddr *)&addr, &addr_len);
+	*client = socket(domain, SOCK_STREAM, 0);
+	if (*client < 0 ||
+	    connect(*client, (struct sockaddr *)&addr, addr_len) != 0)
+		abort();
+	*server = accept(listen_fd, NULL, NULL);
+	if (*server < 0)
+		abort();
+	close(listen_fd);
+	if (domain == AF_INET) {
+		int yes = 1;
+		setsockopt(*client, IPPROTO_TCP, TCP_NODELAY, &yes,
+			   sizeof(yes));
+	}
+	if (is_blocking)
+		return;
+	fcntl(*client, F_SETFL, fcntl(*client, F_GETFL) | O_NONBLOCK);
+	fcntl(*server, F_SETFL, fcntl(*server, F_GETFL) | O_NONBLOCK);
+}
+
+static void
+bench_socket(int domain, enum bench_socket_mode mode, long iterations,
+	     long pack_size)
+{
+	bench_pause();
+	int client, server;
+	bench_socket_pair(domain, mode == BENCH_SOCKET_URING, &client,
+			  &server);
+	if (mode == BENCH_SOCKET_ZEROCOPY) {
+		int yes = 1;
+		if (setsockopt(client, SOL_SOCKET, SO_ZEROCOPY, &yes,
+			       sizeof(yes)) != 0)
+			abort();
+	}
+	struct bench_socket_ctx ctx = {
+		.mode = mode,
+		.fd = server,
+		.pack_size = pack_size,
+		.total_size = iterations * pack_size,
+	};
+	struct bench_threads t;
+	bench_threads_start(&t, 1, bench_socket_recv_f, &ctx, sizeof(ctx));
+	switch (mode) {
+	case BENCH_SOCKET_PLAIN:
+		bench_socket_send_plain(client, iterations, pack_size);
+		break;
+	case BENCH_SOCKET_MMSG:
+		bench_socket_send_mmsg(client, iterations, pack_size);
+		break;
+	case BENCH_SOCKET_ZEROCOPY:
+		bench_socket_send_zerocopy(client, iterations, pack_size);
+		break;
+	case BENCH_SOCKET_SPLICE:
+		bench_socket_send_splice(client, iterations, pack_size);
+		break;
+	case BENCH_SOCKET_URING:
+		bench_socket_send_uring(client, iterations, pack_size);
+		break;
+	}
+	shutdown(client, SHUT_WR);
+	bench_threads_join(&t);
+	close(client);
+	close(server);
+	bench_resume();
+}
+
+#define BENCH_SOCKET_DEFINE(name, domain, mode)				\
+static void								\
+bench_socket_##name(long iterations, long pack_size)			\
+{									\
+	bench_socket(domain, mode, iterations, pack_size);		\
+}
+
+BENCH_SOCKET_DEFINE(unix, AF_UNIX, BENCH_SOCKET_PLAIN)
+BENCH_SOCKET_DEFINE(tcp, AF_INET, BENCH_SOCKET_PLAIN)
+BENCH_SOCKET_DEFINE(unix_mmsg, AF_UNIX, BENCH_SOCKET_MMSG)
+BENCH_SOCKET_DEFINE(tcp_mmsg, AF_INET, BENCH_SOCKET_MMSG)
+BENCH_SOCKET_DEFINE(tcp_zerocopy, AF_INET, BENCH_SOCKET_ZEROCOPY)
+BENCH_SOCKET_DEFINE(unix_splice, AF_UNIX, BENCH_SOCKET_SPLICE)
+BENCH_SOCKET_DEFINE(tcp_splice, AF_INET, BENCH_SOCKET_SPLICE)
+BENCH_SOCKET_DEFINE(unix_uring, AF_UNIX, BENCH_SOCKET_URING)
+BENCH_SOCKET_DEFINE(tcp_uring, AF_INET, BENCH_SOCKET_URING)
+
+/** Whether the kernel lets to create an io_uring at all. */
+static bool
+bench_has_uring(void)
+{
+	struct uring r;
+	if (uring_create(&r, 1) != 0)
+		return false;
+	uring_destroy(&r);
+	return true;
+}
+////////////////////////////////////////////////////////////////////////////////
+
+/** (3) pthread_mutex in N threads. */
+
+struct bench_mutex_ctx {
+	struct bench_threads threads;
+	pthread_mutex_t mutex;
+	long iterations;
+	uint64_t counter;
+};
+
+static void *
+bench_mutex_f(void *arg)
+{
+	struct bench_mutex_ctx *ctx = arg;
+	bench_threads_wait_start(&ctx->threads);
+	for (long i = 0; i < ctx->iterations; ++i) {
+		pthread_mutex_lock(&ctx->mutex);
+		++ctx->counter;
+		pthread_mutex_unlock(&ctx->mutex);
+	}
+	return NULL;
+}
+
+static void
+bench_mutex(long iterations, long thread_count)
+{
+	bench_pause();
+	struct bench_mutex_ctx ctx;
+	pthread_mutex_init(&ctx.mutex, NULL);
+	ctx.iterations = iterations / thread_count;
+	ctx.counter = 0;
+	bench_threads_start(&ctx.threads, thread_count, bench_mutex_f, &ctx,
+			    0);
+	bench_threads_join(&ctx.threads);
+	if (ctx.counter != (uint64_t)(ctx.iterations * thread_count))
+		abort();
+	pthread_mutex_destroy(&ctx.mutex);
+	bench_resume();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/** (4) pthread_create() + pthread_join(). */
+
+static void *
+bench_empty_f(void *arg)
+{
+	return arg;
+}
+
+static void
+bench_thread_create_join(long iterations, long arg)
+{
+	(void)arg;
+	for (long i = 0; i < iterations; ++i) {
+		pthread_t tid;
+		if (pthread_create(&tid, NULL, bench_empty_f, NULL) != 0)
+			abort();
+		pthread_join(tid, NULL);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/** (5) Atomic store with the given order in N threads. */
+
+struct bench_atomic_ctx {
+	struct bench_threads threads;
+	uint64_t target;
+	uint64_t counter __attribute__((aligned(64)));
+	uint64_t value __attribute__((aligned(64)));
+};
+
+#define BENCH_ATOMIC_WORKER(order)					\
+static void *								\
+bench_atomic_##order##_f(void *arg)					\
+{									\
+	struct bench_atomic_ctx *ctx = arg;				\
+	bench_threads_wait_start(&ctx->threads);			\
+	volatile uint64_t random_on_stack = (uintptr_t)&arg;		\
+	while (__atomic_add_fetch(&ctx->counter, 1, __ATOMIC_RELAXED) <	\
+	       ctx->target)						\
+		__atomic_store_n(&ctx->value, random_on_stack, order);	\
+	return NULL;							\
+}
+
+BENCH_ATOMIC_WORKER(__ATOMIC_RELAXED)
+BENCH_ATOMIC_WORKER(__ATOMIC_SEQ_CST)
+
+static void
+bench_atomic(void *(*f)(void *), long iterations, long thread_count)
+{
+	bench_pause();
+	struct bench_atomic_ctx *ctx = aligned_alloc(64, sizeof(*ctx));
+	ctx->target = iterations;
+	ctx->counter = 0;
+	ctx->value = 0;
+	bench_threads_start(&ctx->threads, thread_count, f, ctx, 0);
+	bench_threads_join(&ctx->threads);
+	free(ctx);
+	bench_resume();
+}
+
+static void
+bench_atomic_relaxed(long iterations, long thread_count)
+{
+	bench_atomic(bench_atomic___ATOMIC_RELAXED_f, iterations,
+		     thread_count);
+}
+
+static void
+bench_atomic_seq_cst(long iterations, long thread_count)
+{
+	bench_atomic(bench_atomic___ATOMIC_SEQ_CST_f, iterations,
+		     thread_count);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/** (6) pthread_cond_signal() or broadcast() with N waiters. */
+
+struct bench_cond_ctx {
+	struct bench_threads threads;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	bool is_stopped;
+};
+
+static void *
+bench_cond_wait_f(void *arg)
+{
+	struct bench_cond_ctx *ctx = arg;
+	pthread_mutex_lock(&ctx->mutex);
+	while (!ctx->is_stopped)
+		pthread_cond_wait(&ctx->cond, &ctx->mutex);
+	pthread_mutex_unlock(&ctx->mutex);
+	return NULL;
+}
+
+static void
+bench_cond(bool is_broadcast, long iterations, long thread_count)
+{
+	bench_pause();
+	struct bench_cond_ctx ctx;
+	pthread_mutex_init(&ctx.mutex, NULL);
+	pthread_cond_init(&ctx.cond, NULL);
+	ctx.is_stopped = false;
+	bench_threads_start(&ctx.threads, thread_count, bench_cond_wait_f,
+			    &ctx, 0);
+	for (long i = 0; i < iterations; ++i) {
+		pthread_mutex_lock(&ctx.mutex);
+		if (is_broadcast)
+			pthread_cond_broadcast(&ctx.cond);
+		else
+			pthread_cond_signal(&ctx.cond);
+		pthread_mutex_unlock(&ctx.mutex);
+	}
+	bench_pause();
+	pthread_mutex_lock(&ctx.mutex);
+	ctx.is_stopped = true;
+	pthread_cond_broadcast(&ctx.cond);
+	pthread_mutex_unlock(&ctx.mutex);
+	bench_threads_join(&ctx.threads);
+	pthread_cond_destroy(&ctx.cond);
+	pthread_mutex_destroy(&ctx.mutex);
+	bench_resume();
+}
+
+static void
+bench_cond_signal(long iterations, long thread_count)
+{
+	bench_cond(false, iterations, thread_count);
+}
+
+static void
+bench_cond_broadcast(long iterations, long thread_count)
+{
+	bench_cond(true, iterations, thread_count);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/** (7) Each thread increments its own number, close or distant. */
+
+struct bench_sharing_arg {
+	struct bench_threads *threads;
+	uint64_t *number;
+	long iterations;
+};
+
+static void *
+bench_sharing_f(void *arg)
+{
+	struct bench_sharing_arg *a = arg;
+	bench_threads_wait_start(a->threads);
+	volatile uint64_t *number = a->number;
+	for (volatile long i = 0; i < a->iterations; ++i)
+		*number = *number + 1;
+	return NULL;
+}
+
+static void
+bench_sharing(long stride, long iterations, long thread_count)
+{
+	bench_pause();
+	uint64_t *numbers = aligned_alloc(64, sizeof(uint64_t) *
+					  BENCH_MAX_THREADS * BENCH_LINE_STRIDE);
+	struct bench_threads threads;
+	struct bench_sharing_arg args[BENCH_MAX_THREADS];
+	for (long i = 0; i < thread_count; ++i) {
+		numbers[i * stride] = 0;
+		args[i].threads = &threads;
+		args[i].number = &numbers[i * stride];
+		args[i].iterations = iterations;
+	}
+	bench_threads_start(&threads, thread_count, bench_sharing_f, args,
+			    sizeof(args[0]));
+	bench_threads_join(&threads);
+	free(numbers);
+	bench_resume();
+}
+
+static void
+bench_sharing_close(long iterations, long thread_count)
+{
+	bench_sharing(1, iterations, thread_count);
+}
+
+static void
+bench_sharing_distant(long iterations, long thread_count)
+{
+	bench_sharing(BENCH_LINE_STRIDE, iterations, thread_count);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+bench_add_host_info(void)
+{
+	char buf[256];
+	struct utsname u;
+	if (uname(&u) == 0) {
+		bench_info("host", u.nodename);
+		snprintf(buf, sizeof(buf), "%s %s %s", u.sysname, u.release,
+			 u.machine);
+		bench_info("kernel", buf);
+	}
+	snprintf(buf, sizeof(buf), "%ld", sysconf(_SC_NPROCESSORS_ONLN));
+	bench_info("cpu_count", buf);
+	FILE *f = fopen("/proc/cpuinfo", "r");
+	if (f != NULL) {
+		while (fgets(buf, sizeof(buf), f) != NULL) {
+			if (strncmp(buf, "model name", 10) != 0)
+				continue;
+			char *value = strchr(buf, ':');
+			if (value == NULL)
+				break;
+			value += 1 + (value[1] == ' ');
+			value[strcspn(value, "\n")] = 0;
+			bench_info("cpu", value);
+			break;
+		}
+		fclose(f);
+	}
+	snprintf(buf, sizeof(buf), "%ld", bench_scale);
+	bench_info("scale", buf);
+}
+
+static void
+bench_register_threads(const char *name, bench_f f, long iterations)
+{
+	static const long thread_counts[] = {1, 2, 3, 4, 8};
+	for (size_t i = 0; i < sizeof(thread_counts) /
+	     sizeof(thread_counts[0]); ++i) {
+		bench_register_arg(name, f, iterations * bench_scale,
+				   thread_counts[i]);
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	/* Take own options out, the rest go to the harness. */
+	int argc_left = 1;
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc) {
+			bench_scale = atol(argv[++i]);
+			if (bench_scale < 1)
+				bench_scale = 1;
+			continue;
+		}
+		argv[argc_left++] = argv[i];
+	}
+	argc = argc_left;
+	bench_add_host_info();
+
+	const long clock_count = 5 * 1000 * 1000 * bench_scale;
+	bench_register_arg("clock_realtime", bench_clock, clock_count,
+			   CLOCK_REALTIME);
+	bench_register_arg("clock_monotonic", bench_clock, clock_count,
+			   CLOCK_MONOTONIC);
+	bench_register_arg("clock_monotonic_raw", bench_clock, clock_count,
+			   CLOCK_MONOTONIC_RAW);
+	bench_register_arg("clock_monotonic_coarse", bench_clock,
+			   clock_count, CLOCK_MONOTONIC_COARSE);
+
+	static const long pack_sizes[] = {512, 1024, 16 * 1024, 48 * 1024};
+	const long socket_bytes = 256L * 1024 * 1024 * bench_scale;
+	bool has_uring = bench_has_uring();
+	bench_info("io_uring", has_uring ? "yes" : "no");
+	for (size_t i = 0; i < sizeof(pack_sizes) / sizeof(pack_sizes[0]);
+	     ++i) {
+		long size = pack_sizes[i];
+		long count = socket_bytes / size;
+		bench_register_arg("socket_unix", bench_socket_unix, count,
+				   size);
+		bench_register_arg("socket_tcp", bench_socket_tcp, count, size);
+		bench_register_arg("socket_unix_mmsg", bench_socket_unix_mmsg,
+				   count, size);
+		bench_register_arg("socket_tcp_mmsg", bench_socket_tcp_mmsg,
+				   count, size);
+		bench_register_arg("socket_tcp_zerocopy",
+				   bench_socket_tcp_zerocopy, count, size);
+		bench_register_arg("socket_unix_splice",
+				   bench_socket_unix_splice, count, size);
+		bench_register_arg("socket_tcp_splice", bench_socket_tcp_splice,
+				   count, size);
+		if (!has_uring)
+			continue;
+		bench_register_arg("socket_unix_uring", bench_socket_unix_uring,
+				   count, size);
+		bench_register_arg("socket_tcp_uring", bench_socket_tcp_uring,
+				   count, size);
+	}
+
+	bench_register_threads("mutex", bench_mutex, 2 * 1000 * 1000);
+	bench_register("thread_create_join", bench_thread_create_join,
+		       20 * 1000 * bench_scale);
+	bench_register_threads("atomic_store_relaxed", bench_atomic_relaxed,
+			       10 * 1000 * 1000);
+	bench_register_threads("atomic_store_seq_cst", bench_atomic_seq_cst,
+			       10 * 1000 * 1000);
+	bench_register_threads("cond_signal", bench_cond_signal,
+			       200 * 1000);
+	bench_register_threads("cond_broadcast", bench_cond_broadcast,
+			       200 * 1000);
+	bench_register_threads("false_sharing_close", bench_sharing_close,
+			       10 * 1000 * 1000);
+	bench_register_threads("false_sharing_distant",
+			       bench_sharing_distant, 10 * 1000 * 1000);
+	return bench_main(argc, argv);
+}
@@ -0,0 +1,486 @@
+#include "iocoro.h"
+
+#include <cassert>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <mutex>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string_view>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// HTTP/1.1 keep-alive server on IOCoreGroup, for the load generators like wrk or h2load:
+//
+//     ./http [--port N] [--cores N] [--uring]
+//     wrk -t4 -c256 -d10s http://127.0.0.1:8080/
+//
+// Any GET gives a 13 byte plain text, like the plaintext test of TechEmpower. The
+// requests are read with the buffered stream reads of IOTask, one line at a time into a
+// string which keeps its capacity, and are parsed in place. So a request costs no heap
+// allocations. The responses to the pipelined requests are collected while the next
+// request is already buffered, and go in one vectored send. Runs until SIGINT or SIGTERM.
+
+// A longer line in the head closes the connection.
+static constexpr size_t theMaxLineSize = 8 * 1024;
+// Pipelined responses collected before a send.
+static constexpr int theMaxBatchSize = 64;
+
+static const char theResponseOk[] =
+	"HTTP/1.1 200 OK\r\n"
+	"Server: iocoro\r\n"
+	"Content-Type: text/plain\r\n"
+	"Content-Length: 13\r\n"
+	"\r\n"
+	"Hello, World!";
+
+static const char theResponseOkClose[] =
+	"HTTP/1.1 200 OK\r\n"
+	"Server: iocoro\r\n"
+	"Content-Type: text/plain\r\n"
+	"Content-Length: 13\r\n"
+	"Connection: close\r\n"
+	"\r\n"
+	"Hello, World!";
+
+static const char theResponseNotAllowed[] =
+	"HTTP/1.1 405 Method Not Allowed\r\n"
+	"Server: iocoro\r\n"
+	"Allow: GET\r\n"
+	"Content-Length: 0\r\n"
+	"Connection: close\r\n"
+	"\r\n";
+
+static const char theResponseBad[] =
+	"HTTP/1.1 400 Bad Request\r\n"
+	"Server: iocoro\r\n"
+	"Content-Length: 0\r\n"
+	"Connection: close\r\n"
+	"\r\n";
+
+// Set before the sockets are closed, so as the connections handed to a core after that
+// are closed right away.
+static std::atomic_bool theIsStopping{false};
+
+static void
+makeFdNonblock(
+	int fd);
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// A connection or the listener. Linked into the list of its core, so as to stop them all.
+// Lives in the frame of its coroutine.
+//
+struct HttpSocket
+{
+	HttpSocket(
+		IOTask *task);
+	~HttpSocket();
+
+	IOTask *const myTask;
+	HttpSocket *myPrev;
+	HttpSocket *myNext;
+
+	// The sockets of the core rolled in this thread.
+	static thread_local HttpSocket *theList;
+};
+
+thread_local HttpSocket *HttpSocket::theList = nullptr;
+
+HttpSocket::HttpSocket(
+	IOTask *task)
+	: myTask(task)
+	, myPrev(nullptr)
+	, myNext(theList)
+{
+	if (myNext != nullptr)
+		myNext->myPrev = this;
+	theList = this;
+}
+
+HttpSocket::~HttpSocket()
+{
+	if (myPrev != nullptr)
+		myPrev->myNext = myNext;
+	else
+		theList = myNext;
+	if (myNext != nullptr)
+		myNext->myPrev = myPrev;
+	myTask->close();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// What the server needs from a request head.
+struct HttpRequest
+{
+	bool myIsGet = false;
+	bool myIsKeepAlive = false;
+	size_t myBodySize = 0;
+};
+
+static bool
+httpIsToken(
+	std::string_view value,
+	std::string_view token)
+{
+	return value.size() == token.size() &&
+		strncasecmp(value.data(), token.data(), token.size()) == 0;
+}
+
+// Case-insensitive check of the header name, with the value trimmed.
+static bool
+httpHeaderValue(
+	std::string_view line,
+	std::string_view name,
+	std::string_view &value)
+{
+	if (line.size() <= name.size() || line[name.size()] != ':' ||
+		strncasecmp(line.data(), name.data(), name.size()) != 0)
+		return false;
+	value = line.substr(name.size() + 1);
+	while (!value.empty() && (value.front() == ' ' || value.front() == '\t'))
+		value.remove_prefix(1);
+	while (!value.empty() && (value.back() == ' ' || value.back() == '\t'))
+		value.remove_suffix(1);
+	return true;
+}
+
+static bool
+httpParseRequestLine(
+	std::string_view line,
+	HttpRequest &req)
+{
+	size_t methodEnd = line.find(' ');
+	if (methodEnd == std::string_view::npos)
+		return false;
+	size_t pathEnd = line.find(' ', methodEnd + 1);
+	if (pathEnd == std::string_view::npos || pathEnd == methodEnd + 1)
+		return false;
+	std::string_view version = line.substr(pathEnd + 1);
+	if (version == "HTTP/1.1")
+		req.myIsKeepAlive = true;
+	else if (version != "HTTP/1.0")
+		return false;
+	req.myIsGet = line.substr(0, methodEnd) == "GET";
+	return true;
+}
+
+static bool
+httpParseHeader(
+	std::string_view line,
+	HttpRequest &req)
+{
+	std::string_view value;
+	if (httpHeaderValue(line, "content-length", value))
+	{
+		size_t size = 0;
+		if (value.empty())
+			return false;
+		for (char c : value)
+		{
+			if (c < '0' || c > '9' || size > (SIZE_MAX - 9) / 10)
+				return false;
+			size = size * 10 + (c - '0');
+		}
+		req.myBodySize = size;
+	}
+	else if (httpHeaderValue(line, "transfer-encoding", value))
+	{
+		// The chunked bodies are not supported.
+		return false;
+	}
+	else if (httpHeaderValue(line, "connection", value))
+	{
+		if (httpIsToken(value, "close"))
+			req.myIsKeepAlive = false;
+		else if (httpIsToken(value, "keep-alive"))
+			req.myIsKeepAlive = true;
+	}
+	return true;
+}
+
+// Read a request head and skip its body. False when the connection has to be closed:
+// EOF, an error, or a bad request.
+static IOSubCoroutine<bool>
+httpReadRequest(
+	IOTask *task,
+	std::string &line,
+	HttpRequest &req,
+	bool &isBad)
+{
+	req = HttpRequest();
+	bool isFirst = true;
+	while (true)
+	{
+		line.clear();
+		ssize_t rc = co_await task->asyncReadUntil(line, '\n');
+		if (rc <= 0 || line.back() != '\n')
+			co_return false;
+		if (line.size() > theMaxLineSize)
+		{
+			isBad = true;
+			co_return false;
+		}
+		std::string_view view(line.data(), line.size() - 1);
+		if (!view.empty() && view.back() == '\r')
+			view.remove_suffix(1);
+		// Empty lines before the request are allowed.
+		if (isFirst && view.empty())
+			continue;
+		bool ok;
+		if (isFirst)
+			ok = httpParseRequestLine(view, req);
+		else if (view.empty())
+			break;
+		else
+			ok = httpParseHeader(view, req);
+		if (!ok)
+		{
+			isBad = true;
+			co_return false;
+		}
+		isFirst = false;
+	}
+	char skip[1024];
+	while (req.myBodySize > 0)
+	{
+		size_t size = std::min(req.myBodySize, sizeof(skip));
+		ssize_t rc = co_await task->asyncReadExactly(skip, size);
+		if (rc != (ssize_t)size)
+			co_return false;
+		req.myBodySize -= size;
+	}
+	co_return true;
+}
+
+static IOSubCoroutine<bool>
+httpFlush(
+	IOTask *task,
+	iovec *vecs,
+	int &count)
+{
+	if (count == 0)
+		co_return true;
+	ssize_t rc = co_await task->asyncWriteAllV(vecs, count);
+	count = 0;
+	co_return rc >= 0;
+}
+
+static IOCoroutine
+httpServe(
+	IOTask *task)
+{
+	HttpSocket sock(task);
+	std::string line;
+	line.reserve(256);
+	iovec vecs[theMaxBatchSize];
+	int count = 0;
+	while (true)
+	{
+		HttpRequest req;
+		bool isBad = false;
+		bool ok = co_await httpReadRequest(task, line, req, isBad);
+		const char *resp = nullptr;
+		size_t respSize = 0;
+		if (!ok)
+		{
+			if (isBad)
+			{
+				resp = theResponseBad;
+				respSize = sizeof(theResponseBad) - 1;
+			}
+		}
+		else if (!req.myIsGet)
+		{
+			resp = theResponseNotAllowed;
+			respSize = sizeof(theResponseNotAllowed) - 1;
+			ok = false;
+		}
+		else if (req.myIsKeepAlive)
+		{
+			resp = theResponseOk;
+			respSize = sizeof(theResponseOk) - 1;
+		}
+		else
+		{
+			resp = theResponseOkClose;
+			respSize = sizeof(theResponseOkClose) - 1;
+			ok = false;
+		}
+		if (resp != nullptr)
+			vecs[count++] = {(void *)resp, respSize};
+		// The next pipelined request is here already. Its response goes with this one.
+		// A partially buffered one can wait for its rest, the client sends it anyway.
+		if (ok && count < theMaxBatchSize && task->bufferedSize() > 0)
+			continue;
+		if (!co_await httpFlush(task, vecs, count) || !ok)
+			break;
+	}
+	co_return;
+}
+
+static IOCoroutine
+httpListen(
+	IOTask *task,
+	IOCoreGroup *group)
+{
+	HttpSocket sock(task);
+	while (true)
+	{
+		int fd = co_await task->asyncAccept(nullptr, nullptr);
+		// Could be the stop.
+		if (fd < 0)
+		{
+			if (errno == ECANCELED)
+				break;
+			continue;
+		}
+		int value = 1;
+		int rc = setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value));
+		assert(rc == 0);
+		MAYBE_UNUSED(rc);
+		makeFdNonblock(fd);
+		group->post(fd, [fd](IOCore &core) {
+			if (theIsStopping.load(std::memory_order_relaxed))
+				close(fd);
+			else
+				httpServe(core.subscribe(fd));
+		});
+	}
+	co_return;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Close all the sockets of each core in its thread. Their coroutines get ECANCELED right
+// away and end.
+static void
+httpStop(
+	IOCoreGroup &group)
+{
+	std::mutex mutex;
+	std::condition_variable cond;
+	uint32_t doneCount = 0;
+	theIsStopping.store(true, std::memory_order_relaxed);
+	for (uint32_t i = 0; i < group.size(); ++i)
+	{
+		group.core(i).post([&]() {
+			HttpSocket *s = HttpSocket::theList;
+			while (s != nullptr)
+			{
+				// The closed one can be gone when its coroutine is resumed in close().
+				HttpSocket *next = s->myNext;
+				s->myTask->close();
+				s = next;
+			}
+			std::unique_lock lock(mutex);
+			++doneCount;
+			cond.notify_one();
+		});
+	}
+	std::unique_lock lock(mutex);
+	while (doneCount < group.size())
+		cond.wait(lock);
+}
+
+static int
+httpBind(
+	uint16_t port)
+{
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	assert(sock >= 0);
+	int value = 1;
+	int rc = setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(value));
+	assert(rc == 0);
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if (bind(sock, (sockaddr *)&addr, sizeof(addr)) != 0)
+	{
+		std::cerr << "bind: " << strerror(errno) << std::endl;
+		exit(1);
+	}
+	rc = listen(sock, SOMAXCONN);
+	assert(rc == 0);
+	makeFdNonblock(sock);
+	return sock;
+}
+
+int main(int argc, char **argv)
+{
+	uint16_t port = 8080;
+	uint32_t coreCount = 1;
+	IOCoreBackend backend = IO_CORE_BACKEND_EPOLL;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--port") == 0 && i + 1 < argc)
+		{
+			port = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--cores") == 0 && i + 1 < argc)
+		{
+			coreCount = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--uring") == 0)
+		{
+			backend = IO_CORE_BACKEND_URING;
+		}
+		else
+		{
+			std::cerr << "Usage: " << argv[0] << " [--port N] [--cores N] [--uring]" <<
+				std::endl;
+			return 1;
+		}
+	}
+	if (coreCount == 0)
+		coreCount = 1;
+	// The core threads inherit the mask, and only the main one takes the signals.
+	sigset_t sigs;
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &sigs, nullptr);
+	signal(SIGPIPE, SIG_IGN);
+
+	int sock = httpBind(port);
+	IOCoreGroup group(coreCount, IO_CORE_GROUP_PICK_HASH, 0, backend);
+	group.post(sock, [sock, &group](IOCore &core) {
+		httpListen(core.subscribe(sock), &group);
+	});
+	std::cout << "listening on " << port << ", cores: " << coreCount <<
+		(group.core(0).backend() == IO_CORE_BACKEND_URING ? ", io_uring" : ", epoll") <<
+		std::endl;
+	int sig;
+	sigwait(&sigs, &sig);
+
+	httpStop(group);
+	group.stop();
+	for (uint32_t i = 0; i < group.size(); ++i)
+	{
+		const IOCoreStats &stats = group.core(i).stats();
+		std::cout << "core " << i << ": rolls: " << stats.myRollCount.get() <<
+			", events: " << stats.myEventCount.get() << ", recv wait p50: <" <<
+			stats.myOpWaitNs[IO_OP_RECV].percentile(0.5) / 1000.0 << " us" << std::endl;
+	}
+	return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+static void
+makeFdNonblock(
+	int fd)
+{
+	int rc = fcntl(fd, F_GETFL, 0);
+	assert(rc >= 0);
+	rc = fcntl(fd, F_SETFL, rc | O_NONBLOCK);
+	assert(rc == 0);
+	MAYBE_UNUSED(rc);
+}
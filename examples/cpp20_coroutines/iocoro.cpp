@@ -2,18 +2,355 @@
 
 #include <cassert>
 #include <cstring>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
 #include <sys/epoll.h>
 #include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 
-static constexpr int theEpollBatchSize = 128;
+// Events taken by one epoll_wait(). The batch size doubles up to the max each time the
+// kernel fills it fully, so a busy core makes less syscalls per event.
+static constexpr int theEpollBatchMinSize = 128;
+static constexpr int theEpollBatchMaxSize = 4096;
+// Submission entries of a ring. The kernel makes twice more completion entries.
+static constexpr unsigned theUringSize = 4096;
+// User data of the io_uring requests which are not AsyncOperations.
+static constexpr uint64_t theUringDataIgnore = 0;
+static constexpr uint64_t theUringDataWakeup = 1;
+// Stream reads of a task are received by chunks of this size. The bigger reads go right
+// into the destination.
+static constexpr size_t theTaskReadBufSize = 16 * 1024;
 
 std::atomic_int IOCoroutinePromise::theCount{0};
+std::atomic_uint64_t IOCoroutinePromise::theFrameHeapCount{0};
+std::atomic_uint64_t IOCoroutinePromise::theFramePoolCount{0};
 std::atomic_int IOTask::theCount{0};
+thread_local IOCore *IOCore::theCurrent = nullptr;
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
-AsyncOperation::AsyncOperation(IOTask *sub)
+// Frames are pooled in the size classes of this step.
+static constexpr size_t theFrameClassStep = 64;
+static constexpr size_t theFrameClassCount = 32;
+// Free frames kept in one class of one thread. The rest goes back to the heap.
+static constexpr size_t theFrameClassMaxFree = 1024;
+
+// Free coroutine frames of one thread. A frame can be freed in another thread than the
+// one which allocated it. Then it just joins the other thread's pool.
+//
+class IOFramePool
+{
+public:
+	IOFramePool() : myFree{}, myFreeCount{} {}
+
+	~IOFramePool()
+	{
+		for (size_t i = 0; i < theFrameClassCount; ++i)
+		{
+			while (myFree[i] != nullptr)
+			{
+				Frame *f = myFree[i];
+				myFree[i] = f->myNext;
+				::operator delete(f);
+			}
+		}
+	}
+
+	void *
+	alloc(
+		size_t size)
+	{
+		size_t cls = (size + theFrameClassStep - 1) / theFrameClassStep;
+		if (cls >= theFrameClassCount || myFree[cls] == nullptr)
+		{
+			IOCoroutinePromise::theFrameHeapCount.fetch_add(1, std::memory_order_relaxed);
+			// Allocate the full class size, so the frame fits any size of its class
+			// when reused.
+			return ::operator new(cls < theFrameClassCount ? cls * theFrameClassStep : size);
+		}
+		IOCoroutinePromise::theFramePoolCount.fetch_add(1, std::memory_order_relaxed);
+		Frame *f = myFree[cls];
+		myFree[cls] = f->myNext;
+		--myFreeCount[cls];
+		return f;
+	}
+
+	void
+	free(
+		void *ptr,
+		size_t size)
+	{
+		size_t cls = (size + theFrameClassStep - 1) / theFrameClassStep;
+		if (cls >= theFrameClassCount || myFreeCount[cls] == theFrameClassMaxFree)
+		{
+			::operator delete(ptr);
+			return;
+		}
+		Frame *f = (Frame *)ptr;
+		f->myNext = myFree[cls];
+		myFree[cls] = f;
+		++myFreeCount[cls];
+	}
+
+private:
+	struct Frame
+	{
+		Frame *myNext;
+	};
+
+	Frame *myFree[theFrameClassCount];
+	size_t myFreeCount[theFrameClassCount];
+};
+
+static thread_local IOFramePool theFramePool;
+
+void *
+IOCoroutinePromise::operator new(
+	size_t size)
+{
+	return theFramePool.alloc(size);
+}
+
+void
+IOCoroutinePromise::operator delete(
+	void *ptr,
+	size_t size)
+{
+	theFramePool.free(ptr, size);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// A minimal io_uring ring over the raw syscalls.
+//
+struct IOUring
+{
+	IOUring() = default;
+	IOUring(
+		const IOUring&) = delete;
+	IOUring& operator=(
+		const IOUring&) = delete;
+	~IOUring();
+
+	// False when io_uring is not available.
+	bool
+	open();
+
+	// A cleared submission entry. When the queue is full, it is submitted first.
+	io_uring_sqe *
+	getSqe();
+
+	// Submit the new entries and wait for at least one completion, or for the timeout
+	// in milliseconds. -1 is infinity.
+	void
+	wait(
+		int timeoutMs);
+
+	bool
+	hasUnsubmitted() const { return mySqLocalTail != *mySqTail; }
+
+	// Next completion, or null. It is consumed by seen().
+	io_uring_cqe *
+	peek()
+	{
+		unsigned head = *myCqHead;
+		if (head == __atomic_load_n(myCqTail, __ATOMIC_ACQUIRE))
+			return nullptr;
+		return &myCqes[head & myCqMask];
+	}
+
+	void
+	seen() { __atomic_store_n(myCqHead, *myCqHead + 1, __ATOMIC_RELEASE); }
+
+	int myFd = -1;
+	// Submission queue, shared with the kernel.
+	unsigned *mySqHead = nullptr;
+	unsigned *mySqTail = nullptr;
+	unsigned mySqMask = 0;
+	unsigned mySqEntries = 0;
+	unsigned *mySqArray = nullptr;
+	io_uring_sqe *mySqes = nullptr;
+	// Tail with the not submitted entries yet.
+	unsigned mySqLocalTail = 0;
+	// Completion queue, shared with the kernel.
+	unsigned *myCqHead = nullptr;
+	unsigned *myCqTail = nullptr;
+	unsigned myCqMask = 0;
+	io_uring_cqe *myCqes = nullptr;
+	// The mappings, to unmap them.
+	void *mySqPtr = nullptr;
+	size_t mySqMapSize = 0;
+	void *myCqPtr = nullptr;
+	size_t myCqMapSize = 0;
+	size_t mySqesMapSize = 0;
+
+	// Requests in the kernel, not completed yet.
+	uint64_t myInFlightCount = 0;
+	// Cancelled operations, not completed yet.
+	uint64_t myCancelCount = 0;
+	// The wakeup eventfd is read by the ring, to this buffer.
+	bool myIsWakeupPending = false;
+	uint64_t myWakeupBuf = 0;
+};
+
+static void *
+uringMap(
+	int fd,
+	size_t size,
+	off_t offset)
+{
+	void *res = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		fd, offset);
+	return res == MAP_FAILED ? nullptr : res;
+}
+
+IOUring::~IOUring()
+{
+	assert(myInFlightCount == 0);
+	if (myFd >= 0)
+		close(myFd);
+	if (mySqes != nullptr)
+		munmap(mySqes, mySqesMapSize);
+	if (myCqPtr != nullptr && myCqPtr != mySqPtr)
+		munmap(myCqPtr, myCqMapSize);
+	if (mySqPtr != nullptr)
+		munmap(mySqPtr, mySqMapSize);
+}
+
+bool
+IOUring::open()
+{
+	io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	myFd = (int)syscall(__NR_io_uring_setup, theUringSize, &p);
+	if (myFd < 0)
+		return false;
+	mySqMapSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	myCqMapSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+	bool isSingleMap = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (isSingleMap)
+	{
+		mySqMapSize = std::max(mySqMapSize, myCqMapSize);
+		myCqMapSize = mySqMapSize;
+	}
+	mySqPtr = uringMap(myFd, mySqMapSize, IORING_OFF_SQ_RING);
+	if (mySqPtr == nullptr)
+		return false;
+	myCqPtr = isSingleMap ? mySqPtr : uringMap(myFd, myCqMapSize, IORING_OFF_CQ_RING);
+	if (myCqPtr == nullptr)
+		return false;
+	mySqesMapSize = p.sq_entries * sizeof(io_uring_sqe);
+	mySqes = (io_uring_sqe *)uringMap(myFd, mySqesMapSize, IORING_OFF_SQES);
+	if (mySqes == nullptr)
+		return false;
+	char *sq = (char *)mySqPtr;
+	mySqHead = (unsigned *)(sq + p.sq_off.head);
+	mySqTail = (unsigned *)(sq + p.sq_off.tail);
+	mySqMask = *(unsigned *)(sq + p.sq_off.ring_mask);
+	mySqEntries = *(unsigned *)(sq + p.sq_off.ring_entries);
+	mySqArray = (unsigned *)(sq + p.sq_off.array);
+	mySqLocalTail = *mySqTail;
+	char *cq = (char *)myCqPtr;
+	myCqHead = (unsigned *)(cq + p.cq_off.head);
+	myCqTail = (unsigned *)(cq + p.cq_off.tail);
+	myCqMask = *(unsigned *)(cq + p.cq_off.ring_mask);
+	myCqes = (io_uring_cqe *)(cq + p.cq_off.cqes);
+	return true;
+}
+
+io_uring_sqe *
+IOUring::getSqe()
+{
+	unsigned head = __atomic_load_n(mySqHead, __ATOMIC_ACQUIRE);
+	if (mySqLocalTail - head == mySqEntries)
+	{
+		unsigned count = mySqLocalTail - *mySqTail;
+		__atomic_store_n(mySqTail, mySqLocalTail, __ATOMIC_RELEASE);
+		int rc;
+		while ((rc = (int)syscall(__NR_io_uring_enter, myFd, count, 0, 0, nullptr, 0)) < 0)
+			assert(errno == EINTR || errno == EAGAIN || errno == EBUSY);
+	}
+	// The kernel takes all the submitted entries right away.
+	unsigned idx = mySqLocalTail++ & mySqMask;
+	mySqArray[idx] = idx;
+	io_uring_sqe *sqe = &mySqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+void
+IOUring::wait(
+	int timeoutMs)
+{
+	unsigned count = mySqLocalTail - *mySqTail;
+	__atomic_store_n(mySqTail, mySqLocalTail, __ATOMIC_RELEASE);
+	unsigned minComplete = peek() != nullptr ? 0 : 1;
+	unsigned flags = IORING_ENTER_GETEVENTS;
+	__kernel_timespec ts;
+	io_uring_getevents_arg arg;
+	const void *argPtr = nullptr;
+	size_t argSize = 0;
+	if (timeoutMs >= 0)
+	{
+		ts.tv_sec = timeoutMs / 1000;
+		ts.tv_nsec = (long long)(timeoutMs % 1000) * 1'000'000;
+		memset(&arg, 0, sizeof(arg));
+		arg.ts = (uint64_t)&ts;
+		flags |= IORING_ENTER_EXT_ARG;
+		argPtr = &arg;
+		argSize = sizeof(arg);
+	}
+	int rc = (int)syscall(__NR_io_uring_enter, myFd, count, minComplete, flags, argPtr,
+		argSize);
+	assert(rc >= 0 || errno == EINTR || errno == EAGAIN || errno == EBUSY ||
+		errno == ETIME);
+	MAYBE_UNUSED(rc);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+uint64_t
+IOStatHistogram::count() const
+{
+	uint64_t res = 0;
+	for (const IOStatCounter &b : myBuckets)
+		res += b.get();
+	return res;
+}
+
+uint64_t
+IOStatHistogram::percentile(
+	double share) const
+{
+	// The buckets are read one by one, so they are copied first to see the same total.
+	uint64_t counts[theBucketCount];
+	uint64_t total = 0;
+	for (int i = 0; i < theBucketCount; ++i)
+	{
+		counts[i] = myBuckets[i].get();
+		total += counts[i];
+	}
+	uint64_t target = (uint64_t)(share * total);
+	uint64_t sum = 0;
+	for (int i = 0; i < theBucketCount; ++i)
+	{
+		sum += counts[i];
+		if (sum > target || (sum == total && counts[i] > 0))
+			return i == 64 ? UINT64_MAX : (1ull << i) - 1;
+	}
+	return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+AsyncOperation::AsyncOperation(
+	IOTask *sub,
+	IOOpType type)
 	: myTask(sub)
+	, myType(type)
+	, myCancelErr(0)
 {
 }
 
@@ -23,17 +360,48 @@ AsyncOperation::await_suspend(
 {
 	assert(myTask->myAsyncOp == nullptr);
 	myCoro = coro;
+	mySuspendTime = IOClock::now();
 	myTask->myAsyncOp = this;
+	if (myTask->myCore.backend() == IO_CORE_BACKEND_URING)
+		myTask->myCore.submit(this);
 	return true;
 }
 
+void
+AsyncOperation::resume()
+{
+	auto wait = IOClock::now() - mySuspendTime;
+	myTask->myCore.myStats.myOpWaitNs[myType].add(
+		std::chrono::duration_cast<std::chrono::nanoseconds>(wait).count());
+	myCoro.resume();
+}
+
+void
+AsyncOperation::cancel(
+	int err)
+{
+	assert(myTask->myAsyncOp == this);
+	// Can only be the io_uring one, waiting for the kernel.
+	if (myCancelErr != 0)
+		return;
+	myCancelErr = err;
+	if (myTask->myCore.backend() == IO_CORE_BACKEND_URING)
+	{
+		// The kernel still uses the operation. It is resumed from the completion.
+		myTask->myCore.cancel(this);
+		return;
+	}
+	myTask->myAsyncOp = nullptr;
+	onComplete(-err);
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////
 
 AsyncRecv::AsyncRecv(
 	IOTask *sub,
 	void *data,
 	size_t size)
-	: AsyncOperation(sub)
+	: AsyncOperation(sub, IO_OP_RECV)
 	, myData(data)
 	, mySize(size)
 	, myRes(-1)
@@ -58,31 +426,48 @@ bool
 AsyncRecv::onIOEvent()
 {
 	if ((myTask->myEventsReady & IO_EVENT_READ) == 0)
-	{
-		if (myTask->myState == IO_TASK_STATE_DELETING)
-		{
-			// Cancellation.
-			myRes = -1;
-			myCoro.resume();
-			return true;
-		}
 		return false;
-	}
 	execute();
 	// Could be a spurious wakeup.
 	if (myRes < 0)
 		return false;
-	myCoro.resume();
+	resume();
 	return true;
 }
 
+void
+AsyncRecv::prepare(
+	io_uring_sqe &sqe)
+{
+	sqe.opcode = IORING_OP_RECV;
+	sqe.fd = myTask->myFd;
+	sqe.addr = (uint64_t)myData;
+	sqe.len = mySize;
+}
+
+void
+AsyncRecv::onComplete(
+	int res)
+{
+	// Cancellation. Even if something was received, nobody is going to use it.
+	if (myTask->myState == IO_TASK_STATE_DELETING)
+		res = -ECANCELED;
+	if (res < 0)
+	{
+		errno = -res;
+		res = -1;
+	}
+	myRes = res;
+	resume();
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////
 
 AsyncSend::AsyncSend(
 	IOTask *sub,
 	const void *data,
 	size_t size)
-	: AsyncOperation(sub)
+	: AsyncOperation(sub, IO_OP_SEND)
 	, myData(data)
 	, mySize(size)
 	, myRes(-1)
@@ -107,31 +492,177 @@ bool
 AsyncSend::onIOEvent()
 {
 	if ((myTask->myEventsReady & IO_EVENT_WRITE) == 0)
+		return false;
+	execute();
+	// Could be a spurious wakeup.
+	if (myRes < 0)
+		return false;
+	resume();
+	return true;
+}
+
+void
+AsyncSend::prepare(
+	io_uring_sqe &sqe)
+{
+	sqe.opcode = IORING_OP_SEND;
+	sqe.fd = myTask->myFd;
+	sqe.addr = (uint64_t)myData;
+	sqe.len = mySize;
+}
+
+void
+AsyncSend::onComplete(
+	int res)
+{
+	if (myTask->myState == IO_TASK_STATE_DELETING)
+		res = -ECANCELED;
+	if (res < 0)
 	{
-		if (myTask->myState == IO_TASK_STATE_DELETING)
-		{
-			// Cancellation.
-			myRes = -1;
-			myCoro.resume();
-			return true;
-		}
+		errno = -res;
+		res = -1;
+	}
+	myRes = res;
+	resume();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+AsyncRecvV::AsyncRecvV(
+	IOTask *sub,
+	const iovec *vecs,
+	int count)
+	: AsyncOperation(sub, IO_OP_RECV)
+	, myRes(-1)
+{
+	memset(&myMsg, 0, sizeof(myMsg));
+	myMsg.msg_iov = (iovec *)vecs;
+	myMsg.msg_iovlen = count;
+	execute();
+}
+
+void
+AsyncRecvV::execute()
+{
+	if ((myTask->myEventsReady & IO_EVENT_READ) == 0)
+		return;
+	myRes = recvmsg(myTask->myFd, &myMsg, 0);
+	if (myRes >= 0)
+		return;
+	assert(errno == EWOULDBLOCK);
+	myTask->myEventsReady &= ~IO_EVENT_READ;
+}
+
+bool
+AsyncRecvV::onIOEvent()
+{
+	if ((myTask->myEventsReady & IO_EVENT_READ) == 0)
 		return false;
+	execute();
+	// Could be a spurious wakeup.
+	if (myRes < 0)
+		return false;
+	resume();
+	return true;
+}
+
+void
+AsyncRecvV::prepare(
+	io_uring_sqe &sqe)
+{
+	sqe.opcode = IORING_OP_RECVMSG;
+	sqe.fd = myTask->myFd;
+	sqe.addr = (uint64_t)&myMsg;
+	sqe.len = 1;
+}
+
+void
+AsyncRecvV::onComplete(
+	int res)
+{
+	if (myTask->myState == IO_TASK_STATE_DELETING)
+		res = -ECANCELED;
+	if (res < 0)
+	{
+		errno = -res;
+		res = -1;
 	}
+	myRes = res;
+	resume();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+AsyncSendV::AsyncSendV(
+	IOTask *sub,
+	const iovec *vecs,
+	int count)
+	: AsyncOperation(sub, IO_OP_SEND)
+	, myRes(-1)
+{
+	memset(&myMsg, 0, sizeof(myMsg));
+	myMsg.msg_iov = (iovec *)vecs;
+	myMsg.msg_iovlen = count;
+	execute();
+}
+
+void
+AsyncSendV::execute()
+{
+	if ((myTask->myEventsReady & IO_EVENT_WRITE) == 0)
+		return;
+	myRes = sendmsg(myTask->myFd, &myMsg, 0);
+	if (myRes >= 0)
+		return;
+	assert(errno == EWOULDBLOCK);
+	myTask->myEventsReady &= ~IO_EVENT_WRITE;
+}
+
+bool
+AsyncSendV::onIOEvent()
+{
+	if ((myTask->myEventsReady & IO_EVENT_WRITE) == 0)
+		return false;
 	execute();
 	// Could be a spurious wakeup.
 	if (myRes < 0)
 		return false;
-	myCoro.resume();
+	resume();
 	return true;
 }
 
+void
+AsyncSendV::prepare(
+	io_uring_sqe &sqe)
+{
+	sqe.opcode = IORING_OP_SENDMSG;
+	sqe.fd = myTask->myFd;
+	sqe.addr = (uint64_t)&myMsg;
+	sqe.len = 1;
+}
+
+void
+AsyncSendV::onComplete(
+	int res)
+{
+	if (myTask->myState == IO_TASK_STATE_DELETING)
+		res = -ECANCELED;
+	if (res < 0)
+	{
+		errno = -res;
+		res = -1;
+	}
+	myRes = res;
+	resume();
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////
 
 AsyncAccept::AsyncAccept(
 	IOTask *sub,
 	sockaddr *addr,
 	socklen_t *size)
-	: AsyncOperation(sub)
+	: AsyncOperation(sub, IO_OP_ACCEPT)
 	, myAddr(addr)
 	, mySize(size)
 	, myRes(-1)
@@ -156,34 +687,60 @@ bool
 AsyncAccept::onIOEvent()
 {
 	if ((myTask->myEventsReady & IO_EVENT_READ) == 0)
-	{
-		if (myTask->myState == IO_TASK_STATE_DELETING)
-		{
-			// Cancellation.
-			myRes = -1;
-			myCoro.resume();
-			return true;
-		}
 		return false;
-	}
 	execute();
 	// Could be a spurious wakeup.
 	if (myRes < 0)
 		return false;
-	myCoro.resume();
+	resume();
 	return true;
 }
 
+void
+AsyncAccept::prepare(
+	io_uring_sqe &sqe)
+{
+	sqe.opcode = IORING_OP_ACCEPT;
+	sqe.fd = myTask->myFd;
+	sqe.addr = (uint64_t)myAddr;
+	sqe.addr2 = (uint64_t)mySize;
+}
+
+void
+AsyncAccept::onComplete(
+	int res)
+{
+	if (myTask->myState == IO_TASK_STATE_DELETING)
+	{
+		// The cancellation came too late, a socket is accepted. But nobody wants it.
+		if (res >= 0)
+			::close(res);
+		res = -ECANCELED;
+	}
+	if (res < 0)
+	{
+		errno = -res;
+		res = -1;
+	}
+	myRes = res;
+	resume();
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////
 
 AsyncConnect::AsyncConnect(
 	IOTask *sub,
 	const sockaddr *addr,
 	socklen_t size)
-	: AsyncOperation(sub)
+	: AsyncOperation(sub, IO_OP_CONNECT)
+	, myAddr(addr)
+	, mySize(size)
 	, myIsDone(false)
 	, myRes(-1)
 {
+	// Io_uring does the whole connect by itself.
+	if (myTask->myCore.backend() == IO_CORE_BACKEND_URING)
+		return;
 	int rc = connect(myTask->myFd, addr, size);
 	if (rc == 0)
 	{
@@ -202,23 +759,50 @@ bool
 AsyncConnect::onIOEvent()
 {
 	if ((myTask->myEventsReady & IO_EVENT_WRITE) == 0)
-	{
-		if (myTask->myState == IO_TASK_STATE_DELETING)
-		{
-			// Cancellation.
-			myIsDone = true;
-			myRes = -1;
-			myCoro.resume();
-			return true;
-		}
 		return false;
-	}
 	myIsDone = true;
 	myRes = 0;
-	myCoro.resume();
+	resume();
 	return true;
 }
 
+void
+AsyncConnect::prepare(
+	io_uring_sqe &sqe)
+{
+	sqe.opcode = IORING_OP_CONNECT;
+	sqe.fd = myTask->myFd;
+	sqe.addr = (uint64_t)myAddr;
+	// The address length goes in the offset field.
+	sqe.off = mySize;
+}
+
+void
+AsyncConnect::onComplete(
+	int res)
+{
+	if (myTask->myState == IO_TASK_STATE_DELETING)
+		res = -ECANCELED;
+	myIsDone = true;
+	myRes = 0;
+	if (res < 0)
+	{
+		errno = -res;
+		myRes = -1;
+	}
+	resume();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+void
+AsyncSleep::await_suspend(
+	std::coroutine_handle<> coro)
+{
+	myCoro = coro;
+	myCore.addTimer(this, myDuration);
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////
 
 IOTask::IOTask(
@@ -227,9 +811,12 @@ IOTask::IOTask(
 	: myState(IO_TASK_STATE_NEW)
 	, myFd(fd)
 	, myIdx(-1)
+	, myNext(nullptr)
 	, myEventsReady(0)
 	, myAsyncOp(nullptr)
 	, myCore(core)
+	, myReadPos(0)
+	, myReadEnd(0)
 {
 	LOG_DEBUG("IOTask create");
 	theCount.fetch_add(1, std::memory_order_relaxed);
@@ -249,18 +836,229 @@ IOTask::~IOTask()
 void
 IOTask::close()
 {
-	myCore.unsubscribe(this);
+	if (!myCore.unsubscribe(this))
+		return;
+	if (IOCore::current() == &myCore && myAsyncOp != nullptr)
+		myAsyncOp->cancel(ECANCELED);
+}
+
+void
+IOTask::cancel()
+{
+	assert(IOCore::current() == &myCore);
+	if (myAsyncOp != nullptr)
+		myAsyncOp->cancel(ECANCELED);
+}
+
+IOSubCoroutine<ssize_t>
+IOTask::asyncReadExactly(
+	void *data,
+	size_t size)
+{
+	char *dst = (char *)data;
+	size_t done = takeBuffered(dst, size);
+	while (done < size)
+	{
+		size_t left = size - done;
+		ssize_t rc;
+		if (left >= theTaskReadBufSize)
+		{
+			rc = co_await asyncRecv(dst + done, left);
+			if (rc > 0)
+				done += rc;
+		}
+		else
+		{
+			rc = co_await asyncRecvBuffer();
+			if (rc > 0)
+			{
+				myReadEnd += rc;
+				done += takeBuffered(dst + done, left);
+			}
+		}
+		if (rc < 0)
+			co_return -1;
+		if (rc == 0)
+			break;
+	}
+	co_return done;
+}
+
+IOSubCoroutine<ssize_t>
+IOTask::asyncReadUntil(
+	std::string &out,
+	char delim)
+{
+	size_t done = 0;
+	while (true)
+	{
+		size_t count = myReadEnd - myReadPos;
+		if (count > 0)
+		{
+			const char *begin = myReadBuf.get() + myReadPos;
+			const char *end = (const char *)memchr(begin, delim, count);
+			if (end != nullptr)
+				count = end - begin + 1;
+			out.append(begin, count);
+			myReadPos += count;
+			done += count;
+			if (end != nullptr)
+				break;
+		}
+		ssize_t rc = co_await asyncRecvBuffer();
+		if (rc < 0)
+			co_return -1;
+		if (rc == 0)
+			break;
+		myReadEnd += rc;
+	}
+	co_return done;
+}
+
+IOSubCoroutine<ssize_t>
+IOTask::asyncWriteAll(
+	const void *data,
+	size_t size)
+{
+	const char *src = (const char *)data;
+	size_t done = 0;
+	while (done < size)
+	{
+		ssize_t rc = co_await asyncSend(src + done, size - done);
+		if (rc < 0)
+			co_return -1;
+		done += rc;
+	}
+	co_return done;
+}
+
+IOSubCoroutine<ssize_t>
+IOTask::asyncWriteAllV(
+	iovec *vecs,
+	int count)
+{
+	size_t done = 0;
+	while (count > 0)
+	{
+		// Skip the empty ones, including those sent fully.
+		if (vecs->iov_len == 0)
+		{
+			++vecs;
+			--count;
+			continue;
+		}
+		ssize_t rc = co_await asyncSendv(vecs, count);
+		if (rc < 0)
+			co_return -1;
+		done += rc;
+		size_t sent = rc;
+		while (sent > 0)
+		{
+			size_t step = std::min(sent, vecs->iov_len);
+			vecs->iov_base = (char *)vecs->iov_base + step;
+			vecs->iov_len -= step;
+			sent -= step;
+			if (vecs->iov_len == 0)
+			{
+				++vecs;
+				--count;
+			}
+		}
+	}
+	co_return done;
+}
+
+size_t
+IOTask::takeBuffered(
+	void *data,
+	size_t size)
+{
+	size_t count = std::min(size, myReadEnd - myReadPos);
+	if (count == 0)
+		return 0;
+	memcpy(data, myReadBuf.get() + myReadPos, count);
+	myReadPos += count;
+	return count;
+}
+
+AsyncRecv
+IOTask::asyncRecvBuffer()
+{
+	assert(myReadPos == myReadEnd);
+	if (!myReadBuf)
+		myReadBuf.reset(new char[theTaskReadBufSize]);
+	myReadPos = 0;
+	myReadEnd = 0;
+	return asyncRecv(myReadBuf.get(), theTaskReadBufSize);
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
-IOCore::IOCore()
-	: myFd(epoll_create1(0))
+template<typename T>
+bool
+IOCore::stackPush(
+	std::atomic<T *>& stack,
+	T *item)
+{
+	T *head = stack.load(std::memory_order_relaxed);
+	do
+	{
+		item->myNext = head;
+	} while (!stack.compare_exchange_weak(head, item, std::memory_order_release,
+		std::memory_order_relaxed));
+	return head == nullptr;
+}
+
+template<typename T>
+T *
+IOCore::stackTakeAll(
+	std::atomic<T *>& stack)
+{
+	if (stack.load(std::memory_order_relaxed) == nullptr)
+		return nullptr;
+	T *head = stack.exchange(nullptr, std::memory_order_acquire);
+	// The stack has the newest items first.
+	T *res = nullptr;
+	while (head != nullptr)
+	{
+		T *item = head;
+		head = item->myNext;
+		item->myNext = res;
+		res = item;
+	}
+	return res;
+}
+
+IOCore::IOCore(
+	IOCoreBackend backend)
+	: myFd(-1)
+	, myEpollBatchSize(0)
+	, myLoad(0)
+	, myQueue(nullptr)
+	, myCalls(nullptr)
+	, myWakeTime(IOClock::now())
 {
 	LOG_DEBUG("IOCore create");
 	myIsStopped = false;
-	// Eventfd is used to wakeup from epoll_wait() for handling non-kernel events. For
-	// example, to let IOCore know, that there are new or deleting tasks to process.
+	if (backend == IO_CORE_BACKEND_URING)
+	{
+		myRing = std::make_unique<IOUring>();
+		if (!myRing->open())
+		{
+			LOG_DEBUG("IOCore io_uring is not available: " << strerror(errno));
+			myRing.reset();
+		}
+	}
+	if (!myRing)
+	{
+		myFd = epoll_create1(0);
+		assert(myFd >= 0);
+		myEpollBatchSize = theEpollBatchMinSize;
+		myEpollEvents.reset(new epoll_event[myEpollBatchSize]);
+	}
+	// Eventfd is used to wakeup from epoll_wait() or from the ring for handling non-kernel
+	// events. For example, to let IOCore know, that there are new or deleting tasks to
+	// process.
 	myEventFd = eventfd(0, EFD_NONBLOCK);
 	myEventSub = subscribe(myEventFd);
 }
@@ -268,15 +1066,36 @@ IOCore::IOCore()
 IOCore::~IOCore()
 {
 	LOG_DEBUG("IOCore destroy");
+	// The core might have never rolled. Then the eventfd task isn't added yet.
+	processQueues();
 	unsubscribe(myEventSub);
 	myEventSub = nullptr;
 	myEventFd = -1;
 	processQueues();
+	if (myRing)
+	{
+		// The kernel might still write into the wakeup buffer, and the cancelled
+		// operations still use their tasks. Wait for them all before closing the ring.
+		if (myRing->myIsWakeupPending)
+		{
+			io_uring_sqe *sqe = myRing->getSqe();
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->addr = theUringDataWakeup;
+			sqe->user_data = theUringDataIgnore;
+		}
+		while (myRing->myInFlightCount > 0)
+			reapUring(-1);
+		myRing.reset();
+	}
 	assert(myTasks.empty());
-	assert(myQueue.empty());
-	assert(myFd >= 0);
-	int rc = close(myFd);
-	assert(rc == 0);
+	assert(myTimers.empty());
+	assert(myQueue.load(std::memory_order_relaxed) == nullptr);
+	assert(myCalls.load(std::memory_order_relaxed) == nullptr);
+	if (myFd >= 0)
+	{
+		int rc = close(myFd);
+		assert(rc == 0);
+	}
 }
 
 void
@@ -291,54 +1110,96 @@ IOTask *
 IOCore::subscribe(
 	int fd)
 {
-	std::unique_lock lock(myMutex);
-	for (IOTask *s : myTasks)
-		assert(s->myFd != fd);
-	for (IOTask *s : myQueue)
-		assert(s->myFd != fd);
+	if (myRing)
+	{
+		// Io_uring doesn't wait on a non-blocking fd. It returns EAGAIN right away.
+		int flags = fcntl(fd, F_GETFL, 0);
+		assert(flags >= 0);
+		if ((flags & O_NONBLOCK) != 0)
+		{
+			int rc = fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+			assert(rc == 0);
+			MAYBE_UNUSED(rc);
+		}
+	}
 	IOTask *s = new IOTask(*this, fd);
-	myQueue.push_back(s);
-	mySize.fetch_add(1, std::memory_order_relaxed);
-	wakeup();
+	myLoad.fetch_add(1, std::memory_order_relaxed);
+	pushQueue(s);
 	return s;
 }
 
-void
+bool
 IOCore::unsubscribe(
 	IOTask *s)
 {
-	std::unique_lock lock(myMutex);
-	for (IOTask *is : myQueue)
-		assert(is != s);
-	assert(myTasks[s->myIdx] == s);
-	assert(s->myState == IO_TASK_STATE_WORKING);
-	s->myState = IO_TASK_STATE_DELETING;
-	myQueue.push_back(s);
-	mySize.fetch_add(1, std::memory_order_relaxed);
-	wakeup();
+	// The task can't be in the queue twice. It has to be added before it is deleted.
+	IOTaskState state = IO_TASK_STATE_WORKING;
+	if (!s->myState.compare_exchange_strong(state, IO_TASK_STATE_DELETING))
+	{
+		assert(state == IO_TASK_STATE_DELETING);
+		return false;
+	}
+	assert(s->myNext == nullptr);
+	myLoad.fetch_sub(1, std::memory_order_relaxed);
+	pushQueue(s);
+	return true;
+}
+
+void
+IOCore::pushQueue(
+	IOTask *s)
+{
+	// Only the first task in an empty queue needs a wakeup. When the queue is not empty,
+	// its first pusher either did the wakeup already or is going to. And roll() takes
+	// all the queue after that wakeup anyway.
+	if (stackPush(myQueue, s))
+		wakeup();
+}
+
+void
+IOCore::post(
+	std::function<void()>&& func)
+{
+	myLoad.fetch_add(1, std::memory_order_relaxed);
+	IOCoreCall *call = new IOCoreCall{std::move(func), nullptr};
+	// Same as with the tasks, one wakeup per non-empty queue.
+	if (stackPush(myCalls, call))
+		wakeup();
 }
 
 void
 IOCore::roll()
 {
+	theCurrent = this;
+	myStats.myRollCount.add(1);
 	processQueues();
-	epoll_event evs[theEpollBatchSize];
-	int rc = epoll_wait(myFd, evs, theEpollBatchSize, -1);
-	if (rc < 0 && errno == EINTR)
+	int timeoutMs = processTimers();
+	if (myRing)
+	{
+		rollUring(timeoutMs);
+		processTimers();
 		return;
+	}
+	epoll_event *evs = myEpollEvents.get();
+	IOClock::time_point waitBegin = IOClock::now();
+	int rc = epoll_wait(myFd, evs, myEpollBatchSize, timeoutMs);
+	statsAddWait(waitBegin, IOClock::now());
+	if (rc < 0 && errno == EINTR)
+		rc = 0;
 	assert(rc >= 0);
+	statsAddEvents(rc);
 	LOG_THIS_DEBUG(IOCore, roll, rc << " events");
+	// First all the events are saved into their tasks, and only then the operations are
+	// handled. So when a resumed coroutine goes to another task of the same batch, its
+	// new operation is done right away instead of being suspended till the event.
 	for (int i = 0; i < rc; ++i)
 	{
-		epoll_event& ev = evs[i];
-		IOTask *s = (IOTask *)ev.data.ptr;
-		int mask = 0;
-		if ((ev.events & EPOLLIN) != 0)
-			mask |= IO_EVENT_READ;
-		if ((ev.events & EPOLLOUT) != 0)
-			mask |= IO_EVENT_WRITE;
+		const epoll_event& ev = evs[i];
 		assert((ev.events & ~(EPOLLIN | EPOLLOUT)) == 0);
+		static_assert((int)IO_EVENT_READ == EPOLLIN && (int)IO_EVENT_WRITE == EPOLLOUT >> 1);
+		int mask = (ev.events & EPOLLIN) | ((ev.events & EPOLLOUT) >> 1);
 		assert(mask != 0);
+#if IO_IS_LOG_DEBUG
 		const char *eventStr = "[empty]";
 		if ((mask & IO_EVENT_READ) && (mask & IO_EVENT_WRITE))
 		{
@@ -353,7 +1214,14 @@ IOCore::roll()
 			eventStr = "[write]";
 		}
 		LOG_THIS_DEBUG(IOCore, roll, "event " << i << ": " << eventStr);
-		s->myEventsReady |= mask;
+#endif
+		((IOTask *)ev.data.ptr)->myEventsReady |= mask;
+	}
+	for (int i = 0; i < rc; ++i)
+	{
+		IOTask *s = (IOTask *)evs[i].data.ptr;
+		// The task is dropped only in processQueues(), so it is still alive here. But the
+		// operation could be done already by a coroutine resumed earlier in the batch.
 		AsyncOperation* op = s->myAsyncOp;
 		if (op != nullptr)
 		{
@@ -365,33 +1233,250 @@ IOCore::roll()
 				s->myAsyncOp = op;
 		}
 	}
+	if (rc == myEpollBatchSize && myEpollBatchSize < theEpollBatchMaxSize)
+	{
+		myEpollBatchSize *= 2;
+		myEpollEvents.reset(new epoll_event[myEpollBatchSize]);
+		LOG_THIS_DEBUG(IOCore, roll, "batch size " << myEpollBatchSize);
+	}
+	processTimers();
 }
 
 void
-IOCore::processQueues()
+IOCore::addTimer(
+	IOTimer *t,
+	IOClock::duration timeout)
 {
-	if (mySize.load(std::memory_order_relaxed) == 0)
-		return;
-	std::unique_lock lock(myMutex);
-	if (myQueue.empty())
+	assert(!t->isArmed());
+	t->myDeadline = IOClock::now() + timeout;
+	t->myHeapIdx = myTimers.size();
+	myTimers.push_back(t);
+	timerSiftUp(t->myHeapIdx);
+}
+
+void
+IOCore::removeTimer(
+	IOTimer *t)
+{
+	assert(t->isArmed());
+	assert(myTimers[t->myHeapIdx] == t);
+	int idx = t->myHeapIdx;
+	IOTimer *last = myTimers.back();
+	myTimers.pop_back();
+	t->myHeapIdx = -1;
+	if (last == t)
 		return;
-	for (IOTask *s : myQueue)
+	myTimers[idx] = last;
+	last->myHeapIdx = idx;
+	timerSiftUp(idx);
+	timerSiftDown(last->myHeapIdx);
+}
+
+int
+IOCore::processTimers()
+{
+	if (myTimers.empty())
+		return -1;
+	IOClock::time_point now = IOClock::now();
+	while (!myTimers.empty())
 	{
+		IOTimer *t = myTimers[0];
+		if (t->myDeadline > now)
+		{
+			// Round up, not to wake up a bit too early and spin then.
+			auto left = std::chrono::ceil<std::chrono::milliseconds>(t->myDeadline - now);
+			return (int)left.count();
+		}
+		removeTimer(t);
+		// Can resume a coroutine, which in turn can add or remove the timers.
+		t->onTimer();
+	}
+	return -1;
+}
+
+void
+IOCore::timerSiftUp(
+	int idx)
+{
+	IOTimer *t = myTimers[idx];
+	while (idx > 0)
+	{
+		int parentIdx = (idx - 1) / 2;
+		IOTimer *parent = myTimers[parentIdx];
+		if (parent->myDeadline <= t->myDeadline)
+			break;
+		myTimers[idx] = parent;
+		parent->myHeapIdx = idx;
+		idx = parentIdx;
+	}
+	myTimers[idx] = t;
+	t->myHeapIdx = idx;
+}
+
+void
+IOCore::timerSiftDown(
+	int idx)
+{
+	IOTimer *t = myTimers[idx];
+	int count = myTimers.size();
+	while (true)
+	{
+		int childIdx = idx * 2 + 1;
+		if (childIdx >= count)
+			break;
+		if (childIdx + 1 < count &&
+			myTimers[childIdx + 1]->myDeadline < myTimers[childIdx]->myDeadline)
+			++childIdx;
+		IOTimer *child = myTimers[childIdx];
+		if (t->myDeadline <= child->myDeadline)
+			break;
+		myTimers[idx] = child;
+		child->myHeapIdx = idx;
+		idx = childIdx;
+	}
+	myTimers[idx] = t;
+	t->myHeapIdx = idx;
+}
+
+void
+IOCore::rollUring(
+	int timeoutMs)
+{
+	if (!myRing->myIsWakeupPending)
+	{
+		io_uring_sqe *sqe = myRing->getSqe();
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = myEventFd;
+		sqe->addr = (uint64_t)&myRing->myWakeupBuf;
+		sqe->len = sizeof(myRing->myWakeupBuf);
+		sqe->user_data = theUringDataWakeup;
+		myRing->myIsWakeupPending = true;
+		++myRing->myInFlightCount;
+	}
+	reapUring(timeoutMs);
+}
+
+void
+IOCore::reapUring(
+	int timeoutMs)
+{
+	IOClock::time_point waitBegin = IOClock::now();
+	myRing->wait(timeoutMs);
+	statsAddWait(waitBegin, IOClock::now());
+	uint64_t eventCount = 0;
+	io_uring_cqe *cqe;
+	while (true)
+	{
+		cqe = myRing->peek();
+		if (cqe == nullptr)
+		{
+			// The resumed coroutines could cancel some operations. The kernel cancels
+			// a socket operation right in the submission, so one more non-blocking
+			// enter resumes them in this same roll.
+			if (myRing->myCancelCount == 0 || !myRing->hasUnsubmitted())
+				break;
+			myRing->wait(0);
+			continue;
+		}
+		uint64_t data = cqe->user_data;
+		int res = cqe->res;
+		myRing->seen();
+		++eventCount;
+		if (data == theUringDataIgnore)
+			continue;
+		--myRing->myInFlightCount;
+		if (data == theUringDataWakeup)
+		{
+			myRing->myIsWakeupPending = false;
+			continue;
+		}
+		AsyncOperation *op = (AsyncOperation *)data;
+		IOTask *s = op->myTask;
+		assert(s->myAsyncOp == op);
+		s->myAsyncOp = nullptr;
+		if (op->myCancelErr != 0)
+		{
+			--myRing->myCancelCount;
+			if (res == -ECANCELED)
+				res = -op->myCancelErr;
+		}
+		// The task is already dropped by processQueues(), which left the deletion for
+		// when the kernel is done with it.
+		bool isDropped = s->myState == IO_TASK_STATE_DELETING && s->myIdx < 0;
+		op->onComplete(res);
+		if (isDropped)
+			delete s;
+	}
+	statsAddEvents(eventCount);
+}
+
+void
+IOCore::statsAddWait(
+	IOClock::time_point begin,
+	IOClock::time_point end)
+{
+	using std::chrono::nanoseconds;
+	myStats.myBusyNs.add(std::chrono::duration_cast<nanoseconds>(begin - myWakeTime).count());
+	myStats.myWaitNs.add(std::chrono::duration_cast<nanoseconds>(end - begin).count());
+	myWakeTime = end;
+}
+
+void
+IOCore::statsAddEvents(
+	uint64_t count)
+{
+	myStats.myEventCount.add(count);
+	myStats.myEventsPerRoll.add(count);
+}
+
+void
+IOCore::submit(
+	AsyncOperation *op)
+{
+	io_uring_sqe *sqe = myRing->getSqe();
+	op->prepare(*sqe);
+	sqe->user_data = (uint64_t)op;
+	++myRing->myInFlightCount;
+}
+
+void
+IOCore::cancel(
+	AsyncOperation *op)
+{
+	io_uring_sqe *sqe = myRing->getSqe();
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = (uint64_t)op;
+	sqe->user_data = theUringDataIgnore;
+	++myRing->myCancelCount;
+}
+
+void
+IOCore::processQueues()
+{
+	IOTask *next = stackTakeAll(myQueue);
+	while (next != nullptr)
+	{
+		IOTask *s = next;
+		next = s->myNext;
+		s->myNext = nullptr;
 		if (s->myState == IO_TASK_STATE_NEW)
 		{
 			LOG_THIS_DEBUG(IOCore, processQueues, "add " << s);
 			s->myState = IO_TASK_STATE_WORKING;
+			s->myIdx = myTasks.size();
+			myTasks.push_back(s);
+			// Io_uring doesn't need any readiness.
+			if (myRing)
+				continue;
 			// Assume that in a new socket all the events are there. The task will clear
 			// those which are not really available yet.
 			s->myEventsReady = IO_EVENT_READ | IO_EVENT_WRITE;
-			s->myIdx = myTasks.size();
 			epoll_event ev;
 			memset(&ev, 0, sizeof(ev));
 			ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
 			ev.data.ptr = (void *)s;
 			int rc = epoll_ctl(myFd, EPOLL_CTL_ADD, s->myFd, &ev);
 			assert(rc == 0);
-			myTasks.push_back(s);
 		}
 		else if (s->myState == IO_TASK_STATE_DELETING)
 		{
@@ -402,23 +1487,143 @@ IOCore::processQueues()
 			// Cyclic deletion, for O(1).
 			myTasks.back()->myIdx = s->myIdx;
 			myTasks[s->myIdx] = myTasks.back();
-			int rc = epoll_ctl(myFd, EPOLL_CTL_DEL, s->myFd, nullptr);
-			assert(rc == 0);
-			if (s->myAsyncOp != nullptr)
+			myTasks.resize(myTasks.size() - 1);
+			s->myIdx = -1;
+			if (myRing)
 			{
-				LOG_THIS_DEBUG(IOCore, processQueues, "cancel " << s);
-				s->myEventsReady = 0;
-				s->myAsyncOp->onIOEvent();
-				s->myAsyncOp = nullptr;
+				if (s->myAsyncOp != nullptr)
+				{
+					// The kernel still uses the operation and the task. The task is
+					// deleted when the operation completes. The cancellation could be
+					// sent already by close().
+					LOG_THIS_DEBUG(IOCore, processQueues, "cancel " << s);
+					s->myAsyncOp->cancel(ECANCELED);
+					continue;
+				}
+			}
+			else
+			{
+				int rc = epoll_ctl(myFd, EPOLL_CTL_DEL, s->myFd, nullptr);
+				assert(rc == 0);
+				if (s->myAsyncOp != nullptr)
+				{
+					LOG_THIS_DEBUG(IOCore, processQueues, "cancel " << s);
+					s->myAsyncOp->cancel(ECANCELED);
+				}
 			}
 			delete s;
-			myTasks.resize(myTasks.size() - 1);
 		}
 		else
 		{
 			assert(false);
 		}
 	}
-	myQueue.clear();
-	mySize.store(myTasks.size(), std::memory_order_relaxed);
+	IOCoreCall *call = stackTakeAll(myCalls);
+	while (call != nullptr)
+	{
+		IOCoreCall *next = call->myNext;
+		call->myFunc();
+		delete call;
+		myLoad.fetch_sub(1, std::memory_order_relaxed);
+		call = next;
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+IOCoroutine
+IOTaskGroup::runChild(
+	IOTaskGroup *group,
+	IOSubCoroutine<> child)
+{
+	co_await child;
+	assert(group->myCount > 0);
+	if (--group->myCount == 0 && group->myJoiner)
+		std::exchange(group->myJoiner, nullptr).resume();
+	co_return;
+}
+
+void
+IOTaskGroup::spawn(
+	IOSubCoroutine<> &&child)
+{
+	++myCount;
+	runChild(this, std::move(child));
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+IOCoreGroup::IOCoreGroup(
+	uint32_t count,
+	IOCoreGroupPick pick,
+	uint32_t firstCpu,
+	IOCoreBackend backend)
+	: myPick(pick)
+{
+	assert(count > 0);
+	uint32_t cpuCount = std::thread::hardware_concurrency();
+	if (cpuCount == 0)
+		cpuCount = 1;
+	for (uint32_t i = 0; i < count; ++i)
+		myCores.push_back(std::make_unique<IOCore>(backend));
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		IOCore *core = myCores[i].get();
+		myThreads.emplace_back([core]() {
+			while (!core->isStopped())
+				core->roll();
+		});
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET((firstCpu + i) % cpuCount, &cpus);
+		// Not fatal. The CPU might be not allowed for the process, it still works then.
+		int rc = pthread_setaffinity_np(myThreads.back().native_handle(), sizeof(cpus),
+			&cpus);
+		if (rc != 0)
+			LOG_DEBUG("IOCoreGroup couldn't pin a thread: " << strerror(rc));
+	}
+}
+
+IOCoreGroup::~IOCoreGroup()
+{
+	stop();
+}
+
+IOCore&
+IOCoreGroup::pick(
+	int fd)
+{
+	if (myPick == IO_CORE_GROUP_PICK_HASH)
+	{
+		// The fds are small sequential numbers. Multiplicative hash, so as the sockets of
+		// the same kind, like all even ones, don't end up in the same core.
+		uint32_t hash = (uint32_t)fd * 2654435761u;
+		return *myCores[(hash >> 16) % myCores.size()];
+	}
+	IOCore *res = myCores[0].get();
+	for (const std::unique_ptr<IOCore>& c : myCores)
+	{
+		if (c->load() < res->load())
+			res = c.get();
+	}
+	return *res;
+}
+
+void
+IOCoreGroup::post(
+	int fd,
+	std::function<void(IOCore&)>&& func)
+{
+	IOCore &core = pick(fd);
+	core.post([&core, func = std::move(func)]() { func(core); });
+}
+
+void
+IOCoreGroup::stop()
+{
+	for (std::unique_ptr<IOCore>& c : myCores)
+		c->stop();
+	for (std::thread& t : myThreads)
+		t.join();
+	myThreads.clear();
 }
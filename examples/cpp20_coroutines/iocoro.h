@@ -1,12 +1,22 @@
 #pragma once
 
 #include <atomic>
+#include <bit>
+#include <cassert>
+#include <cerrno>
+#include <chrono>
 #include <coroutine>
+#include <functional>
 #include <iostream>
-#include <mutex>
+#include <memory>
+#include <optional>
 #include <sstream>
+#include <string>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <thread>
+#include <utility>
 #include <vector>
 
 #define MAYBE_UNUSED(...) ((void)sizeof(1, ##__VA_ARGS__))
@@ -21,15 +31,29 @@
 
 #define LOG_NOP(...) MAYBE_UNUSED(std::cerr << __VA_ARGS__)
 
-// Enable the logging using LOG_IMPL if needed.
+// Set to 1 to enable the debug logging. Otherwise the code which is only needed for the
+// logs is compiled out.
+#ifndef IO_IS_LOG_DEBUG
+#define IO_IS_LOG_DEBUG 0
+#endif
+
+#if IO_IS_LOG_DEBUG
+#define LOG_DEBUG LOG_IMPL
+#else
 #define LOG_DEBUG LOG_NOP
-#define LOG_OBJ_DEBUG(name, obj, method, ...) LOG_NOP(#name "(" << obj << ")::" #method << ": " << __VA_ARGS__)
+#endif
+#define LOG_OBJ_DEBUG(name, obj, method, ...) LOG_DEBUG(#name "(" << obj << ")::" #method << ": " << __VA_ARGS__)
 #define LOG_THIS_DEBUG(name, ...) LOG_OBJ_DEBUG(name, this, __VA_ARGS__)
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
 class IOCore;
+class IOCoreGroup;
+template<typename Op> struct AsyncTimeout;
 class IOTask;
+struct IOUring;
+struct epoll_event;
+struct io_uring_sqe;
 
 enum IOEventBit
 {
@@ -37,6 +61,24 @@ enum IOEventBit
 	IO_EVENT_WRITE = 2,
 };
 
+enum IOCoreBackend
+{
+	// Readiness. An operation is tried, and on EAGAIN waits for an epoll event to retry.
+	IO_CORE_BACKEND_EPOLL,
+	// Completion. An operation is submitted to io_uring as is, and the coroutine is
+	// resumed from its completion. Falls back to epoll when io_uring is not available.
+	IO_CORE_BACKEND_URING,
+};
+
+enum IOOpType
+{
+	IO_OP_RECV,
+	IO_OP_SEND,
+	IO_OP_ACCEPT,
+	IO_OP_CONNECT,
+	IO_OP_TYPE_COUNT,
+};
+
 enum IOTaskState
 {
 	IO_TASK_STATE_NEW,
@@ -105,8 +147,251 @@ struct IOCoroutinePromise
 	void
 	unhandled_exception() { abort(); }
 
+	// The frames are reused from the per-thread pools of the freed ones. The heap is
+	// only used when a thread has no free frame of the needed size class yet.
+	static void *
+	operator new(
+		size_t size);
+
+	static void
+	operator delete(
+		void *ptr,
+		size_t size);
+
 	// Keep track of the promise count to ensure there are no memory leaks.
 	static std::atomic_int theCount;
+	// Frames allocated from the heap and reused from the pools.
+	static std::atomic_uint64_t theFrameHeapCount;
+	static std::atomic_uint64_t theFramePoolCount;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// A coroutine which can be awaited by another coroutine: co_await sub(...). It is lazy,
+// starts only when awaited, and returns right into its caller when done. Both are the
+// symmetric transfers, so a chain of the nested ones doesn't grow the stack. Each takes
+// only its own frame, from the same pools as IOCoroutine.
+//
+// That allows to yield from any depth. Only the calls in between have to be
+// IOSubCoroutines too, not plain functions.
+//
+template<typename T>
+struct IOSubCoroutinePromise;
+
+template<typename T = void>
+class IOSubCoroutine
+{
+public:
+	using promise_type = IOSubCoroutinePromise<T>;
+
+	explicit IOSubCoroutine(
+		std::coroutine_handle<promise_type> coro) : myCoro(coro) {}
+	IOSubCoroutine(
+		IOSubCoroutine &&other) noexcept : myCoro(std::exchange(other.myCoro, nullptr)) {}
+	IOSubCoroutine(
+		const IOSubCoroutine&) = delete;
+	IOSubCoroutine& operator=(
+		const IOSubCoroutine&) = delete;
+
+	// The frame lives until the end of the co_await expression. Then the result is
+	// already taken.
+	~IOSubCoroutine()
+	{
+		if (myCoro)
+			myCoro.destroy();
+	}
+
+	bool
+	await_ready() const noexcept { return false; }
+
+	// Start the sub-coroutine instead of returning to the caller's resumer.
+	std::coroutine_handle<>
+	await_suspend(
+		std::coroutine_handle<> caller) noexcept
+	{
+		myCoro.promise().myCaller = caller;
+		return myCoro;
+	}
+
+	T
+	await_resume() { return myCoro.promise().takeResult(); }
+
+private:
+	std::coroutine_handle<promise_type> myCoro;
+};
+
+struct IOSubCoroutinePromiseBase
+{
+	// Continue the caller. It is the one waiting for this coroutine.
+	struct FinalAwaiter
+	{
+		bool
+		await_ready() noexcept { return false; }
+
+		template<typename Promise>
+		std::coroutine_handle<>
+		await_suspend(
+			std::coroutine_handle<Promise> coro) noexcept
+		{ return coro.promise().myCaller; }
+
+		void
+		await_resume() noexcept {}
+	};
+
+	// The sub-coroutines are counted together with the root ones.
+	IOSubCoroutinePromiseBase()
+	{ IOCoroutinePromise::theCount.fetch_add(1, std::memory_order_relaxed); }
+	~IOSubCoroutinePromiseBase()
+	{ IOCoroutinePromise::theCount.fetch_sub(1, std::memory_order_relaxed); }
+
+	std::suspend_always
+	initial_suspend() noexcept { return {}; }
+
+	FinalAwaiter
+	final_suspend() noexcept { return {}; }
+
+	void
+	unhandled_exception() { abort(); }
+
+	static void *
+	operator new(
+		size_t size) { return IOCoroutinePromise::operator new(size); }
+
+	static void
+	operator delete(
+		void *ptr,
+		size_t size) { IOCoroutinePromise::operator delete(ptr, size); }
+
+	std::coroutine_handle<> myCaller;
+};
+
+template<typename T>
+struct IOSubCoroutinePromise : public IOSubCoroutinePromiseBase
+{
+	IOSubCoroutine<T>
+	get_return_object()
+	{
+		return IOSubCoroutine<T>(
+			std::coroutine_handle<IOSubCoroutinePromise>::from_promise(*this));
+	}
+
+	void
+	return_value(
+		T value) { myResult.emplace(std::move(value)); }
+
+	T
+	takeResult() { return std::move(*myResult); }
+
+	std::optional<T> myResult;
+};
+
+template<>
+struct IOSubCoroutinePromise<void> : public IOSubCoroutinePromiseBase
+{
+	IOSubCoroutine<void>
+	get_return_object()
+	{
+		return IOSubCoroutine<void>(
+			std::coroutine_handle<IOSubCoroutinePromise>::from_promise(*this));
+	}
+
+	void
+	return_void() {}
+
+	void
+	takeResult() {}
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+using IOClock = std::chrono::steady_clock;
+
+// A deadline in the IOCore's timer heap. onTimer() is called in the core's thread once
+// the deadline has passed. A timer is only used in the thread of its core.
+//
+struct IOTimer
+{
+	IOTimer() : myHeapIdx(-1) {}
+	IOTimer(
+		const IOTimer&) = delete;
+	IOTimer& operator=(
+		const IOTimer&) = delete;
+
+	bool
+	isArmed() const { return myHeapIdx >= 0; }
+
+private:
+	virtual void
+	onTimer() = 0;
+
+	IOClock::time_point myDeadline;
+	// Position in the heap, or -1 when not armed.
+	int myHeapIdx;
+
+	friend IOCore;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// A counter with one writer thread and any number of readers. The writer doesn't need an
+// atomic increment, so it costs as much as a plain one.
+//
+struct IOStatCounter
+{
+	IOStatCounter() : myValue(0) {}
+
+	void
+	add(
+		uint64_t value)
+	{
+		myValue.store(myValue.load(std::memory_order_relaxed) + value,
+			std::memory_order_relaxed);
+	}
+
+	uint64_t
+	get() const { return myValue.load(std::memory_order_relaxed); }
+
+private:
+	std::atomic_uint64_t myValue;
+};
+
+// Histogram with a bucket per power of 2. The bucket i has the values of i bits: 0, 1,
+// 2-3, 4-7, and so on. Same one writer as the counter.
+//
+struct IOStatHistogram
+{
+	static constexpr int theBucketCount = 65;
+
+	void
+	add(
+		uint64_t value) { myBuckets[std::bit_width(value)].add(1); }
+
+	uint64_t
+	count() const;
+
+	// The upper bound of the bucket where the given share (0..1) of the values ends.
+	uint64_t
+	percentile(
+		double share) const;
+
+	IOStatCounter myBuckets[theBucketCount];
+};
+
+// Statistics of an IOCore. Are updated only in the core's thread, and can be read from
+// any thread at any time without locks. A reader can see the counters from slightly
+// different moments.
+//
+struct IOCoreStats
+{
+	IOStatCounter myRollCount;
+	// Epoll events or io_uring completions.
+	IOStatCounter myEventCount;
+	IOStatHistogram myEventsPerRoll;
+	// Handling the events and the queues, versus sleeping in the kernel.
+	IOStatCounter myBusyNs;
+	IOStatCounter myWaitNs;
+	// From a suspension of an operation till its coroutine's resume.
+	IOStatHistogram myOpWaitNs[IO_OP_TYPE_COUNT];
 };
 
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -114,7 +399,8 @@ struct IOCoroutinePromise
 struct AsyncOperation
 {
 	AsyncOperation(
-		IOTask *sub);
+		IOTask *sub,
+		IOOpType type);
 	AsyncOperation(
 		const AsyncOperation&) = delete;
 	AsyncOperation& operator=(
@@ -131,11 +417,43 @@ private:
 	virtual bool
 	onIOEvent() = 0;
 
+	// io_uring. Fill the request for the kernel.
+	virtual void
+	prepare(
+		io_uring_sqe &sqe) = 0;
+
+	// The operation is done, with the result >= 0 or -errno. Io_uring completions and the
+	// timeouts come here.
+	virtual void
+	onComplete(
+		int res) = 0;
+
+	// The deadline of withTimeout() has passed. The operation is cancelled.
+	void
+	onTimeout() { cancel(ETIMEDOUT); }
+
+	// End the operation with -1 and the given errno. With epoll the coroutine is resumed
+	// right away. With io_uring the kernel still uses the operation, and it is resumed
+	// from the completion. Only the first cancellation counts.
+	void
+	cancel(
+		int err);
+
 protected:
+	// Resume the suspended coroutine. The wait is counted in the core's stats.
+	void
+	resume();
+
 	IOTask *const myTask;
+	const IOOpType myType;
 	std::coroutine_handle<> myCoro;
+	IOClock::time_point mySuspendTime;
+	// Errno of the cancellation, or 0.
+	int myCancelErr;
 
 	friend IOCore;
+	friend IOTask;
+	template<typename Op> friend struct AsyncTimeout;
 };
 
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -166,6 +484,14 @@ private:
 	bool
 	onIOEvent() final;
 
+	void
+	prepare(
+		io_uring_sqe &sqe) final;
+
+	void
+	onComplete(
+		int res) final;
+
 	void *const myData;
 	const size_t mySize;
 	ssize_t myRes;
@@ -197,6 +523,14 @@ private:
 	bool
 	onIOEvent() final;
 
+	void
+	prepare(
+		io_uring_sqe &sqe) final;
+
+	void
+	onComplete(
+		int res) final;
+
 	const void *const myData;
 	const size_t mySize;
 	ssize_t myRes;
@@ -204,6 +538,85 @@ private:
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
+// Vectored recv and send. Like the plain ones, they can return less than the total size.
+// The iovecs and the data must stay alive until the operation is done.
+//
+struct AsyncRecvV final : public AsyncOperation
+{
+	AsyncRecvV(
+		IOTask *sub,
+		const iovec *vecs,
+		int count);
+	AsyncRecvV(
+		const AsyncRecvV&) = delete;
+	AsyncRecvV& operator=(
+		const AsyncRecvV&) = delete;
+
+	bool
+	await_ready() const noexcept { return myRes >= 0; }
+
+	ssize_t
+	await_resume() { return myRes; }
+
+private:
+	void
+	execute();
+
+	bool
+	onIOEvent() final;
+
+	void
+	prepare(
+		io_uring_sqe &sqe) final;
+
+	void
+	onComplete(
+		int res) final;
+
+	msghdr myMsg;
+	ssize_t myRes;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+struct AsyncSendV final : public AsyncOperation
+{
+	AsyncSendV(
+		IOTask *sub,
+		const iovec *vecs,
+		int count);
+	AsyncSendV(
+		const AsyncSendV&) = delete;
+	AsyncSendV& operator=(
+		const AsyncSendV&) = delete;
+
+	bool
+	await_ready() const noexcept { return myRes >= 0; }
+
+	ssize_t
+	await_resume() { return myRes; }
+
+private:
+	void
+	execute();
+
+	bool
+	onIOEvent() final;
+
+	void
+	prepare(
+		io_uring_sqe &sqe) final;
+
+	void
+	onComplete(
+		int res) final;
+
+	msghdr myMsg;
+	ssize_t myRes;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
 struct AsyncAccept final : public AsyncOperation
 {
 	AsyncAccept(
@@ -228,6 +641,14 @@ private:
 	bool
 	onIOEvent() final;
 
+	void
+	prepare(
+		io_uring_sqe &sqe) final;
+
+	void
+	onComplete(
+		int res) final;
+
 	sockaddr *const myAddr;
 	socklen_t *const mySize;
 	int myRes;
@@ -256,12 +677,49 @@ private:
 	bool
 	onIOEvent() final;
 
+	void
+	prepare(
+		io_uring_sqe &sqe) final;
+
+	void
+	onComplete(
+		int res) final;
+
+	const sockaddr *const myAddr;
+	const socklen_t mySize;
 	bool myIsDone;
 	int myRes;
 };
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
+struct AsyncSleep final : public IOTimer
+{
+	AsyncSleep(
+		IOCore &core,
+		IOClock::duration duration) : myCore(core), myDuration(duration) {}
+
+	bool
+	await_ready() const noexcept { return myDuration <= IOClock::duration::zero(); }
+
+	void
+	await_suspend(
+		std::coroutine_handle<> coro);
+
+	void
+	await_resume() {}
+
+private:
+	void
+	onTimer() final { myCoro.resume(); }
+
+	IOCore &myCore;
+	const IOClock::duration myDuration;
+	std::coroutine_handle<> myCoro;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
 class IOTask
 {
 public:
@@ -271,9 +729,19 @@ public:
 
 	~IOTask();
 
+	// Unsubscribe the task. Can be done from any thread. In the thread of the core the
+	// pending operation is cancelled right away, like with cancel(). Then the coroutine
+	// is resumed before the task is dropped. If it closes the task too, that is ignored.
 	void
 	close();
 
+	// End the pending operation, if any, with -1 and ECANCELED. With epoll the coroutine
+	// is resumed right inside the call. With io_uring it is resumed within the same
+	// roll(), when the kernel cancels the operation right away, as it does for the
+	// sockets. The task stays usable. Only in the thread of the core.
+	void
+	cancel();
+
 	IOCore&
 	core() { return myCore; }
 
@@ -286,44 +754,119 @@ public:
 	AsyncSend
 	asyncSend(const void *data, size_t size) { return AsyncSend(this, data, size); }
 
+	AsyncRecvV
+	asyncRecvv(const iovec *vecs, int count) { return AsyncRecvV(this, vecs, count); }
+
+	AsyncSendV
+	asyncSendv(const iovec *vecs, int count) { return AsyncSendV(this, vecs, count); }
+
 	AsyncAccept
 	asyncAccept(sockaddr *addr, socklen_t *size) { return AsyncAccept(this, addr, size); }
 
 	AsyncConnect
 	asyncConnect(const sockaddr *addr, socklen_t size) { return AsyncConnect(this, addr, size); }
+
+	// Buffered stream IO. The data is received in big chunks into the task's buffer, and
+	// the small reads take it from there without any syscalls. The buffered reads
+	// shouldn't be mixed with asyncRecv(), unless bufferedSize() is 0.
+	//
+	// Returns the size, or less on EOF, or -1 on an error.
+	IOSubCoroutine<ssize_t>
+	asyncReadExactly(
+		void *data,
+		size_t size);
+
+	// Append the data to 'out' up to and including the delimiter. Returns the appended
+	// size. On EOF it is the rest of the stream, without the delimiter. -1 on an error.
+	IOSubCoroutine<ssize_t>
+	asyncReadUntil(
+		std::string &out,
+		char delim);
+
+	// Send all the data, with as many sends as needed. Returns the size, or -1 on an
+	// error.
+	IOSubCoroutine<ssize_t>
+	asyncWriteAll(
+		const void *data,
+		size_t size);
+
+	// Send all the iovecs, with as many sendmsgs as needed. A partial send moves on to the
+	// unsent rest, across the iovec boundaries. The iovecs are changed for that. Returns
+	// the total size, or -1 on an error.
+	IOSubCoroutine<ssize_t>
+	asyncWriteAllV(
+		iovec *vecs,
+		int count);
 	//
 	//////////////////////////////////////////////
 
+	// Received, but not read yet.
+	size_t
+	bufferedSize() const { return myReadEnd - myReadPos; }
+
 	static std::atomic_int theCount;
 
 private:
-	IOTaskState myState;
+	// Take what is buffered, up to the size.
+	size_t
+	takeBuffered(
+		void *data,
+		size_t size);
+
+	// Receive into the empty read buffer.
+	AsyncRecv
+	asyncRecvBuffer();
+
+	// Atomic, because unsubscribe() can be called from any thread.
+	std::atomic<IOTaskState> myState;
 	const int myFd;
 	int myIdx;
+	// Link in the IOCore's queue of incoming tasks.
+	IOTask *myNext;
 	// Mask of events which are ready for consumption.
 	int myEventsReady;
 	// Currently waiting async operation blocked by a co_await. Coroutine can't be blocked
 	// more than once at a time, which means the current operation can only be one.
 	AsyncOperation* myAsyncOp;
 	IOCore &myCore;
+	// Buffer of the stream reads. Allocated on the first one.
+	std::unique_ptr<char[]> myReadBuf;
+	size_t myReadPos;
+	size_t myReadEnd;
 
 	friend AsyncAccept;
 	friend AsyncConnect;
 	friend AsyncOperation;
 	friend AsyncRecv;
+	friend AsyncRecvV;
 	friend AsyncSend;
+	friend AsyncSendV;
 	friend IOCore;
 };
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
+// A function to call in the thread of an IOCore. Linked into its queue of calls.
+struct IOCoreCall
+{
+	std::function<void()> myFunc;
+	IOCoreCall *myNext;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
 // Event loop + IO operations with C++ coroutine support.
 //
 struct IOCore
 {
-	IOCore();
+	IOCore(
+		IOCoreBackend backend = IO_CORE_BACKEND_EPOLL);
 	~IOCore();
 
+	// The backend really used. Could be not the requested one.
+	IOCoreBackend
+	backend() const { return myRing ? IO_CORE_BACKEND_URING : IO_CORE_BACKEND_EPOLL; }
+
 	void
 	wakeup();
 
@@ -339,29 +882,314 @@ struct IOCore
 		int fd);
 
 	// Destroy the task asynchronously. The memory will be freed, the task can't be used
-	// anymore after unsubscription.
-	void
+	// anymore after unsubscription. False when it is unsubscribed already.
+	bool
 	unsubscribe(
 		IOTask *s);
 
+	// Call the function in the thread doing roll(). Can be done from any thread. For
+	// example, to hand a socket over to this core and start a coroutine on it here.
+	void
+	post(
+		std::function<void()>&& func);
+
+	// Call the timer's onTimer() once the timeout has passed. In the core's thread only.
+	void
+	addTimer(
+		IOTimer *t,
+		IOClock::duration timeout);
+
+	void
+	removeTimer(
+		IOTimer *t);
+
+	// An argument for co_await.
+	AsyncSleep
+	asyncSleep(IOClock::duration duration) { return AsyncSleep(*this, duration); }
+
+	// The tasks and the not done calls. Good enough to find the least loaded core.
+	uint32_t
+	load() const { return myLoad.load(std::memory_order_relaxed); }
+
+	// Can be read from any thread.
+	const IOCoreStats&
+	stats() const { return myStats; }
+
 	// Get all pending events from the kernel and handle them. Can only be done in one
 	// thread at a time.
 	void
 	roll();
 
+	// The last core rolled in this thread.
+	static IOCore *
+	current() { return theCurrent; }
+
 private:
 	void
 	processQueues();
 
+	void
+	rollUring(
+		int timeoutMs);
+
+	// The kernel wait has gone from begin till end. The time before it since the previous
+	// wait is the busy one.
+	void
+	statsAddWait(
+		IOClock::time_point begin,
+		IOClock::time_point end);
+
+	void
+	statsAddEvents(
+		uint64_t count);
+
+	// Run the timers with the passed deadlines. Returns the milliseconds till the next
+	// deadline, or -1 when there are no timers.
+	int
+	processTimers();
+
+	void
+	timerSiftUp(
+		int idx);
+
+	void
+	timerSiftDown(
+		int idx);
+
+	// Ask io_uring to cancel the operation. It completes then with ECANCELED, unless
+	// it is done already.
+	void
+	cancel(
+		AsyncOperation *op);
+
+	// Wait for io_uring completions and handle them.
+	void
+	reapUring(
+		int timeoutMs);
+
+	// Send the operation to io_uring. Is resumed from roll().
+	void
+	submit(
+		AsyncOperation *op);
+
+	// Push a new or a deleting task to the incoming queue. Can be done from any thread.
+	void
+	pushQueue(
+		IOTask *s);
+
+	// Lock-free stack linked via myNext. Push is true when the stack was empty.
+	template<typename T>
+	static bool
+	stackPush(
+		std::atomic<T *>& stack,
+		T *item);
+
+	// Take all the stack in one exchange. The items come in the order of pushing.
+	template<typename T>
+	static T *
+	stackTakeAll(
+		std::atomic<T *>& stack);
+
 	int myEventFd;
 	IOTask *myEventSub;
+	// Epoll. Not used with io_uring.
 	int myFd;
+	// Events of one epoll_wait(). Grows while the batches come full.
+	std::unique_ptr<epoll_event[]> myEpollEvents;
+	int myEpollBatchSize;
+	// Io_uring, when it is used. The eventfd there is read by the ring itself.
+	std::unique_ptr<IOUring> myRing;
 	std::atomic_bool myIsStopped;
+	std::atomic_uint32_t myLoad;
 
-	std::mutex myMutex;
 	// Tasks currently in work.
 	std::vector<IOTask *> myTasks;
-	// Incoming tasks. New and deleting ones.
-	std::vector<IOTask *> myQueue;
-	std::atomic_uint64_t mySize;
+	// Incoming tasks. New and deleting ones. It is a lock-free stack, linked via the
+	// tasks themselves. Any thread can push, and roll() takes all of them in one
+	// exchange.
+	std::atomic<IOTask *> myQueue;
+	// Posted calls. The same kind of stack.
+	std::atomic<IOCoreCall *> myCalls;
+	// Min-heap of the timers by the deadline.
+	std::vector<IOTimer *> myTimers;
+	IOCoreStats myStats;
+	// When the last wait in the kernel ended. Everything since then is the busy time.
+	IOClock::time_point myWakeTime;
+
+	static thread_local IOCore *theCurrent;
+
+	friend AsyncOperation;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+enum IOCoreGroupPick
+{
+	// Hash of the fd. The same fd always goes to the same core.
+	IO_CORE_GROUP_PICK_HASH,
+	// The core with the smallest load().
+	IO_CORE_GROUP_PICK_LEAST_LOAD,
+};
+
+// A set of IOCores, one per thread, each thread pinned to its own CPU. The fds are spread
+// between the cores, and each fd is served by one core only. Then the cores don't share
+// anything, besides the calls posted to each other.
+//
+class IOCoreGroup
+{
+public:
+	// The threads take the CPUs starting from the given one, wrapping around the CPU
+	// count. The cores start rolling right away.
+	IOCoreGroup(
+		uint32_t count,
+		IOCoreGroupPick pick,
+		uint32_t firstCpu = 0,
+		IOCoreBackend backend = IO_CORE_BACKEND_EPOLL);
+	~IOCoreGroup();
+
+	uint32_t
+	size() const { return myCores.size(); }
+
+	IOCore&
+	core(uint32_t idx) { return *myCores[idx]; }
+
+	// Pick a core for a new fd.
+	IOCore&
+	pick(
+		int fd);
+
+	// Call the function in the thread of the core picked for the fd. It would usually
+	// subscribe the fd there and start a coroutine on it. That is how an accepted socket
+	// is handed from the listener's core to another one.
+	void
+	post(
+		int fd,
+		std::function<void(IOCore&)>&& func);
+
+	// Stop the cores and wait for their threads to end.
+	void
+	stop();
+
+private:
+	const IOCoreGroupPick myPick;
+	std::vector<std::unique_ptr<IOCore>> myCores;
+	std::vector<std::thread> myThreads;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// An async operation with a deadline. When the time is out, the operation is cancelled
+// and returns -1 with errno ETIMEDOUT. The operation is taken by reference. So it has to
+// be a temporary of the same co_await expression, like
+//
+//     co_await withTimeout(task->asyncRecv(buf, size), std::chrono::seconds(1));
+//
+template<typename Op>
+struct AsyncTimeout final : public IOTimer
+{
+	AsyncTimeout(
+		Op &op,
+		IOClock::duration timeout) : myOp(op), myTimeout(timeout), myCore(nullptr) {}
+
+	bool
+	await_ready() const noexcept { return myOp.await_ready(); }
+
+	bool
+	await_suspend(
+		std::coroutine_handle<> coro)
+	{
+		AsyncOperation &op = myOp;
+		myCore = &op.myTask->core();
+		bool rc = op.await_suspend(coro);
+		myCore->addTimer(this, myTimeout);
+		return rc;
+	}
+
+	auto
+	await_resume()
+	{
+		if (isArmed())
+			myCore->removeTimer(this);
+		return myOp.await_resume();
+	}
+
+private:
+	void
+	onTimer() final { static_cast<AsyncOperation &>(myOp).onTimeout(); }
+
+	Op &myOp;
+	const IOClock::duration myTimeout;
+	IOCore *myCore;
+};
+
+template<typename Op>
+AsyncTimeout<std::remove_reference_t<Op>>
+withTimeout(
+	Op &&op,
+	IOClock::duration timeout)
+{
+	return AsyncTimeout<std::remove_reference_t<Op>>(op, timeout);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+
+// Child coroutines of a parent one, which can wait for them all with
+//
+//     co_await group.join();
+//
+// The group is a plain object of the parent's frame, and a child costs only its pooled
+// frames, no heap. The parent has to join before the group is gone. A child stuck in an
+// operation is ended by closing or cancelling its task, and then the join goes on within
+// the same roll(). Only in one thread.
+//
+class IOTaskGroup
+{
+public:
+	IOTaskGroup() : myCount(0) {}
+	IOTaskGroup(
+		const IOTaskGroup&) = delete;
+	IOTaskGroup& operator=(
+		const IOTaskGroup&) = delete;
+	~IOTaskGroup() { assert(myCount == 0); }
+
+	// Start the child right away. It runs till its first suspension.
+	void
+	spawn(
+		IOSubCoroutine<> &&child);
+
+	// Children not done yet.
+	uint32_t
+	size() const { return myCount; }
+
+	struct Join
+	{
+		bool
+		await_ready() const noexcept { return myGroup.myCount == 0; }
+
+		void
+		await_suspend(
+			std::coroutine_handle<> coro) noexcept { myGroup.myJoiner = coro; }
+
+		void
+		await_resume() noexcept {}
+
+		IOTaskGroup &myGroup;
+	};
+
+	// An argument for co_await. Resumes the parent when all the children are done.
+	Join
+	join()
+	{
+		assert(!myJoiner);
+		return Join{*this};
+	}
+
+private:
+	static IOCoroutine
+	runChild(
+		IOTaskGroup *group,
+		IOSubCoroutine<> child);
+
+	uint32_t myCount;
+	std::coroutine_handle<> myJoiner;
 };
@@ -7,29 +7,44 @@
 #include <fcntl.h>
 #include <iostream>
 #include <netinet/in.h>
+#include <sys/socket.h>
 #include <thread>
 #include <unistd.h>
 
 static constexpr uint64_t theRequestTargetCount = 50;
 static constexpr int theClientCount = 100;
+// The benchmark runs the same test with more load, on 1, 2, 4, ... cores for the clients
+// and as many for the server.
+static constexpr uint64_t theBenchRequestCount = 500;
+static constexpr int theBenchClientCount = 1000;
 
 static uint64_t
 getUsec();
 
-static void
-ioCoreRunF(
-	IOCore &core);
-
 static void
 makeFdNonblock(
 	int fd);
 
+static void
+printStats(
+	const char *name,
+	IOCoreGroup &group);
+
 //////////////////////////////////////////////////////////////////////////////////////////
 
 class Context
 {
 public:
-	Context() : myFinishClientCount(0), myIsServerFinished(false) {}
+	Context(
+		uint64_t clientCount,
+		uint64_t requestCount)
+		: myClientCount(clientCount)
+		, myRequestCount(requestCount)
+		, myFinishClientCount(0)
+		, myIsServerFinished(false) {}
+
+	uint64_t
+	requestCount() const { return myRequestCount; }
 
 	void
 	onClientFinish();
@@ -44,6 +59,8 @@ public:
 	waitServerFinish();
 
 private:
+	const uint64_t myClientCount;
+	const uint64_t myRequestCount;
 	std::mutex myMutex;
 	std::condition_variable myCond;
 	uint64_t myFinishClientCount;
@@ -74,6 +91,10 @@ private:
 	IOCoroutine
 	coroRun();
 
+	// One send and one receive, awaited by coroRun().
+	IOSubCoroutine<bool>
+	coroPingPong();
+
 	IOTask *myTask;
 	uint64_t myRecvCount;
 	uint64_t mySendCount;
@@ -90,9 +111,10 @@ struct Server
 		const std::shared_ptr<Context>& ctx);
 	~Server();
 
+	// The accepted clients are spread between the cores of the group.
 	uint16_t
 	bindAndListenAndRun(
-		IOCore &core);
+		IOCoreGroup &group);
 
 	void
 	stop();
@@ -102,51 +124,371 @@ private:
 	coroRun();
 
 	IOTask *myTask;
+	IOCoreGroup *myGroup;
 	const std::shared_ptr<Context> myContext;
 };
 
 //////////////////////////////////////////////////////////////////////////////////////////
 
-static int
-run()
+// Returns how long the clients took, in microseconds.
+static uint64_t
+run(
+	uint32_t coreCount,
+	int clientCount,
+	uint64_t requestCount,
+	IOCoreBackend backend,
+	bool isVerbose)
 {
-	std::shared_ptr<Context> context = std::make_shared<Context>();
-
-	IOCore serverCore;
-	std::cout << "start server" << std::endl;
+	std::shared_ptr<Context> context = std::make_shared<Context>(
+		clientCount, requestCount);
+
+	// The clients are added while the threads are already running. A new client has no
+	// fd yet, so they go by the load. The server's peers have the fds, so by the hash.
+	IOCoreGroup serverGroup(coreCount, IO_CORE_GROUP_PICK_HASH, 0, backend);
+	if (isVerbose)
+		std::cout << "start server" << std::endl;
 	Server server(context);
-	uint16_t port = server.bindAndListenAndRun(serverCore);
-	std::thread serverThread(ioCoreRunF, std::ref(serverCore));
-
-	std::cout << "start clients" << std::endl;
-	IOCore clientCore;
-	for (int i = 0; i < theClientCount; ++i)
-		(new Client(context))->connectAndRun(clientCore, port);
-
-	std::cout << "wait for the load to pass" << std::endl;
+	uint16_t port = server.bindAndListenAndRun(serverGroup);
+
+	if (isVerbose)
+		std::cout << "start clients" << std::endl;
+	IOCoreGroup clientGroup(coreCount, IO_CORE_GROUP_PICK_LEAST_LOAD, coreCount,
+		backend);
+	uint64_t heapCount1 = IOCoroutinePromise::theFrameHeapCount.load(
+		std::memory_order_relaxed);
+	uint64_t poolCount1 = IOCoroutinePromise::theFramePoolCount.load(
+		std::memory_order_relaxed);
 	uint64_t t1 = getUsec();
-	std::thread clientThread(ioCoreRunF, std::ref(clientCore));
+	for (int i = 0; i < clientCount; ++i)
+	{
+		clientGroup.post(-1, [context, port](IOCore &core) {
+			(new Client(context))->connectAndRun(core, port);
+		});
+	}
+
+	if (isVerbose)
+		std::cout << "wait for the load to pass" << std::endl;
 	context->waitClientsFinish();
-	clientCore.stop();
-	clientThread.join();
+	clientGroup.stop();
 	uint64_t t2 = getUsec();
-	std::cout << "Took " << (t2 - t1) / 1000.0 << " ms" << std::endl;
+	// The server's cores are still running, and their stats are read on the fly.
+	printStats("server", serverGroup);
+	printStats("clients", clientGroup);
+	if (isVerbose)
+	{
+		std::cout << "Took " << (t2 - t1) / 1000.0 << " ms" << std::endl;
+		uint64_t heapCount2 = IOCoroutinePromise::theFrameHeapCount.load(
+			std::memory_order_relaxed);
+		uint64_t poolCount2 = IOCoroutinePromise::theFramePoolCount.load(
+			std::memory_order_relaxed);
+		std::cout << "Coroutine frames: " << heapCount2 - heapCount1 <<
+			" from the heap, " << poolCount2 - poolCount1 << " from the pools" <<
+			std::endl;
+	}
 
-	std::cout << "wait for the server to stop" << std::endl;
+	if (isVerbose)
+		std::cout << "wait for the server to stop" << std::endl;
 	server.stop();
 	context->waitServerFinish();
-	serverCore.stop();
-	serverThread.join();
-	return 0;
+	serverGroup.stop();
+	return t2 - t1;
+}
+
+// A recv with nothing to receive times out. A sleep takes its time. A timeout of an
+// operation which is done in time doesn't fire.
+static void
+runTimerTest(
+	IOCoreBackend backend)
+{
+	int fds[2];
+	int rc = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	assert(rc == 0);
+	makeFdNonblock(fds[0]);
+	IOCore core(backend);
+	IOTask *task = core.subscribe(fds[0]);
+	bool isDone = false;
+	[](IOCore &core, IOTask *task, int peerFd, bool *isDone) -> IOCoroutine {
+		uint8_t data;
+		uint64_t t1 = getUsec();
+		ssize_t rc = co_await withTimeout(task->asyncRecv(&data, 1),
+			std::chrono::milliseconds(50));
+		assert(rc == -1 && errno == ETIMEDOUT);
+		assert(getUsec() - t1 >= 50'000);
+
+		t1 = getUsec();
+		co_await core.asyncSleep(std::chrono::milliseconds(20));
+		assert(getUsec() - t1 >= 20'000);
+
+		rc = write(peerFd, "x", 1);
+		assert(rc == 1);
+		rc = co_await withTimeout(task->asyncRecv(&data, 1), std::chrono::seconds(10));
+		assert(rc == 1 && data == 'x');
+		*isDone = true;
+		co_return;
+	}(core, task, fds[1], &isDone);
+	while (!isDone)
+		core.roll();
+	task->close();
+	close(fds[1]);
+	std::cout << "timers work" << std::endl;
+}
+
+// The buffered reads take many small messages out of one recv, and a big write and read
+// go through whole, in as many syscalls as needed. EOF ends the stream.
+static void
+runStreamTest(
+	IOCoreBackend backend)
+{
+	int fds[2];
+	int rc = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	assert(rc == 0);
+	makeFdNonblock(fds[0]);
+	makeFdNonblock(fds[1]);
+	IOCore core(backend);
+	IOTask *reader = core.subscribe(fds[0]);
+	IOTask *writer = core.subscribe(fds[1]);
+	constexpr size_t bigSize = 1024 * 1024;
+	bool isDone = false;
+	[](IOTask *task, bool *isDone) -> IOCoroutine {
+		std::string line;
+		ssize_t rc = co_await task->asyncReadUntil(line, '\n');
+		assert(rc == 6 && line == "hello\n");
+		// The rest came with the same recv.
+		assert(task->bufferedSize() > 0);
+		line.clear();
+		rc = co_await task->asyncReadUntil(line, '\n');
+		assert(rc == 6 && line == "world\n");
+		uint32_t num = 0;
+		rc = co_await task->asyncReadExactly(&num, sizeof(num));
+		assert(rc == sizeof(num) && num == 0x01020304);
+
+		std::unique_ptr<char[]> big(new char[bigSize]);
+		rc = co_await task->asyncReadExactly(big.get(), bigSize);
+		assert(rc == bigSize);
+		for (size_t i = 0; i < bigSize; ++i)
+			assert(big[i] == (char)i);
+		line.clear();
+		rc = co_await task->asyncReadUntil(line, '\n');
+		assert(rc == 4 && line == "tail");
+		rc = co_await task->asyncReadExactly(&num, sizeof(num));
+		assert(rc == 0);
+		*isDone = true;
+		co_return;
+	}(reader, &isDone);
+	[](IOTask *task, int fd) -> IOCoroutine {
+		const char head[] = "hello\nworld\n\x04\x03\x02\x01";
+		ssize_t rc = co_await task->asyncWriteAll(head, sizeof(head) - 1);
+		assert(rc == sizeof(head) - 1);
+		std::unique_ptr<char[]> big(new char[bigSize]);
+		for (size_t i = 0; i < bigSize; ++i)
+			big[i] = (char)i;
+		rc = co_await task->asyncWriteAll(big.get(), bigSize);
+		assert(rc == bigSize);
+		rc = co_await task->asyncWriteAll("tail", 4);
+		assert(rc == 4);
+		// EOF for the reader.
+		shutdown(fd, SHUT_WR);
+		co_return;
+	}(writer, fds[1]);
+	while (!isDone)
+		core.roll();
+	reader->close();
+	writer->close();
+	std::cout << "streams work" << std::endl;
+}
+
+// A header, a body and a trailer go in one vectored write, and the partial sends move on
+// across the iovecs. The receiver takes the header and a piece of the body in one
+// vectored recv.
+static void
+runVectorTest(
+	IOCoreBackend backend)
+{
+	int fds[2];
+	int rc = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	assert(rc == 0);
+	makeFdNonblock(fds[0]);
+	makeFdNonblock(fds[1]);
+	IOCore core(backend);
+	IOTask *reader = core.subscribe(fds[0]);
+	IOTask *writer = core.subscribe(fds[1]);
+	constexpr size_t bodySize = 1024 * 1024;
+	bool isDone = false;
+	[](IOTask *task, bool *isDone) -> IOCoroutine {
+		uint32_t header = 0;
+		char piece[12];
+		iovec vecs[2] = {{&header, sizeof(header)}, {piece, sizeof(piece)}};
+		ssize_t rc = co_await task->asyncRecvv(vecs, 2);
+		assert(rc == sizeof(header) + sizeof(piece));
+		assert(header == bodySize);
+		for (size_t i = 0; i < sizeof(piece); ++i)
+			assert(piece[i] == (char)i);
+		size_t restSize = bodySize - sizeof(piece) + 3;
+		std::unique_ptr<char[]> rest(new char[restSize]);
+		rc = co_await task->asyncReadExactly(rest.get(), restSize);
+		assert(rc == (ssize_t)restSize);
+		for (size_t i = 0; i < bodySize - sizeof(piece); ++i)
+			assert(rest[i] == (char)(i + sizeof(piece)));
+		assert(memcmp(rest.get() + restSize - 3, "end", 3) == 0);
+		*isDone = true;
+		co_return;
+	}(reader, &isDone);
+	[](IOTask *task) -> IOCoroutine {
+		uint32_t header = bodySize;
+		std::unique_ptr<char[]> body(new char[bodySize]);
+		for (size_t i = 0; i < bodySize; ++i)
+			body[i] = (char)i;
+		iovec vecs[3] = {{&header, sizeof(header)}, {body.get(), bodySize},
+			{(void *)"end", 3}};
+		ssize_t rc = co_await task->asyncWriteAllV(vecs, 3);
+		assert(rc == (ssize_t)(sizeof(header) + bodySize + 3));
+		co_return;
+	}(writer);
+	while (!isDone)
+		core.roll();
+	reader->close();
+	writer->close();
+	std::cout << "vectored IO works" << std::endl;
+}
+
+static IOSubCoroutine<>
+coroRecvCancelled(
+	IOCore &core,
+	IOTask *task,
+	uint64_t *rollCount)
+{
+	uint8_t data;
+	ssize_t rc = co_await task->asyncRecv(&data, 1);
+	assert(rc == -1 && errno == ECANCELED);
+	*rollCount = core.stats().myRollCount.get();
+	co_return;
+}
+
+// Children of a group are stuck in the recvs. One task is closed, another is cancelled,
+// and both children are resumed with ECANCELED in the same roll. So is the parent, which
+// joins them. The cancelled task still works after that.
+static void
+runCancelTest(
+	IOCoreBackend backend)
+{
+	int fds[2][2];
+	for (int i = 0; i < 2; ++i)
+	{
+		int rc = socketpair(AF_UNIX, SOCK_STREAM, 0, fds[i]);
+		assert(rc == 0);
+		makeFdNonblock(fds[i][0]);
+	}
+	IOCore core(backend);
+	IOTask *closed = core.subscribe(fds[0][0]);
+	IOTask *cancelled = core.subscribe(fds[1][0]);
+	bool isDone = false;
+	[](IOCore &core, IOTask *closed, IOTask *cancelled, int peerFd,
+		bool *isDone) -> IOCoroutine {
+		// The tasks are added in the first roll.
+		co_await core.asyncSleep(std::chrono::milliseconds(1));
+		uint64_t rollCounts[2] = {0, 0};
+		IOTaskGroup group;
+		group.spawn(coroRecvCancelled(core, closed, &rollCounts[0]));
+		group.spawn(coroRecvCancelled(core, cancelled, &rollCounts[1]));
+		assert(group.size() == 2);
+		[](IOCore &core, IOTask *closed, IOTask *cancelled) -> IOCoroutine {
+			co_await core.asyncSleep(std::chrono::milliseconds(10));
+			closed->close();
+			cancelled->cancel();
+			co_return;
+		}(core, closed, cancelled);
+		co_await group.join();
+		uint64_t rollCount = core.stats().myRollCount.get();
+		assert(rollCounts[0] == rollCount && rollCounts[1] == rollCount);
+		assert(group.size() == 0);
+
+		ssize_t rc = write(peerFd, "x", 1);
+		assert(rc == 1);
+		uint8_t data;
+		rc = co_await cancelled->asyncRecv(&data, 1);
+		assert(rc == 1 && data == 'x');
+		*isDone = true;
+		co_return;
+	}(core, closed, cancelled, fds[1][1], &isDone);
+	while (!isDone)
+		core.roll();
+	cancelled->close();
+	close(fds[0][1]);
+	close(fds[1][1]);
+	std::cout << "cancellation works" << std::endl;
+}
+
+static IOSubCoroutine<uint64_t>
+coroSum(
+	uint64_t n)
+{
+	if (n == 0)
+		co_return 0;
+	uint64_t sum = co_await coroSum(n - 1);
+	co_return sum + n;
+}
+
+// A deep chain of the nested coroutines doesn't grow the stack. Each one enters the next
+// and returns into the previous one with the symmetric transfer.
+static void
+runSubCoroutineTest()
+{
+	constexpr uint64_t depth = 1'000'000;
+	uint64_t sum = 0;
+	[](uint64_t *sum) -> IOCoroutine {
+		*sum = co_await coroSum(depth);
+		co_return;
+	}(&sum);
+	assert(sum == depth * (depth + 1) / 2);
+	std::cout << "sub-coroutines work" << std::endl;
 }
 
-int main()
+static void
+runBench(
+	IOCoreBackend backend)
 {
-	int rc = run();
+	uint32_t cpuCount = std::thread::hardware_concurrency();
+	// The clients and the server take a core each.
+	uint32_t maxCoreCount = cpuCount > 1 ? cpuCount / 2 : 1;
+	for (uint32_t coreCount = 1; coreCount <= maxCoreCount; coreCount *= 2)
+	{
+		uint64_t usec = run(coreCount, theBenchClientCount, theBenchRequestCount,
+			backend, false);
+		uint64_t total = theBenchClientCount * theBenchRequestCount;
+		std::cout << "cores: " << coreCount << ", clients: " << theBenchClientCount <<
+			", requests: " << total << ", took: " << usec / 1000.0 << " ms, " <<
+			(uint64_t)(total * 1'000'000.0 / usec) << " requests/sec" << std::endl;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	bool isBench = false;
+	IOCoreBackend backend = IO_CORE_BACKEND_EPOLL;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--bench") == 0)
+			isBench = true;
+		else if (strcmp(argv[i], "--uring") == 0)
+			backend = IO_CORE_BACKEND_URING;
+	}
+	if (isBench)
+	{
+		runBench(backend);
+	}
+	else
+	{
+		runSubCoroutineTest();
+		runTimerTest(backend);
+		runStreamTest(backend);
+		runVectorTest(backend);
+		runCancelTest(backend);
+		run(1, theClientCount, theRequestTargetCount, backend, true);
+	}
 	assert(Client::theCount.load(std::memory_order_relaxed) == 0);
 	assert(IOCoroutinePromise::theCount.load(std::memory_order_relaxed) == 0);
 	assert(IOTask::theCount.load(std::memory_order_relaxed) == 0);
-	return rc;
+	return 0;
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -159,13 +501,6 @@ getUsec()
 	return t.tv_sec * 1'000'000 + t.tv_nsec / 1000;
 }
 
-static void
-ioCoreRunF(IOCore &core)
-{
-	while (!core.isStopped())
-		core.roll();
-}
-
 static void
 makeFdNonblock(
 	int fd)
@@ -176,6 +511,34 @@ makeFdNonblock(
 	assert(rc == 0);
 }
 
+static void
+printStats(
+	const char *name,
+	IOCoreGroup &group)
+{
+	uint64_t rollCount = 0;
+	uint64_t eventCount = 0;
+	uint64_t busyNs = 0;
+	uint64_t waitNs = 0;
+	IOStatHistogram recvWait;
+	for (uint32_t i = 0; i < group.size(); ++i)
+	{
+		const IOCoreStats &st = group.core(i).stats();
+		rollCount += st.myRollCount.get();
+		eventCount += st.myEventCount.get();
+		busyNs += st.myBusyNs.get();
+		waitNs += st.myWaitNs.get();
+		const IOStatHistogram &h = st.myOpWaitNs[IO_OP_RECV];
+		for (int j = 0; j < IOStatHistogram::theBucketCount; ++j)
+			recvWait.myBuckets[j].add(h.myBuckets[j].get());
+	}
+	std::cout << "  " << name << ": rolls: " << rollCount << ", events/roll: " <<
+		(rollCount == 0 ? 0 : (double)eventCount / rollCount) << ", busy: " <<
+		(busyNs + waitNs == 0 ? 0 : busyNs * 100 / (busyNs + waitNs)) << "%, recv wait " <<
+		"p50: <" << recvWait.percentile(0.5) / 1000.0 << " us, p99: <" <<
+		recvWait.percentile(0.99) / 1000.0 << " us" << std::endl;
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////
 
 void
@@ -198,7 +561,8 @@ Context::onServerFinish()
 void
 Context::waitClientsFinish()
 {
-	constexpr uint64_t target = theClientCount * 2;
+	// The clients and the server's peers.
+	const uint64_t target = myClientCount * 2;
 	std::unique_lock lock(myMutex);
 	while (myFinishClientCount < target)
 		myCond.wait(lock);
@@ -282,17 +646,11 @@ IOCoroutine
 Client::coroRun()
 {
 	LOG_THIS_DEBUG(Client, coroRun, "");
-	for (uint32_t i = 0; i < theRequestTargetCount; ++i)
+	for (uint64_t i = 0, count = myContext->requestCount(); i < count; ++i)
 	{
-		uint8_t data;
-		LOG_THIS_DEBUG(Client, coroRun, "send");
-		ssize_t rc = co_await myTask->asyncSend(&data, 1);
-		LOG_THIS_DEBUG(Client, coroRun, "sent " << rc);
-		assert(rc == 1);
-		LOG_THIS_DEBUG(Client, coroRun, "receive");
-		rc = co_await myTask->asyncRecv(&data, 1);
-		LOG_THIS_DEBUG(Client, coroRun, "received " << rc);
-		assert(rc == 1);
+		bool ok = co_await coroPingPong();
+		assert(ok);
+		MAYBE_UNUSED(ok);
 	}
 	LOG_THIS_DEBUG(Client, coroRun, "finish");
 	myContext->onClientFinish();
@@ -300,11 +658,27 @@ Client::coroRun()
 	co_return;
 }
 
+IOSubCoroutine<bool>
+Client::coroPingPong()
+{
+	uint8_t data;
+	LOG_THIS_DEBUG(Client, coroPingPong, "send");
+	ssize_t rc = co_await myTask->asyncSend(&data, 1);
+	LOG_THIS_DEBUG(Client, coroPingPong, "sent " << rc);
+	if (rc != 1)
+		co_return false;
+	LOG_THIS_DEBUG(Client, coroPingPong, "receive");
+	rc = co_await myTask->asyncRecv(&data, 1);
+	LOG_THIS_DEBUG(Client, coroPingPong, "received " << rc);
+	co_return rc == 1;
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////
 
 Server::Server(
 	const std::shared_ptr<Context>& ctx)
 	: myTask(nullptr)
+	, myGroup(nullptr)
 	, myContext(ctx)
 {
 }
@@ -316,7 +690,7 @@ Server::~Server()
 
 uint16_t
 Server::bindAndListenAndRun(
-	IOCore &core)
+	IOCoreGroup &group)
 {
 	sockaddr_in addr;
 	memset(&addr, 0, sizeof(addr));
@@ -334,13 +708,18 @@ Server::bindAndListenAndRun(
 	rc = listen(sock, SOMAXCONN);
 	assert(rc == 0);
 	makeFdNonblock(sock);
-	myTask = core.subscribe(sock);
-	LOG_THIS_DEBUG(Server, bindAndListen, myTask);
-
 	rc = getsockname(sock, (sockaddr *)&addr, &len);
 	assert(rc == 0);
 	assert(addr.sin_family == AF_INET);
-	coroRun();
+
+	myGroup = &group;
+	// The cores are running already. The listener's coroutine has to start in the
+	// thread of its core.
+	group.post(sock, [this, sock](IOCore &core) {
+		myTask = core.subscribe(sock);
+		LOG_THIS_DEBUG(Server, bindAndListen, myTask);
+		coroRun();
+	});
 	return ntohs(addr.sin_port);
 }
 
@@ -366,7 +745,10 @@ Server::coroRun()
 		if (sock < 0)
 			break;
 		LOG_THIS_DEBUG(Server, coroRun, "new client, " << sock);
-		(new Client(myContext))->wrapAndRun(task->core(), sock);
+		// Hand the socket over to its core. It might be this one.
+		myGroup->post(sock, [ctx = myContext, sock](IOCore &core) {
+			(new Client(ctx))->wrapAndRun(core, sock);
+		});
 	}
 	myContext->onServerFinish();
 	co_return;
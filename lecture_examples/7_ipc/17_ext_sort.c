@@ -0,0 +1,468 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../../utils/heap.h"
+#include "../../utils/shm_ring.h"
+
+/*
+ * External sort of the text files with integers, grown up from
+ * 2_parallel_sort.c. The files are mmap()-ed and split into chunks.
+ * Worker processes parse the chunks, radix sort them and give the
+ * sorted runs to the parent, which merges them with a heap and
+ * writes the result as text.
+ *
+ * When the whole input fits into the memory limit, each worker sorts
+ * its share of the chunks as one run and streams it through a shared
+ * memory ring. The merge then goes in parallel with the sorting of
+ * the slower workers. Otherwise the workers sort the chunks one by
+ * one and spill the runs into temporary files, and the parent merges
+ * the files.
+ *
+ * Usage: 17_ext_sort [-j workers] [-m memory MB] [-t tmp dir]
+ *                    -o output input...
+ */
+
+enum {
+	RING_SIZE = 1024 * 1024,
+	/** Numbers read from a run at once. */
+	RUN_BUF_COUNT = 16 * 1024,
+	OUT_BUF_SIZE = 1024 * 1024,
+};
+
+struct chunk {
+	const char *begin;
+	const char *end;
+};
+
+/** A sorted run which is being merged. */
+struct run {
+	/** Either the ring or the spill file. */
+	struct shm_ring *ring;
+	int fd;
+	int32_t buf[RUN_BUF_COUNT];
+	size_t pos;
+	size_t count;
+	int32_t value;
+	size_t heap_pos;
+};
+
+#define run_less(a, b) ((a)->value < (b)->value)
+
+HEAP_DEFINE(run_heap, struct run, heap_pos, run_less, 4)
+
+static struct chunk *chunks = NULL;
+static int chunk_count = 0;
+static int chunk_capacity = 0;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static bool
+is_space(char c)
+{
+	return c == ' ' || c == '\n' || c == '\t' || c == '\r';
+}
+
+static void
+chunk_add(const char *begin, const char *end)
+{
+	if (chunk_count == chunk_capacity) {
+		chunk_capacity = chunk_capacity == 0 ? 16 : chunk_capacity * 2;
+		chunks = realloc(chunks, sizeof(chunks[0]) * chunk_capacity);
+	}
+	chunks[chunk_count].begin = begin;
+	chunks[chunk_count].end = end;
+	++chunk_count;
+}
+
+/** Map the file and cut it into chunks on the number borders. */
+static int
+input_split(const char *path, size_t chunk_size, size_t *total_size)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	struct stat st;
+	fstat(fd, &st);
+	size_t size = st.st_size;
+	*total_size += size;
+	if (size == 0) {
+		close(fd);
+		return 0;
+	}
+	const char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		fprintf(stderr, "mmap %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	madvise((void *)data, size, MADV_SEQUENTIAL);
+	const char *pos = data;
+	const char *end = data + size;
+	while (pos < end) {
+		const char *next = end - pos > (ssize_t)chunk_size ?
+			pos + chunk_size : end;
+		while (next < end && !is_space(*next))
+			++next;
+		chunk_add(pos, next);
+		pos = next;
+	}
+	return 0;
+}
+
+/**
+ * Parse the numbers. Much faster than fscanf(), there is no locale,
+ * no format, and no checks beyond the digits and the sign.
+ */
+static size_t
+parse_ints(const char *pos, const char *end, int32_t *out)
+{
+	size_t count = 0;
+	while (true) {
+		while (pos < end && is_space(*pos))
+			++pos;
+		if (pos == end)
+			break;
+		bool is_neg = *pos == '-';
+		if (is_neg)
+			++pos;
+		uint32_t value = 0;
+		while (pos < end && *pos >= '0' && *pos <= '9')
+			value = value * 10 + (*pos++ - '0');
+		/* Skip garbage, if any. */
+		while (pos < end && !is_space(*pos))
+			++pos;
+		out[count++] = is_neg ? -(int32_t)value : (int32_t)value;
+	}
+	return count;
+}
+
+/**
+ * LSD radix sort by bytes. The sign bit is flipped so the negative
+ * numbers go first when compared as unsigned.
+ */
+static void
+radix_sort(int32_t *data, int32_t *tmp, size_t count)
+{
+	uint32_t *src = (uint32_t *)data;
+	uint32_t *dst = (uint32_t *)tmp;
+	for (size_t i = 0; i < count; ++i)
+		src[i] ^= 0x80000000u;
+	for (int shift = 0; shift < 32; shift += 8) {
+		size_t offsets[256] = {0};
+		for (size_t i = 0; i < count; ++i)
+			++offsets[(src[i] >> shift) & 0xff];
+		size_t sum = 0;
+		for (int b = 0; b < 256; ++b) {
+			size_t c = offsets[b];
+			offsets[b] = sum;
+			sum += c;
+		}
+		for (size_t i = 0; i < count; ++i)
+			dst[offsets[(src[i] >> shift) & 0xff]++] = src[i];
+		uint32_t *t = src;
+		src = dst;
+		dst = t;
+	}
+	/* 4 passes, so the result is back in data. */
+	for (size_t i = 0; i < count; ++i)
+		src[i] ^= 0x80000000u;
+}
+
+/**
+ * Parse the chunks from @a first with the step @a step and sort them
+ * together. Up to @a last, not including. Returns the number count.
+ */
+static size_t
+chunks_sort(int first, int last, int step, int32_t **data)
+{
+	/* A number takes at least 2 bytes with the separator. */
+	size_t max_count = 0;
+	for (int i = first; i < last; i += step)
+		max_count += (chunks[i].end - chunks[i].begin) / 2 + 1;
+	*data = malloc(max_count * sizeof(int32_t));
+	size_t count = 0;
+	for (int i = first; i < last; i += step) {
+		count += parse_ints(chunks[i].begin, chunks[i].end,
+				    *data + count);
+	}
+	int32_t *tmp = malloc(count * sizeof(int32_t));
+	radix_sort(*data, tmp, count);
+	free(tmp);
+	return count;
+}
+
+/** The spill files are named by the parent's pid and the chunk. */
+static void
+spill_path(char *buf, size_t size, const char *dir, pid_t pid, int chunk_id)
+{
+	snprintf(buf, size, "%s/ext_sort.%d.%d", dir, (int)pid, chunk_id);
+}
+
+static int
+write_full(int fd, const void *data, size_t size)
+{
+	const char *pos = data;
+	while (size > 0) {
+		ssize_t rc = write(fd, pos, size);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		pos += rc;
+		size -= rc;
+	}
+	return 0;
+}
+
+/** Sort the worker's share of the chunks into the spill files. */
+static int
+worker_spill(int id, int worker_count, const char *dir)
+{
+	for (int i = id; i < chunk_count; i += worker_count) {
+		int32_t *data;
+		size_t count = chunks_sort(i, i + 1, 1, &data);
+		char path[1024];
+		spill_path(path, sizeof(path), dir, getppid(), i);
+		int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		if (fd < 0 || write_full(fd, data,
+					 count * sizeof(int32_t)) != 0) {
+			fprintf(stderr, "spill %s: %s\n", path,
+				strerror(errno));
+			return -1;
+		}
+		close(fd);
+		free(data);
+	}
+	return 0;
+}
+
+/** Sort the worker's share of the chunks right into the ring. */
+static int
+worker_stream(int id, int worker_count, struct shm_ring *ring)
+{
+	int32_t *data;
+	size_t count = chunks_sort(id, chunk_count, worker_count, &data);
+	shm_ring_write_all(ring, data, count * sizeof(int32_t));
+	shm_ring_close(ring);
+	free(data);
+	return 0;
+}
+
+/** Get the next number of the run. False when it is over. */
+static bool
+run_next(struct run *r)
+{
+	if (r->pos == r->count) {
+		size_t size;
+		if (r->ring != NULL) {
+			size = shm_ring_read_all(r->ring, r->buf,
+						 sizeof(r->buf));
+		} else {
+			ssize_t rc = read(r->fd, r->buf, sizeof(r->buf));
+			size = rc > 0 ? rc : 0;
+		}
+		r->pos = 0;
+		r->count = size / sizeof(int32_t);
+		if (r->count == 0)
+			return false;
+	}
+	r->value = r->buf[r->pos++];
+	return true;
+}
+
+struct out_buf {
+	int fd;
+	char data[OUT_BUF_SIZE];
+	size_t size;
+};
+
+static void
+out_flush(struct out_buf *out)
+{
+	write_full(out->fd, out->data, out->size);
+	out->size = 0;
+}
+
+static void
+out_int(struct out_buf *out, int32_t value)
+{
+	if (out->size + 16 > OUT_BUF_SIZE)
+		out_flush(out);
+	char digits[12];
+	int len = 0;
+	uint32_t v = value < 0 ? -(uint32_t)value : (uint32_t)value;
+	do {
+		digits[len++] = '0' + v % 10;
+		v /= 10;
+	} while (v != 0);
+	char *pos = out->data + out->size;
+	if (value < 0)
+		*pos++ = '-';
+	while (len > 0)
+		*pos++ = digits[--len];
+	*pos++ = ' ';
+	out->size = pos - out->data;
+}
+
+/** K-way merge of the runs into the output. Returns the count. */
+static size_t
+merge(struct run *runs, int run_count, int out_fd)
+{
+	struct run_heap heap;
+	run_heap_create(&heap);
+	for (int i = 0; i < run_count; ++i) {
+		runs[i].pos = 0;
+		runs[i].count = 0;
+		if (run_next(&runs[i]))
+			run_heap_push(&heap, &runs[i]);
+	}
+	struct out_buf *out = malloc(sizeof(*out));
+	out->fd = out_fd;
+	out->size = 0;
+	size_t total = 0;
+	struct run *r;
+	while ((r = run_heap_top(&heap)) != NULL) {
+		out_int(out, r->value);
+		++total;
+		if (run_next(r))
+			run_heap_update(&heap, r);
+		else
+			run_heap_pop(&heap);
+	}
+	if (out->size > 0)
+		out->data[out->size - 1] = '\n';
+	out_flush(out);
+	free(out);
+	run_heap_destroy(&heap);
+	return total;
+}
+
+int
+main(int argc, char **argv)
+{
+	int worker_count = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t mem_limit = 1024 * 1024 * 1024;
+	const char *tmp_dir = "/tmp";
+	const char *out_path = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "j:m:t:o:")) != -1) {
+		switch (opt) {
+		case 'j': worker_count = atoi(optarg); break;
+		case 'm': mem_limit = strtoull(optarg, NULL, 10) << 20; break;
+		case 't': tmp_dir = optarg; break;
+		case 'o': out_path = optarg; break;
+		default: return -1;
+		}
+	}
+	if (out_path == NULL || optind == argc) {
+		fprintf(stderr, "Usage: %s [-j workers] [-m memory MB] "
+			"[-t tmp dir] -o output input...\n", argv[0]);
+		return -1;
+	}
+	if (worker_count < 1)
+		worker_count = 1;
+	uint64_t start_ns = now_ns();
+	/*
+	 * A worker keeps the numbers and the radix sort buffer. Each of
+	 * them can take 2 bytes of text per 4 bytes of number.
+	 */
+	size_t chunk_size = mem_limit / worker_count / 4;
+	if (chunk_size < 4096)
+		chunk_size = 4096;
+	size_t total_size = 0;
+	for (int i = optind; i < argc; ++i) {
+		if (input_split(argv[i], chunk_size, &total_size) != 0)
+			return -1;
+	}
+	bool is_stream = total_size <= chunk_size * worker_count;
+	if (is_stream && worker_count > chunk_count)
+		worker_count = chunk_count;
+	struct run *runs = calloc(chunk_count > 0 ? chunk_count : 1,
+				  sizeof(runs[0]));
+	for (int i = 0; i < worker_count; ++i) {
+		struct shm_ring *ring = NULL;
+		if (is_stream) {
+			ring = shm_ring_new(RING_SIZE);
+			runs[i].ring = ring;
+		}
+		pid_t pid = fork();
+		if (pid == 0) {
+			int rc = is_stream ?
+				worker_stream(i, worker_count, ring) :
+				worker_spill(i, worker_count, tmp_dir);
+			_exit(rc == 0 ? 0 : 1);
+		}
+		if (pid < 0) {
+			fprintf(stderr, "fork: %s\n", strerror(errno));
+			return -1;
+		}
+	}
+	int rc = 0;
+	if (!is_stream) {
+		for (int i = 0; i < worker_count; ++i) {
+			int status;
+			wait(&status);
+			if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+				rc = -1;
+		}
+		for (int i = 0; i < chunk_count; ++i) {
+			char path[1024];
+			spill_path(path, sizeof(path), tmp_dir, getpid(), i);
+			runs[i].fd = open(path, O_RDONLY);
+			if (runs[i].fd < 0) {
+				rc = -1;
+				continue;
+			}
+			unlink(path);
+		}
+		if (rc != 0) {
+			fprintf(stderr, "a worker has failed\n");
+			return -1;
+		}
+		fprintf(stderr, "sorted %d runs in %.3fs\n", chunk_count,
+			(now_ns() - start_ns) / 1000000000.0);
+	}
+	int out_fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out_fd < 0) {
+		fprintf(stderr, "open %s: %s\n", out_path, strerror(errno));
+		return -1;
+	}
+	int run_count = is_stream ? worker_count : chunk_count;
+	size_t total = merge(runs, run_count, out_fd);
+	close(out_fd);
+	for (int i = 0; i < run_count; ++i) {
+		if (runs[i].ring != NULL)
+			shm_ring_delete(runs[i].ring);
+		else
+			close(runs[i].fd);
+	}
+	if (is_stream) {
+		for (int i = 0; i < worker_count; ++i)
+			wait(NULL);
+	}
+	fprintf(stderr, "%zu numbers in %d runs (%s) in %.3fs\n", total,
+		run_count, is_stream ? "streamed" : "spilled",
+		(now_ns() - start_ns) / 1000000000.0);
+	free(runs);
+	free(chunks);
+	return rc;
+}
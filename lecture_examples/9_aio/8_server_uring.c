@@ -0,0 +1,136 @@
+#include <sys/socket.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "../../utils/uring.h"
+
+/*
+ * The same server as the select, poll and epoll ones, but on
+ * io_uring. Instead of waiting for readiness, the operations
+ * themselves are queued: an accept, and a recv for each client. The
+ * kernel completes them when there is something, and the results
+ * come in the completion queue. No syscall per operation, one
+ * io_uring_enter() submits the new ones and waits for the finished
+ * ones.
+ */
+
+enum op_type {
+	OP_ACCEPT,
+	OP_RECV,
+	OP_SEND,
+};
+
+struct peer {
+	int fd;
+	int buffer;
+};
+
+/* The operation type is in the low bits of the peer pointer. */
+static uint64_t
+op_data(struct peer *p, enum op_type type)
+{
+	return (uint64_t)(uintptr_t)p | type;
+}
+
+static void
+queue_op(struct uring *ring, int fd, struct peer *p, enum op_type type)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(ring);
+	if (sqe == NULL) {
+		/* The queue is full, give it to the kernel and retry. */
+		uring_submit(ring);
+		sqe = uring_get_sqe(ring);
+	}
+	switch (type) {
+	case OP_ACCEPT:
+		uring_prep_rw(sqe, IORING_OP_ACCEPT, fd, NULL, 0, 0);
+		break;
+	case OP_RECV:
+		uring_prep_rw(sqe, IORING_OP_RECV, fd, &p->buffer,
+			      sizeof(p->buffer), 0);
+		break;
+	case OP_SEND:
+		uring_prep_rw(sqe, IORING_OP_SEND, fd, &p->buffer,
+			      sizeof(p->buffer), 0);
+		break;
+	}
+	sqe->user_data = op_data(p, type);
+}
+
+int
+main(void)
+{
+	int server = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (server == -1) {
+		printf("error = %s\n", strerror(errno));
+		return -1;
+	}
+	struct sockaddr_in addr;
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(12345);
+	inet_aton("127.0.0.1", &addr.sin_addr);
+
+	if (bind(server, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+		printf("bind error = %s\n", strerror(errno));
+		return -1;
+	}
+	if (listen(server, 128) == -1) {
+		printf("listen error = %s\n", strerror(errno));
+		return -1;
+	}
+	struct uring ring;
+	if (uring_create(&ring, 1024) != 0) {
+		printf("io_uring error = %s\n", strerror(errno));
+		close(server);
+		return -1;
+	}
+	queue_op(&ring, server, NULL, OP_ACCEPT);
+	while (1) {
+		if (uring_submit_and_wait(&ring, 1) < 0) {
+			printf("error = %s\n", strerror(errno));
+			break;
+		}
+		struct io_uring_cqe *cqe;
+		while ((cqe = uring_peek_cqe(&ring)) != NULL) {
+			enum op_type type = cqe->user_data & 3;
+			struct peer *p = (struct peer *)(uintptr_t)
+				(cqe->user_data & ~(uint64_t)3);
+			int res = cqe->res;
+			uring_cqe_seen(&ring);
+			if (type == OP_ACCEPT) {
+				queue_op(&ring, server, NULL, OP_ACCEPT);
+				if (res < 0) {
+					printf("error = %s\n", strerror(-res));
+					continue;
+				}
+				printf("New client\n");
+				p = malloc(sizeof(*p));
+				p->fd = res;
+				queue_op(&ring, p->fd, p, OP_RECV);
+				continue;
+			}
+			if (res <= 0) {
+				if (res < 0)
+					printf("error = %s\n", strerror(-res));
+				printf("Client disconnected\n");
+				close(p->fd);
+				free(p);
+				continue;
+			}
+			if (type == OP_RECV) {
+				printf("Received %d\n", p->buffer);
+				p->buffer++;
+				queue_op(&ring, p->fd, p, OP_SEND);
+			} else {
+				printf("Sent %d\n", p->buffer);
+				queue_op(&ring, p->fd, p, OP_RECV);
+			}
+		}
+	}
+	uring_destroy(&ring);
+	close(server);
+	return 0;
+}
@@ -0,0 +1,410 @@
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * A load driver for the servers of this folder: select, poll, epoll
+ * and io_uring. They all listen on 127.0.0.1:12345 and answer a 4
+ * byte int with the int + 1.
+ *
+ *     9_server_bench [-i idle,idle,...] [-h hot] [-d seconds] server...
+ *
+ * For each server and each idle connection count the server is
+ * started with its output to /dev/null. Then the idle connections
+ * are opened, they never send anything. Then the few hot ones start
+ * ping-pong, one request in flight each, for the given time. This is
+ * what a chat server looks like: many peers, only some are talking.
+ *
+ * A select() or poll() server has to look at all the descriptors on
+ * each event, so its cost per event grows with the idle count. An
+ * epoll or io_uring one only sees the ready ones.
+ *
+ * The output is a JSON line per run, with the request rate, the
+ * latencies and the server's CPU time per request. The CPU time is
+ * from /proc/<pid>/schedstat, of the server alone.
+ *
+ * To open more than 28k connections to one port the source addresses
+ * are different, 127.0.0.2, 127.0.0.3 and so on. The idle count is
+ * limited by RLIMIT_NOFILE, it is raised to the hard limit. Note, the
+ * select server with descriptors above FD_SETSIZE writes past its
+ * fd_set. It might even seem to work, but it is undefined behaviour.
+ */
+
+enum {
+	PORT = 12345,
+	/** Connections per source address, below the ephemeral range. */
+	CONNS_PER_ADDR = 25000,
+	/** Connections being opened at once, below the backlog. */
+	CONNECT_BATCH = 100,
+	/** Latency histogram, a bucket per microsecond. */
+	LATENCY_BUCKETS = 100 * 1000,
+	/** No reply in that many ms means the server is broken. */
+	STALL_TIMEOUT_MS = 5000,
+};
+
+static double
+now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** CPU time of the process in seconds. */
+static double
+process_cpu_sec(pid_t pid)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/schedstat", (int)pid);
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+	unsigned long long ns = 0;
+	int rc = fscanf(f, "%llu", &ns);
+	fclose(f);
+	return rc == 1 ? ns / 1e9 : -1;
+}
+
+static pid_t
+server_start(const char *path)
+{
+	pid_t pid = fork();
+	if (pid != 0)
+		return pid;
+	int null_fd = open("/dev/null", O_WRONLY);
+	dup2(null_fd, STDOUT_FILENO);
+	close(null_fd);
+	execl(path, path, (char *)NULL);
+	perror("exec");
+	_exit(-1);
+}
+
+static void
+make_addr(struct sockaddr_in *addr, uint32_t ip, uint16_t port)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family = AF_INET;
+	addr->sin_port = htons(port);
+	addr->sin_addr.s_addr = htonl(ip);
+}
+
+static bool
+port_is_listened(void)
+{
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr;
+	make_addr(&addr, INADDR_LOOPBACK, PORT);
+	int rc = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+	close(fd);
+	return rc == 0;
+}
+
+static void
+server_stop(pid_t pid)
+{
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	/*
+	 * An io_uring is torn down by the kernel asynchronously, and its
+	 * pending accept keeps the listening socket alive for a while.
+	 */
+	for (int i = 0; i < 100 && port_is_listened(); ++i)
+		usleep(50 * 1000);
+}
+
+/** Connected socket, or -1. The source address depends on @a i. */
+static int
+conn_start(int i)
+{
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (fd < 0)
+		return -1;
+	struct sockaddr_in addr;
+	make_addr(&addr, INADDR_LOOPBACK + 1 + i / CONNS_PER_ADDR, 0);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		close(fd);
+		return -1;
+	}
+	make_addr(&addr, INADDR_LOOPBACK, PORT);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 &&
+	    errno != EINPROGRESS) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/** Open @a count connections in batches. Returns 0 or -1. */
+static int
+conns_open(int *fds, int count)
+{
+	struct pollfd pfds[CONNECT_BATCH];
+	for (int i = 0; i < count; i += CONNECT_BATCH) {
+		int n = count - i < CONNECT_BATCH ? count - i : CONNECT_BATCH;
+		for (int j = 0; j < n; ++j) {
+			fds[i + j] = conn_start(i + j);
+			if (fds[i + j] < 0) {
+				fprintf(stderr, "connect %d: %s\n", i + j,
+					strerror(errno));
+				return -1;
+			}
+			pfds[j].fd = fds[i + j];
+			pfds[j].events = POLLOUT;
+		}
+		int left = n;
+		while (left > 0) {
+			int rc = poll(pfds, n, STALL_TIMEOUT_MS);
+			if (rc <= 0) {
+				fprintf(stderr, "connect timeout\n");
+				return -1;
+			}
+			for (int j = 0; j < n; ++j) {
+				if (pfds[j].fd < 0 || pfds[j].revents == 0)
+					continue;
+				int err = 0;
+				socklen_t len = sizeof(err);
+				getsockopt(pfds[j].fd, SOL_SOCKET, SO_ERROR,
+					   &err, &len);
+				if (err != 0) {
+					fprintf(stderr, "connect: %s\n",
+						strerror(err));
+					return -1;
+				}
+				pfds[j].fd = -1;
+				--left;
+			}
+		}
+	}
+	return 0;
+}
+
+/** Wait for the server to listen. */
+static bool
+server_wait_ready(pid_t pid)
+{
+	for (int i = 0; i < 100; ++i) {
+		if (waitpid(pid, NULL, WNOHANG) == pid)
+			return false;
+		if (port_is_listened())
+			return true;
+		usleep(50 * 1000);
+	}
+	return false;
+}
+
+struct hot_conn {
+	int value;
+	double sent_at;
+};
+
+static bool
+hot_send(int fd, struct hot_conn *c)
+{
+	c->sent_at = now_sec();
+	return send(fd, &c->value, sizeof(c->value), MSG_NOSIGNAL) ==
+		sizeof(c->value);
+}
+
+static double
+percentile(const uint64_t *buckets, uint64_t total, double p)
+{
+	uint64_t target = (uint64_t)(total * p);
+	uint64_t sum = 0;
+	for (int i = 0; i < LATENCY_BUCKETS; ++i) {
+		sum += buckets[i];
+		if (sum > target)
+			return i;
+	}
+	return LATENCY_BUCKETS;
+}
+
+/** The hot connections' ping-pong. Returns the request count or -1. */
+static int64_t
+hot_run(int *fds, int count, double duration, uint64_t *latencies)
+{
+	struct pollfd *pfds = calloc(count, sizeof(pfds[0]));
+	struct hot_conn *conns = calloc(count, sizeof(conns[0]));
+	for (int i = 0; i < count; ++i) {
+		int yes = 1;
+		setsockopt(fds[i], IPPROTO_TCP, TCP_NODELAY, &yes,
+			   sizeof(yes));
+		pfds[i].fd = fds[i];
+		pfds[i].events = POLLIN;
+		conns[i].value = i * 1000000;
+		if (!hot_send(fds[i], &conns[i]))
+			goto error;
+	}
+	int64_t request_count = 0;
+	double deadline = now_sec() + duration;
+	while (now_sec() < deadline) {
+		int rc = poll(pfds, count, STALL_TIMEOUT_MS);
+		if (rc <= 0) {
+			fprintf(stderr, "server stalled\n");
+			goto error;
+		}
+		for (int i = 0; i < count; ++i) {
+			if (pfds[i].revents == 0)
+				continue;
+			int reply;
+			/* The 4 bytes come in one segment over loopback. */
+			if (recv(fds[i], &reply, sizeof(reply), 0) !=
+			    sizeof(reply) || reply != conns[i].value + 1) {
+				fprintf(stderr, "bad reply\n");
+				goto error;
+			}
+			double us = (now_sec() - conns[i].sent_at) * 1e6;
+			++latencies[us < LATENCY_BUCKETS - 1 ?
+				    (int)us : LATENCY_BUCKETS - 1];
+			++request_count;
+			conns[i].value = reply;
+			if (!hot_send(fds[i], &conns[i]))
+				goto error;
+		}
+	}
+	/* The last replies, so the next run starts clean. */
+	struct timeval timeout = {.tv_sec = STALL_TIMEOUT_MS / 1000};
+	for (int i = 0; i < count; ++i) {
+		int reply;
+		fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) & ~O_NONBLOCK);
+		setsockopt(fds[i], SOL_SOCKET, SO_RCVTIMEO, &timeout,
+			   sizeof(timeout));
+		if (recv(fds[i], &reply, sizeof(reply), 0) != sizeof(reply)) {
+			fprintf(stderr, "server stalled\n");
+			goto error;
+		}
+	}
+	free(conns);
+	free(pfds);
+	return request_count;
+error:
+	free(conns);
+	free(pfds);
+	return -1;
+}
+
+static void
+bench_one(const char *server, int idle_count, int hot_count,
+	  double duration)
+{
+	const char *name = strrchr(server, '/');
+	name = name == NULL ? server : name + 1;
+	printf("{\"server\": \"%s\", \"idle\": %d, \"hot\": %d, ", name,
+	       idle_count, hot_count);
+	fflush(stdout);
+	int total = idle_count + hot_count;
+	int *fds = malloc(sizeof(int) * total);
+	int open_count = 0;
+	uint64_t *latencies = calloc(LATENCY_BUCKETS, sizeof(uint64_t));
+	pid_t pid = server_start(server);
+	if (!server_wait_ready(pid)) {
+		printf("\"error\": \"server didn't start\"}\n");
+		goto out;
+	}
+	if (conns_open(fds, total) != 0) {
+		printf("\"error\": \"couldn't connect\"}\n");
+		goto out;
+	}
+	open_count = total;
+	/* The first round trip waits till the server accepts them all. */
+	if (hot_run(fds + idle_count, hot_count, 0, latencies) < 0) {
+		printf("\"error\": \"no replies\"}\n");
+		goto out;
+	}
+	memset(latencies, 0, LATENCY_BUCKETS * sizeof(uint64_t));
+	double cpu_start = process_cpu_sec(pid);
+	double start = now_sec();
+	int64_t count = hot_run(fds + idle_count, hot_count, duration,
+				latencies);
+	double elapsed = now_sec() - start;
+	double cpu = process_cpu_sec(pid) - cpu_start;
+	if (count <= 0) {
+		printf("\"error\": \"no replies\"}\n");
+		goto out;
+	}
+	printf("\"requests_per_sec\": %.0f, \"p50_us\": %.0f, "
+	       "\"p99_us\": %.0f, \"server_cpu_us_per_request\": %.2f}\n",
+	       count / elapsed, percentile(latencies, count, 0.5),
+	       percentile(latencies, count, 0.99), cpu * 1e6 / count);
+out:
+	fflush(stdout);
+	/*
+	 * Reset, not close. If the server closed first, its side would
+	 * be in TIME_WAIT, and the next server couldn't bind the port.
+	 */
+	for (int i = 0; i < open_count; ++i) {
+		struct linger lin = {.l_onoff = 1, .l_linger = 0};
+		setsockopt(fds[i], SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+		close(fds[i]);
+	}
+	server_stop(pid);
+	free(latencies);
+	free(fds);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *idle_list = "0,1000,10000";
+	int hot_count = 4;
+	double duration = 2;
+	int opt;
+	while ((opt = getopt(argc, argv, "i:h:d:")) != -1) {
+		switch (opt) {
+		case 'i':
+			idle_list = optarg;
+			break;
+		case 'h':
+			hot_count = atoi(optarg);
+			break;
+		case 'd':
+			duration = atof(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-i idle,...] [-h hot] "
+				"[-d seconds] server...\n", argv[0]);
+			return -1;
+		}
+	}
+	if (optind == argc || hot_count < 1) {
+		fprintf(stderr, "no servers to bench\n");
+		return -1;
+	}
+	struct rlimit lim;
+	getrlimit(RLIMIT_NOFILE, &lim);
+	lim.rlim_cur = lim.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &lim);
+	signal(SIGPIPE, SIG_IGN);
+	for (int s = optind; s < argc; ++s) {
+		char *list = strdup(idle_list);
+		for (char *tok = strtok(list, ","); tok != NULL;
+		     tok = strtok(NULL, ",")) {
+			int idle_count = atoi(tok);
+			if ((rlim_t)(idle_count + hot_count + 16) >
+			    lim.rlim_cur) {
+				fprintf(stderr, "%d connections are above the "
+					"descriptor limit %llu\n", idle_count,
+					(unsigned long long)lim.rlim_cur);
+				continue;
+			}
+			bench_one(argv[s], idle_count, hot_count, duration);
+		}
+		free(list);
+	}
+	return 0;
+}
@@ -0,0 +1,205 @@
+#include "deque.h"
+#include "heap.h"
+#include "rlist.h"
+#include "unit_bench.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * Microbenchmarks of the vector-backed containers against rlist.
+ * The argument of each is the container size. An iteration is an
+ * operation on one item.
+ *
+ * The rlist items are linked in a random order, like the ones of a
+ * long running program, where the neighbours in a list are rarely
+ * the neighbours in memory. The deque stores pointers to the same
+ * items, which is how a run queue of coroutines would use it.
+ */
+
+enum {
+	/** About that many operations are done in each run. */
+	BENCH_OP_COUNT = 4 * 1000 * 1000,
+};
+
+struct bench_item {
+	uint64_t key;
+	struct rlist link;
+	size_t heap_pos;
+};
+
+#define bench_item_less(a, b) ((a)->key < (b)->key)
+
+DEQUE_DEFINE(bench_deque, struct bench_item *)
+HEAP_DEFINE(bench_heap2, struct bench_item, heap_pos, bench_item_less, 2)
+HEAP_DEFINE(bench_heap4, struct bench_item, heap_pos, bench_item_less, 4)
+
+static struct bench_item *items;
+/** Items in a random order. */
+static struct bench_item **order;
+/** Keeps the results alive, so the loops are not optimized out. */
+static volatile uint64_t bench_sink;
+
+////////////////////////////////////////////////////////////////////////////////
+
+/** Push all items to the tail, pop all from the head. */
+static void
+bench_rlist_push_pop(long iterations, long size)
+{
+	long rounds = iterations / size;
+	RLIST_HEAD(list);
+	uint64_t sum = 0;
+	for (long r = 0; r < rounds; ++r) {
+		for (long i = 0; i < size; ++i)
+			rlist_add_tail_entry(&list, order[i], link);
+		while (!rlist_empty(&list)) {
+			sum += rlist_shift_entry(&list, struct bench_item,
+				link)->key;
+		}
+	}
+	bench_sink = sum;
+}
+
+static void
+bench_deque_push_pop(long iterations, long size)
+{
+	long rounds = iterations / size;
+	struct bench_deque d;
+	bench_deque_create(&d);
+	uint64_t sum = 0;
+	for (long r = 0; r < rounds; ++r) {
+		for (long i = 0; i < size; ++i)
+			bench_deque_push_back(&d, order[i]);
+		while (!bench_deque_empty(&d))
+			sum += bench_deque_pop_front(&d)->key;
+	}
+	bench_deque_destroy(&d);
+	bench_sink = sum;
+}
+
+static void
+bench_rlist_iterate(long iterations, long size)
+{
+	long rounds = iterations / size;
+	RLIST_HEAD(list);
+	bench_pause();
+	for (long i = 0; i < size; ++i)
+		rlist_add_tail_entry(&list, order[i], link);
+	bench_resume();
+	uint64_t sum = 0;
+	for (long r = 0; r < rounds; ++r) {
+		struct bench_item *it;
+		rlist_foreach_entry(it, &list, link)
+			sum += it->key;
+	}
+	bench_sink = sum;
+}
+
+static void
+bench_rlist_iterate_prefetch(long iterations, long size)
+{
+	long rounds = iterations / size;
+	RLIST_HEAD(list);
+	bench_pause();
+	for (long i = 0; i < size; ++i)
+		rlist_add_tail_entry(&list, order[i], link);
+	bench_resume();
+	uint64_t sum = 0;
+	for (long r = 0; r < rounds; ++r) {
+		struct bench_item *it;
+		rlist_foreach_entry_prefetch(it, &list, link)
+			sum += it->key;
+	}
+	bench_sink = sum;
+}
+
+static void
+bench_deque_iterate(long iterations, long size)
+{
+	long rounds = iterations / size;
+	struct bench_deque d;
+	bench_deque_create(&d);
+	bench_pause();
+	for (long i = 0; i < size; ++i)
+		bench_deque_push_back(&d, order[i]);
+	bench_resume();
+	uint64_t sum = 0;
+	for (long r = 0; r < rounds; ++r) {
+		size_t i;
+		struct bench_item **it;
+		deque_foreach(bench_deque, &d, i, it)
+			sum += (*it)->key;
+	}
+	bench_deque_destroy(&d);
+	bench_sink = sum;
+}
+
+/** Push all items with random keys, pop all in the key order. */
+#define BENCH_HEAP_PUSH_POP(name)					\
+static void								\
+bench_##name##_push_pop(long iterations, long size)			\
+{									\
+	long rounds = iterations / size;				\
+	struct name h;							\
+	name##_create(&h);						\
+	uint64_t sum = 0;						\
+	for (long r = 0; r < rounds; ++r) {				\
+		for (long i = 0; i < size; ++i)				\
+			name##_push(&h, order[i]);			\
+		while (!name##_empty(&h))				\
+			sum += name##_pop(&h)->key;			\
+	}								\
+	name##_destroy(&h);						\
+	bench_sink = sum;						\
+}
+
+BENCH_HEAP_PUSH_POP(bench_heap2)
+BENCH_HEAP_PUSH_POP(bench_heap4)
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+bench_register_size(const char *name, bench_f f, long size)
+{
+	long rounds = BENCH_OP_COUNT / size;
+	bench_register_arg(name, f, (rounds > 0 ? rounds : 1) * size, size);
+}
+
+int
+main(int argc, char **argv)
+{
+	const long max_size = 1000 * 1000;
+	items = malloc(sizeof(items[0]) * max_size);
+	order = malloc(sizeof(order[0]) * max_size);
+	srand(1);
+	for (long i = 0; i < max_size; ++i) {
+		items[i].key = ((uint64_t)rand() << 31) ^ rand();
+		rlist_create(&items[i].link);
+		items[i].heap_pos = HEAP_NO_POS;
+		order[i] = &items[i];
+	}
+	for (long i = max_size - 1; i > 0; --i) {
+		long j = rand() % (i + 1);
+		struct bench_item *tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+	for (long size = 10; size <= max_size; size *= 10) {
+		bench_register_size("rlist_push_pop", bench_rlist_push_pop,
+				    size);
+		bench_register_size("deque_push_pop", bench_deque_push_pop,
+				    size);
+		bench_register_size("rlist_iterate", bench_rlist_iterate, size);
+		bench_register_size("rlist_iterate_prefetch",
+				    bench_rlist_iterate_prefetch, size);
+		bench_register_size("deque_iterate", bench_deque_iterate, size);
+		bench_register_size("heap2_push_pop",
+				    bench_bench_heap2_push_pop, size);
+		bench_register_size("heap4_push_pop",
+				    bench_bench_heap4_push_pop, size);
+	}
+	int rc = bench_main(argc, argv);
+	free(order);
+	free(items);
+	return rc;
+}
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+/**
+ * Double-ended queue in a ring buffer. Unlike rlist, the items are
+ * stored by value, next to each other. So a walk is sequential
+ * memory access instead of a pointer chase.
+ *
+ * DEQUE_DEFINE(name, type) defines struct name and its functions
+ * prefixed with name_. For example, DEQUE_DEFINE(int_deque, int)
+ * defines struct int_deque, int_deque_push_back() and so on.
+ *
+ * The capacity is a power of 2, so the index wraps with a mask. It
+ * is doubled when full and is never shrunk.
+ */
+
+enum {
+	DEQUE_MIN_CAPACITY = 8,
+};
+
+#define DEQUE_DEFINE(name, type)					\
+									\
+struct name {								\
+	type *data;							\
+	/** Index of the first item. */					\
+	size_t begin;							\
+	size_t count;							\
+	/** Power of 2 or 0. */						\
+	size_t capacity;						\
+};									\
+									\
+static inline void							\
+name##_create(struct name *d)						\
+{									\
+	d->data = NULL;							\
+	d->begin = 0;							\
+	d->count = 0;							\
+	d->capacity = 0;						\
+}									\
+									\
+static inline void							\
+name##_destroy(struct name *d)						\
+{									\
+	free(d->data);							\
+}									\
+									\
+static inline size_t							\
+name##_size(const struct name *d)					\
+{									\
+	return d->count;						\
+}									\
+									\
+static inline bool							\
+name##_empty(const struct name *d)					\
+{									\
+	return d->count == 0;						\
+}									\
+									\
+/** Item by its index from the front. */				\
+static inline type *							\
+name##_at(const struct name *d, size_t i)				\
+{									\
+	return &d->data[(d->begin + i) & (d->capacity - 1)];		\
+}									\
+									\
+static inline type *							\
+name##_front(const struct name *d)					\
+{									\
+	return name##_at(d, 0);						\
+}									\
+									\
+static inline type *							\
+name##_back(const struct name *d)					\
+{									\
+	return name##_at(d, d->count - 1);				\
+}									\
+									\
+/** Make sure @a count more items fit without a reallocation. */	\
+static inline void							\
+name##_reserve(struct name *d, size_t count)				\
+{									\
+	size_t need = d->count + count;					\
+	if (need <= d->capacity)					\
+		return;							\
+	size_t cap = d->capacity == 0 ? DEQUE_MIN_CAPACITY : d->capacity;\
+	while (cap < need)						\
+		cap *= 2;						\
+	d->data = (type *)realloc(d->data, cap * sizeof(type));		\
+	/* The wrapped part goes after the old end. */			\
+	size_t tail = d->begin + d->count;				\
+	if (tail > d->capacity) {					\
+		memcpy(d->data + d->capacity, d->data,			\
+		       (tail - d->capacity) * sizeof(type));		\
+	}								\
+	d->capacity = cap;						\
+}									\
+									\
+static inline void							\
+name##_push_back(struct name *d, type item)				\
+{									\
+	if (d->count == d->capacity)					\
+		name##_reserve(d, 1);					\
+	*name##_at(d, d->count++) = item;				\
+}									\
+									\
+static inline void							\
+name##_push_front(struct name *d, type item)				\
+{									\
+	if (d->count == d->capacity)					\
+		name##_reserve(d, 1);					\
+	d->begin = (d->begin - 1) & (d->capacity - 1);			\
+	++d->count;							\
+	d->data[d->begin] = item;					\
+}									\
+									\
+/** @pre the deque is not empty */					\
+static inline type							\
+name##_pop_front(struct name *d)					\
+{									\
+	type res = d->data[d->begin];					\
+	d->begin = (d->begin + 1) & (d->capacity - 1);			\
+	--d->count;							\
+	return res;							\
+}									\
+									\
+/** @pre the deque is not empty */					\
+static inline type							\
+name##_pop_back(struct name *d)						\
+{									\
+	return *name##_at(d, --d->count);				\
+}
+
+/**
+ * foreach through all the items, from the front, i is the index
+ * and item is the pointer to the item
+ */
+#define deque_foreach(name, d, i, item)					\
+	for ((i) = 0; (i) < (d)->count &&				\
+	     ((item) = name##_at((d), (i)), true); ++(i))
+
+#if defined(__cplusplus)
+} /* extern "C" */
+#endif /* defined(__cplusplus) */
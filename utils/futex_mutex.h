@@ -0,0 +1,152 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sched.h>
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if defined(__cplusplus)
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+/**
+ * Mutex on a futex word with 3 states, as in "Futexes Are Tricky" by
+ * Ulrich Drepper:
+ * 0 - free;
+ * 1 - locked, nobody waits;
+ * 2 - locked, someone might wait in the kernel.
+ *
+ * Unlike the 0/1 lock of lecture_examples/6_threads/8_futex.c, the
+ * unlock makes the wake syscall only in the state 2. So a lock
+ * without contention costs two atomic operations and no syscalls.
+ *
+ * Before going to sleep the lock spins for a while, in case the
+ * owner is about to release it. The spin limit adapts like in
+ * PTHREAD_MUTEX_ADAPTIVE_NP of glibc: it follows the average of how
+ * long the recent spins took to get the lock, with some headroom.
+ * When the lock is held for long, the spins give up fast and the
+ * limit goes down.
+ *
+ * The mutex is zero-initialized, FUTEX_MUTEX_INITIALIZER is the same.
+ * It works between processes when placed in shared memory.
+ */
+
+enum {
+	/** Upper bound of the adaptive spin limit. */
+	FUTEX_MUTEX_MAX_SPIN = 100,
+};
+
+struct futex_mutex {
+	uint32_t state;
+	/** Average spin count of the recent contended locks. */
+	int32_t spin_avg;
+};
+
+#define FUTEX_MUTEX_INITIALIZER {0, 0}
+
+static inline void
+futex_mutex_create(struct futex_mutex *m)
+{
+	m->state = 0;
+	m->spin_avg = 0;
+}
+
+static inline void
+futex_mutex_destroy(struct futex_mutex *m)
+{
+	(void)m;
+}
+
+static inline void
+futex_mutex_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+static inline void
+futex_mutex_wait(uint32_t *addr, uint32_t value)
+{
+#if defined(__linux__)
+	/* Not FUTEX_PRIVATE, so the mutex works in shared memory. */
+	syscall(SYS_futex, addr, FUTEX_WAIT, value, NULL, NULL, 0);
+#else
+	(void)addr;
+	(void)value;
+	sched_yield();
+#endif
+}
+
+static inline void
+futex_mutex_wake(uint32_t *addr)
+{
+#if defined(__linux__)
+	syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+#else
+	(void)addr;
+#endif
+}
+
+/** Lock if free. Returns true on success. */
+static inline bool
+futex_mutex_trylock(struct futex_mutex *m)
+{
+	uint32_t expected = 0;
+	return __atomic_compare_exchange_n(&m->state, &expected, 1, false,
+					   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void
+futex_mutex_lock_slow(struct futex_mutex *m)
+{
+	int32_t avg = __atomic_load_n(&m->spin_avg, __ATOMIC_RELAXED);
+	int32_t limit = avg * 2 + 10;
+	if (limit > FUTEX_MUTEX_MAX_SPIN)
+		limit = FUTEX_MUTEX_MAX_SPIN;
+	int32_t spin = 0;
+	for (; spin < limit; ++spin) {
+		futex_mutex_cpu_relax();
+		/* Read first, not to steal the cache line with a CAS. */
+		if (__atomic_load_n(&m->state, __ATOMIC_RELAXED) == 0 &&
+		    futex_mutex_trylock(m)) {
+			__atomic_store_n(&m->spin_avg, avg + (spin - avg) / 8,
+					 __ATOMIC_RELAXED);
+			return;
+		}
+	}
+	__atomic_store_n(&m->spin_avg, avg + (spin - avg) / 8,
+			 __ATOMIC_RELAXED);
+	/*
+	 * From now on the state is set to 2 on each attempt. The lock
+	 * can't tell whether other waiters are left when it gets the
+	 * mutex, so it has to assume they are, and the unlock will wake.
+	 */
+	while (__atomic_exchange_n(&m->state, 2, __ATOMIC_ACQUIRE) != 0)
+		futex_mutex_wait(&m->state, 2);
+}
+
+static inline void
+futex_mutex_lock(struct futex_mutex *m)
+{
+	if (!futex_mutex_trylock(m))
+		futex_mutex_lock_slow(m);
+}
+
+static inline void
+futex_mutex_unlock(struct futex_mutex *m)
+{
+	if (__atomic_exchange_n(&m->state, 0, __ATOMIC_RELEASE) == 2)
+		futex_mutex_wake(&m->state);
+}
+
+#if defined(__cplusplus)
+} /* extern "C" */
+#endif /* defined(__cplusplus) */
@@ -0,0 +1,141 @@
+#define _GNU_SOURCE
+#include "futex_mutex.h"
+#include "unit_bench.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+/**
+ * The futex mutex against pthread_mutex and against the 0/1 lock of
+ * lecture_examples/6_threads/8_futex.c, which wakes on each unlock.
+ * The argument is the thread count. An iteration is one lock and
+ * unlock, done by any of the threads. The critical section is an
+ * increment of a shared counter.
+ */
+
+enum {
+	BENCH_OP_COUNT = 2 * 1000 * 1000,
+	BENCH_MAX_THREADS = 8,
+};
+
+static void
+naive_lock(uint32_t *futex)
+{
+	while (!__sync_bool_compare_and_swap(futex, 0, 1))
+		futex_mutex_wait(futex, 1);
+}
+
+static void
+naive_unlock(uint32_t *futex)
+{
+	__sync_bool_compare_and_swap(futex, 1, 0);
+	futex_mutex_wake(futex);
+}
+
+enum bench_lock_type {
+	BENCH_LOCK_FUTEX_MUTEX,
+	BENCH_LOCK_PTHREAD,
+	BENCH_LOCK_NAIVE,
+};
+
+struct bench_ctx {
+	enum bench_lock_type type;
+	long iterations;
+	struct futex_mutex fm;
+	pthread_mutex_t pm;
+	uint32_t naive;
+	bool is_started;
+	volatile uint64_t counter;
+};
+
+static void *
+bench_thread_f(void *arg)
+{
+	struct bench_ctx *ctx = arg;
+	while (!__atomic_load_n(&ctx->is_started, __ATOMIC_ACQUIRE))
+		futex_mutex_cpu_relax();
+	long n = ctx->iterations;
+	switch (ctx->type) {
+	case BENCH_LOCK_FUTEX_MUTEX:
+		for (long i = 0; i < n; ++i) {
+			futex_mutex_lock(&ctx->fm);
+			ctx->counter = ctx->counter + 1;
+			futex_mutex_unlock(&ctx->fm);
+		}
+		break;
+	case BENCH_LOCK_PTHREAD:
+		for (long i = 0; i < n; ++i) {
+			pthread_mutex_lock(&ctx->pm);
+			ctx->counter = ctx->counter + 1;
+			pthread_mutex_unlock(&ctx->pm);
+		}
+		break;
+	case BENCH_LOCK_NAIVE:
+		for (long i = 0; i < n; ++i) {
+			naive_lock(&ctx->naive);
+			ctx->counter = ctx->counter + 1;
+			naive_unlock(&ctx->naive);
+		}
+		break;
+	}
+	return NULL;
+}
+
+static void
+bench_lock(enum bench_lock_type type, long iterations, long thread_count)
+{
+	bench_pause();
+	struct bench_ctx ctx;
+	ctx.type = type;
+	ctx.iterations = iterations / thread_count;
+	futex_mutex_create(&ctx.fm);
+	pthread_mutex_init(&ctx.pm, NULL);
+	ctx.naive = 0;
+	ctx.is_started = false;
+	ctx.counter = 0;
+	pthread_t tids[BENCH_MAX_THREADS];
+	for (long i = 0; i < thread_count; ++i)
+		pthread_create(&tids[i], NULL, bench_thread_f, &ctx);
+	bench_resume();
+	__atomic_store_n(&ctx.is_started, true, __ATOMIC_RELEASE);
+	for (long i = 0; i < thread_count; ++i)
+		pthread_join(tids[i], NULL);
+	bench_pause();
+	if (ctx.counter != (uint64_t)(ctx.iterations * thread_count))
+		abort();
+	pthread_mutex_destroy(&ctx.pm);
+	futex_mutex_destroy(&ctx.fm);
+	bench_resume();
+}
+
+static void
+bench_futex_mutex(long iterations, long thread_count)
+{
+	bench_lock(BENCH_LOCK_FUTEX_MUTEX, iterations, thread_count);
+}
+
+static void
+bench_pthread_mutex(long iterations, long thread_count)
+{
+	bench_lock(BENCH_LOCK_PTHREAD, iterations, thread_count);
+}
+
+static void
+bench_naive_futex(long iterations, long thread_count)
+{
+	bench_lock(BENCH_LOCK_NAIVE, iterations, thread_count);
+}
+
+int
+main(int argc, char **argv)
+{
+	for (long threads = 1; threads <= BENCH_MAX_THREADS; threads *= 2) {
+		bench_register_arg("futex_mutex", bench_futex_mutex,
+				   BENCH_OP_COUNT, threads);
+		bench_register_arg("pthread_mutex", bench_pthread_mutex,
+				   BENCH_OP_COUNT, threads);
+		bench_register_arg("naive_futex", bench_naive_futex,
+				   BENCH_OP_COUNT, threads);
+	}
+	return bench_main(argc, argv);
+}
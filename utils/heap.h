@@ -0,0 +1,169 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+/**
+ * Min-heap of pointers to the items. An item stores its position in
+ * the heap in an intrusive size_t field. So it can be deleted or
+ * have its key changed in O(log n), without a search.
+ *
+ * HEAP_DEFINE(name, type, member, less, arity) defines struct name
+ * and its functions prefixed with name_:
+ * - type is the item type, member is its size_t position field;
+ * - less(a, b) compares 2 items given by pointers;
+ * - arity is 2 for a binary heap or 4 for a 4-ary one. The 4-ary
+ *   heap is 2 times flatter, and the children of a node mostly are
+ *   in one cache line. It is usually faster for big heaps, where
+ *   the pops are frequent.
+ *
+ * The position of an item which is not in a heap is HEAP_NO_POS.
+ */
+
+#define HEAP_NO_POS ((size_t)-1)
+
+enum {
+	HEAP_MIN_CAPACITY = 8,
+};
+
+#define HEAP_DEFINE(name, type, member, less, arity)			\
+									\
+struct name {								\
+	type **data;							\
+	size_t count;							\
+	size_t capacity;						\
+};									\
+									\
+static inline void							\
+name##_create(struct name *h)						\
+{									\
+	h->data = NULL;							\
+	h->count = 0;							\
+	h->capacity = 0;						\
+}									\
+									\
+static inline void							\
+name##_destroy(struct name *h)						\
+{									\
+	free(h->data);							\
+}									\
+									\
+static inline size_t							\
+name##_size(const struct name *h)					\
+{									\
+	return h->count;						\
+}									\
+									\
+static inline bool							\
+name##_empty(const struct name *h)					\
+{									\
+	return h->count == 0;						\
+}									\
+									\
+/** The smallest item or NULL. */					\
+static inline type *							\
+name##_top(const struct name *h)					\
+{									\
+	return h->count == 0 ? NULL : h->data[0];			\
+}									\
+									\
+static inline void							\
+name##_place(struct name *h, size_t pos, type *item)			\
+{									\
+	h->data[pos] = item;						\
+	item->member = pos;						\
+}									\
+									\
+static inline void							\
+name##_sift_up(struct name *h, size_t pos)				\
+{									\
+	type *item = h->data[pos];					\
+	while (pos > 0) {						\
+		size_t parent = (pos - 1) / (arity);			\
+		if (!less(item, h->data[parent]))			\
+			break;						\
+		name##_place(h, pos, h->data[parent]);			\
+		pos = parent;						\
+	}								\
+	name##_place(h, pos, item);					\
+}									\
+									\
+static inline void							\
+name##_sift_down(struct name *h, size_t pos)				\
+{									\
+	type *item = h->data[pos];					\
+	while (true) {							\
+		size_t first = pos * (arity) + 1;			\
+		if (first >= h->count)					\
+			break;						\
+		size_t end = first + (arity);				\
+		if (end > h->count)					\
+			end = h->count;					\
+		size_t min = first;					\
+		for (size_t i = first + 1; i < end; ++i) {		\
+			if (less(h->data[i], h->data[min]))		\
+				min = i;				\
+		}							\
+		if (!less(h->data[min], item))				\
+			break;						\
+		name##_place(h, pos, h->data[min]);			\
+		pos = min;						\
+	}								\
+	name##_place(h, pos, item);					\
+}									\
+									\
+static inline void							\
+name##_push(struct name *h, type *item)					\
+{									\
+	if (h->count == h->capacity) {					\
+		h->capacity = h->capacity == 0 ?			\
+			HEAP_MIN_CAPACITY : h->capacity * 2;		\
+		h->data = (type **)realloc(h->data,			\
+			h->capacity * sizeof(h->data[0]));		\
+	}								\
+	h->data[h->count] = item;					\
+	name##_sift_up(h, h->count++);					\
+}									\
+									\
+/** Remove the item from any place in the heap. */			\
+static inline void							\
+name##_delete(struct name *h, type *item)				\
+{									\
+	size_t pos = item->member;					\
+	item->member = HEAP_NO_POS;					\
+	type *last = h->data[--h->count];				\
+	if (last == item)						\
+		return;							\
+	name##_place(h, pos, last);					\
+	if (pos > 0 && less(last, h->data[(pos - 1) / (arity)]))	\
+		name##_sift_up(h, pos);					\
+	else								\
+		name##_sift_down(h, pos);				\
+}									\
+									\
+/** Remove the smallest item and return it or NULL. */			\
+static inline type *							\
+name##_pop(struct name *h)						\
+{									\
+	type *res = name##_top(h);					\
+	if (res != NULL)						\
+		name##_delete(h, res);					\
+	return res;							\
+}									\
+									\
+/** Restore the order after the key of the item was changed. */	\
+static inline void							\
+name##_update(struct name *h, type *item)				\
+{									\
+	name##_sift_up(h, item->member);				\
+	name##_sift_down(h, item->member);				\
+}
+
+#if defined(__cplusplus)
+} /* extern "C" */
+#endif /* defined(__cplusplus) */
@@ -4,6 +4,7 @@
 #include <dlfcn.h>
 #include <errno.h>
 #include <execinfo.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -11,6 +12,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 
 #if __APPLE__
@@ -24,6 +26,23 @@
 enum {
 	MAX_BACKTRACE_LEN = 64,
 	ALLOCATION_BATCH_SIZE = 1024,
+	// Initial capacity of an allocation table, as a power of 2.
+	ALLOCATION_TABLE_MIN_BITS = 10,
+	ALLOCATION_SHARD_COUNT = 64,
+	TRACE_TABLE_MIN_BITS = 10,
+	TRACE_SHARD_COUNT = 16,
+	// The traces are stored in mmap()-ed chunks of this size.
+	TRACE_CHUNK_SIZE = 64 * 1024,
+	// Power of 2 size classes of the profile.
+	SIZE_CLASS_COUNT = 65,
+	PROFILE_TOP_SITE_COUNT = 5,
+	// Frames of a call site shown in the profile.
+	PROFILE_SITE_FRAME_COUNT = 6,
+	// Limits of the freed guarded allocations kept inaccessible.
+	GUARD_QUARANTINE_COUNT = 4096,
+	GUARD_QUARANTINE_BYTES = 256 * 1024 * 1024,
+	GUARD_HEADER_MAGIC = 0x48484755,
+	GUARD_ALIGNMENT = 16,
 };
 
 enum report_mode {
@@ -33,11 +52,18 @@ enum report_mode {
 	REPORT_MODE_LEAKS,
 	// Do not report anything.
 	REPORT_MODE_QUIET,
+	// Be an allocation profiler. Print the sizes, the peak, the top call
+	// sites, the short-lived allocations. Then report like the verbose mode.
+	REPORT_MODE_PROFILE,
 };
 
 enum backtrace_mode {
 	BACKTRACE_ON,
 	BACKTRACE_OFF,
+	// Capture one allocation in N.
+	BACKTRACE_SAMPLE_COUNT,
+	// Capture one allocation per N bytes allocated.
+	BACKTRACE_SAMPLE_BYTES,
 };
 
 enum content_mode {
@@ -49,13 +75,30 @@ enum content_mode {
 	CONTENT_MODE_TRASH,
 };
 
+// A call stack. It is stored once for all the allocations having it, and is
+// never freed.
+struct trace {
+	uint64_t hash;
+	// Profile of the call site. Updated without locks.
+	uint64_t alloc_count;
+	uint64_t alloc_bytes;
+	int size;
+	void *frames[];
+};
+
 // Single allocation done on the heap by a user.
 struct allocation {
-	void *trace[MAX_BACKTRACE_LEN];
-	int trace_size;
+	// NULL when the backtrace wasn't captured.
+	struct trace *trace;
 	int depth;
 	void *mem;
 	size_t size;
+	// Microseconds since the start. Only in the profile mode.
+	uint64_t time_us;
+	// Number of the allocation in its shard. The snapshots use it to tell the
+	// allocations done after them.
+	uint64_t seq;
+	// Link in the pool of the unused objects.
 	struct allocation *next;
 };
 
@@ -69,33 +112,116 @@ struct allocation_batch {
 struct symbol {
 	const char *file;
 	const char *name;
+	// Offset in the file. The static functions and the ones of a binary not
+	// built with -rdynamic have no name, but addr2line finds them by it.
+	uintptr_t offset;
 };
 
+// The thread-locals are accessed on each call. The initial-exec model makes it
+// a plain load, even when heap help is built into a shared library.
+#define HEAPH_TLS __thread __attribute__((tls_model("initial-exec")))
+
 static bool init_lock = false;
 static bool is_init_done = false;
 static bool is_exit_done = false;
-static __thread int init_lock_count = 0;
-static __thread int depth = 0;
+static HEAPH_TLS int init_lock_count = 0;
+static HEAPH_TLS int depth = 0;
 static enum report_mode report_mode = REPORT_MODE_LEAKS;
 static enum content_mode content_mode = CONTENT_MODE_ORIGINAL;
 static enum backtrace_mode backtrace_mode = BACKTRACE_ON;
+static uint64_t backtrace_sample_rate = 1;
+// Allocations or bytes left till the next sampled backtrace.
+static HEAPH_TLS uint64_t backtrace_sample_left = 0;
 
 // Before the original heap functions are retrieved, there is a dummy static
 // allocator working. It is needed because on some platforms the original
 // functions getting via dlsym() itself can do allocations. Which means there
-// has to be some allocation technique before the symbols are known.
-static int static_size = 0;
-static int static_used = 0;
-static uint8_t* static_buf = NULL;
-
-static bool allocs_lock = false;
-static int64_t alloc_count = 0;
-static uint64_t alloc_count_total = 0;
-static struct allocation *allocs = NULL;
-// Unused allocation objects. For re-use.
-static struct allocation *alloc_pool = NULL;
-// Freshly created allocation objects. Taken from here when the pool is empty.
-static struct allocation_batch *alloc_batch = NULL;
+// has to be some allocation technique before the symbols are known. It is only
+// used by the thread doing the initialization, under init_lock. The others
+// wait for the initialization to end.
+enum {
+	STATIC_BUF_SIZE = 16 * 1024,
+	STATIC_ALIGNMENT = 16,
+};
+static size_t static_used = 0;
+static uint8_t static_buf[STATIC_BUF_SIZE]
+	__attribute__((aligned(STATIC_ALIGNMENT)));
+
+// The live allocations are split into shards by the pointer hash. Each shard
+// has its own lock, table, and pool. So the threads allocating at the same time
+// mostly take different locks.
+struct allocation_shard {
+	bool lock;
+	int64_t count;
+	uint64_t count_total;
+	// Live allocations. An open addressing hash table with linear probing,
+	// keyed by the user's memory pointer. It is mmap()-ed for the same reason
+	// as the allocation objects. Is grown 2 times when gets half full.
+	struct allocation **table;
+	int table_bits;
+	// Unused allocation objects. For re-use.
+	struct allocation *pool;
+	// Freshly created allocation objects. Taken from here when the pool is
+	// empty.
+	struct allocation_batch *batch;
+	// Profile. The allocations by size class, and those freed quickly.
+	uint64_t size_classes[SIZE_CLASS_COUNT];
+	uint64_t churn_count;
+	uint64_t churn_bytes;
+} __attribute__((aligned(64)));
+
+static struct allocation_shard alloc_shards[ALLOCATION_SHARD_COUNT];
+
+// The unique call stacks, sharded by their hash like the allocations.
+struct trace_shard {
+	bool lock;
+	int64_t count;
+	// Open addressing hash table with linear probing. The traces are never
+	// deleted.
+	struct trace **table;
+	int table_bits;
+	// Free space in the current chunk of the traces.
+	char *chunk_pos;
+	char *chunk_end;
+} __attribute__((aligned(64)));
+
+static struct trace_shard trace_shards[TRACE_SHARD_COUNT];
+
+// The guard mode. Each allocation gets own pages, with the user's memory ending
+// right at a PROT_NONE page. The freed ones are made PROT_NONE too and are
+// kept in a quarantine for a while, so their reuse would crash.
+static size_t guard_page_size = 0;
+// The real free(), for the memory which didn't come from the guard allocator.
+static void (*guard_next_free)(void *) = NULL;
+
+// Precedes the user's memory, in the beginning of the page of its first byte
+// minus the header size. So it is found without any lookups.
+struct guard_header {
+	uint64_t magic;
+	void *map;
+	size_t map_size;
+	size_t size;
+};
+
+struct guard_quarantine_entry {
+	void *map;
+	size_t map_size;
+};
+
+// A ring of the freed mappings. The oldest are unmapped when it is full.
+static bool guard_quarantine_lock = false;
+static struct guard_quarantine_entry guard_quarantine[GUARD_QUARANTINE_COUNT];
+static size_t guard_quarantine_begin = 0;
+static size_t guard_quarantine_count = 0;
+static size_t guard_quarantine_bytes = 0;
+
+// The profile mode's global numbers. Atomic, they aren't in the shards.
+static uint64_t profile_start_us = 0;
+static int64_t profile_live_bytes = 0;
+static int64_t profile_peak_bytes = 0;
+static uint64_t profile_peak_us = 0;
+// The allocations freed sooner than that are the churn.
+static uint64_t profile_churn_us = 100;
 
 static void *(*default_malloc)(size_t) = NULL;
 static void (*default_free)(void *) = NULL;
@@ -107,6 +233,54 @@ static int (*default_getaddrinfo)(
 	const char *, const char *, const struct addrinfo *,
 	struct addrinfo **) = NULL;
 static void (*default_freeaddrinfo)(struct addrinfo *) = NULL;
+static int (*default_posix_memalign)(void **, size_t, size_t) = NULL;
+static void *(*default_aligned_alloc)(size_t, size_t) = NULL;
+static void *(*default_memalign)(size_t, size_t) = NULL;
+static char *(*default_strndup)(const char *, size_t) = NULL;
+// C++ operators new. They are called as is, so as to keep their new_handler
+// and exceptions. They are absent when the app doesn't use libstdc++.
+static void *(*default_new)(size_t) = NULL;
+static void *(*default_new_arr)(size_t) = NULL;
+static void *(*default_new_nothrow)(size_t, const void *) = NULL;
+static void *(*default_new_arr_nothrow)(size_t, const void *) = NULL;
+static void *(*default_new_aligned)(size_t, size_t) = NULL;
+static void *(*default_new_arr_aligned)(size_t, size_t) = NULL;
+static void *(*default_new_aligned_nothrow)(
+	size_t, size_t, const void *) = NULL;
+static void *(*default_new_arr_aligned_nothrow)(
+	size_t, size_t, const void *) = NULL;
+
+// The reports go to stdout, or to the file of HHOUTPUT when it is set. "%p" in
+// its name is the pid, so each process started or forked with heap help in
+// LD_PRELOAD gets its own file. It is opened at the first report of a process.
+static char output_path[256] = {0};
+static int output_fd = -1;
+static pid_t output_pid = 0;
+
+static int
+heaph_output_fd(void)
+{
+	if (output_path[0] == 0)
+		return STDOUT_FILENO;
+	pid_t pid = getpid();
+	// A forked child has the parent's descriptor. It is left to the parent.
+	if (output_fd >= 0 && output_pid == pid)
+		return output_fd;
+	char path[sizeof(output_path) + 16];
+	size_t len = 0;
+	for (const char *c = output_path; *c != 0; ++c) {
+		if (len + 12 >= sizeof(path))
+			break;
+		if (c[0] == '%' && c[1] == 'p')
+			len += sprintf(path + len, "%d", (int)pid), ++c;
+		else
+			path[len++] = *c;
+	}
+	path[len] = 0;
+	output_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	output_pid = pid;
+	return output_fd >= 0 ? output_fd : STDOUT_FILENO;
+}
 
 static void
 heaph_printf(const char *format, ...)
@@ -116,7 +290,7 @@ heaph_printf(const char *format, ...)
 	char msg[1024];
 	vsnprintf(msg, sizeof(msg), format, args);
 	va_end(args);
-	write(STDOUT_FILENO, msg, strlen(msg));
+	write(heaph_output_fd(), msg, strlen(msg));
 }
 
 static void
@@ -132,7 +306,7 @@ heaph_assert_do(bool flag, const char *expr, int line)
 	heaph_printf("\n");
 	heaph_printf("HH: assertion failure, line %d\n", line);
 	heaph_printf("HH: ");
-	write(STDOUT_FILENO, expr, strlen(expr));
+	write(heaph_output_fd(), expr, strlen(expr));
 	heaph_printf("\n");
 	abort();
 }
@@ -146,7 +320,7 @@ spinlock_acq(bool *lock)
 	while (true) {
 		int i = 0;
 		while (i++ < 1000) {
-			if (!__atomic_test_and_set(lock, __ATOMIC_SEQ_CST))
+			if (!__atomic_test_and_set(lock, __ATOMIC_ACQUIRE))
 				return;
 		}
 		usleep(10);
@@ -157,14 +331,352 @@ static void
 spinlock_rel(bool *lock)
 {
 	heaph_assert(*lock);
-	__atomic_clear(lock, __ATOMIC_SEQ_CST);
+	// Release is enough. Seq-cst would add a full fence to each unlock.
+	__atomic_clear(lock, __ATOMIC_RELEASE);
 }
 
 static bool
 alloc_is_static(const void *ptr)
 {
-	return ptr != NULL && ptr >= (void *)static_buf &&
-		ptr <= (void *)(static_buf + static_size);
+	return ptr >= (void *)static_buf &&
+		ptr < (void *)(static_buf + STATIC_BUF_SIZE);
+}
+
+static uint64_t
+alloc_hash(const void *ptr)
+{
+	// Fibonacci hashing. The low bits of the heap pointers are mostly the same
+	// due to alignment, so the high bits of the product are used. The top ones
+	// for the slot in a table, the next ones for the shard.
+	return (uint64_t)(uintptr_t)ptr * 0x9E3779B97F4A7C15ull;
+}
+
+static struct allocation_shard *
+alloc_shard(const void *ptr)
+{
+	return &alloc_shards[(alloc_hash(ptr) >> 26) % ALLOCATION_SHARD_COUNT];
+}
+
+static size_t
+alloc_table_slot(const struct allocation_shard *sh, const void *ptr)
+{
+	return (size_t)(alloc_hash(ptr) >> (64 - sh->table_bits));
+}
+
+static size_t
+alloc_table_cap(const struct allocation_shard *sh)
+{
+	return sh->table_bits == 0 ? 0 : (size_t)1 << sh->table_bits;
+}
+
+static struct allocation **
+alloc_table_new(int bits)
+{
+	size_t size = sizeof(struct allocation *) << bits;
+	struct allocation **res = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_ANON | MAP_PRIVATE, -1, 0);
+	heaph_assert(res != MAP_FAILED);
+	// Anonymous mappings are zeroed, so all the slots are empty.
+	return res;
+}
+
+static void
+alloc_table_put(struct allocation_shard *sh, struct allocation *a)
+{
+	size_t mask = alloc_table_cap(sh) - 1;
+	size_t i = alloc_table_slot(sh, a->mem);
+	while (sh->table[i] != NULL) {
+		heaph_assert(sh->table[i]->mem != a->mem);
+		i = (i + 1) & mask;
+	}
+	sh->table[i] = a;
+}
+
+// Make sure there is space for one more allocation. Must be called under the
+// shard's lock.
+static void
+alloc_table_reserve(struct allocation_shard *sh)
+{
+	size_t cap = alloc_table_cap(sh);
+	if ((size_t)(sh->count + 1) * 2 <= cap)
+		return;
+	struct allocation **old = sh->table;
+	int bits = sh->table_bits == 0 ?
+		ALLOCATION_TABLE_MIN_BITS : sh->table_bits + 1;
+	// The shard takes the hash bits right below the table's top ones.
+	heaph_assert(bits <= 64 - 26 - 6);
+	sh->table = alloc_table_new(bits);
+	sh->table_bits = bits;
+	for (size_t i = 0; i < cap; ++i) {
+		if (old[i] != NULL)
+			alloc_table_put(sh, old[i]);
+	}
+	if (old != NULL)
+		munmap(old, sizeof(*old) * cap);
+}
+
+// Slot of the allocation with the given memory, or -1. Must be called under the
+// shard's lock.
+static ssize_t
+alloc_table_find(const struct allocation_shard *sh, const void *ptr)
+{
+	if (sh->table == NULL)
+		return -1;
+	size_t mask = alloc_table_cap(sh) - 1;
+	size_t i = alloc_table_slot(sh, ptr);
+	struct allocation *a;
+	while ((a = sh->table[i]) != NULL) {
+		if (a->mem == ptr)
+			return i;
+		i = (i + 1) & mask;
+	}
+	return -1;
+}
+
+// Empty the slot. The next entries of the probe chain are shifted back into the
+// hole when they can, so as there are no tombstones and the lookups stay short.
+static void
+alloc_table_delete(struct allocation_shard *sh, size_t idx)
+{
+	size_t mask = alloc_table_cap(sh) - 1;
+	size_t hole = idx;
+	size_t i = idx;
+	while (true) {
+		i = (i + 1) & mask;
+		struct allocation *a = sh->table[i];
+		if (a == NULL)
+			break;
+		size_t home = alloc_table_slot(sh, a->mem);
+		// Can move into the hole only if the hole is not before the entry's
+		// home slot in its probe chain.
+		if (((i - home) & mask) >= ((i - hole) & mask)) {
+			sh->table[hole] = a;
+			hole = i;
+		}
+	}
+	sh->table[hole] = NULL;
+}
+
+// Must be called under the shard's lock.
+static struct allocation *
+alloc_shard_new_object(struct allocation_shard *sh)
+{
+	struct allocation *a = sh->pool;
+	if (a != NULL) {
+		sh->pool = a->next;
+		return a;
+	}
+	if (sh->batch == NULL || sh->batch->used == ALLOCATION_BATCH_SIZE) {
+		sh->batch = mmap(NULL, sizeof(*sh->batch),
+			PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+		heaph_assert(sh->batch != MAP_FAILED);
+		sh->batch->used = 0;
+	} else {
+		heaph_assert(sh->batch->used < ALLOCATION_BATCH_SIZE);
+	}
+	return &sh->batch->allocs[sh->batch->used++];
+}
+
+// For the reports, to see all the shards at one moment.
+static void
+alloc_shards_lock_all(void)
+{
+	for (int i = 0; i < ALLOCATION_SHARD_COUNT; ++i)
+		spinlock_acq(&alloc_shards[i].lock);
+}
+
+static void
+alloc_shards_unlock_all(void)
+{
+	for (int i = 0; i < ALLOCATION_SHARD_COUNT; ++i)
+		spinlock_rel(&alloc_shards[i].lock);
+}
+
+// Iterate all the live allocations. The positions start from zeros. Must be
+// called under all the shard locks.
+static const struct allocation *
+alloc_shards_next(int *shard_idx, size_t *slot_idx)
+{
+	for (; *shard_idx < ALLOCATION_SHARD_COUNT; ++*shard_idx, *slot_idx = 0) {
+		const struct allocation_shard *sh = &alloc_shards[*shard_idx];
+		size_t cap = alloc_table_cap(sh);
+		while (*slot_idx < cap) {
+			const struct allocation *a = sh->table[(*slot_idx)++];
+			if (a != NULL)
+				return a;
+		}
+	}
+	return NULL;
+}
+
+static uint64_t
+heaph_now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Size class, the power of 2 which is >= the size.
+static int
+profile_size_class(size_t size)
+{
+	return size <= 1 ? 0 : 64 - __builtin_clzll(size - 1);
+}
+
+static void
+profile_on_new(struct allocation_shard *sh, struct allocation *a)
+{
+	a->time_us = heaph_now_us();
+	++sh->size_classes[profile_size_class(a->size)];
+	if (a->trace != NULL) {
+		__atomic_add_fetch(&a->trace->alloc_count, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&a->trace->alloc_bytes, a->size,
+			__ATOMIC_RELAXED);
+	}
+	int64_t live = __atomic_add_fetch(&profile_live_bytes, a->size,
+		__ATOMIC_RELAXED);
+	int64_t peak = __atomic_load_n(&profile_peak_bytes, __ATOMIC_RELAXED);
+	while (live > peak) {
+		if (__atomic_compare_exchange_n(&profile_peak_bytes, &peak, live,
+						true, __ATOMIC_RELAXED,
+						__ATOMIC_RELAXED)) {
+			__atomic_store_n(&profile_peak_us,
+				a->time_us - profile_start_us, __ATOMIC_RELAXED);
+			break;
+		}
+	}
+}
+
+static void
+profile_on_free(struct allocation_shard *sh, const struct allocation *a)
+{
+	__atomic_sub_fetch(&profile_live_bytes, a->size, __ATOMIC_RELAXED);
+	if (heaph_now_us() - a->time_us >= profile_churn_us)
+		return;
+	++sh->churn_count;
+	sh->churn_bytes += a->size;
+}
+
+static uint64_t
+trace_hash(void *const *frames, int size)
+{
+	uint64_t h = (uint64_t)size;
+	for (int i = 0; i < size; ++i)
+		h = (h ^ (uint64_t)(uintptr_t)frames[i]) * 0x100000001B3ull;
+	// The table slot comes from the top bits, so mix the low ones up there.
+	h ^= h >> 29;
+	return h * 0x9E3779B97F4A7C15ull;
+}
+
+static size_t
+trace_table_cap(const struct trace_shard *sh)
+{
+	return sh->table_bits == 0 ? 0 : (size_t)1 << sh->table_bits;
+}
+
+static void
+trace_table_put(struct trace_shard *sh, struct trace *t)
+{
+	size_t mask = trace_table_cap(sh) - 1;
+	size_t i = (size_t)(t->hash >> (64 - sh->table_bits));
+	while (sh->table[i] != NULL)
+		i = (i + 1) & mask;
+	sh->table[i] = t;
+}
+
+static void
+trace_table_reserve(struct trace_shard *sh)
+{
+	size_t cap = trace_table_cap(sh);
+	if ((size_t)(sh->count + 1) * 2 <= cap)
+		return;
+	struct trace **old = sh->table;
+	int bits = sh->table_bits == 0 ?
+		TRACE_TABLE_MIN_BITS : sh->table_bits + 1;
+	size_t size = sizeof(*old) << bits;
+	sh->table = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_ANON | MAP_PRIVATE, -1, 0);
+	heaph_assert(sh->table != MAP_FAILED);
+	sh->table_bits = bits;
+	for (size_t i = 0; i < cap; ++i) {
+		if (old[i] != NULL)
+			trace_table_put(sh, old[i]);
+	}
+	if (old != NULL)
+		munmap(old, sizeof(*old) * cap);
+}
+
+// The stored copy of the call stack. The same frames always give the same
+// trace.
+static struct trace *
+trace_intern(void *const *frames, int size)
+{
+	uint64_t hash = trace_hash(frames, size);
+	struct trace_shard *sh = &trace_shards[(hash >> 20) % TRACE_SHARD_COUNT];
+	size_t frames_size = sizeof(frames[0]) * size;
+	spinlock_acq(&sh->lock);
+	if (sh->table != NULL) {
+		size_t mask = trace_table_cap(sh) - 1;
+		size_t i = (size_t)(hash >> (64 - sh->table_bits));
+		struct trace *t;
+		while ((t = sh->table[i]) != NULL) {
+			if (t->hash == hash && t->size == size &&
+			    memcmp(t->frames, frames, frames_size) == 0) {
+				spinlock_rel(&sh->lock);
+				return t;
+			}
+			i = (i + 1) & mask;
+		}
+	}
+	size_t trace_size = sizeof(struct trace) + frames_size;
+	trace_size = (trace_size + 7) & ~(size_t)7;
+	if ((size_t)(sh->chunk_end - sh->chunk_pos) < trace_size) {
+		sh->chunk_pos = mmap(NULL, TRACE_CHUNK_SIZE,
+			PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+		heaph_assert(sh->chunk_pos != MAP_FAILED);
+		sh->chunk_end = sh->chunk_pos + TRACE_CHUNK_SIZE;
+	}
+	struct trace *t = (struct trace *)sh->chunk_pos;
+	sh->chunk_pos += trace_size;
+	t->hash = hash;
+	t->alloc_count = 0;
+	t->alloc_bytes = 0;
+	t->size = size;
+	memcpy(t->frames, frames, frames_size);
+	trace_table_reserve(sh);
+	trace_table_put(sh, t);
+	++sh->count;
+	spinlock_rel(&sh->lock);
+	return t;
+}
+
+// Whether the new allocation of the given size has to capture its backtrace.
+static bool
+trace_is_sampled(size_t size)
+{
+	switch (backtrace_mode) {
+	case BACKTRACE_ON:
+		return true;
+	case BACKTRACE_OFF:
+		return false;
+	case BACKTRACE_SAMPLE_COUNT:
+		if (backtrace_sample_left > 0) {
+			--backtrace_sample_left;
+			return false;
+		}
+		backtrace_sample_left = backtrace_sample_rate - 1;
+		return true;
+	case BACKTRACE_SAMPLE_BYTES:
+		if (size < backtrace_sample_left) {
+			backtrace_sample_left -= size;
+			return false;
+		}
+		backtrace_sample_left = backtrace_sample_rate;
+		return true;
+	}
+	heaph_assert(false);
+	return false;
 }
 
 static void
@@ -182,40 +694,32 @@ alloc_trace_new(void *ptr, size_t size)
 	heaph_assert(is_init_done);
 	if (is_exit_done)
 		return;
-	spinlock_acq(&allocs_lock);
-	struct allocation *a = alloc_pool;
-	if (a != NULL) {
-		alloc_pool = a->next;
-	} else {
-		if (alloc_batch == NULL ||
-		    alloc_batch->used == ALLOCATION_BATCH_SIZE) {
-			alloc_batch = mmap(NULL,
-				sizeof(*alloc_batch), PROT_READ | PROT_WRITE,
-				MAP_ANON | MAP_PRIVATE, -1, 0);
-			heaph_assert(alloc_batch != MAP_FAILED);
-			alloc_batch->used = 0;
-		} else {
-			heaph_assert(alloc_batch->used < ALLOCATION_BATCH_SIZE);
-		}
-		a = &alloc_batch->allocs[alloc_batch->used++];
+	// The backtrace is taken before locking, it is the slowest part.
+	struct trace *trace = NULL;
+	if (depth == 1 && trace_is_sampled(size)) {
+		void *frames[MAX_BACKTRACE_LEN];
+		int frame_count = backtrace(frames, MAX_BACKTRACE_LEN);
+		heaph_assert(frame_count >= 0);
+		trace = trace_intern(frames, frame_count);
 	}
-	spinlock_rel(&allocs_lock);
 
+	struct allocation_shard *sh = alloc_shard(ptr);
+	spinlock_acq(&sh->lock);
+	struct allocation *a = alloc_shard_new_object(sh);
 	a->mem = ptr;
 	a->size = size;
 	a->depth = depth;
-	if (depth == 1 && backtrace_mode == BACKTRACE_ON)
-		a->trace_size = backtrace(a->trace, MAX_BACKTRACE_LEN);
-	else
-		a->trace_size = 0;
-	heaph_assert(a->trace_size >= 0);
-
-	spinlock_acq(&allocs_lock);
-	a->next = allocs;
-	allocs = a;
-	++alloc_count;
-	++alloc_count_total;
-	spinlock_rel(&allocs_lock);
+	a->trace = trace;
+	a->seq = sh->count_total;
+	if (report_mode == REPORT_MODE_PROFILE)
+		profile_on_new(sh, a);
+	alloc_table_reserve(sh);
+	alloc_table_put(sh, a);
+	// Atomic for the lock-free reads of the count.
+	__atomic_store_n(&sh->count, sh->count + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&sh->count_total, sh->count_total + 1,
+		__ATOMIC_RELAXED);
+	spinlock_rel(&sh->lock);
 }
 
 static size_t
@@ -228,29 +732,27 @@ alloc_untrace(void *ptr)
 	heaph_assert(is_init_done);
 	if (is_exit_done)
 		return 0;
-	spinlock_acq(&allocs_lock);
-	struct allocation *a = allocs;
-	struct allocation *prev = NULL;
-	while (a != NULL) {
-		if (a->mem == ptr) {
-			if (prev == NULL)
-				allocs = a->next;
-			else
-				prev->next = a->next;
-			a->next = alloc_pool;
-			alloc_pool = a;
-			int64_t new_count = --alloc_count;
-			spinlock_rel(&allocs_lock);
-
-			heaph_assert(new_count >= 0 && "freeing bad memory");
-			return a->size;
-		}
-		prev = a;
-		a = a->next;
+	struct allocation_shard *sh = alloc_shard(ptr);
+	spinlock_acq(&sh->lock);
+	ssize_t idx = alloc_table_find(sh, ptr);
+	if (idx < 0) {
+		spinlock_rel(&sh->lock);
+		heaph_assert(!"freeing bad memory");
+		return 0;
 	}
-	spinlock_rel(&allocs_lock);
-	heaph_assert(!"freeing bad memory");
-	return 0;
+	struct allocation *a = sh->table[idx];
+	alloc_table_delete(sh, idx);
+	if (report_mode == REPORT_MODE_PROFILE)
+		profile_on_free(sh, a);
+	a->next = sh->pool;
+	sh->pool = a;
+	int64_t new_count = sh->count - 1;
+	__atomic_store_n(&sh->count, new_count, __ATOMIC_RELAXED);
+	size_t size = a->size;
+	spinlock_rel(&sh->lock);
+
+	heaph_assert(new_count >= 0 && "freeing bad memory");
+	return size;
 }
 
 static const struct allocation *
@@ -263,28 +765,12 @@ alloc_find(void *ptr)
 	heaph_assert(is_init_done);
 	if (is_exit_done)
 		return NULL;
-	spinlock_acq(&allocs_lock);
-	struct allocation *a = allocs;
-	while (a != NULL) {
-		if (a->mem == ptr) {
-			spinlock_rel(&allocs_lock);
-			return a;
-		}
-		a = a->next;
-	}
-	spinlock_rel(&allocs_lock);
-	return NULL;
-}
-
-static void
-static_allocator_touch(void)
-{
-	if (static_buf != NULL)
-		return;
-	static_size = 16 * 1024;
-	static_buf = mmap(NULL, static_size, PROT_READ | PROT_WRITE,
-			  MAP_ANON | MAP_PRIVATE, -1, 0);
-	heaph_assert(static_buf != MAP_FAILED);
+	struct allocation_shard *sh = alloc_shard(ptr);
+	spinlock_acq(&sh->lock);
+	ssize_t idx = alloc_table_find(sh, ptr);
+	struct allocation *a = idx < 0 ? NULL : sh->table[idx];
+	spinlock_rel(&sh->lock);
+	return a;
 }
 
 static void *
@@ -292,13 +778,14 @@ static_malloc(size_t size)
 {
 	heaph_assert(!is_init_done);
 	heaph_assert(init_lock);
-	static_allocator_touch();
-	heaph_assert(static_size >= static_used);
-	heaph_assert(size < (size_t)(static_size - static_used));
+	heaph_assert(STATIC_BUF_SIZE >= static_used);
+	heaph_assert(size < STATIC_BUF_SIZE - static_used);
 	void *res = static_buf + static_used;
 	if (content_mode == CONTENT_MODE_TRASH)
 		memset(res, '#', size);
-	static_used += size;
+	size = (size + STATIC_ALIGNMENT - 1) & ~(size_t)(STATIC_ALIGNMENT - 1);
+	static_used += size < STATIC_BUF_SIZE - static_used ?
+		size : STATIC_BUF_SIZE - static_used;
 	return res;
 }
 
@@ -307,7 +794,6 @@ static_free(void *ptr)
 {
 	heaph_assert(!is_init_done);
 	heaph_assert(init_lock);
-	static_allocator_touch();
 	if (ptr != NULL)
 		heaph_assert(alloc_is_static(ptr));
 	(void)ptr;
@@ -322,6 +808,148 @@ static_calloc(size_t count, size_t size)
 	return res;
 }
 
+static struct guard_header *
+guard_header(void *ptr)
+{
+	uintptr_t addr = (uintptr_t)ptr - sizeof(struct guard_header);
+	return (struct guard_header *)(addr & ~(uintptr_t)(guard_page_size - 1));
+}
+
+static void *
+guard_alloc(size_t size, size_t alignment)
+{
+	if (alignment < GUARD_ALIGNMENT)
+		alignment = GUARD_ALIGNMENT;
+	size_t page = guard_page_size;
+	size_t data_size = sizeof(struct guard_header) + size + alignment - 1;
+	if (data_size < size)
+		return NULL;
+	data_size = (data_size + page - 1) & ~(page - 1);
+	size_t map_size = data_size + page;
+	char *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+			 MAP_ANON | MAP_PRIVATE, -1, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+	if (mprotect(map + data_size, page, PROT_NONE) != 0) {
+		munmap(map, map_size);
+		return NULL;
+	}
+	// The end is as close to the guard page as the alignment allows.
+	uintptr_t res = (uintptr_t)(map + data_size) - size;
+	res &= ~(uintptr_t)(alignment - 1);
+	struct guard_header *h = guard_header((void *)res);
+	h->magic = GUARD_HEADER_MAGIC;
+	h->map = map;
+	h->map_size = map_size;
+	h->size = size;
+	return (void *)res;
+}
+
+static void *
+guard_malloc(size_t size)
+{
+	return guard_alloc(size, 0);
+}
+
+static void *
+guard_calloc(size_t count, size_t size)
+{
+	size_t total;
+	if (__builtin_mul_overflow(count, size, &total))
+		return NULL;
+	// Fresh pages are zeros.
+	return guard_alloc(total, 0);
+}
+
+static void
+guard_free(void *ptr)
+{
+	if (ptr == NULL)
+		return;
+	struct guard_header *h = guard_header(ptr);
+	if (h->magic != GUARD_HEADER_MAGIC || (void *)h < h->map ||
+	    (char *)ptr >= (char *)h->map + h->map_size) {
+		// Not from this allocator. Like the memory which the standard
+		// library allocated not via malloc().
+		guard_next_free(ptr);
+		return;
+	}
+	void *map = h->map;
+	size_t map_size = h->map_size;
+	// The pages are given back to the kernel but the addresses stay
+	// reserved and inaccessible.
+	madvise(map, map_size, MADV_DONTNEED);
+	heaph_assert(mprotect(map, map_size, PROT_NONE) == 0);
+
+	struct guard_quarantine_entry old[8];
+	int old_count = 0;
+	spinlock_acq(&guard_quarantine_lock);
+	size_t idx = (guard_quarantine_begin + guard_quarantine_count) %
+		GUARD_QUARANTINE_COUNT;
+	guard_quarantine[idx].map = map;
+	guard_quarantine[idx].map_size = map_size;
+	++guard_quarantine_count;
+	guard_quarantine_bytes += map_size;
+	while (old_count < 8 &&
+	       (guard_quarantine_count >= GUARD_QUARANTINE_COUNT ||
+		guard_quarantine_bytes > GUARD_QUARANTINE_BYTES)) {
+		struct guard_quarantine_entry *e =
+			&guard_quarantine[guard_quarantine_begin];
+		old[old_count++] = *e;
+		guard_quarantine_bytes -= e->map_size;
+		guard_quarantine_begin = (guard_quarantine_begin + 1) %
+			GUARD_QUARANTINE_COUNT;
+		--guard_quarantine_count;
+	}
+	spinlock_rel(&guard_quarantine_lock);
+	// Unmapping is slow, it is done out of the lock.
+	for (int i = 0; i < old_count; ++i)
+		munmap(old[i].map, old[i].map_size);
+}
+
+static void *
+guard_realloc(void *ptr, size_t size)
+{
+	if (ptr == NULL)
+		return guard_alloc(size, 0);
+	if (size == 0) {
+		guard_free(ptr);
+		return NULL;
+	}
+	// Always moved. So the stale pointers to the old memory crash.
+	struct guard_header *h = guard_header(ptr);
+	heaph_assert(h->magic == GUARD_HEADER_MAGIC);
+	void *res = guard_alloc(size, 0);
+	if (res == NULL)
+		return NULL;
+	memcpy(res, ptr, size < h->size ? size : h->size);
+	guard_free(ptr);
+	return res;
+}
+
+static void *
+guard_memalign(size_t alignment, size_t size)
+{
+	if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	return guard_alloc(size, alignment);
+}
+
+static int
+guard_posix_memalign(void **res, size_t alignment, size_t size)
+{
+	if (alignment < sizeof(void *) ||
+	    (alignment & (alignment - 1)) != 0)
+		return EINVAL;
+	void *mem = guard_alloc(size, alignment);
+	if (mem == NULL)
+		return ENOMEM;
+	*res = mem;
+	return 0;
+}
+
 static void
 heaph_lock(void)
 {
@@ -399,10 +1027,114 @@ trace_resolve(void *const *addrs, int count, struct symbol *syms)
 		}
 		s->name = info.dli_sname;
 		s->file = info.dli_fname;
+		s->offset = (uintptr_t)addrs[i] - (uintptr_t)info.dli_fbase;
 	}
 	return failures;
 }
 
+static void
+trace_print_frame(int i, const struct symbol *sym)
+{
+	if (sym->name != NULL)
+		heaph_printf("%d - %s\n", i, sym->name);
+	else if (sym->file != NULL)
+		heaph_printf("%d - %s+0x%zx\n", i, sym->file,
+			     (size_t)sym->offset);
+	else
+		heaph_printf("%d - ??\n", i);
+}
+
+// Put the trace into the top list if it is bigger than the smallest one there.
+static void
+profile_top_add(struct trace **top, struct trace *t, bool by_bytes)
+{
+	uint64_t value = by_bytes ? t->alloc_bytes : t->alloc_count;
+	int i = PROFILE_TOP_SITE_COUNT;
+	while (i > 0 && (top[i - 1] == NULL || value >
+	       (by_bytes ? top[i - 1]->alloc_bytes : top[i - 1]->alloc_count))) {
+		if (i < PROFILE_TOP_SITE_COUNT)
+			top[i] = top[i - 1];
+		--i;
+	}
+	if (i < PROFILE_TOP_SITE_COUNT)
+		top[i] = t;
+}
+
+static void
+profile_print_top(struct trace **top, const char *title)
+{
+	struct symbol syms[MAX_BACKTRACE_LEN];
+	heaph_printf("HH: top call sites by %s:\n", title);
+	for (int i = 0; i < PROFILE_TOP_SITE_COUNT && top[i] != NULL; ++i) {
+		const struct trace *t = top[i];
+		heaph_printf("#### Site %d (%llu allocations, %llu bytes) ####\n",
+			     i + 1, (long long)t->alloc_count,
+			     (long long)t->alloc_bytes);
+		int count = t->size;
+		if (count > PROFILE_SITE_FRAME_COUNT)
+			count = PROFILE_SITE_FRAME_COUNT;
+		trace_resolve(t->frames, count, syms);
+		for (int j = 0; j < count; ++j)
+			trace_print_frame(j, &syms[j]);
+	}
+}
+
+static void
+heaph_report_profile(void)
+{
+	uint64_t size_classes[SIZE_CLASS_COUNT];
+	memset(size_classes, 0, sizeof(size_classes));
+	uint64_t total = 0;
+	uint64_t churn_count = 0;
+	uint64_t churn_bytes = 0;
+	alloc_shards_lock_all();
+	for (int i = 0; i < ALLOCATION_SHARD_COUNT; ++i) {
+		const struct allocation_shard *sh = &alloc_shards[i];
+		for (int j = 0; j < SIZE_CLASS_COUNT; ++j)
+			size_classes[j] += sh->size_classes[j];
+		total += sh->count_total;
+		churn_count += sh->churn_count;
+		churn_bytes += sh->churn_bytes;
+	}
+	alloc_shards_unlock_all();
+
+	heaph_printf("\n");
+	heaph_printf("HH: allocation profile, %llu allocations\n",
+		     (long long)total);
+	heaph_printf("HH: allocations by size:\n");
+	for (int i = 0; i < SIZE_CLASS_COUNT; ++i) {
+		if (size_classes[i] == 0)
+			continue;
+		heaph_printf("HH:   <= %llu bytes - %llu\n",
+			     (unsigned long long)(i == 64 ? UINT64_MAX : 1ull << i),
+			     (long long)size_classes[i]);
+	}
+	heaph_printf("HH: peak live bytes - %lld at %.3f s\n",
+		     (long long)profile_peak_bytes, profile_peak_us / 1e6);
+	heaph_printf("HH: freed within %llu us - %llu allocations (%llu "
+		     "bytes)\n", (long long)profile_churn_us,
+		     (long long)churn_count, (long long)churn_bytes);
+
+	struct trace *top_count[PROFILE_TOP_SITE_COUNT] = {NULL};
+	struct trace *top_bytes[PROFILE_TOP_SITE_COUNT] = {NULL};
+	for (int i = 0; i < TRACE_SHARD_COUNT; ++i) {
+		struct trace_shard *sh = &trace_shards[i];
+		spinlock_acq(&sh->lock);
+		for (size_t j = 0, cap = trace_table_cap(sh); j < cap; ++j) {
+			struct trace *t = sh->table[j];
+			if (t == NULL || t->alloc_count == 0)
+				continue;
+			profile_top_add(top_count, t, false);
+			profile_top_add(top_bytes, t, true);
+		}
+		spinlock_rel(&sh->lock);
+	}
+	if (top_count[0] == NULL)
+		return;
+	profile_print_top(top_count, "count");
+	profile_print_top(top_bytes, "bytes");
+}
+
 static void
 heaph_atexit(void)
 {
@@ -412,19 +1144,27 @@ heaph_atexit(void)
 		return;
 	if (report_mode == REPORT_MODE_QUIET)
 		return;
-	spinlock_acq(&allocs_lock);
-	int64_t count = alloc_count;
+	if (report_mode == REPORT_MODE_PROFILE)
+		heaph_report_profile();
+	bool is_verbose = report_mode == REPORT_MODE_VERBOSE ||
+		report_mode == REPORT_MODE_PROFILE;
+	alloc_shards_lock_all();
+	int64_t count = 0;
+	uint64_t count_total = 0;
+	for (int i = 0; i < ALLOCATION_SHARD_COUNT; ++i) {
+		count += alloc_shards[i].count;
+		count_total += alloc_shards[i].count_total;
+	}
 	if (count == 0) {
-		spinlock_rel(&allocs_lock);
-		if (report_mode == REPORT_MODE_VERBOSE) {
+		alloc_shards_unlock_all();
+		if (is_verbose) {
 			heaph_printf("\n");
 			heaph_printf("HH: found no leaks\n");
 			heaph_printf("HH: total allocation count - %llu\n",
-			       (long long)alloc_count_total);
+			       (long long)count_total);
 		}
 		return;
 	}
-	const struct allocation *a = allocs;
 	const int report_limit = 10;
 	int report_count = 0;
 	int64_t total_count = count;
@@ -435,34 +1175,41 @@ heaph_atexit(void)
 	// makes it harder to read HH output unless the latter prepends itself
 	// with a line wrap.
 	const char *prefix = "\n";
-	for (; a != NULL; a = a->next) {
+	int shard_idx = 0;
+	size_t slot_idx = 0;
+	const struct allocation *a;
+	while ((a = alloc_shards_next(&shard_idx, &slot_idx)) != NULL) {
 		heaph_assert(count > 0);
 		if (a->depth > 1) {
 			--count;
 			continue;
 		}
-		total_fail_count += trace_resolve(a->trace, a->trace_size, syms);
-		bool is_internal = trace_is_internal(syms, a->trace_size);
+		int trace_size = a->trace == NULL ? 0 : a->trace->size;
+		if (trace_size > 0) {
+			total_fail_count += trace_resolve(a->trace->frames,
+				trace_size, syms);
+		}
+		bool is_internal = trace_is_internal(syms, trace_size);
 		if (is_internal) {
 			--count;
 		} else if (report_count < report_limit) {
 			heaph_printf("%s", prefix), prefix = "";
 			heaph_printf("#### Leak %d (%zu bytes) ####\n",
 				     ++report_count, a->size);
-			for (int i = 0; i < a->trace_size; ++i)
-				heaph_printf("%d - %s\n", i, syms[i].name);
+			for (int i = 0; i < trace_size; ++i)
+				trace_print_frame(i, &syms[i]);
 		}
 		if (!is_internal)
 			leak_size += a->size;
 	}
-	spinlock_rel(&allocs_lock);
+	alloc_shards_unlock_all();
 
 	if (total_fail_count > 0) {
 		heaph_printf("\nHH: dladdr() failure %lld times\n",
 		             (long long)total_fail_count);
 	}
 
-	if (count == 0 && report_mode != REPORT_MODE_VERBOSE)
+	if (count == 0 && !is_verbose)
 		return;
 	int64_t suppressed_count = total_count - count;
 	heaph_printf("%s", prefix), prefix = "";
@@ -477,15 +1224,17 @@ heaph_atexit(void)
 			     report_count);
 	}
 	heaph_printf("HH: total allocation count - %llu\n",
-		     (long long)alloc_count_total);
+		     (long long)count_total);
 }
 
 static void
 heaph_init(void)
 {
-	default_malloc = static_malloc;
-	default_free = static_free;
-	default_calloc = static_calloc;
+	// GCC assumes dlsym() can't call malloc() and seeing that these are
+	// overwritten below drops the stores. Atomic ones are kept.
+	__atomic_store_n(&default_malloc, static_malloc, __ATOMIC_RELAXED);
+	__atomic_store_n(&default_free, static_free, __ATOMIC_RELAXED);
+	__atomic_store_n(&default_calloc, static_calloc, __ATOMIC_RELAXED);
 
 	void *(*sym_malloc)(size_t) = dlsym(RTLD_NEXT, "malloc");
 	void (*sym_free)(void *) = dlsym(RTLD_NEXT, "free");
@@ -500,6 +1249,23 @@ heaph_init(void)
 	void (*sym_freeaddrinfo)(struct addrinfo *) =
 		dlsym(RTLD_NEXT, "freeaddrinfo");
 
+	// These can fail, when the app has no libstdc++. Then dlsym() allocates
+	// the error, and that has to go to the static allocator too.
+	default_posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+	default_aligned_alloc = dlsym(RTLD_NEXT, "aligned_alloc");
+	default_memalign = dlsym(RTLD_NEXT, "memalign");
+	default_strndup = dlsym(RTLD_NEXT, "strndup");
+	default_new = dlsym(RTLD_NEXT, "_Znwm");
+	default_new_arr = dlsym(RTLD_NEXT, "_Znam");
+	default_new_nothrow = dlsym(RTLD_NEXT, "_ZnwmRKSt9nothrow_t");
+	default_new_arr_nothrow = dlsym(RTLD_NEXT, "_ZnamRKSt9nothrow_t");
+	default_new_aligned = dlsym(RTLD_NEXT, "_ZnwmSt11align_val_t");
+	default_new_arr_aligned = dlsym(RTLD_NEXT, "_ZnamSt11align_val_t");
+	default_new_aligned_nothrow =
+		dlsym(RTLD_NEXT, "_ZnwmSt11align_val_tRKSt9nothrow_t");
+	default_new_arr_aligned_nothrow =
+		dlsym(RTLD_NEXT, "_ZnamSt11align_val_tRKSt9nothrow_t");
+
 	default_malloc = sym_malloc;
 	default_free = sym_free;
 	default_calloc = sym_calloc;
@@ -509,6 +1275,21 @@ heaph_init(void)
 	default_getaddrinfo = sym_getaddrinfo;
 	default_freeaddrinfo = sym_freeaddrinfo;
 
+	// Before any allocations are done with the real functions. Then all
+	// the memory freed in the guard mode is from the guard allocator.
+	const char *hh_guard = getenv("HHGUARD");
+	if (hh_guard != NULL && strcmp(hh_guard, "on") == 0) {
+		guard_page_size = sysconf(_SC_PAGESIZE);
+		guard_next_free = default_free;
+		default_malloc = guard_malloc;
+		default_free = guard_free;
+		default_calloc = guard_calloc;
+		default_realloc = guard_realloc;
+		default_memalign = guard_memalign;
+		default_aligned_alloc = guard_memalign;
+		default_posix_memalign = guard_posix_memalign;
+	}
+
 	const char *hh_report = getenv("HHREPORT");
 	if (hh_report != NULL) {
 		if (strcmp(hh_report, "v") == 0)
@@ -517,7 +1298,18 @@ heaph_init(void)
 			report_mode = REPORT_MODE_LEAKS;
 		else if (strcmp(hh_report, "q") == 0)
 			report_mode = REPORT_MODE_QUIET;
+		else if (strcmp(hh_report, "p") == 0)
+			report_mode = REPORT_MODE_PROFILE;
 	}
+	const char *hh_output = getenv("HHOUTPUT");
+	if (hh_output != NULL) {
+		strncpy(output_path, hh_output, sizeof(output_path) - 1);
+		output_path[sizeof(output_path) - 1] = 0;
+	}
+	profile_start_us = heaph_now_us();
+	const char *hh_churn = getenv("HHCHURN");
+	if (hh_churn != NULL)
+		profile_churn_us = strtoull(hh_churn, NULL, 10);
 
 	const char *hh_content = getenv("HHCONTENT");
 	if (hh_content != NULL) {
@@ -533,23 +1325,53 @@ heaph_init(void)
 			backtrace_mode = BACKTRACE_ON;
 		else if (strcmp(bt_mode, "off") == 0)
 			backtrace_mode = BACKTRACE_OFF;
+		else if (strncmp(bt_mode, "sample:", 7) == 0)
+			backtrace_mode = BACKTRACE_SAMPLE_COUNT;
+		else if (strncmp(bt_mode, "bytes:", 6) == 0)
+			backtrace_mode = BACKTRACE_SAMPLE_BYTES;
+		if (backtrace_mode == BACKTRACE_SAMPLE_COUNT ||
+		    backtrace_mode == BACKTRACE_SAMPLE_BYTES) {
+			const char *rate = strchr(bt_mode, ':') + 1;
+			backtrace_sample_rate = strtoull(rate, NULL, 10);
+			if (backtrace_sample_rate == 0)
+				backtrace_sample_rate = 1;
+		}
 	}
 	atexit(heaph_atexit);
 }
 
-static void
-heaph_touch(void)
+static void __attribute__((noinline))
+heaph_touch_slow(void)
 {
-	if (__atomic_load_n(&is_init_done, __ATOMIC_SEQ_CST))
-		return;
+	// The initialization itself allocates. Those calls use the static
+	// allocator.
 	if (init_lock_count > 0)
 		return;
-
 	heaph_lock();
-	heaph_init();
-	bool old = __atomic_exchange_n(&is_init_done, true, __ATOMIC_SEQ_CST);
+	// Another thread could have done it while this one was waiting.
+	if (!__atomic_load_n(&is_init_done, __ATOMIC_ACQUIRE)) {
+		heaph_init();
+		__atomic_store_n(&is_init_done, true, __ATOMIC_RELEASE);
+	}
 	heaph_unlock();
-	heaph_assert(!old);
+}
+
+// The initialization is normally done by the constructor before main(). Only
+// the allocations made before it, by the loader or by other constructors, can
+// get here with it not done. So the check is a single branch which is always
+// predicted right.
+static inline void
+heaph_touch(void)
+{
+	if (__builtin_expect(!__atomic_load_n(&is_init_done, __ATOMIC_ACQUIRE),
+			     0))
+		heaph_touch_slow();
+}
+
+static void __attribute__((constructor))
+heaph_ctor(void)
+{
+	heaph_touch();
 }
 
 ssize_t
@@ -603,6 +1425,67 @@ malloc(size_t size)
 	return res;
 }
 
+// Trace the memory which came from a default function of the size. The
+// caller does the depth.
+static void *
+heaph_trace_new_mem(void *res, size_t size)
+{
+	if (res != NULL) {
+		alloc_trace_new(res, size);
+		if (content_mode == CONTENT_MODE_TRASH)
+			memset(res, '#', size);
+	}
+	return res;
+}
+
+int
+posix_memalign(void **res, size_t alignment, size_t size)
+{
+	heaph_touch();
+	++depth;
+	int rc = default_posix_memalign(res, alignment, size);
+	if (rc == 0)
+		heaph_trace_new_mem(*res, size);
+	--depth;
+	return rc;
+}
+
+void *
+aligned_alloc(size_t alignment, size_t size)
+{
+	heaph_touch();
+	++depth;
+	void *res = heaph_trace_new_mem(
+		default_aligned_alloc(alignment, size), size);
+	--depth;
+	return res;
+}
+
+void *
+memalign(size_t alignment, size_t size)
+{
+	heaph_touch();
+	++depth;
+	void *res = heaph_trace_new_mem(
+		default_memalign(alignment, size), size);
+	--depth;
+	return res;
+}
+
+char *
+strndup(const char *ptr, size_t size)
+{
+	heaph_touch();
+	heaph_assert(!is_exit_done);
+	heaph_assert(!alloc_is_static(ptr));
+	++depth;
+	char *res = default_strndup(ptr, size);
+	if (res != NULL)
+		alloc_trace_new(res, strlen(res) + 1);
+	--depth;
+	return res;
+}
+
 void *
 calloc(size_t num, size_t size)
 {
@@ -670,6 +1553,17 @@ free(void *ptr)
 	--depth;
 }
 
+void *
+reallocarray(void *ptr, size_t count, size_t size)
+{
+	size_t total;
+	if (__builtin_mul_overflow(count, size, &total)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return realloc(ptr, total);
+}
+
 int
 getaddrinfo(const char *hostname, const char *servname,
 	    const struct addrinfo *hints, struct addrinfo **res)
@@ -696,11 +1590,347 @@ freeaddrinfo(struct addrinfo *ai)
 	--depth;
 }
 
+// The C++ operators new and delete, by their mangled names for 64 bit. A new
+// calls the default one, which allocates via malloc(). That malloc() is nested
+// and isn't traced, the new itself is. All the deletes just free(), which is
+// what the default ones do.
+#if __SIZEOF_SIZE_T__ == 8
+
+static void *
+heaph_new_do(void *(*func)(size_t), size_t size)
+{
+	heaph_touch();
+	heaph_assert(func != NULL);
+	++depth;
+	// Can throw. Then the depth is broken. It only happens when the memory
+	// is over though.
+	void *res = heaph_trace_new_mem(func(size), size);
+	--depth;
+	return res;
+}
+
+static void *
+heaph_new_aligned_do(void *(*func)(size_t, size_t), size_t size, size_t align)
+{
+	heaph_touch();
+	heaph_assert(func != NULL);
+	++depth;
+	void *res = heaph_trace_new_mem(func(size, align), size);
+	--depth;
+	return res;
+}
+
+void *
+_Znwm(size_t size)
+{
+	return heaph_new_do(default_new, size);
+}
+
+void *
+_Znam(size_t size)
+{
+	return heaph_new_do(default_new_arr, size);
+}
+
+void *
+_ZnwmRKSt9nothrow_t(size_t size, const void *tag)
+{
+	heaph_touch();
+	heaph_assert(default_new_nothrow != NULL);
+	++depth;
+	void *res = heaph_trace_new_mem(default_new_nothrow(size, tag), size);
+	--depth;
+	return res;
+}
+
+void *
+_ZnamRKSt9nothrow_t(size_t size, const void *tag)
+{
+	heaph_touch();
+	heaph_assert(default_new_arr_nothrow != NULL);
+	++depth;
+	void *res = heaph_trace_new_mem(
+		default_new_arr_nothrow(size, tag), size);
+	--depth;
+	return res;
+}
+
+void *
+_ZnwmSt11align_val_t(size_t size, size_t align)
+{
+	return heaph_new_aligned_do(default_new_aligned, size, align);
+}
+
+void *
+_ZnamSt11align_val_t(size_t size, size_t align)
+{
+	return heaph_new_aligned_do(default_new_arr_aligned, size, align);
+}
+
+void *
+_ZnwmSt11align_val_tRKSt9nothrow_t(size_t size, size_t align, const void *tag)
+{
+	heaph_touch();
+	heaph_assert(default_new_aligned_nothrow != NULL);
+	++depth;
+	void *res = heaph_trace_new_mem(
+		default_new_aligned_nothrow(size, align, tag), size);
+	--depth;
+	return res;
+}
+
+void *
+_ZnamSt11align_val_tRKSt9nothrow_t(size_t size, size_t align, const void *tag)
+{
+	heaph_touch();
+	heaph_assert(default_new_arr_aligned_nothrow != NULL);
+	++depth;
+	void *res = heaph_trace_new_mem(
+		default_new_arr_aligned_nothrow(size, align, tag), size);
+	--depth;
+	return res;
+}
+
+void
+_ZdlPv(void *ptr)
+{
+	free(ptr);
+}
+
+void
+_ZdaPv(void *ptr)
+{
+	free(ptr);
+}
+
+void
+_ZdlPvm(void *ptr, size_t size)
+{
+	(void)size;
+	free(ptr);
+}
+
+void
+_ZdaPvm(void *ptr, size_t size)
+{
+	(void)size;
+	free(ptr);
+}
+
+void
+_ZdlPvRKSt9nothrow_t(void *ptr, const void *tag)
+{
+	(void)tag;
+	free(ptr);
+}
+
+void
+_ZdaPvRKSt9nothrow_t(void *ptr, const void *tag)
+{
+	(void)tag;
+	free(ptr);
+}
+
+void
+_ZdlPvSt11align_val_t(void *ptr, size_t align)
+{
+	(void)align;
+	free(ptr);
+}
+
+void
+_ZdaPvSt11align_val_t(void *ptr, size_t align)
+{
+	(void)align;
+	free(ptr);
+}
+
+void
+_ZdlPvmSt11align_val_t(void *ptr, size_t size, size_t align)
+{
+	(void)size;
+	(void)align;
+	free(ptr);
+}
+
+void
+_ZdaPvmSt11align_val_t(void *ptr, size_t size, size_t align)
+{
+	(void)size;
+	(void)align;
+	free(ptr);
+}
+
+void
+_ZdlPvSt11align_val_tRKSt9nothrow_t(void *ptr, size_t align, const void *tag)
+{
+	(void)align;
+	(void)tag;
+	free(ptr);
+}
+
+void
+_ZdaPvSt11align_val_tRKSt9nothrow_t(void *ptr, size_t align, const void *tag)
+{
+	(void)align;
+	(void)tag;
+	free(ptr);
+}
+
+#endif
+
+struct heaph_snapshot_entry {
+	struct trace *trace;
+	size_t size;
+	uint64_t seq;
+	int shard_idx;
+};
+
+struct heaph_snapshot {
+	// The whole mapping of the snapshot.
+	size_t map_size;
+	// Allocation count of each shard at the moment it was copied.
+	uint64_t shard_totals[ALLOCATION_SHARD_COUNT];
+	size_t count;
+	size_t cap;
+	struct heaph_snapshot_entry entries[];
+};
+
+static struct heaph_snapshot *
+snapshot_new(size_t cap)
+{
+	size_t size = sizeof(struct heaph_snapshot) +
+		cap * sizeof(struct heaph_snapshot_entry);
+	struct heaph_snapshot *res = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_ANON | MAP_PRIVATE, -1, 0);
+	heaph_assert(res != MAP_FAILED);
+	res->map_size = size;
+	res->count = 0;
+	res->cap = cap;
+	return res;
+}
+
+struct heaph_snapshot *
+heaph_snapshot(void)
+{
+	heaph_touch();
+	size_t cap = heaph_get_alloc_count() + 1024;
+	struct heaph_snapshot *res = snapshot_new(cap);
+	// The shards are copied one by one, not to stop all the threads at once.
+	// Each copy is consistent with its shard's total.
+	for (int i = 0; i < ALLOCATION_SHARD_COUNT; ++i) {
+		struct allocation_shard *sh = &alloc_shards[i];
+		spinlock_acq(&sh->lock);
+		while (res->count + sh->count > res->cap) {
+			spinlock_rel(&sh->lock);
+			struct heaph_snapshot *old = res;
+			res = snapshot_new(old->cap * 2 + sh->count);
+			memcpy(res->shard_totals, old->shard_totals,
+			       sizeof(old->shard_totals));
+			memcpy(res->entries, old->entries,
+			       old->count * sizeof(old->entries[0]));
+			res->count = old->count;
+			munmap(old, old->map_size);
+			spinlock_acq(&sh->lock);
+		}
+		res->shard_totals[i] = sh->count_total;
+		for (size_t j = 0, cap = alloc_table_cap(sh); j < cap; ++j) {
+			const struct allocation *a = sh->table[j];
+			if (a == NULL || a->depth > 1)
+				continue;
+			struct heaph_snapshot_entry *e = &res->entries[res->count++];
+			e->trace = a->trace;
+			e->size = a->size;
+			e->seq = a->seq;
+			e->shard_idx = i;
+		}
+		spinlock_rel(&sh->lock);
+	}
+	return res;
+}
+
+void
+heaph_snapshot_delete(struct heaph_snapshot *s)
+{
+	if (s != NULL)
+		munmap(s, s->map_size);
+}
+
+struct snapshot_group {
+	struct trace *trace;
+	uint64_t count;
+	uint64_t bytes;
+};
+
+uint64_t
+heaph_diff(const struct heaph_snapshot *a, const struct heaph_snapshot *b)
+{
+	const int report_limit = 10;
+	// Group the new allocations by the call stack, in a hash table by the
+	// trace pointer.
+	int bits = 4;
+	while (((size_t)1 << bits) < b->count * 2)
+		++bits;
+	size_t cap = (size_t)1 << bits;
+	size_t map_size = cap * sizeof(struct snapshot_group);
+	struct snapshot_group *groups = mmap(NULL, map_size,
+		PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+	heaph_assert(groups != MAP_FAILED);
+	uint64_t total_count = 0;
+	uint64_t total_bytes = 0;
+	uint64_t group_count = 0;
+	for (size_t i = 0; i < b->count; ++i) {
+		const struct heaph_snapshot_entry *e = &b->entries[i];
+		if (e->seq < a->shard_totals[e->shard_idx])
+			continue;
+		size_t idx = (size_t)(alloc_hash(e->trace) >> (64 - bits));
+		// The slots with no allocations are the empty ones. The trace can
+		// be NULL, when it wasn't captured.
+		while (groups[idx].count != 0 && groups[idx].trace != e->trace)
+			idx = (idx + 1) & (cap - 1);
+		struct snapshot_group *g = &groups[idx];
+		if (g->count == 0)
+			++group_count;
+		g->trace = e->trace;
+		++g->count;
+		g->bytes += e->size;
+		++total_count;
+		total_bytes += e->size;
+	}
+	heaph_printf("\n");
+	heaph_printf("HH: diff - %llu new allocations (%llu bytes) in %llu "
+		     "call stacks\n", (long long)total_count,
+		     (long long)total_bytes, (long long)group_count);
+	// Show the biggest groups by bytes. Each is taken out after printing.
+	struct symbol syms[MAX_BACKTRACE_LEN];
+	for (int r = 0; r < report_limit; ++r) {
+		struct snapshot_group *top = NULL;
+		for (size_t i = 0; i < cap; ++i) {
+			if (groups[i].count != 0 &&
+			    (top == NULL || groups[i].bytes > top->bytes))
+				top = &groups[i];
+		}
+		if (top == NULL)
+			break;
+		heaph_printf("#### Stack %d (%llu allocations, %llu bytes) ####\n",
+			     r + 1, (long long)top->count,
+			     (long long)top->bytes);
+		int trace_size = top->trace == NULL ? 0 : top->trace->size;
+		if (trace_size > 0)
+			trace_resolve(top->trace->frames, trace_size, syms);
+		for (int i = 0; i < trace_size; ++i)
+			trace_print_frame(i, &syms[i]);
+		top->count = 0;
+	}
+	munmap(groups, map_size);
+	return total_count;
+}
+
 uint64_t
 heaph_get_alloc_count(void)
 {
-	spinlock_acq(&allocs_lock);
-	uint64_t res = alloc_count;
-	spinlock_rel(&allocs_lock);
+	int64_t res = 0;
+	for (int i = 0; i < ALLOCATION_SHARD_COUNT; ++i)
+		res += __atomic_load_n(&alloc_shards[i].count, __ATOMIC_RELAXED);
 	return res;
 }
@@ -2,5 +2,28 @@
 
 #include <stdint.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 uint64_t
 heaph_get_alloc_count(void);
+
+struct heaph_snapshot;
+
+// Copy of the live allocations. The threads keep working meanwhile, only one
+// shard at a time is locked while it is copied.
+struct heaph_snapshot *
+heaph_snapshot(void);
+
+void
+heaph_snapshot_delete(struct heaph_snapshot *s);
+
+// Print the allocations which are alive in 'b' but were done after 'a', grouped
+// by the call stack, the biggest first. Returns their count.
+uint64_t
+heaph_diff(const struct heaph_snapshot *a, const struct heaph_snapshot *b);
+
+#ifdef __cplusplus
+}
+#endif
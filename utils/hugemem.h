@@ -0,0 +1,136 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#if defined(__linux__)
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if defined(__cplusplus)
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+/**
+ * Anonymous memory on huge pages, for the big long living arenas
+ * where the TLB misses of the 4KB pages are seen: a 2MB page takes
+ * one TLB entry instead of 512. Also one page fault instead of 512.
+ *
+ * The mapping is aligned to 2MB, or the kernel can't put a huge page
+ * into it. With HUGEMEM_THP it is madvise(MADV_HUGEPAGE), and the
+ * transparent huge pages are taken on the fault if there are free
+ * ones, else the usual pages, and khugepaged collapses them later.
+ * The mapping can be unmapped and madvise()-d in parts, a huge page
+ * is split then. With HUGEMEM_HUGETLB it is the hugetlbfs pool of
+ * /proc/sys/vm/nr_hugepages first, which is usually empty, so then
+ * THP. Such a mapping can be unmapped only whole.
+ *
+ * HUGEMEM_NODE_LOCAL binds the memory to the NUMA node of the CPU of
+ * the calling thread, with MPOL_PREFERRED, so it still comes from the
+ * other nodes when the local one is full. Without it the pages are
+ * from the node of the thread doing the first touch, which for the
+ * arenas shared by a pool of threads can be anyone.
+ *
+ * It is all Linux only. Elsewhere it is a usual mapping.
+ */
+
+enum {
+	HUGEMEM_PAGE_SIZE = 2 * 1024 * 1024,
+};
+
+enum hugemem_flags {
+	HUGEMEM_THP = 1 << 0,
+	HUGEMEM_HUGETLB = 1 << 1,
+	HUGEMEM_NODE_LOCAL = 1 << 2,
+};
+
+/** NUMA node of the CPU of the calling thread, or -1 if unknown. */
+static inline int
+hugemem_node(void)
+{
+#if defined(__linux__) && defined(SYS_getcpu)
+	unsigned cpu, node;
+	if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0)
+		return (int)node;
+#endif
+	return -1;
+}
+
+/** Prefer the node of the calling thread for the pages of the range. */
+static inline void
+hugemem_bind_local(void *addr, size_t size)
+{
+#if defined(__linux__) && defined(SYS_mbind)
+	int node = hugemem_node();
+	if (node < 0 || node >= (int)sizeof(unsigned long) * 8)
+		return;
+	unsigned long mask = 1UL << node;
+	/* Not the libnuma wrapper, so it isn't a dependency. */
+	syscall(SYS_mbind, addr, size, MPOL_PREFERRED, &mask,
+		sizeof(mask) * 8, 0);
+#else
+	(void)addr;
+	(void)size;
+#endif
+}
+
+/** Round @a size up to the huge pages. */
+static inline size_t
+hugemem_round(size_t size)
+{
+	return (size + HUGEMEM_PAGE_SIZE - 1) &
+	       ~(size_t)(HUGEMEM_PAGE_SIZE - 1);
+}
+
+/**
+ * Map @a size bytes, a multiple of HUGEMEM_PAGE_SIZE, aligned to it,
+ * with a combination of hugemem_flags. The pages are not touched.
+ * NULL when out of memory.
+ */
+static inline void *
+hugemem_map(size_t size, int flags)
+{
+	int prot = PROT_READ | PROT_WRITE;
+	int map_flags = MAP_PRIVATE | MAP_ANONYMOUS;
+	char *res = NULL;
+#if defined(MAP_HUGETLB)
+	if ((flags & HUGEMEM_HUGETLB) != 0) {
+		res = (char *)mmap(NULL, size, prot, map_flags | MAP_HUGETLB,
+				   -1, 0);
+		if (res == MAP_FAILED)
+			res = NULL;
+	}
+#endif
+	if (res == NULL) {
+#if defined(MAP_NORESERVE)
+		map_flags |= MAP_NORESERVE;
+#endif
+		/* Over-mapped and trimmed to the alignment. */
+		size_t map_size = size + HUGEMEM_PAGE_SIZE;
+		char *map = (char *)mmap(NULL, map_size, prot, map_flags,
+					 -1, 0);
+		if (map == MAP_FAILED)
+			return NULL;
+		res = (char *)(((uintptr_t)map + HUGEMEM_PAGE_SIZE - 1) &
+			       ~(uintptr_t)(HUGEMEM_PAGE_SIZE - 1));
+		if (res != map)
+			munmap(map, res - map);
+		if (res + size != map + map_size)
+			munmap(res + size, map + map_size - res - size);
+#if defined(MADV_HUGEPAGE)
+		if ((flags & (HUGEMEM_THP | HUGEMEM_HUGETLB)) != 0)
+			madvise(res, size, MADV_HUGEPAGE);
+#endif
+	}
+	if ((flags & HUGEMEM_NODE_LOCAL) != 0)
+		hugemem_bind_local(res, size);
+	return res;
+}
+
+#if defined(__cplusplus)
+} /* extern "C" */
+#endif /* defined(__cplusplus) */
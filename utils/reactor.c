@@ -0,0 +1,343 @@
+#define _GNU_SOURCE
+#include "reactor.h"
+#include "heap.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+enum {
+	/** Events taken from epoll at once. */
+	REACTOR_EVENT_BATCH = 128,
+};
+
+#define reactor_timer_less(a, b) ((a)->deadline < (b)->deadline)
+
+HEAP_DEFINE(reactor_timer_heap, struct reactor_timer, heap_pos,
+	    reactor_timer_less, 4)
+
+struct reactor {
+	int epoll_fd;
+	/** Eventfd to wake up the loop from other threads. */
+	int wakeup_fd;
+	struct reactor_io wakeup_io;
+	struct reactor_timer_heap timers;
+	/** Stack of the posted tasks, pushed by any thread. */
+	struct reactor_task *tasks;
+	bool is_stopped;
+	/**
+	 * The batch being processed. A descriptor deleted in a callback
+	 * is removed from the rest of it, so its events are not
+	 * delivered after the user has freed it.
+	 */
+	struct epoll_event events[REACTOR_EVENT_BATCH];
+	int event_pos;
+	int event_count;
+};
+
+static uint64_t
+reactor_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+double
+reactor_time(void)
+{
+	return reactor_now_ns() / 1e9;
+}
+
+static void
+reactor_wakeup_cb(struct reactor_io *io, uint32_t events)
+{
+	(void)events;
+	uint64_t value;
+	while (read(io->fd, &value, sizeof(value)) > 0) {
+	}
+}
+
+static void
+reactor_wakeup(struct reactor *r)
+{
+	uint64_t one = 1;
+	ssize_t rc = write(r->wakeup_fd, &one, sizeof(one));
+	/* Can only fail when the counter is full, it wakes up then too. */
+	(void)rc;
+}
+
+struct reactor *
+reactor_new(void)
+{
+	struct reactor *r = calloc(1, sizeof(*r));
+	if (r == NULL)
+		return NULL;
+	r->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (r->epoll_fd < 0)
+		goto error_free;
+	r->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (r->wakeup_fd < 0)
+		goto error_close_epoll;
+	reactor_timer_heap_create(&r->timers);
+	if (reactor_add(r, &r->wakeup_io, r->wakeup_fd, REACTOR_IN,
+			reactor_wakeup_cb, NULL) != 0)
+		goto error_close_wakeup;
+	return r;
+
+error_close_wakeup:
+	reactor_timer_heap_destroy(&r->timers);
+	close(r->wakeup_fd);
+error_close_epoll:
+	close(r->epoll_fd);
+error_free:
+	free(r);
+	return NULL;
+}
+
+void
+reactor_delete(struct reactor *r)
+{
+	struct reactor_timer *t;
+	while ((t = reactor_timer_heap_pop(&r->timers)) != NULL)
+		t->reactor = NULL;
+	reactor_timer_heap_destroy(&r->timers);
+	close(r->wakeup_fd);
+	close(r->epoll_fd);
+	free(r);
+}
+
+int
+reactor_add(struct reactor *r, struct reactor_io *io, int fd,
+	    uint32_t events, reactor_io_f cb, void *ctx)
+{
+	io->reactor = r;
+	io->fd = fd;
+	io->events = events;
+	io->cb = cb;
+	io->ctx = ctx;
+	struct epoll_event ev;
+	ev.events = events | EPOLLET;
+	ev.data.ptr = io;
+	return epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+int
+reactor_mod(struct reactor_io *io, uint32_t events)
+{
+	io->events = events;
+	struct epoll_event ev;
+	ev.events = events | EPOLLET;
+	ev.data.ptr = io;
+	return epoll_ctl(io->reactor->epoll_fd, EPOLL_CTL_MOD, io->fd, &ev);
+}
+
+void
+reactor_del(struct reactor_io *io)
+{
+	struct reactor *r = io->reactor;
+	epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, io->fd, NULL);
+	for (int i = r->event_pos; i < r->event_count; ++i) {
+		if (r->events[i].data.ptr == io)
+			r->events[i].data.ptr = NULL;
+	}
+	io->reactor = NULL;
+}
+
+void
+reactor_timer_create(struct reactor_timer *t, reactor_timer_f cb,
+		     void *ctx)
+{
+	t->reactor = NULL;
+	t->deadline = 0;
+	t->heap_pos = HEAP_NO_POS;
+	t->cb = cb;
+	t->ctx = ctx;
+}
+
+void
+reactor_timer_start(struct reactor *r, struct reactor_timer *t,
+		    double timeout)
+{
+	reactor_timer_stop(t);
+	if (timeout < 0)
+		timeout = 0;
+	t->deadline = reactor_now_ns() + (uint64_t)(timeout * 1e9);
+	t->reactor = r;
+	reactor_timer_heap_push(&r->timers, t);
+}
+
+void
+reactor_timer_stop(struct reactor_timer *t)
+{
+	if (t->reactor == NULL)
+		return;
+	reactor_timer_heap_delete(&t->reactor->timers, t);
+	t->reactor = NULL;
+}
+
+void
+reactor_post(struct reactor *r, struct reactor_task *task,
+	     reactor_task_f cb, void *ctx)
+{
+	task->cb = cb;
+	task->ctx = ctx;
+	struct reactor_task *head = __atomic_load_n(&r->tasks,
+						    __ATOMIC_RELAXED);
+	do {
+		task->next = head;
+	} while (!__atomic_compare_exchange_n(&r->tasks, &head, task, true,
+					      __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+	/*
+	 * A non-empty stack is not taken by the loop yet, it will see
+	 * the task before going to sleep. So only the first one wakes.
+	 */
+	if (head == NULL)
+		reactor_wakeup(r);
+}
+
+void
+reactor_stop(struct reactor *r)
+{
+	__atomic_store_n(&r->is_stopped, true, __ATOMIC_RELEASE);
+	reactor_wakeup(r);
+}
+
+static void
+reactor_run_tasks(struct reactor *r)
+{
+	if (__atomic_load_n(&r->tasks, __ATOMIC_RELAXED) == NULL)
+		return;
+	struct reactor_task *list = __atomic_exchange_n(&r->tasks, NULL,
+							__ATOMIC_ACQUIRE);
+	/* The stack is in the reverse order of the posts. */
+	struct reactor_task *fifo = NULL;
+	while (list != NULL) {
+		struct reactor_task *next = list->next;
+		list->next = fifo;
+		fifo = list;
+		list = next;
+	}
+	while (fifo != NULL) {
+		struct reactor_task *next = fifo->next;
+		/* Read before the callback, which may reuse the task. */
+		fifo->cb(fifo);
+		fifo = next;
+	}
+}
+
+static int
+reactor_run_timers(struct reactor *r)
+{
+	int count = 0;
+	uint64_t now = 0;
+	struct reactor_timer *t;
+	while ((t = reactor_timer_heap_top(&r->timers)) != NULL) {
+		if (now < t->deadline) {
+			now = reactor_now_ns();
+			if (now < t->deadline)
+				break;
+		}
+		reactor_timer_heap_pop(&r->timers);
+		t->reactor = NULL;
+		t->cb(t);
+		++count;
+	}
+	return count;
+}
+
+/** Milliseconds for epoll_wait(), rounded up not to spin. */
+static int
+reactor_wait_ms(struct reactor *r, double timeout)
+{
+	if (__atomic_load_n(&r->tasks, __ATOMIC_RELAXED) != NULL)
+		return 0;
+	int64_t ms = timeout < 0 ? -1 : (int64_t)(timeout * 1000 + 0.999);
+	struct reactor_timer *t = reactor_timer_heap_top(&r->timers);
+	if (t != NULL) {
+		uint64_t now = reactor_now_ns();
+		int64_t timer_ms = t->deadline <= now ? 0 :
+			(int64_t)((t->deadline - now + 999999) / 1000000);
+		if (ms < 0 || timer_ms < ms)
+			ms = timer_ms;
+	}
+	return ms > INT32_MAX ? INT32_MAX : (int)ms;
+}
+
+int
+reactor_run_once(struct reactor *r, double timeout)
+{
+	int rc = epoll_wait(r->epoll_fd, r->events, REACTOR_EVENT_BATCH,
+			    reactor_wait_ms(r, timeout));
+	if (rc < 0) {
+		if (errno != EINTR)
+			return -1;
+		rc = 0;
+	}
+	r->event_count = rc;
+	int count = 0;
+	for (r->event_pos = 0; r->event_pos < r->event_count;) {
+		struct epoll_event *ev = &r->events[r->event_pos++];
+		struct reactor_io *io = ev->data.ptr;
+		if (io == NULL)
+			continue;
+		io->cb(io, ev->events);
+		++count;
+	}
+	r->event_pos = 0;
+	r->event_count = 0;
+	count += reactor_run_timers(r);
+	reactor_run_tasks(r);
+	return count;
+}
+
+int
+reactor_run(struct reactor *r)
+{
+	while (!__atomic_load_n(&r->is_stopped, __ATOMIC_ACQUIRE)) {
+		if (reactor_run_once(r, -1) < 0)
+			return -1;
+	}
+	__atomic_store_n(&r->is_stopped, false, __ATOMIC_RELAXED);
+	return 0;
+}
+
+int
+reactor_listen(const char *host, uint16_t port, int backlog,
+	       bool is_reuse_port)
+{
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	if (host == NULL) {
+		addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	} else if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+		errno = EINVAL;
+		return -1;
+	}
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			0);
+	if (fd < 0)
+		return -1;
+	int yes = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+	if ((is_reuse_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes,
+					 sizeof(yes)) != 0) ||
+	    bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+	    listen(fd, backlog) != 0) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	return fd;
+}
@@ -0,0 +1,177 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+/**
+ * Event loop on edge-triggered epoll, one per thread. It is what the
+ * lecture servers of 9_aio, the chat and the IOCore example do each
+ * on its own:
+ * - descriptors with a callback on readiness;
+ * - timers on a 4-ary heap;
+ * - tasks posted from other threads, with an eventfd wakeup.
+ *
+ * The descriptors are edge-triggered: the callback is called when
+ * the descriptor becomes ready, and it must read or write until
+ * EAGAIN, otherwise it won't be called again.
+ *
+ * For a multi-threaded server each thread runs its own reactor.
+ * Either each one has its own listening socket with SO_REUSEPORT,
+ * and the kernel balances the connections between them. Or they
+ * share one socket added with REACTOR_EXCLUSIVE, and the kernel
+ * wakes up only one of the waiting loops per connection.
+ *
+ * Only reactor_post() and reactor_stop() can be called from other
+ * threads. The rest is for the thread running the reactor.
+ */
+
+#if !defined(__linux__)
+#error "The reactor is built on epoll, Linux only"
+#endif
+
+#include <sys/epoll.h>
+
+enum reactor_event {
+	REACTOR_IN = EPOLLIN,
+	REACTOR_OUT = EPOLLOUT,
+	/** Always reported, no need to ask. */
+	REACTOR_ERR = EPOLLERR,
+	REACTOR_HUP = EPOLLHUP | EPOLLRDHUP,
+	/**
+	 * Wake up only one of the reactors sharing the descriptor. Can
+	 * be given only to reactor_add(), not to reactor_mod().
+	 */
+	REACTOR_EXCLUSIVE = EPOLLEXCLUSIVE,
+};
+
+struct reactor;
+struct reactor_io;
+struct reactor_timer;
+struct reactor_task;
+
+typedef void (*reactor_io_f)(struct reactor_io *io, uint32_t events);
+typedef void (*reactor_timer_f)(struct reactor_timer *timer);
+typedef void (*reactor_task_f)(struct reactor_task *task);
+
+/** A descriptor in a reactor. Owned by the user. */
+struct reactor_io {
+	struct reactor *reactor;
+	int fd;
+	uint32_t events;
+	reactor_io_f cb;
+	void *ctx;
+};
+
+/** A one-shot timer. Owned by the user. */
+struct reactor_timer {
+	struct reactor *reactor;
+	/** CLOCK_MONOTONIC nanoseconds. */
+	uint64_t deadline;
+	/** In the reactor's timer heap, or HEAP_NO_POS. */
+	size_t heap_pos;
+	reactor_timer_f cb;
+	void *ctx;
+};
+
+/** A function to call in the reactor's thread. Owned by the user. */
+struct reactor_task {
+	struct reactor_task *next;
+	reactor_task_f cb;
+	void *ctx;
+};
+
+/** A new reactor, or NULL with errno set. */
+struct reactor *
+reactor_new(void);
+
+/**
+ * Delete the reactor. The descriptors are not closed, the timers and
+ * the not executed tasks are dropped.
+ */
+void
+reactor_delete(struct reactor *r);
+
+/**
+ * Watch the descriptor. The callback gets the ready events. Returns
+ * 0 on success, or -1 with errno set.
+ */
+int
+reactor_add(struct reactor *r, struct reactor_io *io, int fd,
+	    uint32_t events, reactor_io_f cb, void *ctx);
+
+/** Change the watched events. Returns 0, or -1 with errno set. */
+int
+reactor_mod(struct reactor_io *io, uint32_t events);
+
+/** Stop watching the descriptor. Safe to call from its callback. */
+void
+reactor_del(struct reactor_io *io);
+
+/** Prepare a timer. Until started it is not in any reactor. */
+void
+reactor_timer_create(struct reactor_timer *t, reactor_timer_f cb,
+		     void *ctx);
+
+/** Call the timer callback in @a timeout seconds. Restarts it. */
+void
+reactor_timer_start(struct reactor *r, struct reactor_timer *t,
+		    double timeout);
+
+/** Cancel the timer if it is running. */
+void
+reactor_timer_stop(struct reactor_timer *t);
+
+static inline bool
+reactor_timer_is_active(const struct reactor_timer *t)
+{
+	return t->reactor != NULL;
+}
+
+/**
+ * Call the task in the reactor's thread, on its next iteration. From
+ * any thread. The loop is woken up if it sleeps.
+ */
+void
+reactor_post(struct reactor *r, struct reactor_task *task,
+	     reactor_task_f cb, void *ctx);
+
+/** Make reactor_run() return. From any thread. */
+void
+reactor_stop(struct reactor *r);
+
+/**
+ * Run the loop until reactor_stop(). Returns 0 after a stop, or -1
+ * with errno set on an epoll failure.
+ */
+int
+reactor_run(struct reactor *r);
+
+/**
+ * Process the ready events, the expired timers and the posted tasks
+ * once. Wait for them up to @a timeout seconds, negative means no
+ * limit. Returns the number of the processed events, or -1.
+ */
+int
+reactor_run_once(struct reactor *r, double timeout);
+
+/**
+ * A non-blocking listening TCP socket on the address. With
+ * @a is_reuse_port it can be bound by each thread's reactor.
+ * Returns the descriptor, or -1 with errno set.
+ */
+int
+reactor_listen(const char *host, uint16_t port, int backlog,
+	       bool is_reuse_port);
+
+/** Monotonic clock of the timers, in seconds. */
+double
+reactor_time(void);
+
+#if defined(__cplusplus)
+} /* extern "C" */
+#endif /* defined(__cplusplus) */
@@ -0,0 +1,466 @@
+#define _GNU_SOURCE
+#include "reactor.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/**
+ * Echo server on the reactor and a load client for it, speaking the
+ * protocol of lecture_examples/9_aio servers: the client sends a
+ * 4 byte int, the server replies with the int + 1. So the client can
+ * load those servers too and compare them with the reactor.
+ *
+ * reactor_bench server [-t threads] [-p port] [-x]
+ *     Run the server until SIGINT or SIGTERM. Each thread has its own
+ *     SO_REUSEPORT listener, or with -x all of them share one socket
+ *     with EPOLLEXCLUSIVE.
+ *
+ * reactor_bench client [-c connections] [-d seconds] [-p port]
+ *     Keep one request in flight on each connection for the given
+ *     time, then print the request rate and the latencies as JSON.
+ *     The client itself runs on a reactor, the duration is a timer.
+ *
+ * reactor_bench [-t threads] [-c connections] [-d seconds] [-x]
+ *     Both in one process, the server in the threads, the client in
+ *     the main thread.
+ */
+
+enum {
+	BENCH_DEFAULT_PORT = 12345,
+	BENCH_BUF_SIZE = 4096,
+	BENCH_MAX_THREADS = 64,
+	/** Latency histogram buckets, a bucket per microsecond. */
+	BENCH_LATENCY_BUCKETS = 100 * 1000,
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct server_conn {
+	struct reactor_io io;
+	/** A part of an int left from the previous read. */
+	char in[BENCH_BUF_SIZE];
+	size_t in_size;
+	char out[BENCH_BUF_SIZE * 2];
+	size_t out_pos;
+	size_t out_size;
+};
+
+struct server_thread {
+	pthread_t tid;
+	struct reactor *reactor;
+	struct reactor_io listen_io;
+	int listen_fd;
+	bool is_listen_shared;
+	pthread_barrier_t *ready;
+};
+
+static void
+server_conn_delete(struct server_conn *c)
+{
+	reactor_del(&c->io);
+	close(c->io.fd);
+	free(c);
+}
+
+/** Returns false if the connection is gone. */
+static bool
+server_conn_flush(struct server_conn *c)
+{
+	while (c->out_pos < c->out_size) {
+		ssize_t rc = send(c->io.fd, c->out + c->out_pos,
+				  c->out_size - c->out_pos, MSG_NOSIGNAL);
+		if (rc > 0) {
+			c->out_pos += rc;
+			continue;
+		}
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			return false;
+		if ((c->io.events & REACTOR_OUT) == 0)
+			reactor_mod(&c->io, REACTOR_IN | REACTOR_OUT);
+		return true;
+	}
+	c->out_pos = 0;
+	c->out_size = 0;
+	if ((c->io.events & REACTOR_OUT) != 0)
+		reactor_mod(&c->io, REACTOR_IN);
+	return true;
+}
+
+static void
+server_conn_cb(struct reactor_io *io, uint32_t events)
+{
+	struct server_conn *c = io->ctx;
+	if ((events & REACTOR_OUT) != 0 && !server_conn_flush(c))
+		goto close;
+	if ((events & (REACTOR_IN | REACTOR_HUP | REACTOR_ERR)) == 0)
+		return;
+	while (true) {
+		/* Not to get more replies than the output can take. */
+		if (c->out_size + sizeof(c->in) > sizeof(c->out))
+			return;
+		size_t size = sizeof(c->in) - c->in_size;
+		ssize_t rc = recv(io->fd, c->in + c->in_size, size, 0);
+		if (rc == 0)
+			goto close;
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			goto close;
+		}
+		c->in_size += rc;
+		size_t pos = 0;
+		for (; pos + sizeof(int) <= c->in_size; pos += sizeof(int)) {
+			int value;
+			memcpy(&value, c->in + pos, sizeof(value));
+			++value;
+			memcpy(c->out + c->out_size, &value, sizeof(value));
+			c->out_size += sizeof(value);
+		}
+		c->in_size -= pos;
+		memmove(c->in, c->in + pos, c->in_size);
+		if (!server_conn_flush(c))
+			goto close;
+		/*
+		 * A short read has drained the socket. New data makes a new
+		 * edge, so no need in one more recv() just to get EAGAIN.
+		 */
+		if ((size_t)rc < size)
+			return;
+	}
+close:
+	server_conn_delete(c);
+}
+
+static void
+server_accept_cb(struct reactor_io *io, uint32_t events)
+{
+	(void)events;
+	struct reactor *r = io->reactor;
+	while (true) {
+		int fd = accept4(io->fd, NULL, NULL, SOCK_NONBLOCK |
+				 SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			/* EAGAIN, or another thread has taken it. */
+			return;
+		}
+		int yes = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+		struct server_conn *c = malloc(sizeof(*c));
+		c->in_size = 0;
+		c->out_pos = 0;
+		c->out_size = 0;
+		if (reactor_add(r, &c->io, fd, REACTOR_IN, server_conn_cb,
+				c) != 0) {
+			close(fd);
+			free(c);
+		}
+	}
+}
+
+static void *
+server_thread_f(void *arg)
+{
+	struct server_thread *t = arg;
+	uint32_t events = REACTOR_IN;
+	if (t->is_listen_shared)
+		events |= REACTOR_EXCLUSIVE;
+	if (reactor_add(t->reactor, &t->listen_io, t->listen_fd, events,
+			server_accept_cb, t) != 0) {
+		perror("reactor_add");
+		exit(-1);
+	}
+	pthread_barrier_wait(t->ready);
+	if (reactor_run(t->reactor) != 0)
+		perror("reactor_run");
+	/* The connections are left to the process exit. */
+	return NULL;
+}
+
+struct server {
+	struct server_thread threads[BENCH_MAX_THREADS];
+	int thread_count;
+	pthread_barrier_t ready;
+};
+
+static int
+server_start(struct server *s, int thread_count, uint16_t port,
+	     bool is_listen_shared)
+{
+	s->thread_count = thread_count;
+	pthread_barrier_init(&s->ready, NULL, thread_count + 1);
+	int shared_fd = -1;
+	if (is_listen_shared) {
+		shared_fd = reactor_listen("127.0.0.1", port, 1024, false);
+		if (shared_fd < 0)
+			return -1;
+	}
+	for (int i = 0; i < thread_count; ++i) {
+		struct server_thread *t = &s->threads[i];
+		t->reactor = reactor_new();
+		t->is_listen_shared = is_listen_shared;
+		t->listen_fd = is_listen_shared ? shared_fd :
+			reactor_listen("127.0.0.1", port, 1024, true);
+		t->ready = &s->ready;
+		if (t->reactor == NULL || t->listen_fd < 0)
+			return -1;
+		pthread_create(&t->tid, NULL, server_thread_f, t);
+	}
+	pthread_barrier_wait(&s->ready);
+	return 0;
+}
+
+static void
+server_stop(struct server *s)
+{
+	for (int i = 0; i < s->thread_count; ++i)
+		reactor_stop(s->threads[i].reactor);
+	for (int i = 0; i < s->thread_count; ++i) {
+		pthread_join(s->threads[i].tid, NULL);
+		if (!s->threads[i].is_listen_shared || i == 0)
+			close(s->threads[i].listen_fd);
+		reactor_delete(s->threads[i].reactor);
+	}
+	pthread_barrier_destroy(&s->ready);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct client;
+
+struct client_conn {
+	struct reactor_io io;
+	struct client *client;
+	int value;
+	double sent_at;
+	char in[sizeof(int)];
+	size_t in_size;
+};
+
+struct client {
+	struct reactor *reactor;
+	struct reactor_timer stop_timer;
+	uint64_t request_count;
+	uint64_t error_count;
+	uint64_t *latencies;
+	bool is_done;
+};
+
+static void
+client_send(struct client_conn *c)
+{
+	c->sent_at = reactor_time();
+	/* 4 bytes into an empty socket buffer always fit. */
+	if (send(c->io.fd, &c->value, sizeof(c->value), MSG_NOSIGNAL) !=
+	    sizeof(c->value))
+		c->value = -1;
+}
+
+static void
+client_conn_cb(struct reactor_io *io, uint32_t events)
+{
+	(void)events;
+	struct client_conn *c = io->ctx;
+	while (true) {
+		ssize_t rc = recv(io->fd, c->in + c->in_size,
+				  sizeof(c->in) - c->in_size, 0);
+		if (rc <= 0) {
+			if (rc < 0 && errno == EINTR)
+				continue;
+			if (rc < 0 && (errno == EAGAIN ||
+				       errno == EWOULDBLOCK))
+				return;
+			reactor_del(io);
+			return;
+		}
+		c->in_size += rc;
+		if (c->in_size < sizeof(c->in))
+			continue;
+		c->in_size = 0;
+		struct client *client = c->client;
+		int reply;
+		memcpy(&reply, c->in, sizeof(reply));
+		if (reply != c->value + 1)
+			++client->error_count;
+		double us = (reactor_time() - c->sent_at) * 1e6;
+		size_t bucket = us < BENCH_LATENCY_BUCKETS - 1 ?
+			(size_t)us : BENCH_LATENCY_BUCKETS - 1;
+		++client->latencies[bucket];
+		++client->request_count;
+		if (client->is_done)
+			return;
+		c->value = reply;
+		client_send(c);
+		/* Only one request is in flight, nothing else to read. */
+		return;
+	}
+}
+
+static void
+client_stop_cb(struct reactor_timer *t)
+{
+	struct client *client = t->ctx;
+	client->is_done = true;
+	reactor_stop(client->reactor);
+}
+
+static double
+client_percentile(const struct client *client, double p)
+{
+	uint64_t target = (uint64_t)(client->request_count * p);
+	uint64_t sum = 0;
+	for (size_t i = 0; i < BENCH_LATENCY_BUCKETS; ++i) {
+		sum += client->latencies[i];
+		if (sum > target)
+			return i;
+	}
+	return BENCH_LATENCY_BUCKETS;
+}
+
+static int
+client_run(int conn_count, double duration, uint16_t port)
+{
+	struct client client;
+	memset(&client, 0, sizeof(client));
+	client.reactor = reactor_new();
+	client.latencies = calloc(BENCH_LATENCY_BUCKETS, sizeof(uint64_t));
+	struct client_conn *conns = calloc(conn_count, sizeof(conns[0]));
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+	for (int i = 0; i < conn_count; ++i) {
+		struct client_conn *c = &conns[i];
+		c->client = &client;
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd < 0 || connect(fd, (struct sockaddr *)&addr,
+				      sizeof(addr)) != 0) {
+			perror("connect");
+			return -1;
+		}
+		int yes = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		c->value = i * 1000;
+		reactor_add(client.reactor, &c->io, fd, REACTOR_IN,
+			    client_conn_cb, c);
+	}
+	reactor_timer_create(&client.stop_timer, client_stop_cb, &client);
+	reactor_timer_start(client.reactor, &client.stop_timer, duration);
+	double start = reactor_time();
+	for (int i = 0; i < conn_count; ++i)
+		client_send(&conns[i]);
+	reactor_run(client.reactor);
+	double elapsed = reactor_time() - start;
+	printf("{\"connections\": %d, \"seconds\": %.2f, "
+	       "\"requests_per_sec\": %.0f, \"p50_us\": %.0f, "
+	       "\"p99_us\": %.0f, \"errors\": %llu}\n", conn_count, elapsed,
+	       client.request_count / elapsed,
+	       client_percentile(&client, 0.5),
+	       client_percentile(&client, 0.99),
+	       (unsigned long long)client.error_count);
+	for (int i = 0; i < conn_count; ++i) {
+		struct client_conn *c = &conns[i];
+		if (c->io.reactor != NULL)
+			reactor_del(&c->io);
+		close(c->io.fd);
+	}
+	free(conns);
+	free(client.latencies);
+	reactor_delete(client.reactor);
+	return client.error_count == 0 ? 0 : -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+server_wait_signal(void)
+{
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	int sig;
+	sigwait(&set, &sig);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *mode = "all";
+	int first_opt = 1;
+	if (argc > 1 && argv[1][0] != '-') {
+		mode = argv[1];
+		first_opt = 2;
+	}
+	int thread_count = 1;
+	int conn_count = 64;
+	double duration = 3;
+	int port = BENCH_DEFAULT_PORT;
+	bool is_listen_shared = false;
+	for (int i = first_opt; i < argc; ++i) {
+		const char *val = i + 1 < argc ? argv[i + 1] : "";
+		if (strcmp(argv[i], "-t") == 0) {
+			thread_count = atoi(val), ++i;
+		} else if (strcmp(argv[i], "-c") == 0) {
+			conn_count = atoi(val), ++i;
+		} else if (strcmp(argv[i], "-d") == 0) {
+			duration = atof(val), ++i;
+		} else if (strcmp(argv[i], "-p") == 0) {
+			port = atoi(val), ++i;
+		} else if (strcmp(argv[i], "-x") == 0) {
+			is_listen_shared = true;
+		} else {
+			fprintf(stderr, "unknown option %s\n", argv[i]);
+			return -1;
+		}
+	}
+	if (thread_count < 1 || thread_count > BENCH_MAX_THREADS ||
+	    conn_count < 1) {
+		fprintf(stderr, "bad thread or connection count\n");
+		return -1;
+	}
+	if (strcmp(mode, "client") == 0)
+		return client_run(conn_count, duration, port);
+	bool is_server_only = strcmp(mode, "server") == 0;
+	if (!is_server_only && strcmp(mode, "all") != 0) {
+		fprintf(stderr, "unknown mode %s\n", mode);
+		return -1;
+	}
+	/* Blocked in all the threads, waited for in the main one. */
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+	struct server *s = malloc(sizeof(*s));
+	if (server_start(s, thread_count, port, is_listen_shared) != 0) {
+		perror("server start");
+		return -1;
+	}
+	int rc = 0;
+	if (is_server_only)
+		server_wait_signal();
+	else
+		rc = client_run(conn_count, duration, port);
+	server_stop(s);
+	free(s);
+	return rc;
+}
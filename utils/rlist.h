@@ -229,7 +229,7 @@ rlist_splice_tail(struct rlist *head1, struct rlist *head2)
 static inline void
 rlist_cut_before(struct rlist *head1, struct rlist *head2, struct rlist *item)
 {
-	if (head1->next == item) {
+	if (head2->next == item) {
 		rlist_create(head1);
 		return;
 	}
@@ -241,6 +241,67 @@ rlist_cut_before(struct rlist *head1, struct rlist *head2, struct rlist *item)
 	item->prev = head2;
 }
 
+/**
+ * move the items from first up to and including last, which go in
+ * this order in some list, to the head of list head
+ */
+static inline void
+rlist_splice_range(struct rlist *head, struct rlist *first,
+		   struct rlist *last)
+{
+	first->prev->next = last->next;
+	last->next->prev = first->prev;
+	first->prev = head;
+	last->next = head->next;
+	head->next->prev = last;
+	head->next = first;
+}
+
+/**
+ * move the items from first up to and including last, which go in
+ * this order in some list, to the tail of list head
+ */
+static inline void
+rlist_splice_range_tail(struct rlist *head, struct rlist *first,
+			struct rlist *last)
+{
+	first->prev->next = last->next;
+	last->next->prev = first->prev;
+	last->next = head;
+	first->prev = head->prev;
+	head->prev->next = first;
+	head->prev = last;
+}
+
+/**
+ * move up to count first items of list head2 to the tail of list
+ * head1, return how many were moved. The items are walked to find
+ * the last one, but are relinked at once
+ */
+static inline size_t
+rlist_splice_tail_n(struct rlist *head1, struct rlist *head2, size_t count)
+{
+	if (count == 0 || rlist_empty(head2))
+		return 0;
+	struct rlist *last = head2->next;
+	size_t moved = 1;
+	while (moved < count && last->next != head2) {
+		last = last->next;
+		++moved;
+	}
+	rlist_splice_range_tail(head1, head2->next, last);
+	return moved;
+}
+
+/**
+ * tell the CPU the item is going to be read soon
+ */
+#if __has_builtin(__builtin_prefetch) || defined(__GNUC__)
+#define rlist_prefetch(item) __builtin_prefetch(item)
+#else
+#define rlist_prefetch(item) ((void)(item))
+#endif
+
 /**
  * list head initializer
  */
@@ -368,6 +429,17 @@ delete from one list and add_tail as another's head
 	     !rlist_entry_is_head((item), (head), member);		\
 	     item = rlist_next_entry((item), member))
 
+/**
+ * foreach through all list entries, fetching the next one into the
+ * cache while the current one is processed. Helps when the loop body
+ * is long enough to hide the memory latency of the next node
+ */
+#define rlist_foreach_entry_prefetch(item, head, member)		\
+	for (item = rlist_first_entry((head), typeof(*item), member);	\
+	     !rlist_entry_is_head((item), (head), member) &&		\
+	     (rlist_prefetch(rlist_next(&(item)->member)), 1);		\
+	     item = rlist_next_entry((item), member))
+
 /**
  * foreach backward through all list entries
  */
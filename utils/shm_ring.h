@@ -0,0 +1,259 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sched.h>
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if defined(__cplusplus)
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+/**
+ * Byte stream from one producer to one consumer over shared memory.
+ * Works between processes: the ring is created with MAP_SHARED
+ * before fork(), and both sides use the same pointer.
+ *
+ * The producer and the consumer positions are in separate cache
+ * lines, so they don't bounce the line with each write and read.
+ * When the ring is empty the consumer spins a bit and then sleeps on
+ * a futex. The same for the producer when the ring is full. The
+ * other side only makes the wakeup syscall when someone sleeps.
+ *
+ * The positions only grow, the capacity is a power of 2, so the
+ * offset in the data is the position masked.
+ */
+
+enum {
+	SHM_RING_CACHE_LINE = 64,
+	/** Empty checks before going to sleep. */
+	SHM_RING_SPIN_COUNT = 1000,
+};
+
+struct shm_ring {
+	/** Written by the consumer only. */
+	uint64_t head __attribute__((aligned(SHM_RING_CACHE_LINE)));
+	/** Changed when the ring gets space, to wake the producer. */
+	uint32_t space_seq;
+	uint32_t is_producer_waiting;
+	/** Written by the producer only. */
+	uint64_t tail __attribute__((aligned(SHM_RING_CACHE_LINE)));
+	/** Changed when the ring gets data, to wake the consumer. */
+	uint32_t data_seq;
+	uint32_t is_consumer_waiting;
+	uint32_t is_closed;
+	uint64_t capacity __attribute__((aligned(SHM_RING_CACHE_LINE)));
+	size_t map_size;
+	char data[] __attribute__((aligned(SHM_RING_CACHE_LINE)));
+};
+
+static inline void
+shm_ring_futex_wait(uint32_t *addr, uint32_t value)
+{
+#if defined(__linux__)
+	/* Shared between processes, so not FUTEX_PRIVATE. */
+	syscall(SYS_futex, addr, FUTEX_WAIT, value, NULL, NULL, 0);
+#else
+	(void)addr;
+	(void)value;
+	sched_yield();
+#endif
+}
+
+static inline void
+shm_ring_futex_wake(uint32_t *addr)
+{
+#if defined(__linux__)
+	syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+#else
+	(void)addr;
+#endif
+}
+
+/**
+ * Create a ring with at least @a capacity bytes of data. Returns
+ * NULL if the memory couldn't be mapped.
+ */
+static inline struct shm_ring *
+shm_ring_new(size_t capacity)
+{
+	size_t cap = SHM_RING_CACHE_LINE;
+	while (cap < capacity)
+		cap *= 2;
+	size_t size = sizeof(struct shm_ring) + cap;
+	struct shm_ring *ring = (struct shm_ring *)mmap(NULL, size,
+		PROT_READ | PROT_WRITE, MAP_ANON | MAP_SHARED, -1, 0);
+	if (ring == MAP_FAILED)
+		return NULL;
+	memset(ring, 0, sizeof(*ring));
+	ring->capacity = cap;
+	ring->map_size = size;
+	return ring;
+}
+
+/** Unmap the ring. Each process does it for itself. */
+static inline void
+shm_ring_delete(struct shm_ring *ring)
+{
+	munmap(ring, ring->map_size);
+}
+
+/**
+ * Wait until the condition stops being true: spin, then sleep on the
+ * futex word while the other side is told about it by the flag.
+ */
+static inline void
+shm_ring_wait(uint32_t *seq, uint32_t *is_waiting, bool (*is_blocked)(
+	const struct shm_ring *), const struct shm_ring *ring)
+{
+	for (int i = 0; i < SHM_RING_SPIN_COUNT; ++i) {
+		if (!is_blocked(ring))
+			return;
+	}
+	while (true) {
+		uint32_t value = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+		__atomic_store_n(is_waiting, 1, __ATOMIC_SEQ_CST);
+		/*
+		 * Checked after the flag is set. So either the other side
+		 * sees the flag, or this side sees its progress.
+		 */
+		if (!is_blocked(ring))
+			break;
+		shm_ring_futex_wait(seq, value);
+	}
+	__atomic_store_n(is_waiting, 0, __ATOMIC_RELAXED);
+}
+
+static inline void
+shm_ring_notify(uint32_t *seq, uint32_t *is_waiting)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(is_waiting, __ATOMIC_RELAXED) == 0)
+		return;
+	__atomic_fetch_add(seq, 1, __ATOMIC_RELEASE);
+	shm_ring_futex_wake(seq);
+}
+
+static inline bool
+shm_ring_is_full(const struct shm_ring *ring)
+{
+	uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	return ring->tail - head == ring->capacity;
+}
+
+static inline bool
+shm_ring_is_empty(const struct shm_ring *ring)
+{
+	uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	return tail == ring->head &&
+		!__atomic_load_n(&ring->is_closed, __ATOMIC_ACQUIRE);
+}
+
+/** Write as much as fits, without blocking. Returns the byte count. */
+static inline size_t
+shm_ring_write(struct shm_ring *ring, const void *src, size_t size)
+{
+	uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	uint64_t tail = ring->tail;
+	size_t space = ring->capacity - (tail - head);
+	if (size > space)
+		size = space;
+	if (size == 0)
+		return 0;
+	size_t offset = tail & (ring->capacity - 1);
+	size_t first = ring->capacity - offset;
+	if (first > size)
+		first = size;
+	memcpy(ring->data + offset, src, first);
+	memcpy(ring->data, (const char *)src + first, size - first);
+	__atomic_store_n(&ring->tail, tail + size, __ATOMIC_RELEASE);
+	shm_ring_notify(&ring->data_seq, &ring->is_consumer_waiting);
+	return size;
+}
+
+/** Read what is there, without blocking. Returns the byte count. */
+static inline size_t
+shm_ring_read(struct shm_ring *ring, void *dst, size_t size)
+{
+	uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	uint64_t head = ring->head;
+	size_t used = tail - head;
+	if (size > used)
+		size = used;
+	if (size == 0)
+		return 0;
+	size_t offset = head & (ring->capacity - 1);
+	size_t first = ring->capacity - offset;
+	if (first > size)
+		first = size;
+	memcpy(dst, ring->data + offset, first);
+	memcpy((char *)dst + first, ring->data, size - first);
+	__atomic_store_n(&ring->head, head + size, __ATOMIC_RELEASE);
+	shm_ring_notify(&ring->space_seq, &ring->is_producer_waiting);
+	return size;
+}
+
+/** Write all the data, waiting for space when the ring is full. */
+static inline void
+shm_ring_write_all(struct shm_ring *ring, const void *src, size_t size)
+{
+	const char *pos = (const char *)src;
+	while (size > 0) {
+		size_t rc = shm_ring_write(ring, pos, size);
+		pos += rc;
+		size -= rc;
+		if (size > 0) {
+			shm_ring_wait(&ring->space_seq,
+				      &ring->is_producer_waiting,
+				      shm_ring_is_full, ring);
+		}
+	}
+}
+
+/**
+ * Read up to @a size bytes, waiting when the ring is empty. Returns
+ * less only when the producer has closed the ring and it is drained.
+ */
+static inline size_t
+shm_ring_read_all(struct shm_ring *ring, void *dst, size_t size)
+{
+	char *pos = (char *)dst;
+	size_t total = 0;
+	while (total < size) {
+		size_t rc = shm_ring_read(ring, pos + total, size - total);
+		total += rc;
+		if (rc > 0)
+			continue;
+		if (__atomic_load_n(&ring->is_closed, __ATOMIC_ACQUIRE)) {
+			/* Could get more data right before the close. */
+			rc = shm_ring_read(ring, pos + total, size - total);
+			if (rc == 0)
+				break;
+			total += rc;
+			continue;
+		}
+		shm_ring_wait(&ring->data_seq, &ring->is_consumer_waiting,
+			      shm_ring_is_empty, ring);
+	}
+	return total;
+}
+
+/** The producer is done. The consumer gets the rest, then the end. */
+static inline void
+shm_ring_close(struct shm_ring *ring)
+{
+	__atomic_store_n(&ring->is_closed, 1, __ATOMIC_RELEASE);
+	shm_ring_notify(&ring->data_seq, &ring->is_consumer_waiting);
+}
+
+#if defined(__cplusplus)
+} /* extern "C" */
+#endif /* defined(__cplusplus) */
@@ -0,0 +1,207 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sched.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+/**
+ * Spinlocks for short critical sections, when a mutex syscall costs
+ * more than the wait.
+ *
+ * tas_lock - test-and-test-and-set with exponential backoff. It is
+ * the lock of lecture_examples/6_threads/7_spin_lock.c, but it only
+ * reads the line while it is locked, so the waiters don't bounce it
+ * between the CPUs with failed writes. Not fair.
+ *
+ * ticket_lock - FIFO. A waiter takes the next ticket and waits for
+ * its turn. The backoff is proportional to the place in the queue.
+ * All the waiters still read the same line, so each unlock
+ * invalidates it in all of them.
+ *
+ * mcs_lock - FIFO queue, where each waiter spins on its own node. An
+ * unlock touches only the next waiter's line, so the cost doesn't
+ * grow with the waiter count. The node is provided by the caller,
+ * usually on the stack, and must live until the unlock.
+ *
+ * The waits yield the CPU after a while. Without it, when there are
+ * more threads than CPUs, a fair lock can hand itself over to a
+ * thread which isn't running, and everyone spins until the scheduler
+ * gets to it.
+ */
+
+enum {
+	SPINLOCK_MAX_BACKOFF = 1024,
+	/** Pauses before each sched_yield(). */
+	SPINLOCK_YIELD_AFTER = 1024,
+	SPINLOCK_CACHE_LINE = 64,
+};
+
+static inline void
+spinlock_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+/** Spin @a count times. Returns new total, yields when it is big. */
+static inline uint32_t
+spinlock_backoff(uint32_t count, uint32_t total)
+{
+	for (uint32_t i = 0; i < count; ++i)
+		spinlock_cpu_relax();
+	total += count;
+	if (total >= SPINLOCK_YIELD_AFTER) {
+		sched_yield();
+		total = 0;
+	}
+	return total;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct tas_lock {
+	bool is_locked;
+};
+
+#define TAS_LOCK_INITIALIZER {false}
+
+static inline bool
+tas_lock_trylock(struct tas_lock *l)
+{
+	return !__atomic_exchange_n(&l->is_locked, true, __ATOMIC_ACQUIRE);
+}
+
+static inline void
+tas_lock_lock(struct tas_lock *l)
+{
+	uint32_t backoff = 1;
+	uint32_t total = 0;
+	while (!tas_lock_trylock(l)) {
+		do {
+			total = spinlock_backoff(backoff, total);
+			if (backoff < SPINLOCK_MAX_BACKOFF)
+				backoff *= 2;
+		} while (__atomic_load_n(&l->is_locked, __ATOMIC_RELAXED));
+	}
+}
+
+static inline void
+tas_lock_unlock(struct tas_lock *l)
+{
+	__atomic_store_n(&l->is_locked, false, __ATOMIC_RELEASE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct ticket_lock {
+	/** The next ticket to give out. */
+	uint32_t next;
+	/** The ticket which owns the lock. */
+	uint32_t owner;
+};
+
+#define TICKET_LOCK_INITIALIZER {0, 0}
+
+static inline bool
+ticket_lock_trylock(struct ticket_lock *l)
+{
+	uint32_t owner = __atomic_load_n(&l->owner, __ATOMIC_RELAXED);
+	uint32_t expected = owner;
+	return __atomic_compare_exchange_n(&l->next, &expected, owner + 1,
+					   false, __ATOMIC_ACQUIRE,
+					   __ATOMIC_RELAXED);
+}
+
+static inline void
+ticket_lock_lock(struct ticket_lock *l)
+{
+	uint32_t ticket = __atomic_fetch_add(&l->next, 1, __ATOMIC_RELAXED);
+	uint32_t total = 0;
+	while (true) {
+		uint32_t owner = __atomic_load_n(&l->owner, __ATOMIC_ACQUIRE);
+		if (owner == ticket)
+			return;
+		/* About a short critical section per waiter ahead. */
+		uint32_t backoff = (ticket - owner) * 32;
+		if (backoff > SPINLOCK_MAX_BACKOFF)
+			backoff = SPINLOCK_MAX_BACKOFF;
+		total = spinlock_backoff(backoff, total);
+	}
+}
+
+static inline void
+ticket_lock_unlock(struct ticket_lock *l)
+{
+	/* Only the owner writes it, no need in an atomic increment. */
+	uint32_t owner = __atomic_load_n(&l->owner, __ATOMIC_RELAXED);
+	__atomic_store_n(&l->owner, owner + 1, __ATOMIC_RELEASE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct mcs_node {
+	struct mcs_node *next;
+	bool is_locked;
+} __attribute__((aligned(SPINLOCK_CACHE_LINE)));
+
+struct mcs_lock {
+	/** The last waiter, or the owner when there are none. */
+	struct mcs_node *tail;
+};
+
+#define MCS_LOCK_INITIALIZER {NULL}
+
+static inline bool
+mcs_lock_trylock(struct mcs_lock *l, struct mcs_node *node)
+{
+	node->next = NULL;
+	struct mcs_node *expected = NULL;
+	return __atomic_compare_exchange_n(&l->tail, &expected, node, false,
+					   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void
+mcs_lock_lock(struct mcs_lock *l, struct mcs_node *node)
+{
+	node->next = NULL;
+	node->is_locked = true;
+	struct mcs_node *prev = __atomic_exchange_n(&l->tail, node,
+						    __ATOMIC_ACQ_REL);
+	if (prev == NULL)
+		return;
+	__atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+	uint32_t total = 0;
+	while (__atomic_load_n(&node->is_locked, __ATOMIC_ACQUIRE))
+		total = spinlock_backoff(1, total);
+}
+
+static inline void
+mcs_lock_unlock(struct mcs_lock *l, struct mcs_node *node)
+{
+	struct mcs_node *next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+	if (next == NULL) {
+		struct mcs_node *expected = node;
+		if (__atomic_compare_exchange_n(&l->tail, &expected, NULL,
+						false, __ATOMIC_RELEASE,
+						__ATOMIC_RELAXED))
+			return;
+		/* A new waiter has taken the tail, but isn't linked yet. */
+		uint32_t total = 0;
+		while ((next = __atomic_load_n(&node->next,
+					       __ATOMIC_ACQUIRE)) == NULL)
+			total = spinlock_backoff(1, total);
+	}
+	__atomic_store_n(&next->is_locked, false, __ATOMIC_RELEASE);
+}
+
+#if defined(__cplusplus)
+} /* extern "C" */
+#endif /* defined(__cplusplus) */
@@ -0,0 +1,167 @@
+#define _GNU_SOURCE
+#include "futex_mutex.h"
+#include "spinlock.h"
+#include "unit_bench.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+/**
+ * The spinlocks against each other and the futex mutex, with
+ * different thread counts and critical section lengths. The argument
+ * is the thread count. An iteration is one lock and unlock, done by
+ * any of the threads. The critical section increments a shared
+ * counter and then does the given number of dependent increments of
+ * a local one. The code between the sections is the same loop.
+ */
+
+enum {
+	BENCH_OP_COUNT = 200 * 1000,
+	BENCH_MAX_THREADS = 8,
+};
+
+enum bench_lock_type {
+	BENCH_LOCK_TAS,
+	BENCH_LOCK_TICKET,
+	BENCH_LOCK_MCS,
+	BENCH_LOCK_FUTEX_MUTEX,
+};
+
+struct bench_ctx {
+	enum bench_lock_type type;
+	long iterations;
+	long work;
+	struct tas_lock tas;
+	struct ticket_lock ticket;
+	struct mcs_lock mcs;
+	struct futex_mutex fm;
+	bool is_started;
+	/** In its own line, not to share it with the locks. */
+	uint64_t counter __attribute__((aligned(SPINLOCK_CACHE_LINE)));
+};
+
+static inline void
+bench_work(long work)
+{
+	volatile long x = 0;
+	for (long i = 0; i < work; ++i)
+		x = x + 1;
+}
+
+static void *
+bench_thread_f(void *arg)
+{
+	struct bench_ctx *ctx = arg;
+	while (!__atomic_load_n(&ctx->is_started, __ATOMIC_ACQUIRE))
+		spinlock_cpu_relax();
+	long n = ctx->iterations;
+	long work = ctx->work;
+	struct mcs_node node;
+	for (long i = 0; i < n; ++i) {
+		switch (ctx->type) {
+		case BENCH_LOCK_TAS:
+			tas_lock_lock(&ctx->tas);
+			break;
+		case BENCH_LOCK_TICKET:
+			ticket_lock_lock(&ctx->ticket);
+			break;
+		case BENCH_LOCK_MCS:
+			mcs_lock_lock(&ctx->mcs, &node);
+			break;
+		case BENCH_LOCK_FUTEX_MUTEX:
+			futex_mutex_lock(&ctx->fm);
+			break;
+		}
+		++*(volatile uint64_t *)&ctx->counter;
+		bench_work(work);
+		switch (ctx->type) {
+		case BENCH_LOCK_TAS:
+			tas_lock_unlock(&ctx->tas);
+			break;
+		case BENCH_LOCK_TICKET:
+			ticket_lock_unlock(&ctx->ticket);
+			break;
+		case BENCH_LOCK_MCS:
+			mcs_lock_unlock(&ctx->mcs, &node);
+			break;
+		case BENCH_LOCK_FUTEX_MUTEX:
+			futex_mutex_unlock(&ctx->fm);
+			break;
+		}
+		bench_work(work);
+	}
+	return NULL;
+}
+
+static void
+bench_lock(enum bench_lock_type type, long work, long iterations,
+	   long thread_count)
+{
+	bench_pause();
+	struct bench_ctx *ctx = aligned_alloc(SPINLOCK_CACHE_LINE,
+					      sizeof(*ctx));
+	ctx->type = type;
+	ctx->iterations = iterations / thread_count;
+	ctx->work = work;
+	ctx->tas = (struct tas_lock)TAS_LOCK_INITIALIZER;
+	ctx->ticket = (struct ticket_lock)TICKET_LOCK_INITIALIZER;
+	ctx->mcs = (struct mcs_lock)MCS_LOCK_INITIALIZER;
+	futex_mutex_create(&ctx->fm);
+	ctx->is_started = false;
+	ctx->counter = 0;
+	pthread_t tids[BENCH_MAX_THREADS];
+	for (long i = 0; i < thread_count; ++i)
+		pthread_create(&tids[i], NULL, bench_thread_f, ctx);
+	bench_resume();
+	__atomic_store_n(&ctx->is_started, true, __ATOMIC_RELEASE);
+	for (long i = 0; i < thread_count; ++i)
+		pthread_join(tids[i], NULL);
+	bench_pause();
+	if (ctx->counter != (uint64_t)(ctx->iterations * thread_count))
+		abort();
+	futex_mutex_destroy(&ctx->fm);
+	free(ctx);
+	bench_resume();
+}
+
+#define BENCH_LOCK_DEFINE(name, type, work)				\
+static void								\
+bench_##name##_##work(long iterations, long thread_count)		\
+{									\
+	bench_lock(type, work, iterations, thread_count);		\
+}
+
+BENCH_LOCK_DEFINE(tas, BENCH_LOCK_TAS, 0)
+BENCH_LOCK_DEFINE(tas, BENCH_LOCK_TAS, 100)
+BENCH_LOCK_DEFINE(ticket, BENCH_LOCK_TICKET, 0)
+BENCH_LOCK_DEFINE(ticket, BENCH_LOCK_TICKET, 100)
+BENCH_LOCK_DEFINE(mcs, BENCH_LOCK_MCS, 0)
+BENCH_LOCK_DEFINE(mcs, BENCH_LOCK_MCS, 100)
+BENCH_LOCK_DEFINE(futex_mutex, BENCH_LOCK_FUTEX_MUTEX, 0)
+BENCH_LOCK_DEFINE(futex_mutex, BENCH_LOCK_FUTEX_MUTEX, 100)
+
+int
+main(int argc, char **argv)
+{
+	static const struct {
+		const char *name;
+		bench_f f;
+	} benches[] = {
+		{"tas_cs0", bench_tas_0},
+		{"ticket_cs0", bench_ticket_0},
+		{"mcs_cs0", bench_mcs_0},
+		{"futex_mutex_cs0", bench_futex_mutex_0},
+		{"tas_cs100", bench_tas_100},
+		{"ticket_cs100", bench_ticket_100},
+		{"mcs_cs100", bench_mcs_100},
+		{"futex_mutex_cs100", bench_futex_mutex_100},
+	};
+	int count = sizeof(benches) / sizeof(benches[0]);
+	for (long threads = 1; threads <= BENCH_MAX_THREADS; threads *= 2) {
+		for (int i = 0; i < count; ++i) {
+			bench_register_arg(benches[i].name, benches[i].f,
+					   BENCH_OP_COUNT, threads);
+		}
+	}
+	return bench_main(argc, argv);
+}
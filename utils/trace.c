@@ -0,0 +1,235 @@
+#define _GNU_SOURCE
+#include "trace.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+struct trace_record {
+	uint64_t ts_ns;
+	const char *name;
+	uint64_t arg;
+	enum trace_phase phase;
+};
+
+/**
+ * Events of one thread. Only the owner writes the records and the
+ * position, the dump reads them. The buffers of the exited threads
+ * are kept, so their events are in the dump too.
+ */
+struct trace_buffer {
+	struct trace_buffer *next;
+	/** Count of the events ever written. Grows forever. */
+	uint64_t pos;
+	/** The events before it were dropped by trace_reset(). */
+	uint64_t reset_pos;
+	pid_t tid;
+	char name[TRACE_THREAD_NAME_SIZE];
+	struct trace_record records[TRACE_BUFFER_SIZE];
+};
+
+static __thread struct trace_buffer *trace_current = NULL;
+/** Stack of all the buffers, pushed by the threads on first event. */
+static struct trace_buffer *trace_buffers = NULL;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+/** The timeline starts at the first event of the process. */
+static uint64_t trace_epoch_ns;
+
+static inline uint64_t
+trace_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+trace_dump_at_exit(void)
+{
+	const char *path = getenv("TRACE_FILE");
+	if (path == NULL)
+		path = "trace.json";
+	/* Empty means the user doesn't want the file. */
+	if (*path == 0)
+		return;
+	if (trace_dump_path(path) != 0)
+		fprintf(stderr, "trace: can't write %s: %s\n", path,
+			strerror(errno));
+}
+
+static void
+trace_init(void)
+{
+	trace_epoch_ns = trace_now_ns();
+	atexit(trace_dump_at_exit);
+}
+
+static struct trace_buffer *
+trace_buffer_new(void)
+{
+	pthread_once(&trace_once, trace_init);
+	struct trace_buffer *b = calloc(1, sizeof(*b));
+	if (b == NULL)
+		return NULL;
+	b->tid = syscall(SYS_gettid);
+	struct trace_buffer *head = __atomic_load_n(&trace_buffers,
+						    __ATOMIC_RELAXED);
+	do {
+		b->next = head;
+	} while (!__atomic_compare_exchange_n(&trace_buffers, &head, b, true,
+					      __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+	trace_current = b;
+	return b;
+}
+
+void
+trace_event(enum trace_phase phase, const char *name, uint64_t arg)
+{
+	struct trace_buffer *b = trace_current;
+	if (__builtin_expect(b == NULL, 0)) {
+		b = trace_buffer_new();
+		if (b == NULL)
+			return;
+	}
+	uint64_t pos = b->pos;
+	struct trace_record *r = &b->records[pos & (TRACE_BUFFER_SIZE - 1)];
+	r->ts_ns = trace_now_ns();
+	r->name = name;
+	r->arg = arg;
+	r->phase = phase;
+	__atomic_store_n(&b->pos, pos + 1, __ATOMIC_RELEASE);
+}
+
+void
+trace_thread_name(const char *name)
+{
+	struct trace_buffer *b = trace_current;
+	if (b == NULL && (b = trace_buffer_new()) == NULL)
+		return;
+	snprintf(b->name, sizeof(b->name), "%s", name);
+}
+
+/** Print a string as a JSON string, the names are short. */
+static void
+trace_print_str(FILE *out, const char *str)
+{
+	putc('"', out);
+	for (; *str != 0; ++str) {
+		unsigned char c = *str;
+		if (c == '"' || c == '\\')
+			fprintf(out, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(out, "\\u%04x", c);
+		else
+			putc(c, out);
+	}
+	putc('"', out);
+}
+
+/**
+ * Copy the events of the buffer which are certainly not overwritten.
+ * Returns how many were copied into @a dst.
+ */
+static uint64_t
+trace_buffer_copy(const struct trace_buffer *b, struct trace_record *dst)
+{
+	uint64_t end = __atomic_load_n(&b->pos, __ATOMIC_ACQUIRE);
+	uint64_t begin = __atomic_load_n(&b->reset_pos, __ATOMIC_RELAXED);
+	if (end - begin > TRACE_BUFFER_SIZE)
+		begin = end - TRACE_BUFFER_SIZE;
+	for (uint64_t i = begin; i < end; ++i)
+		dst[i - begin] = b->records[i & (TRACE_BUFFER_SIZE - 1)];
+	/*
+	 * The owner could write new events meanwhile. Those which were
+	 * overwritten during the copy are dropped, they could be torn.
+	 */
+	uint64_t new_end = __atomic_load_n(&b->pos, __ATOMIC_ACQUIRE);
+	uint64_t skip = 0;
+	if (new_end - begin > TRACE_BUFFER_SIZE)
+		skip = new_end - begin - TRACE_BUFFER_SIZE;
+	if (skip >= end - begin)
+		return 0;
+	memmove(dst, dst + skip, (end - begin - skip) * sizeof(*dst));
+	return end - begin - skip;
+}
+
+int
+trace_dump(FILE *out)
+{
+	struct trace_record *records = malloc(TRACE_BUFFER_SIZE *
+					      sizeof(*records));
+	if (records == NULL)
+		return -1;
+	pid_t pid = getpid();
+	const char *sep = "\n";
+	fprintf(out, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+	struct trace_buffer *b = __atomic_load_n(&trace_buffers,
+						 __ATOMIC_ACQUIRE);
+	for (; b != NULL; b = b->next) {
+		if (b->name[0] != 0) {
+			fprintf(out, "%s{\"name\": \"thread_name\", "
+				"\"ph\": \"M\", \"pid\": %d, \"tid\": %d, "
+				"\"args\": {\"name\": ", sep, (int)pid,
+				(int)b->tid);
+			trace_print_str(out, b->name);
+			fprintf(out, "}}");
+			sep = ",\n";
+		}
+		uint64_t count = trace_buffer_copy(b, records);
+		/* The ring could overwrite the beginnings of the slices. */
+		uint64_t depth = 0;
+		for (uint64_t i = 0; i < count; ++i) {
+			const struct trace_record *r = &records[i];
+			if (r->phase == TRACE_PHASE_BEGIN) {
+				++depth;
+			} else if (r->phase == TRACE_PHASE_END) {
+				if (depth == 0)
+					continue;
+				--depth;
+			}
+			uint64_t ts = r->ts_ns - trace_epoch_ns;
+			fprintf(out, "%s{\"name\": ", sep);
+			trace_print_str(out, r->name);
+			fprintf(out, ", \"ph\": \"%c\", \"ts\": %.3f, "
+				"\"pid\": %d, \"tid\": %d, ", (char)r->phase,
+				ts / 1000.0, (int)pid, (int)b->tid);
+			if (r->phase == TRACE_PHASE_INSTANT)
+				fprintf(out, "\"s\": \"t\", ");
+			fprintf(out, "\"args\": {\"arg\": %llu}}",
+				(unsigned long long)r->arg);
+			sep = ",\n";
+		}
+	}
+	fprintf(out, "\n]}\n");
+	free(records);
+	return ferror(out) ? -1 : 0;
+}
+
+int
+trace_dump_path(const char *path)
+{
+	FILE *out = fopen(path, "w");
+	if (out == NULL)
+		return -1;
+	int rc = trace_dump(out);
+	if (fclose(out) != 0)
+		rc = -1;
+	return rc;
+}
+
+void
+trace_reset(void)
+{
+	struct trace_buffer *b = __atomic_load_n(&trace_buffers,
+						 __ATOMIC_ACQUIRE);
+	for (; b != NULL; b = b->next) {
+		__atomic_store_n(&b->reset_pos,
+				 __atomic_load_n(&b->pos, __ATOMIC_ACQUIRE),
+				 __ATOMIC_RELAXED);
+	}
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+/**
+ * Timeline of events for chrome://tracing and Perfetto. Each thread
+ * writes its events into its own ring buffer, with no locks and no
+ * atomic read-modify-write, only a release store of the position.
+ * When the ring is full the oldest events are overwritten, so the
+ * trace has the last TRACE_BUFFER_SIZE events of each thread.
+ *
+ * The events are:
+ * - begin and end of a slice, nested on the same thread;
+ * - instant, a point on the timeline.
+ * Each one has a name, which must be a string literal or otherwise
+ * live until the dump, and a number shown in the event's args.
+ *
+ * The calls compile to nothing unless the code is built with
+ * -DTRACE=1, and then trace.c has to be linked. A traced program
+ * writes the trace at exit into the file of the TRACE_FILE
+ * environment variable, trace.json by default. It can be dumped
+ * explicitly with trace_dump() too.
+ *
+ *     trace_begin("render", frame);
+ *     ...
+ *     trace_end("render", frame);
+ */
+
+#ifndef TRACE
+#define TRACE 0
+#endif
+
+enum {
+	/** Events kept per thread, a power of 2. */
+	TRACE_BUFFER_SIZE = 1 << 15,
+	/** Max length of a thread name, with the terminating zero. */
+	TRACE_THREAD_NAME_SIZE = 32,
+};
+
+enum trace_phase {
+	TRACE_PHASE_BEGIN = 'B',
+	TRACE_PHASE_END = 'E',
+	TRACE_PHASE_INSTANT = 'i',
+};
+
+/** Add an event to the current thread's buffer. */
+void
+trace_event(enum trace_phase phase, const char *name, uint64_t arg);
+
+/** Name of the current thread in the trace. The name is copied. */
+void
+trace_thread_name(const char *name);
+
+/**
+ * Write the events of all the threads in the Chrome trace format.
+ * The threads still writing can lose the events being overwritten
+ * during the dump, the rest is consistent. Returns 0, or -1 with
+ * errno set.
+ */
+int
+trace_dump(FILE *out);
+
+/** Same as trace_dump() into a new file at @a path. */
+int
+trace_dump_path(const char *path);
+
+/** Drop the collected events of all the threads. */
+void
+trace_reset(void);
+
+#if TRACE
+
+#define trace_begin(name, arg) trace_event(TRACE_PHASE_BEGIN, name, arg)
+#define trace_end(name, arg) trace_event(TRACE_PHASE_END, name, arg)
+#define trace_instant(name, arg) trace_event(TRACE_PHASE_INSTANT, name, arg)
+#define trace_set_thread_name(name) trace_thread_name(name)
+
+#else /* !TRACE */
+
+#define trace_begin(name, arg) do { (void)(name); (void)(arg); } while (0)
+#define trace_end(name, arg) do { (void)(name); (void)(arg); } while (0)
+#define trace_instant(name, arg) do { (void)(name); (void)(arg); } while (0)
+#define trace_set_thread_name(name) do { (void)(name); } while (0)
+
+#endif /* !TRACE */
+
+#if defined(__cplusplus)
+} /* extern "C" */
+#endif /* defined(__cplusplus) */
@@ -0,0 +1,80 @@
+#define TRACE 1
+#include "trace.h"
+#include "unit_bench.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * Cost of the trace events. An iteration of the event benches is one
+ * event, with the argument threads writing them at once. The dump
+ * bench writes one full buffer, an iteration is an event of it.
+ */
+
+enum {
+	BENCH_OP_COUNT = 4 * 1000 * 1000,
+	BENCH_MAX_THREADS = 8,
+};
+
+struct bench_ctx {
+	long iterations;
+};
+
+static void *
+bench_thread_f(void *arg)
+{
+	struct bench_ctx *ctx = arg;
+	for (long i = 0; i < ctx->iterations; i += 2) {
+		trace_begin("slice", i);
+		trace_end("slice", i);
+	}
+	return NULL;
+}
+
+static void
+bench_event(long iterations, long thread_count)
+{
+	if (thread_count == 1) {
+		struct bench_ctx ctx = {iterations};
+		bench_thread_f(&ctx);
+		return;
+	}
+	pthread_t threads[BENCH_MAX_THREADS];
+	struct bench_ctx ctx = {iterations / thread_count};
+	for (long i = 0; i < thread_count; ++i)
+		pthread_create(&threads[i], NULL, bench_thread_f, &ctx);
+	for (long i = 0; i < thread_count; ++i)
+		pthread_join(threads[i], NULL);
+}
+
+static void
+bench_dump(long iterations, long arg)
+{
+	(void)arg;
+	FILE *out = fopen("/dev/null", "w");
+	if (out == NULL)
+		abort();
+	for (long i = 0; i < iterations; i += TRACE_BUFFER_SIZE) {
+		bench_pause();
+		trace_reset();
+		for (long j = 0; j < TRACE_BUFFER_SIZE; ++j)
+			trace_instant("instant", j);
+		bench_resume();
+		trace_dump(out);
+	}
+	fclose(out);
+}
+
+int
+main(int argc, char **argv)
+{
+	/* Thousands of buffers of the threads are not for a file. */
+	setenv("TRACE_FILE", "", 1);
+	for (long threads = 1; threads <= BENCH_MAX_THREADS; threads *= 2) {
+		bench_register_arg("event", bench_event, BENCH_OP_COUNT,
+				   threads);
+	}
+	bench_register("dump", bench_dump, 10 * TRACE_BUFFER_SIZE);
+	return bench_main(argc, argv);
+}
@@ -1,6 +1,14 @@
 #include "unit.h"
 
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 
 bool
 doCmdMaxPoints(int argc, char **argv)
@@ -14,3 +22,373 @@ doCmdMaxPoints(int argc, char **argv)
 	}
 	return false;
 }
+
+enum {
+	/** Slack of the baseline comparison, for the noise of short tests. */
+	UNIT_SLOW_SLACK_MS = 20,
+};
+
+struct unit_test {
+	const char *name;
+	unit_test_f f;
+	/** Times of the last run. */
+	double wall_ms;
+	double cpu_ms;
+	/** Exit status of the forked run. */
+	int status;
+	bool is_done;
+	/** Collected output of the forked run. */
+	char *out;
+	size_t out_size;
+	size_t out_capacity;
+	/** Times saved in the baseline, < 0 when it is not there. */
+	double base_wall_ms;
+	double base_cpu_ms;
+};
+
+struct unit_options {
+	int job_count;
+	const char *filter;
+	const char *baseline;
+	const char *save_baseline;
+	double tolerance;
+	bool is_strict;
+};
+
+static struct unit_test *tests = NULL;
+static int test_count = 0;
+static int test_capacity = 0;
+
+void
+unit_register(const char *name, unit_test_f f)
+{
+	if (test_count == test_capacity) {
+		test_capacity = test_capacity == 0 ? 16 : test_capacity * 2;
+		tests = realloc(tests, sizeof(tests[0]) * test_capacity);
+	}
+	struct unit_test *t = &tests[test_count++];
+	memset(t, 0, sizeof(*t));
+	t->name = name;
+	t->f = f;
+	t->base_wall_ms = -1;
+	t->base_cpu_ms = -1;
+}
+
+static double
+unit_clock_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static double
+unit_rusage_ms(const struct rusage *ru)
+{
+	return (ru->ru_utime.tv_sec + ru->ru_stime.tv_sec) * 1000.0 +
+		(ru->ru_utime.tv_usec + ru->ru_stime.tv_usec) / 1000.0;
+}
+
+static bool
+unit_parse_options(int argc, char **argv, struct unit_options *opts)
+{
+	opts->job_count = 0;
+	opts->filter = NULL;
+	opts->baseline = NULL;
+	opts->save_baseline = NULL;
+	opts->tolerance = 1.5;
+	opts->is_strict = false;
+	for (int i = 1; i < argc; ++i) {
+		const char *arg = argv[i];
+		const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+		if (strcmp(arg, "--strict") == 0) {
+			opts->is_strict = true;
+			continue;
+		}
+		if (value == NULL)
+			return false;
+		++i;
+		if (strcmp(arg, "--jobs") == 0)
+			opts->job_count = atoi(value);
+		else if (strcmp(arg, "--filter") == 0)
+			opts->filter = value;
+		else if (strcmp(arg, "--baseline") == 0)
+			opts->baseline = value;
+		else if (strcmp(arg, "--save-baseline") == 0)
+			opts->save_baseline = value;
+		else if (strcmp(arg, "--tolerance") == 0)
+			opts->tolerance = atof(value);
+		else
+			return false;
+	}
+	return opts->job_count >= 0 && opts->tolerance > 0;
+}
+
+/** Read the baseline times of the registered tests, if any. */
+static void
+unit_load_baseline(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		printf("# no baseline %s\n", path);
+		return;
+	}
+	char name[256];
+	double wall_ms, cpu_ms;
+	while (fscanf(f, "%255s %lf %lf", name, &wall_ms, &cpu_ms) == 3) {
+		for (int i = 0; i < test_count; ++i) {
+			if (strcmp(tests[i].name, name) == 0) {
+				tests[i].base_wall_ms = wall_ms;
+				tests[i].base_cpu_ms = cpu_ms;
+			}
+		}
+	}
+	fclose(f);
+}
+
+static bool
+unit_is_selected(const struct unit_test *t, const struct unit_options *opts)
+{
+	return opts->filter == NULL || strstr(t->name, opts->filter) != NULL;
+}
+
+/**
+ * Print the times of a finished test and compare them with the
+ * baseline. Returns true if it is slower.
+ */
+static bool
+unit_report(const struct unit_test *t, const struct unit_options *opts)
+{
+	printf("# time %s: wall %.1f ms, cpu %.1f ms\n", t->name, t->wall_ms,
+	       t->cpu_ms);
+	if (t->base_wall_ms < 0)
+		return false;
+	bool is_slower = false;
+	if (t->wall_ms > t->base_wall_ms * opts->tolerance +
+	    UNIT_SLOW_SLACK_MS) {
+		printf("# slower %s: wall %.1f ms, baseline %.1f ms\n",
+		       t->name, t->wall_ms, t->base_wall_ms);
+		is_slower = true;
+	}
+	if (t->cpu_ms > t->base_cpu_ms * opts->tolerance +
+	    UNIT_SLOW_SLACK_MS) {
+		printf("# slower %s: cpu %.1f ms, baseline %.1f ms\n",
+		       t->name, t->cpu_ms, t->base_cpu_ms);
+		is_slower = true;
+	}
+	return is_slower;
+}
+
+static void
+unit_run_here(struct unit_test *t)
+{
+	struct rusage ru_start, ru_end;
+	getrusage(RUSAGE_SELF, &ru_start);
+	double start = unit_clock_ms();
+	t->f();
+	t->wall_ms = unit_clock_ms() - start;
+	getrusage(RUSAGE_SELF, &ru_end);
+	t->cpu_ms = unit_rusage_ms(&ru_end) - unit_rusage_ms(&ru_start);
+	t->is_done = true;
+}
+
+/** A forked test which is running. */
+struct unit_job {
+	struct unit_test *test;
+	pid_t pid;
+	/** Read end of the output of the test. */
+	int fd;
+	double start_ms;
+};
+
+static bool
+unit_job_start(struct unit_job *job, struct unit_test *t)
+{
+	int fds[2];
+	if (pipe(fds) != 0)
+		return false;
+	/* Or the buffered output is printed by each child too. */
+	fflush(stdout);
+	fflush(stderr);
+	job->start_ms = unit_clock_ms();
+	pid_t pid = fork();
+	if (pid < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return false;
+	}
+	if (pid == 0) {
+		close(fds[0]);
+		dup2(fds[1], STDOUT_FILENO);
+		dup2(fds[1], STDERR_FILENO);
+		close(fds[1]);
+		t->f();
+		exit(0);
+	}
+	close(fds[1]);
+	job->test = t;
+	job->pid = pid;
+	job->fd = fds[0];
+	return true;
+}
+
+/** Read the output of the job. Returns false on its end. */
+static bool
+unit_job_read(struct unit_job *job)
+{
+	struct unit_test *t = job->test;
+	if (t->out_capacity - t->out_size < 4096) {
+		t->out_capacity = t->out_capacity == 0 ? 8192 :
+				  t->out_capacity * 2;
+		t->out = realloc(t->out, t->out_capacity);
+	}
+	ssize_t rc = read(job->fd, t->out + t->out_size,
+			  t->out_capacity - t->out_size);
+	if (rc < 0 && errno == EINTR)
+		return true;
+	if (rc > 0) {
+		t->out_size += rc;
+		return true;
+	}
+	close(job->fd);
+	struct rusage ru;
+	while (wait4(job->pid, &t->status, 0, &ru) < 0 && errno == EINTR)
+		;
+	t->wall_ms = unit_clock_ms() - job->start_ms;
+	t->cpu_ms = unit_rusage_ms(&ru);
+	t->is_done = true;
+	return false;
+}
+
+/**
+ * Run the selected tests in child processes, @a job_count at once.
+ * Returns the number of the failed ones.
+ */
+static int
+unit_run_forked(const struct unit_options *opts, int *slow_count)
+{
+	size_t max_job_count = opts->job_count;
+	struct unit_job *jobs = malloc(sizeof(jobs[0]) * max_job_count);
+	struct pollfd *fds = malloc(sizeof(fds[0]) * max_job_count);
+	size_t job_count = 0;
+	int next_start = 0;
+	int next_print = 0;
+	int fail_count = 0;
+	while (next_print < test_count) {
+		while (job_count < max_job_count && next_start < test_count) {
+			struct unit_test *t = &tests[next_start++];
+			if (!unit_is_selected(t, opts)) {
+				t->is_done = true;
+				continue;
+			}
+			if (!unit_job_start(&jobs[job_count], t)) {
+				printf("# can't start %s\n", t->name);
+				t->status = -1;
+				t->is_done = true;
+				continue;
+			}
+			++job_count;
+		}
+		/* The finished ones are printed in the registration order. */
+		while (next_print < test_count && tests[next_print].is_done) {
+			struct unit_test *t = &tests[next_print++];
+			if (!unit_is_selected(t, opts))
+				continue;
+			fwrite(t->out, 1, t->out_size, stdout);
+			if (t->status != 0) {
+				if (t->status > 0 && WIFSIGNALED(t->status))
+					printf("# %s failed, signal %d\n",
+					       t->name, WTERMSIG(t->status));
+				else
+					printf("# %s failed\n", t->name);
+				++fail_count;
+			} else if (unit_report(t, opts)) {
+				++*slow_count;
+			}
+			fflush(stdout);
+		}
+		if (job_count == 0)
+			continue;
+		for (size_t i = 0; i < job_count; ++i) {
+			fds[i].fd = jobs[i].fd;
+			fds[i].events = POLLIN;
+		}
+		if (poll(fds, job_count, -1) < 0)
+			continue;
+		for (size_t i = job_count; i-- > 0;) {
+			if (fds[i].revents == 0 || unit_job_read(&jobs[i]))
+				continue;
+			jobs[i] = jobs[--job_count];
+		}
+	}
+	free(fds);
+	free(jobs);
+	return fail_count;
+}
+
+/** Save the times of the run, the tests not run keep the old ones. */
+static void
+unit_save_baseline(const char *path, const struct unit_options *opts)
+{
+	FILE *f = fopen(path, "w");
+	if (f == NULL) {
+		printf("# can't save the baseline %s\n", path);
+		return;
+	}
+	for (int i = 0; i < test_count; ++i) {
+		const struct unit_test *t = &tests[i];
+		double wall_ms = t->wall_ms;
+		double cpu_ms = t->cpu_ms;
+		if (!unit_is_selected(t, opts) || t->status != 0) {
+			if (t->base_wall_ms < 0)
+				continue;
+			wall_ms = t->base_wall_ms;
+			cpu_ms = t->base_cpu_ms;
+		}
+		fprintf(f, "%s %.1f %.1f\n", t->name, wall_ms, cpu_ms);
+	}
+	fclose(f);
+}
+
+int
+unit_run(int argc, char **argv)
+{
+	struct unit_options opts;
+	if (!unit_parse_options(argc, argv, &opts)) {
+		printf("Usage: %s [--jobs N] [--filter STR] [--baseline FILE] "
+		       "[--save-baseline FILE] [--tolerance X] [--strict]\n",
+		       argv[0]);
+		return -1;
+	}
+	if (opts.baseline != NULL)
+		unit_load_baseline(opts.baseline);
+	else if (opts.save_baseline != NULL)
+		unit_load_baseline(opts.save_baseline);
+	int fail_count = 0;
+	int slow_count = 0;
+	double start = unit_clock_ms();
+	if (opts.job_count > 0) {
+		fail_count = unit_run_forked(&opts, &slow_count);
+	} else {
+		for (int i = 0; i < test_count; ++i) {
+			struct unit_test *t = &tests[i];
+			if (!unit_is_selected(t, &opts))
+				continue;
+			unit_run_here(t);
+			if (unit_report(t, &opts))
+				++slow_count;
+		}
+	}
+	printf("# total: wall %.1f ms, %d failed, %d slower\n",
+	       unit_clock_ms() - start, fail_count, slow_count);
+	if (opts.save_baseline != NULL)
+		unit_save_baseline(opts.save_baseline, &opts);
+	for (int i = 0; i < test_count; ++i)
+		free(tests[i].out);
+	free(tests);
+	tests = NULL;
+	test_count = test_capacity = 0;
+	if (fail_count > 0 || (opts.is_strict && slow_count > 0))
+		return -1;
+	return 0;
+}
@@ -35,3 +35,47 @@
 } while(0)
 
 bool doCmdMaxPoints(int argc, char **argv);
+
+/**
+ * Test runner. The tests are registered with unit_add(), then
+ * unit_run() runs them and prints the wall and the CPU time of each
+ * after its output, like
+ *
+ *     # time test_push: wall 12.3 ms, cpu 10.1 ms
+ *
+ * By default each test runs in this process, one by one, in the
+ * order of the registration, same as when called directly. The
+ * options of unit_run():
+ * --jobs N - run each test in a forked process, N at once. A test
+ *     sees the state of the process at unit_run(), and what it
+ *     changes is not seen by the others. The output of each test is
+ *     collected and printed in the order of the registration. A
+ *     failed test doesn't stop the others, the run fails in the end;
+ * --filter STR - run only the tests with STR in the name;
+ * --baseline FILE - compare the times with the ones saved in FILE.
+ *     A test taking more than `tolerance * baseline + 20 ms` of the
+ *     wall or of the CPU time is reported as slower. The run doesn't
+ *     fail because of it, unless with --strict. The same --jobs as
+ *     for the saved one gives comparable walls;
+ * --save-baseline FILE - save the times of the run, a line per test
+ *     with its name, wall and CPU milliseconds;
+ * --tolerance X - 1.5 by default;
+ * --strict - fail the run when a test is slower than the baseline.
+ */
+
+typedef void (*unit_test_f)(void);
+
+/** Add a test. The name is not copied. */
+void
+unit_register(const char *name, unit_test_f f);
+
+/** Add a test named after its function. */
+#define unit_add(f) unit_register(#f, f)
+
+/**
+ * Run the registered tests, see the options above. Returns 0 when
+ * all passed, -1 otherwise. A failed test in this process exits
+ * right away like before.
+ */
+int
+unit_run(int argc, char **argv);
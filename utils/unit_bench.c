@@ -0,0 +1,478 @@
+#define _GNU_SOURCE
+#include "unit_bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#define BENCH_HAS_PERF 1
+#else
+#define BENCH_HAS_PERF 0
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BENCH_HAS_RDTSC 1
+#else
+#define BENCH_HAS_RDTSC 0
+#endif
+
+enum {
+	BENCH_DEFAULT_RUN_COUNT = 7,
+	BENCH_DEFAULT_WARMUP_COUNT = 1,
+};
+
+enum bench_counter {
+	BENCH_COUNTER_CYCLES,
+	BENCH_COUNTER_INSTRUCTIONS,
+	BENCH_COUNTER_CACHE_MISSES,
+	BENCH_COUNTER_DTLB_MISSES,
+	BENCH_COUNTER_PAGE_FAULTS,
+	BENCH_COUNTER_COUNT,
+};
+
+static const char *bench_counter_names[BENCH_COUNTER_COUNT] = {
+	"cycles", "instructions", "cache_misses", "dtlb_misses", "page_faults",
+};
+
+struct bench {
+	const char *name;
+	bench_f f;
+	long iterations;
+	long arg;
+	bool has_arg;
+};
+
+/** Whatever is measured in a run, in absolute numbers. */
+struct bench_sample {
+	uint64_t ns;
+	uint64_t tsc;
+	uint64_t counters[BENCH_COUNTER_COUNT];
+};
+
+struct bench_result {
+	const struct bench *bench;
+	double min;
+	double med;
+	double max;
+	/** Medians per iteration. */
+	double tsc;
+	double counters[BENCH_COUNTER_COUNT];
+};
+
+struct bench_info {
+	char *key;
+	char *value;
+};
+
+static struct bench_info *infos = NULL;
+static int info_count = 0;
+
+static struct bench *benches = NULL;
+static int bench_count = 0;
+static int bench_capacity = 0;
+
+static int bench_run_count = BENCH_DEFAULT_RUN_COUNT;
+static int bench_warmup_count = BENCH_DEFAULT_WARMUP_COUNT;
+static bool bench_use_rdtsc = false;
+static bool bench_use_perf = false;
+/** Group leader of the perf counters, or -1. */
+static int bench_perf_fd = -1;
+/** The counters which could be opened, the rest are not printed. */
+static int bench_perf_fds[BENCH_COUNTER_COUNT];
+static bool bench_counter_is_open[BENCH_COUNTER_COUNT];
+
+/** Measured so far in the current run, and when it was resumed. */
+static struct bench_sample bench_total;
+static struct bench_sample bench_start;
+static bool bench_is_paused = true;
+
+static uint64_t
+bench_clock_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t
+bench_rdtsc(void)
+{
+#if BENCH_HAS_RDTSC
+	return __builtin_ia32_rdtsc();
+#else
+	return 0;
+#endif
+}
+
+#if BENCH_HAS_PERF
+
+static int
+bench_perf_open(uint32_t type, uint64_t config, int group_fd)
+{
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.read_format = PERF_FORMAT_GROUP;
+	/* Allowed to the users more often than the kernel counting. */
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.disabled = group_fd < 0;
+	return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+/**
+ * Open the counters which are there. The hardware ones are missing in
+ * many VMs, and the cache ones on some CPUs, so each one is optional.
+ * The first opened one leads the group. False if none is opened.
+ */
+static bool
+bench_perf_create(void)
+{
+	static const struct {
+		uint32_t type;
+		uint64_t config;
+	} events[BENCH_COUNTER_COUNT] = {
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+		{PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+			(PERF_COUNT_HW_CACHE_OP_READ << 8) |
+			(PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+		{PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+	};
+	for (int i = 0; i < BENCH_COUNTER_COUNT; ++i) {
+		bench_perf_fds[i] = bench_perf_open(events[i].type,
+						    events[i].config,
+						    bench_perf_fd);
+		bench_counter_is_open[i] = bench_perf_fds[i] >= 0;
+		if (!bench_counter_is_open[i]) {
+			fprintf(stderr, "bench: no perf counter %s\n",
+				bench_counter_names[i]);
+		} else if (bench_perf_fd < 0) {
+			bench_perf_fd = bench_perf_fds[i];
+		}
+	}
+	if (bench_perf_fd < 0)
+		return false;
+	ioctl(bench_perf_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	ioctl(bench_perf_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	return true;
+}
+
+/** The values of the group are in the order of the opened counters. */
+static void
+bench_perf_read(uint64_t *counters)
+{
+	uint64_t buf[1 + BENCH_COUNTER_COUNT];
+	memset(counters, 0, sizeof(buf) - sizeof(buf[0]));
+	if (read(bench_perf_fd, buf, sizeof(buf)) < (ssize_t)sizeof(buf[0]))
+		return;
+	uint64_t next = 0;
+	for (int i = 0; i < BENCH_COUNTER_COUNT && next < buf[0]; ++i) {
+		if (bench_counter_is_open[i])
+			counters[i] = buf[1 + next++];
+	}
+}
+
+#else /* !BENCH_HAS_PERF */
+
+static bool
+bench_perf_create(void)
+{
+	return false;
+}
+
+static void
+bench_perf_read(uint64_t *counters)
+{
+	memset(counters, 0, sizeof(uint64_t) * BENCH_COUNTER_COUNT);
+}
+
+#endif /* !BENCH_HAS_PERF */
+
+static void
+bench_sample_now(struct bench_sample *s)
+{
+	/* The counters first, the time last, the same order on pause. */
+	if (bench_use_perf)
+		bench_perf_read(s->counters);
+	s->tsc = bench_use_rdtsc ? bench_rdtsc() : 0;
+	s->ns = bench_clock_ns();
+}
+
+void
+bench_pause(void)
+{
+	if (bench_is_paused)
+		return;
+	struct bench_sample now;
+	bench_sample_now(&now);
+	bench_total.ns += now.ns - bench_start.ns;
+	bench_total.tsc += now.tsc - bench_start.tsc;
+	for (int i = 0; i < BENCH_COUNTER_COUNT; ++i)
+		bench_total.counters[i] += now.counters[i] -
+			bench_start.counters[i];
+	bench_is_paused = true;
+}
+
+void
+bench_resume(void)
+{
+	if (!bench_is_paused)
+		return;
+	bench_is_paused = false;
+	bench_sample_now(&bench_start);
+}
+
+static void
+bench_add(const char *name, bench_f f, long iterations, long arg,
+	  bool has_arg)
+{
+	if (bench_count == bench_capacity) {
+		bench_capacity = bench_capacity == 0 ? 16 : bench_capacity * 2;
+		benches = realloc(benches, sizeof(benches[0]) * bench_capacity);
+	}
+	struct bench *b = &benches[bench_count++];
+	b->name = name;
+	b->f = f;
+	b->iterations = iterations > 0 ? iterations : 1;
+	b->arg = arg;
+	b->has_arg = has_arg;
+}
+
+void
+bench_register(const char *name, bench_f f, long iterations)
+{
+	bench_add(name, f, iterations, 0, false);
+}
+
+void
+bench_register_arg(const char *name, bench_f f, long iterations, long arg)
+{
+	bench_add(name, f, iterations, arg, true);
+}
+
+void
+bench_info(const char *key, const char *value)
+{
+	for (int i = 0; i < info_count; ++i) {
+		if (strcmp(infos[i].key, key) != 0)
+			continue;
+		free(infos[i].value);
+		infos[i].value = strdup(value);
+		return;
+	}
+	infos = realloc(infos, sizeof(infos[0]) * (info_count + 1));
+	infos[info_count].key = strdup(key);
+	infos[info_count].value = strdup(value);
+	++info_count;
+}
+
+static int
+bench_cmp_double(const void *a, const void *b)
+{
+	double l = *(const double *)a;
+	double r = *(const double *)b;
+	return l < r ? -1 : l > r;
+}
+
+static double
+bench_median(double *values, int count)
+{
+	qsort(values, count, sizeof(values[0]), bench_cmp_double);
+	return values[count / 2];
+}
+
+static void
+bench_run(const struct bench *b, struct bench_result *res)
+{
+	/* Measured too, so the pauses inside work the same way. */
+	for (int i = 0; i < bench_warmup_count; ++i) {
+		bench_resume();
+		b->f(b->iterations, b->arg);
+		bench_pause();
+	}
+	double times[bench_run_count];
+	double tsc[bench_run_count];
+	double counters[BENCH_COUNTER_COUNT][bench_run_count];
+	for (int i = 0; i < bench_run_count; ++i) {
+		memset(&bench_total, 0, sizeof(bench_total));
+		bench_resume();
+		b->f(b->iterations, b->arg);
+		bench_pause();
+		double n = b->iterations;
+		times[i] = bench_total.ns / n;
+		tsc[i] = bench_total.tsc / n;
+		for (int j = 0; j < BENCH_COUNTER_COUNT; ++j)
+			counters[j][i] = bench_total.counters[j] / n;
+	}
+	res->bench = b;
+	res->med = bench_median(times, bench_run_count);
+	res->min = times[0];
+	res->max = times[bench_run_count - 1];
+	res->tsc = bench_median(tsc, bench_run_count);
+	for (int j = 0; j < BENCH_COUNTER_COUNT; ++j)
+		res->counters[j] = bench_median(counters[j], bench_run_count);
+}
+
+static void
+bench_print_json(const struct bench_result *results, int count)
+{
+	printf("{\n\t\"unit\": \"ns/op\",\n\t\"run_count\": %d,\n",
+	       bench_run_count);
+	if (info_count > 0) {
+		printf("\t\"info\": {\n");
+		for (int i = 0; i < info_count; ++i) {
+			printf("\t\t\"%s\": \"%s\"%s\n", infos[i].key,
+			       infos[i].value, i + 1 < info_count ? "," : "");
+		}
+		printf("\t},\n");
+	}
+	printf("\t\"benches\": [\n");
+	for (int i = 0; i < count; ++i) {
+		const struct bench_result *r = &results[i];
+		printf("\t\t{\"name\": \"%s\", ", r->bench->name);
+		if (r->bench->has_arg)
+			printf("\"arg\": %ld, ", r->bench->arg);
+		printf("\"min\": %.2f, \"med\": %.2f, \"max\": %.2f", r->min,
+		       r->med, r->max);
+		if (bench_use_rdtsc)
+			printf(", \"tsc\": %.2f", r->tsc);
+		for (int j = 0; j < BENCH_COUNTER_COUNT && bench_use_perf; ++j) {
+			if (!bench_counter_is_open[j])
+				continue;
+			printf(", \"%s\": %.2f", bench_counter_names[j],
+			       r->counters[j]);
+		}
+		printf("}%s\n", i + 1 < count ? "," : "");
+	}
+	printf("\t]\n}\n");
+}
+
+static void
+bench_print_tsv(const struct bench_result *results, int count)
+{
+	for (int i = 0; i < info_count; ++i)
+		printf("# %s\t%s\n", infos[i].key, infos[i].value);
+	printf("name\targ\tmin\tmed\tmax");
+	if (bench_use_rdtsc)
+		printf("\ttsc");
+	for (int j = 0; j < BENCH_COUNTER_COUNT && bench_use_perf; ++j) {
+		if (bench_counter_is_open[j])
+			printf("\t%s", bench_counter_names[j]);
+	}
+	printf("\n");
+	for (int i = 0; i < count; ++i) {
+		const struct bench_result *r = &results[i];
+		printf("%s\t", r->bench->name);
+		if (r->bench->has_arg)
+			printf("%ld", r->bench->arg);
+		printf("\t%.2f\t%.2f\t%.2f", r->min, r->med, r->max);
+		if (bench_use_rdtsc)
+			printf("\t%.2f", r->tsc);
+		for (int j = 0; j < BENCH_COUNTER_COUNT && bench_use_perf; ++j) {
+			if (bench_counter_is_open[j])
+				printf("\t%.2f", r->counters[j]);
+		}
+		printf("\n");
+	}
+}
+
+static bool
+bench_pin(int cpu)
+{
+#if defined(__linux__)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+	(void)cpu;
+	return false;
+#endif
+}
+
+int
+bench_main(int argc, char **argv)
+{
+	bool is_tsv = false;
+	const char *filter = NULL;
+	for (int i = 1; i < argc; ++i) {
+		const char *opt = argv[i];
+		const char *val = i + 1 < argc ? argv[i + 1] : NULL;
+		if (strcmp(opt, "--tsv") == 0) {
+			is_tsv = true;
+		} else if (strcmp(opt, "--rdtsc") == 0) {
+			bench_use_rdtsc = true;
+		} else if (strcmp(opt, "--perf") == 0) {
+			bench_use_perf = true;
+		} else if (val == NULL) {
+			fprintf(stderr, "bench: unknown option %s\n", opt);
+			return -1;
+		} else if (strcmp(opt, "--runs") == 0) {
+			bench_run_count = atoi(val), ++i;
+		} else if (strcmp(opt, "--warmup") == 0) {
+			bench_warmup_count = atoi(val), ++i;
+		} else if (strcmp(opt, "--filter") == 0) {
+			filter = val, ++i;
+		} else if (strcmp(opt, "--cpu") == 0) {
+			if (!bench_pin(atoi(val)))
+				fprintf(stderr, "bench: couldn't pin to CPU %s\n",
+					val);
+			++i;
+		} else {
+			fprintf(stderr, "bench: unknown option %s\n", opt);
+			return -1;
+		}
+	}
+	if (bench_run_count < 1)
+		bench_run_count = 1;
+	if (bench_use_rdtsc && !BENCH_HAS_RDTSC) {
+		fprintf(stderr, "bench: no rdtsc on this platform\n");
+		bench_use_rdtsc = false;
+	}
+	if (bench_use_perf && !bench_perf_create()) {
+		fprintf(stderr, "bench: perf_event is not available\n");
+		bench_use_perf = false;
+	}
+	struct bench_result *results = malloc(sizeof(results[0]) *
+		(bench_count > 0 ? bench_count : 1));
+	int result_count = 0;
+	for (int i = 0; i < bench_count; ++i) {
+		if (filter != NULL && strstr(benches[i].name, filter) == NULL)
+			continue;
+		bench_run(&benches[i], &results[result_count++]);
+	}
+	if (is_tsv)
+		bench_print_tsv(results, result_count);
+	else
+		bench_print_json(results, result_count);
+	free(results);
+	free(benches);
+	benches = NULL;
+	for (int i = 0; i < info_count; ++i) {
+		free(infos[i].key);
+		free(infos[i].value);
+	}
+	free(infos);
+	infos = NULL;
+	info_count = 0;
+	bench_count = 0;
+	bench_capacity = 0;
+	for (int i = 0; i < BENCH_COUNTER_COUNT && bench_perf_fd >= 0; ++i) {
+		if (bench_counter_is_open[i])
+			close(bench_perf_fds[i]);
+		bench_counter_is_open[i] = false;
+	}
+	bench_perf_fd = -1;
+	return 0;
+}
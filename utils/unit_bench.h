@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+/**
+ * Benchmark harness with the methodology of the bonus tasks. Each
+ * registered bench is run a few times untimed to warm up, then
+ * several timed runs follow. The time of a run is taken with
+ * CLOCK_MONOTONIC and is divided by the iteration count. The min,
+ * median and max of the runs are reported.
+ *
+ * Optionally the runs also count the CPU cycles with rdtsc, and the
+ * cycles, instructions, cache misses, dTLB load misses and page
+ * faults with perf_event. The process can be pinned to a CPU for less
+ * noise.
+ *
+ * A bench function does the tested operation @a iterations times.
+ * The setup which shouldn't be measured can be put between
+ * bench_pause() and bench_resume().
+ *
+ *     static void
+ *     bench_clock(long iterations, long arg)
+ *     {
+ *             struct timespec ts;
+ *             for (long i = 0; i < iterations; ++i)
+ *                     clock_gettime(arg, &ts);
+ *     }
+ *
+ *     int
+ *     main(int argc, char **argv)
+ *     {
+ *             bench_register_arg("monotonic", bench_clock, 1000000,
+ *                                CLOCK_MONOTONIC);
+ *             return bench_main(argc, argv);
+ *     }
+ *
+ * The options of bench_main():
+ * --runs N - timed runs of each bench, 7 by default;
+ * --warmup N - untimed runs before them, 1 by default;
+ * --cpu N - pin the process to the CPU;
+ * --rdtsc - count the cycles with rdtsc, on x86 only;
+ * --perf - count with perf_event, on Linux only, the counters which
+ *   are allowed and are there, often no hardware ones in a VM;
+ * --tsv - print tab separated values instead of JSON;
+ * --filter STR - run only the benches with STR in the name.
+ */
+
+typedef void (*bench_f)(long iterations, long arg);
+
+/** Add a bench. The name is not copied. */
+void
+bench_register(const char *name, bench_f f, long iterations);
+
+/**
+ * Add a bench with an argument passed to the function. Like a size
+ * or a mode. It is reported next to the name.
+ */
+void
+bench_register_arg(const char *name, bench_f f, long iterations, long arg);
+
+/**
+ * Add a key-value pair to the report, like the host or the kernel
+ * version, so the reports of different machines can be told apart.
+ * Can be called from the benches too. A key set again gets the new
+ * value. The strings are copied.
+ */
+void
+bench_info(const char *key, const char *value);
+
+/** Stop the time and the counters of the current run. */
+void
+bench_pause(void);
+
+/** Continue the time and the counters of the current run. */
+void
+bench_resume(void);
+
+/** Run the registered benches and print the results. */
+int
+bench_main(int argc, char **argv);
+
+#if defined(__cplusplus)
+} /* extern "C" */
+#endif /* defined(__cplusplus) */
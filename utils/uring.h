@@ -0,0 +1,198 @@
+#pragma once
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+/**
+ * The smallest io_uring wrapper over the raw syscalls, for when
+ * liburing is not installed. Only what the benches and the reactors
+ * need: get a submission entry, fill it, submit with an optional
+ * wait, then walk the completions.
+ *
+ *     struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+ *     uring_prep_rw(sqe, IORING_OP_SEND, fd, buf, size, 0);
+ *     sqe->user_data = 1;
+ *     uring_submit_and_wait(&ring, 1);
+ *     struct io_uring_cqe *cqe;
+ *     while ((cqe = uring_peek_cqe(&ring)) != NULL) {
+ *             ... cqe->res, cqe->user_data ...
+ *             uring_cqe_seen(&ring);
+ *     }
+ *
+ * The ring is for one thread.
+ */
+
+struct uring {
+	int fd;
+	/** Submission queue. */
+	uint32_t *sq_head;
+	uint32_t *sq_tail;
+	uint32_t sq_mask;
+	uint32_t *sq_array;
+	struct io_uring_sqe *sqes;
+	/** Entries filled but not yet given to the kernel. */
+	uint32_t sq_pending;
+	/** Completion queue. */
+	uint32_t *cq_head;
+	uint32_t *cq_tail;
+	uint32_t cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_map;
+	size_t sq_map_size;
+	void *cq_map;
+	size_t cq_map_size;
+	size_t sqes_size;
+};
+
+/** Returns 0 on success, or -1 with errno set. */
+static inline int
+uring_create(struct uring *r, uint32_t entries)
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	memset(r, 0, sizeof(*r));
+	r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd < 0)
+		return -1;
+	r->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+	r->cq_map_size = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	bool is_single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (is_single && r->cq_map_size > r->sq_map_size)
+		r->sq_map_size = r->cq_map_size;
+	r->sq_map = mmap(NULL, r->sq_map_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_map == MAP_FAILED)
+		goto error_close;
+	if (is_single) {
+		r->cq_map = r->sq_map;
+	} else {
+		r->cq_map = mmap(NULL, r->cq_map_size, PROT_READ | PROT_WRITE,
+				 MAP_SHARED | MAP_POPULATE, r->fd,
+				 IORING_OFF_CQ_RING);
+		if (r->cq_map == MAP_FAILED)
+			goto error_unmap_sq;
+	}
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = (struct io_uring_sqe *)mmap(NULL, r->sqes_size,
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+		IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		goto error_unmap_cq;
+	char *sq = (char *)r->sq_map;
+	r->sq_head = (uint32_t *)(sq + p.sq_off.head);
+	r->sq_tail = (uint32_t *)(sq + p.sq_off.tail);
+	r->sq_mask = *(uint32_t *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (uint32_t *)(sq + p.sq_off.array);
+	char *cq = (char *)r->cq_map;
+	r->cq_head = (uint32_t *)(cq + p.cq_off.head);
+	r->cq_tail = (uint32_t *)(cq + p.cq_off.tail);
+	r->cq_mask = *(uint32_t *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return 0;
+
+error_unmap_cq:
+	if (r->cq_map != r->sq_map)
+		munmap(r->cq_map, r->cq_map_size);
+error_unmap_sq:
+	munmap(r->sq_map, r->sq_map_size);
+error_close:
+	close(r->fd);
+	r->fd = -1;
+	return -1;
+}
+
+static inline void
+uring_destroy(struct uring *r)
+{
+	munmap(r->sqes, r->sqes_size);
+	if (r->cq_map != r->sq_map)
+		munmap(r->cq_map, r->cq_map_size);
+	munmap(r->sq_map, r->sq_map_size);
+	close(r->fd);
+}
+
+/** A zeroed submission entry, or NULL when the queue is full. */
+static inline struct io_uring_sqe *
+uring_get_sqe(struct uring *r)
+{
+	uint32_t head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	uint32_t tail = *r->sq_tail + r->sq_pending;
+	if (tail - head > r->sq_mask)
+		return NULL;
+	uint32_t idx = tail & r->sq_mask;
+	r->sq_array[idx] = idx;
+	++r->sq_pending;
+	struct io_uring_sqe *sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+static inline void
+uring_prep_rw(struct io_uring_sqe *sqe, uint8_t opcode, int fd,
+	      const void *addr, uint32_t len, uint64_t offset)
+{
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)addr;
+	sqe->len = len;
+	sqe->off = offset;
+}
+
+/**
+ * Give the filled entries to the kernel and wait for at least
+ * @a wait_count completions. Returns the submitted count or -1.
+ */
+static inline int
+uring_submit_and_wait(struct uring *r, uint32_t wait_count)
+{
+	uint32_t count = r->sq_pending;
+	__atomic_store_n(r->sq_tail, *r->sq_tail + count, __ATOMIC_RELEASE);
+	r->sq_pending = 0;
+	unsigned flags = wait_count > 0 ? IORING_ENTER_GETEVENTS : 0;
+	while (true) {
+		int rc = (int)syscall(__NR_io_uring_enter, r->fd, count,
+				      wait_count, flags, NULL, 0);
+		if (rc >= 0 || errno != EINTR)
+			return rc;
+	}
+}
+
+static inline int
+uring_submit(struct uring *r)
+{
+	return uring_submit_and_wait(r, 0);
+}
+
+/** The oldest completion, or NULL when there are none. */
+static inline struct io_uring_cqe *
+uring_peek_cqe(struct uring *r)
+{
+	uint32_t head = *r->cq_head;
+	if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &r->cqes[head & r->cq_mask];
+}
+
+/** Done with the completion returned by uring_peek_cqe(). */
+static inline void
+uring_cqe_seen(struct uring *r)
+{
+	__atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+#if defined(__cplusplus)
+} /* extern "C" */
+#endif /* defined(__cplusplus) */